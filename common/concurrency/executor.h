@@ -21,6 +21,12 @@
 
 #pragma once
 
+#include "lock.h"
+#include "parallel_arena.h"
+#include "thread_placement.h"
+
+#include "../diagnostics/executor_stats.h"
+#include "../diagnostics/trace.h"
 #include "../exception/win32_exception.h"
 #include "../exception/exceptions.h"
 #include "../utility/string.h"
@@ -35,6 +41,7 @@
 #include <boost/noncopyable.hpp>
 
 #include <functional>
+#include <typeinfo>
 
 namespace caspar {
 
@@ -66,10 +73,12 @@ inline void SetThreadName(DWORD dwThreadID, LPCSTR szThreadName)
 
 }
 
+// Low priority tasks only run while no other task is waiting, one between two checks of the other lanes.
 enum task_priority
 {
 	high_priority,
 	normal_priority,
+	low_priority,
 	priority_count
 };
 
@@ -84,11 +93,19 @@ enum thread_priority
 class executor : boost::noncopyable
 {
 	const std::string name_;
+	const std::shared_ptr<diagnostics::executor_stats> stats_; // Queue latency and run time, see diagnostics::set_stall_watchdog.
+	const thread_placement placement_; // Inherited from the thread that created the executor.
+	const std::shared_ptr<parallel_arena> arena_; // Likewise.
 	boost::thread thread_;
 	tbb::atomic<bool> is_running_;
 	
 	typedef tbb::concurrent_bounded_queue<std::function<void()>> function_queue;
 	function_queue execution_queue_[priority_count];
+	tbb::atomic<int64_t> queue_wait_[priority_count]; // Microseconds from queued to started, averaged. 
+	tbb::atomic<int> normal_pending_; // Normal priority tasks queued, the queue also holds wake ups.
+#if CASPAR_LOCK_PROFILING
+	lock_stats& queue_stats_; // Of the pushes, which block on a full queue or the locks inside of it.
+#endif
 		
 	template<typename Func>
 	auto create_task(Func&& func) -> boost::packaged_task<decltype(func())> // noexcept
@@ -112,9 +129,19 @@ class executor : boost::noncopyable
 
 public:
 		
-	explicit executor(const std::wstring& name) : name_(narrow(name)) // noexcept
+	explicit executor(const std::wstring& name) // noexcept
+		: name_(narrow(name))
+		, stats_(diagnostics::register_executor(name_))
+		, placement_(inherited_thread_placement())
+		, arena_(parallel_arena::current())
+#if CASPAR_LOCK_PROFILING
+		, queue_stats_(get_lock_stats("executor." + name_))
+#endif
 	{
 		is_running_ = true;
+		for(int n = 0; n < priority_count; ++n)
+			queue_wait_[n] = 0;
+		normal_pending_ = 0;
 		thread_ = boost::thread([this]{run();});
 	}
 	
@@ -134,21 +161,41 @@ public:
 		begin_invoke([=]
 		{
 			if(p == high_priority_class)
-				SetThreadPriority(GetCurrentThread(), HIGH_PRIORITY_CLASS);
+				SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
 			else if(p == above_normal_priority_class)
-				SetThreadPriority(GetCurrentThread(), ABOVE_NORMAL_PRIORITY_CLASS);
+				SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
 			else if(p == normal_priority_class)
-				SetThreadPriority(GetCurrentThread(), NORMAL_PRIORITY_CLASS);
+				SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
 			else if(p == below_normal_priority_class)
-				SetThreadPriority(GetCurrentThread(), BELOW_NORMAL_PRIORITY_CLASS);
+				SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
 		});
 	}
+
+	// Moves the thread, and the executors and threads it starts from then on, see thread_placement.
+	void set_placement(const thread_placement& placement)
+	{
+		begin_invoke([=]
+		{
+			apply_thread_placement(placement);
+		}, high_priority);
+	}
+
+	// Runs the parallel work started on the thread, and by the executors it starts from then on, in the arena.
+	void set_arena(const std::shared_ptr<parallel_arena>& arena)
+	{
+		begin_invoke([=]
+		{
+			parallel_arena::set_current(arena);
+		}, high_priority);
+	}
 	
 	void clear()
 	{		
 		std::function<void()> func;
 		while(execution_queue_[normal_priority].try_pop(func));
 		while(execution_queue_[high_priority].try_pop(func));
+		while(execution_queue_[low_priority].try_pop(func));
+		normal_pending_ = 0;
 	}
 				
 	void stop() // noexcept
@@ -178,9 +225,20 @@ public:
 		auto task_adaptor = make_move_on_copy(create_task(func));
 
 		auto future = task_adaptor.value.get_future();
+		auto queued_at = diagnostics::trace::now();
+		auto origin = typeid(Func).name();
+
+		if(priority == normal_priority)
+			++normal_pending_;
 
-		execution_queue_[priority].push([=]
+		std::function<void()> task = [=]
 		{
+			auto started_at = diagnostics::trace::now();
+			queue_wait_[priority] = (queue_wait_[priority] * 15 + started_at - queued_at) / 16;
+			stats_->queue_latency.record(started_at - queued_at);
+
+			diagnostics::executor_stats::task_scope running(*stats_, origin, started_at);
+
 			try
 			{
 				task_adaptor.value();
@@ -192,7 +250,13 @@ public:
 			{
 				CASPAR_LOG_CURRENT_EXCEPTION();
 			}
-		});
+		};
+
+#if CASPAR_LOCK_PROFILING
+		profiled_push(queue_stats_, execution_queue_[priority], task);
+#else
+		execution_queue_[priority].push(task);
+#endif
 
 		if(priority != normal_priority)
 			execution_queue_[normal_priority].push(nullptr);
@@ -226,6 +290,7 @@ public:
 	function_queue::size_type size() const /*noexcept*/ { return execution_queue_[normal_priority].size();	}
 	bool empty() const /*noexcept*/	{ return execution_queue_[normal_priority].empty();	}
 	bool is_running() const /*noexcept*/ { return is_running_; }	
+	int64_t queue_wait(task_priority priority) const /*noexcept*/ { return queue_wait_[priority]; }
 		
 private:
 	
@@ -237,6 +302,25 @@ private:
 		yield();
 
 		if(func)
+		{
+			--normal_pending_;
+			func();
+		}
+		else
+			execute_low();
+	}
+
+	// Every low priority task also queues a wake up. One which is passed over because normal priority tasks are
+	// waiting queues another, which is behind them.
+	void execute_low() // noexcept
+	{
+		if(execution_queue_[low_priority].empty())
+			return;
+
+		std::function<void()> func;
+		if(normal_pending_ > 0)
+			execution_queue_[normal_priority].push(nullptr);
+		else if(execution_queue_[low_priority].try_pop(func) && func)
 			func();
 	}
 
@@ -252,6 +336,9 @@ private:
 	void run() // noexcept
 	{
 		win32_exception::ensure_handler_installed_for_thread(name_.c_str());
+		stats_->thread_id = GetCurrentThreadId();
+		apply_thread_placement(placement_);
+		parallel_arena::set_current(arena_);
 
 		while(is_running_)
 		{
@@ -267,6 +354,7 @@ private:
 
 		execute_rest(high_priority);
 		execute_rest(normal_priority);
+		execute_rest(low_priority);
 	}	
 };
 
@@ -0,0 +1,168 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "lock.h"
+
+#include "../utility/string.h"
+
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/spin_mutex.h>
+
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include <windows.h>
+
+namespace caspar {
+
+namespace {
+
+struct lock_registry
+{
+	tbb::spin_mutex									mutex;
+	std::map<std::string, std::unique_ptr<lock_stats>>	locks;
+};
+
+lock_registry& get_registry()
+{
+	static lock_registry instance;
+	return instance;
+}
+
+int64_t tick_frequency()
+{
+	static const int64_t frequency = []() -> int64_t
+	{
+		LARGE_INTEGER value;
+		::QueryPerformanceFrequency(&value);
+		return value.QuadPart;
+	}();
+	return frequency;
+}
+
+double to_seconds(int64_t ticks)
+{
+	return static_cast<double>(ticks) / static_cast<double>(tick_frequency());
+}
+
+// A copy of the counters by name.
+std::map<std::string, lock_stats> snapshot()
+{
+	std::map<std::string, lock_stats> result;
+
+	auto& registry = get_registry();
+	tbb::spin_mutex::scoped_lock lock(registry.mutex);
+
+	BOOST_FOREACH(auto& entry, registry.locks)
+	{
+		auto& stats = result[entry.first];
+		stats.acquisitions		= entry.second->acquisitions;
+		stats.contentions		= entry.second->contentions;
+		stats.wait_ticks		= entry.second->wait_ticks;
+		stats.max_wait_ticks	= entry.second->max_wait_ticks;
+		stats.hold_ticks		= entry.second->hold_ticks;
+	}
+
+	return result;
+}
+
+}
+
+lock_stats& get_lock_stats(const std::string& name)
+{
+	auto& registry = get_registry();
+	tbb::spin_mutex::scoped_lock lock(registry.mutex);
+
+	auto& stats = registry.locks[name];
+	if(!stats)
+		stats.reset(new lock_stats());
+	return *stats;
+}
+
+int64_t lock_ticks()
+{
+	LARGE_INTEGER value;
+	::QueryPerformanceCounter(&value);
+	return value.QuadPart;
+}
+
+boost::property_tree::wptree get_lock_info()
+{
+	boost::property_tree::wptree info;
+	info.add(L"profiling", CASPAR_LOCK_PROFILING != 0);
+
+	BOOST_FOREACH(auto& entry, snapshot())
+	{
+		auto& stats = entry.second;
+
+		boost::property_tree::wptree lock;
+		lock.add(L"name",			widen(entry.first));
+		lock.add(L"acquisitions",	stats.acquisitions);
+		lock.add(L"contentions",	stats.contentions);
+		lock.add(L"wait-ms",		to_seconds(stats.wait_ticks) * 1000.0);
+		lock.add(L"max-wait-ms",	to_seconds(stats.max_wait_ticks) * 1000.0);
+		lock.add(L"hold-ms",		to_seconds(stats.hold_ticks) * 1000.0);
+		info.add_child(L"lock", lock);
+	}
+
+	return info;
+}
+
+std::string print_lock_metrics()
+{
+	auto locks = snapshot();
+	if(locks.empty())
+		return std::string();
+
+	std::ostringstream acquisitions;
+	std::ostringstream contentions;
+	std::ostringstream waits;
+	std::ostringstream holds;
+
+	acquisitions	<< "# HELP caspar_lock_acquisitions_total Number of times a lock was acquired.\n"
+					<< "# TYPE caspar_lock_acquisitions_total counter\n";
+	contentions		<< "# HELP caspar_lock_contentions_total Number of acquisitions which had to wait for a lock.\n"
+					<< "# TYPE caspar_lock_contentions_total counter\n";
+	waits			<< "# HELP caspar_lock_wait_seconds_total Time spent waiting for a lock.\n"
+					<< "# TYPE caspar_lock_wait_seconds_total counter\n";
+	holds			<< "# HELP caspar_lock_hold_seconds_total Time a lock was held.\n"
+					<< "# TYPE caspar_lock_hold_seconds_total counter\n";
+
+	BOOST_FOREACH(auto& entry, locks)
+	{
+		auto label = "{lock=\"" + boost::replace_all_copy(boost::replace_all_copy(entry.first, "\\", "\\\\"), "\"", "\\\"") + "\"} ";
+
+		acquisitions	<< "caspar_lock_acquisitions_total" << label << entry.second.acquisitions << "\n";
+		contentions		<< "caspar_lock_contentions_total" << label << entry.second.contentions << "\n";
+		waits			<< "caspar_lock_wait_seconds_total" << label << to_seconds(entry.second.wait_ticks) << "\n";
+		holds			<< "caspar_lock_hold_seconds_total" << label << to_seconds(entry.second.hold_ticks) << "\n";
+	}
+
+	return acquisitions.str() + contentions.str() + waits.str() + holds.str();
+}
+
+}
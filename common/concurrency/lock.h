@@ -20,6 +20,21 @@
 */
 #pragma once
 
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <tbb/atomic.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Compiled in by the Profile configuration. It has to be the same in every project, since it changes the layout of 
+// profiled_mutex and of executor.
+#ifndef CASPAR_LOCK_PROFILING
+#define CASPAR_LOCK_PROFILING 0
+#endif
+
 namespace caspar {
 
 template<typename T, typename F>
@@ -29,4 +44,153 @@ auto lock(T& mutex, F&& func) -> decltype(func())
 	return func();
 }
 
+// Counters of every lock with the same name, see profiled_mutex. Times are in performance counter ticks.
+struct lock_stats
+{
+	tbb::atomic<int64_t> acquisitions;
+	tbb::atomic<int64_t> contentions;	// Acquisitions which had to wait.
+	tbb::atomic<int64_t> wait_ticks;
+	tbb::atomic<int64_t> max_wait_ticks;
+	tbb::atomic<int64_t> hold_ticks;
+
+	lock_stats()
+	{
+		acquisitions	= 0;
+		contentions		= 0;
+		wait_ticks		= 0;
+		max_wait_ticks	= 0;
+		hold_ticks		= 0;
+	}
+
+	void waited(int64_t ticks)
+	{
+		++contentions;
+		wait_ticks += ticks;
+
+		auto max = max_wait_ticks;
+		while(ticks > max && max_wait_ticks.compare_and_swap(ticks, max) != max)
+			max = max_wait_ticks;
+	}
+};
+
+// The counters of the name, registered on first use and kept for the lifetime of the process.
+lock_stats& get_lock_stats(const std::string& name);
+
+int64_t lock_ticks();
+
+// Per lock name, empty unless compiled with CASPAR_LOCK_PROFILING.
+boost::property_tree::wptree get_lock_info();
+
+// The counters in the Prometheus text format, see diagnostics::print_metrics.
+std::string print_lock_metrics();
+
+#if CASPAR_LOCK_PROFILING
+
+// A tbb::spin_mutex, tbb::mutex or boost::mutex which counts how often and for how long it is waited for and held.
+// Lock holders try first and are only timed while waiting when that fails, so an uncontended lock costs the 
+// two timestamps of the hold time.
+template<typename T>
+class profiled_mutex : boost::noncopyable
+{
+	T			mutex_;
+	lock_stats&	stats_;
+	int64_t		acquired_at_; // Written by the holder only.
+public:
+	explicit profiled_mutex(const char* name)
+		: stats_(get_lock_stats(name))
+		, acquired_at_(0)
+	{
+	}
+
+	void lock()
+	{
+		if(!mutex_.try_lock())
+		{
+			auto start = lock_ticks();
+			mutex_.lock();
+			stats_.waited(lock_ticks() - start);
+		}
+		++stats_.acquisitions;
+		acquired_at_ = lock_ticks();
+	}
+
+	bool try_lock()
+	{
+		if(!mutex_.try_lock())
+			return false;
+		++stats_.acquisitions;
+		acquired_at_ = lock_ticks();
+		return true;
+	}
+
+	void unlock()
+	{
+		stats_.hold_ticks += lock_ticks() - acquired_at_;
+		mutex_.unlock();
+	}
+
+	class scoped_lock : boost::noncopyable
+	{
+		profiled_mutex* mutex_;
+	public:
+		scoped_lock()
+			: mutex_(nullptr)
+		{
+		}
+
+		explicit scoped_lock(profiled_mutex& mutex)
+			: mutex_(&mutex)
+		{
+			mutex.lock();
+		}
+
+		~scoped_lock()
+		{
+			if(mutex_)
+				mutex_->unlock();
+		}
+
+		void acquire(profiled_mutex& mutex)
+		{
+			mutex.lock();
+			mutex_ = &mutex;
+		}
+
+		void release()
+		{
+			mutex_->unlock();
+			mutex_ = nullptr;
+		}
+	};
+};
+
+// Times a blocking push into a queue as waiting for a lock, counted as contended when the queue was full.
+template<typename Q, typename V>
+void profiled_push(lock_stats& stats, Q& queue, V&& value)
+{
+	auto full	= queue.size() >= queue.capacity();
+	auto start	= lock_ticks();
+	queue.push(std::forward<V>(value));
+	auto ticks	= lock_ticks() - start;
+
+	++stats.acquisitions;
+	if(full)
+		stats.waited(ticks);
+	else
+		stats.hold_ticks += ticks;
+}
+
+#else
+
+template<typename T>
+class profiled_mutex : public T
+{
+public:
+	explicit profiled_mutex(const char*)
+	{
+	}
+};
+
+#endif
+
 }
\ No newline at end of file
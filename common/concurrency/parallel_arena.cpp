@@ -0,0 +1,108 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "parallel_arena.h"
+
+#include <tbb/atomic.h>
+#include <tbb/task_scheduler_init.h>
+
+#include <boost/thread/tss.hpp>
+
+namespace caspar {
+
+namespace {
+
+boost::thread_specific_ptr<std::shared_ptr<parallel_arena>>& current_arena()
+{
+	static boost::thread_specific_ptr<std::shared_ptr<parallel_arena>> arena;
+	return arena;
+}
+
+tbb::atomic<int>& busy_pieces()
+{
+	static tbb::atomic<int> pieces;
+	return pieces;
+}
+
+int hardware_concurrency()
+{
+	static int concurrency = tbb::task_scheduler_init::default_num_threads();
+	return concurrency;
+}
+
+}
+
+parallel_arena::parallel_arena(int concurrency)
+	: concurrency_(std::max(1, std::min(concurrency, hardware_concurrency())))
+{
+}
+
+int parallel_arena::concurrency() const
+{
+	return concurrency_;
+}
+
+int parallel_arena::width() const
+{
+	auto idle = hardware_concurrency() - busy_pieces();
+	return std::max(concurrency_, idle);
+}
+
+std::shared_ptr<parallel_arena> parallel_arena::current()
+{
+	auto arena = current_arena().get();
+	return arena ? *arena : std::shared_ptr<parallel_arena>();
+}
+
+void parallel_arena::set_current(const std::shared_ptr<parallel_arena>& arena)
+{
+	current_arena().reset(new std::shared_ptr<parallel_arena>(arena));
+}
+
+parallel_arena::scope::scope(const std::shared_ptr<parallel_arena>& arena)
+	: previous_(current())
+{
+	set_current(arena);
+}
+
+parallel_arena::scope::~scope()
+{
+	set_current(previous_);
+}
+
+namespace detail {
+
+arena_piece::arena_piece(const std::shared_ptr<parallel_arena>& arena)
+	: scope_(arena)
+{
+	++busy_pieces();
+}
+
+arena_piece::~arena_piece()
+{
+	--busy_pieces();
+}
+
+}
+
+}
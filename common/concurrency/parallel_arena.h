@@ -0,0 +1,149 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+
+namespace caspar {
+
+// A share of the TBB workers for the parallel work of one channel.
+//
+// TBB 3.0 has a single scheduler whose workers all channels draw from, so an arena does not own threads. It 
+// bounds how many pieces the work started inside it is split into, and so how many workers it keeps busy, 
+// and lets that work spread over the whole pool only while the pool is otherwise idle.
+class parallel_arena : boost::noncopyable
+{
+public:
+	explicit parallel_arena(int concurrency);
+
+	int concurrency() const;
+
+	// How many pieces work started now may be split into.
+	int width() const;
+
+	// The arena of the calling thread, null outside any. Executors, and the pieces split by arena_parallel_for 
+	// and arena_parallel_invoke, inherit it.
+	static std::shared_ptr<parallel_arena> current();
+	static void set_current(const std::shared_ptr<parallel_arena>& arena);
+
+	class scope : boost::noncopyable
+	{
+		std::shared_ptr<parallel_arena> previous_;
+	public:
+		explicit scope(const std::shared_ptr<parallel_arena>& arena);
+		~scope();
+	};
+
+private:
+	const int concurrency_;
+};
+
+namespace detail {
+
+// A piece of split work running on a worker, counted process wide.
+class arena_piece : boost::noncopyable
+{
+	parallel_arena::scope scope_;
+public:
+	explicit arena_piece(const std::shared_ptr<parallel_arena>& arena);
+	~arena_piece();
+};
+
+}
+
+// tbb::parallel_for, split into no more pieces than the calling thread's arena allows.
+template<typename T, typename Func, typename Partitioner>
+void arena_parallel_for(const tbb::blocked_range<T>& range, const Func& func, const Partitioner& partitioner)
+{
+	auto arena = parallel_arena::current();
+	if(!arena)
+	{
+		tbb::parallel_for(range, func, partitioner);
+		return;
+	}
+
+	auto width = static_cast<std::size_t>(arena->width());
+	auto grain = std::max(range.grainsize(), (range.size() + width - 1) / width);
+
+	tbb::parallel_for(tbb::blocked_range<T>(range.begin(), range.end(), grain), [&](const tbb::blocked_range<T>& r)
+	{
+		detail::arena_piece piece(arena);
+		func(r);
+	}, partitioner);
+}
+
+template<typename T, typename Func>
+void arena_parallel_for(const tbb::blocked_range<T>& range, const Func& func)
+{
+	arena_parallel_for(range, func, tbb::auto_partitioner());
+}
+
+template<typename T, typename Func>
+void arena_parallel_for(T begin, T end, const Func& func)
+{
+	arena_parallel_for(tbb::blocked_range<T>(begin, end), [&](const tbb::blocked_range<T>& r)
+	{
+		for(auto n = r.begin(); n != r.end(); ++n)
+			func(n);
+	});
+}
+
+// tbb::parallel_invoke, run one after the other when the calling thread's arena is down to a single piece.
+template<typename F0, typename F1>
+void arena_parallel_invoke(const F0& f0, const F1& f1)
+{
+	auto arena = parallel_arena::current();
+	if(!arena)
+	{
+		tbb::parallel_invoke(f0, f1);
+		return;
+	}
+
+	if(arena->width() < 2)
+	{
+		f0();
+		f1();
+		return;
+	}
+
+	tbb::parallel_invoke(
+		[&]
+		{
+			detail::arena_piece piece(arena);
+			f0();
+		},
+		[&]
+		{
+			detail::arena_piece piece(arena);
+			f1();
+		});
+}
+
+}
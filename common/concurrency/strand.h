@@ -0,0 +1,296 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "../log/log.h"
+#include "../utility/string.h"
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+#include <tbb/task.h>
+
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <deque>
+#include <functional>
+#include <new>
+#include <string>
+#include <type_traits>
+
+namespace caspar {
+
+namespace detail {
+
+// Move only callable stored in place when small enough, queued tasks are moved instead of copied into a heap 
+// allocated std::function.
+class small_task
+{
+	static const std::size_t inline_size = 64;
+
+	struct operations
+	{
+		void (*invoke)(void* storage);
+		void (*move)(void* from, void* to); // Leaves nothing to destroy in from.
+		void (*destroy)(void* storage);
+	};
+
+	template<typename F>
+	struct inline_operations
+	{
+		static void invoke(void* storage)			{ (*static_cast<F*>(storage))(); }
+		static void move(void* from, void* to)		{ new(to) F(std::move(*static_cast<F*>(from))); static_cast<F*>(from)->~F(); }
+		static void destroy(void* storage)			{ static_cast<F*>(storage)->~F(); }
+		static const operations* get()				{ static const operations ops = {&invoke, &move, &destroy}; return &ops; }
+	};
+
+	template<typename F>
+	struct heap_operations
+	{
+		static void invoke(void* storage)			{ (**static_cast<F**>(storage))(); }
+		static void move(void* from, void* to)		{ *static_cast<F**>(to) = *static_cast<F**>(from); }
+		static void destroy(void* storage)			{ delete *static_cast<F**>(storage); }
+		static const operations* get()				{ static const operations ops = {&invoke, &move, &destroy}; return &ops; }
+	};
+
+	std::aligned_storage<inline_size, 16>::type	storage_;
+	const operations*							ops_;
+	
+	small_task(const small_task&);
+	small_task& operator=(const small_task&);
+public:
+	small_task() : ops_(nullptr){}
+
+	template<typename F>
+	explicit small_task(F&& func) 
+	{
+		typedef typename std::remove_reference<F>::type functor_type;
+
+		if(sizeof(functor_type) <= inline_size && std::alignment_of<functor_type>::value <= 16)
+		{
+			new(&storage_) functor_type(std::forward<F>(func));
+			ops_ = inline_operations<functor_type>::get();
+		}
+		else
+		{
+			*reinterpret_cast<functor_type**>(&storage_) = new functor_type(std::forward<F>(func));
+			ops_ = heap_operations<functor_type>::get();
+		}
+	}
+
+	small_task(small_task&& other) : ops_(other.ops_)
+	{
+		if(ops_)
+			ops_->move(&other.storage_, &storage_);
+		other.ops_ = nullptr;
+	}
+
+	small_task& operator=(small_task&& other)
+	{
+		if(this != &other)
+		{
+			reset();
+			ops_ = other.ops_;
+			if(ops_)
+				ops_->move(&other.storage_, &storage_);
+			other.ops_ = nullptr;
+		}
+		return *this;
+	}
+
+	~small_task()
+	{
+		reset();
+	}
+
+	void operator()()
+	{
+		if(ops_)
+			ops_->invoke(&storage_);
+	}
+
+	void reset()
+	{
+		if(ops_)
+			ops_->destroy(&storage_);
+		ops_ = nullptr;
+	}
+};
+
+template<typename R>
+struct packaged_runner
+{
+	boost::packaged_task<R> task;
+
+	explicit packaged_runner(boost::packaged_task<R>&& task) : task(std::move(task)){}
+	packaged_runner(packaged_runner&& other) : task(std::move(other.task)){}
+
+	void operator()()
+	{
+		try
+		{
+			task();
+		}
+		catch(boost::task_already_started&){}
+	}
+};
+
+}
+
+// Runs tasks one at a time in the order they were queued, on the shared tbb worker pool instead of a thread of its 
+// own. Meant for background work that does not block for long, waiting on hardware still belongs on an executor.
+class strand : boost::noncopyable
+{
+	class drain_task : public tbb::task
+	{
+		strand& self_;
+	public:
+		explicit drain_task(strand& self) : self_(self){}
+
+		virtual tbb::task* execute() override
+		{
+			self_.drain();
+			return nullptr;
+		}
+	};
+
+	const std::string				name_;
+	tbb::spin_mutex					mutex_;
+	std::deque<detail::small_task>	queue_;
+	tbb::atomic<int>				pending_; // Queued and running tasks, the first one schedules a drain.
+	tbb::atomic<int>				peak_size_;
+	tbb::atomic<int64_t>			executed_count_;
+	boost::thread::id				drain_thread_;
+
+public:
+	explicit strand(const std::wstring& name) : name_(narrow(name))
+	{
+		pending_		= 0;
+		peak_size_		= 0;
+		executed_count_	= 0;
+	}
+
+	~strand()
+	{
+		wait();
+
+		// The last drain may still be returning after the task that woke us.
+		while(pending_ != 0)
+			boost::this_thread::yield();
+	}
+
+	template<typename Func>
+	void post(Func&& func)
+	{
+		enqueue(detail::small_task([=]
+		{
+			try
+			{
+				func();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}));
+	}
+
+	template<typename Func>
+	auto begin_invoke(Func&& func) -> boost::unique_future<decltype(func())>
+	{
+		typedef decltype(func()) result_type;
+
+		boost::packaged_task<result_type> task(std::forward<Func>(func));
+		auto future = task.get_future();
+
+		enqueue(detail::small_task(detail::packaged_runner<result_type>(std::move(task))));
+
+		return std::move(future);
+	}
+
+	template<typename Func>
+	auto invoke(Func&& func) -> decltype(func())
+	{
+		if(boost::this_thread::get_id() == drain_thread_) // Avoids deadlock when called from one of our own tasks.
+			return func();
+
+		return begin_invoke(std::forward<Func>(func)).get();
+	}
+
+	void wait()
+	{
+		invoke([]{});
+	}
+
+	// Metrics, a strand that keeps a deep queue is falling behind.
+
+	int size() const		{ return pending_; }
+	int peak_size() const	{ return peak_size_; }
+	int64_t executed_count() const { return executed_count_; }
+	const std::string& name() const { return name_; }
+
+private:
+	void enqueue(detail::small_task&& task)
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			queue_.push_back(std::move(task));
+		}
+
+		const int size = ++pending_;
+
+		int peak = peak_size_;
+		while(size > peak && peak_size_.compare_and_swap(size, peak) != peak)
+			peak = peak_size_;
+
+		if(size == 1)
+			tbb::task::enqueue(*new(tbb::task::allocate_root()) drain_task(*this));
+	}
+
+	void drain()
+	{
+		for(int n = 0; n < 16; ++n)
+		{
+			detail::small_task task;
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				task = std::move(queue_.front());
+				queue_.pop_front();
+			}
+
+			drain_thread_ = boost::this_thread::get_id();
+			task();
+			drain_thread_ = boost::thread::id();
+
+			task.reset();
+			++executed_count_;
+
+			if(--pending_ == 0)
+				return; // Nothing may be touched once the count reaches zero, the strand can be destroyed.
+		}
+
+		// Still more queued, a busy strand gives other work a turn on the worker it occupies.
+		tbb::task::enqueue(*new(tbb::task::allocate_root()) drain_task(*this));
+	}
+};
+
+}
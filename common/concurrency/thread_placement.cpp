@@ -0,0 +1,163 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "thread_placement.h"
+
+#include "../log/log.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <vector>
+
+namespace caspar {
+
+namespace {
+
+boost::thread_specific_ptr<thread_placement>& inherited()
+{
+	static boost::thread_specific_ptr<thread_placement> placement;
+	return placement;
+}
+
+void set_inherited(const thread_placement& placement)
+{
+	inherited().reset(new thread_placement(placement));
+}
+
+unsigned long long parse_cpus(const std::wstring& str)
+{
+	unsigned long long mask = 0;
+
+	std::vector<std::wstring> ranges;
+	boost::split(ranges, str, boost::is_any_of(L","));
+	BOOST_FOREACH(auto range, ranges)
+	{
+		boost::trim(range);
+		if(range.empty())
+			continue;
+
+		std::vector<std::wstring> bounds;
+		boost::split(bounds, range, boost::is_any_of(L"-"));
+
+		auto first	= boost::lexical_cast<int>(boost::trim_copy(bounds.front()));
+		auto last	= boost::lexical_cast<int>(boost::trim_copy(bounds.back()));
+		for(int cpu = first; cpu <= last && cpu < 64; ++cpu)
+			mask |= 1ull << cpu;
+	}
+
+	return mask;
+}
+
+int parse_priority(const std::wstring& priority)
+{
+	if(boost::iequals(priority, L"high"))
+		return THREAD_PRIORITY_HIGHEST;
+	if(boost::iequals(priority, L"above-normal"))
+		return THREAD_PRIORITY_ABOVE_NORMAL;
+	if(boost::iequals(priority, L"below-normal"))
+		return THREAD_PRIORITY_BELOW_NORMAL;
+	return THREAD_PRIORITY_NORMAL;
+}
+
+// avrt.dll is loaded at runtime, the process does not depend on it for anything else.
+bool join_mmcss_task(const std::wstring& task)
+{
+	typedef HANDLE (WINAPI *set_characteristics_t)(LPCWSTR, LPDWORD);
+
+	static auto avrt = ::LoadLibraryW(L"avrt.dll");
+	if(!avrt)
+		return false;
+
+	auto set_characteristics = reinterpret_cast<set_characteristics_t>(::GetProcAddress(avrt, "AvSetMmThreadCharacteristicsW"));
+	if(!set_characteristics)
+		return false;
+
+	DWORD task_index = 0;
+	return set_characteristics(task.c_str(), &task_index) != nullptr;
+}
+
+}
+
+thread_placement parse_thread_placement(const boost::property_tree::wptree& ptree)
+{
+	thread_placement placement;
+	placement.cpus			= parse_cpus(ptree.get(L"cpus", L""));
+	placement.numa_node		= ptree.get(L"numa-node", -1);
+	placement.mmcss_task	= ptree.get(L"mmcss", L"");
+	placement.priority		= ptree.get(L"priority", L"");
+	return placement;
+}
+
+void apply_thread_placement(const thread_placement& placement)
+{
+	set_inherited(placement);
+
+	if(placement.empty())
+		return;
+
+	auto mask = static_cast<DWORD_PTR>(placement.cpus);
+
+	if(placement.numa_node >= 0)
+	{
+		ULONGLONG node_mask = 0;
+		if(::GetNumaNodeProcessorMask(static_cast<UCHAR>(placement.numa_node), &node_mask) && node_mask != 0)
+			mask = mask != 0 ? (mask & static_cast<DWORD_PTR>(node_mask)) : static_cast<DWORD_PTR>(node_mask);
+		else
+			CASPAR_LOG(warning) << L"[thread_placement] No processors on NUMA node " << placement.numa_node << L".";
+	}
+
+	if(mask != 0 && !::SetThreadAffinityMask(::GetCurrentThread(), mask))
+		CASPAR_LOG(warning) << L"[thread_placement] Could not set the affinity of thread " << ::GetCurrentThreadId() << L".";
+
+	// A thread in a multimedia class scheduler task gets its priority from the scheduler.
+	if(!placement.mmcss_task.empty())
+	{
+		if(!join_mmcss_task(placement.mmcss_task))
+			CASPAR_LOG(warning) << L"[thread_placement] Could not join the MMCSS task \"" << placement.mmcss_task << L"\".";
+	}
+	else if(!placement.priority.empty())
+		::SetThreadPriority(::GetCurrentThread(), parse_priority(placement.priority));
+}
+
+thread_placement inherited_thread_placement()
+{
+	auto placement = inherited().get();
+	return placement ? *placement : thread_placement();
+}
+
+scoped_thread_placement::scoped_thread_placement(const thread_placement& placement)
+	: previous_(inherited_thread_placement())
+{
+	set_inherited(placement);
+}
+
+scoped_thread_placement::~scoped_thread_placement()
+{
+	set_inherited(previous_);
+}
+
+}
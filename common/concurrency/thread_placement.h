@@ -0,0 +1,70 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <string>
+
+namespace caspar {
+
+// Where and how a thread runs. Threads and executors started by a thread with a placement get the same 
+// placement, so that what a channel starts stays on its cores.
+struct thread_placement
+{
+	unsigned long long	cpus;		// Mask of processor numbers, 0 for any.
+	int					numa_node;	// -1 for any.
+	std::wstring		mmcss_task;	// A multimedia class scheduler task, such as "Pro Audio" or "Playback", empty for none.
+	std::wstring		priority;	// high, above-normal, normal or below-normal, empty to leave it.
+
+	thread_placement()
+		: cpus(0)
+		, numa_node(-1)
+	{
+	}
+
+	bool empty() const
+	{
+		return cpus == 0 && numa_node < 0 && mmcss_task.empty() && priority.empty();
+	}
+};
+
+// <cpus>0-3,8</cpus> <numa-node>0</numa-node> <mmcss>Pro Audio</mmcss> <priority>high</priority>, all optional.
+thread_placement parse_thread_placement(const boost::property_tree::wptree& ptree);
+
+// Applies the placement to the calling thread and makes it the one that threads it starts inherit.
+void apply_thread_placement(const thread_placement& placement);
+
+// The placement threads started by the calling thread get.
+thread_placement inherited_thread_placement();
+
+// Lets the threads started by the calling thread inherit another placement for the duration of the scope,
+// without moving the calling thread itself.
+class scoped_thread_placement
+{
+	thread_placement previous_;
+public:
+	explicit scoped_thread_placement(const thread_placement& placement);
+	~scoped_thread_placement();
+};
+
+}
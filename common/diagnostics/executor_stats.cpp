@@ -0,0 +1,379 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../stdafx.h"
+
+#include "executor_stats.h"
+
+#include "../log/log.h"
+#include "../utility/string.h"
+
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/range/algorithm_ext/erase.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/mutex.h>
+#include <tbb/spin_mutex.h>
+
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <windows.h>
+#include <dbghelp.h>
+
+namespace caspar { namespace diagnostics {
+
+namespace {
+
+struct executor_registry
+{
+	tbb::spin_mutex								mutex;
+	std::vector<std::weak_ptr<executor_stats>>	executors;
+};
+
+executor_registry& get_registry()
+{
+	static executor_registry instance;
+	return instance;
+}
+
+std::vector<std::shared_ptr<executor_stats>> registered()
+{
+	std::vector<std::shared_ptr<executor_stats>> result;
+
+	auto& registry = get_registry();
+	tbb::spin_mutex::scoped_lock lock(registry.mutex);
+
+	BOOST_FOREACH(auto& executor, registry.executors)
+	{
+		auto strong = executor.lock();
+		if(strong)
+			result.push_back(strong);
+	}
+
+	return result;
+}
+
+const std::size_t max_stack_frames = 32;
+
+// The return addresses of a thread of this process. Nothing is allocated while the thread is suspended, it could 
+// hold the heap lock. Symbols are resolved after it has been resumed.
+std::vector<DWORD64> sample_stack(DWORD thread_id)
+{
+	std::vector<DWORD64> addresses;
+	addresses.reserve(max_stack_frames);
+
+	auto thread = ::OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, thread_id);
+	if(!thread)
+		return addresses;
+
+	if(::SuspendThread(thread) != static_cast<DWORD>(-1))
+	{
+		CONTEXT context;
+		std::memset(&context, 0, sizeof(context));
+		context.ContextFlags = CONTEXT_FULL;
+
+		if(::GetThreadContext(thread, &context))
+		{
+#ifdef _M_X64
+			while(addresses.size() < max_stack_frames && context.Rip != 0)
+			{
+				addresses.push_back(context.Rip);
+
+				DWORD64 image_base = 0;
+				auto function = ::RtlLookupFunctionEntry(context.Rip, &image_base, nullptr);
+				if(!function) // A leaf function, the return address is on top of the stack.
+				{
+					SIZE_T read = 0;
+					if(!::ReadProcessMemory(::GetCurrentProcess(), reinterpret_cast<void*>(context.Rsp), &context.Rip, sizeof(context.Rip), &read))
+						break;
+					context.Rsp += sizeof(context.Rip);
+					continue;
+				}
+
+				void*	handler_data		= nullptr;
+				DWORD64	establisher_frame	= 0;
+				::RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, context.Rip, function, &context, &handler_data, &establisher_frame, nullptr);
+			}
+#else
+			addresses.push_back(context.Eip);
+
+			// Follows the frame pointers, which frames built without them end.
+			DWORD frame = context.Ebp;
+			while(addresses.size() < max_stack_frames && frame != 0)
+			{
+				DWORD link[2]; // The previous frame and the return address.
+				SIZE_T read = 0;
+				if(!::ReadProcessMemory(::GetCurrentProcess(), reinterpret_cast<void*>(frame), link, sizeof(link), &read) || link[1] == 0 || link[0] <= frame)
+					break;
+				addresses.push_back(link[1]);
+				frame = link[0];
+			}
+#endif
+		}
+
+		::ResumeThread(thread);
+	}
+
+	::CloseHandle(thread);
+
+	return addresses;
+}
+
+std::wstring print_stack(const std::vector<DWORD64>& addresses)
+{
+	static tbb::mutex mutex; // dbghelp is single threaded.
+	static bool initialized = false;
+
+	tbb::mutex::scoped_lock lock(mutex);
+
+	auto process = ::GetCurrentProcess();
+	if(!initialized)
+	{
+		::SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+		initialized = ::SymInitialize(process, nullptr, TRUE) != FALSE;
+	}
+
+	char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+	auto symbol = reinterpret_cast<SYMBOL_INFO*>(buffer);
+
+	std::wstringstream stack;
+	BOOST_FOREACH(auto address, addresses)
+	{
+		std::memset(buffer, 0, sizeof(buffer));
+		symbol->SizeOfStruct	= sizeof(SYMBOL_INFO);
+		symbol->MaxNameLen		= MAX_SYM_NAME;
+
+		DWORD64 displacement = 0;
+		if(initialized && ::SymFromAddr(process, address, &displacement, symbol))
+			stack << L"\n\t" << widen(std::string(symbol->Name)) << L" + 0x" << std::hex << displacement << std::dec;
+		else
+			stack << L"\n\t0x" << std::hex << address << std::dec;
+	}
+
+	return stack.str();
+}
+
+class watchdog
+{
+	tbb::mutex			mutex_;
+	int					threshold_ms_;
+	stall_handler		handler_;
+	boost::thread		thread_;
+public:
+	watchdog()
+		: threshold_ms_(0)
+	{
+	}
+
+	// The thread is started on the first threshold above 0 and idles while it is 0.
+	void configure(int threshold_ms, const stall_handler& handler)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		threshold_ms_	= threshold_ms;
+		handler_		= handler;
+
+		if(threshold_ms > 0 && !thread_.joinable())
+			thread_ = boost::thread([this]{run();});
+	}
+private:
+	void run()
+	{
+		::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL); // Has to run while the system is loaded.
+
+		while(true)
+		{
+			int				threshold_ms;
+			stall_handler	handler;
+			{
+				tbb::mutex::scoped_lock lock(mutex_);
+				threshold_ms	= threshold_ms_;
+				handler			= handler_;
+			}
+
+			boost::this_thread::sleep(boost::posix_time::milliseconds(threshold_ms > 0 ? std::max(10, threshold_ms / 4) : 100));
+			if(threshold_ms <= 0)
+				continue;
+
+			auto now = trace::now();
+			BOOST_FOREACH(auto& stats, registered())
+			{
+				const char*	origin		= stats->task_origin;
+				int64_t		started_at	= stats->task_started_at;
+				if(started_at == 0 || started_at == stats->reported_at || now - started_at < threshold_ms * 1000LL)
+					continue;
+
+				stats->reported_at = started_at;
+				++stats->stalls;
+
+				auto running_micros	= now - started_at;
+				auto origin_str		= std::string(origin ? origin : "unknown");
+
+				CASPAR_LOG(warning) << L"[executor] " << widen(stats->name) << L" has been running a task for " 
+									<< running_micros / 1000 << L" ms, from " << widen(origin_str) << L"."
+									<< print_stack(sample_stack(stats->thread_id));
+
+				if(handler)
+				{
+					try
+					{
+						handler(stats->name, origin_str, running_micros);
+					}
+					catch(...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+					}
+				}
+			}
+		}
+	}
+};
+
+watchdog& get_watchdog()
+{
+	static watchdog instance;
+	return instance;
+}
+
+void add_histogram(boost::property_tree::wptree& info, const std::wstring& name, const latency_histogram& histogram)
+{
+	int64_t count = histogram.count;
+
+	boost::property_tree::wptree node;
+	node.add(L"count",		count);
+	node.add(L"average-ms",	count > 0 ? static_cast<double>(histogram.sum_micros) / static_cast<double>(count) / 1000.0 : 0.0);
+	node.add(L"max-ms",		static_cast<double>(histogram.max_micros) / 1000.0);
+
+	for(std::size_t n = 0; n < num_latency_buckets; ++n)
+	{
+		boost::property_tree::wptree bucket;
+		bucket.add(L"le-ms",	static_cast<double>(latency_bucket_bounds[n]) / 1000.0);
+		bucket.add(L"count",	histogram.buckets[n]);
+		node.add_child(L"bucket", bucket);
+	}
+
+	info.add_child(name, node);
+}
+
+void print_histogram(std::ostream& out, const std::string& metric, const std::string& labels, const latency_histogram& histogram)
+{
+	int64_t cumulative = 0;
+	for(std::size_t n = 0; n < num_latency_buckets; ++n)
+	{
+		cumulative += histogram.buckets[n];
+		out << metric << "_bucket{" << labels << ",le=\"" << static_cast<double>(latency_bucket_bounds[n]) / 1000000.0 << "\"} " << cumulative << "\n";
+	}
+	cumulative += histogram.buckets[num_latency_buckets];
+	out << metric << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+	out << metric << "_sum{" << labels << "} " << static_cast<double>(histogram.sum_micros) / 1000000.0 << "\n";
+	out << metric << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+}
+
+std::shared_ptr<executor_stats> register_executor(const std::string& name)
+{
+	auto stats = std::make_shared<executor_stats>(name);
+
+	auto& registry = get_registry();
+	tbb::spin_mutex::scoped_lock lock(registry.mutex);
+
+	boost::remove_erase_if(registry.executors, [](const std::weak_ptr<executor_stats>& executor)
+	{
+		return executor.expired();
+	});
+	registry.executors.push_back(stats);
+
+	return stats;
+}
+
+void set_stall_watchdog(int threshold_ms, const stall_handler& handler)
+{
+	get_watchdog().configure(threshold_ms, handler);
+}
+
+boost::property_tree::wptree get_executor_info()
+{
+	boost::property_tree::wptree info;
+
+	auto now = trace::now();
+	BOOST_FOREACH(auto& stats, registered())
+	{
+		boost::property_tree::wptree executor;
+		executor.add(L"name",	widen(stats->name));
+		executor.add(L"stalls",	stats->stalls);
+
+		const char*	origin		= stats->task_origin;
+		int64_t		started_at	= stats->task_started_at;
+		if(started_at != 0)
+		{
+			executor.add(L"running.origin",		widen(std::string(origin ? origin : "unknown")));
+			executor.add(L"running.elapsed-ms",	static_cast<double>(now - started_at) / 1000.0);
+		}
+
+		add_histogram(executor, L"queue-latency",	stats->queue_latency);
+		add_histogram(executor, L"run-time",		stats->run_time);
+
+		info.add_child(L"executor", executor);
+	}
+
+	return info;
+}
+
+std::string print_executor_metrics()
+{
+	auto executors = registered();
+	if(executors.empty())
+		return std::string();
+
+	std::ostringstream latencies;
+	std::ostringstream run_times;
+	std::ostringstream stalls;
+
+	latencies	<< "# HELP caspar_executor_queue_latency_seconds Time from queuing a task on an executor to it starting.\n"
+				<< "# TYPE caspar_executor_queue_latency_seconds histogram\n";
+	run_times	<< "# HELP caspar_executor_run_seconds Time a task ran on an executor.\n"
+				<< "# TYPE caspar_executor_run_seconds histogram\n";
+	stalls		<< "# HELP caspar_executor_stalls_total Number of tasks which ran longer than the stall threshold.\n"
+				<< "# TYPE caspar_executor_stalls_total counter\n";
+
+	// Executors of the same name, e.g. one per channel, are told apart by their order.
+	std::map<std::string, int> indices;
+	BOOST_FOREACH(auto& stats, executors)
+	{
+		auto labels = "executor=\"" + boost::replace_all_copy(boost::replace_all_copy(stats->name, "\\", "\\\\"), "\"", "\\\"") + "\"" 
+					+ ",index=\"" + boost::lexical_cast<std::string>(indices[stats->name]++) + "\"";
+
+		print_histogram(latencies, "caspar_executor_queue_latency_seconds", labels, stats->queue_latency);
+		print_histogram(run_times, "caspar_executor_run_seconds", labels, stats->run_time);
+		stalls << "caspar_executor_stalls_total{" << labels << "} " << stats->stalls << "\n";
+	}
+
+	return latencies.str() + run_times.str() + stalls.str();
+}
+
+}}
@@ -0,0 +1,145 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include "trace.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <tbb/atomic.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace caspar { namespace diagnostics {
+
+// Upper bounds of the latency buckets, in microseconds.
+const std::size_t num_latency_buckets = 10;
+const int64_t latency_bucket_bounds[num_latency_buckets] = {100, 500, 1000, 2000, 5000, 10000, 20000, 40000, 100000, 1000000};
+
+struct latency_histogram
+{
+	std::array<tbb::atomic<int64_t>, num_latency_buckets+1>	buckets;
+	tbb::atomic<int64_t>									count;
+	tbb::atomic<int64_t>									sum_micros;
+	tbb::atomic<int64_t>									max_micros;
+
+	latency_histogram()
+	{
+		count		= 0;
+		sum_micros	= 0;
+		max_micros	= 0;
+
+		for(std::size_t n = 0; n < buckets.size(); ++n)
+			buckets[n] = 0;
+	}
+
+	void record(int64_t micros)
+	{
+		std::size_t n = 0;
+		while(n < num_latency_buckets && micros > latency_bucket_bounds[n])
+			++n;
+
+		buckets[n].fetch_and_increment();
+		sum_micros.fetch_and_add(micros);
+		count.fetch_and_increment();
+
+		auto max = max_micros;
+		while(micros > max && max_micros.compare_and_swap(micros, max) != max)
+			max = max_micros;
+	}
+};
+
+// Registered by every executor, for the stall watchdog and INFO EXECUTORS.
+struct executor_stats : boost::noncopyable
+{
+	const std::string			name;
+	tbb::atomic<unsigned long>	thread_id;			// Of the executor thread, 0 until it runs.
+	latency_histogram			queue_latency;		// From queued to started.
+	latency_histogram			run_time;
+	tbb::atomic<const char*>	task_origin;		// The type name of the running task, for lambdas that of the 
+													// function they were written in.
+	tbb::atomic<int64_t>		task_started_at;	// trace::now() when the running task started, 0 while idle.
+	tbb::atomic<int64_t>		stalls;
+	int64_t						reported_at;		// task_started_at of the last reported stall, watchdog only.
+
+	explicit executor_stats(const std::string& name)
+		: name(name)
+		, reported_at(0)
+	{
+		thread_id		= 0;
+		task_origin		= nullptr;
+		task_started_at	= 0;
+		stalls			= 0;
+	}
+
+	// Marks a task as running on the executor thread for its lifetime. Tasks run from within other tasks, see 
+	// executor::yield, restore the outer one when done.
+	class task_scope : boost::noncopyable
+	{
+		executor_stats&	stats_;
+		const char*		outer_origin_;
+		const int64_t	outer_started_at_;
+		const int64_t	started_at_;
+	public:
+		task_scope(executor_stats& stats, const char* origin, int64_t started_at)
+			: stats_(stats)
+			, outer_origin_(stats.task_origin)
+			, outer_started_at_(stats.task_started_at)
+			, started_at_(started_at)
+		{
+			stats_.task_origin		= origin;
+			stats_.task_started_at	= started_at;
+		}
+
+		~task_scope()
+		{
+			stats_.run_time.record(trace::now() - started_at_);
+			stats_.task_started_at	= outer_started_at_;
+			stats_.task_origin		= outer_origin_;
+		}
+	};
+};
+
+// The stats are kept while the executor lives.
+std::shared_ptr<executor_stats> register_executor(const std::string& name);
+
+// Called on the watchdog thread for every task which has run longer than the threshold, once per task.
+typedef std::function<void (const std::string& executor, const std::string& origin, int64_t running_micros)> stall_handler;
+
+// Starts, or reconfigures, the thread which checks the running task of every executor. A stall is logged with the 
+// executor name, the task origin and a stack sample of the executor thread, then passed to the handler. 
+// A threshold of 0 stops the watchdog.
+void set_stall_watchdog(int threshold_ms, const stall_handler& handler);
+
+// Per executor, the queue latency and run time histograms, the stalls and the currently running task.
+boost::property_tree::wptree get_executor_info();
+
+// The histograms in the Prometheus text format, see diagnostics::print_metrics.
+std::string print_executor_metrics();
+
+}}
@@ -28,12 +28,16 @@
 #include "../concurrency/executor.h"
 #include "../concurrency/lock.h"
 #include "../env.h"
+#include "../memory/tagged_allocator.h"
+#include "executor_stats.h"
+#include "../utility/string.h"
 
 #include <SFML/Graphics.hpp>
 
 #include <boost/foreach.hpp>
 #include <boost/optional.hpp>
 #include <boost/circular_buffer.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/range/algorithm_ext/erase.hpp>
 
 #include <tbb/concurrent_unordered_map.h>
@@ -42,7 +46,9 @@
 
 #include <array>
 #include <numeric>
+#include <sstream>
 #include <tuple>
+#include <vector>
 
 namespace caspar { namespace diagnostics {
 		
@@ -70,6 +76,9 @@ struct drawable : public sf::Drawable
 	virtual ~drawable(){}
 	virtual void render(sf::RenderTarget& target) = 0;
 	virtual void Render(sf::RenderTarget& target) const { const_cast<drawable*>(this)->render(target);}
+
+	// Moves the values set since the last tick into what is drawn, on every tick whether drawn or not.
+	virtual void advance() {}
 };
 
 class context : public drawable
@@ -77,6 +86,9 @@ class context : public drawable
 	std::unique_ptr<sf::RenderWindow> window_;
 	
 	std::list<std::weak_ptr<drawable>> drawables_;
+
+	bool						ticking_;
+	boost::posix_time::ptime	viewed_until_; // While remote viewers are polling print_graphs.
 		
 	executor executor_;
 public:					
@@ -99,9 +111,25 @@ public:
 			get_instance().do_show(value);
 		}, high_priority);
 	}
+
+	// Runs func on the diagnostics thread, which keeps sampling the lines for a while after, without a window.
+	template<typename F>
+	static void view_remotely(const F& func)
+	{
+		get_instance().executor_.invoke([&]
+		{
+			auto& instance = get_instance();
+			instance.viewed_until_ = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(5);
+			instance.start_ticking();
+			func();
+		}, high_priority);
+	}
 				
 private:
-	context() : executor_(L"diagnostics")
+	context() 
+		: ticking_(false)
+		, viewed_until_(boost::posix_time::min_date_time)
+		, executor_(L"diagnostics")
 	{
 		executor_.set_priority_class(below_normal_priority_class);
 	}
@@ -119,33 +147,58 @@ private:
 				glEnable(GL_LINE_SMOOTH);
 				glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
 				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-				tick();
+				start_ticking();
 			}
 		}
 		else
 			window_.reset();
 	}
 
-	void tick()
+	void start_ticking()
 	{
-		if(!window_)
+		if(ticking_)
 			return;
 
-		sf::Event e;
-		while(window_->GetEvent(e))
+		ticking_ = true;
+		tick();
+	}
+
+	void tick()
+	{
+		if(window_)
 		{
-			if(e.Type == sf::Event::Closed)
+			sf::Event e;
+			while(window_->GetEvent(e))
 			{
-				window_.reset();
-				return;
+				if(e.Type == sf::Event::Closed)
+				{
+					window_.reset();
+					break;
+				}
 			}
-		}		
+		}
+
+		if(!window_ && boost::posix_time::microsec_clock::universal_time() > viewed_until_)
+		{
+			ticking_ = false;
+			return;
+		}
+
+		for(auto it = drawables_.begin(); it != drawables_.end(); ++it)
+		{
+			auto drawable = it->lock();
+			if(drawable)
+				drawable->advance();
+		}
 
 		try
 		{
-			glClear(GL_COLOR_BUFFER_BIT);
-			window_->Draw(*this);
-			window_->Display();
+			if(window_)
+			{
+				glClear(GL_COLOR_BUFFER_BIT);
+				window_->Draw(*this);
+				window_->Display();
+			}
 			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
 		}
 		catch (...)
@@ -154,7 +207,6 @@ private:
 			CASPAR_LOG(error)
 					<< L"Closing diag window due to error during rendering";
 			window_.reset();
-			return;
 		}
 
 		executor_.begin_invoke([this]{tick();});
@@ -203,32 +255,153 @@ private:
 	}
 };
 
-class line : public drawable
+struct sampler_holder
+{
+	tbb::atomic<bool>				installed;
+	tbb::spin_mutex					mutex;
+	std::shared_ptr<value_sampler>	sampler;
+
+	sampler_holder()
+	{
+		installed = false;
+	}
+
+	static sampler_holder& get_instance()
+	{
+		static sampler_holder instance;
+		return instance;
+	}
+};
+
+// Upper bounds of the histogram buckets, values are mostly relative to a frame duration.
+const std::size_t num_buckets = 10;
+const double bucket_bounds[num_buckets] = {0.05, 0.1, 0.25, 0.5, 0.75, 0.9, 1.0, 1.25, 1.5, 2.0};
+
+// Recorded for the metrics export, only updated with atomic increments so that set_value stays cheap.
+struct line_metrics
+{
+	tbb::atomic<double>										last;
+	tbb::atomic<int64_t>									count;
+	tbb::atomic<int64_t>									sum_micros;
+	tbb::atomic<int64_t>									tags;
+	std::array<tbb::atomic<int64_t>, num_buckets+1>				buckets;
+
+	line_metrics()
+	{
+		last		= 0.0;
+		count		= 0;
+		sum_micros	= 0;
+		tags		= 0;
+
+		BOOST_FOREACH(auto& bucket, buckets)
+			bucket = 0;
+	}
+
+	void record(double value)
+	{
+		std::size_t n = 0;
+		while(n < num_buckets && value > bucket_bounds[n])
+			++n;
+
+		last = value;
+		buckets[n].fetch_and_increment();
+		sum_micros.fetch_and_add(static_cast<int64_t>(value * 1000000.0));
+		count.fetch_and_increment();
+	}
+};
+
+// The values set on a line between two ticks of the context. Written by the thread setting the values and read on the
+// diagnostics thread without either waiting for the other. Values not read within the size of the ring are dropped.
+class value_ring
+{
+	static const uint32_t size = 64;
+
+	std::array<tbb::atomic<float>, size>	values_;
+	tbb::atomic<uint32_t>					written_;
+	uint32_t								read_;
+public:
+	value_ring()
+		: read_(0)
+	{
+		written_ = 0;
+
+		BOOST_FOREACH(auto& value, values_)
+			value = 0.0f;
+	}
+
+	// Single writer.
+	void push(float value)
+	{
+		uint32_t written = written_;
+		values_[written % size] = value;
+		written_ = written + 1;
+	}
+
+	// The min and max of the values pushed since the last call, false if there were none.
+	bool drain(float& min, float& max)
+	{
+		uint32_t written = written_;
+		if(written == read_)
+			return false;
+
+		if(written - read_ > size)
+			read_ = written - size;
+
+		min = max = values_[read_ % size];
+		for(; read_ != written; ++read_)
+		{
+			float value = values_[read_ % size];
+			min = std::min(min, value);
+			max = std::max(max, value);
+		}
+
+		return true;
+	}
+};
+
+class line
 {
-	boost::circular_buffer<std::pair<float, bool>> line_data_;
+	// The min and max of a tick, below -0.5 before the first value.
+	struct tick_values
+	{
+		float	min;
+		float	max;
+		bool	tag;
+	};
 
-	tbb::atomic<float>	tick_data_;
+	boost::circular_buffer<tick_values> ticks_;
+	std::vector<float>					vertices_;
+	std::vector<float>					tag_vertices_;
+
+	value_ring			values_;
 	tbb::atomic<bool>	tick_tag_;
 	tbb::atomic<int>	color_;
+	line_metrics		metrics_;
+	float				last_;
 public:
 	line(uint32_t res = 1200)
-		: line_data_(res)
+		: ticks_(res)
+		, last_(-1.0f)
 	{
-		tick_data_	= -1.0f;
 		color_		= 0xFFFFFFFF;
 		tick_tag_	= false;
-
-		line_data_.push_back(std::make_pair(-1.0f, false));
 	}
 	
-	void set_value(float value)
+	void set_value(double value)
 	{
-		tick_data_ = value;
+		values_.push(static_cast<float>(value));
+		metrics_.record(value);
 	}
-	
+
 	void set_tag()
 	{
 		tick_tag_ = true;
+		metrics_.tags.fetch_and_increment();
+	}
+
+	const line_metrics& metrics() const
+	{
+		return metrics_;
 	}
 		
 	void set_color(int color)
@@ -240,39 +413,138 @@ public:
 	{
 		return color_;
 	}
+
+	// Without new values a tick repeats the last value, or is 0 when the graph resets, see graph::auto_reset.
+	void advance(bool auto_reset)
+	{
+		tick_values tick;
+		if(!values_.drain(tick.min, tick.max))
+		{
+			if(auto_reset && last_ > -0.5f)
+				last_ = 0.0f;
+			tick.min = tick.max = last_;
+		}
+		else
+			last_ = tick.max;
+
+		tick.tag = tick_tag_.fetch_and_store(false);
+		ticks_.push_back(tick);
+	}
+
+	// Calls func(column, min, max, tag) for each of columns over the width of the line, with the min and max of the
+	// ticks falling in it. Columns before the first value are skipped.
+	template<typename F>
+	void decimate(int columns, const F& func) const
+	{
+		auto capacity	= ticks_.capacity();
+		auto offset		= capacity - ticks_.size();
+
+		int		column	= -1;
+		float	min		= 0.0f;
+		float	max		= 0.0f;
+		bool	tag		= false;
+
+		for(size_t n = 0; n < ticks_.size(); ++n)
+		{
+			auto& tick = ticks_[n];
+			int tick_column = static_cast<int>((offset + n) * columns / capacity);
+
+			if(tick_column != column)
+			{
+				if(column >= 0 && max > -0.5f)
+					func(column, min, max, tag);
+
+				column	= tick_column;
+				min		= tick.min;
+				max		= tick.max;
+				tag		= tick.tag;
+			}
+			else
+			{
+				min = std::min(min, tick.min);
+				max = std::max(max, tick.max);
+				tag = tag || tick.tag;
+			}
+		}
+
+		if(column >= 0 && max > -0.5f)
+			func(column, min, max, tag);
+	}
 		
-	void render(sf::RenderTarget& target)
+	// Draws the line in the unit square, decimated to columns, which is the width in pixels. 
+	void render(int columns)
 	{
-		float dx = 1.0f/static_cast<float>(line_data_.capacity());
-		float x = static_cast<float>(line_data_.capacity()-line_data_.size())*dx;
+		columns = std::max(1, columns);
 
-		line_data_.push_back(std::make_pair(tick_data_, tick_tag_));		
-		tick_tag_   = false;
-				
-		glBegin(GL_LINE_STRIP);
-		auto c = color(color_);
-		glColor4f(std::get<0>(c), std::get<1>(c), std::get<2>(c), 0.8f);		
-		for(uint32_t n = 0; n < line_data_.size(); ++n)		
-			if(line_data_[n].first > -0.5)
-				glVertex3d(x+n*dx, std::max(0.05, std::min(0.95, (1.0f-line_data_[n].first)*0.8 + 0.1f)), 0.0);		
-		glEnd();
-				
-		glEnable(GL_LINE_STIPPLE);
-		glLineStipple(3, 0xAAAA);
-		for(uint32_t n = 0; n < line_data_.size(); ++n)	
+		vertices_.clear();
+		tag_vertices_.clear();
+
+		float dx = 1.0f/static_cast<float>(columns);
+
+		decimate(columns, [&](int column, float min, float max, bool tag)
 		{
-			if(line_data_[n].second)
+			float x = static_cast<float>(column)*dx;
+			vertices_.push_back(x);
+			vertices_.push_back(std::max(0.05f, std::min(0.95f, (1.0f-min)*0.8f + 0.1f)));
+			if(max != min)
+			{
+				vertices_.push_back(x);
+				vertices_.push_back(std::max(0.05f, std::min(0.95f, (1.0f-max)*0.8f + 0.1f)));
+			}
+
+			if(tag)
 			{
-				glBegin(GL_LINE_STRIP);			
-					glVertex3f(x+n*dx, 0.0f, 0.0f);				
-					glVertex3f(x+n*dx, 1.0f, 0.0f);		
-				glEnd();
+				tag_vertices_.push_back(x);
+				tag_vertices_.push_back(0.0f);
+				tag_vertices_.push_back(x);
+				tag_vertices_.push_back(1.0f);
 			}
+		});
+
+		auto c = color(color_);
+		glColor4f(std::get<0>(c), std::get<1>(c), std::get<2>(c), 0.8f);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+
+		if(!vertices_.empty())
+		{
+			glVertexPointer(2, GL_FLOAT, 0, vertices_.data());
+			glDrawArrays(GL_LINE_STRIP, 0, static_cast<GLsizei>(vertices_.size()/2));
+		}
+				
+		if(!tag_vertices_.empty())
+		{
+			glEnable(GL_LINE_STIPPLE);
+			glLineStipple(3, 0xAAAA);
+			glVertexPointer(2, GL_FLOAT, 0, tag_vertices_.data());
+			glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(tag_vertices_.size()/2));
+			glDisable(GL_LINE_STIPPLE);
 		}
-		glDisable(GL_LINE_STIPPLE);
+
+		glDisableClientState(GL_VERTEX_ARRAY);
 	}
 };
 
+// Escapes a label value of the metrics, which is also enough for a json string.
+std::string escape_label(const std::string& value)
+{
+	std::string result;
+	result.reserve(value.size());
+
+	BOOST_FOREACH(auto c, value)
+	{
+		if(c == '\\' || c == '"')
+			result += '\\';
+
+		if(c == '\n')
+			result += "\\n";
+		else
+			result += c;
+	}
+
+	return result;
+}
+
 struct graph::impl : public drawable
 {
 	tbb::concurrent_unordered_map<std::string, diagnostics::line> lines_;
@@ -280,10 +552,18 @@ struct graph::impl : public drawable
 	tbb::spin_mutex mutex_;
 	std::wstring text_;
 	bool auto_reset_;
+	const int id_;
 
 	impl()
 		: auto_reset_(false)
+		, id_(next_id())
+	{
+	}
+
+	static int next_id()
 	{
+		static tbb::atomic<int> id;
+		return ++id;
 	}
 		
 	void set_text(const std::wstring& value)
@@ -298,11 +578,35 @@ struct graph::impl : public drawable
 	void set_value(const std::string& name, double value)
 	{
 		lines_[name].set_value(value);
+		sample(name, value);
 	}
 
 	void set_tag(const std::string& name)
 	{
 		lines_[name].set_tag();
+		sample(name, 1.0);
+	}
+
+	std::pair<diagnostics::line*, const std::string*> get_line(const std::string& name)
+	{
+		auto it = lines_.insert(std::make_pair(name, diagnostics::line())).first;
+		return std::make_pair(&it->second, &it->first);
+	}
+
+	void sample(const std::string& name, double value)
+	{
+		auto& holder = sampler_holder::get_instance();
+		if(!holder.installed)
+			return;
+
+		std::shared_ptr<value_sampler> sampler;
+		{
+			tbb::spin_mutex::scoped_lock lock(holder.mutex);
+			sampler = holder.sampler;
+		}
+
+		if(sampler)
+			(*sampler)(text(), name, value);
 	}
 
 	void set_color(const std::string& name, int color)
@@ -317,6 +621,41 @@ struct graph::impl : public drawable
 			auto_reset_ = true;
 		});
 	}
+
+	void advance()
+	{
+		bool auto_reset = lock(mutex_, [this]
+		{
+			return auto_reset_;
+		});
+
+		for(auto it = lines_.begin(); it != lines_.end(); ++it)
+			it->second.advance(auto_reset);
+	}
+
+	// Only called on the diagnostics thread, like advance.
+	void print(std::ostream& out, int columns)
+	{
+		out << "{\"graph\":" << id_ << ",\"text\":\"" << escape_label(narrow(text())) << "\",\"lines\":[";
+
+		bool first_line = true;
+		for(auto it = lines_.begin(); it != lines_.end(); ++it)
+		{
+			out << (first_line ? "" : ",") << "{\"name\":\"" << escape_label(it->first) << "\",\"color\":" << static_cast<uint32_t>(it->second.get_color()) << ",\"values\":[";
+			first_line = false;
+
+			bool first_value = true;
+			it->second.decimate(columns, [&](int column, float min, float max, bool tag)
+			{
+				out << (first_value ? "" : ",") << "[" << column << "," << min << "," << max << "," << (tag ? 1 : 0) << "]";
+				first_value = false;
+			});
+
+			out << "]}";
+		}
+
+		out << "]}";
+	}
 		
 private:
 	void render(sf::RenderTarget& target)
@@ -326,11 +665,9 @@ private:
 		const uint32_t text_offset = (text_size+text_margin*2)*2;
 
 		std::wstring text_str;
-		bool auto_reset;
 		{
 			tbb::spin_mutex::scoped_lock lock(mutex_);
 			text_str = text_;
-			auto_reset = auto_reset_;
 		}
 
 		sf::String text(text_str.c_str(), sf::Font::GetDefaultFont(), text_size);
@@ -387,19 +724,74 @@ private:
 			//target.Draw(diagnostics::guide(0.0f, color(1.0f, 1.0f, 1.0f, 0.6f)));
 
 			for(auto it = lines_.begin(); it != lines_.end(); ++it)
-			{
-				target.Draw(it->second);
-
-				if (auto_reset)
-					it->second.set_value(0.0f);
-			}
+				it->second.render(static_cast<int>(GetScale().x));
 		
 		glPopMatrix();
 	}
 
+public:
+	std::wstring text()
+	{
+		return lock(mutex_, [this]
+		{
+			return text_;
+		});
+	}
+
+	template<typename F>
+	void for_each_line(const F& func) const
+	{
+		for(auto it = lines_.begin(); it != lines_.end(); ++it)
+			func(it->first, it->second.metrics());
+	}
+
+	// Every registered graph, for the metrics export.
+
+	static void add_to_registry(const std::shared_ptr<impl>& graph)
+	{
+		auto& all = get_registry();
+		tbb::spin_mutex::scoped_lock lock(all.mutex);
+		
+		boost::remove_erase_if(all.graphs, [](const std::weak_ptr<impl>& graph)
+		{
+			return graph.expired();
+		});
+		all.graphs.push_back(graph);
+	}
+
+	static std::vector<std::shared_ptr<impl>> registered()
+	{
+		std::vector<std::shared_ptr<impl>> result;
+		
+		auto& all = get_registry();
+		tbb::spin_mutex::scoped_lock lock(all.mutex);
+
+		BOOST_FOREACH(auto& graph, all.graphs)
+		{
+			auto strong = graph.lock();
+			if(strong)
+				result.push_back(strong);
+		}
+
+		return result;
+	}
+private:
+	struct registry
+	{
+		tbb::spin_mutex						mutex;
+		std::vector<std::weak_ptr<impl>>	graphs;
+	};
+
+	static registry& get_registry()
+	{
+		static registry instance;
+		return instance;
+	}
+
 	impl(impl&);
 	impl& operator=(impl&);
 };
+
 	
 graph::graph() : impl_(new impl())
 {
@@ -411,11 +803,115 @@ void graph::set_color(const std::string& name, int color){impl_->set_color(name,
 void graph::set_tag(const std::string& name){impl_->set_tag(name);}
 void graph::auto_reset(){impl_->auto_reset();}
 
+graph::line_handle graph::get_line(const std::string& name)
+{
+	auto line = impl_->get_line(name);
+
+	line_handle handle;
+	handle.line_ = line.first;
+	handle.name_ = line.second;
+	return handle;
+}
+
+void graph::set_value(const line_handle& line, double value)
+{
+	line.line_->set_value(value);
+	impl_->sample(*line.name_, value);
+}
+
+void graph::set_tag(const line_handle& line)
+{
+	line.line_->set_tag();
+	impl_->sample(*line.name_, 1.0);
+}
+
 void register_graph(const safe_ptr<graph>& graph)
 {
+	graph::impl::add_to_registry(graph->impl_);
 	context::register_drawable(graph->impl_);
 }
 
+std::string print_metrics()
+{
+	std::ostringstream values;
+	std::ostringstream tags;
+	std::ostringstream histograms;
+
+	values		<< "# HELP caspar_graph_value Latest value of a diagnostics graph line.\n"
+				<< "# TYPE caspar_graph_value gauge\n";
+	tags		<< "# HELP caspar_graph_tags_total Number of tags set on a diagnostics graph line.\n"
+				<< "# TYPE caspar_graph_tags_total counter\n";
+	histograms	<< "# HELP caspar_graph_values Values of a diagnostics graph line.\n"
+				<< "# TYPE caspar_graph_values histogram\n";
+
+	BOOST_FOREACH(auto& g, graph::impl::registered())
+	{
+		std::ostringstream graph_labels;
+		graph_labels << "graph=\"" << g->id_ << "\",text=\"" << escape_label(narrow(g->text())) << "\"";
+		auto graph_label_str = graph_labels.str();
+
+		g->for_each_line([&](const std::string& name, const line_metrics& metrics)
+		{
+			auto labels = graph_label_str + ",line=\"" + escape_label(name) + "\"";
+
+			if(metrics.tags > 0)
+				tags << "caspar_graph_tags_total{" << labels << "} " << metrics.tags << "\n";
+
+			int64_t count = metrics.count;
+			if(count == 0)
+				return;
+
+			values << "caspar_graph_value{" << labels << "} " << metrics.last << "\n";
+
+			int64_t cumulative = 0;
+			for(std::size_t n = 0; n < num_buckets; ++n)
+			{
+				cumulative += metrics.buckets[n];
+				histograms << "caspar_graph_values_bucket{" << labels << ",le=\"" << bucket_bounds[n] << "\"} " << cumulative << "\n";
+			}
+			cumulative += metrics.buckets[num_buckets];
+			histograms << "caspar_graph_values_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+			histograms << "caspar_graph_values_sum{" << labels << "} " << static_cast<double>(metrics.sum_micros) / 1000000.0 << "\n";
+			histograms << "caspar_graph_values_count{" << labels << "} " << cumulative << "\n";
+		});
+	}
+
+	return values.str() + tags.str() + histograms.str() + print_lock_metrics() + print_allocation_metrics() + print_executor_metrics();
+}
+
+std::string print_graphs(int columns)
+{
+	columns = std::max(1, std::min(columns, 4096));
+
+	std::ostringstream out;
+	out << "[";
+
+	context::view_remotely([&]
+	{
+		bool first = true;
+		BOOST_FOREACH(auto& g, graph::impl::registered())
+		{
+			out << (first ? "" : ",");
+			g->print(out, columns);
+			first = false;
+		}
+	});
+
+	out << "]";
+	return out.str();
+}
+
+void set_value_sampler(const value_sampler& sampler)
+{
+	auto& holder = sampler_holder::get_instance();
+
+	tbb::spin_mutex::scoped_lock lock(holder.mutex);
+	holder.sampler.reset();
+	if(sampler)
+		holder.sampler = std::make_shared<value_sampler>(sampler);
+	holder.installed = holder.sampler != nullptr;
+}
+
 void show_graphs(bool value)
 {
 	context::show(value);
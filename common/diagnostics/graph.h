@@ -23,6 +23,7 @@
 
 #include "../memory/safe_ptr.h"
 
+#include <functional>
 #include <string>
 #include <tuple>
 
@@ -31,16 +32,35 @@ namespace caspar { namespace diagnostics {
 int color(float r, float g, float b, float a = 1.0f);
 std::tuple<float, float, float, float> color(int code);
 
+class line;
+
 class graph
 {
 	friend void register_graph(const safe_ptr<graph>& graph);
+	friend std::string print_metrics();
+	friend std::string print_graphs(int columns);
 public:
+	// A line resolved by its name once, so that values are set without looking the name up. Only valid while the
+	// graph it was taken from lives. Each line is expected to be set from one thread at a time.
+	class line_handle
+	{
+		friend class graph;
+		diagnostics::line*	line_;
+		const std::string*	name_;
+	public:
+		line_handle() : line_(nullptr), name_(nullptr) {}
+	};
+
 	graph();
 	void set_text(const std::wstring& value);
 	void set_value(const std::string& name, double value);
 	void set_color(const std::string& name, int color);
 	void set_tag(const std::string& name);
 	void auto_reset();
+
+	line_handle get_line(const std::string& name);
+	void set_value(const line_handle& line, double value);
+	void set_tag(const line_handle& line);
 private:
 	struct impl;
 	std::shared_ptr<impl> impl_;
@@ -49,4 +69,18 @@ private:
 void register_graph(const safe_ptr<graph>& graph);
 void show_graphs(bool value);
 
+// The values of all registered graphs in the Prometheus text format.
+std::string print_metrics();
+
+// The lines of all registered graphs decimated to the min and max of each of columns points, as json, for drawing
+// them on another machine. Lines are only sampled while the window is shown or while they are being requested.
+std::string print_graphs(int columns);
+
+// Receives every value set on any graph, on the thread setting it, while installed. For the benchmark mode,
+// which needs each sample rather than the histograms of print_metrics. A tag is sampled as the value 1.
+typedef std::function<void (const std::wstring& graph, const std::string& line, double value)> value_sampler;
+
+// An empty function removes the sampler.
+void set_value_sampler(const value_sampler& sampler);
+
 }}
\ No newline at end of file
@@ -0,0 +1,40 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "thread_clock.h"
+
+#include <cstdint>
+
+namespace caspar { namespace diagnostics {
+
+double thread_cpu_time()
+{
+	FILETIME creation, exit, kernel, user;
+	if(!::GetThreadTimes(::GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0.0;
+
+	auto to_int64 = [](const FILETIME& t) { return static_cast<int64_t>(t.dwHighDateTime) << 32 | t.dwLowDateTime; };
+	return static_cast<double>(to_int64(kernel) + to_int64(user)) / 10000000.0; // 100 ns units
+}
+
+}}
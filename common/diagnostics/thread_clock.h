@@ -0,0 +1,52 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+namespace caspar { namespace diagnostics {
+
+// Seconds of kernel and user time consumed by the calling thread.
+double thread_cpu_time();
+
+// Measures the cpu time the calling thread spends in a scope, as opposed to the
+// wall clock time measured by boost::timer and high_prec_timer.
+class thread_cpu_timer
+{
+public:
+	thread_cpu_timer()
+		: start_(thread_cpu_time())
+	{
+	}
+
+	void restart()
+	{
+		start_ = thread_cpu_time();
+	}
+
+	double elapsed() const
+	{
+		return thread_cpu_time() - start_;
+	}
+private:
+	double start_;
+};
+
+}}
@@ -0,0 +1,177 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "trace.h"
+
+#include "../exception/exceptions.h"
+#include "../utility/string.h"
+
+#include <tbb/atomic.h>
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/foreach.hpp>
+
+#include <sstream>
+#include <vector>
+
+namespace caspar { namespace diagnostics { namespace trace {
+
+namespace {
+
+const size_t CAPACITY = 1 << 16;
+
+struct event
+{
+	tbb::atomic<int64_t>	sequence; // index of the event in the slot, negative while it is written
+	const char*				name;
+	int64_t					frame;
+	int						index;
+	DWORD					thread;
+	int64_t					begin;
+	int64_t					end;
+};
+
+struct ring
+{
+	tbb::atomic<bool>		enabled;
+	tbb::atomic<int64_t>	write_pos;
+	std::vector<event>		events;
+	int64_t					frequency;
+
+	ring()
+		: events(CAPACITY)
+	{
+		enabled		= false;
+		write_pos	= 0;
+
+		BOOST_FOREACH(auto& event, events)
+			event.sequence = -1;
+
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		frequency = freq.QuadPart;
+	}
+};
+
+ring& get_ring()
+{
+	static ring instance;
+	return instance;
+}
+
+}
+
+bool is_enabled()
+{
+	return get_ring().enabled;
+}
+
+void set_enabled(bool value)
+{
+	get_ring().enabled = value;
+}
+
+void clear()
+{
+	auto& ring = get_ring();
+	BOOST_FOREACH(auto& event, ring.events)
+		event.sequence = -1;
+}
+
+int64_t now()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart / get_ring().frequency * 1000000 + counter.QuadPart % get_ring().frequency * 1000000 / get_ring().frequency;
+}
+
+void record(const char* name, int64_t frame, int index, int64_t begin, int64_t end)
+{
+	auto& ring = get_ring();
+	
+	auto pos	= ring.write_pos.fetch_and_increment();
+	auto& event = ring.events[static_cast<size_t>(pos) & (CAPACITY - 1)];
+
+	event.sequence	= -1;
+	event.name		= name;
+	event.frame		= frame;
+	event.index		= index;
+	event.thread	= GetCurrentThreadId();
+	event.begin		= begin;
+	event.end		= end;
+	event.sequence	= pos;
+}
+
+std::string to_chrome_json()
+{
+	auto& ring = get_ring();
+
+	std::stringstream str;
+	str << "{\"traceEvents\":[";
+
+	bool first = true;
+	BOOST_FOREACH(auto& slot, ring.events)
+	{
+		// Slots that are rewritten while being read are skipped.
+		auto sequence = slot.sequence;
+		if(sequence < 0)
+			continue;
+
+		const char* name	= slot.name;
+		int64_t		frame	= slot.frame;
+		int			index	= slot.index;
+		DWORD		thread	= slot.thread;
+		int64_t		begin	= slot.begin;
+		int64_t		end		= slot.end;
+
+		if(slot.sequence != sequence)
+			continue;
+
+		str << (first ? "" : ",") 
+			<< "\n{\"name\":\"" << name << "\",\"cat\":\"caspar\",\"ph\":\"X\",\"pid\":1"
+			<< ",\"tid\":"	<< thread
+			<< ",\"ts\":"	<< begin
+			<< ",\"dur\":"	<< (end - begin)
+			<< ",\"args\":{\"frame\":" << frame;
+
+		if(index >= 0)
+			str << ",\"index\":" << index;
+
+		str << "}}";
+		first = false;
+	}
+
+	str << "\n]}\n";
+	return str.str();
+}
+
+void dump(const std::wstring& filename)
+{
+	boost::filesystem::ofstream file(filename, std::ios::out | std::ios::trunc | std::ios::binary);
+	if(!file)
+		BOOST_THROW_EXCEPTION(file_write_error() << msg_info("Could not open trace file.") << boost::errinfo_file_name(narrow(filename)));
+
+	file << to_chrome_json();
+}
+
+}}}
@@ -0,0 +1,69 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace caspar { namespace diagnostics { namespace trace {
+
+// Spans of work per frame kept in a fixed size in-memory ring, exportable in the
+// Chrome trace_event format (chrome://tracing). Nothing is recorded unless enabled.
+
+bool is_enabled();
+void set_enabled(bool value);
+void clear();
+
+int64_t now(); // microseconds
+
+void record(const char* name, int64_t frame, int index, int64_t begin, int64_t end);
+
+std::string to_chrome_json();
+void dump(const std::wstring& filename);
+
+// Records the lifetime of the scope. The name must be a string literal.
+class scope : boost::noncopyable
+{
+public:
+	scope(const char* name, int64_t frame, int index = -1)
+		: name_(name)
+		, frame_(frame)
+		, index_(index)
+		, begin_(is_enabled() ? now() : -1)
+	{
+	}
+
+	~scope()
+	{
+		if(begin_ >= 0)
+			record(name_, frame_, index_, begin_, now());
+	}
+private:
+	const char* name_;
+	int64_t		frame_;
+	int			index_;
+	int64_t		begin_;
+};
+
+}}}
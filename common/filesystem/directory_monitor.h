@@ -0,0 +1,299 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+#include <ctime>
+
+#include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/range/adaptor/map.hpp>
+#include <boost/range/algorithm/copy.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include "../log/log.h"
+
+#include "filesystem_monitor.h"
+
+namespace caspar {
+
+class exception_protected_handler
+{
+	filesystem_monitor_handler handler_;
+public:
+	exception_protected_handler(const filesystem_monitor_handler& handler)
+		: handler_(handler)
+	{
+	}
+
+	void operator()(filesystem_event event, const boost::filesystem::wpath& file)
+	{
+		try
+		{
+			handler_(event, file);
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+};
+
+/**
+ * Keeps track of the files in a folder and reports the differences found on
+ * each scan. Not thread safe, all calls are expected from the same thread.
+ */
+class directory_monitor
+{
+	bool report_already_existing_;
+	boost::filesystem::wpath folder_;
+	filesystem_event events_mask_;
+	filesystem_monitor_handler handler_;
+	initial_files_handler initial_files_handler_;
+	bool first_scan_;
+	std::map<boost::filesystem::wpath, std::time_t> files_;
+	std::map<boost::filesystem::wpath, uintmax_t> being_written_sizes_;
+public:
+	directory_monitor(
+			bool report_already_existing,
+			const boost::filesystem::wpath& folder,
+			filesystem_event events_mask,
+			const filesystem_monitor_handler& handler,
+			const initial_files_handler& initial_files_handler)
+		: report_already_existing_(report_already_existing)
+		, folder_(folder)
+		, events_mask_(events_mask)
+		, handler_(exception_protected_handler(handler))
+		, initial_files_handler_(initial_files_handler)
+		, first_scan_(true)
+	{
+	}
+
+	void reemmit_all()
+	{
+		if ((events_mask_ & MODIFIED) == 0)
+			return;
+
+		BOOST_FOREACH(auto& file, files_)
+			handler_(MODIFIED, file.first);
+	}
+
+	void reemmit(const boost::filesystem::wpath& file)
+	{
+		if ((events_mask_ & MODIFIED) == 0)
+			return;
+
+		if (files_.find(file) != files_.end() && boost::filesystem::exists(file))
+			handler_(MODIFIED, file);
+	}
+
+	void scan(const boost::function<bool ()>& should_abort)
+	{
+		static const std::time_t NO_LONGER_WRITING_AGE = 3; // Assume std::time_t is expressed in seconds
+		using namespace boost::filesystem;
+
+		bool interested_in_removed = (events_mask_ & REMOVED) > 0;
+		bool interested_in_created = (events_mask_ & CREATED) > 0;
+		bool interested_in_modified = (events_mask_ & MODIFIED) > 0;
+
+		std::set<wpath> removed_files;
+		boost::copy(
+				files_ | boost::adaptors::map_keys,
+				std::insert_iterator<decltype(removed_files)>(removed_files, removed_files.end()));
+
+		std::set<wpath> initial_files;
+
+		for (wrecursive_directory_iterator iter(folder_); iter != wrecursive_directory_iterator(); ++iter)
+		{
+			if (should_abort())
+				return;
+
+			auto& path = iter->path();
+
+			if (is_directory(path))
+				continue;
+
+			auto now = std::time(nullptr);
+			std::time_t current_mtime;
+			
+			try
+			{
+				current_mtime = last_write_time(path);
+			}
+			catch (...)
+			{
+				// Probably removed, will be captured the next round.
+				continue;
+			}
+
+			auto time_since_written_to = now - current_mtime;
+			bool no_longer_being_written_to = time_since_written_to >= NO_LONGER_WRITING_AGE;
+			auto previous_it = files_.find(path);
+			bool already_known = previous_it != files_.end();
+
+			if (already_known && no_longer_being_written_to)
+			{
+				bool modified = previous_it->second != current_mtime;
+
+				if (modified && can_read_file(path))
+				{
+					if (interested_in_modified)
+						handler_(MODIFIED, path);
+
+					files_[path] = current_mtime;
+					being_written_sizes_.erase(path);
+				}
+			}
+			else if (no_longer_being_written_to && can_read_file(path))
+			{
+				if (interested_in_created && (report_already_existing_ || !first_scan_))
+					handler_(CREATED, path);
+
+				if (first_scan_)
+					initial_files.insert(path);
+
+				files_.insert(std::make_pair(path, current_mtime));
+				being_written_sizes_.erase(path);
+			}
+
+			removed_files.erase(path);
+		}
+
+		BOOST_FOREACH(auto& path, removed_files)
+		{
+			files_.erase(path);
+			being_written_sizes_.erase(path);
+
+			if (interested_in_removed)
+				handler_(REMOVED, path);
+		}
+
+		if (first_scan_)
+			initial_files_handler_(initial_files);
+
+		first_scan_ = false;
+	}
+	/**
+	 * Looks at a single path reported as changed, instead of scanning the whole
+	 * folder. A directory is examined recursively.
+	 *
+	 * @param path               The file or directory that changed.
+	 * @param still_being_written Receives the files that are still being
+	 *                            written to and should be checked again later.
+	 */
+	void check(const boost::filesystem::wpath& path, std::set<boost::filesystem::wpath>& still_being_written)
+	{
+		static const std::time_t NO_LONGER_WRITING_AGE = 3; // Assume std::time_t is expressed in seconds
+		using namespace boost::filesystem;
+
+		auto prefix = path.string() + L"/";
+
+		if (!exists(path))
+		{
+			// Either a file or a whole directory disappeared.
+			std::vector<wpath> removed;
+
+			BOOST_FOREACH(auto& file, files_ | boost::adaptors::map_keys)
+			{
+				if (file == path || file.string().compare(0, prefix.size(), prefix) == 0)
+					removed.push_back(file);
+			}
+
+			BOOST_FOREACH(auto& file, removed)
+			{
+				files_.erase(file);
+				being_written_sizes_.erase(file);
+
+				if (events_mask_ & REMOVED)
+					handler_(REMOVED, file);
+			}
+
+			return;
+		}
+
+		if (is_directory(path))
+		{
+			// The files in an already known directory are reported on their own.
+			BOOST_FOREACH(auto& file, files_ | boost::adaptors::map_keys)
+			{
+				if (file.string().compare(0, prefix.size(), prefix) == 0)
+					return;
+			}
+
+			for (wrecursive_directory_iterator iter(path); iter != wrecursive_directory_iterator(); ++iter)
+			{
+				if (!is_directory(iter->path()))
+					check(iter->path(), still_being_written);
+			}
+
+			return;
+		}
+
+		std::time_t current_mtime;
+
+		try
+		{
+			current_mtime = last_write_time(path);
+		}
+		catch (...)
+		{
+			// Probably removed, will be reported by its own notification.
+			return;
+		}
+
+		if (std::time(nullptr) - current_mtime < NO_LONGER_WRITING_AGE || !can_read_file(path))
+		{
+			still_being_written.insert(path);
+			return;
+		}
+
+		auto previous_it = files_.find(path);
+
+		if (previous_it == files_.end())
+		{
+			if (events_mask_ & CREATED)
+				handler_(CREATED, path);
+
+			files_.insert(std::make_pair(path, current_mtime));
+		}
+		else if (previous_it->second != current_mtime)
+		{
+			if (events_mask_ & MODIFIED)
+				handler_(MODIFIED, path);
+
+			previous_it->second = current_mtime;
+		}
+
+		being_written_sizes_.erase(path);
+	}
+private:
+	bool can_read_file(const boost::filesystem::wpath& file)
+	{
+		boost::filesystem::wifstream stream(file);
+
+		return stream.is_open();
+	}
+};
+
+}
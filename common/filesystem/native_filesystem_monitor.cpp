@@ -0,0 +1,379 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "native_filesystem_monitor.h"
+
+#include <set>
+#include <vector>
+#include <cstring>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/replace.hpp>
+
+#include <tbb/atomic.h>
+
+#include "../concurrency/executor.h"
+#include "../exception/win32_exception.h"
+
+#include "directory_monitor.h"
+
+namespace caspar {
+
+class native_filesystem_monitor : public filesystem_monitor
+{
+	static const int RECHECK_INTERVAL_MILLIS = 1000;
+	static const int NOTIFICATION_BUFFER_SIZE = 64 * 1024; // The maximum supported for network shares.
+
+	std::shared_ptr<boost::asio::io_service> scheduler_;
+	boost::filesystem::wpath folder_;
+	directory_monitor root_monitor_;
+	executor executor_;
+	boost::asio::deadline_timer poll_timer_;
+	boost::asio::deadline_timer recheck_timer_;
+	tbb::atomic<bool> running_;
+	tbb::atomic<bool> polling_;
+	int scan_interval_millis_;
+	boost::promise<void> initial_scan_completion_;
+	std::set<boost::filesystem::wpath> still_being_written_;
+	bool recheck_scheduled_;
+
+	std::shared_ptr<void> directory_;
+	std::shared_ptr<void> read_event_;
+	std::shared_ptr<void> stop_event_;
+	OVERLAPPED overlapped_;
+	std::vector<DWORD> buffer_;
+	boost::thread watcher_;
+public:
+	native_filesystem_monitor(
+			const boost::filesystem::wpath& folder_to_watch,
+			filesystem_event events_of_interest_mask,
+			bool report_already_existing,
+			int scan_interval_millis,
+			std::shared_ptr<boost::asio::io_service> scheduler,
+			const filesystem_monitor_handler& handler,
+			const initial_files_handler& initial_files_handler)
+		: scheduler_(std::move(scheduler))
+		, folder_(folder_to_watch)
+		, root_monitor_(
+				report_already_existing,
+				folder_to_watch,
+				events_of_interest_mask,
+				handler,
+				initial_files_handler)
+		, executor_(L"native_filesystem_monitor")
+		, poll_timer_(*scheduler_)
+		, recheck_timer_(*scheduler_)
+		, scan_interval_millis_(scan_interval_millis)
+		, recheck_scheduled_(false)
+		, buffer_(NOTIFICATION_BUFFER_SIZE / sizeof(DWORD))
+	{
+		running_ = true;
+		polling_ = false;
+		std::memset(&overlapped_, 0, sizeof(overlapped_));
+
+		// Start listening before the initial scan so that no change in between is missed.
+		bool listening = open_directory() && begin_read();
+
+		executor_.begin_invoke([this]
+		{
+			scan();
+			initial_scan_completion_.set_value();
+		});
+
+		if (listening)
+			watcher_ = boost::thread([this] { watch(); });
+		else
+			fall_back();
+	}
+
+	virtual ~native_filesystem_monitor()
+	{
+		running_ = false;
+
+		if (stop_event_)
+			SetEvent(stop_event_.get());
+
+		if (watcher_.joinable())
+			watcher_.join();
+
+		boost::system::error_code e;
+		poll_timer_.cancel(e);
+		recheck_timer_.cancel(e);
+	}
+
+	virtual boost::unique_future<void> initial_files_processed()
+	{
+		return initial_scan_completion_.get_future();
+	}
+
+	virtual void reemmit_all()
+	{
+		executor_.begin_invoke([this]
+		{
+			root_monitor_.reemmit_all();
+		});
+	}
+
+	virtual void reemmit(const boost::filesystem::wpath& file)
+	{
+		executor_.begin_invoke([=]
+		{
+			root_monitor_.reemmit(file);
+		});
+	}
+private:
+	bool open_directory()
+	{
+		auto directory = CreateFileW(
+				folder_.file_string().c_str(),
+				FILE_LIST_DIRECTORY,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+				nullptr,
+				OPEN_EXISTING,
+				FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+				nullptr);
+
+		if (directory == INVALID_HANDLE_VALUE)
+			return false;
+
+		directory_ = std::shared_ptr<void>(directory, CloseHandle);
+		read_event_ = std::shared_ptr<void>(CreateEvent(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+		stop_event_ = std::shared_ptr<void>(CreateEvent(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+		overlapped_.hEvent = read_event_.get();
+
+		return true;
+	}
+
+	bool begin_read()
+	{
+		ResetEvent(read_event_.get());
+
+		return ReadDirectoryChangesW(
+				directory_.get(),
+				buffer_.data(),
+				static_cast<DWORD>(buffer_.size() * sizeof(DWORD)),
+				TRUE,
+				FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+				nullptr,
+				&overlapped_,
+				nullptr) != FALSE;
+	}
+
+	void watch()
+	{
+		win32_exception::install_handler();
+
+		HANDLE handles[] = { read_event_.get(), stop_event_.get() };
+
+		while (running_)
+		{
+			if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+				break;
+
+			DWORD bytes = 0;
+
+			if (!GetOverlappedResult(directory_.get(), &overlapped_, &bytes, FALSE))
+			{
+				fall_back();
+				return;
+			}
+
+			if (bytes == 0)
+			{
+				// The notifications did not fit in the buffer, so we do not know what changed.
+				executor_.begin_invoke([this] { scan(); });
+			}
+			else
+			{
+				auto changed = parse_notifications();
+				executor_.begin_invoke([=] { check(changed); });
+			}
+
+			if (!begin_read())
+			{
+				fall_back();
+				return;
+			}
+		}
+
+		// Make sure that the pending read does not write to the buffer after we are gone.
+		DWORD bytes = 0;
+		CancelIo(directory_.get());
+		GetOverlappedResult(directory_.get(), &overlapped_, &bytes, TRUE);
+	}
+
+	std::set<boost::filesystem::wpath> parse_notifications() const
+	{
+		std::set<boost::filesystem::wpath> changed;
+		auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer_.data());
+
+		while (true)
+		{
+			std::wstring name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+			boost::replace_all(name, L"\\", L"/");
+			changed.insert(folder_ / name);
+
+			if (info->NextEntryOffset == 0)
+				break;
+
+			info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(
+					reinterpret_cast<const char*>(info) + info->NextEntryOffset);
+		}
+
+		return changed;
+	}
+
+	void fall_back()
+	{
+		if (!running_)
+			return;
+
+		CASPAR_LOG(warning) << L"Change notifications are not available for " << folder_.file_string()
+				<< L". Polling every " << scan_interval_millis_ << L" ms instead.";
+
+		polling_ = true;
+		schedule_poll();
+	}
+
+	void schedule_poll()
+	{
+		if (!running_)
+			return;
+
+		poll_timer_.expires_from_now(
+			boost::posix_time::milliseconds(scan_interval_millis_));
+		poll_timer_.async_wait([this](const boost::system::error_code& e)
+		{
+			if (e || !running_)
+				return;
+
+			executor_.begin_invoke([this]
+			{
+				scan();
+				schedule_poll();
+			});
+		});
+	}
+
+	void schedule_recheck()
+	{
+		if (!running_ || recheck_scheduled_ || still_being_written_.empty())
+			return;
+
+		recheck_scheduled_ = true;
+		recheck_timer_.expires_from_now(
+			boost::posix_time::milliseconds(RECHECK_INTERVAL_MILLIS));
+		recheck_timer_.async_wait([this](const boost::system::error_code& e)
+		{
+			if (e || !running_)
+				return;
+
+			executor_.begin_invoke([this]
+			{
+				recheck_scheduled_ = false;
+				std::set<boost::filesystem::wpath> to_check;
+				to_check.swap(still_being_written_);
+				check(to_check);
+			});
+		});
+	}
+
+	void check(const std::set<boost::filesystem::wpath>& changed)
+	{
+		if (!running_)
+			return;
+
+		try
+		{
+			BOOST_FOREACH(auto& path, changed)
+				root_monitor_.check(path, still_being_written_);
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+
+		schedule_recheck();
+	}
+
+	void scan()
+	{
+		if (!running_)
+			return;
+
+		try
+		{
+			root_monitor_.scan([=] { return !running_; });
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+};
+
+struct native_filesystem_monitor_factory::implementation
+{
+	std::shared_ptr<boost::asio::io_service> scheduler_;
+	int fallback_scan_interval_millis;
+
+	implementation(
+			std::shared_ptr<boost::asio::io_service> scheduler,
+			int fallback_scan_interval_millis)
+		: scheduler_(std::move(scheduler))
+		, fallback_scan_interval_millis(fallback_scan_interval_millis)
+	{
+	}
+};
+
+native_filesystem_monitor_factory::native_filesystem_monitor_factory(
+		std::shared_ptr<boost::asio::io_service> scheduler,
+		int fallback_scan_interval_millis)
+	: impl_(new implementation(std::move(scheduler), fallback_scan_interval_millis))
+{
+}
+
+native_filesystem_monitor_factory::~native_filesystem_monitor_factory()
+{
+}
+
+filesystem_monitor::ptr native_filesystem_monitor_factory::create(
+		const boost::filesystem::wpath& folder_to_watch,
+		filesystem_event events_of_interest_mask,
+		bool report_already_existing,
+		const filesystem_monitor_handler& handler,
+		const initial_files_handler& initial_files_handler)
+{
+	return make_safe<native_filesystem_monitor>(
+			folder_to_watch,
+			events_of_interest_mask,
+			report_already_existing,
+			impl_->fallback_scan_interval_millis,
+			impl_->scheduler_,
+			handler,
+			initial_files_handler);
+}
+
+}
@@ -0,0 +1,71 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "filesystem_monitor.h"
+
+namespace boost { namespace asio {
+	class io_service;
+}}
+
+namespace caspar {
+
+/**
+ * A filesystem monitor implementation which reacts on the change
+ * notifications of the operating system (ReadDirectoryChangesW), so that only
+ * the files actually touched are examined instead of the whole folder.
+ * <p>
+ * Falls back to periodically polling the folder if notifications are not
+ * supported by it, which may be the case for some network shares, and does a
+ * full rescan whenever notifications are lost due to buffer overflow.
+ * <p>
+ * Will create two dedicated threads for each monitor created.
+ */
+class native_filesystem_monitor_factory : public filesystem_monitor_factory
+{
+public:
+	/**
+	 * Constructor.
+	 *
+	 * @param scheduler                     The io_service that will be used
+	 *                                      for scheduling delayed checks and
+	 *                                      fallback scans.
+	 * @param fallback_scan_interval_millis The number of milliseconds between
+	 *                                      each scan when falling back to
+	 *                                      polling.
+	 */
+	native_filesystem_monitor_factory(
+			std::shared_ptr<boost::asio::io_service> scheduler,
+			int fallback_scan_interval_millis = 5000);
+	virtual ~native_filesystem_monitor_factory();
+	virtual filesystem_monitor::ptr create(
+			const boost::filesystem::wpath& folder_to_watch,
+			filesystem_event events_of_interest_mask,
+			bool report_already_existing,
+			const filesystem_monitor_handler& handler,
+			const initial_files_handler& initial_files_handler);
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}
@@ -37,6 +37,7 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/chrono.hpp>
 #include <boost/filesystem/convenience.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/algorithm/string.hpp>
@@ -62,6 +63,7 @@
 #include <boost/log/utility/attribute_value_extractor.hpp>
 
 #include <boost/log/utility/init/common_attributes.hpp>
+#include <boost/log/attributes/clock.hpp>
 #include <boost/log/utility/empty_deleter.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/bind.hpp>
@@ -70,9 +72,8 @@ namespace caspar { namespace log {
 
 using namespace boost;
 
-void append_timestamp(std::wostream& stream)
+void append_timestamp(std::wostream& stream, const boost::posix_time::ptime& timestamp)
 {
-	auto timestamp = boost::posix_time::microsec_clock::local_time();
 	auto date = timestamp.date();
 	auto time = timestamp.time_of_day();
 	auto milliseconds = time.fractional_seconds() / 1000; // microseconds to milliseconds
@@ -98,7 +99,11 @@ void my_formatter(bool print_all_characters, std::wostream& strm, boost::log::ba
 	
 	#pragma warning(disable : 4996)
 
-	append_timestamp(strm);
+	// Records can be formatted well after they were logged, so the time is taken from the record.
+	auto timestamp = boost::posix_time::microsec_clock::local_time();
+	boost::log::extract<boost::log::attributes::local_clock::held_type>(L"TimeStamp", rec.attribute_values(), lambda::var(timestamp) = lambda::_1);
+
+	append_timestamp(strm, timestamp);
 		
     boost::log::attributes::current_thread_id::held_type thread_id;
     if(boost::log::extract<boost::log::attributes::current_thread_id::held_type>(L"ThreadID", rec.attribute_values(), lambda::var(thread_id) = lambda::_1))
@@ -125,6 +130,62 @@ void my_formatter(bool print_all_characters, std::wostream& strm, boost::log::ba
 	}
 }
 
+// Bounds the records waiting in an asynchronous sink.
+struct queue_limit
+{
+	tbb::atomic<int>	queued;
+	tbb::atomic<int>	dropped;
+	const int			max_queued;
+
+	queue_limit(int max_queued)
+		: max_queued(max_queued)
+	{
+		queued	= 0;
+		dropped	= 0;
+	}
+};
+
+// Runs on the logging thread, before the record is built.
+struct queue_limit_filter
+{
+	typedef bool result_type;
+
+	boost::shared_ptr<queue_limit> limit;
+
+	queue_limit_filter(const boost::shared_ptr<queue_limit>& limit)
+		: limit(limit)
+	{
+	}
+
+	template<typename T>
+	bool operator()(const T&) const
+	{
+		if(limit->queued.fetch_and_increment() >= limit->max_queued)
+		{
+			--limit->queued;
+			++limit->dropped;
+			return false;
+		}
+
+		return true;
+	}
+};
+
+// Runs on the sink thread.
+void queued_formatter(const boost::shared_ptr<queue_limit>& limit, std::wostream& strm, boost::log::basic_record<wchar_t> const& rec)
+{
+	--limit->queued;
+
+	int dropped = limit->dropped.fetch_and_store(0);
+	if(dropped > 0)
+	{
+		append_timestamp(strm, boost::posix_time::microsec_clock::local_time());
+		strm << L"[warning] " << dropped << L" log messages were dropped, the log queue was full.\n";
+	}
+
+	my_formatter(true, strm, rec);
+}
+
 namespace internal{
 	
 void init()
@@ -155,28 +216,30 @@ void init()
 
 }
 
-void add_file_sink(const std::wstring& folder)
+void add_file_sink(const std::wstring& folder, int max_queued)
 {	
 	boost::log::add_common_attributes<wchar_t>();
 	typedef boost::log::aux::add_common_attributes_constants<wchar_t> traits_t;
 
-	typedef boost::log::sinks::synchronous_sink<boost::log::sinks::wtext_file_backend> file_sink_type;
+	typedef boost::log::sinks::asynchronous_sink<boost::log::sinks::wtext_file_backend> file_sink_type;
 
 	try
 	{
 		if(!boost::filesystem::is_directory(folder))
 			BOOST_THROW_EXCEPTION(directory_not_found());
 
-		auto file_sink = boost::make_shared<file_sink_type>(
+		auto file_backend = boost::make_shared<boost::log::sinks::wtext_file_backend>(
 			boost::log::keywords::file_name = (folder + L"caspar_%Y-%m-%d.log"),
 			boost::log::keywords::time_based_rotation = boost::log::sinks::file::rotation_at_time_point(0, 0, 0),
 			boost::log::keywords::auto_flush = true,
 			boost::log::keywords::open_mode = std::ios::app
 		);
 
-		bool print_all_characters = true;
+		auto file_sink = boost::make_shared<file_sink_type>(file_backend);
+		auto limit = boost::make_shared<queue_limit>(std::max(1, max_queued));
 
-		file_sink->locked_backend()->set_formatter(boost::bind(my_formatter, print_all_characters, _1, _2));
+		file_sink->set_filter(queue_limit_filter(limit));
+		file_sink->locked_backend()->set_formatter(boost::bind(queued_formatter, limit, _1, _2));
 
 //#ifdef NDEBUG
 //		file_sink->set_filter(boost::log::filters::attr<severity_level>(boost::log::sources::aux::severity_attribute_name<wchar_t>::get()) >= debug);
@@ -191,6 +254,25 @@ void add_file_sink(const std::wstring& folder)
 	}
 }
 
+suppressed_messages rate_limiter::try_pass(int messages_per_second)
+{
+	auto now = boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+	
+	// The first message of a new window reports what the previous windows suppressed.
+	int64_t start = window_start;
+	if(now - start >= 1000 && window_start.compare_and_swap(now, start) == start)
+	{
+		count = 1;
+		return suppressed_messages(suppressed.fetch_and_store(0));
+	}
+
+	if(++count <= messages_per_second)
+		return suppressed_messages(0);
+
+	++suppressed;
+	return suppressed_messages(-1);
+}
+
 void set_log_level(const std::wstring& lvl)
 {	
 	if(boost::iequals(lvl, L"trace"))
@@ -36,6 +36,8 @@
 #include <boost/log/sources/severity_logger.hpp>
 #include <boost/log/sources/record_ostream.hpp>
 
+#include <tbb/atomic.h>
+
 #include <string>
 #include <locale>
 
@@ -45,7 +47,8 @@ namespace internal{
 void init();
 }
 
-void add_file_sink(const std::wstring& folder);
+// The file is written on a background thread, messages beyond max_queued are dropped and counted in the log.
+void add_file_sink(const std::wstring& folder, int max_queued = 8192);
 
 enum severity_level
 {
@@ -96,6 +99,47 @@ BOOST_LOG_DECLARE_GLOBAL_LOGGER_INIT(logger, caspar_logger)
 	{CASPAR_LOG(error) << boost::current_exception_diagnostic_information().c_str();}\
 	catch(...){}
 
+// Logs at most messages_per_second from one call site, and how many were suppressed in between.
+#define CASPAR_LOG_RATE_LIMITED(lvl, messages_per_second)\
+	for(auto caspar_log_pass = ([]() -> ::caspar::log::rate_limiter& { static ::caspar::log::rate_limiter limiter; return limiter; })().try_pass(messages_per_second);\
+		caspar_log_pass.passed();\
+		caspar_log_pass.done())\
+		CASPAR_LOG(lvl) << caspar_log_pass
+
+class suppressed_messages
+{
+	int count_;
+public:
+	explicit suppressed_messages(int count)
+		: count_(count)
+	{
+	}
+
+	bool passed() const	{return count_ >= 0;}
+	void done()			{count_ = -1;}
+	int count() const	{return count_;}
+};
+
+template< typename CharT, typename TraitsT >
+inline std::basic_ostream< CharT, TraitsT >& operator<< (
+	std::basic_ostream< CharT, TraitsT >& strm, const suppressed_messages& suppressed)
+{
+	if(suppressed.count() > 0)
+		strm << "(" << suppressed.count() << " similar messages suppressed) ";
+
+	return strm;
+}
+
+// No constructor so that a static instance is zero initialized before any thread can use it.
+struct rate_limiter
+{
+	tbb::atomic<int64_t>	window_start;
+	tbb::atomic<int>		count;
+	tbb::atomic<int>		suppressed;
+
+	suppressed_messages try_pass(int messages_per_second);
+};
+
 void set_log_level(const std::wstring& lvl);
 
 template<typename T>
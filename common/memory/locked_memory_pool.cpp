@@ -0,0 +1,392 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "locked_memory_pool.h"
+
+#include "../log/log.h"
+
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace caspar {
+
+namespace {
+
+const std::size_t ALIGNMENT = 4096;
+
+std::size_t align_up(std::size_t size, std::size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+bool enable_lock_memory_privilege()
+{
+	HANDLE token = nullptr;
+	if(!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	bool result = ::LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+				  ::AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+				  ::GetLastError() == ERROR_SUCCESS;
+
+	::CloseHandle(token);
+	return result;
+}
+
+int current_numa_node()
+{
+	UCHAR node = 0;
+	if(!::GetNumaProcessorNode(static_cast<UCHAR>(::GetCurrentProcessorNumber()), &node) || node == 0xFF)
+		return 0;
+	return node;
+}
+
+struct arena
+{
+	uint8_t*						base;
+	std::size_t						size;
+	std::size_t						used;
+	int								node;
+	bool							large_pages;
+	std::map<std::size_t, std::size_t>	free_ranges; // offset -> size
+
+	arena(uint8_t* base, std::size_t size, int node, bool large_pages)
+		: base(base)
+		, size(size)
+		, used(0)
+		, node(node)
+		, large_pages(large_pages)
+	{
+		free_ranges[0] = size;
+	}
+
+	void* allocate(std::size_t size)
+	{
+		for(auto it = free_ranges.begin(); it != free_ranges.end(); ++it)
+		{
+			if(it->second < size)
+				continue;
+
+			auto offset = it->first;
+			auto rest	= it->second - size;
+			free_ranges.erase(it);
+			if(rest > 0)
+				free_ranges[offset + size] = rest;
+
+			used += size;
+			return base + offset;
+		}
+
+		return nullptr;
+	}
+
+	void deallocate(void* p, std::size_t size)
+	{
+		auto offset = static_cast<std::size_t>(reinterpret_cast<uint8_t*>(p) - base);
+		auto it = free_ranges.insert(std::make_pair(offset, size)).first;
+
+		auto next = it;
+		++next;
+		if(next != free_ranges.end() && it->first + it->second == next->first)
+		{
+			it->second += next->second;
+			free_ranges.erase(next);
+		}
+
+		if(it != free_ranges.begin())
+		{
+			auto prev = it;
+			--prev;
+			if(prev->first + prev->second == it->first)
+			{
+				prev->second += it->second;
+				free_ranges.erase(it);
+			}
+		}
+
+		used -= size;
+	}
+
+	bool contains(const void* p) const
+	{
+		return p >= base && p < base + size;
+	}
+};
+
+struct allocation
+{
+	arena*		owner;
+	std::size_t	size;
+};
+
+class locked_memory_pool
+{
+	tbb::mutex									mutex_;
+	locked_memory_config						config_;
+	bool										large_pages_;
+	int											nodes_;
+	std::vector<std::unique_ptr<arena>>			arenas_;
+	std::unordered_map<void*, allocation>		allocations_;
+	std::size_t									peak_used_;
+	tbb::atomic<bool>							enabled_;
+public:
+	locked_memory_pool()
+		: large_pages_(false)
+		, nodes_(1)
+		, peak_used_(0)
+	{
+		enabled_ = false;
+	}
+
+	~locked_memory_pool()
+	{
+		BOOST_FOREACH(auto& a, arenas_)
+			::VirtualFree(a->base, 0, MEM_RELEASE);
+	}
+
+	void init(const locked_memory_config& config)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		if(enabled_)
+			return;
+
+		config_ = config;
+
+		ULONG highest_node = 0;
+		if(config_.numa_local && ::GetNumaHighestNodeNumber(&highest_node))
+			nodes_ = static_cast<int>(highest_node) + 1;
+
+		if(config_.large_pages)
+		{
+			auto large_page_size = ::GetLargePageMinimum();
+			if(large_page_size > 0 && enable_lock_memory_privilege())
+			{
+				large_pages_ = true;
+				config_.arena_size = align_up(config_.arena_size, large_page_size);
+			}
+			else
+				CASPAR_LOG(warning) << L"[locked_memory_pool] Large pages are not available, SeLockMemoryPrivilege is needed. Using locked regular pages.";
+		}
+
+		config_.arena_size = align_up(config_.arena_size, ALIGNMENT);
+
+		for(int node = 0; node < nodes_; ++node)
+		{
+			for(int n = 0; n < config_.arenas_per_node; ++n)
+			{
+				if(!reserve_arena(node))
+					break;
+			}
+		}
+
+		enabled_ = true;
+
+		CASPAR_LOG(info) << L"[locked_memory_pool] Reserved " << arenas_.size() << L" arena(s) of " << config_.arena_size / (1024*1024) << L" MB on " << nodes_ << L" NUMA node(s)" << (large_pages_ ? L" with large pages." : L".");
+	}
+
+	bool enabled() const
+	{
+		return enabled_;
+	}
+
+	void* allocate(std::size_t size)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		size = align_up(std::max<std::size_t>(size, 1), ALIGNMENT);
+
+		auto node = nodes_ > 1 ? current_numa_node() % nodes_ : 0;
+
+		auto p = allocate_from(size, node, true);
+		if(!p)
+			p = allocate_from(size, node, false);
+
+		if(!p)
+		{
+			CASPAR_LOG(warning) << L"[locked_memory_pool] Arenas are full, reserving another one on node " << node << L". Increase arenas-per-node to avoid this.";
+			auto a = reserve_arena(node, size);
+			if(a)
+				p = a->allocate(size);
+		}
+
+		if(!p)
+			throw std::bad_alloc();
+
+		auto owner = std::find_if(arenas_.begin(), arenas_.end(), [&](const std::unique_ptr<arena>& a){ return a->contains(p); });
+		allocation entry = {owner->get(), size};
+		allocations_[p] = entry;
+
+		peak_used_ = std::max(peak_used_, used());
+		return p;
+	}
+
+	bool deallocate(void* p)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = allocations_.find(p);
+		if(it == allocations_.end())
+			return false;
+
+		it->second.owner->deallocate(p, it->second.size);
+		allocations_.erase(it);
+		return true;
+	}
+
+	boost::property_tree::wptree info()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		boost::property_tree::wptree info;
+		info.add(L"enabled",		enabled_ ? L"true" : L"false");
+		info.add(L"large-pages",	large_pages_ ? L"true" : L"false");
+		info.add(L"numa-nodes",		nodes_);
+		info.add(L"used",			used());
+		info.add(L"peak-used",		peak_used_);
+		info.add(L"allocations",	allocations_.size());
+
+		BOOST_FOREACH(auto& a, arenas_)
+		{
+			boost::property_tree::wptree arena_info;
+			arena_info.add(L"node",			a->node);
+			arena_info.add(L"size",			a->size);
+			arena_info.add(L"used",			a->used);
+			arena_info.add(L"large-pages",	a->large_pages ? L"true" : L"false");
+			info.add_child(L"arenas.arena", arena_info);
+		}
+
+		return info;
+	}
+
+private:
+	std::size_t used() const
+	{
+		std::size_t result = 0;
+		BOOST_FOREACH(auto& a, arenas_)
+			result += a->used;
+		return result;
+	}
+
+	void* allocate_from(std::size_t size, int node, bool same_node)
+	{
+		BOOST_FOREACH(auto& a, arenas_)
+		{
+			if((a->node == node) != same_node)
+				continue;
+
+			auto p = a->allocate(size);
+			if(p)
+				return p;
+		}
+
+		return nullptr;
+	}
+
+	arena* reserve_arena(int node, std::size_t min_size = 0)
+	{
+		auto size = std::max(config_.arena_size, align_up(min_size, config_.arena_size));
+
+		void* p = nullptr;
+
+		if(large_pages_)
+			p = ::VirtualAllocExNuma(::GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+
+		// Large pages are always resident, regular pages have to be locked into a working set grown to fit them.
+		bool large_pages = p != nullptr;
+		if(!p)
+		{
+			SIZE_T working_set_min = 0, working_set_max = 0;
+			if(!::GetProcessWorkingSetSize(::GetCurrentProcess(), &working_set_min, &working_set_max) ||
+			   !::SetProcessWorkingSetSize(::GetCurrentProcess(), working_set_min + size, working_set_max + size))
+			{
+				CASPAR_LOG(warning) << L"[locked_memory_pool] Could not grow the working set by " << size << L" bytes.";
+				return nullptr;
+			}
+
+			p = ::VirtualAllocExNuma(::GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+			if(p && !::VirtualLock(p, size))
+			{
+				::VirtualFree(p, 0, MEM_RELEASE);
+				p = nullptr;
+			}
+		}
+
+		if(!p)
+		{
+			CASPAR_LOG(warning) << L"[locked_memory_pool] Could not reserve an arena of " << size << L" bytes on node " << node << L".";
+			return nullptr;
+		}
+
+		arenas_.push_back(std::unique_ptr<arena>(new arena(reinterpret_cast<uint8_t*>(p), size, node, large_pages)));
+		return arenas_.back().get();
+	}
+};
+
+locked_memory_pool& get_pool()
+{
+	static locked_memory_pool pool;
+	return pool;
+}
+
+}
+
+void init_locked_memory_pool(const locked_memory_config& config)
+{
+	get_pool().init(config);
+}
+
+bool locked_memory_pool_enabled()
+{
+	return get_pool().enabled();
+}
+
+void* locked_memory_allocate(std::size_t size)
+{
+	return get_pool().allocate(size);
+}
+
+bool locked_memory_deallocate(void* p)
+{
+	return get_pool().deallocate(p);
+}
+
+boost::property_tree::wptree locked_memory_info()
+{
+	return get_pool().info();
+}
+
+}
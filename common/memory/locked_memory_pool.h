@@ -0,0 +1,61 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstddef>
+
+namespace caspar {
+
+struct locked_memory_config
+{
+	bool		large_pages;		// MEM_LARGE_PAGES arenas, needs SeLockMemoryPrivilege.
+	bool		numa_local;			// one set of arenas per NUMA node.
+	std::size_t	arena_size;
+	int			arenas_per_node;	// reserved up front, so that the working set does not have to grow later.
+
+	locked_memory_config()
+		: large_pages(true)
+		, numa_local(true)
+		, arena_size(64 * 1024 * 1024)
+		, arenas_per_node(1)
+	{
+	}
+};
+
+// Reserves the arenas that page_locked_allocator hands out its buffers from.
+// Without a call to this page_locked_allocator locks every allocation on its own.
+void init_locked_memory_pool(const locked_memory_config& config);
+bool locked_memory_pool_enabled();
+
+// Takes the buffer from an arena on the NUMA node the calling thread runs on,
+// falling back to the other nodes. Throws std::bad_alloc when all are full and
+// no new arena can be reserved.
+void* locked_memory_allocate(std::size_t size);
+
+// Returns false if p was not handed out by the pool.
+bool locked_memory_deallocate(void* p);
+
+boost::property_tree::wptree locked_memory_info();
+
+}
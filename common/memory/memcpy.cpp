@@ -0,0 +1,194 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "memcpy.h"
+
+#include "../utility/assert.h"
+#include "../concurrency/parallel_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include <tbb/parallel_for.h>
+
+namespace caspar { namespace detail {
+
+namespace {
+
+// Below this the copy is done on the calling thread, since spawning tasks costs
+// more than what they save.
+const std::size_t PARALLEL_THRESHOLD	= 1024 * 1024;
+
+// Every task copies a contiguous range of this size, so that each thread works
+// on pages of its own.
+const std::size_t PARALLEL_GRAIN		= 256 * 1024;
+
+// Copies larger than this would only evict what is in the cache, so the stores
+// bypass it.
+const std::size_t STREAMING_THRESHOLD	= 256 * 1024;
+
+const std::size_t BLOCK_SIZE			= 128;
+
+bool detect_avx()
+{
+	int info[4];
+	__cpuid(info, 1);
+
+	bool has_avx		= (info[2] & (1 << 28)) != 0;
+	bool has_osxsave	= (info[2] & (1 << 27)) != 0;
+
+	if(!has_avx || !has_osxsave)
+		return false;
+
+	// The operating system has to save the upper halves of the registers too.
+	return (_xgetbv(0) & 6) == 6;
+}
+
+const bool g_has_avx = detect_avx();
+
+template<bool Stream>
+void copy_blocks_sse2(char* dest, const char* source, std::size_t count)
+{
+	CASPAR_ASSERT(reinterpret_cast<std::uintptr_t>(dest) % 16 == 0);
+
+	bool aligned_source = reinterpret_cast<std::uintptr_t>(source) % 16 == 0;
+
+	for(; count != 0; count -= BLOCK_SIZE, dest += BLOCK_SIZE, source += BLOCK_SIZE)
+	{
+		auto s = reinterpret_cast<const __m128i*>(source);
+		auto d = reinterpret_cast<__m128i*>(dest);
+
+		__m128i xmm[8];
+		for(int n = 0; n < 8; ++n)
+			xmm[n] = aligned_source ? _mm_load_si128(s + n) : _mm_loadu_si128(s + n);
+
+		for(int n = 0; n < 8; ++n)
+		{
+			if(Stream)
+				_mm_stream_si128(d + n, xmm[n]);
+			else
+				_mm_store_si128(d + n, xmm[n]);
+		}
+	}
+}
+
+template<bool Stream>
+void copy_blocks_avx(char* dest, const char* source, std::size_t count)
+{
+	CASPAR_ASSERT(reinterpret_cast<std::uintptr_t>(dest) % 32 == 0);
+
+	for(; count != 0; count -= BLOCK_SIZE, dest += BLOCK_SIZE, source += BLOCK_SIZE)
+	{
+		auto s = reinterpret_cast<const __m256i*>(source);
+		auto d = reinterpret_cast<__m256i*>(dest);
+
+		__m256i ymm0 = _mm256_loadu_si256(s + 0);
+		__m256i ymm1 = _mm256_loadu_si256(s + 1);
+		__m256i ymm2 = _mm256_loadu_si256(s + 2);
+		__m256i ymm3 = _mm256_loadu_si256(s + 3);
+
+		if(Stream)
+		{
+			_mm256_stream_si256(d + 0, ymm0);
+			_mm256_stream_si256(d + 1, ymm1);
+			_mm256_stream_si256(d + 2, ymm2);
+			_mm256_stream_si256(d + 3, ymm3);
+		}
+		else
+		{
+			_mm256_store_si256(d + 0, ymm0);
+			_mm256_store_si256(d + 1, ymm1);
+			_mm256_store_si256(d + 2, ymm2);
+			_mm256_store_si256(d + 3, ymm3);
+		}
+	}
+
+	// Avoids the penalty of switching back to the legacy SSE encoding.
+	_mm256_zeroupper();
+}
+
+void copy_range(char* dest, const char* source, std::size_t count, bool stream)
+{
+	// The vector stores need an aligned destination.
+	std::size_t head = (32 - reinterpret_cast<std::uintptr_t>(dest) % 32) % 32;
+	if(head > count)
+		head = count;
+
+	memcpy(dest, source, head);
+	dest	+= head;
+	source	+= head;
+	count	-= head;
+
+	std::size_t rest = count % BLOCK_SIZE;
+	count -= rest;
+
+	if(count > 0)
+	{
+		if(g_has_avx)
+			stream ? copy_blocks_avx<true>(dest, source, count) : copy_blocks_avx<false>(dest, source, count);
+		else
+			stream ? copy_blocks_sse2<true>(dest, source, count) : copy_blocks_sse2<false>(dest, source, count);
+
+		if(stream)
+			_mm_sfence();
+	}
+
+	memcpy(dest + count, source + count, rest);
+}
+
+}
+
+void* fast_memcpy(void* dest, const void* source, std::size_t count)
+{
+	CASPAR_ASSERT(dest != nullptr);
+	CASPAR_ASSERT(source != nullptr);
+
+	auto dest8		= reinterpret_cast<char*>(dest);
+	auto source8	= reinterpret_cast<const char*>(source);
+	bool stream		= count >= STREAMING_THRESHOLD;
+
+	if(count < PARALLEL_THRESHOLD)
+	{
+		copy_range(dest8, source8, count, stream);
+		return dest;
+	}
+
+	std::size_t chunks = (count + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+
+	arena_parallel_for(tbb::blocked_range<std::size_t>(0, chunks), [&](const tbb::blocked_range<std::size_t>& r)
+	{
+		auto begin	= r.begin() * PARALLEL_GRAIN;
+		auto end	= std::min(r.end() * PARALLEL_GRAIN, count);
+
+		copy_range(dest8 + begin, source8 + begin, end - begin, stream);
+	}, tbb::simple_partitioner());
+
+	return dest;
+}
+
+}}
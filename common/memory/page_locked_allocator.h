@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include "locked_memory_pool.h"
+
 #include <unordered_map>
 #include <tbb/mutex.h>
 
@@ -44,6 +46,9 @@ public:
   
 	pointer allocate(size_type n, const void * = 0) 
 	{
+		if(locked_memory_pool_enabled())
+			return reinterpret_cast<T*>(locked_memory_allocate(n * sizeof(T)));
+
 		tbb::mutex::scoped_lock lock(get().mutex);
 
 		size_type size = n * sizeof(T);		
@@ -67,6 +72,9 @@ public:
   
 	void deallocate(void* p, size_type) 
 	{
+		if(locked_memory_deallocate(p))
+			return;
+
 		tbb::mutex::scoped_lock lock(get().mutex);
 
 		if(!p || get().map.find(p) == get().map.end())
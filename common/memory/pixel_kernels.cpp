@@ -0,0 +1,446 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "pixel_kernels.h"
+
+#include "../concurrency/parallel_arena.h"
+
+#include <intrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+namespace caspar {
+
+namespace {
+
+// Below this many bytes the work is done on the calling thread.
+const std::size_t PARALLEL_THRESHOLD	= 1024 * 1024;
+const std::size_t PARALLEL_GRAIN		= 64 * 1024;
+
+bool detect_ssse3()
+{
+	int info[4];
+	__cpuid(info, 1);
+
+	return (info[2] & (1 << 9)) != 0;
+}
+
+const bool g_has_ssse3 = detect_ssse3();
+
+// Runs func over [0, count) in grains of whole units, on the calling thread for
+// small counts.
+template<typename Func>
+void for_each_range(std::size_t count, std::size_t unit_bytes, const Func& func)
+{
+	if(count * unit_bytes < PARALLEL_THRESHOLD)
+	{
+		func(0, count);
+		return;
+	}
+
+	auto grain = std::max<std::size_t>(1, PARALLEL_GRAIN / unit_bytes);
+
+	arena_parallel_for(tbb::blocked_range<std::size_t>(0, count, grain), [&](const tbb::blocked_range<std::size_t>& r)
+	{
+		func(r.begin(), r.end());
+	});
+}
+
+uint16_t pack_565(const int* bgr)
+{
+	return static_cast<uint16_t>(((bgr[2] * 31 + 127) / 255) << 11 | ((bgr[1] * 63 + 127) / 255) << 5 | ((bgr[0] * 31 + 127) / 255));
+}
+
+void unpack_565(uint16_t color, int* bgr)
+{
+	const int r = (color >> 11) & 31;
+	const int g = (color >> 5) & 63;
+	const int b = color & 31;
+	bgr[0] = (b << 3) | (b >> 2);
+	bgr[1] = (g << 2) | (g >> 4);
+	bgr[2] = (r << 3) | (r >> 2);
+}
+
+// Fits the range of each channel, which is quick, and good enough for stills which are mostly flat or smooth
+// and for replays.
+void encode_dxt5_block(const uint8_t (&pixels)[16][4], uint8_t* block)
+{
+	int min[4] = {255, 255, 255, 255};
+	int max[4] = {0, 0, 0, 0};
+	for(int i = 0; i < 16; ++i)
+	{
+		for(int c = 0; c < 4; ++c)
+		{
+			min[c] = std::min<int>(min[c], pixels[i][c]);
+			max[c] = std::max<int>(max[c], pixels[i][c]);
+		}
+	}
+
+	// Alpha, 8 steps from the largest to the smallest value.
+	block[0] = static_cast<uint8_t>(max[3]);
+	block[1] = static_cast<uint8_t>(min[3]);
+
+	uint64_t alpha_indices = 0;
+	if(max[3] > min[3])
+	{
+		int palette[8] = {max[3], min[3]};
+		for(int n = 1; n < 7; ++n)
+			palette[n + 1] = ((7 - n) * max[3] + n * min[3] + 3) / 7;
+
+		for(int i = 0; i < 16; ++i)
+		{
+			int best = 0;
+			for(int n = 1; n < 8; ++n)
+			{
+				if(std::abs(palette[n] - pixels[i][3]) < std::abs(palette[best] - pixels[i][3]))
+					best = n;
+			}
+			alpha_indices |= static_cast<uint64_t>(best) << (3 * i);
+		}
+	}
+
+	for(int n = 0; n < 6; ++n)
+		block[2 + n] = static_cast<uint8_t>(alpha_indices >> (8 * n));
+
+	// Colors, the bounding box inset by a sixteenth so that the error is spread over the block.
+	for(int c = 0; c < 3; ++c)
+	{
+		const int inset = (max[c] - min[c]) >> 4;
+		min[c] += inset;
+		max[c] -= inset;
+	}
+
+	// Every channel of the first endpoint is at least that of the second, which keeps the 4 color mode.
+	const auto color0 = pack_565(max);
+	const auto color1 = pack_565(min);
+
+	int palette[4][3];
+	unpack_565(color0, palette[0]);
+	unpack_565(color1, palette[1]);
+	for(int c = 0; c < 3; ++c)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	uint32_t color_indices = 0;
+	if(color0 != color1)
+	{
+		for(int i = 0; i < 16; ++i)
+		{
+			int best = 0;
+			int best_distance = INT_MAX;
+			for(int n = 0; n < 4; ++n)
+			{
+				int distance = 0;
+				for(int c = 0; c < 3; ++c)
+					distance += (palette[n][c] - pixels[i][c]) * (palette[n][c] - pixels[i][c]);
+
+				if(distance < best_distance)
+				{
+					best = n;
+					best_distance = distance;
+				}
+			}
+			color_indices |= static_cast<uint32_t>(best) << (2 * i);
+		}
+	}
+
+	block[8]  = static_cast<uint8_t>(color0);
+	block[9]  = static_cast<uint8_t>(color0 >> 8);
+	block[10] = static_cast<uint8_t>(color1);
+	block[11] = static_cast<uint8_t>(color1 >> 8);
+	for(int n = 0; n < 4; ++n)
+		block[12 + n] = static_cast<uint8_t>(color_indices >> (8 * n));
+}
+
+void shuffle_bytes_ssse3(uint8_t* dest, const uint8_t* source, std::size_t blocks, __m128i mask)
+{
+	auto dest128	= reinterpret_cast<__m128i*>(dest);
+	auto source128	= reinterpret_cast<const __m128i*>(source);
+
+	for(std::size_t n = 0; n < blocks; ++n)
+		_mm_storeu_si128(dest128 + n, _mm_shuffle_epi8(_mm_loadu_si128(source128 + n), mask));
+}
+
+void shuffle_bytes_scalar(uint8_t* dest, const uint8_t* source, std::size_t blocks, const uint8_t* mask)
+{
+	for(std::size_t n = 0; n < blocks; ++n, dest += 16, source += 16)
+	{
+		for(int i = 0; i < 16; ++i)
+			dest[i] = mask[i] & 0x80 ? 0 : source[mask[i] & 0x0F];
+	}
+}
+
+// a * b / 255 rounded, in 16 bit lanes of values up to 255.
+__m128i multiply_lanes(__m128i a, __m128i b)
+{
+	auto x = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// 255 - the alpha of each of the two pixels, in all four of its lanes.
+__m128i inverse_alpha_lanes(__m128i pixels16)
+{
+	auto alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+}
+
+void blend_over_row(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	std::size_t n = 0;
+
+	const __m128i zero = _mm_setzero_si128();
+	for(; n + 4 <= pixels; n += 4)
+	{
+		auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgra + n*4));
+		auto d = _mm_loadu_si128(reinterpret_cast<__m128i*>(dest + n*4));
+
+		auto lo = multiply_lanes(_mm_unpacklo_epi8(d, zero), inverse_alpha_lanes(_mm_unpacklo_epi8(s, zero)));
+		auto hi = multiply_lanes(_mm_unpackhi_epi8(d, zero), inverse_alpha_lanes(_mm_unpackhi_epi8(s, zero)));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n*4), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+	}
+
+	for(; n < pixels; ++n)
+	{
+		const int inverse = 255 - bgra[n*4+3];
+		for(int c = 0; c < 4; ++c)
+		{
+			const int x = dest[n*4+c] * inverse + 128;
+			dest[n*4+c] = static_cast<uint8_t>(std::min(255, bgra[n*4+c] + ((x + (x >> 8)) >> 8)));
+		}
+	}
+}
+
+void blend_add_row(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	std::size_t n = 0;
+
+	for(; n + 4 <= pixels; n += 4)
+	{
+		auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgra + n*4));
+		auto d = _mm_loadu_si128(reinterpret_cast<__m128i*>(dest + n*4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n*4), _mm_adds_epu8(s, d));
+	}
+
+	for(n *= 4; n < pixels*4; ++n)
+		dest[n] = static_cast<uint8_t>(std::min(255, dest[n] + bgra[n]));
+}
+
+void unpack_uyvy_row(const uint8_t* s, int width, uint8_t* y, uint8_t* cb, uint8_t* cr)
+{
+	int x = 0;
+
+	// 16 pixels at a time: the luma is in the odd bytes, the chroma in the even ones.
+	const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+	for(; x + 16 <= width; x += 16, s += 32)
+	{
+		auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+		auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+
+		auto luma	= _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		auto chroma	= _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(y + x), luma);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(cb + x/2), _mm_packus_epi16(_mm_and_si128(chroma, low_bytes), _mm_setzero_si128()));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(cr + x/2), _mm_packus_epi16(_mm_srli_epi16(chroma, 8), _mm_setzero_si128()));
+	}
+
+	for(; x + 1 < width; x += 2, s += 4)
+	{
+		cb[x/2]	= s[0];
+		y[x]	= s[1];
+		cr[x/2]	= s[2];
+		y[x+1]	= s[3];
+	}
+}
+
+void unpack_v210_row(const uint32_t* words, int width, uint16_t* y, uint16_t* cb, uint16_t* cr)
+{
+	uint16_t c[12];
+	for(int x = 0; x < width; x += 6, words += 4)
+	{
+		for(int n = 0; n < 4; ++n)
+		{
+			c[n*3+0] = static_cast<uint16_t>( words[n]        & 0x3FF);
+			c[n*3+1] = static_cast<uint16_t>((words[n] >> 10) & 0x3FF);
+			c[n*3+2] = static_cast<uint16_t>((words[n] >> 20) & 0x3FF);
+		}
+
+		// Cb0 Y0 Cr0 | Y1 Cb1 Y2 | Cr1 Y3 Cb2 | Y4 Cr2 Y5
+		static const int luma[]		= {1, 3, 5, 7, 9, 11};
+		static const int blue[]		= {0, 4, 8};
+		static const int red[]		= {2, 6, 10};
+		for(int n = 0; n < 6 && x + n < width; ++n)
+			y[x + n] = c[luma[n]];
+		for(int n = 0; n < 3 && x + n*2 < width; ++n)
+		{
+			cb[x/2 + n] = c[blue[n]];
+			cr[x/2 + n] = c[red[n]];
+		}
+	}
+}
+
+}
+
+void shuffle_bytes(void* dest, const void* source, std::size_t count, int m1, int m2, int m3, int m4)
+{
+	auto dest8		= reinterpret_cast<uint8_t*>(dest);
+	auto source8	= reinterpret_cast<const uint8_t*>(source);
+
+	const __m128i mask128 = _mm_set_epi32(m1, m2, m3, m4);
+
+	uint8_t mask[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(mask), mask128);
+
+	for_each_range(count / 16, 16, [&](std::size_t begin, std::size_t end)
+	{
+		if(g_has_ssse3)
+			shuffle_bytes_ssse3(dest8 + begin*16, source8 + begin*16, end - begin, mask128);
+		else
+			shuffle_bytes_scalar(dest8 + begin*16, source8 + begin*16, end - begin, mask);
+	});
+}
+
+void broadcast_alpha(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	shuffle_bytes(dest, bgra, pixels * 4, 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
+
+	for(std::size_t n = pixels & ~3; n < pixels; ++n)
+		dest[n*4+0] = dest[n*4+1] = dest[n*4+2] = dest[n*4+3] = bgra[n*4+3];
+}
+
+void extract_alpha(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	for_each_range(pixels / 16, 64, [&](std::size_t begin, std::size_t end)
+	{
+		auto s = bgra + begin*64;
+		auto d = dest + begin*16;
+
+		if(!g_has_ssse3)
+		{
+			for(std::size_t n = 0; n < (end - begin)*16; ++n)
+				d[n] = s[n*4+3];
+			return;
+		}
+
+		// The alphas of each 4 pixels go to one of the four 32 bit lanes.
+		const __m128i gather = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, 11, 7, 3);
+		for(std::size_t n = begin; n < end; ++n, s += 64, d += 16)
+		{
+			auto a0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s +  0)), gather);
+			auto a1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16)), gather);
+			auto a2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32)), gather);
+			auto a3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48)), gather);
+
+			auto a01 = _mm_unpacklo_epi32(a0, a1);
+			auto a23 = _mm_unpacklo_epi32(a2, a3);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_unpacklo_epi64(a01, a23));
+		}
+	});
+
+	for(std::size_t n = pixels & ~15; n < pixels; ++n)
+		dest[n] = bgra[n*4+3];
+}
+
+void blend_over(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	for_each_range(pixels, 4, [&](std::size_t begin, std::size_t end)
+	{
+		blend_over_row(dest + begin*4, bgra + begin*4, end - begin);
+	});
+}
+
+void blend_add(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	for_each_range(pixels, 4, [&](std::size_t begin, std::size_t end)
+	{
+		blend_add_row(dest + begin*4, bgra + begin*4, end - begin);
+	});
+}
+
+void unpack_uyvy(const uint8_t* src, int src_stride, int width, int height, uint8_t* y, uint8_t* cb, uint8_t* cr)
+{
+	for_each_range(height, width*2, [&](std::size_t begin, std::size_t end)
+	{
+		for(auto row = begin; row != end; ++row)
+			unpack_uyvy_row(src + row*src_stride, width, y + row*width, cb + row*(width/2), cr + row*(width/2));
+	});
+}
+
+void unpack_v210(
+		const uint8_t* src, int src_stride, int width, int height,
+		uint16_t* y, int y_stride, uint16_t* cb, int cb_stride, uint16_t* cr, int cr_stride)
+{
+	auto y8		= reinterpret_cast<uint8_t*>(y);
+	auto cb8	= reinterpret_cast<uint8_t*>(cb);
+	auto cr8	= reinterpret_cast<uint8_t*>(cr);
+
+	for_each_range(height, src_stride, [&](std::size_t begin, std::size_t end)
+	{
+		for(auto row = begin; row != end; ++row)
+		{
+			unpack_v210_row(
+					reinterpret_cast<const uint32_t*>(src + row*src_stride),
+					width,
+					reinterpret_cast<uint16_t*>(y8  + row*y_stride),
+					reinterpret_cast<uint16_t*>(cb8 + row*cb_stride),
+					reinterpret_cast<uint16_t*>(cr8 + row*cr_stride));
+		}
+	});
+}
+
+void encode_dxt5(uint8_t* dest, const uint8_t* bgra, int stride, int width, int height)
+{
+	const int blocks_x = (width + 3) / 4;
+
+	for_each_range((height + 3) / 4, std::abs(stride) * 4, [&](std::size_t begin, std::size_t end)
+	{
+		for(auto block_row = static_cast<int>(begin); block_row != static_cast<int>(end); ++block_row)
+		{
+			auto block = dest + block_row * blocks_x * 16;
+			for(int x = 0; x < width; x += 4, block += 16)
+			{
+				// Edges are repeated into partial blocks.
+				uint8_t pixels[16][4];
+				for(int by = 0; by < 4; ++by)
+				{
+					const auto row = bgra + static_cast<std::ptrdiff_t>(std::min(block_row * 4 + by, height - 1)) * stride;
+					for(int bx = 0; bx < 4; ++bx)
+						std::memcpy(pixels[by * 4 + bx], row + std::min(x + bx, width - 1) * 4, 4);
+				}
+				encode_dxt5_block(pixels, block);
+			}
+		}
+	});
+}
+
+}
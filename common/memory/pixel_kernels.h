@@ -0,0 +1,63 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace caspar {
+
+// Per-pixel work done on the cpu, each with a SIMD implementation picked at
+// runtime and a scalar one for older cpus. Large images are split across the
+// tbb worker threads.
+
+// Shuffles every 16 bytes as _mm_shuffle_epi8 does, with the mask given the way
+// _mm_set_epi32 takes it. count has to be a multiple of 16.
+void shuffle_bytes(void* dest, const void* source, std::size_t count, int m1, int m2, int m3, int m4);
+
+// Writes the alpha of every BGRA pixel to all four of its bytes, for key output.
+void broadcast_alpha(uint8_t* dest, const uint8_t* bgra, std::size_t pixels);
+
+// Writes the alpha of every BGRA pixel to a plane of one byte per pixel.
+void extract_alpha(uint8_t* dest, const uint8_t* bgra, std::size_t pixels);
+
+// Composites premultiplied BGRA pixels over dest, dest = source + dest * (1 - source alpha).
+void blend_over(uint8_t* dest, const uint8_t* bgra, std::size_t pixels);
+
+// Adds premultiplied BGRA pixels to dest, saturating.
+void blend_add(uint8_t* dest, const uint8_t* bgra, std::size_t pixels);
+
+// Splits UYVY rows into the planes of a 4:2:2 picture, width bytes of Y and
+// width / 2 bytes of Cb and Cr per row.
+void unpack_uyvy(const uint8_t* src, int src_stride, int width, int height, uint8_t* y, uint8_t* cb, uint8_t* cr);
+
+// Encodes premultiplied BGRA into DXT5 blocks, top row first. The stride is in
+// bytes and negative for images stored bottom row first, with bgra at the top row.
+void encode_dxt5(uint8_t* dest, const uint8_t* bgra, int stride, int width, int height);
+
+// Unpacks v210 rows into the 16 bit planes of a 4:2:2 picture. The strides
+// are in bytes.
+void unpack_v210(
+		const uint8_t* src, int src_stride, int width, int height,
+		uint16_t* y, int y_stride, uint16_t* cb, int cb_stride, uint16_t* cr, int cr_stride);
+
+}
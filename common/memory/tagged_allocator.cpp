@@ -0,0 +1,92 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "tagged_allocator.h"
+
+#include "../utility/string.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <sstream>
+
+namespace caspar {
+
+namespace {
+
+const char* subsystem_names[allocation_subsystem::count] = { "producer", "mixer", "consumer", "protocol" };
+
+__declspec(align(64)) allocation_counters g_counters[allocation_subsystem::count];
+
+}
+
+allocation_counters& get_allocation_counters(allocation_subsystem::type subsystem)
+{
+	return g_counters[subsystem];
+}
+
+boost::property_tree::wptree get_allocation_info()
+{
+	boost::property_tree::wptree info;
+
+	for(int n = 0; n < allocation_subsystem::count; ++n)
+	{
+		auto& counters = g_counters[n];
+
+		boost::property_tree::wptree subsystem;
+		subsystem.add(L"name",				widen(std::string(subsystem_names[n])));
+		subsystem.add(L"allocations",		counters.allocations);
+		subsystem.add(L"deallocations",		counters.deallocations);
+		subsystem.add(L"allocated-mb",		counters.allocated_bytes / (1024 * 1024));
+		subsystem.add(L"live-kb",			counters.live_bytes / 1024);
+		info.add_child(L"subsystem", subsystem);
+	}
+
+	return info;
+}
+
+std::string print_allocation_metrics()
+{
+	std::ostringstream allocations;
+	std::ostringstream bytes;
+	std::ostringstream live;
+
+	allocations	<< "# HELP caspar_allocations_total Number of allocations by the containers of a subsystem.\n"
+				<< "# TYPE caspar_allocations_total counter\n";
+	bytes		<< "# HELP caspar_allocated_bytes_total Bytes allocated by the containers of a subsystem.\n"
+				<< "# TYPE caspar_allocated_bytes_total counter\n";
+	live		<< "# HELP caspar_allocated_bytes Bytes currently held by the containers of a subsystem.\n"
+				<< "# TYPE caspar_allocated_bytes gauge\n";
+
+	for(int n = 0; n < allocation_subsystem::count; ++n)
+	{
+		auto label = std::string("{subsystem=\"") + subsystem_names[n] + "\"} ";
+
+		allocations	<< "caspar_allocations_total" << label << g_counters[n].allocations << "\n";
+		bytes		<< "caspar_allocated_bytes_total" << label << g_counters[n].allocated_bytes << "\n";
+		live		<< "caspar_allocated_bytes" << label << g_counters[n].live_bytes << "\n";
+	}
+
+	return allocations.str() + bytes.str() + live.str();
+}
+
+}
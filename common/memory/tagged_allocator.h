@@ -0,0 +1,132 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/scalable_allocator.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace caspar {
+
+// The parts of the server whose allocations are counted apart, see tagged_allocator.
+struct allocation_subsystem
+{
+	enum type
+	{
+		producer = 0,
+		mixer,
+		consumer,
+		protocol,
+		count
+	};
+};
+
+// A cache line of its own for each subsystem, so that the subsystems do not contend on the counters.
+struct allocation_counters
+{
+	tbb::atomic<int64_t> allocations;
+	tbb::atomic<int64_t> deallocations;
+	tbb::atomic<int64_t> allocated_bytes;
+	tbb::atomic<int64_t> live_bytes;
+	char				 padding[64 - 4 * sizeof(int64_t)];
+};
+
+allocation_counters& get_allocation_counters(allocation_subsystem::type subsystem);
+
+// Per subsystem, the allocations and bytes since startup and the bytes currently held.
+boost::property_tree::wptree get_allocation_info();
+
+// The counters in the Prometheus text format, see diagnostics::print_metrics.
+std::string print_allocation_metrics();
+
+// Counts the allocations of a container against a subsystem. The memory comes from the base allocator, the tbb 
+// scalable allocator unless the container needs another, e.g. tbb::cache_aligned_allocator for buffers processed
+// with simd.
+template<typename T, allocation_subsystem::type Subsystem, typename Base = tbb::scalable_allocator<T>>
+class tagged_allocator : public Base
+{
+public:
+	typedef typename Base::size_type	size_type;
+	typedef typename Base::pointer		pointer;
+
+	template<typename U>
+	struct rebind
+	{
+		typedef tagged_allocator<U, Subsystem, typename Base::template rebind<U>::other> other;
+	};
+
+	tagged_allocator()
+	{
+	}
+
+	tagged_allocator(const tagged_allocator& other)
+		: Base(other)
+	{
+	}
+
+	template<typename U, typename B>
+	tagged_allocator(const tagged_allocator<U, Subsystem, B>& other)
+		: Base(other)
+	{
+	}
+
+	pointer allocate(size_type n, const void* hint = 0)
+	{
+		auto p = Base::allocate(n, hint);
+
+		auto& counters = get_allocation_counters(Subsystem);
+		++counters.allocations;
+		counters.allocated_bytes	+= static_cast<int64_t>(n * sizeof(T));
+		counters.live_bytes			+= static_cast<int64_t>(n * sizeof(T));
+
+		return p;
+	}
+
+	void deallocate(pointer p, size_type n)
+	{
+		Base::deallocate(p, n);
+
+		auto& counters = get_allocation_counters(Subsystem);
+		++counters.deallocations;
+		counters.live_bytes -= static_cast<int64_t>(n * sizeof(T));
+	}
+};
+
+template<typename T, typename U, allocation_subsystem::type Subsystem, typename B1, typename B2>
+bool operator==(const tagged_allocator<T, Subsystem, B1>&, const tagged_allocator<U, Subsystem, B2>&)
+{
+	return true;
+}
+
+template<typename T, typename U, allocation_subsystem::type Subsystem, typename B1, typename B2>
+bool operator!=(const tagged_allocator<T, Subsystem, B1>&, const tagged_allocator<U, Subsystem, B2>&)
+{
+	return false;
+}
+
+}
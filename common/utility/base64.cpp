@@ -26,8 +26,9 @@
 #include <vector>
 #include <algorithm>
 
-#include <boost/archive/iterators/insert_linebreaks.hpp>
-#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <intrin.h>
+#include <tmmintrin.h>
+
 #include <boost/archive/iterators/binary_from_base64.hpp>
 #include <boost/archive/iterators/transform_width.hpp>
 #include <boost/archive/iterators/remove_whitespace.hpp>
@@ -39,40 +40,138 @@
 
 namespace caspar {
 
-std::string to_base64(const char* data, uint32_t length)
+namespace {
+
+const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Line breaks are inserted every 76 characters, which is 57 bytes of input.
+const std::size_t LINE_CHARS	= 76;
+const std::size_t LINE_BYTES	= LINE_CHARS / 4 * 3;
+
+bool detect_ssse3()
 {
-	using namespace boost::archive::iterators;
-
-	// From http://www.webbiscuit.co.uk/2012/04/02/base64-encoder-and-boost/
-		
-	typedef
-		insert_linebreaks<         // insert line breaks every 76 characters
-			base64_from_binary<    // convert binary values to base64 characters
-				transform_width<   // retrieve 6 bit integers from a sequence of 8 bit bytes
-					const unsigned char *,
-					6,
-					8
-				>
-			>,
-			76
-		>
-        base64_iterator; // compose all the above operations in to a new iterator
-	std::vector<char> bytes;
-	bytes.resize(length);
-	std::memcpy(bytes.data(), data, length);
+	int info[4];
+	__cpuid(info, 1);
 
-	int padding = 0;
+	return (info[2] & (1 << 9)) != 0;
+}
 
-	while (bytes.size() % 3 != 0)
+const bool g_has_ssse3 = detect_ssse3();
+
+void encode_scalar(char* dest, const unsigned char* source, std::size_t triplets)
+{
+	for (std::size_t n = 0; n < triplets; ++n, source += 3, dest += 4)
 	{
-		++padding;
-		bytes.push_back(0x00);
+		uint32_t bits = (source[0] << 16) | (source[1] << 8) | source[2];
+
+		dest[0] = BASE64_CHARS[(bits >> 18) & 0x3F];
+		dest[1] = BASE64_CHARS[(bits >> 12) & 0x3F];
+		dest[2] = BASE64_CHARS[(bits >> 6) & 0x3F];
+		dest[3] = BASE64_CHARS[bits & 0x3F];
 	}
+}
 
-	std::string result(
-			base64_iterator(bytes.data()),
-			base64_iterator(bytes.data() + length));
-	result.insert(result.end(), padding, '=');
+// Encodes 12 bytes to 16 characters per block, as described by Wojciech Mula
+// in http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html. Reads 4
+// bytes past the last block.
+void encode_ssse3(char* dest, const unsigned char* source, std::size_t blocks)
+{
+	const __m128i shuffle	= _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i offsets	= _mm_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	for (std::size_t n = 0; n < blocks; ++n, source += 12, dest += 16)
+	{
+		auto input = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source)), shuffle);
+
+		// Moves each 6 bit group to a byte of its own.
+		auto high	= _mm_mulhi_epu16(_mm_and_si128(input, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+		auto low	= _mm_mullo_epi16(_mm_and_si128(input, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+		auto values	= _mm_or_si128(high, low);
+
+		// Picks the offset from the value to its character: 0 for a-z, 1-10
+		// for 0-9, 11 for +, 12 for / and 13 for A-Z.
+		auto range	= _mm_subs_epu8(values, _mm_set1_epi8(51));
+		range		= _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values), _mm_set1_epi8(13)));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_add_epi8(values, _mm_shuffle_epi8(offsets, range)));
+	}
+}
+
+void encode_line(char* dest, const unsigned char* source)
+{
+	if (g_has_ssse3)
+	{
+		// The last block reads up to byte 52 of the 57.
+		encode_ssse3(dest, source, 4);
+		encode_scalar(dest + 64, source + 48, 3);
+	}
+	else
+		encode_scalar(dest, source, LINE_CHARS / 4);
+}
+
+// Encodes less than a line, padding the last group.
+std::size_t encode_tail(char* dest, const unsigned char* source, std::size_t length)
+{
+	auto triplets = length / 3;
+	encode_scalar(dest, source, triplets);
+
+	auto remaining	= length % 3;
+	auto chars		= triplets * 4;
+
+	if (remaining > 0)
+	{
+		unsigned char last[3] = { source[triplets * 3], 0, 0 };
+
+		if (remaining > 1)
+			last[1] = source[triplets * 3 + 1];
+
+		encode_scalar(dest + chars, last, 1);
+		dest[chars + 3] = '=';
+
+		if (remaining == 1)
+			dest[chars + 2] = '=';
+
+		chars += 4;
+	}
+
+	return chars;
+}
+
+void encode(std::string& result, const char* data, std::size_t length)
+{
+	auto source = reinterpret_cast<const unsigned char*>(data);
+	auto lines	= length / LINE_BYTES;
+	auto tail	= length % LINE_BYTES;
+	auto chars	= (length + 2) / 3 * 4;
+
+	result.reserve(result.size() + chars + chars / (LINE_CHARS + 1));
+
+	// Encoded on the stack and appended a line at a time, behind the line
+	// break of the previous one.
+	char line[LINE_CHARS + 1];
+	line[0] = '\n';
+
+	for (std::size_t n = 0; n < lines; ++n, source += LINE_BYTES)
+	{
+		encode_line(line + 1, source);
+		result.append(line + (n == 0 ? 1 : 0), line + LINE_CHARS + 1);
+	}
+
+	if (tail > 0)
+	{
+		auto tail_chars = encode_tail(line + 1, source, tail);
+		result.append(line + (lines == 0 ? 1 : 0), line + tail_chars + 1);
+	}
+}
+
+}
+
+std::string to_base64(const char* data, uint32_t length)
+{
+	std::string result;
+	encode(result, data, length);
 
 	CASPAR_VERIFY((result.length() - result.length() / 77) % 4 == 0);
 
@@ -26,65 +26,138 @@
 #include <windows.h>
 #include <Mmsystem.h>
 
+#include <boost/noncopyable.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
 namespace caspar {
-	
-class high_prec_timer
+
+// Paces a thread at a given interval. The thread sleeps on a waitable timer until shortly before the deadline and 
+// spins the rest on QueryPerformanceCounter. Deadlines follow from the previous deadline rather than from when the 
+// previous tick returned, so that wake up latency does not add up over the frames.
+class high_prec_timer : boost::noncopyable
 {
 public:
 	high_prec_timer()
 		: time_(0)
+		, timer_(::CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS))
+		, spin_ticks_(0)
+	{
+		LARGE_INTEGER frequency;
+		::QueryPerformanceFrequency(&frequency);
+		frequency_ = frequency.QuadPart;
+
+		// Without high resolution timers (before Windows 10 1803) the timer fires at the system timer resolution.
+		double spin = 0.001;
+		if(!timer_)
+		{
+			timer_ = ::CreateWaitableTimer(nullptr, TRUE, nullptr);
+			spin = 0.002;
+		}
+		spin_ticks_ = static_cast<int64_t>(spin * frequency_);
+	}
+
+	~high_prec_timer()
 	{
+		if(timer_)
+			::CloseHandle(timer_);
 	}
 
-	// Author: Ryan M. Geiss
-	// http://www.geisswerks.com/ryan/FAQS/timing.html
+	// Waits until interval seconds after the previous tick. 0 restarts the measurement from now.
 	void tick(double interval)
 	{
-		tick_millis(static_cast<DWORD>(interval * 1000.0));
+		auto now = counter();
+
+		if(time_ == 0 || interval <= 0.0)
+		{
+			time_ = now;
+			return;
+		}
+
+		auto interval_ticks = static_cast<int64_t>(interval * frequency_);
+		auto target			= time_ + interval_ticks;
+
+		// Late by more than a fraction of the interval, the caller was busy rather than the timer, so the 
+		// schedule starts over instead of catching up with shorter intervals.
+		if(now - target > interval_ticks / 4)
+		{
+			time_ = now;
+			return;
+		}
+
+		wait_until(target);
+		time_ = target;
 	}
 
 	void tick_millis(DWORD ticks_to_wait)
 	{
-		auto t = ::timeGetTime();
+		tick(ticks_to_wait / 1000.0);
+	}
+
+	// Waits for the next multiple of interval on the performance counter. Every timer ticking at the same interval 
+	// is in phase with the others, across channels and processes, without any of them driving the rest.
+	void tick_aligned(double interval)
+	{
+		if(interval <= 0.0)
+			return;
 
-		if (time_ != 0)
+		auto now			= counter();
+		auto interval_ticks = interval * frequency_;
+		auto next			= std::floor(static_cast<double>(now) / interval_ticks) + 1.0;
+
+		// One interval after the previous tick. Just behind it the tick returns at once and stays on that 
+		// boundary, further behind it skips ahead to the next one.
+		if(time_ != 0)
 		{
-			bool done = 0;
-			do
-			{
-				auto ticks_passed = t - time_;
-				auto ticks_left	  = ticks_to_wait - ticks_passed;
-
-				if (t < time_)    // time wrap
-					done = 1;
-				if (ticks_passed >= ticks_to_wait)
-					done = 1;
-
-				if (!done)
-				{
-					// if > 0.002s left, do Sleep(1), which will actually sleep some
-					//   steady amount, probably 1-2 ms,
-					//   and do so in a nice way (cpu meter drops; laptop battery spared).
-					// otherwise, do a few Sleep(0)'s, which just give up the timeslice,
-					//   but don't really save cpu or battery, but do pass a tiny
-					//   amount of time.
-					if (ticks_left > 2)
-						Sleep(1);
-					else
-						for (int i = 0; i < 10; ++i)
-							Sleep(0);  // causes thread to give up its timeslice
-				}
-
-				t = ::timeGetTime();
-			}
-			while (!done);
+			auto expected = std::floor(static_cast<double>(time_) / interval_ticks + 0.5) + 1.0;
+			if(expected >= next || (expected == next - 1.0 && now - expected * interval_ticks < interval_ticks / 4))
+				next = expected;
 		}
 
-		time_ = t;
+		auto target = static_cast<int64_t>(next * interval_ticks);
+		wait_until(target);
+		time_ = target;
 	}
-private:	
-	DWORD time_;
-};
 
+	// Waits the given number of seconds from now, without touching the schedule of tick.
+	void wait_for(double seconds)
+	{
+		if(seconds > 0.0)
+			wait_until(counter() + static_cast<int64_t>(seconds * frequency_));
+	}
+private:
+	int64_t counter() const
+	{
+		LARGE_INTEGER value;
+		::QueryPerformanceCounter(&value);
+		return value.QuadPart;
+	}
+
+	void wait_until(int64_t target)
+	{
+		auto remaining = target - counter();
+
+		if(timer_ && remaining > spin_ticks_)
+		{
+			LARGE_INTEGER due;
+			due.QuadPart = -static_cast<LONGLONG>((remaining - spin_ticks_) * 10000000 / frequency_); // Relative, in 100 ns units.
+			if(::SetWaitableTimer(timer_, &due, 0, nullptr, nullptr, FALSE))
+				::WaitForSingleObject(timer_, INFINITE);
+		}
+
+		while(counter() < target)
+			YieldProcessor();
+	}
+
+	int64_t	time_;
+	int64_t	frequency_;
+	HANDLE	timer_;
+	int64_t	spin_ticks_;
+};
 
-}
\ No newline at end of file
+}
@@ -46,10 +46,14 @@
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <tbb/spin_mutex.h>
+
 #include <unordered_map>
 #include <string>
 #include <locale>
 #include <functional>
+#include <map>
+#include <memory>
 #include <vector>
 
 namespace caspar {
@@ -377,14 +381,15 @@ double ease_out_in_bounce (double t, double b, double c, double d, const std::ve
 	return ease_in_bounce((t*2)-d, b+c/2, c/2, d, params);
 }
 
-tweener_t get_tweener(std::wstring name)
+typedef double (*tween_func)(double, double, double, double, const std::vector<double>&);
+
+// Looks the tween up by name, with its optional parameters. Unknown names are linear.
+tween_func resolve_tween(std::wstring name, std::vector<double>& params)
 {
 	std::transform(name.begin(), name.end(), name.begin(), std::tolower);
 
 	if(name == L"linear")
-		return [](double t, double b, double c, double d){return ease_none(t, b, c, d, std::vector<double>());};
-	
-	std::vector<double> params;
+		return ease_none;
 	
 	static const boost::wregex expr(L"(?<NAME>\\w*)(:(?<V0>\\d+\\.?\\d?))?(:(?<V1>\\d+\\.?\\d?))?"); // boost::regex has no repeated captures?
 	boost::wsmatch what;
@@ -397,8 +402,7 @@ tweener_t get_tweener(std::wstring name)
 			params.push_back(boost::lexical_cast<double>(what["V1"].str()));
 	}
 		
-	typedef std::function<double(double, double, double, double, const std::vector<double>&)> tween_t;	
-	static const std::unordered_map<std::wstring, tween_t> tweens = boost::assign::map_list_of	
+	static const std::unordered_map<std::wstring, tween_func> tweens = boost::assign::map_list_of	
 		(L"",					ease_none		   )	
 		(L"linear",				ease_none		   )	
 		(L"easenone",			ease_none		   )
@@ -445,12 +449,89 @@ tweener_t get_tweener(std::wstring name)
 
 	auto it = tweens.find(name);
 	if(it == tweens.end())
-		it = tweens.find(L"linear");
+		return ease_none;
 	
+	return it->second;
+}
+
+tweener_t get_tweener(std::wstring name)
+{
+	std::vector<double> params;
+	auto func = resolve_tween(name, params);
+
+	if(func == ease_none)
+		return [](double t, double b, double c, double d){return ease_none(t, b, c, d, std::vector<double>());};
+
 	return [=](double t, double b, double c, double d)
 	{
-		return it->second(t, b, c, d, params);
+		return func(t, b, c, d, params);
 	};
 };
 
+namespace {
+
+const int MAX_CURVE_DURATION = 8192;
+
+// Curves are shared by the animations running with the same tween and duration, as long as one of them lives.
+class tween_curve_cache
+{
+	tbb::spin_mutex mutex_;
+	std::map<std::pair<std::wstring, int>, std::weak_ptr<const std::vector<double>>> curves_;
+public:
+	std::shared_ptr<const std::vector<double>> get(const std::wstring& name, int duration)
+	{
+		auto key = std::make_pair(name, duration);
+
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			auto it = curves_.find(key);
+			if(it != curves_.end())
+			{
+				auto curve = it->second.lock();
+				if(curve)
+					return curve;
+			}
+		}
+
+		std::vector<double> params;
+		auto func = resolve_tween(name, params);
+
+		// With an amplitude the elastic tweens depend on the distance travelled, not only on the time.
+		bool elastic = func == ease_in_elastic || func == ease_out_elastic || func == ease_in_out_elastic || func == ease_out_in_elastic;
+		if(elastic && params.size() > 1)
+			return nullptr;
+
+		auto curve = std::make_shared<std::vector<double>>(duration + 1);
+		for(int n = 0; n <= duration; ++n)
+			(*curve)[n] = func(static_cast<double>(n), 0.0, 1.0, static_cast<double>(duration), params);
+
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		for(auto it = curves_.begin(); it != curves_.end();)
+		{
+			if(it->second.expired())
+				it = curves_.erase(it);
+			else
+				++it;
+		}
+
+		curves_[key] = curve;
+
+		return curve;
+	}
+};
+
+}
+
+std::shared_ptr<const std::vector<double>> get_tween_curve(std::wstring name, int duration)
+{
+	if(duration <= 0 || duration > MAX_CURVE_DURATION)
+		return nullptr;
+
+	std::transform(name.begin(), name.end(), name.begin(), std::tolower);
+
+	static tween_curve_cache cache;
+	return cache.get(name, duration);
+}
+
 }
\ No newline at end of file
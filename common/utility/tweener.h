@@ -22,10 +22,18 @@
 #pragma once
 
 #include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace caspar {
 
 typedef std::function<double(double, double, double, double)> tweener_t;
 tweener_t get_tweener(std::wstring name = L"linear");
 
+// The progress of the tween at each frame of the duration, from 0.0 to duration inclusive, so that a value tweens to 
+// source + (dest - source) * curve[frame]. Null for durations above 8192 frames, and for elastic tweens with an 
+// amplitude, which do not scale with the distance. Shared between the callers asking for the same curve.
+std::shared_ptr<const std::vector<double>> get_tween_curve(std::wstring name, int duration);
+
 }
\ No newline at end of file
@@ -0,0 +1,387 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "stdafx.h"
+
+#include "channel_state.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstdint>
+
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <common/exception/exceptions.h>
+#include <common/exception/win32_exception.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include "video_channel.h"
+#include "parameters/parameters.h"
+#include "producer/stage.h"
+#include "producer/frame_producer.h"
+#include "producer/frame/frame_transform.h"
+#include "mixer/mixer.h"
+
+namespace caspar { namespace core {
+
+namespace {
+
+int64_t now_millis()
+{
+	boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+	return (boost::posix_time::microsec_clock::universal_time() - epoch).total_milliseconds();
+}
+
+void write_pair(boost::property_tree::wptree& pt, const std::wstring& key, const boost::array<double, 2>& value)
+{
+	pt.add(key + L".x", value[0]);
+	pt.add(key + L".y", value[1]);
+}
+
+void read_pair(const boost::property_tree::wptree& pt, const std::wstring& key, boost::array<double, 2>& value)
+{
+	value[0] = pt.get(key + L".x", value[0]);
+	value[1] = pt.get(key + L".y", value[1]);
+}
+
+boost::property_tree::wptree write_transform(const frame_transform& transform)
+{
+	boost::property_tree::wptree pt;
+	pt.add(L"volume",				transform.volume);
+	pt.add(L"opacity",				transform.opacity);
+	pt.add(L"contrast",				transform.contrast);
+	pt.add(L"brightness",			transform.brightness);
+	pt.add(L"saturation",			transform.saturation);
+	write_pair(pt, L"fill-translation",	transform.fill_translation);
+	write_pair(pt, L"fill-scale",		transform.fill_scale);
+	write_pair(pt, L"clip-translation",	transform.clip_translation);
+	write_pair(pt, L"clip-scale",		transform.clip_scale);
+	pt.add(L"levels.min-input",		transform.levels.min_input);
+	pt.add(L"levels.max-input",		transform.levels.max_input);
+	pt.add(L"levels.gamma",			transform.levels.gamma);
+	pt.add(L"levels.min-output",	transform.levels.min_output);
+	pt.add(L"levels.max-output",	transform.levels.max_output);
+	pt.add(L"is-key",				transform.is_key);
+	return pt;
+}
+
+frame_transform read_transform(const boost::property_tree::wptree& pt)
+{
+	frame_transform transform;
+	transform.volume				= pt.get(L"volume",				transform.volume);
+	transform.opacity				= pt.get(L"opacity",			transform.opacity);
+	transform.contrast				= pt.get(L"contrast",			transform.contrast);
+	transform.brightness			= pt.get(L"brightness",			transform.brightness);
+	transform.saturation			= pt.get(L"saturation",			transform.saturation);
+	read_pair(pt, L"fill-translation",	transform.fill_translation);
+	read_pair(pt, L"fill-scale",		transform.fill_scale);
+	read_pair(pt, L"clip-translation",	transform.clip_translation);
+	read_pair(pt, L"clip-scale",		transform.clip_scale);
+	transform.levels.min_input		= pt.get(L"levels.min-input",	transform.levels.min_input);
+	transform.levels.max_input		= pt.get(L"levels.max-input",	transform.levels.max_input);
+	transform.levels.gamma			= pt.get(L"levels.gamma",		transform.levels.gamma);
+	transform.levels.min_output		= pt.get(L"levels.min-output",	transform.levels.min_output);
+	transform.levels.max_output		= pt.get(L"levels.max-output",	transform.levels.max_output);
+	transform.is_key				= pt.get(L"is-key",				transform.is_key);
+	return transform;
+}
+
+// The file is written as UTF-8 whatever the locale, since the parameters can
+// contain any file name.
+void write_state(const std::wstring& state_file, const boost::property_tree::wptree& state)
+{
+	std::wstringstream stream;
+	boost::property_tree::xml_writer_settings<wchar_t> settings(' ', 2);
+	boost::property_tree::xml_parser::write_xml(stream, state, settings);
+
+	auto temp_file = state_file + L".tmp";
+
+	{
+		std::ofstream out(temp_file.c_str(), std::ios::binary | std::ios::trunc);
+		out << narrow(stream.str());
+		out.flush();
+
+		if (!out)
+			BOOST_THROW_EXCEPTION(file_write_error() << msg_info(narrow(L"Failed to write " + temp_file)));
+	}
+
+	boost::filesystem::wpath target(state_file);
+
+	if (boost::filesystem::exists(target))
+		boost::filesystem::remove(target);
+
+	boost::filesystem::rename(boost::filesystem::wpath(temp_file), target);
+}
+
+boost::property_tree::wptree read_state(const std::wstring& state_file)
+{
+	std::ifstream in(state_file.c_str(), std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	std::wstringstream stream;
+	stream << widen(content);
+
+	boost::property_tree::wptree state;
+	boost::property_tree::xml_parser::read_xml(stream, state, boost::property_tree::xml_parser::trim_whitespace | boost::property_tree::xml_parser::no_comments);
+	return state;
+}
+
+}
+
+struct channel_state_store::implementation : boost::noncopyable
+{
+	const std::vector<safe_ptr<video_channel>>	channels_;
+	const std::wstring							state_file_;
+	const int									save_interval_millis_;
+
+	boost::mutex								mutex_;
+	boost::condition_variable					stopped_;
+	bool										running_;
+	boost::thread								saver_;
+
+	implementation(const std::vector<safe_ptr<video_channel>>& channels, const std::wstring& state_file, int save_interval_millis)
+		: channels_(channels)
+		, state_file_(state_file)
+		, save_interval_millis_(save_interval_millis)
+		, running_(true)
+	{
+		try
+		{
+			restore();
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << L"Failed to restore the channels from " << state_file_;
+		}
+
+		saver_ = boost::thread([this] { run_saver(); });
+	}
+
+	~implementation()
+	{
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			running_ = false;
+		}
+
+		stopped_.notify_all();
+		saver_.join();
+	}
+
+	void run_saver()
+	{
+		win32_exception::ensure_handler_installed_for_thread("channel-state-saver");
+
+		boost::mutex::scoped_lock lock(mutex_);
+
+		while (running_)
+		{
+			stopped_.timed_wait(lock, boost::posix_time::milliseconds(save_interval_millis_), [this] { return !running_; });
+
+			if (!running_)
+				break;
+
+			lock.unlock();
+
+			try
+			{
+				write_state(state_file_, capture());
+			}
+			catch (...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			lock.lock();
+		}
+	}
+
+	boost::property_tree::wptree capture() const
+	{
+		boost::property_tree::wptree state;
+		auto& xml_state = state.add_child(L"channel-state", boost::property_tree::wptree());
+		xml_state.add(L"saved-at", now_millis());
+
+		BOOST_FOREACH(auto& channel, channels_)
+		{
+			auto& xml_channel = xml_state.add_child(L"channel", boost::property_tree::wptree());
+			xml_channel.add(L"index", channel->index());
+
+			auto info = channel->stage()->info().get();
+			auto layers = info.get_child_optional(L"layers");
+			if (!layers)
+				continue;
+
+			BOOST_FOREACH(auto& xml_layer_info, *layers)
+			{
+				auto& layer_info = xml_layer_info.second;
+				auto params = layer_info.get_child_optional(L"foreground.producer.creation-params");
+				if (!params)
+					continue;
+
+				int index = layer_info.get<int>(L"index");
+				auto& producer_info = layer_info.get_child(L"foreground.producer");
+
+				auto& xml_layer = xml_channel.add_child(L"layer", boost::property_tree::wptree());
+				xml_layer.add(L"index", index);
+				xml_layer.add(L"paused", layer_info.get(L"status", L"") == L"paused");
+				xml_layer.add_child(L"params", *params);
+
+				auto file_frame_number = producer_info.get_optional<int64_t>(L"file-frame-number");
+				if (file_frame_number)
+				{
+					xml_layer.add(L"file-frame-number", *file_frame_number);
+					xml_layer.add(L"file-nb-frames", producer_info.get(L"file-nb-frames", -1));
+					xml_layer.add(L"fps", producer_info.get(L"fps", channel->get_video_format_desc().fps));
+					xml_layer.add(L"loop", producer_info.get(L"loop", false));
+				}
+
+				xml_layer.add_child(L"transform", write_transform(channel->stage()->get_current_transform(index)));
+			}
+		}
+
+		return state;
+	}
+
+	void restore()
+	{
+		if (!boost::filesystem::exists(boost::filesystem::wpath(state_file_)))
+			return;
+
+		auto state = read_state(state_file_);
+		auto xml_state = state.get_child(L"channel-state");
+		auto saved_at = xml_state.get(L"saved-at", now_millis());
+
+		boost::thread_group restorers;
+
+		BOOST_FOREACH(auto& xml_channel, xml_state)
+		{
+			if (xml_channel.first != L"channel")
+				continue;
+
+			auto index = xml_channel.second.get(L"index", 0);
+			auto channel = std::find_if(channels_.begin(), channels_.end(), [=](const safe_ptr<video_channel>& channel)
+			{
+				return channel->index() == index;
+			});
+
+			if (channel == channels_.end())
+				continue;
+
+			BOOST_FOREACH(auto& xml_layer, xml_channel.second)
+			{
+				if (xml_layer.first != L"layer")
+					continue;
+
+				auto target = *channel;
+				auto layer = xml_layer.second;
+
+				restorers.create_thread([=]
+				{
+					win32_exception::ensure_handler_installed_for_thread("channel-state-restorer");
+
+					try
+					{
+						restore_layer(target, layer, saved_at);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+					}
+				});
+			}
+		}
+
+		restorers.join_all();
+	}
+
+	static void restore_layer(const safe_ptr<video_channel>& channel, const boost::property_tree::wptree& layer, int64_t saved_at)
+	{
+		std::vector<std::wstring> original_params;
+		BOOST_FOREACH(auto& param, layer.get_child(L"params"))
+			original_params.push_back(param.second.data());
+
+		parameters params(original_params);
+		params.to_upper();
+
+		auto index		= layer.get<int>(L"index");
+		auto paused		= layer.get(L"paused", false);
+		auto producer	= create_producer(channel->mixer(), params);
+
+		auto file_frame_number = layer.get_optional<int64_t>(L"file-frame-number");
+		if (file_frame_number)
+		{
+			auto nb_frames	= layer.get(L"file-nb-frames", -1ll);
+			auto fps		= layer.get(L"fps", channel->get_video_format_desc().fps);
+			auto frame		= *file_frame_number;
+
+			// Where the layer would have been had the server kept running.
+			if (!paused)
+				frame += static_cast<int64_t>((now_millis() - saved_at) * fps / 1000.0);
+
+			if (nb_frames > 0 && frame >= nb_frames)
+				frame = layer.get(L"loop", false) ? frame % nb_frames : nb_frames - 1;
+
+			try
+			{
+				producer->call(L"SEEK " + boost::lexical_cast<std::wstring>(frame)).get();
+			}
+			catch (...)
+			{
+				CASPAR_LOG(warning) << producer->print() << L" Could not be seeked to frame " << frame << L".";
+			}
+		}
+
+		auto transform = read_transform(layer.get_child(L"transform", boost::property_tree::wptree()));
+		channel->stage()->apply_transform(index, [=](frame_transform) { return transform; });
+
+		channel->stage()->load(index, producer, paused);
+		if (!paused)
+			channel->stage()->play(index);
+
+		CASPAR_LOG(info) << L"Restored layer " << channel->index() << L"-" << index << L": " << producer->print();
+	}
+};
+
+channel_state_store::channel_state_store(
+		const std::vector<safe_ptr<video_channel>>& channels,
+		const std::wstring& state_file,
+		int save_interval_millis)
+	: impl_(new implementation(channels, state_file, save_interval_millis))
+{
+}
+
+channel_state_store::~channel_state_store()
+{
+}
+
+}}
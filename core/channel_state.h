@@ -0,0 +1,58 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <string>
+#include <vector>
+
+namespace caspar { namespace core {
+
+class video_channel;
+
+/**
+ * Saves what is playing on the layers of the channels to state_file every
+ * save_interval_millis: the parameters the producers were created from, where
+ * in their files they are, whether they are paused and the mixer transforms.
+ *
+ * On construction the layers saved by a previous run are recreated, all of
+ * them in parallel, each seeked to where it would have been by now. Only
+ * layers with producers created from parameters are saved, which leaves out
+ * templates, routes and the inputs of the configuration.
+ */
+class channel_state_store : boost::noncopyable
+{
+public:
+	channel_state_store(
+			const std::vector<safe_ptr<video_channel>>& channels,
+			const std::wstring& state_file,
+			int save_interval_millis = 1000);
+	~channel_state_store();
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
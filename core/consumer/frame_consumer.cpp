@@ -134,10 +134,30 @@ public:
 		return consumer_->buffer_depth();
 	}
 
+	virtual uint32_t held_frames() const override
+	{
+		return consumer_->held_frames();
+	}
+
 	virtual int index() const override
 	{
 		return consumer_->index();
 	}
+
+	virtual void set_monitor_output(const safe_ptr<monitor::subject>& subject) override
+	{
+		consumer_->set_monitor_output(subject);
+	}
+
+	virtual bool set_frame_requested_callback(const std::function<void()>& callback) override
+	{
+		return consumer_->set_frame_requested_callback(callback);
+	}
+
+	virtual int get_image_usage() const override
+	{
+		return consumer_->get_image_usage();
+	}
 };
 
 safe_ptr<frame_consumer> create_consumer_cadence_guard(const safe_ptr<frame_consumer>& consumer)
@@ -145,6 +165,95 @@ safe_ptr<frame_consumer> create_consumer_cadence_guard(const safe_ptr<frame_cons
 	return make_safe<cadence_guard>(std::move(consumer));
 }
 
+class raster_consumer : public frame_consumer
+{
+	safe_ptr<frame_consumer>	consumer_;
+	const video_format_desc		raster_;
+	int							missing_;
+public:
+	raster_consumer(const safe_ptr<frame_consumer>& consumer, const video_format_desc& raster)
+		: consumer_(consumer)
+		, raster_(raster)
+		, missing_(0)
+	{
+	}
+
+	virtual void initialize(const video_format_desc&, int channel_index) override
+	{
+		missing_ = 0;
+		consumer_->initialize(raster_, channel_index);
+	}
+
+	virtual int64_t presentation_frame_age_millis() const
+	{
+		return consumer_->presentation_frame_age_millis();
+	}
+
+	// Rasters at half the channel rate come with every other frame.
+	virtual boost::unique_future<bool> send(const safe_ptr<read_frame>& frame) override
+	{
+		auto raster = frame->raster(raster_.format);
+
+		if(!raster)
+		{
+			if(++missing_ == 3)
+				CASPAR_LOG(warning) << print() << L" The channel does not render the " << raster_.name << L" raster.";
+
+			return caspar::wrap_as_future(true);
+		}
+
+		missing_ = 0;
+		return consumer_->send(make_safe_ptr(raster));
+	}
+
+	virtual std::wstring print() const override
+	{
+		return consumer_->print() + L"[" + raster_.name + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		auto info = consumer_->info();
+		info.add(L"raster", raster_.name);
+		return info;
+	}
+
+	virtual bool has_synchronization_clock() const override
+	{
+		return consumer_->has_synchronization_clock();
+	}
+
+	virtual uint32_t buffer_depth() const override
+	{
+		return consumer_->buffer_depth();
+	}
+
+	virtual uint32_t held_frames() const override
+	{
+		return consumer_->held_frames();
+	}
+
+	virtual int index() const override
+	{
+		return consumer_->index();
+	}
+
+	virtual void set_monitor_output(const safe_ptr<monitor::subject>& subject) override
+	{
+		consumer_->set_monitor_output(subject);
+	}
+
+	virtual int get_image_usage() const override
+	{
+		return image_usage::raster;
+	}
+};
+
+safe_ptr<frame_consumer> create_raster_consumer(const safe_ptr<frame_consumer>& consumer, const video_format_desc& raster)
+{
+	return make_safe<raster_consumer>(consumer, raster);
+}
+
 const safe_ptr<frame_consumer>& frame_consumer::empty()
 {
 	struct empty_frame_consumer : public frame_consumer
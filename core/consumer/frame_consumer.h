@@ -23,6 +23,9 @@
 
 #include <common/memory/safe_ptr.h>
 
+#include "../monitor/monitor.h"
+#include "../mixer/output_packing.h"
+
 #include <boost/noncopyable.hpp>
 #include <boost/property_tree/ptree_fwd.hpp>
 #include <boost/thread/future.hpp>
@@ -39,6 +42,8 @@
 #define BLUEFISH_CONSUMER_BASE_INDEX 400
 #define OAL_CONSUMER_INDEX 500
 #define OGL_CONSUMER_BASE_INDEX 600
+#define SHARED_MEMORY_CONSUMER_BASE_INDEX 700
+#define REPLAY_CONSUMER_BASE_INDEX 800
 
 namespace caspar { namespace core {
 	
@@ -60,11 +65,29 @@ struct frame_consumer : boost::noncopyable
 	virtual uint32_t buffer_depth() const = 0;
 	virtual int index() const = 0;
 
+	// How many frames the consumer may still keep once send has returned, consumers keeping more than 
+	// configuration.mixer.max-pinned-ticks are given held copies, see hold.
+	virtual uint32_t held_frames() const {return buffer_depth();}
+
+	// The output hands every consumer a subject of its own, /channel/n/output/consumer/index, to report on.
+	virtual void set_monitor_output(const safe_ptr<monitor::subject>& subject) {}
+
+	// Consumers with a hardware clock call back once per output frame, so the output can pull the channel instead of 
+	// being pushed by it. Returns false when there is no such clock.
+	virtual bool set_frame_requested_callback(const std::function<void()>& callback) {return false;}
+
+	// What the consumer reads of the frames, see image_usage. Asked once when the consumer is added.
+	virtual int get_image_usage() const {return image_usage::host;}
+
 	static const safe_ptr<frame_consumer>& empty();
 };
 
 safe_ptr<frame_consumer> create_consumer_cadence_guard(const safe_ptr<frame_consumer>& consumer);
 
+// Hands the consumer the given output raster of the channel instead of the channel image, see 
+// mixer::set_output_rasters. Raster consumers never clock the channel in pull mode.
+safe_ptr<frame_consumer> create_raster_consumer(const safe_ptr<frame_consumer>& consumer, const video_format_desc& raster);
+
 typedef std::function<safe_ptr<core::frame_consumer>(const core::parameters&)> consumer_factory_t;
 
 void register_consumer_factory(const consumer_factory_t& factory);
@@ -30,61 +30,314 @@
 #include "../video_format.h"
 #include "../mixer/gpu/ogl_device.h"
 #include "../mixer/read_frame.h"
+#include "../resource_usage.h"
 
 #include <common/concurrency/executor.h>
+#include <common/concurrency/parallel_arena.h>
+#include <common/concurrency/thread_placement.h>
+#include <common/diagnostics/thread_clock.h>
+#include <common/diagnostics/trace.h>
 #include <common/utility/assert.h>
 #include <common/utility/timer.h>
-#include <common/memory/memshfl.h>
 #include <common/env.h>
 
 #include <boost/circular_buffer.hpp>
+#include <boost/algorithm/string.hpp>
 #include <boost/timer.hpp>
 #include <boost/range/algorithm.hpp>
 #include <boost/range/adaptors.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <deque>
+
 namespace caspar { namespace core {
-	
+
+namespace {
+
+// A consumer with a worker of its own, so that a slow consumer only falls behind itself. Frames wait for the worker
+// in a queue of queue_depth and are dropped for the consumer when it is full. Failures are recovered on the worker,
+// a consumer that cannot be recovered or is done is removed by the output on its next frame.
+class consumer_port : boost::noncopyable
+{		
+	const int						index_;
+	const safe_ptr<frame_consumer>	consumer_;
+	const safe_ptr<diagnostics::graph> graph_;
+	const int						queue_depth_;
+
+	video_format_desc				format_desc_; // Worker only.
+	const int						channel_index_;
+
+	tbb::atomic<int>				queued_;
+	tbb::atomic<bool>				finished_;
+
+	mutable tbb::spin_mutex			stats_mutex_;
+	double							cpu_average_;	// Thread cpu time of the sends, averaged.
+	double							lag_average_;	// ms from queued to sent, averaged.
+	int64_t							sendoff_age_;	// ms, age of the last frame when it was sent.
+	int64_t							dropped_;
+
+	executor						executor_;
+public:
+	resource_usage					reported; // What the consumer reported as of its last info, output thread only.
+
+	consumer_port(int index, const safe_ptr<frame_consumer>& consumer, const safe_ptr<diagnostics::graph>& graph, int queue_depth, const video_format_desc& format_desc, int channel_index)
+		: index_(index)
+		, consumer_(consumer)
+		, graph_(graph)
+		, queue_depth_(queue_depth)
+		, format_desc_(format_desc)
+		, channel_index_(channel_index)
+		, cpu_average_(0.0)
+		, lag_average_(0.0)
+		, sendoff_age_(0)
+		, dropped_(0)
+		, executor_(L"consumer " + boost::lexical_cast<std::wstring>(index))
+	{
+		queued_		= 0;
+		finished_	= false;
+	}
+
+	~consumer_port()
+	{
+		executor_.clear();
+		executor_.stop();
+	}
+
+	const safe_ptr<frame_consumer>& consumer() const
+	{
+		return consumer_;
+	}
+
+	bool finished() const
+	{
+		return finished_;
+	}
+
+	int queued() const
+	{
+		return queued_;
+	}
+
+	void set_placement(const thread_placement& placement)
+	{
+		executor_.set_placement(placement);
+	}
+
+	void set_arena(const std::shared_ptr<parallel_arena>& arena)
+	{
+		executor_.set_arena(arena);
+	}
+
+	// After the frames already queued.
+	boost::unique_future<void> begin_initialize(const video_format_desc& format_desc)
+	{
+		return executor_.begin_invoke([=]
+		{
+			format_desc_ = format_desc;
+			consumer_->initialize(format_desc_, channel_index_);
+		});
+	}
+
+	// Queues the frame, or drops it when the queue is full. Returns false when dropped.
+	bool send(const safe_ptr<read_frame>& frame, int64_t frame_number)
+	{
+		if(finished_)
+			return false;
+
+		if(++queued_ > queue_depth_)
+		{
+			--queued_;
+			graph_->set_tag("dropped-frame");
+
+			tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+			++dropped_;
+			return false;
+		}
+
+		auto queued_at = diagnostics::trace::now();
+
+		executor_.begin_invoke([=]
+		{
+			diagnostics::thread_cpu_timer cpu_timer;
+			auto send_begin = diagnostics::trace::now();
+			auto sendoff_age = frame->get_age_millis();
+
+			do_send(frame);
+			--queued_;
+
+			auto send_end = diagnostics::trace::now();
+			if(diagnostics::trace::is_enabled())
+				diagnostics::trace::record("consumer.send", frame_number, index_, send_begin, send_end);
+
+			tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+			cpu_average_ = cpu_average_ * 0.9 + cpu_timer.elapsed() * 0.1;
+			lag_average_ = lag_average_ * 0.9 + static_cast<double>(send_end - queued_at) / 1000.0 * 0.1;
+			sendoff_age_ = sendoff_age;
+		});
+
+		return true;
+	}
+
+	// Until every queued frame is sent.
+	void wait()
+	{
+		executor_.wait();
+	}
+
+	resource_usage usage() const
+	{
+		auto usage = reported;
+		usage.queue_depth += queued_;
+
+		tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+		usage.cpu_time += cpu_average_;
+		return usage;
+	}
+
+	double lag() const
+	{
+		tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+		return lag_average_;
+	}
+
+	int64_t sendoff_age() const
+	{
+		tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+		return sendoff_age_;
+	}
+
+	boost::property_tree::wptree queue_info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"depth",		static_cast<int>(queued_));
+		info.add(L"capacity",	queue_depth_);
+
+		tbb::spin_mutex::scoped_lock lock(stats_mutex_);
+		info.add(L"dropped",	dropped_);
+		info.add(L"lag",		lag_average_); // ms from queued to sent
+		return info;
+	}
+private:
+	void do_send(const safe_ptr<read_frame>& frame)
+	{
+		if(finished_)
+			return;
+
+		try
+		{
+			if(!consumer_->send(frame).get())
+				finished_ = true;
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			try
+			{
+				consumer_->initialize(format_desc_, channel_index_);
+				if(!consumer_->send(frame).get())
+					finished_ = true;
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				CASPAR_LOG(error) << "Failed to recover consumer: " << consumer_->print() << L". Removing it.";
+				finished_ = true;
+			}
+		}
+	}
+};
+
+}
+
 struct output::implementation
 {		
 	const int										channel_index_;
 	const safe_ptr<diagnostics::graph>				graph_;
-	monitor::subject								monitor_subject_;
+	diagnostics::graph::line_handle					consume_time_line_;
+	const safe_ptr<monitor::subject>				monitor_subject_;
 	boost::timer									consume_timer_;
 
 	video_format_desc								format_desc_;
 
-	std::map<int, safe_ptr<frame_consumer>>			consumers_;
-	
+	// The channel is clocked by one consumer, whose queue the output waits for. In pull mode the stage tickets are
+	// held here after a frame is consumed, and the clock consumer releases one per hardware frame, so the stage
+	// renders when the card asks for a frame rather than as fast as the queues allow.
+	const bool										pull_;
+	int												clock_index_;
+	bool											pulling_;
+	tbb::spin_mutex									held_tickets_mutex_;
+	std::deque<std::shared_ptr<void>>				held_tickets_;
+	int												owed_tickets_;
+
+	const int										queue_depth_; // Frames a consumer may fall behind before frames are dropped for it.
+	std::map<int, safe_ptr<consumer_port>>			ports_;
+	tbb::atomic<int>								image_usage_;
+
 	high_prec_timer									sync_timer_;
+	const bool										shared_clock_; // Unclocked channels at the same frame rate tick in phase.
+	tbb::atomic<bool>								free_running_;
+	tbb::atomic<bool>								composition_; // Rendered on demand of the channels routing it, see set_composition.
+	std::function<void()>							frame_callback_;
 
 	boost::circular_buffer<safe_ptr<read_frame>>	frames_;
-	std::map<int, int64_t>							send_to_consumers_delays_;
+	const int										max_pinned_ticks_; // 0 never copies to pageable memory.
+	int64_t											frame_count_;
+
+	std::shared_ptr<thread_placement>				placement_;
+	std::shared_ptr<parallel_arena>					arena_;
 
 	executor										executor_;
-		
+
 public:
 	implementation(const safe_ptr<diagnostics::graph>& graph, const video_format_desc& format_desc, int channel_index) 
 		: channel_index_(channel_index)
 		, graph_(graph)
-		, monitor_subject_("/output")
+		, monitor_subject_(make_safe<monitor::subject>("/output"))
 		, format_desc_(format_desc)
+		, pull_(boost::iequals(env::properties().get(L"configuration.pipeline-mode", L"push"), L"pull"))
+		, clock_index_(-1)
+		, pulling_(false)
+		, owed_tickets_(0)
+		, queue_depth_(std::max(1, env::properties().get(L"configuration.consumer-queue-depth", 2)))
+		, shared_clock_(env::properties().get(L"configuration.shared-channel-clock", false))
+		, frame_count_(0)
+		, max_pinned_ticks_(std::max(0, env::properties().get(L"configuration.mixer.max-pinned-ticks", 3)))
 		, executor_(L"output")
 	{
+		image_usage_ = image_usage::host;
+		free_running_ = false;
+		composition_ = false;
 		graph_->set_color("consume-time", diagnostics::color(1.0f, 0.4f, 0.0f, 0.8));
+		graph_->set_color("dropped-frame", diagnostics::color(0.3f, 0.6f, 0.3f));
+		consume_time_line_ = graph_->get_line("consume-time");
 	}
 
 	void add(int index, safe_ptr<frame_consumer> consumer)
-	{		
+	{
 		remove(index);
 
 		consumer = create_consumer_cadence_guard(consumer);
 		consumer->initialize(format_desc_, channel_index_);
 
+		auto consumer_subject = make_safe<monitor::subject>("/consumer/" + boost::lexical_cast<std::string>(index));
+		consumer_subject->attach_parent(monitor_subject_);
+		consumer->set_monitor_output(consumer_subject);
+
 		executor_.invoke([&]
 		{
-			consumers_.insert(std::make_pair(index, consumer));
+			auto port = make_safe<consumer_port>(index, consumer, graph_, queue_depth_, format_desc_, channel_index_);
+			if(placement_)
+				port->set_placement(*placement_);
+			if(arena_)
+				port->set_arena(arena_);
+
+			ports_.insert(std::make_pair(index, port));
 			CASPAR_LOG(info) << print() << L" " << consumer->print() << L" Added.";
+			update_clock();
+			update_image_usage();
 		}, high_priority);
 	}
 
@@ -94,25 +347,26 @@ public:
 	}
 
 	void remove(int index)
-	{		
+	{
 		// Destroy  consumer on calling thread:
-		std::shared_ptr<frame_consumer> old_consumer;
+		std::shared_ptr<consumer_port> old_port;
 
 		executor_.invoke([&]
 		{
-			auto it = consumers_.find(index);
-			if(it != consumers_.end())
+			auto it = ports_.find(index);
+			if(it != ports_.end())
 			{
-				old_consumer = it->second;
-				send_to_consumers_delays_.erase(it->first);
-				consumers_.erase(it);
+				old_port = it->second;
+				ports_.erase(it);
+				update_clock();
+				update_image_usage();
 			}
 		}, high_priority);
 
-		if(old_consumer)
+		if(old_port)
 		{
-			auto str = old_consumer->print();
-			old_consumer.reset();
+			auto str = old_port->consumer()->print();
+			old_port.reset();
 			CASPAR_LOG(info) << print() << L" " << str << L" Removed.";
 		}
 	}
@@ -121,61 +375,227 @@ public:
 	{
 		remove(consumer->index());
 	}
-	
+
 	void set_video_format_desc(const video_format_desc& format_desc)
 	{
 		executor_.invoke([&]
 		{
-			auto it = consumers_.begin();
-			while(it != consumers_.end())
-			{						
+			// Consumers reopen their devices on their own workers at the same time, so a mode change takes as long
+			// as the slowest of them rather than all of them together.
+			std::map<int, std::shared_ptr<boost::unique_future<void>>> initializations;
+			BOOST_FOREACH(auto& port, ports_)
+				initializations[port.first] = std::make_shared<boost::unique_future<void>>(port.second->begin_initialize(format_desc));
+
+			BOOST_FOREACH(auto& initialization, initializations)
+			{
 				try
 				{
-					it->second->initialize(format_desc, channel_index_);
-					++it;
+					initialization.second->get();
 				}
 				catch(...)
 				{
 					CASPAR_LOG_CURRENT_EXCEPTION();
-					CASPAR_LOG(info) << print() << L" " << it->second->print() << L" Removed.";
-					send_to_consumers_delays_.erase(it->first);
-					consumers_.erase(it++);
+					CASPAR_LOG(info) << print() << L" " << ports_.at(initialization.first)->consumer()->print() << L" Removed.";
+					ports_.erase(initialization.first);
 				}
 			}
-			
+
 			format_desc_ = format_desc;
 			frames_.clear();
+			update_clock();
+			update_image_usage();
+		});
+	}
+
+	void set_thread_placement(const thread_placement& placement)
+	{
+		executor_.set_placement(placement);
+		executor_.invoke([&]
+		{
+			placement_ = std::make_shared<thread_placement>(placement);
+			BOOST_FOREACH(auto& port, ports_)
+				port.second->set_placement(placement);
+		});
+	}
+
+	void set_parallel_arena(const std::shared_ptr<parallel_arena>& arena)
+	{
+		executor_.set_arena(arena);
+		executor_.invoke([&]
+		{
+			arena_ = arena;
+			BOOST_FOREACH(auto& port, ports_)
+				port.second->set_arena(arena);
 		});
 	}
-	
+
+	void on_frame_requested()
+	{
+		std::shared_ptr<void> ticket;
+		{
+			tbb::spin_mutex::scoped_lock lock(held_tickets_mutex_);
+			if(held_tickets_.empty())
+			{
+				++owed_tickets_; // the frame is late, let its ticket through as soon as it is consumed
+				return;
+			}
+			ticket = std::move(held_tickets_.front());
+			held_tickets_.pop_front();
+		}
+		// ticket goes out of scope here and starts the next stage tick.
+	}
+
+	void hold_ticket(const std::shared_ptr<void>& ticket)
+	{
+		tbb::spin_mutex::scoped_lock lock(held_tickets_mutex_);
+		if(owed_tickets_ > 0)
+			--owed_tickets_;
+		else
+			held_tickets_.push_back(ticket);
+	}
+
+	void release_held_tickets()
+	{
+		std::deque<std::shared_ptr<void>> tickets;
+		{
+			tbb::spin_mutex::scoped_lock lock(held_tickets_mutex_);
+			std::swap(tickets, held_tickets_);
+			owed_tickets_ = 0;
+		}
+	}
+
+	// Picks the consumer that clocks the channel: in pull mode, or for a composition, the one whose hardware callback
+	// or whose route drives it, otherwise the first with a synchronization clock. Without one the sync timer ticks 
+	// the channel.
+	void update_clock()
+	{
+		if(clock_index_ >= 0 && ports_.find(clock_index_) == ports_.end())
+		{
+			if(pulling_)
+			{
+				CASPAR_LOG(info) << print() << L" Lost clock consumer, pushing frames.";
+				release_held_tickets();
+			}
+			clock_index_	= -1;
+			pulling_		= false;
+		}
+
+		if((pull_ || composition_) && !pulling_)
+		{
+			BOOST_FOREACH(auto& port, ports_)
+			{
+				if(port.second->consumer()->set_frame_requested_callback([this]{on_frame_requested();}))
+				{
+					clock_index_	= port.first;
+					pulling_		= true;
+					CASPAR_LOG(info) << print() << L" " << port.second->consumer()->print() << L" Pulling frames.";
+					break;
+				}
+			}
+		}
+
+		if(clock_index_ >= 0)
+			return;
+
+		BOOST_FOREACH(auto& port, ports_)
+		{
+			if(port.second->consumer()->has_synchronization_clock())
+			{
+				clock_index_ = port.first;
+				break;
+			}
+		}
+	}
+
+	// Without consumers the mixer keeps reading back, so that the first frames of a new consumer are not empty.
+	void update_image_usage()
+	{
+		int usage = ports_.empty() ? image_usage::host : 0;
+		BOOST_FOREACH(auto& port, ports_)
+			usage |= port.second->consumer()->get_image_usage();
+		image_usage_ = usage;
+	}
+
+	int image_usage() const
+	{
+		return image_usage_;
+	}
+
 	std::map<int, uint32_t> buffer_depths_snapshot() const
 	{
 		std::map<int, uint32_t> result;
 
-		BOOST_FOREACH(auto& consumer, consumers_)
+		BOOST_FOREACH(auto& port, ports_)
 			result.insert(std::make_pair(
-					consumer.first,
-					consumer.second->buffer_depth()));
+					port.first,
+					port.second->consumer()->buffer_depth()));
 
 		return std::move(result);
 	}
 
 	std::pair<uint32_t, uint32_t> minmax_buffer_depth(
 			const std::map<int, uint32_t>& buffer_depths) const
-	{		
-		if(consumers_.empty())
+	{
+		if(ports_.empty())
 			return std::make_pair(0, 0);
-		
+
 		auto depths = buffer_depths | boost::adaptors::map_values; 
-		
+
 		return std::make_pair(
 				*boost::range::min_element(depths),
 				*boost::range::max_element(depths));
 	}
 
-	bool has_synchronization_clock() const
+	void tick_sync_timer()
 	{
-		return boost::range::count_if(consumers_ | boost::adaptors::map_values, [](const safe_ptr<frame_consumer>& x){return x->has_synchronization_clock();}) > 0;
+		if(free_running_)
+			return;
+
+		if(shared_clock_)
+			sync_timer_.tick_aligned(1.0/format_desc_.fps);
+		else
+			sync_timer_.tick(1.0/format_desc_.fps);
+	}
+
+	void set_composition(bool value)
+	{
+		executor_.invoke([=]
+		{
+			if(composition_ == value)
+				return;
+
+			composition_ = value;
+
+			// A route stops clocking the channel once it is no composition, unless the channel pulls anyway.
+			if(!value && !pull_)
+			{
+				if(pulling_)
+				{
+					auto clock = ports_.find(clock_index_);
+					if(clock != ports_.end())
+						clock->second->consumer()->set_frame_requested_callback(nullptr);
+					clock_index_	= -1;
+					pulling_		= false;
+				}
+				release_held_tickets();
+				update_clock();
+			}
+		}, high_priority);
+	}
+
+	// Consumers that are done or failed to recover, see consumer_port.
+	void remove_finished()
+	{
+		for(auto it = ports_.begin(); it != ports_.end();)
+		{
+			if(it->second->finished())
+			{
+				CASPAR_LOG(info) << print() << L" " << it->second->consumer()->print() << L" Removed.";
+				it = ports_.erase(it);
+			}
+			else
+				++it;
+		}
 	}
 
 	void send(const std::pair<safe_ptr<read_frame>, std::shared_ptr<void>>& packet)
@@ -186,101 +606,70 @@ public:
 			{
 				consume_timer_.restart();
 
+				diagnostics::trace::scope trace("output.send", ++frame_count_);
+
 				auto input_frame = packet.first;
 
-				if(!has_synchronization_clock())
-					sync_timer_.tick(1.0/format_desc_.fps);
+				remove_finished();
+				update_clock();
+				update_image_usage();
+
+				// A composition nobody routes renders nothing, the first route to it releases the held tickets.
+				if(composition_ && !pulling_)
+				{
+					hold_ticket(packet.second);
+					return;
+				}
+
+				if(clock_index_ < 0)
+					tick_sync_timer();
 
 				if(input_frame->image_size() != format_desc_.size)
 				{
-					sync_timer_.tick(1.0/format_desc_.fps);
+					tick_sync_timer();
 					return;
 				}
-				
+
 				auto buffer_depths = buffer_depths_snapshot();
 				auto minmax = minmax_buffer_depth(buffer_depths);
 
 				frames_.set_capacity(minmax.second - minmax.first + 1);
 				frames_.push_back(input_frame);
 
+				// Frames held back for longer than the pinned ticks are copied out of the read-back buffers.
+				if(max_pinned_ticks_ > 0 && frames_.size() > static_cast<std::size_t>(max_pinned_ticks_))
+				{
+					auto& held = frames_[frames_.size() - 1 - max_pinned_ticks_];
+					held = hold(held);
+				}
+
 				if(!frames_.full())
 					return;
 
-				std::map<int, boost::unique_future<bool>> send_results;
+				BOOST_FOREACH(auto& port, ports_)
+					port.second->send(frame_for(*port.second, frames_.at(buffer_depths[port.first]-minmax.first)), frame_count_);
 
-				// Start invocations
-				for (auto it = consumers_.begin(); it != consumers_.end();)
+				// The clock consumer paces the channel, the others keep up on their own or drop frames.
+				auto clock = ports_.find(clock_index_);
+				if(clock != ports_.end())
 				{
-					auto consumer	= it->second;
-					auto frame		= frames_.at(buffer_depths[it->first]-minmax.first);
+					clock->second->wait();
 
-					send_to_consumers_delays_[it->first] = frame->get_age_millis();
-						
-					try
-					{
-						send_results.insert(std::make_pair(it->first, consumer->send(frame)));
-						++it;
-					}
-					catch(...)
+					if(pulling_)
 					{
-						CASPAR_LOG_CURRENT_EXCEPTION();
-						try
-						{
-							send_results.insert(std::make_pair(it->first, consumer->send(frame)));
-							++it;
-						}
-						catch(...)
-						{
-							CASPAR_LOG_CURRENT_EXCEPTION();
-							CASPAR_LOG(error) << "Failed to recover consumer: " << consumer->print() << L". Removing it.";
-							send_to_consumers_delays_.erase(it->first);
-							it = consumers_.erase(it);
-						}
+						hold_ticket(packet.second);
+						*monitor_subject_ << monitor::message("/latency") % clock->second->consumer()->presentation_frame_age_millis();
 					}
 				}
 
-				// Retrieve results
-				for (auto result_it = send_results.begin(); result_it != send_results.end(); ++result_it)
-				{
-					auto consumer = consumers_.find(result_it->first);
-					auto frame = frames_.at(buffer_depths[result_it->first] - minmax.first);
-					auto& result_future = result_it->second;
-
-					if (consumer != consumers_.end())
-						try
-						{
-							if (!result_future.get())
-							{
-								CASPAR_LOG(info) << print() << L" " << consumer->second->print() << L" Removed.";
-								send_to_consumers_delays_.erase(result_it->first);
-								consumers_.erase(result_it->first);
-							}
-						}
-						catch (...)
-						{
-							CASPAR_LOG_CURRENT_EXCEPTION();
-							try
-							{
-								consumer->second->initialize(format_desc_, channel_index_);
-								if (!consumer->second->send(frame).get())
-								{
-									CASPAR_LOG(info) << print() << L" " << consumer->second->print() << L" Removed.";
-									send_to_consumers_delays_.erase(result_it->first);
-									consumers_.erase(result_it->first);
-								}
-							}
-							catch (...)
-							{
-								CASPAR_LOG_CURRENT_EXCEPTION();
-								CASPAR_LOG(error) << "Failed to recover consumer: " << consumer->second->print() << L". Removing it.";
-								send_to_consumers_delays_.erase(result_it->first);
-								consumers_.erase(result_it->first);
-							}
-						}
-				}
-						
-				graph_->set_value("consume-time", consume_timer_.elapsed()*format_desc_.fps*0.5);
-				monitor_subject_ << monitor::message("/consume_time") % (consume_timer_.elapsed());
+				graph_->set_value(consume_time_line_, consume_timer_.elapsed()*format_desc_.fps*0.5);
+				*monitor_subject_ << monitor::message("/consume_time") % (consume_timer_.elapsed());
+
+				if(monitor_subject_->is_observed())
+					send_resources();
+
+				if(frame_callback_)
+					frame_callback_();
 			}
 			catch(...)
 			{
@@ -289,6 +678,45 @@ public:
 		});
 	}
 
+	// Consumers keeping frames for longer than the pinned ticks, counting those waiting in their queue, get held
+	// copies, so that the mixer's pinned buffers recycle at the pace of the fastest consumers.
+	safe_ptr<read_frame> frame_for(const consumer_port& port, const safe_ptr<read_frame>& frame) const
+	{
+		if(max_pinned_ticks_ > 0 && port.consumer()->held_frames() + port.queued() > static_cast<uint32_t>(max_pinned_ticks_))
+			return hold(frame);
+
+		return frame;
+	}
+
+	// The frames held back for the consumers with shorter buffers.
+	resource_usage buffered_resources() const
+	{
+		resource_usage usage;
+		BOOST_FOREACH(auto& frame, frames_)
+			usage.host_bytes += frame->image_size();
+		usage.queue_depth = frames_.size();
+		return usage;
+	}
+
+	// The consumers are asked for what they report about once a second, the rest is measured every frame.
+	void send_resources()
+	{
+		bool refresh = frame_count_ % std::max(1, static_cast<int>(format_desc_.fps + 0.5)) == 0;
+
+		auto total = buffered_resources();
+		BOOST_FOREACH(auto& port, ports_)
+		{
+			if(refresh)
+				port.second->reported = resource_usage::from_info(port.second->consumer()->info());
+
+			auto path = "/consumer/" + boost::lexical_cast<std::string>(port.first);
+			port.second->usage().send(*monitor_subject_, path + "/resources");
+			*monitor_subject_ << monitor::message(path + "/lag") % port.second->lag();
+			total += port.second->usage();
+		}
+		total.send(*monitor_subject_, "/resources");
+	}
+
 	std::wstring print() const
 	{
 		return L"output[" + boost::lexical_cast<std::wstring>(channel_index_) + L"]";
@@ -297,12 +725,33 @@ public:
 	boost::unique_future<boost::property_tree::wptree> info()
 	{
 		return std::move(executor_.begin_invoke([&]() -> boost::property_tree::wptree
-		{			
+		{
 			boost::property_tree::wptree info;
-			BOOST_FOREACH(auto& consumer, consumers_)
+			auto total = buffered_resources();
+			BOOST_FOREACH(auto& port, ports_)
 			{
-				info.add_child(L"consumers.consumer", consumer.second->info())
-					.add(L"index", consumer.first); 
+				auto consumer_info = port.second->consumer()->info();
+				port.second->reported = resource_usage::from_info(consumer_info);
+				consumer_info.put_child(L"resources", port.second->usage().info());
+				consumer_info.put_child(L"queue", port.second->queue_info());
+				total += port.second->usage();
+
+				info.add_child(L"consumers.consumer", consumer_info)
+					.add(L"index", port.first);
+			}
+			info.add_child(L"resources", total.info());
+
+			info.add(L"clock.mode", pulling_ ? L"pull" : L"push");
+			auto clock = ports_.find(clock_index_);
+			if(clock != ports_.end())
+			{
+				info.add(L"clock.consumer", clock->first);
+				if(pulling_)
+				{
+					tbb::spin_mutex::scoped_lock lock(held_tickets_mutex_);
+					info.add(L"clock.held-tickets", held_tickets_.size());
+					info.add(L"clock.latency", clock->second->consumer()->presentation_frame_age_millis()); // tick to displayed, ms
+				}
 			}
 			return info;
 		}, high_priority));
@@ -311,17 +760,17 @@ public:
 	boost::unique_future<boost::property_tree::wptree> delay_info()
 	{
 		return std::move(executor_.begin_invoke([&]() -> boost::property_tree::wptree
-		{			
+		{
 			boost::property_tree::wptree info;
-			BOOST_FOREACH(auto& consumer, consumers_)
+			BOOST_FOREACH(auto& port, ports_)
 			{
 				auto total_age =
-						consumer.second->presentation_frame_age_millis();
-				auto sendoff_age = send_to_consumers_delays_[consumer.first];
+						port.second->consumer()->presentation_frame_age_millis();
+				auto sendoff_age = port.second->sendoff_age();
 				auto presentation_time = total_age - sendoff_age;
 
 				boost::property_tree::wptree child;
-				child.add(L"name", consumer.second->print());
+				child.add(L"name", port.second->consumer()->print());
 				child.add(L"age-at-arrival", sendoff_age);
 				child.add(L"presentation-time", presentation_time);
 				child.add(L"age-at-presentation", total_age);
@@ -336,13 +785,13 @@ public:
 	{
 		return executor_.invoke([this]
 		{
-			return consumers_.empty();
+			return ports_.empty();
 		});
 	}
 
 	monitor::subject& monitor_output()
-	{ 
-		return monitor_subject_;
+	{
+		return *monitor_subject_;
 	}
 };
 
@@ -353,8 +802,14 @@ void output::remove(int index){impl_->remove(index);}
 void output::remove(const safe_ptr<frame_consumer>& consumer){impl_->remove(consumer);}
 void output::send(const std::pair<safe_ptr<read_frame>, std::shared_ptr<void>>& frame) {impl_->send(frame); }
 void output::set_video_format_desc(const video_format_desc& format_desc){impl_->set_video_format_desc(format_desc);}
+void output::set_thread_placement(const thread_placement& placement){impl_->set_thread_placement(placement);}
+void output::set_free_running(bool value){impl_->free_running_ = value;}
+void output::set_composition(bool value){impl_->set_composition(value);}
+void output::set_frame_callback(const std::function<void()>& callback){impl_->frame_callback_ = callback;}
+void output::set_parallel_arena(const std::shared_ptr<parallel_arena>& arena){impl_->set_parallel_arena(arena);}
 boost::unique_future<boost::property_tree::wptree> output::info() const{return impl_->info();}
 boost::unique_future<boost::property_tree::wptree> output::delay_info() const{return impl_->delay_info();}
 bool output::empty() const{return impl_->empty();}
+int output::image_usage() const{return impl_->image_usage();}
 monitor::subject& output::monitor_output() { return impl_->monitor_output(); }
-}}
\ No newline at end of file
+}}
@@ -32,7 +32,14 @@
 #include <boost/property_tree/ptree_fwd.hpp>
 #include <boost/thread/future.hpp>
 
-namespace caspar { namespace core {
+#include <functional>
+
+namespace caspar {
+
+struct thread_placement;
+class parallel_arena;
+
+namespace core {
 	
 class output : public target<std::pair<safe_ptr<read_frame>, std::shared_ptr<void>>>
 			 , boost::noncopyable
@@ -52,11 +59,17 @@ public:
 	void remove(int index);
 	
 	void set_video_format_desc(const video_format_desc& format_desc);
+	void set_thread_placement(const thread_placement& placement);
+	void set_free_running(bool value); // Ticks without waiting for the frame rate when no consumer clocks the channel.
+	void set_composition(bool value); // Ticks when a route to the channel asks for a frame, see is_composition_channel.
+	void set_parallel_arena(const std::shared_ptr<parallel_arena>& arena);
+	void set_frame_callback(const std::function<void()>& callback); // Called on the output thread after each sent frame, set it before the first.
 
 	boost::unique_future<boost::property_tree::wptree> info() const;
 	boost::unique_future<boost::property_tree::wptree> delay_info() const;
 
 	bool empty() const;
+	int image_usage() const; // Combined image_usage flags of the consumers.
 
 	monitor::subject& monitor_output();
 private:
@@ -0,0 +1,478 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../StdAfx.h"
+
+#include "replay_buffer.h"
+
+#include <core/mixer/read_frame.h>
+#include <core/producer/frame/pixel_format.h>
+
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/memory/memcpy.h>
+#include <common/memory/pixel_kernels.h>
+#include <common/utility/string.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/mutex.h>
+
+#include <algorithm>
+#include <array>
+#include <map>
+
+#include <windows.h>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const uint32_t	SECTOR_SIZE		= 4096;	// Unbuffered I/O is in whole sectors, to and from aligned memory.
+const int		WRITE_DEPTH		= 4;	// Overlapped writes in flight.
+const int		MAX_CHANNELS	= 16;
+
+uint64_t align(uint64_t size, uint64_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+tbb::mutex											g_buffers_mutex;
+std::map<std::wstring, std::weak_ptr<replay_buffer>> g_buffers;
+
+struct aligned_deleter
+{
+	void operator()(uint8_t* p) const
+	{
+		_aligned_free(p);
+	}
+};
+
+typedef std::unique_ptr<uint8_t, aligned_deleter> aligned_ptr;
+
+aligned_ptr allocate_aligned(std::size_t size)
+{
+	auto p = static_cast<uint8_t*>(_aligned_malloc(size, SECTOR_SIZE));
+	if(!p)
+		BOOST_THROW_EXCEPTION(std::bad_alloc());
+	return aligned_ptr(p);
+}
+
+}
+
+struct replay_buffer::implementation : boost::noncopyable
+{
+	// Readers check the frame number before and after they copy the slot, it is -1 while the slot is written.
+	struct slot
+	{
+		tbb::atomic<int64_t>	frame;
+		bool					has_image;
+		uint32_t				audio_samples;
+		int						audio_channels;
+		int						timecode;
+	};
+
+	// A slot's data staged for an overlapped write to the file.
+	struct write
+	{
+		aligned_ptr				data;
+		OVERLAPPED				overlapped;
+		int64_t					frame;
+		bool					pending;
+	};
+
+	const std::wstring							name_;
+	const video_format_desc						format_desc_;
+	const uint32_t								capacity_;
+	const std::wstring							path_;
+	const bool									compressed_;
+	const uint32_t								image_size_;
+	const uint32_t								audio_offset_;
+	const uint32_t								max_audio_samples_;
+	const uint32_t								slot_size_;
+
+	std::unique_ptr<slot[]>						slots_;
+	uint8_t*									memory_;	// Of the slots, unless they are in the file.
+	HANDLE										write_file_;
+	HANDLE										read_file_;
+	std::array<write, WRITE_DEPTH>				writes_;
+	mutable tbb::concurrent_queue<uint8_t*>		read_buffers_;
+
+	int64_t										next_;
+	tbb::atomic<int64_t>						recorded_;
+	tbb::atomic<int64_t>						dropped_;
+
+	implementation(const std::wstring& name, const video_format_desc& format_desc, uint32_t capacity, const std::wstring& path, bool compressed)
+		: name_(name)
+		, format_desc_(format_desc)
+		, capacity_(std::max(capacity, static_cast<uint32_t>(WRITE_DEPTH * 2)))
+		, path_(path)
+		, compressed_(compressed)
+		, image_size_(compressed ? get_compressed_size(texture_compression::dxt5, format_desc.width, format_desc.height) : format_desc.size)
+		, audio_offset_(static_cast<uint32_t>(align(image_size_, 64)))
+		, max_audio_samples_((format_desc.audio_cadence.empty() ? format_desc.audio_sample_rate : *std::max_element(format_desc.audio_cadence.begin(), format_desc.audio_cadence.end())) * MAX_CHANNELS)
+		, slot_size_(static_cast<uint32_t>(align(audio_offset_ + max_audio_samples_ * sizeof(int32_t), SECTOR_SIZE)))
+		, slots_(new slot[capacity_])
+		, memory_(nullptr)
+		, write_file_(INVALID_HANDLE_VALUE)
+		, read_file_(INVALID_HANDLE_VALUE)
+		, next_(0)
+	{
+		recorded_	= 0;
+		dropped_	= 0;
+
+		for(uint32_t n = 0; n < capacity_; ++n)
+		{
+			slots_[n].frame				= -1;
+			slots_[n].has_image			= false;
+			slots_[n].audio_samples		= 0;
+			slots_[n].audio_channels	= 0;
+			slots_[n].timecode			= 0;
+		}
+
+		boost::timer timer;
+		auto size = static_cast<uint64_t>(slot_size_) * capacity_;
+
+		if(path_.empty())
+			allocate_memory(size);
+		else
+			open_file(size);
+
+		CASPAR_LOG(info) << print() << L" Allocated " << capacity_ << L" frames, " << size / (1024 * 1024) << L" MB " 
+						 << (path_.empty() ? L"of memory" : L"in " + path_) << L", in " << static_cast<int>(timer.elapsed() * 1000.0) << L" ms.";
+	}
+
+	~implementation()
+	{
+		if(write_file_ != INVALID_HANDLE_VALUE)
+		{
+			CancelIo(write_file_);
+			BOOST_FOREACH(auto& write, writes_)
+			{
+				DWORD bytes = 0;
+				if(write.pending)
+					GetOverlappedResult(write_file_, &write.overlapped, &bytes, TRUE);
+				CloseHandle(write.overlapped.hEvent);
+			}
+			CloseHandle(write_file_);
+		}
+
+		if(read_file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(read_file_);
+
+		uint8_t* buffer;
+		while(read_buffers_.try_pop(buffer))
+			_aligned_free(buffer);
+
+		if(memory_)
+			VirtualFree(memory_, 0, MEM_RELEASE);
+	}
+
+	// Committed and touched up front, so that recording never waits on the memory manager.
+	void allocate_memory(uint64_t size)
+	{
+		memory_ = static_cast<uint8_t*>(VirtualAlloc(nullptr, static_cast<SIZE_T>(size), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+		if(!memory_)
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not allocate the replay buffer.") << arg_value_info(boost::lexical_cast<std::string>(size)));
+
+		for(uint64_t offset = 0; offset < size; offset += SECTOR_SIZE)
+			memory_[offset] = 0;
+	}
+
+	void open_file(uint64_t size)
+	{
+		write_file_ = CreateFileW(path_.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, nullptr);
+		if(write_file_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info("Could not create the replay file.") << arg_value_info(narrow(path_)));
+
+		LARGE_INTEGER end;
+		end.QuadPart = size;
+		if(!SetFilePointerEx(write_file_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(write_file_))
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not size the replay file.") << arg_value_info(narrow(path_)));
+
+		// Writes past the valid data length are zero filled and completed synchronously by the file system.
+		if(!SetFileValidData(write_file_, size))
+			CASPAR_LOG(warning) << print() << L" Could not set the valid data length, which needs SeManageVolumePrivilege. Writes may block until the file has been filled once.";
+
+		read_file_ = CreateFileW(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, nullptr);
+		if(read_file_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info("Could not open the replay file.") << arg_value_info(narrow(path_)));
+
+		BOOST_FOREACH(auto& write, writes_)
+		{
+			write.data		= allocate_aligned(slot_size_);
+			write.frame		= -1;
+			write.pending	= false;
+			std::memset(&write.overlapped, 0, sizeof(write.overlapped));
+			write.overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		}
+	}
+
+	slot& slot_of(int64_t n) const
+	{
+		return slots_[static_cast<size_t>(n % capacity_)];
+	}
+
+	uint64_t offset_of(int64_t n) const
+	{
+		return static_cast<uint64_t>(n % capacity_) * slot_size_;
+	}
+
+	// The image and audio of a slot, in its memory or in the staged data of a write.
+	bool fill(uint8_t* data, read_frame& frame, slot& slot)
+	{
+		auto image = frame.image_data();
+		slot.has_image = image.size() == format_desc_.size;
+		if(slot.has_image && compressed_)
+			encode_dxt5(data, image.begin(), format_desc_.width * 4, format_desc_.width, format_desc_.height);
+		else if(slot.has_image)
+			fast_memcpy(data, image.begin(), image_size_);
+
+		auto audio = frame.audio_data();
+		slot.audio_samples	= std::min(static_cast<uint32_t>(audio.size()), max_audio_samples_);
+		slot.audio_channels = frame.num_channels();
+		slot.timecode		= frame.get_timecode();
+		std::memcpy(data + audio_offset_, audio.begin(), slot.audio_samples * sizeof(int32_t));
+
+		return slot.has_image;
+	}
+
+	void write(read_frame& frame)
+	{
+		auto n		= next_++;
+		auto& slot	= slot_of(n);
+
+		slot.frame = -1;
+
+		if(memory_)
+		{
+			fill(memory_ + offset_of(n), frame, slot);
+			slot.frame	= n;
+			recorded_	= n + 1;
+			return;
+		}
+
+		complete_writes();
+
+		auto& write = writes_[static_cast<size_t>(n % WRITE_DEPTH)];
+		if(write.pending)
+		{
+			// The disk is behind, the frame is dropped rather than waited for.
+			slot.has_image		= false;
+			slot.audio_samples	= 0;
+			slot.frame			= n;
+			++dropped_;
+			update_recorded();
+			return;
+		}
+
+		fill(write.data.get(), frame, slot);
+
+		auto offset = offset_of(n);
+		auto bytes	= static_cast<DWORD>(align(audio_offset_ + slot.audio_samples * sizeof(int32_t), SECTOR_SIZE));
+		write.overlapped.Offset		= static_cast<DWORD>(offset & 0xFFFFFFFF);
+		write.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		write.frame					= n;
+		ResetEvent(write.overlapped.hEvent);
+
+		if(WriteFile(write_file_, write.data.get(), bytes, nullptr, &write.overlapped) || GetLastError() == ERROR_IO_PENDING)
+			write.pending = true;
+		else
+		{
+			CASPAR_LOG(warning) << print() << L" Could not write frame " << n << L".";
+			slot.has_image		= false;
+			slot.audio_samples	= 0;
+			slot.frame			= n;
+			++dropped_;
+		}
+
+		complete_writes();
+	}
+
+	// Publishes the frames whose writes have completed.
+	void complete_writes()
+	{
+		BOOST_FOREACH(auto& write, writes_)
+		{
+			if(!write.pending || !HasOverlappedIoCompleted(&write.overlapped))
+				continue;
+
+			DWORD bytes = 0;
+			auto& slot = slot_of(write.frame);
+			if(!GetOverlappedResult(write_file_, &write.overlapped, &bytes, FALSE))
+			{
+				slot.has_image		= false;
+				slot.audio_samples	= 0;
+				++dropped_;
+			}
+
+			slot.frame		= write.frame;
+			write.pending	= false;
+		}
+
+		update_recorded();
+	}
+
+	// Frames are only readable once all before them are.
+	void update_recorded()
+	{
+		int64_t recorded = recorded_;
+		while(recorded < next_ && slot_of(recorded).frame == recorded)
+			++recorded;
+		recorded_ = recorded;
+	}
+
+	bool read(int64_t n, uint8_t* image, replay_frame& frame) const
+	{
+		if(n < oldest() || n >= recorded_)
+			return false;
+
+		auto& slot = slot_of(n);
+		if(slot.frame != n)
+			return false;
+
+		frame.has_image			= slot.has_image;
+		frame.audio_channels	= slot.audio_channels;
+		frame.timecode			= slot.timecode;
+		auto audio_samples		= std::min(slot.audio_samples, max_audio_samples_);
+
+		if(memory_)
+		{
+			auto data = memory_ + offset_of(n);
+			if(frame.has_image)
+				fast_memcpy(image, data, image_size_);
+			auto audio = reinterpret_cast<const int32_t*>(data + audio_offset_);
+			frame.audio.assign(audio, audio + audio_samples);
+		}
+		else if(frame.has_image || audio_samples > 0)
+		{
+			auto buffer = take_read_buffer();
+			auto bytes	= static_cast<DWORD>(align(audio_offset_ + audio_samples * sizeof(int32_t), SECTOR_SIZE));
+			auto ok		= read_file(buffer, offset_of(n), bytes);
+
+			if(ok && frame.has_image)
+				fast_memcpy(image, buffer, image_size_);
+			if(ok)
+			{
+				auto audio = reinterpret_cast<const int32_t*>(buffer + audio_offset_);
+				frame.audio.assign(audio, audio + audio_samples);
+			}
+
+			read_buffers_.push(buffer);
+			if(!ok)
+				return false;
+		}
+		else
+			frame.audio.clear();
+
+		return slot.frame == n;
+	}
+
+	bool read_file(uint8_t* buffer, uint64_t offset, DWORD bytes) const
+	{
+		OVERLAPPED overlapped;
+		std::memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset		= static_cast<DWORD>(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh	= static_cast<DWORD>(offset >> 32);
+		overlapped.hEvent		= CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+		DWORD read = 0;
+		bool ok = (ReadFile(read_file_, buffer, bytes, nullptr, &overlapped) || GetLastError() == ERROR_IO_PENDING)
+				&& GetOverlappedResult(read_file_, &overlapped, &read, TRUE)
+				&& read == bytes;
+
+		CloseHandle(overlapped.hEvent);
+		return ok;
+	}
+
+	uint8_t* take_read_buffer() const
+	{
+		uint8_t* buffer;
+		if(read_buffers_.try_pop(buffer))
+			return buffer;
+
+		return allocate_aligned(slot_size_).release();
+	}
+
+	// Slots this close to being written next are left alone, so that a read has time to finish before its slot is.
+	int64_t oldest() const
+	{
+		return std::max<int64_t>(0, recorded_ - capacity_ + WRITE_DEPTH + 1);
+	}
+
+	std::wstring print() const
+	{
+		return L"replay-buffer[" + name_ + L"]";
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"name",			name_);
+		info.add(L"video-mode",		format_desc_.name);
+		info.add(L"storage",		path_.empty() ? L"memory" : path_);
+		info.add(L"compression",	compressed_ ? L"dxt5" : L"none");
+		info.add(L"capacity",		capacity_);
+		info.add(L"slot-size",		slot_size_);
+		info.add(L"megabytes",		static_cast<uint64_t>(slot_size_) * capacity_ / (1024 * 1024));
+		info.add(L"recorded",		recorded_);
+		info.add(L"oldest",			oldest());
+		info.add(L"dropped",		dropped_);
+		return info;
+	}
+};
+
+replay_buffer::replay_buffer(const std::wstring& name, const video_format_desc& format_desc, uint32_t capacity, const std::wstring& path, bool compressed)
+	: impl_(new implementation(name, format_desc, capacity, path, compressed)){}
+replay_buffer::~replay_buffer(){}
+void replay_buffer::write(read_frame& frame){impl_->write(frame);}
+bool replay_buffer::read(int64_t n, uint8_t* image, replay_frame& frame) const{return impl_->read(n, image, frame);}
+uint32_t replay_buffer::image_size() const{return impl_->image_size_;}
+int64_t replay_buffer::recorded() const{return impl_->recorded_;}
+int64_t replay_buffer::oldest() const{return impl_->oldest();}
+int64_t replay_buffer::dropped() const{return impl_->dropped_;}
+uint32_t replay_buffer::capacity() const{return impl_->capacity_;}
+bool replay_buffer::compressed() const{return impl_->compressed_;}
+const video_format_desc& replay_buffer::format_desc() const{return impl_->format_desc_;}
+const std::wstring& replay_buffer::name() const{return impl_->name_;}
+boost::property_tree::wptree replay_buffer::info() const{return impl_->info();}
+
+void register_replay_buffer(const std::shared_ptr<replay_buffer>& buffer)
+{
+	tbb::mutex::scoped_lock lock(g_buffers_mutex);
+	g_buffers[buffer->name()] = buffer;
+}
+
+std::shared_ptr<replay_buffer> find_replay_buffer(const std::wstring& name)
+{
+	tbb::mutex::scoped_lock lock(g_buffers_mutex);
+	auto it = g_buffers.find(name);
+	if(it == g_buffers.end())
+		return nullptr;
+
+	return it->second.lock();
+}
+
+}}
@@ -0,0 +1,95 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "../../video_format.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace caspar { namespace core {
+
+class read_frame;
+
+// What was recorded with a frame besides the image, see replay_buffer::read.
+struct replay_frame
+{
+	bool					has_image; // False for frames which were dropped or had no image.
+	std::vector<int32_t>	audio;
+	int						audio_channels;
+	int						timecode;
+
+	replay_frame() 
+		: has_image(false)
+		, audio_channels(0)
+		, timecode(0)
+	{
+	}
+};
+
+// The last frames of a channel in a ring of preallocated slots, written by a replay consumer and read by any 
+// number of replay producers. Frames are numbered from 0 in the order they are recorded, and frame n is kept in 
+// slot n % capacity until frame n + capacity replaces it.
+//
+// The slots are in memory, or in a file which is written with overlapped unbuffered I/O so that the disk is 
+// never waited on. A frame which finds its slot's previous write still pending is dropped, its number stays in
+// the ring without an image and playback repeats the frame before it.
+class replay_buffer : boost::noncopyable
+{
+public:
+	// capacity is in frames, path is the file of the slots or empty to keep them in memory.
+	replay_buffer(const std::wstring& name, const video_format_desc& format_desc, uint32_t capacity, const std::wstring& path, bool compressed);
+	~replay_buffer();
+
+	void write(read_frame& frame); // Called by a single thread.
+
+	// Copies the image of frame n to image_size() bytes at image and returns true if it is still in the ring.
+	bool read(int64_t n, uint8_t* image, replay_frame& frame) const; 
+
+	uint32_t image_size() const; // Of bgra, or of dxt5 blocks when compressed.
+
+	int64_t recorded() const; // Frames recorded so far, the newest is recorded() - 1.
+	int64_t oldest() const; // The oldest frame which can be read.
+	int64_t dropped() const;
+	uint32_t capacity() const;
+	bool compressed() const;
+	const video_format_desc& format_desc() const;
+	const std::wstring& name() const;
+	boost::property_tree::wptree info() const;
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+// Replaces the buffer registered under its name. Producers find it by the name, and keep a buffer alive for as 
+// long as they play it.
+void register_replay_buffer(const std::shared_ptr<replay_buffer>& buffer);
+std::shared_ptr<replay_buffer> find_replay_buffer(const std::wstring& name);
+
+}}
@@ -0,0 +1,194 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../StdAfx.h"
+
+#include "replay_consumer.h"
+#include "replay_buffer.h"
+
+#include <core/mixer/read_frame.h>
+#include <core/parameters/parameters.h>
+#include <core/video_format.h>
+
+#include <common/concurrency/executor.h>
+#include <common/concurrency/future_util.h>
+#include <common/diagnostics/graph.h>
+#include <common/log/log.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+namespace caspar { namespace core {
+
+static const size_t MAX_QUEUED_FRAMES = 2;
+
+struct replay_consumer : public frame_consumer
+{
+	const std::wstring				name_;
+	const double					seconds_;
+	const std::wstring				path_;
+	const bool						compressed_;
+
+	std::shared_ptr<replay_buffer>	buffer_;
+	video_format_desc				format_desc_;
+	tbb::atomic<int>				skipped_; // Frames not queued since the last write.
+
+	safe_ptr<diagnostics::graph>	graph_;
+	boost::timer					frame_timer_;
+	executor						executor_;
+
+public:
+	replay_consumer(const std::wstring& name, double seconds, const std::wstring& path, bool compressed)
+		: name_(name)
+		, seconds_(std::max(1.0, seconds))
+		, path_(path)
+		, compressed_(compressed)
+		, executor_(L"replay_consumer")
+	{
+		skipped_ = 0;
+
+		graph_->set_text(print());
+		graph_->set_color("frame-time", diagnostics::color(0.5f, 1.0f, 0.2f));
+		graph_->set_color("dropped-frame", diagnostics::color(0.3f, 0.6f, 0.3f));
+		diagnostics::register_graph(graph_);
+	}
+
+	~replay_consumer()
+	{
+		executor_.invoke([=]
+		{
+			buffer_.reset();
+		});
+	}
+
+	// A frame which cannot be queued still takes its place in the ring, without an image, so that playback 
+	// keeps the timing of the recording.
+	void write(const safe_ptr<read_frame>& frame)
+	{
+		frame_timer_.restart();
+
+		read_frame empty;
+		for(int skipped = skipped_.fetch_and_store(0); skipped > 0; --skipped)
+			buffer_->write(empty);
+
+		buffer_->write(*frame);
+
+		graph_->set_value("frame-time", frame_timer_.elapsed() * format_desc_.fps * 0.5);
+	}
+
+	// frame_consumer
+	
+	virtual void initialize(const video_format_desc& format_desc, int) override
+	{
+		executor_.invoke([=]
+		{
+			buffer_.reset();
+			format_desc_	= format_desc;
+			buffer_			= std::make_shared<replay_buffer>(name_, format_desc, static_cast<uint32_t>(seconds_ * format_desc.fps), path_, compressed_);
+			register_replay_buffer(buffer_);
+		});
+	}
+
+	// Recording never holds up the channel, the frame is written on the consumer's thread.
+	virtual boost::unique_future<bool> send(const safe_ptr<read_frame>& frame) override
+	{
+		if(executor_.size() >= MAX_QUEUED_FRAMES)
+		{
+			++skipped_;
+			graph_->set_tag("dropped-frame");
+			return wrap_as_future(true);
+		}
+
+		executor_.begin_invoke([=]
+		{
+			if(buffer_)
+				write(frame);
+		});
+
+		return wrap_as_future(true);
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"replay[" + name_ + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type", L"replay-consumer");
+		info.add(L"name", name_);
+		info.add(L"seconds", seconds_);
+
+		auto buffer = find_replay_buffer(name_);
+		if(buffer)
+			info.add_child(L"buffer", buffer->info());
+
+		return info;
+	}
+
+	virtual uint32_t buffer_depth() const override
+	{
+		return 0;
+	}
+
+	// The name tells several of them apart.
+	virtual int index() const override
+	{
+		return REPLAY_CONSUMER_BASE_INDEX + static_cast<int>(boost::hash<std::wstring>()(name_) % 100);
+	}
+
+	virtual int64_t presentation_frame_age_millis() const override
+	{
+		return 0;
+	}
+
+	virtual bool has_synchronization_clock() const override
+	{
+		return false;
+	}
+};
+
+safe_ptr<frame_consumer> create_replay_consumer(const parameters& params)
+{
+	if(params.size() < 1 || params[0] != L"REPLAY")
+		return frame_consumer::empty();
+
+	return make_safe<replay_consumer>(
+			params.get_original(L"NAME", L"replay"),
+			params.get(L"SECONDS", 60.0),
+			params.get_original(L"PATH", L""),
+			params.has(L"COMPRESS"));
+}
+
+safe_ptr<frame_consumer> create_replay_consumer(const boost::property_tree::wptree& ptree)
+{
+	return make_safe<replay_consumer>(
+			ptree.get(L"name", L"replay"),
+			ptree.get(L"seconds", 60.0),
+			ptree.get(L"path", L""),
+			ptree.get(L"compress", false));
+}
+
+}}
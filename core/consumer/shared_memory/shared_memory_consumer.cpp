@@ -0,0 +1,286 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../StdAfx.h"
+
+#include "shared_memory_consumer.h"
+
+#include <core/mixer/read_frame.h>
+#include <core/parameters/parameters.h>
+#include <core/video_format.h>
+
+#include <common/concurrency/executor.h>
+#include <common/diagnostics/graph.h>
+#include <common/exception/exceptions.h>
+#include <common/exception/win32_exception.h>
+#include <common/log/log.h>
+#include <common/memory/memcpy.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+
+#include <windows.h>
+
+namespace caspar { namespace core {
+
+static const uint32_t PAGE_SIZE =	4096;
+
+static uint32_t align(uint32_t size, uint32_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+struct shared_memory_consumer : public frame_consumer
+{
+	const std::wstring				configured_name_;
+	const uint32_t					slot_count_;
+
+	std::wstring					name_;
+	video_format_desc				format_desc_;
+	HANDLE							mapping_;
+	shared_memory::header*			header_;
+	uint8_t*						data_;
+	uint32_t						max_audio_samples_;
+	int64_t							frame_number_;
+	tbb::atomic<int64_t>			published_;
+
+	safe_ptr<diagnostics::graph>	graph_;
+	boost::timer					frame_timer_;
+	executor						executor_;
+
+public:
+	shared_memory_consumer(const std::wstring& name, uint32_t slot_count)
+		: configured_name_(name)
+		, slot_count_(std::max(2u, std::min(shared_memory::MAX_SLOTS, slot_count)))
+		, mapping_(nullptr)
+		, header_(nullptr)
+		, data_(nullptr)
+		, max_audio_samples_(0)
+		, frame_number_(0)
+		, executor_(L"shared_memory_consumer")
+	{
+		published_ = 0;
+
+		graph_->set_text(print());
+		graph_->set_color("frame-time", diagnostics::color(0.5f, 1.0f, 0.2f));
+		diagnostics::register_graph(graph_);
+	}
+
+	~shared_memory_consumer()
+	{
+		executor_.invoke([=]
+		{
+			close();
+		});
+	}
+
+	void open(const video_format_desc& format_desc)
+	{
+		auto pitch				= format_desc.width * 4;
+		auto image_size			= pitch * format_desc.height;
+		auto max_cadence		= format_desc.audio_cadence.empty() ? format_desc.audio_sample_rate : *std::max_element(format_desc.audio_cadence.begin(), format_desc.audio_cadence.end());
+		max_audio_samples_		= max_cadence * shared_memory::MAX_CHANNELS;
+		auto audio_offset		= align(image_size, 64);
+		auto slot_size			= align(audio_offset + max_audio_samples_ * sizeof(int32_t), PAGE_SIZE);
+		auto header_size		= align(sizeof(shared_memory::header), PAGE_SIZE);
+		auto size				= static_cast<uint64_t>(header_size) + static_cast<uint64_t>(slot_size) * slot_count_;
+
+		// Readers may keep a mapping of an earlier run open, which is used as it is if it is large enough.
+		mapping_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFF), name_.c_str());
+		if(!mapping_)
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not create the file mapping.") << arg_value_info(narrow(name_)));
+		if(GetLastError() == ERROR_ALREADY_EXISTS)
+			CASPAR_LOG(info) << print() << L" Reusing the existing mapping.";
+
+		header_ = static_cast<shared_memory::header*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(size)));
+		if(!header_)
+		{
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not map the file mapping, an existing one may be too small.") << arg_value_info(narrow(name_)));
+		}
+		data_ = reinterpret_cast<uint8_t*>(header_) + header_size;
+
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+
+		// Readers go by the magic and write_sequence, the geometry is written before either.
+		InterlockedExchange(reinterpret_cast<volatile LONG*>(&header_->magic), 0);
+		InterlockedExchange64(&header_->write_sequence, 0);
+		for(uint32_t n = 0; n < shared_memory::MAX_SLOTS; ++n)
+			InterlockedExchange64(&header_->slots[n].sequence, 0);
+
+		header_->version				= shared_memory::VERSION;
+		header_->header_size			= header_size;
+		header_->slot_count				= slot_count_;
+		header_->slot_size				= slot_size;
+		header_->audio_offset			= audio_offset;
+		header_->width					= format_desc.width;
+		header_->height					= format_desc.height;
+		header_->pitch					= pitch;
+		header_->field_mode				= format_desc.field_mode;
+		header_->time_scale				= format_desc.time_scale;
+		header_->duration				= format_desc.duration;
+		header_->audio_sample_rate		= format_desc.audio_sample_rate;
+		header_->reserved				= 0;
+		header_->performance_frequency	= frequency.QuadPart;
+
+		InterlockedExchange(reinterpret_cast<volatile LONG*>(&header_->magic), shared_memory::MAGIC);
+
+		frame_number_	= 0;
+		format_desc_	= format_desc;
+
+		CASPAR_LOG(info) << print() << L" Publishing " << slot_count_ << L" slots of " << slot_size / 1024 << L" KB.";
+	}
+
+	void close()
+	{
+		if(header_)
+		{
+			InterlockedExchange(reinterpret_cast<volatile LONG*>(&header_->magic), 0);
+			UnmapViewOfFile(header_);
+		}
+		if(mapping_)
+			CloseHandle(mapping_);
+
+		header_		= nullptr;
+		data_		= nullptr;
+		mapping_	= nullptr;
+	}
+
+	void publish(read_frame& frame)
+	{
+		auto n		= frame_number_++;
+		auto index	= static_cast<uint32_t>(n % slot_count_);
+		auto& slot	= header_->slots[index];
+		auto data	= data_ + static_cast<size_t>(index) * header_->slot_size;
+
+		InterlockedExchange64(&slot.sequence, 2 * n + 1);
+
+		auto image		= frame.image_data();
+		auto image_size = image.size() == header_->pitch * header_->height ? static_cast<uint32_t>(image.size()) : 0;
+		if(image_size > 0)
+			fast_memcpy(data, image.begin(), image_size);
+
+		auto audio			= frame.audio_data();
+		auto audio_samples	= std::min(static_cast<uint32_t>(audio.size()), max_audio_samples_);
+		std::memcpy(data + header_->audio_offset, audio.begin(), audio_samples * sizeof(int32_t));
+
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+
+		slot.frame_number	= n;
+		slot.timestamp		= now.QuadPart;
+		slot.timecode		= frame.get_timecode();
+		slot.image_size		= image_size;
+		slot.audio_samples	= audio_samples;
+		slot.audio_channels = frame.num_channels();
+
+		InterlockedExchange64(&slot.sequence, 2 * (n + 1));
+		InterlockedExchange64(&header_->write_sequence, n + 1);
+
+		++published_;
+	}
+
+	// frame_consumer
+	
+	virtual void initialize(const video_format_desc& format_desc, int channel_index) override
+	{
+		executor_.invoke([=]
+		{
+			close();
+			name_ = configured_name_.empty() ? L"Local\\casparcg-channel-" + boost::lexical_cast<std::wstring>(channel_index) : configured_name_;
+			open(format_desc);
+		});
+		graph_->set_text(print());
+	}
+
+	virtual boost::unique_future<bool> send(const safe_ptr<read_frame>& frame) override
+	{
+		return executor_.begin_invoke([=]() -> bool
+		{
+			frame_timer_.restart();
+
+			if(header_)
+				publish(*frame);
+
+			graph_->set_value("frame-time", frame_timer_.elapsed() * format_desc_.fps * 0.5);
+			return true;
+		});
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"shared-memory[" + (name_.empty() ? configured_name_ : name_) + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",		L"shared-memory-consumer");
+		info.add(L"name",		name_);
+		info.add(L"slots",		slot_count_);
+		info.add(L"frames",		published_);
+		return info;
+	}
+
+	virtual uint32_t buffer_depth() const override
+	{
+		return 0;
+	}
+
+	// The name tells several of them on a channel apart.
+	virtual int index() const override
+	{
+		return SHARED_MEMORY_CONSUMER_BASE_INDEX + static_cast<int>(boost::hash<std::wstring>()(configured_name_) % 100);
+	}
+
+	virtual int64_t presentation_frame_age_millis() const override
+	{
+		return 0;
+	}
+
+	virtual bool has_synchronization_clock() const override
+	{
+		return false;
+	}
+};
+
+safe_ptr<frame_consumer> create_shared_memory_consumer(const parameters& params)
+{
+	if(params.size() < 1 || params[0] != L"SHARED_MEMORY")
+		return frame_consumer::empty();
+
+	return make_safe<shared_memory_consumer>(params.get_original(L"NAME", L""), params.get(L"SLOTS", 4u));
+}
+
+safe_ptr<frame_consumer> create_shared_memory_consumer(const boost::property_tree::wptree& ptree)
+{
+	return make_safe<shared_memory_consumer>(ptree.get(L"name", L""), ptree.get(L"slots", 4u));
+}
+
+}}
@@ -0,0 +1,91 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "../frame_consumer.h"
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace caspar { namespace core {
+
+class parameters;
+
+// The layout of the named file mapping a shared_memory_consumer publishes, for the processes that map it.
+//
+// Frame n is written to slot n % slot_count. The slot's sequence is odd while it is written and 2 * (n + 1) once 
+// frame n is in it, after which write_sequence is n + 1. A reader takes the slot of write_sequence - 1, reads its
+// sequence, uses the data in place, and reads the sequence again; the frame is valid if both reads are the same
+// even value. The writer never waits, readers that fall more than slot_count frames behind see a changed sequence
+// and skip to the latest frame.
+namespace shared_memory {
+
+static const uint32_t MAGIC			= 0x4D485343; // "CSHM"
+static const uint32_t VERSION		= 1;
+static const uint32_t MAX_SLOTS		= 16;
+static const uint32_t MAX_CHANNELS	= 16;
+
+#pragma pack(push, 8)
+
+struct slot
+{
+	volatile int64_t	sequence;
+	int64_t				frame_number;
+	int64_t				timestamp;			// QueryPerformanceCounter when the frame was published.
+	int32_t				timecode;
+	uint32_t			image_size;			// Bytes of bgra, 0 if the frame had no image.
+	uint32_t			audio_samples;		// Interleaved int32 samples, all channels.
+	uint32_t			audio_channels;
+};
+
+struct header
+{
+	uint32_t			magic;
+	uint32_t			version;
+	uint32_t			header_size;		// Offset of the data of slot 0, the data of slot i is at header_size + i * slot_size.
+	uint32_t			slot_count;
+	uint32_t			slot_size;
+	uint32_t			audio_offset;		// Of the audio in a slot's data, the image is at 0.
+	uint32_t			width;
+	uint32_t			height;
+	uint32_t			pitch;				// Bytes per image row.
+	uint32_t			field_mode;			// core::field_mode::type
+	uint32_t			time_scale;
+	uint32_t			duration;
+	uint32_t			audio_sample_rate;
+	uint32_t			reserved;
+	int64_t				performance_frequency;
+	volatile int64_t	write_sequence;
+	slot				slots[MAX_SLOTS];
+};
+
+#pragma pack(pop)
+
+}
+
+// SHARED_MEMORY [NAME name] [SLOTS 4]. The mapping is Local\casparcg-channel-<n> unless it is named.
+safe_ptr<frame_consumer> create_shared_memory_consumer(const parameters& params);
+safe_ptr<frame_consumer> create_shared_memory_consumer(const boost::property_tree::wptree& ptree);
+
+}}
@@ -25,9 +25,12 @@
 
 #include <common/log/log.h>
 #include <common/diagnostics/graph.h>
+#include <common/concurrency/executor.h>
 #include <common/concurrency/future_util.h>
+#include <common/utility/timer.h>
 
 #include <core/video_format.h>
+#include <core/mixer/read_frame.h>
 
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/range/algorithm/min_element.hpp>
@@ -38,9 +41,10 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/thread/future.hpp>
 
+#include <cstdlib>
+#include <deque>
 #include <functional>
 #include <vector>
-#include <queue>
 #include <utility>
 
 #include <tbb/atomic.h>
@@ -105,6 +109,11 @@ public:
 		return get_delegate().buffer_depth();
 	}
 
+	virtual uint32_t held_frames() const override
+	{
+		return get_delegate().held_frames();
+	}
+
 	virtual int index() const override
 	{
 		return get_delegate().index();
@@ -124,86 +133,119 @@ const std::vector<int>& diag_colors()
 	return colors;
 }
 
-class buffering_consumer_adapter : public delegating_frame_consumer
+// Sends the frames to one consumer on a thread of its own, each at the time it is scheduled for. Whole frames of 
+// delay are a line of references to earlier frames, the rest of a frame is waited before the send.
+class scheduling_consumer_adapter : public delegating_frame_consumer
 {
-	std::queue<safe_ptr<read_frame>>	buffer_;
-	tbb::atomic<uint32_t>					buffered_;
-	tbb::atomic<int64_t>				duplicate_next_;
+	executor								executor_;
+	high_prec_timer							timer_;
+	std::deque<safe_ptr<read_frame>>		delay_line_;
+	tbb::atomic<int64_t>					delay_;			// microseconds, set by the synchronizing consumer
+	tbb::atomic<int64_t>					applied_delay_;	// microseconds, of the frame sent last
+	boost::unique_future<bool>				result_;
 public:
-	buffering_consumer_adapter(const safe_ptr<frame_consumer>& consumer)
+	scheduling_consumer_adapter(const safe_ptr<frame_consumer>& consumer)
 		: delegating_frame_consumer(consumer)
+		, executor_(L"synchronized " + consumer->print())
 	{
-		buffered_ = 0;
-		duplicate_next_ = 0;
+		delay_ = 0;
+		applied_delay_ = 0;
 	}
 
-	boost::unique_future<bool> consume_one()
+	void dispatch(const safe_ptr<read_frame>& frame, int64_t frame_duration)
 	{
-		if (!buffer_.empty())
+		auto delay = static_cast<int64_t>(delay_);
+
+		result_ = executor_.begin_invoke([=]() -> bool
 		{
-			buffer_.pop();
-			--buffered_;
-		}
+			auto delay_frames = static_cast<size_t>(delay / frame_duration);
+
+			delay_line_.push_back(frame);
+			while (delay_line_.size() > delay_frames + 1)
+				delay_line_.pop_front();
 
-		return get_delegate().send(buffer_.front());
+			// A line still shorter than the delay sends its first frame once more, which is the only way a 
+			// consumer falls back by a whole frame.
+			auto rest = delay - static_cast<int64_t>(delay_frames) * frame_duration;
+			if (rest > 0)
+				timer_.wait_for(rest / 1000000.0);
+
+			applied_delay_ = static_cast<int64_t>(delay_line_.size() - 1) * frame_duration + rest;
+
+			return get_delegate().send(delay_line_.front()).get();
+		});
 	}
 
-	virtual boost::unique_future<bool> send(
-			const safe_ptr<read_frame>& frame) override
+	// Waits for the frame dispatched last, rethrowing what its send threw.
+	bool wait_sent()
 	{
-		if (duplicate_next_)
+		if (result_.get_state() == boost::future_state::uninitialized)
+			return true;
+
+		auto result = std::move(result_);
+		return result.get();
+	}
+
+	virtual void initialize(const video_format_desc& format_desc, int channel_index) override
+	{
+		try
 		{
-			--duplicate_next_;
+			wait_sent();
 		}
-		else if (!buffer_.empty())
+		catch (...)
 		{
-			buffer_.pop();
-			--buffered_;
 		}
 
-		buffer_.push(frame);
-		++buffered_;
+		executor_.invoke([&]
+		{
+			delay_line_.clear();
+			applied_delay_ = 0;
+			get_delegate().initialize(format_desc, channel_index);
+		});
+	}
 
-		return get_delegate().send(buffer_.front());
+	void set_delay(int64_t delay)
+	{
+		delay_ = delay;
 	}
 
-	void duplicate_next(int64_t to_duplicate)
+	int64_t delay() const
 	{
-		duplicate_next_ += to_duplicate;
+		return delay_;
 	}
 
-	uint32_t num_buffered() const
+	int64_t applied_delay() const
 	{
-		return buffered_ - 1;
+		return applied_delay_;
 	}
 
 	virtual std::wstring print() const override
 	{
-		return L"buffering[" + get_delegate().print() + L"]";
+		return L"scheduled[" + get_delegate().print() + L"]";
 	}
 
 	virtual boost::property_tree::wptree info() const override
 	{
 		boost::property_tree::wptree info;
 
-		info.add(L"type", L"buffering-consumer-adapter");
+		info.add(L"type", L"scheduling-consumer-adapter");
 		info.add_child(L"consumer", get_delegate().info());
-		info.add(L"buffered-frames", num_buffered());
+		info.add(L"delay", static_cast<double>(applied_delay_) / 1000.0); // ms
 
 		return info;
 	}
 };
 
-static const uint64_t MAX_BUFFERED_OUT_OF_MEMORY_GUARD = 5;
+// Frames held back for the consumers with the least latency at most.
+static const int64_t MAX_DELAY_FRAMES = 5;
 
 struct synchronizing_consumer::implementation
 {
 private:
-	std::vector<safe_ptr<buffering_consumer_adapter>>	consumers_;
-	uint32_t												buffer_depth_;
+	std::vector<safe_ptr<scheduling_consumer_adapter>>	consumers_;
+	uint32_t											buffer_depth_;
+	uint32_t											held_frames_;
 	bool												has_synchronization_clock_;
-	std::vector<boost::unique_future<bool>>				results_;
-	boost::promise<bool>								promise_;
 	video_format_desc									format_desc_;
 	safe_ptr<diagnostics::graph>						graph_;
 	int64_t												grace_period_;
@@ -213,121 +255,101 @@ public:
 		: grace_period_(0)
 	{
 		BOOST_FOREACH(auto& consumer, consumers)
-			consumers_.push_back(make_safe<buffering_consumer_adapter>(consumer));
+			consumers_.push_back(make_safe<scheduling_consumer_adapter>(consumer));
 
 		current_diff_ = 0;
 		auto buffer_depths = consumers | transformed(std::mem_fn(&frame_consumer::buffer_depth));
 		std::vector<uint32_t> depths(buffer_depths.begin(), buffer_depths.end());
 		buffer_depth_ = *boost::max_element(depths);
+		auto held = consumers | transformed(std::mem_fn(&frame_consumer::held_frames));
+		std::vector<uint32_t> held_frames(held.begin(), held.end());
+		held_frames_ = *boost::max_element(held_frames) + static_cast<uint32_t>(MAX_DELAY_FRAMES) + 1;
 		has_synchronization_clock_ = boost::count_if(consumers, std::mem_fn(&frame_consumer::has_synchronization_clock)) > 0;
 
 		diagnostics::register_graph(graph_);
 	}
 
+	// Every consumer is sent the frame at the same time, on its own thread, and has at most one frame in flight. 
+	// The channel waits for the slowest of them one frame later instead of for each in turn.
 	boost::unique_future<bool> send(const safe_ptr<read_frame>& frame)
 	{
-		results_.clear();
-
 		BOOST_FOREACH(auto& consumer, consumers_)
-			results_.push_back(consumer->send(frame));
-
-		promise_ = boost::promise<bool>();
-		promise_.set_wait_callback(std::function<void(boost::promise<bool>&)>([this](boost::promise<bool>& promise)
-		{
-			BOOST_FOREACH(auto& result, results_)
-			{
-				result.get();
-			}
-
-			auto frame_ages = consumers_ | transformed(std::mem_fn(&frame_consumer::presentation_frame_age_millis));
-			std::vector<int64_t> ages(frame_ages.begin(), frame_ages.end());
-			auto max_age_iter = boost::max_element(ages);
-			auto min_age_iter = boost::min_element(ages);
-			int64_t min_age = *min_age_iter;
-			
-			if (min_age == 0)
-			{
-				// One of the consumers have yet no measurement, wait until next 
-				// frame until we make any assumptions.
-				promise.set_value(true);
-				return;
-			}
+			consumer->wait_sent();
 
-			int64_t max_age = *max_age_iter;
-			int64_t age_diff = max_age - min_age;
+		schedule();
 
-			current_diff_ = age_diff;
+		auto frame_duration = static_cast<int64_t>(1000000.0 / format_desc_.fps);
 
-			for (unsigned i = 0; i < ages.size(); ++i)
-				graph_->set_value(
-						narrow(consumers_[i]->print()),
-						static_cast<double>(ages[i]) / *max_age_iter);
-
-			bool grace_period_over = grace_period_ == 1;
+		BOOST_FOREACH(auto& consumer, consumers_)
+			consumer->dispatch(frame, frame_duration);
 
-			if (grace_period_)
-				--grace_period_;
+		return wrap_as_future(true);
+	}
 
-			if (grace_period_ == 0)
-			{
-				int64_t frame_duration = static_cast<int64_t>(1000 / format_desc_.fps);
+	// Every consumer is delayed by how much less latency it has than the slowest one, so that they all display a 
+	// frame at the same time. The latency of a consumer is its presentation age less the delay it was sent with.
+	void schedule()
+	{
+		auto frame_ages = consumers_ | transformed(std::mem_fn(&frame_consumer::presentation_frame_age_millis));
+		std::vector<int64_t> ages(frame_ages.begin(), frame_ages.end());
+		int64_t min_age = *boost::min_element(ages);
+		int64_t max_age = *boost::max_element(ages);
 
-				if (age_diff >= frame_duration)
-				{
-					CASPAR_LOG(info) << print() << L" Consumers not in sync. min: " << min_age << L" max: " << max_age;
+		if (min_age == 0)
+		{
+			// One of the consumers have yet no measurement, wait until next 
+			// frame until we make any assumptions.
+			return;
+		}
 
-					auto index = min_age_iter - ages.begin();
-					auto to_duplicate = age_diff / frame_duration;
-					auto& consumer = *consumers_.at(index);
+		current_diff_ = max_age - min_age;
 
-					auto currently_buffered = consumer.num_buffered();
+		for (unsigned i = 0; i < ages.size(); ++i)
+			graph_->set_value(
+					narrow(consumers_[i]->print()),
+					static_cast<double>(ages[i]) / max_age);
 
-					if (currently_buffered + to_duplicate > MAX_BUFFERED_OUT_OF_MEMORY_GUARD)
-					{
-						CASPAR_LOG(info) << print() << L" Protecting from out of memory. Duplicating less frames than calculated";
+		bool grace_period_over = grace_period_ == 1;
 
-						to_duplicate = MAX_BUFFERED_OUT_OF_MEMORY_GUARD - currently_buffered;
-					}
+		if (grace_period_)
+			--grace_period_;
 
-					consumer.duplicate_next(to_duplicate);
+		if (grace_period_)
+			return;
 
-					grace_period_ = 10 + to_duplicate + buffer_depth_;
-				}
-				else if (grace_period_over)
-				{
-					CASPAR_LOG(info) << print() << L" Consumers resynced. min: " << min_age << L" max: " << max_age;
-				}
-			}
+		std::vector<int64_t> latencies;
+		for (unsigned i = 0; i < ages.size(); ++i)
+			latencies.push_back(ages[i] * 1000 - consumers_[i]->applied_delay());
 
-			blocking_consume_unnecessarily_buffered();
+		auto target = *boost::max_element(latencies);
+		auto max_delay = static_cast<int64_t>(MAX_DELAY_FRAMES * 1000000.0 / format_desc_.fps);
+		bool changed = false;
 
-			promise.set_value(true);
-		}));
+		for (unsigned i = 0; i < latencies.size(); ++i)
+		{
+			auto delay = std::min(target - latencies[i], max_delay);
 
-		return promise_.get_future();
-	}
+			// Presentation ages are in whole milliseconds.
+			if (std::abs(delay - consumers_[i]->delay()) <= 1000)
+				continue;
 
-	void blocking_consume_unnecessarily_buffered()
-	{
-		auto buffered = consumers_ | transformed(std::mem_fn(&buffering_consumer_adapter::num_buffered));
-		std::vector<uint32_t> num_buffered(buffered.begin(), buffered.end());
-		auto min_buffered = *boost::min_element(num_buffered);
+			if (delay == max_delay)
+				CASPAR_LOG(info) << print() << L" Protecting from out of memory. Delaying " << consumers_[i]->print() << L" less than calculated";
 
-		if (min_buffered)
-			CASPAR_LOG(info) << print() << L" " << min_buffered 
-					<< L" frames unnecessarily buffered. Consuming and letting channel pause during that time.";
+			consumers_[i]->set_delay(delay);
+			changed = true;
+		}
 
-		while (min_buffered)
+		if (changed)
 		{
-			std::vector<boost::unique_future<bool>> results;
+			CASPAR_LOG(info) << print() << L" Consumers not in sync. min: " << min_age << L" max: " << max_age;
 
-			BOOST_FOREACH(auto& consumer, consumers_)
-				results.push_back(consumer->consume_one());
-
-			BOOST_FOREACH(auto& result, results)
-				result.get();
-
-			--min_buffered;
+			// Until the frames sent with the new delays are the ones being presented.
+			grace_period_ = 2 + buffer_depth_;
+		}
+		else if (grace_period_over)
+		{
+			CASPAR_LOG(info) << print() << L" Consumers resynced. min: " << min_age << L" max: " << max_age;
 		}
 	}
 
@@ -344,6 +366,7 @@ public:
 
 		graph_->set_text(print());
 		format_desc_ = format_desc;
+		grace_period_ = 0;
 	}
 
 	int64_t presentation_frame_age_millis() const
@@ -385,6 +408,11 @@ public:
 		return buffer_depth_;
 	}
 
+	uint32_t held_frames() const
+	{
+		return held_frames_;
+	}
+
 	int index() const
 	{
 		return boost::accumulate(consumers_ | transformed(std::mem_fn(&frame_consumer::index)), 10000);
@@ -431,6 +459,11 @@ uint32_t synchronizing_consumer::buffer_depth() const
 	return impl_->buffer_depth();
 }
 
+uint32_t synchronizing_consumer::held_frames() const
+{
+	return impl_->held_frames();
+}
+
 int synchronizing_consumer::index() const
 {
 	return impl_->index();
@@ -45,6 +45,7 @@ public:
 	virtual boost::property_tree::wptree info() const override;
 	virtual bool has_synchronization_clock() const override;
 	virtual uint32_t buffer_depth() const override;
+	virtual uint32_t held_frames() const override;
 	virtual int index() const override;
 private:
 	struct implementation;
@@ -0,0 +1,239 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "stdafx.h"
+
+#include "load_governor.h"
+
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <array>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const std::size_t num_degradations = 5;
+
+const struct
+{
+	degradation::type	type;
+	const wchar_t*		name;
+} degradation_names[num_degradations] =
+{
+	{degradation::cheap_deinterlace,	L"cheap-deinterlace"},
+	{degradation::fast_scaling,			L"fast-scaling"},
+	{degradation::static_layers,		L"static-layers"},
+	{degradation::osc_rate,				L"osc-rate"},
+	{degradation::thumbnails,			L"thumbnails"}
+};
+
+// How many channels have each degradation in effect.
+std::array<tbb::atomic<int>, num_degradations>& active_counts()
+{
+	static std::array<tbb::atomic<int>, num_degradations> counts;
+	return counts;
+}
+
+void count(int degradations, int delta)
+{
+	for(std::size_t n = 0; n < num_degradations; ++n)
+	{
+		if(degradations & degradation_names[n].type)
+			active_counts()[n].fetch_and_add(delta);
+	}
+}
+
+}
+
+degradation::type degradation::parse(const std::wstring& name)
+{
+	BOOST_FOREACH(auto& entry, degradation_names)
+	{
+		if(boost::iequals(name, entry.name))
+			return entry.type;
+	}
+
+	return none;
+}
+
+std::wstring degradation::print(int degradations)
+{
+	std::wstring result;
+
+	BOOST_FOREACH(auto& entry, degradation_names)
+	{
+		if(degradations & entry.type)
+			result += (result.empty() ? L"" : L",") + std::wstring(entry.name);
+	}
+
+	return result.empty() ? L"none" : result;
+}
+
+load_governor_config::load_governor_config()
+	: enabled(false)
+	, high_load(0.9)
+	, low_load(0.6)
+	, shed_frames(10)
+	, restore_frames(250)
+{
+	BOOST_FOREACH(auto& entry, degradation_names)
+		order.push_back(entry.type);
+}
+
+load_governor_config parse_load_governor_config(const boost::property_tree::wptree& ptree)
+{
+	load_governor_config config;
+	config.enabled			= ptree.get(L"enabled", true);
+	config.high_load		= ptree.get(L"high-load", config.high_load);
+	config.low_load			= std::min(config.high_load, ptree.get(L"low-load", config.low_load));
+	config.shed_frames		= std::max(1, ptree.get(L"shed-frames", config.shed_frames));
+	config.restore_frames	= std::max(1, ptree.get(L"restore-frames", config.restore_frames));
+
+	auto order = ptree.get(L"order", L"");
+	if(!order.empty())
+	{
+		config.order.clear();
+
+		std::vector<std::wstring> names;
+		boost::split(names, order, boost::is_any_of(L","));
+		BOOST_FOREACH(auto name, names)
+		{
+			boost::trim(name);
+			auto type = degradation::parse(name);
+			if(type == degradation::none)
+				CASPAR_LOG(warning) << L"[load_governor] Unknown degradation " << name << L", ignored.";
+			else
+				config.order.push_back(type);
+		}
+	}
+
+	return config;
+}
+
+struct load_governor::implementation : boost::noncopyable
+{
+	const std::wstring					name_;
+	safe_ptr<monitor::subject>			monitor_subject_;
+
+	tbb::spin_mutex						mutex_;
+	load_governor_config				config_;
+	std::size_t							level_;		// Steps of the order in effect.
+	int									frames_over_;
+	int									frames_under_;
+	tbb::atomic<int>					active_;
+
+	implementation(const std::wstring& name)
+		: name_(name)
+		, monitor_subject_(make_safe<monitor::subject>("/governor"))
+		, level_(0)
+		, frames_over_(0)
+		, frames_under_(0)
+	{
+		active_ = degradation::none;
+	}
+
+	~implementation()
+	{
+		count(active_, -1);
+	}
+
+	void set_config(const load_governor_config& config)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		config_ = config;
+		set_level(config_.enabled ? std::min(level_, config_.order.size()) : 0);
+	}
+
+	void update(double load)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		if(!config_.enabled)
+			return;
+
+		frames_over_	= load > config_.high_load ? frames_over_ + 1 : 0;
+		frames_under_	= load < config_.low_load  ? frames_under_ + 1 : 0;
+
+		if(frames_over_ >= config_.shed_frames && level_ < config_.order.size())
+			set_level(level_ + 1);
+		else if(frames_under_ >= config_.restore_frames && level_ > 0)
+			set_level(level_ - 1);
+	}
+
+	void set_level(std::size_t level)
+	{
+		frames_over_	= 0;
+		frames_under_	= 0;
+
+		int active = degradation::none;
+		for(std::size_t n = 0; n < level; ++n)
+			active |= config_.order[n];
+
+		bool shed = level > level_;
+		level_ = level;
+
+		int previous = active_.fetch_and_store(active);
+		if(previous == active)
+			return;
+
+		count(previous, -1);
+		count(active, +1);
+
+		auto changed = degradation::print(shed ? active & ~previous : previous & ~active);
+		if(shed)
+			CASPAR_LOG(warning) << name_ << L" [load_governor] Over budget, shedding " << changed << L".";
+		else
+			CASPAR_LOG(info) << name_ << L" [load_governor] Within budget, restoring " << changed << L".";
+
+		*monitor_subject_	<< monitor::message("/level")			% static_cast<int32_t>(level_)
+							<< monitor::message("/degradations")	% narrow(degradation::print(active));
+	}
+};
+
+load_governor::load_governor(const std::wstring& name) : impl_(new implementation(name)){}
+load_governor::~load_governor(){}
+void load_governor::set_config(const load_governor_config& config){impl_->set_config(config);}
+void load_governor::update(double load){impl_->update(load);}
+int load_governor::active() const{return impl_->active_;}
+monitor::subject& load_governor::monitor_output(){return *impl_->monitor_subject_;}
+
+int load_governor::active_anywhere()
+{
+	int active = degradation::none;
+	for(std::size_t n = 0; n < num_degradations; ++n)
+	{
+		if(active_counts()[n] > 0)
+			active |= degradation_names[n].type;
+	}
+	return active;
+}
+
+}}
@@ -0,0 +1,92 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "monitor/monitor.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <string>
+#include <vector>
+
+namespace caspar { namespace core {
+
+// Work a channel gives up when it runs over its frame budget, see load_governor.
+struct degradation
+{
+	enum type
+	{
+		none				= 0,
+		cheap_deinterlace	= 1 << 0,	// Yadif skips its spatial check.
+		fast_scaling		= 1 << 1,	// The ffmpeg scalers filter fast bilinear.
+		static_layers		= 1 << 2,	// Layers that become static are no longer rendered into the static layer cache.
+		osc_rate			= 1 << 3,	// OSC sends each path at most every osc.degraded-interval.
+		thumbnails			= 1 << 4	// Thumbnail generation pauses.
+	};
+
+	static type parse(const std::wstring& name); // none when unknown.
+	static std::wstring print(int degradations);
+};
+
+struct load_governor_config
+{
+	bool							enabled;
+	std::vector<degradation::type>	order;			// Shed first to last, restored in reverse.
+	double							high_load;		// Of the frame budget, above it for shed_frames sheds the next step.
+	double							low_load;		// Below it for restore_frames restores the last step shed.
+	int								shed_frames;
+	int								restore_frames;
+
+	load_governor_config();
+};
+
+// <enabled> <order>cheap-deinterlace,fast-scaling,...</order> <high-load> <low-load> <shed-frames> <restore-frames>
+load_governor_config parse_load_governor_config(const boost::property_tree::wptree& ptree);
+
+// Sheds the work of a channel step by step, in the configured order, while the channel keeps running over its frame 
+// budget, and takes the steps back once it has been comfortably within it for a while.
+class load_governor : boost::noncopyable
+{
+public:
+	explicit load_governor(const std::wstring& name);
+	~load_governor();
+
+	void set_config(const load_governor_config& config);
+
+	// Called once per frame with the load of the busiest part of the pipeline, 1.0 is the whole frame budget.
+	void update(double load);
+
+	int active() const; // The degradation::type flags in effect.
+
+	// The flags in effect on any channel, for the work that is shared by the channels.
+	static int active_anywhere();
+
+	monitor::subject& monitor_output();
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
@@ -0,0 +1,345 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "stdafx.h"
+
+#include "media_library.h"
+
+#include "producer/media_info/media_info_repository.h"
+
+#include <common/log/log.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
+#include <tbb/spin_rw_mutex.h>
+
+#include <list>
+#include <map>
+
+namespace caspar { namespace core {
+
+// Upper case and with / as separator, so that the index sorts and matches case insensitively.
+std::wstring make_key(const std::wstring& name)
+{
+	auto key = boost::to_upper_copy(name);
+	boost::replace_all(key, L"\\", L"/");
+	boost::trim_if(key, boost::is_any_of(L"/"));
+	return key;
+}
+
+std::wstring get_name(const boost::filesystem::wpath& folder, const boost::filesystem::wpath& file)
+{
+	auto folder_str = folder.file_string();
+	auto relative = boost::filesystem::wpath(file.file_string().substr(std::min(folder_str.size(), file.file_string().size())));
+	auto name = relative.replace_extension(L"").external_file_string();
+	boost::trim_left_if(name, boost::is_any_of(L"\\/"));
+	return name;
+}
+
+bool describe_file(
+		const boost::filesystem::wpath& folder,
+		const boost::filesystem::wpath& file,
+		const library_classifier& classifier,
+		const std::shared_ptr<media_info_repository>& media_info_repo,
+		library_entry& entry)
+{
+	if (!boost::filesystem::is_regular_file(file))
+		return false;
+
+	auto type = classifier(file);
+	if (type.empty())
+		return false;
+
+	entry.path				= file;
+	entry.name				= get_name(folder, file);
+	entry.type				= type;
+	entry.size				= boost::filesystem::file_size(file);
+	entry.last_write_time	= boost::filesystem::last_write_time(file);
+
+	if (media_info_repo)
+		entry.info = media_info_repo->get(file.file_string());
+
+	return true;
+}
+
+bool matches_prefix(const std::wstring& name, const std::wstring& prefix)
+{
+	return boost::starts_with(make_key(name), make_key(prefix));
+}
+
+struct cached_file
+{
+	std::string								content;
+	std::uintmax_t							size;
+	std::time_t								last_write_time;
+	std::list<std::wstring>::iterator		lru_position;
+};
+
+struct media_library::implementation : boost::noncopyable
+{
+	const boost::filesystem::wpath					folder_;
+	const library_classifier						classifier_;
+	const std::shared_ptr<media_info_repository>	media_info_repo_;
+	const std::size_t								cache_bytes_;
+
+	mutable tbb::spin_rw_mutex						mutex_;
+	std::multimap<std::wstring, library_entry>		entries_;
+	tbb::atomic<bool>								is_ready_;
+
+	mutable tbb::mutex								cache_mutex_;
+	mutable std::map<std::wstring, cached_file>		cache_;
+	mutable std::list<std::wstring>					cache_lru_;		// Most recently used first.
+	mutable std::size_t								cached_bytes_;
+
+	std::shared_ptr<filesystem_monitor>				monitor_;
+public:
+	implementation(
+			filesystem_monitor_factory& monitor_factory,
+			const boost::filesystem::wpath& folder,
+			const library_classifier& classifier,
+			const std::shared_ptr<media_info_repository>& media_info_repo,
+			std::size_t cache_bytes)
+		: folder_(folder)
+		, classifier_(classifier)
+		, media_info_repo_(media_info_repo)
+		, cache_bytes_(cache_bytes)
+		, cached_bytes_(0)
+	{
+		is_ready_ = false;
+
+		monitor_ = monitor_factory.create(
+				folder,
+				ALL,
+				true,
+				[this] (filesystem_event event, const boost::filesystem::wpath& file)
+				{
+					this->on_file_event(event, file);
+				},
+				[this] (const std::set<boost::filesystem::wpath>& initial_files) 
+				{
+					this->on_initial_files(initial_files);
+				});
+	}
+
+	~implementation()
+	{
+		monitor_.reset();
+	}
+
+	bool is_ready() const
+	{
+		return is_ready_;
+	}
+
+	std::vector<library_entry> list(const std::wstring& prefix, std::size_t offset, std::size_t count) const
+	{
+		auto key = make_key(prefix);
+		std::vector<library_entry> result;
+
+		tbb::spin_rw_mutex::scoped_lock lock(mutex_, false);
+		
+		for (auto it = entries_.lower_bound(key); it != entries_.end() && result.size() < count; ++it)
+		{
+			if (!boost::starts_with(it->first, key))
+				break;
+
+			if (offset > 0)
+				--offset;
+			else
+				result.push_back(it->second);
+		}
+
+		return result;
+	}
+
+	std::vector<library_entry> find(const std::wstring& file_name) const
+	{
+		std::vector<library_entry> result;
+
+		tbb::spin_rw_mutex::scoped_lock lock(mutex_, false);
+
+		BOOST_FOREACH(auto& entry, entries_)
+		{
+			if (boost::iequals(boost::filesystem::wpath(entry.second.path).replace_extension(L"").filename(), file_name))
+				result.push_back(entry.second);
+		}
+
+		return result;
+	}
+
+	std::string read(const boost::filesystem::wpath& file, const file_reader& reader) const
+	{
+		if (cache_bytes_ == 0 || !boost::filesystem::is_regular_file(file))
+			return reader(file);
+
+		auto key				= make_key(file.file_string());
+		auto size				= boost::filesystem::file_size(file);
+		auto last_write_time	= boost::filesystem::last_write_time(file);
+
+		{
+			tbb::mutex::scoped_lock lock(cache_mutex_);
+
+			auto it = cache_.find(key);
+			if (it != cache_.end())
+			{
+				if (it->second.size == size && it->second.last_write_time == last_write_time)
+				{
+					cache_lru_.splice(cache_lru_.begin(), cache_lru_, it->second.lru_position);
+					return it->second.content;
+				}
+
+				uncache(it);
+			}
+		}
+
+		// Read without the lock so that a miss does not hold up hits on other files.
+		auto content = reader(file);
+		auto bytes = content.size();
+
+		if (content.empty() || bytes > cache_bytes_)
+			return content;
+
+		tbb::mutex::scoped_lock lock(cache_mutex_);
+
+		auto it = cache_.find(key);
+		if (it != cache_.end())
+			uncache(it);
+
+		while (cached_bytes_ + bytes > cache_bytes_)
+			uncache(cache_.find(cache_lru_.back()));
+
+		cache_lru_.push_front(key);
+
+		cached_file& cached		= cache_[key];
+		cached.content			= content;
+		cached.size				= size;
+		cached.last_write_time	= last_write_time;
+		cached.lru_position		= cache_lru_.begin();
+
+		cached_bytes_ += bytes;
+
+		return content;
+	}
+private:
+	// Called with cache_mutex_ held.
+	void uncache(std::map<std::wstring, cached_file>::iterator it) const
+	{
+		cached_bytes_ -= it->second.content.size();
+		cache_lru_.erase(it->second.lru_position);
+		cache_.erase(it);
+	}
+
+	void on_initial_files(const std::set<boost::filesystem::wpath>& initial_files)
+	{
+		is_ready_ = true;
+
+		CASPAR_LOG(info) << L"[media_library] Indexed " << folder_.file_string() << L".";
+	}
+
+	void on_file_event(filesystem_event event, const boost::filesystem::wpath& file)
+	{
+		remove(file);
+
+		if (cache_bytes_ > 0)
+		{
+			tbb::mutex::scoped_lock lock(cache_mutex_);
+
+			auto it = cache_.find(make_key(file.file_string()));
+			if (it != cache_.end())
+				uncache(it);
+		}
+
+		if (event == REMOVED)
+		{
+			if (media_info_repo_)
+				media_info_repo_->remove(file.file_string());
+
+			return;
+		}
+
+		// The repository notices on its own whether the content changed.
+
+		library_entry entry;
+		if (!describe_file(folder_, file, classifier_, media_info_repo_, entry))
+			return;
+
+		auto key = make_key(entry.name);
+
+		tbb::spin_rw_mutex::scoped_lock lock(mutex_, true);
+		entries_.insert(std::make_pair(std::move(key), std::move(entry)));
+	}
+
+	void remove(const boost::filesystem::wpath& file)
+	{
+		auto range_key = make_key(get_name(folder_, file));
+
+		tbb::spin_rw_mutex::scoped_lock lock(mutex_, true);
+
+		auto range = entries_.equal_range(range_key);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second.path == file)
+			{
+				entries_.erase(it);
+				return;
+			}
+		}
+	}
+};
+
+media_library::media_library(
+		filesystem_monitor_factory& monitor_factory,
+		const boost::filesystem::wpath& folder,
+		const library_classifier& classifier,
+		const std::shared_ptr<media_info_repository>& media_info_repo,
+		std::size_t cache_bytes)
+	: impl_(new implementation(monitor_factory, folder, classifier, media_info_repo, cache_bytes))
+{
+}
+
+media_library::~media_library()
+{
+}
+
+bool media_library::is_ready() const
+{
+	return impl_->is_ready();
+}
+
+std::vector<library_entry> media_library::list(const std::wstring& prefix, std::size_t offset, std::size_t count) const
+{
+	return impl_->list(prefix, offset, count);
+}
+
+std::vector<library_entry> media_library::find(const std::wstring& file_name) const
+{
+	return impl_->find(file_name);
+}
+
+std::string media_library::read(const boost::filesystem::wpath& file, const file_reader& reader) const
+{
+	return impl_->read(file, reader);
+}
+
+}}
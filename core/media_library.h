@@ -0,0 +1,149 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+
+#include <common/memory/safe_ptr.h>
+#include <common/filesystem/filesystem_monitor.h>
+
+#include "producer/media_info/media_info.h"
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace caspar { namespace core {
+
+struct media_info_repository;
+
+struct library_entry
+{
+	std::wstring				name;				// Relative to the folder and without extension.
+	boost::filesystem::wpath	path;
+	std::uintmax_t				size;
+	std::time_t					last_write_time;
+	std::wstring				type;
+	media_info					info;
+};
+
+/**
+ * Returns the type to list a file as, or an empty string to leave it out.
+ */
+typedef std::function<std::wstring (const boost::filesystem::wpath& file)> library_classifier;
+
+/**
+ * Makes a UTF-8 reply out of the content of a file, or returns an empty string
+ * if it cannot be read.
+ */
+typedef std::function<std::string (const boost::filesystem::wpath& file)> file_reader;
+
+/**
+ * Describes a file in folder.
+ *
+ * @return false if the classifier leaves the file out.
+ */
+bool describe_file(
+		const boost::filesystem::wpath& folder,
+		const boost::filesystem::wpath& file,
+		const library_classifier& classifier,
+		const std::shared_ptr<media_info_repository>& media_info_repo,
+		library_entry& entry);
+
+/**
+ * @return whether name starts with prefix, the way media_library::list
+ *         matches them.
+ */
+bool matches_prefix(const std::wstring& name, const std::wstring& prefix);
+
+/**
+ * An in-memory index of the files in a folder, kept up to date by a
+ * filesystem monitor so that listing them does not touch the disk.
+ */
+class media_library : boost::noncopyable
+{
+public:
+	media_library(
+			filesystem_monitor_factory& monitor_factory,
+			const boost::filesystem::wpath& folder,
+			const library_classifier& classifier,
+			const std::shared_ptr<media_info_repository>& media_info_repo = nullptr,
+			std::size_t cache_bytes = 0);
+	~media_library();
+
+	/**
+	 * @return whether the initial scan of the folder has completed. Until
+	 *         then the index is incomplete.
+	 */
+	bool is_ready() const;
+
+	/**
+	 * @param prefix Only entries whose name starts with it, case insensitive
+	 *               and with / and \ treated alike.
+	 * @param offset The number of matching entries to skip.
+	 * @param count  The maximum number of entries to return.
+	 *
+	 * @return the matching entries ordered by name.
+	 */
+	std::vector<library_entry> list(
+			const std::wstring& prefix = L"",
+			std::size_t offset = 0,
+			std::size_t count = std::numeric_limits<std::size_t>::max()) const;
+
+	/**
+	 * @return the entries whose file name without extension is file_name,
+	 *         case insensitive, in any sub folder.
+	 */
+	std::vector<library_entry> find(const std::wstring& file_name) const;
+
+	/**
+	 * @param file   A file in the folder.
+	 * @param reader The same for every call with the same file.
+	 *
+	 * @return what reader makes of file, from memory if it has been read
+	 *         before and neither its size nor its last write time has changed
+	 *         since. Up to cache_bytes of results are kept, dropping the least
+	 *         recently used first, and a result is dropped as soon as the
+	 *         monitor reports its file changed or removed.
+	 */
+	std::string read(const boost::filesystem::wpath& file, const file_reader& reader) const;
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+/**
+ * The libraries the listing commands are served from.
+ */
+struct media_libraries
+{
+	std::shared_ptr<media_library> media;
+	std::shared_ptr<media_library> templates;
+	std::shared_ptr<media_library> data;
+	std::shared_ptr<media_library> thumbnails;
+};
+
+}}
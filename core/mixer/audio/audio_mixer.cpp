@@ -34,17 +34,129 @@
 #include <boost/range/adaptors.hpp>
 #include <boost/range/distance.hpp>
 
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cmath>
 #include <map>
 #include <stack>
 #include <vector>
 
 namespace caspar { namespace core {
 
+static __m128 load_samples(const int32_t* source)
+{
+	return _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source)));
+}
+
+static __m128 load_samples(const float* source)
+{
+	return _mm_loadu_ps(source);
+}
+
+// Appends the samples scaled by a volume moving linearly from start, one step per sample frame.
+template<typename T>
+static void ramp_samples(const T* source, float* dest, uint32_t frames, int channels, float start, float step)
+{
+	uint32_t frame = 0;
+
+	if(channels % 4 == 0)
+	{
+		for(; frame < frames; ++frame)
+		{
+			const auto volume = _mm_set1_ps(start + frame * step);
+			for(int ch = 0; ch < channels; ch += 4, source += 4, dest += 4)
+				_mm_storeu_ps(dest, _mm_mul_ps(load_samples(source), volume));
+		}
+	}
+	else if(channels == 2 || channels == 1)
+	{
+		const uint32_t per_vector = 4 / channels; // Sample frames per four samples.
+		const auto offsets	= channels == 2 ? _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f) : _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+		const auto steps	= _mm_mul_ps(offsets, _mm_set1_ps(step));
+
+		for(; frame + per_vector <= frames; frame += per_vector, source += 4, dest += 4)
+		{
+			const auto volume = _mm_add_ps(_mm_set1_ps(start + frame * step), steps);
+			_mm_storeu_ps(dest, _mm_mul_ps(load_samples(source), volume));
+		}
+	}
+
+	for(; frame < frames; ++frame)
+	{
+		const auto volume = start + frame * step;
+		for(int ch = 0; ch < channels; ++ch)
+			*dest++ = *source++ * volume;
+	}
+}
+
+static void accumulate_samples(const float* source, float* dest, uint32_t count)
+{
+	uint32_t n = 0;
+	for(; n + 4 <= count; n += 4)
+		_mm_storeu_ps(dest + n, _mm_add_ps(_mm_loadu_ps(dest + n), _mm_loadu_ps(source + n)));
+	for(; n < count; ++n)
+		dest[n] += source[n];
+}
+
+// Clips into the int32 range, converts and keeps the peak of every channel in a single pass.
+static void convert_samples_and_peaks(const float* source, int32_t* dest, uint32_t count, int channels, std::vector<float>& peaks)
+{
+	static const float max_sample = 2147483520.0f; // The largest float below 2^31.
+	static const float min_sample = -2147483648.0f;
+
+	peaks.assign(channels, 0.0f);
+
+	const auto max_value	= _mm_set1_ps(max_sample);
+	const auto min_value	= _mm_set1_ps(min_sample);
+	const auto sign_mask	= _mm_set1_ps(-0.0f);
+
+	uint32_t n = 0;
+
+	if(channels % 4 == 0 || 4 % channels == 0)
+	{
+		// Lane i of accumulator k always holds channel (k*4 + i) % channels.
+		const int vectors = channels % 4 == 0 ? channels / 4 : 1;
+		__m128 accumulators[8];
+		for(int k = 0; k < 8; ++k)
+			accumulators[k] = _mm_setzero_ps();
+
+		if(vectors <= 8)
+		{
+			for(; n + vectors * 4 <= count; )
+			{
+				for(int k = 0; k < vectors; ++k, n += 4)
+				{
+					auto sample = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(source + n), min_value), max_value);
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), _mm_cvttps_epi32(sample));
+					accumulators[k] = _mm_max_ps(accumulators[k], _mm_andnot_ps(sign_mask, sample));
+				}
+			}
+
+			for(int k = 0; k < vectors; ++k)
+			{
+				float lanes[4];
+				_mm_storeu_ps(lanes, accumulators[k]);
+				for(int i = 0; i < 4; ++i)
+					peaks[(k * 4 + i) % channels] = std::max(peaks[(k * 4 + i) % channels], lanes[i]);
+			}
+		}
+	}
+
+	for(; n < count; ++n)
+	{
+		const auto sample = std::min(std::max(source[n], min_sample), max_sample);
+		dest[n] = static_cast<int32_t>(sample);
+		peaks[n % channels] = std::max(peaks[n % channels], std::abs(sample));
+	}
+}
+
 struct audio_item
 {
 	const void*			tag;
 	frame_transform		transform;
 	audio_buffer		audio_data;
+	audio_buffer_ps		audio_data_float; // Full scale is 1.0, used instead of audio_data when not empty.
 
 	audio_item()
 	{
@@ -54,16 +166,18 @@ struct audio_item
 		: tag(std::move(other.tag))
 		, transform(std::move(other.transform))
 		, audio_data(std::move(other.audio_data))
+		, audio_data_float(std::move(other.audio_data_float))
 	{
 	}
 };
-
-typedef std::vector<float, tbb::cache_aligned_allocator<float>> audio_buffer_ps;
 	
 struct audio_stream
 {
 	frame_transform prev_transform;
-	audio_buffer_ps audio_data;
+	audio_buffer_ps audio_data; // Kept between frames, only the samples left over from the cadence are moved.
+	bool			is_active;
+
+	audio_stream() : is_active(false){}
 };
 
 struct audio_mixer::implementation
@@ -73,6 +187,8 @@ struct audio_mixer::implementation
 	std::map<const void*, audio_stream>	audio_streams_;
 	std::vector<audio_item>				items_;
 	std::vector<uint32_t>					audio_cadence_;
+	audio_buffer_ps						result_ps_;
+	std::vector<float>					peaks_;
 	video_format_desc					format_desc_;
 	channel_layout						channel_layout_;
 	float								master_volume_;
@@ -99,13 +215,30 @@ public:
 
 	void visit(core::write_frame& frame)
 	{
-		if(transform_stack_.top().volume < 0.002 || frame.audio_data().empty())
+		if(transform_stack_.top().volume < 0.002 || (frame.audio_data().empty() && frame.audio_data_float().empty()))
 			return;
 
 		audio_item item;
 		item.tag		= frame.tag();
 		item.transform	= transform_stack_.top();
 
+		if (!frame.audio_data_float().empty())
+		{
+			if (!needs_rearranging(frame.get_channel_layout(), channel_layout_))
+			{
+				item.audio_data_float = std::move(frame.audio_data_float());
+				items_.push_back(std::move(item));
+				return;
+			}
+
+			// Remapping works on int32, only producers with a layout of their own pay for the conversion.
+			auto& samples = frame.audio_data_float();
+			frame.audio_data().resize(samples.size());
+			for (size_t n = 0; n < samples.size(); ++n)
+				frame.audio_data()[n] = static_cast<int32_t>(std::min(std::max(samples[n] * 2147483648.0f, -2147483648.0f), 2147483520.0f));
+			samples.clear();
+		}
+
 		if (needs_rearranging(frame.get_channel_layout(), channel_layout_))
 		{
 			auto src_view = frame.get_multichannel_view();
@@ -167,47 +300,59 @@ public:
 			channel_layout_ = layout;
 		}
 		
-		std::map<const void*, audio_stream>	next_audio_streams;
+		const int num_channels = channel_layout_.num_channels;
+
+		BOOST_FOREACH(auto& stream, audio_streams_ | boost::adaptors::map_values)
+			stream.is_active = false;
 
 		BOOST_FOREACH(auto& item, items_)
 		{			
-			audio_buffer_ps next_audio;
-
 			auto next_transform = item.transform;
 			auto prev_transform = next_transform;
 
-			const auto it = audio_streams_.find(item.tag);
+			auto it = audio_streams_.find(item.tag);
 			if(it != audio_streams_.end())
-			{	
-				prev_transform	= it->second.prev_transform;
-				next_audio		= std::move(it->second.audio_data);
-			}
+				prev_transform = it->second.prev_transform;
 
 			if(prev_transform.volume < 0.001 && next_transform.volume < 0.001)
 				continue;
+
+			if(it == audio_streams_.end())
+				it = audio_streams_.insert(std::make_pair(item.tag, audio_stream())).first;
+
+			auto& stream = it->second;
 			
 			const float prev_volume = static_cast<float>(prev_transform.volume) * previous_master_volume_;
 			const float next_volume = static_cast<float>(next_transform.volume) * master_volume_;
-									
-			auto alpha = (next_volume-prev_volume)/static_cast<float>(item.audio_data.size()/channel_layout_.num_channels);
-			
-			for(uint32_t n = 0; n < item.audio_data.size(); ++n)
-			{
-				auto sample_multiplier = (prev_volume + (n/channel_layout_.num_channels) * alpha);
-				next_audio.push_back(item.audio_data[n] * sample_multiplier);
-			}
+
+			const bool is_float	= !item.audio_data_float.empty();
+			const auto frames	= static_cast<uint32_t>((is_float ? item.audio_data_float.size() : item.audio_data.size()) / num_channels);
+			const auto alpha	= (next_volume-prev_volume)/static_cast<float>(std::max<uint32_t>(frames, 1));
+
+			const auto offset = stream.audio_data.size();
+			stream.audio_data.resize(offset + frames * num_channels); // Within capacity once the stream has run a few frames.
+
+			// Mixed in the int32 range, float samples are scaled up by the volume ramp itself.
+			if (is_float)
+				ramp_samples(item.audio_data_float.data(), stream.audio_data.data() + offset, frames, num_channels, prev_volume * 2147483648.0f, alpha * 2147483648.0f);
+			else
+				ramp_samples(item.audio_data.data(), stream.audio_data.data() + offset, frames, num_channels, prev_volume, alpha);
 										
-			next_audio_streams[item.tag].prev_transform  = std::move(next_transform); // Store all active tags, inactive tags will be removed at the end.
-			next_audio_streams[item.tag].audio_data		 = std::move(next_audio);			
+			stream.prev_transform	= std::move(next_transform);
+			stream.is_active		= true;
+		}
+
+		// Tags without audio this frame are removed, along with what was left of their samples.
+		for(auto it = audio_streams_.begin(); it != audio_streams_.end();)
+		{
+			if(it->second.is_active)
+				++it;
+			else
+				it = audio_streams_.erase(it);
 		}
 
 		previous_master_volume_ = master_volume_;
 		items_.clear();
-
-		audio_streams_ = std::move(next_audio_streams);
-		
-		if(audio_streams_.empty())		
-			audio_streams_[nullptr].audio_data = audio_buffer_ps(audio_size(audio_cadence_.front()), 0.0f);
 				
 		{ // sanity check
 
@@ -220,43 +365,42 @@ public:
 				CASPAR_LOG(trace) << "[audio_mixer] Incorrect frame audio cadence detected.";			
 		}
 
-		std::vector<float> result_ps(audio_size(audio_cadence_.front()), 0.0f);
+		const auto result_size = audio_size(audio_cadence_.front());
+		result_ps_.assign(result_size, 0.0f);
 
 		BOOST_FOREACH(auto& stream, audio_streams_ | boost::adaptors::map_values)
 		{
-			//CASPAR_LOG(debug) << stream.audio_data.size() << L" : " << result_ps.size();
-
-			if(stream.audio_data.size() < result_ps.size())
+			if(stream.audio_data.size() < result_size)
 			{
-				stream.audio_data.resize(result_ps.size(), 0.0f);
-				CASPAR_LOG(trace) << L"[audio_mixer] Appended zero samples";
+				stream.audio_data.resize(result_size, 0.0f);
+				CASPAR_LOG_RATE_LIMITED(trace, 1) << L"[audio_mixer] Appended zero samples";
 			}
 
-			auto out = boost::range::transform(result_ps, stream.audio_data, std::begin(result_ps), std::plus<float>());
-			stream.audio_data.erase(std::begin(stream.audio_data), std::begin(stream.audio_data) + std::distance(std::begin(result_ps), out));
+			accumulate_samples(stream.audio_data.data(), result_ps_.data(), result_size);
+
+			// Only the few samples beyond this frame's cadence are moved to the front.
+			auto remaining = stream.audio_data.size() - result_size;
+			std::copy(stream.audio_data.begin() + result_size, stream.audio_data.end(), stream.audio_data.begin());
+			stream.audio_data.resize(remaining);
 		}
 		
 		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
-		
 
-		audio_buffer result;
-		result.reserve(result_ps.size());
-		boost::range::transform(result_ps, std::back_inserter(result), [](float sample){return static_cast<int32_t>(sample);});		
+		audio_buffer result(result_size);
+		convert_samples_and_peaks(result_ps_.data(), result.data(), result_size, num_channels, peaks_);
 		
-		const int num_channels = channel_layout_.num_channels;
-		monitor_subject_ << monitor::message("/nb_channels") % num_channels;
-
-		auto max = std::vector<int32_t>(num_channels, std::numeric_limits<int32_t>::min());
-
-		for (uint32_t n = 0; n < result.size(); n += num_channels)
-			for (int ch = 0; ch < num_channels; ++ch)
-				max[ch] = std::max(max[ch], std::abs(result[n + ch]));
+		std::vector<int32_t> max(num_channels);
+		for (int ch = 0; ch < num_channels; ++ch)
+			max[ch] = static_cast<int32_t>(peaks_[ch]);
 		
 		// Makes the dBFS of silence => -dynamic range of 32bit LPCM => about -192 dBFS
 		// Otherwise it would be -infinity
 		static const auto MIN_PFS = 0.5f / static_cast<float>(std::numeric_limits<int32_t>::max());
 
-		for (int i = 0; i < num_channels; ++i)
+		if (monitor_subject_.is_observed())
+			monitor_subject_ << monitor::message("/nb_channels") % num_channels;
+
+		for (int i = 0; i < num_channels && monitor_subject_.is_observed(); ++i)
 		{
 			const auto pFS  = max[i] / static_cast<float>(std::numeric_limits<int32_t>::max());
 			const auto dBFS = 20.0f * std::log10(std::max(MIN_PFS, pFS));
@@ -294,6 +438,7 @@ public:
 audio_mixer::audio_mixer(const safe_ptr<diagnostics::graph>& graph) : impl_(new implementation(graph)){}
 void audio_mixer::begin(core::basic_frame& frame){impl_->begin(frame);}
 void audio_mixer::visit(core::write_frame& frame){impl_->visit(frame);}
+void audio_mixer::visit(core::color_frame&){} // Color frames are silent.
 void audio_mixer::end(){impl_->end();}
 float audio_mixer::get_master_volume() const { return impl_->get_master_volume(); }
 void audio_mixer::set_master_volume(float volume) { impl_->set_master_volume(volume); }
@@ -27,6 +27,8 @@
 
 #include <core/producer/frame/frame_visitor.h>
 
+#include <common/memory/tagged_allocator.h>
+
 #include <boost/noncopyable.hpp>
 
 #include <tbb/cache_aligned_allocator.h>
@@ -46,7 +48,8 @@ namespace core {
 struct video_format_desc;
 struct channel_layout;
 	
-typedef std::vector<int32_t, tbb::cache_aligned_allocator<int32_t>> audio_buffer;
+typedef std::vector<int32_t, tagged_allocator<int32_t, allocation_subsystem::mixer, tbb::cache_aligned_allocator<int32_t>>> audio_buffer;
+typedef std::vector<float, tagged_allocator<float, allocation_subsystem::mixer, tbb::cache_aligned_allocator<float>>> audio_buffer_ps;
 
 class audio_mixer : public core::frame_visitor, boost::noncopyable
 {
@@ -55,6 +58,7 @@ public:
 
 	virtual void begin(core::basic_frame& frame);
 	virtual void visit(core::write_frame& frame);
+	virtual void visit(core::color_frame& frame);
 	virtual void end();
 
 	float get_master_volume() const;
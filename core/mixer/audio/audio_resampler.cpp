@@ -0,0 +1,176 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../../stdafx.h"
+
+#include "audio_resampler.h"
+#include "audio_util.h"
+
+#include <boost/foreach.hpp>
+
+#include <xmmintrin.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const int PHASES	= 64;
+const int TAPS		= 16;
+const int LEADING	= TAPS/2 - 1;	// Taps before the interpolated position.
+const double CUTOFF	= 0.9;			// Of the nyquist frequency, a ratio close to 1 needs no more anti-aliasing.
+
+// Blackman windowed sinc at the distance from the interpolated position, the window spans all taps.
+double tap(double distance)
+{
+	static const double pi = 3.14159265358979323846;
+
+	if(std::abs(distance) >= TAPS/2)
+		return 0.0;
+
+	auto window = 0.42 + 0.5*std::cos(pi*distance/(TAPS/2)) + 0.08*std::cos(2.0*pi*distance/(TAPS/2));
+	auto x		= pi*CUTOFF*distance;
+	auto sinc	= std::abs(x) < 1.0e-9 ? 1.0 : std::sin(x)/x;
+	return CUTOFF*sinc*window;
+}
+
+}
+
+audio_resampler::audio_resampler(int num_channels)
+	: num_channels_(num_channels)
+	, filters_((PHASES + 1)*TAPS)
+	, history_(num_channels)
+	, position_(0.0)
+{
+	for(int phase = 0; phase <= PHASES; ++phase)
+	{
+		auto row = filters_.begin() + phase*TAPS;
+
+		double sum = 0.0;
+		for(int n = 0; n < TAPS; ++n)
+			sum += tap(n - LEADING - static_cast<double>(phase)/PHASES);
+
+		// Normalized for unity gain at dc in every phase.
+		for(int n = 0; n < TAPS; ++n)
+			row[n] = static_cast<float>(tap(n - LEADING - static_cast<double>(phase)/PHASES)/sum);
+	}
+
+	clear();
+}
+
+void audio_resampler::clear()
+{
+	// The first output sample is the first input sample, the taps before it see silence.
+	BOOST_FOREACH(auto& channel, history_)
+		channel.assign(LEADING, 0.0f);
+	position_ = 0.0;
+}
+
+int audio_resampler::num_channels() const
+{
+	return num_channels_;
+}
+
+void audio_resampler::resample(const int32_t* source, std::size_t count, double ratio, audio_buffer_ps& dest)
+{
+	const std::size_t num_samples = count/num_channels_;
+
+	planar_.resize(num_samples*num_channels_);
+	audio_32_to_planar_float(source, planar_.data(), num_samples*num_channels_, num_channels_);
+
+	for(int channel = 0; channel < num_channels_; ++channel)
+	{
+		auto plane = planar_.begin() + channel*num_samples;
+		history_[channel].insert(history_[channel].end(), plane, plane + num_samples);
+	}
+
+	interpolate(ratio, dest);
+}
+
+void audio_resampler::resample(const float* source, std::size_t count, double ratio, audio_buffer_ps& dest)
+{
+	const std::size_t num_samples = count/num_channels_;
+
+	for(int channel = 0; channel < num_channels_; ++channel)
+	{
+		auto& history = history_[channel];
+		auto offset = history.size();
+		history.resize(offset + num_samples);
+		for(std::size_t n = 0; n < num_samples; ++n)
+			history[offset + n] = source[n*num_channels_ + channel];
+	}
+
+	interpolate(ratio, dest);
+}
+
+void audio_resampler::interpolate(double ratio, audio_buffer_ps& dest)
+{
+	const double step	= 1.0/std::min(std::max(ratio, 0.5), 2.0);
+	const auto length	= history_.front().size();
+
+	if(length >= TAPS)
+		dest.reserve(dest.size() + (static_cast<std::size_t>((length - TAPS + 1)/step) + 1)*num_channels_);
+
+	for(auto index = static_cast<std::size_t>(position_); index + TAPS <= length; index = static_cast<std::size_t>(position_))
+	{
+		// The taps between the two nearest phases, blended once and applied to every channel.
+		auto phase	= static_cast<float>((position_ - index)*PHASES);
+		auto row	= std::min(static_cast<int>(phase), PHASES - 1);
+		auto weight	= _mm_set1_ps(phase - row);
+
+		const float* lower = filters_.data() + row*TAPS;
+		const float* upper = lower + TAPS;
+
+		__m128 taps[TAPS/4];
+		for(int n = 0; n < TAPS/4; ++n)
+		{
+			auto a = _mm_load_ps(lower + n*4);
+			taps[n] = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(upper + n*4), a), weight));
+		}
+
+		for(int channel = 0; channel < num_channels_; ++channel)
+		{
+			const float* samples = history_[channel].data() + index;
+
+			auto sum = _mm_mul_ps(taps[0], _mm_loadu_ps(samples));
+			for(int n = 1; n < TAPS/4; ++n)
+				sum = _mm_add_ps(sum, _mm_mul_ps(taps[n], _mm_loadu_ps(samples + n*4)));
+
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+
+			dest.push_back(_mm_cvtss_f32(sum));
+		}
+
+		position_ += step;
+	}
+
+	// Keeps the input from the first tap of the next output sample on.
+	auto consumed = std::min(static_cast<std::size_t>(position_), length);
+	BOOST_FOREACH(auto& channel, history_)
+		channel.erase(channel.begin(), channel.begin() + consumed);
+	position_ -= consumed;
+}
+
+}}
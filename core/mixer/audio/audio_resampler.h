@@ -0,0 +1,63 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include "audio_mixer.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace caspar { namespace core {
+
+/**
+ * Polyphase windowed sinc interpolator for resampling by a ratio close to 1,
+ * such as the few hundred ppm a free running input drifts against the
+ * channel. The ratio (output samples per input sample) may change on every
+ * call without discontinuities. Input and output are interleaved, the output
+ * is float with full scale 1.0 as mixed from write_frame::audio_data_float().
+ */
+class audio_resampler : boost::noncopyable
+{
+public:
+	explicit audio_resampler(int num_channels);
+
+	void resample(const int32_t* source, std::size_t count, double ratio, audio_buffer_ps& dest);
+	void resample(const float* source, std::size_t count, double ratio, audio_buffer_ps& dest);
+
+	void clear();
+
+	int num_channels() const;
+
+private:
+	void interpolate(double ratio, audio_buffer_ps& dest);
+
+	const int						num_channels_;
+	audio_buffer_ps					filters_;	// A row of taps for each phase and one for the phase after the last.
+	std::vector<audio_buffer_ps>	history_;	// Planar input that is still needed by the next output samples.
+	audio_buffer_ps					planar_;
+	double							position_;	// Of the next output sample in history_, between input samples.
+};
+
+}}
@@ -31,8 +31,196 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/exceptions.hpp>
 
+#include <tmmintrin.h>
+
 namespace caspar { namespace core {
 
+void audio_32_to_24(const int32_t* source, int8_t* dest, std::size_t count)
+{
+	const auto mask = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+
+	std::size_t n = 0;
+
+	// Sixteen bytes are stored for every twelve, the four extra are overwritten by the next group.
+	for(; n + 8 <= count; n += 4)
+	{
+		auto samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n * 3), _mm_shuffle_epi8(samples, mask));
+	}
+
+	auto input8 = reinterpret_cast<const int8_t*>(source);
+	for(; n < count; ++n)
+	{
+		dest[n*3+0] = input8[n*4+1];
+		dest[n*3+1] = input8[n*4+2];
+		dest[n*3+2] = input8[n*4+3];
+	}
+}
+
+void audio_32_to_16(const int32_t* source, int16_t* dest, std::size_t count)
+{
+	std::size_t n = 0;
+	for(; n + 8 <= count; n += 8)
+	{
+		auto lo = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n)), 16);
+		auto hi = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n + 4)), 16);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), _mm_packs_epi32(lo, hi));
+	}
+	for(; n < count; ++n)
+		dest[n] = static_cast<int16_t>(source[n] >> 16);
+}
+
+void audio_32_to_float(const int32_t* source, float* dest, std::size_t count)
+{
+	static const float scale = 1.0f / 2147483648.0f;
+
+	const auto factor = _mm_set1_ps(scale);
+
+	std::size_t n = 0;
+	for(; n + 4 <= count; n += 4)
+		_mm_storeu_ps(dest + n, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n))), factor));
+	for(; n < count; ++n)
+		dest[n] = static_cast<float>(source[n]) * scale;
+}
+
+void audio_32_to_planar_float(const int32_t* source, float* dest, std::size_t count, int num_channels)
+{
+	static const float scale = 1.0f / 2147483648.0f;
+
+	if(num_channels < 1)
+		return;
+
+	const std::size_t num_samples = count / num_channels;
+
+	if(num_channels == 2)
+	{
+		const auto factor = _mm_set1_ps(scale);
+
+		float* left		= dest;
+		float* right	= dest + num_samples;
+
+		std::size_t n = 0;
+		for(; n + 4 <= num_samples; n += 4)
+		{
+			auto a = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n * 2)));
+			auto b = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n * 2 + 4)));
+			_mm_storeu_ps(left + n,  _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), factor));
+			_mm_storeu_ps(right + n, _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), factor));
+		}
+		for(; n < num_samples; ++n)
+		{
+			left[n]  = static_cast<float>(source[n * 2]) * scale;
+			right[n] = static_cast<float>(source[n * 2 + 1]) * scale;
+		}
+
+		return;
+	}
+
+	for(int ch = 0; ch < num_channels; ++ch)
+	{
+		float* plane = dest + ch * num_samples;
+		for(std::size_t n = 0; n < num_samples; ++n)
+			plane[n] = static_cast<float>(source[n * num_channels + ch]) * scale;
+	}
+}
+
+namespace {
+
+// 2^31 is out of range, the largest float below it is used for full scale instead.
+static const float FLOAT_TO_32_SCALE	= 2147483648.0f;
+static const float FLOAT_TO_32_MAX		= 2147483520.0f;
+
+inline int32_t sample_to_32(int16_t sample)	{ return static_cast<int32_t>(sample) << 16; }
+inline int32_t sample_to_32(int32_t sample)	{ return sample; }
+inline int32_t sample_to_32(float sample)	{ return static_cast<int32_t>(std::min(FLOAT_TO_32_MAX, std::max(-FLOAT_TO_32_SCALE, sample * FLOAT_TO_32_SCALE))); }
+
+// Four samples.
+inline __m128i samples_to_32(const int16_t* source)	
+{ 
+	return _mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source))); 
+}
+
+inline __m128i samples_to_32(const int32_t* source)	
+{ 
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(source)); 
+}
+
+inline __m128i samples_to_32(const float* source)	
+{ 
+	auto scaled = _mm_mul_ps(_mm_loadu_ps(source), _mm_set1_ps(FLOAT_TO_32_SCALE));
+	return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(scaled, _mm_set1_ps(-FLOAT_TO_32_SCALE)), _mm_set1_ps(FLOAT_TO_32_MAX)));
+}
+
+template<typename T>
+void interleaved_to_32(const T* source, int32_t* dest, std::size_t count)
+{
+	std::size_t n = 0;
+	for(; n + 4 <= count; n += 4)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), samples_to_32(source + n));
+	for(; n < count; ++n)
+		dest[n] = sample_to_32(source[n]);
+}
+
+template<typename T>
+void planar_to_32(const T* const* source, int32_t* dest, std::size_t count, int num_channels)
+{
+	if(num_channels < 1)
+		return;
+
+	if(num_channels == 1)
+	{
+		interleaved_to_32(source[0], dest, count);
+		return;
+	}
+
+	const std::size_t num_samples = count / num_channels;
+
+	std::size_t n = 0;
+	if(num_channels == 2)
+	{
+		for(; n + 4 <= num_samples; n += 4)
+		{
+			auto left  = samples_to_32(source[0] + n);
+			auto right = samples_to_32(source[1] + n);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n * 2),	   _mm_unpacklo_epi32(left, right));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n * 2 + 4), _mm_unpackhi_epi32(left, right));
+		}
+	}
+
+	for(; n < num_samples; ++n)
+	{
+		for(int ch = 0; ch < num_channels; ++ch)
+			dest[n * num_channels + ch] = sample_to_32(source[ch][n]);
+	}
+}
+
+}
+
+void audio_16_to_32(const int16_t* source, int32_t* dest, std::size_t count)
+{
+	interleaved_to_32(source, dest, count);
+}
+
+void audio_float_to_32(const float* source, int32_t* dest, std::size_t count)
+{
+	interleaved_to_32(source, dest, count);
+}
+
+void audio_planar_16_to_32(const int16_t* const* source, int32_t* dest, std::size_t count, int num_channels)
+{
+	planar_to_32(source, dest, count, num_channels);
+}
+
+void audio_planar_32_to_32(const int32_t* const* source, int32_t* dest, std::size_t count, int num_channels)
+{
+	planar_to_32(source, dest, count, num_channels);
+}
+
+void audio_planar_float_to_32(const float* const* source, int32_t* dest, std::size_t count, int num_channels)
+{
+	planar_to_32(source, dest, count, num_channels);
+}
+
 channel_layout::channel_layout()
 	: num_channels(0)
 {
@@ -201,9 +389,256 @@ channel_layout_repository& default_channel_layout_repository()
 	return repository;
 }
 
+mix_matrix::mix_matrix(int source_channels, int destination_channels)
+	: source_channels(source_channels)
+	, destination_channels(destination_channels)
+	, padded_destination_channels((destination_channels + 3) & ~3)
+	, gains(source_channels * ((destination_channels + 3) & ~3), 0.0f)
+	, satisfactory(true)
+{
+}
+
+float& mix_matrix::gain(int source_channel, int destination_channel)
+{
+	return gains[source_channel * padded_destination_channels + destination_channel];
+}
+
+void mix_matrix::finalize()
+{
+	sources.clear();
+	permutation.assign(destination_channels, -1);
+
+	bool is_permutation = true;
+
+	for (int s = 0; s < source_channels; ++s)
+	{
+		bool is_used = false;
+
+		for (int d = 0; d < destination_channels; ++d)
+		{
+			auto value = gain(s, d);
+
+			if (value == 0.0f)
+				continue;
+
+			is_used = true;
+
+			if (value != 1.0f || permutation[d] != -1)
+				is_permutation = false;
+			else
+				permutation[d] = s;
+		}
+
+		if (is_used)
+			sources.push_back(s);
+	}
+
+	if (!is_permutation)
+		permutation.clear();
+}
+
+void apply_mix_matrix(
+		const mix_matrix& matrix,
+		const int32_t* source,
+		int source_stride,
+		int32_t* destination,
+		int destination_stride,
+		int num_samples)
+{
+	const int destination_channels =
+			std::min(matrix.destination_channels, destination_stride);
+
+	if (!matrix.permutation.empty())
+	{
+		for (int n = 0; n < num_samples; ++n)
+		{
+			for (int d = 0; d < destination_channels; ++d)
+			{
+				auto s = matrix.permutation[d];
+				destination[d] = s >= 0 && s < source_stride ? source[s] : 0;
+			}
+
+			source += source_stride;
+			destination += destination_stride;
+		}
+
+		return;
+	}
+
+	static const float max_sample = 2147483520.0f; // The largest float below 2^31.
+	static const float min_sample = -2147483648.0f;
+
+	const auto max_value = _mm_set1_ps(max_sample);
+	const auto min_value = _mm_set1_ps(min_sample);
+
+	const int vectors = matrix.padded_destination_channels / 4;
+
+	// On the stack for up to 64 channels, this runs for every frame of every output.
+	static const int STACK_ACCUMULATORS = 64;
+	__declspec(align(16)) float stack_accumulators[STACK_ACCUMULATORS];
+	std::vector<float, tbb::cache_aligned_allocator<float>> heap_accumulators;
+	float* accumulators = stack_accumulators;
+
+	if (matrix.padded_destination_channels > STACK_ACCUMULATORS)
+	{
+		heap_accumulators.resize(matrix.padded_destination_channels);
+		accumulators = heap_accumulators.data();
+	}
+
+	for (int n = 0; n < num_samples; ++n)
+	{
+		for (int v = 0; v < vectors; ++v)
+			_mm_store_ps(&accumulators[v * 4], _mm_setzero_ps());
+
+		// Every destination channel at once, four at a time, from each source channel that is mapped anywhere.
+		BOOST_FOREACH(auto s, matrix.sources)
+		{
+			if (s >= source_stride)
+				continue;
+
+			const auto sample = _mm_set1_ps(static_cast<float>(source[s]));
+			const float* gains = &matrix.gains[s * matrix.padded_destination_channels];
+
+			for (int v = 0; v < vectors; ++v)
+			{
+				auto accumulator = _mm_load_ps(&accumulators[v * 4]);
+				accumulator = _mm_add_ps(accumulator, _mm_mul_ps(sample, _mm_loadu_ps(gains + v * 4)));
+				_mm_store_ps(&accumulators[v * 4], accumulator);
+			}
+		}
+
+		for (int v = 0; v < vectors; ++v)
+		{
+			int32_t values[4];
+			_mm_storeu_si128(
+					reinterpret_cast<__m128i*>(values), 
+					_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_load_ps(&accumulators[v * 4]), min_value), max_value)));
+
+			auto count = std::min(4, destination_channels - v * 4);
+			for (int i = 0; i < count; ++i)
+				destination[v * 4 + i] = values[i];
+		}
+
+		source += source_stride;
+		destination += destination_stride;
+	}
+}
+
+void apply_mix_matrix_24(
+		const mix_matrix& matrix,
+		const int32_t* source,
+		int source_stride,
+		int8_t* destination,
+		int destination_stride,
+		int num_samples)
+{
+	static const int BLOCK_VALUES = 4096; // 16 kB of mixed samples.
+
+	if (destination_stride > BLOCK_VALUES)
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Too many destination channels."));
+
+	__declspec(align(16)) int32_t block[BLOCK_VALUES];
+	const int block_samples = BLOCK_VALUES / destination_stride;
+	const bool is_partial = matrix.destination_channels < destination_stride;
+
+	for (int n = 0; n < num_samples; n += block_samples)
+	{
+		auto count = std::min(block_samples, num_samples - n);
+
+		if (is_partial)
+			std::fill(block, block + count * destination_stride, 0);
+
+		apply_mix_matrix(matrix, source + n * source_stride, source_stride, block, destination_stride, count);
+		audio_32_to_24(block, destination + n * destination_stride * 3, count * destination_stride);
+	}
+}
+
+namespace {
+
+void add_rearrange_gains(
+		mix_matrix& matrix,
+		const channel_layout& source,
+		const channel_layout& destination)
+{
+	if (source.no_channel_names() || destination.no_channel_names())
+	{
+		auto num_channels = std::min(
+				source.num_channels, destination.num_channels);
+
+		for (int i = 0; i < num_channels; ++i)
+			matrix.gain(i, i) = 1.0f;
+
+		return;
+	}
+
+	BOOST_FOREACH(auto& channel_name, source.channel_names)
+	{
+		if (channel_name.empty() || !destination.has_channel(channel_name))
+			continue;
+
+		matrix.gain(
+				source.channel_index(channel_name),
+				destination.channel_index(channel_name)) = 1.0f;
+	}
+}
+
+void add_mix_gains(
+		mix_matrix& matrix,
+		const channel_layout& source,
+		const channel_layout& destination,
+		const mix_config& config)
+{
+	std::map<std::wstring, int> num_mixed_to_channel;
+
+	BOOST_FOREACH(auto& elem, config.destination_ch_by_source_ch)
+	{
+		if (source.has_channel(elem.first)
+				&& destination.has_channel(elem.second.channel_name))
+			++num_mixed_to_channel[elem.second.channel_name];
+	}
+
+	// A running average of every mapped channel is their mean.
+	BOOST_FOREACH(auto& elem, config.destination_ch_by_source_ch)
+	{
+		auto& destination_channel_name = elem.second.channel_name;
+
+		if (!source.has_channel(elem.first)
+				|| !destination.has_channel(destination_channel_name))
+			continue;
+
+		auto influence = static_cast<float>(elem.second.influence);
+
+		if (config.strategy == mix_config::average)
+			influence /= static_cast<float>(
+					num_mixed_to_channel[destination_channel_name]);
+
+		matrix.gain(
+				source.channel_index(elem.first),
+				destination.channel_index(destination_channel_name)) += influence;
+	}
+}
+
+}
+
 struct mix_config_repository::impl
 {
+	struct cached_matrix
+	{
+		channel_layout source;
+		channel_layout destination;
+		safe_ptr<const mix_matrix> matrix;
+
+		cached_matrix(
+				const channel_layout& source,
+				const channel_layout& destination,
+				const safe_ptr<const mix_matrix>& matrix)
+			: source(source), destination(destination), matrix(matrix)
+		{
+		}
+	};
+
 	std::map<std::wstring, std::map<std::wstring, const mix_config>> configs;
+	std::vector<cached_matrix> matrices; // Few layout pairs are in use, searched linearly.
 	boost::mutex mutex;
 };
 
@@ -223,6 +658,7 @@ void mix_config_repository::register_mix_config(const mix_config& config)
 	impl_->configs[config.from_layout_type].erase(config.to_layout_type);
 	impl_->configs[config.from_layout_type].insert(
 			std::make_pair(config.to_layout_type, config));
+	impl_->matrices.clear();
 }
 
 boost::optional<mix_config> mix_config_repository::get_mix_config(
@@ -239,6 +675,56 @@ boost::optional<mix_config> mix_config_repository::get_mix_config(
 	return iter->second;
 }
 
+safe_ptr<const mix_matrix> mix_config_repository::get_mix_matrix(
+		const channel_layout& source,
+		const channel_layout& destination) const
+{
+	{
+		boost::unique_lock<boost::mutex> lock(impl_->mutex);
+
+		BOOST_FOREACH(auto& cached, impl_->matrices)
+		{
+			if (cached.source == source
+					&& cached.source.layout_type == source.layout_type
+					&& cached.destination == destination
+					&& cached.destination.layout_type == destination.layout_type)
+				return cached.matrix;
+		}
+	}
+
+	auto matrix = make_safe<mix_matrix>(
+			source.num_channels, destination.num_channels);
+
+	if (source.no_channel_names()
+			|| destination.no_channel_names()
+			|| source.layout_type == destination.layout_type)
+	{
+		add_rearrange_gains(*matrix, source, destination);
+	}
+	else
+	{
+		auto config = get_mix_config(
+				source.layout_type, destination.layout_type);
+
+		if (config)
+			add_mix_gains(*matrix, source, destination, *config);
+		else
+		{
+			add_rearrange_gains(*matrix, source, destination);
+			matrix->satisfactory = false;
+		}
+	}
+
+	matrix->finalize();
+
+	boost::unique_lock<boost::mutex> lock(impl_->mutex);
+
+	impl_->matrices.push_back(
+			impl::cached_matrix(source, destination, matrix));
+
+	return matrix;
+}
+
 mix_config create_mix_config_from_string(
 		const std::wstring& from_layout_type,
 		const std::wstring& to_layout_type,
@@ -44,21 +44,28 @@
 #include <common/memory/safe_ptr.h>
 
 namespace caspar { namespace core {
+
+// Sse conversions of count interleaved samples, read_frame keeps the results for all of its consumers.
+void audio_32_to_24(const int32_t* source, int8_t* dest, std::size_t count); // The upper three bytes, little endian.
+void audio_32_to_16(const int32_t* source, int16_t* dest, std::size_t count); // The upper two bytes.
+void audio_32_to_float(const int32_t* source, float* dest, std::size_t count); // Full scale is 1.0.
+void audio_32_to_planar_float(const int32_t* source, float* dest, std::size_t count, int num_channels); // Channel after channel.
+
+// The other way, for decoders which do not need to resample.
+void audio_16_to_32(const int16_t* source, int32_t* dest, std::size_t count); // Into the upper two bytes.
+void audio_float_to_32(const float* source, int32_t* dest, std::size_t count); // Full scale is 1.0, clipped.
+void audio_planar_16_to_32(const int16_t* const* source, int32_t* dest, std::size_t count, int num_channels); // A plane per channel.
+void audio_planar_32_to_32(const int32_t* const* source, int32_t* dest, std::size_t count, int num_channels);
+void audio_planar_float_to_32(const float* const* source, int32_t* dest, std::size_t count, int num_channels);
 	
 template<typename T>
 static std::vector<int8_t, tbb::cache_aligned_allocator<int8_t>> audio_32_to_24(const T& audio_data)
 {	
 	auto size		 = std::distance(std::begin(audio_data), std::end(audio_data));
-	auto input8		 = reinterpret_cast<const int8_t*>(&(*std::begin(audio_data)));
-	auto output8	 = std::vector<int8_t, tbb::cache_aligned_allocator<int8_t>>();
+	auto output8	 = std::vector<int8_t, tbb::cache_aligned_allocator<int8_t>>(size*3);
 			
-	output8.reserve(size*3);
-	for(int n = 0; n < size; ++n)
-	{
-		output8.push_back(input8[n*4+1]);
-		output8.push_back(input8[n*4+2]);
-		output8.push_back(input8[n*4+3]);
-	}
+	if(size > 0)
+		audio_32_to_24(&(*std::begin(audio_data)), output8.data(), size);
 
 	return output8;
 }
@@ -67,12 +74,10 @@ template<typename T>
 static std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>> audio_32_to_16(const T& audio_data)
 {	
 	auto size		 = std::distance(std::begin(audio_data), std::end(audio_data));
-	auto input32	 = &(*std::begin(audio_data));
-	auto output16	 = std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>>();
+	auto output16	 = std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>>(size);
 			
-	output16.reserve(size);
-	for(int n = 0; n < size; ++n)
-		output16.push_back((input32[n] >> 16) & 0xFFFF);
+	if(size > 0)
+		audio_32_to_16(&(*std::begin(audio_data)), output16.data(), size);
 
 	return output16;
 }
@@ -489,6 +494,8 @@ void parse_channel_layouts(
 		const boost::property_tree::wptree& layouts_element);
 channel_layout_repository& default_channel_layout_repository();
 
+struct mix_matrix;
+
 class mix_config_repository
 {
 public:
@@ -498,11 +505,63 @@ public:
 	boost::optional<mix_config> get_mix_config(
 			const std::wstring& from_layout_type,
 			const std::wstring& to_layout_type) const;
+	safe_ptr<const mix_matrix> get_mix_matrix(
+			const channel_layout& source,
+			const channel_layout& destination) const; // Compiled on first use.
 private:
 	struct impl;
 	safe_ptr<impl> impl_;
 };
 
+/**
+ * A source layout to destination layout mapping compiled once into the gain
+ * of every source channel in every destination channel, applied to whole
+ * buffers by apply_mix_matrix. Mappings with only unity gains and at most one
+ * source per destination channel are also kept as a permutation.
+ */
+struct mix_matrix
+{
+	int source_channels;
+	int destination_channels;
+	int padded_destination_channels; // Rounded up to a multiple of four.
+	std::vector<float> gains; // By source channel, then destination channel.
+	std::vector<int> sources; // The source channels with any non zero gain.
+	std::vector<int> permutation; // Source channel or -1 by destination channel, empty if not a permutation.
+	bool satisfactory; // False when no mix config was found and channels might be lost.
+
+	mix_matrix(int source_channels, int destination_channels);
+
+	float& gain(int source_channel, int destination_channel);
+	void finalize();
+};
+
+/**
+ * Interleaved int32 from source to destination, the strides are the number
+ * of channels in each buffer and may be wider than the matrix. Destination
+ * channels beyond the matrix are left untouched.
+ */
+void apply_mix_matrix(
+		const mix_matrix& matrix,
+		const int32_t* source,
+		int source_stride,
+		int32_t* destination,
+		int destination_stride,
+		int num_samples);
+
+/**
+ * apply_mix_matrix followed by audio_32_to_24, a block of samples small
+ * enough to stay in the cache at a time, into num_samples *
+ * destination_stride * 3 bytes. Destination channels beyond the matrix are
+ * silent.
+ */
+void apply_mix_matrix_24(
+		const mix_matrix& matrix,
+		const int32_t* source,
+		int source_stride,
+		int8_t* destination,
+		int destination_stride,
+		int num_samples);
+
 mix_config create_mix_config_from_string(
 		const std::wstring& from_layout_type,
 		const std::wstring& to_layout_type,
@@ -524,33 +583,23 @@ bool rearrange_or_rearrange_and_mix(
 		multichannel_view<DstSampleT, DstIter>& destination,
 		const mix_config_repository& repository)
 {
-	if (source.channel_layout().no_channel_names() 
-			|| destination.channel_layout().no_channel_names() 
-			|| source.channel_layout().layout_type
-					== destination.channel_layout().layout_type)
-	{
-		rearrange(source, destination);
-
-		return true;
-	}
-	else
-	{
-		auto mix_config = repository.get_mix_config(
-				source.channel_layout().layout_type,
-				destination.channel_layout().layout_type);
-
-		if (!mix_config)
-		{
-			rearrange(source, destination);
-
-			return false; // Non-satisfactory mixing, some channels might be
-			              // lost
-		}
-
-		rearrange_and_mix(source, destination, *mix_config);
-
-		return true;
-	}
+	auto matrix = repository.get_mix_matrix(
+			source.channel_layout(), destination.channel_layout());
+
+	auto num_samples = std::min(
+			source.num_samples(), destination.num_samples());
+
+	if (num_samples > 0)
+		apply_mix_matrix(
+				*matrix,
+				&*source.raw_begin(),
+				source.num_channels(),
+				&*destination.raw_begin(),
+				destination.num_channels(),
+				num_samples);
+
+	return matrix->satisfactory; // Non-satisfactory mixing, some channels
+	                             // might be lost
 }
 
 channel_layout create_custom_channel_layout(
@@ -0,0 +1,460 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "loudness_meter.h"
+#include "audio_util.h"
+
+#include <core/video_format.h>
+
+#include <common/concurrency/executor.h>
+#include <common/log/log.h>
+
+#include <boost/foreach.hpp>
+
+#include <tbb/cache_aligned_allocator.h>
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const double	LOUDNESS_FLOOR		= -120.0;
+const double	ABSOLUTE_GATE		= -70.0;
+const double	RELATIVE_GATE		= -10.0;
+const int		HISTOGRAM_BINS		= 1000; // 0.1 LU bins from -70 to +30 LUFS.
+const size_t	MOMENTARY_BLOCKS	= 4;	// 400 ms of 100 ms sub-blocks.
+const size_t	SHORT_TERM_BLOCKS	= 30;	// 3 s of 100 ms sub-blocks.
+const size_t	MAX_PENDING			= 8;
+
+// 4x oversampling interpolation filter of ITU-R BS.1770-4 Annex 2, 12 taps per phase.
+const float TRUE_PEAK_TAPS[4][12] =
+{
+	{ 0.0017089843750f,  0.0109863281250f, -0.0196533203125f,  0.0332031250000f, -0.0594482421875f,  0.1373291015625f,  0.9721679687500f, -0.1022949218750f,  0.0476074218750f, -0.0266113281250f,  0.0148925781250f, -0.0083007812500f},
+	{-0.0291748046875f,  0.0292968750000f, -0.0517578125000f,  0.0891113281250f, -0.1665039062500f,  0.4650878906250f,  0.7797851562500f, -0.2003173828125f,  0.1015625000000f, -0.0582275390625f,  0.0330810546875f, -0.0189208984375f},
+	{-0.0189208984375f,  0.0330810546875f, -0.0582275390625f,  0.1015625000000f, -0.2003173828125f,  0.7797851562500f,  0.4650878906250f, -0.1665039062500f,  0.0891113281250f, -0.0517578125000f,  0.0292968750000f, -0.0291748046875f},
+	{-0.0083007812500f,  0.0148925781250f, -0.0266113281250f,  0.0476074218750f, -0.1022949218750f,  0.9721679687500f,  0.1373291015625f, -0.0594482421875f,  0.0332031250000f, -0.0196533203125f,  0.0109863281250f,  0.0017089843750f}
+};
+
+const int TRUE_PEAK_HISTORY = 11;
+
+double to_lufs(double energy)
+{
+	return energy > 0.0 ? std::max(LOUDNESS_FLOOR, -0.691 + 10.0 * std::log10(energy)) : LOUDNESS_FLOOR;
+}
+
+double to_db(double amplitude)
+{
+	return amplitude > 0.0 ? std::max(LOUDNESS_FLOOR, 20.0 * std::log10(amplitude)) : LOUDNESS_FLOOR;
+}
+
+double channel_weight(const std::wstring& name)
+{
+	if(name == L"LFE")
+		return 0.0;
+
+	if(name == L"Ls" || name == L"Rs" || name == L"Lss" || name == L"Rss" || name == L"Lsr" || name == L"Rsr" || name == L"Lrs" || name == L"Rrs")
+		return 1.41;
+
+	return 1.0;
+}
+
+struct biquad
+{
+	double b0, b1, b2, a1, a2;
+};
+
+// The two K-weighting stages of BS.1770, derived for the actual sample rate.
+void k_weighting(double sample_rate, biquad& shelf, biquad& high_pass)
+{
+	const double pi = 3.14159265358979323846;
+
+	{
+		double f0 = 1681.974450955533;
+		double g  = 3.999843853973347;
+		double q  = 0.7071752369554196;
+
+		double k  = std::tan(pi * f0 / sample_rate);
+		double vh = std::pow(10.0, g / 20.0);
+		double vb = std::pow(vh, 0.4996667741545416);
+		double a0 = 1.0 + k / q + k * k;
+
+		shelf.b0 = (vh + vb * k / q + k * k) / a0;
+		shelf.b1 = 2.0 * (k * k - vh) / a0;
+		shelf.b2 = (vh - vb * k / q + k * k) / a0;
+		shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+		shelf.a2 = (1.0 - k / q + k * k) / a0;
+	}
+
+	{
+		double f0 = 38.13547087602444;
+		double q  = 0.5003270373238773;
+
+		double k  = std::tan(pi * f0 / sample_rate);
+		double a0 = 1.0 + k / q + k * k;
+
+		high_pass.b0 = 1.0;
+		high_pass.b1 = -2.0;
+		high_pass.b2 = 1.0;
+		high_pass.a1 = 2.0 * (k * k - 1.0) / a0;
+		high_pass.a2 = (1.0 - k / q + k * k) / a0;
+	}
+}
+
+// Filter state of two channels, one for each lane. Kept unaligned since it lives in a std::vector.
+struct channel_pair
+{
+	double z[4][2];
+	double energy[2];
+};
+
+struct histogram_bin
+{
+	int64_t	count;
+	double	energy;
+};
+
+}
+
+struct loudness_meter::implementation : boost::noncopyable
+{
+	const int									interval_ms_;
+
+	safe_ptr<monitor::subject>					monitor_subject_;
+
+	int											sample_rate_;
+	int											num_channels_;
+	std::vector<double>							weights_;
+	biquad										shelf_;
+	biquad										high_pass_;
+	std::vector<channel_pair>					pairs_;
+
+	int											block_samples_;
+	int											block_position_;
+	std::deque<double>							blocks_;
+	std::vector<histogram_bin>					histogram_;
+
+	std::vector<float, tbb::cache_aligned_allocator<float>> peak_input_;
+	std::vector<float>							peak_history_;
+	std::vector<float>							peaks_;
+
+	int											interval_samples_;
+	int											samples_since_publish_;
+	int64_t										dropped_;
+
+	executor									executor_;
+
+	implementation(int interval_ms)
+		: interval_ms_(interval_ms)
+		, monitor_subject_(make_safe<monitor::subject>())
+		, sample_rate_(0)
+		, num_channels_(0)
+		, block_samples_(0)
+		, block_position_(0)
+		, interval_samples_(0)
+		, samples_since_publish_(0)
+		, dropped_(0)
+		, executor_(L"loudness_meter")
+	{
+		executor_.set_priority_class(below_normal_priority_class);
+	}
+
+	void push(const audio_buffer& audio, const video_format_desc& format_desc, const channel_layout& layout)
+	{
+		if(interval_ms_ <= 0 || audio.empty() || layout.num_channels <= 0)
+			return;
+
+		// Metering must never hold back the mixer, drop the frame if the worker is behind.
+		if(executor_.size() >= MAX_PENDING)
+		{
+			if(dropped_++ == 0)
+				CASPAR_LOG(warning) << L"[loudness_meter] Worker is behind, dropping audio from measurement.";
+			return;
+		}
+
+		auto samples		= std::make_shared<audio_buffer>(audio);
+		auto sample_rate	= static_cast<int>(format_desc.audio_sample_rate);
+		auto channel_layout = layout;
+
+		executor_.begin_invoke([=]
+		{
+			try
+			{
+				analyse(*samples, sample_rate, channel_layout);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		});
+	}
+
+	void reset(int sample_rate, const channel_layout& layout)
+	{
+		sample_rate_	= sample_rate;
+		num_channels_	= layout.num_channels;
+
+		weights_.assign(num_channels_, 1.0);
+		for(int n = 0; n < num_channels_ && n < static_cast<int>(layout.channel_names.size()); ++n)
+			weights_[n] = channel_weight(layout.channel_names[n]);
+
+		k_weighting(sample_rate_, shelf_, high_pass_);
+		channel_pair empty_pair = {};
+		pairs_.assign((num_channels_ + 1) / 2, empty_pair);
+
+		block_samples_		= std::max(1, sample_rate_ / 10);
+		block_position_		= 0;
+		blocks_.clear();
+
+		histogram_bin empty = {0, 0.0};
+		histogram_.assign(HISTOGRAM_BINS, empty);
+
+		peak_history_.assign(num_channels_ * TRUE_PEAK_HISTORY, 0.0f);
+		peaks_.assign(num_channels_, 0.0f);
+
+		interval_samples_		= std::max(1, static_cast<int>(static_cast<int64_t>(sample_rate_) * interval_ms_ / 1000));
+		samples_since_publish_	= 0;
+	}
+
+	void analyse(const audio_buffer& audio, int sample_rate, const channel_layout& layout)
+	{
+		if(sample_rate != sample_rate_ || layout.num_channels != num_channels_)
+			reset(sample_rate, layout);
+
+		const int32_t* samples	= audio.data();
+		int frames				= static_cast<int>(audio.size()) / num_channels_;
+
+		measure_true_peak(samples, frames);
+
+		for(int offset = 0; offset < frames;)
+		{
+			int count = std::min(frames - offset, block_samples_ - block_position_);
+
+			k_filter(samples + offset * num_channels_, count);
+
+			offset			+= count;
+			block_position_ += count;
+
+			if(block_position_ == block_samples_)
+				end_block();
+		}
+
+		samples_since_publish_ += frames;
+		if(samples_since_publish_ >= interval_samples_)
+		{
+			publish();
+			samples_since_publish_ = 0;
+		}
+	}
+
+	// Runs both K-weighting stages over each channel pair and accumulates the squared output.
+	void k_filter(const int32_t* samples, int count)
+	{
+		const __m128d scale = _mm_set1_pd(1.0 / 2147483648.0);
+
+		const __m128d sb0 = _mm_set1_pd(shelf_.b0), sb1 = _mm_set1_pd(shelf_.b1), sb2 = _mm_set1_pd(shelf_.b2);
+		const __m128d sa1 = _mm_set1_pd(shelf_.a1), sa2 = _mm_set1_pd(shelf_.a2);
+		const __m128d hb0 = _mm_set1_pd(high_pass_.b0), hb1 = _mm_set1_pd(high_pass_.b1), hb2 = _mm_set1_pd(high_pass_.b2);
+		const __m128d ha1 = _mm_set1_pd(high_pass_.a1), ha2 = _mm_set1_pd(high_pass_.a2);
+
+		for(size_t p = 0; p < pairs_.size(); ++p)
+		{
+			auto& pair		= pairs_[p];
+			bool  single	= static_cast<int>(p * 2 + 1) == num_channels_;
+
+			__m128d z0 = _mm_loadu_pd(pair.z[0]), z1 = _mm_loadu_pd(pair.z[1]);
+			__m128d z2 = _mm_loadu_pd(pair.z[2]), z3 = _mm_loadu_pd(pair.z[3]);
+			__m128d energy = _mm_loadu_pd(pair.energy);
+
+			const int32_t* source = samples + p * 2;
+
+			for(int n = 0; n < count; ++n, source += num_channels_)
+			{
+				__m128i in = single	? _mm_cvtsi32_si128(source[0])
+									: _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source));
+
+				__m128d x = _mm_mul_pd(_mm_cvtepi32_pd(in), scale);
+
+				// Transposed direct form II.
+				__m128d y = _mm_add_pd(_mm_mul_pd(sb0, x), z0);
+				z0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(sb1, x), _mm_mul_pd(sa1, y)), z1);
+				z1 = _mm_sub_pd(_mm_mul_pd(sb2, x), _mm_mul_pd(sa2, y));
+
+				__m128d w = _mm_add_pd(_mm_mul_pd(hb0, y), z2);
+				z2 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(hb1, y), _mm_mul_pd(ha1, w)), z3);
+				z3 = _mm_sub_pd(_mm_mul_pd(hb2, y), _mm_mul_pd(ha2, w));
+
+				energy = _mm_add_pd(energy, _mm_mul_pd(w, w));
+			}
+
+			_mm_storeu_pd(pair.z[0], z0);
+			_mm_storeu_pd(pair.z[1], z1);
+			_mm_storeu_pd(pair.z[2], z2);
+			_mm_storeu_pd(pair.z[3], z3);
+			_mm_storeu_pd(pair.energy, energy);
+		}
+	}
+
+	void end_block()
+	{
+		double sum = 0.0;
+		for(size_t p = 0; p < pairs_.size(); ++p)
+		{
+			auto& energy = pairs_[p].energy;
+
+			sum += weights_[p * 2] * energy[0];
+			if(static_cast<int>(p * 2 + 1) < num_channels_)
+				sum += weights_[p * 2 + 1] * energy[1];
+
+			energy[0] = energy[1] = 0.0;
+		}
+
+		blocks_.push_back(sum / block_samples_);
+		if(blocks_.size() > SHORT_TERM_BLOCKS)
+			blocks_.pop_front();
+
+		block_position_ = 0;
+
+		// Every sub-block completes a 400 ms gating block overlapping the previous by 75%.
+		if(blocks_.size() < MOMENTARY_BLOCKS)
+			return;
+
+		double gating_energy = mean_energy(MOMENTARY_BLOCKS);
+		double loudness		 = to_lufs(gating_energy);
+		if(loudness <= ABSOLUTE_GATE)
+			return;
+
+		int bin = std::min(HISTOGRAM_BINS - 1, static_cast<int>((loudness - ABSOLUTE_GATE) * 10.0));
+		histogram_[bin].count  += 1;
+		histogram_[bin].energy += gating_energy;
+	}
+
+	double mean_energy(size_t count) const
+	{
+		count = std::min(count, blocks_.size());
+		if(count == 0)
+			return 0.0;
+
+		double sum = 0.0;
+		for(auto it = blocks_.end() - count; it != blocks_.end(); ++it)
+			sum += *it;
+
+		return sum / count;
+	}
+
+	double integrated_loudness() const
+	{
+		int64_t count  = 0;
+		double	energy = 0.0;
+		BOOST_FOREACH(auto& bin, histogram_)
+		{
+			count  += bin.count;
+			energy += bin.energy;
+		}
+
+		if(count == 0)
+			return LOUDNESS_FLOOR;
+
+		double threshold = to_lufs(energy / count) + RELATIVE_GATE;
+		int first		 = std::max(0, static_cast<int>((threshold - ABSOLUTE_GATE) * 10.0));
+
+		count  = 0;
+		energy = 0.0;
+		for(int n = first; n < HISTOGRAM_BINS; ++n)
+		{
+			count  += histogram_[n].count;
+			energy += histogram_[n].energy;
+		}
+
+		return count > 0 ? to_lufs(energy / count) : LOUDNESS_FLOOR;
+	}
+
+	// Oversamples each channel 4 times, all four phases of a sample are computed in one vector.
+	void measure_true_peak(const int32_t* samples, int frames)
+	{
+		__m128 taps[12];
+		for(int n = 0; n < 12; ++n)
+			taps[n] = _mm_setr_ps(TRUE_PEAK_TAPS[0][n], TRUE_PEAK_TAPS[1][n], TRUE_PEAK_TAPS[2][n], TRUE_PEAK_TAPS[3][n]);
+
+		const float scale = 1.0f / 2147483648.0f;
+		const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+		peak_input_.resize(TRUE_PEAK_HISTORY + frames);
+
+		for(int c = 0; c < num_channels_; ++c)
+		{
+			float* history = peak_history_.data() + c * TRUE_PEAK_HISTORY;
+			float* input   = peak_input_.data();
+
+			std::copy(history, history + TRUE_PEAK_HISTORY, input);
+			for(int n = 0; n < frames; ++n)
+				input[TRUE_PEAK_HISTORY + n] = static_cast<float>(samples[n * num_channels_ + c]) * scale;
+
+			__m128 peak = _mm_set1_ps(peaks_[c]);
+
+			for(int n = 0; n < frames; ++n)
+			{
+				const float* newest = input + n + TRUE_PEAK_HISTORY;
+
+				__m128 out = _mm_setzero_ps();
+				for(int t = 0; t < 12; ++t)
+					out = _mm_add_ps(out, _mm_mul_ps(taps[t], _mm_set1_ps(newest[-t])));
+
+				peak = _mm_max_ps(peak, _mm_and_ps(out, sign));
+			}
+
+			float lanes[4];
+			_mm_storeu_ps(lanes, peak);
+			peaks_[c] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+
+			std::copy(input + frames, input + frames + TRUE_PEAK_HISTORY, history);
+		}
+	}
+
+	void publish()
+	{
+		*monitor_subject_ << monitor::message("/loudness")
+								% static_cast<float>(to_lufs(mean_energy(MOMENTARY_BLOCKS)))
+								% static_cast<float>(to_lufs(mean_energy(SHORT_TERM_BLOCKS)))
+								% static_cast<float>(integrated_loudness());
+
+		auto true_peak = monitor::message("/true-peak");
+		BOOST_FOREACH(auto& peak, peaks_)
+		{
+			true_peak % static_cast<float>(to_db(peak));
+			peak = 0.0f;
+		}
+		*monitor_subject_ << true_peak;
+	}
+};
+
+loudness_meter::loudness_meter(int interval_ms) : impl_(new implementation(interval_ms)){}
+void loudness_meter::push(const audio_buffer& audio, const video_format_desc& format_desc, const channel_layout& layout){impl_->push(audio, format_desc, layout);}
+monitor::subject& loudness_meter::monitor_output(){return *impl_->monitor_subject_;}
+
+}}
@@ -0,0 +1,56 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "audio_mixer.h"
+
+#include "../../monitor/monitor.h"
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar { namespace core {
+
+struct video_format_desc;
+struct channel_layout;
+
+/**
+ * EBU R128 / ITU-R BS.1770 loudness and true-peak meter. Mixed audio is
+ * analysed on a low priority worker and the momentary, short-term and
+ * integrated loudness (LUFS) and the per channel true-peak (dBTP) are
+ * published as "/loudness" and "/true-peak" monitor messages every
+ * interval_ms milliseconds of audio. An interval of 0 disables the meter.
+ */
+class loudness_meter : boost::noncopyable
+{
+public:
+	explicit loudness_meter(int interval_ms);
+
+	void push(const audio_buffer& audio, const video_format_desc& format_desc, const channel_layout& layout);
+
+	monitor::subject& monitor_output();
+
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
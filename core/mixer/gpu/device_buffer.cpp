@@ -28,14 +28,23 @@
 #include <common/exception/exceptions.h>
 #include <common/gl/gl_check.h>
 
+#include <core/producer/frame/pixel_format.h>
+
 #include <gl/glew.h>
 
+#include <boost/foreach.hpp>
+
 #include <tbb/atomic.h>
+#include <tbb/cache_aligned_allocator.h>
+
+#include <vector>
 
 namespace caspar { namespace core {
 	
 static GLenum FORMAT[] = {0, GL_RED, GL_RG, GL_BGR, GL_BGRA};
 static GLenum INTERNAL_FORMAT[] = {0, GL_R8, GL_RG8, GL_RGB8, GL_RGBA8};	
+static GLenum INTERNAL_FORMAT16[] = {0, GL_R16, GL_RG16, GL_RGB16, GL_RGBA16};	
+static GLenum COMPRESSED_FORMAT[] = {0, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RGBA_BPTC_UNORM_ARB};
 
 unsigned int format(uint32_t stride)
 {
@@ -43,6 +52,7 @@ unsigned int format(uint32_t stride)
 }
 
 static tbb::atomic<int> g_total_count;
+static tbb::atomic<int64_t> g_generation;
 
 struct device_buffer::implementation : boost::noncopyable
 {
@@ -51,31 +61,55 @@ struct device_buffer::implementation : boost::noncopyable
 	const uint32_t width_;
 	const uint32_t height_;
 	const uint32_t stride_;
+	const uint32_t depth_;
+
+	const texture_compression::type compression_;
+	const uint32_t size_;
 
 	fence		 fence_;
+	int64_t		 generation_;
+
+	const bool	 software_;
+	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> data_;
 
 public:
-	implementation(uint32_t width, uint32_t height, uint32_t stride) 
-		: width_(width)
+	implementation(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression, bool software) 
+		: id_(0)
+		, width_(width)
 		, height_(height)
 		, stride_(stride)
+		, depth_(depth)
+		, compression_(compression)
+		, size_(compression != texture_compression::none ? get_compressed_size(compression, width, height) : width*height*stride*depth)
+		, generation_(++g_generation)
+		, software_(software)
 	{	
+		if(software_)
+		{
+			data_.resize(size_, 0);
+			return;
+		}
+
 		GL(glGenTextures(1, &id_));
 		GL(glBindTexture(GL_TEXTURE_2D, id_));
 		GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
 		GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
 		GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
 		GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-		GL(glTexImage2D(GL_TEXTURE_2D, 0, INTERNAL_FORMAT[stride_], static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), 0, FORMAT[stride_], GL_UNSIGNED_BYTE, NULL));
+		if(compression_ != texture_compression::none)
+			GL(glCompressedTexImage2D(GL_TEXTURE_2D, 0, COMPRESSED_FORMAT[compression_], static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), 0, static_cast<GLsizei>(size_), NULL));
+		else
+			GL(glTexImage2D(GL_TEXTURE_2D, 0, depth_ == 2 ? INTERNAL_FORMAT16[stride_] : INTERNAL_FORMAT[stride_], static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), 0, FORMAT[stride_], type(), NULL));
 		GL(glBindTexture(GL_TEXTURE_2D, 0));
-		CASPAR_LOG(trace) << "[device_buffer] [" << ++g_total_count << L"] allocated size:" << width*height*stride;	
+		CASPAR_LOG(trace) << "[device_buffer] [" << ++g_total_count << L"] allocated size:" << size_;	
 	}	
 
 	~implementation()
 	{
 		try
 		{
-			GL(glDeleteTextures(1, &id_));
+			if(!software_)
+				GL(glDeleteTextures(1, &id_));
 			//CASPAR_LOG(trace) << "[device_buffer] [" << --g_total_count << L"] deallocated size:" << width_*height_*stride_;
 		}
 		catch(...)
@@ -84,6 +118,11 @@ public:
 		}
 	}
 	
+	GLenum type() const
+	{
+		return depth_ == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+	}
+
 	void bind()
 	{
 		GL(glBindTexture(GL_TEXTURE_2D, id_));
@@ -102,27 +141,90 @@ public:
 
 	void begin_read()
 	{
+		if(software_) // Copied in by the device.
+		{
+			generation_ = ++g_generation;
+			return;
+		}
+
 		bind();
-		GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), FORMAT[stride_], GL_UNSIGNED_BYTE, NULL));
+		GL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1)); // Rows of packed 16 bit rgb are not 4 byte aligned.
+		if(compression_ != texture_compression::none) // The blocks as they are, the gpu decodes them when sampling.
+			GL(glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), COMPRESSED_FORMAT[compression_], static_cast<GLsizei>(size_), NULL));
+		else
+			GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, static_cast<GLsizei>(width_), static_cast<GLsizei>(height_), FORMAT[stride_], type(), NULL));
 		unbind();
 		fence_.set();
+		generation_ = ++g_generation;
+	}
+
+	void begin_read(const std::vector<image_region>& regions)
+	{
+		if(compression_ != texture_compression::none || software_)
+			return begin_read();
+
+		bind();
+		GL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+		GL(glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(width_)));
+		BOOST_FOREACH(auto& region, regions)
+		{
+			GL(glPixelStorei(GL_UNPACK_SKIP_PIXELS, static_cast<GLint>(region.x)));
+			GL(glPixelStorei(GL_UNPACK_SKIP_ROWS, static_cast<GLint>(region.y)));
+			GL(glTexSubImage2D(GL_TEXTURE_2D, 0, region.x, region.y, static_cast<GLsizei>(region.width), static_cast<GLsizei>(region.height), FORMAT[stride_], type(), NULL));
+		}
+		GL(glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0));
+		GL(glPixelStorei(GL_UNPACK_SKIP_ROWS, 0));
+		GL(glPixelStorei(GL_UNPACK_ROW_LENGTH, 0));
+		unbind();
+		fence_.set();
+		generation_ = ++g_generation;
+	}
+
+	void begin_read_at(const image_region& placement)
+	{
+		if(compression_ != texture_compression::none || software_)
+			return begin_read();
+
+		bind();
+		GL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+		GL(glTexSubImage2D(GL_TEXTURE_2D, 0, placement.x, placement.y, static_cast<GLsizei>(placement.width), static_cast<GLsizei>(placement.height), FORMAT[stride_], type(), NULL));
+		unbind();
+		fence_.set();
+		generation_ = ++g_generation;
 	}
 	
 	bool ready() const
 	{
 		return fence_.ready();
 	}
+
+	void end_write()
+	{
+		if(!software_)
+			fence_.set();
+		generation_ = ++g_generation; // Render targets handed on as sources must not match the static layer cache of an earlier frame.
+	}
 };
 
-device_buffer::device_buffer(uint32_t width, uint32_t height, uint32_t stride) : impl_(new implementation(width, height, stride)){}
+device_buffer::device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression, bool software) : impl_(new implementation(width, height, stride, depth, compression, software)){}
 uint32_t device_buffer::stride() const { return impl_->stride_; }
+uint32_t device_buffer::depth() const { return impl_->depth_; }
 uint32_t device_buffer::width() const { return impl_->width_; }
 uint32_t device_buffer::height() const { return impl_->height_; }
+texture_compression::type device_buffer::compression() const { return impl_->compression_; }
+uint32_t device_buffer::size() const { return impl_->size_; }
 void device_buffer::bind(int index){impl_->bind(index);}
 void device_buffer::unbind(){impl_->unbind();}
 void device_buffer::begin_read(){impl_->begin_read();}
+void device_buffer::begin_read(const std::vector<image_region>& regions){impl_->begin_read(regions);}
+void device_buffer::begin_read_at(const image_region& placement){impl_->begin_read_at(placement);}
 bool device_buffer::ready() const{return impl_->ready();}
+void device_buffer::end_write(){impl_->end_write();}
+void device_buffer::wait_written() const{impl_->fence_.gpu_wait();}
+int64_t device_buffer::generation() const{return impl_->generation_;}
 int device_buffer::id() const{ return impl_->id_;}
+uint8_t* device_buffer::data(){return impl_->software_ ? impl_->data_.data() : nullptr;}
+const uint8_t* device_buffer::data() const{return impl_->software_ ? impl_->data_.data() : nullptr;}
 
 
 }}
\ No newline at end of file
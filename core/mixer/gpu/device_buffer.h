@@ -23,28 +23,50 @@
 
 #include <common/memory/safe_ptr.h>
 
+#include <core/producer/frame/pixel_format.h>
+
 #include <boost/noncopyable.hpp>
 
 #include <memory>
+#include <vector>
 
 namespace caspar { namespace core {
+
+struct image_region;
 		
 class device_buffer : boost::noncopyable
 {
 public:
 	
 	uint32_t stride() const;	
+	uint32_t depth() const;
 	uint32_t width() const;
 	uint32_t height() const;
+	texture_compression::type compression() const; // Sampled as rgba when compressed, stride is then 4.
+	uint32_t size() const; // Bytes of the texture.
 		
 	void bind(int index);
 	void unbind();
 		
 	void begin_read();
+	void begin_read(const std::vector<image_region>& regions); // Only the regions of the bound upload buffer, which holds the whole image.
+	void begin_read_at(const image_region& placement); // The bound upload buffer holds only the placement.
 	bool ready() const;
+
+	// Fences the commands rendering into the buffer, for other contexts that sample it. 
+	void end_write();
+	void wait_written() const; // In the sampling context, see fence::gpu_wait.
+
+	// Unique for every upload and finished render, buffers with the same generation have the same content unless they 
+	// are render targets still being drawn into.
+	int64_t generation() const;
+
+	// The pixels of a buffer of a software device, laid out as in host memory. Null for gpu textures.
+	uint8_t* data();
+	const uint8_t* data() const;
 private:
 	friend class ogl_device;
-	device_buffer(uint32_t width, uint32_t height, uint32_t stride);
+	device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression = texture_compression::none, bool software = false);
 
 	int id() const;
 
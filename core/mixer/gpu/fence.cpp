@@ -29,23 +29,30 @@
 
 #include <gl/glew.h>
 
+#include <boost/timer.hpp>
+
+#include <tbb/spin_mutex.h>
+
 namespace caspar { namespace core {
 
 struct fence::implementation
 {
-	GLsync sync_;
+	GLsync					sync_;
+	mutable tbb::spin_mutex mutex_; // Textures of an atlas page are set by the transfer context while the render context checks them.
 
 	implementation() : sync_(0){}
 	~implementation(){glDeleteSync(sync_);}
 		
 	void set()
 	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
 		glDeleteSync(sync_);
 		sync_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 	}
 
 	bool ready() const
 	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
 		if(!sync_)
 			return true;
 
@@ -57,17 +64,28 @@ struct fence::implementation
 		return values[0] == GL_SIGNALED;
 	}
 
+	void gpu_wait() const
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		if(sync_)
+			GL(glWaitSync(sync_, 0, GL_TIMEOUT_IGNORED));
+	}
+
 	void wait(ogl_device& ogl)
 	{	
-		int delay = 0;
-		if(!ogl.invoke([this]{return ready();}, high_priority))
+		if(ogl.invoke([this]{return ready();}, high_priority))
+			return;
+
+		// Block in the driver until the fence is signalled instead of polling it, the frames are
+		// normally read back into a ring deep enough for this to be rare.
+		boost::timer timer;
+
+		ogl.invoke([this]
 		{
-			while(!ogl.invoke([this]{return ready();}, normal_priority) && delay < 20)
-			{
-				delay += 2;
-				Sleep(2);
-			}
-		}
+			glClientWaitSync(sync_, GL_SYNC_FLUSH_COMMANDS_BIT, 20*1000*1000); // 20 ms
+		}, normal_priority);
+
+		int delay = static_cast<int>(timer.elapsed()*1000.0);
 		
 		static tbb::atomic<uint32_t> count;
 		static tbb::atomic<bool> warned;
@@ -82,7 +100,7 @@ struct fence::implementation
 									<< L" Further help is available at (www.casparcg.com/forum).";
 			}
 			else
-				CASPAR_LOG(trace) << L"[fence] Performance warning. GPU was not ready during requested host read-back. Delayed by atleast: " << delay << L" ms.";
+				CASPAR_LOG_RATE_LIMITED(trace, 1) << L"[fence] Performance warning. GPU was not ready during requested host read-back. Delayed by atleast: " << delay << L" ms.";
 		}
 	}
 };
@@ -117,4 +135,10 @@ void fence::wait(ogl_device& ogl)
 		impl_->wait(ogl);
 }
 
+void fence::gpu_wait() const
+{
+	if(impl_)
+		impl_->gpu_wait();
+}
+
 }}
\ No newline at end of file
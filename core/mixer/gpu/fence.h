@@ -37,6 +37,10 @@ public:
 	void set();
 	bool ready() const;
 	void wait(ogl_device& ogl);
+
+	// Makes the commands issued after this in the calling context wait for the fence, without blocking the thread. 
+	// The context must share objects with the one the fence was set in.
+	void gpu_wait() const;
 private:
 	struct implementation;
 	std::shared_ptr<implementation> impl_;
@@ -33,11 +33,26 @@
 #include <gl/glew.h>
 
 #include <tbb/atomic.h>
+#include <tbb/cache_aligned_allocator.h>
+
+#include <vector>
 
 namespace caspar { namespace core {
 
 static tbb::atomic<int> g_w_total_count;
 static tbb::atomic<int> g_r_total_count;
+
+// GL_ARB_buffer_storage is newer than the glew version in use.
+#define CASPAR_GL_MAP_PERSISTENT_BIT	0x0040
+#define CASPAR_GL_MAP_COHERENT_BIT		0x0080
+
+typedef void (APIENTRY *buffer_storage_proc)(GLenum target, GLsizeiptr size, const GLvoid* data, GLbitfield flags);
+
+buffer_storage_proc get_buffer_storage()
+{
+	static buffer_storage_proc proc = glewGetExtension("GL_ARB_buffer_storage") ? reinterpret_cast<buffer_storage_proc>(wglGetProcAddress("glBufferStorage")) : nullptr;
+	return proc;
+}
 																																								
 struct host_buffer::implementation : boost::noncopyable
 {	
@@ -47,18 +62,38 @@ struct host_buffer::implementation : boost::noncopyable
 	GLenum			usage_;
 	GLenum			target_;
 	fence			fence_;
+	bool			persistent_;
+	const bool		software_;
+	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> memory_;
 
 public:
-	implementation(uint32_t size, usage_t usage) 
+	implementation(uint32_t size, usage_t usage, bool software) 
 		: size_(size)
 		, data_(nullptr)
 		, pbo_(0)
 		, target_(usage == write_only ? GL_PIXEL_UNPACK_BUFFER : GL_PIXEL_PACK_BUFFER)
 		, usage_(usage == write_only ? GL_STREAM_DRAW : GL_STREAM_READ)
+		, persistent_(software || (usage == write_only && get_buffer_storage() != nullptr))
+		, software_(software)
 	{
+		if(software_)
+		{
+			// Plain memory which stays mapped, uploads copy from it right away.
+			memory_.resize(size_);
+			data_ = memory_.data();
+			return;
+		}
+
 		GL(glGenBuffers(1, &pbo_));
 		GL(glBindBuffer(target_, pbo_));
-		if(usage_ != write_only)	
+		if(persistent_)
+		{
+			// Mapped once for its whole lifetime, producers write straight into memory the gpu reads from.
+			const GLbitfield flags = GL_MAP_WRITE_BIT | CASPAR_GL_MAP_PERSISTENT_BIT | CASPAR_GL_MAP_COHERENT_BIT;
+			GL(get_buffer_storage()(target_, size_, NULL, flags));
+			data_ = GL2(glMapBufferRange(target_, 0, size_, flags));
+		}
+		else if(usage_ != write_only)	
 			GL(glBufferData(target_, size_, NULL, usage_));	
 		GL(glBindBuffer(target_, 0));
 
@@ -72,7 +107,8 @@ public:
 	{
 		try
 		{
-			GL(glDeleteBuffers(1, &pbo_));
+			if(!software_)
+				GL(glDeleteBuffers(1, &pbo_));
 			//CASPAR_LOG(trace) << "[host_buffer] [" << --(usage_ == write_only ? g_w_total_count : g_r_total_count) << L"] deallocated size:" << size_ << " usage: " << (usage_ == write_only ? "write_only" : "read_only");
 		}
 		catch(...)
@@ -83,7 +119,7 @@ public:
 
 	void map()
 	{
-		if(data_)
+		if(data_ || persistent_)
 			return;
 
 		if(usage_ == write_only)			
@@ -103,7 +139,7 @@ public:
 
 	void unmap()
 	{
-		if(!data_)
+		if(!data_ || persistent_)
 			return;
 		
 		GL(glBindBuffer(target_, pbo_));
@@ -114,16 +150,21 @@ public:
 
 	void bind()
 	{
-		GL(glBindBuffer(target_, pbo_));
+		if(!software_)
+			GL(glBindBuffer(target_, pbo_));
 	}
 
 	void unbind()
 	{
-		GL(glBindBuffer(target_, 0));
+		if(!software_)
+			GL(glBindBuffer(target_, 0));
 	}
 
 	void begin_read(uint32_t width, uint32_t height, unsigned int format)
 	{
+		if(software_) // Rendered into directly.
+			return;
+
 		unmap();
 		bind();
 		GL(glReadPixels(0, 0, static_cast<GLsizei>(width), static_cast<GLsizei>(height), static_cast<GLuint>(format), GL_UNSIGNED_BYTE, NULL));
@@ -131,13 +172,19 @@ public:
 		fence_.set();
 	}
 
+	void end_upload()
+	{
+		if(!software_)
+			fence_.set();
+	}
+
 	bool ready() const
 	{
 		return fence_.ready();
 	}
 };
 
-host_buffer::host_buffer(uint32_t size, usage_t usage) : impl_(new implementation(size, usage)){}
+host_buffer::host_buffer(uint32_t size, usage_t usage, bool software) : impl_(new implementation(size, usage, software)){}
 const void* host_buffer::data() const {return impl_->data_;}
 void* host_buffer::data() {return impl_->data_;}
 void host_buffer::map(){impl_->map();}
@@ -146,6 +193,8 @@ void host_buffer::bind(){impl_->bind();}
 void host_buffer::unbind(){impl_->unbind();}
 void host_buffer::begin_read(uint32_t width, uint32_t height, unsigned int format){impl_->begin_read(width, height, format);}
 uint32_t host_buffer::size() const { return impl_->size_; }
+void host_buffer::end_upload(){impl_->end_upload();}
+bool host_buffer::persistent() const{return impl_->persistent_;}
 bool host_buffer::ready() const{return impl_->ready();}
 void host_buffer::wait(ogl_device& ogl){impl_->wait(ogl);}
 
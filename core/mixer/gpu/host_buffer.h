@@ -50,11 +50,13 @@ public:
 	void unmap();
 	
 	void begin_read(uint32_t width, uint32_t height, unsigned int format);
+	void end_upload(); // Called after the buffer has been used as the source of an upload.
+	bool persistent() const; // Stays mapped, must not be written until ready() after an upload.
 	bool ready() const;
 	void wait(ogl_device& ogl);
 private:
 	friend class ogl_device;
-	host_buffer(uint32_t size, usage_t usage);
+	host_buffer(uint32_t size, usage_t usage, bool software = false); // Plain memory for a device without an OpenGL context.
 
 	struct implementation;
 	safe_ptr<implementation> impl_;
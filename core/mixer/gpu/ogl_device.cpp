@@ -19,38 +19,126 @@
 * Author: Robert Nagy, ronag89@gmail.com
 */
 
-// TODO: Smart GC
-
 #include "../../stdafx.h"
 
 #include "ogl_device.h"
 
 #include "shader.h"
+#include "texture_atlas.h"
 
 #include <common/exception/exceptions.h>
 #include <common/utility/assert.h>
 #include <common/gl/gl_check.h>
+#include <common/env.h>
+#include <common/memory/memcpy.h>
 
 #include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #include <gl/glew.h>
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 namespace caspar { namespace core {
 
-ogl_device::ogl_device() 
+template<typename T>
+bool evict(buffer_pool<T>& pool, tbb::atomic<int64_t>& bytes)
+{
+	std::shared_ptr<T> item;
+	if(!pool.items.try_pop(item))
+		return false;
+
+	--pool.allocated;
+	++pool.evictions;
+	bytes -= pool.item_size;
+
+	return true;
+}
+
+// Releases one free buffer from the least recently used pool that has not been used since max_last_use.
+template<typename P>
+bool evict_lru(P& pools, tbb::atomic<int64_t>& bytes, int64_t max_last_use, bool keep_reserved = false)
+{
+	typedef typename P::value_type::mapped_type::element_type pool_t;
+
+	std::shared_ptr<pool_t> lru;
+	BOOST_FOREACH(auto& pool_map, pools)
+	{
+		BOOST_FOREACH(auto& pool, pool_map)
+		{
+			if(keep_reserved && pool.second->allocated <= pool.second->reserved)
+				continue;
+			if(!pool.second->items.empty() && pool.second->last_use <= max_last_use && (!lru || pool.second->last_use < lru->last_use))
+				lru = pool.second;
+		}
+	}
+
+	return lru && evict(*lru, bytes);
+}
+
+template<typename T>
+void clear_pool(buffer_pool<T>& pool, tbb::atomic<int64_t>& bytes)
+{
+	std::shared_ptr<T> item;
+	while(pool.items.try_pop(item))
+	{
+		--pool.allocated;
+		bytes -= pool.item_size;
+	}
+}
+
+template<typename T>
+boost::property_tree::wptree pool_info(const buffer_pool<T>& pool)
+{
+	boost::property_tree::wptree info;
+	info.add(L"allocated",	static_cast<int>(pool.allocated));
+	info.add(L"free",		static_cast<int>(pool.items.size()));
+	info.add(L"bytes",		static_cast<int64_t>(pool.allocated) * pool.item_size);
+	info.add(L"hits",		static_cast<int64_t>(pool.hits));
+	info.add(L"misses",		static_cast<int64_t>(pool.misses));
+	info.add(L"evictions",	static_cast<int64_t>(pool.evictions));
+	info.add(L"reserved",	static_cast<int>(pool.reserved));
+	return info;
+}
+
+ogl_device::ogl_device(bool software) 
 	: executor_(L"ogl_device")
+	, software_(software)
 	, pattern_(nullptr)
 	, attached_texture_(0)
 	, attached_fbo_(0)
 	, active_shader_(0)
 	, read_buffer_(0)
+	, transfer_fbo_(0)
+	, render_sync_(0)
 {
+	uploads_scheduled_ = false;
+	trim_scheduled_		= false;
+	device_bytes_		= 0;
+	host_bytes_			= 0;
+	pageable_bytes_		= 0;
+	tick_				= 0;
+	device_budget_		= std::max(0, env::properties().get(L"configuration.mixer.device-buffer-budget", 0)) * 1024LL * 1024LL;
+	host_budget_		= std::max(0, env::properties().get(L"configuration.mixer.host-buffer-budget", 0)) * 1024LL * 1024LL;
+
 	CASPAR_LOG(info) << L"Initializing OpenGL Device.";
 
 	std::fill(binded_textures_.begin(), binded_textures_.end(), 0);
 	std::fill(viewport_.begin(), viewport_.end(), 0);
 	std::fill(scissor_.begin(), scissor_.end(), 0);
 	std::fill(blend_func_.begin(), blend_func_.end(), 0);
+	std::fill(compressions_.begin(), compressions_.end(), false);
+
+	if(software_)
+	{
+		compressions_[texture_compression::none] = true;
+		CASPAR_LOG(info) << L"Initialized software device, the mixer composites on the cpu.";
+		return;
+	}
+
+	atlas_.reset(new texture_atlas(*this));
 	
 	invoke([=]
 	{
@@ -66,29 +154,79 @@ ogl_device::ogl_device()
 			BOOST_THROW_EXCEPTION(gl::ogl_exception() << msg_info("Your graphics card does not meet the minimum hardware requirements since it does not support OpenGL 3.0 or higher. CasparCG Server will not be able to continue."));
 	
 		glGenFramebuffers(1, &fbo_);	
+
+		compressions_[texture_compression::none] = true;
+		compressions_[texture_compression::dxt1] = compressions_[texture_compression::dxt5] = GLEW_EXT_texture_compression_s3tc != 0;
+		compressions_[texture_compression::bc7]	 = GLEW_VERSION_4_2 || GLEW_ARB_texture_compression_bptc;
 		
 		CASPAR_LOG(info) << L"Successfully initialized OpenGL Device.";
 	});
+
+	if(env::properties().get(L"configuration.mixer.transfer-context", false))
+	{
+		if(!GLEW_ARB_sync)
+			CASPAR_LOG(warning) << L"GL_SYNC not supported, uploading in the render context.";
+		else
+		{
+			transfer_executor_.reset(new executor(L"ogl_transfer"));
+			transfer_executor_->invoke([=]
+			{
+				transfer_context_.reset(new sf::Context());
+				transfer_context_->SetActive(true);
+				glGenFramebuffers(1, &transfer_fbo_);
+			});
+
+			CASPAR_LOG(info) << L"Initialized OpenGL transfer context.";
+		}
+	}
 }
 
 ogl_device::~ogl_device()
 {
+	if(transfer_executor_)
+	{
+		transfer_executor_->invoke([=]
+		{
+			pending_upload upload;
+			while(uploads_.try_pop(upload))
+			{
+			}
+			retiring_uploads_.clear();
+			glDeleteFramebuffers(1, &transfer_fbo_);
+			transfer_context_.reset();
+		});
+		transfer_executor_.reset();
+	}
+
 	invoke([=]
 	{
+		atlas_.reset();
 		BOOST_FOREACH(auto& pool, device_pools_)
 			pool.clear();
 		BOOST_FOREACH(auto& pool, host_pools_)
 			pool.clear();
-		glDeleteFramebuffers(1, &fbo_);
+		BOOST_FOREACH(auto& pool, pageable_pools_)
+			pool.clear();
+		retired_uploads_.clear();
+		retiring_uploads_.clear();
+		if(!software_)
+			glDeleteFramebuffers(1, &fbo_);
+		if(render_sync_)
+			glDeleteSync(render_sync_);
 	});
 }
 
-safe_ptr<device_buffer> ogl_device::allocate_device_buffer(uint32_t width, uint32_t height, uint32_t stride)
+safe_ptr<device_buffer> ogl_device::allocate_device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression)
 {
+	const int64_t size = compression != texture_compression::none ? get_compressed_size(compression, width, height) : static_cast<int64_t>(width) * height * stride * depth;
+	while(device_budget_ > 0 && device_bytes_ + size > device_budget_ && evict_lru(device_pools_, device_bytes_, tick_))
+	{
+	}
+
 	std::shared_ptr<device_buffer> buffer;
 	try
 	{
-		buffer.reset(new device_buffer(width, height, stride));
+		buffer.reset(new device_buffer(width, height, stride, depth, compression, software_));
 	}
 	catch(...)
 	{
@@ -100,7 +238,7 @@ safe_ptr<device_buffer> ogl_device::allocate_device_buffer(uint32_t width, uint3
 			future.wait();
 					
 			// Try again
-			buffer.reset(new device_buffer(width, height, stride));
+			buffer.reset(new device_buffer(width, height, stride, depth, compression, software_));
 		}
 		catch(...)
 		{
@@ -111,16 +249,41 @@ safe_ptr<device_buffer> ogl_device::allocate_device_buffer(uint32_t width, uint3
 	return make_safe_ptr(buffer);
 }
 				
-safe_ptr<device_buffer> ogl_device::create_device_buffer(uint32_t width, uint32_t height, uint32_t stride)
+safe_ptr<device_buffer> ogl_device::create_device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth)
 {
 	CASPAR_VERIFY(stride > 0 && stride < 5);
+	CASPAR_VERIFY(depth == 1 || depth == 2);
 	CASPAR_VERIFY(width > 0 && height > 0);
-	auto& pool = device_pools_[stride-1][((width << 16) & 0xFFFF0000) | (height & 0x0000FFFF)];
+	return pooled_device_buffer((depth-1)*4 + stride-1, width, height, stride, depth, texture_compression::none);
+}
+
+safe_ptr<device_buffer> ogl_device::create_compressed_device_buffer(uint32_t width, uint32_t height, texture_compression::type compression)
+{
+	CASPAR_VERIFY(compression > texture_compression::none && compression < texture_compression::count);
+	CASPAR_VERIFY(width > 0 && height > 0);
+	return pooled_device_buffer(8 + compression-1, width, height, 4, 1, compression);
+}
+
+bool ogl_device::supports(texture_compression::type compression) const
+{
+	return compression >= texture_compression::none && compression < texture_compression::count && compressions_[compression];
+}
+
+safe_ptr<device_buffer> ogl_device::pooled_device_buffer(size_t pool_index, uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression)
+{
+	auto& pool = device_pools_[pool_index][((width << 16) & 0xFFFF0000) | (height & 0x0000FFFF)];
+	pool->item_size = compression != texture_compression::none ? get_compressed_size(compression, width, height) : width*height*stride*depth;
+	pool->last_use	= tick_;
 	std::shared_ptr<device_buffer> buffer;
-	if(!pool->items.try_pop(buffer))		
-		buffer = executor_.invoke([&]{return allocate_device_buffer(width, height, stride);}, high_priority);			
-	
-	//++pool->usage_count;
+	if(pool->items.try_pop(buffer))
+		++pool->hits;
+	else
+	{
+		++pool->misses;
+		buffer = executor_.invoke([&]{return allocate_device_buffer(width, height, stride, depth, compression);}, high_priority);			
+		++pool->allocated;
+		device_bytes_ += pool->item_size;
+	}
 
 	return safe_ptr<device_buffer>(buffer.get(), [=](device_buffer*) mutable
 	{		
@@ -130,11 +293,15 @@ safe_ptr<device_buffer> ogl_device::create_device_buffer(uint32_t width, uint32_
 
 safe_ptr<host_buffer> ogl_device::allocate_host_buffer(uint32_t size, usage_t usage)
 {
+	while(host_budget_ > 0 && host_bytes_ + size > host_budget_ && evict_lru(host_pools_, host_bytes_, tick_))
+	{
+	}
+
 	std::shared_ptr<host_buffer> buffer;
 
 	try
 	{
-		buffer.reset(new host_buffer(size, usage));
+		buffer.reset(new host_buffer(size, usage, software_));
 		if(usage == write_only)
 			buffer->map();
 		else
@@ -150,7 +317,7 @@ safe_ptr<host_buffer> ogl_device::allocate_host_buffer(uint32_t size, usage_t us
 			future.wait();
 
 			// Try again
-			buffer.reset(new host_buffer(size, usage));
+			buffer.reset(new host_buffer(size, usage, software_));
 			if(usage == write_only)
 				buffer->map();
 			else
@@ -171,15 +338,36 @@ safe_ptr<host_buffer> ogl_device::create_host_buffer(uint32_t size, usage_t usag
 	CASPAR_VERIFY(usage == write_only || usage == read_only);
 	CASPAR_VERIFY(size > 0);
 	auto& pool = host_pools_[usage][size];
+	pool->item_size = size;
+	pool->last_use	= tick_;
 	std::shared_ptr<host_buffer> buffer;
-	if(!pool->items.try_pop(buffer))	
+	if(pool->items.try_pop(buffer))
+		++pool->hits;
+	else
+	{
+		++pool->misses;
 		buffer = executor_.invoke([=]{return allocate_host_buffer(size, usage);}, high_priority);	
-	
-	//++pool->usage_count;
+		++pool->allocated;
+		host_bytes_ += pool->item_size;
+	}
 
 	auto self = shared_from_this();
 	return safe_ptr<host_buffer>(buffer.get(), [=](host_buffer*) mutable
 	{
+		if(self->software_)
+		{
+			pool->items.push(buffer);
+			return;
+		}
+
+		// Persistently mapped buffers need no work on the ogl thread, they are returned to the pool 
+		// by the next upload once the gpu has finished reading them.
+		if(buffer->persistent())
+		{
+			self->retired_uploads_.push(std::make_pair(buffer, pool));
+			return;
+		}
+
 		self->executor_.begin_invoke([=]() mutable
 		{		
 			if(usage == write_only)
@@ -192,48 +380,285 @@ safe_ptr<host_buffer> ogl_device::create_host_buffer(uint32_t size, usage_t usag
 	});
 }
 
-safe_ptr<ogl_device> ogl_device::create()
+safe_ptr<host_buffer> ogl_device::create_pageable_buffer(uint32_t size)
+{
+	CASPAR_VERIFY(size > 0);
+	auto& pool = pageable_pools_[0][size];
+	pool->item_size = size;
+	pool->last_use	= tick_;
+	std::shared_ptr<host_buffer> buffer;
+	if(pool->items.try_pop(buffer))
+		++pool->hits;
+	else
+	{
+		// Needs no context, allocated on the calling thread.
+		++pool->misses;
+		buffer.reset(new host_buffer(size, read_only, true));
+		++pool->allocated;
+		pageable_bytes_ += pool->item_size;
+	}
+
+	return safe_ptr<host_buffer>(buffer.get(), [=](host_buffer*) mutable
+	{
+		pool->items.push(buffer);
+	});
+}
+
+void ogl_device::reserve_device_buffers(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, int count)
+{
+	std::vector<safe_ptr<device_buffer>> buffers;
+	for(int n = 0; n < count; ++n)
+		buffers.push_back(create_device_buffer(width, height, stride, depth));
+
+	auto& pool = device_pools_[(depth-1)*4 + stride-1][((width << 16) & 0xFFFF0000) | (height & 0x0000FFFF)];
+	pool->reserved = std::max<int>(pool->reserved, count);
+}
+
+void ogl_device::reserve_host_buffers(uint32_t size, usage_t usage, int count)
+{
+	std::vector<safe_ptr<host_buffer>> buffers;
+	for(int n = 0; n < count; ++n)
+	{
+		auto buffer = create_host_buffer(size, usage);
+
+		// Page locked memory is only backed once it is written to.
+		if(usage == write_only && buffer->data())
+			std::memset(buffer->data(), 0, size);
+
+		buffers.push_back(buffer);
+	}
+
+	auto& pool = host_pools_[usage][size];
+	pool->reserved = std::max<int>(pool->reserved, count);
+}
+
+void ogl_device::upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target)
+{
+	if(software_)
+		return copy_upload(*source, *target, nullptr, std::vector<image_region>(), image_region());
+
+	pending_upload upload;
+	upload.source = source;
+	upload.target = target;
+	uploads_.push(upload);
+
+	schedule_uploads();
+}
+
+void ogl_device::upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target, const safe_ptr<device_buffer>& base, const std::vector<image_region>& regions)
+{
+	if(software_)
+		return copy_upload(*source, *target, base.get(), regions, image_region());
+
+	pending_upload upload;
+	upload.source	= source;
+	upload.target	= target;
+	upload.base		= base;
+	upload.regions	= regions;
+	uploads_.push(upload);
+
+	schedule_uploads();
+}
+
+void ogl_device::upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target, const image_region& placement)
 {
-	return safe_ptr<ogl_device>(new ogl_device());
+	if(software_)
+		return copy_upload(*source, *target, nullptr, std::vector<image_region>(), placement);
+
+	pending_upload upload;
+	upload.source		= source;
+	upload.target		= target;
+	upload.placement	= placement;
+	uploads_.push(upload);
+
+	schedule_uploads();
+}
+
+// Uploads of a software device are copies in the calling thread, the frame is ready when it is committed.
+void ogl_device::copy_upload(const host_buffer& source, device_buffer& target, const device_buffer* base, const std::vector<image_region>& regions, const image_region& placement)
+{
+	auto src  = static_cast<const uint8_t*>(source.data());
+	auto dest = target.data();
+	auto row_size = target.size() / target.height();
+
+	if(placement.width > 0 && target.compression() == texture_compression::none)
+	{
+		auto pixel_size = target.stride() * target.depth();
+		for(uint32_t y = 0; y < placement.height; ++y)
+			std::memcpy(dest + (placement.y + y) * row_size + placement.x * pixel_size, src + y * placement.width * pixel_size, placement.width * pixel_size);
+	}
+	else if(!regions.empty() && target.compression() == texture_compression::none)
+	{
+		if(base && base != &target)
+			fast_memcpy(dest, base->data(), target.size());
+
+		auto pixel_size = target.stride() * target.depth();
+		BOOST_FOREACH(auto& region, regions)
+		{
+			for(uint32_t y = region.y; y < region.y + region.height; ++y)
+				std::memcpy(dest + y * row_size + region.x * pixel_size, src + y * row_size + region.x * pixel_size, region.width * pixel_size);
+		}
+	}
+	else
+		fast_memcpy(dest, src, std::min(source.size(), target.size()));
+
+	target.begin_read();
+}
+
+std::shared_ptr<atlas_region> ogl_device::create_atlas_region(uint32_t width, uint32_t height)
+{
+	if(!atlas_)
+		return nullptr;
+
+	return atlas_->allocate(width, height);
+}
+
+void ogl_device::schedule_uploads()
+{
+	if(uploads_scheduled_.fetch_and_store(true))
+		return;
+
+	if(transfer_executor_)
+		transfer_executor_->begin_invoke([=]{do_uploads();}, high_priority);
+	else
+		executor_.begin_invoke([=]{do_uploads();}, high_priority);
+}
+
+void ogl_device::do_uploads()
+{
+	uploads_scheduled_ = false;
+
+	recycle_uploaded_buffers();
+
+	if(transfer_context_)
+	{
+		// Pooled textures are handed out again once their frames are gone, which is not before the renders 
+		// sampling them have been flushed.
+		tbb::spin_mutex::scoped_lock lock(render_sync_mutex_);
+		if(render_sync_)
+			GL(glWaitSync(render_sync_, 0, GL_TIMEOUT_IGNORED));
+	}
+	
+	pending_upload upload;
+	while(uploads_.try_pop(upload))
+	{
+		if(upload.base)
+		{
+			if(transfer_context_)
+			{
+				// The framebuffer and the cached state of attach and read_buffer belong to the render context.
+				upload.base->wait_written();
+				GL(glBindFramebuffer(GL_FRAMEBUFFER, transfer_fbo_));
+				GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, upload.base->id(), 0));
+				GL(glReadBuffer(GL_COLOR_ATTACHMENT0));
+			}
+			else
+			{
+				attach(*upload.base);
+				read_buffer(*upload.base);
+			}
+			upload.target->bind(0);
+			GL(glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, upload.target->width(), upload.target->height()));
+			upload.target->unbind();
+		}
+
+		upload.source->unmap();
+		upload.source->bind();
+		if(upload.placement.width > 0)
+			upload.target->begin_read_at(upload.placement);
+		else if(upload.regions.empty())
+			upload.target->begin_read();
+		else
+			upload.target->begin_read(upload.regions);
+		upload.source->unbind();
+		upload.source->end_upload();
+	}
+
+	// The fences of the uploads are only seen by the render context once they have been flushed.
+	if(transfer_context_)
+		GL(glFlush());
+}
+
+void ogl_device::recycle_uploaded_buffers()
+{
+	std::pair<std::shared_ptr<host_buffer>, std::shared_ptr<buffer_pool<host_buffer>>> retired;
+	while(retired_uploads_.try_pop(retired))
+		retiring_uploads_.push_back(std::move(retired));
+
+	while(!retiring_uploads_.empty() && retiring_uploads_.front().first->ready())
+	{
+		retiring_uploads_.front().second->items.push(retiring_uploads_.front().first);
+		retiring_uploads_.pop_front();
+	}
+}
+
+safe_ptr<ogl_device> ogl_device::create(bool software)
+{
+	return safe_ptr<ogl_device>(new ogl_device(software));
+}
+
+bool ogl_device::software() const
+{
+	return software_;
 }
 
-//template<typename T>
-//void flush_pool(buffer_pool<T>& pool)
-//{	
-//	if(pool.flush_count.fetch_and_increment() < 16)
-//		return;
-//
-//	if(pool.usage_count.fetch_and_store(0) < pool.items.size())
-//	{
-//		std::shared_ptr<T> buffer;
-//		pool.items.try_pop(buffer);
-//	}
-//
-//	pool.flush_count = 0;
-//	pool.usage_count = 0;
-//}
+bool ogl_device::transfer_context() const
+{
+	return transfer_executor_ != nullptr;
+}
+
+void ogl_device::sync_uploads()
+{
+	if(transfer_executor_)
+		transfer_executor_->invoke([]{}, high_priority);
+}
 
 void ogl_device::flush()
 {
-	GL(glFlush());	
-		
-	//try
-	//{
-	//	BOOST_FOREACH(auto& pools, device_pools_)
-	//	{
-	//		BOOST_FOREACH(auto& pool, pools)
-	//			flush_pool(*pool.second);
-	//	}
-	//	BOOST_FOREACH(auto& pools, host_pools_)
-	//	{
-	//		BOOST_FOREACH(auto& pool, pools)
-	//			flush_pool(*pool.second);
-	//	}
-	//}
-	//catch(...)
-	//{
-	//	CASPAR_LOG_CURRENT_EXCEPTION();
-	//}
+	if(transfer_executor_)
+	{
+		auto sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		{
+			tbb::spin_mutex::scoped_lock lock(render_sync_mutex_);
+			std::swap(sync, render_sync_);
+		}
+		if(sync)
+			glDeleteSync(sync);
+	}
+
+	if(!software_)
+		GL(glFlush());	
+
+	++tick_;
+
+	// Allocations over budget evict by themselves, trimming waits until no render or upload is.
+	if(!trim_scheduled_.fetch_and_store(true))
+	{
+		executor_.begin_invoke([=]
+		{
+			trim_scheduled_ = false;
+			trim_pools();
+		}, low_priority);
+	}
+}
+
+void ogl_device::trim_pools()
+{
+	// Free buffers are released one at a time per flush, to spread out the cost of deleting them. Over budget 
+	// the least recently used goes first, otherwise only buffers of pools which have been idle for a while.
+	static const int64_t idle_ticks = 250;
+
+	if(device_budget_ > 0 && device_bytes_ > device_budget_)
+		evict_lru(device_pools_, device_bytes_, tick_);
+	else
+		evict_lru(device_pools_, device_bytes_, tick_ - idle_ticks, true);
+
+	if(host_budget_ > 0 && host_bytes_ > host_budget_)
+		evict_lru(host_pools_, host_bytes_, tick_);
+	else
+		evict_lru(host_pools_, host_bytes_, tick_ - idle_ticks, true);
+
+	evict_lru(pageable_pools_, pageable_bytes_, tick_ - idle_ticks);
 }
 
 void ogl_device::yield()
@@ -252,13 +677,25 @@ boost::unique_future<void> ogl_device::gc()
 			BOOST_FOREACH(auto& pools, device_pools_)
 			{
 				BOOST_FOREACH(auto& pool, pools)
-					pool.second->items.clear();
+					clear_pool(*pool.second, device_bytes_);
 			}
 			BOOST_FOREACH(auto& pools, host_pools_)
 			{
 				BOOST_FOREACH(auto& pool, pools)
-					pool.second->items.clear();
+					clear_pool(*pool.second, host_bytes_);
+			}
+			BOOST_FOREACH(auto& pool, pageable_pools_[0])
+				clear_pool(*pool.second, pageable_bytes_);
+
+			std::pair<std::shared_ptr<host_buffer>, std::shared_ptr<buffer_pool<host_buffer>>> retired;
+			while(retired_uploads_.try_pop(retired))
+				retiring_uploads_.push_back(std::move(retired));
+			BOOST_FOREACH(auto& retiring, retiring_uploads_)
+			{
+				--retiring.second->allocated;
+				host_bytes_ -= retiring.second->item_size;
 			}
+			retiring_uploads_.clear();
 		}
 		catch(...)
 		{
@@ -269,6 +706,9 @@ boost::unique_future<void> ogl_device::gc()
 
 std::wstring ogl_device::version()
 {	
+	if(software_)
+		return L"Software";
+
 	static std::wstring ver = L"Not found";
 	try
 	{
@@ -280,6 +720,84 @@ std::wstring ogl_device::version()
 	return ver;
 }
 
+boost::property_tree::wptree ogl_device::info() const
+{
+	boost::property_tree::wptree info;
+
+	boost::property_tree::wptree device_info;
+	device_info.add(L"bytes",  static_cast<int64_t>(device_bytes_));
+	device_info.add(L"budget", device_budget_);
+	for(std::size_t n = 0; n < device_pools_.size(); ++n)
+	{
+		BOOST_FOREACH(auto& pool, device_pools_[n])
+		{
+			auto pool_tree = pool_info(*pool.second);
+			pool_tree.add(L"width",  pool.first >> 16);
+			pool_tree.add(L"height", pool.first & 0x0000FFFF);
+			if(n < 8)
+			{
+				pool_tree.add(L"stride", n%4+1);
+				pool_tree.add(L"depth",  n/4+1);
+			}
+			else
+				pool_tree.add(L"compression", n-8+1);
+			device_info.add_child(L"pool", pool_tree);
+		}
+	}
+	info.add_child(L"device", device_info);
+
+	boost::property_tree::wptree host_info;
+	host_info.add(L"bytes",  static_cast<int64_t>(host_bytes_));
+	host_info.add(L"budget", host_budget_);
+	for(std::size_t n = 0; n < host_pools_.size(); ++n)
+	{
+		BOOST_FOREACH(auto& pool, host_pools_[n])
+		{
+			auto pool_tree = pool_info(*pool.second);
+			pool_tree.add(L"size",  pool.first);
+			pool_tree.add(L"usage", std::wstring(n == write_only ? L"write-only" : L"read-only"));
+			host_info.add_child(L"pool", pool_tree);
+		}
+	}
+	info.add_child(L"host", host_info);
+
+	boost::property_tree::wptree pageable_info;
+	pageable_info.add(L"bytes", static_cast<int64_t>(pageable_bytes_));
+	BOOST_FOREACH(auto& pool, pageable_pools_[0])
+	{
+		auto pool_tree = pool_info(*pool.second);
+		pool_tree.add(L"size", pool.first);
+		pageable_info.add_child(L"pool", pool_tree);
+	}
+	info.add_child(L"pageable", pageable_info);
+	if(atlas_)
+		info.add_child(L"atlas", atlas_->info());
+
+	// Uploads, fence checks and emergency gcs are high, channel renders normal and thumbnails and pool trimming low.
+	info.add(L"queue-wait.high",	executor_.queue_wait(high_priority));
+	info.add(L"queue-wait.normal",	executor_.queue_wait(normal_priority));
+	info.add(L"queue-wait.low",		executor_.queue_wait(low_priority));
+	if(transfer_executor_)
+		info.add(L"queue-wait.transfer", transfer_executor_->queue_wait(high_priority));
+
+	return info;
+}
+
+int64_t ogl_device::device_bytes() const
+{
+	return device_bytes_;
+}
+
+int64_t ogl_device::host_bytes() const
+{
+	return host_bytes_;
+}
+
+int64_t ogl_device::pageable_bytes() const
+{
+	return pageable_bytes_;
+}
+
 
 void ogl_device::enable(GLenum cap)
 {
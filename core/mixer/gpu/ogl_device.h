@@ -27,22 +27,38 @@
 #include <common/concurrency/executor.h>
 #include <common/memory/safe_ptr.h>
 
+#include <core/producer/frame/pixel_format.h>
+
 #include <gl/glew.h>
 
 #include <SFML/Window/Context.hpp>
 
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_queue.h>
+#include <tbb/spin_mutex.h>
 
 #include <boost/noncopyable.hpp>
 #include <boost/thread/future.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
 
 #include <array>
+#include <deque>
 #include <unordered_map>
 
 namespace caspar { namespace core {
 
 class shader;
+class texture_atlas;
+struct atlas_region;
+
+struct pending_upload
+{
+	std::shared_ptr<host_buffer>	source;
+	std::shared_ptr<device_buffer>	target;
+	std::shared_ptr<device_buffer>	base;		// Copied into target before the regions are uploaded.
+	std::vector<image_region>		regions;	// Empty for the whole image.
+	image_region					placement;	// Where in target a source holding only that rectangle goes, empty otherwise.
+};
 
 template<typename T>
 struct buffer_pool
@@ -51,10 +67,28 @@ struct buffer_pool
 	tbb::atomic<int> flush_count;
 	tbb::concurrent_bounded_queue<std::shared_ptr<T>> items;
 
+	// Statistics, item_size is in bytes and last_use is the flush tick of the latest request.
+	tbb::atomic<uint32_t> item_size;
+	tbb::atomic<int> allocated;
+	tbb::atomic<int64_t> hits;
+	tbb::atomic<int64_t> misses;
+	tbb::atomic<int64_t> evictions;
+	tbb::atomic<int64_t> last_use;
+
+	// Buffers the idle trimming leaves allocated, see ogl_device::reserve_device_buffers.
+	tbb::atomic<int> reserved;
+
 	buffer_pool()
 	{
 		usage_count = 0;
 		flush_count = 0;
+		item_size	= 0;
+		allocated	= 0;
+		hits		= 0;
+		misses		= 0;
+		evictions	= 0;
+		last_use	= 0;
+		reserved	= 0;
 	}
 };
 
@@ -73,18 +107,52 @@ class ogl_device : public std::enable_shared_from_this<ogl_device>, boost::nonco
 
 	std::unique_ptr<sf::Context> context_;
 	
-	std::array<tbb::concurrent_unordered_map<uint32_t, safe_ptr<buffer_pool<device_buffer>>>, 4> device_pools_;
+	// By depth and stride, followed by those of the compressed textures by compression.
+	std::array<tbb::concurrent_unordered_map<uint32_t, safe_ptr<buffer_pool<device_buffer>>>, 8 + texture_compression::count - 1> device_pools_;
+	std::array<bool, texture_compression::count> compressions_; // Supported by the gpu.
 	std::array<tbb::concurrent_unordered_map<uint32_t, safe_ptr<buffer_pool<host_buffer>>>, 2> host_pools_;
+	std::array<tbb::concurrent_unordered_map<uint32_t, safe_ptr<buffer_pool<host_buffer>>>, 1> pageable_pools_;
 	
 	GLuint fbo_;
 
+	// Bytes held by the pools, including buffers currently in use. A budget of 0 is unlimited.
+	tbb::atomic<int64_t>			 device_bytes_;
+	tbb::atomic<int64_t>			 host_bytes_;
+	tbb::atomic<int64_t>			 pageable_bytes_;
+	int64_t							 device_budget_;
+	int64_t							 host_budget_;
+	tbb::atomic<int64_t>			 tick_;
+
+	std::unique_ptr<texture_atlas>	 atlas_;
+
+	tbb::concurrent_queue<pending_upload>							uploads_;
+	tbb::atomic<bool>												uploads_scheduled_;
+	tbb::atomic<bool>												trim_scheduled_;
+	tbb::concurrent_queue<std::pair<std::shared_ptr<host_buffer>, std::shared_ptr<buffer_pool<host_buffer>>>> retired_uploads_;
+	std::deque<std::pair<std::shared_ptr<host_buffer>, std::shared_ptr<buffer_pool<host_buffer>>>> retiring_uploads_;
+
 	executor executor_;
+
+	// With configuration.mixer.transfer-context the uploads are done in a second context of their own, which 
+	// shares its objects with context_. The render context waits for them in the gpu through the fences of 
+	// the uploaded textures, and the uploads wait for the renders flushed before them through render_sync_.
+	std::unique_ptr<executor>		 transfer_executor_;
+	std::unique_ptr<sf::Context>	 transfer_context_;
+	GLuint							 transfer_fbo_;
+	GLsync							 render_sync_;
+	tbb::spin_mutex					 render_sync_mutex_;
+
+	const bool software_;
 				
-	ogl_device();
+	ogl_device(bool software);
 public:		
-	static safe_ptr<ogl_device> create();
+	// A software device has no OpenGL context. Its buffers are in host memory, uploads are copies and the
+	// image mixer composites on the cpu, for machines without a usable gpu.
+	static safe_ptr<ogl_device> create(bool software = false);
 	~ogl_device();
 
+	bool software() const;
+
 	// Not thread-safe, must be called inside of context
 	void enable(GLenum cap);
 	void disable(GLenum cap);
@@ -104,6 +172,13 @@ public:
 
 	void flush();
 
+	// Whether uploads are done in a context of their own, see transfer_executor_.
+	bool transfer_context() const;
+
+	// Blocks until the uploads queued so far have been issued, the textures are then waited for with 
+	// device_buffer::wait_written. Does nothing without a transfer context.
+	void sync_uploads();
+
 	// thread-afe
 	template<typename Func>
 	auto begin_invoke(Func&& func, task_priority priority = normal_priority) -> boost::unique_future<decltype(func())> // noexcept
@@ -117,16 +192,49 @@ public:
 		return executor_.invoke(std::forward<Func>(func), priority);
 	}
 		
-	safe_ptr<device_buffer> create_device_buffer(uint32_t width, uint32_t height, uint32_t stride);
+	// Textures with depth 2 hold 16 bit unsigned normalized channels.
+	safe_ptr<device_buffer> create_device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth = 1);
+	safe_ptr<device_buffer> create_compressed_device_buffer(uint32_t width, uint32_t height, texture_compression::type compression);
+	bool supports(texture_compression::type compression) const;
 	safe_ptr<host_buffer> create_host_buffer(uint32_t size, usage_t usage);
+	safe_ptr<host_buffer> create_pageable_buffer(uint32_t size); // Plain memory without a pbo, for frames held by slow consumers.
+
+	// Allocates count buffers of the size into their pools ahead of the first frames, the pages of write only host 
+	// buffers touched. The pools are not trimmed below count for being idle, the budgets may still evict them.
+	void reserve_device_buffers(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, int count);
+	void reserve_host_buffers(uint32_t size, usage_t usage, int count);
+
+	// Uploads the write_only source into the target. Uploads queued until the ogl thread gets to them 
+	// are all done in the same task.
+	void upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target);
+
+	// As upload, but target gets a gpu copy of base with only the regions of source uploaded over it.
+	void upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target, const safe_ptr<device_buffer>& base, const std::vector<image_region>& regions);
+
+	// As upload, but the source holds only the placement in target.
+	void upload(const safe_ptr<host_buffer>& source, const safe_ptr<device_buffer>& target, const image_region& placement);
+
+	// A place in a shared texture for a small bgra image, null when it has to have a texture of its own.
+	std::shared_ptr<atlas_region> create_atlas_region(uint32_t width, uint32_t height);
 	
 	void yield();
 	boost::unique_future<void> gc();
 
 	std::wstring version();
 
+	boost::property_tree::wptree info() const;
+	int64_t device_bytes() const;
+	int64_t host_bytes() const;
+	int64_t pageable_bytes() const;
+
 private:
-	safe_ptr<device_buffer> allocate_device_buffer(uint32_t width, uint32_t height, uint32_t stride);
+	void schedule_uploads();
+	void do_uploads();
+	void copy_upload(const host_buffer& source, device_buffer& target, const device_buffer* base, const std::vector<image_region>& regions, const image_region& placement);
+	void recycle_uploaded_buffers();
+	void trim_pools();
+	safe_ptr<device_buffer> pooled_device_buffer(size_t pool_index, uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression);
+	safe_ptr<device_buffer> allocate_device_buffer(uint32_t width, uint32_t height, uint32_t stride, uint32_t depth, texture_compression::type compression);
 	safe_ptr<host_buffer> allocate_host_buffer(uint32_t size, usage_t usage);
 };
 
@@ -24,21 +24,147 @@
 #include "shader.h"
 
 #include <common/gl/gl_check.h>
+#include <common/env.h>
 
 #include <GL/glew.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <unordered_map>
 
 namespace caspar { namespace core {
 
+// Linked programs are cached on disk to avoid recompiling every shader on startup. Entries are keyed by the 
+// driver and the shader sources, entries which do not match or which the driver rejects are recompiled.
+
+std::string get_gl_string(GLenum name)
+{
+	auto str = glGetString(name);
+	return str ? reinterpret_cast<const char*>(str) : "";
+}
+
+std::wstring get_program_cache_file(const std::string& cache_key)
+{
+	if(!GLEW_ARB_get_program_binary || !env::properties().get(L"configuration.mixer.shader-cache", true))
+		return L"";
+
+	try
+	{
+		auto folder = boost::filesystem::wpath(env::data_folder() + L"shader-cache\\");
+		if(!boost::filesystem::exists(folder))
+			boost::filesystem::create_directory(folder);
+
+		std::wstringstream file;
+		file << std::hex << std::setw(sizeof(std::size_t)*2) << std::setfill(L'0') << boost::hash_value(cache_key) << L".bin";
+
+		return (folder / file.str()).file_string();
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+		return L"";
+	}
+}
+
+bool load_program_binary(GLuint program, const std::wstring& file, const std::string& cache_key)
+{
+	std::ifstream stream(file.c_str(), std::ios::in | std::ios::binary);
+	if(!stream)
+		return false;
+	
+	uint32_t key_size = 0;
+	stream.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+	if(!stream || key_size != cache_key.size())
+		return false;
+
+	std::string key(key_size, '\0');
+	stream.read(&key[0], key_size);
+	if(!stream || key != cache_key)
+		return false;
+	
+	uint32_t format = 0;
+	uint32_t size = 0;
+	stream.read(reinterpret_cast<char*>(&format), sizeof(format));
+	stream.read(reinterpret_cast<char*>(&size), sizeof(size));
+	if(!stream || size == 0)
+		return false;
+
+	std::vector<char> binary(size);
+	stream.read(binary.data(), size);
+	if(!stream)
+		return false;
+
+	glProgramBinary(program, format, binary.data(), size);
+	while(glGetError() != GL_NO_ERROR); // An unsupported format is reported as an error, fall back to compiling.
+	
+	GLint success = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	return success == GL_TRUE;
+}
+
+void save_program_binary(GLuint program, const std::wstring& file, const std::string& cache_key)
+{
+	GLint size = 0;
+	GL(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size));
+	if(size <= 0)
+		return;
+	
+	GLenum format = 0;
+	std::vector<char> binary(size);
+	GL(glGetProgramBinary(program, size, nullptr, &format, binary.data()));
+	
+	std::ofstream stream(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+	uint32_t key_size		= static_cast<uint32_t>(cache_key.size());
+	uint32_t binary_format	= static_cast<uint32_t>(format);
+	uint32_t binary_size	= static_cast<uint32_t>(size);
+	stream.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+	stream.write(cache_key.data(), key_size);
+	stream.write(reinterpret_cast<const char*>(&binary_format), sizeof(binary_format));
+	stream.write(reinterpret_cast<const char*>(&binary_size), sizeof(binary_size));
+	stream.write(binary.data(), binary_size);
+
+	if(!stream)
+		CASPAR_LOG(warning) << L"[shader] Failed to write shader cache: " << file;
+}
+
+// Uniforms keep their values in the program, so a value which is set again is not sent to the driver. Most of
+// what the kernel sets per draw, the samplers in particular, does not change between items.
+struct uniform
+{
+	GLint	location;
+	bool	is_set;
+	bool	is_int;
+	GLint	int_value;
+	float	values[4];
+};
+
 struct shader::implementation : boost::noncopyable
 {
 	GLuint program_;
-	std::unordered_map<std::string, GLint> locations_;
+	std::unordered_map<std::string, uniform> uniforms_;
 public:
 
 	implementation(const std::string& vertex_source_str, const std::string& fragment_source_str) : program_(0)
 	{
+		auto cache_key	= get_gl_string(GL_VERSION) + " " + get_gl_string(GL_VENDOR) + " " + get_gl_string(GL_RENDERER) + "\n" + vertex_source_str + "\n" + fragment_source_str;
+		auto cache_file = get_program_cache_file(cache_key);
+
+		if(!cache_file.empty())
+		{
+			program_ = glCreateProgram();
+
+			if(load_program_binary(program_, cache_file, cache_key))
+				return;
+
+			glDeleteProgram(program_);
+			program_ = 0;
+		}
+
 		GLint success;
 	
 		const char* vertex_source = vertex_source_str.c_str();
@@ -82,6 +208,9 @@ public:
 		GL(glAttachObjectARB(program_, vertex_shader));
 		GL(glAttachObjectARB(program_, fragmemt_shader));
 
+		if(!cache_file.empty())
+			GL(glProgramParameteri(program_, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+
 		GL(glLinkProgramARB(program_));
 			
 		GL(glDeleteObjectARB(vertex_shader));
@@ -97,7 +226,18 @@ public:
 			str << "Failed to link shader program:" << std::endl << info << std::endl;
 			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(str.str()));
 		}
-		GL(glUseProgramObjectARB(program_));
+
+		if(!cache_file.empty())
+		{
+			try
+			{
+				save_program_binary(program_, cache_file, cache_key);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
 	}
 	
 	~implementation()
@@ -105,13 +245,33 @@ public:
 		glDeleteProgram(program_);
 	}
 
-	GLint get_location(const char* name)
+	uniform& get_uniform(const std::string& name)
 	{
-		auto it = locations_.find(name);
-		if(it == locations_.end())
-			it = locations_.insert(std::make_pair(name, glGetUniformLocation(program_, name))).first;
+		auto it = uniforms_.find(name);
+		if(it == uniforms_.end())
+		{
+			uniform value = {glGetUniformLocation(program_, name.c_str()), false, false, 0, {0.0f, 0.0f, 0.0f, 0.0f}};
+			it = uniforms_.insert(std::make_pair(name, value)).first;
+		}
 		return it->second;
 	}
+
+	// Returns the uniform if the values differ from what the program holds, updating the cached values.
+	uniform* changed(const std::string& name, int count, float value1, float value2 = 0.0f, float value3 = 0.0f, float value4 = 0.0f)
+	{
+		auto& u = get_uniform(name);
+		if(u.location < 0) // Not used by this variant.
+			return nullptr;
+
+		float values[] = {value1, value2, value3, value4};
+		if(u.is_set && !u.is_int && std::equal(values, values + count, u.values))
+			return nullptr;
+
+		std::copy(values, values + 4, u.values);
+		u.is_set = true;
+		u.is_int = false;
+		return &u;
+	}
 	
 	void set(const std::string& name, bool value)
 	{
@@ -120,37 +280,48 @@ public:
 
 	void set(const std::string& name, int value)
 	{
-		GL(glUniform1i(get_location(name.c_str()), value));
+		auto& u = get_uniform(name);
+		if(u.location < 0 || (u.is_set && u.is_int && u.int_value == value))
+			return;
+
+		GL(glUniform1i(u.location, value));
+		u.int_value = value;
+		u.is_set	= true;
+		u.is_int	= true;
 	}
 	
 	void set(const std::string& name, float value)
 	{
-		GL(glUniform1f(get_location(name.c_str()), value));
+		if(auto u = changed(name, 1, value))
+			GL(glUniform1f(u->location, value));
 	}
 
     void set(const std::string& name, float value1, float value2)
     {
-        GL(glUniform2f(get_location(name.c_str()), value1, value2));
+		if(auto u = changed(name, 2, value1, value2))
+			GL(glUniform2f(u->location, value1, value2));
     }
 
     void set(const std::string& name, float value1, float value2, float value3)
     {
-        GL(glUniform3f(get_location(name.c_str()), value1, value2, value3));
+		if(auto u = changed(name, 3, value1, value2, value3))
+			GL(glUniform3f(u->location, value1, value2, value3));
     }
 
     void set(const std::string& name, float value1, float value2, float value3, float value4)
     {
-        GL(glUniform4f(get_location(name.c_str()), value1, value2, value3, value4));
+		if(auto u = changed(name, 4, value1, value2, value3, value4))
+			GL(glUniform4f(u->location, value1, value2, value3, value4));
     }
 
     void set(const std::string& name, double value)
 	{
-		GL(glUniform1f(get_location(name.c_str()), static_cast<float>(value)));
+		set(name, static_cast<float>(value));
 	}
 
     void set(const std::string& name, double value1, double value2)
     {
-        GL(glUniform2f(get_location(name.c_str()), static_cast<float>(value1), static_cast<float>(value2)));
+		set(name, static_cast<float>(value1), static_cast<float>(value2));
     }
 };
 
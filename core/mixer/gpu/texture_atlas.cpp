@@ -0,0 +1,222 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "texture_atlas.h"
+
+#include "ogl_device.h"
+
+#include <common/env.h>
+
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace caspar { namespace core {
+
+static const uint32_t	page_size		= 1024;
+static const uint32_t	max_image_size	= 256; // Larger images have textures of their own.
+static const std::size_t max_pages		= 16;
+
+atlas_region::atlas_region(const safe_ptr<device_buffer>& page, const image_region& placement)
+	: page(page)
+	, placement(placement)
+	, image(placement.x + 1, placement.y + 1, placement.width - 2, placement.height - 2)
+{
+}
+
+texture_rect atlas_region::rect() const
+{
+	auto width	= static_cast<double>(page->width());
+	auto height = static_cast<double>(page->height());
+	return texture_rect(image.x/width, image.y/height, image.width/width, image.height/height);
+}
+
+struct shelf
+{
+	uint32_t y;
+	uint32_t height;
+	uint32_t x; // Where the next region goes.
+};
+
+struct atlas_page : boost::noncopyable
+{
+	safe_ptr<device_buffer>	texture;
+	std::vector<shelf>		shelves;
+	uint32_t				used_height;
+	tbb::atomic<int>		regions;
+
+	explicit atlas_page(const safe_ptr<device_buffer>& texture)
+		: texture(texture)
+		, used_height(0)
+	{
+		regions = 0;
+	}
+
+	// Regions are only allocated with the atlas locked, so a page without regions stays without them.
+	void reset_if_unused()
+	{
+		if(regions > 0)
+			return;
+
+		shelves.clear();
+		used_height = 0;
+	}
+
+	bool try_place(uint32_t width, uint32_t height, image_region& placement)
+	{
+		// The lowest shelf with room wastes the least of its height.
+		shelf* best = nullptr;
+		BOOST_FOREACH(auto& s, shelves)
+		{
+			if(height <= s.height && s.x + width <= page_size && (!best || s.height < best->height))
+				best = &s;
+		}
+
+		if(!best || best->height > height*2)
+		{
+			if(used_height + height <= page_size)
+			{
+				shelf s = {used_height, height, 0};
+				shelves.push_back(s);
+				used_height += height;
+				best = &shelves.back();
+			}
+		}
+
+		if(!best)
+			return false;
+
+		placement = image_region(best->x, best->y, width, height);
+		best->x += width;
+		return true;
+	}
+};
+
+struct texture_atlas::implementation : boost::noncopyable
+{
+	ogl_device&								ogl_;
+	const bool								enabled_;
+	mutable tbb::mutex						mutex_;
+	std::vector<std::shared_ptr<atlas_page>> pages_;
+
+	explicit implementation(ogl_device& ogl)
+		: ogl_(ogl)
+		, enabled_(env::properties().get(L"configuration.mixer.texture-atlas", true))
+	{
+	}
+
+	std::shared_ptr<atlas_region> allocate(uint32_t width, uint32_t height)
+	{
+		if(!enabled_ || width == 0 || height == 0 || width > max_image_size || height > max_image_size)
+			return nullptr;
+
+		width  += 2;
+		height += 2;
+
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		BOOST_FOREACH(auto& page, pages_)
+			page->reset_if_unused();
+
+		// Emptied pages are given back to the pool, except for the first.
+		if(!pages_.empty())
+			pages_.erase(std::remove_if(pages_.begin() + 1, pages_.end(), [](const std::shared_ptr<atlas_page>& page){return page->regions == 0;}), pages_.end());
+
+		image_region placement;
+
+		std::shared_ptr<atlas_page> target;
+		BOOST_FOREACH(auto& page, pages_)
+		{
+			if(page->try_place(width, height, placement))
+			{
+				target = page;
+				break;
+			}
+		}
+
+		if(!target)
+		{
+			if(pages_.size() >= max_pages)
+			{
+				CASPAR_LOG(trace) << L"[texture_atlas] Full, image gets a texture of its own.";
+				return nullptr;
+			}
+
+			target = std::make_shared<atlas_page>(ogl_.create_device_buffer(page_size, page_size, 4));
+			pages_.push_back(target);
+			if(!target->try_place(width, height, placement))
+				return nullptr;
+		}
+
+		++target->regions;
+
+		return std::shared_ptr<atlas_region>(new atlas_region(target->texture, placement), [target](atlas_region* region)
+		{
+			--target->regions;
+			delete region;
+		});
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		boost::property_tree::wptree info;
+		BOOST_FOREACH(auto& page, pages_)
+		{
+			boost::property_tree::wptree page_info;
+			page_info.add(L"regions", static_cast<int>(page->regions));
+			page_info.add(L"used-height", page->used_height);
+			info.add_child(L"page", page_info);
+		}
+		return info;
+	}
+};
+
+texture_atlas::texture_atlas(ogl_device& ogl) : impl_(new implementation(ogl)){}
+std::shared_ptr<atlas_region> texture_atlas::allocate(uint32_t width, uint32_t height){return impl_->allocate(width, height);}
+boost::property_tree::wptree texture_atlas::info() const{return impl_->info();}
+
+void copy_with_border(const uint8_t* source, uint8_t* target, uint32_t width, uint32_t height)
+{
+	const uint32_t row_size		= width*4;
+	const uint32_t target_row	= row_size + 8;
+
+	for(uint32_t y = 0; y < height + 2; ++y)
+	{
+		auto src = source + std::min(height - 1, y > 0 ? y - 1 : 0)*row_size;
+		auto dst = target + y*target_row;
+
+		std::memcpy(dst, src, 4);
+		std::memcpy(dst + 4, src, row_size);
+		std::memcpy(dst + 4 + row_size, src + row_size - 4, 4);
+	}
+}
+
+}}
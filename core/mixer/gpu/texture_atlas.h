@@ -0,0 +1,73 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "device_buffer.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/producer/frame/pixel_format.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <memory>
+
+namespace caspar { namespace core {
+
+class ogl_device;
+
+// A rectangle of an atlas page, it is given back to the page when the last reference goes away.
+struct atlas_region
+{
+	safe_ptr<device_buffer>	page;
+	image_region			placement;	// In the page, including a border of one pixel on every side.
+	image_region			image;		// The inside of placement which holds the image.
+
+	atlas_region(const safe_ptr<device_buffer>& page, const image_region& placement);
+
+	// The image in normalized coordinates of the page.
+	texture_rect rect() const;
+};
+
+// Packs small bgra images into shared pages, which saves a texture, and a pool of its own, for each size.
+// Pages are filled shelf by shelf and only reused once every region in them has been released, which suits
+// images that live for a long time.
+class texture_atlas : boost::noncopyable
+{
+public:
+	explicit texture_atlas(ogl_device& ogl);
+
+	// Null when the image is too large for the atlas, or every page is full. Thread-safe.
+	std::shared_ptr<atlas_region> allocate(uint32_t width, uint32_t height);
+
+	boost::property_tree::wptree info() const;
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+// Copies a width x height bgra image into the placement sized target, repeating the edge pixels in the border 
+// so that filtering at the edges of the image does not bleed in its neighbours.
+void copy_with_border(const uint8_t* source, uint8_t* target, uint32_t width, uint32_t height);
+
+}}
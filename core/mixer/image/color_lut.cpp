@@ -0,0 +1,253 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "color_lut.h"
+
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <core/producer/frame/frame_transform.h>
+
+#include <tbb/mutex.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const int max_lut_size		= 256;
+const int default_lut_size	= 33; // Generated luts, which is also the most common size of .cube files.
+
+struct lut_file
+{
+	std::int64_t	last_write_time;
+	int				id;
+};
+
+tbb::mutex												g_lut_mutex;
+std::map<std::wstring, lut_file>						g_lut_files;
+std::map<int, std::shared_ptr<const color_lut>>			g_luts;
+int														g_next_lut_id = 1;
+
+double apply_levels(double value, const core::levels& settings)
+{
+	auto range = std::max(settings.max_input - settings.min_input, 0.0000001);
+	value = std::min(std::max(value - settings.min_input, 0.0) / range, 1.0);
+	value = std::pow(value, 1.0 / settings.gamma);
+	return settings.min_output + (settings.max_output - settings.min_output)*value;
+}
+
+// The same math as ContrastSaturationBrightness of the image shader used to do, on straight colors.
+void apply_csb(double* rgb, double brt, double sat, double con)
+{
+	for(int n = 0; n < 3; ++n)
+		rgb[n] *= brt;
+
+	auto intensity = rgb[0]*0.0721 + rgb[1]*0.7154 + rgb[2]*0.2125;
+
+	for(int n = 0; n < 3; ++n)
+	{
+		rgb[n] = intensity + (rgb[n] - intensity)*sat;
+		rgb[n] = 0.5 + (rgb[n] - 0.5)*con;
+	}
+}
+
+}
+
+safe_ptr<color_lut> read_cube_file(const std::wstring& path)
+{
+	std::ifstream stream(path.c_str(), std::ios::in);
+	if(!stream)
+		BOOST_THROW_EXCEPTION(file_not_found() << msg_info("Could not open lut file.") << arg_value_info(narrow(path)));
+
+	auto lut = make_safe<color_lut>();
+	lut->name = boost::filesystem::wpath(path).filename();
+
+	auto fail = [&](const std::string& message)
+	{
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info(message) << arg_value_info(narrow(path)));
+	};
+
+	std::string line;
+	while(std::getline(stream, line))
+	{
+		boost::trim(line);
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream fields(line);
+
+		if(std::isalpha(static_cast<unsigned char>(line[0])))
+		{
+			std::string keyword;
+			fields >> keyword;
+
+			if(keyword == "LUT_3D_SIZE")
+			{
+				if(!(fields >> lut->size) || lut->size < 2 || lut->size > max_lut_size)
+					fail("Invalid LUT_3D_SIZE.");
+				lut->data.reserve(lut->size*lut->size*lut->size*3);
+			}
+			else if(keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX")
+			{
+				double r = 0.0, g = 0.0, b = 0.0;
+				fields >> r >> g >> b;
+				auto expected = keyword == "DOMAIN_MIN" ? 0.0 : 1.0;
+				if(r != expected || g != expected || b != expected)
+					fail("Only luts over the domain [0, 1] are supported.");
+			}
+			else if(keyword == "LUT_1D_SIZE")
+				fail("Only 3D luts are supported.");
+
+			// TITLE and unknown keywords are ignored.
+			continue;
+		}
+
+		if(lut->size == 0)
+			fail("Missing LUT_3D_SIZE.");
+
+		float r, g, b;
+		if(!(fields >> r >> g >> b))
+			fail("Invalid lut entry.");
+
+		lut->data.push_back(r);
+		lut->data.push_back(g);
+		lut->data.push_back(b);
+	}
+
+	if(lut->size == 0 || lut->data.size() != static_cast<size_t>(lut->size*lut->size*lut->size*3))
+		fail("Wrong number of lut entries.");
+
+	return lut;
+}
+
+int load_color_lut(const std::wstring& path)
+{
+	boost::filesystem::wpath file_path(path);
+	auto last_write_time = boost::filesystem::exists(file_path) ? static_cast<std::int64_t>(boost::filesystem::last_write_time(file_path)) : 0;
+
+	{
+		tbb::mutex::scoped_lock lock(g_lut_mutex);
+		auto it = g_lut_files.find(path);
+		if(it != g_lut_files.end() && it->second.last_write_time == last_write_time)
+			return it->second.id;
+	}
+
+	std::shared_ptr<const color_lut> lut = read_cube_file(path);
+
+	tbb::mutex::scoped_lock lock(g_lut_mutex);
+
+	// Transforms which still refer to an older version of the file keep it.
+	lut_file file = {last_write_time, g_next_lut_id++};
+	g_lut_files[path] = file;
+	g_luts[file.id] = lut;
+
+	CASPAR_LOG(info) << L"[color_lut] Loaded " << path << L" (" << lut->size << L"^3).";
+
+	return file.id;
+}
+
+std::shared_ptr<const color_lut> get_color_lut(int id)
+{
+	if(id == 0)
+		return nullptr;
+
+	tbb::mutex::scoped_lock lock(g_lut_mutex);
+	auto it = g_luts.find(id);
+	return it != g_luts.end() ? it->second : nullptr;
+}
+
+bool is_color_neutral(const frame_transform& transform)
+{
+	static const double epsilon = 0.001;
+
+	return transform.lut == 0 &&
+		   transform.levels.min_input  < epsilon && transform.levels.max_input  > 1.0-epsilon &&
+		   transform.levels.min_output < epsilon && transform.levels.max_output > 1.0-epsilon &&
+		   std::abs(transform.levels.gamma - 1.0) < epsilon &&
+		   std::abs(transform.brightness - 1.0) < epsilon &&
+		   std::abs(transform.saturation - 1.0) < epsilon &&
+		   std::abs(transform.contrast - 1.0)   < epsilon;
+}
+
+safe_ptr<color_lut> bake_color_lut(const frame_transform& transform)
+{
+	auto base = get_color_lut(transform.lut);
+
+	auto lut = make_safe<color_lut>();
+	lut->size = base ? base->size : default_lut_size;
+	lut->name = base ? base->name : L"";
+	lut->data.resize(lut->size*lut->size*lut->size*3);
+
+	auto size = lut->size;
+
+	// Without a base lut the nodes along every axis are the same values, so the levels are only evaluated
+	// once for each of them.
+	std::vector<double> axis(size);
+	for(int n = 0; n < size; ++n)
+		axis[n] = apply_levels(static_cast<double>(n) / static_cast<double>(size - 1), transform.levels);
+
+	auto out = lut->data.begin();
+	for(int b = 0; b < size; ++b)
+	{
+		for(int g = 0; g < size; ++g)
+		{
+			for(int r = 0; r < size; ++r)
+			{
+				double rgb[3];
+				if(base)
+				{
+					auto in = base->data.begin() + ((b*size + g)*size + r)*3;
+					for(int n = 0; n < 3; ++n)
+						rgb[n] = apply_levels(in[n], transform.levels);
+				}
+				else
+				{
+					rgb[0] = axis[r];
+					rgb[1] = axis[g];
+					rgb[2] = axis[b];
+				}
+
+				apply_csb(rgb, transform.brightness, transform.saturation, transform.contrast);
+
+				for(int n = 0; n < 3; ++n)
+					*out++ = static_cast<float>(rgb[n]);
+			}
+		}
+	}
+
+	return lut;
+}
+
+}}
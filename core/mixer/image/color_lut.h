@@ -0,0 +1,59 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <string>
+#include <vector>
+
+namespace caspar { namespace core {
+
+struct frame_transform;
+
+// A 3D color lookup table of size^3 straight rgb entries over [0, 1], with red varying fastest.
+struct color_lut
+{
+	int					size;
+	std::vector<float>	data;
+	std::wstring		name;
+
+	color_lut() : size(0) {}
+};
+
+// Reads a 3D lut in the .cube format of Resolve and Adobe.
+safe_ptr<color_lut> read_cube_file(const std::wstring& path);
+
+// Loads a .cube file and returns its id for frame_transform::lut. A file is only read again when it
+// has been modified.
+int load_color_lut(const std::wstring& path);
+
+// The lut of an id returned by load_color_lut, null for 0 or an unknown id.
+std::shared_ptr<const color_lut> get_color_lut(int id);
+
+// Whether the lut, levels and contrast, saturation and brightness of the transform leave colors as they are.
+bool is_color_neutral(const frame_transform& transform);
+
+// Bakes the lut of the transform followed by its levels and contrast, saturation and brightness into one lut.
+safe_ptr<color_lut> bake_color_lut(const frame_transform& transform);
+
+}}
@@ -0,0 +1,529 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "cpu_image_renderer.h"
+
+#include "image_kernel.h"
+#include "color_lut.h"
+#include "image_mixer.h"
+#include "../gpu/ogl_device.h"
+#include "../gpu/host_buffer.h"
+#include "../gpu/device_buffer.h"
+
+#include <common/concurrency/executor.h>
+#include <common/concurrency/parallel_arena.h>
+#include <common/diagnostics/trace.h>
+#include <common/log/log.h>
+#include <common/memory/pixel_kernels.h>
+#include <common/utility/move_on_copy.h>
+
+#include <core/video_format.h>
+
+#include <boost/foreach.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace caspar { namespace core {
+
+namespace {
+
+// A plane of a texture of a software device, one byte per channel.
+struct plane_view
+{
+	const uint8_t*	data;
+	int				width;
+	int				height;
+	int				channels;
+
+	plane_view()
+		: data(nullptr)
+		, width(0)
+		, height(0)
+		, channels(0)
+	{
+	}
+};
+
+// The target of a draw, bgra or a key of one byte per pixel.
+struct surface
+{
+	uint8_t*	data;
+	int			width;
+	int			height;
+	int			stride; // Bytes per pixel.
+};
+
+bool is_supported(pixel_format::type format)
+{
+	switch(format)
+	{
+	case pixel_format::gray:
+	case pixel_format::bgra:
+	case pixel_format::rgba:
+	case pixel_format::argb:
+	case pixel_format::abgr:
+	case pixel_format::ycbcr:
+	case pixel_format::ycbcra:
+	case pixel_format::luma:
+	case pixel_format::color:
+	case pixel_format::nv12:
+	case pixel_format::ycbcr_keyed:
+	case pixel_format::bgra_keyed:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Bilinear with the edges clamped, as the gpu samples with GL_LINEAR, at the texture coordinates s and t.
+void sample(const plane_view& plane, float s, float t, float* out)
+{
+	float x = s*plane.width  - 0.5f;
+	float y = t*plane.height - 0.5f;
+
+	int x0 = static_cast<int>(std::floor(x));
+	int y0 = static_cast<int>(std::floor(y));
+	float fx = x - static_cast<float>(x0);
+	float fy = y - static_cast<float>(y0);
+
+	int x1 = std::max(0, std::min(x0 + 1, plane.width  - 1));
+	int y1 = std::max(0, std::min(y0 + 1, plane.height - 1));
+	x0 = std::max(0, std::min(x0, plane.width  - 1));
+	y0 = std::max(0, std::min(y0, plane.height - 1));
+
+	auto row0 = plane.data + y0*plane.width*plane.channels;
+	auto row1 = plane.data + y1*plane.width*plane.channels;
+
+	for(int c = 0; c < plane.channels; ++c)
+	{
+		float a = row0[x0*plane.channels + c];
+		float b = row0[x1*plane.channels + c];
+		float d = row1[x0*plane.channels + c];
+		float e = row1[x1*plane.channels + c];
+
+		float top	 = a + (b - a)*fx;
+		float bottom = d + (e - d)*fx;
+		out[c] = (top + (bottom - top)*fy) * (1.0f/255.0f);
+	}
+}
+
+// As ycbcra_to_rgba of the image shader, into bgra.
+void ycbcra_to_bgra(float y, float cb, float cr, float a, bool is_hd, float* bgra)
+{
+	y  = 1.164f*(y*255.0f - 16.0f);
+	cb = cb*255.0f - 128.0f;
+	cr = cr*255.0f - 128.0f;
+
+	if(is_hd)
+	{
+		bgra[2] = (y + 1.793f*cr) / 255.0f;
+		bgra[1] = (y - 0.534f*cr - 0.213f*cb) / 255.0f;
+		bgra[0] = (y + 2.115f*cb) / 255.0f;
+	}
+	else
+	{
+		bgra[2] = (y + 1.596f*cr) / 255.0f;
+		bgra[1] = (y - 0.813f*cr - 0.391f*cb) / 255.0f;
+		bgra[0] = (y + 2.018f*cb) / 255.0f;
+	}
+	bgra[3] = a;
+}
+
+float video_range_key(float luma)
+{
+	return std::max(0.0f, std::min(1.0f, (luma - 0.065f)/0.859f));
+}
+
+// The color of a supported format at s and t, as get_rgba_color of the image shader but in memory order.
+void get_bgra_color(pixel_format::type format, const std::array<plane_view, 4>& planes, float s, float t, bool is_hd, float* bgra)
+{
+	float p[4][4];
+
+	switch(format)
+	{
+	case pixel_format::gray:
+		sample(planes[0], s, t, p[0]);
+		bgra[0] = bgra[1] = bgra[2] = p[0][0];
+		bgra[3] = 1.0f;
+		break;
+	case pixel_format::bgra:
+		sample(planes[0], s, t, bgra);
+		break;
+	case pixel_format::rgba:
+		sample(planes[0], s, t, p[0]);
+		bgra[0] = p[0][2]; bgra[1] = p[0][1]; bgra[2] = p[0][0]; bgra[3] = p[0][3];
+		break;
+	case pixel_format::argb:
+		sample(planes[0], s, t, p[0]);
+		bgra[0] = p[0][3]; bgra[1] = p[0][2]; bgra[2] = p[0][1]; bgra[3] = p[0][0];
+		break;
+	case pixel_format::abgr:
+		sample(planes[0], s, t, p[0]);
+		bgra[0] = p[0][1]; bgra[1] = p[0][2]; bgra[2] = p[0][3]; bgra[3] = p[0][0];
+		break;
+	case pixel_format::ycbcr:
+	case pixel_format::ycbcra:
+	case pixel_format::ycbcr_keyed:
+		for(int n = 0; n < (format == pixel_format::ycbcr ? 3 : 4); ++n)
+			sample(planes[n], s, t, p[n]);
+		ycbcra_to_bgra(p[0][0], p[1][0], p[2][0], format == pixel_format::ycbcra ? p[3][0] : 1.0f, is_hd, bgra);
+		if(format == pixel_format::ycbcr_keyed)
+		{
+			float k = video_range_key(p[3][0]);
+			for(int c = 0; c < 4; ++c)
+				bgra[c] *= k;
+		}
+		break;
+	case pixel_format::luma:
+		sample(planes[0], s, t, p[0]);
+		bgra[0] = bgra[1] = bgra[2] = (p[0][0] - 0.065f)/0.859f;
+		bgra[3] = 1.0f;
+		break;
+	case pixel_format::nv12:
+		sample(planes[0], s, t, p[0]);
+		sample(planes[1], s, t, p[1]);
+		ycbcra_to_bgra(p[0][0], p[1][0], p[1][1], 1.0f, is_hd, bgra);
+		break;
+	case pixel_format::bgra_keyed:
+		{
+			sample(planes[0], s, t, bgra);
+			sample(planes[1], s, t, p[1]);
+			float k = video_range_key(p[1][0]);
+			for(int c = 0; c < 4; ++c)
+				bgra[c] *= k;
+		}
+		break;
+	default:
+		bgra[0] = bgra[1] = bgra[2] = bgra[3] = 0.0f;
+	}
+}
+
+uint8_t to_byte(float value)
+{
+	return static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, value*255.0f + 0.5f)));
+}
+
+// Keys hold the red channel of what is drawn into them, as the one channel key textures of the gpu renderer.
+void blend_key(uint8_t* dest, const uint8_t* bgra, std::size_t pixels)
+{
+	for(std::size_t n = 0; n < pixels; ++n)
+	{
+		const int x = dest[n] * (255 - bgra[n*4+3]) + 128;
+		dest[n] = static_cast<uint8_t>(std::min(255, bgra[n*4+2] + ((x + (x >> 8)) >> 8)));
+	}
+}
+
+}
+
+struct cpu_image_renderer::implementation : boost::noncopyable
+{
+	safe_ptr<ogl_device>	ogl_;
+	tbb::atomic<bool>		warned_formats_;
+	tbb::atomic<bool>		warned_features_;
+	int64_t					render_count_;
+	executor				executor_;
+
+	implementation(const safe_ptr<ogl_device>& ogl)
+		: ogl_(ogl)
+		, render_count_(0)
+		, executor_(L"cpu_image_renderer")
+	{
+		warned_formats_	 = false;
+		warned_features_ = false;
+	}
+
+	boost::unique_future<rendered_image> render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha)
+	{
+		auto layers2 = make_move_on_copy(std::move(layers));
+		return executor_.begin_invoke([=]
+		{
+			return do_render(std::move(layers2.value), format_desc, straighten_alpha);
+		});
+	}
+
+private:
+	rendered_image do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha)
+	{
+		diagnostics::trace::scope trace("image_mixer.render", ++render_count_);
+
+		auto image = ogl_->create_host_buffer(format_desc.size, read_only);
+		std::memset(image->data(), 0, format_desc.size);
+
+		surface target = {static_cast<uint8_t*>(image->data()), static_cast<int>(format_desc.width), static_cast<int>(format_desc.height), 4};
+
+		std::vector<uint8_t> layer_key;
+		BOOST_FOREACH(auto& layer, layers)
+			draw_layer(layer, target, layer_key);
+
+		if(straighten_alpha)
+			straighten(target);
+
+		rendered_image result;
+		result.image = image;
+		return result;
+	}
+
+	void draw_layer(const layer& layer, const surface& target, std::vector<uint8_t>& layer_key)
+	{
+		const std::size_t pixels = target.width*target.height;
+
+		if(layer.first.mode != blend_mode::normal || layer.first.chroma.key != chroma::none)
+			warn_feature(L"blend modes and chroma keys");
+
+		std::vector<uint8_t> local_key;
+		std::vector<uint8_t> local_mix;
+
+		BOOST_FOREACH(auto& item, layer.second)
+		{
+			if(item.transform.field_mode == field_mode::empty)
+				continue;
+
+			if(item.transform.is_key)
+			{
+				if(local_key.empty())
+					local_key.resize(pixels, 0);
+
+				surface key = {local_key.data(), target.width, target.height, 1};
+				draw_item(item, key, nullptr, nullptr, keyer::linear);
+			}
+			else if(item.transform.is_mix)
+			{
+				if(local_mix.empty())
+					local_mix.resize(pixels*4, 0);
+
+				surface mix = {local_mix.data(), target.width, target.height, 4};
+				draw_item(item, mix, key_data(local_key), key_data(layer_key), keyer::additive);
+				local_key.clear();
+			}
+			else
+			{
+				flush_mix(target, local_mix);
+				draw_item(item, target, key_data(local_key), key_data(layer_key), keyer::linear);
+				local_key.clear();
+			}
+		}
+
+		flush_mix(target, local_mix);
+
+		layer_key = std::move(local_key);
+	}
+
+	const uint8_t* key_data(const std::vector<uint8_t>& key)
+	{
+		return key.empty() ? nullptr : key.data();
+	}
+
+	void flush_mix(const surface& target, std::vector<uint8_t>& mix)
+	{
+		if(mix.empty())
+			return;
+
+		blend_over(target.data, mix.data(), target.width*target.height);
+		mix.clear();
+	}
+
+	void draw_item(const item& item, const surface& target, const uint8_t* local_key, const uint8_t* layer_key, keyer::type keyer)
+	{
+		static const double epsilon = 0.001;
+
+		const auto& transform = item.transform;
+		const auto format	  = item.pix_desc.pix_fmt;
+		const bool is_color	  = format == pixel_format::color;
+		const float opacity	  = static_cast<float>(transform.is_key ? 1.0 : transform.opacity);
+
+		if(opacity < epsilon || (item.textures.empty() && !is_color))
+			return;
+
+		std::array<plane_view, 4> planes;
+		for(std::size_t n = 0; n < item.textures.size() && n < planes.size(); ++n)
+		{
+			auto& texture = *item.textures[n];
+			if(!texture.data() || texture.compression() != texture_compression::none || texture.depth() != 1)
+				return warn_format(format);
+
+			planes[n].data		= texture.data();
+			planes[n].width		= texture.width();
+			planes[n].height	= texture.height();
+			planes[n].channels	= texture.stride();
+		}
+
+		if(!is_supported(format))
+			return warn_format(format);
+
+		if(item.deinterlace_field != field_mode::progressive || !is_color_neutral(transform))
+			warn_feature(L"levels, csb, luts and deinterlacing");
+
+		auto f_p = transform.fill_translation;
+		auto f_s = transform.fill_scale;
+
+		if(std::abs(f_s[0]) < std::numeric_limits<double>::epsilon() || std::abs(f_s[1]) < std::numeric_limits<double>::epsilon())
+			return;
+
+		// The pixels whose centers are inside of the fill, within the region which is exact for the clip.
+		auto region = get_region(transform, target.width, target.height);
+
+		const double w = target.width;
+		const double h = target.height;
+		const auto& rect = item.texture_rect;
+
+		std::vector<float> columns; // Texture s of every pixel from x0.
+		int x0 = 0;
+		for(int x = region.x; x < static_cast<int>(region.x + region.width); ++x)
+		{
+			double u = ((x + 0.5)/w - f_p[0])/f_s[0];
+			if(u >= 0.0 && u < 1.0)
+			{
+				if(columns.empty())
+					x0 = x;
+				columns.push_back(static_cast<float>(rect.x + u*rect.width));
+			}
+			else if(!columns.empty())
+				break;
+		}
+		
+		if(columns.empty())
+			return;
+
+		const int  x1	 = x0 + static_cast<int>(columns.size());
+		const bool is_hd = !item.pix_desc.planes.empty() && item.pix_desc.planes.at(0).height > 700;
+
+		float color[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+		if(is_color)
+		{
+			for(int c = 0; c < 4; ++c)
+				color[c] = static_cast<float>((item.color >> (8*c)) & 0xFF) / 255.0f;
+		}
+
+		// Bgra drawn one to one onto pixels, as full screen video usually is, is blended from the texture as it is.
+		const double texels_x = rect.width *planes[0].width /(f_s[0]*w);
+		const double texels_y = rect.height*planes[0].height/(f_s[1]*h);
+		const double first_x  = columns.front()*planes[0].width - 0.5;
+		const bool direct = format == pixel_format::bgra && opacity > 1.0 - epsilon && !local_key && !layer_key && target.stride == 4 &&
+							std::abs(texels_x - 1.0) < 0.0001 && std::abs(texels_y - 1.0) < 0.0001 &&
+							std::abs(first_x - std::floor(first_x + 0.5)) < 0.001 &&
+							first_x > -0.5 && first_x + columns.size() < planes[0].width + 0.5;
+
+		arena_parallel_for(tbb::blocked_range<int>(region.y, region.y + region.height), [&](const tbb::blocked_range<int>& r)
+		{
+			std::vector<uint8_t> row(columns.size()*4);
+
+			for(int y = r.begin(); y < r.end(); ++y)
+			{
+				// Rows count from the top of the image, the upper field holds the even rows.
+				if(!(transform.field_mode & (y % 2 == 0 ? field_mode::upper : field_mode::lower)))
+					continue;
+
+				double v = ((y + 0.5)/h - f_p[1])/f_s[1];
+				if(v < 0.0 || v >= 1.0)
+					continue;
+
+				const float t = static_cast<float>(rect.y + v*rect.height);
+				auto dest = target.data + (y*target.width + x0)*target.stride;
+
+				if(direct)
+				{
+					auto texel_y = static_cast<int>(std::floor(t*planes[0].height));
+					if(texel_y >= 0 && texel_y < planes[0].height)
+					{
+						auto source = planes[0].data + (texel_y*planes[0].width + static_cast<int>(std::floor(first_x + 0.5)))*4;
+						blend(dest, source, columns.size(), target.stride, keyer);
+						continue;
+					}
+				}
+
+				for(int x = x0; x < x1; ++x)
+				{
+					float bgra[4];
+					if(is_color)
+						std::copy(color, color + 4, bgra);
+					else
+						get_bgra_color(format, planes, columns[x - x0], t, is_hd, bgra);
+
+					float factor = opacity;
+					if(local_key)
+						factor *= local_key[y*target.width + x] * (1.0f/255.0f);
+					if(layer_key)
+						factor *= layer_key[y*target.width + x] * (1.0f/255.0f);
+
+					auto out = row.data() + (x - x0)*4;
+					for(int c = 0; c < 4; ++c)
+						out[c] = to_byte(bgra[c]*factor);
+				}
+
+				blend(dest, row.data(), columns.size(), target.stride, keyer);
+			}
+		});
+	}
+
+	void blend(uint8_t* dest, const uint8_t* bgra, std::size_t pixels, int stride, keyer::type keyer)
+	{
+		if(stride == 1)
+			blend_key(dest, bgra, pixels);
+		else if(keyer == keyer::additive)
+			blend_add(dest, bgra, pixels);
+		else
+			blend_over(dest, bgra, pixels);
+	}
+
+	void straighten(const surface& target)
+	{
+		arena_parallel_for(tbb::blocked_range<int>(0, target.height), [&](const tbb::blocked_range<int>& r)
+		{
+			for(int y = r.begin(); y < r.end(); ++y)
+			{
+				auto pixel = target.data + y*target.width*4;
+				for(int x = 0; x < target.width; ++x, pixel += 4)
+				{
+					if(pixel[3] == 0 || pixel[3] == 255)
+						continue;
+
+					for(int c = 0; c < 3; ++c)
+						pixel[c] = static_cast<uint8_t>(std::min(255, (pixel[c]*255 + pixel[3]/2) / pixel[3]));
+				}
+			}
+		});
+	}
+
+	void warn_format(pixel_format::type format)
+	{
+		if(!warned_formats_.fetch_and_store(true))
+			CASPAR_LOG(warning) << L"[cpu_image_renderer] Pixel format " << static_cast<int>(format) << L" is only drawn by the gpu renderer, such items are left out.";
+	}
+
+	void warn_feature(const std::wstring& feature)
+	{
+		if(!warned_features_.fetch_and_store(true))
+			CASPAR_LOG(warning) << L"[cpu_image_renderer] The cpu renderer ignores " << feature << L".";
+	}
+};
+
+cpu_image_renderer::cpu_image_renderer(const safe_ptr<ogl_device>& ogl) : impl_(new implementation(ogl)){}
+boost::unique_future<rendered_image> cpu_image_renderer::operator()(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha){return impl_->render(std::move(layers), format_desc, straighten_alpha);}
+
+}}
@@ -0,0 +1,53 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "image_item.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/future.hpp>
+
+#include <vector>
+
+namespace caspar { namespace core {
+
+class ogl_device;
+struct rendered_image;
+struct video_format_desc;
+
+// Composites the layers in host memory, for a software ogl_device. Items are sampled bilinearly and drawn with
+// their transforms, opacity, clipping, fields and keys. Blend modes, chroma keys, levels, csb and deinterlacing
+// are left out, the output is the host image only.
+class cpu_image_renderer : boost::noncopyable
+{
+public:
+	explicit cpu_image_renderer(const safe_ptr<ogl_device>& ogl);
+
+	boost::unique_future<rendered_image> operator()(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha);
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
@@ -0,0 +1,60 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "blend_modes.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/producer/frame/frame_transform.h>
+#include <core/producer/frame/pixel_format.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace caspar { namespace core {
+
+class device_buffer;
+	
+// A frame of a layer as visited by the image mixer, drawn by the gpu or the cpu renderer.
+struct item
+{
+	pixel_format_desc						pix_desc;
+	std::vector<safe_ptr<device_buffer>>	textures;
+	texture_rect							texture_rect;
+	frame_transform							transform;
+	uint32_t								color; // bgra, pixel_format::color only.
+	field_mode::type						deinterlace_field;
+	std::vector<safe_ptr<device_buffer>>	before_textures;
+	std::vector<safe_ptr<device_buffer>>	after_textures;
+
+	item()
+		: color(0)
+		, deinterlace_field(field_mode::progressive)
+	{
+	}
+};
+
+typedef std::pair<blend_mode, std::vector<item>> layer;
+
+}}
@@ -22,6 +22,7 @@
 #include "../../stdafx.h"
 
 #include "image_kernel.h"
+#include "color_lut.h"
 
 #include "shader/image_shader.h"
 #include "shader/blending_glsl.h"
@@ -39,6 +40,11 @@
 #include <core/producer/frame/frame_transform.h>
 
 #include <boost/noncopyable.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
 
 namespace caspar { namespace core {
 	
@@ -54,36 +60,215 @@ GLubyte lower_pattern[] = {
 	0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff,	0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff,
 	0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff,	0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,	0xff, 0xff, 0xff, 0xff};
 
+region merge(const region& lhs, const region& rhs)
+{
+	if(lhs.empty())
+		return rhs;
+	if(rhs.empty())
+		return lhs;
+
+	auto x0 = std::min(lhs.x, rhs.x);
+	auto y0 = std::min(lhs.y, rhs.y);
+	auto x1 = std::max(static_cast<uint64_t>(lhs.x) + lhs.width,  static_cast<uint64_t>(rhs.x) + rhs.width);
+	auto y1 = std::max(static_cast<uint64_t>(lhs.y) + lhs.height, static_cast<uint64_t>(rhs.y) + rhs.height);
+
+	return region(x0, y0, static_cast<uint32_t>(std::min<uint64_t>(x1 - x0, std::numeric_limits<uint32_t>::max())), static_cast<uint32_t>(std::min<uint64_t>(y1 - y0, std::numeric_limits<uint32_t>::max())));
+}
+
+region intersect(const region& lhs, const region& rhs)
+{
+	auto x0 = std::max(lhs.x, rhs.x);
+	auto y0 = std::max(lhs.y, rhs.y);
+	auto x1 = std::min(static_cast<uint64_t>(lhs.x) + lhs.width,  static_cast<uint64_t>(rhs.x) + rhs.width);
+	auto y1 = std::min(static_cast<uint64_t>(lhs.y) + lhs.height, static_cast<uint64_t>(rhs.y) + rhs.height);
+
+	if(x1 <= x0 || y1 <= y0)
+		return region();
+
+	return region(x0, y0, static_cast<uint32_t>(x1 - x0), static_cast<uint32_t>(y1 - y0));
+}
+
+region get_region(const frame_transform& transform, uint32_t width, uint32_t height)
+{
+	auto w = static_cast<double>(width);
+	auto h = static_cast<double>(height);
+
+	auto f_p = transform.fill_translation;
+	auto f_s = transform.fill_scale;
+
+	// The fill quad is rasterized by the gpu anyway, so it is enough to be conservative. 
+	// One pixel of margin covers rounding and the viewport offset used for paused upper fields.
+	auto fill_x0 = std::floor(std::min(f_p[0], f_p[0]+f_s[0])*w) - 1.0;
+	auto fill_y0 = std::floor(std::min(f_p[1], f_p[1]+f_s[1])*h) - 1.0;
+	auto fill_x1 = std::ceil (std::max(f_p[0], f_p[0]+f_s[0])*w) + 1.0;
+	auto fill_y1 = std::ceil (std::max(f_p[1], f_p[1]+f_s[1])*h) + 1.0;
+
+	auto clamp = [](double value, double max) -> uint32_t
+	{
+		return static_cast<uint32_t>(std::max(0.0, std::min(max, value)));
+	};
+
+	auto fill = region(clamp(fill_x0, w), clamp(fill_y0, h), 0, 0);
+	fill.width  = clamp(fill_x1, w) - fill.x;
+	fill.height = clamp(fill_y1, h) - fill.y;
+	
+	auto m_p = transform.clip_translation;
+	auto m_s = transform.clip_scale;
+
+	bool clip = m_p[0] > std::numeric_limits<double>::epsilon()			|| m_p[1] > std::numeric_limits<double>::epsilon() ||
+				m_s[0] < (1.0 - std::numeric_limits<double>::epsilon())	|| m_s[1] < (1.0 - std::numeric_limits<double>::epsilon());
+
+	if(!clip)
+		return fill;
+
+	// The clip rectangle on the other hand has to be exact.
+	return intersect(fill, region(static_cast<uint32_t>(m_p[0]*w), static_cast<uint32_t>(m_p[1]*h), static_cast<uint32_t>(m_s[0]*w), static_cast<uint32_t>(m_s[1]*h)));
+}
+
+// A color_lut uploaded into a 3D texture, which is sampled with trilinear filtering.
+class lut_texture : boost::noncopyable
+{
+	GLuint	id_;
+	int		size_;
+public:
+	explicit lut_texture(const color_lut& lut)
+		: id_(0)
+		, size_(lut.size)
+	{
+		GL(glGenTextures(1, &id_));
+		GL(glBindTexture(GL_TEXTURE_3D, id_));
+		GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GL(glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+		GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0)); // Uploads from host memory, not from a host_buffer.
+		GL(glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB16F, size_, size_, size_, 0, GL_RGB, GL_FLOAT, lut.data.data()));
+		GL(glBindTexture(GL_TEXTURE_3D, 0));
+	}
+
+	~lut_texture()
+	{
+		try
+		{
+			GL(glDeleteTextures(1, &id_));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+
+	void bind(int index)
+	{
+		GL(glActiveTexture(GL_TEXTURE0+index));
+		GL(glBindTexture(GL_TEXTURE_3D, id_));
+	}
+
+	int size() const
+	{
+		return size_;
+	}
+};
+
+// The members of a frame_transform which a baked lut depends on.
+struct lut_key
+{
+	int		lut;
+	double	levels[5];
+	double	brightness;
+	double	saturation;
+	double	contrast;
+
+	explicit lut_key(const frame_transform& transform)
+		: lut(transform.lut)
+		, brightness(transform.brightness)
+		, saturation(transform.saturation)
+		, contrast(transform.contrast)
+	{
+		levels[0] = transform.levels.min_input;
+		levels[1] = transform.levels.max_input;
+		levels[2] = transform.levels.gamma;
+		levels[3] = transform.levels.min_output;
+		levels[4] = transform.levels.max_output;
+	}
+
+	bool operator<(const lut_key& other) const
+	{
+		return boost::tie(lut, levels[0], levels[1], levels[2], levels[3], levels[4], brightness, saturation, contrast)
+			 < boost::tie(other.lut, other.levels[0], other.levels[1], other.levels[2], other.levels[3], other.levels[4], other.brightness, other.saturation, other.contrast);
+	}
+};
+
 struct image_kernel::implementation : boost::noncopyable
 {	
+	struct cached_lut
+	{
+		std::shared_ptr<lut_texture>	texture;
+		int64_t							last_used;
+	};
+
+
 	safe_ptr<ogl_device>	ogl_;
 	safe_ptr<shader>		shader_;
+	safe_ptr<shader>		packing_shader_;
+	safe_ptr<shader>		keyer_shader_;
 	bool					blend_modes_;
 	bool					post_processing_;
 	bool					supports_texture_barrier_;
+	int64_t					draw_calls_;
+	std::map<lut_key, cached_lut> luts_;
 							
 	implementation(const safe_ptr<ogl_device>& ogl)
 		: ogl_(ogl)
 		, shader_(ogl_->invoke([&]{return get_image_shader(*ogl, blend_modes_, post_processing_);}))
+		, packing_shader_(ogl_->invoke([&]{return get_packing_shader(*ogl);}))
+		, keyer_shader_(ogl_->invoke([&]{return get_keyer_shader(*ogl);}))
 		, supports_texture_barrier_(glTextureBarrierNV != 0)
+		, draw_calls_(0)
 	{
 		if (!supports_texture_barrier_)
 			CASPAR_LOG(warning) << L"[image_mixer] TextureBarrierNV not supported. Post processing will not be available";
 	}
 
+	~implementation()
+	{
+		try
+		{
+			// The lut textures have to be deleted in the context which created them.
+			ogl_->invoke([this]{luts_.clear();});
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+
 	void draw(draw_params&& params)
 	{
 		static const double epsilon = 0.001;
 
 		CASPAR_ASSERT(params.pix_desc.planes.size() == params.textures.size());
 
-		if(params.textures.empty() || !params.background)
+		bool is_color = params.pix_desc.pix_fmt == pixel_format::color;
+
+		if((params.textures.empty() && !is_color) || !params.background)
 			return;
 
 		if(params.transform.opacity < epsilon)
 			return;
+
+		auto region = intersect(get_region(params.transform, params.background->width(), params.background->height()), params.scissor);
+
+		if(region.empty())
+			return;
+
+		if(is_color && try_clear(params, region))
+			return;
 		
-		if(!std::all_of(params.textures.begin(), params.textures.end(), std::mem_fn(&device_buffer::ready)))
+		if(ogl_->transfer_context()) // Uploaded in another context, the gpu waits for them instead.
+			std::for_each(params.textures.begin(), params.textures.end(), std::mem_fn(&device_buffer::wait_written));
+		else if(!std::all_of(params.textures.begin(), params.textures.end(), std::mem_fn(&device_buffer::ready)))
 		{
 			CASPAR_LOG(trace) << L"[image_mixer] Performance warning. Host to device transfer not complete, GPU will be stalled";
 			ogl_->yield(); // Try to give it some more time.
@@ -94,55 +279,134 @@ struct image_kernel::implementation : boost::noncopyable
 		for(uint32_t n = 0; n < params.textures.size(); ++n)
 			params.textures[n]->bind(n);
 
+		bool deinterlace = params.deinterlace_field == field_mode::upper || params.deinterlace_field == field_mode::lower;
+		bool temporal	 = deinterlace && params.before_textures.size() == params.textures.size() && params.after_textures.size() == params.textures.size();
+
+		if(temporal)
+		{
+			for(uint32_t n = 0; n < params.textures.size(); ++n)
+			{
+				params.before_textures[n]->bind(texture_id::before0 + n);
+				params.after_textures[n]->bind(texture_id::after0 + n);
+			}
+		}
+
 		if(params.local_key)
 			params.local_key->bind(texture_id::local_key);
 		
 		if(params.layer_key)
 			params.layer_key->bind(texture_id::layer_key);
 			
+		// Select shader
+
+		if(params.transform.is_key)
+			params.blend_mode = blend_mode::normal;
+
+		bool color_lut = !is_color_neutral(params.transform);
+
+		// Up to a sample per pixel the image moves, which is converted into the texture coordinates of the image.
+		static const int max_motion_blur_samples = 32;
+		auto motion_length	= std::sqrt(params.transform.motion_blur[0]*params.transform.motion_blur[0] + params.transform.motion_blur[1]*params.transform.motion_blur[1]);
+		auto motion_samples	= std::min(max_motion_blur_samples, static_cast<int>(std::ceil(motion_length)));
+		bool motion_blur	= motion_samples > 1 && params.transform.fill_scale[0] > 0.0 && params.transform.fill_scale[1] > 0.0;
+
+		int chroma_mode = params.blend_mode.chroma.key == chroma::green ? 1 : (params.blend_mode.chroma.key == chroma::blue ? 2 : 0);
+
+		image_shader_key key;
+		key.pixel_format	= params.pix_desc.pix_fmt;
+		key.has_local_key	= bool(params.local_key);
+		key.has_layer_key	= bool(params.layer_key);
+		key.blend_mode		= params.blend_mode.mode;
+		key.keyer			= params.keyer;
+		key.chroma_mode		= chroma_mode;
+		key.color_lut		= color_lut;
+		key.deinterlace		= deinterlace ? params.deinterlace_field : 0;
+		key.motion_blur		= motion_blur && !deinterlace;
+
+		// Uniforms compiled in as constants in the specialized variant are simply ignored.
+		auto shader = get_image_shader(*ogl_, key);
+		if(!shader)
+			shader = shader_;
+
 		// Setup shader
 								
-		ogl_->use(*shader_);
-
-		shader_->set("plane[0]",		texture_id::plane0);
-		shader_->set("plane[1]",		texture_id::plane1);
-		shader_->set("plane[2]",		texture_id::plane2);
-		shader_->set("plane[3]",		texture_id::plane3);
-		shader_->set("local_key",		texture_id::local_key);
-		shader_->set("layer_key",		texture_id::layer_key);
-		shader_->set("is_hd",		 	params.pix_desc.planes.at(0).height > 700 ? 1 : 0);
-		shader_->set("has_local_key",	bool(params.local_key));
-		shader_->set("has_layer_key",	bool(params.layer_key));
-		shader_->set("pixel_format",	params.pix_desc.pix_fmt);	
-		shader_->set("opacity",			params.transform.is_key ? 1.0 : params.transform.opacity);	
-		shader_->set("post_processing",	false);
-
-		shader_->set("chroma_mode",    params.blend_mode.chroma.key == chroma::green ? 1 : (params.blend_mode.chroma.key == chroma::blue ? 2 : 0));
-        shader_->set("chroma_blend",   params.blend_mode.chroma.threshold, params.blend_mode.chroma.softness);
-        shader_->set("chroma_spill",   params.blend_mode.chroma.spill);
-//        shader_->set("chroma.key",      ((params.blend_mode.chroma.key >> 24) && 0xff)/255.0f,
+		ogl_->use(*shader);
+
+		shader->set("plane[0]",		texture_id::plane0);
+		shader->set("plane[1]",		texture_id::plane1);
+		shader->set("plane[2]",		texture_id::plane2);
+		shader->set("plane[3]",		texture_id::plane3);
+		shader->set("local_key",		texture_id::local_key);
+		shader->set("layer_key",		texture_id::layer_key);
+		shader->set("is_hd",		 	!params.pix_desc.planes.empty() && params.pix_desc.planes.at(0).height > 700 ? 1 : 0);
+		shader->set("has_local_key",	bool(params.local_key));
+		shader->set("has_layer_key",	bool(params.layer_key));
+		shader->set("pixel_format",	params.pix_desc.pix_fmt);	
+		shader->set("packed_width",	static_cast<int>(params.pix_desc.packed_width));
+		shader->set("opacity",			params.transform.is_key ? 1.0 : params.transform.opacity);	
+		shader->set("deinterlace",		deinterlace ? static_cast<int>(params.deinterlace_field) : 0);
+		shader->set("deinterlace_temporal", temporal);
+		shader->set("motion_blur",		key.motion_blur);
+
+		if(key.motion_blur)
+		{
+			auto pixels_x = params.transform.fill_scale[0] * static_cast<double>(params.background->width());
+			auto pixels_y = params.transform.fill_scale[1] * static_cast<double>(params.background->height());
+
+			shader->set("motion_blur_step",		static_cast<float>(params.transform.motion_blur[0] / motion_samples * params.texture_rect.width / pixels_x),
+												static_cast<float>(params.transform.motion_blur[1] / motion_samples * params.texture_rect.height / pixels_y));
+			shader->set("motion_blur_samples",	motion_samples);
+			shader->set("motion_blur_bounds",	static_cast<float>(params.texture_rect.x), 
+												static_cast<float>(params.texture_rect.y),
+												static_cast<float>(params.texture_rect.x + params.texture_rect.width),
+												static_cast<float>(params.texture_rect.y + params.texture_rect.height));
+		}
+
+		if(temporal)
+		{
+			shader->set("before[0]",	texture_id::before0);
+			shader->set("before[1]",	texture_id::before1);
+			shader->set("before[2]",	texture_id::before2);
+			shader->set("before[3]",	texture_id::before3);
+			shader->set("after[0]",		texture_id::after0);
+			shader->set("after[1]",		texture_id::after1);
+			shader->set("after[2]",		texture_id::after2);
+			shader->set("after[3]",		texture_id::after3);
+		}
+
+		if(is_color)
+		{
+			shader->set("solid_color",	static_cast<float>( params.color        & 0xFF) / 255.0f,
+										static_cast<float>((params.color >> 8)  & 0xFF) / 255.0f,
+										static_cast<float>((params.color >> 16) & 0xFF) / 255.0f,
+										static_cast<float>((params.color >> 24) & 0xFF) / 255.0f);
+		}
+		shader->set("post_processing",	false);
+
+		shader->set("chroma_mode",    chroma_mode);
+        shader->set("chroma_blend",   params.blend_mode.chroma.threshold, params.blend_mode.chroma.softness);
+        shader->set("chroma_spill",   params.blend_mode.chroma.spill);
+//        shader->set("chroma.key",      ((params.blend_mode.chroma.key >> 24) && 0xff)/255.0f,
 //                                        ((params.blend_mode.chroma.key >> 16) && 0xff)/255.0f,
 //                                        (params.blend_mode.chroma.key & 0xff)/255.0f);
 //		if (params.blend_mode.chroma.key != chroma::none)
 //		{
-//		    shader_->set("chroma.threshold", 	params.blend_mode.chroma.threshold);
-//		    shader_->set("chroma.softness",     params.blend_mode.chroma.softness);
-//            shader_->set("chroma.blur",         params.blend_mode.chroma.blur);
-//		    shader_->set("chroma.spill",        params.blend_mode.chroma.spill);
-//            shader_->set("chroma.show_mask",    params.blend_mode.chroma.show_mask);
+//		    shader->set("chroma.threshold", 	params.blend_mode.chroma.threshold);
+//		    shader->set("chroma.softness",     params.blend_mode.chroma.softness);
+//            shader->set("chroma.blur",         params.blend_mode.chroma.blur);
+//		    shader->set("chroma.spill",        params.blend_mode.chroma.spill);
+//            shader->set("chroma.show_mask",    params.blend_mode.chroma.show_mask);
 //		}
 		
 		// Setup blend_func		
-		if(params.transform.is_key)
-			params.blend_mode = blend_mode::normal;
 
 		if(blend_modes_)
 		{
 			params.background->bind(texture_id::background);
 
-			shader_->set("background",	texture_id::background);
-			shader_->set("blend_mode",	params.blend_mode.mode);
-			shader_->set("keyer",		params.keyer);
+			shader->set("background",	texture_id::background);
+			shader->set("blend_mode",	params.blend_mode.mode);
+			shader->set("keyer",		params.keyer);
 		}
 		else
 		{
@@ -159,70 +423,60 @@ struct image_kernel::implementation : boost::noncopyable
 
 		// Setup image-adjustements
 		
-		if(params.transform.levels.min_input  > epsilon		||
-		   params.transform.levels.max_input  < 1.0-epsilon	||
-		   params.transform.levels.min_output > epsilon		||
-		   params.transform.levels.max_output < 1.0-epsilon	||
-		   std::abs(params.transform.levels.gamma - 1.0) > epsilon)
+		if(color_lut)
 		{
-			shader_->set("levels", true);	
-			shader_->set("min_input",	params.transform.levels.min_input);	
-			shader_->set("max_input",	params.transform.levels.max_input);
-			shader_->set("min_output",	params.transform.levels.min_output);
-			shader_->set("max_output",	params.transform.levels.max_output);
-			shader_->set("gamma",		params.transform.levels.gamma);
-		}
-		else
-			shader_->set("levels", false);	
+			auto& texture = get_lut_texture(params.transform);
+			texture.bind(texture_id::color_lut);
 
-		if(std::abs(params.transform.brightness - 1.0) > epsilon ||
-		   std::abs(params.transform.saturation - 1.0) > epsilon ||
-		   std::abs(params.transform.contrast - 1.0)   > epsilon)
-		{
-			shader_->set("csb",	true);	
-			
-			shader_->set("brt", params.transform.brightness);	
-			shader_->set("sat", params.transform.saturation);
-			shader_->set("con", params.transform.contrast);
+			shader->set("color_lut",	true);
+			shader->set("lut",			texture_id::color_lut);
+			shader->set("lut_size",		static_cast<float>(texture.size()));
 		}
 		else
-			shader_->set("csb",	false);	
+			shader->set("color_lut",	false);
 		
-		// Setup interlacing
+		// Setup interlacing and drawing area
 
-		if(params.transform.field_mode == core::field_mode::progressive)			
-			ogl_->disable(GL_POLYGON_STIPPLE);			
-		else			
-		{
-			ogl_->enable(GL_POLYGON_STIPPLE);
+		auto f_p = params.transform.fill_translation;
+		auto f_s = params.transform.fill_scale;
 
-			if(params.transform.field_mode == core::field_mode::upper)
-				ogl_->stipple_pattern(upper_pattern);
-			else if(params.transform.field_mode == core::field_mode::lower)
-				ogl_->stipple_pattern(lower_pattern);
-		}
+		auto t_x0 = params.texture_rect.x;
+		auto t_y0 = params.texture_rect.y;
+		auto t_x1 = params.texture_rect.x + params.texture_rect.width;
+		auto t_y1 = params.texture_rect.y + params.texture_rect.height;
 
-		// Setup drawing area
-		
-		ogl_->viewport(0, (params.transform.is_paused && params.transform.field_mode == core::field_mode::upper) ? 1 : 0, params.background->width(), params.background->height());
-								
-		auto m_p = params.transform.clip_translation;
-		auto m_s = params.transform.clip_scale;
+		if(params.target_field != core::field_mode::progressive)
+		{
+			// Rows of a field target are centered between two frame lines, the geometry is moved half a frame line 
+			// so that they sample the lines of their field instead.
+			double line = 0.5 / static_cast<double>(params.background->height());
 
-		bool scissor = m_p[0] > std::numeric_limits<double>::epsilon()			|| m_p[1] > std::numeric_limits<double>::epsilon() ||
-					   m_s[0] < (1.0 - std::numeric_limits<double>::epsilon())	|| m_s[1] < (1.0 - std::numeric_limits<double>::epsilon());
+			f_p[1] += params.target_field == core::field_mode::upper ? line*0.5 : -line*0.5;
+			if(params.transform.is_paused && params.target_field == core::field_mode::upper)
+				f_p[1] += line;
 
-		if(scissor)
+			ogl_->disable(GL_POLYGON_STIPPLE);
+			ogl_->viewport(0, 0, params.background->width(), params.background->height());
+		}
+		else
 		{
-			double w = static_cast<double>(params.background->width());
-			double h = static_cast<double>(params.background->height());
+			if(params.transform.field_mode == core::field_mode::progressive)			
+				ogl_->disable(GL_POLYGON_STIPPLE);			
+			else			
+			{
+				ogl_->enable(GL_POLYGON_STIPPLE);
+
+				if(params.transform.field_mode == core::field_mode::upper)
+					ogl_->stipple_pattern(upper_pattern);
+				else if(params.transform.field_mode == core::field_mode::lower)
+					ogl_->stipple_pattern(lower_pattern);
+			}
 		
-			ogl_->enable(GL_SCISSOR_TEST);
-			ogl_->scissor(static_cast<uint32_t>(m_p[0]*w), static_cast<uint32_t>(m_p[1]*h), static_cast<uint32_t>(m_s[0]*w), static_cast<uint32_t>(m_s[1]*h));
+			ogl_->viewport(0, (params.transform.is_paused && params.transform.field_mode == core::field_mode::upper) ? 1 : 0, params.background->width(), params.background->height());
 		}
-
-		auto f_p = params.transform.fill_translation;
-		auto f_s = params.transform.fill_scale;
+								
+		ogl_->enable(GL_SCISSOR_TEST);
+		ogl_->scissor(region.x, region.y, region.width, region.height);
 		
 		// Set render target
 		
@@ -231,21 +485,24 @@ struct image_kernel::implementation : boost::noncopyable
 		// Draw
 				
 		/*
-			GL_TEXTURE0 are texture coordinates to the source material, what will be rendered with this call. These are always set to the whole thing.
+			GL_TEXTURE0 are texture coordinates to the source material, what will be rendered with this call. These are set to the whole image, which is a part of the textures when it is in an atlas.
 			GL_TEXTURE1 are texture coordinates to background- / key-material, that which will have to be taken in consideration when blending. These are set to the rectangle over which the source will be rendered
 		*/
 		glBegin(GL_QUADS);
-			glMultiTexCoord2d(GL_TEXTURE0, 0.0, 0.0); glMultiTexCoord2d(GL_TEXTURE1,  f_p[0]        ,  f_p[1]        );		glVertex2d( f_p[0]        *2.0-1.0,  f_p[1]        *2.0-1.0);
-			glMultiTexCoord2d(GL_TEXTURE0, 1.0, 0.0); glMultiTexCoord2d(GL_TEXTURE1, (f_p[0]+f_s[0]),  f_p[1]        );		glVertex2d((f_p[0]+f_s[0])*2.0-1.0,  f_p[1]        *2.0-1.0);
-			glMultiTexCoord2d(GL_TEXTURE0, 1.0, 1.0); glMultiTexCoord2d(GL_TEXTURE1, (f_p[0]+f_s[0]), (f_p[1]+f_s[1]));		glVertex2d((f_p[0]+f_s[0])*2.0-1.0, (f_p[1]+f_s[1])*2.0-1.0);
-			glMultiTexCoord2d(GL_TEXTURE0, 0.0, 1.0); glMultiTexCoord2d(GL_TEXTURE1,  f_p[0]        , (f_p[1]+f_s[1]));		glVertex2d( f_p[0]        *2.0-1.0, (f_p[1]+f_s[1])*2.0-1.0);
+			glMultiTexCoord2d(GL_TEXTURE0, t_x0, t_y0); glMultiTexCoord2d(GL_TEXTURE1,  f_p[0]        ,  f_p[1]        );		glVertex2d( f_p[0]        *2.0-1.0,  f_p[1]        *2.0-1.0);
+			glMultiTexCoord2d(GL_TEXTURE0, t_x1, t_y0); glMultiTexCoord2d(GL_TEXTURE1, (f_p[0]+f_s[0]),  f_p[1]        );		glVertex2d((f_p[0]+f_s[0])*2.0-1.0,  f_p[1]        *2.0-1.0);
+			glMultiTexCoord2d(GL_TEXTURE0, t_x1, t_y1); glMultiTexCoord2d(GL_TEXTURE1, (f_p[0]+f_s[0]), (f_p[1]+f_s[1]));		glVertex2d((f_p[0]+f_s[0])*2.0-1.0, (f_p[1]+f_s[1])*2.0-1.0);
+			glMultiTexCoord2d(GL_TEXTURE0, t_x0, t_y1); glMultiTexCoord2d(GL_TEXTURE1,  f_p[0]        , (f_p[1]+f_s[1]));		glVertex2d( f_p[0]        *2.0-1.0, (f_p[1]+f_s[1])*2.0-1.0);
 		glEnd();
+		++draw_calls_;
 		
 		// Cleanup
 
 		ogl_->disable(GL_SCISSOR_TEST);	
 						
 		params.textures.clear();
+		params.before_textures.clear();
+		params.after_textures.clear();
 		ogl_->yield(); // Return resources to pool as early as possible.
 
 		if(blend_modes_)
@@ -256,6 +513,87 @@ struct image_kernel::implementation : boost::noncopyable
 		}
 	}
 
+	// Luts are baked once for every combination of color adjustments, tweened adjustments bake one for every 
+	// frame but those which are not used for a while are released.
+	lut_texture& get_lut_texture(const frame_transform& transform)
+	{
+		static const size_t max_cached_luts = 16;
+
+		lut_key key(transform);
+
+		auto it = luts_.find(key);
+		if(it == luts_.end())
+		{
+			if(luts_.size() >= max_cached_luts)
+			{
+				auto oldest = std::min_element(luts_.begin(), luts_.end(), [](const std::pair<const lut_key, cached_lut>& lhs, const std::pair<const lut_key, cached_lut>& rhs)
+				{
+					return lhs.second.last_used < rhs.second.last_used;
+				});
+				luts_.erase(oldest);
+			}
+
+			cached_lut lut = {std::make_shared<lut_texture>(*bake_color_lut(transform)), 0};
+			it = luts_.insert(std::make_pair(key, lut)).first;
+		}
+
+		it->second.last_used = draw_calls_;
+		return *it->second.texture;
+	}
+
+	// An opaque color which replaces everything inside of the region is cleared instead of drawn.
+	bool try_clear(const draw_params& params, const region& region)
+	{
+		static const double epsilon = 0.001;
+
+		const auto& transform = params.transform;
+
+		if(!params.pix_desc.is_opaque || params.local_key || params.layer_key || params.keyer != keyer::linear)
+			return false;
+
+		if(transform.is_key || transform.is_mix || transform.opacity < 1.0-epsilon)
+			return false;
+
+		if(params.blend_mode.mode != blend_mode::normal || params.blend_mode.chroma.key != chroma::none)
+			return false;
+
+		if(transform.is_paused || (params.target_field == field_mode::progressive && transform.field_mode != field_mode::progressive))
+			return false;
+
+		if(!is_color_neutral(transform))
+			return false;
+
+		// The region of the quad is only conservative, so it has to cover the whole scissor exactly.
+		for(int n = 0; n < 2; ++n)
+		{
+			if(transform.fill_translation[n] > epsilon || transform.fill_translation[n] + transform.fill_scale[n] < 1.0-epsilon)
+				return false;
+			if(transform.clip_translation[n] > epsilon || transform.clip_translation[n] + transform.clip_scale[n] < 1.0-epsilon)
+				return false;
+		}
+
+		ogl_->attach(*params.background);
+
+		ogl_->enable(GL_SCISSOR_TEST);
+		ogl_->scissor(region.x, region.y, region.width, region.height);
+
+		// The framebuffer holds rgba, the color is bgra.
+		GL(glClearColor(static_cast<float>((params.color >> 16) & 0xFF) / 255.0f, 
+						static_cast<float>((params.color >> 8)  & 0xFF) / 255.0f,
+						static_cast<float>( params.color        & 0xFF) / 255.0f,
+						1.0f));
+		GL(glClear(GL_COLOR_BUFFER_BIT));
+		GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+		++draw_calls_;
+
+		ogl_->disable(GL_SCISSOR_TEST);
+
+		if(blend_modes_)
+			glTextureBarrierNV(); 
+
+		return true;
+	}
+
 	void post_process(
 			const safe_ptr<device_buffer>& background, bool straighten_alpha)
 	{
@@ -276,10 +614,17 @@ struct image_kernel::implementation : boost::noncopyable
 
 		background->bind(texture_id::background);
 
-		ogl_->use(*shader_);
-		shader_->set("background", texture_id::background);
-		shader_->set("post_processing", should_post_process);
-		shader_->set("straighten_alpha", straighten_alpha);
+		image_shader_key key;
+		key.post_processing = true;
+
+		auto shader = get_image_shader(*ogl_, key);
+		if(!shader)
+			shader = shader_;
+
+		ogl_->use(*shader);
+		shader->set("background", texture_id::background);
+		shader->set("post_processing", should_post_process);
+		shader->set("straighten_alpha", straighten_alpha);
 
 		ogl_->viewport(0, 0, background->width(), background->height());
 
@@ -289,15 +634,159 @@ struct image_kernel::implementation : boost::noncopyable
 			glMultiTexCoord2d(GL_TEXTURE0, 1.0, 1.0); glVertex2d( 1.0,  1.0);
 			glMultiTexCoord2d(GL_TEXTURE0, 0.0, 1.0); glVertex2d(-1.0,  1.0);
 		glEnd();
+		++draw_calls_;
 
 		glTextureBarrierNV();
 
 		if (!blend_modes_)
 			ogl_->enable(GL_BLEND);
 	}
+
+	void pack(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, output_packing::type packing, bool interlaced, output_split::type split)
+	{
+		draw_packing(source, target, packing, false, false, interlaced, split);
+	}
+
+	void extract_key(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target)
+	{
+		draw_packing(source, target, output_packing::none, true);
+	}
+
+	void interleave(
+			const safe_ptr<device_buffer>& upper, const safe_ptr<device_buffer>& lower, const safe_ptr<device_buffer>& target)
+	{
+		lower->bind(texture_id::plane0);
+		draw_packing(upper, target, output_packing::none, false, true);
+	}
+
+	void scale(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, field_mode::type field)
+	{
+		draw_packing(source, target, output_packing::none, false, false, false, output_split::none, true, field);
+	}
+
+	void chroma_key(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, const chroma& chroma, const region& area)
+	{
+		static const int max_radius = 16;
+
+		auto full = intersect(area, region(0, 0, source->width(), source->height()));
+		if(full.empty())
+			return;
+
+		// The matte covers the region at half resolution, rounded outwards.
+		auto half = region(full.x/2, full.y/2, 0, 0);
+		half.width  = (full.x + full.width  + 1)/2 - half.x;
+		half.height = (full.y + full.height + 1)/2 - half.y;
+
+		// The blur is in pixels of the source, with taps out to two deviations.
+		auto sigma	= chroma.blur * 0.5f;
+		auto radius	= std::min(max_radius, static_cast<int>(std::ceil(sigma * 2.0f)));
+
+		auto matte	 = ogl_->create_device_buffer((source->width() + 1)/2, (source->height() + 1)/2, 1);
+		auto blurred = radius > 0 ? ogl_->create_device_buffer(matte->width(), matte->height(), 1) : matte;
+
+		if (!blend_modes_)
+			ogl_->disable(GL_BLEND);
+
+		ogl_->disable(GL_POLYGON_STIPPLE);
+
+		int chroma_mode = chroma.key == chroma::green ? 1 : (chroma.key == chroma::blue ? 2 : 0);
+
+		ogl_->use(*keyer_shader_);
+		keyer_shader_->set("source",		texture_id::plane0);
+		keyer_shader_->set("matte",			texture_id::plane1);
+		keyer_shader_->set("chroma_mode",	chroma_mode);
+		keyer_shader_->set("chroma_blend",	chroma.threshold, chroma.softness);
+		keyer_shader_->set("chroma_spill",	chroma.spill);
+		keyer_shader_->set("show_mask",		chroma.show_mask);
+		keyer_shader_->set("radius",		radius);
+		keyer_shader_->set("sigma",			std::max(sigma, 0.5f));
+		keyer_shader_->set("bounds",		half.x + 0.5f, half.y + 0.5f, half.x + half.width - 0.5f, half.y + half.height - 0.5f);
+
+		source->bind(texture_id::plane0);
+		draw_keyer_pass(0, *matte, half);
+
+		if(radius > 0)
+		{
+			matte->bind(texture_id::plane1);
+			draw_keyer_pass(1, *blurred, half);
+			blurred->bind(texture_id::plane1);
+			draw_keyer_pass(2, *matte, half);
+		}
+
+		matte->bind(texture_id::plane1);
+		draw_keyer_pass(3, *target, full);
+
+		if (!blend_modes_)
+			ogl_->enable(GL_BLEND);
+	}
+
+	void draw_keyer_pass(int pass, device_buffer& target, const region& area)
+	{
+		ogl_->attach(target);
+		keyer_shader_->set("pass", pass);
+
+		ogl_->viewport(0, 0, target.width(), target.height());
+		ogl_->enable(GL_SCISSOR_TEST);
+		ogl_->scissor(area.x, area.y, area.width, area.height);
+
+		glBegin(GL_QUADS);
+			glVertex2d(-1.0, -1.0);
+			glVertex2d( 1.0, -1.0);
+			glVertex2d( 1.0,  1.0);
+			glVertex2d(-1.0,  1.0);
+		glEnd();
+		++draw_calls_;
+
+		ogl_->disable(GL_SCISSOR_TEST);
+	}
+
+	void draw_packing(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, output_packing::type packing, bool key_only, bool interleave = false, bool interlaced = false, output_split::type split = output_split::none, bool scale = false, field_mode::type field = field_mode::progressive)
+	{
+		if (!blend_modes_)
+			ogl_->disable(GL_BLEND);
+
+		ogl_->disable(GL_POLYGON_STIPPLE);
+
+		ogl_->attach(*target);
+
+		source->bind(texture_id::background);
+
+		ogl_->use(*packing_shader_);
+		packing_shader_->set("background", texture_id::background);
+		packing_shader_->set("packing", static_cast<int>(packing));
+		packing_shader_->set("is_hd", source->height() > 700);
+		packing_shader_->set("key_only", key_only);
+		packing_shader_->set("interleave", interleave);
+		packing_shader_->set("interlaced", interlaced);
+		packing_shader_->set("split", static_cast<int>(split));
+		packing_shader_->set("lower", texture_id::plane0);
+		packing_shader_->set("scale", scale);
+		packing_shader_->set("field", static_cast<int>(field));
+		packing_shader_->set("target_width", static_cast<int>(target->width()));
+		packing_shader_->set("target_height", static_cast<int>(target->height()));
+
+		ogl_->viewport(0, 0, target->width(), target->height());
+
+		glBegin(GL_QUADS);
+			glVertex2d(-1.0, -1.0);
+			glVertex2d( 1.0, -1.0);
+			glVertex2d( 1.0,  1.0);
+			glVertex2d(-1.0,  1.0);
+		glEnd();
+		++draw_calls_;
+
+		if (!blend_modes_)
+			ogl_->enable(GL_BLEND);
+	}
 };
 
 image_kernel::image_kernel(const safe_ptr<ogl_device>& ogl) : impl_(new implementation(ogl)){}
+int64_t image_kernel::draw_calls() const{return impl_->draw_calls_;}
 void image_kernel::draw(draw_params&& params)
 {
 	impl_->draw(std::move(params));
@@ -309,4 +798,34 @@ void image_kernel::post_process(
 	impl_->post_process(background, straighten_alpha);
 }
 
+void image_kernel::pack(
+		const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, output_packing::type packing, bool interlaced, output_split::type split)
+{
+	impl_->pack(source, target, packing, interlaced, split);
+}
+
+void image_kernel::extract_key(
+		const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target)
+{
+	impl_->extract_key(source, target);
+}
+
+void image_kernel::interleave(
+		const safe_ptr<device_buffer>& upper, const safe_ptr<device_buffer>& lower, const safe_ptr<device_buffer>& target)
+{
+	impl_->interleave(upper, lower, target);
+}
+
+void image_kernel::scale(
+		const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, field_mode::type field)
+{
+	impl_->scale(source, target, field);
+}
+
+void image_kernel::chroma_key(
+		const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, const chroma& chroma, const region& area)
+{
+	impl_->chroma_key(source, target, chroma, area);
+}
+
 }}
@@ -25,11 +25,14 @@
 
 #include <common/memory/safe_ptr.h>
 
+#include <core/mixer/output_packing.h>
 #include <core/producer/frame/pixel_format.h>
 #include <core/producer/frame/frame_transform.h>
 
 #include <boost/noncopyable.hpp>
 
+#include <limits>
+
 namespace caspar { namespace core {
 	
 class device_buffer;
@@ -44,20 +47,72 @@ struct keyer
 	};
 };
 
+// Screen-space rectangle in pixels, with the origin in the lower left corner (same as glScissor).
+struct region
+{
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+
+	region() 
+		: x(0)
+		, y(0)
+		, width(0)
+		, height(0)
+	{
+	}
+
+	region(uint32_t x, uint32_t y, uint32_t width, uint32_t height) 
+		: x(x)
+		, y(y)
+		, width(width)
+		, height(height)
+	{
+	}
+
+	bool empty() const
+	{
+		return width == 0 || height == 0;
+	}
+
+	static region unbounded()
+	{
+		return region(0, 0, std::numeric_limits<uint32_t>::max(), std::numeric_limits<uint32_t>::max());
+	}
+};
+
+region merge(const region& lhs, const region& rhs);
+region intersect(const region& lhs, const region& rhs);
+
+// The area of a target with the given size which can be touched when drawing with the transform.
+region get_region(const frame_transform& transform, uint32_t width, uint32_t height);
+
 struct draw_params
 {
 	pixel_format_desc						pix_desc;
 	std::vector<safe_ptr<device_buffer>>	textures;
+	texture_rect							texture_rect; // Of the image in the textures.
 	frame_transform							transform;
 	blend_mode								blend_mode;
 	keyer::type								keyer;
 	std::shared_ptr<device_buffer>			background;
 	std::shared_ptr<device_buffer>			local_key;
 	std::shared_ptr<device_buffer>			layer_key;
+	region									scissor;
+	field_mode::type						target_field; // The field held by a half height background.
+	uint32_t								color; // bgra, pixel_format::color only.
+	field_mode::type						deinterlace_field; // The field of the textures which is kept, progressive when not deinterlacing.
+	std::vector<safe_ptr<device_buffer>>	before_textures; // Temporal neighbours for deinterlacing, may be empty.
+	std::vector<safe_ptr<device_buffer>>	after_textures;
 
 	draw_params() 
 		: blend_mode(blend_mode::normal)
 		, keyer(keyer::linear)
+		, scissor(region::unbounded())
+		, target_field(field_mode::progressive)
+		, color(0)
+		, deinterlace_field(field_mode::progressive)
 	{
 	}
 };
@@ -69,6 +124,32 @@ public:
 	void draw(draw_params&& params);
 	void post_process(
 			const safe_ptr<device_buffer>& background, bool straighten_alpha);
+
+	// Converts the source into the packed format, the target is sized by get_packed_row_bytes / 4 and get_packed_rows.
+	// Interlaced sources keep the 4:2:0 chroma of each field apart.
+	void pack(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, output_packing::type packing, bool interlaced = false, output_split::type split = output_split::none);
+
+	// Broadcasts the alpha of the source into all channels of the target, which has the same size.
+	void extract_key(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target);
+
+	// Interleaves the half height upper and lower fields into the target.
+	void interleave(
+			const safe_ptr<device_buffer>& upper, const safe_ptr<device_buffer>& lower, const safe_ptr<device_buffer>& target);
+
+	// Scales the source into the target by averaging the covered area. Unless progressive, the target is the
+	// given field of a frame twice its height.
+	void scale(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, field_mode::type field);
+
+	// Keys the source into the target of the same size, within the area. The matte is computed at half resolution 
+	// and given a separable blur of chroma.blur pixels, spill is suppressed where it is applied.
+	void chroma_key(
+			const safe_ptr<device_buffer>& source, const safe_ptr<device_buffer>& target, const chroma& chroma, const region& area);
+
+	// Draws and clears submitted since construction, only to be read by the ogl thread.
+	int64_t draw_calls() const;
 private:
 	struct implementation;
 	safe_ptr<implementation> impl_;
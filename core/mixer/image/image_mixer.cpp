@@ -24,15 +24,24 @@
 #include "image_mixer.h"
 
 #include "image_kernel.h"
+#include "color_lut.h"
+#include "image_item.h"
+#include "cpu_image_renderer.h"
+#include "shader/image_shader.h"
 #include "../write_frame.h"
+#include "../../producer/frame/color_frame.h"
 #include "../gpu/ogl_device.h"
 #include "../gpu/host_buffer.h"
 #include "../gpu/device_buffer.h"
 
+#include <common/diagnostics/graph.h>
+#include <common/diagnostics/trace.h>
+#include <common/env.h>
 #include <common/exception/exceptions.h>
 #include <common/gl/gl_check.h>
 #include <common/utility/move_on_copy.h>
 
+#include <core/load_governor.h>
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/pixel_format.h>
 #include <core/video_format.h>
@@ -42,51 +51,444 @@
 #include <boost/foreach.hpp>
 #include <boost/range/algorithm_ext/erase.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <deque>
+#include <map>
+#include <memory>
 
 using namespace boost::assign;
 
 namespace caspar { namespace core {
 	
-struct item
+struct layer_regions
+{
+	region layer;
+	region local_key;
+	region local_mix;
+	region layer_key;
+};
+
+// Whether the item, once drawn, completely replaces whatever is below it in the given field.
+bool is_occluder(const item& item, field_mode::type field)
+{
+	static const double epsilon = 0.001;
+
+	const auto& transform = item.transform;
+
+	if(transform.is_key || transform.is_mix || !is_opaque(item.pix_desc))
+		return false;
+
+	if(transform.opacity < 1.0-epsilon || transform.field_mode != field)
+		return false;
+
+	if(transform.is_paused && transform.field_mode == field_mode::upper) // Viewport is offset by one line.
+		return false;
+
+	for(int n = 0; n < 2; ++n)
+	{
+		if(transform.fill_translation[n] > epsilon || transform.fill_translation[n] + transform.fill_scale[n] < 1.0-epsilon)
+			return false;
+		if(transform.clip_translation[n] > epsilon || transform.clip_translation[n] + transform.clip_scale[n] < 1.0-epsilon)
+			return false;
+	}
+
+	return true;
+}
+
+// Whether the layer leaves a key behind which is applied to the layer above it.
+bool has_layer_key(const layer& layer)
+{
+	BOOST_REVERSE_FOREACH(auto& item, layer.second)
+	{
+		if(item.transform.field_mode == field_mode::empty)
+			continue;
+		return item.transform.is_key;
+	}
+	return false;
+}
+
+// Whether the layer reaches the background in a single draw, which can then blend and chroma key it directly 
+// instead of compositing the layer in a buffer of its own first. Keying the item rather than the composite is 
+// only the same when the item is not adjusted.
+bool is_single_draw(const layer& layer)
+{
+	static const double epsilon = 0.001;
+
+	int  draws	= 0;
+	bool mix	= false;
+	BOOST_FOREACH(auto& item, layer.second)
+	{
+		const auto& transform = item.transform;
+
+		if(transform.is_key)
+			continue;
+
+		if(transform.is_mix)
+		{
+			draws += mix ? 0 : 1; // Mixed items are composited together.
+			mix = true;
+			continue;
+		}
+
+		++draws;
+
+		if(layer.first.chroma.key != chroma::none)
+		{
+			if(!is_color_neutral(transform) || transform.opacity < 1.0-epsilon)
+				return false;
+		}
+	}
+	return draws <= 1;
+}
+
+// Identifies what a layer draws, layers with equal fingerprints in consecutive frames draw the same image.
+struct layer_fingerprint
+{
+	struct item_fingerprint
+	{
+		pixel_format::type								pix_fmt;
+		std::vector<std::pair<const device_buffer*, int64_t>>	textures;
+		texture_rect									texture_rect;
+		frame_transform									transform;
+		uint32_t										color;
+		field_mode::type								deinterlace_field;
+	};
+
+	blend_mode						blend;
+	std::vector<item_fingerprint>	items;
+
+	layer_fingerprint(const layer& layer)
+		: blend(layer.first)
+	{
+		BOOST_FOREACH(auto& item, layer.second)
+		{
+			item_fingerprint fingerprint;
+			fingerprint.pix_fmt		= item.pix_desc.pix_fmt;
+			fingerprint.texture_rect = item.texture_rect;
+			fingerprint.transform	= item.transform;
+			fingerprint.color		= item.color;
+			fingerprint.deinterlace_field = item.deinterlace_field;
+			BOOST_FOREACH(auto& texture, item.textures)
+				fingerprint.textures.push_back(std::make_pair(texture.get(), texture->generation()));
+			BOOST_FOREACH(auto& texture, item.before_textures)
+				fingerprint.textures.push_back(std::make_pair(texture.get(), texture->generation()));
+			BOOST_FOREACH(auto& texture, item.after_textures)
+				fingerprint.textures.push_back(std::make_pair(texture.get(), texture->generation()));
+			items.push_back(std::move(fingerprint));
+		}
+	}
+
+	bool operator==(const layer_fingerprint& other) const
+	{
+		if(blend.mode				!= other.blend.mode				||
+		   blend.chroma.key			!= other.blend.chroma.key		||
+		   blend.chroma.threshold	!= other.blend.chroma.threshold	||
+		   blend.chroma.softness	!= other.blend.chroma.softness	||
+		   blend.chroma.spill		!= other.blend.chroma.spill		||
+		   blend.chroma.blur		!= other.blend.chroma.blur		||
+		   blend.chroma.show_mask	!= other.blend.chroma.show_mask	||
+		   items.size()				!= other.items.size())
+			return false;
+
+		for(std::size_t n = 0; n < items.size(); ++n)
+		{
+			if(items[n].pix_fmt	  != other.items[n].pix_fmt		||
+			   items[n].textures  != other.items[n].textures	||
+			   items[n].texture_rect != other.items[n].texture_rect ||
+			   items[n].transform != other.items[n].transform	||
+			   items[n].color	  != other.items[n].color		||
+			   items[n].deinterlace_field != other.items[n].deinterlace_field)
+				return false;
+		}
+
+		return true;
+	}
+};
+
+std::size_t common_prefix(const std::vector<layer_fingerprint>& lhs, const std::vector<layer_fingerprint>& rhs)
+{
+	std::size_t count = 0;
+	while(count < lhs.size() && count < rhs.size() && lhs[count] == rhs[count])
+		++count;
+	return count;
+}
+
+// The composite of the bottom layers which did not change since the previous frame.
+struct static_layer_cache
 {
-	pixel_format_desc						pix_desc;
-	std::vector<safe_ptr<device_buffer>>	textures;
-	frame_transform							transform;
+	std::vector<layer_fingerprint>	previous;
+	std::vector<layer_fingerprint>	cached;
+	std::shared_ptr<device_buffer>	buffer;
 };
 
-typedef std::pair<blend_mode, std::vector<item>> layer;
+// GL_TIMESTAMP queries marking the end of each pass of a frame. They are read a few frames later, once available, 
+// so that timing never stalls the pipeline.
+class pass_timer : boost::noncopyable
+{
+public:
+	enum pass
+	{
+		draw,
+		key,
+		post,
+		output
+	};
+private:
+	struct mark
+	{
+		GLuint	query;
+		pass	what;
+		int		layer;
+	};
+
+	const bool						enabled_;
+	std::vector<GLuint>				free_queries_;
+	std::vector<mark>				current_;
+	std::deque<std::vector<mark>>	pending_;
+	tbb::spin_mutex					mutex_;
+	gpu_times						last_;
+public:
+	pass_timer()
+		: enabled_(GLEW_ARB_timer_query && env::properties().get(L"configuration.mixer.gpu-timers", true))
+	{
+	}
+
+	void release()
+	{
+		BOOST_FOREACH(auto& marks, pending_)
+			recycle(marks);
+		recycle(current_);
+		pending_.clear();
+
+		if(!free_queries_.empty())
+			glDeleteQueries(static_cast<GLsizei>(free_queries_.size()), free_queries_.data());
+		free_queries_.clear();
+	}
+
+	void begin_frame()
+	{
+		if(!enabled_)
+			return;
+
+		collect();
+		current_.clear();
+		add_mark(draw, -1);
+	}
+
+	// Marks the end of work of the given kind, which is the time since the previous mark.
+	void add_mark(pass what, int layer = -1)
+	{
+		if(!enabled_)
+			return;
+
+		if(free_queries_.empty())
+		{
+			free_queries_.resize(16);
+			glGenQueries(static_cast<GLsizei>(free_queries_.size()), free_queries_.data());
+		}
+
+		mark m = {free_queries_.back(), what, layer};
+		free_queries_.pop_back();
+
+		glQueryCounter(m.query, GL_TIMESTAMP);
+		current_.push_back(m);
+	}
+
+	void end_frame()
+	{
+		if(!enabled_ || current_.empty())
+			return;
+
+		pending_.push_back(std::move(current_));
+		current_ = std::vector<mark>();
+
+		// Results which are still not in after this many frames are dropped.
+		while(pending_.size() > 8)
+		{
+			recycle(pending_.front());
+			pending_.pop_front();
+		}
+	}
+
+	gpu_times last() 
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		return last_;
+	}
+private:
+	void collect()
+	{
+		while(!pending_.empty())
+		{
+			auto& marks = pending_.front();
+
+			GLint available = 0;
+			glGetQueryObjectiv(marks.back().query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(!available)
+				return;
+
+			gpu_times times;
+			GLuint64 previous = 0;
+			for(std::size_t n = 0; n < marks.size(); ++n)
+			{
+				GLuint64 timestamp = 0;
+				glGetQueryObjectui64v(marks[n].query, GL_QUERY_RESULT, &timestamp);
+
+				if(n > 0)
+				{
+					double elapsed = static_cast<double>(timestamp - previous) / 1000000000.0;
+					switch(marks[n].what)
+					{
+					case draw:		times.draw	 += elapsed; break;
+					case key:		times.key	 += elapsed; times.draw += elapsed; break;
+					case post:		times.post	 += elapsed; break;
+					case output:	times.output += elapsed; break;
+					}
+
+					if(marks[n].layer >= 0)
+					{
+						if(times.layers.size() <= static_cast<std::size_t>(marks[n].layer))
+							times.layers.resize(marks[n].layer + 1, 0.0);
+						times.layers[marks[n].layer] += elapsed;
+					}
+				}
+				previous = timestamp;
+			}
+
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				last_ = std::move(times);
+			}
+
+			recycle(marks);
+			pending_.pop_front();
+		}
+	}
+
+	void recycle(std::vector<mark>& marks)
+	{
+		BOOST_FOREACH(auto& m, marks)
+			free_queries_.push_back(m.query);
+		marks.clear();
+	}
+};
 
 class image_renderer
 {
 	safe_ptr<ogl_device>			ogl_;
+	safe_ptr<diagnostics::graph>	graph_;
 	image_kernel					kernel_;	
 	std::shared_ptr<device_buffer>	transferring_buffer_;
+	std::shared_ptr<device_buffer>	transferring_packed_buffer_;
+	std::shared_ptr<device_buffer>	transferring_key_buffer_;
+	std::vector<safe_ptr<device_buffer>> transferring_raster_buffers_;
+	std::map<int, std::shared_ptr<device_buffer>> raster_fields_; // First fields of interlaced rasters.
+	tbb::atomic<int>				culled_count_;
+	const bool						use_static_cache_;
+	std::array<static_layer_cache, 2> static_caches_; // Progressive or upper, and lower field.
+	tbb::atomic<int>				static_count_;
+	tbb::atomic<bool>				static_frozen_; // Under load, the cache is drawn as it is but not rendered again.
+	tbb::atomic<int>				draw_calls_;
+	tbb::atomic<bool>				background_; // Renders wait for the channels' on the ogl device.
+	int64_t							render_count_;
+	int								current_layer_; // Being drawn, for the pass timer, -1 for cached layers.
+	pass_timer						pass_timer_;
 public:
-	image_renderer(const safe_ptr<ogl_device>& ogl)
+	image_renderer(const safe_ptr<ogl_device>& ogl, const safe_ptr<diagnostics::graph>& graph)
 		: ogl_(ogl)
+		, graph_(graph)
 		, kernel_(ogl_)
+		, use_static_cache_(env::properties().get(L"configuration.mixer.static-layer-cache", true))
+		, render_count_(0)
+		, current_layer_(-1)
+	{
+		culled_count_ = 0;
+		static_count_ = 0;
+		static_frozen_ = false;
+		draw_calls_ = 0;
+		background_ = false;
+		graph_->set_color("culled-items", diagnostics::color(0.5f, 0.5f, 0.5f));
+	}
+
+	~image_renderer()
+	{
+		ogl_->invoke([this]
+		{
+			pass_timer_.release();
+		});
+	}
+
+	int culled_count() const
+	{
+		return culled_count_;
+	}
+
+	gpu_times last_gpu_times()
+	{
+		return pass_timer_.last();
+	}
+
+	int static_count() const
+	{
+		return static_count_;
+	}
+
+	int draw_calls() const
+	{
+		return draw_calls_;
+	}
+
+	void set_static_frozen(bool value)
 	{
+		static_frozen_ = value;
+	}
+
+	void set_background(bool value)
+	{
+		background_ = value;
 	}
 	
-	boost::unique_future<safe_ptr<host_buffer>> operator()(
+	boost::unique_future<rendered_image> operator()(
 			std::vector<layer>&& layers,
 			const video_format_desc& format_desc,
-			bool straighten_alpha)
+			bool straighten_alpha,
+			output_packing::type packing,
+			bool key,
+			output_split::type split,
+			int usage,
+			const std::vector<raster_pass>& rasters)
 	{		
 		auto layers2 = make_move_on_copy(std::move(layers));
 		return ogl_->begin_invoke([=]
 		{
 			return do_render(
-					std::move(layers2.value), format_desc, straighten_alpha);
-		});
+					std::move(layers2.value), format_desc, straighten_alpha, packing, key, split, usage, rasters);
+		}, background_ ? low_priority : normal_priority);
 	}
 
 private:
-	safe_ptr<host_buffer> do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha)
+	rendered_image do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha, output_packing::type packing, bool key, output_split::type split, int usage, const std::vector<raster_pass>& rasters)
 	{
-		auto draw_buffer = create_mixer_buffer(4, format_desc);
+		diagnostics::trace::scope trace("image_mixer.render", ++render_count_);
+
+		pass_timer_.begin_frame();
+
+		ogl_->sync_uploads();
+
+		auto first_draw_call = kernel_.draw_calls();
+
+		auto draw_buffer = ogl_->create_device_buffer(format_desc.width, format_desc.height, 4);
+
+		int item_count = 0;
+		BOOST_FOREACH(auto& layer, layers)
+			item_count += static_cast<int>(layer.second.size());
+
+		int culled_count = 0;
 
 		if(format_desc.field_mode != field_mode::progressive)
 		{
@@ -105,70 +507,346 @@ private:
 					item.transform.field_mode = static_cast<field_mode::type>(item.transform.field_mode & field_mode::lower);
 			}
 
-			draw(std::move(upper), draw_buffer, format_desc);
-			draw(std::move(lower), draw_buffer, format_desc);
+			culled_count += cull(upper, field_mode::upper);
+			culled_count += cull(lower, field_mode::lower);
+
+			// Each field is drawn into a half height buffer of its own, instead of drawing full frames twice with
+			// every other line masked out, and the two are interleaved afterwards.
+			auto field_desc = format_desc;
+			field_desc.height /= 2;
+
+			auto upper_buffer = create_mixer_buffer(4, field_desc);
+			auto lower_buffer = create_mixer_buffer(4, field_desc);
+
+			draw(std::move(upper), upper_buffer, field_desc, field_mode::upper);
+			draw(std::move(lower), lower_buffer, field_desc, field_mode::lower);
+
+			kernel_.interleave(upper_buffer, lower_buffer, draw_buffer);
+			pass_timer_.add_mark(pass_timer::draw);
+
+			item_count *= 2;
 		}
 		else
 		{
-			draw(std::move(layers), draw_buffer, format_desc);
+			culled_count += cull(layers, field_mode::progressive);
+
+			ogl_->clear(*draw_buffer);
+			draw(std::move(layers), draw_buffer, format_desc, field_mode::progressive);
 		}
 
+		culled_count_ = culled_count;
+		graph_->set_value("culled-items", static_cast<double>(culled_count)/static_cast<double>(std::max(1, item_count)));
+
 		kernel_.post_process(draw_buffer, straighten_alpha);
+		pass_timer_.add_mark(pass_timer::post);
+
+		rendered_image result;
+
+		if(usage & image_usage::host)
+			result.image = read_back(draw_buffer, format_desc.size);
+
+		if(usage & image_usage::texture)
+		{
+			// Sampled by the consumers in contexts of their own, held by the read_frame until they are done.
+			draw_buffer->end_write();
+			result.texture = draw_buffer;
+		}
+
+		if(packing != output_packing::none)
+		{
+			if(!supports_split(packing))
+				split = output_split::none;
+
+			// Split sub-images are stacked in one buffer, so that all four come back in a single transfer.
+			auto packed_buffer = split == output_split::none
+				? ogl_->create_device_buffer(get_packed_row_bytes(packing, format_desc.width)/4, get_packed_rows(packing, format_desc.height), 4)
+				: ogl_->create_device_buffer(get_packed_row_bytes(packing, format_desc.width/2)/4, 4*get_packed_rows(packing, format_desc.height/2), 4);
+			kernel_.pack(draw_buffer, packed_buffer, packing, format_desc.field_mode != field_mode::progressive, split);
+
+			result.packed_image = read_back(packed_buffer, get_packed_size(packing, format_desc.width, format_desc.height, split));
+			result.packing		= packing;
+			result.split		= split;
+
+			transferring_packed_buffer_ = std::move(packed_buffer);
+		}
+		else
+			transferring_packed_buffer_.reset();
+
+		if(key)
+		{
+			auto key_buffer = ogl_->create_device_buffer(format_desc.width, format_desc.height, 4);
+			kernel_.extract_key(draw_buffer, key_buffer);
+
+			result.key_image = read_back(key_buffer, format_desc.size);
+
+			transferring_key_buffer_ = std::move(key_buffer);
+		}
+		else
+			transferring_key_buffer_.reset();
 
-		auto host_buffer = ogl_->create_host_buffer(format_desc.size, read_only);
-		ogl_->attach(*draw_buffer);
-		ogl_->read_buffer(*draw_buffer);
-		host_buffer->begin_read(draw_buffer->width(), draw_buffer->height(), format(draw_buffer->stride()));
+		transferring_raster_buffers_.clear();
+		BOOST_FOREACH(auto& pass, rasters)
+			render_raster(draw_buffer, pass, result);
 		
 		transferring_buffer_ = std::move(draw_buffer);
 
+		pass_timer_.add_mark(pass_timer::output);
+		pass_timer_.end_frame();
+
+		draw_calls_ = static_cast<int>(kernel_.draw_calls() - first_draw_call);
+
 		ogl_->flush(); // NOTE: This is important, otherwise fences will deadlock.
 			
+		return result;
+	}
+
+	// Progressive rasters are scaled from every frame they are rendered for. Interlaced rasters take the fields
+	// from two consecutive frames, the first is held until the frame with the second.
+	void render_raster(const safe_ptr<device_buffer>& source, const raster_pass& pass, rendered_image& result)
+	{
+		auto target = ogl_->create_device_buffer(pass.width, pass.height, 4);
+
+		if(pass.field == field_mode::progressive)
+			kernel_.scale(source, target, field_mode::progressive);
+		else
+		{
+			auto field = ogl_->create_device_buffer(pass.width, pass.height/2, 4);
+			kernel_.scale(source, field, pass.field);
+
+			if(!pass.complete)
+			{
+				raster_fields_[pass.index] = field;
+				return;
+			}
+
+			auto first = raster_fields_.find(pass.index);
+			if(first == raster_fields_.end()) // The first field was not drawn, the raster was just requested.
+				return;
+
+			if(pass.field == field_mode::lower)
+				kernel_.interleave(make_safe_ptr(first->second), field, target);
+			else
+				kernel_.interleave(field, make_safe_ptr(first->second), target);
+
+			transferring_raster_buffers_.push_back(make_safe_ptr(first->second));
+			raster_fields_.erase(first);
+		}
+
+		result.rasters.push_back(std::make_pair(pass.index, read_back(target, pass.width*pass.height*4)));
+		transferring_raster_buffers_.push_back(target);
+	}
+
+	safe_ptr<host_buffer> read_back(const safe_ptr<device_buffer>& source, uint32_t size)
+	{
+		auto host_buffer = ogl_->create_host_buffer(size, read_only);
+		ogl_->attach(*source);
+		ogl_->read_buffer(*source);
+		host_buffer->begin_read(source->width(), source->height(), format(source->stride()));
 		return host_buffer;
 	}
 
+	// Removes everything below the top-most item which is opaque and covers the whole field, 
+	// since it cannot affect the output. Returns the number of removed items.
+	int cull(std::vector<layer>& layers, field_mode::type field)
+	{
+		for(int n = static_cast<int>(layers.size())-1; n >= 0; --n)
+		{
+			auto& layer = layers[n];
+
+			if(layer.first.mode != blend_mode::normal || layer.first.chroma.key != chroma::none)
+				continue;
+
+			if(n > 0 && has_layer_key(layers[n-1]))
+				continue;
+
+			auto& items = layer.second;
+			for(int m = static_cast<int>(items.size())-1; m >= 0; --m)
+			{
+				if(!is_occluder(items[m], field))
+					continue;
+
+				if(m > 0 && items[m-1].transform.is_key) // Local key is applied to the item.
+					continue;
+
+				int count = m;
+				for(int k = 0; k < n; ++k)
+					count += static_cast<int>(layers[k].second.size());
+
+				items.erase(items.begin(), items.begin() + m);
+				layers.erase(layers.begin(), layers.begin() + n);
+
+				return count;
+			}
+		}
+
+		return 0;
+	}
+
 	void draw(std::vector<layer>&&		layers, 
 			  safe_ptr<device_buffer>&	draw_buffer, 
-			  const video_format_desc& format_desc)
+			  const video_format_desc&	format_desc,
+			  field_mode::type			field)
 	{
+		auto first = draw_static_layers(layers, draw_buffer, format_desc, field);
+		pass_timer_.add_mark(pass_timer::draw);
+
 		std::shared_ptr<device_buffer> layer_key_buffer;
+		region						   layer_key_region;
 
-		BOOST_FOREACH(auto& layer, layers)
-			draw_layer(std::move(layer), draw_buffer, layer_key_buffer, format_desc);
+		for(std::size_t n = first; n < layers.size(); ++n)
+		{
+			current_layer_ = static_cast<int>(n);
+			draw_layer(std::move(layers[n]), draw_buffer, layer_key_buffer, layer_key_region, format_desc, field);
+			pass_timer_.add_mark(pass_timer::draw, current_layer_);
+		}
+		current_layer_ = -1;
+	}
+
+	// Draws the bottom layers which did not change since the previous frame from the cache, where they are 
+	// composited once. Returns the number of layers drawn.
+	std::size_t draw_static_layers(std::vector<layer>&		layers, 
+								   safe_ptr<device_buffer>&	draw_buffer, 
+								   const video_format_desc&	format_desc,
+								   field_mode::type			field)
+	{
+		if(!use_static_cache_)
+			return 0;
+
+		auto& cache = static_caches_[field == field_mode::lower ? 1 : 0];
+
+		std::vector<layer_fingerprint> fingerprints(layers.begin(), layers.end());
+
+		auto count = common_prefix(fingerprints, cache.previous);
+
+		// The layer above the cached ones cannot be keyed by them.
+		while(count > 0 && has_layer_key(layers[count-1]))
+			--count;
+
+		cache.previous = fingerprints;
+
+		// Drawing a single layer from the cache is no cheaper than drawing it.
+		if(count < 2)
+		{
+			cache.cached.clear();
+			cache.buffer.reset();
+			static_count_ = 0;
+			return 0;
+		}
+
+		bool valid = cache.buffer												&& 
+					 cache.buffer->width()  == draw_buffer->width()				&&
+					 cache.buffer->height() == draw_buffer->height()			&&
+					 cache.cached.size() <= count								&&
+					 common_prefix(fingerprints, cache.cached) == cache.cached.size();
+
+		// Re-rendering costs a pass more than drawing the layers, so under load the layers are drawn directly until
+		// the cache has become valid again or the load goes down.
+		if(!valid && static_frozen_)
+		{
+			static_count_ = 0;
+			return 0;
+		}
+
+		if(!valid)
+		{
+			cache.cached.clear();
+			cache.buffer = create_mixer_buffer(4, format_desc);
+		}
+
+		if(static_frozen_)
+			count = std::min(count, cache.cached.size());
+
+		// Layers which have become static are added on top of the ones already cached.
+		if(cache.cached.size() < count)
+		{
+			auto cache_buffer = make_safe_ptr(cache.buffer);
+
+			std::shared_ptr<device_buffer> layer_key_buffer;
+			region						   layer_key_region;
+		
+			for(std::size_t n = cache.cached.size(); n < count; ++n)
+				draw_layer(std::move(layers[n]), cache_buffer, layer_key_buffer, layer_key_region, format_desc, field);
+
+			cache.cached.assign(fingerprints.begin(), fingerprints.begin() + count);
+		}
+
+		draw_mixer_buffer(draw_buffer, std::shared_ptr<device_buffer>(cache.buffer), region::unbounded(), blend_mode::normal);
+
+		static_count_ = static_cast<int>(count);
+
+		return count;
 	}
 
 	void draw_layer(layer&&							layer, 
 					safe_ptr<device_buffer>&		draw_buffer,
 					std::shared_ptr<device_buffer>& layer_key_buffer,
-					const video_format_desc&		format_desc)
+					region&							layer_key_region,
+					const video_format_desc&		format_desc,
+					field_mode::type				field)
 	{				
 		boost::remove_erase_if(layer.second, [](const item& item){return item.transform.field_mode == field_mode::empty;});
 
 		if(layer.second.empty())
 			return;
 
+		// Intermediate buffers are only cleared, and composited, where the items of the layer can touch them.
+
+		layer_regions regions;
+		regions.layer_key = layer_key_region;
+
+		BOOST_FOREACH(auto& item, layer.second)
+		{
+			auto item_region = get_region(item.transform, format_desc.width, format_desc.height);
+
+			if(item.transform.is_key)
+				regions.local_key = merge(regions.local_key, item_region);
+			else
+			{
+				regions.layer = merge(regions.layer, item_region);
+				if(item.transform.is_mix)
+					regions.local_mix = merge(regions.local_mix, item_region);
+			}
+		}
+
 		std::shared_ptr<device_buffer> local_key_buffer;
 		std::shared_ptr<device_buffer> local_mix_buffer;
 				
-		if(layer.first.mode != blend_mode::normal || layer.first.chroma.key != chroma::none)
+		bool blended = layer.first.mode != blend_mode::normal || layer.first.chroma.key != chroma::none;
+		bool keyed	 = layer.first.chroma.key != chroma::none && (layer.first.chroma.blur > 0.0f || layer.first.chroma.show_mask);
+
+		if(blended && (keyed || !is_single_draw(layer)))
 		{
-			auto layer_draw_buffer = create_mixer_buffer(4, format_desc);
+			auto layer_draw_buffer = create_mixer_buffer(4, format_desc, regions.layer);
 
 			BOOST_FOREACH(auto& item, layer.second)
-				draw_item(std::move(item), layer_draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);	
+				draw_item(std::move(item), layer_draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, regions, format_desc, field, blend_mode::normal);	
 		
-			draw_mixer_buffer(layer_draw_buffer, std::move(local_mix_buffer), blend_mode::normal);							
-			draw_mixer_buffer(draw_buffer, std::move(layer_draw_buffer), layer.first);
+			draw_mixer_buffer(layer_draw_buffer, std::move(local_mix_buffer), regions.local_mix, blend_mode::normal);							
+
+			if(keyed)
+			{
+				// Edge blur needs the neighbours of each pixel, which only a separate stage over the layer can sample.
+				auto keyed_buffer = ogl_->create_device_buffer(format_desc.width, format_desc.height, 4);
+				pass_timer_.add_mark(pass_timer::draw, current_layer_);
+				kernel_.chroma_key(layer_draw_buffer, keyed_buffer, layer.first.chroma, regions.layer);
+				pass_timer_.add_mark(pass_timer::key, current_layer_);
+
+				auto mode = blend_mode(layer.first.mode);
+				draw_mixer_buffer(draw_buffer, std::move(keyed_buffer), regions.layer, mode);
+			}
+			else
+				draw_mixer_buffer(draw_buffer, std::move(layer_draw_buffer), regions.layer, layer.first);
 		}
-		else // fast path
+		else // fast path, blended layers are blended by their single draw.
 		{
 			BOOST_FOREACH(auto& item, layer.second)		
-				draw_item(std::move(item), draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);		
+				draw_item(std::move(item), draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, regions, format_desc, field, layer.first);		
 					
-			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), layer.first);
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), regions.local_mix, layer.first);
 		}					
 
 		layer_key_buffer = std::move(local_key_buffer);
+		layer_key_region = regions.local_key;
 	}
 
 	void draw_item(item&&							item, 
@@ -176,16 +854,25 @@ private:
 				   std::shared_ptr<device_buffer>&	layer_key_buffer, 
 				   std::shared_ptr<device_buffer>&	local_key_buffer, 
 				   std::shared_ptr<device_buffer>&	local_mix_buffer,
-				   const video_format_desc&			format_desc)
+				   const layer_regions&				regions,
+				   const video_format_desc&			format_desc,
+				   field_mode::type					field,
+				   blend_mode						blend)
 	{			
 		draw_params draw_params;
 		draw_params.pix_desc				= std::move(item.pix_desc);
 		draw_params.textures				= std::move(item.textures);
+		draw_params.texture_rect			= item.texture_rect;
 		draw_params.transform				= std::move(item.transform);
+		draw_params.color					= item.color;
+		draw_params.target_field			= field;
+		draw_params.deinterlace_field		= item.deinterlace_field;
+		draw_params.before_textures			= std::move(item.before_textures);
+		draw_params.after_textures			= std::move(item.after_textures);
 
 		if(item.transform.is_key)
 		{
-			local_key_buffer = local_key_buffer ? local_key_buffer : create_mixer_buffer(1, format_desc);
+			local_key_buffer = local_key_buffer ? local_key_buffer : create_mixer_buffer(1, format_desc, regions.local_key);
 
 			draw_params.background			= local_key_buffer;
 			draw_params.local_key			= nullptr;
@@ -195,11 +882,12 @@ private:
 		}
 		else if(item.transform.is_mix)
 		{
-			local_mix_buffer = local_mix_buffer ? local_mix_buffer : create_mixer_buffer(4, format_desc);
+			local_mix_buffer = local_mix_buffer ? local_mix_buffer : create_mixer_buffer(4, format_desc, regions.local_mix);
 
 			draw_params.background			= local_mix_buffer;
 			draw_params.local_key			= std::move(local_key_buffer);
 			draw_params.layer_key			= layer_key_buffer;
+			draw_params.scissor				= key_scissor(draw_params, regions);
 
 			draw_params.keyer				= keyer::additive;
 
@@ -207,18 +895,35 @@ private:
 		}
 		else
 		{
-			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), blend_mode::normal);
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), regions.local_mix, blend_mode::normal);
 			
 			draw_params.background			= draw_buffer;
 			draw_params.local_key			= std::move(local_key_buffer);
 			draw_params.layer_key			= layer_key_buffer;
+			draw_params.scissor				= key_scissor(draw_params, regions);
+			draw_params.blend_mode			= blend;
 
 			kernel_.draw(std::move(draw_params));
 		}	
 	}
 
+	// Key buffers only hold valid data inside of their regions, everything outside is keyed out anyway.
+	region key_scissor(const draw_params& draw_params, const layer_regions& regions)
+	{
+		auto scissor = region::unbounded();
+
+		if(draw_params.local_key)
+			scissor = intersect(scissor, regions.local_key);
+
+		if(draw_params.layer_key)
+			scissor = intersect(scissor, regions.layer_key);
+
+		return scissor;
+	}
+
 	void draw_mixer_buffer(safe_ptr<device_buffer>&			draw_buffer, 
 						   std::shared_ptr<device_buffer>&& source_buffer, 
+						   const region&					source_region,
 						   blend_mode   			        blend_mode = blend_mode::normal)
 	{
 		if(!source_buffer)
@@ -231,6 +936,7 @@ private:
 		draw_params.transform			= frame_transform();
 		draw_params.blend_mode			= blend_mode;
 		draw_params.background			= draw_buffer;
+		draw_params.scissor				= source_region;
 
 		kernel_.draw(std::move(draw_params));
 	}
@@ -241,20 +947,34 @@ private:
 		ogl_->clear(*buffer);
 		return buffer;
 	}
+
+	safe_ptr<device_buffer> create_mixer_buffer(uint32_t stride, const video_format_desc& format_desc, const region& region)
+	{
+		auto buffer = ogl_->create_device_buffer(format_desc.width, format_desc.height, stride);
+		ogl_->enable(GL_SCISSOR_TEST);
+		ogl_->scissor(region.x, region.y, region.width, region.height);
+		ogl_->clear(*buffer);
+		ogl_->disable(GL_SCISSOR_TEST);
+		return buffer;
+	}
 };
 		
 struct image_mixer::implementation : boost::noncopyable
 {	
-	safe_ptr<ogl_device>			ogl_;
-	image_renderer					renderer_;
-	std::vector<frame_transform>	transform_stack_;
-	std::vector<layer>				layers_; // layer/stream/items
+	safe_ptr<ogl_device>				ogl_;
+	std::unique_ptr<image_renderer>		renderer_; // Null for a software device, which the cpu renderer draws for.
+	std::unique_ptr<cpu_image_renderer>	cpu_renderer_;
+	std::vector<frame_transform>		transform_stack_;
+	std::vector<layer>					layers_; // layer/stream/items
 public:
-	implementation(const safe_ptr<ogl_device>& ogl) 
+	implementation(const safe_ptr<ogl_device>& ogl, const safe_ptr<diagnostics::graph>& graph) 
 		: ogl_(ogl)
-		, renderer_(ogl)
 		, transform_stack_(1)	
 	{
+		if(ogl_->software())
+			cpu_renderer_.reset(new cpu_image_renderer(ogl));
+		else
+			renderer_.reset(new image_renderer(ogl, graph));
 	}
 
 	void begin_layer(blend_mode blend_mode)
@@ -267,14 +987,31 @@ public:
 		transform_stack_.push_back(transform_stack_.back()*frame.get_frame_transform());
 	}
 		
+	// Items are filled in place, copying a filled item would copy its texture vectors.
 	void visit(write_frame& frame)
 	{			
-		item item;
+		if(frame.is_audio_only())
+			return;
+
+		layers_.back().second.push_back(core::item());
+		auto& item = layers_.back().second.back();
 		item.pix_desc	= frame.get_pixel_format_desc();
 		item.textures	= frame.get_textures();
+		item.texture_rect = frame.get_texture_rect();
 		item.transform	= transform_stack_.back();
+		item.deinterlace_field	= frame.get_deinterlace_field();
+		item.before_textures	= frame.get_deinterlace_textures(false);
+		item.after_textures		= frame.get_deinterlace_textures(true);
+	}
 
-		layers_.back().second.push_back(item);
+	void visit(color_frame& frame)
+	{
+		layers_.back().second.push_back(core::item());
+		auto& item = layers_.back().second.back();
+		item.pix_desc.pix_fmt	= pixel_format::color;
+		item.pix_desc.is_opaque	= frame.is_opaque();
+		item.color				= frame.color();
+		item.transform			= transform_stack_.back();
 	}
 
 	void end()
@@ -286,18 +1023,96 @@ public:
 	{		
 	}
 	
-	boost::unique_future<safe_ptr<host_buffer>> render(const video_format_desc& format_desc, bool straighten_alpha)
+	boost::unique_future<rendered_image> render(const video_format_desc& format_desc, bool straighten_alpha, output_packing::type packing, bool key, output_split::type split, int usage, const std::vector<raster_pass>& rasters)
+	{
+		// The cpu renderer has neither packing, key extraction, textures nor rasters, read_frame and the consumers 
+		// fall back to doing them in host memory.
+		if(cpu_renderer_)
+			return (*cpu_renderer_)(std::move(layers_), format_desc, straighten_alpha);
+
+		return (*renderer_)(std::move(layers_), format_desc, straighten_alpha, packing, key, split, usage, rasters);
+	}
+
+	int culled_count() const
+	{
+		return renderer_ ? renderer_->culled_count() : 0;
+	}
+
+	int static_count() const
+	{
+		return renderer_ ? renderer_->static_count() : 0;
+	}
+
+	int draw_calls() const
 	{
-		return renderer_(std::move(layers_), format_desc, straighten_alpha);
+		return renderer_ ? renderer_->draw_calls() : 0;
+	}
+
+	void set_degradations(int degradations)
+	{
+		if(renderer_)
+			renderer_->set_static_frozen((degradations & degradation::static_layers) != 0);
+	}
+
+	gpu_times last_gpu_times()
+	{
+		return renderer_ ? renderer_->last_gpu_times() : gpu_times();
+	}
+
+	void set_background(bool value)
+	{
+		if(renderer_)
+			renderer_->set_background(value);
 	}
 };
 
-image_mixer::image_mixer(const safe_ptr<ogl_device>& ogl) : impl_(new implementation(ogl)){}
+image_mixer::image_mixer(const safe_ptr<ogl_device>& ogl, const safe_ptr<diagnostics::graph>& graph) : impl_(new implementation(ogl, graph)){}
 void image_mixer::begin(basic_frame& frame){impl_->begin(frame);}
 void image_mixer::visit(write_frame& frame){impl_->visit(frame);}
+void image_mixer::visit(color_frame& frame){impl_->visit(frame);}
 void image_mixer::end(){impl_->end();}
-boost::unique_future<safe_ptr<host_buffer>> image_mixer::operator()(const video_format_desc& format_desc, bool straighten_alpha){return impl_->render(format_desc, straighten_alpha);}
+boost::unique_future<rendered_image> image_mixer::operator()(const video_format_desc& format_desc, bool straighten_alpha, output_packing::type packing, bool key, output_split::type split, int usage, const std::vector<raster_pass>& rasters){return impl_->render(format_desc, straighten_alpha, packing, key, split, usage, rasters);}
 void image_mixer::begin_layer(blend_mode blend_mode){impl_->begin_layer(blend_mode);}
 void image_mixer::end_layer(){impl_->end_layer();}
+int image_mixer::culled_count() const{return impl_->culled_count();}
+int image_mixer::static_count() const{return impl_->static_count();}
+int image_mixer::draw_calls() const{return impl_->draw_calls();}
+void image_mixer::set_degradations(int degradations){impl_->set_degradations(degradations);}
+void image_mixer::set_background(bool value){impl_->set_background(value);}
+gpu_times image_mixer::last_gpu_times() const{return impl_->last_gpu_times();}
+
+void prewarm_image_mixer(const safe_ptr<ogl_device>& ogl, const video_format_desc& format_desc)
+{
+	auto frames = env::properties().get(L"configuration.mixer.prewarm-frames", 4);
+	if(frames <= 0)
+		return;
+
+	auto width	= static_cast<uint32_t>(format_desc.width);
+	auto height = static_cast<uint32_t>(format_desc.height);
+
+	// The layers and render targets of the channel, and the planes of bgra, 4:2:2 and 4:2:0 clips at its size.
+	ogl->reserve_device_buffers(width, height, 4, 1, frames + 2);
+	ogl->reserve_device_buffers(width, height, 1, 1, frames);
+	ogl->reserve_device_buffers(width/2, height, 1, 1, frames*2);
+	ogl->reserve_device_buffers(width/2, height/2, 1, 1, frames*2);
+
+	// Their uploads, and the read backs of the channel image.
+	ogl->reserve_host_buffers(width*height*4, write_only, frames);
+	ogl->reserve_host_buffers(width*height, write_only, frames);
+	ogl->reserve_host_buffers(width/2*height, write_only, frames*2);
+	ogl->reserve_host_buffers(width/2*height/2, write_only, frames*2);
+	ogl->reserve_host_buffers(width*height*4, read_only, frames);
+
+	if(ogl->software())
+		return;
+
+	ogl->invoke([&]
+	{
+		bool blend_modes = false;
+		bool post_processing = false;
+		get_image_shader(*ogl, blend_modes, post_processing);
+		prewarm_image_shaders(*ogl);
+	});
+}
 
 }}
\ No newline at end of file
@@ -25,38 +25,118 @@
 
 #include <common/memory/safe_ptr.h>
 
+#include <core/mixer/output_packing.h>
 #include <core/producer/frame/frame_visitor.h>
+#include <core/video_format.h>
 
 #include <boost/noncopyable.hpp>
 
 #include <boost/thread/future.hpp>
 
-namespace caspar { namespace core {
+#include <vector>
+
+namespace caspar { 
+	
+namespace diagnostics {
+	
+class graph;
+
+}
+
+namespace core {
 
 class write_frame;
 class host_buffer;
+class device_buffer;
 class ogl_device;
 struct video_format_desc;
 struct pixel_format_desc;
 
+// The rendered channel image, being read back to host memory.
+struct rendered_image
+{
+	std::shared_ptr<host_buffer>	image; // Null unless image_usage::host was requested.
+	std::shared_ptr<host_buffer>	packed_image; // Null unless packing was requested.
+	output_packing::type			packing;
+	output_split::type				split;
+	std::shared_ptr<host_buffer>	key_image; // Null unless the key was requested.
+	std::shared_ptr<device_buffer>	texture; // Null unless image_usage::texture was requested.
+	std::vector<std::pair<int, std::shared_ptr<host_buffer>>> rasters; // Completed output rasters by index, bgra.
+
+	rendered_image() 
+		: packing(output_packing::none)
+		, split(output_split::none)
+	{
+	}
+};
+
+// Scaling of the channel image into an output raster, see mixer::set_output_rasters.
+struct raster_pass
+{
+	int					index;
+	uint32_t			width;
+	uint32_t			height;
+	field_mode::type	field; // Drawn this frame, the other field of an interlaced raster comes from the frame before.
+	bool				complete; // Read back after this pass, otherwise only the first field is drawn.
+
+	raster_pass()
+		: index(0)
+		, width(0)
+		, height(0)
+		, field(field_mode::progressive)
+		, complete(true)
+	{
+	}
+};
+
+// GPU time spent on the passes of a recently rendered frame, in seconds.
+struct gpu_times
+{
+	double				draw;
+	double				key; // Part of draw, the chroma keyer stage.
+	double				post;
+	double				output; // Packing, key extraction and readback.
+	std::vector<double>	layers; // Part of draw, bottom layer first. Cached layers are not included.
+
+	gpu_times()
+		: draw(0.0)
+		, key(0.0)
+		, post(0.0)
+		, output(0.0)
+	{
+	}
+};
+
 class image_mixer : public core::frame_visitor, boost::noncopyable
 {
 public:
-	image_mixer(const safe_ptr<ogl_device>& ogl);
+	image_mixer(const safe_ptr<ogl_device>& ogl, const safe_ptr<diagnostics::graph>& graph);
 	
 	virtual void begin(core::basic_frame& frame);
 	virtual void visit(core::write_frame& frame);
+	virtual void visit(core::color_frame& frame);
 	virtual void end();
 
 	void begin_layer(blend_mode blend_mode);
 	void end_layer();
 		
-	boost::unique_future<safe_ptr<host_buffer>> operator()(
-			const video_format_desc& format_desc, bool straighten_alpha);
+	boost::unique_future<rendered_image> operator()(
+			const video_format_desc& format_desc, bool straighten_alpha, output_packing::type packing, bool key, output_split::type split = output_split::none, int usage = image_usage::host, const std::vector<raster_pass>& rasters = std::vector<raster_pass>());
+
+	int culled_count() const; // Items culled during the last render.
+	int static_count() const; // Layers drawn from the static layer cache during the last render.
+	int draw_calls() const; // Draws and clears submitted by the last render, including packing and post processing.
+	void set_degradations(int degradations); // Honours degradation::static_layers from the next render.
+	void set_background(bool value); // Renders only when the ogl device has nothing else to do, for work which is not on air.
+	gpu_times last_gpu_times() const; // Of a frame a few renders back, all zero without GL_ARB_timer_query.
 		
 private:
 	struct implementation;
 	safe_ptr<implementation> impl_;
 };
 
+// Fills the pools of the device with the buffers a channel of the format and the clips at its size use once it 
+// plays, configuration.mixer.prewarm-frames of each, and builds the shader variants ahead. Blocks until done.
+void prewarm_image_mixer(const safe_ptr<ogl_device>& ogl, const video_format_desc& format_desc);
+
 }}
\ No newline at end of file
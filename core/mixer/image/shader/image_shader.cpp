@@ -31,14 +31,39 @@
 #include <common/gl/gl_check.h>
 #include <common/env.h>
 
+#include <core/producer/frame/pixel_format.h>
+#include <core/video_format.h>
+
+#include "../blend_modes.h"
+
 #include <tbb/mutex.h>
 
+#include <boost/lexical_cast.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+#include <map>
+#include <set>
+
 namespace caspar { namespace core {
 
-std::shared_ptr<shader> g_shader;
 tbb::mutex				g_shader_mutex;
+bool					g_configured = false;
 bool					g_blend_modes = false;
 bool					g_post_processing = false;
+bool					g_chroma_key = false;
+
+// Uniform values are program state, which is shared between contexts, so every ogl_device compiles 
+// programs of its own.
+struct device_shaders
+{
+	std::shared_ptr<shader>								generic;
+	std::shared_ptr<shader>								packing;
+	std::shared_ptr<shader>								keyer;
+	std::map<image_shader_key, std::shared_ptr<shader>>	variants;
+	std::set<image_shader_key>							pending;
+};
+
+std::map<const ogl_device*, device_shaders> g_device_shaders;
 
 std::string get_blend_color_func()
 {
@@ -146,8 +171,19 @@ std::string get_chroma_func()
 		"}                                                                      \n";
 }
 
-std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing)
+std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing, const image_shader_key* key)
 {
+	// Generic shaders select features with uniforms, specialized shaders have them compiled in as constants 
+	// which allows the glsl compiler to remove the branches.
+	auto k = key ? *key : image_shader_key();
+	auto feature = [&](const std::string& type, const std::string& name, int value) -> std::string
+	{
+		if(!key)
+			return "uniform " + type + "\t\t" + name + ";\n";
+		
+		return "const " + type + "\t\t" + name + " = " + (type == "bool" ? (value ? "true" : "false") : boost::lexical_cast<std::string>(value)) + ";\n";
+	};
+
 	return
 
 	"#version 130																		\n"
@@ -155,31 +191,40 @@ std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing
 	"uniform sampler2D	plane[4];														\n"
 	"uniform sampler2D	local_key;														\n"
 	"uniform sampler2D	layer_key;														\n"
+	"uniform sampler2D	before[4];														\n"
+	"uniform sampler2D	after[4];														\n"
 	"																					\n"
 	"uniform bool		is_hd;															\n"
-	"uniform bool		has_local_key;													\n"
-	"uniform bool		has_layer_key;													\n"
-	"uniform int		blend_mode;														\n"
-	"uniform int		keyer;															\n"
-	"uniform int		pixel_format;													\n"
+	+ feature("bool",	"has_local_key",	k.has_local_key)
+	+ feature("bool",	"has_layer_key",	k.has_layer_key)
+	+ feature("int",	"blend_mode",		k.blend_mode)
+	+ feature("int",	"keyer",			k.keyer)
+	+ feature("int",	"pixel_format",		k.pixel_format)
+	+ feature("int",	"deinterlace",		k.deinterlace)
+	+
+	"uniform bool		deinterlace_temporal;											\n"
+	+
 	"																					\n"
 	"uniform float		opacity;														\n"
-	"uniform bool		levels;															\n"
-	"uniform float		min_input;														\n"
-	"uniform float		max_input;														\n"
-	"uniform float		gamma;															\n"
-	"uniform float		min_output;														\n"
-	"uniform float		max_output;														\n"
-	"																					\n"
-	"uniform bool		csb;															\n"
-	"uniform float		brt;															\n"
-	"uniform float		sat;															\n"
-	"uniform float		con;															\n"
+	"uniform vec4		solid_color;													\n"
+	"uniform int		packed_width;													\n"
+	+ feature("bool",	"color_lut",		k.color_lut)
+	+
+	"uniform sampler3D	lut;															\n"
+	"uniform float		lut_size;														\n"
 	"																					\n"	
-	"uniform bool		post_processing;												\n"
+	+ feature("bool",	"motion_blur",		k.motion_blur)
+	+
+	"uniform vec2		motion_blur_step;												\n"
+	"uniform int		motion_blur_samples;											\n"
+	"uniform vec4		motion_blur_bounds;												\n"
+	"																					\n"
+	+ feature("bool",	"post_processing",	k.post_processing)
+	+
 	"uniform bool		straighten_alpha;												\n"
 	"																					\n"	
-    "uniform int        chroma_mode;                                                    \n"
+	+ feature("int",	"chroma_mode",		k.chroma_mode)
+	+
     "uniform vec2       chroma_blend;                                                   \n"
     "uniform float      chroma_spill;                                                   \n"
 
@@ -223,44 +268,262 @@ std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing
 	"		return ycbcra_to_rgba_sd(y, cb, cr, a);										\n"
 	"}																					\n"
 	"																					\n"
-	"vec4 get_rgba_color()																\n"
+	"vec4 texel(int source, int n, vec2 st)												\n"
+	"{																					\n"
+	"	if(source == 1)																	\n"
+	"	{																				\n"
+	"		switch(n)																	\n"
+	"		{																			\n"
+	"		case 0: return texture2D(before[0], st);									\n"
+	"		case 1: return texture2D(before[1], st);									\n"
+	"		case 2: return texture2D(before[2], st);									\n"
+	"		case 3: return texture2D(before[3], st);									\n"
+	"		}																			\n"
+	"	}																				\n"
+	"	else if(source == 2)															\n"
+	"	{																				\n"
+	"		switch(n)																	\n"
+	"		{																			\n"
+	"		case 0: return texture2D(after[0], st);										\n"
+	"		case 1: return texture2D(after[1], st);										\n"
+	"		case 2: return texture2D(after[2], st);										\n"
+	"		case 3: return texture2D(after[3], st);										\n"
+	"		}																			\n"
+	"	}																				\n"
+	"	switch(n)																		\n"
+	"	{																				\n"
+	"	case 0: return texture2D(plane[0], st);											\n"
+	"	case 1: return texture2D(plane[1], st);											\n"
+	"	case 2: return texture2D(plane[2], st);											\n"
+	"	case 3: return texture2D(plane[3], st);											\n"
+	"	}																				\n"
+	"	return vec4(0.0, 0.0, 0.0, 0.0);												\n"
+	"}																					\n"
+	"																					\n"
+	"ivec4 word(int source, ivec2 pos)													\n"
+	"{																					\n"
+	"	vec4 bytes;																		\n"
+	"	if(source == 1)																	\n"
+	"		bytes = texelFetch(before[0], pos, 0);										\n"
+	"	else if(source == 2)															\n"
+	"		bytes = texelFetch(after[0], pos, 0);										\n"
+	"	else																			\n"
+	"		bytes = texelFetch(plane[0], pos, 0);										\n"
+	"	return ivec4(bytes.bgra*255.0 + 0.5); // uploaded as bgra, back to memory order	\n"
+	"}																					\n"
+	"																					\n"
+	"// The three 10 bit components of a little endian v210 word, normalized.			\n"
+	"vec3 unpack_word(ivec4 b)															\n"
+	"{																					\n"
+	"	return vec3(b.r + (b.g & 3)*256,												\n"
+	"				(b.g >> 2) + (b.b & 15)*64,											\n"
+	"				(b.b >> 4) + (b.a & 63)*16) / 1023.0;								\n"
+	"}																					\n"
+	"																					\n"
+	"// Every 4 words hold 6 pixels: Cb0 Y0 Cr0 | Y1 Cb1 Y2 | Cr1 Y3 Cb2 | Y4 Cr2 Y5	\n"
+	"vec4 get_v210_color(int source, vec2 st)											\n"
+	"{																					\n"
+	"	ivec2 size = textureSize(plane[0], 0);											\n"
+	"	int x = clamp(int(st.s*float(packed_width)), 0, packed_width - 1);				\n"
+	"	int y = clamp(int(st.t*float(size.y)), 0, size.y - 1);							\n"
+	"	int base = (x / 6) * 4;															\n"
+	"	int i = x - (x / 6) * 6;														\n"
+	"																					\n"
+	"	vec3 w0 = unpack_word(word(source, ivec2(base + 0, y)));						\n"
+	"	vec3 w1 = unpack_word(word(source, ivec2(base + 1, y)));						\n"
+	"	vec3 w2 = unpack_word(word(source, ivec2(base + 2, y)));						\n"
+	"	vec3 w3 = unpack_word(word(source, ivec2(base + 3, y)));						\n"
+	"																					\n"
+	"	float luma;																		\n"
+	"	if(i == 0)		luma = w0.y;													\n"
+	"	else if(i == 1)	luma = w1.x;													\n"
+	"	else if(i == 2)	luma = w1.z;													\n"
+	"	else if(i == 3)	luma = w2.y;													\n"
+	"	else if(i == 4)	luma = w3.x;													\n"
+	"	else			luma = w3.z;													\n"
+	"																					\n"
+	"	vec2 cbcr;																		\n"
+	"	if(i < 2)		cbcr = vec2(w0.x, w0.z);										\n"
+	"	else if(i < 4)	cbcr = vec2(w1.y, w2.x);										\n"
+	"	else			cbcr = vec2(w2.z, w3.y);										\n"
+	"																					\n"
+	"	return ycbcra_to_rgba(luma, cbcr.x, cbcr.y, 1.0);								\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 get_rgba_color(int source, vec2 st)											\n"
 	"{																					\n"
 	"	switch(pixel_format)															\n"
 	"	{																				\n"
 	"	case 0:		//gray																\n"
-	"		return vec4(texture2D(plane[0], gl_TexCoord[0].st).rrr, 1.0);				\n"
+	"		return vec4(texel(source, 0, st).rrr, 1.0);									\n"
 	"	case 1:		//bgra,																\n"
-	"		return texture2D(plane[0], gl_TexCoord[0].st).bgra;							\n"
+	"		return texel(source, 0, st).bgra;											\n"
 	"	case 2:		//rgba,																\n"
-	"		return texture2D(plane[0], gl_TexCoord[0].st).rgba;							\n"
+	"		return texel(source, 0, st).rgba;											\n"
 	"	case 3:		//argb,																\n"
-	"		return texture2D(plane[0], gl_TexCoord[0].st).argb;							\n"
+	"		return texel(source, 0, st).argb;											\n"
 	"	case 4:		//abgr,																\n"
-	"		return texture2D(plane[0], gl_TexCoord[0].st).gbar;							\n"
+	"		return texel(source, 0, st).gbar;											\n"
 	"	case 5:		//ycbcr,															\n"
 	"		{																			\n"
-	"			float y  = texture2D(plane[0], gl_TexCoord[0].st).r;					\n"
-	"			float cb = texture2D(plane[1], gl_TexCoord[0].st).r;					\n"
-	"			float cr = texture2D(plane[2], gl_TexCoord[0].st).r;					\n"
+	"			float y  = texel(source, 0, st).r;										\n"
+	"			float cb = texel(source, 1, st).r;										\n"
+	"			float cr = texel(source, 2, st).r;										\n"
 	"			return ycbcra_to_rgba(y, cb, cr, 1.0);									\n"
 	"		}																			\n"
 	"	case 6:		//ycbcra															\n"
 	"		{																			\n"
-	"			float y  = texture2D(plane[0], gl_TexCoord[0].st).r;					\n"
-	"			float cb = texture2D(plane[1], gl_TexCoord[0].st).r;					\n"
-	"			float cr = texture2D(plane[2], gl_TexCoord[0].st).r;					\n"
-	"			float a  = texture2D(plane[3], gl_TexCoord[0].st).r;					\n"
+	"			float y  = texel(source, 0, st).r;										\n"
+	"			float cb = texel(source, 1, st).r;										\n"
+	"			float cr = texel(source, 2, st).r;										\n"
+	"			float a  = texel(source, 3, st).r;										\n"
 	"			return ycbcra_to_rgba(y, cb, cr, a);									\n"
 	"		}																			\n"
 	"	case 7:		//luma																\n"
 	"		{																			\n"
-	"			vec3 y3 = texture2D(plane[0], gl_TexCoord[0].st).rrr;					\n"
+	"			vec3 y3 = texel(source, 0, st).rrr;										\n"
 	"			return vec4((y3-0.065)/0.859, 1.0);										\n"
 	"		}																			\n"
+	"	case 8:		//color																\n"
+	"		return solid_color;															\n"
+	"	case 9:		//nv12																\n"
+	"	case 10:	//p010																\n"
+	"		{																			\n"
+	"			// p010 keeps 10 bits in the msbs of 16 bit samples.					\n"
+	"			float scale = pixel_format == 10 ? 65535.0/65472.0 : 1.0;				\n"
+	"			float y  = texel(source, 0, st).r * scale;								\n"
+	"			vec2 cbcr = texel(source, 1, st).rg * scale;							\n"
+	"			return ycbcra_to_rgba(y, cbcr.x, cbcr.y, 1.0);							\n"
+	"		}																			\n"
+	"	case 11:	//ycbcr10															\n"
+	"	case 12:	//ycbcra10															\n"
+	"		{																			\n"
+	"			float scale = 65535.0/1023.0;											\n"
+	"			float y  = texel(source, 0, st).r * scale;								\n"
+	"			float cb = texel(source, 1, st).r * scale;								\n"
+	"			float cr = texel(source, 2, st).r * scale;								\n"
+	"			float a  = pixel_format == 12 ? texel(source, 3, st).r * scale : 1.0;	\n"
+	"			return ycbcra_to_rgba(y, cb, cr, a);									\n"
+	"		}																			\n"
+	"	case 13:	//rgb48																\n"
+	"		return vec4(texel(source, 0, st).rgb, 1.0);									\n"
+	"	case 14:	//rgba64															\n"
+	"		return texel(source, 0, st).rgba;											\n"
+	"	case 15:	//v210																\n"
+	"		return get_v210_color(source, st);											\n"
+	"	case 16:	//ycbcr_keyed														\n"
+	"		{																			\n"
+	"			float y  = texel(source, 0, st).r;										\n"
+	"			float cb = texel(source, 1, st).r;										\n"
+	"			float cr = texel(source, 2, st).r;										\n"
+	"			float k  = clamp((texel(source, 3, st).r-0.065)/0.859, 0.0, 1.0);		\n"
+	"			return ycbcra_to_rgba(y, cb, cr, 1.0) * k;								\n"
+	"		}																			\n"
+	"	case 17:	//bgra_keyed														\n"
+	"		{																			\n"
+	"			float k  = clamp((texel(source, 1, st).r-0.065)/0.859, 0.0, 1.0);		\n"
+	"			return texel(source, 0, st).bgra * k;									\n"
+	"		}																			\n"
+	"	case 18:	//dxt1, decoded by the gpu in rgba order							\n"
+	"		return vec4(texel(source, 0, st).bgr, 1.0);									\n"
+	"	case 19:	//dxt5																\n"
+	"	case 21:	//bc7																\n"
+	"		return texel(source, 0, st).bgra;											\n"
+	"	case 20:	//ycocg_dxt5														\n"
+	"		{																			\n"
+	"			vec4 cocgsy = texel(source, 0, st) - vec4(0.50196078, 0.50196078, 0.0, 0.0);\n"
+	"			float scale = cocgsy.b * (255.0/8.0) + 1.0;								\n"
+	"			float co = cocgsy.r / scale;											\n"
+	"			float cg = cocgsy.g / scale;											\n"
+	"			float y  = cocgsy.a;													\n"
+	"			return vec4(y - co - cg, y + cg, y + co - cg, 1.0);						\n"
+	"		}																			\n"
 	"	}																				\n"
 	"	return vec4(0.0, 0.0, 0.0, 0.0);												\n"
 	"}																					\n"
 	"																					\n"
+	"// Motion adaptive deinterlacing along the lines of yadif. The lines of the kept field are shown as they are, the	\n"
+	"// others are interpolated spatially along the best of three directions, clamped to the temporal prediction		\n"
+	"// from the frames before and after by how much the picture moves.					\n"
+	"float score(vec4 a, vec4 b)														\n"
+	"{																					\n"
+	"	vec4 d = abs(a - b);															\n"
+	"	return d.r + d.g + d.b;															\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 get_deinterlaced_color()														\n"
+	"{																					\n"
+	"	vec2  size = vec2(textureSize(plane[0], 0));									\n"
+	"	vec2  unit = vec2(1.0, 1.0)/size;												\n"
+	"	float row  = min(floor(gl_TexCoord[0].t*size.y), size.y - 1.0);					\n"
+	"	float x    = gl_TexCoord[0].s;													\n"
+	"	float y    = (row + 0.5)*unit.y;												\n"
+	"																					\n"
+	"	// Rows count from the top of the image, the upper field holds the even rows.	\n"
+	"	if(mod(row, 2.0) == (deinterlace == 2 ? 0.0 : 1.0))								\n"
+	"		return get_rgba_color(0, vec2(x, y));										\n"
+	"																					\n"
+	"	float yc = row > 0.0 ? y - unit.y : y + unit.y;									\n"
+	"	float ye = row < size.y - 1.0 ? y + unit.y : y - unit.y;						\n"
+	"																					\n"
+	"	vec4 c  = get_rgba_color(0, vec2(x, yc));										\n"
+	"	vec4 e  = get_rgba_color(0, vec2(x, ye));										\n"
+	"	vec4 cl = get_rgba_color(0, vec2(x - unit.x, yc));								\n"
+	"	vec4 cr = get_rgba_color(0, vec2(x + unit.x, yc));								\n"
+	"	vec4 el = get_rgba_color(0, vec2(x - unit.x, ye));								\n"
+	"	vec4 er = get_rgba_color(0, vec2(x + unit.x, ye));								\n"
+	"																					\n"
+	"	vec4  spatial = (c + e)*0.5;													\n"
+	"	float best    = score(c, e);													\n"
+	"	if(score(cl, er) < best)														\n"
+	"	{																				\n"
+	"		best    = score(cl, er);													\n"
+	"		spatial = (cl + er)*0.5;													\n"
+	"	}																				\n"
+	"	if(score(cr, el) < best)														\n"
+	"		spatial = (cr + el)*0.5;													\n"
+	"																					\n"
+	"	if(!deinterlace_temporal)														\n"
+	"		return spatial;																\n"
+	"																					\n"
+	"	vec4 b = get_rgba_color(1, vec2(x, y));											\n"
+	"	vec4 a = get_rgba_color(2, vec2(x, y));											\n"
+	"	vec4 d = (b + a)*0.5;															\n"
+	"																					\n"
+	"	vec4 diff0 = abs(b - a)*0.5;													\n"
+	"	vec4 diff1 = (abs(get_rgba_color(1, vec2(x, yc)) - c) + abs(get_rgba_color(1, vec2(x, ye)) - e))*0.5;\n"
+	"	vec4 diff2 = (abs(get_rgba_color(2, vec2(x, yc)) - c) + abs(get_rgba_color(2, vec2(x, ye)) - e))*0.5;\n"
+	"	vec4 diff  = max(diff0, max(diff1, diff2));										\n"
+	"																					\n"
+	"	return clamp(spatial, d - diff, d + diff);										\n"
+	"}																					\n"
+	"																					\n"
+	"// Averages the samples along the path the image moved during the frame, the ones longer ago weigh less. The	\n"
+	"// samples are kept within the image, which may be a part of the texture.		\n"
+	"vec4 get_motion_blurred_color()													\n"
+	"{																					\n"
+	"	vec4  sum    = vec4(0.0);														\n"
+	"	float weight = 0.0;																\n"
+	"	for(int n = 0; n < motion_blur_samples; ++n)									\n"
+	"	{																				\n"
+	"		float t  = float(n) / float(motion_blur_samples);							\n"
+	"		float w  = 1.0 - t*t;														\n"
+	"		vec2  st = clamp(gl_TexCoord[0].st - motion_blur_step*float(n), motion_blur_bounds.xy, motion_blur_bounds.zw);\n"
+	"		sum		+= get_rgba_color(0, st) * w;										\n"
+	"		weight	+= w;																\n"
+	"	}																				\n"
+	"	return sum / max(weight, 0.0000001);											\n"
+	"}																					\n"
+	"																					\n"
+	"// The lut holds the levels, contrast, saturation and brightness of the layer, along with the lut of a .cube file.	\n"
+	"// It maps straight colors, the coordinates are moved to the centers of the outermost texels.						\n"
+	"vec3 lookup_color(vec4 color)														\n"
+	"{																					\n"
+	"	vec3 rgb   = clamp(color.rgb / (color.a + 0.0000001), 0.0, 1.0);				\n"
+	"	vec3 coord = rgb*((lut_size - 1.0)/lut_size) + 0.5/lut_size;					\n"
+	"	return texture3D(lut, coord).rgb * color.a;										\n"
+	"}																					\n"
+	"																					\n"
 	"vec4 post_process()																\n"
 	"{																					\n"
 	"	vec4 color = texture2D(background, gl_TexCoord[0].st).bgra;						\n"
@@ -282,15 +545,18 @@ std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing
 	"	else																			\n" : "")
 	+
 	"	{																				\n"
-	"		vec4 color = get_rgba_color();												\n"
+	"		vec4 color;																	\n"
+	"		if(deinterlace != 0)														\n"
+	"			color = get_deinterlaced_color();										\n"
+	"		else if(motion_blur)														\n"
+	"			color = get_motion_blurred_color();										\n"
+	"		else																		\n"
+	"			color = get_rgba_color(0, gl_TexCoord[0].st);							\n"
 	+
 	(chroma_key ? "		color = chroma_key(color);\n" : "")
 	+
-	"		if(levels)																	\n"
-	"			color.rgb = LevelsControl(												\n"
-	"					color.rgb, min_input, gamma, max_input, min_output, max_output);\n"
-	"		if(csb)																		\n"
-	"			color.rgb = ContrastSaturationBrightness(color, brt, sat, con);			\n"
+	"		if(color_lut)																\n"
+	"			color.rgb = lookup_color(color);										\n"
 	"		if(has_local_key)															\n"
 	"			color *= texture2D(local_key, gl_TexCoord[1].st).r;						\n"
 	"		if(has_layer_key)															\n"
@@ -302,27 +568,114 @@ std::string get_fragment(bool blend_modes, bool chroma_key, bool post_processing
 	"}																					\n";
 }
 
+image_shader_key::image_shader_key()
+	: pixel_format(core::pixel_format::bgra)
+	, has_local_key(false)
+	, has_layer_key(false)
+	, blend_mode(core::blend_mode::normal)
+	, keyer(0)
+	, chroma_mode(0)
+	, color_lut(false)
+	, post_processing(false)
+	, deinterlace(0)
+	, motion_blur(false)
+{
+}
+
+bool image_shader_key::operator<(const image_shader_key& other) const
+{
+	return boost::tie(pixel_format, has_local_key, has_layer_key, blend_mode, keyer, chroma_mode, color_lut, post_processing, deinterlace, motion_blur) 
+		 < boost::tie(other.pixel_format, other.has_local_key, other.has_layer_key, other.blend_mode, other.keyer, other.chroma_mode, other.color_lut, other.post_processing, other.deinterlace, other.motion_blur);
+}
+
+// Features which are not compiled into the shaders at all do not need separate variants.
+image_shader_key normalize(image_shader_key key)
+{
+	if(!g_blend_modes)
+	{
+		key.blend_mode	= blend_mode::normal;
+		key.keyer		= 0;
+	}
+
+	if(!g_chroma_key)
+		key.chroma_mode = 0;
+
+	if(key.post_processing)
+	{
+		auto post_processing = key.post_processing;
+		key = image_shader_key();
+		key.post_processing = post_processing;
+	}
+
+	return key;
+}
+
+std::shared_ptr<shader> build_image_shader(const image_shader_key& key)
+{
+	try
+	{
+		return std::make_shared<shader>(get_vertex(), get_fragment(g_blend_modes, g_chroma_key, g_post_processing, &key));
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+		CASPAR_LOG(warning) << "[shader] Failed to compile specialized shader. Falling back to generic shader.";
+		return nullptr;
+	}
+}
+
+void prepare_image_shaders(device_shaders& shaders)
+{
+	// Plain draws without adjustments, for every pixel format and keying.
+	for(int pix_fmt = 0; pix_fmt < pixel_format::count; ++pix_fmt)
+	{
+		for(int keys = 0; keys < 4; ++keys)
+		{
+			image_shader_key key;
+			key.pixel_format	= pix_fmt;
+			key.has_local_key	= (keys & 1) != 0;
+			key.has_layer_key	= (keys & 2) != 0;
+			shaders.variants[key] = build_image_shader(key);
+		}
+	}
+
+	if(g_post_processing)
+	{
+		image_shader_key key;
+		key.post_processing = true;
+		shaders.variants[key] = build_image_shader(key);
+	}
+
+	CASPAR_LOG(info) << L"[shader] Prepared " << shaders.variants.size() << L" specialized shaders.";
+}
+
 safe_ptr<shader> get_image_shader(
 		ogl_device& ogl, bool& blend_modes, bool& post_processing)
 {
 	tbb::mutex::scoped_lock lock(g_shader_mutex);
 
-	if(g_shader)
+	auto& shaders = g_device_shaders[&ogl];
+
+	if(shaders.generic)
 	{
 		blend_modes = g_blend_modes;
 		post_processing = g_post_processing;
 
-		return make_safe_ptr(g_shader);
+		return make_safe_ptr(shaders.generic);
 	}
 		
-	bool chroma_key = env::properties().get(L"configuration.mixer.chroma-key", false);
-	bool straight_alpha = env::properties().get(L"configuration.mixer.straight-alpha", false);
-	g_post_processing = straight_alpha;
+	if(!g_configured)
+	{
+		g_chroma_key = env::properties().get(L"configuration.mixer.chroma-key", false);
+		bool straight_alpha = env::properties().get(L"configuration.mixer.straight-alpha", false);
+		g_post_processing = straight_alpha;
+		g_blend_modes  = glTextureBarrierNV ? env::properties().get(L"configuration.mixer.blend-modes", false) : false;
+		g_configured = true;
+	}
 
 	try
 	{				
-		g_blend_modes  = glTextureBarrierNV ? env::properties().get(L"configuration.mixer.blend-modes", false) : false;
-		g_shader.reset(new shader(get_vertex(), get_fragment(g_blend_modes, chroma_key, g_post_processing)));
+		shaders.generic.reset(new shader(get_vertex(), get_fragment(g_blend_modes, g_chroma_key, g_post_processing, nullptr)));
 	}
 	catch(...)
 	{
@@ -330,8 +683,10 @@ safe_ptr<shader> get_image_shader(
 		CASPAR_LOG(warning) << "Failed to compile shader. Trying to compile without blend-modes.";
 				
 		g_blend_modes = false;
-		g_shader.reset(new shader(get_vertex(), get_fragment(g_blend_modes, chroma_key, g_post_processing)));
+		shaders.generic.reset(new shader(get_vertex(), get_fragment(g_blend_modes, g_chroma_key, g_post_processing, nullptr)));
 	}
+
+	prepare_image_shaders(shaders);
 						
 	ogl.enable(GL_TEXTURE_2D);
 
@@ -345,7 +700,352 @@ safe_ptr<shader> get_image_shader(
 	blend_modes = g_blend_modes;
 	post_processing = g_post_processing;
 
-	return make_safe_ptr(g_shader);
+	return make_safe_ptr(shaders.generic);
+}
+
+std::shared_ptr<shader> get_image_shader(ogl_device& ogl, const image_shader_key& key)
+{
+	auto normalized = normalize(key);
+
+	tbb::mutex::scoped_lock lock(g_shader_mutex);
+
+	auto& shaders = g_device_shaders[&ogl];
+
+	auto it = shaders.variants.find(normalized);
+	if(it != shaders.variants.end())
+		return it->second;
+
+	// Build uncommon variants in between frames instead of stalling the current one.
+	if(shaders.pending.insert(normalized).second)
+	{
+		auto device = &ogl;
+		ogl.begin_invoke([=]
+		{
+			auto shader = build_image_shader(normalized);
+
+			tbb::mutex::scoped_lock lock(g_shader_mutex);
+			auto& shaders = g_device_shaders[device];
+			shaders.variants[normalized] = shader;
+			shaders.pending.erase(normalized);
+		});
+	}
+
+	return nullptr;
+}
+
+void prewarm_image_shaders(ogl_device& ogl)
+{
+	for(int pix_fmt = 0; pix_fmt < pixel_format::count; ++pix_fmt)
+	{
+		image_shader_key key;
+		key.pixel_format = pix_fmt;
+
+		key.color_lut = true;
+		get_image_shader(ogl, key);
+		key.color_lut = false;
+
+		key.deinterlace = field_mode::upper;
+		get_image_shader(ogl, key);
+		key.deinterlace = field_mode::lower;
+		get_image_shader(ogl, key);
+	}
+}
+
+std::string get_packing_fragment()
+{
+	return
+
+	"#version 130																		\n"
+	"uniform sampler2D	background;														\n"
+	"uniform int		packing;														\n"
+	"uniform bool		is_hd;															\n"
+	"uniform bool		key_only;														\n"
+	"uniform bool		interleave;														\n"
+	"uniform bool		interlaced;														\n"
+	"uniform int		split;															\n"
+	"uniform sampler2D	lower;															\n"
+	"uniform bool		scale;															\n"
+	"uniform int		field;															\n"
+	"uniform int		target_width;													\n"
+	"uniform int		target_height;													\n"
+	"																					\n"
+	"int sub_image = 0;																	\n"
+	"																					\n"
+	"// Where pixel x, y of the current sub-image is in the channel image.				\n"
+	"ivec2 source_pos(int x, int y)														\n"
+	"{																					\n"
+	"	ivec2 size = textureSize(background, 0);										\n"
+	"	if(split == 0)																	\n"
+	"		return ivec2(min(x, size.x-1), y);											\n"
+	"																					\n"
+	"	x = min(x, size.x/2-1);															\n"
+	"	if(split == 1) // quad															\n"
+	"		return ivec2(x + (sub_image%2)*(size.x/2), y + (sub_image/2)*(size.y/2));	\n"
+	"																					\n"
+	"	// 2si: sample pairs alternate between sub-images 0/1 on even lines, 2/3 on odd.\n"
+	"	return ivec2((x/2)*4 + (sub_image%2)*2 + x%2, y*2 + sub_image/2);				\n"
+	"}																					\n"
+	"																					\n"
+	"vec3 get_ycbcr(int x, int y)														\n"
+	"{																					\n"
+	"	vec3 rgb  = texelFetch(background, source_pos(x, y), 0).rgb;					\n"
+	"	float Y = is_hd ? dot(rgb, vec3(0.2126, 0.7152, 0.0722))						\n"
+	"					: dot(rgb, vec3(0.299,  0.587,  0.114));						\n"
+	"	float Cb = (rgb.b - Y) / (is_hd ? 1.8556 : 1.772);								\n"
+	"	float Cr = (rgb.r - Y) / (is_hd ? 1.5748 : 1.402);								\n"
+	"	return vec3(Y, Cb, Cr);															\n"
+	"}																					\n"
+	"																					\n"
+	"// Studio range ycbcr of two horizontally adjacent pixels with shared chroma.		\n"
+	"void get_pair(int x, int y, float scale, out uint y0, out uint y1, out uint cb, out uint cr)\n"
+	"{																					\n"
+	"	vec3 p0 = get_ycbcr(x, y);														\n"
+	"	vec3 p1 = get_ycbcr(x+1, y);													\n"
+	"	vec2 c  = (p0.yz + p1.yz) * 0.5;												\n"
+	"	y0 = uint(round(( 16.0 + 219.0*clamp(p0.x, 0.0, 1.0)) * scale));				\n"
+	"	y1 = uint(round(( 16.0 + 219.0*clamp(p1.x, 0.0, 1.0)) * scale));				\n"
+	"	cb = uint(round((128.0 + 224.0*clamp(c.x, -0.5, 0.5)) * scale));				\n"
+	"	cr = uint(round((128.0 + 224.0*clamp(c.y, -0.5, 0.5)) * scale));				\n"
+	"}																					\n"
+	"																					\n"
+	"// Output is read back as bgra, i.e. b, g, r, a are bytes 0, 1, 2, 3 in memory.	\n"
+	"vec4 to_bytes(uint b0, uint b1, uint b2, uint b3)									\n"
+	"{																					\n"
+	"	return vec4(float(b2), float(b1), float(b0), float(b3)) / 255.0;				\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 pack_uyvy(int x, int y)														\n"
+	"{																					\n"
+	"	uint y0, y1, cb, cr;															\n"
+	"	get_pair(x*2, y, 1.0, y0, y1, cb, cr);											\n"
+	"	return to_bytes(cb, y0, cr, y1);												\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 pack_v210(int x, int y)														\n"
+	"{																					\n"
+	"	int first = (x / 4) * 6;														\n"
+	"	int word  = x % 4;																\n"
+	"																					\n"
+	"	uint y0, y1, cb0, cr0;															\n"
+	"	uint y2, y3, cb1, cr1;															\n"
+	"	uint y4, y5, cb2, cr2;															\n"
+	"	get_pair(first+0, y, 4.0, y0, y1, cb0, cr0);									\n"
+	"	get_pair(first+2, y, 4.0, y2, y3, cb1, cr1);									\n"
+	"	get_pair(first+4, y, 4.0, y4, y5, cb2, cr2);									\n"
+	"																					\n"
+	"	uint value;																		\n"
+	"	if(word == 0)																	\n"
+	"		value = cb0 | (y0  << 10) | (cr0 << 20);									\n"
+	"	else if(word == 1)																\n"
+	"		value = y1  | (cb1 << 10) | (y2  << 20);									\n"
+	"	else if(word == 2)																\n"
+	"		value = cr1 | (y3  << 10) | (cb2 << 20);									\n"
+	"	else																			\n"
+	"		value = y4  | (cr2 << 10) | (y5  << 20);									\n"
+	"																					\n"
+	"	return to_bytes(value & 255u, (value >> 8) & 255u, (value >> 16) & 255u, value >> 24);\n"
+	"}																					\n"
+	"																					\n"
+	"uint get_luma(int x, int y)														\n"
+	"{																					\n"
+	"	return uint(round(16.0 + 219.0*clamp(get_ycbcr(x, y).x, 0.0, 1.0)));			\n"
+	"}																					\n"
+	"																					\n"
+	"// Average of the 2x2 block at x, taken from lines y0 and y1.						\n"
+	"void get_chroma(int x, int y0, int y1, out uint cb, out uint cr)					\n"
+	"{																					\n"
+	"	vec2 c = (get_ycbcr(x, y0).yz + get_ycbcr(x+1, y0).yz							\n"
+	"			+ get_ycbcr(x, y1).yz + get_ycbcr(x+1, y1).yz) * 0.25;					\n"
+	"	cb = uint(round(128.0 + 224.0*clamp(c.x, -0.5, 0.5)));							\n"
+	"	cr = uint(round(128.0 + 224.0*clamp(c.y, -0.5, 0.5)));							\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 pack_nv12(int x, int y)														\n"
+	"{																					\n"
+	"	int height = textureSize(background, 0).y;										\n"
+	"	if(y < height)																	\n"
+	"		return to_bytes(get_luma(x*4, y), get_luma(x*4+1, y), get_luma(x*4+2, y), get_luma(x*4+3, y));\n"
+	"																					\n"
+	"	int row = y - height;															\n"
+	"	int y0  = interlaced ? (row/2)*4 + row%2 : row*2;								\n"
+	"	int y1  = min(y0 + (interlaced ? 2 : 1), height-1);								\n"
+	"																					\n"
+	"	uint cb0, cr0, cb1, cr1;														\n"
+	"	get_chroma(x*4,   y0, y1, cb0, cr0);											\n"
+	"	get_chroma(x*4+2, y0, y1, cb1, cr1);											\n"
+	"	return to_bytes(cb0, cr0, cb1, cr1);											\n"
+	"}																					\n"
+	"																					\n"
+	"// Area average of the source pixels under pixel x, y of the target, which is one field\n"
+	"// of the scaled frame unless field is progressive (3). The lower field (1) is odd lines.\n"
+	"vec4 scale_pixel(int x, int y)														\n"
+	"{																					\n"
+	"	ivec2 size  = textureSize(background, 0);										\n"
+	"	int   rows  = field == 3 ? 1 : 2;												\n"
+	"	int   line  = y*rows + (field == 1 ? 1 : 0);									\n"
+	"	vec2  ratio = vec2(size) / vec2(target_width, target_height*rows);				\n"
+	"	vec2  first = vec2(x, line) * ratio;											\n"
+	"	vec2  last  = first + ratio;													\n"
+	"																					\n"
+	"	vec4  sum	 = vec4(0.0);														\n"
+	"	float weight = 0.0;																\n"
+	"	for(int sy = int(first.y); sy < min(int(ceil(last.y)), int(first.y)+8); ++sy)	\n"
+	"	{																				\n"
+	"		float wy = min(last.y, float(sy+1)) - max(first.y, float(sy));				\n"
+	"		for(int sx = int(first.x); sx < min(int(ceil(last.x)), int(first.x)+8); ++sx)\n"
+	"		{																			\n"
+	"			float w = wy * (min(last.x, float(sx+1)) - max(first.x, float(sx)));	\n"
+	"			sum	   += w * texelFetch(background, min(ivec2(sx, sy), size-1), 0);	\n"
+	"			weight += w;															\n"
+	"		}																			\n"
+	"	}																				\n"
+	"	return sum / max(weight, 0.0001);												\n"
+	"}																					\n"
+	"																					\n"
+	"void main()																		\n"
+	"{																					\n"
+	"	int x = int(gl_FragCoord.x);													\n"
+	"	int y = int(gl_FragCoord.y);													\n"
+	"																					\n"
+	"	if(scale)																		\n"
+	"	{																				\n"
+	"		gl_FragColor = scale_pixel(x, y);											\n"
+	"		return;																		\n"
+	"	}																				\n"
+	"																					\n"
+	"	if(split != 0)																	\n"
+	"	{																				\n"
+	"		int rows  = textureSize(background, 0).y/2;									\n"
+	"		sub_image = y / rows;														\n"
+	"		y		 -= sub_image*rows;													\n"
+	"	}																				\n"
+	"																					\n"
+	"	if(interleave)																	\n"
+	"	{																				\n"
+	"		if(y % 2 == 0)																\n"
+	"			gl_FragColor = texelFetch(background, ivec2(x, y / 2), 0);				\n"
+	"		else																		\n"
+	"			gl_FragColor = texelFetch(lower, ivec2(x, y / 2), 0);					\n"
+	"	}																				\n"
+	"	else if(key_only)																\n"
+	"		gl_FragColor = texelFetch(background, ivec2(x, y), 0).aaaa;					\n"
+	"	else if(packing == 2)															\n"
+	"		gl_FragColor = pack_v210(x, y);												\n"
+	"	else if(packing == 3)															\n"
+	"		gl_FragColor = pack_nv12(x, y);												\n"
+	"	else																			\n"
+	"		gl_FragColor = pack_uyvy(x, y);												\n"
+	"}																					\n";
+}
+
+// Passes of the chroma keyer: the matte at half resolution, its horizontal and vertical blur, and the composite 
+// which applies it with spill suppression at full resolution.
+std::string get_keyer_fragment()
+{
+	return
+
+	"#version 130																		\n"
+	"uniform sampler2D	source;															\n"
+	"uniform sampler2D	matte;															\n"
+	"uniform int		pass;															\n"
+	"uniform int		chroma_mode;													\n"
+	"uniform vec2		chroma_blend;													\n"
+	"uniform float		chroma_spill;													\n"
+	"uniform bool		show_mask;														\n"
+	"uniform int		radius;															\n"
+	"uniform float		sigma;															\n"
+	"uniform vec4		bounds;															\n"
+	"																					\n"
+
+	+
+
+	get_chroma_glsl()
+
+	+
+
+	"																					\n"
+	"// How far the color is towards the key color.										\n"
+	"float key_distance(vec4 c)															\n"
+	"{																					\n"
+	"	if(chroma_mode == 1)															\n"
+	"		return fma(2.0, c.g, -c.r - c.b)/2.0;										\n"
+	"	if(chroma_mode == 2)															\n"
+	"		return fma(2.0, c.b, -c.r - c.g)/2.0;										\n"
+	"	return 0.0;																		\n"
+	"}																					\n"
+	"																					\n"
+	"float get_matte(vec4 c)															\n"
+	"{																					\n"
+	"	return chroma_mode == 0 ? 1.0 : alpha_map(key_distance(c));						\n"
+	"}																					\n"
+	"																					\n"
+	"// Samples in the middle of 2x2 source pixels, which filtering averages.			\n"
+	"float downsample()																	\n"
+	"{																					\n"
+	"	vec2 st = gl_FragCoord.xy * 2.0 / vec2(textureSize(source, 0));					\n"
+	"	return get_matte(texture2D(source, st).bgra);									\n"
+	"}																					\n"
+	"																					\n"
+	"// Taps stay within the bounds, outside of which the matte is not computed.		\n"
+	"float blur(vec2 direction)															\n"
+	"{																					\n"
+	"	vec2  size	 = vec2(textureSize(matte, 0));										\n"
+	"	float sum	 = 0.0;																\n"
+	"	float weight = 0.0;																\n"
+	"	for(int n = -radius; n <= radius; ++n)											\n"
+	"	{																				\n"
+	"		vec2  pos = clamp(gl_FragCoord.xy + direction*float(n), bounds.xy, bounds.zw);\n"
+	"		float w	  = exp(-float(n*n) / (2.0*sigma*sigma));							\n"
+	"		sum		 += texture2D(matte, pos / size).r * w;								\n"
+	"		weight	 += w;																\n"
+	"	}																				\n"
+	"	return sum / weight;															\n"
+	"}																					\n"
+	"																					\n"
+	"vec4 composite()																	\n"
+	"{																					\n"
+	"	vec4  c = texelFetch(source, ivec2(gl_FragCoord.xy), 0).bgra;					\n"
+	"	float m = texture2D(matte, gl_FragCoord.xy * 0.5 / vec2(textureSize(matte, 0))).r;\n"
+	"	if(show_mask)																	\n"
+	"		return vec4(m, m, m, 1.0);													\n"
+	"	return supress_spill(c * m, key_distance(c));									\n"
+	"}																					\n"
+	"																					\n"
+	"void main()																		\n"
+	"{																					\n"
+	"	if(pass == 0)																	\n"
+	"		gl_FragColor = vec4(downsample());											\n"
+	"	else if(pass == 1)																\n"
+	"		gl_FragColor = vec4(blur(vec2(1.0, 0.0)));									\n"
+	"	else if(pass == 2)																\n"
+	"		gl_FragColor = vec4(blur(vec2(0.0, 1.0)));									\n"
+	"	else																			\n"
+	"		gl_FragColor = composite().bgra;											\n"
+	"}																					\n";
+}
+
+safe_ptr<shader> get_packing_shader(ogl_device& ogl)
+{
+	tbb::mutex::scoped_lock lock(g_shader_mutex);
+
+	auto& shaders = g_device_shaders[&ogl];
+
+	if(!shaders.packing)
+		shaders.packing.reset(new shader(get_vertex(), get_packing_fragment()));
+
+	return make_safe_ptr(shaders.packing);
+}
+
+safe_ptr<shader> get_keyer_shader(ogl_device& ogl)
+{
+	tbb::mutex::scoped_lock lock(g_shader_mutex);
+
+	auto& shaders = g_device_shaders[&ogl];
+
+	if(!shaders.keyer)
+		shaders.keyer.reset(new shader(get_vertex(), get_keyer_fragment()));
+
+	return make_safe_ptr(shaders.keyer);
 }
 
 }}
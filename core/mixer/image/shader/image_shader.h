@@ -41,11 +41,56 @@ struct texture_id
 		local_key,
 		layer_key,
 		background,
+		before0,	// Planes of the frames before and after a deinterlaced frame.
+		before1,
+		before2,
+		before3,
+		after0,
+		after1,
+		after2,
+		after3,
+		color_lut,	// The 3D lut of the color adjustments.
 	};
 };
 
+// Draw state which specialized shader variants have compiled in as constants instead of selecting 
+// it through uniforms.
+struct image_shader_key
+{
+	int		pixel_format;
+	bool	has_local_key;
+	bool	has_layer_key;
+	int		blend_mode;
+	int		keyer;
+	int		chroma_mode;
+	bool	color_lut; // Levels, contrast, saturation, brightness and .cube luts, see color_lut.h.
+	bool	post_processing;
+	int		deinterlace; // The field_mode which is kept, 0 when not deinterlacing.
+	bool	motion_blur; // Along frame_transform::motion_blur.
+
+	image_shader_key();
+
+	bool operator<(const image_shader_key& other) const;
+};
+
+// Returns the generic shader, the common specialized variants are built along with it.
 safe_ptr<shader> get_image_shader(
 		ogl_device& ogl, bool& blend_modes, bool& post_processing);
 
+// Returns the specialized variant for the key or nullptr if it is not available yet, in which case 
+// it is built asynchronously and the generic shader should be used in the meantime.
+std::shared_ptr<shader> get_image_shader(ogl_device& ogl, const image_shader_key& key);
+
+// Starts building the variants which are otherwise built on first use, for color adjustments and deinterlacing 
+// of every pixel format. The generic shader has to be built first.
+void prewarm_image_shaders(ogl_device& ogl);
+
+// Returns the shader which packs a bgra image into the formats of output_packing, extracts its key or 
+// interleaves two fields into a frame.
+safe_ptr<shader> get_packing_shader(ogl_device& ogl);
+
+// Returns the shader of the passes of image_kernel::chroma_key.
+safe_ptr<shader> get_keyer_shader(ogl_device& ogl);
+
 
 }}
\ No newline at end of file
@@ -27,11 +27,14 @@
 #include "write_frame.h"
 
 #include "audio/audio_mixer.h"
+#include "audio/loudness_meter.h"
 #include "image/image_mixer.h"
 
 #include <common/env.h>
 #include <common/concurrency/executor.h>
 #include <common/concurrency/future_util.h>
+#include <common/concurrency/lock.h>
+#include <common/diagnostics/trace.h>
 #include <common/exception/exceptions.h>
 #include <common/gl/gl_check.h>
 #include <common/utility/tweener.h>
@@ -57,28 +60,54 @@
 #include <tbb/spin_mutex.h>
 #include <tbb/atomic.h>
 
+#include <deque>
 #include <unordered_map>
 
 namespace caspar { namespace core {
+
+// An extra output raster, scaled from the channel image on the gpu.
+struct output_raster
+{
+	video_format_desc	format_desc;
+	int					ticks;	// Channel frames per raster frame, one or two.
+	bool				fields; // The two channel frames are the fields of an interlaced raster frame.
+	int					phase;	// Channel frames of the current raster frame so far.
+	audio_buffer		audio;	// Of those channel frames.
+};
 		
 struct mixer::implementation : boost::noncopyable
 {		
 	safe_ptr<diagnostics::graph>	graph_;
+	diagnostics::graph::line_handle	mix_time_line_;
+	diagnostics::graph::line_handle	gpu_lines_[4]; // draw, key, post and output.
 	boost::timer					mix_timer_;
 	tbb::atomic<int64_t>			current_mix_time_;
+	tbb::atomic<int>				mix_load_; // Per mille of the frame duration.
+	tbb::atomic<int>				degradations_;
 
 	safe_ptr<mixer::target_t>		target_;
-	mutable tbb::spin_mutex			format_desc_mutex_;
+	mutable profiled_mutex<tbb::spin_mutex> format_desc_mutex_;
 	video_format_desc				format_desc_;
 	safe_ptr<ogl_device>			ogl_;
 	channel_layout					audio_channel_layout_;
 	bool							straighten_alpha_;
+	output_packing::type			output_packing_;
+	output_split::type				output_split_;
+	bool							key_output_;
+	size_t							readback_depth_;
+	std::deque<safe_ptr<read_frame>> readback_ring_;
+	std::function<int()>			image_usage_;
+	std::vector<video_format_desc>	raster_formats_;
+	std::vector<output_raster>		rasters_;
 	
 	audio_mixer	audio_mixer_;
 	image_mixer image_mixer_;
+	loudness_meter loudness_meter_;
 	
 	std::unordered_map<int, blend_mode> blend_modes_;
 			
+	int64_t							 frame_count_;
+
 	executor executor_;
 	safe_ptr<monitor::subject>		 monitor_subject_;
 
@@ -86,19 +115,38 @@ public:
 	implementation(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<mixer::target_t>& target, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout) 
 		: graph_(graph)
 		, target_(target)
+		, format_desc_mutex_("mixer.format-desc")
 		, format_desc_(format_desc)
 		, ogl_(ogl)
 		, audio_channel_layout_(audio_channel_layout)
 		, straighten_alpha_(false)
+		, output_packing_(output_packing::none)
+		, output_split_(output_split::none)
+		, key_output_(false)
+		, readback_depth_(0)
 		, audio_mixer_(graph_)
-		, image_mixer_(ogl)
+		, image_mixer_(ogl, graph_)
+		, loudness_meter_(env::properties().get(L"configuration.mixer.loudness-interval", 100))
+		, frame_count_(0)
 		, executor_(L"mixer")
 		, monitor_subject_(make_safe<monitor::subject>("/mixer"))
 	{			
 		graph_->set_color("mix-time", diagnostics::color(1.0f, 0.0f, 0.9f, 0.8));
+		graph_->set_color("gpu-draw", diagnostics::color(0.3f, 0.6f, 1.0f, 0.8));
+		graph_->set_color("gpu-key", diagnostics::color(0.3f, 1.0f, 0.6f, 0.8));
+		graph_->set_color("gpu-post", diagnostics::color(0.6f, 0.3f, 1.0f, 0.8));
+		graph_->set_color("gpu-output", diagnostics::color(1.0f, 0.6f, 0.3f, 0.8));
+		mix_time_line_	= graph_->get_line("mix-time");
+		gpu_lines_[0]	= graph_->get_line("gpu-draw");
+		gpu_lines_[1]	= graph_->get_line("gpu-key");
+		gpu_lines_[2]	= graph_->get_line("gpu-post");
+		gpu_lines_[3]	= graph_->get_line("gpu-output");
 		current_mix_time_ = 0;
+		mix_load_ = 0;
+		degradations_ = 0;
 
 		audio_mixer_.monitor_output().attach_parent(monitor_subject_);
+		loudness_meter_.monitor_output().attach_parent(monitor_subject_);
 	}
 	
 	void send(const std::pair<std::map<int, safe_ptr<core::basic_frame>>, std::shared_ptr<void>>& packet)
@@ -109,6 +157,8 @@ public:
 			{
 				mix_timer_.restart();
 
+				diagnostics::trace::scope trace("mixer.mix", ++frame_count_);
+
 				auto frames = packet.first;
 				int timecode = std::numeric_limits<int>().max();
 				
@@ -124,15 +174,70 @@ public:
 					timecode = std::min(timecode, frame.second->get_timecode());
 				}
 
-				auto image = image_mixer_(format_desc_, straighten_alpha_);
+				auto usage = image_usage_ ? image_usage_() : static_cast<int>(image_usage::host);
+				image_mixer_.set_degradations(degradations_);
+				auto image = image_mixer_(format_desc_, straighten_alpha_, output_packing_, key_output_, output_split_, usage, get_raster_passes(usage));
 				auto audio = audio_mixer_(format_desc_, audio_channel_layout_);
+				loudness_meter_.push(audio, format_desc_, audio_channel_layout_);
+
+				BOOST_FOREACH(auto& raster, rasters_)
+					raster.audio.insert(raster.audio.end(), audio.begin(), audio.end());
+
 				image.wait();
 
 				auto mix_time = mix_timer_.elapsed();
-				graph_->set_value("mix-time", mix_time*format_desc_.fps*0.5);
+				graph_->set_value(mix_time_line_, mix_time*format_desc_.fps*0.5);
 				current_mix_time_ = static_cast<int64_t>(mix_time * 1000.0);
+				mix_load_ = static_cast<int>(mix_time*format_desc_.fps*1000.0);
+
+				auto rendered = image.get();
+
+				if(monitor_subject_->is_observed())
+				{
+					*monitor_subject_ << monitor::message("/buffers/device/bytes") % ogl_->device_bytes()
+									  << monitor::message("/buffers/host/bytes")   % ogl_->host_bytes()
+									  << monitor::message("/buffers/pageable/bytes") % ogl_->pageable_bytes();
+				}
+
+				publish_gpu_times(image_mixer_.last_gpu_times());
+
+				read_frame::raster_frames raster_frames;
+				BOOST_FOREACH(auto& raster_image, rendered.rasters)
+				{
+					auto& raster = rasters_.at(raster_image.first);
+					raster_frames.push_back(std::make_pair(raster.format_desc.format, make_safe<read_frame>(ogl_, raster.format_desc.size, std::move(raster_image.second), std::shared_ptr<host_buffer>(), output_packing::none, std::shared_ptr<host_buffer>(), std::move(raster.audio), audio_channel_layout_, timecode)));
+				}
+
+				BOOST_FOREACH(auto& raster, rasters_)
+				{
+					if(++raster.phase < raster.ticks)
+						continue;
 
-				target_->send(std::make_pair(make_safe<read_frame>(ogl_, format_desc_.size, std::move(image.get()), std::move(audio), audio_channel_layout_, timecode), packet.second));
+					raster.phase = 0;
+					raster.audio.clear();
+				}
+
+				// More arguments than make_safe forwards.
+				auto frame = safe_ptr<read_frame>(new read_frame(ogl_, format_desc_.size, std::move(rendered.image), std::move(rendered.packed_image), rendered.packing, std::move(rendered.key_image), std::move(audio), audio_channel_layout_, timecode, rendered.split, rendered.texture, raster_frames));
+
+				if(readback_depth_ == 0 && readback_ring_.empty())
+				{
+					target_->send(std::make_pair(frame, packet.second));
+					return;
+				}
+
+				// Keep the latest frames reading back and pass on the oldest once it is complete. It takes the
+				// ticket of the received frame, which keeps the number of frames in the pipeline unchanged.
+				readback_ring_.push_back(frame);
+
+				while(readback_ring_.size() > readback_depth_)
+				{
+					auto oldest = readback_ring_.front();
+					readback_ring_.pop_front();
+
+					oldest->prepare();
+					target_->send(std::make_pair(oldest, packet.second));
+				}
 			}
 			catch(...)
 			{
@@ -141,6 +246,99 @@ public:
 		});		
 	}
 					
+	// Progressive rasters at half the channel rate are only scaled on the frame which completes them.
+	std::vector<raster_pass> get_raster_passes(int usage) const
+	{
+		std::vector<raster_pass> passes;
+
+		if(!(usage & image_usage::raster))
+			return passes;
+
+		for(size_t n = 0; n < rasters_.size(); ++n)
+		{
+			auto& raster = rasters_[n];
+			bool complete = raster.phase == raster.ticks-1;
+
+			if(!raster.fields && !complete)
+				continue;
+
+			raster_pass pass;
+			pass.index		= static_cast<int>(n);
+			pass.width		= raster.format_desc.width;
+			pass.height		= raster.format_desc.height;
+			pass.complete	= complete;
+
+			if(raster.fields)
+			{
+				bool upper_first = raster.format_desc.field_mode == field_mode::upper;
+				pass.field = complete == upper_first ? field_mode::lower : field_mode::upper;
+			}
+
+			passes.push_back(pass);
+		}
+
+		return passes;
+	}
+
+	// Rasters at the frame rate of the channel are scaled from every frame, those at half the rate from every 
+	// other frame or, when interlaced, from the fields of two. Other rates would need a frame rate conversion.
+	void update_rasters()
+	{
+		rasters_.clear();
+
+		BOOST_FOREACH(auto& raster_desc, raster_formats_)
+		{
+			auto channel_rate	= static_cast<uint64_t>(format_desc_.time_scale) * raster_desc.duration;
+			auto raster_rate	= static_cast<uint64_t>(raster_desc.time_scale) * format_desc_.duration;
+
+			output_raster raster;
+			raster.format_desc	= raster_desc;
+			raster.ticks		= 0;
+			raster.fields		= false;
+			raster.phase		= 0;
+
+			bool progressive = format_desc_.field_mode == field_mode::progressive;
+
+			if(progressive && channel_rate == raster_rate)
+				raster.ticks = 1;
+			else if(progressive && channel_rate == raster_rate*2)
+			{
+				raster.ticks	= 2;
+				raster.fields	= raster_desc.field_mode != field_mode::progressive;
+			}
+
+			if(raster.ticks == 0)
+			{
+				CASPAR_LOG(warning) << L"[mixer] Cannot derive the " << raster_desc.name << L" raster from " << format_desc_.name << L", ignoring it.";
+				continue;
+			}
+
+			rasters_.push_back(raster);
+		}
+	}
+
+	void publish_gpu_times(const gpu_times& times)
+	{
+		graph_->set_value(gpu_lines_[0], times.draw*format_desc_.fps*0.5);
+		graph_->set_value(gpu_lines_[1], times.key*format_desc_.fps*0.5);
+		graph_->set_value(gpu_lines_[2], times.post*format_desc_.fps*0.5);
+		graph_->set_value(gpu_lines_[3], times.output*format_desc_.fps*0.5);
+
+		if(!monitor_subject_->is_observed())
+			return;
+
+		auto layers = monitor::message("/gpu/layers");
+		BOOST_FOREACH(auto time, times.layers)
+			layers % static_cast<float>(time);
+
+		*monitor_subject_ << monitor::message("/gpu/draw")	 % static_cast<float>(times.draw)
+						  << monitor::message("/gpu/key")	 % static_cast<float>(times.key)
+						  << monitor::message("/gpu/post")	 % static_cast<float>(times.post)
+						  << monitor::message("/gpu/output") % static_cast<float>(times.output)
+						  << monitor::message("/gpu/draw-calls") % image_mixer_.draw_calls()
+						  << layers;
+	}
+					
 	safe_ptr<core::write_frame> create_frame(
 			const void* tag,
 			const core::pixel_format_desc& desc,
@@ -213,6 +411,95 @@ public:
 		});
 	}
 
+	void set_output_packing(output_packing::type value)
+	{
+        executor_.begin_invoke([=]
+        {
+			output_packing_ = value;
+        }, high_priority);
+	}
+
+	output_packing::type get_output_packing()
+	{
+		return executor_.invoke([=]
+		{
+			return output_packing_;
+		});
+	}
+
+	void set_output_split(output_split::type value)
+	{
+        executor_.begin_invoke([=]
+        {
+			output_split_ = value;
+        }, high_priority);
+	}
+
+	output_split::type get_output_split()
+	{
+		return executor_.invoke([=]
+		{
+			return output_split_;
+		});
+	}
+
+	void set_readback_depth(size_t value)
+	{
+        executor_.begin_invoke([=]
+        {
+			readback_depth_ = value;
+        }, high_priority);
+	}
+
+	size_t get_readback_depth()
+	{
+		return executor_.invoke([=]
+		{
+			return readback_depth_;
+		});
+	}
+
+	void set_image_usage(const std::function<int()>& usage)
+	{
+        executor_.begin_invoke([=]
+        {
+			image_usage_ = usage;
+        }, high_priority);
+	}
+
+	void set_output_rasters(const std::vector<video_format_desc>& rasters)
+	{
+        executor_.begin_invoke([=]
+        {
+			raster_formats_ = rasters;
+			update_rasters();
+        }, high_priority);
+	}
+
+	std::vector<video_format_desc> get_output_rasters()
+	{
+		return executor_.invoke([=]
+		{
+			return raster_formats_;
+		});
+	}
+
+	void set_key_output(bool value)
+	{
+        executor_.begin_invoke([=]
+        {
+			key_output_ = value;
+        }, high_priority);
+	}
+
+	bool get_key_output()
+	{
+		return executor_.invoke([=]
+		{
+			return key_output_;
+		});
+	}
+
 	float get_master_volume()
 	{
 		return executor_.invoke([=]
@@ -233,14 +520,17 @@ public:
 	{
 		executor_.begin_invoke([=]
 		{
-			tbb::spin_mutex::scoped_lock lock(format_desc_mutex_);
-			format_desc_ = format_desc;
+			{
+				profiled_mutex<tbb::spin_mutex>::scoped_lock lock(format_desc_mutex_);
+				format_desc_ = format_desc;
+			}
+			update_rasters();
 		});
 	}
 
 	core::video_format_desc get_video_format_desc() const // nothrow
 	{
-		tbb::spin_mutex::scoped_lock lock(format_desc_mutex_);
+		profiled_mutex<tbb::spin_mutex>::scoped_lock lock(format_desc_mutex_);
 		return format_desc_;
 	}
 
@@ -248,6 +538,11 @@ public:
 	{
 		boost::property_tree::wptree info;
 		info.add(L"mix-time", current_mix_time_);
+		info.add(L"culled-items", image_mixer_.culled_count());
+		info.add(L"static-layers", image_mixer_.static_count());
+		info.add(L"draw-calls", image_mixer_.draw_calls());
+		info.add(L"readback-depth", readback_depth_);
+		info.add_child(L"buffers", ogl_->info());
 
 		return wrap_as_future(std::move(info));
 	}
@@ -274,6 +569,24 @@ void mixer::clear_blend_mode(int index) { impl_->clear_blend_mode(index); }
 void mixer::clear_blend_modes() { impl_->clear_blend_modes(); }
 void mixer::set_straight_alpha_output(bool value) { impl_->set_straight_alpha_output(value); }
 bool mixer::get_straight_alpha_output() { return impl_->get_straight_alpha_output(); }
+void mixer::set_output_packing(output_packing::type value) { impl_->set_output_packing(value); }
+output_packing::type mixer::get_output_packing() { return impl_->get_output_packing(); }
+void mixer::set_output_split(output_split::type value) { impl_->set_output_split(value); }
+output_split::type mixer::get_output_split() { return impl_->get_output_split(); }
+void mixer::set_readback_depth(size_t value) { impl_->set_readback_depth(value); }
+void mixer::set_thread_placement(const thread_placement& placement){impl_->executor_.set_placement(placement);}
+void mixer::set_parallel_arena(const std::shared_ptr<parallel_arena>& arena){impl_->executor_.set_arena(arena);}
+size_t mixer::get_readback_depth() { return impl_->get_readback_depth(); }
+void mixer::set_key_output(bool value) { impl_->set_key_output(value); }
+bool mixer::get_key_output() { return impl_->get_key_output(); }
+void mixer::set_output_rasters(const std::vector<video_format_desc>& rasters) { impl_->set_output_rasters(rasters); }
+std::vector<video_format_desc> mixer::get_output_rasters() { return impl_->get_output_rasters(); }
+void mixer::set_image_usage(const std::function<int()>& usage) { impl_->set_image_usage(usage); }
+void mixer::set_degradations(int degradations) { impl_->degradations_ = degradations; }
+void mixer::set_background(bool value) { impl_->image_mixer_.set_background(value); }
+int mixer::get_degradations() const { return impl_->degradations_; }
+bool mixer::supports(pixel_format::type format) const { return impl_->ogl_->supports(get_texture_compression(format)); }
+double mixer::mix_load() const { return impl_->mix_load_ / 1000.0; }
 float mixer::get_master_volume() { return impl_->get_master_volume(); }
 void mixer::set_master_volume(float volume) { impl_->set_master_volume(volume); }
 void mixer::set_video_format_desc(const video_format_desc& format_desc){impl_->set_video_format_desc(format_desc);}
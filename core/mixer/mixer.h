@@ -22,6 +22,7 @@
 #pragma once
 
 #include "image/blend_modes.h"
+#include "output_packing.h"
 
 #include "../producer/frame/frame_factory.h"
 #include "../monitor/monitor.h"
@@ -33,11 +34,15 @@
 #include <boost/property_tree/ptree_fwd.hpp>
 #include <boost/thread/future.hpp>
 
+#include <functional>
 #include <map>
+#include <vector>
 
 namespace caspar { 
 
 class executor;
+struct thread_placement;
+class parallel_arena;
 	
 namespace core {
 
@@ -76,6 +81,24 @@ public:
 	void clear_blend_modes();
 	void set_straight_alpha_output(bool value);
 	bool get_straight_alpha_output();
+	void set_output_packing(output_packing::type value);
+	output_packing::type get_output_packing();
+	void set_output_split(output_split::type value); // Only applies with uyvy or v210 packing.
+	output_split::type get_output_split();
+	void set_readback_depth(size_t value); // Frames kept reading back before they are sent, adds the same latency.
+	void set_thread_placement(const thread_placement& placement);
+	void set_parallel_arena(const std::shared_ptr<parallel_arena>& arena);
+	size_t get_readback_depth();
+	void set_key_output(bool value); // Render the key on the gpu for key-only consumers.
+	bool get_key_output();
+	void set_image_usage(const std::function<int()>& usage); // Asked once per frame for the image_usage flags.
+	void set_output_rasters(const std::vector<video_format_desc>& rasters); // Scaled from the channel image for raster consumers.
+	std::vector<video_format_desc> get_output_rasters();
+	void set_degradations(int degradations); // degradation::type flags, see load_governor.
+	void set_background(bool value); // For mixers which are not on air, see image_mixer::set_background.
+	virtual int get_degradations() const override;
+	virtual bool supports(pixel_format::type format) const override;
+	double mix_load() const; // The last mix time over the frame duration.
 
 	float get_master_volume();
 	void set_master_volume(float volume);
@@ -0,0 +1,118 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../StdAfx.h"
+
+#include "output_packing.h"
+
+#include <boost/algorithm/string.hpp>
+
+namespace caspar { namespace core {
+
+output_packing::type get_output_packing(const std::wstring& str)
+{
+	if(boost::iequals(str, L"uyvy"))
+		return output_packing::uyvy;
+	else if(boost::iequals(str, L"v210"))
+		return output_packing::v210;
+	else if(boost::iequals(str, L"nv12"))
+		return output_packing::nv12;
+
+	return output_packing::none;
+}
+
+std::wstring get_output_packing(output_packing::type packing)
+{
+	switch(packing)
+	{
+	case output_packing::uyvy:
+		return L"uyvy";
+	case output_packing::v210:
+		return L"v210";
+	case output_packing::nv12:
+		return L"nv12";
+	default:
+		return L"none";
+	}
+}
+
+uint32_t get_packed_row_bytes(output_packing::type packing, uint32_t width)
+{
+	switch(packing)
+	{
+	case output_packing::uyvy:
+		return width*2;
+	case output_packing::v210:
+		return ((width + 47) / 48) * 128;
+	case output_packing::nv12:
+		return width;
+	default:
+		return width*4;
+	}
+}
+
+uint32_t get_packed_rows(output_packing::type packing, uint32_t height)
+{
+	return packing == output_packing::nv12 ? height + height / 2 : height;
+}
+
+uint32_t get_packed_size(output_packing::type packing, uint32_t width, uint32_t height)
+{
+	return get_packed_row_bytes(packing, width) * get_packed_rows(packing, height);
+}
+
+output_split::type get_output_split(const std::wstring& str)
+{
+	if(boost::iequals(str, L"quad"))
+		return output_split::quad;
+	else if(boost::iequals(str, L"2si"))
+		return output_split::two_sample_interleave;
+
+	return output_split::none;
+}
+
+std::wstring get_output_split(output_split::type split)
+{
+	switch(split)
+	{
+	case output_split::quad:
+		return L"quad";
+	case output_split::two_sample_interleave:
+		return L"2si";
+	default:
+		return L"none";
+	}
+}
+
+bool supports_split(output_packing::type packing)
+{
+	return packing == output_packing::uyvy || packing == output_packing::v210;
+}
+
+uint32_t get_packed_size(output_packing::type packing, uint32_t width, uint32_t height, output_split::type split)
+{
+	if(split == output_split::none)
+		return get_packed_size(packing, width, height);
+
+	return 4 * get_packed_size(packing, width / 2, height / 2);
+}
+
+}}
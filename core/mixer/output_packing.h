@@ -0,0 +1,79 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace caspar { namespace core {
+
+// Formats which the mixer can pack the channel output into on the gpu, in addition to the bgra image.
+struct output_packing
+{
+	enum type
+	{
+		none = 0,
+		uyvy,	// 8-bit 4:2:2, 2 bytes per pixel.
+		v210,	// 10-bit 4:2:2, 6 pixels per 16 bytes with rows padded to 128 bytes.
+		nv12,	// 8-bit 4:2:0, the luma plane followed by the interleaved chroma plane. What hardware encoders take.
+		count
+	};
+};
+
+// How a 2160 line channel is split into four 1080 line sub-images for quad-link SDI, when packed. The sub-images follow 
+// each other in the packed image, each packed as an image of half the width and height.
+struct output_split
+{
+	enum type
+	{
+		none = 0,
+		quad,					// Square division, top left, top right, bottom left, bottom right.
+		two_sample_interleave,	// 2SI, each sub-image takes every other pair of samples on every other line.
+		count
+	};
+};
+
+// What the consumers read of the channel output, so that the mixer can leave out the rest.
+struct image_usage
+{
+	enum type
+	{
+		host	= 1,	// The bgra image read back to host memory.
+		texture	= 2,	// The final image on the gpu, for consumers rendering with a context shared with the mixer.
+		raster	= 4		// The extra output rasters of the channel, see mixer::set_output_rasters.
+	};
+};
+
+output_packing::type get_output_packing(const std::wstring& str);
+std::wstring get_output_packing(output_packing::type packing);
+
+uint32_t get_packed_row_bytes(output_packing::type packing, uint32_t width);
+uint32_t get_packed_rows(output_packing::type packing, uint32_t height);
+uint32_t get_packed_size(output_packing::type packing, uint32_t width, uint32_t height);
+
+output_split::type get_output_split(const std::wstring& str);
+std::wstring get_output_split(output_split::type split);
+
+bool supports_split(output_packing::type packing);
+uint32_t get_packed_size(output_packing::type packing, uint32_t width, uint32_t height, output_split::type split);
+
+}}
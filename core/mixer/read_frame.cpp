@@ -27,6 +27,13 @@
 #include "gpu/host_buffer.h"	
 #include "gpu/ogl_device.h"
 
+#include <common/concurrency/lock.h>
+#include <common/memory/memcpy.h>
+#include <common/memory/pixel_kernels.h>
+#include <common/memory/tagged_allocator.h>
+
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/atomic.h>
 #include <tbb/mutex.h>
 
 #include <boost/chrono.hpp>
@@ -45,61 +52,250 @@ struct read_frame::implementation : boost::noncopyable
 {
 	safe_ptr<ogl_device>		ogl_;
 	uint32_t					size_;
-	safe_ptr<host_buffer>		image_data_;
-	tbb::mutex					mutex_;
+	std::shared_ptr<host_buffer> image_data_;
+	std::shared_ptr<host_buffer> packed_image_data_;
+	output_packing::type		packing_;
+	output_split::type			split_;
+	std::shared_ptr<host_buffer> key_image_data_;
+	profiled_mutex<tbb::mutex>	mutex_;
+	profiled_mutex<tbb::mutex>	key_mutex_;
+	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> cpu_key_;
 	audio_buffer				audio_data_;
 	channel_layout				audio_channel_layout_;
 	int64_t						created_timestamp_;
 	const int					frame_timecode_;
+	std::shared_ptr<device_buffer> image_texture_;
+	read_frame::raster_frames	rasters_;
+
+	profiled_mutex<tbb::mutex>	audio_mutex_;
+	// Converted for the consumers, on the first request for the sample format.
+	std::vector<int16_t, tagged_allocator<int16_t, allocation_subsystem::consumer, tbb::cache_aligned_allocator<int16_t>>>	audio_16_;
+	std::vector<int8_t, tagged_allocator<int8_t, allocation_subsystem::consumer, tbb::cache_aligned_allocator<int8_t>>>		audio_24_;
+	std::vector<float, tagged_allocator<float, allocation_subsystem::consumer, tbb::cache_aligned_allocator<float>>>			audio_float_;
+	std::vector<float, tagged_allocator<float, allocation_subsystem::consumer, tbb::cache_aligned_allocator<float>>>			audio_planar_;
+	tbb::atomic<bool>			has_audio_16_;
+	tbb::atomic<bool>			has_audio_24_;
+	tbb::atomic<bool>			has_audio_float_;
+	tbb::atomic<bool>			has_audio_planar_;
+
+	bool						is_held_;
+	profiled_mutex<tbb::mutex>	hold_mutex_;
+	std::weak_ptr<read_frame>	held_; // The copy made by hold, while anyone has it.
 
 public:
 	implementation(
 			const safe_ptr<ogl_device>& ogl,
 			uint32_t size,
-			safe_ptr<host_buffer>&& image_data,
+			std::shared_ptr<host_buffer>&& image_data,
+			std::shared_ptr<host_buffer>&& packed_image_data,
+			output_packing::type packing,
+			std::shared_ptr<host_buffer>&& key_image_data,
 			audio_buffer&& audio_data,
 			const channel_layout& audio_channel_layout,
-			const unsigned int frame_timecode
+			const unsigned int frame_timecode,
+			output_split::type split,
+			const std::shared_ptr<device_buffer>& image_texture,
+			const read_frame::raster_frames& rasters
 	) 
 		: ogl_(ogl)
 		, size_(size)
 		, image_data_(std::move(image_data))
+		, packed_image_data_(std::move(packed_image_data))
+		, packing_(packed_image_data_ ? packing : output_packing::none)
+		, split_(packed_image_data_ ? split : output_split::none)
+		, key_image_data_(std::move(key_image_data))
+		, mutex_("read_frame.image")
+		, key_mutex_("read_frame.key")
 		, audio_data_(std::move(audio_data))
 		, audio_channel_layout_(audio_channel_layout)
 		, created_timestamp_(get_current_time_millis())
 		, frame_timecode_(frame_timecode)
+		, image_texture_(image_texture)
+		, rasters_(rasters)
+		, audio_mutex_("read_frame.audio")
+		, is_held_(false)
+		, hold_mutex_("read_frame.hold")
 	{
+		has_audio_16_		= false;
+		has_audio_24_		= false;
+		has_audio_float_	= false;
+		has_audio_planar_	= false;
 	}	
 	
 	const boost::iterator_range<const uint8_t*> image_data()
 	{
+		if(!image_data_)
+			return boost::iterator_range<const uint8_t*>();
+
+		return map(*image_data_);
+	}
+
+	const boost::iterator_range<const uint8_t*> packed_image_data()
+	{
+		if(!packed_image_data_)
+			return boost::iterator_range<const uint8_t*>();
+
+		return map(*packed_image_data_);
+	}
+
+	const boost::iterator_range<const uint8_t*> key_image_data()
+	{
+		if(key_image_data_)
+			return map(*key_image_data_);
+
+		// The mixer did not render the key, extract it once for all consumers.
+		profiled_mutex<tbb::mutex>::scoped_lock lock(key_mutex_);
+
+		if(cpu_key_.empty())
+		{
+			auto image = image_data();
+			cpu_key_.resize(image.size());
+			broadcast_alpha(cpu_key_.data(), image.begin(), image.size() / 4);
+		}
+
+		return boost::iterator_range<const uint8_t*>(cpu_key_.data(), cpu_key_.data() + cpu_key_.size());
+	}
+
+	void prepare()
+	{
+		if(image_data_)
+			map(*image_data_);
+
+		if(packed_image_data_)
+			map(*packed_image_data_);
+
+		if(key_image_data_)
+			map(*key_image_data_);
+
+		BOOST_FOREACH(auto& raster, rasters_)
+			raster.second->prepare();
+	}
+
+	std::shared_ptr<read_frame> raster(video_format::type format) const
+	{
+		BOOST_FOREACH(auto& raster, rasters_)
 		{
-			tbb::mutex::scoped_lock lock(mutex_);
+			if(raster.first == format)
+				return raster.second;
+		}
 
-			if(!image_data_->data())
+		return nullptr;
+	}
+
+	std::shared_ptr<implementation> copy_held()
+	{
+		auto held_rasters = rasters_;
+		BOOST_FOREACH(auto& raster, held_rasters)
+			raster.second = hold(raster.second);
+
+		auto audio = audio_data_;
+		auto copy = std::shared_ptr<implementation>(new implementation(
+				ogl_, size_, copy_pageable(image_data_), copy_pageable(packed_image_data_), packing_, copy_pageable(key_image_data_), 
+				std::move(audio), audio_channel_layout_, frame_timecode_, split_, nullptr, held_rasters));
+
+		copy->created_timestamp_ = created_timestamp_;
+		copy->is_held_			 = true;
+		return copy;
+	}
+
+	std::shared_ptr<host_buffer> copy_pageable(const std::shared_ptr<host_buffer>& buffer)
+	{
+		if(!buffer)
+			return nullptr;
+
+		auto source = map(*buffer);
+		auto copy	= ogl_->create_pageable_buffer(static_cast<uint32_t>(source.size()));
+		fast_memcpy(copy->data(), source.begin(), source.size());
+		return copy;
+	}
+
+	const boost::iterator_range<const uint8_t*> map(host_buffer& buffer)
+	{
+		{
+			profiled_mutex<tbb::mutex>::scoped_lock lock(mutex_);
+
+			if(!buffer.data())
 			{
-				image_data_.get()->wait(*ogl_);
-				ogl_->invoke([=]{image_data_.get()->map();}, high_priority);
+				buffer.wait(*ogl_);
+				ogl_->invoke([&]{buffer.map();}, high_priority);
 			}
 		}
 
-		auto ptr = static_cast<const uint8_t*>(image_data_->data());
-		return boost::iterator_range<const uint8_t*>(ptr, ptr + image_data_->size());
+		auto ptr = static_cast<const uint8_t*>(buffer.data());
+		return boost::iterator_range<const uint8_t*>(ptr, ptr + buffer.size());
 	}
 	const boost::iterator_range<const int32_t*> audio_data()
 	{
 		return boost::iterator_range<const int32_t*>(audio_data_.data(), audio_data_.data() + audio_data_.size());
 	}
+
+	// Converts on the first call, later calls only read the flag.
+	template<typename T, typename A, typename Func>
+	const boost::iterator_range<const T*> converted_audio(std::vector<T, A>& buffer, tbb::atomic<bool>& is_converted, std::size_t size, const Func& convert)
+	{
+		if(!is_converted)
+		{
+			profiled_mutex<tbb::mutex>::scoped_lock lock(audio_mutex_);
+
+			if(!is_converted)
+			{
+				buffer.resize(size);
+				if(!audio_data_.empty())
+					convert(buffer.data());
+				is_converted = true;
+			}
+		}
+
+		return boost::iterator_range<const T*>(buffer.data(), buffer.data() + buffer.size());
+	}
+
+	const boost::iterator_range<const int16_t*> audio_data_16()
+	{
+		return converted_audio(audio_16_, has_audio_16_, audio_data_.size(), [this](int16_t* dest)
+		{
+			audio_32_to_16(audio_data_.data(), dest, audio_data_.size());
+		});
+	}
+
+	const boost::iterator_range<const int8_t*> audio_data_24()
+	{
+		return converted_audio(audio_24_, has_audio_24_, audio_data_.size() * 3, [this](int8_t* dest)
+		{
+			audio_32_to_24(audio_data_.data(), dest, audio_data_.size());
+		});
+	}
+
+	const boost::iterator_range<const float*> audio_data_float()
+	{
+		return converted_audio(audio_float_, has_audio_float_, audio_data_.size(), [this](float* dest)
+		{
+			audio_32_to_float(audio_data_.data(), dest, audio_data_.size());
+		});
+	}
+
+	const boost::iterator_range<const float*> audio_data_planar()
+	{
+		return converted_audio(audio_planar_, has_audio_planar_, audio_data_.size(), [this](float* dest)
+		{
+			audio_32_to_planar_float(audio_data_.data(), dest, audio_data_.size(), audio_channel_layout_.num_channels);
+		});
+	}
 };
 
 read_frame::read_frame(
 		const safe_ptr<ogl_device>& ogl,
 		uint32_t size,
-		safe_ptr<host_buffer>&& image_data,
+		std::shared_ptr<host_buffer>&& image_data,
+		std::shared_ptr<host_buffer>&& packed_image_data,
+		output_packing::type packing,
+		std::shared_ptr<host_buffer>&& key_image_data,
 		audio_buffer&& audio_data,
 		const channel_layout& audio_channel_layout,
-		int frame_timecode)
-	: impl_(new implementation(ogl, size, std::move(image_data), std::move(audio_data), audio_channel_layout, frame_timecode))
+		int frame_timecode,
+		output_split::type split,
+		const std::shared_ptr<device_buffer>& image_texture,
+		const raster_frames& rasters)
+	: impl_(new implementation(ogl, size, std::move(image_data), std::move(packed_image_data), packing, std::move(key_image_data), std::move(audio_data), audio_channel_layout, frame_timecode, split, image_texture, rasters))
 {
 }
 
@@ -109,12 +305,51 @@ const boost::iterator_range<const uint8_t*> read_frame::image_data()
 	return impl_ ? impl_->image_data() : boost::iterator_range<const uint8_t*>();
 }
 
+const boost::iterator_range<const uint8_t*> read_frame::packed_image_data()
+{
+	return impl_ ? impl_->packed_image_data() : boost::iterator_range<const uint8_t*>();
+}
+
+const boost::iterator_range<const uint8_t*> read_frame::key_image_data()
+{
+	return impl_ ? impl_->key_image_data() : boost::iterator_range<const uint8_t*>();
+}
+
 const boost::iterator_range<const int32_t*> read_frame::audio_data()
 {
 	return impl_ ? impl_->audio_data() : boost::iterator_range<const int32_t*>();
 }
 
+const boost::iterator_range<const int16_t*> read_frame::audio_data_16()
+{
+	return impl_ ? impl_->audio_data_16() : boost::iterator_range<const int16_t*>();
+}
+
+const boost::iterator_range<const int8_t*> read_frame::audio_data_24()
+{
+	return impl_ ? impl_->audio_data_24() : boost::iterator_range<const int8_t*>();
+}
+
+const boost::iterator_range<const float*> read_frame::audio_data_float()
+{
+	return impl_ ? impl_->audio_data_float() : boost::iterator_range<const float*>();
+}
+
+const boost::iterator_range<const float*> read_frame::audio_data_planar()
+{
+	return impl_ ? impl_->audio_data_planar() : boost::iterator_range<const float*>();
+}
+
+void read_frame::prepare()
+{
+	if(impl_)
+		impl_->prepare();
+}
+
 uint32_t read_frame::image_size() const{return impl_ ? impl_->size_ : 0;}
+output_packing::type read_frame::packing() const{return impl_ ? impl_->packing_ : output_packing::none;}
+output_split::type read_frame::split() const{return impl_ ? impl_->split_ : output_split::none;}
+std::shared_ptr<device_buffer> read_frame::image_texture() const{return impl_ ? impl_->image_texture_ : nullptr;}
 int read_frame::num_channels() const { return impl_ ? impl_->audio_channel_layout_.num_channels : 0; }
 const multichannel_view<const int32_t, boost::iterator_range<const int32_t*>::const_iterator> read_frame::multichannel_view() const
 {
@@ -134,6 +369,38 @@ int read_frame::get_timecode() const
 	return impl_ ? impl_->frame_timecode_ : std::numeric_limits<int>().max();
 }
 
+std::shared_ptr<read_frame> read_frame::raster(video_format::type format) const
+{
+	if(!impl_)
+		return nullptr;
+
+	return impl_->raster(format);
+}
+
+bool read_frame::is_held() const
+{
+	return impl_ && impl_->is_held_;
+}
+
+safe_ptr<read_frame> hold(const safe_ptr<read_frame>& frame)
+{
+	auto impl = frame->impl_;
+	if(!impl || impl->is_held_)
+		return frame;
+
+	profiled_mutex<tbb::mutex>::scoped_lock lock(impl->hold_mutex_);
+
+	auto held = impl->held_.lock();
+	if(!held)
+	{
+		held = std::make_shared<read_frame>();
+		held->impl_ = impl->copy_held();
+		impl->held_ = held;
+	}
+
+	return make_safe_ptr(held);
+}
+
 //#include <tbb/scalable_allocator.h>
 //#include <tbb/parallel_for.h>
 //#include <tbb/enumerable_thread_specific.h>
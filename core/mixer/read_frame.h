@@ -25,6 +25,8 @@
 
 #include <core/mixer/audio/audio_mixer.h>
 #include <core/mixer/audio/audio_util.h>
+#include <core/mixer/output_packing.h>
+#include <core/video_format.h>
 
 #include <boost/noncopyable.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -37,31 +39,62 @@ namespace caspar { namespace core {
 	
 class host_buffer;
 class ogl_device;
+class device_buffer;
 
 class read_frame : boost::noncopyable
 {
 public:
+	typedef std::vector<std::pair<video_format::type, safe_ptr<read_frame>>> raster_frames;
+
 	read_frame();
 	read_frame(
 			const safe_ptr<ogl_device>& ogl,
 			uint32_t size,
-			safe_ptr<host_buffer>&& image_data,
+			std::shared_ptr<host_buffer>&& image_data,
+			std::shared_ptr<host_buffer>&& packed_image_data,
+			output_packing::type packing,
+			std::shared_ptr<host_buffer>&& key_image_data,
 			audio_buffer&& audio_data,
 			const channel_layout& audio_channel_layout,
-			int frame_timecode);
+			int frame_timecode,
+			output_split::type split = output_split::none,
+			const std::shared_ptr<device_buffer>& image_texture = nullptr,
+			const raster_frames& rasters = raster_frames());
 
-	virtual const boost::iterator_range<const uint8_t*> image_data();
+	virtual const boost::iterator_range<const uint8_t*> image_data(); // Empty when no consumer reads the host image.
+	virtual const boost::iterator_range<const uint8_t*> packed_image_data(); // Empty unless packing() != none.
+	virtual const boost::iterator_range<const uint8_t*> key_image_data(); // Alpha broadcast into all channels of the bgra image.
 	virtual const boost::iterator_range<const int32_t*> audio_data();
 
+	// Conversions of audio_data(), made once on first use and shared by all consumers.
+	virtual const boost::iterator_range<const int16_t*> audio_data_16();
+	virtual const boost::iterator_range<const int8_t*> audio_data_24(); // Packed little endian, three bytes per sample.
+	virtual const boost::iterator_range<const float*> audio_data_float(); // Interleaved, full scale is 1.0.
+	virtual const boost::iterator_range<const float*> audio_data_planar(); // Float, channel after channel.
+
+	virtual void prepare(); // Waits for the read-back and maps the image data, so that consumers do not block on it.
+
 	virtual uint32_t image_size() const;
+	virtual output_packing::type packing() const;
+	virtual output_split::type split() const; // How the packed image is divided into sub-images.
+	virtual std::shared_ptr<device_buffer> image_texture() const; // Null unless a consumer samples the image on the gpu.
 	virtual int num_channels() const;
 	virtual int64_t get_age_millis() const;
 	virtual const multichannel_view<const int32_t, boost::iterator_range<const int32_t*>::const_iterator> multichannel_view() const;
 	virtual int get_timecode() const;
+	virtual std::shared_ptr<read_frame> raster(video_format::type format) const; // Null unless the raster completed with this frame.
+	virtual bool is_held() const; // Made by hold, backed by pageable memory.
 		
 private:
+	friend safe_ptr<read_frame> hold(const safe_ptr<read_frame>& frame);
+
 	struct implementation;
 	std::shared_ptr<implementation> impl_;
 };
 
+// A copy of the frame in pageable memory, without the texture, for consumers which keep frames for many ticks, so 
+// that the pinned read-back buffers of the mixer go back to their pool. The copy is made once and shared by 
+// everyone holding the frame at the same time. Held frames are returned as they are.
+safe_ptr<read_frame> hold(const safe_ptr<read_frame>& frame);
+
 }}
\ No newline at end of file
@@ -26,28 +26,71 @@
 #include "gpu/ogl_device.h"
 #include "gpu/host_buffer.h"
 #include "gpu/device_buffer.h"
+#include "gpu/texture_atlas.h"
 
 #include <core/producer/frame/frame_visitor.h>
 #include <core/producer/frame/pixel_format.h>
 #include <core/mixer/audio/audio_util.h>
 
+#include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/timer.hpp>
 
 #include <tbb/atomic.h>
 
+#include <algorithm>
+
 namespace caspar { namespace core {
+
+static core::pixel_format_desc bgra_desc(uint32_t width, uint32_t height)
+{
+	core::pixel_format_desc desc;
+	desc.pix_fmt = core::pixel_format::bgra;
+	desc.planes.push_back(core::pixel_format_desc::plane(width, height, 4));
+	return desc;
+}
+
+static core::pixel_format_desc keyed_desc(const core::pixel_format_desc& fill, const core::pixel_format_desc& key)
+{
+	core::pixel_format_desc desc = fill;
+	desc.pix_fmt	= fill.pix_fmt == core::pixel_format::ycbcr ? core::pixel_format::ycbcr_keyed : core::pixel_format::bgra_keyed;
+	desc.is_opaque	= false;
+	desc.planes.push_back(key.planes.at(0));
+	return desc;
+}
+
+static bool fits_atlas(const core::pixel_format_desc& desc)
+{
+	if(!desc.is_still || desc.planes.size() != 1 || desc.planes[0].channels != 4 || desc.planes[0].depth != 1)
+		return false;
+
+	switch(desc.pix_fmt)
+	{
+	case core::pixel_format::bgra:
+	case core::pixel_format::rgba:
+	case core::pixel_format::argb:
+	case core::pixel_format::abgr:
+		return true;
+	default:
+		return false;
+	}
+}
 																																							
 struct write_frame::implementation
 {				
 	std::shared_ptr<ogl_device>					ogl_;
 	std::vector<std::shared_ptr<host_buffer>>	buffers_;
 	std::vector<safe_ptr<device_buffer>>		textures_;
+	std::shared_ptr<atlas_region>				atlas_; // Where the image is when textures_ is an atlas page.
 	audio_buffer								audio_data_;
+	audio_buffer_ps								audio_data_float_;
 	const core::pixel_format_desc				desc_;
 	const channel_layout						channel_layout_;
 	const void*									tag_;
 	core::field_mode::type						mode_;
+	core::field_mode::type						deinterlace_field_;
+	std::vector<safe_ptr<device_buffer>>		before_textures_;
+	std::vector<safe_ptr<device_buffer>>		after_textures_;
 	boost::timer								since_created_timer_;
 	tbb::atomic<int64_t>						recorded_frame_age_;
 	tbb::atomic<int>							timecode_;
@@ -55,6 +98,7 @@ struct write_frame::implementation
 	implementation(const void* tag, const channel_layout& channel_layout)
 		: channel_layout_(channel_layout)
 		, tag_(tag)
+		, deinterlace_field_(core::field_mode::progressive)
 	{
 		recorded_frame_age_ = -1;
 	}
@@ -65,18 +109,69 @@ struct write_frame::implementation
 		, channel_layout_(channel_layout)
 		, tag_(tag)
 		, mode_(core::field_mode::progressive)
+		, deinterlace_field_(core::field_mode::progressive)
 	{
 		std::transform(desc.planes.begin(), desc.planes.end(), std::back_inserter(buffers_), [&](const core::pixel_format_desc::plane& plane)
 		{
 			return ogl_->create_host_buffer(plane.size, write_only);
 		});
-		std::transform(desc.planes.begin(), desc.planes.end(), std::back_inserter(textures_), [&](const core::pixel_format_desc::plane& plane)
+
+		if(fits_atlas(desc))
+			atlas_ = ogl_->create_atlas_region(desc.planes[0].width, desc.planes[0].height);
+
+		if(atlas_)
+			textures_.push_back(atlas_->page);
+		else
 		{
-			return ogl_->create_device_buffer(plane.width, plane.height, plane.channels);	
-		});
+			auto compression = get_texture_compression(desc.pix_fmt);
+			std::transform(desc.planes.begin(), desc.planes.end(), std::back_inserter(textures_), [&](const core::pixel_format_desc::plane& plane)
+			{
+				return compression != texture_compression::none 
+					? ogl_->create_compressed_device_buffer(plane.width, plane.height, compression)
+					: ogl_->create_device_buffer(plane.width, plane.height, plane.channels, plane.depth);	
+			});
+		}
 
 		recorded_frame_age_ = -1;
 	}
+
+	implementation(const void* tag, const safe_ptr<device_buffer>& texture, const channel_layout& channel_layout) 
+		: desc_(bgra_desc(texture->width(), texture->height()))
+		, channel_layout_(channel_layout)
+		, tag_(tag)
+		, mode_(core::field_mode::progressive)
+		, deinterlace_field_(core::field_mode::progressive)
+	{
+		textures_.push_back(texture);
+
+		recorded_frame_age_ = -1;
+	}
+
+	implementation(const implementation& fill, const implementation& key) 
+		: textures_(fill.textures_)
+		, audio_data_(fill.audio_data_)
+		, audio_data_float_(fill.audio_data_float_)
+		, desc_(keyed_desc(fill.desc_, key.desc_))
+		, channel_layout_(fill.channel_layout_)
+		, tag_(fill.tag_)
+		, mode_(fill.mode_)
+		, deinterlace_field_(fill.deinterlace_field_)
+		, since_created_timer_(fill.since_created_timer_)
+	{
+		textures_.push_back(key.textures_.at(0));
+
+		// Temporal deinterlacing needs the neighbours of both.
+		if(!fill.before_textures_.empty() && !key.before_textures_.empty() && fill.deinterlace_field_ == key.deinterlace_field_)
+		{
+			before_textures_ = fill.before_textures_;
+			before_textures_.push_back(key.before_textures_.at(0));
+			after_textures_	 = fill.after_textures_;
+			after_textures_.push_back(key.after_textures_.at(0));
+		}
+
+		recorded_frame_age_ = fill.recorded_frame_age_;
+		timecode_			= fill.timecode_;
+	}
 			
 	void accept(write_frame& self, core::frame_visitor& visitor)
 	{
@@ -118,15 +213,73 @@ struct write_frame::implementation
 		if(!buffer)
 			return;
 
-		auto texture = textures_.at(plane_index);
-		
-		ogl_->begin_invoke([=]
-		{			
-			buffer->unmap();
-			buffer->bind();
-			texture->begin_read();
-			buffer->unbind();
-		}, high_priority);
+		if(atlas_)
+		{
+			auto& placement = atlas_->placement;
+			auto bordered	= ogl_->create_host_buffer(placement.width*placement.height*4, write_only);
+			copy_with_border(static_cast<const uint8_t*>(buffer->data()), static_cast<uint8_t*>(bordered->data()), atlas_->image.width, atlas_->image.height);
+			ogl_->upload(bordered, textures_.at(0), placement);
+			return;
+		}
+
+		ogl_->upload(make_safe_ptr(buffer), textures_.at(plane_index));
+	}
+
+	void commit(const std::vector<image_region>& regions, const std::shared_ptr<write_frame>& base)
+	{
+		if(buffers_.size() != 1 || !buffers_[0])
+			return;
+
+		if(atlas_)
+		{
+			commit(0);
+			return;
+		}
+
+		auto& base_textures = base ? base->get_textures() : textures_;
+		if(!base || regions.empty() || base_textures.size() != 1 || base_textures[0] == textures_[0] ||
+		   base_textures[0]->width() != textures_[0]->width() || base_textures[0]->height() != textures_[0]->height() || 
+		   base_textures[0]->stride() != textures_[0]->stride() || base_textures[0]->depth() != textures_[0]->depth())
+		{
+			commit(0);
+			return;
+		}
+
+		auto buffer = std::move(buffers_[0]);
+		ogl_->upload(make_safe_ptr(buffer), textures_[0], base_textures[0], regions);
+	}
+
+	void set_deinterlace(field_mode::type field, const std::shared_ptr<write_frame>& before, const std::shared_ptr<write_frame>& after)
+	{
+		deinterlace_field_ = field;
+		before_textures_.clear();
+		after_textures_.clear();
+
+		// The deinterlacer samples whole textures.
+		if(atlas_)
+		{
+			deinterlace_field_ = field_mode::progressive;
+			return;
+		}
+
+		// Temporal neighbours are only used when both have the same layout as this frame.
+		if(field == field_mode::progressive || !before || !after)
+			return;
+
+		auto& before_textures = before->get_textures();
+		auto& after_textures  = after->get_textures();
+		if(before_textures.size() != textures_.size() || after_textures.size() != textures_.size())
+			return;
+
+		for(size_t n = 0; n < textures_.size(); ++n)
+		{
+			if(before_textures[n]->width() != textures_[n]->width() || before_textures[n]->height() != textures_[n]->height() ||
+			   after_textures[n]->width()  != textures_[n]->width() || after_textures[n]->height()  != textures_[n]->height())
+				return;
+		}
+
+		before_textures_ = before_textures;
+		after_textures_	 = after_textures;
 	}
 };
 	
@@ -142,6 +295,14 @@ write_frame::write_frame(
 	: impl_(new implementation(ogl, tag, desc, channel_layout))
 {
 }
+write_frame::write_frame(const void* tag, const safe_ptr<device_buffer>& texture, const channel_layout& channel_layout)
+	: impl_(new implementation(tag, texture, channel_layout))
+{
+}
+write_frame::write_frame(const write_frame& fill, const write_frame& key)
+	: impl_(new implementation(*fill.impl_, *key.impl_))
+{
+}
 write_frame::write_frame(const write_frame& other) : impl_(new implementation(*other.impl_)){}
 write_frame::write_frame(write_frame&& other) : impl_(std::move(other.impl_)){}
 write_frame& write_frame::operator=(const write_frame& other)
@@ -160,18 +321,75 @@ void write_frame::swap(write_frame& other){impl_.swap(other.impl_);}
 
 boost::iterator_range<uint8_t*> write_frame::image_data(uint32_t index){return impl_->image_data(index);}
 audio_buffer& write_frame::audio_data() { return impl_->audio_data_; }
+audio_buffer_ps& write_frame::audio_data_float() { return impl_->audio_data_float_; }
 const void* write_frame::tag() const {return impl_->tag_;}
 const core::pixel_format_desc& write_frame::get_pixel_format_desc() const{return impl_->desc_;}
+bool write_frame::is_audio_only() const{return impl_->textures_.empty();}
+bool write_frame::can_key(const write_frame& fill, const write_frame& key)
+{
+	auto& fill_desc = fill.impl_->desc_;
+	auto& key_desc	= key.impl_->desc_;
+
+	if(fill_desc.pix_fmt != pixel_format::ycbcr && fill_desc.pix_fmt != pixel_format::bgra)
+		return false;
+
+	if(key_desc.pix_fmt != pixel_format::luma || key_desc.planes.size() != 1 || fill_desc.planes.empty())
+		return false;
+
+	if(fill.impl_->textures_.size() != fill_desc.planes.size() || key.impl_->textures_.size() != 1)
+		return false;
+
+	if(fill.impl_->atlas_ || key.impl_->atlas_) // The planes are sampled at the same coordinates.
+		return false;
+
+	// Only what is committed is in the textures.
+	auto committed = [](const std::shared_ptr<host_buffer>& buffer){return !buffer;};
+	if(!std::all_of(fill.impl_->buffers_.begin(), fill.impl_->buffers_.end(), committed) || 
+	   !std::all_of(key.impl_->buffers_.begin(), key.impl_->buffers_.end(), committed))
+		return false;
+
+	if(fill.impl_->deinterlace_field_ != key.impl_->deinterlace_field_)
+		return false;
+
+	return fill_desc.planes[0].width  == key_desc.planes[0].width && 
+		   fill_desc.planes[0].height == key_desc.planes[0].height &&
+		   key_desc.planes[0].depth	  == 1;
+}
+int64_t write_frame::host_bytes() const
+{
+	int64_t bytes = 0;
+	BOOST_FOREACH(auto& buffer, impl_->buffers_)
+	{
+		if(buffer)
+			bytes += buffer->size();
+	}
+	return bytes;
+}
+int64_t write_frame::device_bytes() const
+{
+	if(impl_->atlas_)
+		return static_cast<int64_t>(impl_->atlas_->placement.width) * impl_->atlas_->placement.height * impl_->atlas_->page->stride();
+
+	int64_t bytes = 0;
+	BOOST_FOREACH(auto& texture, impl_->textures_)
+		bytes += texture->size();
+	return bytes;
+}
 const channel_layout& write_frame::get_channel_layout() const{return impl_->channel_layout_;}
 multichannel_view<int32_t, audio_buffer::iterator> write_frame::get_multichannel_view()
 {
 	return make_multichannel_view<int32_t>(impl_->audio_data_.begin(), impl_->audio_data_.end(), impl_->channel_layout_);
 }
 const std::vector<safe_ptr<device_buffer>>& write_frame::get_textures() const{return impl_->textures_;}
+texture_rect write_frame::get_texture_rect() const{return impl_->atlas_ ? impl_->atlas_->rect() : texture_rect();}
 void write_frame::commit(uint32_t plane_index){impl_->commit(plane_index);}
 void write_frame::commit(){impl_->commit();}
+void write_frame::commit(const std::vector<image_region>& regions, const std::shared_ptr<write_frame>& base){impl_->commit(regions, base);}
 void write_frame::set_type(const field_mode::type& mode){impl_->mode_ = mode;}
 core::field_mode::type write_frame::get_type() const{return impl_->mode_;}
+void write_frame::set_deinterlace(field_mode::type field, const std::shared_ptr<write_frame>& before, const std::shared_ptr<write_frame>& after){impl_->set_deinterlace(field, before, after);}
+core::field_mode::type write_frame::get_deinterlace_field() const{return impl_->deinterlace_field_;}
+const std::vector<safe_ptr<device_buffer>>& write_frame::get_deinterlace_textures(bool after) const{return after ? impl_->after_textures_ : impl_->before_textures_;}
 void write_frame::accept(core::frame_visitor& visitor){impl_->accept(*this, visitor);}
 int64_t write_frame::get_and_record_age_millis() { return impl_->get_and_record_age_millis(); }
 int write_frame::get_timecode() { return impl_->timecode_; }
@@ -39,6 +39,8 @@ namespace caspar { namespace core {
 class device_buffer;
 struct frame_visitor;
 struct pixel_format_desc;
+struct image_region;
+struct texture_rect;
 class ogl_device;	
 
 class write_frame : public core::basic_frame, boost::noncopyable
@@ -46,6 +48,8 @@ class write_frame : public core::basic_frame, boost::noncopyable
 public:	
 	explicit write_frame(const void* tag, const channel_layout& channel_layout);
 	explicit write_frame(const safe_ptr<ogl_device>& ogl, const void* tag, const core::pixel_format_desc& desc, const channel_layout& channel_layout);
+	explicit write_frame(const void* tag, const safe_ptr<device_buffer>& texture, const channel_layout& channel_layout); // A bgra image already on the gpu, nothing to commit.
+	explicit write_frame(const write_frame& fill, const write_frame& key); // The committed fill keyed by the luma of the key, sharing their textures, see can_key.
 
 	write_frame(const write_frame& other);
 	write_frame(write_frame&& other);
@@ -66,22 +70,44 @@ public:
 			
 	boost::iterator_range<uint8_t*> image_data(uint32_t plane_index = 0);	
 	audio_buffer& audio_data();
+	audio_buffer_ps& audio_data_float(); // Full scale is 1.0, mixed instead of audio_data() when not empty.
 	
 	void commit(uint32_t plane_index);
 	void commit();
+
+	// Commits a single plane frame of which only the regions were written, the rest of the image is the same as
+	// in base and is copied from its texture on the gpu. Commits the whole image when base does not match.
+	void commit(const std::vector<image_region>& regions, const std::shared_ptr<write_frame>& base);
 	
 	void set_type(const field_mode::type& mode);
 	field_mode::type get_type() const;
+
+	// Shows the frame as the given field with the lines of the other field rebuilt by the image mixer, motion 
+	// adaptive from the frames before and after it in time when they are given.
+	void set_deinterlace(field_mode::type field, const std::shared_ptr<write_frame>& before, const std::shared_ptr<write_frame>& after);
+	field_mode::type get_deinterlace_field() const;
 	
 	const void* tag() const;
 
 	const core::pixel_format_desc& get_pixel_format_desc() const;
+
+	// Whether the frame only carries audio, as made by the constructor without an image. The image mixer skips it.
+	bool is_audio_only() const;
+
+	// Memory held by the frame, the uncommitted host buffers and its textures (only its part of an atlas page).
+	int64_t host_bytes() const;
+	int64_t device_bytes() const;
+
+	// Whether a ycbcr or bgra fill and a luma key of the same size can be drawn as one keyed frame.
+	static bool can_key(const write_frame& fill, const write_frame& key);
 	const channel_layout& get_channel_layout() const;
 	multichannel_view<int32_t, audio_buffer::iterator> get_multichannel_view();
 private:
 	friend class image_mixer;
 	
 	const std::vector<safe_ptr<device_buffer>>& get_textures() const;
+	texture_rect get_texture_rect() const; // Of the image in the textures, which are shared when it is in an atlas.
+	const std::vector<safe_ptr<device_buffer>>& get_deinterlace_textures(bool after) const;
 
 	struct implementation;
 	safe_ptr<implementation> impl_;
@@ -22,8 +22,78 @@
 
 #include "monitor.h"
 
+#include <tbb/atomic.h>
+
 namespace caspar { namespace core { namespace monitor {
 
+namespace {
+
+tbb::atomic<int> g_observed_generation;
+
+// Moves pos past the next segment of path, which is [begin, end). A trailing "/" has no segment.
+bool next_segment(const std::string& path, std::size_t& pos, std::size_t& begin, std::size_t& end)
+{
+	if (pos + 1 >= path.size())
+		return false;
+
+	begin	= pos + 1;
+	end		= std::min(path.find('/', begin), path.size());
+	pos		= end;
+
+	return true;
+}
+
+enum match_result
+{
+	mismatch,
+	pattern_is_longer,
+	path_is_covered
+};
+
+match_result compare(const std::string& pattern, const std::string& path)
+{
+	std::size_t pattern_pos = 0, pattern_begin, pattern_end;
+	std::size_t path_pos	= 0, path_begin,	path_end;
+
+	while (next_segment(pattern, pattern_pos, pattern_begin, pattern_end))
+	{
+		if (!next_segment(path, path_pos, path_begin, path_end))
+			return pattern_is_longer;
+
+		auto length = pattern_end - pattern_begin;
+
+		if (length == 1 && pattern[pattern_begin] == '*')
+			continue;
+
+		if (length != path_end - path_begin || pattern.compare(pattern_begin, length, path, path_begin, length) != 0)
+			return mismatch;
+	}
+
+	return path_is_covered;
+}
+
+}
+
+bool matches(const std::string& pattern, const std::string& path)
+{
+	return compare(pattern, path) == path_is_covered;
+}
+
+bool may_match(const std::string& pattern, const std::string& path_prefix)
+{
+	return compare(pattern, path_prefix) != mismatch;
+}
+
+void invalidate_observed()
+{
+	++g_observed_generation;
+}
+
+int observed_generation()
+{
+	return g_observed_generation;
+}
+
 /*class in_callers_thread_schedule_group : public Concurrency::ScheduleGroup
 {
 	virtual void ScheduleTask(Concurrency::TaskProc proc, void* data) override
@@ -26,6 +26,9 @@
 #include <boost/variant.hpp>
 #include <boost/chrono/duration.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -86,11 +89,25 @@ private:
 	safe_ptr<std::vector<data_t>>	data_ptr_;
 };
 
+// A pattern is a path where a segment may be "*" to match any one segment. It matches the paths
+// it spells out and everything below them, so "/" matches every path.
+bool matches(const std::string& pattern, const std::string& path);
+
+// Whether the pattern matches any path that starts with the given one.
+bool may_match(const std::string& pattern, const std::string& path_prefix);
+
+// Called when what the sinks observe may have changed, which makes the subjects ask again.
+void invalidate_observed();
+int observed_generation();
+
 struct sink
 {
 	virtual ~sink() { }
 
 	virtual void propagate(const message& msg) = 0;
+
+	// Whether anything below the path may be wanted. Called rarely, see subject::is_observed.
+	virtual bool wants(const std::string& path_prefix) { return true; }
 };
 
 class subject : public sink
@@ -98,21 +115,50 @@ class subject : public sink
 private:
 	std::weak_ptr<sink> parent_;
 	const std::string path_;
+	tbb::atomic<int>	observed_generation_;
+	tbb::atomic<bool>	is_observed_;
 public:
 	subject(std::string path = "")
 		: path_(std::move(path))
 	{
 		CASPAR_ASSERT(path.empty() || path[0] == '/');
+
+		observed_generation_	= -1;
+		is_observed_			= false;
 	}
 
 	void attach_parent(const safe_ptr<sink>& parent)
 	{
 		parent_ = parent;
+		invalidate_observed();
 	}
 
 	void detach_parent()
 	{
 		parent_.reset();
+		invalidate_observed();
+	}
+
+	// Cheap enough to call before building each message; the answer is only looked up again
+	// after a subscription or a parent has changed.
+	bool is_observed()
+	{
+		auto generation = observed_generation();
+
+		if (observed_generation_ != generation)
+		{
+			observed_generation_	= generation;
+			is_observed_			= wants("");
+		}
+
+		return is_observed_;
+	}
+
+	virtual bool wants(const std::string& path_prefix) override
+	{
+		auto parent = parent_.lock();
+
+		return parent && parent->wants(path_ + path_prefix);
 	}
 
 	subject& operator<<(const message& msg)
@@ -124,6 +170,9 @@ public:
 
 	virtual void propagate(const message& msg) override
 	{
+		if (!is_observed())
+			return;
+
 		auto parent = parent_.lock();
 
 		if (parent)
@@ -131,4 +180,66 @@ public:
 	}
 };
 
+// Hands the messages to several sinks, as a subject has a single parent.
+class multi_sink : public sink
+{
+	typedef std::vector<std::weak_ptr<sink>> sinks_t;
+
+	tbb::spin_mutex					mutex_;
+	std::shared_ptr<const sinks_t>	sinks_;
+public:
+	multi_sink()
+		: sinks_(std::make_shared<sinks_t>())
+	{
+	}
+
+	void add(const safe_ptr<sink>& sink)
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+
+			auto sinks = std::make_shared<sinks_t>(*sinks_);
+			sinks->push_back(sink);
+			sinks_ = sinks;
+		}
+
+		invalidate_observed();
+	}
+
+	virtual bool wants(const std::string& path_prefix) override
+	{
+		auto sinks = get_sinks();
+
+		for (auto it = sinks->begin(); it != sinks->end(); ++it)
+		{
+			auto sink = it->lock();
+
+			if (sink && sink->wants(path_prefix))
+				return true;
+		}
+
+		return false;
+	}
+
+	virtual void propagate(const message& msg) override
+	{
+		auto sinks = get_sinks();
+
+		for (auto it = sinks->begin(); it != sinks->end(); ++it)
+		{
+			auto sink = it->lock();
+
+			if (sink)
+				sink->propagate(msg);
+		}
+	}
+private:
+	std::shared_ptr<const sinks_t> get_sinks()
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		return sinks_;
+	}
+};
+
 }}}
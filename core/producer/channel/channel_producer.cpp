@@ -29,7 +29,9 @@
 #include "../../video_channel.h"
 
 #include "../frame/basic_frame.h"
+#include "../frame/color_frame.h"
 #include "../frame/frame_factory.h"
+#include "../frame/frame_transform.h"
 #include "../../mixer/write_frame.h"
 #include "../../mixer/read_frame.h"
 
@@ -38,6 +40,11 @@
 #include <common/concurrency/future_util.h>
 
 #include <tbb/concurrent_queue.h>
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 namespace caspar { namespace core {
 
@@ -48,6 +55,8 @@ class channel_consumer : public frame_consumer
 	tbb::atomic<int>											channel_index_;
 	tbb::atomic<bool>											is_running_;
 	tbb::atomic<int64_t>										current_age_;
+	tbb::spin_mutex												frame_requested_mutex_;
+	std::function<void()>										frame_requested_;
 
 public:
 	channel_consumer() 
@@ -108,6 +117,22 @@ public:
 	{
 		return 78500 + channel_index_;
 	}
+
+	virtual int get_image_usage() const override
+	{
+		return image_usage::texture;
+	}
+
+	// Only a composition is clocked by the channels routing it.
+	virtual bool set_frame_requested_callback(const std::function<void()>& callback) override
+	{
+		if(callback && !is_composition_channel(channel_index_))
+			return false;
+
+		tbb::spin_mutex::scoped_lock lock(frame_requested_mutex_);
+		frame_requested_ = callback;
+		return true;
+	}
 	
 	int channel_index() const
 	{
@@ -127,6 +152,18 @@ public:
 		return format_desc_;
 	}
 
+	void request_frame()
+	{
+		std::function<void()> frame_requested;
+		{
+			tbb::spin_mutex::scoped_lock lock(frame_requested_mutex_);
+			frame_requested = frame_requested_;
+		}
+
+		if(frame_requested)
+			frame_requested();
+	}
+
 	std::shared_ptr<read_frame> receive()
 	{
 		if(!is_running_)
@@ -147,14 +184,17 @@ class channel_producer : public frame_producer
 	const safe_ptr<frame_factory>		frame_factory_;
 	const safe_ptr<channel_consumer>	consumer_;
 
+	const bool							audio_meters_;
+
 	std::queue<safe_ptr<basic_frame>>	frame_buffer_;
 	safe_ptr<basic_frame>				last_frame_;
 	uint64_t							frame_number_;
 
 public:
-	explicit channel_producer(const safe_ptr<frame_factory>& frame_factory, const safe_ptr<video_channel>& channel) 
+	explicit channel_producer(const safe_ptr<frame_factory>& frame_factory, const safe_ptr<video_channel>& channel, bool audio_meters) 
 		: frame_factory_(frame_factory)
 		, consumer_(make_safe<channel_consumer>())
+		, audio_meters_(audio_meters)
 		, last_frame_(basic_frame::empty())
 		, frame_number_(0)
 	{
@@ -171,6 +211,43 @@ public:
 	// frame_producer
 			
 	virtual safe_ptr<basic_frame> receive(int) override
+	{
+		// Asks a composition for the frames shown from the next tick on, a route at half its rate skips every other.
+		if(frame_buffer_.size() <= 1)
+		{
+			bool half_speed = std::abs(consumer_->get_video_format_desc().fps / 2.0 - frame_factory_->get_video_format_desc().fps) < 0.01;
+			for(int n = 0; n < (half_speed ? 2 : 1); ++n)
+				consumer_->request_frame();
+		}
+
+		return receive_frame();
+	}
+
+	virtual safe_ptr<basic_frame> last_frame() const override
+	{
+		return last_frame_; 
+	}	
+
+	virtual std::wstring print() const override
+	{
+		return L"channel[" + boost::lexical_cast<std::wstring>(consumer_->channel_index()) + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type", L"channel-producer");
+		return info;
+	}
+
+	monitor::subject& monitor_output() 
+	{
+		return monitor_subject_;
+	}
+
+	// channel_producer
+
+	safe_ptr<basic_frame> receive_frame()
 	{
 		auto format_desc = consumer_->get_video_format_desc();
 
@@ -182,7 +259,7 @@ public:
 		}
 		
 		auto read_frame = consumer_->receive();
-		if(!read_frame || read_frame->image_data().empty())
+		if(!read_frame || (!read_frame->image_texture() && read_frame->image_data().empty()))
 			return basic_frame::late();		
 
 		frame_number_++;
@@ -192,11 +269,22 @@ public:
 		bool half_speed		= std::abs(format_desc.fps / 2.0 - frame_factory_->get_video_format_desc().fps) < 0.01;
 
 		if(half_speed && frame_number_ % 2 == 0) // Skip frame
-			return receive(0);
+			return receive_frame();
+
+		std::shared_ptr<write_frame> frame;
+
+		// The channel's own render target is drawn as is, both channels are mixed in the same gl context.
+		if(read_frame->image_texture())
+			frame = make_safe<write_frame>(this, make_safe_ptr(read_frame->image_texture()), channel_layout::stereo());
+		else
+		{
+			desc.pix_fmt = core::pixel_format::bgra;
+			desc.planes.push_back(core::pixel_format_desc::plane(format_desc.width, format_desc.height, 4));
+			frame = frame_factory_->create_frame(this, desc);
+			fast_memcpy(frame->image_data().begin(), read_frame->image_data().begin(), read_frame->image_data().size());
+			frame->commit();
+		}
 
-		desc.pix_fmt = core::pixel_format::bgra;
-		desc.planes.push_back(core::pixel_format_desc::plane(format_desc.width, format_desc.height, 4));
-		auto frame = frame_factory_->create_frame(this, desc);
 		bool copy_audio = !double_speed && !half_speed;
 
 		if (copy_audio)
@@ -205,44 +293,70 @@ public:
 			boost::copy(read_frame->audio_data(), std::back_inserter(frame->audio_data()));
 		}
 
-		fast_memcpy(frame->image_data().begin(), read_frame->image_data().begin(), read_frame->image_data().size());
-		frame->commit();
+		safe_ptr<basic_frame> result = make_safe_ptr(frame);
+
+		if(audio_meters_)
+			result = with_audio_meters(result, *read_frame);
 
-		frame_buffer_.push(frame);	
+		frame_buffer_.push(result);	
 		
 		if(double_speed)	
-			frame_buffer_.push(frame);
+			frame_buffer_.push(result);
 
-		return receive(0);
-	}	
+		return receive_frame();
+	}
 
-	virtual safe_ptr<basic_frame> last_frame() const override
+	// One bar per audio channel along the right edge, drawn as color frames in the same pass as the image.
+	static safe_ptr<basic_frame> with_audio_meters(const safe_ptr<basic_frame>& image, read_frame& read_frame)
 	{
-		return last_frame_; 
-	}	
+		const int channels = read_frame.num_channels();
+		if(channels < 1)
+			return image;
 
-	virtual std::wstring print() const override
-	{
-		return L"channel[" + boost::lexical_cast<std::wstring>(consumer_->channel_index()) + L"]";
-	}
+		std::vector<int32_t> peaks(channels, 0);
+		auto audio = read_frame.audio_data();
+		for(size_t n = 0; n < audio.size(); ++n)
+		{
+			auto& peak = peaks[n % channels];
+			peak = std::max(peak, std::abs(std::max(audio[n], -std::numeric_limits<int32_t>::max())));
+		}
 
-	virtual boost::property_tree::wptree info() const override
-	{
-		boost::property_tree::wptree info;
-		info.add(L"type", L"channel-producer");
-		return info;
-	}
+		const double bar_width	= std::min(0.02, 0.25 / channels);
+		const double left		= 1.0 - bar_width * channels;
 
-	monitor::subject& monitor_output() 
-	{
-		return monitor_subject_;
+		std::vector<safe_ptr<basic_frame>> frames;
+		frames.push_back(image);
+
+		auto background = safe_ptr<basic_frame>(make_safe<color_frame>(0x80000000));
+		background->get_frame_transform().fill_translation[0]	= left;
+		background->get_frame_transform().fill_scale[0]			= 1.0 - left;
+		frames.push_back(background);
+
+		for(int n = 0; n < channels; ++n)
+		{
+			// -60 dBFS to full scale, red from -6 dBFS.
+			auto level = 20.0 * std::log10(std::max(1, peaks[n]) / static_cast<double>(std::numeric_limits<int32_t>::max()));
+			auto height = std::max(0.0, std::min(1.0, (level + 60.0) / 60.0));
+			if(height <= 0.0)
+				continue;
+
+			auto bar = safe_ptr<basic_frame>(make_safe<color_frame>(level > -6.0 ? 0xFFFF0000 : 0xFF00FF00));
+			auto& transform = bar->get_frame_transform();
+			transform.fill_translation[0]	= left + (n + 0.1) * bar_width;
+			transform.fill_translation[1]	= 1.0 - height;
+			transform.fill_scale[0]			= bar_width * 0.8;
+			transform.fill_scale[1]			= height;
+			frames.push_back(bar);
+		}
+
+		return make_safe<basic_frame>(std::move(frames));
 	}
 };
 
-safe_ptr<frame_producer> create_channel_producer(const safe_ptr<core::frame_factory>& frame_factory, const safe_ptr<video_channel>& channel)
+safe_ptr<frame_producer> create_channel_producer(const safe_ptr<core::frame_factory>& frame_factory, const safe_ptr<video_channel>& channel, bool audio_meters)
 {
 	return create_producer_print_proxy(
-			make_safe<channel_producer>(frame_factory, channel));
+			make_safe<channel_producer>(frame_factory, channel, audio_meters));
 }
 
 }}
\ No newline at end of file
@@ -31,6 +31,6 @@ namespace caspar { namespace core {
 class video_channel;
 struct frame_factory;
 
-safe_ptr<frame_producer> create_channel_producer(const safe_ptr<core::frame_factory>& frame_factory, const safe_ptr<video_channel>& channel);
+safe_ptr<frame_producer> create_channel_producer(const safe_ptr<core::frame_factory>& frame_factory, const safe_ptr<video_channel>& channel, bool audio_meters = false);
 
 }}
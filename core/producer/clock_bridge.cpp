@@ -0,0 +1,315 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../StdAfx.h"
+
+#include "clock_bridge.h"
+
+#include "frame/basic_frame.h"
+#include "../mixer/write_frame.h"
+#include "../mixer/audio/audio_resampler.h"
+
+#include <common/diagnostics/graph.h>
+
+#include <tbb/mutex.h>
+
+#include <boost/timer.hpp>
+
+#include <boost/range/algorithm/rotate.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <numeric>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const double LEVEL_ALPHA		= 0.02;		// Of the filtered fifo levels, about a second at 50 fps.
+const double PROPORTIONAL_GAIN	= 2.5e-3;	// Ratio per frame of error.
+const double INTEGRAL_GAIN		= 4.0e-6;	// Ratio per frame of error and tick, settles in about a minute.
+const double MAX_CORRECTION		= 1.0e-3;	// 1000 ppm, far more than any reference drifts.
+const double MAX_AUDIO_ERROR	= 2.0;		// Frames of audio off depth before the fifo is resynced at once.
+
+}
+
+struct clock_bridge::implementation : boost::noncopyable
+{
+	const safe_ptr<diagnostics::graph>		graph_;
+	const channel_layout					channel_layout_;
+	const int								num_channels_;
+	const double							depth_;
+	const std::size_t						max_video_;
+	const double							samples_per_frame_;
+	const double							sample_rate_;
+
+	mutable tbb::mutex						mutex_;
+	std::vector<uint32_t>					audio_cadence_;
+	audio_resampler							resampler_;
+	audio_buffer_ps							audio_;
+	boost::timer							push_timer_;
+	double									last_push_;	// Samples per channel of the last push.
+	std::deque<safe_ptr<basic_frame>>		video_;
+	std::shared_ptr<basic_frame>			last_video_;
+
+	double									audio_level_;
+	double									video_level_;
+	double									integral_;
+	double									ratio_;
+	bool									started_;
+
+	implementation(const video_format_desc& format_desc, const channel_layout& audio_channel_layout, std::size_t depth, const safe_ptr<diagnostics::graph>& graph)
+		: graph_(graph)
+		, channel_layout_(audio_channel_layout)
+		, num_channels_(audio_channel_layout.num_channels)
+		, depth_(static_cast<double>(std::max<std::size_t>(depth, 1)))
+		, max_video_(std::max<std::size_t>(depth, 1)*2 + 2)
+		, samples_per_frame_(static_cast<double>(std::accumulate(format_desc.audio_cadence.begin(), format_desc.audio_cadence.end(), static_cast<std::size_t>(0)))/static_cast<double>(std::max<std::size_t>(format_desc.audio_cadence.size(), 1)))
+		, sample_rate_(static_cast<double>(format_desc.audio_sample_rate))
+		, audio_cadence_(format_desc.audio_cadence)
+		, resampler_(audio_channel_layout.num_channels)
+		, integral_(0.0)
+		, ratio_(1.0)
+	{
+		reset();
+
+		graph_->set_color("drift", diagnostics::color(1.0f, 0.5f, 1.0f));
+		graph_->set_color("audio-buffer", diagnostics::color(0.7f, 0.4f, 1.0f));
+		graph_->set_color("duplicated-frame", diagnostics::color(0.3f, 0.3f, 1.0f));
+		graph_->set_color("empty-audio", diagnostics::color(0.3f, 0.9f, 1.0f));
+		graph_->set_color("dropped-audio", diagnostics::color(1.0f, 0.5f, 0.0f));
+	}
+
+	void reset()
+	{
+		resampler_.clear();
+		audio_.clear();
+		last_push_		= 0.0;
+		video_.clear();
+		last_video_.reset();
+		audio_level_	= depth_;
+		video_level_	= depth_;
+		started_		= false;
+
+		// The drift estimate of the integral is kept, the input still runs on the same clock.
+	}
+
+	void push_video(const safe_ptr<basic_frame>& frame)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		// Only when the channel has stopped pulling, the queue is otherwise kept around depth by pop.
+		while(video_.size() >= max_video_)
+		{
+			video_.pop_front();
+			graph_->set_tag("dropped-frame");
+		}
+
+		video_.push_back(frame);
+	}
+
+	template<typename T>
+	void push_audio(const T* samples, std::size_t count)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		const auto size = audio_.size();
+		resampler_.resample(samples, count, ratio_, audio_);
+		last_push_ = static_cast<double>((audio_.size() - size)/num_channels_);
+		push_timer_.restart();
+
+		const auto max_samples = static_cast<std::size_t>(samples_per_frame_*(depth_ + MAX_AUDIO_ERROR*2.0))*num_channels_;
+		if(audio_.size() > max_samples)
+		{
+			audio_.erase(audio_.begin(), audio_.end() - max_samples);
+			graph_->set_tag("dropped-audio");
+		}
+	}
+
+	safe_ptr<basic_frame> pop()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		if(!started_)
+		{
+			if(video_.size() < static_cast<std::size_t>(depth_))
+				return basic_frame::late();
+
+			// Starts with both at depth, the loop then only has to follow the drift.
+			started_ = true;
+			resync_audio(depth_);
+		}
+
+		auto video = pop_video();
+		auto audio = pop_audio();
+
+		graph_->set_value("output-buffer", static_cast<double>(video_.size())/static_cast<double>(max_video_));
+		graph_->set_value("audio-buffer", audio_level_/(depth_ + MAX_AUDIO_ERROR*2.0));
+		graph_->set_value("drift", 0.5 + drift()/(MAX_CORRECTION*2.0));
+
+		std::vector<safe_ptr<basic_frame>> frames;
+		frames.push_back(disable_audio(video));
+		frames.push_back(audio);
+		return make_safe<basic_frame>(std::move(frames));
+	}
+
+	safe_ptr<basic_frame> pop_video()
+	{
+		video_level_ = video_level_*(1.0 - LEVEL_ALPHA) + static_cast<double>(video_.size())*LEVEL_ALPHA;
+
+		// Repeated when the queue has run dry or has stayed a frame short of depth, dropped when it has stayed a
+		// frame over. The filtered level is moved by the frame so that one correction is made at a time.
+		if(video_.empty() && last_video_)
+		{
+			graph_->set_tag("late-frame");
+			video_level_ += 1.0;
+			return make_safe_ptr(last_video_);
+		}
+
+		if(video_level_ < depth_ - 1.0 && last_video_)
+		{
+			graph_->set_tag("duplicated-frame");
+			video_level_ += 1.0;
+			return make_safe_ptr(last_video_);
+		}
+
+		if(video_level_ > depth_ + 1.0 && video_.size() > 1)
+		{
+			graph_->set_tag("dropped-frame");
+			video_level_ -= 1.0;
+			video_.pop_front();
+		}
+
+		auto frame = video_.front();
+		video_.pop_front();
+		last_video_ = frame;
+		return frame;
+	}
+
+	safe_ptr<basic_frame> pop_audio()
+	{
+		const auto samples = audio_cadence_.front()*num_channels_;
+		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_) + 1);
+
+		auto frame = make_safe<write_frame>(this, channel_layout_);
+
+		if(audio_.size() < samples)
+		{
+			graph_->set_tag("empty-audio");
+			audio_.resize(samples, 0.0f);
+		}
+
+		frame->audio_data_float().assign(audio_.begin(), audio_.begin() + samples);
+		audio_.erase(audio_.begin(), audio_.begin() + samples);
+
+		update_ratio();
+
+		return frame;
+	}
+
+	// In frames, as if the audio arrived continuously instead of a frame at a time. Otherwise the fifo steps by a
+	// whole frame whenever the phase of the input against the channel wraps, which the loop would take for drift.
+	double level() const
+	{
+		const auto arrived = std::min(push_timer_.elapsed()*sample_rate_*ratio_, last_push_);
+		return (static_cast<double>(audio_.size()/num_channels_) - last_push_ + arrived)/samples_per_frame_;
+	}
+
+	void update_ratio()
+	{
+		const auto level = this->level();
+		audio_level_ = audio_level_*(1.0 - LEVEL_ALPHA) + level*LEVEL_ALPHA;
+
+		if(std::abs(level - depth_) > MAX_AUDIO_ERROR)
+		{
+			// After a gap in the input, or when the channel stalled, not worth minutes of correction.
+			resync_audio(depth_);
+			return;
+		}
+
+		const auto error = audio_level_ - depth_;
+
+		integral_ += error;
+		integral_ = std::min(std::max(integral_, -MAX_CORRECTION/INTEGRAL_GAIN), MAX_CORRECTION/INTEGRAL_GAIN);
+
+		auto correction = PROPORTIONAL_GAIN*error + INTEGRAL_GAIN*integral_;
+		correction = std::min(std::max(correction, -MAX_CORRECTION), MAX_CORRECTION);
+
+		// Fewer output samples per input sample while the input delivers more than the channel takes.
+		ratio_ = 1.0 - correction;
+	}
+
+	void resync_audio(double frames)
+	{
+		const auto samples = static_cast<std::ptrdiff_t>((frames - level())*samples_per_frame_)*num_channels_;
+
+		if(samples < 0)
+		{
+			audio_.erase(audio_.begin(), audio_.begin() + std::min<std::ptrdiff_t>(-samples, audio_.size()));
+			graph_->set_tag("dropped-audio");
+		}
+		else if(samples > 0)
+		{
+			audio_.insert(audio_.begin(), samples, 0.0f);
+			graph_->set_tag("empty-audio");
+		}
+
+		audio_level_ = frames;
+	}
+
+	// The steady part of the correction, the proportional part only follows the jitter of the input.
+	double drift() const
+	{
+		return 1.0/(1.0 - INTEGRAL_GAIN*integral_) - 1.0;
+	}
+
+	double drift_ppm() const
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		return drift()*1000000.0;
+	}
+
+	double resample_ratio() const
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		return ratio_;
+	}
+
+	void clear()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		reset();
+	}
+};
+
+clock_bridge::clock_bridge(const video_format_desc& format_desc, const channel_layout& audio_channel_layout, std::size_t depth, const safe_ptr<diagnostics::graph>& graph)
+	: impl_(new implementation(format_desc, audio_channel_layout, depth, graph)){}
+void clock_bridge::push_video(const safe_ptr<basic_frame>& frame){impl_->push_video(frame);}
+void clock_bridge::push_audio(const int32_t* samples, std::size_t count){impl_->push_audio(samples, count);}
+void clock_bridge::push_audio(const float* samples, std::size_t count){impl_->push_audio(samples, count);}
+safe_ptr<basic_frame> clock_bridge::pop(){return impl_->pop();}
+double clock_bridge::drift_ppm() const{return impl_->drift_ppm();}
+double clock_bridge::resample_ratio() const{return impl_->resample_ratio();}
+void clock_bridge::clear(){impl_->clear();}
+
+}}
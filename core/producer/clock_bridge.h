@@ -0,0 +1,84 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include "../video_format.h"
+#include "../mixer/audio/audio_util.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+
+namespace caspar { 
+
+namespace diagnostics {
+
+class graph;
+
+}
+	
+namespace core {
+
+class basic_frame;
+
+/**
+ * Carries the frames of a live input running on a clock of its own, such as an
+ * unlocked decklink input or an NDI source, into the channel.
+ *
+ * The input thread pushes video frames and the audio as it arrives. Every
+ * channel tick pops a video frame together with exactly the samples of the
+ * channel's audio cadence. The level of the audio fifo drives a control loop
+ * resampling the audio by at most 1000 ppm so that the fifo stays at
+ * depth frames, the steady part of the correction is the drift of the input
+ * against the channel. The video is never resampled, its queue is allowed to
+ * wander a frame around depth before a frame is repeated or dropped.
+ *
+ * Both threads may call concurrently, the bridge reports to the graph.
+ */
+class clock_bridge : boost::noncopyable
+{
+public:
+	clock_bridge(const video_format_desc& format_desc, const channel_layout& audio_channel_layout, std::size_t depth, const safe_ptr<diagnostics::graph>& graph);
+
+	// Input thread. The audio of the frames is not mixed, it is pushed separately.
+	void push_video(const safe_ptr<basic_frame>& frame);
+	void push_audio(const int32_t* samples, std::size_t count);
+	void push_audio(const float* samples, std::size_t count); // Full scale is 1.0.
+
+	// Channel thread, late until depth video frames have arrived.
+	safe_ptr<basic_frame> pop();
+
+	// Of the input against the channel, positive when the input runs fast.
+	double drift_ppm() const;
+	double resample_ratio() const;
+
+	void clear();
+
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
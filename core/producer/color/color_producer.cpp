@@ -26,10 +26,11 @@
 #include "../../monitor/monitor.h"
 
 #include "../frame/basic_frame.h"
+#include "../frame/color_frame.h"
 #include "../frame/frame_factory.h"
-#include "../../mixer/write_frame.h"
 
 #include <common/exception/exceptions.h>
+#include <common/utility/string.h>
 
 #include <core/parameters/parameters.h>
 
@@ -44,11 +45,13 @@ class color_producer : public frame_producer
 	monitor::subject		monitor_subject_;
 	safe_ptr<basic_frame>	frame_;
 	const std::wstring		color_str_;
+	const std::string		color_utf8_;	// Sent every frame, so converted once.
 
 public:
-	explicit color_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& color) 
+	explicit color_producer(const std::wstring& color) 
 		: color_str_(color)
-		, frame_(create_color_frame(this, frame_factory, color))
+		, color_utf8_(narrow(color))
+		, frame_(create_color_frame(color))
 	{
 	}
 
@@ -56,7 +59,7 @@ public:
 			
 	virtual safe_ptr<basic_frame> receive(int) override
 	{
-		monitor_subject_ << monitor::message("/color") % color_str_;
+		monitor_subject_ << monitor::message("/color") % color_utf8_;
 
 		return frame_;
 	}	
@@ -138,29 +141,23 @@ safe_ptr<frame_producer> create_color_producer(
 		return core::frame_producer::empty();
 
 	return create_producer_print_proxy(
-			make_safe<color_producer>(frame_factory, color2));
+			make_safe<color_producer>(color2));
 }
-safe_ptr<core::write_frame> create_color_frame(void* tag, const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& color)
+safe_ptr<core::basic_frame> create_color_frame(const std::wstring& color)
 {
 	auto color2 = get_hex_color(color);
 	if(color2.length() != 9 || color2[0] != '#')
 		BOOST_THROW_EXCEPTION(invalid_argument() << arg_name_info("color") << arg_value_info(narrow(color2)) << msg_info("Invalid color."));
-	
-	core::pixel_format_desc desc;
-	desc.pix_fmt = pixel_format::bgra;
-	desc.planes.push_back(core::pixel_format_desc::plane(1, 1, 4));
-	auto frame = frame_factory->create_frame(tag, desc);
-		
-	// Read color from hex-string and write to frame pixel.
-
-	auto& value = *reinterpret_cast<uint32_t*>(frame->image_data().begin());
+			
+	// Read color from hex-string, #AARRGGBB is a bgra pixel in memory.
+
+	uint32_t value = 0;
 	std::wstringstream str(color2.substr(1));
 	if(!(str >> std::hex >> value) || !str.eof())
 		BOOST_THROW_EXCEPTION(invalid_argument() << arg_name_info("color") << arg_value_info(narrow(color2)) << msg_info("Invalid color."));
-
-	frame->commit();
-		
-	return frame;
+	
+	// Drawn by the image mixer as a uniform color, there is nothing to upload.
+	return make_safe<color_frame>(value);
 }
 
 }}
\ No newline at end of file
@@ -28,12 +28,12 @@
 
 namespace caspar { namespace core {
 
-class write_frame;
+class basic_frame;
 struct frame_factory;
 
 safe_ptr<frame_producer> create_color_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params);
-safe_ptr<core::write_frame> create_color_frame(void* tag, const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& color);
+safe_ptr<core::basic_frame> create_color_frame(const std::wstring& color);
 
 }}
@@ -28,38 +28,90 @@
 
 #include <boost/foreach.hpp>
 
+#include <tbb/atomic.h>
+
 namespace caspar { namespace core {
+
+namespace {
+
+tbb::atomic<int64_t> g_num_allocated;
+
+bool is_concrete_frame(const basic_frame& frame)
+{
+	return &frame != basic_frame::empty().get() && &frame != basic_frame::eof().get() && &frame != basic_frame::late().get();
+}
+
+}
 																																						
 struct basic_frame::implementation
 {		
-	std::vector<safe_ptr<basic_frame>> frames_;
+	// Nearly every frame wraps exactly one other frame, which is kept inline to save the vector allocation.
+	std::shared_ptr<basic_frame>		frame_;
+	std::vector<safe_ptr<basic_frame>>	frames_;
 
 	frame_transform frame_transform_;	
 public:
-	implementation(const std::vector<safe_ptr<basic_frame>>& frames) : frames_(frames) 
+	implementation()
+	{
+		++g_num_allocated;
+	}
+	implementation(const implementation& other)
+		: frame_(other.frame_)
+		, frames_(other.frames_)
+		, frame_transform_(other.frame_transform_)
 	{
+		++g_num_allocated;
+	}
+	implementation(const std::vector<safe_ptr<basic_frame>>& frames)
+	{
+		++g_num_allocated;
+		if(!frames.empty())
+		{
+			frame_ = frames.front();
+			frames_.assign(frames.begin() + 1, frames.end());
+		}
 	}
-	implementation(std::vector<safe_ptr<basic_frame>>&& frames) : frames_(std::move(frames))
+	implementation(std::vector<safe_ptr<basic_frame>>&& frames) 
+		: frames_(std::move(frames))
 	{
+		++g_num_allocated;
+		if(!frames_.empty())
+		{
+			frame_ = frames_.front();
+			frames_.erase(frames_.begin());
+		}
 	}
 	implementation(safe_ptr<basic_frame>&& frame) 
+		: frame_(std::move(frame))
 	{
-		frames_.push_back(std::move(frame));
+		++g_num_allocated;
 	}
 	implementation(const safe_ptr<basic_frame>& frame) 		
+		: frame_(frame)
 	{ 
-		frames_.push_back(frame);
+		++g_num_allocated;
+	}
+
+	template<typename F>
+	void for_each_frame(const F& func)
+	{
+		if(!frame_)
+			return;
+
+		func(*frame_);
+		BOOST_FOREACH(auto& frame, frames_)
+			func(*frame);
 	}
 
 	int64_t get_and_record_age_millis(const basic_frame& self)
 	{
 		int64_t result = 0;
 
-		BOOST_FOREACH(auto& frame, frames_)
+		for_each_frame([&](basic_frame& frame)
 		{
-			if (is_concrete_frame(frame) && frame.get() != &self)
-				result = std::max(result, frame->get_and_record_age_millis());
-		}
+			if (is_concrete_frame(frame) && &frame != &self)
+				result = std::max(result, frame.get_and_record_age_millis());
+		});
 
 		return result;
 	}
@@ -67,8 +119,10 @@ public:
 	void accept(basic_frame& self, frame_visitor& visitor)
 	{
 		visitor.begin(self);
-		BOOST_FOREACH(auto frame, frames_)
-			frame->accept(visitor);
+		for_each_frame([&](basic_frame& frame)
+		{
+			frame.accept(visitor);
+		});
 		visitor.end();
 	}	
 
@@ -76,21 +130,21 @@ public:
 	{
 		int result = std::numeric_limits<int>().max();
 
-		BOOST_FOREACH(auto& frame, frames_)
+		for_each_frame([&](basic_frame& frame)
 		{
-			if (is_concrete_frame(frame) && frame.get() != &self)
-				result = std::min(result, frame->get_timecode());
-		}
+			if (is_concrete_frame(frame) && &frame != &self)
+				result = std::min(result, frame.get_timecode());
+		});
 		return result;
 	}
 };
 	
-basic_frame::basic_frame() : impl_(new implementation(std::vector<safe_ptr<basic_frame>>())){}
-basic_frame::basic_frame(const std::vector<safe_ptr<basic_frame>>& frames) : impl_(new implementation(frames)){}
-basic_frame::basic_frame(const basic_frame& other) : impl_(new implementation(*other.impl_)){}
-basic_frame::basic_frame(std::vector<safe_ptr<basic_frame>>&& frames) : impl_(new implementation(frames)){}
-basic_frame::basic_frame(const safe_ptr<basic_frame>& frame) : impl_(new implementation(frame)){}
-basic_frame::basic_frame(safe_ptr<basic_frame>&& frame)  : impl_(new implementation(std::move(frame))){}
+basic_frame::basic_frame() : impl_(make_safe<implementation>()){}
+basic_frame::basic_frame(const std::vector<safe_ptr<basic_frame>>& frames) : impl_(make_safe<implementation>(frames)){}
+basic_frame::basic_frame(const basic_frame& other) : impl_(make_safe<implementation>(*other.impl_)){}
+basic_frame::basic_frame(std::vector<safe_ptr<basic_frame>>&& frames) : impl_(make_safe<implementation>(std::move(frames))){}
+basic_frame::basic_frame(const safe_ptr<basic_frame>& frame) : impl_(make_safe<implementation>(frame)){}
+basic_frame::basic_frame(safe_ptr<basic_frame>&& frame)  : impl_(make_safe<implementation>(std::move(frame))){}
 basic_frame::basic_frame(basic_frame&& other) : impl_(std::move(other.impl_)){}
 basic_frame& basic_frame::operator=(const basic_frame& other)
 {
@@ -111,6 +165,7 @@ frame_transform& basic_frame::get_frame_transform() { return impl_->frame_transf
 int64_t basic_frame::get_and_record_age_millis() { return impl_->get_and_record_age_millis(*this); }
 int basic_frame::get_timecode() { return impl_->get_timecode(*this);; }
 void basic_frame::accept(frame_visitor& visitor){impl_->accept(*this, visitor);}
+int64_t basic_frame::num_allocated(){return g_num_allocated;}
 
 safe_ptr<basic_frame> basic_frame::interlace(const safe_ptr<basic_frame>& frame1, const safe_ptr<basic_frame>& frame2, field_mode::type mode)
 {				
@@ -81,6 +81,9 @@ public:
 	}
 	
 	virtual void accept(frame_visitor& visitor);
+
+	// Number of frames created by the process so far, including derived frames.
+	static int64_t num_allocated();
 private:
 	struct implementation;
 	safe_ptr<implementation> impl_;
@@ -0,0 +1,40 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "color_frame.h"
+
+namespace caspar { namespace core {
+
+color_frame::color_frame(uint32_t color) : color_(color){}
+
+void color_frame::accept(frame_visitor& visitor)
+{
+	visitor.begin(*this);
+	visitor.visit(*this);
+	visitor.end();
+}
+
+uint32_t color_frame::color() const{return color_;}
+bool color_frame::is_opaque() const{return (color_ >> 24) == 0xFF;}
+
+}}
@@ -0,0 +1,48 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "basic_frame.h"
+
+#include <cstdint>
+
+namespace caspar { namespace core {
+
+// A frame consisting of a single color, which the image mixer draws without any texture.
+class color_frame : public basic_frame
+{
+public:
+	explicit color_frame(uint32_t color); // As a bgra pixel in memory.
+
+	// basic_frame
+
+	virtual void accept(frame_visitor& visitor) override;
+
+	// color_frame
+
+	uint32_t color() const;
+	bool is_opaque() const;
+private:
+	const uint32_t color_;
+};
+
+}}
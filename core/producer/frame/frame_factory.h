@@ -43,6 +43,11 @@ struct frame_factory : boost::noncopyable
 			const channel_layout& audio_channel_layout = channel_layout::stereo()) = 0;	
 
 	virtual video_format_desc get_video_format_desc() const = 0; // nothrow
+
+	virtual int get_degradations() const {return 0;} // The degradation::type flags the load governor has in effect.
+
+	// Whether frames of the format can be created, the block compressed ones need support by the gpu.
+	virtual bool supports(pixel_format::type format) const {return get_texture_compression(format) == texture_compression::none;}
 };
 
 }}
\ No newline at end of file
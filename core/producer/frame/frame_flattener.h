@@ -0,0 +1,69 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "basic_frame.h"
+#include "frame_transform.h"
+#include "frame_visitor.h"
+
+#include <utility>
+#include <vector>
+
+namespace caspar { namespace core {
+
+// Collects the write frames of a frame with the transforms they are drawn with, for producers that look into the 
+// frames of others before passing them on.
+class frame_flattener : public frame_visitor
+{
+	std::vector<frame_transform> transform_stack_;
+public:
+	std::vector<std::pair<write_frame*, frame_transform>>	frames;
+	bool													has_colors;
+
+	frame_flattener() 
+		: transform_stack_(1)
+		, has_colors(false)
+	{
+	}
+
+	virtual void begin(basic_frame& frame) override
+	{
+		transform_stack_.push_back(transform_stack_.back()*frame.get_frame_transform());
+	}
+
+	virtual void end() override
+	{
+		transform_stack_.pop_back();
+	}
+
+	virtual void visit(write_frame& frame) override
+	{
+		frames.push_back(std::make_pair(&frame, transform_stack_.back()));
+	}
+
+	virtual void visit(color_frame& frame) override
+	{
+		has_colors = true;
+	}
+};
+
+}}
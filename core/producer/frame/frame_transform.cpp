@@ -25,6 +25,10 @@
 
 #include <common/utility/assert.h>
 
+#include <cstddef>
+
+#include <emmintrin.h>
+
 namespace caspar { namespace core {
 		
 frame_transform::frame_transform() 
@@ -37,11 +41,13 @@ frame_transform::frame_transform()
 	, is_key(false)
 	, is_mix(false)
 	, is_paused(false)
+	, lut(0)
 {
 	std::fill(fill_translation.begin(), fill_translation.end(), 0.0);
 	std::fill(fill_scale.begin(), fill_scale.end(), 1.0);
 	std::fill(clip_translation.begin(), clip_translation.end(), 0.0);
 	std::fill(clip_scale.begin(), clip_scale.end(), 1.0);
+	std::fill(motion_blur.begin(), motion_blur.end(), 0.0);
 }
 
 frame_transform& frame_transform::operator*=(const frame_transform &other)
@@ -64,10 +70,13 @@ frame_transform& frame_transform::operator*=(const frame_transform &other)
 	levels.min_output		 = std::max(levels.min_output, other.levels.min_output);
 	levels.max_output		 = std::min(levels.max_output, other.levels.max_output);
 	levels.gamma			*= other.levels.gamma;
+	motion_blur[0]			+= other.motion_blur[0];
+	motion_blur[1]			+= other.motion_blur[1];
 	field_mode				 = static_cast<field_mode::type>(field_mode & other.field_mode);
 	is_key					|= other.is_key;
 	is_mix					|= other.is_mix;
 	is_paused				|= other.is_paused;
+	lut						 = other.lut != 0 ? other.lut : lut;
 
 	return *this;
 }
@@ -103,10 +112,41 @@ frame_transform tween(double time, const frame_transform& source, const frame_tr
 	result.levels.max_output	= do_tween(time, source.levels.max_output,		dest.levels.max_output,		duration, tweener);
 	result.levels.min_output	= do_tween(time, source.levels.min_output,		dest.levels.min_output,		duration, tweener);
 	result.levels.gamma			= do_tween(time, source.levels.gamma,			dest.levels.gamma,			duration, tweener);
+	result.motion_blur[0]		= do_tween(time, source.motion_blur[0],			dest.motion_blur[0],		duration, tweener);
+	result.motion_blur[1]		= do_tween(time, source.motion_blur[1],			dest.motion_blur[1],		duration, tweener);
+	result.field_mode			= static_cast<field_mode::type>(source.field_mode & dest.field_mode);
+	result.is_key				= source.is_key | dest.is_key;
+	result.is_mix				= source.is_mix | dest.is_mix;
+	result.is_paused			= source.is_paused | dest.is_paused;
+	result.lut					= dest.lut;
+	return result;
+}
+
+// The tweened members, from volume to the motion blur, are consecutive doubles.
+static const int NUM_TWEENED = 20;
+static_assert(offsetof(frame_transform, volume) == 0 && offsetof(frame_transform, field_mode) == NUM_TWEENED*sizeof(double), "frame_transform layout");
+
+frame_transform tween(const frame_transform& source, const frame_transform& dest, double progress)
+{
+	frame_transform result;
+
+	auto src	= reinterpret_cast<const double*>(&source);
+	auto dst	= reinterpret_cast<const double*>(&dest);
+	auto out	= reinterpret_cast<double*>(&result);
+	auto k		= _mm_set1_pd(progress);
+
+	for(int n = 0; n < NUM_TWEENED; n += 2)
+	{
+		auto s = _mm_loadu_pd(src + n);
+		auto d = _mm_loadu_pd(dst + n);
+		_mm_storeu_pd(out + n, _mm_add_pd(s, _mm_mul_pd(_mm_sub_pd(d, s), k)));
+	}
+
 	result.field_mode			= static_cast<field_mode::type>(source.field_mode & dest.field_mode);
 	result.is_key				= source.is_key | dest.is_key;
 	result.is_mix				= source.is_mix | dest.is_mix;
 	result.is_paused			= source.is_paused | dest.is_paused;
+	result.lut					= dest.lut;
 	return result;
 }
 
@@ -64,17 +64,20 @@ public:
 	boost::array<double, 2>	clip_translation;  
 	boost::array<double, 2>	clip_scale;  
 	levels					levels;
+	boost::array<double, 2>	motion_blur; // Pixels of the channel the image moves during the frame, blurred along.
 
 	field_mode::type		field_mode;
 	bool					is_key;
 	bool					is_mix;
 	bool					is_paused;
+	int						lut; // Id of a color_lut from load_color_lut, 0 for none.
 	
 	frame_transform& frame_transform::operator*=(const frame_transform &other);
 	frame_transform frame_transform::operator*(const frame_transform &other) const;
 };
 
 frame_transform tween(double time, const frame_transform& source, const frame_transform& dest, double duration, const tweener_t& tweener);
+frame_transform tween(const frame_transform& source, const frame_transform& dest, double progress); // See get_tween_curve.
 
 bool operator<(const frame_transform& lhs, const frame_transform& rhs);
 bool operator==(const frame_transform& lhs, const frame_transform& rhs);
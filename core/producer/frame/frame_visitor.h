@@ -25,6 +25,7 @@ namespace caspar{ namespace core{
 
 class basic_frame;
 class write_frame;
+class color_frame;
 
 struct frame_visitor
 {
@@ -32,6 +33,7 @@ struct frame_visitor
 	virtual void begin(basic_frame& frame) = 0;
 	virtual void end() = 0;
 	virtual void visit(write_frame& frame) = 0;
+	virtual void visit(color_frame& frame) = 0;
 };
 
 }}
\ No newline at end of file
@@ -37,6 +37,20 @@ struct pixel_format
 		ycbcr,
 		ycbcra,
 		luma,
+		color, // A single color without planes, see color_frame.
+		nv12,		// 8 bit luma plane and interleaved cb/cr plane.
+		p010,		// As nv12 with 16 bit samples, the 10 significant bits in the msbs.
+		ycbcr10,	// As ycbcr with 16 bit samples, the 10 significant bits in the lsbs.
+		ycbcra10,
+		rgb48,		// Packed 16 bit samples.
+		rgba64,
+		v210,		// 10 bit 4:2:2 packed as on SDI, a single plane of 32 bit words (see packed_width).
+		ycbcr_keyed, // ycbcr with the video range luma of a key as a fourth plane, shown premultiplied by it.
+		bgra_keyed,	// bgra with the video range luma of a key as a second plane, likewise.
+		dxt1,		// Block compressed rgb as in hap, uploaded as it is and decoded by the gpu when sampled.
+		dxt5,		// Block compressed rgba.
+		ycocg_dxt5,	// Scaled YCoCg with luma in alpha, in dxt5 blocks (hap q).
+		bc7,		// Block compressed rgba at higher quality (hap r).
 		count,
 		invalid
 	};
@@ -51,26 +65,148 @@ struct pixel_format_desc
 		uint32_t height;
 		uint32_t size;
 		uint32_t channels;
+		uint32_t depth; // Bytes per channel, 1 or 2.
 
 		plane() 
 			: linesize(0)
 			, width(0)
 			, height(0)
 			, size(0)
-			, channels(0){}
+			, channels(0)
+			, depth(0){}
 
-		plane(uint32_t width, uint32_t height, uint32_t channels)
-			: linesize(width*channels)
+		plane(uint32_t width, uint32_t height, uint32_t channels, uint32_t depth = 1)
+			: linesize(width*channels*depth)
 			, width(width)
 			, height(height)
-			, size(width*height*channels)
-			, channels(channels){}
+			, size(width*height*channels*depth)
+			, channels(channels)
+			, depth(depth){}
 	};
 
-	pixel_format_desc() : pix_fmt(pixel_format::invalid){}
+	pixel_format_desc() 
+		: pix_fmt(pixel_format::invalid)
+		, is_opaque(false)
+		, is_still(false)
+		, packed_width(0){}
 	
 	pixel_format::type pix_fmt;
 	std::vector<plane> planes;
+	bool			   is_opaque; // Hint that every pixel has full alpha, formats without alpha are always opaque.
+	bool			   is_still; // Hint that the image is shown for many frames, small bgra ones may share an atlas texture.
+	uint32_t		   packed_width; // Pixels per row of packed formats, whose planes are sized in words.
+};
+
+// Whether every pixel of an image in the format has full alpha.
+inline bool is_opaque(const pixel_format_desc& desc)
+{
+	switch(desc.pix_fmt)
+	{
+	case pixel_format::gray:
+	case pixel_format::ycbcr:
+	case pixel_format::luma:
+	case pixel_format::nv12:
+	case pixel_format::p010:
+	case pixel_format::ycbcr10:
+	case pixel_format::rgb48:
+	case pixel_format::v210:
+	case pixel_format::dxt1:
+	case pixel_format::ycocg_dxt5:
+		return true;
+	default:
+		return desc.is_opaque;
+	}
+}
+
+// How the texture of a block compressed format is stored on the gpu. A plane of such a format is sized in pixels, 
+// with its linesize being a row of 4x4 blocks.
+struct texture_compression
+{
+	enum type
+	{
+		none = 0,
+		dxt1,	// 8 bytes per block.
+		dxt5,	// 16 bytes per block.
+		bc7,	// 16 bytes per block.
+		count
+	};
+};
+
+inline texture_compression::type get_texture_compression(pixel_format::type format)
+{
+	switch(format)
+	{
+	case pixel_format::dxt1:		return texture_compression::dxt1;
+	case pixel_format::dxt5:		
+	case pixel_format::ycocg_dxt5:	return texture_compression::dxt5;
+	case pixel_format::bc7:			return texture_compression::bc7;
+	default:						return texture_compression::none;
+	}
+}
+
+inline uint32_t get_compressed_linesize(texture_compression::type compression, uint32_t width)
+{
+	return ((width + 3) / 4) * (compression == texture_compression::dxt1 ? 8 : 16);
+}
+
+inline uint32_t get_compressed_size(texture_compression::type compression, uint32_t width, uint32_t height)
+{
+	return get_compressed_linesize(compression, width) * ((height + 3) / 4);
+}
+
+// The single plane of blocks of a block compressed image.
+inline pixel_format_desc get_compressed_pixel_format_desc(pixel_format::type format, uint32_t width, uint32_t height)
+{
+	auto compression = get_texture_compression(format);
+
+	pixel_format_desc::plane plane(width, height, 4);
+	plane.linesize	= get_compressed_linesize(compression, width);
+	plane.size		= get_compressed_size(compression, width, height);
+
+	pixel_format_desc desc;
+	desc.pix_fmt = format;
+	desc.planes.push_back(plane);
+	return desc;
+}
+
+// A rectangle of pixels in a plane, see write_frame::commit.
+struct image_region
+{
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+
+	image_region()
+		: x(0), y(0), width(0), height(0){}
+
+	image_region(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+		: x(x), y(y), width(width), height(height){}
+};
+
+// The part of a texture which holds an image, in normalized coordinates. All of it unless the image is in an atlas.
+struct texture_rect
+{
+	double x;
+	double y;
+	double width;
+	double height;
+
+	texture_rect()
+		: x(0.0), y(0.0), width(1.0), height(1.0){}
+
+	texture_rect(double x, double y, double width, double height)
+		: x(x), y(y), width(width), height(height){}
+
+	bool operator==(const texture_rect& other) const
+	{
+		return x == other.x && y == other.y && width == other.width && height == other.height;
+	}
+
+	bool operator!=(const texture_rect& other) const
+	{
+		return !(*this == other);
+	}
 };
 
 }}
\ No newline at end of file
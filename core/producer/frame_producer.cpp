@@ -32,12 +32,29 @@
 
 #include <common/memory/safe_ptr.h>
 #include <common/concurrency/executor.h>
+#include <common/concurrency/thread_placement.h>
 #include <common/exception/exceptions.h>
 #include <common/utility/move_on_copy.h>
+#include <common/env.h>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/mutex.h>
+
+#include <deque>
 
 namespace caspar { namespace core {
 	
-std::vector<const producer_factory_t> g_factories;
+struct producer_factory_entry
+{
+	producer_factory_t			factory;
+	producer_factory_filter_t	filter;
+};
+
+std::vector<const producer_factory_entry> g_factories;
 std::vector<const producer_factory_t> g_thumbnail_factories;
 
 tbb::atomic<bool>& destroy_producers_in_separate_thread()
@@ -52,6 +69,218 @@ void destroy_producers_synchronously()
 	destroy_producers_in_separate_thread() = false;
 }
 	
+// Producers are destroyed on a few threads of below normal priority, in the order they were released, so that 
+// clearing many layers at once does not tear them all down next to the channels. A destruction taking longer than 
+// the timeout of its type of producer is reported as a zombie, and once every thread is held up by one another 
+// thread is added.
+class producer_destroyer : boost::noncopyable
+{
+	struct worker
+	{
+		std::unique_ptr<executor>		executor;
+		bool							busy;
+		std::wstring					producer;
+		std::wstring					type;
+		boost::posix_time::ptime		started;
+		bool							zombie;
+
+		worker() : busy(false), zombie(false){}
+	};
+
+	const int										threads_;
+	const int										max_threads_;
+	mutable tbb::mutex								mutex_;
+	std::deque<std::shared_ptr<frame_producer>>		queue_;
+	std::vector<std::shared_ptr<worker>>			workers_;
+	int64_t											destroyed_;
+	double											total_millis_;
+	double											max_millis_;
+	mutable int										zombies_;
+	mutable int64_t									total_zombies_;
+public:
+	producer_destroyer()
+		: threads_(std::max(1, env::properties().get(L"configuration.producer-teardown.threads", 2)))
+		, max_threads_(threads_ + 16)
+		, destroyed_(0)
+		, total_millis_(0.0)
+		, max_millis_(0.0)
+		, zombies_(0)
+		, total_zombies_(0)
+	{
+	}
+
+	static producer_destroyer& instance()
+	{
+		static producer_destroyer destroyer;
+		return destroyer;
+	}
+
+	void destroy(std::shared_ptr<frame_producer>&& producer)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		queue_.push_back(std::move(producer));
+		update_zombies();
+
+		std::shared_ptr<worker> idle;
+		BOOST_FOREACH(auto& worker, workers_)
+		{
+			if(!worker->busy)
+			{
+				idle = worker;
+				break;
+			}
+		}
+
+		if(!idle && (static_cast<int>(workers_.size()) < threads_ || (zombies_ == static_cast<int>(workers_.size()) && static_cast<int>(workers_.size()) < max_threads_)))
+		{
+			// The destroyers do not take the placement of the channel thread releasing the producer.
+			scoped_thread_placement placement((thread_placement()));
+
+			idle = std::make_shared<worker>();
+			idle->executor.reset(new executor(L"destroyer"));
+			idle->executor->set_priority_class(below_normal_priority_class);
+			workers_.push_back(idle);
+
+			if(static_cast<int>(workers_.size()) > threads_)
+				CASPAR_LOG(warning) << L"[producer_destroyer] Every destroyer is held up, added destroyer " << workers_.size() << L".";
+		}
+
+		if(!idle)
+			return;
+
+		idle->busy = true;
+		idle->executor->begin_invoke([=]
+		{
+			drain(idle);
+		});
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		update_zombies();
+
+		info.add(L"threads", workers_.size());
+		info.add(L"queued", queue_.size());
+		info.add(L"destroyed", destroyed_);
+		info.add(L"average-time", destroyed_ > 0 ? total_millis_ / static_cast<double>(destroyed_) : 0.0); // ms
+		info.add(L"max-time", max_millis_); // ms
+		info.add(L"zombies", zombies_);
+		info.add(L"total-zombies", total_zombies_);
+
+		BOOST_FOREACH(auto& worker, workers_)
+		{
+			if(!worker->busy || worker->producer.empty())
+				continue;
+
+			auto& child = info.add(L"destroying.producer", worker->producer);
+			child.add(L"<xmlattr>.elapsed", elapsed_millis(worker->started));
+			child.add(L"<xmlattr>.zombie", worker->zombie);
+		}
+
+		return info;
+	}
+private:
+	void drain(const std::shared_ptr<worker>& self)
+	{
+		while(true)
+		{
+			std::shared_ptr<frame_producer> producer;
+			{
+				tbb::mutex::scoped_lock lock(mutex_);
+				if(queue_.empty())
+				{
+					self->busy = false;
+					return;
+				}
+				producer = std::move(queue_.front());
+				queue_.pop_front();
+			}
+
+			std::wstring str;
+			try
+			{
+				str = producer->print();
+				if(!producer.unique())
+					CASPAR_LOG(trace) << str << L" Not destroyed on asynchronous destruction thread: " << producer.use_count();
+				else
+					CASPAR_LOG(trace) << str << L" Destroying on asynchronous destruction thread.";
+			}
+			catch(...){}
+
+			{
+				tbb::mutex::scoped_lock lock(mutex_);
+				self->producer	= str;
+				self->type		= str.substr(0, str.find(L'['));
+				self->started	= boost::posix_time::microsec_clock::universal_time();
+				self->zombie	= false;
+			}
+
+			try
+			{
+				producer.reset();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto millis = elapsed_millis(self->started);
+			++destroyed_;
+			total_millis_ += millis;
+			max_millis_ = std::max(max_millis_, millis);
+
+			if(self->zombie)
+			{
+				--zombies_;
+				CASPAR_LOG(info) << L"[producer_destroyer] " << self->producer << L" Destroyed after " << static_cast<int>(millis) << L" ms.";
+			}
+
+			self->producer.clear();
+			self->zombie = false;
+		}
+	}
+
+	// Under the lock.
+	void update_zombies() const
+	{
+		BOOST_FOREACH(auto& worker, workers_)
+		{
+			if(!worker->busy || worker->zombie || worker->producer.empty())
+				continue;
+
+			if(elapsed_millis(worker->started) > timeout(worker->type) * 1000.0)
+			{
+				worker->zombie = true;
+				++zombies_;
+				++total_zombies_;
+				CASPAR_LOG(warning) << L"[producer_destroyer] " << worker->producer << L" Still being destroyed after " << timeout(worker->type) << L" s.";
+			}
+		}
+	}
+
+	static double timeout(const std::wstring& type)
+	{
+		auto timeout = env::properties().get(L"configuration.producer-teardown.timeout", 5.0);
+
+		if(type.empty() || type.find_first_of(L". ") != std::wstring::npos)
+			return timeout;
+
+		return env::properties().get(L"configuration.producer-teardown.timeouts." + type, timeout);
+	}
+
+	static double elapsed_millis(const boost::posix_time::ptime& since)
+	{
+		return static_cast<double>((boost::posix_time::microsec_clock::universal_time() - since).total_microseconds()) / 1000.0;
+	}
+};
+
 class destroy_producer_proxy : public frame_producer
 {	
 	std::unique_ptr<std::shared_ptr<frame_producer>> producer_;
@@ -64,20 +293,11 @@ public:
 
 	~destroy_producer_proxy()
 	{
-		static auto destroyers = std::make_shared<tbb::concurrent_bounded_queue<std::shared_ptr<executor>>>();
-		static tbb::atomic<int> destroyer_count;
-
 		if (!destroy_producers_in_separate_thread())
 		{
 			try
 			{
 				producer_.reset();
-
-				std::shared_ptr<executor> destroyer;
-
-				// Destruct any executors, causing them to execute pending tasks
-				while (destroyers->try_pop(destroyer))
-					--destroyer_count;
 			}
 			catch (...)
 			{
@@ -89,35 +309,7 @@ public:
 
 		try
 		{
-			std::shared_ptr<executor> destroyer;
-			if(!destroyers->try_pop(destroyer))
-			{
-				destroyer.reset(new executor(L"destroyer"));
-				destroyer->set_priority_class(below_normal_priority_class);
-				if(++destroyer_count > 16)
-					CASPAR_LOG(warning) << L"Potential destroyer dead-lock detected.";
-				CASPAR_LOG(trace) << "Created destroyer: " << destroyer_count;
-			}
-				
-			auto producer = producer_.release();
-			auto pool	  = destroyers;
-			destroyer->begin_invoke([=]
-			{
-				std::unique_ptr<std::shared_ptr<frame_producer>> producer2(producer);
-
-				auto str = (*producer2)->print();
-				try
-				{
-					if(!producer->unique())
-						CASPAR_LOG(trace) << str << L" Not destroyed on asynchronous destruction thread: " << producer->use_count();
-					else
-						CASPAR_LOG(trace) << str << L" Destroying on asynchronous destruction thread.";
-				}
-				catch(...){}
-								
-				producer2.reset();
-				pool->push(destroyer);
-			}); 
+			producer_destroyer::instance().destroy(std::move(*producer_));
 		}
 		catch(...)
 		{
@@ -133,12 +325,15 @@ public:
 	virtual safe_ptr<basic_frame>								receive(int hints) override												{return (*producer_)->receive(hints);}
 	virtual safe_ptr<basic_frame>								last_frame() const override		 										{return (*producer_)->last_frame();}
 	virtual safe_ptr<basic_frame>								create_thumbnail_frame() override										{return (*producer_)->create_thumbnail_frame();}
+	virtual std::vector<safe_ptr<basic_frame>>					create_scrub_frames(int count) override									{return (*producer_)->create_scrub_frames(count);}
 	virtual std::wstring										print() const override													{return (*producer_)->print();}
 	virtual boost::property_tree::wptree 						info() const override													{return (*producer_)->info();}
 	virtual boost::unique_future<std::wstring>					call(const std::wstring& str) override									{return (*producer_)->call(str);}
 	virtual safe_ptr<frame_producer>							get_following_producer() const override									{return (*producer_)->get_following_producer();}
 	virtual void												set_leading_producer(const safe_ptr<frame_producer>& producer) override	{(*producer_)->set_leading_producer(producer);}
 	virtual uint32_t											nb_frames() const override												{return (*producer_)->nb_frames();}
+	virtual void												preroll(int hints) override												{(*producer_)->preroll(hints);}
+	virtual bool												is_ready() const override												{return (*producer_)->is_ready();}
 	virtual monitor::subject&									monitor_output()														{return (*producer_)->monitor_output();}
 };
 
@@ -147,6 +342,11 @@ safe_ptr<core::frame_producer> create_producer_destroy_proxy(safe_ptr<core::fram
 	return make_safe<destroy_producer_proxy>(std::move(producer));
 }
 
+boost::property_tree::wptree get_producer_teardown_info()
+{
+	return producer_destroyer::instance().info();
+}
+
 class print_producer_proxy : public frame_producer
 {	
 	std::shared_ptr<frame_producer> producer_;
@@ -168,12 +368,15 @@ public:
 	virtual safe_ptr<basic_frame>								receive(int hints) override												{return (producer_)->receive(hints);}
 	virtual safe_ptr<basic_frame>								last_frame() const override		 										{return (producer_)->last_frame();}
 	virtual safe_ptr<basic_frame>								create_thumbnail_frame() override										{return (producer_)->create_thumbnail_frame();}
+	virtual std::vector<safe_ptr<basic_frame>>					create_scrub_frames(int count) override									{return (producer_)->create_scrub_frames(count);}
 	virtual std::wstring										print() const override													{return (producer_)->print();}
 	virtual boost::property_tree::wptree 						info() const override													{return (producer_)->info();}
 	virtual boost::unique_future<std::wstring>					call(const std::wstring& str) override									{return (producer_)->call(str);}
 	virtual safe_ptr<frame_producer>							get_following_producer() const override									{return (producer_)->get_following_producer();}
 	virtual void												set_leading_producer(const safe_ptr<frame_producer>& producer) override	{(producer_)->set_leading_producer(producer);}
 	virtual uint32_t											nb_frames() const override												{return (producer_)->nb_frames();}
+	virtual void												preroll(int hints) override												{(producer_)->preroll(hints);}
+	virtual bool												is_ready() const override												{return (producer_)->is_ready();}
 	virtual monitor::subject&									monitor_output()														{return (producer_)->monitor_output();}
 };
 
@@ -182,6 +385,42 @@ safe_ptr<core::frame_producer> create_producer_print_proxy(safe_ptr<core::frame_
 	return make_safe<print_producer_proxy>(std::move(producer));
 }
 
+// Reports the parameters a producer was created from in its info, so that the
+// layer can be recreated, like when restoring the channels after a restart.
+class creation_params_producer_proxy : public frame_producer
+{	
+	std::shared_ptr<frame_producer>	producer_;
+	const std::vector<std::wstring>	params_;
+public:
+	creation_params_producer_proxy(safe_ptr<frame_producer>&& producer, const std::vector<std::wstring>& params) 
+		: producer_(std::move(producer))
+		, params_(params)
+	{
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		auto info = producer_->info();
+		auto& creation_params = info.add_child(L"creation-params", boost::property_tree::wptree());
+		BOOST_FOREACH(auto& param, params_)
+			creation_params.add(L"param", param);
+		return info;
+	}
+
+	virtual safe_ptr<basic_frame>								receive(int hints) override												{return (producer_)->receive(hints);}
+	virtual safe_ptr<basic_frame>								last_frame() const override		 										{return (producer_)->last_frame();}
+	virtual safe_ptr<basic_frame>								create_thumbnail_frame() override										{return (producer_)->create_thumbnail_frame();}
+	virtual std::vector<safe_ptr<basic_frame>>					create_scrub_frames(int count) override									{return (producer_)->create_scrub_frames(count);}
+	virtual std::wstring										print() const override													{return (producer_)->print();}
+	virtual boost::unique_future<std::wstring>					call(const std::wstring& str) override									{return (producer_)->call(str);}
+	virtual safe_ptr<frame_producer>							get_following_producer() const override									{return (producer_)->get_following_producer();}
+	virtual void												set_leading_producer(const safe_ptr<frame_producer>& producer) override	{(producer_)->set_leading_producer(producer);}
+	virtual uint32_t											nb_frames() const override												{return (producer_)->nb_frames();}
+	virtual void												preroll(int hints) override												{(producer_)->preroll(hints);}
+	virtual bool												is_ready() const override												{return (producer_)->is_ready();}
+	virtual monitor::subject&									monitor_output()														{return (producer_)->monitor_output();}
+};
+
 class last_frame_producer : public frame_producer
 {
 	const std::wstring			print_;
@@ -246,6 +485,11 @@ safe_ptr<basic_frame> frame_producer::create_thumbnail_frame()
 	return basic_frame::empty();
 }
 
+std::vector<safe_ptr<basic_frame>> frame_producer::create_scrub_frames(int count)
+{
+	return std::vector<safe_ptr<basic_frame>>();
+}
+
 safe_ptr<basic_frame> receive_and_follow(safe_ptr<frame_producer>& producer, int hints)
 {	
 	auto frame = producer->receive(hints);
@@ -268,7 +512,15 @@ safe_ptr<basic_frame> receive_and_follow(safe_ptr<frame_producer>& producer, int
 
 void register_producer_factory(const producer_factory_t& factory)
 {
-	g_factories.push_back(factory);
+	register_producer_factory(factory, nullptr);
+}
+
+void register_producer_factory(const producer_factory_t& factory, const producer_factory_filter_t& filter)
+{
+	producer_factory_entry entry;
+	entry.factory	= factory;
+	entry.filter	= filter;
+	g_factories.push_back(entry);
 }
 
 void register_thumbnail_producer_factory(const producer_factory_t& factory)
@@ -303,9 +555,148 @@ safe_ptr<core::frame_producer> do_create_producer(const safe_ptr<frame_factory>&
 	return producer;
 }
 
+// Remembers which factory accepted the parameters for a resource, so that the
+// next time only that one is asked, and for a shorter while that none did.
+class producer_route_cache : boost::noncopyable
+{
+	struct route
+	{
+		int							factory; // -1 when no factory accepted it.
+		boost::posix_time::ptime	expires;
+	};
+
+	static const size_t				MAX_ROUTES = 4096;
+
+	boost::mutex					mutex_;
+	std::map<std::wstring, route>	routes_;
+public:
+	bool find(const std::wstring& key, int& factory)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		auto it = routes_.find(key);
+		if (it == routes_.end())
+			return false;
+
+		if (it->second.expires < boost::posix_time::microsec_clock::universal_time())
+		{
+			routes_.erase(it);
+			return false;
+		}
+
+		factory = it->second.factory;
+		return true;
+	}
+
+	void store(const std::wstring& key, int factory)
+	{
+		static const int hit_millis		= env::properties().get(L"configuration.producer-routing.hit-cache-millis", 60000);
+		static const int miss_millis	= env::properties().get(L"configuration.producer-routing.miss-cache-millis", 2000);
+
+		auto now = boost::posix_time::microsec_clock::universal_time();
+
+		boost::mutex::scoped_lock lock(mutex_);
+
+		if (routes_.size() >= MAX_ROUTES)
+		{
+			for (auto it = routes_.begin(); it != routes_.end();)
+			{
+				if (it->second.expires < now)
+					it = routes_.erase(it);
+				else
+					++it;
+			}
+
+			if (routes_.size() >= MAX_ROUTES)
+				routes_.clear();
+		}
+
+		route r;
+		r.factory	= factory;
+		r.expires	= now + boost::posix_time::milliseconds(factory == -1 ? miss_millis : hit_millis);
+		routes_[key] = r;
+	}
+
+	void forget(const std::wstring& key)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		routes_.erase(key);
+	}
+};
+
+producer_route_cache& route_cache()
+{
+	static producer_route_cache cache;
+	return cache;
+}
+
+safe_ptr<core::frame_producer> try_factory(const producer_factory_t& factory, const safe_ptr<frame_factory>& my_frame_factory, const core::parameters& params)
+{
+	try
+	{
+		return factory(my_frame_factory, params);
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+	}
+
+	return frame_producer::empty();
+}
+
+// Factories answer from the resource name, the files on disk and what their
+// filters look at, so those make up the key of the route.
+safe_ptr<core::frame_producer> resolve_producer(const safe_ptr<frame_factory>& my_frame_factory, const core::parameters& params)
+{
+	if(params.empty())
+		BOOST_THROW_EXCEPTION(invalid_argument() << arg_name_info("params") << arg_value_info(""));
+
+	std::vector<bool> candidates;
+	std::wstring key = boost::to_upper_copy(params.at_original(0)) + L"|";
+	BOOST_FOREACH(auto& entry, g_factories)
+	{
+		candidates.push_back(!entry.filter || entry.filter(params));
+		key += candidates.back() ? L'1' : L'0';
+	}
+
+	int factory = -1;
+	if(route_cache().find(key, factory))
+	{
+		if(factory == -1)
+			return create_color_producer(my_frame_factory, params);
+
+		auto producer = try_factory(g_factories.at(factory).factory, my_frame_factory, params);
+		if(producer != frame_producer::empty())
+			return producer;
+
+		route_cache().forget(key); // The resource has changed since.
+	}
+
+	auto producer = frame_producer::empty();
+	for(factory = 0; factory < static_cast<int>(g_factories.size()); ++factory)
+	{
+		if(!candidates[factory])
+			continue;
+
+		producer = try_factory(g_factories[factory].factory, my_frame_factory, params);
+		if(producer != frame_producer::empty())
+			break;
+	}
+
+	if(producer == frame_producer::empty())
+	{
+		route_cache().store(key, -1);
+		return create_color_producer(my_frame_factory, params);
+	}
+
+	route_cache().store(key, factory);
+	return producer;
+}
+
 safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>& my_frame_factory, const core::parameters& params)
 {	
-	auto producer = do_create_producer(my_frame_factory, params, g_factories);
+	auto producer = resolve_producer(my_frame_factory, params);
 	auto key_producer = frame_producer::empty();
 	
 	std::wstring resource_name = L"";
@@ -324,11 +715,11 @@ safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>& my
 			auto resource_name = params_copy.at_original(0);
 			params_copy.set(0, resource_name + L"_A");
 			params_copy.push_back(L"IS_ALPHA");
-			key_producer = do_create_producer(my_frame_factory, params_copy, g_factories);			
+			key_producer = resolve_producer(my_frame_factory, params_copy);			
 			if(key_producer == frame_producer::empty())
 			{
 				params_copy.set(0, resource_name + L"_ALPHA");
-				key_producer = do_create_producer(my_frame_factory, params_copy, g_factories);	
+				key_producer = resolve_producer(my_frame_factory, params_copy);	
 			}
 		}
 	}
@@ -336,7 +727,7 @@ safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>& my
 	}
 
 	if(producer != frame_producer::empty() && key_producer != frame_producer::empty())
-		return create_separated_producer(producer, key_producer);
+		producer = create_separated_producer(producer, key_producer);
 	
 	if(producer == frame_producer::empty())
 	{
@@ -344,7 +735,7 @@ safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>& my
 		BOOST_THROW_EXCEPTION(file_not_found() << msg_info("No match found for supplied commands. Check syntax.") << arg_value_info(narrow(str)));
 	}
 
-	return producer;
+	return make_safe<creation_params_producer_proxy>(std::move(producer), params.get_original());
 }
 
 safe_ptr<core::frame_producer> create_thumbnail_producer(const safe_ptr<frame_factory>& my_frame_factory, const std::wstring& media_file)
@@ -55,7 +55,9 @@ public:
 	{
 		NO_HINT = 0,
 		ALPHA_HINT = 1,
-		DEINTERLACE_HINT
+		DEINTERLACE_HINT,
+		HALF_SCALE_HINT = 4,	// Shown at no more than half the channel's size, producers may decode and upload at that.
+		QUARTER_SCALE_HINT = 8	// At no more than a quarter.
 	};
 
 	virtual ~frame_producer(){}	
@@ -72,10 +74,14 @@ public:
 	virtual void set_leading_producer(const safe_ptr<frame_producer>&) {}  // nothrow
 		
 	virtual uint32_t nb_frames() const {return std::numeric_limits<uint32_t>::max();}
+
+	virtual void preroll(int hints) {}	// Called every frame while loaded in the background, to decode ahead before playing.
+	virtual bool is_ready() const {return true;}  // nothrow, true once pre-rolled.
 	
 	virtual safe_ptr<basic_frame> receive(int hints) = 0;
 	virtual safe_ptr<core::basic_frame> last_frame() const = 0;
 	virtual safe_ptr<basic_frame> create_thumbnail_frame();
+	virtual std::vector<safe_ptr<basic_frame>> create_scrub_frames(int count); // Evenly spaced over the clip, none without a timeline.
 
 	static const safe_ptr<frame_producer>& empty(); // nothrow
 
@@ -85,7 +91,13 @@ public:
 safe_ptr<basic_frame> receive_and_follow(safe_ptr<frame_producer>& producer, int hints);
 
 typedef std::function<safe_ptr<core::frame_producer>(const safe_ptr<frame_factory>&, const core::parameters& params)> producer_factory_t;
+// Tells from the parameters alone, without looking at files or devices, whether
+// a factory could accept them. Factories with a filter are only asked when it
+// passes, and the filters should check everything but the resource name and
+// the files it refers to that the factory decides on.
+typedef std::function<bool (const core::parameters& params)> producer_factory_filter_t;
 void register_producer_factory(const producer_factory_t& factory); // Not thread-safe.
+void register_producer_factory(const producer_factory_t& factory, const producer_factory_filter_t& filter); // Not thread-safe.
 void register_thumbnail_producer_factory(const producer_factory_t& factory); // Not thread-safe.
 safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>&, const core::parameters& params);
 safe_ptr<core::frame_producer> create_producer(const safe_ptr<frame_factory>&, const std::wstring& params);
@@ -94,4 +106,8 @@ safe_ptr<core::frame_producer> create_producer_print_proxy(safe_ptr<core::frame_
 safe_ptr<core::frame_producer> create_thumbnail_producer(const safe_ptr<frame_factory>& factory, const std::wstring& media_file);
 void destroy_producers_synchronously();
 
+// The threads destroying producers in the background, how long destructions take and the ones taking longer 
+// than configuration.producer-teardown.timeout.
+boost::property_tree::wptree get_producer_teardown_info();
+
 }}
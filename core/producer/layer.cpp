@@ -110,6 +110,8 @@ public:
 		{
 			*monitor_subject_ << monitor::message("/paused") % is_paused_;
 
+			preroll_background(hints);
+
 			if(is_paused_)
 			{
 				if(foreground_->last_frame() == basic_frame::empty())
@@ -147,6 +149,22 @@ public:
 		}
 	}
 
+	void preroll_background(int hints)
+	{
+		if(background_ == frame_producer::empty())
+			return;
+
+		try
+		{
+			background_->preroll(hints);
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << background_->print() << L" Failed to preroll.";
+		}
+	}
+
 	boost::unique_future<std::wstring> call(bool foreground, const std::wstring& param)
 	{
 		static const boost::wregex loop_exp(L"SEEK\\s*(?<VALUE>\\d+)", boost::regex::icase);
@@ -185,6 +203,7 @@ public:
 		info.add(L"nb_frames",	 nb_frames == std::numeric_limits<int64_t>::max() ? -1 : nb_frames);
 		info.add(L"frames-left", nb_frames == std::numeric_limits<int64_t>::max() ? -1 : (foreground_->nb_frames() - frame_number_ - auto_play_delta_));
 		info.add(L"frame-age", current_frame_age_);
+		info.add(L"background.status", background_ == frame_producer::empty() ? L"empty" : (background_->is_ready() ? L"ready" : L"prerolling"));
 		info.add_child(L"foreground.producer", foreground_->info());
 		info.add_child(L"background.producer", background_->info());
 		return info;
@@ -28,6 +28,7 @@
 
 #include <boost/thread/mutex.hpp>
 #include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
 
 #include "media_info.h"
 #include "media_info_repository.h"
@@ -37,7 +38,7 @@ namespace caspar { namespace core {
 class in_memory_media_info_repository : public media_info_repository
 {
 	boost::mutex mutex_;
-	std::map<std::wstring, media_info> info_by_file_;
+	std::map<std::wstring, std::pair<std::time_t, media_info>> info_by_file_;
 	std::vector<media_info_extractor> extractors_;
 public:
 	virtual void register_extractor(media_info_extractor extractor) override
@@ -49,11 +50,13 @@ public:
 
 	virtual media_info get(const std::wstring& file) override
 	{
+		auto write_time = get_write_time(file);
+
 		boost::mutex::scoped_lock lock(mutex_);
 
 		auto iter = info_by_file_.find(file);
 
-		if (iter == info_by_file_.end())
+		if (iter == info_by_file_.end() || iter->second.first != write_time)
 		{
 			media_info info;
 
@@ -65,12 +68,17 @@ public:
 				}
 			}
 
-			info_by_file_.insert(std::make_pair(file, info));
+			info_by_file_[file] = std::make_pair(write_time, info);
 
 			return info;
 		}
 
-		return iter->second;
+		return iter->second.second;
+	}
+
+	virtual std::time_t get_content_write_time(const std::wstring& file) override
+	{
+		return get_write_time(file);
 	}
 
 	virtual void remove(const std::wstring& file) override
@@ -79,6 +87,18 @@ public:
 
 		info_by_file_.erase(file);
 	}
+private:
+	static std::time_t get_write_time(const std::wstring& file)
+	{
+		try
+		{
+			return boost::filesystem::last_write_time(boost::filesystem::wpath(file));
+		}
+		catch (...)
+		{
+			return -1;
+		}
+	}
 };
 
 safe_ptr<struct media_info_repository> create_in_memory_media_info_repository()
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
 
 #include <boost/rational.hpp>
 
@@ -32,8 +33,17 @@ struct media_info
 	std::int64_t duration;
 	boost::rational<std::int64_t> time_base;
 
+	// Templates only.
+	std::uint32_t width;
+	std::uint32_t height;
+	double frame_rate;
+	std::wstring template_info;	// The <template> element describing the template's fields.
+
 	media_info()
 		: duration(0)
+		, width(0)
+		, height(0)
+		, frame_rate(0.0)
 	{
 	}
 };
@@ -23,6 +23,7 @@
 
 #include <string>
 #include <functional>
+#include <ctime>
 
 namespace caspar { namespace core {
 
@@ -33,7 +34,14 @@ struct media_info_repository
 {
 	virtual ~media_info_repository() { }
 	virtual void register_extractor(media_info_extractor extractor) = 0;
+
+	// Retrieves the media information again when the file has been written to since.
 	virtual media_info get(const std::wstring& file) = 0;
+
+	// The last write time of the file at which its content actually changed, which is earlier than its last write time
+	// when it has been copied over or touched since without changing.
+	virtual std::time_t get_content_write_time(const std::wstring& file) = 0;
+
 	virtual void remove(const std::wstring& file) = 0;
 };
 
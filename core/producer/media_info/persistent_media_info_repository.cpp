@@ -0,0 +1,451 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../StdAfx.h"
+
+#include "persistent_media_info_repository.h"
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include "media_info.h"
+#include "media_info_repository.h"
+
+namespace caspar { namespace core {
+
+namespace {
+
+const char			CACHE_MAGIC[4]	= { 'C', 'M', 'I', 'C' };
+const std::uint32_t	CACHE_VERSION	= 3;	// 1 had neither content write time nor fingerprint, 2 no template info.
+
+const std::int64_t	FINGERPRINT_CHUNK_SIZE = 1024 * 1024;
+
+struct cached_media_info
+{
+	std::int64_t	size;
+	std::int64_t	last_write_time;
+	std::int64_t	content_write_time;
+	std::uint64_t	fingerprint;		// 0 when not taken.
+	media_info		info;
+};
+
+typedef std::map<std::wstring, cached_media_info> cache_map;
+
+template<typename T>
+void write_value(std::ostream& out, const T& value)
+{
+	out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+bool read_value(std::istream& in, T& value)
+{
+	return !in.read(reinterpret_cast<char*>(&value), sizeof(value)).fail();
+}
+
+void write_string(std::ostream& out, const std::string& value)
+{
+	write_value(out, static_cast<std::uint32_t>(value.size()));
+	out.write(value.data(), value.size());
+}
+
+bool read_string(std::istream& in, std::string& value)
+{
+	std::uint32_t length;
+
+	if (!read_value(in, length))
+		return false;
+
+	value.assign(length, '\0');
+
+	return length == 0 || !in.read(&value[0], length).fail();
+}
+
+bool stat_file(const std::wstring& file, std::int64_t& size, std::int64_t& last_write_time)
+{
+	try
+	{
+		boost::filesystem::wpath path(file);
+
+		if (!boost::filesystem::is_regular_file(path))
+			return false;
+
+		size			= static_cast<std::int64_t>(boost::filesystem::file_size(path));
+		last_write_time	= static_cast<std::int64_t>(boost::filesystem::last_write_time(path));
+
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+// Hashes the size and the first, middle and last megabyte, which is what tells files of a media library apart in
+// practice, without reading them whole.
+std::uint64_t compute_fingerprint(const std::wstring& file, std::int64_t size)
+{
+	static const std::uint64_t FNV_OFFSET_BASIS	= 14695981039346656037ULL;
+	static const std::uint64_t FNV_PRIME			= 1099511628211ULL;
+
+	std::ifstream in(file.c_str(), std::ios::binary);
+
+	if (!in)
+		return 0;
+
+	std::uint64_t hash = FNV_OFFSET_BASIS;
+	auto add = [&](const char* data, std::size_t length)
+	{
+		for (std::size_t n = 0; n < length; ++n)
+		{
+			hash ^= static_cast<unsigned char>(data[n]);
+			hash *= FNV_PRIME;
+		}
+	};
+
+	add(reinterpret_cast<const char*>(&size), sizeof(size));
+
+	std::vector<char> buffer(static_cast<std::size_t>(FINGERPRINT_CHUNK_SIZE));
+	std::int64_t offsets[] = { 0, (size - FINGERPRINT_CHUNK_SIZE) / 2, size - FINGERPRINT_CHUNK_SIZE };
+
+	BOOST_FOREACH(auto offset, offsets)
+	{
+		in.clear();
+		in.seekg(std::max<std::int64_t>(0, offset));
+		in.read(buffer.data(), buffer.size());
+
+		if (in.bad())
+			return 0;
+
+		add(buffer.data(), static_cast<std::size_t>(in.gcount()));
+	}
+
+	return hash == 0 ? 1 : hash;
+}
+
+void read_cache(const std::wstring& cache_file, cache_map& cache)
+{
+	std::ifstream in(cache_file.c_str(), std::ios::binary);
+
+	if (!in)
+		return;
+
+	char magic[4];
+	std::uint32_t version;
+	std::uint32_t count;
+
+	if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), CACHE_MAGIC)
+			|| !read_value(in, version) || version < 1 || version > CACHE_VERSION
+			|| !read_value(in, count))
+	{
+		CASPAR_LOG(warning) << L"Ignoring unrecognized media info cache " << cache_file;
+		return;
+	}
+
+	for (std::uint32_t i = 0; i < count; ++i)
+	{
+		std::string path;
+		std::string template_info;
+		cached_media_info entry;
+		std::int64_t numerator;
+		std::int64_t denominator;
+
+		if (!read_string(in, path))
+			break;
+
+		entry.fingerprint = 0;
+
+		if (!read_value(in, entry.size)
+				|| !read_value(in, entry.last_write_time)
+				|| (version >= 2 && !read_value(in, entry.content_write_time))
+				|| (version >= 2 && !read_value(in, entry.fingerprint))
+				|| !read_value(in, entry.info.duration)
+				|| !read_value(in, numerator)
+				|| !read_value(in, denominator)
+				|| (version >= 3 && !read_value(in, entry.info.width))
+				|| (version >= 3 && !read_value(in, entry.info.height))
+				|| (version >= 3 && !read_value(in, entry.info.frame_rate))
+				|| (version >= 3 && !read_string(in, template_info)))
+			break;
+
+		if (denominator != 0)
+			entry.info.time_base.assign(numerator, denominator);
+
+		entry.info.template_info = widen(template_info);
+
+		if (version < 2)
+			entry.content_write_time = entry.last_write_time;
+
+		cache[widen(path)] = entry;
+	}
+
+	if (cache.size() != count)
+		CASPAR_LOG(warning) << L"Media info cache " << cache_file << L" is truncated. Read " << cache.size() << L" of " << count << L" entries.";
+}
+
+void write_cache(const std::wstring& cache_file, const cache_map& cache)
+{
+	auto temp_file = cache_file + L".tmp";
+
+	{
+		std::ofstream out(temp_file.c_str(), std::ios::binary | std::ios::trunc);
+
+		out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+		write_value(out, CACHE_VERSION);
+		write_value(out, static_cast<std::uint32_t>(cache.size()));
+
+		BOOST_FOREACH(auto& entry, cache)
+		{
+			write_string(out, narrow(entry.first));
+			write_value(out, entry.second.size);
+			write_value(out, entry.second.last_write_time);
+			write_value(out, entry.second.content_write_time);
+			write_value(out, entry.second.fingerprint);
+			write_value(out, entry.second.info.duration);
+			write_value(out, entry.second.info.time_base.numerator());
+			write_value(out, entry.second.info.time_base.denominator());
+			write_value(out, entry.second.info.width);
+			write_value(out, entry.second.info.height);
+			write_value(out, entry.second.info.frame_rate);
+			write_string(out, narrow(entry.second.info.template_info));
+		}
+
+		out.flush();
+
+		if (!out)
+			BOOST_THROW_EXCEPTION(file_write_error() << msg_info(narrow(L"Failed to write " + temp_file)));
+	}
+
+	boost::filesystem::wpath target(cache_file);
+
+	if (boost::filesystem::exists(target))
+		boost::filesystem::remove(target);
+
+	boost::filesystem::rename(boost::filesystem::wpath(temp_file), target);
+}
+
+}
+
+class persistent_media_info_repository : public media_info_repository
+{
+	const std::wstring					cache_file_;
+	const int							save_delay_millis_;
+	const bool							use_fingerprints_;
+
+	boost::mutex						mutex_;
+	boost::condition_variable			changed_;
+	bool								loaded_;
+	bool								dirty_;
+	bool								running_;
+	cache_map							info_by_file_;
+	std::vector<media_info_extractor>	extractors_;
+
+	boost::thread						writer_;
+public:
+	persistent_media_info_repository(const std::wstring& cache_file, int save_delay_millis, bool use_fingerprints)
+		: cache_file_(cache_file)
+		, save_delay_millis_(save_delay_millis)
+		, use_fingerprints_(use_fingerprints)
+		, loaded_(false)
+		, dirty_(false)
+		, running_(true)
+	{
+		writer_ = boost::thread([this] { run_writer(); });
+	}
+
+	~persistent_media_info_repository()
+	{
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			running_ = false;
+		}
+
+		changed_.notify_all();
+		writer_.join();
+	}
+
+	virtual void register_extractor(media_info_extractor extractor) override
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		extractors_.push_back(extractor);
+	}
+
+	virtual media_info get(const std::wstring& file) override
+	{
+		return lookup(file).info;
+	}
+
+	virtual std::time_t get_content_write_time(const std::wstring& file) override
+	{
+		return static_cast<std::time_t>(lookup(file).content_write_time);
+	}
+
+	virtual void remove(const std::wstring& file) override
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		ensure_loaded();
+
+		if (info_by_file_.erase(file) > 0)
+		{
+			dirty_ = true;
+			changed_.notify_one();
+		}
+	}
+private:
+	cached_media_info lookup(const std::wstring& file)
+	{
+		cached_media_info entry;
+		entry.size				= -1;
+		entry.last_write_time	= -1;
+		entry.fingerprint		= 0;
+
+		bool persistable = stat_file(file, entry.size, entry.last_write_time);
+		entry.content_write_time = entry.last_write_time;
+
+		std::vector<media_info_extractor> extractors;
+		std::shared_ptr<cached_media_info> previous;
+
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+
+			ensure_loaded();
+
+			auto iter = info_by_file_.find(file);
+
+			if (persistable && iter != info_by_file_.end())
+			{
+				if (iter->second.size == entry.size && iter->second.last_write_time == entry.last_write_time)
+					return iter->second;
+
+				if (use_fingerprints_ && iter->second.size == entry.size && iter->second.fingerprint != 0)
+					previous = std::make_shared<cached_media_info>(iter->second);
+			}
+
+			extractors = extractors_;
+		}
+
+		// Hashing and probing can take long, so other files are served meanwhile.
+		if (persistable && use_fingerprints_)
+			entry.fingerprint = compute_fingerprint(file, entry.size);
+
+		if (previous && entry.fingerprint == previous->fingerprint)
+		{
+			// Only written to without changing, for example copied over from an archive.
+			entry.content_write_time	= previous->content_write_time;
+			entry.info					= previous->info;
+		}
+		else
+		{
+			BOOST_FOREACH(auto& extractor, extractors)
+			{
+				if (extractor(file, entry.info))
+				{
+					break;
+				}
+			}
+		}
+
+		if (persistable)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+
+			info_by_file_[file] = entry;
+			dirty_ = true;
+			changed_.notify_one();
+		}
+
+		return entry;
+	}
+
+	void ensure_loaded()
+	{
+		if (loaded_)
+			return;
+
+		loaded_ = true;
+
+		try
+		{
+			read_cache(cache_file_, info_by_file_);
+			CASPAR_LOG(info) << L"Loaded media info for " << info_by_file_.size() << L" files from " << cache_file_;
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			info_by_file_.clear();
+		}
+	}
+
+	void run_writer()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		while (true)
+		{
+			while (running_ && !dirty_)
+				changed_.wait(lock);
+
+			if (!dirty_)
+				break;
+
+			// Gather changes for a while instead of rewriting the file for every probed file.
+			if (running_)
+				changed_.timed_wait(lock, boost::posix_time::milliseconds(save_delay_millis_), [this] { return !running_; });
+
+			auto snapshot = info_by_file_;
+			dirty_ = false;
+
+			lock.unlock();
+
+			try
+			{
+				write_cache(cache_file_, snapshot);
+			}
+			catch (...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			lock.lock();
+		}
+	}
+};
+
+safe_ptr<struct media_info_repository> create_persistent_media_info_repository(
+		const std::wstring& cache_file, int save_delay_millis, bool use_fingerprints)
+{
+	return make_safe<persistent_media_info_repository>(cache_file, save_delay_millis, use_fingerprints);
+}
+
+}}
@@ -0,0 +1,46 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <string>
+
+#include <common/memory/safe_ptr.h>
+
+namespace caspar { namespace core {
+
+/**
+ * Creates a media_info_repository that persists what the extractors found to
+ * cache_file, keyed by file path and invalidated when the size or the last
+ * write time of the file changes.
+ *
+ * The cache file is read on first use and written back on a background
+ * thread at most once every save_delay_millis.
+ *
+ * With use_fingerprints, a hash of the size and of the first, middle and last
+ * megabyte is kept as well, so that a file written to without changing (for
+ * example copied over from an archive) keeps its media information and its
+ * content write time.
+ */
+safe_ptr<struct media_info_repository> create_persistent_media_info_repository(
+		const std::wstring& cache_file, int save_delay_millis = 5000, bool use_fingerprints = false);
+
+}}
@@ -0,0 +1,418 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../../stdafx.h"
+
+#include "playlist_producer.h"
+
+#include "../../monitor/monitor.h"
+
+#include "../frame/basic_frame.h"
+#include "../frame/frame_factory.h"
+
+#include <common/concurrency/executor.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+
+#include <core/parameters/parameters.h>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/future.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <deque>
+#include <limits>
+
+namespace caspar { namespace core {
+
+struct playlist_item
+{
+	const std::wstring			params;
+	const uint32_t				duration;	// Frames, the whole producer if max.
+	safe_ptr<frame_producer>	producer;	// Empty until opened.
+	bool						is_opening;
+	bool						is_opened;	// Also when opening failed, which leaves the producer empty.
+
+	playlist_item(const std::wstring& params, uint32_t duration)
+		: params(params)
+		, duration(duration)
+		, producer(frame_producer::empty())
+		, is_opening(false)
+		, is_opened(false)
+	{
+	}
+};
+
+class playlist_producer : public frame_producer
+{
+	safe_ptr<monitor::subject>					monitor_subject_;
+
+	const safe_ptr<frame_factory>				frame_factory_;
+	const std::size_t							prefetch_;
+
+	mutable tbb::spin_mutex						mutex_;		// Of the upcoming items, which are appended and opened on other threads.
+	std::deque<std::shared_ptr<playlist_item>>	upcoming_;
+
+	std::shared_ptr<playlist_item>				current_;
+	uint32_t									played_;	// Frames of the current item.
+	tbb::atomic<bool>							skip_;
+	tbb::atomic<int>							num_played_;
+	safe_ptr<basic_frame>						last_frame_;
+	std::vector<std::shared_ptr<playlist_item>>	prerolled_;
+
+	executor									executor_;	// Opens and destroys items, last so it is done first.
+public:
+	explicit playlist_producer(const safe_ptr<frame_factory>& frame_factory, const std::vector<std::wstring>& items, std::size_t prefetch) 
+		: monitor_subject_(make_safe<monitor::subject>("/playlist"))
+		, frame_factory_(frame_factory)
+		, prefetch_(prefetch)
+		, played_(0)
+		, last_frame_(basic_frame::empty())
+		, executor_(L"playlist")
+	{
+		skip_		= false;
+		num_played_ = 0;
+
+		append(items);
+
+		CASPAR_LOG(info) << print() << L" Initialized";
+	}
+
+	~playlist_producer()
+	{
+		executor_.clear();
+	}
+
+	// Parsing happens here, so a malformed item fails the whole call and nothing is appended.
+	void append(const std::vector<std::wstring>& items)
+	{
+		std::vector<std::shared_ptr<playlist_item>> parsed;
+		BOOST_FOREACH(auto& item, items)
+		{
+			parameters params(parameters::protocol_split(item));
+			params.to_upper();
+			if(params.empty())
+				BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Empty playlist item."));
+
+			auto duration = params.get(L"DURATION", std::numeric_limits<uint32_t>::max());
+			parsed.push_back(std::make_shared<playlist_item>(item, duration));
+		}
+
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			upcoming_.insert(upcoming_.end(), parsed.begin(), parsed.end());
+		}
+
+		prefetch();
+	}
+
+	void clear_upcoming()
+	{
+		std::deque<std::shared_ptr<playlist_item>> dropped;
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			dropped.swap(upcoming_);
+		}
+		release(dropped);
+	}
+
+	// Opens the next items which are not yet, one at a time so an append is never held back for long.
+	void prefetch()
+	{
+		executor_.begin_invoke([=]
+		{
+			std::shared_ptr<playlist_item> item;
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				for(std::size_t n = 0; n < upcoming_.size() && n < prefetch_; ++n)
+				{
+					if(!upcoming_[n]->is_opening && !upcoming_[n]->is_opened)
+					{
+						item = upcoming_[n];
+						item->is_opening = true;
+						break;
+					}
+				}
+			}
+
+			if(!item)
+				return;
+
+			auto producer = frame_producer::empty();
+			try
+			{
+				producer = create_producer(frame_factory_, item->params);
+				if(producer == frame_producer::empty())
+					CASPAR_LOG(warning) << print() << L" No producer for " << item->params << L", skipped.";
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				CASPAR_LOG(warning) << print() << L" Failed to open " << item->params << L", skipped.";
+			}
+
+			{
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				item->producer	 = producer;
+				item->is_opening = false;
+				item->is_opened	 = true;
+			}
+
+			prefetch();
+		});
+	}
+
+	// Producers are destroyed on the executor, not on the channel.
+	template<typename T>
+	void release(T& items)
+	{
+		if(items.empty())
+			return;
+
+		auto released = std::make_shared<T>();
+		released->swap(items);
+		executor_.begin_invoke([released]
+		{
+			released->clear();
+		});
+	}
+
+	// Moves on to the next item if it has been opened, skipping the ones which failed.
+	bool next()
+	{
+		std::vector<std::shared_ptr<playlist_item>> done;
+		if(current_)
+			done.push_back(current_);
+
+		current_.reset();
+		played_ = 0;
+
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			while(!upcoming_.empty() && upcoming_.front()->is_opened)
+			{
+				auto item = upcoming_.front();
+				upcoming_.pop_front();
+
+				if(item->producer != frame_producer::empty())
+				{
+					current_ = item;
+					break;
+				}
+			}
+		}
+
+		release(done);
+
+		if(!current_)
+			return false;
+
+		current_->producer->monitor_output().attach_parent(monitor_subject_);
+		++num_played_;
+		prefetch();
+
+		return true;
+	}
+
+	// Prerolls the items which are opened and will play next.
+	void preroll_upcoming(int hints)
+	{
+		prerolled_.clear();
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			for(std::size_t n = 0; n < upcoming_.size() && n < prefetch_; ++n)
+			{
+				if(upcoming_[n]->is_opened && upcoming_[n]->producer != frame_producer::empty())
+					prerolled_.push_back(upcoming_[n]);
+			}
+		}
+
+		BOOST_FOREACH(auto& item, prerolled_)
+		{
+			try
+			{
+				item->producer->preroll(hints);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+
+		prerolled_.clear();
+	}
+
+	// frame_producer
+			
+	virtual safe_ptr<basic_frame> receive(int hints) override
+	{
+		if(skip_.fetch_and_store(false) && current_)
+			played_ = current_->duration;
+
+		auto frame = basic_frame::late();
+
+		// An item which ends is followed by the first frame of the next one within the same tick. 
+		for(int n = 0; n < 8 && frame == basic_frame::late(); ++n)
+		{
+			if(!current_ || played_ >= current_->duration)
+			{
+				if(!next())
+					break;
+			}
+
+			frame = current_->producer->receive(hints);
+
+			if(frame == basic_frame::eof())
+			{
+				played_ = current_->duration;
+				frame	= basic_frame::late();
+			}
+			else if(frame != basic_frame::late())
+				++played_;
+			else
+				break;
+		}
+
+		preroll_upcoming(hints);
+
+		if(frame == basic_frame::late())
+			return current_ ? frame : disable_audio(last_frame_);
+
+		return last_frame_ = frame;
+	}
+
+	virtual safe_ptr<core::basic_frame> last_frame() const override
+	{
+		return disable_audio(last_frame_);
+	}
+
+	virtual void preroll(int hints) override
+	{
+		if(!current_)
+			next();
+
+		if(current_)
+			current_->producer->preroll(hints);
+
+		preroll_upcoming(hints);
+	}
+
+	virtual bool is_ready() const override
+	{
+		return current_ && current_->producer->is_ready();
+	}
+
+	virtual boost::unique_future<std::wstring> call(const std::wstring& param) override
+	{
+		boost::promise<std::wstring> promise;
+		promise.set_value(do_call(param));
+		return promise.get_future();
+	}
+
+	std::wstring do_call(const std::wstring& param)
+	{
+		auto tokens = parameters::protocol_split(param);
+		if(tokens.empty())
+			BOOST_THROW_EXCEPTION(invalid_argument());
+
+		auto command = boost::to_upper_copy(tokens.front());
+
+		if(command == L"APPEND" && tokens.size() > 1)
+		{
+			append(std::vector<std::wstring>(tokens.begin() + 1, tokens.end()));
+			return L"APPEND OK";
+		}
+
+		if(command == L"SKIP")
+		{
+			skip_ = true;
+			return L"SKIP OK";
+		}
+
+		if(command == L"CLEAR")
+		{
+			clear_upcoming();
+			return L"CLEAR OK";
+		}
+
+		BOOST_THROW_EXCEPTION(invalid_argument());
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"playlist";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type", L"playlist-producer");
+		info.add(L"played", static_cast<int>(num_played_));
+		info.add(L"prefetch", prefetch_);
+
+		if(current_)
+		{
+			info.add(L"current.params", current_->params);
+			info.add(L"current.frame", played_);
+			info.add_child(L"current.producer", current_->producer->info());
+		}
+
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		info.add(L"upcoming", upcoming_.size());
+		BOOST_FOREACH(auto& item, upcoming_)
+			info.add(L"items.item", item->params);
+
+		return info;
+	}
+
+	virtual monitor::subject& monitor_output() override
+	{
+		return *monitor_subject_;
+	}
+};
+
+safe_ptr<frame_producer> create_playlist_producer(const safe_ptr<frame_factory>& frame_factory, const parameters& params)
+{
+	if(params.empty() || !boost::iequals(params[0], L"PLAYLIST"))
+		return frame_producer::empty();
+
+	std::vector<std::wstring> items;
+	std::size_t prefetch = 2;
+
+	for(std::size_t n = 1; n < params.size(); ++n)
+	{
+		if(params[n] == L"PREFETCH" && n + 1 < params.size())
+			prefetch = std::max(1, boost::lexical_cast<int>(params[++n]));
+		else
+			items.push_back(params.at_original(n));
+	}
+
+	return create_producer_print_proxy(make_safe<playlist_producer>(frame_factory, items, prefetch));
+}
+
+}}
@@ -0,0 +1,44 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include "../frame_producer.h"
+
+#include <string>
+
+namespace caspar { namespace core {
+
+class parameters;
+struct frame_factory;
+
+// PLAYLIST ["item" ...] [PREFETCH 2]. Plays the items one after the other, switching to the next one on the frame
+// after the last frame of the previous one. Each item is the parameters of a producer, such as "AMB LENGTH 50", and 
+// may end in DURATION frames to be cut after that many frames, which stills need. The next PREFETCH items are 
+// opened on a thread of the playlist and prerolled while the current one plays. Once every item has played the 
+// last frame is held, so that more can be appended.
+//
+// CALL takes APPEND "item" ..., which appends all of the items at once, SKIP, which cuts to the next item, and 
+// CLEAR, which drops the items after the current one.
+safe_ptr<frame_producer> create_playlist_producer(const safe_ptr<frame_factory>& frame_factory, const parameters& params);
+
+}}
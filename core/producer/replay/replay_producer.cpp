@@ -0,0 +1,347 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "replay_producer.h"
+
+#include "../../monitor/monitor.h"
+#include "../../consumer/replay/replay_buffer.h"
+#include "../../mixer/write_frame.h"
+#include "../../video_format.h"
+
+#include "../frame/basic_frame.h"
+#include "../frame/frame_factory.h"
+#include "../frame/pixel_format.h"
+
+#include <common/diagnostics/graph.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <core/parameters/parameters.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/regex.hpp>
+#include <boost/thread/future.hpp>
+
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace caspar { namespace core {
+
+class replay_producer : public frame_producer
+{
+	monitor::subject							monitor_subject_;
+
+	const safe_ptr<frame_factory>				frame_factory_;
+	const std::wstring							name_;
+	const channel_layout						audio_layout_;
+
+	safe_ptr<diagnostics::graph>				graph_;
+
+	std::shared_ptr<replay_buffer>				buffer_;
+	pixel_format_desc							desc_;
+
+	mutable tbb::spin_mutex						mutex_;				// Of the playback state, which calls change.
+	double										position_;			// The frame played next, in frames of the recording.
+	double										speed_;
+	int64_t										in_;
+	int64_t										out_;				// -1 to follow the recording.
+	bool										loop_;
+
+	int64_t										frame_number_;		// Of the last frame played, -1 before the first.
+	safe_ptr<basic_frame>						last_frame_;
+	int64_t										missed_;
+
+public:
+	explicit replay_producer(const safe_ptr<frame_factory>& frame_factory, const std::wstring& name, const channel_layout& audio_layout, int64_t in, int64_t out, double speed, bool loop) 
+		: frame_factory_(frame_factory)
+		, name_(name)
+		, audio_layout_(audio_layout)
+		, speed_(speed)
+		, loop_(loop)
+		, frame_number_(-1)
+		, last_frame_(basic_frame::empty())
+		, missed_(0)
+	{
+		auto buffer = find_replay_buffer(name_);
+		if(!buffer)
+			BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("No replay buffer named " + narrow(name_) + "."));
+		set_buffer(buffer);
+
+		in_			= std::max<int64_t>(0, resolve(in));
+		out_		= out == -1 ? -1 : std::max(in_, resolve(out));
+		position_	= static_cast<double>(in_);
+
+		graph_->set_text(print());
+		graph_->set_color("missed", diagnostics::color(1.0f, 0.1f, 0.1f));
+		graph_->set_color("dropped-frame", diagnostics::color(0.6f, 0.3f, 0.9f));
+		diagnostics::register_graph(graph_);
+
+		CASPAR_LOG(info) << print() << L" Initialized";
+	}
+
+	void set_buffer(const std::shared_ptr<replay_buffer>& buffer)
+	{
+		auto& format_desc = buffer->format_desc();
+		if(buffer->compressed() && !frame_factory_->supports(pixel_format::dxt5))
+			BOOST_THROW_EXCEPTION(not_supported() << msg_info(narrow(print()) + " Compressed recordings need a GPU which decodes dxt5."));
+
+		if(buffer->compressed())
+			desc_ = get_compressed_pixel_format_desc(pixel_format::dxt5, format_desc.width, format_desc.height);
+		else
+		{
+			desc_ = pixel_format_desc();
+			desc_.pix_fmt = pixel_format::bgra;
+			desc_.planes.push_back(pixel_format_desc::plane(format_desc.width, format_desc.height, 4));
+		}
+
+		if(format_desc.fps != frame_factory_->get_video_format_desc().fps)
+			CASPAR_LOG(warning) << print() << L" Recorded at " << format_desc.name << L", frames play at the rate of the channel.";
+
+		buffer_			= buffer;
+		frame_number_	= -1;
+	}
+
+	// Negative frames count back from the newest one.
+	int64_t resolve(int64_t frame) const
+	{
+		return frame < 0 ? buffer_->recorded() + frame : frame;
+	}
+
+	// Picks the frame to play and moves on by the speed, within in and out, or in and the newest frame when 
+	// following the recording. Returns -1 if there is nothing to play.
+	int64_t advance(bool& play_audio)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		auto first	= std::max(in_, buffer_->oldest());
+		auto last	= buffer_->recorded() - 1;
+		if(out_ >= 0)
+			last = std::min(out_, last);
+		if(last < first)
+			return -1;
+
+		position_	= std::max(static_cast<double>(first), std::min(static_cast<double>(last), position_));
+		auto n		= static_cast<int64_t>(std::floor(position_));
+		play_audio	= speed_ == 1.0;
+
+		// Past the newest frame is left to the next receive, which finds it recorded meanwhile.
+		position_ += speed_;
+		if(loop_ && out_ >= 0 && position_ >= static_cast<double>(out_ + 1))
+			position_ = static_cast<double>(first);
+		else if(loop_ && position_ < static_cast<double>(first))
+			position_ = static_cast<double>(last);
+
+		return n;
+	}
+
+	// frame_producer
+			
+	virtual safe_ptr<basic_frame> receive(int) override
+	{
+		// A restarted recording replaces the buffer, playback goes on from its start.
+		auto buffer = find_replay_buffer(name_);
+		if(buffer && buffer != buffer_)
+		{
+			try
+			{
+				set_buffer(buffer);
+				tbb::spin_mutex::scoped_lock lock(mutex_);
+				in_			= 0;
+				out_		= -1;
+				position_	= 0.0;
+				CASPAR_LOG(info) << print() << L" Recording restarted.";
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+
+		bool play_audio = false;
+		auto n = advance(play_audio);
+		if(n < 0)
+			return basic_frame::late();
+
+		if(n == frame_number_)
+			return last_frame();
+
+		auto frame = frame_factory_->create_frame(this, desc_, audio_layout_);
+		if(frame->image_data().size() < buffer_->image_size())
+			return basic_frame::late();
+
+		replay_frame recorded;
+		if(!buffer_->read(n, frame->image_data().begin(), recorded))
+		{
+			++missed_;
+			graph_->set_tag("missed");
+			return last_frame();
+		}
+
+		if(!recorded.has_image)
+		{
+			graph_->set_tag("dropped-frame");
+			frame_number_ = n;
+			return last_frame();
+		}
+
+		if(play_audio && recorded.audio_channels == audio_layout_.num_channels)
+			frame->audio_data().assign(recorded.audio.begin(), recorded.audio.end());
+		frame->set_timecode(recorded.timecode);
+		frame->commit();
+
+		monitor_subject_ << monitor::message("/replay/frame") % static_cast<int32_t>(n);
+
+		frame_number_ = n;
+		return last_frame_ = frame;
+	}
+
+	virtual safe_ptr<basic_frame> last_frame() const override
+	{
+		return disable_audio(last_frame_);
+	}
+
+	virtual uint32_t nb_frames() const override
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		if(loop_ || out_ < 0 || speed_ <= 0.0)
+			return std::numeric_limits<uint32_t>::max();
+		return static_cast<uint32_t>(std::ceil(static_cast<double>(out_ - in_ + 1) / speed_));
+	}
+
+	virtual boost::unique_future<std::wstring> call(const std::wstring& param) override
+	{
+		boost::promise<std::wstring> promise;
+		promise.set_value(do_call(param));
+		return promise.get_future();
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"replay[" + name_ + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		boost::property_tree::wptree info;
+		info.add(L"type",		L"replay-producer");
+		info.add(L"name",		name_);
+		info.add(L"frame",		frame_number_);
+		info.add(L"in",			in_);
+		info.add(L"out",		out_);
+		info.add(L"speed",		speed_);
+		info.add(L"loop",		loop_);
+		info.add(L"missed",		missed_);
+		info.add_child(L"buffer", buffer_->info());
+		return info;
+	}
+
+	monitor::subject& monitor_output() 
+	{
+		return monitor_subject_;
+	}
+
+	// replay_producer
+
+	std::wstring do_call(const std::wstring& param)
+	{
+		static const boost::wregex seek_exp(L"SEEK\\s+(?<VALUE>-?\\d+)", boost::regex::icase);
+		static const boost::wregex in_exp(L"IN\\s+(?<VALUE>-?\\d+)", boost::regex::icase);
+		static const boost::wregex out_exp(L"OUT\\s+(?<VALUE>-?\\d+)", boost::regex::icase);
+		static const boost::wregex speed_exp(L"SPEED\\s+(?<VALUE>-?\\d+(\\.\\d+)?)", boost::regex::icase);
+		static const boost::wregex loop_exp(L"LOOP\\s*(?<VALUE>\\d?)?", boost::regex::icase);
+		static const boost::wregex live_exp(L"LIVE", boost::regex::icase);
+
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		boost::wsmatch what;
+		if(boost::regex_match(param, what, seek_exp))
+		{
+			position_ = static_cast<double>(std::max<int64_t>(0, resolve(boost::lexical_cast<int64_t>(what["VALUE"].str()))));
+			return L"SEEK OK";
+		}
+
+		if(boost::regex_match(param, what, in_exp))
+		{
+			in_ = std::max<int64_t>(0, resolve(boost::lexical_cast<int64_t>(what["VALUE"].str())));
+			return L"IN OK";
+		}
+
+		if(boost::regex_match(param, what, out_exp))
+		{
+			auto out = boost::lexical_cast<int64_t>(what["VALUE"].str());
+			out_ = out == -1 ? -1 : std::max(in_, resolve(out));
+			return L"OUT OK";
+		}
+
+		if(boost::regex_match(param, what, speed_exp))
+		{
+			speed_ = boost::lexical_cast<double>(what["VALUE"].str());
+			return L"SPEED OK";
+		}
+
+		if(boost::regex_match(param, what, loop_exp))
+		{
+			loop_ = what["VALUE"].str().empty() || boost::lexical_cast<bool>(what["VALUE"].str());
+			return L"LOOP OK";
+		}
+
+		if(boost::regex_match(param, what, live_exp))
+		{
+			out_		= -1;
+			speed_		= 1.0;
+			position_	= static_cast<double>(buffer_->recorded() - 1);
+			return L"LIVE OK";
+		}
+
+		BOOST_THROW_EXCEPTION(invalid_argument());
+	}
+};
+
+safe_ptr<frame_producer> create_replay_producer(const safe_ptr<frame_factory>& frame_factory, const parameters& params)
+{
+	if(params.empty() || !boost::iequals(params[0], L"REPLAY"))
+		return frame_producer::empty();
+
+	static const wchar_t* keywords[] = {L"IN", L"OUT", L"SPEED", L"LOOP", L"CHANNEL_LAYOUT"};
+
+	std::wstring name = L"replay";
+	if(params.size() > 1 && std::find(std::begin(keywords), std::end(keywords), params[1]) == std::end(keywords))
+		name = params.at_original(1);
+
+	auto in				= params.get(L"IN", static_cast<int64_t>(0));
+	auto out			= params.get(L"OUT", static_cast<int64_t>(-1));
+	auto speed			= params.get(L"SPEED", 1.0);
+	auto loop			= params.has(L"LOOP");
+	auto audio_layout	= create_custom_channel_layout(params.get(L"CHANNEL_LAYOUT", L"STEREO"), default_channel_layout_repository());
+
+	return create_producer_print_proxy(make_safe<replay_producer>(frame_factory, name, audio_layout, in, out, speed, loop));
+}
+
+}}
@@ -0,0 +1,41 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "../frame_producer.h"
+
+#include <string>
+
+namespace caspar { namespace core {
+
+class parameters;
+struct frame_factory;
+
+// REPLAY [name] [IN frame] [OUT frame] [SPEED 1.0] [LOOP] [CHANNEL_LAYOUT STEREO]. Plays the frames recorded by 
+// the replay consumer of the name, "replay" by default. Frames are the numbers of the recording, negative ones 
+// count back from the newest frame. Without OUT playback follows the recording. 
+//
+// CALL takes SEEK frame, IN frame, OUT frame, SPEED speed, LOOP [0|1] and LIVE, which plays the newest frames.
+// Audio is only played at speed 1.
+safe_ptr<frame_producer> create_replay_producer(const safe_ptr<frame_factory>& frame_factory, const parameters& params);
+
+}}
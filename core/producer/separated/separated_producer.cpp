@@ -26,11 +26,78 @@
 #include "separated_producer.h"
 
 #include <core/producer/frame/basic_frame.h>
+#include <core/producer/frame/frame_flattener.h>
+#include <core/mixer/write_frame.h>
+
+#include <common/concurrency/parallel_arena.h>
+#include <common/env.h>
 
 #include <tbb/parallel_invoke.h>
 
+#include <vector>
+
 namespace caspar { namespace core {	
 
+namespace {
+
+// Whether a key drawn with the one transform covers the fill drawn with the other pixel for pixel.
+bool is_same_placement(const frame_transform& fill, const frame_transform& key)
+{
+	return fill.opacity				== key.opacity				&&
+		   fill.contrast			== key.contrast				&&
+		   fill.brightness			== key.brightness			&&
+		   fill.saturation			== key.saturation			&&
+		   fill.fill_translation	== key.fill_translation		&&
+		   fill.fill_scale			== key.fill_scale			&&
+		   fill.clip_translation	== key.clip_translation		&&
+		   fill.clip_scale			== key.clip_scale			&&
+		   fill.levels.min_input	== key.levels.min_input		&&
+		   fill.levels.max_input	== key.levels.max_input		&&
+		   fill.levels.gamma		== key.levels.gamma			&&
+		   fill.levels.min_output	== key.levels.min_output	&&
+		   fill.levels.max_output	== key.levels.max_output	&&
+		   fill.field_mode			== key.field_mode			&&
+		   fill.is_paused			== key.is_paused			&&
+		   !fill.is_key && !fill.is_mix && !key.is_key && !key.is_mix;
+}
+
+// Fills and keys of ycbcr or bgra and luma frames which are drawn alike are merged into keyed frames sharing their 
+// textures, which the mixer draws in one pass instead of rendering the key into a buffer first. Anything else is 
+// keyed by the mixer.
+safe_ptr<basic_frame> merge_fill_and_key(const safe_ptr<basic_frame>& fill, const safe_ptr<basic_frame>& key)
+{
+	if(!is_concrete_frame(fill) || !is_concrete_frame(key))
+		return basic_frame::fill_and_key(fill, key);
+
+	frame_flattener fills;
+	fill->accept(fills);
+
+	frame_flattener keys;
+	key->accept(keys);
+
+	if(fills.has_colors || keys.has_colors || fills.frames.empty() || fills.frames.size() != keys.frames.size())
+		return basic_frame::fill_and_key(fill, key);
+
+	for(std::size_t n = 0; n < fills.frames.size(); ++n)
+	{
+		if(!write_frame::can_key(*fills.frames[n].first, *keys.frames[n].first) || !is_same_placement(fills.frames[n].second, keys.frames[n].second))
+			return basic_frame::fill_and_key(fill, key);
+	}
+
+	std::vector<safe_ptr<basic_frame>> frames;
+	for(std::size_t n = 0; n < fills.frames.size(); ++n)
+	{
+		safe_ptr<basic_frame> keyed = make_safe<write_frame>(*fills.frames[n].first, *keys.frames[n].first);
+		auto frame = make_safe<basic_frame>(keyed);
+		frame->get_frame_transform() = fills.frames[n].second;
+		frames.push_back(frame);
+	}
+
+	return frames.size() == 1 ? frames.front() : make_safe<basic_frame>(std::move(frames));
+}
+
+}
+
 struct separated_producer : public frame_producer
 {		
 	safe_ptr<monitor::subject>	monitor_subject_;
@@ -41,6 +108,7 @@ struct separated_producer : public frame_producer
 	safe_ptr<basic_frame>		fill_;
 	safe_ptr<basic_frame>		key_;
 	safe_ptr<basic_frame>		last_frame_;
+	const bool					merge_keys_;
 		
 	explicit separated_producer(const safe_ptr<frame_producer>& fill, const safe_ptr<frame_producer>& key) 
 		: key_monitor_subject_(make_safe<monitor::subject>("/keyer"))
@@ -49,6 +117,7 @@ struct separated_producer : public frame_producer
 		, fill_(core::basic_frame::late())
 		, key_(core::basic_frame::late())
 		, last_frame_(core::basic_frame::empty())
+		, merge_keys_(env::properties().get(L"configuration.mixer.merge-separated-keys", true))
 	{
 		key_monitor_subject_->attach_parent(monitor_subject_);
 
@@ -60,7 +129,7 @@ struct separated_producer : public frame_producer
 	
 	virtual safe_ptr<basic_frame> receive(int hints) override
 	{
-		tbb::parallel_invoke(
+		arena_parallel_invoke(
 		[&]
 		{
 			if(fill_ == core::basic_frame::late())
@@ -78,7 +147,7 @@ struct separated_producer : public frame_producer
 		if(fill_ == core::basic_frame::late() || key_ == core::basic_frame::late()) // One of the producers is lagging, keep them in sync.
 			return core::basic_frame::late();
 		
-		auto frame = basic_frame::fill_and_key(fill_, key_);
+		auto frame = merge_keys_ ? merge_fill_and_key(fill_, key_) : basic_frame::fill_and_key(fill_, key_);
 
 		fill_ = basic_frame::late();
 		key_  = basic_frame::late();
@@ -105,7 +174,7 @@ struct separated_producer : public frame_producer
 		if (fill_frame == basic_frame::late() || key_frame == basic_frame::late())
 			return basic_frame::late();
 
-		return basic_frame::fill_and_key(fill_frame, key_frame);
+		return merge_keys_ ? merge_fill_and_key(fill_frame, key_frame) : basic_frame::fill_and_key(fill_frame, key_frame);
 	}
 
 	virtual uint32_t nb_frames() const override
@@ -113,6 +182,17 @@ struct separated_producer : public frame_producer
 		return std::min(fill_producer_->nb_frames(), key_producer_->nb_frames());
 	}
 
+	virtual void preroll(int hints) override
+	{
+		fill_producer_->preroll(hints);
+		key_producer_->preroll(hints | ALPHA_HINT);
+	}
+
+	virtual bool is_ready() const override
+	{
+		return fill_producer_->is_ready() && key_producer_->is_ready();
+	}
+
 	virtual std::wstring print() const override
 	{
 		return L"separated[fill:" + fill_producer_->print() + L"|key[" + key_producer_->print() + L"]]";
@@ -0,0 +1,341 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "shared_memory_producer.h"
+
+#include "../../monitor/monitor.h"
+#include "../../consumer/shared_memory/shared_memory_consumer.h"
+#include "../../mixer/write_frame.h"
+#include "../../video_format.h"
+
+#include "../frame/basic_frame.h"
+#include "../frame/frame_factory.h"
+#include "../frame/pixel_format.h"
+
+#include <common/diagnostics/graph.h>
+#include <common/exception/exceptions.h>
+#include <common/memory/memcpy.h>
+
+#include <core/parameters/parameters.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <cmath>
+
+#include <windows.h>
+
+namespace caspar { namespace core {
+
+static const double PHASE_SMOOTHING = 0.05;
+static const double PI = 3.14159265358979323846;
+
+class shared_memory_producer : public frame_producer
+{
+	monitor::subject							monitor_subject_;
+
+	const safe_ptr<frame_factory>				frame_factory_;
+	const std::wstring							name_;
+	const channel_layout						audio_layout_;
+	const double								frame_duration_;	// Of the channel, in seconds.
+
+	safe_ptr<diagnostics::graph>				graph_;
+
+	HANDLE										mapping_;
+	const shared_memory::header*				header_;
+	size_t										view_size_;
+	int											open_retry_;
+	double										frequency_;
+
+	int64_t										write_sequence_;
+	int64_t										frame_number_;		// Of the last frame played, -1 before the first.
+	double										phase_x_;			// Mean phase of the writer to the tick, as a unit vector.
+	double										phase_y_;
+
+	safe_ptr<basic_frame>						last_frame_;
+	int64_t										frames_;
+	int64_t										repeats_;
+	int64_t										skips_;
+	int64_t										overruns_;
+
+public:
+	explicit shared_memory_producer(const safe_ptr<frame_factory>& frame_factory, const std::wstring& name, const channel_layout& audio_layout) 
+		: frame_factory_(frame_factory)
+		, name_(name)
+		, audio_layout_(audio_layout)
+		, frame_duration_(1.0 / frame_factory->get_video_format_desc().fps)
+		, mapping_(nullptr)
+		, header_(nullptr)
+		, view_size_(0)
+		, open_retry_(0)
+		, frequency_(1.0)
+		, write_sequence_(0)
+		, frame_number_(-1)
+		, phase_x_(1.0)
+		, phase_y_(0.0)
+		, last_frame_(basic_frame::empty())
+		, frames_(0)
+		, repeats_(0)
+		, skips_(0)
+		, overruns_(0)
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		frequency_ = static_cast<double>(frequency.QuadPart);
+
+		graph_->set_text(print());
+		graph_->set_color("latency", diagnostics::color(0.3f, 0.8f, 1.0f));
+		graph_->set_color("repeated", diagnostics::color(0.6f, 0.3f, 0.9f));
+		graph_->set_color("skipped", diagnostics::color(1.0f, 0.6f, 0.0f));
+		graph_->set_color("overrun", diagnostics::color(1.0f, 0.1f, 0.1f));
+		diagnostics::register_graph(graph_);
+
+		open();
+		CASPAR_LOG(info) << print() << L" Initialized";
+	}
+
+	~shared_memory_producer()
+	{
+		close();
+	}
+
+	// Tried about once a second until the writer has created the mapping.
+	bool open()
+	{
+		if(open_retry_-- > 0)
+			return false;
+		open_retry_ = static_cast<int>(1.0 / frame_duration_);
+
+		mapping_ = OpenFileMappingW(FILE_MAP_READ, FALSE, name_.c_str());
+		if(!mapping_)
+			return false;
+
+		auto view = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+		MEMORY_BASIC_INFORMATION info;
+		if(!view || VirtualQuery(view, &info, sizeof(info)) == 0 || info.RegionSize < sizeof(shared_memory::header))
+		{
+			if(view)
+				UnmapViewOfFile(view);
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+			return false;
+		}
+
+		header_			= static_cast<const shared_memory::header*>(view);
+		view_size_		= info.RegionSize;
+		write_sequence_	= 0;
+		frame_number_	= -1;
+
+		CASPAR_LOG(info) << print() << L" Opened.";
+		return true;
+	}
+
+	void close()
+	{
+		if(header_)
+			UnmapViewOfFile(header_);
+		if(mapping_)
+			CloseHandle(mapping_);
+		header_		= nullptr;
+		mapping_	= nullptr;
+	}
+
+	bool is_valid() const
+	{
+		return header_->magic == shared_memory::MAGIC
+			&& header_->version == shared_memory::VERSION
+			&& header_->slot_count > 0 && header_->slot_count <= shared_memory::MAX_SLOTS
+			&& header_->width > 0 && header_->height > 0 && header_->pitch >= header_->width * 4
+			&& header_->audio_offset >= header_->pitch * header_->height && header_->audio_offset <= header_->slot_size
+			&& static_cast<uint64_t>(header_->header_size) + static_cast<uint64_t>(header_->slot_size) * header_->slot_count <= view_size_;
+	}
+
+	double age(const shared_memory::slot& slot, int64_t now) const
+	{
+		return static_cast<double>(now - slot.timestamp) / frequency_;
+	}
+
+	// The writer publishes at some phase to the channel ticks. The frame played is the newest one which is at least 
+	// half a frame off that phase, so that jitter around it does not make the choice alternate between frames.
+	int64_t select_frame(int64_t latest, int64_t now)
+	{
+		auto latest_age = age(header_->slots[latest % header_->slot_count], now);
+		auto angle		= 2.0 * PI * std::fmod(std::max(0.0, latest_age), frame_duration_) / frame_duration_;
+		phase_x_		= (1.0 - PHASE_SMOOTHING) * phase_x_ + PHASE_SMOOTHING * std::cos(angle);
+		phase_y_		= (1.0 - PHASE_SMOOTHING) * phase_y_ + PHASE_SMOOTHING * std::sin(angle);
+
+		auto phase		= std::atan2(phase_y_, phase_x_) / (2.0 * PI) * frame_duration_;
+		if(phase < 0.0)
+			phase += frame_duration_;
+		auto delay		= std::fmod(phase + frame_duration_ * 0.5, frame_duration_);
+
+		auto oldest		= std::max<int64_t>(0, latest - header_->slot_count + 2); // The one after the slot being written next.
+		for(auto n = latest; n > oldest; --n)
+		{
+			if(age(header_->slots[n % header_->slot_count], now) >= delay)
+				return n;
+		}
+		return oldest;
+	}
+
+	// Copies the frame into a host buffer of the mixer and keeps it only if the writer did not get to its slot meanwhile.
+	std::shared_ptr<write_frame> read(int64_t n)
+	{
+		auto& slot		= header_->slots[n % header_->slot_count];
+		auto sequence	= slot.sequence;
+		MemoryBarrier();
+		if(sequence != 2 * (n + 1))
+			return nullptr;
+
+		auto data = reinterpret_cast<const uint8_t*>(header_) + header_->header_size + static_cast<size_t>(n % header_->slot_count) * header_->slot_size;
+
+		pixel_format_desc desc;
+		desc.pix_fmt = pixel_format::bgra;
+		desc.planes.push_back(pixel_format_desc::plane(header_->width, header_->height, 4));
+		auto frame = frame_factory_->create_frame(this, desc, audio_layout_);
+
+		auto row_size = header_->width * 4;
+		if(slot.image_size == header_->pitch * header_->height && header_->pitch == row_size)
+			fast_memcpy(frame->image_data().begin(), data, slot.image_size);
+		else if(slot.image_size == header_->pitch * header_->height)
+		{
+			for(uint32_t y = 0; y < header_->height; ++y)
+				std::memcpy(frame->image_data().begin() + y * row_size, data + y * header_->pitch, row_size);
+		}
+		else
+			std::memset(frame->image_data().begin(), 0, frame->image_data().size());
+
+		auto audio_samples = std::min<uint32_t>(slot.audio_samples, (header_->slot_size - header_->audio_offset) / sizeof(int32_t));
+		if(static_cast<int>(slot.audio_channels) == audio_layout_.num_channels)
+		{
+			auto audio = reinterpret_cast<const int32_t*>(data + header_->audio_offset);
+			frame->audio_data().assign(audio, audio + audio_samples);
+		}
+
+		MemoryBarrier();
+		if(slot.sequence != sequence)
+			return nullptr;
+
+		frame->commit();
+		return frame;
+	}
+
+	// frame_producer
+			
+	virtual safe_ptr<basic_frame> receive(int) override
+	{
+		if(!header_ && !open())
+			return basic_frame::late();
+
+		if(!is_valid())
+		{
+			// The writer is gone or starting over, its mapping stays for as long as we keep it open.
+			if(header_->magic != shared_memory::MAGIC)
+			{
+				close();
+				open_retry_ = 0;
+			}
+			return basic_frame::late();
+		}
+
+		int64_t written = header_->write_sequence;
+		if(written < write_sequence_)
+			frame_number_ = -1;
+		write_sequence_ = written;
+		if(written == 0)
+			return basic_frame::late();
+
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+
+		auto n = select_frame(written - 1, now.QuadPart);
+		if(n <= frame_number_)
+		{
+			++repeats_;
+			graph_->set_tag("repeated");
+			return basic_frame::late();
+		}
+
+		if(frame_number_ >= 0 && n > frame_number_ + 1)
+		{
+			skips_ += n - frame_number_ - 1;
+			graph_->set_tag("skipped");
+		}
+
+		auto frame = read(n);
+		if(!frame)
+		{
+			++overruns_;
+			graph_->set_tag("overrun");
+			return basic_frame::late();
+		}
+
+		graph_->set_value("latency", std::min(1.0, age(header_->slots[n % header_->slot_count], now.QuadPart) / (frame_duration_ * 4.0)));
+		monitor_subject_ << monitor::message("/shared-memory/frame") % static_cast<int32_t>(n);
+
+		++frames_;
+		frame_number_ = n;
+		return last_frame_ = make_safe_ptr(frame);
+	}
+
+	virtual safe_ptr<basic_frame> last_frame() const override
+	{
+		return disable_audio(last_frame_);
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"shared-memory[" + name_ + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",		L"shared-memory-producer");
+		info.add(L"name",		name_);
+		info.add(L"connected",	header_ != nullptr);
+		info.add(L"frames",		frames_);
+		info.add(L"repeated",	repeats_);
+		info.add(L"skipped",	skips_);
+		info.add(L"overruns",	overruns_);
+		return info;
+	}
+
+	monitor::subject& monitor_output() 
+	{
+		return monitor_subject_;
+	}
+};
+
+safe_ptr<frame_producer> create_shared_memory_producer(const safe_ptr<frame_factory>& frame_factory, const parameters& params)
+{
+	if(params.empty() || !boost::iequals(params[0], L"SHARED_MEMORY"))
+		return frame_producer::empty();
+
+	auto name			= params.get_original(L"NAME", L"Local\\casparcg-input");
+	auto audio_layout	= create_custom_channel_layout(params.get(L"CHANNEL_LAYOUT", L"STEREO"), default_channel_layout_repository());
+
+	return create_producer_print_proxy(make_safe<shared_memory_producer>(frame_factory, name, audio_layout));
+}
+
+}}
@@ -29,19 +29,34 @@
 #include "frame/frame_factory.h"
 
 #include <common/concurrency/executor.h>
+#include <common/concurrency/future_util.h>
+#include <common/concurrency/parallel_arena.h>
+#include <common/diagnostics/thread_clock.h>
+#include <common/diagnostics/trace.h>
+#include <common/env.h>
 
 #include <core/producer/frame/frame_transform.h>
 #include <core/consumer/frame_consumer.h>
 #include <core/consumer/write_frame_consumer.h>
+#include <core/resource_usage.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/timer.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <tbb/parallel_for_each.h>
+#include <tbb/task_group.h>
 #include <tbb/concurrent_unordered_map.h>
+#include <tbb/spin_mutex.h>
+#include <tbb/atomic.h>
 
 #include <boost/property_tree/ptree.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <map>
 
 namespace caspar { namespace core {
@@ -54,6 +69,7 @@ class tweened_transform
 	int duration_;
 	int time_;
 	tweener_t tweener_;
+	std::shared_ptr<const std::vector<double>> curve_; // Precomputed, without it tweener_ is evaluated per value.
 public:	
 	tweened_transform()
 		: duration_(0)
@@ -64,8 +80,22 @@ public:
 		, dest_(dest)
 		, duration_(duration)
 		, time_(0)
-		, tweener_(get_tweener(tween)){}
+		, curve_(get_tween_curve(tween, duration))
+	{
+		if(!curve_)
+			tweener_ = get_tweener(tween);
+	}
 	
+	// Ends the tween at the value, without looking up a tweener.
+	void set(const T& value)
+	{
+		source_		= value;
+		dest_		= value;
+		duration_	= 0;
+		time_		= 0;
+		curve_.reset();
+	}
+
 	const T& source() const
 	{
 		return source_;
@@ -78,7 +108,13 @@ public:
 
 	T fetch()
 	{
-		return time_ == duration_ ? dest_ : tween(static_cast<double>(time_), source_, dest_, static_cast<double>(duration_), tweener_);
+		if(time_ == duration_)
+			return dest_;
+
+		if(curve_)
+			return tween(source_, dest_, (*curve_)[time_]);
+
+		return tween(static_cast<double>(time_), source_, dest_, static_cast<double>(duration_), tweener_);
 	}
 
 	T fetch_and_tick(int num)
@@ -88,10 +124,87 @@ public:
 	}
 };
 
+// When the changes of a committed batch are applied, see stage_batch::commit_at_tick and commit_at_time.
+struct batch_schedule
+{
+	enum type
+	{
+		now = 0,
+		at_tick,
+		at_time
+	};
+
+	type								mode;
+	int64_t								tick;
+	boost::posix_time::time_duration	time_of_day;
+	int									frames;
+
+	batch_schedule()
+		: mode(now)
+		, tick(0)
+		, frames(0)
+	{
+	}
+};
+
+struct stage_batch::implementation : boost::noncopyable
+{
+	static boost::thread_specific_ptr<implementation>	current;
+
+	implementation*										previous;
+	bool												committed;
+	batch_schedule										schedule;
+	std::vector<std::pair<std::shared_ptr<stage::implementation>, std::function<void()>>> tasks;
+
+	static void keep(implementation*) {}
+};
+
+boost::thread_specific_ptr<stage_batch::implementation> stage_batch::implementation::current(&stage_batch::implementation::keep);
+
+namespace {
+
+void merge(live_transform& dest, const live_transform& src)
+{
+	if(src.fields & live_transform::opacity_field)
+		dest.opacity = src.opacity;
+	if(src.fields & live_transform::fill_translation_field)
+		dest.fill_translation = src.fill_translation;
+	if(src.fields & live_transform::fill_scale_field)
+		dest.fill_scale = src.fill_scale;
+	if(src.fields & live_transform::clip_translation_field)
+		dest.clip_translation = src.clip_translation;
+	if(src.fields & live_transform::clip_scale_field)
+		dest.clip_scale = src.clip_scale;
+	if(src.fields & live_transform::volume_field)
+		dest.volume = src.volume;
+
+	dest.fields |= src.fields;
+}
+
+void apply(frame_transform& dest, const live_transform& src)
+{
+	if(src.fields & live_transform::opacity_field)
+		dest.opacity = src.opacity;
+	if(src.fields & live_transform::fill_translation_field)
+		dest.fill_translation = src.fill_translation;
+	if(src.fields & live_transform::fill_scale_field)
+		dest.fill_scale = src.fill_scale;
+	if(src.fields & live_transform::clip_translation_field)
+		dest.clip_translation = src.clip_translation;
+	if(src.fields & live_transform::clip_scale_field)
+		dest.clip_scale = src.clip_scale;
+	if(src.fields & live_transform::volume_field)
+		dest.volume = src.volume;
+}
+
+}
+
 struct stage::implementation : public std::enable_shared_from_this<implementation>
 							 , boost::noncopyable
 {		
 	safe_ptr<diagnostics::graph>												 graph_;
+	diagnostics::graph::line_handle												 produce_time_line_;
+	diagnostics::graph::line_handle												 tick_time_line_;
 	safe_ptr<stage::target_t>													 target_;
 	video_format_desc															 format_desc_;
 																				 
@@ -105,6 +218,100 @@ struct stage::implementation : public std::enable_shared_from_this<implementatio
 	
 	safe_ptr<monitor::subject>													 monitor_subject_;
 
+	// INFO of the layers as of a tick, read without going through the executor.
+	struct info_snapshot
+	{
+		int64_t										tick;
+		boost::property_tree::wptree				info;
+		boost::property_tree::wptree				delay_info;
+		std::map<int, boost::property_tree::wptree>	layer_info;
+		std::map<int, boost::property_tree::wptree>	layer_delay_info;
+	};
+
+	// Receive time of a layer, averaged to order the layers and bucketed to find slow producers, and what the 
+	// layer costs besides.
+	struct layer_timing
+	{
+		static const int num_buckets = 7;
+
+		double			average;
+		int64_t			buckets[num_buckets];
+
+		double			cpu_average;	// Thread cpu time of the receive.
+		resource_usage	frame_usage;	// Held by the last frame received.
+		resource_usage	reported;		// By the foreground producer, as of the last info.
+
+		layer_timing()
+			: average(0.0)
+			, cpu_average(0.0)
+		{
+			std::fill_n(buckets, num_buckets, 0);
+		}
+
+		void record_usage(double cpu_seconds, const resource_usage& frame)
+		{
+			cpu_average = cpu_average * 0.9 + cpu_seconds * 0.1;
+			frame_usage = frame;
+		}
+
+		void update_reported(const boost::property_tree::wptree& layer_info)
+		{
+			auto producer = layer_info.get_child_optional(L"foreground.producer");
+			reported = producer ? resource_usage::from_info(*producer) : resource_usage();
+		}
+
+		resource_usage usage() const
+		{
+			auto usage = reported + frame_usage;
+			usage.cpu_time += cpu_average;
+			return usage;
+		}
+
+		static double bucket_limit(int bucket)
+		{
+			static const double limits[num_buckets] = {0.001, 0.002, 0.005, 0.010, 0.020, 0.040, std::numeric_limits<double>::max()};
+			return limits[bucket];
+		}
+
+		void record(double seconds)
+		{
+			average = average * 0.9 + seconds * 0.1;
+
+			int bucket = 0;
+			while(seconds > bucket_limit(bucket))
+				++bucket;
+			++buckets[bucket];
+		}
+
+		boost::property_tree::wptree info() const
+		{
+			boost::property_tree::wptree info;
+			info.add(L"average", average);
+			for(int n = 0; n < num_buckets; ++n)
+			{
+				auto& bucket = info.add(L"histogram.bucket", buckets[n]);
+				if(n < num_buckets - 1)
+					bucket.add(L"<xmlattr>.max-ms", static_cast<int>(bucket_limit(n) * 1000.0));
+			}
+			return info;
+		}
+	};
+
+	std::map<int, layer_timing>													 timings_;
+
+	const bool																	 scale_hints_;
+
+	tbb::atomic<int64_t>														 tick_count_;
+	boost::posix_time::ptime													 tick_time_; // Local time the last tick started.
+	std::multimap<int64_t, std::vector<std::function<void()>>>					 scheduled_; // Batches by the tick they are applied before.
+	tbb::atomic<int>															 produce_load_permille_;
+	tbb::atomic<bool>															 snapshot_requested_;
+	tbb::spin_mutex																 snapshot_mutex_;
+	tbb::spin_mutex																 live_mutex_;
+	std::map<int, live_transform>												 live_pending_; // Entries are kept, taking one resets its fields.
+	std::vector<std::pair<int, live_transform>>									 live_taken_;
+	std::shared_ptr<const info_snapshot>										 snapshot_;
+
 	executor																	 executor_;
 
 public:
@@ -113,10 +320,30 @@ public:
 		, format_desc_(format_desc)
 		, target_(target)
 		, monitor_subject_(make_safe<monitor::subject>("/stage"))
+		, scale_hints_(env::properties().get(L"configuration.scale-hints", true))
 		, executor_(L"stage")
 	{
 		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f, 0.8));	
 		graph_->set_color("produce-time", diagnostics::color(0.0f, 1.0f, 0.0f));
+		produce_time_line_	= graph_->get_line("produce-time");
+		tick_time_line_		= graph_->get_line("tick-time");
+
+		tick_count_			= 0;
+		produce_load_permille_ = 0;
+		snapshot_requested_ = false;
+	}
+
+	// Layers filling no more than a half or a quarter of the channel, so that their producers can decode and upload
+	// less than the channel's size.
+	static int scale_hint(const frame_transform& transform)
+	{
+		auto scale = std::max(std::abs(transform.fill_scale[0]), std::abs(transform.fill_scale[1]));
+
+		if(scale <= 0.25)
+			return frame_producer::QUARTER_SCALE_HINT;
+		if(scale <= 0.5)
+			return frame_producer::HALF_SCALE_HINT;
+		return frame_producer::NO_HINT;
 	}
 
 	void spawn_token()
@@ -125,6 +352,82 @@ public:
 		executor_.begin_invoke([=]{tick(self);});
 	}
 	
+	// Changes go to the batch of the calling thread when there is one.
+	void post(const std::function<void()>& task)
+	{
+		auto batch = stage_batch::implementation::current.get();
+		if(batch)
+			batch->tasks.push_back(std::make_pair(shared_from_this(), task));
+		else
+			executor_.begin_invoke(task, high_priority);
+	}
+
+	void apply_batch(const std::vector<std::function<void()>>& tasks, const batch_schedule& schedule)
+	{
+		executor_.begin_invoke([=]
+		{
+			if(schedule.mode == batch_schedule::now)
+			{
+				run_batch(tasks);
+				return;
+			}
+
+			auto tick = schedule.mode == batch_schedule::at_tick ? schedule.tick : tick_at(schedule.time_of_day, schedule.frames);
+
+			// Tasks run now take effect on the next tick anyway.
+			if(tick <= tick_count_ + 1)
+			{
+				if(tick <= tick_count_)
+					CASPAR_LOG(warning) << L"[stage] Batch scheduled for tick " << tick << L" applied " << (tick_count_ + 1 - tick) << L" frames late.";
+				run_batch(tasks);
+				return;
+			}
+
+			scheduled_.insert(std::make_pair(tick, tasks));
+		}, high_priority);
+	}
+
+	void run_batch(const std::vector<std::function<void()>>& tasks)
+	{
+		BOOST_FOREACH(auto& task, tasks)
+		{
+			try
+			{
+				task();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+	}
+
+	// The batches due on the tick about to start, in the order they were scheduled for the same tick.
+	void run_scheduled(int64_t tick)
+	{
+		while(!scheduled_.empty() && scheduled_.begin()->first <= tick)
+		{
+			auto tasks = std::move(scheduled_.begin()->second);
+			scheduled_.erase(scheduled_.begin());
+			run_batch(tasks);
+		}
+	}
+
+	// The first tick at or after the local time of day, counted from the start of the last tick.
+	int64_t tick_at(const boost::posix_time::time_duration& time_of_day, int frames) const
+	{
+		auto now	= tick_time_.is_not_a_date_time() ? boost::posix_time::microsec_clock::local_time() : tick_time_;
+		auto target	= boost::posix_time::ptime(now.date(), time_of_day);
+
+		if(target < now - boost::posix_time::hours(12))
+			target += boost::gregorian::days(1);
+
+		auto seconds = static_cast<double>((target - now).total_microseconds()) / 1000000.0;
+		auto ticks	 = static_cast<int64_t>(std::ceil(seconds * format_desc_.fps - 0.001)) + frames;
+
+		return tick_count_ + std::max<int64_t>(ticks, 0);
+	}
+
 	void add_layer_consumer(void* token, int layer, const std::shared_ptr<write_frame_consumer>& layer_consumer)
 	{
 		executor_.begin_invoke([=]
@@ -152,55 +455,132 @@ public:
 		{
 			produce_timer_.restart();
 
+			++tick_count_;
+			tick_time_ = boost::posix_time::microsec_clock::local_time();
+
+			diagnostics::trace::scope trace("stage.tick", tick_count_);
+
+			run_scheduled(tick_count_);
+			apply_live_transforms();
+
+			auto num_allocated = basic_frame::num_allocated();
+
 			std::map<int, safe_ptr<basic_frame>> frames;
 		
 			for(auto it = layers_.begin(); it != layers_.end(); ++it)
 				frames[it->first] = basic_frame::empty();	
 
-			tbb::parallel_for_each(layers_.begin(), layers_.end(), [&](std::map<int, std::shared_ptr<layer>>::value_type& layer) 
+			for(auto it = timings_.begin(); it != timings_.end();)
 			{
-				auto transform = transforms_[layer.first].fetch_and_tick(1);
+				if(layers_.find(it->first) == layers_.end())
+					it = timings_.erase(it);
+				else
+					++it;
+			}
 
-				int hints = frame_producer::NO_HINT;
-				if(format_desc_.field_mode != field_mode::progressive)
-				{
-					hints |= std::abs(transform.fill_scale[1]  - 1.0) > 0.0001 ? frame_producer::DEINTERLACE_HINT : frame_producer::NO_HINT;
-					hints |= std::abs(transform.fill_translation[1]) > 0.0001 ? frame_producer::DEINTERLACE_HINT : frame_producer::NO_HINT;
-				}
+			// The layers that took longest on the previous ticks start first, so a slow producer
+			// does not start last and hold back the whole tick.
+			typedef std::pair<double, std::map<int, std::shared_ptr<layer>>::value_type*> scheduled_layer;
+
+			std::vector<scheduled_layer> order;
+			BOOST_FOREACH(auto& layer, layers_)
+				order.push_back(std::make_pair(timings_[layer.first].average, &layer));
+
+			std::sort(order.begin(), order.end(), [](const scheduled_layer& lhs, const scheduled_layer& rhs)
+			{
+				return lhs.first > rhs.first;
+			});
+
+			std::vector<layer_timing*> order_timings;
+			BOOST_FOREACH(auto& entry, order)
+				order_timings.push_back(&timings_[entry.second->first]);
+
+			// Inside an arena the layers are received by no more tasks than it allows, each taking the
+			// next layer in order until none is left.
+			auto arena = parallel_arena::current();
+			auto width = arena ? std::min<std::size_t>(arena->width(), order.size()) : order.size();
 
-				if(transform.is_key)
-					hints |= frame_producer::ALPHA_HINT;
+			tbb::atomic<std::size_t> next;
+			next = 0;
+			int64_t tick = tick_count_;
 
-				auto frame = layer.second->receive(hints);	
-				auto layer_consumers_it = layer_consumers_.find(layer.first);
-				if (layer_consumers_it != layer_consumers_.end())
+			tbb::task_group tasks;
+			for(std::size_t n = 0; n < width; ++n)
+			{
+				tasks.run([this, arena, tick, &order, &order_timings, &next, &frames]
 				{
-					auto consumer_it = (*layer_consumers_it).second | boost::adaptors::map_values;
-					tbb::parallel_for_each(consumer_it.begin(), consumer_it.end(), [&](decltype(consumer_it[0]) layer_consumer) 
+					caspar::detail::arena_piece piece(arena);
+
+					for(auto index = next++; index < order.size(); index = next++)
 					{
-						layer_consumer->send(frame);
-					});
-				}
+						auto layer_ptr	= order[index].second;
+						auto timing_ptr = order_timings[index];
+						auto& layer = *layer_ptr;
 
-				auto frame1 = make_safe<core::basic_frame>(frame);
-				frame1->get_frame_transform() = transform;
+						diagnostics::trace::scope trace("layer.receive", tick, layer.first);
 
-				if(format_desc_.field_mode != core::field_mode::progressive)
-				{				
-					auto frame2 = make_safe<core::basic_frame>(frame);
-					frame2->get_frame_transform() = transforms_[layer.first].fetch_and_tick(1);
-					frame1 = core::basic_frame::interlace(frame1, frame2, format_desc_.field_mode);
-				}
+						boost::timer receive_timer;
+						diagnostics::thread_cpu_timer cpu_timer;
 
-				frames[layer.first] = frame1;
-			});
+						auto transform = transforms_[layer.first].fetch_and_tick(1);
+
+						int hints = frame_producer::NO_HINT;
+						if(format_desc_.field_mode != field_mode::progressive)
+						{
+							hints |= std::abs(transform.fill_scale[1]  - 1.0) > 0.0001 ? frame_producer::DEINTERLACE_HINT : frame_producer::NO_HINT;
+							hints |= std::abs(transform.fill_translation[1]) > 0.0001 ? frame_producer::DEINTERLACE_HINT : frame_producer::NO_HINT;
+						}
+
+						if(transform.is_key)
+							hints |= frame_producer::ALPHA_HINT;
+
+						if(scale_hints_)
+							hints |= scale_hint(transform);
+
+						auto frame = layer.second->receive(hints);	
+						auto layer_consumers_it = layer_consumers_.find(layer.first);
+						if (layer_consumers_it != layer_consumers_.end())
+						{
+							auto consumer_it = (*layer_consumers_it).second | boost::adaptors::map_values;
+							tbb::parallel_for_each(consumer_it.begin(), consumer_it.end(), [&](decltype(consumer_it[0]) layer_consumer) 
+							{
+								layer_consumer->send(frame);
+							});
+						}
+
+						auto frame1 = make_safe<core::basic_frame>(frame);
+						frame1->get_frame_transform() = transform;
+
+						if(format_desc_.field_mode != core::field_mode::progressive)
+						{				
+							auto frame2 = make_safe<core::basic_frame>(frame);
+							frame2->get_frame_transform() = transforms_[layer.first].fetch_and_tick(1);
+							frame1 = core::basic_frame::interlace(frame1, frame2, format_desc_.field_mode);
+						}
+
+						frames[layer.first] = frame1;
+
+						timing_ptr->record(receive_timer.elapsed());
+						timing_ptr->record_usage(cpu_timer.elapsed(), frame_resources(frame1));
+					}
+				});
+			}
+			tasks.wait();
 
 			// Tick the transforms that does not have a corresponding layer.
 			BOOST_FOREACH(auto& elem, transforms_)
 				if (layers_.find(elem.first) == layers_.end())
 					elem.second.fetch_and_tick(format_desc_.field_mode != core::field_mode::progressive ? 2 : 1);
 			
-			graph_->set_value("produce-time", produce_timer_.elapsed()*format_desc_.fps*0.5);
+			graph_->set_value(produce_time_line_, produce_timer_.elapsed()*format_desc_.fps*0.5);
+			produce_load_permille_ = static_cast<int>(produce_timer_.elapsed()*format_desc_.fps*1000.0);
+
+			// Counted process wide, so ticks of other channels running at the same time are included.
+			if(monitor_subject_->is_observed())
+			{
+				*monitor_subject_ << monitor::message("/frame-allocations") % (basic_frame::num_allocated() - num_allocated);
+				send_resources(tick);
+			}
 
 			std::shared_ptr<void> ticket(nullptr, [self](void*)
 			{
@@ -211,7 +591,11 @@ public:
 
 			target_->send(std::make_pair(frames, ticket));
 
-			graph_->set_value("tick-time", tick_timer_.elapsed()*format_desc_.fps*0.5);
+			// Refreshed once per tick for as long as someone keeps reading it, however often that is.
+			if(snapshot_requested_.fetch_and_store(false))
+				make_snapshot();
+
+			graph_->set_value(tick_time_line_, tick_timer_.elapsed()*format_desc_.fps*0.5);
 			tick_timer_.restart();
 		}
 		catch(...)
@@ -223,17 +607,17 @@ public:
 		
 	void set_transform(int index, const frame_transform& transform, unsigned int mix_duration, const std::wstring& tween)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			auto src = transforms_[index].fetch();
 			auto dst = transform;
 			transforms_[index] = tweened_transform<frame_transform>(src, dst, mix_duration, tween);
-		}, high_priority);
+		});
 	}
 					
 	void apply_transforms(const std::vector<std::tuple<int, stage::transform_func_t, unsigned int, std::wstring>>& transforms)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			BOOST_FOREACH(auto& transform, transforms)
 			{
@@ -242,33 +626,65 @@ public:
 				auto dst = std::get<1>(transform)(tween.dest());
 				transforms_[std::get<0>(transform)] = tweened_transform<frame_transform>(src, dst, std::get<2>(transform), std::get<3>(transform));
 			}
-		}, high_priority);
+		});
 	}
 						
 	void apply_transform(int index, const stage::transform_func_t& transform, unsigned int mix_duration, const std::wstring& tween)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			auto src = transforms_[index].fetch();
 			auto dst = transform(src);
 			transforms_[index] = tweened_transform<frame_transform>(src, dst, mix_duration, tween);
-		}, high_priority);
+		});
 	}
 
 	void clear_transforms(int index)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			transforms_.unsafe_erase(index);
-		}, high_priority);
+		});
 	}
 
 	void clear_transforms()
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			transforms_.clear();
-		}, high_priority);
+		});
+	}
+
+	void set_live_transform(int index, const live_transform& transform)
+	{
+		tbb::spin_mutex::scoped_lock lock(live_mutex_);
+		merge(live_pending_[index], transform);
+	}
+
+	// Neither allocates once every layer has been written to, so a controller updating at the frame rate costs 
+	// about as much as one lock per update and tick.
+	void apply_live_transforms()
+	{
+		live_taken_.clear();
+		{
+			tbb::spin_mutex::scoped_lock lock(live_mutex_);
+			BOOST_FOREACH(auto& entry, live_pending_)
+			{
+				if(entry.second.fields == 0)
+					continue;
+
+				live_taken_.push_back(entry);
+				entry.second.fields = 0;
+			}
+		}
+
+		BOOST_FOREACH(auto& entry, live_taken_)
+		{
+			auto& tween		= transforms_[entry.first];
+			auto transform	= tween.fetch();
+			apply(transform, entry.second);
+			tween.set(transform);
+		}
 	}
 
 	frame_transform get_current_transform(int index)
@@ -292,50 +708,50 @@ public:
 
 	void load(int index, const safe_ptr<frame_producer>& producer, bool preview, int auto_play_delta)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			get_layer(index).load(producer, preview, auto_play_delta);
-		}, high_priority);
+		});
 	}
 
 	void pause(int index)
 	{		
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			get_layer(index).pause();
-		}, high_priority);
+		});
 	}
 
 	void play(int index)
 	{		
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			get_layer(index).play();
-		}, high_priority);
+		});
 	}
 
 	void stop(int index)
 	{		
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			get_layer(index).stop();
-		}, high_priority);
+		});
 	}
 
 	void clear(int index)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			layers_.erase(index);
-		}, high_priority);
+		});
 	}
 		
 	void clear()
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			layers_.clear();
-		}, high_priority);
+		});
 	}	
 	
 	boost::unique_future<std::wstring> call(int index, bool foreground, const std::wstring& param)
@@ -373,18 +789,18 @@ public:
 				layer->monitor_output().detach_parent();
 		};		
 
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			other_impl->executor_.invoke(func, task_priority::high_priority);
-		}, task_priority::high_priority);
+		});
 	}
 
 	void swap_layer(int index, int other_index)
 	{
-		executor_.begin_invoke([=]
+		post([=]
 		{
 			std::swap(get_layer(index), get_layer(other_index));
-		}, task_priority::high_priority);
+		});
 	}
 
 	void swap_layer(int index, int other_index, stage& other)
@@ -409,10 +825,10 @@ public:
 				other_layer.monitor_output().attach_parent(other_impl->monitor_subject_);
 			};		
 
-			executor_.begin_invoke([=]
+			post([=]
 			{
 				other_impl->executor_.invoke(func, task_priority::high_priority);
-			}, task_priority::high_priority);
+			});
 		}
 	}
 		
@@ -440,20 +856,95 @@ public:
 		}, high_priority);
 	}
 
+	// The producers are asked for what they report about once a second, the rest is measured every tick.
+	void send_resources(int64_t tick)
+	{
+		bool refresh = tick % std::max(1, static_cast<int>(format_desc_.fps + 0.5)) == 0;
+
+		resource_usage total;
+		BOOST_FOREACH(auto& layer, layers_)
+		{
+			auto& timing = timings_[layer.first];
+			if(refresh)
+				timing.update_reported(layer.second->info());
+
+			auto usage = timing.usage();
+			usage.send(*monitor_subject_, "/layer/" + boost::lexical_cast<std::string>(layer.first) + "/resources");
+			total += usage;
+		}
+		total.send(*monitor_subject_, "/resources");
+	}
+
+	std::shared_ptr<const info_snapshot> make_snapshot()
+	{
+		auto snapshot = std::make_shared<info_snapshot>();
+		snapshot->tick = tick_count_;
+
+		resource_usage total;
+		BOOST_FOREACH(auto& layer, layers_)
+		{
+			auto& timing	 = timings_[layer.first];
+			auto& info		 = snapshot->layer_info[layer.first]		= layer.second->info();
+			info.add_child(L"receive-time", timing.info());
+			timing.update_reported(info);
+			info.add_child(L"resources", timing.usage().info());
+			total += timing.usage();
+			auto& delay_info = snapshot->layer_delay_info[layer.first]	= layer.second->delay_info();
+
+			snapshot->info.add_child(L"layers.layer", info)
+				.add(L"index", layer.first);
+			snapshot->delay_info.add_child(L"layer", delay_info)
+				.add(L"index", layer.first);
+		}
+		snapshot->info.add_child(L"resources", total.info());
+		snapshot->info.add(L"tick", snapshot->tick);
+		snapshot->info.add(L"scheduled-batches", scheduled_.size());
+
+		tbb::spin_mutex::scoped_lock lock(snapshot_mutex_);
+		snapshot_ = snapshot;
+
+		return snapshot;
+	}
+
+	// The snapshot made at the end of the previous tick, or null if there is none that recent.
+	std::shared_ptr<const info_snapshot> recent_snapshot()
+	{
+		snapshot_requested_ = true;
+
+		std::shared_ptr<const info_snapshot> snapshot;
+		{
+			tbb::spin_mutex::scoped_lock lock(snapshot_mutex_);
+			snapshot = snapshot_;
+		}
+
+		if(!snapshot || snapshot->tick + 1 < tick_count_)
+			return nullptr;
+
+		return snapshot;
+	}
+
 	boost::unique_future<boost::property_tree::wptree> info()
 	{
+		auto snapshot = recent_snapshot();
+		if(snapshot)
+			return wrap_as_future(boost::property_tree::wptree(snapshot->info));
+
 		return std::move(executor_.begin_invoke([this]() -> boost::property_tree::wptree
 		{
-			boost::property_tree::wptree info;
-			BOOST_FOREACH(auto& layer, layers_)			
-				info.add_child(L"layers.layer", layer.second->info())
-					.add(L"index", layer.first);	
-			return info;
+			return make_snapshot()->info;
 		}, high_priority));
 	}
 
 	boost::unique_future<boost::property_tree::wptree> info(int index)
 	{
+		auto snapshot = recent_snapshot();
+		if(snapshot)
+		{
+			auto it = snapshot->layer_info.find(index);
+			if(it != snapshot->layer_info.end())
+				return wrap_as_future(boost::property_tree::wptree(it->second));
+		}
+
 		return std::move(executor_.begin_invoke([=]() -> boost::property_tree::wptree
 		{
 			return get_layer(index).info();
@@ -462,18 +953,26 @@ public:
 
 	boost::unique_future<boost::property_tree::wptree> delay_info()
 	{
+		auto snapshot = recent_snapshot();
+		if(snapshot)
+			return wrap_as_future(boost::property_tree::wptree(snapshot->delay_info));
+
 		return std::move(executor_.begin_invoke([this]() -> boost::property_tree::wptree
 		{
-			boost::property_tree::wptree info;
-			BOOST_FOREACH(auto& layer, layers_)			
-				info.add_child(L"layer", layer.second->delay_info())
-					.add(L"index", layer.first);	
-			return info;
+			return make_snapshot()->delay_info;
 		}, high_priority));
 	}
 
 	boost::unique_future<boost::property_tree::wptree> delay_info(int index)
 	{
+		auto snapshot = recent_snapshot();
+		if(snapshot)
+		{
+			auto it = snapshot->layer_delay_info.find(index);
+			if(it != snapshot->layer_delay_info.end())
+				return wrap_as_future(boost::property_tree::wptree(it->second));
+		}
+
 		return std::move(executor_.begin_invoke([=]() -> boost::property_tree::wptree
 		{
 			return get_layer(index).delay_info();
@@ -487,6 +986,7 @@ void stage::apply_transforms(const std::vector<stage::transform_tuple_t>& transf
 void stage::apply_transform(int index, const transform_func_t& transform, unsigned int mix_duration, const std::wstring& tween){impl_->apply_transform(index, transform, mix_duration, tween);}
 void stage::clear_transforms(int index){impl_->clear_transforms(index);}
 void stage::clear_transforms(){impl_->clear_transforms();}
+void stage::set_live_transform(int index, const live_transform& transform){impl_->set_live_transform(index, transform);}
 frame_transform stage::get_current_transform(int index) { return impl_->get_current_transform(index); }
 void stage::spawn_token(){impl_->spawn_token();}
 void stage::load(int index, const safe_ptr<frame_producer>& producer, bool preview, int auto_play_delta){impl_->load(index, producer, preview, auto_play_delta);}
@@ -504,9 +1004,85 @@ boost::unique_future<safe_ptr<frame_producer>> stage::foreground(int index) {ret
 boost::unique_future<safe_ptr<frame_producer>> stage::background(int index) {return impl_->background(index);}
 boost::unique_future<std::wstring> stage::call(int index, bool foreground, const std::wstring& param){return impl_->call(index, foreground, param);}
 void stage::set_video_format_desc(const video_format_desc& format_desc){impl_->set_video_format_desc(format_desc);}
+void stage::set_thread_placement(const thread_placement& placement){impl_->executor_.set_placement(placement);}
+void stage::set_parallel_arena(const std::shared_ptr<parallel_arena>& arena){impl_->executor_.set_arena(arena);}
 boost::unique_future<boost::property_tree::wptree> stage::info() const{return impl_->info();}
 boost::unique_future<boost::property_tree::wptree> stage::info(int index) const{return impl_->info(index);}
 boost::unique_future<boost::property_tree::wptree> stage::delay_info() const{return impl_->delay_info();}
+double stage::produce_load() const{return impl_->produce_load_permille_ / 1000.0;}
+int64_t stage::tick_count() const{return impl_->tick_count_;}
 boost::unique_future<boost::property_tree::wptree> stage::delay_info(int index) const{return impl_->delay_info(index);}
 monitor::subject& stage::monitor_output(){return *impl_->monitor_subject_;}
+
+stage_batch::stage_batch()
+	: impl_(new implementation())
+{
+	impl_->previous	 = implementation::current.get();
+	impl_->committed = false;
+	implementation::current.reset(impl_.get());
+}
+
+stage_batch::~stage_batch()
+{
+	if(!impl_->committed)
+		implementation::current.reset(impl_->previous);
+}
+
+bool stage_batch::is_collecting()
+{
+	return implementation::current.get() != nullptr;
+}
+
+void stage_batch::commit()
+{
+	if(impl_->committed)
+		return;
+
+	impl_->committed = true;
+	implementation::current.reset(impl_->previous);
+
+	// A nested batch is committed with the one around it, and when that one is scheduled.
+	if(impl_->previous)
+	{
+		if(impl_->schedule.mode != batch_schedule::now)
+			CASPAR_LOG(warning) << L"[stage] The schedule of a nested batch is ignored.";
+
+		impl_->previous->tasks.insert(impl_->previous->tasks.end(), impl_->tasks.begin(), impl_->tasks.end());
+		return;
+	}
+
+	typedef std::pair<std::shared_ptr<stage::implementation>, std::vector<std::function<void()>>> stage_tasks;
+
+	std::vector<stage_tasks> stages;
+	BOOST_FOREACH(auto& task, impl_->tasks)
+	{
+		auto it = std::find_if(stages.begin(), stages.end(), [&](const stage_tasks& entry)
+		{
+			return entry.first == task.first;
+		});
+
+		if(it == stages.end())
+			it = stages.insert(stages.end(), stage_tasks(task.first, std::vector<std::function<void()>>()));
+
+		it->second.push_back(task.second);
+	}
+
+	BOOST_FOREACH(auto& entry, stages)
+		entry.first->apply_batch(entry.second, impl_->schedule);
+}
+
+void stage_batch::commit_at_tick(int64_t tick)
+{
+	impl_->schedule.mode = batch_schedule::at_tick;
+	impl_->schedule.tick = tick;
+	commit();
+}
+
+void stage_batch::commit_at_time(const boost::posix_time::time_duration& time_of_day, int frames)
+{
+	impl_->schedule.mode		= batch_schedule::at_time;
+	impl_->schedule.time_of_day	= time_of_day;
+	impl_->schedule.frames		= frames;
+	commit();
+}
 }}
\ No newline at end of file
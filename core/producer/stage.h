@@ -29,18 +29,56 @@
 #include <common/concurrency/target.h>
 #include <common/diagnostics/graph.h>
 
+#include <boost/array.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/property_tree/ptree_fwd.hpp>
 #include <boost/thread/future.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <functional>
 
-namespace caspar { namespace core {
+namespace caspar {
+
+struct thread_placement;
+class parallel_arena;
+
+namespace core {
 
 struct video_format_desc;
 struct frame_transform;
 struct write_frame_consumer;
 
+// Geometry, opacity and volume for a layer, written at a high rate by an external controller. Only the fields 
+// in the mask are set, see stage::set_live_transform.
+struct live_transform
+{
+	enum field
+	{
+		opacity_field			= 1,
+		fill_translation_field	= 2,
+		fill_scale_field		= 4,
+		clip_translation_field	= 8,
+		clip_scale_field		= 16,
+		volume_field			= 32
+	};
+
+	int						fields;
+	double					opacity;
+	boost::array<double, 2>	fill_translation;
+	boost::array<double, 2>	fill_scale;
+	boost::array<double, 2>	clip_translation;
+	boost::array<double, 2>	clip_scale;
+	double					volume;
+
+	live_transform() : fields(0), opacity(1.0), volume(1.0)
+	{
+		fill_translation[0] = fill_translation[1] = 0.0;
+		fill_scale[0]		= fill_scale[1]		  = 1.0;
+		clip_translation[0] = clip_translation[1] = 0.0;
+		clip_scale[0]		= clip_scale[1]		  = 1.0;
+	}
+};
+
 class stage : boost::noncopyable
 {
 public:
@@ -63,6 +101,10 @@ public:
 	void clear_transforms();
 	frame_transform get_current_transform(int index);
 
+	// Sets the fields of the transform of a layer from any thread without going through the executor. The latest
+	// values for each layer are taken once at the start of the next tick and replace the tween of the layer.
+	void set_live_transform(int index, const live_transform& transform);
+
 	void spawn_token();
 			
 	void load(int index, const safe_ptr<frame_producer>& producer, bool preview = false, int auto_play_delta = -1);
@@ -90,12 +132,55 @@ public:
 
 	boost::unique_future<boost::property_tree::wptree> delay_info() const;
 	boost::unique_future<boost::property_tree::wptree> delay_info(int layer) const;
+
+	// The time the last tick spent producing, as a fraction of the frame period.
+	double produce_load() const;
+
+	// The number of the last tick, counting from 1. Scheduled batches refer to it, see stage_batch::commit_at_tick.
+	int64_t tick_count() const;
 	
 	void set_video_format_desc(const video_format_desc& format_desc);
+	void set_thread_placement(const thread_placement& placement);
+	void set_parallel_arena(const std::shared_ptr<parallel_arena>& arena);
 		
 	monitor::subject& monitor_output();
 
 private:
+	friend class stage_batch;
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+// While alive, the stage changes made on the constructing thread are collected instead of applied.
+// commit() hands each stage its changes as one task, so they all take effect between the same two
+// ticks of that stage. A batch destroyed without being committed discards its changes. Producers are 
+// created while the changes are collected, so a scheduled batch only loads and plays them at its tick.
+class stage_batch : boost::noncopyable
+{
+public:
+
+	// Constructors
+
+	stage_batch();
+	~stage_batch();
+
+	// Methods
+
+	void commit();
+
+	// Commits the changes to be applied right before the tick with the number, on every stage of the batch, see 
+	// stage::tick_count. A batch committed for a tick that has already started is applied as soon as possible.
+	void commit_at_tick(int64_t tick);
+
+	// Commits the changes to be applied right before the first tick of each stage at or after the local time of day 
+	// plus the frames, at the frame rate of the stage. Times more than 12 hours ago are taken to be on the next day.
+	void commit_at_time(const boost::posix_time::time_duration& time_of_day, int frames = 0);
+
+	// Whether the stage changes made on the calling thread are being collected.
+	static bool is_collecting();
+
+private:
+	friend class stage;
 	struct implementation;
 	safe_ptr<implementation> impl_;
 };
@@ -26,16 +26,74 @@
 #include <core/video_format.h>
 
 #include <core/producer/frame/basic_frame.h>
+#include <core/producer/frame/frame_flattener.h>
 #include <core/producer/frame/frame_transform.h>
+#include <core/producer/frame/pixel_format.h>
+#include <core/mixer/write_frame.h>
+
+#include <common/concurrency/parallel_arena.h>
 
 #include <tbb/parallel_invoke.h>
 
 #include <boost/assign.hpp>
+#include <boost/foreach.hpp>
+
+#include <cstddef>
+#include <cstring>
 
 using namespace boost::assign;
 
 namespace caspar { namespace core {	
 
+namespace {
+
+// Whether the frame is drawn opaque over the whole of both fields.
+bool covers_frame(const safe_ptr<basic_frame>& frame)
+{
+	static const double epsilon = 0.001;
+
+	if(!is_concrete_frame(frame))
+		return false;
+
+	frame_flattener flattener;
+	frame->accept(flattener);
+
+	if(flattener.has_colors || flattener.frames.empty())
+		return false;
+
+	int fields = field_mode::empty;
+
+	BOOST_FOREACH(auto& entry, flattener.frames)
+	{
+		auto& transform = entry.second;
+
+		if(!is_opaque(entry.first->get_pixel_format_desc()) || transform.is_key || transform.is_mix || transform.is_paused || transform.opacity < 1.0-epsilon)
+			return false;
+
+		for(int n = 0; n < 2; ++n)
+		{
+			if(transform.fill_translation[n] > epsilon || transform.fill_translation[n] + transform.fill_scale[n] < 1.0-epsilon)
+				return false;
+			if(transform.clip_translation[n] > epsilon || transform.clip_translation[n] + transform.clip_scale[n] < 1.0-epsilon)
+				return false;
+		}
+
+		fields |= transform.field_mode;
+	}
+
+	return fields == field_mode::progressive;
+}
+
+// Whether both fields draw the same image, the audio is only taken from one of them.
+bool is_same_image(const frame_transform& lhs, const frame_transform& rhs)
+{
+	auto other = rhs;
+	other.volume = lhs.volume;
+	return std::memcmp(&lhs, &other, offsetof(frame_transform, is_paused) + sizeof(bool)) == 0;
+}
+
+}
+
 struct transition_producer : public frame_producer
 {	
 	safe_ptr<monitor::subject>	monitor_subject_;
@@ -86,7 +144,7 @@ struct transition_producer : public frame_producer
 		auto dest = basic_frame::empty();
 		auto source = basic_frame::empty();
 
-		tbb::parallel_invoke(
+		arena_parallel_invoke(
 		[&]
 		{
 			dest = receive_and_follow(dest_producer_, hints);
@@ -128,6 +186,16 @@ struct transition_producer : public frame_producer
 		return get_following_producer()->nb_frames();
 	}
 
+	virtual void preroll(int hints) override
+	{
+		dest_producer_->preroll(hints);
+	}
+
+	virtual bool is_ready() const override
+	{
+		return dest_producer_->is_ready();
+	}
+
 	virtual std::wstring print() const override
 	{
 		return L"transition[" + source_producer_->print() + L"=>" + dest_producer_->print() + L"]";
@@ -175,7 +243,14 @@ struct transition_producer : public frame_producer
 		d_frame1->get_frame_transform().volume = 0.0;
 		d_frame2->get_frame_transform().volume = delta2;
 
-		if(info_.type == transition::mix)
+		// A crossfade to an opaque destination covering the frame is the same as the source drawn as it is with the 
+		// destination over it at the mix opacity, which the mixer blends directly instead of through a mix buffer.
+		if(info_.type == transition::mix && covers_frame(dest_frame))
+		{
+			d_frame1->get_frame_transform().opacity = delta1;	
+			d_frame2->get_frame_transform().opacity = delta2;
+		}
+		else if(info_.type == transition::mix)
 		{
 			d_frame1->get_frame_transform().opacity = delta1;	
 			d_frame1->get_frame_transform().is_mix = true;
@@ -217,8 +292,8 @@ struct transition_producer : public frame_producer
 			s_frame2->get_frame_transform().fill_scale[0] = 1.0-delta2;		
 		} 
 				
-		const auto s_frame = s_frame1->get_frame_transform() == s_frame2->get_frame_transform() ? s_frame2 : basic_frame::interlace(s_frame1, s_frame2, mode_);
-		const auto d_frame = d_frame1->get_frame_transform() == d_frame2->get_frame_transform() ? d_frame2 : basic_frame::interlace(d_frame1, d_frame2, mode_);
+		const auto s_frame = is_same_image(s_frame1->get_frame_transform(), s_frame2->get_frame_transform()) ? s_frame2 : basic_frame::interlace(s_frame1, s_frame2, mode_);
+		const auto d_frame = is_same_image(d_frame1->get_frame_transform(), d_frame2->get_frame_transform()) ? d_frame2 : basic_frame::interlace(d_frame1, d_frame2, mode_);
 		
 		last_frame_ = basic_frame::combine(s_frame2, d_frame2);
 
@@ -0,0 +1,118 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "stdafx.h"
+
+#include "resource_usage.h"
+
+#include "mixer/write_frame.h"
+#include "producer/frame/basic_frame.h"
+#include "producer/frame/frame_visitor.h"
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <set>
+
+namespace caspar { namespace core {
+
+resource_usage::resource_usage()
+	: cpu_time(0.0)
+	, host_bytes(0)
+	, device_bytes(0)
+	, queue_depth(0)
+{
+}
+
+resource_usage& resource_usage::operator+=(const resource_usage& other)
+{
+	cpu_time		+= other.cpu_time;
+	host_bytes		+= other.host_bytes;
+	device_bytes	+= other.device_bytes;
+	queue_depth		+= other.queue_depth;
+	return *this;
+}
+
+resource_usage operator+(resource_usage lhs, const resource_usage& rhs)
+{
+	return lhs += rhs;
+}
+
+boost::property_tree::wptree resource_usage::info() const
+{
+	boost::property_tree::wptree info;
+	info.add(L"cpu-time",		cpu_time);
+	info.add(L"host-bytes",		host_bytes);
+	info.add(L"device-bytes",	device_bytes);
+	info.add(L"queue-depth",	queue_depth);
+	return info;
+}
+
+void resource_usage::send(monitor::subject& subject, const std::string& path) const
+{
+	subject << monitor::message(path + "/cpu-time")		% static_cast<float>(cpu_time)
+			<< monitor::message(path + "/host-bytes")	% host_bytes
+			<< monitor::message(path + "/device-bytes")	% device_bytes
+			<< monitor::message(path + "/queue-depth")	% queue_depth;
+}
+
+resource_usage resource_usage::from_info(const boost::property_tree::wptree& info)
+{
+	resource_usage usage;
+
+	auto resources = info.get_child_optional(L"resources");
+	if(!resources)
+		return usage;
+
+	usage.cpu_time		= resources->get(L"cpu-time",		0.0);
+	usage.host_bytes	= resources->get(L"host-bytes",		static_cast<int64_t>(0));
+	usage.device_bytes	= resources->get(L"device-bytes",	static_cast<int64_t>(0));
+	usage.queue_depth	= resources->get(L"queue-depth",	static_cast<int64_t>(0));
+	return usage;
+}
+
+// Counts each write frame once, the fields of an interlaced frame are often the same frame.
+struct frame_resources_visitor : public frame_visitor
+{
+	resource_usage					usage;
+	std::set<const write_frame*>	visited;
+
+	virtual void begin(basic_frame&) override {}
+	virtual void end() override {}
+	virtual void visit(color_frame&) override {}
+
+	virtual void visit(write_frame& frame) override
+	{
+		if(!visited.insert(&frame).second)
+			return;
+
+		usage.host_bytes	+= frame.host_bytes();
+		usage.device_bytes	+= frame.device_bytes();
+	}
+};
+
+resource_usage frame_resources(const safe_ptr<basic_frame>& frame)
+{
+	frame_resources_visitor visitor;
+	frame->accept(visitor);
+	return visitor.usage;
+}
+
+}}
@@ -0,0 +1,62 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "monitor/monitor.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace caspar { namespace core {
+
+class basic_frame;
+
+// What a producer, a consumer or a sum of them costs per frame. Producers and consumers report their own under
+// "resources" in info(), with any of cpu-time, host-bytes, device-bytes and queue-depth, the stage and the output 
+// add what they measure on their own threads.
+struct resource_usage
+{
+	double	cpu_time;		// Thread cpu time per frame, in seconds.
+	int64_t	host_bytes;
+	int64_t	device_bytes;
+	int64_t	queue_depth;	// Frames buffered.
+
+	resource_usage();
+
+	resource_usage& operator+=(const resource_usage& other);
+
+	boost::property_tree::wptree info() const;
+	void send(monitor::subject& subject, const std::string& path) const; // path/cpu-time, path/host-bytes, ...
+	
+	static resource_usage from_info(const boost::property_tree::wptree& info); // The "resources" child of info, if any.
+};
+
+resource_usage operator+(resource_usage lhs, const resource_usage& rhs);
+
+// The memory held by the write frames of a frame.
+resource_usage frame_resources(const safe_ptr<basic_frame>& frame);
+
+}}
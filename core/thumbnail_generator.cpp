@@ -26,13 +26,23 @@
 #include <iostream>
 #include <iterator>
 #include <set>
+#include <map>
+#include <queue>
+#include <vector>
+#include <cstdint>
+#include <cwchar>
 
 #include <boost/thread.hpp>
 #include <boost/range/algorithm/transform.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <tbb/atomic.h>
 
+#include <common/diagnostics/graph.h>
+#include <common/exception/win32_exception.h>
+
 #include "producer/frame_producer.h"
 #include "consumer/frame_consumer.h"
 #include "mixer/mixer.h"
@@ -69,6 +79,20 @@ std::wstring get_relative_without_extension(
 	return result;
 }
 
+static const int YIELD_POLL_MILLIS = 200;
+
+// Scrub strips are written next to the thumbnails, as <name>.strip.png.
+static const wchar_t* const SCRUB_STRIP_SUFFIX = L".strip";
+
+// The media file a file in the thumbnails folder belongs to, relative and without extension.
+std::wstring get_thumbnail_owner(const std::wstring& relative_without_extension)
+{
+	if (boost::iends_with(relative_without_extension, SCRUB_STRIP_SUFFIX))
+		return relative_without_extension.substr(0, relative_without_extension.size() - std::wcslen(SCRUB_STRIP_SUFFIX));
+
+	return relative_without_extension;
+}
+
 struct thumbnail_output : public mixer::target_t
 {
 	tbb::atomic<int> sleep_millis;
@@ -91,6 +115,64 @@ struct thumbnail_output : public mixer::target_t
 	}
 };
 
+// Jobs with a higher priority are rendered first.
+enum thumbnail_priority
+{
+	NORMAL_PRIORITY = 0,	// Initially found, modified or regenerated files.
+	NEW_FILE_PRIORITY,		// Files added after the initial scan.
+	REQUESTED_PRIORITY		// Files explicitly asked for.
+};
+
+struct thumbnail_job
+{
+	boost::filesystem::wpath	file;
+	int							priority;
+	std::int64_t				sequence;
+	bool						force;
+
+	bool operator<(const thumbnail_job& other) const
+	{
+		if (priority != other.priority)
+			return priority < other.priority;
+
+		return sequence > other.sequence;
+	}
+};
+
+// Each worker renders through a mixer of its own so that jobs do not wait on
+// each other.
+struct thumbnail_worker
+{
+	safe_ptr<diagnostics::graph>	graph;
+	const video_format_desc			format_desc;
+	const safe_ptr<ogl_device>		ogl;
+	const int						sleep_millis;
+	safe_ptr<thumbnail_output>		output;
+	safe_ptr<core::mixer>			renderer;
+	boost::thread					thread;
+
+	thumbnail_worker(int index, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, int sleep_millis)
+		: format_desc(format_desc)
+		, ogl(ogl)
+		, sleep_millis(sleep_millis)
+		, output(new thumbnail_output(sleep_millis))
+		, renderer(new core::mixer(graph, output, format_desc, ogl, channel_layout::stereo()))
+	{
+		renderer->set_background(true);
+		graph->set_text(L"thumbnail-channel-" + boost::lexical_cast<std::wstring>(index));
+		graph->auto_reset();
+		diagnostics::register_graph(graph);
+	}
+
+	// Discards a mixer that might still deliver a frame of an abandoned job.
+	void reset()
+	{
+		output = make_safe<thumbnail_output>(sleep_millis);
+		renderer = make_safe<core::mixer>(graph, output, format_desc, ogl, channel_layout::stereo());
+		renderer->set_background(true);
+	}
+};
+
 struct thumbnail_generator::implementation
 {
 private:
@@ -98,13 +180,23 @@ private:
 	boost::filesystem::wpath thumbnails_path_;
 	int width_;
 	int height_;
-	safe_ptr<ogl_device> ogl_;
-	safe_ptr<diagnostics::graph> graph_;
 	video_format_desc format_desc_;
-	safe_ptr<thumbnail_output> output_;
-	safe_ptr<mixer> mixer_;
 	thumbnail_creator thumbnail_creator_;
 	safe_ptr<media_info_repository> media_info_repo_;
+	const int job_timeout_millis_;
+	const std::function<bool ()> should_yield_;
+	int scrub_strip_columns_;
+	int scrub_strip_frames_;
+
+	boost::mutex mutex_;
+	boost::condition_variable job_available_;
+	bool running_;
+	bool initial_files_found_;
+	std::int64_t next_sequence_;
+	std::priority_queue<thumbnail_job> jobs_;
+	std::map<boost::filesystem::wpath, int> queued_priorities_;
+
+	std::vector<std::shared_ptr<thumbnail_worker>> workers_;
 	filesystem_monitor::ptr monitor_;
 public:
 	implementation(
@@ -117,22 +209,26 @@ public:
 			const safe_ptr<ogl_device>& ogl,
 			int generate_delay_millis,
 			const thumbnail_creator& thumbnail_creator,
-			safe_ptr<media_info_repository> media_info_repo)
+			safe_ptr<media_info_repository> media_info_repo,
+			int num_workers,
+			int job_timeout_millis,
+			const std::function<bool ()>& should_yield,
+			int scrub_strip_frames,
+			int scrub_strip_columns)
 		: media_path_(media_path)
 		, thumbnails_path_(thumbnails_path)
 		, width_(width)
 		, height_(height)
-		, ogl_(ogl)
 		, format_desc_(render_video_mode)
-		, output_(new thumbnail_output(generate_delay_millis))
-		, mixer_(new mixer(
-				graph_,
-				output_,
-				format_desc_,
-				ogl,
-				channel_layout::stereo()))
 		, thumbnail_creator_(thumbnail_creator)
 		, media_info_repo_(std::move(media_info_repo))
+		, job_timeout_millis_(job_timeout_millis)
+		, should_yield_(should_yield)
+		, scrub_strip_columns_(std::max(1, std::min(scrub_strip_columns, render_video_mode.width / std::max(1, width))))
+		, scrub_strip_frames_(std::max(0, std::min(scrub_strip_frames, scrub_strip_columns_ * (render_video_mode.height / std::max(1, height)))))
+		, running_(true)
+		, initial_files_found_(false)
+		, next_sequence_(0)
 		, monitor_(monitor_factory.create(
 				media_path,
 				ALL,
@@ -146,17 +242,42 @@ public:
 					this->on_initial_files(initial_files);
 				}))
 	{
-		graph_->set_text(L"thumbnail-channel");
-		graph_->auto_reset();
-		diagnostics::register_graph(graph_);
-		//monitor_->initial_scan_completion().get();
-		//output_->sleep_millis = 2000;
+		if (scrub_strip_frames_ < scrub_strip_frames)
+			CASPAR_LOG(warning) << L"Scrub strips limited to " << scrub_strip_frames_ << L" frames, which is what fits in " << format_desc_.name << L".";
+
+		for (int n = 0; n < std::max(1, num_workers); ++n)
+		{
+			auto worker = std::shared_ptr<thumbnail_worker>(new thumbnail_worker(n + 1, format_desc_, ogl, generate_delay_millis));
+			worker->thread = boost::thread([this, worker] { run(*worker); });
+			workers_.push_back(worker);
+		}
+	}
+
+	~implementation()
+	{
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			running_ = false;
+		}
+
+		job_available_.notify_all();
+
+		BOOST_FOREACH(auto& worker, workers_)
+		{
+			worker->thread.interrupt();
+			worker->thread.join();
+		}
 	}
 
 	void on_initial_files(const std::set<boost::filesystem::wpath>& initial_files)
 	{
 		using namespace boost::filesystem;
 
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			initial_files_found_ = true;
+		}
+
 		std::set<std::wstring> relative_without_extensions;
 		boost::transform(
 				initial_files,
@@ -173,7 +294,7 @@ public:
 				continue;
 
 			auto relative_without_extension = get_relative_without_extension(path, thumbnails_path_);
-			bool no_corresponding_media_file = relative_without_extensions.find(relative_without_extension) 
+			bool no_corresponding_media_file = relative_without_extensions.find(get_thumbnail_owner(relative_without_extension)) 
 					== relative_without_extensions.end();
 
 			if (no_corresponding_media_file)
@@ -191,14 +312,21 @@ public:
 		{
 			auto stem = iter->path().stem();
 
-			if (boost::iequals(stem, base_file.filename()))
-				monitor_->reemmit(iter->path());
+			if (boost::iequals(stem, base_file.filename()) && is_regular_file(iter->path()))
+				enqueue(iter->path(), REQUESTED_PRIORITY, true);
 		}
 	}
 
 	void generate_all()
 	{
-		monitor_->reemmit_all();
+		using namespace boost::filesystem;
+
+		// Queued directly, since a reemmitted file is only regenerated when its content changed.
+		for (wrecursive_directory_iterator iter(media_path_); iter != wrecursive_directory_iterator(); ++iter)
+		{
+			if (is_regular_file(iter->path()))
+				enqueue(iter->path(), NORMAL_PRIORITY, true);
+		}
 	}
 
 	void on_file_event(filesystem_event event, const boost::filesystem::wpath& file)
@@ -206,39 +334,131 @@ public:
 		switch (event)
 		{
 		case CREATED:
-			if (needs_to_be_generated(file))
-				generate_thumbnail(file);
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				enqueue(lock, file, initial_files_found_ ? NEW_FILE_PRIORITY : NORMAL_PRIORITY, false);
+			}
 
 			break;
 		case MODIFIED:
-			generate_thumbnail(file);
+			enqueue(file, NORMAL_PRIORITY, false);
 
 			break;
 		case REMOVED:
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				queued_priorities_.erase(file);
+			}
+
 			auto relative_without_extension = get_relative_without_extension(file, media_path_);
 			boost::filesystem::remove(thumbnails_path_ / (relative_without_extension + L".png"));
+			boost::filesystem::remove(thumbnails_path_ / (relative_without_extension + SCRUB_STRIP_SUFFIX + L".png"));
 			media_info_repo_->remove(file.file_string());
 
 			break;
 		}
 	}
+private:
+	void enqueue(const boost::filesystem::wpath& file, int priority, bool force)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		enqueue(lock, file, priority, force);
+	}
 
-	bool needs_to_be_generated(const boost::filesystem::wpath& file)
+	void enqueue(boost::mutex::scoped_lock&, const boost::filesystem::wpath& file, int priority, bool force)
 	{
-		using namespace boost::filesystem;
+		auto queued = queued_priorities_.find(file);
 
-		auto png_file = thumbnails_path_ / (get_relative_without_extension(file, media_path_) + L".png");
+		// An already queued file is only queued again to move it forward.
+		if (queued != queued_priorities_.end() && queued->second >= priority)
+			return;
+
+		thumbnail_job job;
+		job.file		= file;
+		job.priority	= priority;
+		job.sequence	= next_sequence_++;
+		job.force		= force;
+
+		queued_priorities_[file] = priority;
+		jobs_.push(job);
+		job_available_.notify_one();
+	}
+
+	bool next_job(thumbnail_job& job)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		while (running_)
+		{
+			if (jobs_.empty())
+			{
+				job_available_.wait(lock);
+				continue;
+			}
+
+			job = jobs_.top();
+			jobs_.pop();
+
+			auto queued = queued_priorities_.find(job.file);
+
+			// Superseded by a job of higher priority, or the file was removed.
+			if (queued == queued_priorities_.end() || queued->second != job.priority)
+				continue;
+
+			queued_priorities_.erase(queued);
 
-		if (!exists(png_file))
 			return true;
+		}
 
-		std::time_t media_file_mtime;
+		return false;
+	}
+
+	void run(thumbnail_worker& worker)
+	{
+		win32_exception::install_handler();
 
 		try
 		{
-			media_file_mtime = last_write_time(file);
+			thumbnail_job job;
+
+			while (next_job(job))
+			{
+				// Leave the resources to the channels while they are struggling.
+				while (should_yield_ && should_yield_())
+					boost::this_thread::sleep(boost::posix_time::milliseconds(YIELD_POLL_MILLIS));
+
+				if (job.force || needs_to_be_generated(job.file))
+					generate_thumbnail(worker, job.file);
+			}
+		}
+		catch (const boost::thread_interrupted&)
+		{
 		}
 		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+
+	bool needs_to_be_generated(const boost::filesystem::wpath& file)
+	{
+		using namespace boost::filesystem;
+
+		auto relative_without_extension = get_relative_without_extension(file, media_path_);
+		auto png_file = thumbnails_path_ / (relative_without_extension + L".png");
+		auto strip_file = thumbnails_path_ / (relative_without_extension + SCRUB_STRIP_SUFFIX + L".png");
+
+		if (!exists(png_file))
+			return true;
+
+		// Only clips get a scrub strip, so a missing one does not bring back the thumbnails of stills.
+		if (scrub_strip_frames_ > 0 && !exists(strip_file) && media_info_repo_->get(file.file_string()).duration > 1)
+			return true;
+
+		// Stays the same when the file is only copied over or touched, in which case the thumbnail still is valid.
+		auto media_file_mtime = media_info_repo_->get_content_write_time(file.file_string());
+
+		if (media_file_mtime == -1)
 		{
 			// Probably removed.
 			return false;
@@ -246,7 +466,8 @@ public:
 
 		try
 		{
-			return media_file_mtime != last_write_time(png_file);
+			return media_file_mtime != last_write_time(png_file)
+				|| (exists(strip_file) && media_file_mtime != last_write_time(strip_file));
 		}
 		catch (...)
 		{
@@ -255,18 +476,20 @@ public:
 		}
 	}
 
-	void generate_thumbnail(const boost::filesystem::wpath& file)
+	void generate_thumbnail(thumbnail_worker& worker, const boost::filesystem::wpath& file)
 	{
+		auto deadline = boost::get_system_time() + boost::posix_time::milliseconds(job_timeout_millis_);
 		auto media_file = get_relative_without_extension(file, media_path_);
 		auto png_file = thumbnails_path_ / (media_file + L".png");
-		boost::promise<void> thumbnail_ready;
+		auto thumbnail_ready = std::make_shared<boost::promise<void>>();
+		auto output = worker.output;
+		auto renderer = worker.renderer;
+		auto producer = frame_producer::empty();
 
 		{
-			auto producer = frame_producer::empty();
-
 			try
 			{
-				producer = create_thumbnail_producer(mixer_, media_file);
+				producer = create_thumbnail_producer(renderer, media_file);
 			}
 			catch (const boost::thread_interrupted&)
 			{
@@ -285,9 +508,14 @@ public:
 			}
 
 			boost::filesystem::create_directories(png_file.parent_path());
-			output_->on_send = [this, &png_file] (const safe_ptr<read_frame>& frame)
+
+			auto thumbnail_creator = thumbnail_creator_;
+			auto format_desc = format_desc_;
+			auto width = width_;
+			auto height = height_;
+			output->on_send = [=] (const safe_ptr<read_frame>& frame)
 			{
-				thumbnail_creator_(frame, format_desc_, png_file, width_, height_);
+				thumbnail_creator(frame, format_desc, png_file, width, height);
 			};
 
 			std::map<int, safe_ptr<basic_frame>> frames;
@@ -296,7 +524,6 @@ public:
 			try
 			{
 				raw_frame = producer->create_thumbnail_frame();
-				media_info_repo_->remove(file.file_string());
 				media_info_repo_->get(file.file_string());
 			}
 			catch (const boost::thread_interrupted&)
@@ -318,27 +545,39 @@ public:
 				return;
 			}
 
+			if (boost::get_system_time() > deadline)
+			{
+				CASPAR_LOG(warning) << L"Gave up on thumbnail for " << media_file << L" after " << job_timeout_millis_ << L" ms.";
+				return;
+			}
+
 			auto transformed_frame = make_safe<basic_frame>(raw_frame);
 			transformed_frame->get_frame_transform().fill_scale[0] = static_cast<double>(width_) / format_desc_.width;
 			transformed_frame->get_frame_transform().fill_scale[1] = static_cast<double>(height_) / format_desc_.height;
 			frames.insert(std::make_pair(0, transformed_frame));
 
-			std::shared_ptr<void> ticket(nullptr, [&thumbnail_ready](void*)
+			std::shared_ptr<void> ticket(nullptr, [thumbnail_ready](void*)
 			{
-				thumbnail_ready.set_value();
+				thumbnail_ready->set_value();
 			});
 
-			mixer_->send(std::make_pair(frames, ticket));
+			renderer->send(std::make_pair(frames, ticket));
 			ticket.reset();
 		}
-		thumbnail_ready.get_future().get();
+
+		if (!thumbnail_ready->get_future().timed_wait_until(deadline))
+		{
+			CASPAR_LOG(warning) << L"Gave up on thumbnail for " << media_file << L" after " << job_timeout_millis_ << L" ms.";
+			worker.reset();
+			return;
+		}
 
 		if (boost::filesystem::exists(png_file))
 		{
-			// Adjust timestamp to match source file.
+			// Adjust timestamp to match the content of the source file.
 			try
 			{
-				boost::filesystem::last_write_time(png_file, boost::filesystem::last_write_time(file));
+				boost::filesystem::last_write_time(png_file, media_info_repo_->get_content_write_time(file.file_string()));
 				CASPAR_LOG(debug) << L"Generated thumbnail for " << media_file;
 			}
 			catch (...)
@@ -347,7 +586,107 @@ public:
 			}
 		}
 		else
+		{
 			CASPAR_LOG(debug) << L"No thumbnail generated for " << media_file;
+			return;
+		}
+
+		if (scrub_strip_frames_ > 0)
+			generate_scrub_strip(worker, file, producer);
+	}
+
+	// Renders scrub_strip_frames_ frames at fixed intervals of the clip as tiles of the thumbnail size, row by row, 
+	// into one sprite sheet, so that clients can scrub without decoding the clip.
+	void generate_scrub_strip(thumbnail_worker& worker, const boost::filesystem::wpath& file, const safe_ptr<frame_producer>& producer)
+	{
+		auto deadline = boost::get_system_time() + boost::posix_time::milliseconds(job_timeout_millis_);
+		auto media_file = get_relative_without_extension(file, media_path_);
+		auto strip_file = thumbnails_path_ / (media_file + SCRUB_STRIP_SUFFIX + L".png");
+		auto strip_ready = std::make_shared<boost::promise<void>>();
+		auto output = worker.output;
+		auto renderer = worker.renderer;
+
+		{
+			std::vector<safe_ptr<basic_frame>> raw_frames;
+
+			try
+			{
+				raw_frames = producer->create_scrub_frames(scrub_strip_frames_);
+			}
+			catch (const boost::thread_interrupted&)
+			{
+				throw;
+			}
+			catch (...)
+			{
+				CASPAR_LOG(debug) << L"Thumbnail producer failed to create scrub strip for " << media_file;
+				return;
+			}
+
+			// Stills and audio have no timeline to scrub.
+			if (raw_frames.empty())
+				return;
+
+			if (boost::get_system_time() > deadline)
+			{
+				CASPAR_LOG(warning) << L"Gave up on scrub strip for " << media_file << L" after " << job_timeout_millis_ << L" ms.";
+				return;
+			}
+
+			auto tile_width		= static_cast<double>(width_) / format_desc_.width;
+			auto tile_height	= static_cast<double>(height_) / format_desc_.height;
+			auto columns		= std::min(static_cast<int>(raw_frames.size()), scrub_strip_columns_);
+			auto rows			= (static_cast<int>(raw_frames.size()) + columns - 1) / columns;
+
+			std::vector<safe_ptr<basic_frame>> tiles;
+			for (int n = 0; n < static_cast<int>(raw_frames.size()); ++n)
+			{
+				auto tile = make_safe<basic_frame>(raw_frames[n]);
+				tile->get_frame_transform().fill_scale[0]		= tile_width;
+				tile->get_frame_transform().fill_scale[1]		= tile_height;
+				tile->get_frame_transform().fill_translation[0]	= tile_width * (n % columns);
+				tile->get_frame_transform().fill_translation[1]	= tile_height * (n / columns);
+				tiles.push_back(tile);
+			}
+
+			auto thumbnail_creator = thumbnail_creator_;
+			auto format_desc = format_desc_;
+			auto width = columns * width_;
+			auto height = rows * height_;
+			output->on_send = [=] (const safe_ptr<read_frame>& frame)
+			{
+				thumbnail_creator(frame, format_desc, strip_file, width, height);
+			};
+
+			std::map<int, safe_ptr<basic_frame>> frames;
+			frames.insert(std::make_pair(0, make_safe<basic_frame>(tiles)));
+
+			std::shared_ptr<void> ticket(nullptr, [strip_ready](void*)
+			{
+				strip_ready->set_value();
+			});
+
+			renderer->send(std::make_pair(frames, ticket));
+			ticket.reset();
+		}
+
+		if (!strip_ready->get_future().timed_wait_until(deadline))
+		{
+			CASPAR_LOG(warning) << L"Gave up on scrub strip for " << media_file << L" after " << job_timeout_millis_ << L" ms.";
+			worker.reset();
+			return;
+		}
+
+		try
+		{
+			// Invalidated along with the thumbnail when the content of the source file changes.
+			boost::filesystem::last_write_time(strip_file, media_info_repo_->get_content_write_time(file.file_string()));
+			CASPAR_LOG(debug) << L"Generated scrub strip for " << media_file;
+		}
+		catch (...)
+		{
+			// One of the files was removed before the call to last_write_time.
+		}
 	}
 };
 
@@ -361,7 +700,12 @@ thumbnail_generator::thumbnail_generator(
 		const safe_ptr<ogl_device>& ogl,
 		int generate_delay_millis,
 		const thumbnail_creator& thumbnail_creator,
-		safe_ptr<media_info_repository> media_info_repo)
+		safe_ptr<media_info_repository> media_info_repo,
+		int num_workers,
+		int job_timeout_millis,
+		const std::function<bool ()>& should_yield,
+		int scrub_strip_frames,
+		int scrub_strip_columns)
 		: impl_(new implementation(
 				monitor_factory,
 				media_path,
@@ -371,7 +715,12 @@ thumbnail_generator::thumbnail_generator(
 				ogl,
 				generate_delay_millis,
 				thumbnail_creator,
-				media_info_repo))
+				media_info_repo,
+				num_workers,
+				job_timeout_millis,
+				should_yield,
+				scrub_strip_frames,
+				scrub_strip_columns))
 {
 }
 
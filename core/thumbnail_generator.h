@@ -40,6 +40,18 @@ typedef std::function<void (
 		int width,
 		int height)> thumbnail_creator;
 
+/**
+ * Keeps the thumbnails of the media folder up to date, rendering them on
+ * num_workers threads of their own. Files explicitly asked for and files added
+ * after the initial scan are rendered first. A job taking longer than
+ * job_timeout_millis is abandoned, and no job is started while should_yield
+ * returns true.
+ *
+ * Clips also get a scrub strip of scrub_strip_frames keyframes at fixed
+ * intervals, tiled scrub_strip_columns to a row at the thumbnail size into
+ * <name>.strip.png next to the thumbnail, as many as fit in
+ * render_video_mode.
+ */
 class thumbnail_generator : boost::noncopyable
 {
 public:
@@ -53,7 +65,12 @@ public:
 			const safe_ptr<ogl_device>& ogl,
 			int generate_delay_millis,
 			const thumbnail_creator& thumbnail_creator,
-			safe_ptr<media_info_repository> media_info_repo);
+			safe_ptr<media_info_repository> media_info_repo,
+			int num_workers = 1,
+			int job_timeout_millis = 10000,
+			const std::function<bool ()>& should_yield = nullptr,
+			int scrub_strip_frames = 0,
+			int scrub_strip_columns = 5);
 	~thumbnail_generator();
 	void generate(const std::wstring& media_file);
 	void generate_all();
@@ -24,6 +24,8 @@
 #include "video_channel.h"
 
 #include "video_format.h"
+#include "load_governor.h"
+#include "resource_usage.h"
 
 #include "consumer/output.h"
 #include "mixer/mixer.h"
@@ -31,15 +33,72 @@
 #include "mixer/audio/audio_util.h"
 #include "producer/stage.h"
 
+#include <common/concurrency/parallel_arena.h>
 #include <common/diagnostics/graph.h>
 #include <common/env.h>
 
 #include <boost/property_tree/ptree.hpp>
 
+#include <tbb/spin_mutex.h>
+
+#include <set>
 #include <string>
 
 namespace caspar { namespace core {
 
+namespace {
+
+// The indices of the channels in a mode, for consumers that only know the index they were initialized with.
+class channel_registry
+{
+	tbb::spin_mutex	mutex_;
+	std::set<int>	indices_;
+public:
+	void set(int index, bool value)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		if(value)
+			indices_.insert(index);
+		else
+			indices_.erase(index);
+	}
+
+	bool contains(int index)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		return indices_.find(index) != indices_.end();
+	}
+};
+
+channel_registry& offline_channels()
+{
+	static channel_registry registry;
+	return registry;
+}
+
+channel_registry& composition_channels()
+{
+	static channel_registry registry;
+	return registry;
+}
+
+// Fills the pools with the buffers frames of the format are mixed into and read back with, so that the first frames
+// after a mode change do not wait for them to be allocated. 
+void prepare_buffers(ogl_device& ogl, const video_format_desc& format_desc)
+{
+	static const int frames_in_flight = 3;
+
+	std::vector<safe_ptr<device_buffer>>	targets;
+	std::vector<safe_ptr<host_buffer>>		images;
+	for(int n = 0; n < frames_in_flight; ++n)
+	{
+		targets.push_back(ogl.create_device_buffer(format_desc.width, format_desc.height, 4));
+		images.push_back(ogl.create_host_buffer(format_desc.size, read_only));
+	}
+}
+
+}
+
 struct video_channel::implementation : boost::noncopyable
 {
 	video_channel&							self_;
@@ -54,6 +113,13 @@ struct video_channel::implementation : boost::noncopyable
 	const safe_ptr<caspar::core::stage>		stage_;
 
 	safe_ptr<monitor::subject>				monitor_subject_;
+	const safe_ptr<load_governor>			governor_;
+
+	tbb::spin_mutex							placement_mutex_;
+	channel_thread_placement				placement_; // As configured, see effective_placement.
+	std::shared_ptr<parallel_arena>			arena_;
+	bool									offline_;
+	bool									offline_arena_; // The arena was made for the offline mode.
 	
 public:
 	implementation(video_channel& self, int index, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout)  
@@ -66,6 +132,9 @@ public:
 		, mixer_(new caspar::core::mixer(graph_, output_, format_desc, ogl, audio_channel_layout))
 		, stage_(new caspar::core::stage(graph_, mixer_, format_desc))	
 		, monitor_subject_(make_safe<monitor::subject>("/channel/" + boost::lexical_cast<std::string>(index)))
+		, governor_(make_safe<load_governor>(print()))
+		, offline_(false)
+		, offline_arena_(false)
 	{
 		graph_->set_text(print());
 		diagnostics::register_graph(graph_);
@@ -73,15 +142,35 @@ public:
 		for(int n = 0; n < std::max(1, env::properties().get(L"configuration.pipeline-tokens", 2)); ++n)
 			stage_->spawn_token();
 
+		mixer_->set_readback_depth(std::max(0, env::properties().get(L"configuration.mixer.readback-depth", 0)));
+
+		auto output = output_;
+		mixer_->set_image_usage([output]{return output->image_usage();});
+
+		auto governor_config = env::properties().get_child_optional(L"configuration.governor");
+		if(governor_config)
+			governor_->set_config(parse_load_governor_config(*governor_config));
+
+		// The output waits for the clock consumer, so the stage and the mixer tell whether the channel keeps up.
+		output_->set_frame_callback([this]
+		{
+			auto load = is_offline() ? 0.0 : std::max(stage_->produce_load(), mixer_->mix_load());
+			governor_->update(load);
+			mixer_->set_degradations(governor_->active());
+		});
+
 		stage_->monitor_output().attach_parent(monitor_subject_);
 		mixer_->monitor_output().attach_parent(monitor_subject_);
 		output_->monitor_output().attach_parent(monitor_subject_);
+		governor_->monitor_output().attach_parent(monitor_subject_);
 
 		CASPAR_LOG(info) << print() << " Successfully Initialized.";
 	}
 
 	~implementation()
 	{
+		offline_channels().set(index_, false);
+		composition_channels().set(index_, false);
 		CASPAR_LOG(info) << print() << " successfully unitialized.";
 	}
 
@@ -90,12 +179,22 @@ public:
 		if(format_desc.format == core::video_format::invalid)
 			BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Invalid video-format"));
 
+		try
+		{
+			prepare_buffers(*ogl_, format_desc);
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+
+		// The buffers of the old format are released by the ogl device once they have been idle for a while, a gc 
+		// would also empty the pools of the other channels and the ones just prepared.
 		try
 		{
 			output_->set_video_format_desc(format_desc);
 			mixer_->set_video_format_desc(format_desc);
 			stage_->set_video_format_desc(format_desc);
-			ogl_->gc();
 		}
 		catch(...)
 		{
@@ -122,18 +221,140 @@ public:
 
 		info.add(L"video-mode", format_desc_.name);
 
+		resource_usage resources;
+
 		if (stage_info.timed_wait(boost::posix_time::seconds(2)))
-			info.add_child(L"stage", stage_info.get());
+			resources += resource_usage::from_info(info.add_child(L"stage", stage_info.get()));
 
 		if (mixer_info.timed_wait(boost::posix_time::seconds(2)))
 			info.add_child(L"mixer", mixer_info.get());
 
 		if (output_info.timed_wait(boost::posix_time::seconds(2)))
-			info.add_child(L"output", output_info.get());
+			resources += resource_usage::from_info(info.add_child(L"output", output_info.get()));
+
+		info.add_child(L"resources", resources.info());
    
 		return info;			   
 	}
 
+	// Offline channels run below on-air ones wherever the configuration leaves the priority open.
+	channel_thread_placement effective_placement(const std::wstring& open_priority)
+	{
+		auto placement = placement_;
+
+		auto fill = [&](thread_placement& thread)
+		{
+			if(thread.priority.empty() && thread.mmcss_task.empty())
+				thread.priority = open_priority;
+		};
+
+		fill(placement.stage);
+		fill(placement.mixer);
+		fill(placement.output);
+		fill(placement.consumers);
+		fill(placement.producers);
+
+		return placement;
+	}
+
+	void apply_placement(const channel_thread_placement& placement)
+	{
+		stage_->set_thread_placement(placement.stage);
+		mixer_->set_thread_placement(placement.mixer);
+		output_->set_thread_placement(placement.output);
+
+		if(!placement.gl.empty())
+		{
+			auto gl = placement.gl;
+			ogl_->begin_invoke([=]{apply_thread_placement(gl);}, high_priority);
+		}
+	}
+
+	void set_thread_placement(const channel_thread_placement& placement)
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+			placement_ = placement;
+		}
+
+		apply_placement(get_thread_placement());
+	}
+
+	channel_thread_placement get_thread_placement()
+	{
+		tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+		return effective_placement(offline_ ? L"below-normal" : L"");
+	}
+
+	void set_offline(bool value)
+	{
+		channel_thread_placement placement;
+		bool lower_arena = false;
+		bool drop_arena = false;
+		{
+			tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+			if(offline_ == value)
+				return;
+
+			offline_ = value;
+
+			// Going back on air has to undo the lowered priorities explicitly.
+			placement		= effective_placement(value ? L"below-normal" : L"normal");
+			lower_arena		= value && !arena_;
+			drop_arena		= !value && offline_arena_;
+		}
+
+		offline_channels().set(index_, value);
+		output_->set_free_running(value);
+		apply_placement(placement);
+
+		// Without an arena of their own offline renders take one worker, and spread further only while the pool is idle.
+		if(lower_arena)
+			set_parallel_concurrency(1, true);
+		else if(drop_arena)
+			set_parallel_concurrency(0, false);
+
+		CASPAR_LOG(info) << print() << (value ? L" Rendering offline." : L" Back on air.");
+	}
+
+	void set_composition(bool value)
+	{
+		if(composition_channels().contains(index_) == value)
+			return;
+
+		composition_channels().set(index_, value);
+		output_->set_composition(value);
+
+		CASPAR_LOG(info) << print() << (value ? L" Rendering as a composition for the channels routing it." : L" No longer a composition.");
+	}
+
+	bool is_offline()
+	{
+		tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+		return offline_;
+	}
+
+	void set_parallel_concurrency(int concurrency, bool offline_arena = false)
+	{
+		auto arena = concurrency > 0 ? std::make_shared<parallel_arena>(concurrency) : std::shared_ptr<parallel_arena>();
+
+		{
+			tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+			arena_			= arena;
+			offline_arena_	= offline_arena;
+		}
+
+		stage_->set_parallel_arena(arena);
+		mixer_->set_parallel_arena(arena);
+		output_->set_parallel_arena(arena);
+	}
+
+	std::shared_ptr<parallel_arena> get_parallel_arena()
+	{
+		tbb::spin_mutex::scoped_lock lock(placement_mutex_);
+		return arena_;
+	}
+
 	boost::property_tree::wptree delay_info() const
 	{
 		boost::property_tree::wptree info;
@@ -148,6 +369,8 @@ public:
 		if (mixer_info.timed_wait(boost::posix_time::seconds(2)))
 			info.add_child(L"mix-time", mixer_info.get());
 
+		info.add(L"readback-frames", mixer_->get_readback_depth());
+
 		if (output_info.timed_wait(boost::posix_time::seconds(2)))
 			info.add_child(L"consumers", output_info.get());
 
@@ -165,6 +388,27 @@ void video_channel::set_video_format_desc(const video_format_desc& format_desc){
 channel_layout video_channel::get_channel_layot() const { return impl_->audio_channel_layout_; }
 boost::property_tree::wptree video_channel::info() const{return impl_->info();}
 int video_channel::index() const {return impl_->index_;}
+void video_channel::set_thread_placement(const channel_thread_placement& placement){impl_->set_thread_placement(placement);}
+channel_thread_placement video_channel::get_thread_placement() const{return impl_->get_thread_placement();}
+void video_channel::set_parallel_concurrency(int concurrency){impl_->set_parallel_concurrency(concurrency);}
+void video_channel::set_offline(bool value){impl_->set_offline(value);}
+void video_channel::set_load_governor(const load_governor_config& config){impl_->governor_->set_config(config);}
+int video_channel::get_degradations() const{return impl_->governor_->active();}
+bool video_channel::is_offline() const{return impl_->is_offline();}
+void video_channel::set_composition(bool value){impl_->set_composition(value);}
+bool video_channel::is_composition() const{return composition_channels().contains(impl_->index_);}
+std::shared_ptr<parallel_arena> video_channel::get_parallel_arena() const{return impl_->get_parallel_arena();}
 monitor::subject& video_channel::monitor_output(){return *impl_->monitor_subject_;}
 boost::property_tree::wptree video_channel::delay_info() const { return impl_->delay_info(); }
+
+bool is_offline_channel(int index)
+{
+	return offline_channels().contains(index);
+}
+
+bool is_composition_channel(int index)
+{
+	return composition_channels().contains(index);
+}
+
 }}
\ No newline at end of file
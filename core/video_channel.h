@@ -24,13 +24,20 @@
 #include "monitor/monitor.h"
 
 #include <common/memory/safe_ptr.h>
+#include <common/concurrency/thread_placement.h>
 
 #include <boost/noncopyable.hpp>
 #include <boost/property_tree/ptree_fwd.hpp>
 
 #include <agents.h>
 
-namespace caspar { namespace core {
+#include <memory>
+
+namespace caspar { 
+	
+class parallel_arena;
+
+namespace core {
 	
 class stage;
 class mixer;
@@ -38,6 +45,19 @@ class output;
 class ogl_device;
 struct video_format_desc;
 struct channel_layout;
+struct load_governor_config;
+
+// Where the threads of a channel run. Consumers and producers get theirs through the threads creating them, see
+// scoped_thread_placement.
+struct channel_thread_placement
+{
+	thread_placement stage;
+	thread_placement mixer;
+	thread_placement output;
+	thread_placement consumers;
+	thread_placement producers;
+	thread_placement gl;	// Only with a context of its own, see configuration.mixer.channel-contexts.
+};
 
 class video_channel : boost::noncopyable
 {
@@ -66,6 +86,26 @@ public:
 	boost::property_tree::wptree delay_info() const;
 
 	int index() const;
+
+	void set_thread_placement(const channel_thread_placement& placement);
+	channel_thread_placement get_thread_placement() const;
+
+	// Bounds the TBB workers the channel's parallel work keeps busy, see parallel_arena. 0 lifts the bound.
+	void set_parallel_concurrency(int concurrency);
+	std::shared_ptr<parallel_arena> get_parallel_arena() const;
+
+	// Renders as fast as the consumers take the frames instead of at the frame rate, see is_offline_channel.
+	void set_offline(bool value);
+	bool is_offline() const;
+
+	// Renders a frame whenever a route to the channel asks for one instead of on a clock of its own, see 
+	// is_composition_channel.
+	void set_composition(bool value);
+	bool is_composition() const;
+
+	// Sheds work while the channel runs over its frame budget, see load_governor. Offline channels do not degrade.
+	void set_load_governor(const load_governor_config& config);
+	int get_degradations() const;
 	
 	monitor::subject& monitor_output();
 
@@ -74,4 +114,13 @@ private:
 	safe_ptr<implementation> impl_;
 };
 
+// Whether the channel with the index renders offline. Its pipeline ticks as soon as the previous frame is consumed,
+// below the priority of on-air channels, and consumers should wait for their encoders rather than drop frames.
+bool is_offline_channel(int index);
+
+// Whether the channel with the index is a composition, a stage of layers shared by the channels routing it. Its 
+// pipeline ticks when the first route to it asks for a frame, and not at all while nothing routes it, and every route
+// draws the same rendered texture without a read back.
+bool is_composition_channel(int index);
+
 }}
\ No newline at end of file
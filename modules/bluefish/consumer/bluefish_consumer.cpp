@@ -33,13 +33,13 @@
 #include <common/diagnostics/graph.h>
 #include <common/memory/memclr.h>
 #include <common/memory/memcpy.h>
-#include <common/memory/memshfl.h>
 #include <common/utility/timer.h>
 
 #include <core/consumer/frame_consumer.h>
 #include <core/mixer/audio/audio_util.h>
 
 #include <tbb/concurrent_queue.h>
+#include <tbb/cache_aligned_allocator.h>
 #include <tbb/atomic.h>
 
 #include <boost/timer.hpp>
@@ -48,9 +48,12 @@
 #include <boost/property_tree/ptree.hpp>
 
 #include <memory>
-#include <array>
+#include <vector>
 
 namespace caspar { namespace bluefish { 
+
+// Number of card framestore buffers cycled through, the ones being transferred and displayed must differ.
+static const int CARD_BUFFER_COUNT = 4;
 			
 struct bluefish_consumer : boost::noncopyable
 {
@@ -63,27 +66,38 @@ struct bluefish_consumer : boost::noncopyable
 	const std::wstring					model_name_;
 
 	safe_ptr<diagnostics::graph>		graph_;
-	boost::timer						frame_timer_;
+	boost::timer						encode_timer_;
+	boost::timer						dma_timer_;
 	boost::timer						tick_timer_;
 	boost::timer						sync_timer_;	
 			
 	unsigned int						vid_fmt_;
+	const bool							is_epoch_;
+	const int							card_type_;
 
-	std::array<blue_dma_buffer_ptr, 4>	reserved_frames_;	
-	tbb::concurrent_bounded_queue<std::shared_ptr<core::read_frame>> frame_buffer_;
+	// Host side ring, a buffer is only reused once its transfer has completed.
+	std::vector<blue_dma_buffer_ptr>	reserved_frames_;	
+	size_t								next_frame_;
+	int									card_buffer_;
 	tbb::atomic<int64_t>				presentation_delay_millis_;
 	std::shared_ptr<core::read_frame>	previous_frame_;
 	
 	const bool							embedded_audio_;
 	const bool							key_only_;
+
+	// Rearranged audio packed to 24 bits, kept between frames. Only touched by the encode executor.
+	std::vector<int8_t, tbb::cache_aligned_allocator<int8_t>>	hanc_audio_;
 		
-	executor							executor_;
+	// The audio of the next frame is encoded while the previous one is transferred.
+	executor							dma_executor_;
+	executor							encode_executor_;
 public:
 	bluefish_consumer(
 			const core::video_format_desc& format_desc,
 			unsigned int device_index,
 			bool embedded_audio,
 			bool key_only,
+			size_t ring_depth,
 			int channel_index,
 			const core::channel_layout& channel_layout)
 		: blue_(create_blue(device_index))
@@ -93,16 +107,26 @@ public:
 		, channel_layout_(channel_layout)
 		, model_name_(get_card_desc(*blue_))
 		, vid_fmt_(get_video_mode(*blue_, format_desc))
+		, is_epoch_(is_epoch_card(*blue_))
+		, card_type_(blue_->has_video_cardtype())
+		, next_frame_(0)
+		, card_buffer_(0)
 		, embedded_audio_(embedded_audio)
 		, key_only_(key_only)
-		, executor_(print())
+		, dma_executor_(print() + L" dma")
+		, encode_executor_(print() + L" encode")
 	{
-		executor_.set_capacity(1);
+		// Frames in flight: one encoding, one queued for and one in transfer, one on the card.
+		ring_depth = std::max<size_t>(ring_depth, 4);
+
+		dma_executor_.set_capacity(1);
+		encode_executor_.set_capacity(1);
 		presentation_delay_millis_ = 0;
 
 		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));	
 		graph_->set_color("sync-time", diagnostics::color(1.0f, 0.0f, 0.0f));
-		graph_->set_color("frame-time", diagnostics::color(0.5f, 1.0f, 0.2f));
+		graph_->set_color("encode-time", diagnostics::color(0.5f, 1.0f, 0.2f));
+		graph_->set_color("dma-time", diagnostics::color(1.0f, 1.0f, 0.0f));
 		graph_->set_text(print());
 		diagnostics::register_graph(graph_);
 			
@@ -177,15 +201,17 @@ public:
 		
 		enable_video_output();
 						
-		int n = 0;
-		boost::range::generate(reserved_frames_, [&]{return std::make_shared<blue_dma_buffer>(format_desc_.size, n++);});
+		for(size_t n = 0; n < ring_depth; ++n)
+			reserved_frames_.push_back(std::make_shared<blue_dma_buffer>(format_desc_.size, static_cast<int>(n)));
 	}
 
 	~bluefish_consumer()
 	{
 		try
 		{
-			executor_.invoke([&]
+			encode_executor_.stop();
+			encode_executor_.join();
+			dma_executor_.invoke([&]
 			{
 				disable_video_output();
 				blue_->device_detach();		
@@ -212,13 +238,27 @@ public:
 	
 	boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame)
 	{
-		return executor_.begin_invoke([=]() -> bool
+		return encode_executor_.begin_invoke([=]() -> bool
 		{
 			try
 			{	
-				display_frame(frame);				
-				graph_->set_value("tick-time", static_cast<float>(tick_timer_.elapsed()*format_desc_.fps*0.5));
-				tick_timer_.restart();
+				auto buffer = reserved_frames_[next_frame_++ % reserved_frames_.size()];
+				encode_frame(frame, buffer);
+
+				// Blocks while the previous frame is still waiting for its transfer.
+				dma_executor_.begin_invoke([=]
+				{
+					try
+					{
+						display_frame(frame, buffer);				
+						graph_->set_value("tick-time", static_cast<float>(tick_timer_.elapsed()*format_desc_.fps*0.5));
+						tick_timer_.restart();
+					}
+					catch(...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+					}
+				});
 			}
 			catch(...)
 			{
@@ -229,36 +269,21 @@ public:
 		});
 	}
 
-	void display_frame(const safe_ptr<core::read_frame>& frame)
+	void encode_frame(const safe_ptr<core::read_frame>& frame, const blue_dma_buffer_ptr& buffer)
 	{
-		// Sync
-
-		sync_timer_.restart();
-		unsigned long n_field = 0;
-		blue_->wait_output_video_synch(UPD_FMT_FRAME, n_field);
-		graph_->set_value("sync-time", sync_timer_.elapsed()*format_desc_.fps*0.5);
-		
-		frame_timer_.restart();
-
-		if (previous_frame_)
-			presentation_delay_millis_ = previous_frame_->get_age_millis();
-
-		previous_frame_ = frame;
+		encode_timer_.restart();
 
 		// Copy to local buffers
 		
 		if(!frame->image_data().empty())
 		{
 			if(key_only_)						
-				fast_memshfl(reserved_frames_.front()->image_data(), std::begin(frame->image_data()), frame->image_data().size(), 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
+				fast_memcpy(buffer->image_data(), std::begin(frame->key_image_data()), frame->key_image_data().size());
 			else
-				fast_memcpy(reserved_frames_.front()->image_data(), std::begin(frame->image_data()), frame->image_data().size());
+				fast_memcpy(buffer->image_data(), std::begin(frame->image_data()), frame->image_data().size());
 		}
 		else
-			fast_memclr(reserved_frames_.front()->image_data(), reserved_frames_.front()->image_size());
-								
-
-		// Send and display
+			fast_memclr(buffer->image_data(), buffer->image_size());
 
 		if(embedded_audio_)
 		{
@@ -266,63 +291,87 @@ public:
 
 			if (core::needs_rearranging(src_view, channel_layout_, channel_layout_.num_channels))
 			{
-				std::vector<int32_t> resulting_audio_data;
-				resulting_audio_data.resize(src_view.num_samples() * channel_layout_.num_channels, 0);
+				// Mixed and packed straight from the audio of the frame, without an int32 copy in between.
+				auto matrix = core::default_mix_config_repository().get_mix_matrix(src_view.channel_layout(), channel_layout_);
+				hanc_audio_.resize(src_view.num_samples() * channel_layout_.num_channels * 3);
+
+				if (src_view.num_samples() > 0)
+					core::apply_mix_matrix_24(
+							*matrix,
+							&*src_view.raw_begin(),
+							src_view.num_channels(),
+							hanc_audio_.data(),
+							channel_layout_.num_channels,
+							src_view.num_samples());
 
-				auto dest_view = core::make_multichannel_view<int32_t>(
-						resulting_audio_data.begin(), 
-						resulting_audio_data.end(),
-						channel_layout_);
-
-				core::rearrange_or_rearrange_and_mix(
-						src_view,
-						dest_view,
-						core::default_mix_config_repository());
-
-				auto frame_audio = core::audio_32_to_24(resulting_audio_data);
 				encode_hanc(
-						reinterpret_cast<BLUE_UINT32*>(reserved_frames_.front()->hanc_data()),
-						frame_audio.data(),
+						reinterpret_cast<BLUE_UINT32*>(buffer->hanc_data()),
+						hanc_audio_.data(),
 						src_view.num_samples(),
 						channel_layout_.num_channels);
 			}
 			else
 			{
-				auto frame_audio = core::audio_32_to_24(frame->audio_data());
+				auto frame_audio = frame->audio_data_24(); // Converted once for every consumer of the frame.
 				encode_hanc(
-						reinterpret_cast<BLUE_UINT32*>(reserved_frames_.front()->hanc_data()),
-						frame_audio.data(),
+						reinterpret_cast<BLUE_UINT32*>(buffer->hanc_data()),
+						const_cast<int8_t*>(frame_audio.begin()),
 						src_view.num_samples(),
 						channel_layout_.num_channels);
 			}
-								
-			blue_->system_buffer_write_async(const_cast<uint8_t*>(reserved_frames_.front()->image_data()), 
-											reserved_frames_.front()->image_size(), 
+		}
+
+		graph_->set_value("encode-time", static_cast<float>(encode_timer_.elapsed()*format_desc_.fps*0.5));
+	}
+
+	void display_frame(const safe_ptr<core::read_frame>& frame, const blue_dma_buffer_ptr& buffer)
+	{
+		// Sync
+
+		sync_timer_.restart();
+		unsigned long n_field = 0;
+		blue_->wait_output_video_synch(UPD_FMT_FRAME, n_field);
+		graph_->set_value("sync-time", sync_timer_.elapsed()*format_desc_.fps*0.5);
+		
+		dma_timer_.restart();
+
+		if (previous_frame_)
+			presentation_delay_millis_ = previous_frame_->get_age_millis();
+
+		previous_frame_ = frame;
+
+		// Send and display
+
+		const int card_buffer = card_buffer_;
+		card_buffer_ = (card_buffer_ + 1) % CARD_BUFFER_COUNT;
+
+		if(embedded_audio_)
+		{
+			blue_->system_buffer_write_async(const_cast<uint8_t*>(buffer->image_data()), 
+											buffer->image_size(), 
 											nullptr, 
-											BlueImage_HANC_DMABuffer(reserved_frames_.front()->id(), BLUE_DATA_IMAGE));
+											BlueImage_HANC_DMABuffer(card_buffer, BLUE_DATA_IMAGE));
 
-			blue_->system_buffer_write_async(reserved_frames_.front()->hanc_data(),
-											reserved_frames_.front()->hanc_size(), 
+			blue_->system_buffer_write_async(buffer->hanc_data(),
+											buffer->hanc_size(), 
 											nullptr,                 
-											BlueImage_HANC_DMABuffer(reserved_frames_.front()->id(), BLUE_DATA_HANC));
+											BlueImage_HANC_DMABuffer(card_buffer, BLUE_DATA_HANC));
 
-			if(BLUE_FAIL(blue_->render_buffer_update(BlueBuffer_Image_HANC(reserved_frames_.front()->id()))))
+			if(BLUE_FAIL(blue_->render_buffer_update(BlueBuffer_Image_HANC(card_buffer))))
 				CASPAR_LOG(warning) << print() << TEXT(" render_buffer_update failed.");
 		}
 		else
 		{
-			blue_->system_buffer_write_async(const_cast<uint8_t*>(reserved_frames_.front()->image_data()),
-											reserved_frames_.front()->image_size(), 
+			blue_->system_buffer_write_async(const_cast<uint8_t*>(buffer->image_data()),
+											buffer->image_size(), 
 											nullptr,                 
-											BlueImage_DMABuffer(reserved_frames_.front()->id(), BLUE_DATA_IMAGE));
+											BlueImage_DMABuffer(card_buffer, BLUE_DATA_IMAGE));
 			
-			if(BLUE_FAIL(blue_->render_buffer_update(BlueBuffer_Image(reserved_frames_.front()->id()))))
+			if(BLUE_FAIL(blue_->render_buffer_update(BlueBuffer_Image(card_buffer))))
 				CASPAR_LOG(warning) << print() << TEXT(" render_buffer_update failed.");
 		}
-
-		boost::range::rotate(reserved_frames_, std::begin(reserved_frames_)+1);
 		
-		graph_->set_value("frame-time", static_cast<float>(frame_timer_.elapsed()*format_desc_.fps*0.5));
+		graph_->set_value("dma-time", static_cast<float>(dma_timer_.elapsed()*format_desc_.fps*0.5));
 	}
 
 	void encode_hanc(BLUE_UINT32* hanc_data, void* audio_data, size_t audio_samples, size_t audio_nchannels)
@@ -349,10 +398,10 @@ public:
 		hanc_stream_info.hanc_data_ptr	  = hanc_data;
 		hanc_stream_info.video_mode		  = vid_fmt_;		
 		
-		if (!is_epoch_card(*blue_))
+		if (!is_epoch_)
 			encode_hanc_frame(&hanc_stream_info, audio_data, audio_nchannels, audio_samples, sample_type, emb_audio_flag);	
 		else
-			encode_hanc_frame_ex(blue_->has_video_cardtype(), &hanc_stream_info, audio_data, audio_nchannels, audio_samples, sample_type, emb_audio_flag);
+			encode_hanc_frame_ex(card_type_, &hanc_stream_info, audio_data, audio_nchannels, audio_samples, sample_type, emb_audio_flag);
 	}
 	
 	std::wstring print() const
@@ -373,6 +422,7 @@ struct bluefish_consumer_proxy : public core::frame_consumer
 	const size_t						device_index_;
 	const bool							embedded_audio_;
 	const bool							key_only_;
+	const size_t						ring_depth_;
 	std::vector<size_t>					audio_cadence_;
 	core::video_format_desc				format_desc_;
 	core::channel_layout				channel_layout_;
@@ -383,10 +433,12 @@ public:
 			size_t device_index,
 			bool embedded_audio,
 			bool key_only,
+			size_t ring_depth,
 			const core::channel_layout& channel_layout)
 		: device_index_(device_index)
 		, embedded_audio_(embedded_audio)
 		, key_only_(key_only)
+		, ring_depth_(ring_depth)
 		, channel_layout_(channel_layout)
 	{
 	}
@@ -410,6 +462,7 @@ public:
 				device_index_,
 				embedded_audio_,
 				key_only_,
+				ring_depth_,
 				channel_index,
 				channel_layout_));
 		audio_cadence_ = format_desc.audio_cadence;
@@ -437,13 +490,14 @@ public:
 		info.add(L"key-only", key_only_);
 		info.add(L"device", device_index_);
 		info.add(L"embedded-audio", embedded_audio_);
+		info.add(L"ring-depth", ring_depth_);
 		info.add(L"presentation-frame-age", presentation_frame_age_millis());
 		return info;
 	}
 
 	virtual size_t buffer_depth() const override
 	{
-		return 1;
+		return 2; // encode and transfer
 	}
 	
 	virtual int index() const override
@@ -466,10 +520,11 @@ safe_ptr<core::frame_consumer> create_consumer(const core::parameters& params)
 
 	const auto embedded_audio	= std::find(params.begin(), params.end(), L"EMBEDDED_AUDIO") != params.end();
 	const auto key_only			= std::find(params.begin(), params.end(), L"KEY_ONLY")	   != params.end();
+	const auto ring_depth		= params.get(L"RING_DEPTH", 4u);
 	const auto audio_layout		= core::default_channel_layout_repository().get_by_name(
 			params.get(L"CHANNEL_LAYOUT", L"STEREO"));
 
-	return make_safe<bluefish_consumer_proxy>(device_index, embedded_audio, key_only, audio_layout);
+	return make_safe<bluefish_consumer_proxy>(device_index, embedded_audio, key_only, ring_depth, audio_layout);
 }
 
 safe_ptr<core::frame_consumer> create_consumer(const boost::property_tree::wptree& ptree) 
@@ -477,12 +532,13 @@ safe_ptr<core::frame_consumer> create_consumer(const boost::property_tree::wptre
 	const auto device_index		= ptree.get(L"device",			1);
 	const auto embedded_audio	= ptree.get(L"embedded-audio",	false);
 	const auto key_only			= ptree.get(L"key-only",		false);
+	const auto ring_depth		= ptree.get(L"ring-depth",		4u);
 	const auto audio_layout =
 		core::default_channel_layout_repository().get_by_name(
 				boost::to_upper_copy(ptree.get(L"channel-layout", L"STEREO")));
 
 	return make_safe<bluefish_consumer_proxy>(
-			device_index, embedded_audio, key_only, audio_layout);
+			device_index, embedded_audio, key_only, ring_depth, audio_layout);
 }
 
 }}
\ No newline at end of file
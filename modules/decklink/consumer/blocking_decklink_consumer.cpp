@@ -68,6 +68,7 @@ struct blocking_decklink_consumer : boost::noncopyable
 	const std::wstring						model_name_;
 	const core::video_format_desc			format_desc_;
 	std::shared_ptr<core::read_frame>		previous_frame_;
+	CComPtr<decklink_frame>					video_frame_;
 	boost::circular_buffer<audio_buffer>	audio_samples_;
 	size_t									buffered_audio_samples_;
 	BMDTimeValue							last_reference_clock_value_;
@@ -269,22 +270,19 @@ public:
 				sync_timer_.elapsed() * format_desc_.fps * 0.5);
 	}
 
-	void write_video_frame(
-			const safe_ptr<core::read_frame>& frame,
-			std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>&& key)
+	void write_video_frame(const safe_ptr<core::read_frame>& frame)
 	{
-		CComPtr<IDeckLinkVideoFrame> frame2;
-
-		if (config_.key_only)
-			frame2 = CComPtr<IDeckLinkVideoFrame>(
-					new decklink_frame(frame, format_desc_, std::move(key)));
+		// DisplayVideoFrameSync is done with the frame when it returns, so one is enough.
+		if (!video_frame_)
+			video_frame_ = new decklink_frame(frame, format_desc_, config_.key_only);
 		else
-			frame2 = CComPtr<IDeckLinkVideoFrame>(
-					new decklink_frame(frame, format_desc_, config_.key_only));
+			video_frame_->set_frame(frame);
 
-		if (FAILED(output_->DisplayVideoFrameSync(frame2)))
+		if (FAILED(output_->DisplayVideoFrameSync(video_frame_)))
 			CASPAR_LOG(error) << print() << L" Failed to display video frame.";
 
+		video_frame_->set_frame(nullptr);
+
 		reference_signal_detector_.detect_change([this]() { return print(); });
 	}
 
@@ -293,10 +291,9 @@ public:
 		return executor_.begin_invoke([=]() -> bool
 		{
 			frame_timer_.restart();
-			std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> key;
 
 			if (config_.key_only)
-				key = std::move(extract_key(frame));
+				frame->key_image_data(); // Prepare the key before waiting for the display slot.
 
 			if (config_.embedded_audio)
 				queue_audio_samples(frame);
@@ -325,7 +322,7 @@ public:
 			tick_timer_.restart();
 
 			frame_timer_.restart();
-			write_video_frame(frame, std::move(key));
+			write_video_frame(frame);
 
 			if (config_.embedded_audio)
 				write_audio_samples();
@@ -44,11 +44,13 @@
 #include <tbb/cache_aligned_allocator.h>
 
 
-#include <boost/circular_buffer.hpp>
+#include <boost/foreach.hpp>
 #include <boost/timer.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include <algorithm>
+
 namespace caspar { namespace decklink { 
 
 struct decklink_consumer : public IDeckLinkVideoOutputCallback, boost::noncopyable
@@ -75,9 +77,16 @@ struct decklink_consumer : public IDeckLinkVideoOutputCallback, boost::noncopyab
 
 	size_t											preroll_count_;
 		
-	boost::circular_buffer<std::vector<int32_t>>	audio_container_;
+	// Handed to ScheduleAudioSamples in turn, allocated up front for the longest frame of the cadence.
+	std::vector<std::vector<int32_t>>				audio_buffers_;
+	size_t											next_audio_buffer_;
 
 	tbb::concurrent_bounded_queue<std::shared_ptr<core::read_frame>> frame_buffer_;
+
+	// The frames handed to the card, recycled in ScheduledFrameCompleted. Only touched from the constructor and the 
+	// completion callback, which do not overlap.
+	std::vector<CComPtr<decklink_frame>>			frames_;
+	std::vector<decklink_frame*>					free_frames_;
 	
 	safe_ptr<diagnostics::graph>					graph_;
 	boost::timer									tick_timer_;
@@ -86,8 +95,11 @@ struct decklink_consumer : public IDeckLinkVideoOutputCallback, boost::noncopyab
 
 	tbb::atomic<int64_t>							current_presentation_delay_;
 
+	tbb::spin_mutex									frame_requested_mutex_;
+	std::function<void()>							frame_requested_;
+
 public:
-	decklink_consumer(const configuration& config, const core::video_format_desc& format_desc, int channel_index) 
+	decklink_consumer(const configuration& config, const core::video_format_desc& format_desc, int channel_index, const std::function<void()>& frame_requested) 
 		: channel_index_(channel_index)
 		, config_(config)
 		, decklink_(get_device(config.device_index))
@@ -100,14 +112,22 @@ public:
 		, video_scheduled_(0)
 		, audio_scheduled_(0)
 		, preroll_count_(0)
-		, audio_container_(buffer_size_+1)
+		, audio_buffers_(buffer_size_+1)
+		, next_audio_buffer_(0)
 		, reference_signal_detector_(output_)
+		, frame_requested_(frame_requested)
 	{
 		is_running_ = true;
 		current_presentation_delay_ = 0;
 				
 		frame_buffer_.set_capacity(1);
 
+		for (size_t n = 0; n < buffer_size_ + 1; ++n)
+			add_frame();
+
+		BOOST_FOREACH(auto& buffer, audio_buffers_)
+			buffer.reserve(*std::max_element(format_desc_.audio_cadence.begin(), format_desc_.audio_cadence.end()) * config_.num_out_channels());
+
 		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));	
 		graph_->set_color("late-frame", diagnostics::color(0.6f, 0.3f, 0.3f));
 		graph_->set_color("dropped-frame", diagnostics::color(0.3f, 0.6f, 0.3f));
@@ -205,12 +225,15 @@ public:
 		{
 			auto dframe = reinterpret_cast<decklink_frame*>(completed_frame);
 			current_presentation_delay_ = dframe->get_age_millis();
+			auto completed_samples = dframe->audio_data().size();
+			dframe->set_frame(nullptr);
+			free_frames_.push_back(dframe);
 
 			if(result == bmdOutputFrameDisplayedLate)
 			{
 				graph_->set_tag("late-frame");
 				video_scheduled_ += format_desc_.duration;
-				audio_scheduled_ += dframe->audio_data().size()/config_.num_out_channels();
+				audio_scheduled_ += completed_samples/config_.num_out_channels();
 				CASPAR_LOG(warning) << print() << L" Frame late.";
 			}
 			else if (result == bmdOutputFrameDropped)
@@ -224,6 +247,15 @@ public:
 				CASPAR_LOG(warning) << print() << L" Frame flushed.";
 			}
 
+			// Ask for the next frame before waiting for this one, the output may be holding its ticket.
+			std::function<void()> frame_requested;
+			{
+				tbb::spin_mutex::scoped_lock lock(frame_requested_mutex_);
+				frame_requested = frame_requested_;
+			}
+			if (frame_requested)
+				frame_requested();
+
 			std::shared_ptr<core::read_frame> frame;	
 			frame_buffer_.pop(frame);
 			send_completion_.try_completion();
@@ -267,39 +299,45 @@ public:
 	void schedule_next_audio(const View& view)
 	{
 		const int sample_frame_count = view.num_samples();
+		const int num_out_channels = config_.num_out_channels();
+
+		auto& buffer = audio_buffers_[next_audio_buffer_];
+		next_audio_buffer_ = (next_audio_buffer_ + 1) % audio_buffers_.size();
 
 		if (core::needs_rearranging(
-				view, config_.audio_layout, config_.num_out_channels()))
+				view, config_.audio_layout, num_out_channels))
 		{
-			std::vector<int32_t> resulting_audio_data;
-			resulting_audio_data.resize(
-					sample_frame_count * config_.num_out_channels());
-
-			auto dest_view = core::make_multichannel_view<int32_t>(
-					resulting_audio_data.begin(), 
-					resulting_audio_data.end(),
-					config_.audio_layout,
-					config_.num_out_channels());
-
-			core::rearrange_or_rearrange_and_mix(
-					view, dest_view, core::default_mix_config_repository());
+			// Reuses the buffer, so the channels the layout does not cover are cleared explicitly.
+			buffer.resize(sample_frame_count * num_out_channels);
+			if (config_.audio_layout.num_channels < num_out_channels)
+				std::fill(buffer.begin(), buffer.end(), 0);
 
-			if (config_.audio_layout.num_channels == 1) // mono
-				boost::copy(                            // duplicate L to R
-						dest_view.channel(0),
-						dest_view.channel(1).begin());
+			if (sample_frame_count > 0)
+			{
+				auto matrix = core::default_mix_config_repository().get_mix_matrix(
+						view.channel_layout(), config_.audio_layout);
+
+				core::apply_mix_matrix(
+						*matrix,
+						&*view.raw_begin(),
+						view.num_channels(),
+						buffer.data(),
+						num_out_channels,
+						sample_frame_count);
+			}
 
-			audio_container_.push_back(std::move(resulting_audio_data));
+			if (config_.audio_layout.num_channels == 1) // mono, duplicate L to R
+			{
+				for (int n = 0; n < sample_frame_count; ++n)
+					buffer[n * num_out_channels + 1] = buffer[n * num_out_channels];
+			}
 		}
 		else
-		{
-			audio_container_.push_back(
-					std::vector<int32_t>(view.raw_begin(), view.raw_end()));
-		}
+			buffer.assign(view.raw_begin(), view.raw_end());
 		
 		unsigned int samples_written;
 		if(FAILED(output_->ScheduleAudioSamples(
-				audio_container_.back().data(),
+				buffer.data(),
 				sample_frame_count,
 				audio_scheduled_,
 				format_desc_.audio_sample_rate,
@@ -310,11 +348,30 @@ public:
 		audio_scheduled_ += sample_frame_count;
 	}
 			
+	void add_frame()
+	{
+		frames_.push_back(CComPtr<decklink_frame>(new decklink_frame(nullptr, format_desc_, config_.key_only, config_.keyer == configuration::default_keyer, config_.sub_image)));
+		free_frames_.push_back(frames_.back());
+	}
+
 	void schedule_next_video(const std::shared_ptr<core::read_frame>& frame)
 	{
-		CComPtr<IDeckLinkVideoFrame> frame2(new decklink_frame(frame, format_desc_, config_.key_only));
+		if (free_frames_.empty())
+		{
+			CASPAR_LOG(debug) << print() << L" Growing frame pool to " << frames_.size() + 1 << L".";
+			add_frame();
+		}
+
+		auto frame2 = free_frames_.back();
+		free_frames_.pop_back();
+		frame2->set_frame(frame);
+
 		if(FAILED(output_->ScheduleVideoFrame(frame2, video_scheduled_, format_desc_.duration, format_desc_.time_scale)))
+		{
 			CASPAR_LOG(error) << print() << L" Failed to schedule video.";
+			frame2->set_frame(nullptr);
+			free_frames_.push_back(frame2);
+		}
 
 		video_scheduled_ += format_desc_.duration;
 
@@ -324,6 +381,12 @@ public:
 		reference_signal_detector_.detect_change([this]() { return print(); });
 	}
 
+	void set_frame_requested_callback(const std::function<void()>& callback)
+	{
+		tbb::spin_mutex::scoped_lock lock(frame_requested_mutex_);
+		frame_requested_ = callback;
+	}
+
 	boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame)
 	{
 		tbb::spin_mutex::scoped_lock lock(exception_mutex_);
@@ -359,51 +422,116 @@ public:
 	std::wstring print() const
 	{
 		return model_name_ + L"[decklink_consumer] [" + boost::lexical_cast<std::wstring>(channel_index_) + L"-" +
-			boost::lexical_cast<std::wstring>(config_.device_index) + L"|" +  format_desc_.name + L"]";
+			boost::lexical_cast<std::wstring>(config_.device_index) + L"|" +  format_desc_.name + 
+			(config_.sub_image >= 0 ? L"|sub-image " + boost::lexical_cast<std::wstring>(config_.sub_image) : L"") + L"]";
 	}
 };
 
+// The 1080 line format of the sub-images of a quad-link 2160 line format.
+static core::video_format_desc get_sub_image_format(const core::video_format_desc& format_desc)
+{
+	for(int n = 0; n < core::video_format::count; ++n)
+	{
+		auto& desc = core::video_format_desc::get(static_cast<core::video_format::type>(n));
+		if(desc.width == format_desc.width/2 && desc.height == format_desc.height/2 && 
+		   desc.time_scale == format_desc.time_scale && desc.duration == format_desc.duration && desc.field_mode == format_desc.field_mode)
+			return desc;
+	}
+
+	BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(narrow(format_desc.name) + " can not be split for quad-link output."));
+}
+
 struct decklink_consumer_proxy : public core::frame_consumer
 {
 	const configuration				config_;
-	com_context<decklink_consumer>	context_;
+	// One per sub-device for quad-link, the first one carries the audio and drives the clock.
+	std::vector<std::shared_ptr<com_context<decklink_consumer>>> contexts_;
 	std::vector<size_t>				audio_cadence_;
+	std::function<void()>			frame_requested_;
+	bool							warned_unsplit_;
 public:
 
 	decklink_consumer_proxy(const configuration& config)
 		: config_(config)
-		, context_(L"decklink_consumer[" + boost::lexical_cast<std::wstring>(config.device_index) + L"]")
+		, warned_unsplit_(false)
 	{
+		for(size_t n = 0; n < (config.quad_link ? 4u : 1u); ++n)
+			contexts_.push_back(std::make_shared<com_context<decklink_consumer>>(L"decklink_consumer[" + boost::lexical_cast<std::wstring>(get_config(n).device_index) + L"]"));
 	}
 
 	~decklink_consumer_proxy()
 	{
-		if(context_)
+		if(*contexts_.front())
 		{
 			auto str = print();
-			context_.reset();
+			contexts_.clear();
 			CASPAR_LOG(info) << str << L" Successfully Uninitialized.";	
 		}
 	}
 
+	configuration get_config(size_t sub_image) const
+	{
+		auto config = config_;
+		if(config_.quad_link)
+		{
+			config.sub_image		= static_cast<int>(sub_image);
+			config.device_index		= sub_image < config_.sub_devices.size() ? config_.sub_devices[sub_image] : config_.device_index + sub_image;
+			config.embedded_audio	= config_.embedded_audio && sub_image == 0;
+		}
+		return config;
+	}
+
 	// frame_consumer
 	
 	virtual void initialize(const core::video_format_desc& format_desc, int channel_index) override
 	{
-		context_.reset([&]{return new decklink_consumer(config_, format_desc, channel_index);});		
+		auto device_format = config_.quad_link ? get_sub_image_format(format_desc) : format_desc;
+		for(size_t n = 0; n < contexts_.size(); ++n)
+		{
+			auto config = get_config(n);
+			auto frame_requested = n == 0 ? frame_requested_ : std::function<void()>();
+			contexts_[n]->reset([&]{return new decklink_consumer(config, device_format, channel_index, frame_requested);});
+		}
 		audio_cadence_ = format_desc.audio_cadence;		
 	}
+
+	virtual bool set_frame_requested_callback(const std::function<void()>& callback) override
+	{
+		frame_requested_ = callback;
+		if (*contexts_.front())
+			(*contexts_.front())->set_frame_requested_callback(callback);
+		return true;
+	}
 	
 	virtual boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame) override
 	{
 		CASPAR_VERIFY(audio_cadence_.front() * frame->num_channels() == static_cast<size_t>(frame->audio_data().size()));
 		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
-		return context_->send(frame);
+
+		if(contexts_.size() == 1)
+			return (*contexts_.front())->send(frame);
+
+		if(frame->image_data().size() > 0 && frame->split() == core::output_split::none && !warned_unsplit_)
+		{
+			CASPAR_LOG(warning) << print() << L" Received frame without sub-images, set output-split and a uyvy or v210 output-packing on the channel.";
+			warned_unsplit_ = true;
+		}
+
+		// The sub-devices are genlocked, so they all free a slot at about the same time.
+		std::vector<boost::unique_future<bool>> results;
+		for(size_t n = 0; n < contexts_.size(); ++n)
+			results.push_back((*contexts_[n])->send(frame));
+
+		bool result = true;
+		for(size_t n = 0; n < results.size(); ++n)
+			result = results[n].get() && result;
+
+		return wrap_as_future(result);
 	}
 	
 	virtual std::wstring print() const override
 	{
-		return context_ ? context_->print() : L"[decklink_consumer]";
+		return *contexts_.front() ? (*contexts_.front())->print() : L"[decklink_consumer]";
 	}		
 
 	virtual boost::property_tree::wptree info() const override
@@ -414,6 +542,9 @@ public:
 		info.add(L"device", config_.device_index);
 		info.add(L"low-latency", config_.low_latency);
 		info.add(L"embedded-audio", config_.embedded_audio);
+		info.add(L"quad-link", config_.quad_link);
+		for(size_t n = 1; n < contexts_.size(); ++n)
+			info.add(L"sub-devices.device", get_config(n).device_index);
 		info.add(L"presentation-frame-age", presentation_frame_age_millis());
 		//info.add(L"internal-key", config_.internal_key);
 		return info;
@@ -431,7 +562,7 @@ public:
 
 	virtual int64_t presentation_frame_age_millis() const
 	{
-		return context_ ? context_->current_presentation_delay_ : 0;
+		return *contexts_.front() ? (*contexts_.front())->current_presentation_delay_ : 0;
 	}
 };	
 
@@ -457,6 +588,7 @@ safe_ptr<core::frame_consumer> create_consumer(const core::parameters& params)
 
 	config.embedded_audio	= std::find(params.begin(), params.end(), L"EMBEDDED_AUDIO") != params.end();
 	config.key_only			= std::find(params.begin(), params.end(), L"KEY_ONLY")		 != params.end();
+	config.quad_link		= std::find(params.begin(), params.end(), L"QUAD_LINK")		 != params.end();
 	config.audio_layout		= core::default_channel_layout_repository().get_by_name(
 			params.get(L"CHANNEL_LAYOUT", L"STEREO"));
 
@@ -483,6 +615,14 @@ safe_ptr<core::frame_consumer> create_consumer(const boost::property_tree::wptre
 	config.device_index			= ptree.get(L"device",				config.device_index);
 	config.embedded_audio		= ptree.get(L"embedded-audio",		config.embedded_audio);
 	config.base_buffer_depth	= ptree.get(L"buffer-depth",		config.base_buffer_depth);
+	config.quad_link			= ptree.get(L"quad-link",			config.quad_link);
+
+	auto sub_devices = ptree.get_child_optional(L"sub-devices");
+	if(sub_devices)
+	{
+		BOOST_FOREACH(auto& device, *sub_devices)
+			config.sub_devices.push_back(device.second.get_value<size_t>());
+	}
 	config.audio_layout =
 		core::default_channel_layout_repository().get_by_name(
 				boost::to_upper_copy(ptree.get(L"channel-layout", L"STEREO")));
@@ -35,6 +35,8 @@
 
 #include "interop/DeckLinkAPI_h.h"
 
+#include <boost/algorithm/string/predicate.hpp>
+
 #pragma warning(push)
 #pragma warning(disable : 4996)
 
@@ -57,7 +59,9 @@ void init()
 		
 	core::register_consumer_factory([](const core::parameters& params){return decklink::create_consumer(params);});
 	core::register_consumer_factory([](const core::parameters& params){return decklink::create_blocking_consumer(params);});
-	core::register_producer_factory([](const safe_ptr<core::frame_factory>& factory, const core::parameters& params) { return decklink::create_producer(factory, params); });
+	core::register_producer_factory(
+			[](const safe_ptr<core::frame_factory>& factory, const core::parameters& params) { return decklink::create_producer(factory, params); },
+			[](const core::parameters& params) { return boost::iequals(params.at(0), L"DECKLINK"); });
 }
 
 std::wstring get_version() 
@@ -33,24 +33,33 @@
 
 #include <common/concurrency/com_context.h>
 #include <common/diagnostics/graph.h>
+#include <common/env.h>
 #include <common/exception/exceptions.h>
 #include <common/exception/win32_exception.h>
 #include <common/log/log.h>
 #include <common/memory/memclr.h>
+#include <common/memory/memcpy.h>
+#include <common/memory/pixel_kernels.h>
 #include <common/utility/string.h>
 
 #include <core/parameters/parameters.h>
 #include <core/monitor/monitor.h>
 #include <core/mixer/write_frame.h>
+#include <core/producer/clock_bridge.h>
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/frame_factory.h>
+#include <core/producer/frame/pixel_format.h>
 
+#include <tbb/atomic.h>
 #include <tbb/concurrent_queue.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/mutex.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 #include <boost/timer.hpp>
 #include <boost/locale.hpp>
+#include <boost/optional.hpp>
 
 #if defined(_MSC_VER)
 #pragma warning (push)
@@ -77,11 +86,150 @@ extern "C"
 #pragma warning(push)
 
 #include <functional>
+#include <map>
+#include <set>
 
 namespace caspar { namespace decklink {
+
+// Splits a UYVY picture into the planes of a 4:2:2 ycbcr write_frame.
+static void unpack_uyvy(const uint8_t* src, int row_bytes, int width, int height, core::write_frame& frame)
+{
+	caspar::unpack_uyvy(src, row_bytes, width, height, frame.image_data(0).begin(), frame.image_data(1).begin(), frame.image_data(2).begin());
+}
+
+// Unpacks v210 into the 16 bit planes of a yuv422p10 frame, for inputs that have to go through the muxer.
+static void unpack_v210(const uint8_t* src, int row_bytes, int width, int height, AVFrame& frame)
+{
+	caspar::unpack_v210(
+			src, row_bytes, width, height,
+			reinterpret_cast<uint16_t*>(frame.data[0]), frame.linesize[0],
+			reinterpret_cast<uint16_t*>(frame.data[1]), frame.linesize[1],
+			reinterpret_cast<uint16_t*>(frame.data[2]), frame.linesize[2]);
+}
 		
+// The write_frame of a direct v210 capture, uploaded as it is including the row padding.
+static core::pixel_format_desc v210_desc(int row_bytes, int width, int height)
+{
+	core::pixel_format_desc desc;
+	desc.pix_fmt		= core::pixel_format::v210;
+	desc.packed_width	= width;
+	desc.planes.push_back(core::pixel_format_desc::plane(row_bytes/4, height, 4));
+	return desc;
+}
+
+// Hands the driver the mapped upload buffers of write_frames while the input is captured directly, so that the 
+// frames are captured into them and committed without a copy. Buffers of another size, and all of them while the
+// input goes through the muxer, are plain memory since the cpu would have to read back the write combined pbos.
+//
+// The driver allocates a buffer for every frame and releases it with the frame. A taken write_frame is owned by
+// the producer from then on and its buffer goes back to the mixer's pool once it has been uploaded.
+class capture_allocator : public IDeckLinkMemoryAllocator, boost::noncopyable
+{
+	typedef std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> plain_buffer;
+
+	const safe_ptr<core::frame_factory>					frame_factory_;
+	const void*											tag_;
+	const core::channel_layout							channel_layout_;
+
+	tbb::mutex											mutex_;
+	core::pixel_format_desc								desc_;
+	std::map<void*, safe_ptr<core::write_frame>>		frames_;
+	std::map<void*, std::shared_ptr<plain_buffer>>		buffers_;
+	std::multiset<void*>								taken_;
+public:
+	capture_allocator(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const core::channel_layout& channel_layout)
+		: frame_factory_(frame_factory)
+		, tag_(tag)
+		, channel_layout_(channel_layout)
+	{
+	}
+
+	// Buffers are allocated for write_frames of the desc from now on, none with an empty desc.
+	void set_desc(const core::pixel_format_desc& desc)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		desc_ = desc;
+	}
+
+	// The write_frame holding the bytes of an arrived frame, null when they are plain memory.
+	std::shared_ptr<core::write_frame> take(void* bytes)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = frames_.find(bytes);
+		if(it == frames_.end())
+			return nullptr;
+
+		std::shared_ptr<core::write_frame> frame = it->second;
+		frames_.erase(it);
+		taken_.insert(bytes);
+		return frame;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID, LPVOID*)	{return E_NOINTERFACE;}
+	virtual ULONG STDMETHODCALLTYPE		AddRef ()							{return 1;}
+	virtual ULONG STDMETHODCALLTYPE		Release ()							{return 1;}
+
+	virtual HRESULT STDMETHODCALLTYPE AllocateBuffer(unsigned int size, void** buffer)
+	{
+		try
+		{
+			core::pixel_format_desc desc;
+			{
+				tbb::mutex::scoped_lock lock(mutex_);
+				desc = desc_;
+			}
+
+			if(desc.planes.size() == 1 && desc.planes[0].size == size)
+			{
+				auto frame = frame_factory_->create_frame(tag_, desc, channel_layout_);
+				if(!frame->image_data(0).empty())
+				{
+					*buffer = frame->image_data(0).begin();
+					tbb::mutex::scoped_lock lock(mutex_);
+					frames_.insert(std::make_pair(*buffer, frame));
+					return S_OK;
+				}
+			}
+
+			auto data = std::make_shared<plain_buffer>(size);
+
+			*buffer = data->data();
+			tbb::mutex::scoped_lock lock(mutex_);
+			buffers_.insert(std::make_pair(*buffer, data));
+			return S_OK;
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			return E_OUTOFMEMORY;
+		}
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE ReleaseBuffer(void* buffer)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		// The buffer of a taken frame may already have been handed out again by the pool, the release of the 
+		// taken one comes first.
+		auto taken = taken_.find(buffer);
+		if(taken != taken_.end())
+			taken_.erase(taken);
+		else if(!frames_.erase(buffer))
+			buffers_.erase(buffer);
+
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE Commit()		{return S_OK;}
+	virtual HRESULT STDMETHODCALLTYPE Decommit()	{return S_OK;}
+};
+
 class decklink_producer : boost::noncopyable, public IDeckLinkInputCallback
 {	
+	// Declared first, the driver may hold its buffers until the input has been released.
+	std::unique_ptr<capture_allocator>							allocator_;
+
 	core::monitor::subject										monitor_subject_;
 	safe_ptr<diagnostics::graph>								graph_;
 	boost::timer												tick_timer_;
@@ -91,6 +239,7 @@ class decklink_producer : boost::noncopyable, public IDeckLinkInputCallback
 	CComPtr<IDeckLink>											decklink_;
 	CComQIPtr<IDeckLinkInput>									input_;
 	CComQIPtr<IDeckLinkAttributes>								attributes_;
+	const BMDPixelFormat										pixel_format_;
 	CComQIPtr<IDeckLinkDisplayMode>								current_display_mode_;
 
 	const std::wstring											model_name_;
@@ -105,6 +254,7 @@ class decklink_producer : boost::noncopyable, public IDeckLinkInputCallback
 	safe_ptr<core::frame_factory>								frame_factory_;
 
 	tbb::concurrent_bounded_queue<safe_ptr<core::basic_frame>>	frame_buffer_;
+	std::unique_ptr<core::clock_bridge>							clock_bridge_; // Instead of frame_buffer_ when recovering the input clock.
 
 	std::exception_ptr											exception_;	
 	int															num_input_channels_;
@@ -114,6 +264,10 @@ class decklink_producer : boost::noncopyable, public IDeckLinkInputCallback
 	BMDTimeScale												time_scale_;
 	int64_t														frame_pts_;
 
+	// Inputs matching the channel skip frame_muxer and are copied straight into a write_frame.
+	const bool													allow_direct_;
+	bool														is_direct_;
+
 public:
 	decklink_producer(
 			const core::video_format_desc& format_desc,
@@ -127,6 +281,7 @@ public:
 		: decklink_(get_device(device_index))
 		, input_(decklink_)
 		, attributes_(decklink_)
+		, pixel_format_(env::properties().get(L"configuration.decklink.capture-10bit", false) ? bmdFormat10BitYUV : bmdFormat8BitYUV)
 		, model_name_(get_model_name(decklink_))
 		, device_index_(device_index)
 		, filter_(filter)
@@ -137,12 +292,17 @@ public:
 		, frame_factory_(frame_factory)
 		, audio_channel_layout_(audio_channel_layout)
 		, timecode_source_(timecode_source)
-		, current_display_mode_(get_display_mode(input_, format_desc_.format, bmdFormat8BitYUV, bmdVideoInputFlagDefault))
+		, current_display_mode_(get_display_mode(input_, format_desc_.format, pixel_format_, bmdVideoInputFlagDefault))
 		, frame_duration_(format_desc_.duration)
 		, time_scale_(format_desc_.time_scale)
 		, frame_pts_(0)
+		, allow_direct_(filter.empty() && env::properties().get(L"configuration.decklink.direct-capture", true))
+		, is_direct_(false)
 	{		
 		hints_ = 0;
+
+		if(pixel_format_ == bmdFormat10BitYUV && allow_direct_ && env::properties().get(L"configuration.decklink.pinned-capture", true))
+			allocator_.reset(new capture_allocator(frame_factory, this, audio_channel_layout));
 		frame_buffer_.set_capacity(buffer_depth);
 
 		if (audio_channel_layout.num_channels <= 2)
@@ -160,6 +320,9 @@ public:
 		graph_->set_color("output-buffer", diagnostics::color(0.0f, 1.0f, 0.0f));
 		graph_->set_text(print());
 		diagnostics::register_graph(graph_);
+
+		if(env::properties().get(L"configuration.decklink.clock-recovery", true))
+			clock_bridge_.reset(new core::clock_bridge(frame_factory->get_video_format_desc(), audio_channel_layout, buffer_depth, graph_));
 		
 		BOOL supportsFormatDetection = false;
 		if (FAILED(attributes_->GetFlag(BMDDeckLinkSupportsInputFormatDetection, &supportsFormatDetection)))
@@ -182,7 +345,13 @@ public:
 
 	void open_input(BMDDisplayMode displayMode, BMDVideoInputFlags bmdVideoInputFlags)
 	{
-		if(FAILED(input_->EnableVideoInput(displayMode, bmdFormat8BitYUV, bmdVideoInputFlags))) 
+		if(allocator_ && FAILED(input_->SetVideoInputFrameMemoryAllocator(allocator_.get())))
+		{
+			CASPAR_LOG(warning) << print() << L" Could not set the capture allocator, frames are copied.";
+			allocator_.reset();
+		}
+
+		if(FAILED(input_->EnableVideoInput(displayMode, pixel_format_, bmdVideoInputFlags))) 
 			BOOST_THROW_EXCEPTION(caspar_exception() 
 									<< msg_info(narrow(print()) + " Could not enable video input.")
 									<< boost::errinfo_api_function("EnableVideoInput"));
@@ -250,9 +419,11 @@ public:
 				return S_OK;
 			
 			std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [](AVFrame* frame) {av_frame_free(&frame);});
-						
+			
+			auto video_bytes			= reinterpret_cast<const uint8_t*>(bytes);
+			auto row_bytes				= video->GetRowBytes();
 			av_frame->data[0]			= reinterpret_cast<uint8_t*>(bytes);
-			av_frame->linesize[0]		= video->GetRowBytes();			
+			av_frame->linesize[0]		= row_bytes;			
 			av_frame->format			= AV_PIX_FMT_UYVY422;
 			av_frame->width				= video->GetWidth();
 			av_frame->height			= video->GetHeight();
@@ -310,27 +481,87 @@ public:
 				return S_OK;
 			}
 
-			muxer_.push(audio_buffer);
-			muxer_.push(av_frame, hints_, frame_timecode);
+			// The frames are mixed without their audio, it is resampled to the channel clock by the bridge.
+			if(clock_bridge_)
+				clock_bridge_->push_audio(audio_buffer->data(), audio_buffer->size());
+
+			auto direct = can_capture_direct(*av_frame);
+			if (direct != is_direct_)
+			{
+				CASPAR_LOG(info) << print() << (direct ? L" Input matches the channel, capturing directly." : L" Input needs conversion, capturing through the muxer.");
+				is_direct_ = direct;
+
+				if (allocator_)
+					allocator_->set_desc(direct ? v210_desc(row_bytes, av_frame->width, av_frame->height) : core::pixel_format_desc());
+			}
+
+			// Captured into the upload buffer of a write_frame by the driver, see capture_allocator.
+			// Held until the bytes have been read when they are not committed as they are.
+			std::shared_ptr<core::write_frame> captured;
+			if (allocator_)
+				captured = allocator_->take(bytes);
+
+			std::shared_ptr<core::write_frame> write;
+			if (captured && is_direct_ && captured->image_data(0).size() == static_cast<size_t>(row_bytes*av_frame->height))
+				write = captured;
+
+			if (is_direct_)
+			{
+				if (!write)
+				{
+					core::pixel_format_desc desc;
+					if (pixel_format_ == bmdFormat10BitYUV)
+					{
+						// Uploaded as it is, including the row padding, and unpacked by the image shader.
+						desc = v210_desc(row_bytes, av_frame->width, av_frame->height);
+					}
+					else
+					{
+						desc.pix_fmt = core::pixel_format::ycbcr;
+						desc.planes.push_back(core::pixel_format_desc::plane(av_frame->width,	av_frame->height, 1));
+						desc.planes.push_back(core::pixel_format_desc::plane(av_frame->width/2, av_frame->height, 1));
+						desc.planes.push_back(core::pixel_format_desc::plane(av_frame->width/2, av_frame->height, 1));
+					}
+
+					write = frame_factory_->create_frame(this, desc, audio_channel_layout_);
+					if (pixel_format_ == bmdFormat10BitYUV)
+						fast_memcpy(write->image_data(0).begin(), video_bytes, row_bytes*av_frame->height);
+					else
+						unpack_uyvy(video_bytes, row_bytes, av_frame->width, av_frame->height, *write);
+				}
+				write->set_type(ffmpeg::get_mode(*av_frame));
+				write->set_timecode(frame_timecode);
+				write->audio_data() = std::move(*audio_buffer);
+				write->commit();
+
+				push_frame(make_safe_ptr(write));
+			}
+			else
+			{
+				if (pixel_format_ == bmdFormat10BitYUV)
+				{
+					av_frame->data[0]	= nullptr;
+					av_frame->format	= AV_PIX_FMT_YUV422P10;
+					if (av_frame_get_buffer(av_frame.get(), 32) < 0)
+						BOOST_THROW_EXCEPTION(bad_alloc());
+					unpack_v210(video_bytes, row_bytes, av_frame->width, av_frame->height, *av_frame);
+				}
+
+				muxer_.push(audio_buffer);
+				muxer_.push(av_frame, hints_, frame_timecode);
+			}
 											
 			boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
 			
 			// POLL
 			
 			for(auto frame = muxer_.poll(); frame; frame = muxer_.poll())
-			{
-				auto safe_frame = make_safe_ptr(frame);
-				while (!frame_buffer_.try_push(safe_frame))
-				{
-					auto dummy = core::basic_frame::empty();
-					frame_buffer_.try_pop(dummy);
-					graph_->set_tag("dropped-frame");
-				}
-			}
+				push_frame(make_safe_ptr(frame));
 
 			graph_->set_value("frame-time", frame_timer_.elapsed()*format_desc_.fps*0.5);
 
-			graph_->set_value("output-buffer", static_cast<float>(frame_buffer_.size())/static_cast<float>(frame_buffer_.capacity()));	
+			if(!clock_bridge_)
+				graph_->set_value("output-buffer", static_cast<float>(frame_buffer_.size())/static_cast<float>(frame_buffer_.capacity()));	
 
 			monitor_subject_ << core::monitor::message("/device") % static_cast<int>(device_index_);
 		}
@@ -343,6 +574,35 @@ public:
 		return S_OK;
 	}
 	
+	bool can_capture_direct(const AVFrame& frame) const
+	{
+		if (!allow_direct_ || (hints_ & (core::frame_producer::DEINTERLACE_HINT | core::frame_producer::ALPHA_HINT)))
+			return false;
+
+		auto channel_format = frame_factory_->get_video_format_desc();
+
+		return frame.width == static_cast<int>(channel_format.width)
+			&& frame.height == static_cast<int>(channel_format.height)
+			&& time_scale_ * channel_format.duration == frame_duration_ * channel_format.time_scale
+			&& ffmpeg::get_mode(frame) == channel_format.field_mode;
+	}
+
+	void push_frame(const safe_ptr<core::basic_frame>& frame)
+	{
+		if(clock_bridge_)
+		{
+			clock_bridge_->push_video(frame);
+			return;
+		}
+
+		while (!frame_buffer_.try_push(frame))
+		{
+			auto dummy = core::basic_frame::empty();
+			frame_buffer_.try_pop(dummy);
+			graph_->set_tag("dropped-frame");
+		}
+	}
+
 	safe_ptr<core::basic_frame> get_frame(int hints)
 	{
 		if(exception_ != nullptr)
@@ -350,12 +610,27 @@ public:
 
 		hints_ = hints;
 
+		if(clock_bridge_)
+		{
+			monitor_subject_ << core::monitor::message("/clock/drift") % clock_bridge_->drift_ppm()
+							 << core::monitor::message("/clock/resample-ratio") % clock_bridge_->resample_ratio();
+			return clock_bridge_->pop();
+		}
+
 		safe_ptr<core::basic_frame> frame = core::basic_frame::late();
 		if(!frame_buffer_.try_pop(frame))
 			graph_->set_tag("late-frame");
 		graph_->set_value("output-buffer", static_cast<float>(frame_buffer_.size())/static_cast<float>(frame_buffer_.capacity()));	
 		return frame;
 	}
+
+	// Of the input against the channel in ppm, null without clock recovery.
+	boost::optional<double> drift_ppm() const
+	{
+		if(!clock_bridge_)
+			return boost::none;
+		return clock_bridge_->drift_ppm();
+	}
 	
 	std::wstring print() const
 	{
@@ -427,6 +702,9 @@ public:
 	{
 		boost::property_tree::wptree info;
 		info.add(L"type", L"decklink-producer");
+		auto drift = context_->drift_ppm();
+		if(drift)
+			info.add(L"drift-ppm", *drift);
 		return info;
 	}
 
@@ -23,7 +23,7 @@
 
 #include <common/exception/exceptions.h>
 #include <common/log/log.h>
-#include <common/memory/memshfl.h>
+#include <common/memory/page_locked_allocator.h>
 #include <core/video_format.h>
 #include <core/mixer/read_frame.h>
 
@@ -34,6 +34,7 @@
 #include <atlbase.h>
 
 #include <string>
+#include <vector>
 
 namespace caspar { namespace decklink {
 
@@ -218,21 +219,6 @@ static std::wstring get_model_name(const T& device)
 	return std::wstring(pModelName);
 }
 
-static std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> extract_key(
-		const safe_ptr<core::read_frame>& frame)
-{
-	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> result;
-
-	result.resize(frame->image_data().size());
-	fast_memshfl(
-			result.data(),
-			frame->image_data().begin(),
-			frame->image_data().size(),
-			0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
-
-	return std::move(result);
-}
-
 class decklink_frame : public IDeckLinkVideoFrame
 {
 	tbb::atomic<int>											ref_count_;
@@ -240,24 +226,32 @@ class decklink_frame : public IDeckLinkVideoFrame
 	const core::video_format_desc								format_desc_;
 
 	const bool													key_only_;
-	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>> data_;
+	const bool													allow_packed_;
+	const int													sub_image_; // Quadrant of a split channel, or -1.
+	core::output_packing::type									packing_;
+	std::vector<uint8_t, page_locked_allocator<uint8_t>>		data_; // black fill for empty frames, kept when the frame is reused
 public:
-	decklink_frame(const std::shared_ptr<core::read_frame>& frame, const core::video_format_desc& format_desc, bool key_only)
-		: frame_(frame)
-		, format_desc_(format_desc)
+	// Uses the image packed by the mixer when allowed, since the keyers need the alpha of the bgra image.
+	// With sub_image set, format_desc is the size of one sub-image and the frame shows that part of a split packed image.
+	decklink_frame(const std::shared_ptr<core::read_frame>& frame, const core::video_format_desc& format_desc, bool key_only, bool allow_packed = false, int sub_image = -1)
+		: format_desc_(format_desc)
 		, key_only_(key_only)
+		, allow_packed_(allow_packed)
+		, sub_image_(sub_image)
+		, packing_(core::output_packing::none)
 	{
 		ref_count_ = 0;
+		set_frame(frame);
 	}
 
-	decklink_frame(const std::shared_ptr<core::read_frame>& frame, const core::video_format_desc& format_desc, std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>&& key_data)
-		: frame_(frame)
-		, format_desc_(format_desc)
-		, key_only_(true)
-		, data_(std::move(key_data))
+	// Reuses the frame for another read_frame, only once the card is done with it.
+	void set_frame(const std::shared_ptr<core::read_frame>& frame)
 	{
-		ref_count_ = 0;
+		frame_ = frame;
+		auto split_matches = frame && (frame->split() != core::output_split::none) == (sub_image_ >= 0);
+		packing_ = split_matches && !key_only_ && allow_packed_ && (frame->packing() == core::output_packing::uyvy || frame->packing() == core::output_packing::v210) ? frame->packing() : core::output_packing::none;
 	}
+
 	
 	// IUnknown
 
@@ -273,37 +267,55 @@ public:
 
 	STDMETHOD_(ULONG,			Release())			
 	{
-		if(--ref_count_ == 0)
+		auto count = --ref_count_;
+		if(count == 0)
 			delete this;
-		return ref_count_;
+		return count;
 	}
 
 	// IDecklinkVideoFrame
 
 	STDMETHOD_(long,			GetWidth())			{return format_desc_.width;}        
     STDMETHOD_(long,			GetHeight())		{return format_desc_.height;}        
-    STDMETHOD_(long,			GetRowBytes())		{return format_desc_.width*4;}        
-	STDMETHOD_(BMDPixelFormat,	GetPixelFormat())	{return bmdFormat8BitBGRA;}        
+    STDMETHOD_(long,			GetRowBytes())		{return core::get_packed_row_bytes(packing_, format_desc_.width);}        
     STDMETHOD_(BMDFrameFlags,	GetFlags())			{return bmdFrameFlagDefault;}
+
+	STDMETHOD_(BMDPixelFormat,	GetPixelFormat())
+	{
+		switch(packing_)
+		{
+		case core::output_packing::uyvy:
+			return bmdFormat8BitYUV;
+		case core::output_packing::v210:
+			return bmdFormat10BitYUV;
+		default:
+			return bmdFormat8BitBGRA;
+		}
+	}
         
     STDMETHOD(GetBytes(void** buffer))
 	{
 		try
 		{
-			if(static_cast<size_t>(frame_->image_data().size()) != format_desc_.size)
-			{
-				data_.resize(format_desc_.size, 0);
-				*buffer = data_.data();
-			}
-			else if(key_only_)
+			if(packing_ != core::output_packing::none)
 			{
-				if(data_.empty())
+				auto packed_size = core::get_packed_size(packing_, format_desc_.width, format_desc_.height);
+				auto sub_images	 = sub_image_ >= 0 ? 4 : 1;
+				if(static_cast<size_t>(frame_->packed_image_data().size()) != packed_size*sub_images)
 				{
-					data_.resize(frame_->image_data().size());
-					fast_memshfl(data_.data(), frame_->image_data().begin(), frame_->image_data().size(), 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
+					data_.resize(packed_size, 0);
+					*buffer = data_.data();
 				}
+				else
+					*buffer = const_cast<uint8_t*>(frame_->packed_image_data().begin()) + packed_size*std::max(0, sub_image_);
+			}
+			else if(static_cast<size_t>(frame_->image_data().size()) != format_desc_.size)
+			{
+				data_.resize(format_desc_.size, 0);
 				*buffer = data_.data();
 			}
+			else if(key_only_)
+				*buffer = const_cast<uint8_t*>(frame_->key_image_data().begin());
 			else
 				*buffer = const_cast<uint8_t*>(frame_->image_data().begin());
 		}
@@ -355,6 +367,9 @@ struct configuration
 	latency_t				latency;
 	bool					key_only;
 	size_t					base_buffer_depth;
+	bool					quad_link;		// Outputs a 2160 line channel on four 1080 line sub-devices.
+	std::vector<size_t>		sub_devices;	// Device per sub-image, consecutive from device_index when empty.
+	int						sub_image;		// The sub-image of a single sub-device consumer, or -1.
 	
 	configuration()
 		: device_index(1)
@@ -364,6 +379,8 @@ struct configuration
 		, latency(default_latency)
 		, key_only(false)
 		, base_buffer_depth(3)
+		, quad_link(false)
+		, sub_image(-1)
 	{
 	}
 	
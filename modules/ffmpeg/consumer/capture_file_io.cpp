@@ -0,0 +1,410 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../StdAfx.h"
+
+#include "capture_file_io.h"
+
+#include <common/diagnostics/graph.h>
+#include <common/env.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/memory/page_locked_allocator.h>
+#include <common/utility/string.h>
+
+#include <boost/foreach.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <deque>
+#include <vector>
+
+#include <windows.h>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avio.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+static const int		IO_BUFFER_SIZE	= 1024*1024;
+static const int64_t	SECTOR_SIZE		= 4096; // covers both 512e and 4Kn drives
+
+struct capture_file_io::implementation : boost::noncopyable
+{
+	struct chunk : boost::noncopyable
+	{
+		OVERLAPPED										overlapped;
+		std::vector<uint8_t, page_locked_allocator<uint8_t>>	data;
+		int64_t											offset;
+		size_t											fill;
+		bool											pending;
+		boost::timer									timer;
+
+		explicit chunk(size_t size)
+			: data(size)
+			, offset(0)
+			, fill(0)
+			, pending(false)
+		{
+			std::memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		}
+
+		~chunk()
+		{
+			CloseHandle(overlapped.hEvent);
+		}
+	};
+
+	struct patch
+	{
+		int64_t					offset;
+		std::vector<uint8_t>	data;
+	};
+
+	const std::wstring					filename_;
+	const safe_ptr<diagnostics::graph>	graph_;
+	const double						fps_;
+	const size_t						chunk_size_;
+	const int64_t						preallocate_size_;
+	HANDLE								file_;
+	int64_t								position_;		// where the muxer writes next
+	int64_t								end_;			// end of the appended data
+	int64_t								allocated_;
+	std::unique_ptr<chunk>				current_;		// holds [current_->offset, end_)
+	std::deque<std::unique_ptr<chunk>>	pending_;
+	std::vector<std::unique_ptr<chunk>>	free_;
+	std::vector<patch>					patches_;
+	bool								failed_;
+	std::shared_ptr<AVIOContext>		context_;
+	boost::timer						timer_;
+	tbb::atomic<int64_t>				bytes_written_;
+	tbb::atomic<int64_t>				stalls_;
+	tbb::atomic<int64_t>				max_latency_us_;
+	tbb::atomic<int64_t>				total_latency_us_;
+	tbb::atomic<int64_t>				writes_;
+
+	implementation(const std::wstring& filename, const safe_ptr<diagnostics::graph>& graph, double fps)
+		: filename_(filename)
+		, graph_(graph)
+		, fps_(fps)
+		, chunk_size_(static_cast<size_t>((std::max(64, env::properties().get(L"configuration.ffmpeg.capture-chunk-size", 4096)) * 1024 + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE))
+		, preallocate_size_(static_cast<int64_t>(std::max(0, env::properties().get(L"configuration.ffmpeg.capture-preallocate", 1024))) * 1024 * 1024)
+		, file_(CreateFileW(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_NEW, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr))
+		, position_(0)
+		, end_(0)
+		, allocated_(0)
+		, failed_(false)
+	{
+		bytes_written_		= 0;
+		stalls_				= 0;
+		max_latency_us_		= 0;
+		total_latency_us_	= 0;
+		writes_				= 0;
+
+		if(file_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_write_error() << msg_info("Could not create file.") << boost::errinfo_file_name(narrow(filename_)));
+
+		const size_t chunk_count = std::max(2, env::properties().get(L"configuration.ffmpeg.capture-chunks", 8));
+		try
+		{
+			for(size_t n = 0; n < chunk_count; ++n)
+				free_.push_back(std::unique_ptr<chunk>(new chunk(chunk_size_)));
+		}
+		catch(std::bad_alloc&)
+		{
+			CloseHandle(file_);
+			BOOST_THROW_EXCEPTION(file_write_error() << msg_info("Could not lock the capture buffers.") << boost::errinfo_file_name(narrow(filename_)));
+		}
+
+		current_ = next_chunk(0);
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+		context_.reset(avio_alloc_context(buffer, IO_BUFFER_SIZE, 1, this, nullptr, &write_packet, &seek), [](AVIOContext* context)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		});
+
+		graph_->set_color("disk-latency", diagnostics::color(0.8f, 0.3f, 0.8f));
+		graph_->set_color("disk-stall", diagnostics::color(0.9f, 0.5f, 0.9f));
+	}
+
+	~implementation()
+	{
+		try
+		{
+			close();
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+
+	void reserve(int64_t size)
+	{
+		if(size <= allocated_ || preallocate_size_ == 0)
+			return;
+
+		FILE_ALLOCATION_INFO allocation;
+		allocation.AllocationSize.QuadPart = size + preallocate_size_;
+		if(SetFileInformationByHandle(file_, FileAllocationInfo, &allocation, sizeof(allocation)))
+			allocated_ = allocation.AllocationSize.QuadPart;
+		else
+			allocated_ = std::numeric_limits<int64_t>::max(); // the file system does not support it, stop trying
+	}
+
+	void complete(chunk& c)
+	{
+		DWORD bytes = 0;
+		if(!GetOverlappedResult(file_, &c.overlapped, &bytes, TRUE))
+			failed_ = true;
+		c.pending = false;
+
+		auto latency_us = static_cast<int64_t>(c.timer.elapsed() * 1000000.0);
+		total_latency_us_ += latency_us;
+		++writes_;
+		if(latency_us > max_latency_us_)
+			max_latency_us_ = latency_us;
+		graph_->set_value("disk-latency", c.timer.elapsed()*fps_*0.5);
+	}
+
+	std::unique_ptr<chunk> next_chunk(int64_t offset)
+	{
+		while(!pending_.empty() && HasOverlappedIoCompleted(&pending_.front()->overlapped))
+		{
+			complete(*pending_.front());
+			free_.push_back(std::move(pending_.front()));
+			pending_.pop_front();
+		}
+
+		if(free_.empty())
+		{
+			// Every chunk is in flight, the disk is behind.
+			++stalls_;
+			graph_->set_tag("disk-stall");
+			complete(*pending_.front());
+			free_.push_back(std::move(pending_.front()));
+			pending_.pop_front();
+		}
+
+		auto c = std::move(free_.back());
+		free_.pop_back();
+		c->offset = offset;
+		c->fill	  = 0;
+		return c;
+	}
+
+	void issue(std::unique_ptr<chunk> c, size_t size)
+	{
+		reserve(c->offset + size);
+
+		c->overlapped.Offset	 = static_cast<DWORD>(c->offset & 0xFFFFFFFF);
+		c->overlapped.OffsetHigh = static_cast<DWORD>(c->offset >> 32);
+		ResetEvent(c->overlapped.hEvent);
+		c->timer.restart();
+
+		if(WriteFile(file_, c->data.data(), static_cast<DWORD>(size), nullptr, &c->overlapped) || GetLastError() == ERROR_IO_PENDING)
+			c->pending = true;
+		else
+		{
+			CASPAR_LOG(error) << L"[capture_file_io] Write failed: " << filename_;
+			failed_ = true;
+			c->pending = false;
+		}
+
+		bytes_written_ += size;
+
+		if(c->pending)
+			pending_.push_back(std::move(c));
+		else
+			free_.push_back(std::move(c));
+	}
+
+	void append(const uint8_t* data, size_t size)
+	{
+		while(size > 0)
+		{
+			auto count = std::min(size, chunk_size_ - current_->fill);
+			std::memcpy(current_->data.data() + current_->fill, data, count);
+			current_->fill += count;
+			end_		   += count;
+			data		   += count;
+			size		   -= count;
+
+			if(current_->fill == chunk_size_)
+			{
+				auto offset = current_->offset + chunk_size_;
+				issue(std::move(current_), chunk_size_);
+				current_ = next_chunk(offset);
+			}
+		}
+	}
+
+	// Writes behind end_, e.g. a size field in a header, stay in memory unless they hit the chunk being filled.
+	void overwrite(int64_t offset, const uint8_t* data, size_t size)
+	{
+		auto in_current = std::max(offset, current_->offset);
+		if(in_current < offset + static_cast<int64_t>(size))
+		{
+			auto skip = static_cast<size_t>(in_current - offset);
+			std::memcpy(current_->data.data() + (in_current - current_->offset), data + skip, size - skip);
+			size = skip;
+		}
+
+		if(size > 0)
+		{
+			patch p;
+			p.offset = offset;
+			p.data.assign(data, data + size);
+			patches_.push_back(std::move(p));
+		}
+	}
+
+	int write(uint8_t* data, int size)
+	{
+		if(failed_)
+			return AVERROR(EIO);
+
+		if(position_ > end_) // seeked past the end, fill the hole
+		{
+			std::vector<uint8_t> zeros(static_cast<size_t>(position_ - end_), 0);
+			position_ = end_;
+			append(zeros.data(), zeros.size());
+		}
+
+		auto behind = static_cast<int>(std::min<int64_t>(size, end_ - position_));
+		if(behind > 0)
+			overwrite(position_, data, behind);
+
+		append(data + behind, size - behind);
+		position_ += size;
+
+		return size;
+	}
+
+	int64_t seek(int64_t offset, int whence)
+	{
+		switch(whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:	return end_;
+		case SEEK_SET:		position_ = offset;			 break;
+		case SEEK_CUR:		position_ = position_ + offset; break;
+		case SEEK_END:		position_ = end_ + offset;	 break;
+		default:			return AVERROR(EINVAL);
+		}
+		return position_;
+	}
+
+	void close()
+	{
+		if(file_ == INVALID_HANDLE_VALUE)
+			return;
+
+		if(current_ && current_->fill > 0)
+		{
+			// Unbuffered writes have to be whole sectors, the padding is cut off below.
+			auto size = static_cast<size_t>((current_->fill + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE);
+			std::memset(current_->data.data() + current_->fill, 0, size - current_->fill);
+			issue(std::move(current_), size);
+		}
+
+		while(!pending_.empty())
+		{
+			complete(*pending_.front());
+			free_.push_back(std::move(pending_.front()));
+			pending_.pop_front();
+		}
+
+		FILE_END_OF_FILE_INFO end_of_file;
+		end_of_file.EndOfFile.QuadPart = end_;
+		if(!SetFileInformationByHandle(file_, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)))
+			CASPAR_LOG(warning) << L"[capture_file_io] Could not set the file size: " << filename_;
+
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+
+		if(!patches_.empty())
+		{
+			auto file = CreateFileW(filename_.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if(file == INVALID_HANDLE_VALUE)
+				BOOST_THROW_EXCEPTION(file_write_error() << msg_info("Could not reopen file.") << boost::errinfo_file_name(narrow(filename_)));
+
+			BOOST_FOREACH(auto& p, patches_)
+			{
+				LARGE_INTEGER offset;
+				offset.QuadPart = p.offset;
+				DWORD written = 0;
+				if(!SetFilePointerEx(file, offset, nullptr, FILE_BEGIN) || !WriteFile(file, p.data.data(), static_cast<DWORD>(p.data.size()), &written, nullptr))
+					CASPAR_LOG(error) << L"[capture_file_io] Could not update header at " << p.offset << L": " << filename_;
+			}
+			CloseHandle(file);
+		}
+
+		CASPAR_LOG(info) << L"[capture_file_io] Closed " << filename_ << L", " << (end_ / (1024*1024)) << L" MB, " << stalls_ << L" stalls.";
+	}
+
+	static int write_packet(void* opaque, uint8_t* buffer, int size)
+	{
+		return static_cast<implementation*>(opaque)->write(buffer, size);
+	}
+
+	static int64_t seek(void* opaque, int64_t offset, int whence)
+	{
+		return static_cast<implementation*>(opaque)->seek(offset, whence);
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",			L"unbuffered");
+		info.add(L"bytes-written",	bytes_written_);
+		info.add(L"write-rate",		static_cast<int64_t>(bytes_written_ / std::max(timer_.elapsed(), 0.001)));
+		info.add(L"average-latency-us", writes_ > 0 ? total_latency_us_ / writes_ : 0);
+		info.add(L"max-latency-us",	max_latency_us_);
+		info.add(L"stalls",			stalls_);
+		info.add(L"chunk-size",		chunk_size_);
+		return info;
+	}
+};
+
+capture_file_io::capture_file_io(const std::wstring& filename, const safe_ptr<diagnostics::graph>& graph, double fps) : impl_(new implementation(filename, graph, fps)){}
+capture_file_io::~capture_file_io(){}
+AVIOContext* capture_file_io::context(){return impl_->context_.get();}
+boost::property_tree::wptree capture_file_io::info() const{return impl_->info();}
+
+}}
@@ -0,0 +1,64 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct AVIOContext;
+
+namespace caspar { 
+	
+namespace diagnostics {
+
+class graph;
+
+}
+	
+namespace ffmpeg {
+
+// Writes a capture file with FILE_FLAG_NO_BUFFERING from a ring of page locked chunks with several overlapped 
+// writes in flight, so a page cache flush can not stall the encoder. Disk space is reserved ahead of the writes.
+// Muxers patching headers behind the write position are applied through a buffered handle when the file is closed.
+// configuration.ffmpeg.capture-chunk-size (KB), capture-chunks and capture-preallocate (MB).
+class capture_file_io : boost::noncopyable
+{
+public:
+	capture_file_io(const std::wstring& filename, const safe_ptr<diagnostics::graph>& graph, double fps);
+	~capture_file_io();
+
+	// For AVFormatContext::pb together with AVFMT_FLAG_CUSTOM_IO, valid as long as this object.
+	AVIOContext* context();
+
+	boost::property_tree::wptree info() const;
+private:
+	struct implementation;
+	std::unique_ptr<implementation> impl_;
+};
+
+}}
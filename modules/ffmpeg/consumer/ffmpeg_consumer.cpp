@@ -23,9 +23,11 @@
 
 #include "../ffmpeg_error.h"
 #include "../ffmpeg.h"
-#include "../producer/filter/filter.h"
 
 #include "ffmpeg_consumer.h"
+#include "frame_conversion.h"
+#include "capture_file_io.h"
+#include "paced_udp_io.h"
 
 #include <core/parameters/parameters.h>
 #include <core/mixer/read_frame.h>
@@ -33,12 +35,12 @@
 #include <core/consumer/frame_consumer.h>
 #include <core/video_format.h>
 #include <core/recorder.h>
+#include <core/video_channel.h>
 
 #include <common/concurrency/executor.h>
 #include <common/concurrency/future_util.h>
 #include <common/diagnostics/graph.h>
 #include <common/env.h>
-#include <common/memory/memshfl.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/timer.hpp>
@@ -55,8 +57,22 @@
 #include <boost/range/algorithm_ext.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <iomanip>
+#include <sstream>
 #include <string>
 
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavutil/eval.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
 namespace caspar {
 	namespace ffmpeg {
 
@@ -76,17 +92,6 @@ namespace caspar {
 			return result.checksum();
 		}
 
-		int get_scale_slice_count(const core::video_format_desc& format)
-		{
-			bool interlaced = format.field_mode != caspar::core::field_mode::progressive;
-			int result = 1;
-			int max = format.height <= 576 ? 2 : 16;
-			while (result < max
-				&& format.height  % (result * (interlaced  ? 4 : 2)) == 0)
-				result *= 2;
-			return result;
-		}
-
 		AVPixelFormat get_pixel_format(AVDictionary ** options)
 		{
 			auto pix_fmt_de = av_dict_get(*options, "pix_fmt", NULL, 0);
@@ -99,16 +104,6 @@ namespace caspar {
 			return pix_fmt;
 		}
 
-		int64_t get_channel_layout_bitmask(int num_channels)
-		{
-			if (num_channels > 63)
-				BOOST_THROW_EXCEPTION(caspar_exception("FFMpeg cannot handle more than 63 audio channels"));
-			const auto ALL_63_CHANNELS = 0x7FFFFFFFFFFFFFFFULL;
-			auto to_shift = 63 - num_channels;
-			auto result = ALL_63_CHANNELS >> to_shift;
-			return static_cast<int64_t>(result);
-		}
-
 		AVRational get_channel_sample_aspect_ratio(const core::video_format::type format, bool is_narrow)
 		{
 			switch (format) {
@@ -123,7 +118,60 @@ namespace caspar {
 			}
 		}
 
+		bool is_hardware_encoder(const AVCodec* encoder)
+		{
+			std::string name = encoder->name;
+			return boost::ends_with(name, "_nvenc") || boost::starts_with(name, "nvenc") || boost::ends_with(name, "_qsv");
+		}
+
 		static const std::string			MXF = ".MXF";
+		static const std::string			M3U8 = ".M3U8";
+		static const std::string			MPD = ".MPD";
+		static const size_t					MUX_QUEUE_CAPACITY = 64;
+		static const size_t					FRAME_QUEUE_CAPACITY = 16;
+
+		// What a consumer does with a frame when its encoders are behind.
+		struct drop_policy
+		{
+			enum type
+			{
+				block,			// waits, which holds up the other consumers on the channel
+				drop_oldest,	// drops the oldest frame that has not started encoding
+				drop_newest,	// drops the frame being sent
+				duplicate		// drops the frame being sent but keeps its time, the previous picture is held and the audio is silent
+			};
+		};
+
+		drop_policy::type get_drop_policy(const std::wstring& str)
+		{
+			if (boost::iequals(str, L"block"))
+				return drop_policy::block;
+			else if (boost::iequals(str, L"drop-oldest"))
+				return drop_policy::drop_oldest;
+			else if (boost::iequals(str, L"duplicate"))
+				return drop_policy::duplicate;
+			return drop_policy::drop_newest;
+		}
+
+		std::wstring get_drop_policy(drop_policy::type policy)
+		{
+			switch (policy)
+			{
+			case drop_policy::block:
+				return L"block";
+			case drop_policy::drop_oldest:
+				return L"drop-oldest";
+			case drop_policy::duplicate:
+				return L"duplicate";
+			default:
+				return L"drop-newest";
+			}
+		}
+
+		bool ends_with_upper(const std::string& filename, const std::string& extension)
+		{
+			return boost::ends_with(boost::to_upper_copy(filename), extension);
+		}
 
 		struct output_params
 		{
@@ -143,6 +191,10 @@ namespace caspar {
 			const int									video_bitrate_;
 			const std::string							file_timecode_;
 			const std::string							filter_;
+			const bool									is_hls_;
+			const bool									is_dash_;
+			const double								segment_duration_;
+			drop_policy::type							drop_policy_;
 			
 			output_params(
 				const std::string filename, 
@@ -159,7 +211,9 @@ namespace caspar {
 				const int a_rate, 
 				const int v_rate, 
 				const std::string file_tc,
-				const std::string filter)
+				const std::string filter,
+				const double segment_duration = 0.0,
+				const std::wstring& policy = L"")
 				: video_codec_(std::move(video_codec))
 				, audio_codec_(std::move(audio_codec))
 				, output_metadata_(std::move(output_metadata))
@@ -176,7 +230,47 @@ namespace caspar {
 				, file_name_(std::move(filename))
 				, file_timecode_(std::move(file_tc))
 				, filter_(std::move(filter))
+				, is_hls_(ends_with_upper(file_name_, M3U8))
+				, is_dash_(ends_with_upper(file_name_, MPD))
+				, segment_duration_(segment_duration > 0.0 ? segment_duration : env::properties().get(L"configuration.ffmpeg.segment-duration", 2.0))
+				, drop_policy_(get_drop_policy(policy.empty() ? env::properties().get(L"configuration.ffmpeg.drop-policy", L"drop-newest") : policy))
 			{ }
+
+			bool is_segmented() const
+			{
+				return is_hls_ || is_dash_;
+			}
+
+			// Offline renders must not lose frames, they wait for the encoders instead.
+			output_params for_offline_channel() const
+			{
+				output_params result(*this);
+				result.drop_policy_ = drop_policy::block;
+				return result;
+			}
+
+			// The same output written to another file, the files of a rotated recording.
+			output_params for_file(const std::string& file_name) const
+			{
+				return output_params(
+					file_name,
+					audio_codec_,
+					video_codec_,
+					output_metadata_,
+					audio_metadata_,
+					video_metadata_,
+					audio_stream_id_,
+					video_stream_id_,
+					options_,
+					is_stream_,
+					is_narrow_,
+					audio_bitrate_,
+					video_bitrate_,
+					file_timecode_,
+					filter_,
+					segment_duration_,
+					get_drop_policy(drop_policy_));
+			}
 			
 		};
 
@@ -186,9 +280,6 @@ namespace caspar {
 			return result;
 		}
 
-		typedef std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>	byte_vector;
-		typedef std::unique_ptr<SwsContext, std::function<void(SwsContext *)>> SwsContextPtr;
-		typedef std::unique_ptr<SwrContext, std::function<void(SwrContext *)>> SwrContextPtr;
 		typedef std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>> AVFormatContextPtr;
 		typedef std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> AVCodecContextPtr;
 		
@@ -197,31 +288,27 @@ namespace caspar {
 			AVDictionary *							options_;
 			const output_params						output_params_;
 			const core::video_format_desc			channel_format_desc_;
+			const int								channel_index_;
 			const int								height_;
 			const AVRational						channel_sample_aspect_ratio_;
 
 			const safe_ptr<diagnostics::graph>		graph_;
 
+			std::shared_ptr<capture_file_io>		capture_io_; // outlives format_context_, the trailer is written through it
+			std::shared_ptr<paced_udp_io>			stream_io_;  // likewise
 			AVFormatContextPtr						format_context_;
 			AVStream *								audio_stream_;
 			AVStream *								video_stream_;
 			AVCodecContextPtr						audio_codec_ctx_;
 			AVCodecContextPtr						video_codec_ctx_;
-			std::shared_ptr<filter>					video_filter_;
 			const AVPixelFormat						out_pixel_format_;
 
-			SwrContextPtr							swr_;
-
-			const size_t							scale_slices_;
-			const int								scale_slice_height_;
-			
-			std::vector<SwsContextPtr>				sws_;
-
-			int										last_frame_no_channels_;
+			// Shared with the other consumers on the channel encoding the same format.
+			std::shared_ptr<video_conversion>		video_conversion_;
+			std::shared_ptr<audio_conversion>		audio_conversion_;
+			int64_t									first_filtered_pts_;
 
 			byte_vector								audio_bufers_[AV_NUM_DATA_POINTERS];
-			byte_vector								key_picture_buf_;
-			byte_vector								picture_buf_;
 
 			tbb::atomic<int64_t>					out_frame_number_;
 			int64_t									out_audio_sample_number_;
@@ -229,35 +316,59 @@ namespace caspar {
 			const bool								key_only_;
 			bool									audio_is_planar_;
 			const bool								is_imx50_pal_;
+			const int								segment_frames_;
+
+			// Frames that neither encoder has started on, the ones drop-oldest can still take back.
+			struct queued_frame
+			{
+				enum state_type { queued, started, dropped };
+				tbb::atomic<int> state;
+			};
+			std::deque<std::shared_ptr<queued_frame>>	queued_frames_;
+			int64_t									skipped_frames_;
+			int64_t									silent_samples_;
+			tbb::atomic<int64_t>					dropped_frames_;
+			tbb::atomic<int64_t>					duplicated_frames_;
 			tbb::atomic<int64_t>					current_encoding_delay_;
-			boost::timer							frame_timer_;
-			executor								encode_executor_;
+			// Video and audio are encoded on their own threads and the packets are interleaved on a third one, 
+			// so audio never waits behind a slow video frame. Declared in the order they have to finish.
+			executor								mux_executor_;
+			executor								audio_executor_;
+			executor								video_executor_;
 
 		public:
 			ffmpeg_consumer
 			(
 				const core::video_format_desc& channel_format_desc,
+				int channel_index,
 				output_params params,
 				bool key_only
 			)
-				: encode_executor_(print())
+				: mux_executor_(print() + L" mux")
+				, audio_executor_(print() + L" audio")
+				, video_executor_(print() + L" video")
 				, out_audio_sample_number_(0)
 				, output_params_(std::move(params))
 				, channel_format_desc_(channel_format_desc)
+				, channel_index_(channel_index)
+				, first_filtered_pts_(AV_NOPTS_VALUE)
 				, key_only_(key_only)
 				, options_(read_parameters(params.options_))
 				, audio_stream_(nullptr)
 				, video_stream_(nullptr)
 				, is_imx50_pal_(output_params_.is_mxf_ && channel_format_desc.format == core::video_format::pal)
-				, scale_slices_(get_scale_slice_count(channel_format_desc_))
+				, segment_frames_(std::max(1, static_cast<int>(output_params_.segment_duration_ * channel_format_desc.fps + 0.5)))
+				, skipped_frames_(0)
+				, silent_samples_(0)
 				, height_(channel_format_desc.format == core::video_format::ntsc ? 480 : channel_format_desc.height)
-				, scale_slice_height_(height_ / scale_slices_)
 				, out_pixel_format_(get_pixel_format(&options_))
 				, channel_sample_aspect_ratio_(get_channel_sample_aspect_ratio(channel_format_desc.format, params.is_narrow_))
 			{
 
 				current_encoding_delay_ = 0;
 				out_frame_number_ = 0;
+				dropped_frames_ = 0;
+				duplicated_frames_ = 0;
 
 				if (boost::filesystem::exists(output_params_.file_name_))
 					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("File already exists: " + params.file_name_));
@@ -274,48 +385,59 @@ namespace caspar {
 				if (params.filter_.empty())
 				{
 					create_output(video_codec, audio_codec, channel_format_desc.width, channel_format_desc.height, out_pixel_format_, av_make_q(channel_format_desc.time_scale, channel_format_desc.duration), av_make_q(channel_format_desc.duration, channel_format_desc.time_scale), channel_sample_aspect_ratio_);
-					create_sws();
+					video_conversion_ = get_video_conversion(channel_index_, channel_format_desc_, key_only_, video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, is_imx50_pal_);
 				}
 				else
 				{
-					auto pix_fmts = std::vector<AVPixelFormat>();
-					pix_fmts.push_back(out_pixel_format_);
-					video_filter_.reset(new filter(
-						channel_format_desc.width,
-						channel_format_desc.height,
-						av_make_q(channel_format_desc.duration, channel_format_desc.time_scale),
-						av_make_q(channel_format_desc.time_scale, channel_format_desc.duration),
-						channel_sample_aspect_ratio_,
-						AV_PIX_FMT_BGRA,
-						pix_fmts,
-						params.filter_
-					));
-					create_output(video_codec, audio_codec, video_filter_->out_width(), video_filter_->out_height(), video_filter_->out_pixel_format(), video_filter_->out_frame_rate(), video_filter_->out_time_base(), video_filter_->out_sample_aspect_ratio());
+					video_conversion_ = get_filtered_video_conversion(channel_index_, channel_format_desc_, key_only_, channel_sample_aspect_ratio_, out_pixel_format_, params.filter_);
+					create_output(video_codec, audio_codec, video_conversion_->out_width(), video_conversion_->out_height(), video_conversion_->out_pixel_format(), video_conversion_->out_frame_rate(), video_conversion_->out_time_base(), video_conversion_->out_sample_aspect_ratio());
 				}
+
+				if (!key_only_)
+					audio_conversion_ = get_audio_conversion(channel_index_, channel_format_desc_, audio_codec_ctx_->channels, audio_codec_ctx_->sample_fmt, audio_codec_ctx_->sample_rate);
 								
 				graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
+				graph_->set_color("audio-time", diagnostics::color(0.1f, 0.6f, 0.9f));
+				graph_->set_color("mux-time", diagnostics::color(0.9f, 0.9f, 0.3f));
+				graph_->set_color("video-queue", diagnostics::color(0.3f, 0.8f, 0.3f, 0.6f));
+				graph_->set_color("audio-queue", diagnostics::color(0.3f, 0.5f, 0.8f, 0.6f));
+				graph_->set_color("mux-queue", diagnostics::color(0.8f, 0.8f, 0.3f, 0.6f));
 				graph_->set_color("dropped-frame", diagnostics::color(1.0f, 0.1f, 0.1f));
 				graph_->set_text(print());
 				diagnostics::register_graph(graph_);
 
-				encode_executor_.set_capacity(16);
+				// drop-oldest keeps queueing while the dropped frames wait for their turn to be skipped.
+				const size_t queue_capacity = output_params_.drop_policy_ == drop_policy::drop_oldest ? FRAME_QUEUE_CAPACITY * 2 : FRAME_QUEUE_CAPACITY;
+				video_executor_.set_capacity(queue_capacity);
+				audio_executor_.set_capacity(queue_capacity);
+				mux_executor_.set_capacity(MUX_QUEUE_CAPACITY);
 			
 				CASPAR_LOG(info) << print() << L" Successfully Initialized.";
 			}
 
 			~ffmpeg_consumer()
 			{
-				encode_executor_.begin_invoke([this] {
-					if (video_filter_)
-					{
-						auto frames = video_filter_->poll_all();
-						for (auto frame = frames.begin(); frame != frames.end(); frame++)
-							encode_video((*frame).get());
-					}
-					if ((video_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY)
-						|| (!key_only_ && audio_codec_ctx_ && (audio_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY)))
-						flush_encoders();
-					avio_flush(format_context_->pb);
+				try
+				{
+					video_executor_.invoke([this] {
+						if (video_conversion_->is_filtered() && video_conversion_.unique()) // the last one out takes the frames left in the graph
+						{
+							auto frames = video_conversion_->flush();
+							for (auto frame = frames.begin(); frame != frames.end(); frame++)
+								encode_filtered_video(*frame);
+						}
+						flush_video();
+					});
+					if (!key_only_ && audio_codec_ctx_)
+						audio_executor_.invoke([this] { flush_audio(); });
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+				mux_executor_.begin_invoke([this] {
+					if (format_context_->pb)
+						avio_flush(format_context_->pb);
 					LOG_ON_ERROR2(av_write_trailer(format_context_.get()), "[ffmpeg_consumer]");
 				});
 				if (options_)
@@ -333,7 +455,11 @@ namespace caspar {
 				try
 				{
 					AVOutputFormat * format = NULL;
-					if (output_params_.is_stream_)
+					if (output_params_.is_hls_)
+						format = av_guess_format("hls", NULL, NULL);
+					else if (output_params_.is_dash_)
+						format = av_guess_format("dash", NULL, NULL);
+					if (!format && output_params_.is_stream_)
 					{
 						if (output_params_.file_name_.find("rtmp://") == 0)
 							format = av_guess_format("flv", NULL, NULL);
@@ -349,11 +475,19 @@ namespace caspar {
 
 					format_context_ = AVFormatContextPtr(alloc_output_params_context(output_params_.file_name_, format), [](AVFormatContext * ctx)
 					{
-						if (!(ctx->oformat->flags & AVFMT_NOFILE))
+						if (!(ctx->oformat->flags & AVFMT_NOFILE) && !(ctx->flags & AVFMT_FLAG_CUSTOM_IO))
 							LOG_ON_ERROR2(avio_close(ctx->pb), "[ffmpeg_consumer]");
 						avformat_free_context(ctx);
 					});
 
+					if (output_params_.is_hls_)
+					{
+						LOG_ON_ERROR2(av_dict_set(&options_, "hls_time", boost::lexical_cast<std::string>(output_params_.segment_duration_).c_str(), AV_DICT_DONT_OVERWRITE), "[ffmpeg_consumer]");
+						LOG_ON_ERROR2(av_dict_set(&options_, "hls_flags", "temp_file", AV_DICT_DONT_OVERWRITE), "[ffmpeg_consumer]");
+					}
+					else if (output_params_.is_dash_)
+						LOG_ON_ERROR2(av_dict_set_int(&options_, "min_seg_duration", static_cast<int64_t>(output_params_.segment_duration_ * 1000000.0), AV_DICT_DONT_OVERWRITE), "[ffmpeg_consumer]");
+
 					add_video_stream(video_codec, format, width, height, pix_fmt, frame_rate, time_base, sample_aspect_ratio);
 
 					if (!key_only_)
@@ -368,7 +502,19 @@ namespace caspar {
 
 					av_dump_format(format_context_.get(), 0, output_params_.file_name_.c_str(), 1);
 
-					if (!(format_context_->oformat->flags & AVFMT_NOFILE))
+					if (!(format_context_->oformat->flags & AVFMT_NOFILE) && !output_params_.is_stream_ && !output_params_.is_segmented() && env::properties().get(L"configuration.ffmpeg.unbuffered-write", false))
+					{
+						capture_io_.reset(new capture_file_io(widen(output_params_.file_name_), graph_, channel_format_desc_.fps));
+						format_context_->pb = capture_io_->context();
+						format_context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+					}
+					else if (output_params_.is_stream_ && boost::starts_with(output_params_.file_name_, "udp://") && env::properties().get(L"configuration.ffmpeg.stream-pacing", true))
+					{
+						stream_io_.reset(new paced_udp_io(output_params_.file_name_, stream_rate(), graph_, channel_format_desc_.fps));
+						format_context_->pb = stream_io_->context();
+						format_context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+					}
+					else if (!(format_context_->oformat->flags & AVFMT_NOFILE))
 						THROW_ON_ERROR2(avio_open2(&format_context_->pb, output_params_.file_name_.c_str(), AVIO_FLAG_WRITE, NULL, &options_), "[ffmpeg_consumer]");
 
 					THROW_ON_ERROR2(avformat_write_header(format_context_.get(), &options_), "[ffmpeg_consumer]");
@@ -387,30 +533,26 @@ namespace caspar {
 				catch (...)
 				{
 					format_context_.reset();
+					capture_io_.reset();
+					stream_io_.reset();
 					boost::filesystem2::remove(output_params_.file_name_); // Delete the file if exists and consumer not fully initialized
 					throw;
 				}
 			}
 
-			void create_sws()
+			// The mux rate of a constant rate transport stream, otherwise that of the encoders with headroom for their peaks.
+			int64_t stream_rate() const
 			{
-				for (size_t i = 0; i < scale_slices_; i++)
-				{
-					if (channel_format_desc_.field_mode == caspar::core::field_mode::progressive)
-					{
-						sws_.push_back(SwsContextPtr(
-							sws_getContext(channel_format_desc_.width, scale_slice_height_, AV_PIX_FMT_BGRA, channel_format_desc_.width, scale_slice_height_, video_codec_ctx_->pix_fmt, 0, nullptr, nullptr, NULL),
-							[](SwsContext * ctx) { sws_freeContext(ctx); }));
-					}
-					else
-					{
-						sws_.push_back(SwsContextPtr(
-							sws_getContext(channel_format_desc_.width, scale_slice_height_ / 2, AV_PIX_FMT_BGRA, channel_format_desc_.width, scale_slice_height_ / 2, video_codec_ctx_->pix_fmt, 0, nullptr, nullptr, NULL),
-							[](SwsContext * ctx) { sws_freeContext(ctx); }));
-					}
-				}
-				if (sws_.size() != scale_slices_)
-					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot initialize the conversion context"));
+				if (auto muxrate = av_dict_get(options_, "muxrate", NULL, 0))
+					return static_cast<int64_t>(av_strtod(muxrate->value, NULL) * 1.02);
+
+				int64_t rate = 0;
+				if (video_codec_ctx_)
+					rate += std::max(video_codec_ctx_->bit_rate, video_codec_ctx_->rc_max_rate);
+				if (audio_codec_ctx_)
+					rate += audio_codec_ctx_->bit_rate;
+
+				return static_cast<int64_t>(rate * env::properties().get(L"configuration.ffmpeg.stream-pacing-headroom", 1.25));
 			}
 
 			void add_video_stream(const AVCodec * encoder, const AVOutputFormat * format, const int width, const int height, const AVPixelFormat pix_fmt, const AVRational frame_rate, const AVRational time_base, const AVRational sample_aspect_ratio)
@@ -434,7 +576,7 @@ namespace caspar {
 				if (channel_format_desc_.format == core::video_format::ntsc && height == 486)
 					video_codec_ctx_->height = 480;
 
-				if (!video_filter_ && channel_format_desc_.field_mode != core::field_mode::progressive)
+				if (!video_conversion_ && channel_format_desc_.field_mode != core::field_mode::progressive)
 					video_codec_ctx_->flags |= (AV_CODEC_FLAG_INTERLACED_ME | AV_CODEC_FLAG_INTERLACED_DCT);
 
 				if (video_codec_ctx_->codec_id == AV_CODEC_ID_PRORES)
@@ -452,7 +594,7 @@ namespace caspar {
 				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_DVVIDEO)
 				{
 					video_codec_ctx_->width = video_codec_ctx_->height == 1280 ? 960 : video_codec_ctx_->width;
-					if (!video_filter_ && pix_fmt == AV_PIX_FMT_NONE)
+					if (!video_conversion_ && pix_fmt == AV_PIX_FMT_NONE)
 					{
 						if (channel_format_desc_.format == core::video_format::ntsc)
 							video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV411P;
@@ -468,7 +610,7 @@ namespace caspar {
 				}
 				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_H264)
 				{
-					video_codec_ctx_->bit_rate = (video_filter_ ? video_filter_->out_height() : height_) * 14 * 1000; // about 8Mbps for SD, 14 for HD
+					video_codec_ctx_->bit_rate = (video_conversion_ ? video_conversion_->out_height() : height_) * 14 * 1000; // about 8Mbps for SD, 14 for HD
 					video_codec_ctx_->gop_size = 30;
 					video_codec_ctx_->max_b_frames = 2;
 					if (strcmp(video_codec_ctx_->codec->name, "libx264") == 0)
@@ -484,7 +626,7 @@ namespace caspar {
 					{
 						video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV422P;
 						video_codec_ctx_->bit_rate = 50 * 1000000;
-						if (!video_filter_ && channel_format_desc_.format == core::video_format::pal)
+						if (!video_conversion_ && channel_format_desc_.format == core::video_format::pal)
 						{
 							// IMX50 encoding parameters
 							video_codec_ctx_->bit_rate = 50 * 1000000;
@@ -503,6 +645,19 @@ namespace caspar {
 					}
 				}
 
+				// Lets the encoder take the nv12 image packed by the mixer when the channel has output-packing nv12.
+				if (!video_conversion_ && is_hardware_encoder(encoder) && output_params_.options_.find("pix_fmt") == std::string::npos)
+					video_codec_ctx_->pix_fmt = AV_PIX_FMT_NV12;
+
+				// Segments can only be cut on keyframes, the ones at segment boundaries are forced in encode_video.
+				if (output_params_.is_segmented())
+				{
+					video_codec_ctx_->gop_size = segment_frames_;
+					video_codec_ctx_->keyint_min = segment_frames_;
+					if (strcmp(encoder->name, "libx264") == 0 || boost::contains(std::string(encoder->name), "nvenc"))
+						LOG_ON_ERROR2(av_dict_set(&options_, "forced-idr", "1", AV_DICT_DONT_OVERWRITE), "[ffmpeg_consumer]");
+				}
+
 				if (output_params_.video_bitrate_ != 0)
 					video_codec_ctx_->bit_rate = output_params_.video_bitrate_ * 1000;
 
@@ -526,11 +681,6 @@ namespace caspar {
 				video_stream_->sample_aspect_ratio = sample_aspect_ratio;
 				video_stream_->time_base = time_base;
 				video_stream_->avg_frame_rate = frame_rate;
-
-				picture_buf_.resize(av_image_get_buffer_size(video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 16));
-				AVFrame black_frame = {0};
-				av_image_fill_arrays(black_frame.data, black_frame.linesize, picture_buf_.data(), video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 16);
-				av_image_fill_black(black_frame.data, black_frame.linesize, video_codec_ctx_->pix_fmt, video_codec_ctx_->color_range, video_codec_ctx_->width, video_codec_ctx_->height);
 			}
 
 			void add_audio_stream(const AVCodec * encoder, AVOutputFormat * format)
@@ -586,100 +736,6 @@ namespace caspar {
 				audio_stream_->id = output_params_.audio_stream_id_;
 			}
 
-			std::shared_ptr<AVFrame> fast_convert_video(core::read_frame& frame)
-			{
-				AVFrame in_frame = { 0 };
-				if (key_only_)
-				{
-					key_picture_buf_.resize(frame.image_data().size());
-					in_frame.linesize[0] = channel_format_desc_.width * 4; //AV_PIX_FMT_BGRA
-					in_frame.data[0] = key_picture_buf_.data();
-					fast_memshfl(in_frame.data[0], frame.image_data().begin(), frame.image_data().size(), 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
-				}
-				else
-				{
-					av_image_fill_arrays(in_frame.data, in_frame.linesize, const_cast<uint8_t*>(frame.image_data().begin()), AV_PIX_FMT_BGRA, channel_format_desc_.width, channel_format_desc_.height, 16);
-				}
-
-				std::shared_ptr<AVFrame> out_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
-
-				av_image_fill_arrays(out_frame->data, out_frame->linesize, picture_buf_.data(), video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 16);
-
-				tbb::parallel_for(0u, scale_slices_, [&](const size_t& sws_index) 
-				{
-					if (channel_format_desc_.field_mode == caspar::core::field_mode::progressive)
-					{
-						uint8_t *in_data[4];
-						uint8_t *out_data[4];
-						for (size_t i = 0; i < 4; i++)
-						{
-							auto in_offset = sws_index * scale_slice_height_ * in_frame.linesize[i];
-							in_data[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset;
-							auto out_offset = sws_index * scale_slice_height_  * out_frame->linesize[i] / ((i > 0 && out_frame->linesize[i] != 0 && video_codec_ctx_->pix_fmt == AV_PIX_FMT_YUV420P) ? 2 : 1);
-							auto strange_adjustmenst = (i > 0 && scale_slices_ % 8 == 0 && video_codec_ctx_->pix_fmt == AV_PIX_FMT_YUV420P && (height_ == 720 || height_ % 1080 == 0) && (sws_index % 2 != 0) ? out_frame->linesize[i] / 2 : 0);
-							out_data[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset + strange_adjustmenst;
-						}
-						sws_scale(sws_.at(sws_index).get(), in_data, in_frame.linesize, 0, scale_slice_height_  , out_data, out_frame->linesize);
-					}
-					else
-					{
-						uint8_t * in_data_upper[4];
-						uint8_t * in_data_lower[4];
-						int in_stride[4];
-						uint8_t * out_data_upper[4];
-						uint8_t * out_data_lower[4];
-						int out_stride[4];
-						for (uint32_t i = 0; i < 4; i++)
-						{
-							auto in_offset_upper = sws_index * scale_slice_height_ * in_frame.linesize[i];
-							auto in_offset_lower = in_offset_upper + in_frame.linesize[i];
-							in_data_upper[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset_upper;
-							in_data_lower[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset_lower;
-							auto out_offset_upper = (sws_index * scale_slice_height_  * out_frame->linesize[i] / ((i > 0 && out_frame->linesize[i] != 0 && video_codec_ctx_->pix_fmt == AV_PIX_FMT_YUV420P) ? 2 : 1)) + (is_imx50_pal_ ? 32 * out_frame->linesize[i] : 0);
-							auto out_offset_lower = out_offset_upper + out_frame->linesize[i];
-							auto strange_adjustmenst = (i > 0 && scale_slices_ % 8 == 0 && video_codec_ctx_->pix_fmt == AV_PIX_FMT_YUV420P && (height_ == 720 || height_ % 1080 == 0) && (sws_index % 2 != 0) ? out_frame->linesize[i] / 2 : 0);
-							out_data_upper[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset_upper + strange_adjustmenst;
-							out_data_lower[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset_lower + strange_adjustmenst;
-							in_stride[i] = in_frame.linesize[i] * 2;
-							out_stride[i] = out_frame->linesize[i] * 2;
-						}
-						sws_scale(sws_.at(sws_index).get(), in_data_upper, in_stride, 0, scale_slice_height_  / 2, out_data_upper, out_stride);
-						sws_scale(sws_.at(sws_index).get(), in_data_lower, in_stride, 0, scale_slice_height_  / 2, out_data_lower, out_stride);
-					}
-				});
-				out_frame->height = video_codec_ctx_->height;
-				out_frame->width = video_codec_ctx_->width;
-				out_frame->format = video_codec_ctx_->pix_fmt;
-				out_frame->interlaced_frame = channel_format_desc_.field_mode != core::field_mode::progressive;
-				out_frame->top_field_first = channel_format_desc_.field_mode == core::field_mode::upper;
-				out_frame->pts = out_frame_number_++;
-				return out_frame;
-			}
-
-			void send_frame_to_filter(core::read_frame& read_frame)
-			{
-				std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
-				av_frame->width = channel_format_desc_.width;
-				av_frame->height = height_;
-				av_frame->format = AV_PIX_FMT_BGRA;
-				av_frame->sample_aspect_ratio = channel_sample_aspect_ratio_;
-				av_frame->interlaced_frame = channel_format_desc_.field_mode != core::field_mode::progressive;
-				av_frame->top_field_first = channel_format_desc_.field_mode == core::field_mode::upper;
-				av_frame->pts = out_frame_number_++;
-				if (key_only_)
-				{
-					key_picture_buf_.resize(read_frame.image_data().size());
-					av_frame->linesize[0] = channel_format_desc_.width * 4; //AV_PIX_FMT_BGRA
-					av_frame->data[0] = key_picture_buf_.data();
-					fast_memshfl(av_frame->data[0], read_frame.image_data().begin(), read_frame.image_data().size(), 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
-				}
-				else
-				{
-					av_image_fill_arrays(av_frame->data, av_frame->linesize, const_cast<uint8_t*>(read_frame.image_data().begin()), AV_PIX_FMT_BGRA, channel_format_desc_.width, height_, 16);
-				}
-				video_filter_->push(av_frame);
-			}
-
 			void encode_video(AVFrame* frame)
 			{
 				AVPacket pkt = { 0 };
@@ -690,81 +746,76 @@ namespace caspar {
 					return;
 				av_packet_rescale_ts(&pkt, video_codec_ctx_->time_base, video_stream_->time_base);
 				pkt.stream_index = video_stream_->index;
+				write_packet(pkt);
+			}
+
+			// Takes over the packet and hands it to the mux thread.
+			void write_packet(AVPacket& pkt)
+			{
 				THROW_ON_ERROR2(av_packet_make_refcounted(&pkt), "[ffmpeg_consumer]");
-				THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), &pkt), "[ffmpeg_consumer]");
+				std::shared_ptr<AVPacket> packet(av_packet_alloc(), [](AVPacket* packet) { av_packet_free(&packet); });
+				if (!packet)
+					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not allocate packet.") << boost::errinfo_api_function("av_packet_alloc"));
+				av_packet_move_ref(packet.get(), &pkt);
+
+				mux_executor_.begin_invoke([=] {
+					boost::timer timer;
+					THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), packet.get()), "[ffmpeg_consumer]");
+					graph_->set_value("mux-time", timer.elapsed()*channel_format_desc_.fps*0.5);
+					graph_->set_value("mux-queue", static_cast<double>(mux_executor_.size())/static_cast<double>(mux_executor_.capacity()));
+				});
 			}
 
-			void process_video_frame(core::read_frame& frame)
+			// The converted frame is shared with other consumers, so the pts is set on a reference of our own.
+			void encode_video(const safe_ptr<AVFrame>& frame, int64_t pts, bool key_frame = false)
 			{
-				if (video_filter_) //filtered path (slow one)
-				{
-					send_frame_to_filter(frame);
-					std::shared_ptr<AVFrame> converted = video_filter_->poll();
-					while (converted)
-					{
-						encode_video(converted.get());
-						converted = video_filter_->poll();
-					};
-				}
-				else // fast, multithreaded conversion
-				{
-					auto av_frame = fast_convert_video(frame);
-					encode_video(av_frame.get());
-				}
+				std::shared_ptr<AVFrame> av_frame(av_frame_clone(frame.get()), [](AVFrame* frame) { av_frame_free(&frame); });
+				if (!av_frame)
+					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not reference the converted frame.") << boost::errinfo_api_function("av_frame_clone"));
+				av_frame->pts = pts;
+				av_frame->pict_type = key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+				encode_video(av_frame.get());
+			}
+
+			void encode_filtered_video(const safe_ptr<AVFrame>& frame, bool key_frame = false)
+			{
+				// Filters may change the frame rate, so keep the filter timing but start from zero.
+				if (first_filtered_pts_ == AV_NOPTS_VALUE)
+					first_filtered_pts_ = frame->pts;
+				encode_video(frame, frame->pts - first_filtered_pts_, key_frame);
+				++out_frame_number_;
 			}
 
-			void resample_audio(core::read_frame& frame)
+			void process_video_frame(const safe_ptr<core::read_frame>& frame, bool key_frame)
 			{
-				if (!swr_ || last_frame_no_channels_ != frame.num_channels())
+				auto converted = video_conversion_->convert(frame);
+				if (video_conversion_->is_filtered())
 				{
-					uint64_t out_channel_layout = av_get_default_channel_layout(audio_codec_ctx_->channels);
-					uint64_t in_channel_layout = get_channel_layout_bitmask(frame.num_channels());
-					swr_ = SwrContextPtr(
-						swr_alloc_set_opts(nullptr,
-							out_channel_layout,
-							audio_codec_ctx_->sample_fmt,
-							audio_codec_ctx_->sample_rate,
-							in_channel_layout,
-							AV_SAMPLE_FMT_S32,
-							channel_format_desc_.audio_sample_rate,
-							0, nullptr),
-						[](SwrContext * ctx) {swr_free(&ctx); });
-					if (!swr_)
-						BOOST_THROW_EXCEPTION(caspar_exception()
-							<< msg_info("Cannot alloc audio resampler"));
-					THROW_ON_ERROR2(swr_init(swr_.get()), "[ffmpeg_consumer]");
-					last_frame_no_channels_ = frame.num_channels();
+					for (auto it = converted.begin(); it != converted.end(); ++it)
+						encode_filtered_video(*it, key_frame && it == converted.begin());
 				}
-				byte_vector out_buffers[AV_NUM_DATA_POINTERS];
-				const int in_samples_count = frame.audio_data().size() / frame.num_channels();
-				const int out_samples_count = static_cast<int>(av_rescale_rnd(in_samples_count, audio_codec_ctx_->sample_rate, channel_format_desc_.audio_sample_rate, AV_ROUND_UP));
-				if (audio_is_planar_)
-					for (char i = 0; i < audio_codec_ctx_->channels; i++)
-						out_buffers[i].resize(out_samples_count * av_get_bytes_per_sample(AV_SAMPLE_FMT_S32));
-				else
-					out_buffers[0].resize(out_samples_count * av_get_bytes_per_sample(AV_SAMPLE_FMT_S32) *audio_codec_ctx_->channels);
-
-				const uint8_t* in[] = { reinterpret_cast<const uint8_t*>(frame.audio_data().begin()) };
-				uint8_t*       out[AV_NUM_DATA_POINTERS];
-				for (char i = 0; i < AV_NUM_DATA_POINTERS; i++)
-					out[i] = out_buffers[i].data();
-
-				int converted_sample_count = swr_convert(swr_.get(),
-					out, out_samples_count,
-					in, in_samples_count);
-				if (audio_is_planar_)
-					for (char i = 0; i < audio_codec_ctx_->channels; i++)
-					{
-						out_buffers[i].resize(converted_sample_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt));
-						boost::range::push_back(audio_bufers_[i], out_buffers[i]);
-					}
 				else
 				{
-					out_buffers[0].resize(converted_sample_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt) * audio_codec_ctx_->channels);
-					boost::range::push_back(audio_bufers_[0], out_buffers[0]);
+					for (auto it = converted.begin(); it != converted.end(); ++it)
+						encode_video(*it, out_frame_number_++, key_frame && it == converted.begin());
 				}
 			}
 
+			void push_silence(int64_t channel_samples)
+			{
+				const int64_t samples = av_rescale(channel_samples, audio_codec_ctx_->sample_rate, channel_format_desc_.audio_sample_rate);
+				const size_t plane_size = static_cast<size_t>(samples * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt) * (audio_is_planar_ ? 1 : audio_codec_ctx_->channels));
+				for (int i = 0; i < (audio_is_planar_ ? audio_codec_ctx_->channels : 1); i++)
+					audio_bufers_[i].insert(audio_bufers_[i].end(), plane_size, 0);
+			}
+
+			void resample_audio(const safe_ptr<core::read_frame>& frame)
+			{
+				auto converted = audio_conversion_->convert(frame);
+				for (size_t i = 0; i < converted->size(); i++)
+					boost::range::push_back(audio_bufers_[i], (*converted)[i]);
+			}
+
 			void encode_audio_buffer(bool is_last_frame)
 			{
 				size_t input_audio_size = audio_codec_ctx_->frame_size == 0 || is_last_frame ?
@@ -799,56 +850,148 @@ namespace caspar {
 						return;
 					av_packet_rescale_ts(&pkt, audio_codec_ctx_->time_base, audio_stream_->time_base);
 					pkt.stream_index = audio_stream_->index;
-					THROW_ON_ERROR2(av_packet_make_refcounted(&pkt), "[ffmpeg_consumer]");
-					THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), &pkt), "[ffmpeg_consumer]");
+					write_packet(pkt);
 				}
 			}
 
-			void process_audio_frame(core::read_frame& frame)
+			void process_audio_frame(const safe_ptr<core::read_frame>& frame)
 			{
 				resample_audio(frame);
 				encode_audio_buffer(false);
 			}
 
+			static bool start(queued_frame& item)
+			{
+				return item.state.compare_and_swap(queued_frame::started, queued_frame::queued) != queued_frame::dropped;
+			}
+
+			bool drop_oldest_queued()
+			{
+				for (auto it = queued_frames_.begin(); it != queued_frames_.end(); ++it)
+				{
+					if ((*it)->state.compare_and_swap(queued_frame::dropped, queued_frame::queued) == queued_frame::queued)
+					{
+						queued_frames_.erase(it);
+						return true;
+					}
+				}
+				return false;
+			}
+
 			void send(const safe_ptr<core::read_frame>& frame)
 			{
-				encode_executor_.begin_invoke([=] {
-					frame_timer_.restart();
+				// Keyframes are placed by the channel frame number, which lines up the segments of every rendition on the channel.
+				bool key_frame = output_params_.is_segmented() && get_channel_frame_number(channel_index_, frame) % segment_frames_ == 0;
 
-					process_video_frame(*frame);
+				while (!queued_frames_.empty() && queued_frames_.front()->state != queued_frame::queued)
+					queued_frames_.pop_front();
 
-					if (!key_only_)
-						process_audio_frame(*frame);
+				if (output_params_.drop_policy_ == drop_policy::drop_oldest && !ready_for_frame())
+				{
+					bool full = video_executor_.size() >= video_executor_.capacity() || audio_executor_.size() >= audio_executor_.capacity();
+					if (full || !drop_oldest_queued())
+					{
+						mark_dropped(frame);
+						return;
+					}
+					++dropped_frames_;
+					graph_->set_tag("dropped-frame");
+				}
+
+				video_conversion_->submit(frame);
+				if (audio_conversion_)
+					audio_conversion_->submit(frame);
 
-					graph_->set_value("frame-time", frame_timer_.elapsed()*channel_format_desc_.fps*0.5);
+				auto item = std::make_shared<queued_frame>();
+				item->state = queued_frame::queued;
+				if (output_params_.drop_policy_ == drop_policy::drop_oldest)
+					queued_frames_.push_back(item);
+
+				auto skipped_frames = skipped_frames_;
+				auto silent_samples = silent_samples_;
+				skipped_frames_ = 0;
+				silent_samples_ = 0;
+
+				video_executor_.begin_invoke([=] {
+					if (!start(*item))
+						return;
+
+					boost::timer timer;
+
+					out_frame_number_ += skipped_frames; // the encoder holds the previous picture over the gap
+					process_video_frame(frame, key_frame);
+
+					graph_->set_value("frame-time", timer.elapsed()*channel_format_desc_.fps*0.5);
+					graph_->set_value("video-queue", static_cast<double>(video_executor_.size())/static_cast<double>(video_executor_.capacity()));
 					graph_->set_text(print());
 					current_encoding_delay_ = frame->get_age_millis();
 				});
+
+				if (!key_only_)
+				{
+					audio_executor_.begin_invoke([=] {
+						if (!start(*item))
+							return;
+
+						boost::timer timer;
+
+						if (silent_samples > 0)
+							push_silence(silent_samples);
+						process_audio_frame(frame);
+
+						graph_->set_value("audio-time", timer.elapsed()*channel_format_desc_.fps*0.5);
+						graph_->set_value("audio-queue", static_cast<double>(audio_executor_.size())/static_cast<double>(audio_executor_.capacity()));
+					});
+				}
 			}
 
 			bool ready_for_frame()
 			{
-				return encode_executor_.size() < encode_executor_.capacity();
+				return video_executor_.size() < FRAME_QUEUE_CAPACITY
+					&& audio_executor_.size() < FRAME_QUEUE_CAPACITY;
 			}
 
-			void mark_dropped()
+			bool accepts_frame()
 			{
+				return output_params_.drop_policy_ == drop_policy::block
+					|| output_params_.drop_policy_ == drop_policy::drop_oldest
+					|| ready_for_frame();
+			}
+
+			void mark_dropped(const safe_ptr<core::read_frame>& frame)
+			{
+				get_channel_frame_number(channel_index_, frame);
+
 				graph_->set_tag("dropped-frame");
 
-				// TODO: adjust PTS accordingly to make dropped frames contribute
-				//       to the total playing time
+				if (output_params_.drop_policy_ == drop_policy::duplicate && !video_conversion_->is_filtered())
+				{
+					++skipped_frames_;
+					if (!key_only_)
+						silent_samples_ += frame->audio_data().size() / std::max(1, frame->num_channels());
+					++duplicated_frames_;
+				}
+				else
+				{
+					// TODO: adjust PTS accordingly to make dropped frames contribute
+					//       to the total playing time
+					++dropped_frames_;
+				}
+			}
+
+			void flush_video()
+			{
+				if (!video_codec_ctx_ || (video_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY) == 0)
+					return;
+				while (!flush_stream(true));
 			}
 
-			void flush_encoders()
+			void flush_audio()
 			{
 				encode_audio_buffer(true); // encode remaining buffer data
-				bool audio_flushed = key_only_ || !audio_codec_ctx_ || (audio_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY) == 0;
-				bool video_flushed = !video_codec_ctx_ || (video_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY) == 0;
-				while (!(audio_flushed && video_flushed))
-				{
-					audio_flushed |= flush_stream(false);
-					video_flushed |= flush_stream(true);
-				} 
+				if ((audio_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY) == 0)
+					return;
+				while (!flush_stream(false));
 			}
 
 			bool flush_stream(bool video)
@@ -872,8 +1015,7 @@ namespace caspar {
 					return true;
 				av_packet_rescale_ts(&pkt, codec_ctx_time_base, stream->time_base);
 				pkt.stream_index = stream->index;
-				THROW_ON_ERROR2(av_packet_make_refcounted(&pkt), "[ffmpeg_consumer]");
-				THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), &pkt), "[ffmpeg_consumer]");
+				write_packet(pkt);
 				return false;
 			}
 					
@@ -892,6 +1034,23 @@ namespace caspar {
 			tbb::atomic<unsigned int>		frames_left_;
 			std::unique_ptr<ffmpeg_consumer> consumer_;
 			std::unique_ptr<ffmpeg_consumer> key_only_consumer_;
+			std::shared_ptr<core::monitor::subject> monitor_subject_;
+
+			// A recording rotated into files of rotate_duration_ seconds each. The next file is opened ahead on 
+			// rotate_executor_ and the previous one is finished there, so the channel only ever switches pointers.
+			struct output_files
+			{
+				std::unique_ptr<ffmpeg_consumer> fill;
+				std::unique_ptr<ffmpeg_consumer> key;
+			};
+			const double					rotate_duration_;
+			core::video_format_desc			format_desc_;
+			int								channel_index_;
+			int								rotate_frames_;
+			int64_t							first_frame_number_;
+			int								file_index_;
+			boost::unique_future<std::shared_ptr<output_files>> next_files_;
+			executor						rotate_executor_;
 		public:
 
 			ffmpeg_consumer_proxy(
@@ -900,7 +1059,8 @@ namespace caspar {
 				core::recorder* const recorder = nullptr, 
 				const int tc_in = 0, 
 				const int tc_out = std::numeric_limits<int>().max(), 
-				const unsigned int frame_limit = std::numeric_limits<unsigned int>().max())
+				const unsigned int frame_limit = std::numeric_limits<unsigned int>().max(),
+				const double rotate_duration = 0.0)
 				: output_params_(std::move(output_params))
 				, separate_key_(separate_key)
 				, index_(FFMPEG_CONSUMER_BASE_INDEX + crc16(boost::to_lower_copy(output_params.file_name_)))
@@ -908,30 +1068,141 @@ namespace caspar {
 				, tc_out_(tc_out)
 				, recorder_(recorder)
 				, recording_(tc_out == std::numeric_limits<int>().max())
+				, rotate_duration_(output_params_.is_stream_ || output_params_.is_segmented() ? 0.0 : rotate_duration)
+				, channel_index_(0)
+				, rotate_frames_(0)
+				, first_frame_number_(-1)
+				, file_index_(0)
+				, rotate_executor_(L"ffmpeg_consumer rotation")
 			{
 				frames_left_ = frame_limit;
 			}
 
-			virtual void initialize(const core::video_format_desc& format_desc, int)
+			~ffmpeg_consumer_proxy()
 			{
-				consumer_.reset(new ffmpeg_consumer(
-					format_desc,
-					output_params_,
+				discard_next_files();
+			}
+
+			virtual void initialize(const core::video_format_desc& format_desc, int channel_index)
+			{
+				discard_next_files();
+
+				format_desc_ = format_desc;
+				channel_index_ = channel_index;
+				rotate_frames_ = rotate_duration_ > 0.0 ? std::max(1, static_cast<int>(rotate_duration_ * format_desc.fps + 0.5)) : 0;
+				first_frame_number_ = -1;
+
+				auto files = open_files(rotate_frames_ > 0 ? rotated_file_name(file_index_++) : output_params_.file_name_);
+				consumer_ = std::move(files->fill);
+				key_only_consumer_ = std::move(files->key);
+
+				if (rotate_frames_ > 0)
+					open_next_files();
+			}
+
+			std::string rotated_file_name(int index) const
+			{
+				boost::filesystem::path file(output_params_.file_name_);
+				auto extension = file.extension();
+				std::ostringstream name;
+				name << output_params_.file_name_.substr(0, output_params_.file_name_.size() - extension.size()) 
+					 << "_" << std::setw(4) << std::setfill('0') << index << extension;
+				return name.str();
+			}
+
+			std::shared_ptr<output_files> open_files(const std::string& file_name) const
+			{
+				auto params = output_params_.for_file(file_name);
+				auto offline = core::is_offline_channel(channel_index_);
+
+				auto files = std::make_shared<output_files>();
+				files->fill.reset(new ffmpeg_consumer(
+					format_desc_,
+					channel_index_,
+					offline ? params.for_offline_channel() : params,
 					false
 				));
 				if (separate_key_)
-				{
-					boost::filesystem::path fill_file(output_params_.file_name_);
-					auto without_extension = fill_file.stem();
-					auto key_file = narrow(env::media_folder()) + without_extension + "_A" + fill_file.extension();
-					key_only_consumer_.reset(new ffmpeg_consumer(
-						format_desc,
-						output_params_,
+					files->key.reset(new ffmpeg_consumer(
+						format_desc_,
+						channel_index_,
+						offline ? params.for_offline_channel() : params,
 						true
 					));
+				return files;
+			}
+
+			void open_next_files()
+			{
+				auto file_name = rotated_file_name(file_index_++);
+				next_files_ = rotate_executor_.begin_invoke([=]
+				{
+					return open_files(file_name);
+				});
+			}
+
+			// Switches to the next files on the first frame of each period. A new encoder starts on a keyframe, 
+			// so every file starts on the frame it is meant to. A file that could not be opened in time is 
+			// waited for, one that failed to open leaves the recording in the current files for another period.
+			void rotate(const safe_ptr<core::read_frame>& frame)
+			{
+				auto frame_number = get_channel_frame_number(channel_index_, frame);
+				if (first_frame_number_ < 0)
+					first_frame_number_ = frame_number;
+				if (frame_number == first_frame_number_ || (frame_number - first_frame_number_) % rotate_frames_ != 0)
+					return;
+
+				std::shared_ptr<output_files> next;
+				try
+				{
+					next = next_files_.get();
 				}
-				else
-					key_only_consumer_.reset();
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+					CASPAR_LOG(warning) << print() << L" Could not open the next file, the recording continues in this one.";
+				}
+
+				if (next)
+				{
+					auto previous = std::make_shared<output_files>();
+					previous->fill = std::move(consumer_);
+					previous->key = std::move(key_only_consumer_);
+					consumer_ = std::move(next->fill);
+					key_only_consumer_ = std::move(next->key);
+
+					rotate_executor_.begin_invoke([previous]
+					{
+						// Flushes the encoders and writes the trailer.
+						previous->fill.reset();
+						previous->key.reset();
+					});
+
+					CASPAR_LOG(info) << print() << L" Started.";
+				}
+
+				open_next_files();
+			}
+
+			// Files opened ahead that never got a frame are removed again.
+			void discard_next_files()
+			{
+				if (next_files_.get_state() == boost::future_state::uninitialized)
+					return;
+
+				try
+				{
+					auto next = next_files_.get();
+					auto file_name = next->fill->output_params_.file_name_;
+					next.reset();
+					boost::filesystem::remove(file_name);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				next_files_ = boost::unique_future<std::shared_ptr<output_files>>();
 			}
 
 			virtual int64_t presentation_frame_age_millis() const override
@@ -941,10 +1212,13 @@ namespace caspar {
 
 			virtual boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame) override
 			{
-				bool ready_for_frame = consumer_->ready_for_frame();
+				if (rotate_frames_ > 0)
+					rotate(frame);
+
+				bool ready_for_frame = consumer_->accepts_frame();
 
 				if (ready_for_frame && separate_key_)
-					ready_for_frame = ready_for_frame && key_only_consumer_->ready_for_frame();
+					ready_for_frame = ready_for_frame && key_only_consumer_->accepts_frame();
 
 				if (ready_for_frame)
 				{
@@ -980,10 +1254,17 @@ namespace caspar {
 				}
 				else
 				{
-					consumer_->mark_dropped();
+					consumer_->mark_dropped(frame);
 					if (separate_key_)
-						key_only_consumer_->mark_dropped();
+						key_only_consumer_->mark_dropped(frame);
 				}
+
+				if (monitor_subject_)
+				{
+					*monitor_subject_ << core::monitor::message("/dropped") % static_cast<int64_t>(consumer_->dropped_frames_)
+									  << core::monitor::message("/duplicated") % static_cast<int64_t>(consumer_->duplicated_frames_);
+				}
+
 				return caspar::wrap_as_future(true);
 			}
 
@@ -998,6 +1279,20 @@ namespace caspar {
 				info.add(L"type", L"ffmpeg_consumer");
 				info.add(L"filename", widen(output_params_.file_name_));
 				info.add(L"separate_key", separate_key_);
+				info.add(L"drop-policy", get_drop_policy(output_params_.drop_policy_));
+				if (rotate_frames_ > 0)
+					info.add(L"rotate-duration", rotate_duration_);
+				if (consumer_)
+				{
+					if (rotate_frames_ > 0)
+						info.add(L"current-file", widen(consumer_->output_params_.file_name_));
+					info.add(L"dropped-frames", static_cast<int64_t>(consumer_->dropped_frames_));
+					info.add(L"duplicated-frames", static_cast<int64_t>(consumer_->duplicated_frames_));
+					if (auto capture_io = consumer_->capture_io_)
+						info.add_child(L"writer", capture_io->info());
+					if (auto stream_io = consumer_->stream_io_)
+						info.add_child(L"writer", stream_io->info());
+				}
 				return info;
 			}
 
@@ -1011,11 +1306,21 @@ namespace caspar {
 				return 1;
 			}
 
+			virtual uint32_t held_frames() const override
+			{
+				return static_cast<uint32_t>(output_params_.drop_policy_ == drop_policy::drop_oldest ? FRAME_QUEUE_CAPACITY * 2 : FRAME_QUEUE_CAPACITY);
+			}
+
 			virtual int index() const override
 			{
 				return index_;
 			}
 
+			virtual void set_monitor_output(const safe_ptr<core::monitor::subject>& subject) override
+			{
+				monitor_subject_ = subject;
+			}
+
 			void set_frame_limit(unsigned int frame_limit)
 			{
 				frames_left_ = frame_limit;
@@ -1111,6 +1416,9 @@ namespace caspar {
 			auto vrate = params.get(L"VRATE", 0);
 			auto narrow_aspect_ratio = params.get(L"NARROW", false);
 			auto filter = params.get_original(L"FILTER");
+			auto segment_duration = params.get(L"SEGMENT_DURATION", 0.0);
+			auto policy = params.get(L"DROP_POLICY", L"");
+			auto rotate_duration = params.get(L"ROTATE", 0.0);
 
 			output_params op(
 				file_path_is_complete ? filename : narrow(env::media_folder()) + filename,
@@ -1127,8 +1435,10 @@ namespace caspar {
 				arate,
 				vrate,
 				std::string("00:00:00:00"),
-				narrow(filter));
-			return make_safe<ffmpeg_consumer_proxy>(op, separate_key);
+				narrow(filter),
+				segment_duration,
+				policy);
+			return make_safe<ffmpeg_consumer_proxy>(op, separate_key, nullptr, 0, std::numeric_limits<int>().max(), std::numeric_limits<unsigned int>().max(), rotate_duration);
 		}
 
 		safe_ptr<core::frame_consumer> create_consumer(const boost::property_tree::wptree& ptree)
@@ -1146,6 +1456,8 @@ namespace caspar {
 			auto audio_stream_id = ptree.get(L"audio_stream_id", 1);
 			auto video_stream_id = ptree.get(L"video_stream_id", 0);
 			auto filter = ptree.get(L"filter", L"");
+			auto segment_duration = ptree.get(L"segment-duration", 0.0);
+			auto policy = ptree.get(L"drop-policy", L"");
 
 			output_params op(
 				filename,
@@ -1162,7 +1474,9 @@ namespace caspar {
 				arate,
 				vrate,
 				std::string("00:00:00:00"),
-				narrow(filter));
+				narrow(filter),
+				segment_duration,
+				policy);
 			return make_safe<ffmpeg_consumer_proxy>(op, separate_key);
 		}
 
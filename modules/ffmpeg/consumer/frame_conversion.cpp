@@ -0,0 +1,606 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../StdAfx.h"
+
+#include "frame_conversion.h"
+
+#include "../ffmpeg_error.h"
+#include "../producer/filter/filter.h"
+
+#include <core/mixer/read_frame.h>
+#include <core/video_format.h>
+
+#include <common/env.h>
+#include <common/concurrency/parallel_arena.h>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/range/algorithm_ext.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
+#include <tbb/parallel_for.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+
+namespace caspar { namespace ffmpeg {
+
+static const size_t MAX_PENDING_CONVERSIONS = 32;
+
+typedef std::unique_ptr<SwsContext, std::function<void(SwsContext *)>> SwsContextPtr;
+typedef std::unique_ptr<SwrContext, std::function<void(SwrContext *)>> SwrContextPtr;
+
+static int get_scale_slice_count(const core::video_format_desc& format)
+{
+	bool interlaced = format.field_mode != caspar::core::field_mode::progressive;
+	int result = 1;
+	int max = format.height <= 576 ? 2 : 16;
+	while (result < max
+		&& format.height  % (result * (interlaced  ? 4 : 2)) == 0)
+		result *= 2;
+	return result;
+}
+
+static int64_t get_channel_layout_bitmask(int num_channels)
+{
+	if (num_channels > 63)
+		BOOST_THROW_EXCEPTION(caspar_exception("FFMpeg cannot handle more than 63 audio channels"));
+	const auto ALL_63_CHANNELS = 0x7FFFFFFFFFFFFFFFULL;
+	auto to_shift = 63 - num_channels;
+	auto result = ALL_63_CHANNELS >> to_shift;
+	return static_cast<int64_t>(result);
+}
+
+// Keeps the frames submitted by the consumers sharing a conversion and converts them in submission order, 
+// whichever consumer gets to a frame first does the work and the others pick up the result.
+template<typename T>
+class ordered_conversion : boost::noncopyable
+{
+	struct entry
+	{
+		const core::read_frame*				frame;
+		std::weak_ptr<core::read_frame>		weak_frame;
+		tbb::atomic<bool>					done;
+		T									result;
+	};
+
+	const std::function<T(const safe_ptr<core::read_frame>&)>	convert_;
+	const T										empty_;
+
+	tbb::mutex									entries_mutex_;
+	std::deque<std::shared_ptr<entry>>			entries_;
+	tbb::mutex									convert_mutex_;
+public:
+	ordered_conversion(const std::function<T(const safe_ptr<core::read_frame>&)>& convert, const T& empty)
+		: convert_(convert)
+		, empty_(empty)
+	{
+	}
+
+	void submit(const safe_ptr<core::read_frame>& frame)
+	{
+		tbb::mutex::scoped_lock lock(entries_mutex_);
+
+		BOOST_FOREACH(auto& item, entries_)
+		{
+			if (item->frame == frame.get() && !item->weak_frame.expired())
+				return;
+		}
+
+		auto item = std::make_shared<entry>();
+		item->frame = frame.get();
+		item->weak_frame = frame;
+		item->done = false;
+		item->result = empty_;
+		entries_.push_back(item);
+
+		trim();
+	}
+
+	T convert(const safe_ptr<core::read_frame>& frame)
+	{
+		tbb::mutex::scoped_lock convert_lock(convert_mutex_);
+
+		std::vector<std::shared_ptr<entry>> pending;
+		std::shared_ptr<entry> target;
+		{
+			tbb::mutex::scoped_lock lock(entries_mutex_);
+			BOOST_FOREACH(auto& item, entries_)
+			{
+				if (!item->done)
+					pending.push_back(item);
+				if (item->frame == frame.get() && !item->weak_frame.expired())
+				{
+					target = item;
+					break;
+				}
+			}
+		}
+
+		if (!target)
+			return convert_(frame);
+
+		BOOST_FOREACH(auto& item, pending)
+		{
+			auto pending_frame = item->weak_frame.lock();
+			if (pending_frame)
+				item->result = convert_(make_safe_ptr(pending_frame));
+			item->done = true;
+		}
+
+		auto result = target->result;
+
+		tbb::mutex::scoped_lock lock(entries_mutex_);
+		trim();
+
+		return result;
+	}
+private:
+	void trim()
+	{
+		// Once every consumer has let go of a frame nobody can ask for it anymore.
+		while (!entries_.empty() && (entries_.front()->weak_frame.expired() || entries_.size() > MAX_PENDING_CONVERSIONS))
+			entries_.pop_front();
+	}
+};
+
+struct video_conversion::implementation : boost::noncopyable
+{
+	const core::video_format_desc					format_desc_;
+	const bool										key_only_;
+	const int										height_;
+
+	// fast path
+	const AVPixelFormat								pix_fmt_;
+	const int										width_;
+	const int										out_height_;
+	const bool										is_imx50_pal_;
+	const size_t									scale_slices_;
+	const int										scale_slice_height_;
+	std::vector<SwsContextPtr>						sws_;
+	std::shared_ptr<AVBufferPool>					buffer_pool_;
+
+	// filtered path
+	std::shared_ptr<filter>							filter_;
+	const AVRational								sample_aspect_ratio_;
+	int64_t											in_frame_number_;
+	bool											logged_packed_;
+
+	ordered_conversion<std::vector<safe_ptr<AVFrame>>>	conversion_;
+
+	implementation(const core::video_format_desc& format_desc, bool key_only, AVPixelFormat pix_fmt, int width, int height, bool imx50)
+		: format_desc_(format_desc)
+		, key_only_(key_only)
+		, height_(format_desc.format == core::video_format::ntsc ? 480 : format_desc.height)
+		, pix_fmt_(pix_fmt)
+		, width_(width)
+		, out_height_(height)
+		, is_imx50_pal_(imx50)
+		, scale_slices_(get_scale_slice_count(format_desc))
+		, scale_slice_height_(height_ / scale_slices_)
+		, sample_aspect_ratio_(av_make_q(1, 1))
+		, in_frame_number_(0)
+		, logged_packed_(false)
+		, conversion_([this](const safe_ptr<core::read_frame>& frame) { return fast_convert(frame); }, std::vector<safe_ptr<AVFrame>>())
+	{
+		const int slice_height = format_desc_.field_mode == core::field_mode::progressive ? scale_slice_height_ : scale_slice_height_ / 2;
+		for (size_t i = 0; i < scale_slices_; i++)
+		{
+			sws_.push_back(SwsContextPtr(
+				sws_getContext(format_desc_.width, slice_height, AV_PIX_FMT_BGRA, format_desc_.width, slice_height, pix_fmt_, 0, nullptr, nullptr, NULL),
+				[](SwsContext * ctx) { sws_freeContext(ctx); }));
+			if (!sws_.back())
+				BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot initialize the conversion context"));
+		}
+
+		buffer_pool_.reset(av_buffer_pool_init(av_image_get_buffer_size(pix_fmt_, width_, out_height_, 16), nullptr), [](AVBufferPool* pool) { av_buffer_pool_uninit(&pool); });
+		if (!buffer_pool_)
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot allocate the picture buffers"));
+	}
+
+	implementation(const core::video_format_desc& format_desc, bool key_only, AVRational sample_aspect_ratio, AVPixelFormat pix_fmt, const std::string& filter_str)
+		: format_desc_(format_desc)
+		, key_only_(key_only)
+		, height_(format_desc.format == core::video_format::ntsc ? 480 : format_desc.height)
+		, pix_fmt_(pix_fmt)
+		, width_(format_desc.width)
+		, out_height_(height_)
+		, is_imx50_pal_(false)
+		, scale_slices_(0)
+		, scale_slice_height_(0)
+		, sample_aspect_ratio_(sample_aspect_ratio)
+		, in_frame_number_(0)
+		, logged_packed_(false)
+		, conversion_([this](const safe_ptr<core::read_frame>& frame) { return filter_convert(*frame); }, std::vector<safe_ptr<AVFrame>>())
+	{
+		std::vector<AVPixelFormat> pix_fmts;
+		pix_fmts.push_back(pix_fmt);
+		filter_.reset(new filter(
+			format_desc.width,
+			format_desc.height,
+			av_make_q(format_desc.duration, format_desc.time_scale),
+			av_make_q(format_desc.time_scale, format_desc.duration),
+			sample_aspect_ratio,
+			AV_PIX_FMT_BGRA,
+			pix_fmts,
+			filter_str
+		));
+	}
+
+	bool is_packed_nv12(core::read_frame& frame) const
+	{
+		return !key_only_
+			&& pix_fmt_ == AV_PIX_FMT_NV12
+			&& frame.packing() == core::output_packing::nv12
+			&& width_ == static_cast<int>(format_desc_.width)
+			&& out_height_ == static_cast<int>(format_desc_.height)
+			&& static_cast<size_t>(frame.packed_image_data().size()) == core::get_packed_size(core::output_packing::nv12, format_desc_.width, format_desc_.height);
+	}
+
+	// Hands the nv12 image the mixer packed on the gpu to the encoder as it is, the frame is kept alive by the buffer.
+	std::vector<safe_ptr<AVFrame>> wrap_packed(const safe_ptr<core::read_frame>& frame)
+	{
+		if (!logged_packed_)
+		{
+			CASPAR_LOG(info) << L"[frame_conversion] Encoding the nv12 image packed by the mixer without conversion.";
+			logged_packed_ = true;
+		}
+
+		auto image = frame->packed_image_data();
+		auto owner = new safe_ptr<core::read_frame>(frame);
+		auto buffer = av_buffer_create(const_cast<uint8_t*>(image.begin()), static_cast<int>(image.size()), [](void* opaque, uint8_t*)
+		{
+			delete static_cast<safe_ptr<core::read_frame>*>(opaque);
+		}, owner, AV_BUFFER_FLAG_READONLY);
+		if (!buffer)
+		{
+			delete owner;
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot reference the packed image") << boost::errinfo_api_function("av_buffer_create"));
+		}
+
+		std::shared_ptr<AVFrame> out_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
+		out_frame->buf[0] = buffer;
+		av_image_fill_arrays(out_frame->data, out_frame->linesize, buffer->data, AV_PIX_FMT_NV12, width_, out_height_, 1);
+		out_frame->height = out_height_;
+		out_frame->width = width_;
+		out_frame->format = AV_PIX_FMT_NV12;
+		out_frame->interlaced_frame = format_desc_.field_mode != core::field_mode::progressive;
+		out_frame->top_field_first = format_desc_.field_mode == core::field_mode::upper;
+		out_frame->pts = in_frame_number_++;
+
+		std::vector<safe_ptr<AVFrame>> result;
+		result.push_back(make_safe_ptr(out_frame));
+		return result;
+	}
+
+	std::vector<safe_ptr<AVFrame>> fast_convert(const safe_ptr<core::read_frame>& read_frame)
+	{
+		if (is_packed_nv12(*read_frame))
+			return wrap_packed(read_frame);
+
+		auto& frame = *read_frame;
+
+		AVFrame in_frame = { 0 };
+		auto image = key_only_ ? frame.key_image_data() : frame.image_data();
+		av_image_fill_arrays(in_frame.data, in_frame.linesize, const_cast<uint8_t*>(image.begin()), AV_PIX_FMT_BGRA, format_desc_.width, format_desc_.height, 16);
+
+		std::shared_ptr<AVFrame> out_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
+		
+		// Pooled buffers keep the frame reference counted, so every encoder sharing it can take its own reference.
+		out_frame->buf[0] = av_buffer_pool_get(buffer_pool_.get());
+		if (!out_frame->buf[0])
+			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot allocate the picture buffer"));
+		av_image_fill_arrays(out_frame->data, out_frame->linesize, out_frame->buf[0]->data, pix_fmt_, width_, out_height_, 16);
+
+		if (is_imx50_pal_ || width_ != format_desc_.width || out_height_ != height_) // parts of the picture are never written
+		{
+			ptrdiff_t linesizes[4];
+			for (int i = 0; i < 4; i++)
+				linesizes[i] = out_frame->linesize[i];
+			av_image_fill_black(out_frame->data, linesizes, pix_fmt_, AVCOL_RANGE_MPEG, width_, out_height_);
+		}
+
+		arena_parallel_for(0u, scale_slices_, [&](const size_t& sws_index) 
+		{
+			if (format_desc_.field_mode == caspar::core::field_mode::progressive)
+			{
+				uint8_t *in_data[4];
+				uint8_t *out_data[4];
+				for (size_t i = 0; i < 4; i++)
+				{
+					auto in_offset = sws_index * scale_slice_height_ * in_frame.linesize[i];
+					in_data[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset;
+					auto out_offset = sws_index * scale_slice_height_  * out_frame->linesize[i] / ((i > 0 && out_frame->linesize[i] != 0 && pix_fmt_ == AV_PIX_FMT_YUV420P) ? 2 : 1);
+					auto strange_adjustmenst = (i > 0 && scale_slices_ % 8 == 0 && pix_fmt_ == AV_PIX_FMT_YUV420P && (height_ == 720 || height_ % 1080 == 0) && (sws_index % 2 != 0) ? out_frame->linesize[i] / 2 : 0);
+					out_data[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset + strange_adjustmenst;
+				}
+				sws_scale(sws_.at(sws_index).get(), in_data, in_frame.linesize, 0, scale_slice_height_  , out_data, out_frame->linesize);
+			}
+			else
+			{
+				uint8_t * in_data_upper[4];
+				uint8_t * in_data_lower[4];
+				int in_stride[4];
+				uint8_t * out_data_upper[4];
+				uint8_t * out_data_lower[4];
+				int out_stride[4];
+				for (uint32_t i = 0; i < 4; i++)
+				{
+					auto in_offset_upper = sws_index * scale_slice_height_ * in_frame.linesize[i];
+					auto in_offset_lower = in_offset_upper + in_frame.linesize[i];
+					in_data_upper[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset_upper;
+					in_data_lower[i] = in_frame.data[i] == NULL ? NULL : in_frame.data[i] + in_offset_lower;
+					auto out_offset_upper = (sws_index * scale_slice_height_  * out_frame->linesize[i] / ((i > 0 && out_frame->linesize[i] != 0 && pix_fmt_ == AV_PIX_FMT_YUV420P) ? 2 : 1)) + (is_imx50_pal_ ? 32 * out_frame->linesize[i] : 0);
+					auto out_offset_lower = out_offset_upper + out_frame->linesize[i];
+					auto strange_adjustmenst = (i > 0 && scale_slices_ % 8 == 0 && pix_fmt_ == AV_PIX_FMT_YUV420P && (height_ == 720 || height_ % 1080 == 0) && (sws_index % 2 != 0) ? out_frame->linesize[i] / 2 : 0);
+					out_data_upper[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset_upper + strange_adjustmenst;
+					out_data_lower[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + out_offset_lower + strange_adjustmenst;
+					in_stride[i] = in_frame.linesize[i] * 2;
+					out_stride[i] = out_frame->linesize[i] * 2;
+				}
+				sws_scale(sws_.at(sws_index).get(), in_data_upper, in_stride, 0, scale_slice_height_  / 2, out_data_upper, out_stride);
+				sws_scale(sws_.at(sws_index).get(), in_data_lower, in_stride, 0, scale_slice_height_  / 2, out_data_lower, out_stride);
+			}
+		});
+		out_frame->height = out_height_;
+		out_frame->width = width_;
+		out_frame->format = pix_fmt_;
+		out_frame->interlaced_frame = format_desc_.field_mode != core::field_mode::progressive;
+		out_frame->top_field_first = format_desc_.field_mode == core::field_mode::upper;
+		out_frame->pts = in_frame_number_++;
+
+		std::vector<safe_ptr<AVFrame>> result;
+		result.push_back(make_safe_ptr(out_frame));
+		return result;
+	}
+
+	std::vector<safe_ptr<AVFrame>> filter_convert(core::read_frame& frame)
+	{
+		std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
+		av_frame->width = format_desc_.width;
+		av_frame->height = height_;
+		av_frame->format = AV_PIX_FMT_BGRA;
+		av_frame->sample_aspect_ratio = sample_aspect_ratio_;
+		av_frame->interlaced_frame = format_desc_.field_mode != core::field_mode::progressive;
+		av_frame->top_field_first = format_desc_.field_mode == core::field_mode::upper;
+		av_frame->pts = in_frame_number_++;
+		auto image = key_only_ ? frame.key_image_data() : frame.image_data();
+		av_image_fill_arrays(av_frame->data, av_frame->linesize, const_cast<uint8_t*>(image.begin()), AV_PIX_FMT_BGRA, format_desc_.width, height_, 16);
+		filter_->push(av_frame);
+		return filter_->poll_all();
+	}
+
+	std::vector<safe_ptr<AVFrame>> flush()
+	{
+		return filter_ ? filter_->poll_all() : std::vector<safe_ptr<AVFrame>>();
+	}
+};
+
+video_conversion::video_conversion(const core::video_format_desc& format_desc, bool key_only, AVPixelFormat pix_fmt, int width, int height, bool imx50)
+	: impl_(new implementation(format_desc, key_only, pix_fmt, width, height, imx50)){}
+video_conversion::video_conversion(const core::video_format_desc& format_desc, bool key_only, AVRational sample_aspect_ratio, AVPixelFormat pix_fmt, const std::string& filter_str)
+	: impl_(new implementation(format_desc, key_only, sample_aspect_ratio, pix_fmt, filter_str)){}
+void video_conversion::submit(const safe_ptr<core::read_frame>& frame){impl_->conversion_.submit(frame);}
+std::vector<safe_ptr<AVFrame>> video_conversion::convert(const safe_ptr<core::read_frame>& frame){return impl_->conversion_.convert(frame);}
+std::vector<safe_ptr<AVFrame>> video_conversion::flush(){return impl_->flush();}
+bool video_conversion::is_filtered() const{return impl_->filter_ != nullptr;}
+int video_conversion::out_width() const{return impl_->filter_ ? impl_->filter_->out_width() : impl_->width_;}
+int video_conversion::out_height() const{return impl_->filter_ ? impl_->filter_->out_height() : impl_->out_height_;}
+AVPixelFormat video_conversion::out_pixel_format() const{return impl_->filter_ ? impl_->filter_->out_pixel_format() : impl_->pix_fmt_;}
+AVRational video_conversion::out_frame_rate() const{return impl_->filter_ ? impl_->filter_->out_frame_rate() : av_make_q(impl_->format_desc_.time_scale, impl_->format_desc_.duration);}
+AVRational video_conversion::out_time_base() const{return impl_->filter_ ? impl_->filter_->out_time_base() : av_make_q(impl_->format_desc_.duration, impl_->format_desc_.time_scale);}
+AVRational video_conversion::out_sample_aspect_ratio() const{return impl_->filter_ ? impl_->filter_->out_sample_aspect_ratio() : impl_->sample_aspect_ratio_;}
+
+struct audio_conversion::implementation : boost::noncopyable
+{
+	const core::video_format_desc						format_desc_;
+	const int											channels_;
+	const AVSampleFormat								sample_fmt_;
+	const int											sample_rate_;
+	const bool											is_planar_;
+
+	SwrContextPtr										swr_;
+	int													last_frame_no_channels_;
+
+	ordered_conversion<std::shared_ptr<const std::vector<byte_vector>>>	conversion_;
+
+	implementation(const core::video_format_desc& format_desc, int channels, AVSampleFormat sample_fmt, int sample_rate)
+		: format_desc_(format_desc)
+		, channels_(channels)
+		, sample_fmt_(sample_fmt)
+		, sample_rate_(sample_rate)
+		, is_planar_(av_sample_fmt_is_planar(sample_fmt) != 0)
+		, last_frame_no_channels_(0)
+		, conversion_([this](const safe_ptr<core::read_frame>& frame) { return resample(*frame); }, nullptr)
+	{
+	}
+
+	std::shared_ptr<const std::vector<byte_vector>> resample(core::read_frame& frame)
+	{
+		if (!swr_ || last_frame_no_channels_ != frame.num_channels())
+		{
+			uint64_t out_channel_layout = av_get_default_channel_layout(channels_);
+			uint64_t in_channel_layout = get_channel_layout_bitmask(frame.num_channels());
+			swr_ = SwrContextPtr(
+				swr_alloc_set_opts(nullptr,
+					out_channel_layout,
+					sample_fmt_,
+					sample_rate_,
+					in_channel_layout,
+					AV_SAMPLE_FMT_S32,
+					format_desc_.audio_sample_rate,
+					0, nullptr),
+				[](SwrContext * ctx) {swr_free(&ctx); });
+			if (!swr_)
+				BOOST_THROW_EXCEPTION(caspar_exception()
+					<< msg_info("Cannot alloc audio resampler"));
+			THROW_ON_ERROR2(swr_init(swr_.get()), "[audio_conversion]");
+			last_frame_no_channels_ = frame.num_channels();
+		}
+		auto out_buffers = std::make_shared<std::vector<byte_vector>>(is_planar_ ? channels_ : 1);
+		const int in_samples_count = frame.audio_data().size() / frame.num_channels();
+		const int out_samples_count = static_cast<int>(av_rescale_rnd(in_samples_count, sample_rate_, format_desc_.audio_sample_rate, AV_ROUND_UP));
+		if (is_planar_)
+			for (int i = 0; i < channels_; i++)
+				(*out_buffers)[i].resize(out_samples_count * av_get_bytes_per_sample(AV_SAMPLE_FMT_S32));
+		else
+			(*out_buffers)[0].resize(out_samples_count * av_get_bytes_per_sample(AV_SAMPLE_FMT_S32) * channels_);
+
+		const uint8_t* in[] = { reinterpret_cast<const uint8_t*>(frame.audio_data().begin()) };
+		uint8_t*       out[AV_NUM_DATA_POINTERS] = { 0 };
+		for (size_t i = 0; i < out_buffers->size(); i++)
+			out[i] = (*out_buffers)[i].data();
+
+		int converted_sample_count = swr_convert(swr_.get(),
+			out, out_samples_count,
+			in, in_samples_count);
+		if (is_planar_)
+			for (int i = 0; i < channels_; i++)
+				(*out_buffers)[i].resize(converted_sample_count * av_get_bytes_per_sample(sample_fmt_));
+		else
+			(*out_buffers)[0].resize(converted_sample_count * av_get_bytes_per_sample(sample_fmt_) * channels_);
+		return out_buffers;
+	}
+};
+
+audio_conversion::audio_conversion(const core::video_format_desc& format_desc, int channels, AVSampleFormat sample_fmt, int sample_rate)
+	: impl_(new implementation(format_desc, channels, sample_fmt, sample_rate)){}
+void audio_conversion::submit(const safe_ptr<core::read_frame>& frame){impl_->conversion_.submit(frame);}
+safe_ptr<const std::vector<byte_vector>> audio_conversion::convert(const safe_ptr<core::read_frame>& frame)
+{
+	auto result = impl_->conversion_.convert(frame);
+	if (!result)
+		BOOST_THROW_EXCEPTION(invalid_operation() << msg_info("Audio frame conversion failed."));
+	return make_safe_ptr(result);
+}
+
+template<typename T>
+class conversion_registry : boost::noncopyable
+{
+	tbb::mutex								mutex_;
+	std::map<std::string, std::weak_ptr<T>>	conversions_;
+	tbb::atomic<int>						unshared_;
+public:
+	conversion_registry()
+	{
+		unshared_ = 0;
+	}
+
+	safe_ptr<T> get(std::string key, const std::function<T*()>& factory)
+	{
+		if (!env::properties().get(L"configuration.ffmpeg.shared-conversion", true))
+			key += "|" + boost::lexical_cast<std::string>(++unshared_);
+	
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		// Drop the ones whose consumers are all gone.
+		for (auto it = conversions_.begin(); it != conversions_.end();)
+		{
+			if (it->second.expired())
+				it = conversions_.erase(it);
+			else
+				++it;
+		}
+
+		auto existing = conversions_[key].lock();
+		if (existing)
+		{
+			CASPAR_LOG(debug) << L"[frame_conversion] Sharing conversion " << widen(key);
+			return make_safe_ptr(existing);
+		}
+
+		auto conversion = safe_ptr<T>(factory());
+		conversions_[key] = conversion;
+		return conversion;
+	}
+};
+
+static conversion_registry<video_conversion> g_video_conversions;
+static conversion_registry<audio_conversion> g_audio_conversions;
+
+static std::string get_format_key(int channel_index, const core::video_format_desc& format_desc)
+{
+	return boost::lexical_cast<std::string>(channel_index) + "|" + narrow(format_desc.name);
+}
+
+safe_ptr<video_conversion> get_video_conversion(int channel_index, const core::video_format_desc& format_desc, bool key_only, AVPixelFormat pix_fmt, int width, int height, bool imx50)
+{
+	auto key = get_format_key(channel_index, format_desc)
+		+ "|" + (key_only ? "key" : "fill")
+		+ "|" + boost::lexical_cast<std::string>(static_cast<int>(pix_fmt))
+		+ "|" + boost::lexical_cast<std::string>(width) + "x" + boost::lexical_cast<std::string>(height)
+		+ (imx50 ? "|imx50" : "");
+	return g_video_conversions.get(key, [&] { return new video_conversion(format_desc, key_only, pix_fmt, width, height, imx50); });
+}
+
+safe_ptr<video_conversion> get_filtered_video_conversion(int channel_index, const core::video_format_desc& format_desc, bool key_only, AVRational sample_aspect_ratio, AVPixelFormat pix_fmt, const std::string& filter_str)
+{
+	auto key = get_format_key(channel_index, format_desc)
+		+ "|" + (key_only ? "key" : "fill")
+		+ "|" + boost::lexical_cast<std::string>(static_cast<int>(pix_fmt))
+		+ "|" + boost::lexical_cast<std::string>(sample_aspect_ratio.num) + ":" + boost::lexical_cast<std::string>(sample_aspect_ratio.den)
+		+ "|" + filter_str;
+	return g_video_conversions.get(key, [&] { return new video_conversion(format_desc, key_only, sample_aspect_ratio, pix_fmt, filter_str); });
+}
+
+struct channel_clock
+{
+	const core::read_frame*			frame;
+	std::weak_ptr<core::read_frame>	weak_frame;
+	int64_t							number;
+
+	channel_clock()
+		: frame(nullptr)
+		, number(-1)
+	{
+	}
+};
+
+static tbb::mutex					g_clock_mutex;
+static std::map<int, channel_clock>	g_channel_clocks;
+
+int64_t get_channel_frame_number(int channel_index, const safe_ptr<core::read_frame>& frame)
+{
+	tbb::mutex::scoped_lock lock(g_clock_mutex);
+
+	auto& clock = g_channel_clocks[channel_index];
+	if (clock.frame != frame.get() || clock.weak_frame.expired())
+	{
+		clock.frame = frame.get();
+		clock.weak_frame = frame;
+		++clock.number;
+	}
+	return clock.number;
+}
+
+safe_ptr<audio_conversion> get_audio_conversion(int channel_index, const core::video_format_desc& format_desc, int channels, AVSampleFormat sample_fmt, int sample_rate)
+{
+	auto key = get_format_key(channel_index, format_desc)
+		+ "|" + boost::lexical_cast<std::string>(channels)
+		+ "|" + boost::lexical_cast<std::string>(static_cast<int>(sample_fmt))
+		+ "|" + boost::lexical_cast<std::string>(sample_rate);
+	return g_audio_conversions.get(key, [&] { return new audio_conversion(format_desc, channels, sample_fmt, sample_rate); });
+}
+
+}}
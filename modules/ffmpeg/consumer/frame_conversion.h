@@ -0,0 +1,107 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+#include <common/memory/tagged_allocator.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <tbb/cache_aligned_allocator.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct AVFrame;
+struct AVRational;
+enum AVPixelFormat;
+enum AVSampleFormat;
+
+namespace caspar { 
+	
+namespace core {
+	
+class read_frame;
+struct video_format_desc;
+
+}
+
+namespace ffmpeg {
+
+typedef std::vector<uint8_t, tagged_allocator<uint8_t, allocation_subsystem::consumer, tbb::cache_aligned_allocator<uint8_t>>> byte_vector;
+
+// Converts the BGRA frames of a channel into one output format. Consumers on the same channel asking for the same 
+// format share one instance, so the colour conversion (or filter graph) runs once per frame no matter how many 
+// encoders are fed from it. Frames are converted in the order they were submitted, which keeps stateful filters
+// intact when the consumers sharing them run on separate threads.
+class video_conversion : boost::noncopyable
+{
+public:
+	video_conversion(const core::video_format_desc& format_desc, bool key_only, AVPixelFormat pix_fmt, int width, int height, bool imx50);
+	video_conversion(const core::video_format_desc& format_desc, bool key_only, AVRational sample_aspect_ratio, AVPixelFormat pix_fmt, const std::string& filter_str);
+
+	// Called in channel order from the sending thread, before the frame is handed to the encoder thread.
+	void submit(const safe_ptr<core::read_frame>& frame);
+
+	// The converted frames are shared between consumers and must not be modified, take a reference to restamp them.
+	std::vector<safe_ptr<AVFrame>> convert(const safe_ptr<core::read_frame>& frame);
+	std::vector<safe_ptr<AVFrame>> flush();
+
+	bool is_filtered() const;
+	int out_width() const;
+	int out_height() const;
+	AVPixelFormat out_pixel_format() const;
+	AVRational out_frame_rate() const;
+	AVRational out_time_base() const;
+	AVRational out_sample_aspect_ratio() const;
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+// Resamples the channel audio into one output format, shared in the same way as video_conversion.
+class audio_conversion : boost::noncopyable
+{
+public:
+	audio_conversion(const core::video_format_desc& format_desc, int channels, AVSampleFormat sample_fmt, int sample_rate);
+
+	void submit(const safe_ptr<core::read_frame>& frame);
+
+	// One buffer per plane, only the first one is used for packed sample formats.
+	safe_ptr<const std::vector<byte_vector>> convert(const safe_ptr<core::read_frame>& frame);
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+// Returns the conversion already used by another consumer on the channel if there is one, 
+// unless configuration.ffmpeg.shared-conversion is false.
+safe_ptr<video_conversion> get_video_conversion(int channel_index, const core::video_format_desc& format_desc, bool key_only, AVPixelFormat pix_fmt, int width, int height, bool imx50);
+safe_ptr<video_conversion> get_filtered_video_conversion(int channel_index, const core::video_format_desc& format_desc, bool key_only, AVRational sample_aspect_ratio, AVPixelFormat pix_fmt, const std::string& filter_str);
+safe_ptr<audio_conversion> get_audio_conversion(int channel_index, const core::video_format_desc& format_desc, int channels, AVSampleFormat sample_fmt, int sample_rate);
+
+// Counts the frames a channel has sent to its ffmpeg consumers, the same frame gives the same number to every consumer.
+int64_t get_channel_frame_number(int channel_index, const safe_ptr<core::read_frame>& frame);
+
+}}
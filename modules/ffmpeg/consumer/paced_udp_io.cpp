@@ -0,0 +1,378 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../StdAfx.h"
+
+#include "paced_udp_io.h"
+
+#include <boost/asio.hpp>
+
+#include <common/diagnostics/graph.h>
+#include <common/diagnostics/trace.h>
+#include <common/env.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+#include <common/utility/timer.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+
+#include <tbb/atomic.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avio.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+using namespace boost::asio::ip;
+
+namespace caspar { namespace ffmpeg {
+
+static const int	MIN_INTERVAL_US		= 250;
+static const int	MAX_INTERVAL_US		= 4000;
+static const double	DRAIN_SECONDS		= 1.0; // Sent after the muxer has closed, the rest is dropped.
+
+struct paced_udp_io::implementation : boost::noncopyable
+{
+	struct datagram
+	{
+		std::vector<uint8_t>	data;
+		size_t					size;
+	};
+
+	const safe_ptr<diagnostics::graph>	graph_;
+	const double						fps_;
+	std::string							host_;
+	std::string							port_;
+	size_t								packet_size_;
+	int									ttl_;
+	int									buffer_size_;
+	const double						bytes_per_us_;
+	const size_t						burst_;
+	int									interval_us_;
+
+	boost::asio::io_service				service_;
+	udp::socket							socket_;
+	udp::endpoint						endpoint_;
+
+	// Written by the muxer at tail_ and sent from head_, one thread each.
+	std::vector<datagram>				ring_;
+	tbb::atomic<size_t>					head_;
+	tbb::atomic<size_t>					tail_;
+
+	std::shared_ptr<AVIOContext>		context_;
+	tbb::atomic<bool>					running_;
+	boost::thread						thread_;
+
+	tbb::atomic<int64_t>				datagrams_sent_;
+	tbb::atomic<int64_t>				bytes_sent_;
+	tbb::atomic<int64_t>				send_errors_;
+	tbb::atomic<int64_t>				stalls_;
+	tbb::atomic<int64_t>				dropped_;
+	tbb::atomic<int64_t>				max_jitter_us_;
+	tbb::atomic<int64_t>				total_jitter_us_;
+	tbb::atomic<int64_t>				ticks_;
+
+	implementation(const std::string& url, int64_t bits_per_second, const safe_ptr<diagnostics::graph>& graph, double fps)
+		: graph_(graph)
+		, fps_(fps)
+		, packet_size_(1316) // 7 transport stream packets
+		, ttl_(-1)
+		, buffer_size_(0)
+		, bytes_per_us_(static_cast<double>(std::max<int64_t>(0, bits_per_second)) / 8000000.0)
+		, burst_(static_cast<size_t>(std::max(1, env::properties().get(L"configuration.ffmpeg.stream-pacing-burst", 4))))
+		, socket_(service_)
+	{
+		head_				= 0;
+		tail_				= 0;
+		running_			= true;
+		datagrams_sent_		= 0;
+		bytes_sent_			= 0;
+		send_errors_		= 0;
+		stalls_				= 0;
+		dropped_			= 0;
+		max_jitter_us_		= 0;
+		total_jitter_us_	= 0;
+		ticks_				= 0;
+
+		parse_url(url);
+
+		// A burst is sent every interval, so that the bucket never holds more than one.
+		interval_us_ = bytes_per_us_ > 0.0 
+			? std::max(MIN_INTERVAL_US, std::min(MAX_INTERVAL_US, static_cast<int>(burst_ * packet_size_ / bytes_per_us_)))
+			: 1000;
+
+		udp::resolver resolver(service_);
+		endpoint_ = *resolver.resolve(udp::resolver::query(udp::v4(), host_, port_));
+
+		socket_.open(udp::v4());
+		if(ttl_ >= 0)
+		{
+			if(endpoint_.address().is_multicast())
+				socket_.set_option(multicast::hops(ttl_));
+			else
+				socket_.set_option(unicast::hops(ttl_));
+		}
+		if(buffer_size_ > 0)
+			socket_.set_option(boost::asio::socket_base::send_buffer_size(buffer_size_));
+
+		ring_.resize(static_cast<size_t>(std::max(16, env::properties().get(L"configuration.ffmpeg.stream-pacing-ring", 4096))));
+		BOOST_FOREACH(auto& d, ring_)
+		{
+			d.data.resize(packet_size_);
+			d.size = 0;
+		}
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(packet_size_));
+		context_.reset(avio_alloc_context(buffer, static_cast<int>(packet_size_), 1, this, nullptr, &write_packet, nullptr), [](AVIOContext* context)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		});
+		context_->max_packet_size = static_cast<int>(packet_size_);
+		context_->seekable		  = 0;
+
+		graph_->set_color("send-jitter", diagnostics::color(0.3f, 0.9f, 0.9f));
+		graph_->set_color("send-queue", diagnostics::color(0.3f, 0.7f, 0.7f, 0.6f));
+		graph_->set_color("send-stall", diagnostics::color(0.5f, 0.9f, 0.9f));
+
+		thread_ = boost::thread([this]{run();});
+
+		CASPAR_LOG(info) << L"[paced_udp_io] Sending to " << widen(host_) << L":" << widen(port_) 
+						 << (bytes_per_us_ > 0.0 ? L" paced at " + boost::lexical_cast<std::wstring>(bits_per_second / 1000) + L" kbit/s" : L" unpaced")
+						 << L", " << burst_ << L" datagrams every " << interval_us_ << L" us.";
+	}
+
+	~implementation()
+	{
+		running_ = false;
+		thread_.join();
+
+		if(dropped_ > 0)
+			CASPAR_LOG(warning) << L"[paced_udp_io] " << dropped_ << L" datagrams were not sent before closing.";
+	}
+
+	void parse_url(const std::string& url)
+	{
+		auto address = url.substr(url.find("://") == std::string::npos ? 0 : url.find("://") + 3);
+
+		std::string options;
+		auto query = address.find('?');
+		if(query != std::string::npos)
+		{
+			options = address.substr(query + 1);
+			address = address.substr(0, query);
+		}
+
+		auto colon = address.rfind(':');
+		if(colon == std::string::npos || colon == 0 || address[0] == '@')
+			BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Paced udp output needs a destination host and port.") << arg_value_info(url));
+
+		host_ = address.substr(0, colon);
+		port_ = address.substr(colon + 1);
+
+		std::vector<std::string> pairs;
+		boost::split(pairs, options, boost::is_any_of("&"), boost::token_compress_on);
+		BOOST_FOREACH(auto& pair, pairs)
+		{
+			auto equal = pair.find('=');
+			if(equal == std::string::npos)
+				continue;
+
+			auto key	= pair.substr(0, equal);
+			auto value	= pair.substr(equal + 1);
+
+			if(key == "pkt_size")
+				packet_size_ = std::max<size_t>(188, std::min<size_t>(65507, boost::lexical_cast<size_t>(value)));
+			else if(key == "ttl")
+				ttl_ = boost::lexical_cast<int>(value);
+			else if(key == "buffer_size")
+				buffer_size_ = boost::lexical_cast<int>(value);
+			else
+				CASPAR_LOG(warning) << L"[paced_udp_io] Ignoring udp option " << widen(key) << L".";
+		}
+	}
+
+	size_t queued() const
+	{
+		return tail_ - head_;
+	}
+
+	int write(const uint8_t* data, int size)
+	{
+		const int written = size;
+
+		while(size > 0)
+		{
+			if(queued() == ring_.size())
+			{
+				// The sender is behind the muxer, which waits for it rather than dropping transport stream packets.
+				++stalls_;
+				graph_->set_tag("send-stall");
+				while(queued() == ring_.size())
+				{
+					if(!running_)
+						return AVERROR(EIO);
+					boost::this_thread::sleep(boost::posix_time::microseconds(interval_us_));
+				}
+			}
+
+			auto& d = ring_[tail_ % ring_.size()];
+			d.size	= std::min(static_cast<size_t>(size), packet_size_);
+			std::memcpy(d.data.data(), data, d.size);
+			data += d.size;
+			size -= static_cast<int>(d.size);
+
+			++tail_; // Publishes the datagram to the sender.
+		}
+
+		return written;
+	}
+
+	void run()
+	{
+		win32_exception::ensure_handler_installed_for_thread("paced-udp-io");
+
+		auto timer = ::CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		if(!timer)
+			timer = ::CreateWaitableTimer(nullptr, TRUE, nullptr);
+
+		const double burst_bytes = static_cast<double>(burst_ * packet_size_);
+		double		 tokens		 = burst_bytes;
+		auto		 last		 = diagnostics::trace::now();
+		int64_t		 drain_until = 0;
+
+		while(true)
+		{
+			LARGE_INTEGER due;
+			due.QuadPart = -static_cast<LONGLONG>(interval_us_) * 10; // Relative, in 100 ns units.
+			if(timer && ::SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE))
+				::WaitForSingleObject(timer, INFINITE);
+			else
+				boost::this_thread::sleep(boost::posix_time::microseconds(interval_us_));
+
+			auto now	 = diagnostics::trace::now();
+			auto elapsed = now - last;
+			last		 = now;
+
+			// How far the wake up was from the intended interval, the tokens make up for it on average.
+			auto jitter = std::abs(elapsed - interval_us_);
+			total_jitter_us_ += jitter;
+			++ticks_;
+			if(jitter > max_jitter_us_)
+				max_jitter_us_ = jitter;
+			graph_->set_value("send-jitter", static_cast<double>(jitter) * fps_ / 1000000.0 * 0.5 * 10.0); // At a tenth of the frame duration.
+			graph_->set_value("send-queue", static_cast<double>(queued()) / static_cast<double>(ring_.size()));
+
+			tokens = bytes_per_us_ > 0.0 ? std::min(burst_bytes, tokens + elapsed * bytes_per_us_) : burst_bytes * ring_.size();
+
+			while(queued() > 0)
+			{
+				auto& d = ring_[head_ % ring_.size()];
+				if(tokens < static_cast<double>(d.size))
+					break;
+
+				send(d);
+				tokens -= d.size;
+				++head_;
+			}
+
+			if(!running_)
+			{
+				if(drain_until == 0)
+					drain_until = now + static_cast<int64_t>(DRAIN_SECONDS * 1000000.0);
+
+				if(queued() == 0 || now > drain_until)
+					break;
+			}
+		}
+
+		dropped_ = queued();
+
+		if(timer)
+			::CloseHandle(timer);
+	}
+
+	void send(const datagram& d)
+	{
+		boost::system::error_code error;
+		socket_.send_to(boost::asio::buffer(d.data.data(), d.size), endpoint_, 0, error);
+
+		if(error)
+		{
+			++send_errors_;
+			CASPAR_LOG_RATE_LIMITED(warning, 1) << L"[paced_udp_io] Send failed: " << widen(error.message());
+			return;
+		}
+
+		++datagrams_sent_;
+		bytes_sent_ += d.size;
+	}
+
+	static int write_packet(void* opaque, uint8_t* buffer, int size)
+	{
+		return static_cast<implementation*>(opaque)->write(buffer, size);
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",				L"paced-udp");
+		info.add(L"destination",		widen(host_ + ":" + port_));
+		info.add(L"rate",				static_cast<int64_t>(bytes_per_us_ * 8000000.0));
+		info.add(L"datagram-size",		packet_size_);
+		info.add(L"burst",				burst_);
+		info.add(L"interval-us",		interval_us_);
+		info.add(L"datagrams-sent",		datagrams_sent_);
+		info.add(L"bytes-sent",			bytes_sent_);
+		info.add(L"send-errors",		send_errors_);
+		info.add(L"queued",				queued());
+		info.add(L"stalls",				stalls_);
+		info.add(L"average-jitter-us",	ticks_ > 0 ? total_jitter_us_ / ticks_ : 0);
+		info.add(L"max-jitter-us",		max_jitter_us_);
+		return info;
+	}
+};
+
+paced_udp_io::paced_udp_io(const std::string& url, int64_t bits_per_second, const safe_ptr<diagnostics::graph>& graph, double fps) : impl_(new implementation(url, bits_per_second, graph, fps)){}
+paced_udp_io::~paced_udp_io(){}
+AVIOContext* paced_udp_io::context(){return impl_->context_.get();}
+boost::property_tree::wptree paced_udp_io::info() const{return impl_->info();}
+
+}}
@@ -0,0 +1,66 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct AVIOContext;
+
+namespace caspar { 
+	
+namespace diagnostics {
+
+class graph;
+
+}
+	
+namespace ffmpeg {
+
+// Sends the output of a udp:// stream from a thread of its own, paced by a token bucket at the given rate so that 
+// an encoded frame does not leave as one burst of datagrams. The muxer fills a single producer single consumer ring 
+// of datagrams, which the sender drains a few at a time on a high precision timer. A rate of 0 sends unpaced.
+// The url takes the pkt_size and ttl options of the udp protocol. configuration.ffmpeg.stream-pacing-burst 
+// (datagrams sent together) and stream-pacing-ring (datagrams queued).
+class paced_udp_io : boost::noncopyable
+{
+public:
+	paced_udp_io(const std::string& url, int64_t bits_per_second, const safe_ptr<diagnostics::graph>& graph, double fps);
+	~paced_udp_io();
+
+	// For AVFormatContext::pb together with AVFMT_FLAG_CUSTOM_IO, valid as long as this object.
+	AVIOContext* context();
+
+	boost::property_tree::wptree info() const;
+private:
+	struct implementation;
+	std::unique_ptr<implementation> impl_;
+};
+
+}}
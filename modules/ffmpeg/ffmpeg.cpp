@@ -21,10 +21,13 @@
 
 #include "StdAfx.h"
 
+#include "ffmpeg.h"
 #include "consumer/ffmpeg_consumer.h"
 #include "producer/ffmpeg_producer.h"
 #include "producer/util/util.h"
+#include "producer/util/conversion_cache.h"
 
+#include <common/env.h>
 #include <common/log/log.h>
 #include <common/exception/win32_exception.h>
 
@@ -35,8 +38,12 @@
 #include <core/producer/media_info/media_info_repository.h>
 
 #include <tbb/recursive_mutex.h>
+#include <tbb/spin_mutex.h>
 
 #include <boost/thread.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <unordered_map>
 
 #if defined(_MSC_VER)
 #pragma warning (disable : 4244)
@@ -104,7 +111,7 @@ static void sanitize(uint8_t *line)
     }
 }
 
-void log_callback(void* ptr, int level, const char* fmt, va_list vl)
+void log_callback(void* ptr, int level, const char* fmt, va_list vl, const log::suppressed_messages& suppressed)
 {
     static int print_prefix=1;
     static int count;
@@ -140,17 +147,17 @@ void log_callback(void* ptr, int level, const char* fmt, va_list vl)
 		line[len-1] = 0;
 	
 	if(level == AV_LOG_DEBUG)
-		CASPAR_LOG(debug) << L"[ffmpeg] " << line;
+		CASPAR_LOG(debug) << L"[ffmpeg] " << suppressed << line;
 	else if(level == AV_LOG_INFO)
-		CASPAR_LOG(info) << L"[ffmpeg] " << line;
+		CASPAR_LOG(info) << L"[ffmpeg] " << suppressed << line;
 	else if(level == AV_LOG_WARNING)
-		CASPAR_LOG(warning) << L"[ffmpeg] " << line;
+		CASPAR_LOG(warning) << L"[ffmpeg] " << suppressed << line;
 	else if(level == AV_LOG_ERROR)
-		CASPAR_LOG(error) << L"[ffmpeg] " << line;
+		CASPAR_LOG(error) << L"[ffmpeg] " << suppressed << line;
 	else if(level == AV_LOG_FATAL)
-		CASPAR_LOG(fatal) << L"[ffmpeg] " << line;
+		CASPAR_LOG(fatal) << L"[ffmpeg] " << suppressed << line;
 	else
-		CASPAR_LOG(trace) << L"[ffmpeg] " << line;
+		CASPAR_LOG(trace) << L"[ffmpeg] " << suppressed << line;
 
 }
 
@@ -185,16 +192,119 @@ std::shared_ptr<void> temporary_disable_logging_for_thread(bool disable)
 	});
 }
 
+struct log_context_registry
+{
+	tbb::spin_mutex												mutex;
+	std::unordered_map<const void*, safe_ptr<log_counters>>	counters;
+};
+
+log_context_registry& get_log_context_registry()
+{
+	static log_context_registry registry;
+	return registry;
+}
+
+std::shared_ptr<void> register_log_context(const void* context, const safe_ptr<log_counters>& counters)
+{
+	{
+		auto& registry = get_log_context_registry();
+		tbb::spin_mutex::scoped_lock lock(registry.mutex);
+		registry.counters.insert(std::make_pair(context, counters));
+	}
+
+	return std::shared_ptr<void>(nullptr, [context](void*)
+	{
+		auto& registry = get_log_context_registry();
+		tbb::spin_mutex::scoped_lock lock(registry.mutex);
+		registry.counters.erase(context);
+	});
+}
+
+// Looks at the context and then at its parent, for messages logged by sub-components.
+std::shared_ptr<log_counters> find_log_counters(void* ptr)
+{
+	if(!ptr)
+		return nullptr;
+
+	auto& registry = get_log_context_registry();
+	tbb::spin_mutex::scoped_lock lock(registry.mutex);
+
+	if(registry.counters.empty())
+		return nullptr;
+
+	auto it = registry.counters.find(ptr);
+	if(it != registry.counters.end())
+		return it->second;
+
+	auto avc = *static_cast<AVClass**>(ptr);
+	if(avc && avc->parent_log_context_offset)
+	{
+		auto parent = *reinterpret_cast<void**>(static_cast<uint8_t*>(ptr) + avc->parent_log_context_offset);
+		it = registry.counters.find(parent);
+		if(it != registry.counters.end())
+			return it->second;
+	}
+
+	return nullptr;
+}
+
+// Lines per second that one input, or everything else together, may log.
+static const int MAX_LOG_LINES_PER_SECOND = 10;
+
+// Filters before anything is formatted, damaged streams can make libav log every packet.
 void log_for_thread(void* ptr, int level, const char* fmt, va_list vl)
 {
+	bool is_logged = level <= av_log_get_level() && !is_logging_already_disabled_for_thread();
+
+	if(!is_logged && level > AV_LOG_WARNING)
+		return;
+
+	auto counters = find_log_counters(ptr);
+	if(counters)
+	{
+		if(level <= AV_LOG_ERROR)
+			++counters->errors;
+		else if(level <= AV_LOG_WARNING)
+			++counters->warnings;
+	}
+
+	if(!is_logged)
+		return;
+
+	static log::rate_limiter unattributed_limiter;
+	auto suppressed = (counters ? counters->limiter : unattributed_limiter).try_pass(MAX_LOG_LINES_PER_SECOND);
+	if(!suppressed.passed())
+		return;
+
 	win32_exception::ensure_handler_installed_for_thread("ffmpeg-thread");
-	log_callback(ptr, level, fmt, vl);
+	log_callback(ptr, level, fmt, vl, suppressed);
 }
 
 
+int get_log_level(const std::wstring& level)
+{
+	if(boost::iequals(level, L"quiet"))
+		return AV_LOG_QUIET;
+	else if(boost::iequals(level, L"fatal"))
+		return AV_LOG_FATAL;
+	else if(boost::iequals(level, L"error"))
+		return AV_LOG_ERROR;
+	else if(boost::iequals(level, L"info"))
+		return AV_LOG_INFO;
+	else if(boost::iequals(level, L"verbose"))
+		return AV_LOG_VERBOSE;
+	else if(boost::iequals(level, L"debug"))
+		return AV_LOG_DEBUG;
+	else if(boost::iequals(level, L"trace"))
+		return AV_LOG_TRACE;
+
+	return AV_LOG_WARNING;
+}
+
 void init(const safe_ptr<core::media_info_repository>& media_info_repo)
 {
 	av_lockmgr_register(ffmpeg_lock_callback);
+	av_log_set_level(get_log_level(env::properties().get(L"configuration.ffmpeg.log-level", L"warning")));
 	av_log_set_callback(log_for_thread);
 
     avfilter_register_all();
@@ -212,6 +322,8 @@ void init(const safe_ptr<core::media_info_repository>& media_info_repo)
 
 				return is_valid_file(file) && try_get_duration(file, info.duration, info.time_base);
 			});
+
+	prewarm_conversion_cache();
 }
 
 void uninit()
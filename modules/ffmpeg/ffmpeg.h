@@ -21,6 +21,11 @@
 
 #pragma once
 
+#include <common/log/log.h>
+#include <common/memory/safe_ptr.h>
+
+#include <tbb/atomic.h>
+
 #include <string>
 #include <memory>
 
@@ -39,6 +44,26 @@ void disable_logging_for_thread();
 bool is_logging_already_disabled_for_thread();
 std::shared_ptr<void> temporary_disable_logging_for_thread(bool disable);
 
+// What libav reported for the contexts of one input, counted whether or not it was logged.
+struct log_counters
+{
+	tbb::atomic<int>	warnings;
+	tbb::atomic<int>	errors;
+	log::rate_limiter	limiter;
+
+	log_counters()
+	{
+		warnings				= 0;
+		errors					= 0;
+		limiter.window_start	= 0;
+		limiter.count			= 0;
+		limiter.suppressed		= 0;
+	}
+};
+
+// Attributes the log messages of an AVFormatContext or AVCodecContext to counters, until the returned token is destroyed.
+std::shared_ptr<void> register_log_context(const void* context, const safe_ptr<log_counters>& counters);
+
 std::wstring get_avcodec_version();
 std::wstring get_avformat_version();
 std::wstring get_avutil_version();
@@ -26,14 +26,24 @@
 //#include "audio_resampler.h"
 
 #include "../util/util.h"
+#include "../util/conversion_cache.h"
 #include "../../ffmpeg_error.h"
 
 #include <core/video_format.h>
 #include <core/mixer/audio/audio_util.h>
 
+#include <common/exception/exceptions.h>
+
 #include <tbb/cache_aligned_allocator.h>
 
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <limits>
 #include <queue>
+#include <vector>
 
 #if defined(_MSC_VER)
 #pragma warning (push)
@@ -50,63 +60,134 @@ extern "C"
 #endif
 
 namespace caspar { namespace ffmpeg {
-	
-struct audio_decoder::implementation : boost::noncopyable
-{	
-	static const int BUFFER_SIZE = 480000 * 2;
-	input 														input_;
+
+// The audio stream numbers, counted from 1, of a list such as "1,2", "3-6" or "ALL". The best stream when empty. 
+std::vector<int> get_audio_stream_indices(const AVFormatContext& context, const std::wstring& audio_tracks)
+{
+	std::vector<int> streams;
+	for(unsigned int index = 0; index < context.nb_streams; ++index)
+	{
+		if(context.streams[index]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+			streams.push_back(index);
+	}
+
+	if(boost::iequals(audio_tracks, L"ALL"))
+		return streams;
+
+	std::vector<int> indices;
+	std::vector<std::wstring> ranges;
+	boost::split(ranges, audio_tracks, boost::is_any_of(L","), boost::token_compress_on);
+	BOOST_FOREACH(auto range, ranges)
+	{
+		boost::trim(range);
+		if(range.empty())
+			continue;
+
+		std::vector<std::wstring> bounds;
+		boost::split(bounds, range, boost::is_any_of(L"-"));
+		const auto first = boost::lexical_cast<int>(bounds.front());
+		const auto last	 = boost::lexical_cast<int>(bounds.back());
+
+		for(int track = first; track <= last; ++track)
+		{
+			if(track < 1 || track > static_cast<int>(streams.size()))
+				BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("No such audio track.") << arg_value_info(narrow(range)));
+			indices.push_back(streams[track - 1]);
+		}
+	}
+
+	return indices;
+}
+
+bool can_convert_samples(int format)
+{
+	switch(format)
+	{
+	case AV_SAMPLE_FMT_S16:
+	case AV_SAMPLE_FMT_S32:
+	case AV_SAMPLE_FMT_FLT:
+	case AV_SAMPLE_FMT_S16P:
+	case AV_SAMPLE_FMT_S32P:
+	case AV_SAMPLE_FMT_FLTP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Samples at the channel's rate are converted straight into the audio buffer with the sse conversions of core, 
+// others go through a resampler. Either way the samples are written once.
+void convert_samples(const AVFrame& frame, int32_t* dest)
+{
+	const auto count = static_cast<std::size_t>(frame.nb_samples) * frame.channels;
+
+	switch(frame.format)
+	{
+	case AV_SAMPLE_FMT_S16:
+		core::audio_16_to_32(reinterpret_cast<const int16_t*>(frame.extended_data[0]), dest, count);
+		break;
+	case AV_SAMPLE_FMT_S32:
+		std::copy_n(reinterpret_cast<const int32_t*>(frame.extended_data[0]), count, dest);
+		break;
+	case AV_SAMPLE_FMT_FLT:
+		core::audio_float_to_32(reinterpret_cast<const float*>(frame.extended_data[0]), dest, count);
+		break;
+	case AV_SAMPLE_FMT_S16P:
+		core::audio_planar_16_to_32(reinterpret_cast<const int16_t* const*>(frame.extended_data), dest, count, frame.channels);
+		break;
+	case AV_SAMPLE_FMT_S32P:
+		core::audio_planar_32_to_32(reinterpret_cast<const int32_t* const*>(frame.extended_data), dest, count, frame.channels);
+		break;
+	case AV_SAMPLE_FMT_FLTP:
+		core::audio_planar_float_to_32(reinterpret_cast<const float* const*>(frame.extended_data), dest, count, frame.channels);
+		break;
+	}
+}
+
+// Decodes and resamples one audio stream.
+class audio_track : boost::noncopyable
+{
 	const safe_ptr<AVCodecContext>								codec_context_;
-	int															stream_index_;
+	const int													stream_index_;
 	const AVStream*												stream_;
 	caspar::core::video_format_desc								format_;
-	const std::shared_ptr<SwrContext>							swr_;
-	core::channel_layout										channel_layout_;
+	std::shared_ptr<SwrContext>									swr_;
+	int															swr_rate_;
+	int															swr_format_;
+	int															swr_channels_;
 	const int64_t												stream_start_pts_;
 	tbb::atomic<int64_t>										seek_pts_;
-	std::vector<int32_t,  tbb::cache_aligned_allocator<int32_t>> buffer_;
 
 public:
-	explicit implementation(input input, caspar::core::video_format_desc format, const std::wstring& custom_channel_order)
-		: input_(input)
-		, codec_context_(input.open_audio_codec(stream_index_))
+	core::audio_buffer											pending; // Decoded samples not yet interleaved with the other tracks.
+
+	audio_track(input& input, const safe_ptr<AVCodecContext>& codec_context, int stream_index, const caspar::core::video_format_desc& format)
+		: codec_context_(codec_context)
+		, stream_index_(stream_index)
+		, stream_(input.format_context()->streams[stream_index])
 		, format_(format)
-		, channel_layout_(get_audio_channel_layout(*codec_context_, custom_channel_order))
-		, swr_(alloc_resampler())
-		, stream_(input_.format_context()->streams[stream_index_])
+		, swr_rate_(0)
+		, swr_format_(AV_SAMPLE_FMT_NONE)
+		, swr_channels_(0)
 		, stream_start_pts_(stream_->start_time)
-		, buffer_(BUFFER_SIZE)
 	{
 		seek_pts_ = 0;
-		THROW_ON_ERROR2(swr_init(swr_.get()), "[audio_decoder]");
-		CASPAR_LOG(debug) << print() 
-				<< " Selected channel layout " << channel_layout_.name;
-	}
-	
-	std::shared_ptr<core::audio_buffer> poll()
-	{
-		std::shared_ptr<core::audio_buffer> audio = nullptr;
-		std::shared_ptr<AVPacket> packet = nullptr;
-		while (!audio && input_.try_pop_audio(packet))
-			audio = decode(packet);
-		return audio;
+		if(codec_context_->sample_rate != format_.audio_sample_rate)
+			get_resampler(codec_context_->sample_rate, codec_context_->sample_fmt, codec_context_->channels);
 	}
 
-
-	std::shared_ptr<SwrContext>	alloc_resampler()
+	// Frames may change format or rate midstream, each gets a resampler for what it is.
+	SwrContext* get_resampler(int rate, int format, int channels)
 	{
-		std::shared_ptr<SwrContext>	resampler(
-		swr_alloc_set_opts(
-				nullptr,
-				create_channel_layout_bitmask(codec_context_->channels),//get_ffmpeg_channel_layout(codec_context_.get()),
-				AV_SAMPLE_FMT_S32,
-				format_.audio_sample_rate,
-				create_channel_layout_bitmask(codec_context_->channels),//get_ffmpeg_channel_layout(codec_context_.get()),
-				codec_context_->sample_fmt,
-				codec_context_->sample_rate,
-				0,
-				nullptr),
-		[](SwrContext* p){swr_free(&p);});
-		return resampler;
+		if(!swr_ || rate != swr_rate_ || format != swr_format_ || channels != swr_channels_)
+		{
+			swr_.reset();
+			swr_ = ffmpeg::get_resampler(rate, format, channels, format_.audio_sample_rate, AV_SAMPLE_FMT_S32, codec_context_->channels);
+			swr_rate_		= rate;
+			swr_format_		= format;
+			swr_channels_	= channels;
+		}
+		return swr_.get();
 	}
 
 	std::shared_ptr<core::audio_buffer> decode(std::shared_ptr<AVPacket> pkt)
@@ -115,49 +196,166 @@ public:
 		safe_ptr<AVFrame> frame = create_frame();
 		int ret = avcodec_decode_audio4(codec_context_.get(), frame.get(), &got_frame, pkt.get());
 		int64_t frame_time_stamp = av_frame_get_best_effort_timestamp(frame.get());
-		if (ret >= 0 && got_frame && frame_time_stamp >= seek_pts_)
+		if (ret < 0 || !got_frame || frame_time_stamp < seek_pts_ || frame->nb_samples <= 0)
+			return nullptr;
+
+		const auto channels = codec_context_->channels;
+
+		if (frame->sample_rate == format_.audio_sample_rate && frame->channels == channels && can_convert_samples(frame->format))
 		{
-			const uint8_t **in = const_cast<const uint8_t**>(frame->extended_data);
-			uint8_t* out[] =  { reinterpret_cast<uint8_t*>(buffer_.data()) };
-			int n_samples = swr_convert(swr_.get(),
-				out,
-				BUFFER_SIZE / codec_context_->channels,
-				in,
-				frame->nb_samples);
-			if (n_samples > 0)
-			{
-				const auto samples = reinterpret_cast<uint32_t*>(*out);
-				return std::make_shared<core::audio_buffer>(samples, samples + n_samples*codec_context_->channels);
-			}
+			swr_.reset();
+			auto audio = std::make_shared<core::audio_buffer>(frame->nb_samples * channels);
+			convert_samples(*frame, audio->data());
+			return audio;
 		}
-		return nullptr;
-	}
 
-	void flush_resampler()
-	{
-		uint8_t* out[] =  { reinterpret_cast<uint8_t*>(buffer_.data()) };
-		while (swr_convert(swr_.get(),
-				out,
-				BUFFER_SIZE / codec_context_->channels,
-				NULL,
-				0)>0) {};
+		auto swr = get_resampler(frame->sample_rate, frame->format, frame->channels);
+
+		const auto capacity = swr_get_out_samples(swr, frame->nb_samples);
+		if (capacity <= 0)
+			return nullptr;
+
+		auto audio = std::make_shared<core::audio_buffer>(capacity * channels);
+		uint8_t* out[] = { reinterpret_cast<uint8_t*>(audio->data()) };
+		const int n_samples = swr_convert(swr, out, capacity, const_cast<const uint8_t**>(frame->extended_data), frame->nb_samples);
+		if (n_samples <= 0)
+			return nullptr;
+
+		audio->resize(n_samples * channels);
+		return audio;
 	}
 	
 	void seek(uint64_t time)
 	{
 		avcodec_flush_buffers(codec_context_.get());
-		flush_resampler();
+		swr_.reset(); // Back to the pool, the next frame gets one without the samples buffered before the seek.
+		pending.clear();
 		seek_pts_ = stream_start_pts_ == AV_NOPTS_VALUE ? 0 : stream_start_pts_
 			+ (time * stream_->time_base.den / (AV_TIME_BASE * stream_->time_base.num));
 	}
+
+	int stream_index() const
+	{
+		return stream_index_;
+	}
+
+	int channels() const
+	{
+		return codec_context_->channels;
+	}
+
+	const AVCodecContext& codec_context() const
+	{
+		return *codec_context_;
+	}
+};
+	
+struct audio_decoder::implementation : boost::noncopyable
+{	
+	input 														input_;
+	std::vector<std::shared_ptr<audio_track>>					tracks_;
+	int															channels_;
+	core::channel_layout										channel_layout_;
+
+public:
+	explicit implementation(input input, caspar::core::video_format_desc format, const std::wstring& custom_channel_order, const std::wstring& audio_tracks)
+		: input_(input)
+		, channels_(0)
+	{
+		if(audio_tracks.empty())
+		{
+			int index = -1;
+			auto codec_context = input_.open_audio_codec(index);
+			tracks_.push_back(std::make_shared<audio_track>(input_, codec_context, index, format));
+		}
+		else
+		{
+			BOOST_FOREACH(auto index, get_audio_stream_indices(*input_.format_context(), audio_tracks))
+				tracks_.push_back(std::make_shared<audio_track>(input_, input_.open_audio_stream(index), index, format));
+		}
+
+		if(tracks_.empty())
+			BOOST_THROW_EXCEPTION(averror_stream_not_found() << msg_info("No audio tracks."));
+
+		BOOST_FOREACH(auto& track, tracks_)
+			channels_ += track->channels();
+
+		// The tracks are one layout of all their channels, the mix configs take it to the channel's layout.
+		channel_layout_ = tracks_.size() == 1 
+			? get_audio_channel_layout(tracks_.front()->codec_context(), custom_channel_order)
+			: get_audio_channel_layout(channels_, 0, custom_channel_order);
+
+		CASPAR_LOG(debug) << print() 
+				<< " Selected channel layout " << channel_layout_.name;
+	}
+	
+	std::shared_ptr<core::audio_buffer> poll()
+	{
+		if(tracks_.size() == 1)
+		{
+			auto& track = *tracks_.front();
+			std::shared_ptr<core::audio_buffer> audio = nullptr;
+			std::shared_ptr<AVPacket> packet = nullptr;
+			while (!audio && input_.try_pop_audio(packet, track.stream_index()))
+				audio = track.decode(packet);
+			return audio;
+		}
+
+		// Every track decodes until it has samples, they are then interleaved as far as all of them have samples.
+		// Tracks which have ended are silent.
+		std::size_t frames = std::numeric_limits<std::size_t>::max();
+		bool ended = true;
+		BOOST_FOREACH(auto& track, tracks_)
+		{
+			std::shared_ptr<AVPacket> packet = nullptr;
+			while (track->pending.empty() && input_.try_pop_audio(packet, track->stream_index()))
+			{
+				auto audio = track->decode(packet);
+				if(audio)
+					track->pending.insert(track->pending.end(), audio->begin(), audio->end());
+			}
+
+			if(!track->pending.empty() || !input_.eof())
+			{
+				frames = std::min(frames, track->pending.size() / track->channels());
+				ended = false;
+			}
+		}
+
+		if(ended || frames == 0)
+			return nullptr;
+
+		auto audio = std::make_shared<core::audio_buffer>(frames * channels_, 0);
+
+		int offset = 0;
+		BOOST_FOREACH(auto& track, tracks_)
+		{
+			const auto channels = track->channels();
+			const auto available = std::min(frames, track->pending.size() / channels);
+
+			for(std::size_t n = 0; n < available; ++n)
+				std::copy_n(track->pending.begin() + n * channels, channels, audio->begin() + n * channels_ + offset);
+
+			track->pending.erase(track->pending.begin(), track->pending.begin() + available * channels);
+			offset += channels;
+		}
+
+		return audio;
+	}
+	
+	void seek(uint64_t time)
+	{
+		BOOST_FOREACH(auto& track, tracks_)
+			track->seek(time);
+	}
 	
 	std::wstring print() const
 	{		
-		return L"[audio-decoder] " + widen(codec_context_->codec->long_name);
+		return L"[audio-decoder] " + widen(tracks_.front()->codec_context().codec->long_name) + (tracks_.size() > 1 ? L"|" + boost::lexical_cast<std::wstring>(tracks_.size()) + L" tracks" : L"");
 	}
 };
 
-audio_decoder::audio_decoder(input input, caspar::core::video_format_desc format, const std::wstring& custom_channel_order) : impl_(new implementation(input, format, custom_channel_order)){}
+audio_decoder::audio_decoder(input input, caspar::core::video_format_desc format, const std::wstring& custom_channel_order, const std::wstring& audio_tracks) : impl_(new implementation(input, format, custom_channel_order, audio_tracks)){}
 std::shared_ptr<core::audio_buffer> audio_decoder::poll(){return impl_->poll();}
 const core::channel_layout& audio_decoder::channel_layout() const { return impl_->channel_layout_; }
 std::wstring audio_decoder::print() const{return impl_->print();}
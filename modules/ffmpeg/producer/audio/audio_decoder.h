@@ -46,7 +46,9 @@ namespace ffmpeg {
 class audio_decoder : boost::noncopyable
 {
 public:
-	explicit audio_decoder(input input, caspar::core::video_format_desc format,  const std::wstring& custom_channel_order);
+	// audio_tracks lists the audio streams to decode, counted from 1, such as "1,2", "3-6" or "ALL". Their channels 
+	// are interleaved in that order. The best stream is decoded when it is empty.
+	explicit audio_decoder(input input, caspar::core::video_format_desc format,  const std::wstring& custom_channel_order, const std::wstring& audio_tracks = L"");
 	std::shared_ptr<core::audio_buffer> poll();
 	const core::channel_layout& channel_layout() const;
 	std::wstring print() const;
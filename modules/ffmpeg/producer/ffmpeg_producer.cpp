@@ -28,7 +28,10 @@
 
 #include "muxer/frame_muxer.h"
 #include "input/input.h"
+#include "input/network_io.h"
 #include "util/util.h"
+#include "util/decode_scheduler.h"
+#include "util/clip_cache.h"
 #include "audio/audio_decoder.h"
 #include "video/video_decoder.h"
 
@@ -36,6 +39,8 @@
 #include <common/utility/assert.h>
 #include <common/diagnostics/graph.h>
 #include <common/utility/string.h>
+#include <common/concurrency/executor.h>
+#include <common/concurrency/parallel_arena.h>
 
 #include <core/monitor/monitor.h>
 #include <core/video_format.h>
@@ -55,11 +60,28 @@
 #include <boost/regex.hpp>
 #include <boost/locale.hpp>
 
-#include <tbb/parallel_invoke.h>
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
 
+#include <cmath>
 #include <limits>
 #include <memory>
 #include <queue>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavutil/frame.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
 
 namespace caspar { namespace ffmpeg {
 
@@ -67,6 +89,9 @@ std::wstring get_relative_or_original(
 		const std::wstring& filename,
 		const boost::filesystem::wpath& relative_to)
 {
+	if(is_network_url(filename))
+		return filename;
+
 	boost::filesystem::wpath file(filename);
 	auto result = file.filename();
 
@@ -94,6 +119,7 @@ struct ffmpeg_producer : public core::frame_producer
 	core::monitor::subject										monitor_subject_;
 	const std::wstring											filename_;
 	const std::wstring											path_relative_to_media_;
+	const std::string											path_relative_to_media_utf8_;	// Sent every frame, so converted once.
 
 	const safe_ptr<diagnostics::graph>							graph_;
 	boost::timer												frame_timer_;
@@ -116,19 +142,40 @@ struct ffmpeg_producer : public core::frame_producer
 	const bool													thumbnail_mode_;
 	const bool													alpha_mode_;
 	const std::string											filter_str_;
-	bool														loop_;
+	tbb::atomic<bool>											loop_;
 
 	safe_ptr<core::basic_frame>									last_frame_;
 	
-	std::queue<std::pair<safe_ptr<core::basic_frame>, size_t>>	frame_buffer_;
+	// Filled by the decode thread, popped by receive.
+	tbb::concurrent_queue<std::pair<safe_ptr<core::basic_frame>, size_t>>	frame_buffer_;
 	uint32_t													file_frame_number_;
 	uint32_t													decoded_frame_number_;
-	
+	tbb::atomic<bool>											on_air_;
+	tbb::atomic<int64_t>										decode_time_; // us, of the last decoded frame.
+	int															reported_errors_;
+
+	const size_t												loop_head_frames_;
+	std::vector<safe_ptr<core::basic_frame>>					loop_head_; // The first frames after start_, replayed at the loop point.
+	size_t														skip_frames_; // Frames of the loop head which are decoded again after the loop seek.
+	const size_t												preroll_frames_;
+	const size_t												look_ahead_frames_; // Decoded ahead of receive while on air.
+
+	tbb::atomic<int>											hints_;
+	tbb::atomic<bool>											decoding_;	// A decode_ahead is queued or running.
+	tbb::atomic<bool>											exhausted_;	// Nothing more to decode until a seek.
+	std::exception_ptr											exception_;
+	std::shared_ptr<parallel_arena>								arena_;
+
+	// Video is decoded, filtered and muxed on the decode thread, while audio is decoded on one of its own. Neither in 
+	// thumbnail mode, which decodes on the calling thread.
+	std::unique_ptr<executor>									audio_executor_;
+	std::unique_ptr<executor>									decode_executor_;
 		
 public:
-	explicit ffmpeg_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, const std::wstring& filter, bool loop, uint32_t start, uint32_t length, bool thumbnail_mode, bool alpha_mode, const std::wstring& custom_channel_order, bool field_order_inverted)
+	explicit ffmpeg_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, const std::wstring& filter, bool loop, uint32_t start, uint32_t length, bool thumbnail_mode, bool alpha_mode, const std::wstring& custom_channel_order, bool field_order_inverted, const std::wstring& hwaccel, const std::wstring& audio_tracks)
 		: filename_(filename)
 		, path_relative_to_media_(get_relative_or_original(filename, env::media_folder()))
+		, path_relative_to_media_utf8_(narrow(path_relative_to_media_))
 		, frame_factory_(frame_factory)
 		, format_desc_(frame_factory->get_video_format_desc())
 		, initial_logger_disabler_(temporary_disable_logging_for_thread(thumbnail_mode))
@@ -140,15 +187,28 @@ public:
 		, last_frame_(core::basic_frame::empty())
 		, filter_str_(narrow(filter))
 		, custom_channel_order_(custom_channel_order)
-		, loop_(loop)
 		, start_(start)
+		, reported_errors_(0)
+		, loop_head_frames_(thumbnail_mode ? 0 : std::min<size_t>(length, env::properties().get(L"configuration.ffmpeg.loop-head-frames", 12)))
+		, skip_frames_(0)
+		, preroll_frames_(thumbnail_mode ? 0 : std::max(0, env::properties().get(L"configuration.ffmpeg.preroll-frames", static_cast<int>(std::ceil(format_desc_.fps)))))
+		, look_ahead_frames_(std::max(1, env::properties().get(L"configuration.ffmpeg.look-ahead-frames", 4)))
 	{
+		loop_			= loop;
+		on_air_			= false;
+		decode_time_	= 0;
+		hints_			= thumbnail_mode ? core::frame_producer::DEINTERLACE_HINT : alpha_mode ? core::frame_producer::ALPHA_HINT : core::frame_producer::NO_HINT;
+		decoding_		= false;
+		exhausted_		= false;
+
 		graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
 		graph_->set_color("underflow", diagnostics::color(0.6f, 0.3f, 0.9f));	
+		graph_->set_color("decode-time", diagnostics::color(0.9f, 0.6f, 0.1f));
+		graph_->set_color("decode-error", diagnostics::color(1.0f, 0.1f, 0.1f));
 		diagnostics::register_graph(graph_);
 		try
 		{
-			video_decoder_.reset(new video_decoder(input_, field_order_inverted));
+			video_decoder_.reset(new video_decoder(input_, field_order_inverted, hwaccel));
 		}
 		catch(averror_stream_not_found&)
 		{
@@ -169,7 +229,7 @@ public:
 		{
 			try
 			{
-				audio_decoder_.reset(new audio_decoder(input_, frame_factory->get_video_format_desc(), custom_channel_order));
+				audio_decoder_.reset(new audio_decoder(input_, frame_factory->get_video_format_desc(), custom_channel_order, audio_tracks));
 				audio_channel_layout_ = audio_decoder_->channel_layout();
 			}
 			catch(averror_stream_not_found&)
@@ -185,16 +245,36 @@ public:
 
 		if(!video_decoder_ && !audio_decoder_)
 			BOOST_THROW_EXCEPTION(averror_stream_not_found() << msg_info("No streams found"));
-		muxer_.reset(new frame_muxer(video_decoder_->frame_rate(), frame_factory, thumbnail_mode_, audio_channel_layout_, filter_str_));
+		auto frame_rate = video_decoder_ ? video_decoder_->frame_rate() : boost::rational<int>(format_desc_.time_scale, format_desc_.duration);
+		muxer_.reset(new frame_muxer(frame_rate, frame_factory, thumbnail_mode_, audio_channel_layout_, filter_str_));
+		if(video_decoder_ && !thumbnail_mode_)
+			video_decoder_->set_direct_output(frame_factory, muxer_->tag(), audio_channel_layout_, filter_str_.empty());
 		seek(start);
-		for (int n = 0; n < 32 && frame_buffer_.size() < 4; ++n)
-			try_decode_frame(thumbnail_mode ? core::frame_producer::DEINTERLACE_HINT : alpha_mode ? core::frame_producer::ALPHA_HINT : core::frame_producer::NO_HINT);
+		for (int n = 0; n < 32 && buffered_frames() < 4; ++n)
+			try_decode_frame(hints_);
+
+		if (!thumbnail_mode_)
+		{
+			audio_executor_.reset(new executor(L"ffmpeg audio decode"));
+			decode_executor_.reset(new executor(L"ffmpeg decode"));
+		}
+	}
+
+	~ffmpeg_producer()
+	{
+		// Stops decoding ahead before the decoders go.
+		if (decode_executor_)
+		{
+			decode_executor_->clear();
+			decode_executor_.reset();
+		}
 	}
 
 	// frame_producer
 	
 	virtual safe_ptr<core::basic_frame> receive(int hints) override
 	{
+		on_air_ = true;
 		return render_frame(hints).first;
 	}
 
@@ -203,19 +283,54 @@ public:
 		return pause(disable_audio(last_frame_));
 	}
 
+	virtual void preroll(int hints) override
+	{
+		if(on_air_)
+			return;
+
+		hints_ = hints;
+		request_decode();
+	}
+
+	virtual bool is_ready() const override
+	{
+		return on_air_ || buffered_frames() >= preroll_frames_ || input_.eof();
+	}
+
 	std::pair<safe_ptr<core::basic_frame>, uint32_t> render_frame(int hints)
 	{		
 		frame_timer_.restart();
-		auto disable_logging = temporary_disable_logging_for_thread(thumbnail_mode_);
-				
-		for(int n = 0; n < 32 && frame_buffer_.size() < 4; ++n)
-			try_decode_frame(hints);
+
+		if (exception_ != nullptr)
+			std::rethrow_exception(exception_);
+
+		hints_ = hints;
+
+		if (!decode_executor_)
+		{
+			auto disable_logging = temporary_disable_logging_for_thread(thumbnail_mode_);
+			for (int n = 0; n < 32 && buffered_frames() < 4; ++n)
+				try_decode_frame(hints);
+			exhausted_ = frame_buffer_.empty() && at_end();
+		}
+
+		std::pair<safe_ptr<core::basic_frame>, size_t> frame(core::basic_frame::empty(), 0);
+		bool has_frame = frame_buffer_.try_pop(frame);
+		request_decode();
 		
 		graph_->set_value("frame-time", frame_timer_.elapsed()*format_desc_.fps*0.5);
+		graph_->set_value("decode-time", decode_time()*format_desc_.fps*0.5);
 
-		if (frame_buffer_.empty())
+		int errors = input_.get_log_counters()->errors;
+		if (errors != reported_errors_)
+		{
+			graph_->set_tag("decode-error");
+			reported_errors_ = errors;
+		}
+
+		if (!has_frame)
 		{
-			if (input_.eof())
+			if (exhausted_)
 			{
 				send_osc();
 				return std::make_pair(last_frame(), -1);
@@ -229,10 +344,8 @@ public:
 			}
 		}
 		
-		auto frame = frame_buffer_.front(); 
 		last_frame_ = frame.first;
 		file_frame_number_ = frame.second;
-		frame_buffer_.pop();
 
 		graph_->set_text(print());
 		send_osc();
@@ -242,31 +355,56 @@ public:
 
 	void send_osc()
 	{
-		monitor_subject_	<< core::monitor::message("/profiler/time")		% frame_timer_.elapsed() % (1.0/format_desc_.fps);			
+		if(!monitor_subject_.is_observed())
+			return;
+
+		monitor_subject_	<< core::monitor::message("/profiler/time")		% frame_timer_.elapsed() % (1.0/format_desc_.fps)
+							<< core::monitor::message("/profiler/decode-time")	% decode_time() % (1.0/format_desc_.fps);
 								
 		monitor_subject_	<< core::monitor::message("/file/time")			% (file_frame_number()/fps_) 
 																			% (file_nb_frames()/fps_)
 							<< core::monitor::message("/file/frame")			% static_cast<int32_t>(file_frame_number())
 																			% static_cast<int32_t>(file_nb_frames())
 							<< core::monitor::message("/file/fps")			% fps_
-							<< core::monitor::message("/file/path")			% path_relative_to_media_
-							<< core::monitor::message("/loop")				% loop_;
+							<< core::monitor::message("/file/path")			% path_relative_to_media_utf8_
+							<< core::monitor::message("/loop")				% static_cast<bool>(loop_);
+
+		auto counters = input_.get_log_counters();
+		monitor_subject_	<< core::monitor::message("/decode/warnings")	% static_cast<int32_t>(counters->warnings)
+							<< core::monitor::message("/decode/errors")		% static_cast<int32_t>(counters->errors);
 	}
 	
 	safe_ptr<core::basic_frame> render_specific_frame(uint32_t file_position, int hints)
 	{
-		// Some trial and error and undeterministic stuff here
-		static const int NUM_RETRIES = 32;
-		
-		seek(file_position);
+		static const int NUM_RETRIES = 64;
+
+		std::pair<safe_ptr<core::basic_frame>, size_t> frame(core::basic_frame::empty(), 0);
+		bool has_frame = false;
 
-		for (int i = 0; i < NUM_RETRIES; ++i)
+		on_decoder([&]
 		{
-			boost::this_thread::sleep(boost::posix_time::milliseconds(40));
-			auto frame = render_frame(hints);
-			return frame.first;
-		}
-		return caspar::core::basic_frame::empty();
+			// Whatever was decoded before the seek is of no use.
+			clear_decoded();
+			seek(file_position);
+
+			// Decodes as soon as the input has read the packets, instead of waiting a fixed time for them.
+			for (int i = 0; i < NUM_RETRIES && !has_frame && !input_.eof(); ++i)
+			{
+				try_decode_frame(hints);
+
+				has_frame = frame_buffer_.try_pop(frame);
+				if (!has_frame)
+					boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+			}
+		});
+
+		if (!has_frame)
+			return caspar::core::basic_frame::empty();
+
+		last_frame_ = frame.first;
+		file_frame_number_ = frame.second;
+
+		return frame.first;
 	}
 
 	virtual safe_ptr<core::basic_frame> create_thumbnail_frame() override
@@ -316,6 +454,24 @@ public:
 
 		return make_safe<core::basic_frame>(frames);
 	}
+
+	// Thumbnail mode only decodes keyframes, so each frame is the keyframe at or before the start of its interval.
+	virtual std::vector<safe_ptr<core::basic_frame>> create_scrub_frames(int count) override
+	{
+		auto disable_logging = temporary_disable_logging_for_thread(thumbnail_mode_);
+
+		std::vector<safe_ptr<core::basic_frame>> frames;
+
+		if (!video_decoder_)
+			return frames;
+
+		uint64_t total_frames = nb_frames();
+
+		for (int i = 0; i < count; ++i)
+			frames.push_back(render_specific_frame(static_cast<uint32_t>(total_frames * i / count), DEINTERLACE_HINT));
+
+		return frames;
+	}
 	
 	uint32_t file_frame_number() const
 	{
@@ -364,11 +520,14 @@ public:
 		info.add(L"height",				video_decoder_ ? video_decoder_->height() : 0);
 		info.add(L"progressive",		video_decoder_ ? video_decoder_->is_progressive() : false);
 		info.add(L"fps",				fps_);
-		info.add(L"loop",				loop_);
+		info.add(L"loop",				static_cast<bool>(loop_));
 		auto nb_frames2 = nb_frames();
 		info.add(L"nb-frames",			nb_frames2 == std::numeric_limits<int64_t>::max() ? -1 : nb_frames2);
 		info.add(L"file-frame-number",	file_frame_number_);
 		info.add(L"file-nb-frames",		file_nb_frames());
+		info.add(L"decode-time",		decode_time());
+		info.add_child(L"input",		input_.info());
+		info.add(L"resources.queue-depth", buffered_frames());
 		return info;
 	}
 
@@ -397,16 +556,23 @@ public:
 
 		if(boost::regex_match(param, what, seek_exp))
 		{
-			while (!frame_buffer_.empty())
-				frame_buffer_.pop();
-			muxer_->clear();
-			seek(boost::lexical_cast<uint32_t>(what["VALUE"].str()));
+			auto frame = boost::lexical_cast<uint32_t>(what["VALUE"].str());
+			on_decoder([&]
+			{
+				clear_decoded();
+				seek(frame);
+			});
+			request_decode();
 			return L"SEEK OK";
 		}
 		if(boost::regex_match(param, what, field_order_inverted_exp))
 		{
-			if (video_decoder_)
-				video_decoder_->invert_field_order(boost::lexical_cast<bool>(what["VALUE"].str()));
+			auto inverted = boost::lexical_cast<bool>(what["VALUE"].str());
+			on_decoder([&]
+			{
+				if (video_decoder_)
+					video_decoder_->invert_field_order(inverted);
+			});
 			return L"FIELD_ORDER_INVERTED OK";
 		}
 		
@@ -423,6 +589,107 @@ public:
 			audio_decoder_->seek(time_to_seek);
 		file_frame_number_ = frame;
 		decoded_frame_number_ = frame;
+		exhausted_ = false;
+	}
+
+	size_t buffered_frames() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(0, frame_buffer_.unsafe_size()));
+	}
+
+	double decode_time() const
+	{
+		return static_cast<double>(decode_time_) / 1000000.0;
+	}
+
+	// Runs func on the decode thread, between two frames, or right away in thumbnail mode.
+	template<typename Func>
+	void on_decoder(const Func& func)
+	{
+		if (decode_executor_)
+			decode_executor_->invoke(func);
+		else
+			func();
+	}
+
+	// The decoded frames, on the decode thread.
+	void clear_decoded()
+	{
+		std::pair<safe_ptr<core::basic_frame>, size_t> frame(core::basic_frame::empty(), 0);
+		while (frame_buffer_.try_pop(frame))
+			;
+		muxer_->clear();
+		skip_frames_ = 0;
+	}
+
+	// Frames to have decoded ahead, the preroll while in the background.
+	size_t decode_target() const
+	{
+		return on_air_ ? look_ahead_frames_ : std::max(look_ahead_frames_, preroll_frames_);
+	}
+
+	// Has the decode thread decode ahead unless it already does, from receive and preroll.
+	void request_decode()
+	{
+		if (!decode_executor_ || exception_ != nullptr)
+			return;
+
+		auto arena = parallel_arena::current();
+		if (arena != arena_)
+		{
+			arena_ = arena;
+			decode_executor_->set_arena(arena);
+			audio_executor_->set_arena(arena);
+		}
+
+		if (decoding_.fetch_and_store(true))
+			return;
+
+		decode_executor_->begin_invoke([this]
+		{
+			decode_ahead();
+		});
+	}
+
+	// Decodes until a frame comes out, and queues itself again until the target is reached, so that seeks and 
+	// calls get in between frames. Stops when the decoders give nothing, receive asks again the next frame.
+	void decode_ahead()
+	{
+		try
+		{
+			if (buffered_frames() < decode_target() || skip_frames_ > 0)
+			{
+				size_t decoded = 0;
+				for (int n = 0; n < 32 && decoded == 0; ++n)
+					decoded = try_decode_frame(hints_);
+
+				if (decoded > 0 && decode_executor_->is_running())
+				{
+					decode_executor_->begin_invoke([this]
+					{
+						decode_ahead();
+					});
+					return;
+				}
+
+				exhausted_ = at_end();
+			}
+		}
+		catch (...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			exception_ = std::current_exception();
+		}
+
+		decoding_ = false;
+	}
+
+	bool at_end() const
+	{
+		if (loop_)
+			return false;
+
+		return input_.eof() || (length_ != std::numeric_limits<uint32_t>().max() && decoded_frame_number_ >= start_ + length_);
 	}
 
 
@@ -431,17 +698,34 @@ public:
 		std::shared_ptr<AVFrame>			video;
 		std::shared_ptr<core::audio_buffer> audio;
 
-		tbb::parallel_invoke(
-			[&]
+		decode_ticket ticket(on_air_ && !thumbnail_mode_ ? decode_priority::on_air : decode_priority::background);
+		boost::timer decode_timer;
+
+		auto decode_video = [&]
 		{
 			if (!muxer_->video_ready() && video_decoder_)
+			{
+				video_decoder_->set_skip_loop_filter((hints & core::frame_producer::QUARTER_SCALE_HINT) != 0);
 				video = video_decoder_->poll();
-		},
-			[&]
+			}
+		};
+
+		bool decode_audio = !muxer_->audio_ready() && audio_decoder_;
+		if (decode_audio && audio_executor_)
+		{
+			auto decoded_audio = audio_executor_->begin_invoke([this]
+			{
+				return audio_decoder_->poll();
+			});
+			decode_video();
+			audio = decoded_audio.get();
+		}
+		else
 		{
-			if (!muxer_->audio_ready() && audio_decoder_)
+			decode_video();
+			if (decode_audio)
 				audio = audio_decoder_->poll();
-		});
+		}
 
 		if ((!audio_decoder_ || (audio == nullptr && input_.eof()))
 			&& !muxer_->audio_ready())
@@ -456,23 +740,48 @@ public:
 		}
 		else
 			muxer_->push(video, hints);
+
+		decode_time_ = static_cast<int64_t>(decode_timer.elapsed() * 1000000.0);
 	}
 	
-	void try_decode_frame(int hints)
+	// Returns the number of frames the muxer gave, including those of the loop head that are skipped.
+	size_t try_decode_frame(int hints)
 	{
 		if (loop_ && 
 			((length_ != std::numeric_limits<uint32_t>().max() && decoded_frame_number_ >= start_ + length_) 
 				|| input_.eof()))
+		{
+			// Play the cached head while the decoders start over, the frames it covers are dropped once decoded again.
+			if (loop_head_frames_ > 0 && loop_head_.size() == loop_head_frames_)
+			{
+				for (size_t n = 0; n < loop_head_.size(); ++n)
+					frame_buffer_.push(std::make_pair(loop_head_[n], start_ + n));
+				skip_frames_ = loop_head_.size();
+			}
 			seek(start_);
+		}
 		if (!loop_ && length_ != std::numeric_limits<uint32_t>().max() && decoded_frame_number_ >= start_ + length_)
-			return;
+			return 0;
 
 		decode_frame(hints);
 		
-		for (auto frame = muxer_->poll(); frame; frame = muxer_->poll())
+		size_t decoded = 0;
+		for (auto frame = muxer_->poll(); frame; frame = muxer_->poll(), ++decoded)
 		{
+			if (skip_frames_ > 0)
+			{
+				--skip_frames_;
+				++decoded_frame_number_;
+				continue;
+			}
+
+			if (loop_ && loop_head_.size() < loop_head_frames_ && decoded_frame_number_ >= start_ && decoded_frame_number_ - start_ == loop_head_.size())
+				loop_head_.push_back(make_safe_ptr(frame));
+
 			frame_buffer_.push(std::make_pair(make_safe_ptr(frame), decoded_frame_number_++));
 		}
+
+		return decoded;
 	}
 
 	core::monitor::subject& monitor_output()
@@ -481,22 +790,178 @@ public:
 	}
 };
 
-safe_ptr<core::frame_producer> create_producer(
-		const safe_ptr<core::frame_factory>& frame_factory,
-		const core::parameters& params)
-{		
+// Plays a clip from the clip cache, muxing its decoded frames like ffmpeg_producer does.
+struct cached_clip_producer : public core::frame_producer
+{
+	core::monitor::subject										monitor_subject_;
+	const std::shared_ptr<const cached_clip>					clip_;
+	const std::wstring											path_relative_to_media_;
+	const std::string											path_relative_to_media_utf8_;
+	const safe_ptr<core::frame_factory>							frame_factory_;
+	const bool													loop_;
+	const int													hints_;
+	std::unique_ptr<frame_muxer>								muxer_;
+	size_t														video_pos_;
+	size_t														audio_pos_;
+	std::queue<safe_ptr<core::basic_frame>>						frame_buffer_;
+	safe_ptr<core::basic_frame>									last_frame_;
+	uint32_t													frame_number_;
+
+public:
+	cached_clip_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::shared_ptr<const cached_clip>& clip, bool loop, bool alpha_mode)
+		: clip_(clip)
+		, path_relative_to_media_(get_relative_or_original(clip->filename, env::media_folder()))
+		, path_relative_to_media_utf8_(narrow(path_relative_to_media_))
+		, frame_factory_(frame_factory)
+		, loop_(loop)
+		, hints_(alpha_mode ? core::frame_producer::ALPHA_HINT : core::frame_producer::NO_HINT)
+		, last_frame_(core::basic_frame::empty())
+		, frame_number_(0)
+	{
+		restart();
+		fill();
+	}
+
+	void restart()
+	{
+		muxer_.reset(new frame_muxer(clip_->frame_rate, frame_factory_, false, clip_->audio_channel_layout));
+		video_pos_ = 0;
+		audio_pos_ = 0;
+	}
+
+	bool eof() const
+	{
+		return video_pos_ >= clip_->video.size() && audio_pos_ >= clip_->audio.size();
+	}
+
+	void fill()
+	{
+		for (int n = 0; n < 32 && frame_buffer_.size() < 2; ++n)
+		{
+			if (eof())
+			{
+				if (!loop_)
+					return;
+				restart();
+			}
+
+			if (!muxer_->video_ready())
+			{
+				if (video_pos_ < clip_->video.size())
+				{
+					// The muxer changes frame properties, the data is shared with the cache.
+					std::shared_ptr<AVFrame> frame(av_frame_clone(clip_->video[video_pos_++].get()), [](AVFrame* f){av_frame_free(&f);});
+					muxer_->push(frame, hints_);
+				}
+			}
+
+			if (!muxer_->audio_ready())
+				muxer_->push(audio_pos_ < clip_->audio.size() ? std::shared_ptr<core::audio_buffer>(clip_->audio[audio_pos_++]) : empty_audio());
+
+			for (auto frame = muxer_->poll(); frame; frame = muxer_->poll())
+				frame_buffer_.push(make_safe_ptr(frame));
+		}
+	}
+
+	// frame_producer
+
+	virtual safe_ptr<core::basic_frame> receive(int) override
+	{
+		fill();
+
+		if (frame_buffer_.empty())
+			return eof() ? last_frame() : core::basic_frame::late();
+
+		last_frame_ = frame_buffer_.front();
+		frame_buffer_.pop();
+		++frame_number_;
+
+		monitor_subject_	<< core::monitor::message("/file/frame")	% static_cast<int32_t>(frame_number_) % static_cast<int32_t>(clip_->video.size())
+							<< core::monitor::message("/file/path")		% path_relative_to_media_utf8_
+							<< core::monitor::message("/loop")			% loop_;
+
+		return last_frame_;
+	}
+
+	virtual safe_ptr<core::basic_frame> last_frame() const override
+	{
+		return pause(disable_audio(last_frame_));
+	}
+
+	virtual uint32_t nb_frames() const override
+	{
+		return loop_ ? std::numeric_limits<uint32_t>::max() : static_cast<uint32_t>(clip_->video.size());
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"ffmpeg[" + boost::filesystem::wpath(clip_->filename).filename() + L"|cached|" + boost::lexical_cast<std::wstring>(frame_number_) + L"/" + boost::lexical_cast<std::wstring>(clip_->video.size()) + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",				L"ffmpeg-producer");
+		info.add(L"filename",			clip_->filename);
+		info.add(L"cached",				true);
+		info.add(L"loop",				loop_);
+		info.add(L"nb-frames",			clip_->video.size());
+		info.add(L"frame-number",		frame_number_);
+		return info;
+	}
+
+	core::monitor::subject& monitor_output()
+	{
+		return monitor_subject_;
+	}
+};
+
+std::wstring find_clip_file(const core::parameters& params)
+{
 	static const std::vector<std::wstring> invalid_exts = boost::assign::list_of(L".png")(L".tga")(L".bmp")(L".jpg")(L".jpeg")(L".gif")(L".tiff")(L".tif")(L".jp2")(L".jpx")(L".j2k")(L".j2c")(L".swf")(L".ct");
 
+	// Network streams are opened by their url.
+	if(is_network_url(params.at_original(0)))
+		return params.at_original(0);
+
 	// Infer the resource type from the resource_name
 	auto tokens = core::parameters::protocol_split(params.at_original(0));
 	auto filename = tokens[1];
 	if (!is_valid_file(filename, invalid_exts))
 		filename = env::media_folder() + L"\\" + tokens[1];
-	if(!boost::filesystem::exists(filename))
+	if(!boost::filesystem::is_regular_file(filename)) // Folders are image sequences.
 		filename = probe_stem(filename, invalid_exts);
+	return filename;
+}
+
+bool pin_clip(const safe_ptr<core::frame_factory>& frame_factory, const core::parameters& params)
+{
+	auto filename = find_clip_file(params);
+	return !filename.empty() && !is_network_url(filename) && pin_clip(filename, frame_factory->get_video_format_desc());
+}
+
+bool unpin_clip(const core::parameters& params)
+{
+	auto filename = find_clip_file(params);
+	return !filename.empty() && unpin_clip(filename);
+}
+
+safe_ptr<core::frame_producer> create_producer(
+		const safe_ptr<core::frame_factory>& frame_factory,
+		const core::parameters& params)
+{		
+	auto filename = find_clip_file(params);
 	if(filename.empty())
 		return core::frame_producer::empty();
 	
+	// Pinned clips play from memory unless they are trimmed, filtered or need other decoder settings.
+	if(!params.has(L"SEEK") && !params.has(L"LENGTH") && !params.has(L"FILTER") && !params.has(L"CHANNEL_LAYOUT") && !params.has(L"FIELD_ORDER_INVERTED") && !params.has(L"AUDIO_TRACKS"))
+	{
+		auto clip = find_cached_clip(filename, frame_factory->get_video_format_desc());
+		if(clip)
+			return create_producer_destroy_proxy(make_safe<cached_clip_producer>(frame_factory, clip, params.has(L"LOOP"), params.has(L"IS_ALPHA")));
+	}
+
 	auto loop		= params.has(L"LOOP");
 	auto start		= params.get(L"SEEK", static_cast<uint32_t>(0));
 	auto length		= params.get(L"LENGTH", std::numeric_limits<uint32_t>::max());
@@ -504,11 +969,13 @@ safe_ptr<core::frame_producer> create_producer(
 	auto custom_channel_order	= params.get(L"CHANNEL_LAYOUT", L"");
 	auto field_order_inverted = params.has(L"FIELD_ORDER_INVERTED");
 	bool is_alpha = params.has(L"IS_ALPHA");
+	auto hwaccel = params.get(L"HWACCEL", env::properties().get(L"configuration.ffmpeg.hwaccel", L"none"));
+	auto audio_tracks = params.get(L"AUDIO_TRACKS", L"");
 
 	boost::replace_all(filter_str, L"DEINTERLACE", L"YADIF=0:-1");
 	boost::replace_all(filter_str, L"DEINTERLACE_BOB", L"YADIF=1:-1");
 	
-	return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, filename, filter_str, loop, start, length, false, is_alpha, custom_channel_order, field_order_inverted));
+	return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, filename, filter_str, loop, start, length, false, is_alpha, custom_channel_order, field_order_inverted, hwaccel, audio_tracks));
 }
 
 safe_ptr<core::frame_producer> create_thumbnail_producer(
@@ -523,7 +990,7 @@ safe_ptr<core::frame_producer> create_thumbnail_producer(
 	if(filename.empty())
 		return core::frame_producer::empty();
 	
-	return make_safe<ffmpeg_producer>(frame_factory, filename, L"", false, 0, std::numeric_limits<uint32_t>::max(), true, false, L"", false);
+	return make_safe<ffmpeg_producer>(frame_factory, filename, L"", false, 0, std::numeric_limits<uint32_t>::max(), true, false, L"", false, L"none", L"");
 }
 
 }}
\ No newline at end of file
@@ -45,4 +45,9 @@ safe_ptr<core::frame_producer> create_thumbnail_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params);
 
+// Keeps the clip decoded in memory so that producers of it start without opening or decoding the file, see 
+// clip_cache.h. Return false if there is no such clip.
+bool pin_clip(const safe_ptr<core::frame_factory>& frame_factory, const core::parameters& params);
+bool unpin_clip(const core::parameters& params);
+
 }}
\ No newline at end of file
@@ -104,6 +104,8 @@ struct filter::implementation
 		{
 			out_pix_fmts_ = boost::assign::list_of
 				(AV_PIX_FMT_YUVA420P)
+				(AV_PIX_FMT_YUVA422P)
+				(AV_PIX_FMT_YUVA444P)
 				(AV_PIX_FMT_YUV444P)
 				(AV_PIX_FMT_YUV422P)
 				(AV_PIX_FMT_YUV420P)
@@ -112,7 +114,17 @@ struct filter::implementation
 				(AV_PIX_FMT_ARGB)
 				(AV_PIX_FMT_RGBA)
 				(AV_PIX_FMT_ABGR)
-				(AV_PIX_FMT_GRAY8);
+				(AV_PIX_FMT_GRAY8)
+				(AV_PIX_FMT_NV12)
+				(AV_PIX_FMT_P010LE)
+				(AV_PIX_FMT_YUVA444P10LE)
+				(AV_PIX_FMT_YUVA422P10LE)
+				(AV_PIX_FMT_YUVA420P10LE)
+				(AV_PIX_FMT_YUV444P10LE)
+				(AV_PIX_FMT_YUV422P10LE)
+				(AV_PIX_FMT_YUV420P10LE)
+				(AV_PIX_FMT_RGBA64LE)
+				(AV_PIX_FMT_RGB48LE);
 		}		
 		out_pix_fmts_.push_back(AV_PIX_FMT_NONE);
 
@@ -355,6 +367,7 @@ filter& filter::operator=(filter&& other){impl_ = std::move(other.impl_); return
 void filter::push(const std::shared_ptr<AVFrame>& frame){impl_->push(frame);}
 std::shared_ptr<AVFrame> filter::poll(){return impl_->poll();}
 std::string filter::filter_str() const{return impl_->filtergraph_;}
+bool filter::is_fast_path() const{return impl_->fast_path();}
 std::vector<safe_ptr<AVFrame>> filter::poll_all()
 {	
 	std::vector<safe_ptr<AVFrame>> frames;
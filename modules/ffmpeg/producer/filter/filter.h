@@ -66,6 +66,7 @@ public:
 	AVRational out_frame_rate();
 	AVRational out_time_base();
 	AVRational out_sample_aspect_ratio();
+	bool is_fast_path() const;
 
 	std::string filter_str() const;
 			
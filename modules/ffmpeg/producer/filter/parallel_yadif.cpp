@@ -24,6 +24,7 @@
 #include "parallel_yadif.h"
 
 #include <common/log/log.h>
+#include <common/concurrency/parallel_arena.h>
 
 #if defined(_MSC_VER)
 #pragma warning (push)
@@ -88,7 +89,7 @@ void parallel_yadif_filter_line(parallel_yadif_context& ctx, uint8_t *dst, uint8
 	
 	if(ctx.index == ctx.last_index)
 	{		
-		tbb::parallel_for(tbb::blocked_range<size_t>(0, ctx.index), [=](const tbb::blocked_range<size_t>& r)
+		caspar::arena_parallel_for(tbb::blocked_range<size_t>(0, ctx.index), [=](const tbb::blocked_range<size_t>& r)
 		{
 			for(auto n = r.begin(); n != r.end(); ++n)
 				org_yadif_filter_line(ctx.args[n].dst, ctx.args[n].prev, ctx.args[n].cur, ctx.args[n].next, ctx.args[n].w, ctx.args[n].prefs, ctx.args[n].mrefs, ctx.args[n].parity, ctx.args[n].mode);
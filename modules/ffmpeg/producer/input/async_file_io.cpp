@@ -0,0 +1,297 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "async_file_io.h"
+
+#include <common/env.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/memory/tagged_allocator.h>
+#include <common/utility/string.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <deque>
+#include <vector>
+
+#include <windows.h>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avio.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+static const int IO_BUFFER_SIZE = 256*1024;
+
+struct async_file_io::implementation : boost::noncopyable
+{
+	struct chunk : boost::noncopyable
+	{
+		OVERLAPPED				overlapped;
+		std::vector<uint8_t, tagged_allocator<uint8_t, allocation_subsystem::producer>>	data;
+		int64_t					offset;
+		DWORD					bytes;
+		bool					pending;
+		bool					failed;
+
+		explicit chunk(size_t size)
+			: data(size)
+			, offset(0)
+			, bytes(0)
+			, pending(false)
+			, failed(false)
+		{
+			std::memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+		}
+
+		~chunk()
+		{
+			CloseHandle(overlapped.hEvent);
+		}
+	};
+
+	const std::wstring					filename_;
+	const size_t						chunk_size_;
+	const size_t						chunk_count_;
+	HANDLE								file_;
+	int64_t								size_;
+	int64_t								position_;
+	std::deque<std::unique_ptr<chunk>>	chunks_;	// Consecutive chunks from the one holding position_.
+	std::vector<std::unique_ptr<chunk>>	free_;
+	std::shared_ptr<AVIOContext>		context_;
+	boost::timer						timer_;
+	tbb::atomic<int64_t>				bytes_read_;
+	tbb::atomic<int64_t>				underruns_;
+
+	implementation(const std::wstring& filename)
+		: filename_(filename)
+		, chunk_size_(std::max(64, env::properties().get(L"configuration.ffmpeg.io-chunk-size", 1024)) * 1024)
+		, chunk_count_(std::max(1, env::properties().get(L"configuration.ffmpeg.io-chunks", 8)))
+		, file_(CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr))
+		, size_(0)
+		, position_(0)
+	{
+		bytes_read_ = 0;
+		underruns_	= 0;
+
+		if(file_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not open file.") << boost::errinfo_file_name(narrow(filename_)));
+
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(file_, &size))
+		{
+			CloseHandle(file_);
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not get file size.") << boost::errinfo_file_name(narrow(filename_)));
+		}
+		size_ = size.QuadPart;
+
+		for(size_t n = 0; n < chunk_count_; ++n)
+			free_.push_back(std::unique_ptr<chunk>(new chunk(chunk_size_)));
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+		context_.reset(avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, this, &read_packet, nullptr, &seek), [](AVIOContext* context)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		});
+	}
+
+	~implementation()
+	{
+		cancel();
+		CloseHandle(file_);
+	}
+
+	void issue(int64_t offset)
+	{
+		auto c = std::move(free_.back());
+		free_.pop_back();
+
+		c->offset					= offset;
+		c->bytes					= 0;
+		c->failed					= false;
+		c->overlapped.Offset		= static_cast<DWORD>(offset & 0xFFFFFFFF);
+		c->overlapped.OffsetHigh	= static_cast<DWORD>(offset >> 32);
+		ResetEvent(c->overlapped.hEvent);
+
+		if(ReadFile(file_, c->data.data(), static_cast<DWORD>(chunk_size_), nullptr, &c->overlapped) || GetLastError() == ERROR_IO_PENDING)
+			c->pending = true;
+		else
+		{
+			c->pending = false;
+			c->failed  = GetLastError() != ERROR_HANDLE_EOF;
+		}
+
+		chunks_.push_back(std::move(c));
+	}
+
+	void wait(chunk& c)
+	{
+		if(!c.pending)
+			return;
+
+		if(!HasOverlappedIoCompleted(&c.overlapped))
+			++underruns_;
+
+		DWORD bytes = 0;
+		if(!GetOverlappedResult(file_, &c.overlapped, &bytes, TRUE))
+			c.failed = GetLastError() != ERROR_HANDLE_EOF && GetLastError() != ERROR_OPERATION_ABORTED;
+
+		c.bytes	  = bytes;
+		c.pending = false;
+	}
+
+	void cancel()
+	{
+		while(!chunks_.empty())
+		{
+			auto& c = *chunks_.front();
+			if(c.pending)
+			{
+				CancelIoEx(file_, &c.overlapped);
+
+				DWORD bytes = 0;
+				GetOverlappedResult(file_, &c.overlapped, &bytes, TRUE);
+				c.pending = false;
+			}
+			free_.push_back(std::move(chunks_.front()));
+			chunks_.pop_front();
+		}
+	}
+
+	// Keeps the chunks in flight from the one holding position_, starting over when it is outside of them.
+	chunk* current()
+	{
+		if(chunks_.empty() || position_ < chunks_.front()->offset || position_ >= chunks_.back()->offset + static_cast<int64_t>(chunk_size_))
+		{
+			cancel();
+			for(auto offset = position_ - position_ % chunk_size_; offset < size_ && !free_.empty(); offset += chunk_size_)
+				issue(offset);
+		}
+
+		while(!chunks_.empty() && position_ >= chunks_.front()->offset + static_cast<int64_t>(chunk_size_))
+		{
+			wait(*chunks_.front());
+			free_.push_back(std::move(chunks_.front()));
+			chunks_.pop_front();
+
+			auto next = chunks_.empty() ? position_ - position_ % chunk_size_ : chunks_.back()->offset + chunk_size_;
+			if(next < size_)
+				issue(next);
+		}
+
+		if(chunks_.empty())
+			return nullptr;
+
+		wait(*chunks_.front());
+		return chunks_.front().get();
+	}
+
+	int read(uint8_t* buffer, int size)
+	{
+		if(position_ >= size_)
+			return AVERROR_EOF;
+
+		auto c = current();
+		if(!c)
+			return AVERROR_EOF;
+
+		if(c->failed)
+		{
+			CASPAR_LOG(error) << L"[async_file_io] Read failed: " << filename_;
+			return AVERROR(EIO);
+		}
+
+		auto begin = position_ - c->offset;
+		if(begin >= c->bytes)
+			return AVERROR_EOF;
+
+		auto count = static_cast<int>(std::min<int64_t>(size, c->bytes - begin));
+		std::memcpy(buffer, c->data.data() + begin, count);
+
+		position_	+= count;
+		bytes_read_ += count;
+
+		return count;
+	}
+
+	int64_t seek(int64_t offset, int whence)
+	{
+		switch(whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:	return size_;
+		case SEEK_SET:		position_ = offset;			 break;
+		case SEEK_CUR:		position_ = position_ + offset; break;
+		case SEEK_END:		position_ = size_ + offset;	 break;
+		default:			return AVERROR(EINVAL);
+		}
+		return position_;
+	}
+
+	static int read_packet(void* opaque, uint8_t* buffer, int size)
+	{
+		return static_cast<implementation*>(opaque)->read(buffer, size);
+	}
+
+	static int64_t seek(void* opaque, int64_t offset, int whence)
+	{
+		return static_cast<implementation*>(opaque)->seek(offset, whence);
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",		L"async");
+		info.add(L"bytes-read",	bytes_read_);
+		info.add(L"read-rate",	static_cast<int64_t>(bytes_read_ / std::max(timer_.elapsed(), 0.001)));
+		info.add(L"underruns",	underruns_);
+		info.add(L"chunk-size",	chunk_size_);
+		info.add(L"chunks",		chunk_count_);
+		return info;
+	}
+};
+
+async_file_io::async_file_io(const std::wstring& filename) : impl_(new implementation(filename)){}
+AVIOContext* async_file_io::context(){return impl_->context_.get();}
+int64_t async_file_io::bytes_read() const{return impl_->bytes_read_;}
+int64_t async_file_io::underruns() const{return impl_->underruns_;}
+boost::property_tree::wptree async_file_io::info() const{return impl_->info();}
+
+}}
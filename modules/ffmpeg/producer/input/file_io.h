@@ -0,0 +1,47 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+
+struct AVIOContext;
+
+namespace caspar { namespace ffmpeg {
+
+// Custom io for the demuxer, see async_file_io and mapped_file_io.
+class file_io : boost::noncopyable
+{
+public:
+	virtual ~file_io(){}
+
+	// For AVFormatContext::pb together with AVFMT_FLAG_CUSTOM_IO, valid as long as this object.
+	virtual AVIOContext* context() = 0;
+
+	virtual int64_t bytes_read() const = 0;
+	virtual int64_t underruns() const = 0;	// Reads that had to wait for the storage.
+	virtual boost::property_tree::wptree info() const = 0;
+};
+
+}}
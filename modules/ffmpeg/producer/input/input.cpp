@@ -22,9 +22,13 @@
 #include "../../stdafx.h"
 
 #include "input.h"
+#include "async_file_io.h"
+#include "mapped_file_io.h"
+#include "network_io.h"
 
 #include "../util/util.h"
 #include "../util/flv.h"
+#include "../util/seek_index.h"
 #include "../../ffmpeg_error.h"
 #include "../../ffmpeg.h"
 
@@ -35,6 +39,7 @@
 #include <common/concurrency/future_util.h>
 #include <common/exception/exceptions.h>
 #include <common/exception/win32_exception.h>
+#include <common/env.h>
 
 #include <tbb/concurrent_queue.h>
 #include <tbb/atomic.h>
@@ -42,10 +47,17 @@
 
 #include <boost/rational.hpp>
 #include <boost/range/algorithm.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 #if defined(_MSC_VER)
 #pragma warning (push)
 #pragma warning (disable : 4244)
@@ -55,6 +67,7 @@ extern "C"
 	#define __STDC_CONSTANT_MACROS
 	#define __STDC_LIMIT_MACROS
 	#include <libavformat/avformat.h>
+	#include <libavutil/time.h>
 }
 #if defined(_MSC_VER)
 #pragma warning (pop)
@@ -64,36 +77,98 @@ static const size_t MAX_BUFFER_COUNT    = 500;
 static const size_t MAX_BUFFER_COUNT_RT = 3;
 static const size_t MIN_BUFFER_COUNT    = 50;
 static const int32_t FLUSH_AV_PACKET_COUNT = 0x150;
+static const int64_t MAX_TIMESTAMP_JUMP = 10 * AV_TIME_BASE;	// Live timestamps further off the clock restart it.
+static const int64_t CLOCK_SLEW = 256;	// Packets over which the live clock corrects a latency error.
 
 
 namespace caspar { namespace ffmpeg {
 		
 struct input::implementation : boost::noncopyable
 {		
+	// The packets of one of the decoded audio streams.
+	struct audio_stream : boost::noncopyable
+	{
+		const int													index;
+		tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>	buffer;
+		tbb::atomic<int64_t>										duration;
+		std::shared_ptr<AVPacket>									held; // Live packets popped before they are due.
+
+		explicit audio_stream(int index)
+			: index(index)
+		{
+			duration = 0;
+		}
+	};
+
 	const safe_ptr<diagnostics::graph>							graph_;
+	tbb::atomic<bool>											aborted_; // Interrupts the protocols of live inputs.
 
+	const bool													live_;
+	const std::shared_ptr<file_io>								io_;
+	const std::shared_ptr<network_io>							network_;
 	const safe_ptr<AVFormatContext>								format_context_; // Destroy this last
+	const safe_ptr<log_counters>								log_counters_;
+	const std::shared_ptr<void>									log_registration_;
 			
 	const std::wstring											filename_;
 	const bool													thumbnail_mode_;
 	tbb::atomic<bool>											is_eof_;
 	tbb::atomic<int>											flush_av_packet_count_;
 	tbb::atomic<int>											video_stream_index_;
-	tbb::atomic<int>											audio_stream_index_;
-	tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>	audio_buffer_;
+	std::vector<std::shared_ptr<audio_stream>>					audio_streams_; // Opened before the first packet is read.
+	bool														streams_discarded_;
 	tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>	video_buffer_;
-	executor													executor_;
+	std::shared_ptr<AVPacket>									held_video_;
+	const int64_t												max_buffer_bytes_;
+	const int64_t												min_buffer_duration_;
+	tbb::atomic<int64_t>										buffer_bytes_;
+	tbb::atomic<int64_t>										video_buffer_duration_;
+	int64_t														underruns_;
+	std::shared_ptr<seek_index>									seek_index_;
 
+	// Live inputs release the packets to the decoders at the rate of their timestamps, which the ts demuxer relates
+	// to the pcr, jitter_buffer_ after the first one arrived. The clock is corrected towards that latency.
+	const int64_t												jitter_buffer_;
+	const int64_t												max_latency_;
+	boost::mutex												clock_mutex_;
+	bool														clock_started_;
+	int64_t														clock_base_;	// When the packet at clock_time_ is due.
+	int64_t														clock_time_;
+	tbb::atomic<int64_t>										newest_time_;	// Of the packets read.
+	tbb::atomic<int64_t>										skip_until_;	// Packets before it are dropped to catch up.
+	tbb::atomic<bool>											video_skipping_;
+	tbb::atomic<bool>											reading_;
+	tbb::atomic<int>											resyncs_;
+	tbb::atomic<int64_t>										latency_;
+	int64_t														overflows_;
+	int64_t														lost_packets_;
+
+	executor													executor_;
 
-	
 	explicit implementation(const safe_ptr<diagnostics::graph> graph, 
 		const std::wstring& filename, 
 		bool thumbnail_mode
 		)
 		: graph_(graph)
+		, aborted_()
+		, live_(is_network_url(filename))
 		, filename_(filename)
+		, io_(open_io(filename, thumbnail_mode))
+		, network_(std::dynamic_pointer_cast<network_io>(io_))
 		, format_context_(open_input(filename))
+		, log_registration_(register_log_context(format_context_.get(), log_counters_))
 		, thumbnail_mode_(thumbnail_mode)
+		, max_buffer_bytes_(static_cast<int64_t>(std::max(1, env::properties().get(L"configuration.ffmpeg.input-buffer-size", 256))) * 1024 * 1024)
+		, min_buffer_duration_(static_cast<int64_t>(env::properties().get(L"configuration.ffmpeg.input-buffer-duration", 2.0) * AV_TIME_BASE))
+		, streams_discarded_(false)
+		, underruns_(0)
+		, jitter_buffer_(static_cast<int64_t>(std::max(0, env::properties().get(L"configuration.ffmpeg.network.jitter-buffer", 200))) * 1000)
+		, max_latency_(std::max(jitter_buffer_ * 2, static_cast<int64_t>(env::properties().get(L"configuration.ffmpeg.network.max-latency", 1000)) * 1000))
+		, clock_started_(false)
+		, clock_base_(0)
+		, clock_time_(0)
+		, overflows_(0)
+		, lost_packets_(0)
 		, executor_(print())
 	{
 		if (thumbnail_mode_)
@@ -103,23 +178,108 @@ struct input::implementation : boost::noncopyable
 			});
 		is_eof_			= false;
 		video_stream_index_ = -1;
-		audio_stream_index_ = -1;
+		buffer_bytes_ = 0;
+		video_buffer_duration_ = 0;
 		graph_->set_color("audio-buffer-count", diagnostics::color(0.7f, 0.4f, 0.4f));
 		graph_->set_color("video-buffer-count", diagnostics::color(1.0f, 1.0f, 0.0f));	
+		graph_->set_color("buffer-size", diagnostics::color(1.0f, 1.0f, 1.0f));
+		graph_->set_color("io-underrun", diagnostics::color(0.6f, 0.3f, 0.9f));
+		newest_time_ = AV_NOPTS_VALUE;
+		skip_until_ = AV_NOPTS_VALUE;
+		video_skipping_ = false;
+		reading_ = false;
+		resyncs_ = 0;
+		latency_ = 0;
+
+		if(live_)
+		{
+			graph_->set_color("jitter-buffer", diagnostics::color(0.3f, 0.8f, 1.0f));
+			graph_->set_color("resync", diagnostics::color(1.0f, 0.6f, 0.0f));
+			if(network_)
+			{
+				graph_->set_color("network-buffer", diagnostics::color(0.5f, 0.5f, 1.0f));
+				graph_->set_color("packet-loss", diagnostics::color(1.0f, 0.3f, 0.3f));
+				graph_->set_color("network-overflow", diagnostics::color(1.0f, 0.0f, 1.0f));
+			}
+		}
+
+		if(!thumbnail_mode_ && !live_ && env::properties().get(L"configuration.ffmpeg.seek-index", true))
+			seek_index_ = seek_index::get(filename_);
+	}
+
+	~implementation()
+	{
+		aborted_ = true;
+		if(network_)
+			network_->abort();
+		executor_.clear();
+	}
+
+	static int interrupt_callback(void* opaque)
+	{
+		return static_cast<implementation*>(opaque)->aborted_ ? 1 : 0;
 	}
 
 	safe_ptr<AVCodecContext> open_audio_codec(int& index)
 	{
 		auto ret = open_codec(format_context_, AVMEDIA_TYPE_AUDIO, index);
-		audio_stream_index_ = index;
-		return ret;
+		audio_streams_.push_back(std::make_shared<audio_stream>(index));
+		return register_codec(ret);
+	}
+
+	safe_ptr<AVCodecContext> open_audio_stream(int index)
+	{
+		auto ret = open_stream_codec(format_context_, index);
+		audio_streams_.push_back(std::make_shared<audio_stream>(index));
+		return register_codec(ret);
+	}
+
+	audio_stream* find_audio_stream(int index)
+	{
+		BOOST_FOREACH(auto& stream, audio_streams_)
+		{
+			if(index == -1 || stream->index == index)
+				return stream.get();
+		}
+		return nullptr;
+	}
+
+	// Streams nothing decodes are skipped by the demuxer instead of being read and dropped packet by packet.
+	void discard_unused_streams()
+	{
+		streams_discarded_ = true;
+
+		for(unsigned int index = 0; index < format_context_->nb_streams; ++index)
+		{
+			if(static_cast<int>(index) != video_stream_index_ && !find_audio_stream(index))
+				format_context_->streams[index]->discard = AVDISCARD_ALL;
+		}
 	}
 	
-	safe_ptr<AVCodecContext> open_video_codec(int& index)
+	safe_ptr<AVCodecContext> open_video_codec(int& index, const std::wstring& hwaccel)
 	{
-		auto ret = open_codec(format_context_, AVMEDIA_TYPE_VIDEO, index);
+		int thumbnail_width = 0;
+		int thumbnail_height = 0;
+
+		if (thumbnail_mode_)
+			get_thumbnail_tile_size(thumbnail_width, thumbnail_height);
+
+		auto ret = open_codec(format_context_, AVMEDIA_TYPE_VIDEO, index, hwaccel, thumbnail_height);
 		video_stream_index_ = index;
-		return ret;
+		return register_codec(ret);
+	}
+
+	// The decoders' messages are counted with the input's, for as long as the codec is open.
+	safe_ptr<AVCodecContext> register_codec(const safe_ptr<AVCodecContext>& context)
+	{
+		auto registration = register_log_context(context.get(), log_counters_);
+		std::shared_ptr<AVCodecContext> holder = context;
+
+		return safe_ptr<AVCodecContext>(context.get(), [registration, holder](AVCodecContext*) mutable
+		{
+			registration.reset();
+			holder.reset();
+		});
 	}
 
 	bool get_flush_av_packet(std::shared_ptr<AVPacket>& packet)
@@ -134,29 +294,42 @@ struct input::implementation : boost::noncopyable
 		return false;
 	}
 	
-	bool try_pop_audio(std::shared_ptr<AVPacket>& packet)
+	bool try_pop_audio(std::shared_ptr<AVPacket>& packet, int index)
 	{	
+		auto stream = find_audio_stream(index);
+		if(!stream)
+			return false;
+
+		if(live_)
+			return try_pop_live(stream->buffer, stream->held, stream->duration, false, packet);
+
 		bool result = false;
 		for (int i = 0; i < 32 && !result; ++i)
 		{
-			result = audio_buffer_.try_pop(packet);
+			result = stream->buffer.try_pop(packet);
 			if (!result)
 				if (is_eof_)
 					return get_flush_av_packet(packet);
 				else
 				{
 					boost::this_thread::sleep(boost::posix_time::milliseconds(10));
-					result = audio_buffer_.try_pop(packet);
+					result = stream->buffer.try_pop(packet);
 				}
 		}
 		if(result)
+		{
+			on_pop(packet, stream->duration);
 			tick();
-		graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size())+0.001)/MAX_BUFFER_COUNT);
+		}
+		graph_->set_value("audio-buffer-count", (static_cast<double>(stream->buffer.size())+0.001)/MAX_BUFFER_COUNT);
 		return result;
 	}
 
 	bool try_pop_video(std::shared_ptr<AVPacket>& packet)
 	{
+		if(live_)
+			return try_pop_live(video_buffer_, held_video_, video_buffer_duration_, true, packet);
+
 		bool result = false;
 		for (int i = 0; i < 32 && !result; ++i)
 		{
@@ -171,11 +344,140 @@ struct input::implementation : boost::noncopyable
 				}
 		}
 		if(result)
+		{
+			on_pop(packet, video_buffer_duration_);
 			tick();
+		}
 		graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001)/MAX_BUFFER_COUNT);
 		return result;
 	}
 
+	// Live packets are not waited for, the jitter buffer is what covers the network.
+	bool try_pop_live(tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>& buffer, std::shared_ptr<AVPacket>& held, tbb::atomic<int64_t>& duration, bool video, std::shared_ptr<AVPacket>& packet)
+	{
+		while(true)
+		{
+			if(!held && !buffer.try_pop(held))
+			{
+				tick();
+				return is_eof_ ? get_flush_av_packet(packet) : false;
+			}
+
+			if(is_skipped(*held, video))
+			{
+				on_pop(held, duration);
+				held.reset();
+				continue;
+			}
+
+			if(!is_due(*held))
+				return false;
+
+			packet = held;
+			held.reset();
+			on_pop(packet, duration);
+			tick();
+			return true;
+		}
+	}
+
+	// In AV_TIME_BASE, decoding order.
+	int64_t packet_time(const AVPacket& packet) const
+	{
+		auto time = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+		if(time == AV_NOPTS_VALUE)
+			return AV_NOPTS_VALUE;
+		return av_rescale_q(time, format_context_->streams[packet.stream_index]->time_base, av_make_q(1, AV_TIME_BASE));
+	}
+
+	bool is_due(const AVPacket& packet)
+	{
+		auto time = packet_time(packet);
+		if(time == AV_NOPTS_VALUE)
+			return true;
+
+		boost::mutex::scoped_lock lock(clock_mutex_);
+
+		auto now	= av_gettime_relative();
+		auto offset	= (time - clock_time_) - (now - clock_base_);
+		if(!clock_started_ || offset > MAX_TIMESTAMP_JUMP || offset < -MAX_TIMESTAMP_JUMP)
+		{
+			if(clock_started_)
+				CASPAR_LOG(info) << print() << L" Timestamp discontinuity, restarting the clock.";
+			clock_started_	= true;
+			clock_base_		= now + jitter_buffer_;
+			clock_time_		= time;
+			offset			= jitter_buffer_;
+		}
+
+		if(offset > 0)
+			return false;
+
+		// What was read after the packet is the latency, more than the channel consumes in time means that the
+		// sender's or the channel's clock is faster than the other.
+		auto latency = newest_time_ == AV_NOPTS_VALUE ? 0 : newest_time_ - time;
+		latency_ = latency;
+		graph_->set_value("jitter-buffer", std::max(0.0, std::min(1.0, static_cast<double>(latency) / static_cast<double>(max_latency_))));
+
+		if(latency > max_latency_)
+		{
+			// Drops what is behind jitter_buffer_ of the newest packet, the video up to the next keyframe after it.
+			skip_until_		= newest_time_ - jitter_buffer_;
+			video_skipping_	= true;
+			clock_base_		= now;
+			clock_time_		= skip_until_;
+			++resyncs_;
+			graph_->set_tag("resync");
+			CASPAR_LOG(warning) << print() << L" Latency " << latency / 1000 << L" ms, skipping ahead.";
+			return false;
+		}
+
+		clock_base_ -= std::max(-max_latency_, std::min(max_latency_, latency - jitter_buffer_)) / CLOCK_SLEW;
+		return true;
+	}
+
+	bool is_skipped(const AVPacket& packet, bool video)
+	{
+		if(skip_until_ == AV_NOPTS_VALUE)
+			return false;
+
+		// Timestamps far before it have wrapped or restarted.
+		auto time	= packet_time(packet);
+		auto behind	= time != AV_NOPTS_VALUE && time < skip_until_ && time > skip_until_ - MAX_TIMESTAMP_JUMP;
+		if(video && video_skipping_)
+		{
+			if(!(packet.flags & AV_PKT_FLAG_KEY) || behind)
+				return true;
+			video_skipping_ = false;
+			return false;
+		}
+
+		return behind;
+	}
+
+
+	int64_t packet_duration(const AVPacket& packet) const
+	{
+		if(packet.duration <= 0)
+			return 0;
+		return av_rescale_q(packet.duration, format_context_->streams[packet.stream_index]->time_base, av_make_q(1, AV_TIME_BASE));
+	}
+
+	void on_push(const std::shared_ptr<AVPacket>& packet, tbb::atomic<int64_t>& duration)
+	{
+		buffer_bytes_ += packet->size;
+		duration += packet_duration(*packet);
+		graph_->set_value("buffer-size", (static_cast<double>(buffer_bytes_) + 0.001) / max_buffer_bytes_);
+	}
+
+	void on_pop(const std::shared_ptr<AVPacket>& packet, tbb::atomic<int64_t>& duration)
+	{
+		if(!packet || packet->size <= 0 || !packet->data)
+			return;
+		buffer_bytes_ -= packet->size;
+		duration -= packet_duration(*packet);
+		graph_->set_value("buffer-size", (static_cast<double>(std::max<int64_t>(0, buffer_bytes_)) + 0.001) / max_buffer_bytes_);
+	}
 
 	std::ptrdiff_t get_max_buffer_count() const
 	{
@@ -192,10 +494,47 @@ struct input::implementation : boost::noncopyable
 		return L"ffmpeg_input[" + filename_ + L")]";
 	}
 	
+	// Read ahead until each stream has min_buffer_duration_ buffered or max_buffer_bytes_ are buffered in total. Streams 
+	// without packet durations fall back to the packet count.
 	bool full() const
 	{
-		return (audio_stream_index_ == -1 || audio_buffer_.size() > get_min_buffer_count())
-			&& (video_stream_index_ == -1 || video_buffer_.size() > get_min_buffer_count());
+		// Live inputs are read as they arrive, is_due paces them.
+		if(live_)
+		{
+			return buffer_bytes_ >= max_buffer_bytes_ 
+				|| video_buffer_.size() >= MAX_BUFFER_COUNT 
+				|| std::any_of(audio_streams_.begin(), audio_streams_.end(), [&](const std::shared_ptr<audio_stream>& stream)
+					{
+						return stream->buffer.size() >= MAX_BUFFER_COUNT;
+					});
+		}
+
+		if(thumbnail_mode_)
+		{
+			return std::all_of(audio_streams_.begin(), audio_streams_.end(), [&](const std::shared_ptr<audio_stream>& stream)
+				{
+					return stream->buffer.size() > get_min_buffer_count();
+				})
+				&& (video_stream_index_ == -1 || video_buffer_.size() > get_min_buffer_count());
+		}
+
+		if(buffer_bytes_ >= max_buffer_bytes_)
+			return true;
+
+		return std::all_of(audio_streams_.begin(), audio_streams_.end(), [&](const std::shared_ptr<audio_stream>& stream)
+			{
+				return is_stream_full(stream->index, stream->buffer, stream->duration);
+			})
+			&& is_stream_full(video_stream_index_, video_buffer_, video_buffer_duration_);
+	}
+
+	bool is_stream_full(int index, const tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>& buffer, int64_t duration) const
+	{
+		if(index == -1 || buffer.size() >= get_max_buffer_count())
+			return true;
+		if(duration > 0)
+			return duration >= min_buffer_duration_;
+		return buffer.size() > get_min_buffer_count();
 	}
 
 	bool is_eof() const
@@ -207,9 +546,17 @@ struct input::implementation : boost::noncopyable
 	{	
 		if(is_eof_)
 			return;
+
+		// The live read loop runs for as long as there is room, one pending at a time.
+		if(live_ && reading_.compare_and_swap(true, false))
+			return;
+
 		executor_.begin_invoke([this]
 		{			
-			while (!is_eof_ && !full())
+			if(!streams_discarded_)
+				discard_unused_streams();
+
+			while (!is_eof_ && !aborted_ && !full())
 			{
 				try
 				{
@@ -221,69 +568,211 @@ struct input::implementation : boost::noncopyable
 					else
 					{
 						THROW_ON_ERROR(ret, "av_read_frame", print());
+						if (live_ && packet->size > 0 && packet_time(*packet) != AV_NOPTS_VALUE && (packet->stream_index == video_stream_index_ || find_audio_stream(packet->stream_index)))
+							newest_time_ = packet_time(*packet);
 						if (packet->stream_index == video_stream_index_ && packet->size > 0)
 						{
 							THROW_ON_ERROR2(av_dup_packet(packet.get()), print());
+							on_push(packet, video_buffer_duration_);
 							video_buffer_.try_push(packet);
 							graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
 						}
-						if (packet->stream_index == audio_stream_index_ && packet->size > 0)
+						auto audio = packet->size > 0 ? find_audio_stream(packet->stream_index) : nullptr;
+						if (audio)
 						{
 							THROW_ON_ERROR2(av_dup_packet(packet.get()), print());
-							audio_buffer_.try_push(packet);
-							graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
+							on_push(packet, audio->duration);
+							audio->buffer.try_push(packet);
+							graph_->set_value("audio-buffer-count", (static_cast<double>(audio->buffer.size()) + 0.001) / MAX_BUFFER_COUNT);
 						}
 					}
 				}
 				catch (...)
 				{
-					if (!thumbnail_mode_)
+					if (!thumbnail_mode_ && !aborted_)
 						CASPAR_LOG_CURRENT_EXCEPTION();
 				}
+
+				if(live_)
+					update_io_graph();
 			}
+
+			update_io_graph();
+			reading_ = false;
 		});
 	}	
 
+	void update_io_graph()
+	{
+		if(io_ && io_->underruns() > underruns_)
+		{
+			underruns_ = io_->underruns();
+			graph_->set_tag("io-underrun");
+		}
+
+		if(!network_)
+			return;
+
+		graph_->set_value("network-buffer", network_->fill());
+		if(network_->lost_packets() > lost_packets_)
+		{
+			lost_packets_ = network_->lost_packets();
+			graph_->set_tag("packet-loss");
+		}
+		if(network_->overflows() > overflows_)
+		{
+			overflows_ = network_->overflows();
+			graph_->set_tag("network-overflow");
+		}
+	}
+
+	static bool is_local_drive(const std::wstring& resource_name)
+	{
+		auto root = boost::filesystem::absolute(resource_name).root_path().wstring();
+		auto type = GetDriveTypeW(root.c_str());
+		return type == DRIVE_FIXED || type == DRIVE_RAMDISK;
+	}
+
+	std::shared_ptr<file_io> open_io(const std::wstring& resource_name, bool thumbnail_mode)
+	{
+		if(is_network_io_url(resource_name) && env::properties().get(L"configuration.ffmpeg.network.receive-thread", true))
+			return std::make_shared<network_io>(resource_name);
+
+		if(thumbnail_mode || live_ || !boost::filesystem::is_regular_file(resource_name))
+			return nullptr;
+
+		try
+		{
+			if(env::properties().get(L"configuration.ffmpeg.mapped-io", false) && is_local_drive(resource_name))
+				return std::make_shared<mapped_file_io>(resource_name);
+			if(env::properties().get(L"configuration.ffmpeg.async-io", true))
+				return std::make_shared<async_file_io>(resource_name);
+			return nullptr;
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << L"ffmpeg_input[" << resource_name << L"] Falling back to synchronous file io.";
+			return nullptr;
+		}
+	}
+
 	safe_ptr<AVFormatContext> open_input(const std::wstring resource_name)
 	{
 		AVFormatContext* weak_context = nullptr;
+		if(io_ || live_)
+		{
+			weak_context = avformat_alloc_context();
+			if(!weak_context)
+				BOOST_THROW_EXCEPTION(std::bad_alloc());
+			weak_context->interrupt_callback.callback	= &interrupt_callback;
+			weak_context->interrupt_callback.opaque		= this;
+		}
+		if(io_)
+		{
+			weak_context->pb	 = io_->context();
+			weak_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+		}
 		THROW_ON_ERROR2(avformat_open_input(&weak_context, narrow(resource_name).c_str(), nullptr, nullptr), resource_name);
-		safe_ptr<AVFormatContext> context(weak_context, [](AVFormatContext* ctx){avformat_close_input(&ctx);});      
+		auto io = io_;
+		safe_ptr<AVFormatContext> context(weak_context, [io](AVFormatContext* ctx){avformat_close_input(&ctx);});      
 		THROW_ON_ERROR2(avformat_find_stream_info(weak_context, nullptr), resource_name);
 		return context;
 	}
 
 	void seek(int64_t target_time)
 	{
+		if(live_)
+		{
+			if(target_time > 0)
+				CASPAR_LOG(warning) << print() << L" Live inputs can not seek.";
+			return;
+		}
+
 		executor_.begin_invoke([=]() 
 		{
-			if (audio_buffer_.size() > 0 || video_buffer_.size() > 0)
+			auto buffered = std::any_of(audio_streams_.begin(), audio_streams_.end(), [](const std::shared_ptr<audio_stream>& stream)
 			{
-				audio_buffer_.clear();
+				return stream->buffer.size() > 0;
+			});
+			if (buffered || video_buffer_.size() > 0)
+			{
+				BOOST_FOREACH(auto& stream, audio_streams_)
+				{
+					stream->buffer.clear();
+					stream->duration = 0;
+				}
 				video_buffer_.clear();
+				buffer_bytes_ = 0;
+				video_buffer_duration_ = 0;
 				LOG_ON_ERROR2(avformat_flush(format_context_.get()), "FFMpeg input avformat_flush");
 			}
-			graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
+			graph_->set_value("audio-buffer-count", 0.001 / MAX_BUFFER_COUNT);
 			graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
 			if (!thumbnail_mode_)
 				CASPAR_LOG(trace) << print() << " Seeking: " << target_time / 1000 << " ms";
 			flush_av_packet_count_ = FLUSH_AV_PACKET_COUNT;
 			is_eof_ = false;
-			if (av_seek_frame(format_context_.get(), -1, target_time, AVSEEK_FLAG_BACKWARD) < 0)
+			if (!seek_keyframe(target_time) && av_seek_frame(format_context_.get(), -1, target_time, AVSEEK_FLAG_BACKWARD) < 0)
 				CASPAR_LOG(error) << print() << " Seek failed";
 			tick();
 		}, high_priority);
 	}		
+
+	// Seeks to the indexed keyframe before target_time, the decoders then only need to decode the frames of that gop 
+	// up to the target.
+	bool seek_keyframe(int64_t target_time)
+	{
+		if (!seek_index_ || !seek_index_->ready() || seek_index_->stream_index() != video_stream_index_)
+			return false;
+
+		auto stream = format_context_->streams[video_stream_index_];
+		auto pts	= av_rescale_q(target_time, av_make_q(1, AV_TIME_BASE), stream->time_base);
+		if (stream->start_time != AV_NOPTS_VALUE)
+			pts += stream->start_time;
+
+		int64_t keyframe_pts;
+		if (!seek_index_->find_keyframe(pts, keyframe_pts))
+			return false;
+
+		return avformat_seek_file(format_context_.get(), video_stream_index_, std::numeric_limits<int64_t>::min(), keyframe_pts, keyframe_pts, 0) >= 0;
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"buffer-bytes",			std::max<int64_t>(0, buffer_bytes_));
+		info.add(L"max-buffer-bytes",		max_buffer_bytes_);
+		BOOST_FOREACH(auto& stream, audio_streams_)
+			info.add(L"audio-buffer-duration",	std::max<int64_t>(0, stream->duration) / 1000);
+		info.add(L"audio-streams",			audio_streams_.size());
+		info.add(L"video-buffer-duration",	std::max<int64_t>(0, video_buffer_duration_) / 1000);
+		info.add(L"warnings",				static_cast<int>(log_counters_->warnings));
+		info.add(L"errors",					static_cast<int>(log_counters_->errors));
+		if(live_)
+		{
+			info.add(L"jitter-buffer",		jitter_buffer_ / 1000);
+			info.add(L"latency",			std::max<int64_t>(0, latency_) / 1000);
+			info.add(L"resyncs",			static_cast<int>(resyncs_));
+		}
+		if(io_)
+			info.add_child(L"io", io_->info());
+		return info;
+	}
 };
 
 input::input(const safe_ptr<diagnostics::graph> graph, const std::wstring& filename, bool thumbnail_mode)
 	: impl_(new implementation(graph, filename, thumbnail_mode)){}
 bool input::eof() const {return impl_->is_eof();}
-bool input::try_pop_audio(std::shared_ptr<AVPacket>& packet){return impl_->try_pop_audio(packet);}
+bool input::try_pop_audio(std::shared_ptr<AVPacket>& packet){return impl_->try_pop_audio(packet, -1);}
+bool input::try_pop_audio(std::shared_ptr<AVPacket>& packet, int index){return impl_->try_pop_audio(packet, index);}
 bool input::try_pop_video(std::shared_ptr<AVPacket>& packet) { return impl_->try_pop_video(packet); }
 safe_ptr<AVFormatContext> input::format_context(){return impl_->format_context_;}
+safe_ptr<log_counters> input::get_log_counters() const {return impl_->log_counters_;}
 void input::seek(int64_t target_time){impl_->seek(target_time);}
+boost::property_tree::wptree input::info() const{return impl_->info();}
 safe_ptr<AVCodecContext> input::open_audio_codec(int& index) { return impl_->open_audio_codec(index);}
-safe_ptr<AVCodecContext> input::open_video_codec(int& index) { return impl_->open_video_codec(index); }
+safe_ptr<AVCodecContext> input::open_audio_stream(int index) { return impl_->open_audio_stream(index);}
+safe_ptr<AVCodecContext> input::open_video_codec(int& index, const std::wstring& hwaccel) { return impl_->open_video_codec(index, hwaccel); }
 
 }}
@@ -28,6 +28,7 @@
 #include <cstdint>
 
 #include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
 #include <boost/thread/future.hpp>
 
 struct AVFormatContext;
@@ -43,19 +44,26 @@ class graph;
 	 
 namespace ffmpeg {
 
+struct log_counters;
+
 class input
 {
 public:
 	explicit input(const safe_ptr<diagnostics::graph> graph, const std::wstring& filename, bool thumbnail_mode);
 	safe_ptr<AVCodecContext> open_audio_codec(int& index);
-	safe_ptr<AVCodecContext> open_video_codec(int& index);
+	safe_ptr<AVCodecContext> open_audio_stream(int index); // Streams which are not opened are discarded.
+	safe_ptr<AVCodecContext> open_video_codec(int& index, const std::wstring& hwaccel = L"");
 
-	bool try_pop_audio(std::shared_ptr<AVPacket>& packet);
+	bool try_pop_audio(std::shared_ptr<AVPacket>& packet); // From the first audio stream opened.
+	bool try_pop_audio(std::shared_ptr<AVPacket>& packet, int index);
 	bool try_pop_video(std::shared_ptr<AVPacket>& packet);
 	bool eof() const;
 
 	void seek(int64_t target_time);
 	safe_ptr<AVFormatContext> format_context();
+	safe_ptr<log_counters> get_log_counters() const;
+
+	boost::property_tree::wptree info() const;
 
 private:
 	struct implementation;
@@ -0,0 +1,260 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "mapped_file_io.h"
+
+#include <common/env.h>
+#include <common/exception/exceptions.h>
+#include <common/exception/win32_exception.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <windows.h>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avio.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+static const int	 IO_BUFFER_SIZE	= 64*1024;
+static const int64_t VIEW_SIZE		= 256*1024*1024;
+
+// PrefetchVirtualMemory is only available from Windows 8.
+typedef struct
+{
+	PVOID	VirtualAddress;
+	SIZE_T	NumberOfBytes;
+} prefetch_range_entry;
+
+typedef BOOL (WINAPI *prefetch_virtual_memory_fn)(HANDLE, ULONG_PTR, prefetch_range_entry*, ULONG);
+
+static prefetch_virtual_memory_fn get_prefetch_virtual_memory()
+{
+	static auto fn = reinterpret_cast<prefetch_virtual_memory_fn>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+	return fn;
+}
+
+struct mapped_file_io::implementation : boost::noncopyable
+{
+	const std::wstring				filename_;
+	const int64_t					read_ahead_;
+	HANDLE							file_;
+	HANDLE							mapping_;
+	int64_t							size_;
+	int64_t							granularity_;
+	int64_t							position_;
+	const uint8_t*					view_;
+	int64_t							view_offset_;
+	int64_t							view_size_;
+	int64_t							prefetched_;	// File offset up to which read-ahead has been requested.
+	std::shared_ptr<AVIOContext>	context_;
+	boost::timer					timer_;
+	tbb::atomic<int64_t>			bytes_read_;
+
+	implementation(const std::wstring& filename)
+		: filename_(filename)
+		, read_ahead_(static_cast<int64_t>(std::max(1, env::properties().get(L"configuration.ffmpeg.mapped-io-read-ahead", 32))) * 1024 * 1024)
+		, file_(CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr))
+		, mapping_(nullptr)
+		, size_(0)
+		, position_(0)
+		, view_(nullptr)
+		, view_offset_(0)
+		, view_size_(0)
+		, prefetched_(0)
+	{
+		bytes_read_ = 0;
+
+		if(file_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not open file.") << boost::errinfo_file_name(narrow(filename_)));
+
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file_);
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not get file size.") << boost::errinfo_file_name(narrow(filename_)));
+		}
+		size_ = size.QuadPart;
+
+		mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if(!mapping_)
+		{
+			CloseHandle(file_);
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not map file.") << boost::errinfo_file_name(narrow(filename_)));
+		}
+
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity_ = info.dwAllocationGranularity;
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+		context_.reset(avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, this, &read_packet, nullptr, &seek), [](AVIOContext* context)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		});
+		context_->direct = 1;
+	}
+
+	~implementation()
+	{
+		unmap();
+		CloseHandle(mapping_);
+		CloseHandle(file_);
+	}
+
+	void unmap()
+	{
+		if(view_)
+			UnmapViewOfFile(view_);
+		view_		= nullptr;
+		view_size_	= 0;
+	}
+
+	bool map(int64_t position)
+	{
+		if(view_ && position >= view_offset_ && position < view_offset_ + view_size_)
+			return true;
+
+		unmap();
+
+		auto offset = position - position % granularity_;
+		auto size	= std::min(VIEW_SIZE, size_ - offset);
+		view_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset & 0xFFFFFFFF), static_cast<SIZE_T>(size)));
+		if(!view_)
+			return false;
+
+		view_offset_ = offset;
+		view_size_	 = size;
+		prefetched_	 = position;
+		return true;
+	}
+
+	void prefetch()
+	{
+		// Request the next read_ahead_ bytes whenever less than half of it is left in flight.
+		if(prefetched_ - position_ > read_ahead_/2)
+			return;
+
+		auto begin	= std::max(prefetched_, position_);
+		auto end	= std::min(position_ + read_ahead_, view_offset_ + view_size_);
+		if(end <= begin)
+			return;
+
+		if(auto prefetch_virtual_memory = get_prefetch_virtual_memory())
+		{
+			prefetch_range_entry range = {const_cast<uint8_t*>(view_ + (begin - view_offset_)), static_cast<SIZE_T>(end - begin)};
+			prefetch_virtual_memory(GetCurrentProcess(), 1, &range, 0);
+		}
+		prefetched_ = end;
+	}
+
+	int read(uint8_t* buffer, int size)
+	{
+		if(position_ >= size_)
+			return AVERROR_EOF;
+
+		if(!map(position_))
+		{
+			CASPAR_LOG(error) << L"[mapped_file_io] Could not map view: " << filename_;
+			return AVERROR(EIO);
+		}
+
+		prefetch();
+
+		auto count = static_cast<int>(std::min<int64_t>(size, view_offset_ + view_size_ - position_));
+
+		try
+		{
+			std::memcpy(buffer, view_ + (position_ - view_offset_), count);
+		}
+		catch(win32_exception&) // EXCEPTION_IN_PAGE_ERROR when the storage fails.
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			return AVERROR(EIO);
+		}
+
+		position_	+= count;
+		bytes_read_ += count;
+
+		return count;
+	}
+
+	int64_t seek(int64_t offset, int whence)
+	{
+		switch(whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:	return size_;
+		case SEEK_SET:		position_ = offset;			 break;
+		case SEEK_CUR:		position_ = position_ + offset; break;
+		case SEEK_END:		position_ = size_ + offset;	 break;
+		default:			return AVERROR(EINVAL);
+		}
+		return position_;
+	}
+
+	static int read_packet(void* opaque, uint8_t* buffer, int size)
+	{
+		return static_cast<implementation*>(opaque)->read(buffer, size);
+	}
+
+	static int64_t seek(void* opaque, int64_t offset, int whence)
+	{
+		return static_cast<implementation*>(opaque)->seek(offset, whence);
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",		L"mapped");
+		info.add(L"bytes-read",	bytes_read_);
+		info.add(L"read-rate",	static_cast<int64_t>(bytes_read_ / std::max(timer_.elapsed(), 0.001)));
+		info.add(L"read-ahead",	read_ahead_);
+		return info;
+	}
+};
+
+mapped_file_io::mapped_file_io(const std::wstring& filename) : impl_(new implementation(filename)){}
+AVIOContext* mapped_file_io::context(){return impl_->context_.get();}
+int64_t mapped_file_io::bytes_read() const{return impl_->bytes_read_;}
+int64_t mapped_file_io::underruns() const{return 0;}
+boost::property_tree::wptree mapped_file_io::info() const{return impl_->info();}
+
+}}
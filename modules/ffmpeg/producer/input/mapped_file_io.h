@@ -0,0 +1,48 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "file_io.h"
+
+#include <memory>
+#include <string>
+
+namespace caspar { namespace ffmpeg {
+
+// Serves the demuxer straight from a view of the file mapping with the AVIOContext in direct mode, which avoids
+// the read calls and the copy through the avio buffer of the file protocol. The read-ahead hint is 
+// configuration.ffmpeg.mapped-io-read-ahead (MB). Meant for local disks, page faults are not counted as underruns.
+class mapped_file_io : public file_io
+{
+public:
+	explicit mapped_file_io(const std::wstring& filename);
+
+	virtual AVIOContext* context() override;
+	virtual int64_t bytes_read() const override;
+	virtual int64_t underruns() const override;
+	virtual boost::property_tree::wptree info() const override;
+private:
+	struct implementation;
+	std::shared_ptr<implementation> impl_;
+};
+
+}}
@@ -0,0 +1,332 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "network_io.h"
+
+#include "../../ffmpeg_error.h"
+
+#include <common/concurrency/thread_placement.h>
+#include <common/env.h>
+#include <common/log/log.h>
+#include <common/memory/tagged_allocator.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avio.h>
+	#include <libavutil/dict.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+static const int IO_BUFFER_SIZE		= 32*1024;
+static const int RECEIVE_SIZE		= 64*1024;
+static const int TS_PACKET_SIZE		= 188;
+static const int TS_NULL_PID		= 0x1FFF;
+
+struct network_io::implementation : boost::noncopyable
+{
+	const std::wstring					url_;
+	const int							timeout_;	// ms without data before the stream ends.
+	tbb::atomic<bool>					aborted_;
+	std::shared_ptr<AVIOContext>		source_;
+	std::shared_ptr<AVIOContext>		context_;
+
+	mutable boost::mutex				mutex_;
+	boost::condition_variable			cond_;
+	std::vector<uint8_t, tagged_allocator<uint8_t, allocation_subsystem::producer>>	ring_;
+	size_t								begin_;
+	size_t								size_;
+	bool								ended_;
+
+	std::vector<int>					continuity_;	// The last continuity counter per pid, -1 before the first.
+	boost::timer						timer_;
+	tbb::atomic<int64_t>				bytes_received_;
+	tbb::atomic<int64_t>				bytes_read_;
+	tbb::atomic<int64_t>				underruns_;
+	tbb::atomic<int64_t>				overflows_;
+	tbb::atomic<int64_t>				ts_packets_;
+	tbb::atomic<int64_t>				continuity_errors_;
+	tbb::atomic<int64_t>				lost_packets_;
+
+	boost::thread						thread_;
+
+	implementation(const std::wstring& url)
+		: url_(url)
+		, timeout_(std::max(100, static_cast<int>(env::properties().get(L"configuration.ffmpeg.network.receive-timeout", 5.0) * 1000)))
+		, ring_(static_cast<size_t>(std::max(1, env::properties().get(L"configuration.ffmpeg.network.receive-buffer", 32))) * 1024 * 1024)
+		, begin_(0)
+		, size_(0)
+		, ended_(false)
+		, continuity_(TS_NULL_PID + 1, -1)
+	{
+		aborted_			= false;
+		bytes_received_		= 0;
+		bytes_read_			= 0;
+		underruns_			= 0;
+		overflows_			= 0;
+		ts_packets_			= 0;
+		continuity_errors_	= 0;
+		lost_packets_		= 0;
+
+		AVDictionary* options = nullptr;
+		if(boost::istarts_with(url_, L"udp://"))
+		{
+			auto socket_buffer = std::max(64, env::properties().get(L"configuration.ffmpeg.network.socket-buffer", 4096)) * 1024;
+			av_dict_set(&options, "buffer_size", boost::lexical_cast<std::string>(socket_buffer).c_str(), 0);
+		}
+
+		AVIOInterruptCB interrupt = {&interrupt_callback, this};
+		AVIOContext* source = nullptr;
+		auto ret = avio_open2(&source, narrow(url_).c_str(), AVIO_FLAG_READ, &interrupt, &options);
+		av_dict_free(&options);
+		THROW_ON_ERROR(ret, "avio_open2", url_);
+		source_.reset(source, [](AVIOContext* context){avio_closep(&context);});
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+		context_.reset(avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, this, &read_packet, nullptr, nullptr), [](AVIOContext* context)
+		{
+			av_freep(&context->buffer);
+			avio_context_free(&context);
+		});
+		context_->seekable = 0;
+
+		thread_ = boost::thread([this]{receive();});
+	}
+
+	~implementation()
+	{
+		abort();
+		thread_.join();
+	}
+
+	void abort()
+	{
+		aborted_ = true;
+		boost::mutex::scoped_lock lock(mutex_);
+		cond_.notify_all();
+	}
+
+	static int interrupt_callback(void* opaque)
+	{
+		return static_cast<implementation*>(opaque)->aborted_ ? 1 : 0;
+	}
+
+	// Drains the socket, the libavformat protocol waits for data with the interrupt callback.
+	void receive()
+	{
+		thread_placement placement = inherited_thread_placement();
+		placement.priority = env::properties().get(L"configuration.ffmpeg.network.receive-priority", L"high");
+		apply_thread_placement(placement);
+
+		std::vector<uint8_t, tagged_allocator<uint8_t, allocation_subsystem::producer>> buffer(RECEIVE_SIZE);
+		while(!aborted_)
+		{
+			auto count = avio_read_partial(source_.get(), buffer.data(), static_cast<int>(buffer.size()));
+			if(count == AVERROR(EAGAIN) || count == 0)
+				continue;
+			if(count < 0)
+			{
+				if(!aborted_)
+					CASPAR_LOG(warning) << L"[network_io] " << url_ << L" Receive ended: " << av_error_str(count).c_str();
+				break;
+			}
+
+			bytes_received_ += count;
+			check_continuity(buffer.data(), count);
+			write(buffer.data(), count);
+		}
+
+		boost::mutex::scoped_lock lock(mutex_);
+		ended_ = true;
+		cond_.notify_all();
+	}
+
+	// Datagrams which do not fit are dropped whole, which keeps the ts packets aligned.
+	void write(const uint8_t* data, int count)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		if(static_cast<size_t>(count) > ring_.size() - size_)
+		{
+			++overflows_;
+			return;
+		}
+
+		auto end	= (begin_ + size_) % ring_.size();
+		auto first	= std::min<size_t>(count, ring_.size() - end);
+		std::memcpy(ring_.data() + end, data, first);
+		std::memcpy(ring_.data(), data + first, count - first);
+		size_ += count;
+
+		cond_.notify_one();
+	}
+
+	// udp and srt carry whole ts packets, a datagram that is not is some other payload and is not checked.
+	void check_continuity(const uint8_t* data, int count)
+	{
+		if(count % TS_PACKET_SIZE != 0 || data[0] != 0x47)
+			return;
+
+		for(auto packet = data; packet < data + count; packet += TS_PACKET_SIZE)
+		{
+			if(packet[0] != 0x47)
+				continue;
+
+			++ts_packets_;
+
+			auto pid = ((packet[1] & 0x1F) << 8) | packet[2];
+			if(pid == TS_NULL_PID)
+				continue;
+
+			// The counter increments with the packets which carry payload, the discontinuity indicator restarts it.
+			auto has_payload		= (packet[3] & 0x10) != 0;
+			auto has_adaptation		= (packet[3] & 0x20) != 0;
+			auto discontinuity		= has_adaptation && packet[4] > 0 && (packet[5] & 0x80) != 0;
+			auto counter			= packet[3] & 0x0F;
+			auto& last				= continuity_[pid];
+
+			if(has_payload && last >= 0 && !discontinuity && counter != last)
+			{
+				auto missing = (counter - last - 1) & 0x0F;
+				if(missing > 0)
+				{
+					++continuity_errors_;
+					lost_packets_ += missing;
+				}
+			}
+
+			if(has_payload)
+				last = counter;
+		}
+	}
+
+	int read(uint8_t* buffer, int size)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		if(size_ == 0 && bytes_read_ > 0)
+			++underruns_;
+
+		auto deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_);
+		while(size_ == 0 && !ended_ && !aborted_)
+		{
+			if(!cond_.timed_wait(lock, deadline))
+			{
+				CASPAR_LOG(warning) << L"[network_io] " << url_ << L" No data for " << timeout_ << L" ms.";
+				return AVERROR_EOF;
+			}
+		}
+
+		if(aborted_)
+			return AVERROR_EXIT;
+		if(size_ == 0)
+			return AVERROR_EOF;
+
+		auto count	= std::min<size_t>(size, size_);
+		auto first	= std::min<size_t>(count, ring_.size() - begin_);
+		std::memcpy(buffer, ring_.data() + begin_, first);
+		std::memcpy(buffer + first, ring_.data(), count - first);
+		begin_	= (begin_ + count) % ring_.size();
+		size_  -= count;
+
+		bytes_read_ += count;
+
+		return static_cast<int>(count);
+	}
+
+	static int read_packet(void* opaque, uint8_t* buffer, int size)
+	{
+		return static_cast<implementation*>(opaque)->read(buffer, size);
+	}
+
+	double fill() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		return static_cast<double>(size_) / static_cast<double>(ring_.size());
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",				L"network");
+		info.add(L"url",				url_);
+		info.add(L"bytes-received",		bytes_received_);
+		info.add(L"bytes-read",			bytes_read_);
+		info.add(L"receive-rate",		static_cast<int64_t>(bytes_received_ / std::max(timer_.elapsed(), 0.001)));
+		info.add(L"buffer-size",		ring_.size());
+		info.add(L"buffer-fill",		fill());
+		info.add(L"overflows",			overflows_);
+		info.add(L"underruns",			underruns_);
+		info.add(L"ts-packets",			ts_packets_);
+		info.add(L"continuity-errors",	continuity_errors_);
+		info.add(L"lost-packets",		lost_packets_);
+		return info;
+	}
+};
+
+network_io::network_io(const std::wstring& url) : impl_(new implementation(url)){}
+AVIOContext* network_io::context(){return impl_->context_.get();}
+int64_t network_io::bytes_read() const{return impl_->bytes_read_;}
+int64_t network_io::underruns() const{return impl_->underruns_;}
+boost::property_tree::wptree network_io::info() const{return impl_->info();}
+double network_io::fill() const{return impl_->fill();}
+int64_t network_io::overflows() const{return impl_->overflows_;}
+int64_t network_io::lost_packets() const{return impl_->lost_packets_;}
+void network_io::abort(){impl_->abort();}
+
+bool is_network_url(const std::wstring& url)
+{
+	return boost::istarts_with(url, L"udp://") || boost::istarts_with(url, L"rtp://") || boost::istarts_with(url, L"srt://");
+}
+
+bool is_network_io_url(const std::wstring& url)
+{
+	return boost::istarts_with(url, L"udp://") || boost::istarts_with(url, L"srt://");
+}
+
+}}
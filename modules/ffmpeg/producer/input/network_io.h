@@ -0,0 +1,61 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include "file_io.h"
+
+#include <memory>
+#include <string>
+
+namespace caspar { namespace ffmpeg {
+
+// Receives udp and srt streams on a thread of its own into a ring buffer which the demuxer reads from, so that
+// the socket is drained while the demuxer or the decoders are busy. The ring buffer size is 
+// configuration.ffmpeg.network.receive-buffer (MB). MPEG-TS payloads are checked for lost packets.
+class network_io : public file_io
+{
+public:
+	explicit network_io(const std::wstring& url);
+
+	virtual AVIOContext* context() override;
+	virtual int64_t bytes_read() const override;
+	virtual int64_t underruns() const override;	// Reads that found the ring buffer empty.
+	virtual boost::property_tree::wptree info() const override;
+
+	double fill() const;			// Of the ring buffer, 0.0 to 1.0.
+	int64_t overflows() const;		// Datagrams dropped for a full ring buffer.
+	int64_t lost_packets() const;	// MPEG-TS packets missing by the continuity counters.
+
+	// Makes blocked and later reads fail, so that the demuxer can be stopped.
+	void abort();
+private:
+	struct implementation;
+	std::shared_ptr<implementation> impl_;
+};
+
+// udp://, rtp:// and srt:// urls.
+bool is_network_url(const std::wstring& url);
+
+// Those which network_io receives, the others are read by the protocols of libavformat.
+bool is_network_io_url(const std::wstring& url);
+
+}}
@@ -26,6 +26,7 @@
 #include "../filter/filter.h"
 #include "../util/util.h"
 
+#include <core/load_governor.h>
 #include <core/producer/frame_producer.h>
 #include <core/producer/frame/basic_frame.h>
 #include <core/producer/frame/frame_transform.h>
@@ -35,8 +36,10 @@
 #include <core/mixer/audio/audio_util.h>
 
 #include <common/env.h>
+#include <common/concurrency/executor.h>
 #include <common/exception/exceptions.h>
 #include <common/log/log.h>
+#include <common/memory/tagged_allocator.h>
 
 #if defined(_MSC_VER)
 #pragma warning (push)
@@ -58,7 +61,10 @@ extern "C"
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/format.hpp>
 
+#include <algorithm>
 #include <deque>
+#include <functional>
+#include <map>
 #include <queue>
 #include <vector>
 
@@ -66,10 +72,135 @@ using namespace caspar::core;
 
 namespace caspar { namespace ffmpeg {
 
+static const size_t MAX_CACHED_FILTERS = 8;
+static const size_t MAX_AUDIO_FRAMES   = 32;
+
+static size_t max_cadence(const video_format_desc& format_desc)
+{
+	return format_desc.audio_cadence.empty() ? 0 : *std::max_element(format_desc.audio_cadence.begin(), format_desc.audio_cadence.end());
+}
+
+// The decoded samples of consecutive audio streams, which are split where the decoder flushes. The samples are kept 
+// in one preallocated ring so that neither pushing decoded audio nor handing out the cadence of a frame allocates 
+// or moves the samples which are left. Only used from the producer thread.
+class audio_sample_ring
+{
+	typedef std::vector<int32_t, tagged_allocator<int32_t, allocation_subsystem::producer>> sample_vector;
+
+	sample_vector			samples_;
+	size_t					begin_;
+	size_t					size_;
+	std::deque<size_t>		streams_; // Samples per stream, samples are pushed to the last one.
+public:
+	explicit audio_sample_ring(size_t capacity)
+		: samples_(std::max<size_t>(capacity, 1))
+		, begin_(0)
+		, size_(0)
+	{
+		streams_.push_back(0);
+	}
+
+	void push(const int32_t* data, size_t count)
+	{
+		reserve(size_ + count);
+
+		auto end   = (begin_ + size_) % samples_.size();
+		auto first = std::min(count, samples_.size() - end);
+		std::copy(data, data + first, samples_.begin() + end);
+		std::copy(data + first, data + count, samples_.begin());
+
+		size_			+= count;
+		streams_.back() += count;
+	}
+
+	void push_silence(size_t count)
+	{
+		reserve(size_ + count);
+
+		auto end   = (begin_ + size_) % samples_.size();
+		auto first = std::min(count, samples_.size() - end);
+		std::fill_n(samples_.begin() + end, first, 0);
+		std::fill_n(samples_.begin(), count - first, 0);
+
+		size_			+= count;
+		streams_.back() += count;
+	}
+
+	void flush()
+	{
+		streams_.push_back(0);
+	}
+
+	size_t stream_count() const
+	{
+		return streams_.size();
+	}
+
+	size_t front_size() const
+	{
+		return streams_.front();
+	}
+
+	size_t back_size() const
+	{
+		return streams_.back();
+	}
+
+	// Copies the next samples of the first stream into the frame's buffer.
+	void pop(size_t count, core::audio_buffer& dest)
+	{
+		CASPAR_VERIFY(count <= streams_.front());
+
+		dest.resize(count);
+		auto first = std::min(count, samples_.size() - begin_);
+		std::copy(samples_.begin() + begin_, samples_.begin() + begin_ + first, dest.begin());
+		std::copy(samples_.begin(), samples_.begin() + (count - first), dest.begin() + first);
+
+		drop(count);
+	}
+
+	void pop_stream()
+	{
+		drop(streams_.front());
+		streams_.pop_front();
+		if(streams_.empty())
+			streams_.push_back(0);
+	}
+
+	void clear()
+	{
+		begin_ = 0;
+		size_  = 0;
+		streams_.clear();
+		streams_.push_back(0);
+	}
+private:
+	void drop(size_t count)
+	{
+		begin_			  = (begin_ + count) % samples_.size();
+		size_			 -= count;
+		streams_.front() -= count;
+	}
+
+	void reserve(size_t size)
+	{
+		if(size <= samples_.size())
+			return;
+
+		sample_vector samples(std::max(size, samples_.size()*2));
+		auto first = std::min(size_, samples_.size() - begin_);
+		std::copy(samples_.begin() + begin_, samples_.begin() + begin_ + first, samples.begin());
+		std::copy(samples_.begin(), samples_.begin() + (size_ - first), samples.begin() + first);
+
+		samples_.swap(samples);
+		begin_ = 0;
+	}
+};
+
 struct frame_muxer::implementation : boost::noncopyable
 {	
 	std::queue<std::queue<safe_ptr<write_frame>>>	video_streams_;
-	std::queue<core::audio_buffer>					audio_streams_;
+	audio_sample_ring								audio_streams_;
 	std::queue<safe_ptr<basic_frame>>				frame_buffer_;
 	display_mode::type								display_mode_;
 	const boost::rational<int>						in_fps_;
@@ -82,10 +213,18 @@ struct frame_muxer::implementation : boost::noncopyable
 	safe_ptr<core::frame_factory>					frame_factory_;
 	
 	std::shared_ptr<filter>							filter_;
+	std::map<std::string, std::shared_ptr<filter>>	filters_;
+	std::map<std::string, std::shared_ptr<boost::unique_future<std::shared_ptr<filter>>>>	pending_filters_;
 	const std::string								filter_str_;
 	const bool										thumbnail_mode_;
 	bool											force_deinterlacing_;
+	int												degradations_; // Those of the load governor the filter was configured for.
+	int												scale_divisor_; // Of the channel's size, from the scale hints.
 	const core::channel_layout						audio_channel_layout_;
+	const bool										gpu_deinterlace_;
+	bool											deinterlace_on_gpu_;
+	core::field_mode::type							first_field_;
+	std::deque<std::shared_ptr<write_frame>>		deinterlace_history_; // The last frames, temporal neighbours of the fields.
 		
 	implementation(
 			boost::rational<int> in_fps,
@@ -97,6 +236,7 @@ struct frame_muxer::implementation : boost::noncopyable
 		: display_mode_(display_mode::invalid)
 		, in_fps_(in_fps)
 		, format_desc_(frame_factory->get_video_format_desc())
+		, audio_streams_(MAX_AUDIO_FRAMES * max_cadence(frame_factory->get_video_format_desc()) * audio_channel_layout.num_channels)
 		, auto_transcode_(env::properties().get(L"configuration.auto-transcode", true))
 		, auto_deinterlace_(env::properties().get(L"configuration.auto-deinterlace", true))
 		, audio_cadence_(format_desc_.audio_cadence)
@@ -104,10 +244,14 @@ struct frame_muxer::implementation : boost::noncopyable
 		, filter_str_(filter_str)
 		, thumbnail_mode_(thumbnail_mode)
 		, force_deinterlacing_(false)
+		, degradations_(0)
+		, scale_divisor_(1)
 		, audio_channel_layout_(audio_channel_layout)
+		, gpu_deinterlace_(!thumbnail_mode && env::properties().get(L"configuration.ffmpeg.gpu-deinterlace", true))
+		, deinterlace_on_gpu_(false)
+		, first_field_(core::field_mode::upper)
 	{
 		video_streams_.push(std::queue<safe_ptr<write_frame>>());
-		audio_streams_.push(core::audio_buffer());
 		// Note: Uses 1 step rotated cadence for 1001 modes (1602, 1602, 1601, 1602, 1601)
 		// This cadence fills the audio mixer most optimally.
 		boost::range::rotate(audio_cadence_, std::end(audio_cadence_)-1);
@@ -120,7 +264,9 @@ struct frame_muxer::implementation : boost::noncopyable
 		if(!video_frame)
 			return;
 
-		if (!filter_ || (video_frame->data[0] && filter_->is_frame_format_changed(video_frame)))
+		auto compressed = get_compressed_frame(this, *video_frame);
+
+		if (!compressed && (!filter_ || (video_frame->data[0] && filter_->is_frame_format_changed(video_frame))))
 		{
 			CASPAR_LOG(debug) << L"[frame_muxer] Frame format has changed. Resetting display mode.";
 			display_mode_ = display_mode::invalid;
@@ -137,6 +283,27 @@ struct frame_muxer::implementation : boost::noncopyable
 			display_mode_ = display_mode::simple;
 			CASPAR_LOG(trace) << "Muxer::push empty video";
 		}
+		else if(compressed)
+		{
+			// Textures uploaded as they are can not be filtered, the frame rate is only matched by repeating and 
+			// dropping frames.
+			if(filter_ || display_mode_ == display_mode::invalid)
+			{
+				filter_.reset();
+				deinterlace_history_.clear();
+				deinterlace_on_gpu_ = false;
+
+				auto mode = get_display_mode(core::field_mode::progressive, boost::rational_cast<double>(in_fps_), format_desc_.field_mode, format_desc_.fps);
+				if(mode != display_mode::simple && mode != display_mode::duplicate && mode != display_mode::half && mode != display_mode::interlace)
+					mode = display_mode::simple;
+				display_mode_ = mode;
+
+				CASPAR_LOG(debug) << L"[frame_muxer] " << display_mode_ << L" compressed " << print_mode(video_frame->width, video_frame->height, boost::rational_cast<double>(in_fps_), false);
+			}
+
+			compressed->set_timecode(timecode);
+			video_streams_.back().push(make_safe_ptr(compressed));
+		}
 		else
 		{
 			video_frame->display_picture_number = timecode;
@@ -147,6 +314,20 @@ struct frame_muxer::implementation : boost::noncopyable
 				display_mode_ = display_mode::invalid;
 			}
 
+			auto degradations = thumbnail_mode_ ? 0 : frame_factory_->get_degradations() & (core::degradation::cheap_deinterlace | core::degradation::fast_scaling);
+			if(degradations_ != degradations)
+			{
+				degradations_ = degradations;
+				display_mode_ = display_mode::invalid;
+			}
+
+			auto scale_divisor = thumbnail_mode_ ? 1 : (hints & core::frame_producer::QUARTER_SCALE_HINT) ? 4 : (hints & core::frame_producer::HALF_SCALE_HINT) ? 2 : 1;
+			if(scale_divisor_ != scale_divisor)
+			{
+				scale_divisor_ = scale_divisor;
+				display_mode_ = display_mode::invalid;
+			}
+
 			if(hints & core::frame_producer::ALPHA_HINT)
 				video_frame->format = make_alpha_format(video_frame->format);
 		
@@ -163,7 +344,7 @@ struct frame_muxer::implementation : boost::noncopyable
 			{
 				if(video_frame->format == AV_PIX_FMT_GRAY8 && format == CASPAR_PIX_FMT_LUMA)
 					av_frame->format = format;
-				video_streams_.back().push(make_write_frame(this, av_frame, frame_factory_, hints, audio_channel_layout_));
+				video_streams_.back().push(make_write_frame(this, av_frame, frame_factory_, hints, audio_channel_layout_, filter_->is_fast_path()));
 			}
 		}
 
@@ -178,29 +359,29 @@ struct frame_muxer::implementation : boost::noncopyable
 
 		if(audio == flush_audio())
 		{
-			audio_streams_.push(core::audio_buffer());
+			audio_streams_.flush();
 		}
 		else if(audio == empty_audio())
 		{
-			boost::range::push_back(audio_streams_.back(), core::audio_buffer(audio_cadence_.front() * audio_channel_layout_.num_channels, 0));
+			audio_streams_.push_silence(audio_cadence_.front() * audio_channel_layout_.num_channels);
 		}
-		else
+		else if(!audio->empty())
 		{
-			boost::range::push_back(audio_streams_.back(), *audio);
+			audio_streams_.push(audio->data(), audio->size());
 		}
 
-		if(audio_streams_.back().size() > 32*audio_cadence_.front() * audio_channel_layout_.num_channels)
+		if(audio_streams_.back_size() > MAX_AUDIO_FRAMES*audio_cadence_.front() * audio_channel_layout_.num_channels)
 			BOOST_THROW_EXCEPTION(invalid_operation() << source_info("frame_muxer") << msg_info("audio-stream overflow. This can be caused by incorrect frame-rate. Check clip meta-data."));
 	}
 	
 	bool video_ready() const
 	{		
-		return video_streams_.size() > 1 || (video_streams_.size() >= audio_streams_.size() && video_ready2());
+		return video_streams_.size() > 1 || (video_streams_.size() >= audio_streams_.stream_count() && video_ready2());
 	}
 	
 	bool audio_ready() const
 	{
-		return audio_streams_.size() > 1 || (audio_streams_.size() >= video_streams_.size() && audio_ready2());
+		return audio_streams_.stream_count() > 1 || (audio_streams_.stream_count() >= video_streams_.size() && audio_ready2());
 	}
 
 	bool video_ready2() const
@@ -219,10 +400,13 @@ struct frame_muxer::implementation : boost::noncopyable
 	{
 		switch(display_mode_)
 		{
+		case display_mode::deinterlace_bob:
+			if(!deinterlace_on_gpu_ || deinterlace_history_.empty())
+				return audio_streams_.front_size() >= audio_cadence_.front() * audio_channel_layout_.num_channels;
 		case display_mode::duplicate:					
-			return audio_streams_.front().size()/2 >= audio_cadence_.front() * audio_channel_layout_.num_channels;
+			return audio_streams_.front_size()/2 >= audio_cadence_.front() * audio_channel_layout_.num_channels;
 		default:										
-			return audio_streams_.front().size() >= audio_cadence_.front() * audio_channel_layout_.num_channels;
+			return audio_streams_.front_size() >= audio_cadence_.front() * audio_channel_layout_.num_channels;
 		}
 	}
 		
@@ -235,20 +419,33 @@ struct frame_muxer::implementation : boost::noncopyable
 			return frame;
 		}
 
-		if(video_streams_.size() > 1 && audio_streams_.size() > 1 && (!video_ready2() || !audio_ready2()))
+		if(video_streams_.size() > 1 && audio_streams_.stream_count() > 1 && (!video_ready2() || !audio_ready2()))
 		{
-			if(!video_streams_.front().empty() || !audio_streams_.front().empty())
-				CASPAR_LOG(trace) << "Truncating: " << video_streams_.front().size() << L" video-frames, " << audio_streams_.front().size() << L" audio-samples.";
+			if(!video_streams_.front().empty() || audio_streams_.front_size() > 0)
+				CASPAR_LOG(trace) << "Truncating: " << video_streams_.front().size() << L" video-frames, " << audio_streams_.front_size() << L" audio-samples.";
 
 			video_streams_.pop();
-			audio_streams_.pop();
+			audio_streams_.pop_stream();
 		}
 
 		if(!video_ready2() || !audio_ready2() || display_mode_ == display_mode::invalid)
 			return nullptr;
+
+		if(deinterlace_on_gpu_ && display_mode_ == display_mode::scale_interlaced && deinterlace_history_.empty())
+		{
+			// The second field needs the frame after it, so the frames are shown one frame late.
+			push_history(pop_video());
+			return poll();
+		}
 				
 		auto frame1				= pop_video();
-		frame1->audio_data()	= pop_audio();
+		pop_audio(frame1->audio_data());
+
+		if(deinterlace_on_gpu_)
+		{
+			poll_gpu_deinterlaced(frame1);
+			return frame_buffer_.empty() ? nullptr : poll();
+		}
 
 		switch(display_mode_)
 		{
@@ -269,7 +466,7 @@ struct frame_muxer::implementation : boost::noncopyable
 		case display_mode::duplicate:	
 			{
 				auto frame2				= make_safe<core::write_frame>(*frame1);
-				frame2->audio_data()	= pop_audio();
+				pop_audio(frame2->audio_data());
 
 				frame_buffer_.push(frame1);
 				frame_buffer_.push(frame2);
@@ -287,6 +484,73 @@ struct frame_muxer::implementation : boost::noncopyable
 		return frame_buffer_.empty() ? nullptr : poll();
 	}
 	
+	// The fields which yadif would output, deinterlaced by the image mixer instead. The audio of the frame goes with 
+	// the first field shown.
+	void poll_gpu_deinterlaced(const safe_ptr<core::write_frame>& frame)
+	{
+		auto second_field = first_field_ == core::field_mode::upper ? core::field_mode::lower : core::field_mode::upper;
+		std::shared_ptr<core::write_frame> prev;
+		if(!deinterlace_history_.empty())
+			prev = deinterlace_history_.back();
+
+		switch(display_mode_)
+		{
+		case display_mode::deinterlace:	
+			{
+				frame_buffer_.push(make_field(frame, first_field_, prev, frame, false));
+				break;
+			}
+		case display_mode::deinterlace_bob:
+			{
+				if(prev)
+				{
+					auto field2 = make_field(make_safe_ptr(prev), second_field, prev, frame, true);
+					field2->audio_data() = frame->audio_data();
+					frame_buffer_.push(field2);
+
+					auto field1 = make_field(frame, first_field_, prev, frame, true);
+					pop_audio(field1->audio_data());
+					frame_buffer_.push(field1);
+				}
+				else
+					frame_buffer_.push(make_field(frame, first_field_, nullptr, nullptr, false));
+				break;
+			}
+		case display_mode::scale_interlaced:
+			{
+				std::shared_ptr<core::write_frame> prev2;
+				if(deinterlace_history_.size() > 1)
+					prev2 = deinterlace_history_.front();
+				auto field1 = make_field(make_safe_ptr(prev), first_field_, prev2, prev, true);
+				auto field2 = make_field(make_safe_ptr(prev), second_field, prev, frame, true);
+				field1->audio_data() = std::move(frame->audio_data());
+				frame_buffer_.push(core::basic_frame::interlace(field1, field2, format_desc_.field_mode));
+				break;
+			}
+		default:
+			frame_buffer_.push(frame);
+		}
+
+		push_history(frame);
+	}
+
+	// A copy of the frame which shares its textures, shown as the field. 
+	safe_ptr<core::write_frame> make_field(const safe_ptr<core::write_frame>& frame, core::field_mode::type field, const std::shared_ptr<core::write_frame>& before, const std::shared_ptr<core::write_frame>& after, bool clear_audio)
+	{
+		auto result = make_safe<core::write_frame>(*frame);
+		if(clear_audio)
+			result->audio_data().clear();
+		result->set_deinterlace(field, before, after);
+		return result;
+	}
+
+	void push_history(const safe_ptr<core::write_frame>& frame)
+	{
+		deinterlace_history_.push_back(frame);
+		while(deinterlace_history_.size() > 2)
+			deinterlace_history_.pop_front();
+	}
+
 	safe_ptr<core::write_frame> pop_video()
 	{
 		auto frame = video_streams_.front().front();
@@ -294,91 +558,229 @@ struct frame_muxer::implementation : boost::noncopyable
 		return frame;
 	}
 
-	core::audio_buffer pop_audio()
+	void pop_audio(core::audio_buffer& dest)
 	{
-		CASPAR_VERIFY(audio_streams_.front().size() >= audio_cadence_.front() * audio_channel_layout_.num_channels);
-
-		auto begin = audio_streams_.front().begin();
-		auto end   = begin + (audio_cadence_.front() * audio_channel_layout_.num_channels);
+		CASPAR_VERIFY(audio_streams_.front_size() >= audio_cadence_.front() * audio_channel_layout_.num_channels);
 
-		core::audio_buffer samples(begin, end);
-		audio_streams_.front().erase(begin, end);
+		audio_streams_.pop(audio_cadence_.front() * audio_channel_layout_.num_channels, dest);
 		
 		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
-
-		return samples;
 	}
 				
-	void update_display_mode(const std::shared_ptr<AVFrame>& frame, bool force_deinterlace)
+	struct filter_config
 	{
-		std::string filter_str = narrow(filter_str_);
-
-		display_mode_ = display_mode::simple;
+		display_mode::type		mode;
+		std::string				filter_str;
+		std::string				key;
+		bool					gpu; // Deinterlaced by the image mixer instead of yadif.
+		core::field_mode::type	first_field;
+	};
+
+	filter_config get_filter_config(const AVFrame& frame, bool force_deinterlace) const
+	{
+		filter_config config;
+		config.filter_str = narrow(filter_str_);
 
-		auto mode = get_mode(*frame);
-		if(mode == core::field_mode::progressive && frame->height < 720 && boost::rational_cast<double>(in_fps_) < 50.0) // SD frames are interlaced. Probably incorrect meta-data. Fix it.
+		auto mode = get_mode(frame);
+		if(mode == core::field_mode::progressive && frame.height < 720 && boost::rational_cast<double>(in_fps_) < 50.0) // SD frames are interlaced. Probably incorrect meta-data. Fix it.
 			mode = core::field_mode::upper;
 
 		double fps = boost::rational_cast<double>(in_fps_);
 
-		display_mode_ = get_display_mode(mode, fps, format_desc_.field_mode, format_desc_.fps);
+		config.mode = get_display_mode(mode, fps, format_desc_.field_mode, format_desc_.fps);
 			
-		if((frame->height != 480 || format_desc_.height != 486) && // don't deinterlace for NTSC DV
-				display_mode_ == display_mode::simple && mode != core::field_mode::progressive && format_desc_.field_mode != core::field_mode::progressive && 
-				((size_t)frame->height != format_desc_.height && !(frame->width == 720 && frame->height == 608 && format_desc_.height == 576)))
-			display_mode_ = display_mode::scale_interlaced; // The frame will be scaled	
-
-		// ALWAYS de-interlace, until we have GPU de-interlacing.
-		if(force_deinterlacing_ && frame->interlaced_frame && display_mode_ != display_mode::deinterlace_bob && display_mode_ != display_mode::deinterlace)
-			display_mode_ = display_mode::scale_interlaced;
+		if((frame.height != 480 || format_desc_.height != 486) && // don't deinterlace for NTSC DV
+				config.mode == display_mode::simple && mode != core::field_mode::progressive && format_desc_.field_mode != core::field_mode::progressive && 
+				((size_t)frame.height != format_desc_.height && !(frame.width == 720 && frame.height == 608 && format_desc_.height == 576)))
+			config.mode = display_mode::scale_interlaced; // The frame will be scaled	
+
+		config.gpu			= false;
+		config.first_field	= mode == core::field_mode::lower ? core::field_mode::lower : core::field_mode::upper;
+
+		// ALWAYS de-interlace scaled layers, on the gpu unless it is disabled.
+		if(force_deinterlace && frame.interlaced_frame && config.mode != display_mode::deinterlace_bob && config.mode != display_mode::deinterlace)
+		{
+			config.mode = display_mode::scale_interlaced;
+			config.gpu	= gpu_deinterlace_;
+		}
+
+		if(mode != core::field_mode::progressive && (config.mode == display_mode::deinterlace || config.mode == display_mode::deinterlace_bob))
+			config.gpu = gpu_deinterlace_;
 		
-		if (frame->height == 608 && frame->width == 720) // fix for IMX frames with VBI lines
-			filter_str = append_filter(filter_str, "CROP=720:576:0:32");
-		if(display_mode_ == display_mode::deinterlace)
-			filter_str = append_filter(filter_str, "YADIF=0:-1");
-		else if(display_mode_ == display_mode::deinterlace_bob)
-			filter_str = append_filter(filter_str, "YADIF=1:-1");
-		else if (display_mode_ == display_mode::scale_interlaced)
-			filter_str = append_filter(filter_str, (boost::format("SCALE=w=%1%:h=%2%:interl=1") %format_desc_.width %format_desc_.height).str());
-
-		if (in_fps_ != boost::rational<int>(format_desc_.time_scale, format_desc_.duration))
-			filter_str = append_filter(filter_str, (boost::format("FPS=%1%/%2%") % format_desc_.time_scale %format_desc_.duration).str());
-
-		if(display_mode_ == display_mode::invalid)
+		if (frame.height == 608 && frame.width == 720) // fix for IMX frames with VBI lines
+			config.filter_str = append_filter(config.filter_str, "CROP=720:576:0:32");
+
+		// A single small still is all a thumbnail needs, so scale it down right away and leave fields and frame rate be.
+		if(thumbnail_mode_)
+		{
+			int width;
+			int height;
+			get_thumbnail_tile_size(width, height);
+
+			config.mode			= display_mode::simple;
+			config.gpu			= false;
+			config.filter_str	= append_filter(config.filter_str, (boost::format("SCALE=w=%1%:h=%2%:flags=fast_bilinear") % width % height).str());
+			config.key			= get_filter_key(frame, config.filter_str);
+
+			return config;
+		}
+		if(!config.gpu) // Otherwise the fields are rebuilt and scaled by the image mixer.
+		{
+			// Under load yadif skips its spatial interlacing check, which is most of its cost.
+			bool cheap = (degradations_ & core::degradation::cheap_deinterlace) != 0;
+			auto scale_flags = degradations_ & core::degradation::fast_scaling ? ":flags=fast_bilinear" : "";
+
+			if(config.mode == display_mode::deinterlace)
+				config.filter_str = append_filter(config.filter_str, cheap ? "YADIF=2:-1" : "YADIF=0:-1");
+			else if(config.mode == display_mode::deinterlace_bob)
+				config.filter_str = append_filter(config.filter_str, cheap ? "YADIF=3:-1" : "YADIF=1:-1");
+			else if (config.mode == display_mode::scale_interlaced)
+				config.filter_str = append_filter(config.filter_str, (boost::format("SCALE=w=%1%:h=%2%:interl=1%3%") %(format_desc_.width / scale_divisor_) %(format_desc_.height / scale_divisor_) %scale_flags).str());
+
+			// A layer shown at a fraction of the channel is scaled down before it is uploaded, never below that fraction
+			// of the channel's size.
+			int width	= std::min<int>(frame.width, format_desc_.width / scale_divisor_);
+			int height	= std::min<int>(frame.height, format_desc_.height / scale_divisor_);
+			if(config.mode != display_mode::scale_interlaced && (width < frame.width || height < frame.height))
+			{
+				bool interlaced = frame.interlaced_frame && config.mode != display_mode::deinterlace && config.mode != display_mode::deinterlace_bob;
+				config.filter_str = append_filter(config.filter_str, (boost::format("SCALE=w=%1%:h=%2%%3%%4%") %width %height %(interlaced ? ":interl=1" : "") %scale_flags).str());
+			}
+		}
+
+		// Without yadif doubling the frame rate, the frames of bob deinterlacing come at half of the channel rate.
+		auto out_fps = config.gpu && config.mode == display_mode::deinterlace_bob ? boost::rational<int>(format_desc_.time_scale, format_desc_.duration*2) : boost::rational<int>(format_desc_.time_scale, format_desc_.duration);
+		if (in_fps_ != out_fps)
+			config.filter_str = append_filter(config.filter_str, (boost::format("FPS=%1%/%2%") % out_fps.numerator() % out_fps.denominator()).str());
+
+		if(config.mode == display_mode::invalid)
 		{
 			CASPAR_LOG(debug) << L"[frame_muxer] Auto-transcode: Failed to detect display-mode.";
-			display_mode_ = display_mode::simple;
+			config.mode = display_mode::simple;
 		}
 
-		auto out_pix_fmts = std::vector<AVPixelFormat>();
-		out_pix_fmts.push_back(AV_PIX_FMT_BGRA);
+		config.key = get_filter_key(frame, config.filter_str);
+
+		return config;
+	}
+
+	static std::string get_filter_key(const AVFrame& frame, const std::string& filter_str)
+	{
+		return (boost::format("%1%x%2%:%3%:%4%/%5%:%6%") % frame.width % frame.height % frame.format % frame.sample_aspect_ratio.num % frame.sample_aspect_ratio.den % filter_str).str();
+	}
+
+	std::function<std::shared_ptr<filter>()> get_filter_factory(const AVFrame& frame, const std::string& filter_str) const
+	{
+		auto width					= frame.width;
+		auto height					= frame.height;
+		auto sample_aspect_ratio	= frame.sample_aspect_ratio;
+		auto pix_fmt				= static_cast<AVPixelFormat>(frame.format);
+		auto in_fps					= in_fps_;
+
+		return [=]() -> std::shared_ptr<filter>
+		{
+			auto out_pix_fmts = std::vector<AVPixelFormat>();
+			out_pix_fmts.push_back(AV_PIX_FMT_BGRA);
+
+			return std::make_shared<filter>(
+				width,
+				height,
+				av_make_q(in_fps.denominator(), in_fps.numerator()),
+				av_make_q(in_fps.numerator(), in_fps.denominator()),
+				sample_aspect_ratio,
+				pix_fmt,
+				out_pix_fmts,
+				filter_str);
+		};
+	}
 
-		filter_.reset (new filter(
-			frame->width,
-			frame->height,
-			av_make_q(in_fps_.denominator(), in_fps_.numerator()),
-			av_make_q(in_fps_.numerator(), in_fps_.denominator()),
-			frame->sample_aspect_ratio,
-			static_cast<AVPixelFormat>(frame->format),
-			out_pix_fmts,
-			filter_str));
+	// Configured graphs are kept per input format and filter string, so that switching back and forth between them
+	// doesn't rebuild the graph.
+	std::shared_ptr<filter> get_filter(const AVFrame& frame, const filter_config& config)
+	{
+		auto it = filters_.find(config.key);
+		if(it != filters_.end())
+			return it->second;
 
-			CASPAR_LOG(debug) << L"[frame_muxer] " << display_mode_ << L" " << print_mode(frame->width, frame->height, fps, frame->interlaced_frame > 0);
+		std::shared_ptr<filter> result;
+
+		auto pending = pending_filters_.find(config.key);
+		if(pending != pending_filters_.end())
+		{
+			try
+			{
+				result = pending->second->get();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+			pending_filters_.erase(pending);
+		}
+
+		if(!result)
+			result = get_filter_factory(frame, config.filter_str)();
+
+		if(filters_.size() >= MAX_CACHED_FILTERS)
+			filters_.clear();
+		filters_[config.key] = result;
+
+		return result;
+	}
+
+	void update_display_mode(const std::shared_ptr<AVFrame>& frame, bool force_deinterlace)
+	{
+		auto config = get_filter_config(*frame, force_deinterlace);
+
+		display_mode_		= config.mode;
+		deinterlace_on_gpu_ = config.gpu;
+		first_field_		= config.first_field;
+		filter_				= get_filter(*frame, config);
+		filter_->clear();
+
+		if(!deinterlace_on_gpu_)
+			deinterlace_history_.clear();
+
+		CASPAR_LOG(debug) << L"[frame_muxer] " << display_mode_ << L" " << print_mode(frame->width, frame->height, boost::rational_cast<double>(in_fps_), frame->interlaced_frame > 0);
+
+		// The deinterlace hint follows MIXER FILL during transitions, prepare the graph for the other value in the 
+		// background so that toggling it doesn't stall playout.
+		if(auto_deinterlace_ && !thumbnail_mode_ && frame->interlaced_frame)
+		{
+			auto other = get_filter_config(*frame, !force_deinterlace);
+			if(filters_.find(other.key) == filters_.end() && pending_filters_.find(other.key) == pending_filters_.end())
+			{
+				auto factory = get_filter_factory(*frame, other.filter_str);
+				pending_filters_[other.key] = std::make_shared<boost::unique_future<std::shared_ptr<filter>>>(filter_executor().begin_invoke([=]
+				{
+					return factory();
+				}));
+			}
+		}
+	}
+
+	static executor& filter_executor()
+	{
+		static executor* instance = []() -> executor*
+		{
+			auto result = new executor(L"frame_muxer_filters");
+			result->set_priority_class(below_normal_priority_class);
+			return result;
+		}();
+		return *instance;
 	}
 	
 	void clear()
 	{
 		while(!video_streams_.empty())
 			video_streams_.pop();
-		audio_streams_.back().clear();
-		while (!audio_streams_.empty())
-			audio_streams_.pop();	
+		audio_streams_.clear();
 		while(!frame_buffer_.empty())
 			frame_buffer_.pop();
+		deinterlace_history_.clear();
 		if (filter_)
 			filter_->clear();
 		video_streams_.push(std::queue<safe_ptr<write_frame>>());
-		audio_streams_.push(core::audio_buffer());
 	}
 };
 
@@ -395,5 +797,6 @@ void frame_muxer::clear(){return impl_->clear();}
 std::shared_ptr<basic_frame> frame_muxer::poll(){return impl_->poll();}
 bool frame_muxer::video_ready() const{return impl_->video_ready();}
 bool frame_muxer::audio_ready() const{return impl_->audio_ready();}
+const void* frame_muxer::tag() const{return impl_.get();}
 
 }}
\ No newline at end of file
@@ -66,6 +66,8 @@ public:
 	
 	std::shared_ptr<core::basic_frame> poll();
 
+	const void* tag() const;
+
 private:
 	struct implementation;
 	safe_ptr<implementation> impl_;
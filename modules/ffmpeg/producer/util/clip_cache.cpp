@@ -0,0 +1,306 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "clip_cache.h"
+
+#include "decode_scheduler.h"
+#include "../input/input.h"
+#include "../video/video_decoder.h"
+#include "../audio/audio_decoder.h"
+#include "../../ffmpeg_error.h"
+
+#include <core/video_format.h>
+
+#include <common/concurrency/executor.h>
+#include <common/diagnostics/graph.h>
+#include <common/env.h>
+#include <common/log/log.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/mutex.h>
+
+#include <ctime>
+#include <map>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavcodec/avcodec.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+int64_t frame_size(const AVFrame& frame)
+{
+	int64_t size = 0;
+	for(int n = 0; n < AV_NUM_DATA_POINTERS && frame.buf[n]; ++n)
+		size += frame.buf[n]->size;
+	return size;
+}
+
+std::time_t last_write_time(const std::wstring& filename)
+{
+	try
+	{
+		return boost::filesystem::last_write_time(boost::filesystem::wpath(filename));
+	}
+	catch(...)
+	{
+		return 0;
+	}
+}
+
+struct clip_cache
+{
+	struct entry
+	{
+		std::time_t						last_write;
+		int								audio_sample_rate;
+		std::shared_ptr<cached_clip>	clip; // Empty while decoding.
+
+		entry() : last_write(0), audio_sample_rate(0){}
+	};
+
+	tbb::mutex						mutex_;
+	std::map<std::wstring, entry>	entries_;
+	const int64_t					max_size_;
+	int64_t							size_;
+	executor						executor_;
+
+	clip_cache()
+		: max_size_(env::properties().get(L"configuration.ffmpeg.clip-cache-size", 1024) * 1024LL * 1024LL)
+		, size_(0)
+		, executor_(L"clip_cache")
+	{
+		executor_.set_priority_class(below_normal_priority_class);
+	}
+
+	static clip_cache& instance()
+	{
+		static clip_cache cache;
+		return cache;
+	}
+
+	bool pin(const std::wstring& filename, const core::video_format_desc& format_desc)
+	{
+		if(!boost::filesystem::exists(filename))
+			return false;
+
+		auto last_write = last_write_time(filename);
+
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = entries_.find(filename);
+			if(it != entries_.end() && it->second.last_write == last_write && it->second.audio_sample_rate == format_desc.audio_sample_rate)
+				return true;
+
+			if(it != entries_.end() && it->second.clip)
+				size_ -= it->second.clip->size;
+
+			auto& entry				= entries_[filename];
+			entry.last_write		= last_write;
+			entry.audio_sample_rate = format_desc.audio_sample_rate;
+			entry.clip.reset();
+		}
+
+		executor_.begin_invoke([=]
+		{
+			std::shared_ptr<cached_clip> clip;
+			try
+			{
+				clip = decode(filename, format_desc);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = entries_.find(filename);
+			if(it == entries_.end() || it->second.last_write != last_write || it->second.clip) // Unpinned or pinned again meanwhile.
+				return;
+
+			if(!clip)
+			{
+				CASPAR_LOG(warning) << print(filename) << L" Failed to cache clip.";
+				entries_.erase(it);
+				return;
+			}
+
+			size_ += clip->size;
+			it->second.clip = clip;
+			CASPAR_LOG(info) << print(filename) << L" Cached " << clip->video.size() << L" frames, " << clip->size / (1024*1024) << L" MB.";
+		});
+
+		return true;
+	}
+
+	bool unpin(const std::wstring& filename)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = entries_.find(filename);
+		if(it == entries_.end())
+			return false;
+
+		if(it->second.clip)
+			size_ -= it->second.clip->size;
+		entries_.erase(it);
+		return true;
+	}
+
+	std::shared_ptr<const cached_clip> find(const std::wstring& filename, const core::video_format_desc& format_desc)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = entries_.find(filename);
+		if(it == entries_.end() || !it->second.clip || it->second.audio_sample_rate != format_desc.audio_sample_rate)
+			return nullptr;
+
+		if(it->second.last_write != last_write_time(filename))
+			return nullptr;
+
+		return it->second.clip;
+	}
+
+	boost::property_tree::wptree info()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		boost::property_tree::wptree info;
+		info.add(L"size",		size_);
+		info.add(L"max-size",	max_size_);
+		BOOST_FOREACH(auto& entry, entries_)
+		{
+			boost::property_tree::wptree clip_info;
+			clip_info.add(L"filename",	entry.first);
+			clip_info.add(L"loaded",	static_cast<bool>(entry.second.clip));
+			clip_info.add(L"frames",	entry.second.clip ? entry.second.clip->video.size() : 0);
+			clip_info.add(L"size",		entry.second.clip ? entry.second.clip->size : 0);
+			info.add_child(L"clip", clip_info);
+		}
+		return info;
+	}
+
+	int64_t available_size()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		return max_size_ - size_;
+	}
+
+	std::shared_ptr<cached_clip> decode(const std::wstring& filename, const core::video_format_desc& format_desc)
+	{
+		safe_ptr<diagnostics::graph> graph;
+		input input(graph, filename, false);
+
+		std::unique_ptr<video_decoder> video_decoder;
+		std::unique_ptr<audio_decoder> audio_decoder;
+
+		try
+		{
+			video_decoder.reset(new ffmpeg::video_decoder(input, false, L"none"));
+		}
+		catch(averror_stream_not_found&)
+		{
+		}
+		
+		try
+		{
+			audio_decoder.reset(new ffmpeg::audio_decoder(input, format_desc, L""));
+		}
+		catch(averror_stream_not_found&)
+		{
+		}
+
+		if(!video_decoder)
+			BOOST_THROW_EXCEPTION(averror_stream_not_found() << msg_info("No video-stream found"));
+
+		auto clip					= std::make_shared<cached_clip>();
+		clip->filename				= filename;
+		clip->frame_rate			= video_decoder->frame_rate();
+		clip->audio_sample_rate		= format_desc.audio_sample_rate;
+		clip->audio_channel_layout	= audio_decoder ? audio_decoder->channel_layout() : core::default_channel_layout_repository().get_by_name(L"STEREO");
+
+		const auto budget = available_size();
+
+		while(true)
+		{
+			std::shared_ptr<AVFrame>			video;
+			std::shared_ptr<core::audio_buffer>	audio;
+			{
+				decode_ticket ticket(decode_priority::background);
+				video = video_decoder->poll();
+				if(audio_decoder)
+					audio = audio_decoder->poll();
+			}
+
+			if(video)
+			{
+				clip->size += frame_size(*video);
+				clip->video.push_back(make_safe_ptr(video));
+			}
+
+			if(audio)
+			{
+				clip->size += audio->size() * sizeof(int32_t);
+				clip->audio.push_back(make_safe_ptr(audio));
+			}
+
+			if(clip->size > budget)
+			{
+				CASPAR_LOG(warning) << print(filename) << L" Clip does not fit in configuration.ffmpeg.clip-cache-size.";
+				return nullptr;
+			}
+
+			if(!video && !audio && input.eof())
+				break;
+		}
+
+		return clip;
+	}
+
+	std::wstring print(const std::wstring& filename) const
+	{
+		return L"clip_cache[" + boost::filesystem::wpath(filename).filename() + L"]";
+	}
+};
+
+bool pin_clip(const std::wstring& filename, const core::video_format_desc& format_desc){return clip_cache::instance().pin(filename, format_desc);}
+bool unpin_clip(const std::wstring& filename){return clip_cache::instance().unpin(filename);}
+std::shared_ptr<const cached_clip> find_cached_clip(const std::wstring& filename, const core::video_format_desc& format_desc){return clip_cache::instance().find(filename, format_desc);}
+boost::property_tree::wptree get_clip_cache_info(){return clip_cache::instance().info();}
+
+}}
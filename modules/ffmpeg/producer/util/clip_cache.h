@@ -0,0 +1,72 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/mixer/audio/audio_mixer.h>
+#include <core/mixer/audio/audio_util.h>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+#include <boost/rational.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct AVFrame;
+
+namespace caspar { 
+
+namespace core {
+
+struct video_format_desc;
+
+}
+
+namespace ffmpeg {
+
+// A clip decoded in full, as the decoders of ffmpeg_producer output it.
+struct cached_clip
+{
+	std::wstring								filename;
+	boost::rational<int>						frame_rate;
+	int											audio_sample_rate;
+	core::channel_layout						audio_channel_layout;
+	std::vector<safe_ptr<AVFrame>>				video;
+	std::vector<safe_ptr<core::audio_buffer>>	audio;
+	int64_t										size;
+
+	cached_clip() : audio_sample_rate(0), size(0){}
+};
+
+// Decodes the clip into host memory in the background and keeps it until unpinned, as long as it fits within 
+// configuration.ffmpeg.clip-cache-size. Returns false if the file does not exist.
+bool pin_clip(const std::wstring& filename, const core::video_format_desc& format_desc);
+bool unpin_clip(const std::wstring& filename);
+
+// Returns the clip if it is pinned, of the same modification time and decoded for the sample rate of format_desc.
+std::shared_ptr<const cached_clip> find_cached_clip(const std::wstring& filename, const core::video_format_desc& format_desc);
+
+boost::property_tree::wptree get_clip_cache_info();
+
+}}
@@ -0,0 +1,397 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "conversion_cache.h"
+#include "util.h"
+
+#include "../../ffmpeg_error.h"
+
+#include <core/video_format.h>
+
+#include <common/env.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <tbb/mutex.h>
+
+#include <ctime>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libswscale/swscale.h>
+	#include <libswresample/swresample.h>
+	#include <libavutil/samplefmt.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+struct idle_context
+{
+	std::string					key;
+	void*						context;
+	std::function<void(void*)>	free;
+	int64_t						size;
+	std::time_t					released;
+};
+
+struct kind_counters
+{
+	int64_t hits;
+	int64_t misses;
+	int64_t in_use;
+
+	kind_counters() : hits(0), misses(0), in_use(0){}
+};
+
+class conversion_cache : boost::noncopyable
+{
+	mutable tbb::mutex									mutex_;
+	std::list<idle_context>								idle_;	// most recently released first
+	std::multimap<std::string, std::list<idle_context>::iterator>	index_;
+	std::set<std::string>								prewarmed_;
+	std::map<std::string, kind_counters>				counters_;
+	int64_t												idle_size_;
+	int64_t												trimmed_;
+	const int64_t										max_size_;
+	const int											max_idle_;
+public:
+	conversion_cache()
+		: idle_size_(0)
+		, trimmed_(0)
+		, max_size_(env::properties().get(L"configuration.ffmpeg.conversion-cache.max-size", 64) * 1024 * 1024)
+		, max_idle_(env::properties().get(L"configuration.ffmpeg.conversion-cache.max-idle", 300))
+	{
+	}
+
+	~conversion_cache()
+	{
+		BOOST_FOREACH(auto& context, idle_)
+			context.free(context.context);
+	}
+
+	static conversion_cache& instance()
+	{
+		static conversion_cache cache;
+		return cache;
+	}
+
+	// An idle context of the key, or null when there is none and the caller is to create one.
+	void* acquire(const std::string& kind, const std::string& key)
+	{
+		std::vector<idle_context> expired;
+		void* context = nullptr;
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = index_.find(key);
+			if(it != index_.end())
+			{
+				context = it->second->context;
+				idle_size_ -= it->second->size;
+				idle_.erase(it->second);
+				index_.erase(it);
+				++counters_[kind].hits;
+			}
+			else
+				++counters_[kind].misses;
+
+			++counters_[kind].in_use;
+			trim(expired);
+		}
+		free(expired);
+
+		return context;
+	}
+
+	// A context the caller failed to set up.
+	void abandon(const std::string& kind)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		--counters_[kind].in_use;
+	}
+
+	void release(const std::string& kind, const std::string& key, void* context, const std::function<void(void*)>& free_context, int64_t size)
+	{
+		std::vector<idle_context> expired;
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			idle_context idle = {key, context, free_context, size, std::time(nullptr)};
+			idle_.push_front(idle);
+			index_.insert(std::make_pair(key, idle_.begin()));
+			idle_size_ += size;
+			--counters_[kind].in_use;
+
+			trim(expired);
+		}
+		free(expired);
+	}
+
+	void set_prewarmed(const std::string& key)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		prewarmed_.insert(key);
+	}
+
+	boost::property_tree::wptree info() const
+	{
+		boost::property_tree::wptree info;
+
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		info.add(L"idle", idle_.size());
+		info.add(L"idle-size", idle_size_ / 1024); // KB, estimated
+		info.add(L"max-size", max_size_ / (1024 * 1024));
+		info.add(L"max-idle", max_idle_);
+		info.add(L"trimmed", trimmed_);
+
+		BOOST_FOREACH(auto& kind, counters_)
+		{
+			auto& child = info.add(L"kinds.kind", L"");
+			child.add(L"name", widen(kind.first));
+			child.add(L"hits", kind.second.hits);
+			child.add(L"misses", kind.second.misses);
+			child.add(L"in-use", kind.second.in_use);
+		}
+
+		return info;
+	}
+private:
+	// Under the lock. The contexts are freed by the caller, after it is released.
+	void trim(std::vector<idle_context>& expired)
+	{
+		auto now = std::time(nullptr);
+
+		for(auto it = idle_.end(); it != idle_.begin();)
+		{
+			--it;
+
+			bool over_size = idle_size_ > max_size_;
+			bool too_old   = max_idle_ > 0 && now - it->released > max_idle_ && prewarmed_.count(it->key) == 0;
+
+			if(!over_size && !too_old)
+				continue;
+
+			auto range = index_.equal_range(it->key);
+			for(auto entry = range.first; entry != range.second; ++entry)
+			{
+				if(entry->second == it)
+				{
+					index_.erase(entry);
+					break;
+				}
+			}
+
+			idle_size_ -= it->size;
+			++trimmed_;
+			expired.push_back(*it);
+			it = idle_.erase(it);
+		}
+	}
+
+	void free(const std::vector<idle_context>& expired)
+	{
+		BOOST_FOREACH(auto& context, expired)
+			context.free(context.context);
+	}
+};
+
+void append_key(std::string& key, int value)
+{
+	key += "|" + boost::lexical_cast<std::string>(value);
+}
+
+void free_scaler(void* context)
+{
+	sws_freeContext(static_cast<SwsContext*>(context));
+}
+
+void free_resampler(void* context)
+{
+	auto swr = static_cast<SwrContext*>(context);
+	swr_free(&swr);
+}
+
+std::string scaler_key(int in_width, int in_height, int in_pix_fmt, int out_width, int out_height, int out_pix_fmt, int flags)
+{
+	std::string key = "sws";
+	append_key(key, in_width);
+	append_key(key, in_height);
+	append_key(key, in_pix_fmt);
+	append_key(key, out_width);
+	append_key(key, out_height);
+	append_key(key, out_pix_fmt);
+	append_key(key, flags);
+	return key;
+}
+
+std::string resampler_key(int in_rate, int in_format, int in_channels, int out_rate, int out_format, int out_channels)
+{
+	std::string key = "swr";
+	append_key(key, in_rate);
+	append_key(key, in_format);
+	append_key(key, in_channels);
+	append_key(key, out_rate);
+	append_key(key, out_format);
+	append_key(key, out_channels);
+	return key;
+}
+
+}
+
+std::shared_ptr<SwsContext> get_scaler(int in_width, int in_height, int in_pix_fmt, int out_width, int out_height, int out_pix_fmt, int flags)
+{
+	auto& cache = conversion_cache::instance();
+	auto key	= scaler_key(in_width, in_height, in_pix_fmt, out_width, out_height, out_pix_fmt, flags);
+
+	auto sws = static_cast<SwsContext*>(cache.acquire("sws", key));
+	if(!sws)
+	{
+		sws = sws_getContext(in_width, in_height, static_cast<AVPixelFormat>(in_pix_fmt), out_width, out_height, static_cast<AVPixelFormat>(out_pix_fmt), flags, nullptr, nullptr, nullptr);
+		if(!sws)
+		{
+			cache.abandon("sws");
+			BOOST_THROW_EXCEPTION(operation_failed() << msg_info("Could not create software scaling context.") << 
+									boost::errinfo_api_function("sws_getContext"));
+		}
+	}
+
+	// The line buffers and filters of swscale, roughly.
+	int64_t size = static_cast<int64_t>(in_width + out_width) * 64;
+
+	return std::shared_ptr<SwsContext>(sws, [key, size](SwsContext* sws)
+	{
+		conversion_cache::instance().release("sws", key, sws, free_scaler, size);
+	});
+}
+
+std::shared_ptr<SwrContext> get_resampler(int in_rate, int in_format, int in_channels, int out_rate, int out_format, int out_channels)
+{
+	auto& cache = conversion_cache::instance();
+	auto key	= resampler_key(in_rate, in_format, in_channels, out_rate, out_format, out_channels);
+
+	auto swr = static_cast<SwrContext*>(cache.acquire("swr", key));
+	if(!swr)
+	{
+		swr = swr_alloc_set_opts(
+				nullptr,
+				create_channel_layout_bitmask(out_channels),
+				static_cast<AVSampleFormat>(out_format),
+				out_rate,
+				create_channel_layout_bitmask(in_channels),
+				static_cast<AVSampleFormat>(in_format),
+				in_rate,
+				0,
+				nullptr);
+		if(!swr)
+		{
+			cache.abandon("swr");
+			BOOST_THROW_EXCEPTION(std::bad_alloc());
+		}
+	}
+
+	// Drops whatever the previous user left buffered.
+	if(swr_init(swr) < 0)
+	{
+		cache.abandon("swr");
+		swr_free(&swr);
+		BOOST_THROW_EXCEPTION(ffmpeg_error() << msg_info("Failed to initialize resampler."));
+	}
+
+	// The filter and the buffers of a resampler, roughly.
+	int64_t size = 64 * 1024;
+
+	return std::shared_ptr<SwrContext>(swr, [key, size](SwrContext* swr)
+	{
+		conversion_cache::instance().release("swr", key, swr, free_resampler, size);
+	});
+}
+
+void prewarm_conversion_cache()
+{
+	if(!env::properties().get(L"configuration.ffmpeg.conversion-cache.prewarm", true))
+		return;
+
+	auto channels = env::properties().get_child_optional(L"configuration.channels");
+	if(!channels)
+		return;
+
+	auto& cache = conversion_cache::instance();
+	std::set<std::wstring> modes;
+
+	BOOST_FOREACH(auto& channel, *channels)
+	{
+		auto mode = channel.second.get(L"video-mode", L"PAL");
+		auto& format_desc = core::video_format_desc::get(mode);
+		if(format_desc.format == core::video_format::invalid || !modes.insert(mode).second)
+			continue;
+
+		try
+		{
+			// The packed 4:2:2 of capture cards and ProRes proxies, which the mixer does not take as they are, and 
+			// the 44.1 kHz stereo of most music and web clips.
+			std::vector<std::shared_ptr<void>> contexts;
+			contexts.push_back(get_scaler(format_desc.width, format_desc.height, AV_PIX_FMT_UYVY422, format_desc.width, format_desc.height, AV_PIX_FMT_YUV422P, SWS_BILINEAR));
+			contexts.push_back(get_scaler(format_desc.width, format_desc.height, AV_PIX_FMT_YUYV422, format_desc.width, format_desc.height, AV_PIX_FMT_YUV422P, SWS_BILINEAR));
+			contexts.push_back(get_resampler(44100, AV_SAMPLE_FMT_FLTP, 2, format_desc.audio_sample_rate, AV_SAMPLE_FMT_S32, 2));
+			contexts.push_back(get_resampler(44100, AV_SAMPLE_FMT_S16, 2, format_desc.audio_sample_rate, AV_SAMPLE_FMT_S32, 2));
+
+			cache.set_prewarmed(scaler_key(format_desc.width, format_desc.height, AV_PIX_FMT_UYVY422, format_desc.width, format_desc.height, AV_PIX_FMT_YUV422P, SWS_BILINEAR));
+			cache.set_prewarmed(scaler_key(format_desc.width, format_desc.height, AV_PIX_FMT_YUYV422, format_desc.width, format_desc.height, AV_PIX_FMT_YUV422P, SWS_BILINEAR));
+			cache.set_prewarmed(resampler_key(44100, AV_SAMPLE_FMT_FLTP, 2, format_desc.audio_sample_rate, AV_SAMPLE_FMT_S32, 2));
+			cache.set_prewarmed(resampler_key(44100, AV_SAMPLE_FMT_S16, 2, format_desc.audio_sample_rate, AV_SAMPLE_FMT_S32, 2));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}
+}
+
+boost::property_tree::wptree get_conversion_cache_info()
+{
+	return conversion_cache::instance().info();
+}
+
+}}
@@ -0,0 +1,49 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <memory>
+
+struct SwsContext;
+struct SwrContext;
+
+namespace caspar { namespace ffmpeg {
+
+// Scaling and resampling contexts are returned to a cache shared by every producer when they are released, and
+// the next user of the same conversion gets them back instead of setting one up anew. The least recently used are
+// freed beyond configuration.ffmpeg.conversion-cache.max-size, or after max-idle seconds unused.
+
+// A scaler from in_width x in_height of in_pix_fmt to out_width x out_height of out_pix_fmt.
+std::shared_ptr<SwsContext> get_scaler(int in_width, int in_height, int in_pix_fmt, int out_width, int out_height, int out_pix_fmt, int flags);
+
+// A resampler to out_format, reset as if it was new.
+std::shared_ptr<SwrContext> get_resampler(int in_rate, int in_format, int in_channels, int out_rate, int out_format, int out_channels);
+
+// Sets up the conversions the producers are most likely to need for the channels of the configuration, so the 
+// first clips played do not pay for them. Those are not freed for being idle.
+void prewarm_conversion_cache();
+
+boost::property_tree::wptree get_conversion_cache_info();
+
+}}
@@ -0,0 +1,105 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "decode_scheduler.h"
+
+#include <common/env.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+
+namespace caspar { namespace ffmpeg {
+
+class decode_scheduler : boost::noncopyable
+{
+	boost::mutex				mutex_;
+	boost::condition_variable	cond_;
+	const int					max_running_;
+	const int					max_background_;
+	int							running_[decode_priority::count];
+	int							waiting_on_air_;
+
+	decode_scheduler()
+		: max_running_(std::max(1, env::properties().get(L"configuration.ffmpeg.decode-threads", static_cast<int>(boost::thread::hardware_concurrency()))))
+		, max_background_(std::max(1, max_running_ / 2))
+		, waiting_on_air_(0)
+	{
+		std::fill_n(running_, static_cast<int>(decode_priority::count), 0);
+	}
+
+	int running() const
+	{
+		return running_[decode_priority::on_air] + running_[decode_priority::background];
+	}
+public:
+	static decode_scheduler& instance()
+	{
+		static decode_scheduler scheduler;
+		return scheduler;
+	}
+
+	void acquire(decode_priority::type priority)
+	{
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
+		if(priority == decode_priority::on_air)
+		{
+			++waiting_on_air_;
+			while(running() >= max_running_)
+				cond_.wait(lock);
+			--waiting_on_air_;
+		}
+		else
+		{
+			while(running() >= max_running_ || waiting_on_air_ > 0 || running_[decode_priority::background] >= max_background_)
+				cond_.wait(lock);
+		}
+
+		++running_[priority];
+	}
+
+	void release(decode_priority::type priority)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			--running_[priority];
+		}
+		cond_.notify_all();
+	}
+};
+
+decode_ticket::decode_ticket(decode_priority::type priority)
+	: priority_(priority)
+{
+	decode_scheduler::instance().acquire(priority_);
+}
+
+decode_ticket::~decode_ticket()
+{
+	decode_scheduler::instance().release(priority_);
+}
+
+}}
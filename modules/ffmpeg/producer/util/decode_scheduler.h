@@ -0,0 +1,50 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar { namespace ffmpeg {
+
+struct decode_priority
+{
+	enum type
+	{
+		on_air = 0,
+		background,
+		count
+	};
+};
+
+// Held while a producer decodes. At most configuration.ffmpeg.decode-threads tickets are held at once across all 
+// ffmpeg producers, and producers that are on air are served before those decoding ahead for LOADBG or thumbnails,
+// which are limited to half of the tickets.
+class decode_ticket : boost::noncopyable
+{
+public:
+	explicit decode_ticket(decode_priority::type priority);
+	~decode_ticket();
+private:
+	const decode_priority::type priority_;
+};
+
+}}
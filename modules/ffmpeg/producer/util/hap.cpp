@@ -0,0 +1,300 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "hap.h"
+
+#include <common/exception/exceptions.h>
+
+#include <cstring>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavcodec/avcodec.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+enum hap_compressor
+{
+	hap_none	= 0xA,
+	hap_snappy	= 0xB,
+	hap_complex = 0xC // Chunks, described by decode instructions.
+};
+
+enum hap_section_type
+{
+	hap_decode_instructions = 0x01,
+	hap_chunk_compressors	= 0x02,
+	hap_chunk_sizes			= 0x03,
+	hap_chunk_offsets		= 0x04
+};
+
+void corrupt()
+{
+	BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Corrupt hap frame."));
+}
+
+uint32_t read_le(const uint8_t* data, int bytes)
+{
+	uint32_t value = 0;
+	for(int n = bytes - 1; n >= 0; --n)
+		value = value << 8 | data[n];
+	return value;
+}
+
+struct section
+{
+	uint8_t			type;
+	const uint8_t*	data;
+	size_t			size;
+	size_t			total; // Including the header.
+};
+
+// A 3 byte size and a type, the size is in the 4 bytes after them when it is 0.
+bool read_section(const uint8_t* data, size_t size, section& result)
+{
+	if(size < 4)
+		return false;
+
+	size_t header	= 4;
+	size_t length	= read_le(data, 3);
+	if(length == 0)
+	{
+		if(size < 8)
+			return false;
+		length = read_le(data + 4, 4);
+		header = 8;
+	}
+
+	if(size - header < length)
+		return false;
+
+	result.type		= data[3];
+	result.data		= data + header;
+	result.size		= length;
+	result.total	= header + length;
+	return true;
+}
+
+// The raw snappy format, without framing. Returns the bytes written.
+size_t snappy_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+	const uint8_t* src_end = src + src_size;
+
+	size_t length = 0;
+	for(int shift = 0; ; shift += 7)
+	{
+		if(src == src_end || shift > 28)
+			corrupt();
+		uint8_t byte = *src++;
+		length |= static_cast<size_t>(byte & 0x7F) << shift;
+		if(!(byte & 0x80))
+			break;
+	}
+
+	if(length > dst_size)
+		corrupt();
+
+	size_t written = 0;
+	while(src < src_end)
+	{
+		uint8_t tag = *src++;
+		size_t	len;
+		size_t	offset;
+
+		switch(tag & 0x3)
+		{
+		case 0: // A literal, lengths above 60 follow in 1 to 4 bytes.
+			{
+				len = tag >> 2;
+				if(len >= 60)
+				{
+					int bytes = static_cast<int>(len) - 59;
+					if(src_end - src < bytes)
+						corrupt();
+					len = read_le(src, bytes);
+					src += bytes;
+				}
+				++len;
+
+				if(static_cast<size_t>(src_end - src) < len || length - written < len)
+					corrupt();
+				std::memcpy(dst + written, src, len);
+				src		+= len;
+				written += len;
+			}
+			continue;
+		case 1:
+			if(src == src_end)
+				corrupt();
+			len		= 4 + ((tag >> 2) & 0x7);
+			offset	= (static_cast<size_t>(tag >> 5) << 8) | *src++;
+			break;
+		case 2:
+			if(src_end - src < 2)
+				corrupt();
+			len		= 1 + (tag >> 2);
+			offset	= read_le(src, 2);
+			src		+= 2;
+			break;
+		default:
+			if(src_end - src < 4)
+				corrupt();
+			len		= 1 + (tag >> 2);
+			offset	= read_le(src, 4);
+			src		+= 4;
+			break;
+		}
+
+		if(offset == 0 || offset > written || length - written < len)
+			corrupt();
+
+		// Copies may overlap what they write, repeating the last offset bytes.
+		auto from = dst + written - offset;
+		auto to	  = dst + written;
+		for(size_t n = 0; n < len; ++n)
+			to[n] = from[n];
+		written += len;
+	}
+
+	if(written != length)
+		corrupt();
+
+	return written;
+}
+
+size_t decompress(int compressor, const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+	if(compressor == hap_snappy)
+		return snappy_decompress(src, src_size, dst, dst_size);
+
+	if(compressor != hap_none || src_size > dst_size)
+		corrupt();
+
+	std::memcpy(dst, src, src_size);
+	return src_size;
+}
+
+// The decode instructions followed by the chunks, which are decompressed one after the other into the texture.
+void decode_chunks(const section& frame, uint8_t* target, size_t size)
+{
+	section instructions;
+	if(!read_section(frame.data, frame.size, instructions) || instructions.type != hap_decode_instructions)
+		corrupt();
+
+	const uint8_t*	compressors		= nullptr;
+	const uint8_t*	sizes			= nullptr;
+	const uint8_t*	offsets			= nullptr;
+	size_t			count			= 0;
+	size_t			sizes_count		= 0;
+	size_t			offsets_count	= 0;
+
+	for(size_t pos = 0; pos < instructions.size; )
+	{
+		section part;
+		if(!read_section(instructions.data + pos, instructions.size - pos, part))
+			corrupt();
+		pos += part.total;
+
+		switch(part.type)
+		{
+		case hap_chunk_compressors:
+			compressors = part.data;
+			count		= part.size;
+			break;
+		case hap_chunk_sizes:
+			sizes		= part.data;
+			sizes_count = part.size / 4;
+			break;
+		case hap_chunk_offsets:
+			offsets		  = part.data;
+			offsets_count = part.size / 4;
+			break;
+		}
+	}
+
+	if(!compressors || sizes_count < count || (offsets && offsets_count < count))
+		corrupt();
+
+	auto chunks		 = frame.data + instructions.total;
+	auto chunks_size = frame.size - instructions.total;
+
+	size_t written	= 0;
+	size_t running	= 0;
+	for(size_t n = 0; n < count; ++n)
+	{
+		size_t chunk_size	= read_le(sizes + n*4, 4);
+		size_t offset		= offsets ? read_le(offsets + n*4, 4) : running;
+		running				= offset + chunk_size;
+
+		if(offset > chunks_size || chunks_size - offset < chunk_size)
+			corrupt();
+
+		written += decompress(compressors[n] & 0xF, chunks + offset, chunk_size, target + written, size - written);
+	}
+
+	if(written != size)
+		corrupt();
+}
+
+}
+
+core::pixel_format::type get_hap_pixel_format(const AVPacket& packet)
+{
+	section frame;
+	if(!packet.data || !read_section(packet.data, packet.size, frame))
+		return core::pixel_format::invalid;
+
+	switch(frame.type & 0x0F)
+	{
+	case 0xB:	return core::pixel_format::dxt1;
+	case 0xE:	return core::pixel_format::dxt5;
+	case 0xF:	return core::pixel_format::ycocg_dxt5;
+	case 0xC:	return core::pixel_format::bc7;
+	default:	return core::pixel_format::invalid;
+	}
+}
+
+void decode_hap(const AVPacket& packet, uint8_t* target, size_t size)
+{
+	section frame;
+	if(!packet.data || !read_section(packet.data, packet.size, frame))
+		corrupt();
+
+	auto compressor = frame.type >> 4;
+	if(compressor == hap_complex)
+		decode_chunks(frame, target, size);
+	else if(decompress(compressor, frame.data, frame.size, target, size) != size)
+		corrupt();
+}
+
+}}
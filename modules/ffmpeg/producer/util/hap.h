@@ -0,0 +1,42 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <core/producer/frame/pixel_format.h>
+
+#include <cstdint>
+
+struct AVPacket;
+
+namespace caspar { namespace ffmpeg {
+
+// Hap frames hold a dxt or bc7 texture, compressed once more with snappy or not at all, in one piece or in chunks. 
+// The textures are uploaded as they are, so decoding one is only undoing the snappy compression.
+
+// The format of the texture of a hap frame, invalid for frames which can not be uploaded as they are, such as those
+// of hap q alpha which hold two textures.
+core::pixel_format::type get_hap_pixel_format(const AVPacket& packet);
+
+// Writes the texture of the frame into target, which has room for exactly the texture. Throws on corrupt frames.
+void decode_hap(const AVPacket& packet, uint8_t* target, size_t size);
+
+}}
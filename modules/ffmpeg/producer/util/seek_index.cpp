@@ -0,0 +1,227 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../../stdafx.h"
+
+#include "seek_index.h"
+
+#include "../../ffmpeg_error.h"
+
+#include <common/concurrency/executor.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
+
+#include <algorithm>
+#include <ctime>
+#include <map>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avformat.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+struct seek_index::implementation : boost::noncopyable
+{
+	const std::wstring		filename_;
+	std::vector<int64_t>	keyframes_; // Written once before ready_ is set.
+	tbb::atomic<bool>		ready_;
+	tbb::atomic<int>		stream_index_;
+
+	implementation(const std::wstring& filename)
+		: filename_(filename)
+	{
+		ready_			= false;
+		stream_index_	= -1;
+	}
+
+	void build()
+	{
+		try
+		{
+			boost::timer timer;
+
+			AVFormatContext* weak_context = nullptr;
+			THROW_ON_ERROR2(avformat_open_input(&weak_context, narrow(filename_).c_str(), nullptr, nullptr), filename_);
+			std::shared_ptr<AVFormatContext> context(weak_context, [](AVFormatContext* ctx){avformat_close_input(&ctx);});
+			THROW_ON_ERROR2(avformat_find_stream_info(weak_context, nullptr), filename_);
+
+			int index = THROW_ON_ERROR2(av_find_best_stream(context.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0), filename_);
+
+			// Only the packet headers are needed.
+			for(int n = 0; n < static_cast<int>(context->nb_streams); ++n)
+			{
+				if(n != index)
+					context->streams[n]->discard = AVDISCARD_ALL;
+			}
+
+			std::vector<int64_t> keyframes;
+
+			AVPacket packet;
+			av_init_packet(&packet);
+			while(av_read_frame(context.get(), &packet) >= 0)
+			{
+				if(packet.stream_index == index && (packet.flags & AV_PKT_FLAG_KEY))
+				{
+					auto pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+					if(pts != AV_NOPTS_VALUE)
+						keyframes.push_back(pts);
+				}
+				av_free_packet(&packet);
+			}
+
+			std::sort(keyframes.begin(), keyframes.end());
+			keyframes.erase(std::unique(keyframes.begin(), keyframes.end()), keyframes.end());
+
+			keyframes_		= std::move(keyframes);
+			stream_index_	= index;
+			ready_			= true;
+
+			CASPAR_LOG(debug) << print() << L" Indexed " << keyframes_.size() << L" keyframes in " << static_cast<int>(timer.elapsed()*1000.0) << L" ms.";
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << print() << L" Failed to index keyframes, seeking without index.";
+		}
+	}
+
+	bool find_keyframe(int64_t pts, int64_t& keyframe_pts) const
+	{
+		if(!ready_)
+			return false;
+
+		auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), pts);
+		if(it == keyframes_.begin())
+			return false;
+
+		keyframe_pts = *(--it);
+		return true;
+	}
+
+	std::wstring print() const
+	{
+		return L"seek_index[" + boost::filesystem::wpath(filename_).filename() + L"]";
+	}
+};
+
+struct seek_index_cache
+{
+	typedef std::pair<std::wstring, std::time_t> key_t;
+
+	struct entry
+	{
+		std::shared_ptr<seek_index>	index;
+		int64_t						last_use;
+	};
+
+	static const size_t		MAX_ENTRIES = 64;
+
+	tbb::mutex				mutex_;
+	std::map<key_t, entry>	entries_;
+	int64_t					use_count_;
+	executor				executor_;
+
+	seek_index_cache()
+		: use_count_(0)
+		, executor_(L"seek_index")
+	{
+		executor_.set_priority_class(below_normal_priority_class);
+	}
+
+	static seek_index_cache& instance()
+	{
+		static seek_index_cache cache;
+		return cache;
+	}
+
+	safe_ptr<seek_index> get(const std::wstring& filename)
+	{
+		std::time_t last_write = 0;
+		try
+		{
+			last_write = boost::filesystem::last_write_time(boost::filesystem::wpath(filename));
+		}
+		catch(...)
+		{
+		}
+
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto& entry = entries_[key_t(filename, last_write)];
+		entry.last_use = ++use_count_;
+
+		if(!entry.index)
+		{
+			entry.index.reset(new seek_index(filename));
+
+			safe_ptr<seek_index::implementation> impl = entry.index->impl_;
+			executor_.begin_invoke([=]
+			{
+				impl->build();
+			});
+
+			trim();
+		}
+
+		return make_safe_ptr(entry.index);
+	}
+
+	void trim()
+	{
+		while(entries_.size() > MAX_ENTRIES)
+		{
+			auto lru = entries_.begin();
+			for(auto it = entries_.begin(); it != entries_.end(); ++it)
+			{
+				if(it->second.last_use < lru->second.last_use)
+					lru = it;
+			}
+			entries_.erase(lru);
+		}
+	}
+};
+
+seek_index::seek_index(const std::wstring& filename) : impl_(new implementation(filename)){}
+safe_ptr<seek_index> seek_index::get(const std::wstring& filename){return seek_index_cache::instance().get(filename);}
+bool seek_index::ready() const{return impl_->ready_;}
+int seek_index::stream_index() const{return impl_->stream_index_;}
+size_t seek_index::size() const{return impl_->ready_ ? impl_->keyframes_.size() : 0;}
+bool seek_index::find_keyframe(int64_t pts, int64_t& keyframe_pts) const{return impl_->find_keyframe(pts, keyframe_pts);}
+
+}}
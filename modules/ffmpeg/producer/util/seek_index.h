@@ -0,0 +1,56 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace caspar { namespace ffmpeg {
+
+// Keyframe positions of the video stream of a file, read in the background without decoding so seeks can go 
+// straight to the keyframe before the target instead of relying on the demuxer.
+class seek_index : boost::noncopyable
+{
+public:
+	// Returns the index of the file, which is shared and kept for a while after use. Indexing starts on the first call.
+	static safe_ptr<seek_index> get(const std::wstring& filename);
+
+	bool ready() const;
+	int stream_index() const;
+	size_t size() const;
+
+	// Returns the pts, in the time base of the stream, of the last keyframe at or before pts. Returns false if the
+	// index is not ready or has no such keyframe.
+	bool find_keyframe(int64_t pts, int64_t& keyframe_pts) const;
+private:
+	friend struct seek_index_cache;
+	explicit seek_index(const std::wstring& filename);
+
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
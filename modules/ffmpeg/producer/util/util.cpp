@@ -24,12 +24,11 @@
 #include "util.h"
 
 #include "flv.h"
+#include "conversion_cache.h"
 
 #include "../../ffmpeg_error.h"
 
-#include <tbb/concurrent_unordered_map.h>
-#include <tbb/concurrent_queue.h>
-
+#include <core/load_governor.h>
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/frame_factory.h>
 #include <core/producer/frame_producer.h>
@@ -39,6 +38,10 @@
 #include <common/exception/exceptions.h>
 #include <common/utility/assert.h>
 #include <common/memory/memcpy.h>
+#include <common/env.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+#include <common/concurrency/parallel_arena.h>
 
 #include <tbb/parallel_for.h>
 
@@ -55,6 +58,7 @@ extern "C"
 	#include <libswscale/swscale.h>
 	#include <libavcodec/avcodec.h>
 	#include <libavformat/avformat.h>
+	#include <libavutil/hwcontext.h>
 }
 #if defined(_MSC_VER)
 #pragma warning (pop)
@@ -136,6 +140,18 @@ core::pixel_format::type get_pixel_format(AVPixelFormat pix_fmt)
 	case AV_PIX_FMT_YUV411P:		return core::pixel_format::ycbcr;
 	case AV_PIX_FMT_YUV410P:		return core::pixel_format::ycbcr;
 	case AV_PIX_FMT_YUVA420P:		return core::pixel_format::ycbcra;
+	case AV_PIX_FMT_YUVA422P:		return core::pixel_format::ycbcra;
+	case AV_PIX_FMT_YUVA444P:		return core::pixel_format::ycbcra;
+	case AV_PIX_FMT_NV12:			return core::pixel_format::nv12;
+	case AV_PIX_FMT_P010LE:			return core::pixel_format::p010;
+	case AV_PIX_FMT_YUV420P10LE:	return core::pixel_format::ycbcr10;
+	case AV_PIX_FMT_YUV422P10LE:	return core::pixel_format::ycbcr10;
+	case AV_PIX_FMT_YUV444P10LE:	return core::pixel_format::ycbcr10;
+	case AV_PIX_FMT_YUVA420P10LE:	return core::pixel_format::ycbcra10;
+	case AV_PIX_FMT_YUVA422P10LE:	return core::pixel_format::ycbcra10;
+	case AV_PIX_FMT_YUVA444P10LE:	return core::pixel_format::ycbcra10;
+	case AV_PIX_FMT_RGB48LE:		return core::pixel_format::rgb48;
+	case AV_PIX_FMT_RGBA64LE:		return core::pixel_format::rgba64;
 	default:					return core::pixel_format::invalid;
 	}
 }
@@ -180,28 +196,213 @@ core::pixel_format_desc get_pixel_format_desc(AVPixelFormat pix_fmt, size_t widt
 				desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[3], height, 1));	
 			return desc;
 		}		
+	case core::pixel_format::nv12:
+	case core::pixel_format::p010:
+		{
+			const size_t depth = desc.pix_fmt == core::pixel_format::p010 ? 2 : 1;
+			const size_t h2	   = AV_CEIL_RSHIFT(static_cast<int>(height), av_pix_fmt_desc_get(pix_fmt)->log2_chroma_h);
+
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[0]/depth, height, 1, depth));
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[1]/(2*depth), h2, 2, depth));
+			return desc;
+		}
+	case core::pixel_format::ycbcr10:
+	case core::pixel_format::ycbcra10:
+		{
+			const size_t h2 = AV_CEIL_RSHIFT(static_cast<int>(height), av_pix_fmt_desc_get(pix_fmt)->log2_chroma_h);
+
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[0]/2, height, 1, 2));
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[1]/2, h2, 1, 2));
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[2]/2, h2, 1, 2));
+
+			if(desc.pix_fmt == core::pixel_format::ycbcra10)						
+				desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[3]/2, height, 1, 2));	
+			return desc;
+		}
+	case core::pixel_format::rgb48:
+		{
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[0]/6, height, 3, 2));						
+			return desc;
+		}
+	case core::pixel_format::rgba64:
+		{
+			desc.planes.push_back(core::pixel_format_desc::plane(dummy_pict.linesize[0]/8, height, 4, 2));						
+			return desc;
+		}
 	default:		
 		desc.pix_fmt = core::pixel_format::invalid;
 		return desc;
 	}
 }
 
+struct direct_frame
+{
+	safe_ptr<core::write_frame>	frame;
+	const void*					tag;
+
+	direct_frame(const safe_ptr<core::write_frame>& frame, const void* tag)
+		: frame(frame)
+		, tag(tag)
+	{
+	}
+};
+
+void free_direct_frame(void*, uint8_t* data)
+{
+	delete reinterpret_cast<direct_frame*>(data);
+}
+
+void unref_direct_frame(void* opaque, uint8_t*)
+{
+	auto ref = static_cast<AVBufferRef*>(opaque);
+	av_buffer_unref(&ref);
+}
+
+int get_direct_buffer(AVCodecContext* context, AVFrame* frame, int flags)
+{
+	auto& output = *static_cast<direct_output*>(context->opaque);
+	auto format = static_cast<AVPixelFormat>(frame->format);
+	auto desc	= get_pixel_format_desc(format, context->width, context->height);
+
+	// The decoder writes up to the aligned coded size, which has to fit within the tightly packed lines while the 
+	// rows below the picture go into extra space at the end of each plane.
+	int width	= frame->width;
+	int height	= frame->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	avcodec_align_dimensions2(context, &width, &height, linesize_align);
+
+	auto pix_desc	= av_pix_fmt_desc_get(format);
+	bool fits		= desc.pix_fmt != core::pixel_format::invalid && pix_desc;
+	bool yuv		= pix_desc && !(pix_desc->flags & AV_PIX_FMT_FLAG_RGB) && pix_desc->nb_components > 2;
+
+	for(size_t n = 0; n < desc.planes.size() && fits; ++n)
+	{
+		auto& plane			= desc.planes[n];
+		bool chroma			= yuv && (n == 1 || n == 2);
+		int plane_width		= chroma ? AV_CEIL_RSHIFT(width, pix_desc->log2_chroma_w) : width;
+		int plane_height	= chroma ? AV_CEIL_RSHIFT(height, pix_desc->log2_chroma_h) : height;
+
+		fits		= plane.linesize % linesize_align[n] == 0 && plane.linesize >= plane_width * plane.channels * plane.depth;
+		plane.size	= plane.linesize * plane_height + 16 + 64;
+	}
+
+	if(!fits)
+		return avcodec_default_get_buffer2(context, frame, flags);
+
+	auto holder		= new direct_frame(output.frame_factory->create_frame(output.tag, desc, output.audio_channel_layout), output.tag);
+	auto holder_ref = av_buffer_create(reinterpret_cast<uint8_t*>(holder), sizeof(direct_frame), free_direct_frame, nullptr, 0);
+
+	if(!holder_ref)
+	{
+		delete holder;
+		return AVERROR(ENOMEM);
+	}
+
+	for(size_t n = 0; n < desc.planes.size(); ++n)
+	{
+		auto data = holder->frame->image_data(n);
+
+		frame->data[n]		= data.begin();
+		frame->linesize[n]	= desc.planes[n].linesize;
+		frame->buf[n]		= av_buffer_create(data.begin(), data.size(), unref_direct_frame, av_buffer_ref(holder_ref), 0);
+	}
+	frame->extended_data	= frame->data;
+	frame->opaque_ref		= holder_ref;
+
+	return 0;
+}
+
+bool enable_direct_output(AVCodecContext& context, direct_output& output)
+{
+	auto codec_desc = avcodec_descriptor_get(context.codec_id);
+
+	if(!context.codec || !(context.codec->capabilities & AV_CODEC_CAP_DR1))
+		return false;
+
+	// The buffers are handed over once decoded, decoders must not keep reading or writing them.
+	if(!codec_desc || !(codec_desc->props & AV_CODEC_PROP_INTRA_ONLY) || (context.active_thread_type & FF_THREAD_FRAME))
+		return false;
+
+	if(context.hw_device_ctx)
+		return false;
+
+	context.opaque		= &output;
+	context.get_buffer2	= get_direct_buffer;
+
+	return true;
+}
+
+std::shared_ptr<core::write_frame> get_direct_frame(const void* tag, const AVFrame& decoded_frame, const core::pixel_format_desc& desc)
+{
+	if(!decoded_frame.opaque_ref || decoded_frame.opaque_ref->size != sizeof(direct_frame))
+		return nullptr;
+
+	auto& direct = *reinterpret_cast<direct_frame*>(decoded_frame.opaque_ref->data);
+	auto& direct_desc = direct.frame->get_pixel_format_desc();
+
+	if(direct.tag != tag || direct_desc.pix_fmt != desc.pix_fmt || direct_desc.planes.size() != desc.planes.size())
+		return nullptr;
+
+	// Filters copy the properties of their input, only frames still pointing into the write frame qualify.
+	for(size_t n = 0; n < desc.planes.size(); ++n)
+	{
+		if(direct_desc.planes[n].linesize != desc.planes[n].linesize ||
+		   direct_desc.planes[n].height != desc.planes[n].height ||
+		   decoded_frame.linesize[n] != static_cast<int>(desc.planes[n].linesize) ||
+		   direct.frame->image_data(n).begin() != decoded_frame.data[n])
+			return nullptr;
+	}
+
+	return direct.frame;
+}
+
+safe_ptr<AVFrame> make_compressed_frame(const safe_ptr<core::write_frame>& frame, const void* tag)
+{
+	auto& desc = frame->get_pixel_format_desc();
+
+	auto av_frame		= create_frame();
+	av_frame->width		= desc.planes.at(0).width;
+	av_frame->height	= desc.planes.at(0).height;
+	av_frame->format	= CASPAR_PIX_FMT_COMPRESSED;
+
+	auto holder			= new direct_frame(frame, tag);
+	av_frame->opaque_ref = av_buffer_create(reinterpret_cast<uint8_t*>(holder), sizeof(direct_frame), free_direct_frame, nullptr, 0);
+	if(!av_frame->opaque_ref)
+	{
+		delete holder;
+		BOOST_THROW_EXCEPTION(bad_alloc());
+	}
+
+	return av_frame;
+}
+
+std::shared_ptr<core::write_frame> get_compressed_frame(const void* tag, const AVFrame& frame)
+{
+	if(frame.format != CASPAR_PIX_FMT_COMPRESSED || !frame.opaque_ref || frame.opaque_ref->size != sizeof(direct_frame))
+		return nullptr;
+
+	auto& direct = *reinterpret_cast<direct_frame*>(frame.opaque_ref->data);
+	if(direct.tag != tag)
+		return nullptr;
+
+	return direct.frame;
+}
+
 int make_alpha_format(int format)
 {
 	switch(get_pixel_format(static_cast<AVPixelFormat>(format)))
 	{
 	case core::pixel_format::ycbcr:
 	case core::pixel_format::ycbcra:
+	case core::pixel_format::nv12:
 		return CASPAR_PIX_FMT_LUMA;
 	default:
 		return format;
 	}
 }
 
-safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVFrame>& decoded_frame, const safe_ptr<core::frame_factory>& frame_factory, int hints, const core::channel_layout& audio_channel_layout)
+safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVFrame>& decoded_frame, const safe_ptr<core::frame_factory>& frame_factory, int hints, const core::channel_layout& audio_channel_layout, bool allow_direct)
 {			
-	static tbb::concurrent_unordered_map<int64_t, tbb::concurrent_queue<std::shared_ptr<SwsContext>>> sws_contexts_;
-	
 	if(decoded_frame->width < 1 || decoded_frame->height < 1)
 		return make_safe<core::write_frame>(tag, audio_channel_layout);
 
@@ -214,7 +415,16 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 
 	std::shared_ptr<core::write_frame> write;
 
-	if(desc.pix_fmt == core::pixel_format::invalid)
+	if(allow_direct && desc.pix_fmt != core::pixel_format::invalid)
+		write = get_direct_frame(tag, *decoded_frame, desc);
+
+	if(write)
+	{
+		write->set_type(get_mode(*decoded_frame));
+		write->set_timecode(decoded_frame->display_picture_number);
+		write->commit();
+	}
+	else if(desc.pix_fmt == core::pixel_format::invalid)
 	{
 		auto pix_fmt = static_cast<AVPixelFormat>(decoded_frame->format);
 		auto target_pix_fmt = AV_PIX_FMT_BGRA;
@@ -225,40 +435,19 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 			target_pix_fmt = AV_PIX_FMT_YUV422P;
 		else if(pix_fmt == AV_PIX_FMT_UYYVYY411)
 			target_pix_fmt = AV_PIX_FMT_YUV411P;
-		else if(pix_fmt == AV_PIX_FMT_YUV420P10)
-			target_pix_fmt = AV_PIX_FMT_YUV420P;
-		else if(pix_fmt == AV_PIX_FMT_YUV422P10)
-			target_pix_fmt = AV_PIX_FMT_YUV422P;
-		else if(pix_fmt == AV_PIX_FMT_YUV444P10)
-			target_pix_fmt = AV_PIX_FMT_YUV444P;
 		
 		auto target_desc = get_pixel_format_desc(static_cast<AVPixelFormat>(target_pix_fmt), width, height);
+		target_desc.is_opaque = !(av_pix_fmt_desc_get(pix_fmt)->flags & AV_PIX_FMT_FLAG_ALPHA);
 
 		write = frame_factory->create_frame(tag, target_desc, audio_channel_layout);
 		write->set_type(get_mode(*decoded_frame));
 		write->set_timecode(decoded_frame->display_picture_number);
 
-		std::shared_ptr<SwsContext> sws_context;
-
 		//CASPAR_LOG(warning) << "Hardware accelerated color transform not supported.";
 		
-		int64_t key = ((static_cast<int64_t>(width)			 << 32) & 0xFFFF00000000) | 
-					  ((static_cast<int64_t>(height)		 << 16) & 0xFFFF0000) | 
-					  ((static_cast<int64_t>(pix_fmt)		 <<  8) & 0xFF00) | 
-					  ((static_cast<int64_t>(target_pix_fmt) <<  0) & 0xFF);
-			
-		auto& pool = sws_contexts_[key];
-						
-		if(!pool.try_pop(sws_context))
-		{
-			sws_context.reset(sws_getContext(width, height, static_cast<AVPixelFormat>(pix_fmt), width, height, target_pix_fmt, SWS_BILINEAR, nullptr, nullptr, NULL), sws_freeContext);
-		}
-			
-		if(!sws_context)
-		{
-			BOOST_THROW_EXCEPTION(operation_failed() << msg_info("Could not create software scaling context.") << 
-									boost::errinfo_api_function("sws_getContext"));
-		}	
+		bool fast = (frame_factory->get_degradations() & core::degradation::fast_scaling) != 0;
+
+		auto sws_context = get_scaler(width, height, pix_fmt, width, height, target_pix_fmt, fast ? SWS_FAST_BILINEAR : SWS_BILINEAR);
 		
 		safe_ptr<AVFrame> av_frame = create_frame();	
 		if(target_pix_fmt == AV_PIX_FMT_BGRA)
@@ -278,7 +467,6 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 		}
 
 		sws_scale(sws_context.get(), decoded_frame->data, decoded_frame->linesize, 0, height, av_frame->data, av_frame->linesize);	
-		pool.push(sws_context);
 
 		write->commit();		
 	}
@@ -301,7 +489,7 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 			if(decoded_linesize != static_cast<int>(plane.linesize))
 			{
 				// Copy line by line since ffmpeg sometimes pads each line.
-				tbb::parallel_for<size_t>(0, desc.planes[n].height, [&](size_t y)
+				arena_parallel_for<size_t>(0, desc.planes[n].height, [&](size_t y)
 				{
 					fast_memcpy(result + y*plane.linesize, decoded + y*decoded_linesize, plane.linesize);
 				});
@@ -426,14 +614,107 @@ double read_fps(AVFormatContext& context, double fail_value)
 }
 
 
-safe_ptr<AVCodecContext> open_codec(safe_ptr<AVFormatContext> context, enum AVMediaType type, int& index)
+AVPixelFormat get_hw_format(AVCodecContext* context, const AVPixelFormat* formats)
+{
+	auto hw_pix_fmt = static_cast<AVPixelFormat>(reinterpret_cast<intptr_t>(context->opaque));
+
+	for(auto format = formats; *format != AV_PIX_FMT_NONE; ++format)
+	{
+		if(*format == hw_pix_fmt)
+			return *format;
+	}
+
+	// The hardware can not decode this stream (profile, size), continue in software.
+	CASPAR_LOG(warning) << L"[open_codec] Hardware decoding not supported for stream. Falling back to software decoding.";
+	return avcodec_default_get_format(context, formats);
+}
+
+void try_enable_hwaccel(AVCodecContext* context, const AVCodec* decoder, const std::wstring& hwaccel)
+{
+	auto type = av_hwdevice_find_type_by_name(narrow(boost::to_lower_copy(hwaccel)).c_str());
+
+	if(type == AV_HWDEVICE_TYPE_NONE)
+	{
+		CASPAR_LOG(warning) << L"[open_codec] Unknown hardware decoder " << hwaccel << L". Using software decoding.";
+		return;
+	}
+
+	for(int n = 0; ; ++n)
+	{
+		auto config = avcodec_get_hw_config(decoder, n);
+
+		if(!config)
+		{
+			CASPAR_LOG(info) << L"[open_codec] " << widen(decoder->long_name) << L" can not be decoded by " << hwaccel << L". Using software decoding.";
+			return;
+		}
+
+		if((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && config->device_type == type)
+		{
+			AVBufferRef* device = nullptr;
+
+			if(av_hwdevice_ctx_create(&device, type, nullptr, nullptr, 0) < 0)
+			{
+				CASPAR_LOG(warning) << L"[open_codec] Failed to create " << hwaccel << L" device. Using software decoding.";
+				return;
+			}
+
+			context->hw_device_ctx	= device; // Released by avcodec_close.
+			context->opaque			= reinterpret_cast<void*>(static_cast<intptr_t>(config->pix_fmt));
+			context->get_format		= get_hw_format;
+			return;
+		}
+	}
+}
+
+void enable_fast_thumbnail_decoding(AVCodecContext& context, const AVCodec& decoder, int min_height)
+{
+	context.skip_frame			= AVDISCARD_NONKEY;
+	context.skip_loop_filter	= AVDISCARD_ALL;
+	context.thread_type			= FF_THREAD_SLICE;
+	context.flags			   |= AV_CODEC_FLAG_LOW_DELAY;
+	context.flags2			   |= AV_CODEC_FLAG2_FAST;
+
+	int lowres = 0;
+	while(lowres < av_codec_get_max_lowres(&decoder) && (context.height >> (lowres + 1)) >= min_height)
+		++lowres;
+
+	av_codec_set_lowres(&context, lowres);
+}
+
+void get_thumbnail_tile_size(int& width, int& height)
+{
+	auto grid = std::max(1, env::properties().get(L"configuration.thumbnails.video-grid", 2));
+
+	width	= std::max(16, env::properties().get(L"configuration.thumbnails.width", 256) / grid) & ~1;
+	height	= std::max(16, env::properties().get(L"configuration.thumbnails.height", 144) / grid) & ~1;
+}
+
+safe_ptr<AVCodecContext> open_codec(safe_ptr<AVFormatContext> context, enum AVMediaType type, int& index, const std::wstring& hwaccel, int thumbnail_height)
 {	
 	AVCodec* decoder;
 	index = THROW_ON_ERROR2(av_find_best_stream(context.get(), type, -1, -1, &decoder, 0), "[open_codec}");
+	if(type == AVMEDIA_TYPE_VIDEO && !hwaccel.empty() && !boost::iequals(hwaccel, L"none"))
+		try_enable_hwaccel(context->streams[index]->codec, decoder, hwaccel);
+	if(type == AVMEDIA_TYPE_VIDEO && thumbnail_height > 0)
+		enable_fast_thumbnail_decoding(*context->streams[index]->codec, *decoder, thumbnail_height);
 	THROW_ON_ERROR2(avcodec_open2(context->streams[index]->codec, decoder, NULL), "[open_codec]");
 	return safe_ptr<AVCodecContext>(context->streams[index]->codec, avcodec_close);
 }
 
+safe_ptr<AVCodecContext> open_stream_codec(safe_ptr<AVFormatContext> context, int index)
+{
+	if(index < 0 || index >= static_cast<int>(context->nb_streams))
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("[open_stream_codec] No such stream."));
+
+	auto decoder = avcodec_find_decoder(context->streams[index]->codec->codec_id);
+	if(!decoder)
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("[open_stream_codec] No decoder for stream."));
+
+	THROW_ON_ERROR2(avcodec_open2(context->streams[index]->codec, decoder, NULL), "[open_stream_codec]");
+	return safe_ptr<AVCodecContext>(context->streams[index]->codec, avcodec_close);
+}
+
 std::wstring print_mode(size_t width, size_t height, double fps, bool interlaced)
 {
 	std::wostringstream fps_ss;
@@ -468,11 +749,27 @@ bool is_valid_file(const std::wstring filename, const std::vector<std::wstring>&
 
 bool is_valid_file(const std::wstring filename)
 {
-	static const std::vector<std::wstring> invalid_exts = boost::assign::list_of(L".png")(L".tga")(L".bmp")(L".jpg")(L".jpeg")(L".gif")(L".tiff")(L".tif")(L".jp2")(L".jpx")(L".j2k")(L".j2c")(L".swf")(L".ct")(L".db");
+	static const std::vector<std::wstring> invalid_exts = boost::assign::list_of(L".png")(L".tga")(L".bmp")(L".jpg")(L".jpeg")(L".gif")(L".tiff")(L".tif")(L".jp2")(L".jpx")(L".j2k")(L".j2c")(L".swf")(L".ct")(L".ft")(L".db");
 	
 	return is_valid_file(filename, invalid_exts);
 }
 
+bool has_header_timing(AVFormatContext& context)
+{
+	if(context.duration == AV_NOPTS_VALUE || context.duration <= 0)
+		return false;
+
+	auto video_index = av_find_best_stream(&context, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0);
+
+	if(video_index < 0)
+		return false;
+
+	auto frame_rate_time_base = av_stream_get_r_frame_rate(context.streams[video_index]);
+	std::swap(frame_rate_time_base.num, frame_rate_time_base.den);
+
+	return frame_rate_time_base.num > 0 && is_sane_fps(frame_rate_time_base);
+}
+
 bool try_get_duration(const std::wstring filename, std::int64_t& duration, boost::rational<std::int64_t>& time_base)
 {
 	AVFormatContext* weak_context = nullptr;
@@ -487,7 +784,8 @@ bool try_get_duration(const std::wstring filename, std::int64_t& duration, boost
 	context->probesize = context->probesize / 5;
 	context->max_analyze_duration = context->max_analyze_duration / 5;
 
-	if(avformat_find_stream_info(context.get(), nullptr) < 0)
+	// Most containers tell the duration and the frame rate in their header, then no frames need to be decoded.
+	if(!has_header_timing(*context) && avformat_find_stream_info(context.get(), nullptr) < 0)
 		return false;
 
 	const auto fps = read_fps(*context, 1.0);
@@ -532,6 +830,12 @@ std::wstring probe_stem(const std::wstring stem)
 
 core::channel_layout get_audio_channel_layout(
 		const AVCodecContext& context, const std::wstring& custom_channel_order)
+{
+	return get_audio_channel_layout(context.channels, context.channel_layout, custom_channel_order);
+}
+
+core::channel_layout get_audio_channel_layout(
+		int num_channels, int64_t ch_layout, const std::wstring& custom_channel_order)
 {
 	if (!custom_channel_order.empty())
 	{
@@ -539,15 +843,13 @@ core::channel_layout get_audio_channel_layout(
 				custom_channel_order,
 				core::default_channel_layout_repository());
 
-		layout.num_channels = context.channels;
+		layout.num_channels = num_channels;
 
 		return layout;
 	}
 
-	int64_t ch_layout = context.channel_layout;
-
 	if (ch_layout == 0)
-		ch_layout = av_get_default_channel_layout(context.channels);
+		ch_layout = av_get_default_channel_layout(num_channels);
 
 	switch (ch_layout) // TODO: refine this auto-detection
 	{
@@ -562,7 +864,7 @@ core::channel_layout get_audio_channel_layout(
 		return core::default_channel_layout_repository().get_by_name(L"DOLBYE");
 	}
 
-	return core::create_unspecified_layout(context.channels);
+	return core::create_unspecified_layout(num_channels);
 }
 
 std::int64_t create_channel_layout_bitmask(int num_channels)
@@ -26,6 +26,7 @@
 #include <core/video_format.h>
 #include <core/producer/frame/pixel_format.h>
 #include <core/mixer/audio/audio_mixer.h>
+#include <core/mixer/audio/audio_util.h>
 
 #include <boost/rational.hpp>
 #include <boost/optional.hpp>
@@ -65,15 +66,51 @@ std::shared_ptr<AVPacket>			flush_packet();
 // Utils
 
 static const int CASPAR_PIX_FMT_LUMA = 10; // Just hijack some unual pixel format.
+static const int CASPAR_PIX_FMT_COMPRESSED = -2; // Below AV_PIX_FMT_NONE, see make_compressed_frame.
 
 core::field_mode::type		get_mode(const AVFrame& frame);
 int							make_alpha_format(int format); // NOTE: Be careful about CASPAR_PIX_FMT_LUMA, change it to PIX_FMT_GRAY8 if you want to use the frame inside some ffmpeg function.
-safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVFrame>& decoded_frame, const safe_ptr<core::frame_factory>& frame_factory, int hints, const core::channel_layout& audio_channel_layout);
+safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVFrame>& decoded_frame, const safe_ptr<core::frame_factory>& frame_factory, int hints, const core::channel_layout& audio_channel_layout, bool allow_direct = false);
+
+// Where a decoder allocates its frames, see enable_direct_output.
+struct direct_output
+{
+	safe_ptr<core::frame_factory>	frame_factory;
+	const void*						tag;
+	core::channel_layout			audio_channel_layout;
+
+	direct_output(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const core::channel_layout& audio_channel_layout)
+		: frame_factory(frame_factory)
+		, tag(tag)
+		, audio_channel_layout(audio_channel_layout)
+	{
+	}
+};
+
+// Makes an intra only decoder allocate its frames straight in write frame host buffers, for formats and sizes that are 
+// uploaded as is, so make_write_frame can commit them without copying when allow_direct is set. output must outlive the
+// codec context. Returns false if the decoder does not qualify.
+bool enable_direct_output(AVCodecContext& context, direct_output& output);
+
+// A frame without pixels which carries a committed block compressed write frame, such as one of a hap texture, past 
+// the filters of the frame muxer. get_compressed_frame returns the write frame, or null for any other frame.
+safe_ptr<AVFrame> make_compressed_frame(const safe_ptr<core::write_frame>& frame, const void* tag);
+std::shared_ptr<core::write_frame> get_compressed_frame(const void* tag, const AVFrame& frame);
 
 safe_ptr<AVPacket> create_packet();
 safe_ptr<AVFrame> create_frame();
 
-safe_ptr<AVCodecContext> open_codec(safe_ptr<AVFormatContext> context,  enum AVMediaType type, int& index);
+// hwaccel names an ffmpeg hardware device type (e.g. dxva2, d3d11va, cuda) to decode with where supported, or is empty.
+// A thumbnail_height above 0 configures the decoder for stills of about that height, see enable_fast_thumbnail_decoding.
+safe_ptr<AVCodecContext> open_codec(safe_ptr<AVFormatContext> context,  enum AVMediaType type, int& index, const std::wstring& hwaccel = L"", int thumbnail_height = 0);
+safe_ptr<AVCodecContext> open_stream_codec(safe_ptr<AVFormatContext> context, int index);
+
+// Only keyframes are decoded, without loop filter, without frame threading delay and at the lowest resolution the
+// decoder supports that still is at least min_height high.
+void enable_fast_thumbnail_decoding(AVCodecContext& context, const AVCodec& decoder, int min_height);
+
+// The size each still of the configured thumbnail grid is rendered at.
+void get_thumbnail_tile_size(int& width, int& height);
 
 bool is_sane_fps(AVRational time_base);
 AVRational fix_time_base(AVRational time_base);
@@ -91,6 +128,7 @@ int64_t ffmpeg_time_from_frame_number(int32_t frame_number, double fps);
 int32_t frame_number_from_ffmpeg_time(int64_t time, double fps);
 
 core::channel_layout get_audio_channel_layout(const AVCodecContext& context, const std::wstring& custom_channel_order);
+core::channel_layout get_audio_channel_layout(int num_channels, int64_t ch_layout, const std::wstring& custom_channel_order);
 std::int64_t create_channel_layout_bitmask(int num_channels);
 
 }}
\ No newline at end of file
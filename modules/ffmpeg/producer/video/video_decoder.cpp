@@ -23,12 +23,16 @@
 
 #include "video_decoder.h"
 
+#include "../util/hap.h"
 #include "../util/util.h"
 
 #include "../../ffmpeg_error.h"
 
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/frame_factory.h>
+#include <core/mixer/write_frame.h>
+
+#include <common/env.h>
 
 #include <boost/range/algorithm_ext/push_back.hpp>
 #include <boost/filesystem.hpp>
@@ -44,6 +48,7 @@ extern "C"
 	#include <libavcodec/avcodec.h>
 	#include <libavformat/avformat.h>
 	#include <libavutil/imgutils.h>
+	#include <libavutil/hwcontext.h>
 }
 #if defined(_MSC_VER)
 #pragma warning (pop)
@@ -64,19 +69,28 @@ struct video_decoder::implementation : boost::noncopyable
 	bool									is_progressive_;
 	const int64_t							stream_start_pts_;
 	tbb::atomic<int64_t>					seek_pts_;
+	const bool								keyframes_only_;
 	tbb::atomic<bool>						invert_field_order_;
 	tbb::atomic<uint32_t>					frame_decoded_;
 	int64_t									frame_number_;
+	std::unique_ptr<direct_output>			direct_output_;
+	bool									compressed_textures_; // Hap frames are uploaded as they are, see decode_compressed.
+	bool									compressed_warned_;
+	const AVDiscard							skip_loop_filter_;
 public:
-	explicit implementation(input input, bool invert_field_order)
+	explicit implementation(input input, bool invert_field_order, const std::wstring& hwaccel)
 		: input_(input)
-		, codec_context_(input.open_video_codec(stream_index_))
+		, codec_context_(input.open_video_codec(stream_index_, hwaccel))
 		, codec_(codec_context_->codec)
 		, width_(codec_context_->width)
 		, height_(codec_context_->height)
 		, stream_(input_.format_context()->streams[stream_index_])
 		, stream_start_pts_(stream_->start_time)
 		, nb_frames_(static_cast<uint32_t>(calc_nb_frames(stream_)))
+		, keyframes_only_(codec_context_->skip_frame >= AVDISCARD_NONKEY)
+		, compressed_textures_(false)
+		, compressed_warned_(false)
+		, skip_loop_filter_(codec_context_->skip_loop_filter)
 	{
 		invert_field_order_ = invert_field_order;
 		seek_pts_ = 0;
@@ -108,15 +122,58 @@ public:
 		return video;
 	}
 
+	// The texture of a hap frame goes straight into a write frame, only its snappy compression is undone on the cpu. 
+	// Null for frames that are decoded by avcodec.
+	std::shared_ptr<AVFrame> decode_compressed(const AVPacket& packet)
+	{
+		if(!compressed_textures_ || !direct_output_)
+			return nullptr;
+
+		auto format = get_hap_pixel_format(packet);
+		if(format == core::pixel_format::invalid)
+			return nullptr;
+
+		if(!direct_output_->frame_factory->supports(format))
+		{
+			if(!compressed_warned_)
+				CASPAR_LOG(warning) << print() << L" The texture format is not supported by the gpu. Decoding to bgra.";
+			compressed_warned_ = true;
+			return nullptr;
+		}
+
+		auto desc  = core::get_compressed_pixel_format_desc(format, static_cast<uint32_t>(width_), static_cast<uint32_t>(height_));
+		auto frame = direct_output_->frame_factory->create_frame(direct_output_->tag, desc, direct_output_->audio_channel_layout);
+		decode_hap(packet, frame->image_data(0).begin(), desc.planes[0].size);
+		frame->commit();
+
+		auto decoded_frame = make_compressed_frame(frame, direct_output_->tag);
+		decoded_frame->best_effort_timestamp = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+		decoded_frame->key_frame			 = 1;
+		return decoded_frame;
+	}
+
 	std::shared_ptr<AVFrame> decode(std::shared_ptr<AVPacket> pkt)
 	{
-		std::shared_ptr<AVFrame> decoded_frame = create_frame();
+		std::shared_ptr<AVFrame> decoded_frame = decode_compressed(*pkt);
+
+		if(!decoded_frame)
+		{
+			decoded_frame = create_frame();
 
-		int got_picture_ptr = 0;
-		int bytes_consumed = avcodec_decode_video2(codec_context_.get(), decoded_frame.get(), &got_picture_ptr, pkt.get());
+			int got_picture_ptr = 0;
+			int bytes_consumed = avcodec_decode_video2(codec_context_.get(), decoded_frame.get(), &got_picture_ptr, pkt.get());
 		
-		if(got_picture_ptr == 0 || bytes_consumed < 0)	
-			return nullptr;
+			if(got_picture_ptr == 0 || bytes_consumed < 0)	
+				return nullptr;
+
+			if(decoded_frame->hw_frames_ctx)
+			{
+				auto sw_frame = create_frame();
+				THROW_ON_ERROR2(av_hwframe_transfer_data(sw_frame.get(), decoded_frame.get(), 0), "[video_decoder]");
+				THROW_ON_ERROR2(av_frame_copy_props(sw_frame.get(), decoded_frame.get()), "[video_decoder]");
+				decoded_frame = sw_frame;
+			}
+		}
 
 		is_progressive_ = !decoded_frame->interlaced_frame;
 		if (invert_field_order_)
@@ -124,7 +181,8 @@ public:
 
 		if(decoded_frame->repeat_pict > 0)
 			CASPAR_LOG(warning) << "[video_decoder] Field repeat_pict not implemented.";
-		if (decoded_frame->best_effort_timestamp < seek_pts_)
+		// The keyframe before the seek target is as close as keyframe only decoding gets.
+		if (!keyframes_only_ && decoded_frame->best_effort_timestamp < seek_pts_)
 			return nullptr;
 		frame_decoded_++;
 		decoded_frame->pts = av_rescale(frame_number_++, stream_->time_base.num * stream_->r_frame_rate.num, stream_->time_base.num * stream_->r_frame_rate.num);
@@ -144,6 +202,11 @@ public:
 		invert_field_order_ = invert;
 	}
 
+	void set_skip_loop_filter(bool skip)
+	{
+		codec_context_->skip_loop_filter = skip ? AVDISCARD_ALL : skip_loop_filter_;
+	}
+
 	uint32_t nb_frames()
 	{
 		return nb_frames_ == 0 ? frame_decoded_ : nb_frames_;
@@ -154,13 +217,31 @@ public:
 		return boost::rational<int>(stream_->r_frame_rate.num, stream_->r_frame_rate.den);
 	}
 
+	void set_direct_output(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const core::channel_layout& audio_channel_layout, bool compressed_textures)
+	{
+		if(direct_output_)
+			return;
+
+		direct_output_.reset(new direct_output(frame_factory, tag, audio_channel_layout));
+
+		compressed_textures_ = compressed_textures && codec_context_->codec_id == AV_CODEC_ID_HAP && 
+							   env::properties().get(L"configuration.ffmpeg.compressed-textures", true);
+		if(compressed_textures_)
+			CASPAR_LOG(debug) << print() << L" Uploading the textures as they are.";
+
+		if(enable_direct_output(*codec_context_, *direct_output_))
+			CASPAR_LOG(debug) << print() << L" Decoding straight into write frames.";
+		else if(!compressed_textures_)
+			direct_output_.reset();
+	}
+
 	std::wstring print() const
 	{		
 		return L"[video-decoder] " + widen(codec_context_->codec->long_name);
 	}
 };
 
-video_decoder::video_decoder(input input, bool invert_field_order) : impl_(new implementation(input, invert_field_order)){}
+video_decoder::video_decoder(input input, bool invert_field_order, const std::wstring& hwaccel) : impl_(new implementation(input, invert_field_order, hwaccel)){}
 std::shared_ptr<AVFrame> video_decoder::poll(){return impl_->poll();}
 size_t video_decoder::width() const{return impl_->width_;}
 size_t video_decoder::height() const{return impl_->height_;}
@@ -169,5 +250,7 @@ bool	video_decoder::is_progressive() const{return impl_->is_progressive_;}
 std::wstring video_decoder::print() const{return impl_->print();}
 void video_decoder::seek(uint64_t time, uint32_t frame) { impl_->seek(time, frame);}
 void video_decoder::invert_field_order(bool invert) {impl_-> invert_field_order(invert);}
+void video_decoder::set_skip_loop_filter(bool skip) {impl_->set_skip_loop_filter(skip);}
 boost::rational<int> video_decoder::frame_rate() const { return impl_->frame_rate(); };
+void video_decoder::set_direct_output(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const core::channel_layout& audio_channel_layout, bool compressed_textures) { impl_->set_direct_output(frame_factory, tag, audio_channel_layout, compressed_textures); }
 }}
\ No newline at end of file
@@ -35,6 +35,7 @@ namespace caspar {
 namespace core {
 	struct frame_factory;
 	class write_frame;
+	struct channel_layout;
 }
 
 namespace ffmpeg {
@@ -42,7 +43,7 @@ namespace ffmpeg {
 class video_decoder : boost::noncopyable
 {
 public:
-	explicit video_decoder(input input, bool invert_field_order);
+	explicit video_decoder(input input, bool invert_field_order, const std::wstring& hwaccel = L"");
 	
 	std::shared_ptr<AVFrame> poll();
 	size_t	 width()		const;
@@ -52,8 +53,13 @@ public:
 	std::wstring print()	const;
 	void seek(uint64_t time, uint32_t frame);
 	void invert_field_order(bool invert);
+	void set_skip_loop_filter(bool skip); // For frames shown much smaller than they are, where the artifacts don't show.
 	boost::rational<int> frame_rate() const;
 
+	// Decodes into write frames from frame_factory where possible, see enable_direct_output. With compressed_textures 
+	// the textures of hap frames are uploaded as they are, for frames that need no filtering.
+	void set_direct_output(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const core::channel_layout& audio_channel_layout, bool compressed_textures);
+
 private:
 	struct implementation;
 	safe_ptr<implementation> impl_;
@@ -25,13 +25,20 @@
 
 #include "producer/cg_producer.h"
 #include "producer/flash_producer.h"
+#include "util/swf.h"
 
+#include <core/parameters/parameters.h>
 #include <core/producer/frame/frame_factory.h>
 #include <core/mixer/write_frame.h>
 #include <core/mixer/audio/audio_util.h>
+#include <core/producer/media_info/media_info.h>
+#include <core/producer/media_info/media_info_repository.h>
 
 #include <common/env.h>
+#include <common/utility/string.h>
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
 
 #include <string>
@@ -39,11 +46,48 @@
 
 namespace caspar { namespace flash {
 
-void init()
+void init(const safe_ptr<core::media_info_repository>& media_info_repo)
 {
 	core::register_producer_factory(create_ct_producer);
-	core::register_producer_factory(create_cg_producer);
+	core::register_producer_factory(create_cg_producer, [](const core::parameters& params)
+	{
+		return params.at(0) == L"[CG]";
+	});
 	core::register_producer_factory(create_swf_producer);
+
+	// Read once per template and kept in the repository, so that INFO TEMPLATE does not inflate the file again.
+	media_info_repo->register_extractor(
+			[](const std::wstring& file, core::media_info& info) -> bool
+			{
+				if(!boost::iequals(boost::filesystem::wpath(file).extension(), L".ft"))
+					return false;
+
+				try
+				{
+					swf_t::header_t header(file);
+
+					if(!header.valid)
+						return false;
+
+					info.width			= header.frame_width;
+					info.height			= header.frame_height;
+					info.frame_rate		= header.frame_rate / 256.0;
+					info.template_info	= widen(read_template_meta_info(file));
+
+					return true;
+				}
+				catch(...)
+				{
+					return false;
+				}
+			});
+
+	init_player_pool();
+}
+
+void uninit()
+{
+	uninit_player_pool();
 }
 
 std::wstring get_cg_version()
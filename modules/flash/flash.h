@@ -21,11 +21,21 @@
 
 #pragma once
 
+#include <common/memory/safe_ptr.h>
+
 #include <string>
 
-namespace caspar { namespace flash {
+namespace caspar { 
+namespace core {
+
+struct media_info_repository;
+
+}
+
+namespace flash {
 
-void init();
+void init(const safe_ptr<core::media_info_repository>& media_info_repo);
+void uninit();
 
 std::wstring get_cg_version();
 std::wstring get_version();
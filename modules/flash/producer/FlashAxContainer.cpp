@@ -326,14 +326,14 @@ HRESULT STDMETHODCALLTYPE FlashAxContainer::InvalidateRect(LPCRECT pRect, BOOL f
 	
 	bInvalidRect_ = true;
 
-/*	//Keep a list of dirty rectangles in order to be able to redraw only them
+	//Keep a list of dirty rectangles in order to be able to redraw only them
 	if(pRect != NULL) {
 		bDirtyRects_.push_back(DirtyRect(*pRect, fErase != 0));
 	}
 	else {
 		bDirtyRects_.push_back(DirtyRect(true));
 	}
-*/	return S_OK;
+	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE FlashAxContainer::InvalidateRgn(HRGN hRGN, BOOL fErase)
@@ -846,6 +846,7 @@ void FlashAxContainer::SetSize(size_t width, size_t height) {
 
 		m_spInPlaceObjectWindowless->SetObjectRects(&m_rcPos, &m_rcPos);
 		bInvalidRect_ = true;
+		bDirtyRects_.push_back(DirtyRect(true));
 	}
 }
 
@@ -865,31 +866,28 @@ bool FlashAxContainer::DrawControl(HDC targetDC)
 	DVASPECTINFO aspectInfo = {sizeof(DVASPECTINFO), DVASPECTINFOFLAG_CANOPTIMIZE};
 	HRESULT hr = S_OK;
 
+	// Always the whole control, drawing the dirty rectangles one by one through SetObjectRects breaks movies with
+	// "filters", such as glow and dropshadow. Callers limit the drawing to the dirty rectangles with the clip region 
+	// of targetDC instead.
 	hr = m_spViewObject->Draw(DVASPECT_CONTENT, -1, &aspectInfo, NULL, NULL, targetDC, NULL, NULL, NULL, NULL); 
 	bInvalidRect_ = false;
-/*	const video_format_desc& fmtDesc = video_format_desc::FormatDescriptions[format_];
-
-	//Trying to redraw just the dirty rectangles. Doesn't seem to work when the movie uses "filters", such as glow, dropshadow etc.
-	std::vector<flash::DirtyRect>::iterator it = bDirtyRects_.begin();
-	std::vector<flash::DirtyRect>::iterator end = bDirtyRects_.end();
-	for(; it != end; ++it) {
-		flash::DirtyRect& dirtyRect = (*it);
-		if(dirtyRect.bWhole || dirtyRect.rect.right >= fmtDesc.width || dirtyRect.rect.bottom >= fmtDesc.height) {
-			m_spInPlaceObjectWindowless->SetObjectRects(&m_rcPos, &m_rcPos);
-			hr = m_spViewObject->Draw(DVASPECT_OPAQUE, -1, NULL, NULL, NULL, targetDC, NULL, NULL, NULL, NULL); 
-			break;
-		}
-		else {
-			m_spInPlaceObjectWindowless->SetObjectRects(&m_rcPos, &(dirtyRect.rect));
-			hr = m_spViewObject->Draw(DVASPECT_OPAQUE, -1, NULL, NULL, NULL, targetDC, NULL, NULL, NULL, NULL); 
-		}
-	}
 	bDirtyRects_.clear();
-*/
 
 	return (hr == S_OK);
 }
 
+bool FlashAxContainer::GetDirtyRects(std::vector<RECT>& rects) const
+{
+	rects.clear();
+	for(auto it = bDirtyRects_.begin(); it != bDirtyRects_.end(); ++it)
+	{
+		if(it->bWhole)
+			return false;
+		rects.push_back(it->rect);
+	}
+	return true;
+}
+
 void FlashAxContainer::Tick()
 {
 	if(pTimerHelper)
@@ -255,6 +255,7 @@ public:
 	bool FlashCall(const std::wstring& str, std::wstring& result);
 	bool DrawControl(HDC targetDC);
 	bool InvalidRect() const { return bInvalidRect_; } 
+	bool GetDirtyRects(std::vector<RECT>& rects) const; // The rectangles invalidated since DrawControl, false if the whole control is.
 	bool IsEmpty() const { return bIsEmpty_; }
 
 	void SetSize(size_t width, size_t height);
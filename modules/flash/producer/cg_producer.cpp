@@ -309,6 +309,10 @@ boost::unique_future<std::wstring> cg_producer::call(const std::wstring& str){re
 std::wstring cg_producer::invoke(int layer, const std::wstring& label){return impl_->timed_invoke(layer, label);}
 std::wstring cg_producer::description(int layer){return impl_->timed_description(layer);}
 std::wstring cg_producer::template_host_info(){return impl_->timed_template_host_info();}
+boost::unique_future<std::wstring> cg_producer::add_async(int layer, const std::wstring& template_name,  bool play_on_load, const std::wstring& startFromLabel, const std::wstring& data){return impl_->add(layer, template_name, play_on_load, startFromLabel, data);}
+boost::unique_future<std::wstring> cg_producer::invoke_async(int layer, const std::wstring& label){return impl_->invoke(layer, label);}
+boost::unique_future<std::wstring> cg_producer::description_async(int layer){return impl_->description(layer);}
+boost::unique_future<std::wstring> cg_producer::template_host_info_async(){return impl_->template_host_info();}
 boost::property_tree::wptree cg_producer::info() const{return impl_->info();}
 core::monitor::subject& cg_producer::monitor_output(){return impl_->monitor_output();}
 }}
\ No newline at end of file
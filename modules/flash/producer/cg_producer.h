@@ -65,6 +65,13 @@ public:
 	std::wstring description(int layer);
 	std::wstring template_host_info();
 
+	// Return as soon as the call is queued on the template host instead of waiting for its result.
+
+	boost::unique_future<std::wstring> add_async(int layer, const std::wstring& template_name,  bool play_on_load, const std::wstring& start_from_label = TEXT(""), const std::wstring& data = TEXT(""));
+	boost::unique_future<std::wstring> invoke_async(int layer, const std::wstring& label);
+	boost::unique_future<std::wstring> description_async(int layer);
+	boost::unique_future<std::wstring> template_host_info_async();
+
 	core::monitor::subject& monitor_output();
 
 private:
@@ -44,6 +44,7 @@
 #include <common/concurrency/lock.h>
 #include <common/concurrency/future_util.h>
 #include <common/diagnostics/graph.h>
+#include <common/diagnostics/thread_clock.h>
 #include <common/memory/memcpy.h>
 #include <common/memory/memclr.h>
 #include <common/utility/timer.h>
@@ -53,8 +54,11 @@
 #include <boost/thread.hpp>
 #include <boost/timer.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/optional.hpp>
 
 #include <functional>
+#include <map>
+#include <vector>
 
 #include <tbb/spin_mutex.h>
 
@@ -151,9 +155,9 @@ template_host get_template_host(const core::video_format_desc& desc)
 	return template_host;
 }
 
-boost::mutex& get_global_init_destruct_mutex()
+profiled_mutex<boost::mutex>& get_global_init_destruct_mutex()
 {
-	static boost::mutex m;
+	static profiled_mutex<boost::mutex> m("flash.init-destruct");
 
 	return m;
 }
@@ -178,35 +182,41 @@ class flash_renderer
 		}
 	} com_init_;
 	
-	const safe_ptr<diagnostics::graph>				graph_;
+	std::shared_ptr<diagnostics::graph>				graph_;
 	const size_t									width_;
 	const size_t									height_;
 	const std::wstring								filename_;
-	const std::shared_ptr<core::frame_factory>		frame_factory_;
+	std::shared_ptr<core::frame_factory>			frame_factory_;
 	
 	CComObject<caspar::flash::FlashAxContainer>*	ax_;
 	safe_ptr<core::basic_frame>						head_;
+	std::shared_ptr<core::write_frame>				base_frame_; // Holds the image in bmp_ as of the last frame.
 	bitmap											bmp_;
+	const bool										dirty_rectangles_;
+	std::vector<uint8_t>							previous_pixels_; // The dirty regions of bmp_ before they were redrawn.
 	
 	boost::timer									frame_timer_;
 	boost::timer									tick_timer_;
 
 	high_prec_timer									timer_;
+
+	boost::timer									cpu_timer_;
+	double											cpu_time_;
+	double											cpu_load_;
 public:
-	flash_renderer(const safe_ptr<diagnostics::graph>& graph, const std::shared_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, int width, int height) 
-		: graph_(graph)
-		, width_(width)
+	// Loads the template host. Nothing is rendered before attach, so that
+	// warm instances can be made before the channel that uses them is known.
+	flash_renderer(const std::wstring& filename, int width, int height) 
+		: width_(width)
 		, height_(height)
 		, filename_(filename)
-		, frame_factory_(frame_factory)
 		, ax_(nullptr)
 		, head_(core::basic_frame::late())
 		, bmp_(width, height)
+		, dirty_rectangles_(env::properties().get(L"configuration.flash.dirty-rectangles", true))
+		, cpu_time_(diagnostics::thread_cpu_time())
+		, cpu_load_(0.0)
 	{		
-		graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
-		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));
-		graph_->set_color("param", diagnostics::color(1.0f, 0.5f, 0.0f));
-
 		lock(get_global_init_destruct_mutex(), [this]
 		{
 			if(FAILED(CComObject<caspar::flash::FlashAxContainer>::CreateInstance(&ax_)))
@@ -232,11 +242,24 @@ public:
 			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(narrow(print()) + " Failed to Set Scale Mode"));
 						
 		ax_->SetSize(width_, height_);		
-		render_frame(0.0);
 	
 		CASPAR_LOG(info) << print() << L" Initialized.";
 	}
 
+	void attach(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<core::frame_factory>& frame_factory)
+	{
+		graph_			= graph;
+		frame_factory_	= frame_factory;
+
+		graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
+		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));
+		graph_->set_color("param", diagnostics::color(1.0f, 0.5f, 0.0f));
+		graph_->set_color("cpu-load", diagnostics::color(0.9f, 0.9f, 0.3f));
+		graph_->set_color("repeated-frame", diagnostics::color(0.4f, 0.4f, 0.4f));
+
+		render_frame(0.0);
+	}
+
 	~flash_renderer()
 	{		
 		if(ax_)
@@ -247,8 +270,12 @@ public:
 				ax_->Release();
 			});
 		}
-		graph_->set_value("tick-time", 0.0f);
-		graph_->set_value("frame-time", 0.0f);
+		if(graph_)
+		{
+			graph_->set_value("tick-time", 0.0f);
+			graph_->set_value("frame-time", 0.0f);
+			graph_->set_value("cpu-load", 0.0f);
+		}
 		CASPAR_LOG(info) << print() << L" Uninitialized.";
 	}
 	
@@ -269,6 +296,8 @@ public:
 	{
 		float frame_time = 1.0f/ax_->GetFPS();
 
+		update_cpu_load();
+
 		if (!ax_->IsReadyToRender())
 			return head_;
 
@@ -283,22 +312,51 @@ public:
 
 		frame_timer_.restart();
 
+		// Without invalidation, or when the redrawn regions came out the same, head_ is emitted again. Its 
+		// textures are then unchanged and the mixer draws the layer from its static layer cache.
 		ax_->Tick();
-		if(ax_->InvalidRect())
+		if(!ax_->InvalidRect())
+			graph_->set_tag("repeated-frame");
+		else
 		{
 			core::pixel_format_desc desc;
 			desc.pix_fmt = core::pixel_format::bgra;
 			desc.planes.push_back(core::pixel_format_desc::plane(width_, height_, 4));
-			auto frame = frame_factory_->create_frame(this, desc);
 
-			fast_memclr(bmp_.data(), width_*height_*4);
-			ax_->DrawControl(bmp_);
+			std::vector<core::image_region> regions;
+			if(base_frame_ && dirty_regions(regions))
+			{
+				save_regions(regions);
+				draw_regions(regions);
 
-			if(frame->image_data().size() == static_cast<int>(width_*height_*4))
+				if(regions_unchanged(regions))
+					graph_->set_tag("repeated-frame");
+				else
+				{
+					auto frame = frame_factory_->create_frame(this, desc);
+					if(frame->image_data().size() == static_cast<int>(width_*height_*4))
+					{
+						copy_regions(frame->image_data().begin(), regions);
+						frame->commit(regions, base_frame_);
+						head_ = frame;
+						base_frame_ = frame;
+					}
+				}
+			}
+			else
 			{
-				fast_memcpy(frame->image_data().begin(), bmp_.data(), width_*height_*4);
-				frame->commit();
-				head_ = frame;
+				auto frame = frame_factory_->create_frame(this, desc);
+
+				fast_memclr(bmp_.data(), width_*height_*4);
+				ax_->DrawControl(bmp_);
+
+				if(frame->image_data().size() == static_cast<int>(width_*height_*4))
+				{
+					fast_memcpy(frame->image_data().begin(), bmp_.data(), width_*height_*4);
+					frame->commit();
+					head_ = frame;
+					base_frame_ = frame;
+				}
 			}
 		}		
 					
@@ -325,6 +383,17 @@ public:
 	{
 		return ax_->GetFPS();	
 	}
+
+	// Share of one core used by the thread of this instance.
+	double cpu_load() const
+	{
+		return cpu_load_;
+	}
+
+	int64_t cpu_time_millis() const
+	{
+		return cpu_time_ / 10000;
+	}
 	
 	std::wstring print()
 	{
@@ -333,8 +402,302 @@ public:
 				  + L"x" + boost::lexical_cast<std::wstring>(height_)
 				  + L"]";		
 	}
+private:
+	// The invalidated rectangles clamped to the image, false when a full redraw is cheaper.
+	bool dirty_regions(std::vector<core::image_region>& regions) const
+	{
+		static const size_t MAX_REGIONS = 16;
+
+		std::vector<RECT> rects;
+		if(!dirty_rectangles_ || !ax_->GetDirtyRects(rects) || rects.empty())
+			return false;
+
+		// One pixel more on every side, for antialiased edges.
+		RECT bounds = {static_cast<LONG>(width_), static_cast<LONG>(height_), 0, 0};
+		BOOST_FOREACH(auto& rect, rects)
+		{
+			rect.left	= std::max(0L, rect.left - 1);
+			rect.top	= std::max(0L, rect.top - 1);
+			rect.right	= std::min(static_cast<LONG>(width_), rect.right + 1);
+			rect.bottom	= std::min(static_cast<LONG>(height_), rect.bottom + 1);
+
+			bounds.left		= std::min(bounds.left, rect.left);
+			bounds.top		= std::min(bounds.top, rect.top);
+			bounds.right	= std::max(bounds.right, rect.right);
+			bounds.bottom	= std::max(bounds.bottom, rect.bottom);
+		}
+
+		if(rects.size() > MAX_REGIONS)
+		{
+			rects.clear();
+			rects.push_back(bounds);
+		}
+
+		size_t area = 0;
+		BOOST_FOREACH(auto& rect, rects)
+		{
+			if(rect.right <= rect.left || rect.bottom <= rect.top)
+				continue;
+
+			regions.push_back(core::image_region(rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top));
+			area += regions.back().width * regions.back().height;
+		}
+
+		return area < width_*height_/2; // No regions when only empty rectangles were invalidated.
+	}
+
+	void save_regions(const std::vector<core::image_region>& regions)
+	{
+		previous_pixels_.clear();
+		BOOST_FOREACH(auto& region, regions)
+		{
+			for(uint32_t y = region.y; y < region.y + region.height; ++y)
+			{
+				auto row = bmp_.data() + (y*width_ + region.x)*4;
+				previous_pixels_.insert(previous_pixels_.end(), row, row + region.width*4);
+			}
+		}
+	}
+
+	bool regions_unchanged(const std::vector<core::image_region>& regions) const
+	{
+		auto previous = previous_pixels_.data();
+		BOOST_FOREACH(auto& region, regions)
+		{
+			for(uint32_t y = region.y; y < region.y + region.height; ++y, previous += region.width*4)
+			{
+				if(memcmp(bmp_.data() + (y*width_ + region.x)*4, previous, region.width*4) != 0)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Clears and redraws only the regions of bmp_, the rest of it still holds the previous frame.
+	void draw_regions(const std::vector<core::image_region>& regions)
+	{
+		auto clip = CreateRectRgn(0, 0, 0, 0);
+		BOOST_FOREACH(auto& region, regions)
+		{
+			for(uint32_t y = region.y; y < region.y + region.height; ++y)
+				memset(bmp_.data() + (y*width_ + region.x)*4, 0, region.width*4);
+
+			auto rect = CreateRectRgn(region.x, region.y, region.x + region.width, region.y + region.height);
+			CombineRgn(clip, clip, rect, RGN_OR);
+			DeleteObject(rect);
+		}
+
+		SelectClipRgn(bmp_, clip);
+		ax_->DrawControl(bmp_);
+		SelectClipRgn(bmp_, NULL);
+		DeleteObject(clip);
+	}
+
+	void copy_regions(uint8_t* dest, const std::vector<core::image_region>& regions) const
+	{
+		BOOST_FOREACH(auto& region, regions)
+		{
+			for(uint32_t y = region.y; y < region.y + region.height; ++y)
+			{
+				auto offset = (y*width_ + region.x)*4;
+				memcpy(dest + offset, bmp_.data() + offset, region.width*4);
+			}
+		}
+	}
+
+	void update_cpu_load()
+	{
+		auto elapsed = cpu_timer_.elapsed();
+		if(elapsed < 0.5)
+			return;
+
+		auto cpu_time = diagnostics::thread_cpu_time();
+		cpu_load_ = (cpu_time - cpu_time_) / elapsed;
+		cpu_time_ = cpu_time;
+		cpu_timer_.restart();
+
+		graph_->set_value("cpu-load", cpu_load_);
+	}
+};
+
+// A flash player loaded with a template host on its own STA thread, ready to
+// be taken over by a producer.
+struct warm_player
+{
+	std::shared_ptr<executor>		executor;
+	std::shared_ptr<flash_renderer>	renderer;
+	int								core;
+};
+
+// Keeps a number of warm players per template host, so that CG ADD does not
+// have to wait for a flash player to start. The threads are pinned to the
+// cores round robin, and a producer takes the warm player on the core its
+// active producers load the least.
+class flash_player_pool : boost::noncopyable
+{
+	profiled_mutex<boost::mutex>						mutex_;
+	const int											size_;
+	const int											cores_;
+	int													next_core_;
+	bool												closed_;
+	std::map<std::wstring, std::vector<warm_player>>	warm_;
+	std::map<std::wstring, int>							pending_;
+	std::vector<std::shared_ptr<executor>>				starting_;
+	std::vector<std::shared_ptr<executor>>				retired_; // destroyed outside of their own thread
+	std::map<const void*, std::pair<int, double>>		loads_;
+public:
+	flash_player_pool()
+		: mutex_("flash.player-pool")
+		, size_(env::properties().get(L"configuration.flash.player-pool.size", 0))
+		, cores_(static_cast<int>(std::min<DWORD>(boost::thread::hardware_concurrency(), sizeof(DWORD_PTR) * 8)))
+		, next_core_(0)
+		, closed_(false)
+	{
+	}
+
+	void warm(const std::wstring& filename, int width, int height)
+	{
+		auto key = make_key(filename, width, height);
+
+		std::vector<std::shared_ptr<executor>> retired;
+
+		profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+
+		std::swap(retired, retired_);
+
+		while(!closed_ && warm_[key].size() + pending_[key] < static_cast<size_t>(size_))
+		{
+			++pending_[key];
+
+			auto core	= next_core_++ % std::max(1, cores_);
+			auto player	= std::make_shared<executor>(L"flash_player");
+			auto raw	= player.get();
+			starting_.push_back(player);
+
+			player->begin_invoke([=]
+			{
+				::SetThreadAffinityMask(::GetCurrentThread(), static_cast<DWORD_PTR>(1) << core);
+
+				std::shared_ptr<flash_renderer> renderer;
+				try
+				{
+					renderer.reset(new flash_renderer(filename, width, height));
+				}
+				catch(...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+
+				auto it = std::find_if(starting_.begin(), starting_.end(), [=](const std::shared_ptr<executor>& e) { return e.get() == raw; });
+				if(it == starting_.end())
+					return; // uninit, the renderer goes with this thread.
+
+				auto owner = *it;
+				starting_.erase(it);
+				--pending_[key];
+
+				if(renderer && !closed_)
+				{
+					warm_player entry = {owner, renderer, core};
+					warm_[key].push_back(entry);
+				}
+				else
+				{
+					renderer.reset();
+					retired_.push_back(owner);
+				}
+			});
+		}
+	}
+
+	boost::optional<warm_player> checkout(const std::wstring& filename, int width, int height)
+	{
+		if(size_ <= 0)
+			return boost::none;
+
+		boost::optional<warm_player> result;
+		{
+			profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+
+			auto& players = warm_[make_key(filename, width, height)];
+			auto best = std::min_element(players.begin(), players.end(), [&](const warm_player& lhs, const warm_player& rhs)
+			{
+				return core_load(lhs.core) < core_load(rhs.core);
+			});
+
+			if(best != players.end())
+			{
+				result = *best;
+				players.erase(best);
+			}
+		}
+
+		warm(filename, width, height);
+
+		return result;
+	}
+
+	void report_load(const void* producer, int core, double load)
+	{
+		profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+		loads_[producer] = std::make_pair(core, load);
+	}
+
+	void release(const void* producer)
+	{
+		profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+		loads_.erase(producer);
+	}
+
+	void uninit()
+	{
+		std::map<std::wstring, std::vector<warm_player>> warm;
+		std::vector<std::shared_ptr<executor>> starting;
+		std::vector<std::shared_ptr<executor>> retired;
+		{
+			profiled_mutex<boost::mutex>::scoped_lock lock(mutex_);
+			closed_ = true;
+			std::swap(warm, warm_);
+			std::swap(starting, starting_);
+			std::swap(retired, retired_);
+		}
+
+		BOOST_FOREACH(auto& players, warm)
+		{
+			BOOST_FOREACH(auto& player, players.second)
+			{
+				auto renderer = player.renderer;
+				player.renderer.reset();
+				player.executor->invoke([&] { renderer.reset(); });
+			}
+		}
+	}
+private:
+	static std::wstring make_key(const std::wstring& filename, int width, int height)
+	{
+		return boost::to_upper_copy(filename) + L"|" + boost::lexical_cast<std::wstring>(width) + L"x" + boost::lexical_cast<std::wstring>(height);
+	}
+
+	double core_load(int core) const
+	{
+		double load = 0.0;
+		BOOST_FOREACH(auto& entry, loads_)
+		{
+			if(entry.second.first == core)
+				load += entry.second.second;
+		}
+		return load;
+	}
 };
 
+flash_player_pool& get_player_pool()
+{
+	static flash_player_pool pool;
+	return pool;
+}
+
 struct flash_producer : public core::frame_producer
 {	
 	core::monitor::subject										monitor_subject_;
@@ -353,10 +716,15 @@ struct flash_producer : public core::frame_producer
 	
 	safe_ptr<core::basic_frame>									last_frame_;
 		
-	std::unique_ptr<flash_renderer>								renderer_;
+	std::shared_ptr<flash_renderer>								renderer_;
 	tbb::atomic<bool>											has_renderer_;
 
-	executor													executor_;	
+	const boost::optional<warm_player>							warm_;
+	std::shared_ptr<flash_renderer>								warm_renderer_;
+	tbb::atomic<int>											cpu_load_permille_;
+	tbb::atomic<int64_t>										cpu_time_millis_;
+
+	const std::shared_ptr<executor>								executor_;	
 public:
 	flash_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, size_t width, size_t height) 
 		: filename_(filename)		
@@ -365,9 +733,13 @@ public:
 		, width_(width > 0 ? width : frame_factory->get_video_format_desc().width)
 		, height_(height > 0 ? height : frame_factory->get_video_format_desc().height)
 		, buffer_size_(env::properties().get(L"configuration.flash.buffer-depth", frame_factory_->get_video_format_desc().fps > 30.0 ? 4 : 2))
-		, executor_(L"flash_producer")
+		, warm_(get_player_pool().checkout(filename, width_, height_))
+		, warm_renderer_(warm_ ? warm_->renderer : std::shared_ptr<flash_renderer>())
+		, executor_(warm_ ? warm_->executor : std::make_shared<executor>(L"flash_producer"))
 	{	
 		fps_ = 0;
+		cpu_load_permille_ = 0;
+		cpu_time_millis_ = 0;
 	 
 		graph_->set_color("late-frame", diagnostics::color(0.6f, 0.3f, 0.9f));
 		graph_->set_color("buffered", diagnostics::color(0.8f, 0.3f, 0.2f));
@@ -379,10 +751,13 @@ public:
 
 	~flash_producer()
 	{
-		executor_.invoke([this]
+		executor_->invoke([this]
 		{
 			renderer_.reset();
+			warm_renderer_.reset();
 		}, high_priority);
+
+		get_player_pool().release(this);
 	}
 
 	// frame_producer
@@ -424,7 +799,7 @@ public:
 		if (param == L"?")
 			return wrap_as_future(std::wstring(has_renderer_ ? L"1" : L"0"));
 
-		return executor_.begin_invoke([this, param]() -> std::wstring
+		return executor_->begin_invoke([this, param]() -> std::wstring
 		{
 			try
 			{
@@ -432,7 +807,12 @@ public:
 
 				if(initialize_renderer)
 				{
-					renderer_.reset(new flash_renderer(graph_, frame_factory_, filename_, width_, height_));
+					if(warm_renderer_)
+						std::swap(renderer_, warm_renderer_);
+					else
+						renderer_.reset(new flash_renderer(filename_, width_, height_));
+
+					renderer_->attach(graph_, frame_factory_);
 
 					has_renderer_ = true;
 				}
@@ -453,7 +833,7 @@ public:
 			catch(...)
 			{
 				CASPAR_LOG_CURRENT_EXCEPTION();
-				renderer_.reset(nullptr);
+				renderer_.reset();
 				has_renderer_ = false;
 			}
 
@@ -470,6 +850,12 @@ public:
 	{
 		boost::property_tree::wptree info;
 		info.add(L"type", L"flash-producer");
+		info.add(L"player.warm", warm_ ? true : false);
+		info.add(L"player.core", warm_ ? warm_->core : -1);
+		info.add(L"player.cpu-load", cpu_load_permille_ / 1000.0);
+		info.add(L"player.cpu-time-millis", cpu_time_millis_);
+		info.add(L"resources.cpu-time", fps_ > 0 ? (cpu_load_permille_ / 1000.0) / (fps_ / 100.0) : 0.0); // Of the player thread, per rendered frame.
+		info.add(L"resources.queue-depth", output_buffer_.size());
 		return info;
 	}
 
@@ -477,7 +863,7 @@ public:
 
 	void fill_buffer()
 	{
-		executor_.begin_invoke([this]
+		executor_->begin_invoke([this]
 		{
 			do_fill_buffer(false);
 		});
@@ -513,7 +899,7 @@ public:
 					return;
 			}
 
-			executor_.yield();
+			executor_->yield();
 		}
 	}
 	
@@ -556,6 +942,13 @@ public:
 						
 			fps_.fetch_and_store(static_cast<int>(renderer_->fps()*100.0));				
 			graph_->set_text(print());
+
+			if(cpu_time_millis_.fetch_and_store(renderer_->cpu_time_millis()) != renderer_->cpu_time_millis())
+			{
+				cpu_load_permille_ = static_cast<int>(renderer_->cpu_load() * 1000.0);
+				if(warm_)
+					get_player_pool().report_load(this, warm_->core, renderer_->cpu_load());
+			}
 			
 			if(renderer_->is_empty())
 			{
@@ -635,6 +1028,34 @@ safe_ptr<core::frame_producer> create_swf_producer(
 	return create_producer_destroy_proxy(create_producer_print_proxy(producer));
 }
 
+void init_player_pool()
+{
+	if(env::properties().get(L"configuration.flash.player-pool.size", 0) <= 0)
+		return;
+
+	auto channels = env::properties().get_child_optional(L"configuration.channels");
+	if(!channels)
+		return;
+
+	BOOST_FOREACH(auto& channel, *channels)
+	{
+		auto& format_desc = core::video_format_desc::get(channel.second.get(L"video-mode", L"PAL"));
+		if(format_desc.format == core::video_format::invalid)
+			continue;
+
+		auto template_host = get_template_host(format_desc);
+		auto filename = env::template_folder() + L"\\" + template_host.filename;
+
+		if(boost::filesystem::exists(filename))
+			get_player_pool().warm(filename, template_host.width, template_host.height);
+	}
+}
+
+void uninit_player_pool()
+{
+	get_player_pool().uninit();
+}
+
 std::wstring find_template(const std::wstring& template_name)
 {
 	if(boost::filesystem::exists(template_name + L".ft")) 
@@ -37,4 +37,9 @@ safe_ptr<core::frame_producer> create_swf_producer(
 
 std::wstring find_template(const std::wstring& templateName);
 
+// Starts the warm flash players of configuration.flash.player-pool for the
+// template hosts of the configured channels.
+void init_player_pool();
+void uninit_player_pool();
+
 }}
\ No newline at end of file
@@ -115,12 +115,18 @@ swf_t::header_t::header_t(const std::wstring& filename)
 	std::vector<char> file_data;
 	std::copy((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>(), std::back_inserter(file_data));
 
-	std::array<char, 32> data;
-	uLongf file_size = 32;
-	auto ret = uncompress(reinterpret_cast<Bytef*>(data.data()), &file_size, reinterpret_cast<const Bytef*>(file_data.data()), static_cast<uLong>(file_data.size()));
+	std::array<char, 32> data = {};
+
+	if(this->signature == s1)
+		std::copy(file_data.begin(), file_data.begin() + std::min(file_data.size(), data.size()), data.begin());
+	else
+	{
+		uLongf file_size = 32;
+		auto ret = uncompress(reinterpret_cast<Bytef*>(data.data()), &file_size, reinterpret_cast<const Bytef*>(file_data.data()), static_cast<uLong>(file_data.size()));
 	
-	if(ret == Z_DATA_ERROR)
-		BOOST_THROW_EXCEPTION(io_error());
+		if(ret == Z_DATA_ERROR)
+			BOOST_THROW_EXCEPTION(io_error());
+	}
 
 	// http://thenobody.blog.matfyz.sk/p13084-how-to-get-dimensions-of-a-swf-file
 
@@ -158,6 +164,12 @@ swf_t::header_t::header_t(const std::wstring& filename)
 	this->frame_width  = dims[1] - dims[0];								// max - mix
 	this->frame_height = dims[3] - dims[2];	
 
+	// The frame rate, in 8.8 fixed point, and the frame count follow the frame size rectangle.
+	auto rate_and_count = reinterpret_cast<unsigned char*>(data.data()) + (5 + 4 * size + 7) / 8;
+
+	this->frame_rate  = static_cast<std::uint16_t>(rate_and_count[0] | (rate_and_count[1] << 8));
+	this->frame_count = static_cast<std::uint16_t>(rate_and_count[2] | (rate_and_count[3] << 8));
+
 	this->valid = true;
 }
 
@@ -26,6 +26,7 @@
 #include <common/env.h>
 #include <common/log/log.h>
 #include <common/utility/string.h>
+#include <common/concurrency/executor.h>
 #include <common/concurrency/future_util.h>
 
 #include <core/parameters/parameters.h>
@@ -34,7 +35,6 @@
 #include <core/mixer/read_frame.h>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/thread.hpp>
 
 #include <FreeImage.h>
 #include <vector>
@@ -61,16 +61,34 @@ void write_cropped_png(
 	FreeImage_SaveU(FIF_PNG, bitmap.get(), output_file.string().c_str(), 0);
 }
 
+// Snapshots are encoded one at a time on a low priority thread shared by all image consumers, holding a reference
+// to the read_frame until written.
+struct image_writer : public executor
+{
+	image_writer() : executor(L"image_consumer")
+	{
+		set_priority_class(below_normal_priority_class);
+	}
+};
+
+executor& get_writer()
+{
+	static image_writer writer;
+	return writer;
+}
+
 struct image_consumer : public core::frame_consumer
 {
 	core::video_format_desc	format_desc_;
 	std::wstring			filename_;
+	FREE_IMAGE_FORMAT		format_;
 public:
 
 	// frame_consumer
 
-	image_consumer(const std::wstring& filename)
+	image_consumer(const std::wstring& filename, FREE_IMAGE_FORMAT format)
 		: filename_(filename)
+		, format_(format)
 	{
 	}
 
@@ -88,31 +106,44 @@ public:
 	{				
 		auto format_desc = format_desc_;
 		auto filename = filename_;
+		auto format = format_;
 
-		boost::thread async([format_desc, frame, filename]
+		auto& writer = get_writer();
+
+		if(writer.size() > 8)
+		{
+			CASPAR_LOG(warning) << print() << L" Snapshot dropped, encoding is falling behind.";
+			return wrap_as_future(false);
+		}
+
+		writer.begin_invoke([format_desc, frame, filename, format]
 		{
 			win32_exception::ensure_handler_installed_for_thread("image-consumer-thread");
 
 			try
 			{
+				auto extension = format == FIF_JPEG ? L".jpg" : format == FIF_TARGA ? L".tga" : L".png";
 				auto filename2 = filename;
 
 				if (filename2.empty())
-					filename2 = env::media_folder() + widen(boost::posix_time::to_iso_string(boost::posix_time::second_clock::local_time())) + L".png";
+					filename2 = env::media_folder() + widen(boost::posix_time::to_iso_string(boost::posix_time::second_clock::local_time())) + extension;
 				else
-					filename2 = env::media_folder() + filename2 + L".png";
+					filename2 = env::media_folder() + filename2 + extension;
 
 				auto bitmap = std::shared_ptr<FIBITMAP>(FreeImage_Allocate(format_desc.width, format_desc.height, 32), FreeImage_Unload);
 				memcpy(FreeImage_GetBits(bitmap.get()), frame->image_data().begin(), frame->image_size());
 				FreeImage_FlipVertical(bitmap.get());
-				FreeImage_SaveU(FIF_PNG, bitmap.get(), filename2.c_str(), 0);
+
+				if (format == FIF_JPEG) // No alpha.
+					bitmap = std::shared_ptr<FIBITMAP>(FreeImage_ConvertTo24Bits(bitmap.get()), FreeImage_Unload);
+
+				FreeImage_SaveU(format, bitmap.get(), filename2.c_str(), format == FIF_PNG ? PNG_Z_BEST_SPEED : 0);
 			}
 			catch(...)
 			{
 				CASPAR_LOG_CURRENT_EXCEPTION();
 			}
 		});
-		async.detach();
 
 		return wrap_as_future(false);
 	}
@@ -147,10 +178,20 @@ safe_ptr<core::frame_consumer> create_consumer(const core::parameters& params)
 
 	std::wstring filename;
 
-	if (params.size() > 1)
+	if (params.size() > 1 && params.at(1) != L"FORMAT")
 		filename = params.at(1);
 
-	return make_safe<image_consumer>(filename);
+	auto format_name = params.get(L"FORMAT", L"PNG");
+	auto format = FIF_PNG;
+
+	if (format_name == L"JPG" || format_name == L"JPEG")
+		format = FIF_JPEG;
+	else if (format_name == L"TGA")
+		format = FIF_TARGA;
+	else if (format_name != L"PNG")
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Unsupported image format " + narrow(format_name)));
+
+	return make_safe<image_consumer>(filename, format);
 }
 
 }}
@@ -23,7 +23,9 @@
 
 #include "producer/image_producer.h"
 #include "producer/image_scroll_producer.h"
+#include "producer/image_sequence_producer.h"
 #include "consumer/image_consumer.h"
+#include "util/image_cache.h"
 
 #include <core/parameters/parameters.h>
 #include <core/producer/frame_producer.h>
@@ -31,13 +33,19 @@
 
 #include <common/utility/string.h>
 
+#include <boost/property_tree/ptree.hpp>
+
 #include <FreeImage.h>
 
 namespace caspar { namespace image {
 
 void init()
 {
-	core::register_producer_factory(create_scroll_producer);
+	core::register_producer_factory(create_scroll_producer, [](const core::parameters& params)
+	{
+		return params.get(L"SPEED", 0.0) != 0.0 || params.get(L"DURATION", 0.0) != 0.0;
+	});
+	core::register_producer_factory(create_sequence_producer);
 	core::register_producer_factory(create_producer);
 	core::register_thumbnail_producer_factory(create_thumbnail_producer);
 	core::register_consumer_factory([](const core::parameters& params){return image::create_consumer(params);});
@@ -48,4 +56,9 @@ std::wstring get_version()
 	return widen(std::string(FreeImage_GetVersion()));
 }
 
+boost::property_tree::wptree get_cache_info()
+{
+	return get_image_cache_info();
+}
+
 }}
\ No newline at end of file
@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <boost/property_tree/ptree_fwd.hpp>
+
 #include <string>
 
 namespace caspar { namespace image {
@@ -29,4 +31,6 @@ void init();
 
 std::wstring get_version();
 
+boost::property_tree::wptree get_cache_info();
+
 }}
\ No newline at end of file
@@ -21,6 +21,8 @@
 
 #include "image_producer.h"
 
+#include "../util/compressed_image.h"
+#include "../util/image_cache.h"
 #include "../util/image_loader.h"
 
 #include <core/video_format.h>
@@ -31,74 +33,255 @@
 #include <core/producer/frame/frame_factory.h>
 #include <core/mixer/write_frame.h>
 
+#include <common/concurrency/executor.h>
 #include <common/env.h>
 #include <common/log/log.h>
 #include <common/utility/base64.h>
 #include <common/utility/string.h>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/assign.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/thread/future.hpp>
 
 #include <algorithm>
+#include <cmath>
 
 using namespace boost::assign;
 
 namespace caspar { namespace image {
 
+safe_ptr<core::write_frame> create_image_frame(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const std::shared_ptr<FIBITMAP>& bitmap)
+{
+	const auto width  = FreeImage_GetWidth(bitmap.get());
+	const auto height = FreeImage_GetHeight(bitmap.get());
+
+	core::pixel_format_desc desc;
+	desc.pix_fmt = core::pixel_format::bgra;
+	desc.is_still = true;
+	desc.planes.push_back(core::pixel_format_desc::plane(width, height, 4));
+	auto frame = frame_factory->create_frame(tag, desc);
+
+	// Rows are copied bottom up rather than flipping the bitmap, which may still be compressed in the background.
+	for(unsigned int y = 0; y < height; ++y)
+		std::copy_n(FreeImage_GetScanLine(bitmap.get(), height - 1 - y), width * 4, frame->image_data().begin() + y * width * 4);
+
+	frame->commit();
+	return frame;
+}
+
+// Where the DXT5 version of a still in the media folder is kept, next to its thumbnail. Empty when there is none. 
+std::wstring get_compressed_cache_file(const std::wstring& filename, const std::wstring& variant)
+{
+	static const bool compress = env::properties().get(L"configuration.image.compress-stills", false);
+
+	if(!compress || !boost::iends_with(filename, L".png") || !boost::istarts_with(filename, env::media_folder()))
+		return L"";
+
+	auto relative = filename.substr(env::media_folder().size());
+	return env::thumbnails_folder() + relative.substr(0, relative.size() - 4) + variant + L".dds";
+}
+
+bool is_up_to_date(const std::wstring& cache_file, const std::wstring& filename)
+{
+	try
+	{
+		return boost::filesystem::exists(cache_file) && boost::filesystem::last_write_time(boost::filesystem::wpath(cache_file)) >= boost::filesystem::last_write_time(boost::filesystem::wpath(filename));
+	}
+	catch(...)
+	{
+		return false; // Probably removed.
+	}
+}
+
+struct image_compressor
+{
+	executor executor_;
+
+	image_compressor()
+		: executor_(L"image_compressor")
+	{
+		executor_.set_priority_class(below_normal_priority_class);
+	}
+};
+
+void compress_image_async(const std::shared_ptr<FIBITMAP>& bitmap, const std::wstring& cache_file)
+{
+	static image_compressor compressor;
+
+	compressor.executor_.begin_invoke([=]
+	{
+		try
+		{
+			boost::filesystem::create_directories(boost::filesystem::wpath(cache_file).parent_path());
+			write_dxt5_image(bitmap, cache_file);
+			CASPAR_LOG(info) << L"[image_producer] Compressed " << cache_file;
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	});
+}
+
+// Compressed files are uploaded as they are, without downscaling, when the mixer has textures of their format, 
+// otherwise FreeImage decodes the DXT ones. PNGs are loaded from their compressed version once it has been made.
+safe_ptr<core::write_frame> load_still(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, unsigned int max_width, unsigned int max_height, const std::wstring& variant)
+{
+	if(is_compressed_image_file(filename))
+	{
+		if(auto frame = create_compressed_image_frame(frame_factory, nullptr, read_compressed_image(filename)))
+			return make_safe_ptr(frame);
+	}
+
+	auto cache_file = get_compressed_cache_file(filename, variant);
+	if(!cache_file.empty() && frame_factory->supports(core::pixel_format::dxt5))
+	{
+		if(is_up_to_date(cache_file, filename))
+		{
+			try
+			{
+				return make_safe_ptr(create_compressed_image_frame(frame_factory, nullptr, read_compressed_image(cache_file)));
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+		
+		auto bitmap = downscale_image(load_image(filename), max_width, max_height);
+		compress_image_async(bitmap, cache_file);
+		return create_image_frame(frame_factory, nullptr, bitmap);
+	}
+
+	return create_image_frame(frame_factory, nullptr, downscale_image(load_image(filename), max_width, max_height));
+}
+
+// The fraction of the channel size a still is shown at, set with DOWNSCALE [fraction] or configuration.image.downscale. 
+// Larger stills are downscaled to it on load. 0 when they are loaded as they are.
+double get_downscale(const core::parameters& params)
+{
+	static const bool downscale = env::properties().get(L"configuration.image.downscale", false);
+
+	if(!params.has(L"DOWNSCALE"))
+		return downscale ? 1.0 : 0.0;
+
+	return std::max(0.0, params.get(L"DOWNSCALE", 1.0));
+}
+
+boost::unique_future<safe_ptr<core::write_frame>> load_image_async(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, double downscale)
+{
+	unsigned int max_width	= 0;
+	unsigned int max_height = 0;
+	std::wstring variant;
+
+	if(downscale > 0.0)
+	{
+		auto format_desc = frame_factory->get_video_format_desc();
+		max_width	= std::max(1u, static_cast<unsigned int>(std::ceil(format_desc.width  * downscale)));
+		max_height	= std::max(1u, static_cast<unsigned int>(std::ceil(format_desc.height * downscale)));
+		variant		= L"@" + boost::lexical_cast<std::wstring>(max_width) + L"x" + boost::lexical_cast<std::wstring>(max_height);
+	}
+
+	return get_cached_image_async(filename, [=]
+	{
+		return load_still(frame_factory, filename, max_width, max_height, variant);
+	}, variant);
+}
+
+std::wstring find_image_file(const std::wstring& name)
+{
+	static const std::vector<std::wstring> extensions = list_of(L"dds")(L"ktx")(L"png")(L"tga")(L"bmp")(L"jpg")(L"jpeg")(L"gif")(L"tiff")(L"tif")(L"jp2")(L"jpx")(L"j2k")(L"j2c");
+	std::wstring filename = env::media_folder() + name;
+	
+	auto ext = std::find_if(extensions.begin(), extensions.end(), [&](const std::wstring& ex) -> bool
+		{					
+			return boost::filesystem::is_regular_file(boost::filesystem::wpath(filename).replace_extension(ex));
+		});
+
+	if(ext == extensions.end())
+		return L"";
+
+	return filename + L"." + *ext;
+}
+
 struct image_producer : public core::frame_producer
 {	
 	const std::wstring description_;
+	const std::string description_utf8_;	// Sent every frame, so converted once.
 	core::monitor::subject		monitor_subject_;
-	const safe_ptr<core::frame_factory> frame_factory_;	safe_ptr<core::basic_frame> frame_;
+	const safe_ptr<core::frame_factory> frame_factory_;	mutable safe_ptr<core::basic_frame> frame_;
+	mutable boost::unique_future<safe_ptr<core::write_frame>> pending_;
 	
-	explicit image_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename) 
+	explicit image_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, bool wait, double downscale) 
 		: description_(filename)
+		, description_utf8_(narrow(filename))
 		, frame_factory_(frame_factory)
 		, frame_(core::basic_frame::empty())	
+		, pending_(load_image_async(frame_factory, filename, downscale))
 	{
-		load(load_image(filename));
+		// Large stills are decoded in the background, empty frames are produced until they are ready.
+		if(wait)
+			pending_.wait();
+		
+		frame();
 	}
 
 	explicit image_producer(const safe_ptr<core::frame_factory>& frame_factory, const void* png_data, size_t size)
 		: description_(L"png from memory")
+		, description_utf8_("png from memory")
 		, frame_factory_(frame_factory)
 		, frame_(core::basic_frame::empty())
 	{
-		load(load_png_from_memory(png_data, size));
+		frame_ = create_image_frame(frame_factory, this, load_png_from_memory(png_data, size));
 	}
 
-	void load(const std::shared_ptr<FIBITMAP>& bitmap)
+	bool loading() const
 	{
-		FreeImage_FlipVertical(bitmap.get());
+		return pending_.get_state() != boost::future_state::uninitialized;
+	}
 
-		core::pixel_format_desc desc;
-		desc.pix_fmt = core::pixel_format::bgra;
-		desc.planes.push_back(core::pixel_format_desc::plane(FreeImage_GetWidth(bitmap.get()), FreeImage_GetHeight(bitmap.get()), 4));
-		auto frame = frame_factory_->create_frame(this, desc);
+	safe_ptr<core::basic_frame> frame() const
+	{
+		if(pending_.is_ready())
+		{
+			try
+			{
+				frame_ = pending_.get();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				CASPAR_LOG(error) << print() << L" Failed to load image.";
+			}
+			pending_ = boost::unique_future<safe_ptr<core::write_frame>>();
+		}
 
-		std::copy_n(FreeImage_GetBits(bitmap.get()), frame->image_data().size(), frame->image_data().begin());
-		frame->commit();
-		frame_ = std::move(frame);
+		return frame_;
 	}
 
 	// frame_producer
 
 	virtual safe_ptr<core::basic_frame> receive(int) override
 	{
-		monitor_subject_ << core::monitor::message("/file/path") % description_;
+		monitor_subject_ << core::monitor::message("/file/path") % description_utf8_;
 
-		return frame_;
+		return frame();
 	}
 		
 	virtual safe_ptr<core::basic_frame> last_frame() const override
 	{
-		return frame_;
+		return frame();
 	}
 
 	virtual safe_ptr<core::basic_frame> create_thumbnail_frame() override
 	{
-		return frame_;
+		if(loading())
+			pending_.wait();
+
+		return frame();
 	}
 		
 	virtual std::wstring print() const override
@@ -111,6 +294,7 @@ struct image_producer : public core::frame_producer
 		boost::property_tree::wptree info;
 		info.add(L"type", L"image-producer");
 		info.add(L"location", description_);
+		info.add(L"loaded", !loading());
 		return info;
 	}
 
@@ -122,7 +306,8 @@ struct image_producer : public core::frame_producer
 
 safe_ptr<core::frame_producer> create_raw_producer(
 	const safe_ptr<core::frame_factory>& frame_factory,
-	const core::parameters& params)
+	const core::parameters& params,
+	bool wait)
 {
 	if (params[0] == L"[PNG_BASE64]")
 	{
@@ -134,25 +319,21 @@ safe_ptr<core::frame_producer> create_raw_producer(
 		return make_safe<image_producer>(frame_factory, png_data.data(), png_data.size());
 	}
 
-	static const std::vector<std::wstring> extensions = list_of(L"png")(L"tga")(L"bmp")(L"jpg")(L"jpeg")(L"gif")(L"tiff")(L"tif")(L"jp2")(L"jpx")(L"j2k")(L"j2c");
-	std::wstring filename = env::media_folder() + params.at_original(0);
-	
-	auto ext = std::find_if(extensions.begin(), extensions.end(), [&](const std::wstring& ex) -> bool
-		{					
-			return boost::filesystem::is_regular_file(boost::filesystem::wpath(filename).replace_extension(ex));
-		});
+	auto filename = find_image_file(params.at_original(0));
 
-	if(ext == extensions.end())
+	if(filename.empty())
 		return core::frame_producer::empty();
 
-	return make_safe<image_producer>(frame_factory, filename + L"." + *ext);
+	static const bool async = env::properties().get(L"configuration.image.async-loading", true);
+
+	return make_safe<image_producer>(frame_factory, filename, wait || !async || params.has(L"WAIT"), get_downscale(params));
 }
 
 safe_ptr<core::frame_producer> create_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params)
 {
-	auto raw_producer = create_raw_producer(frame_factory, params);
+	auto raw_producer = create_raw_producer(frame_factory, params, false);
 
 	if (raw_producer == core::frame_producer::empty())
 		return raw_producer;
@@ -164,7 +345,27 @@ safe_ptr<core::frame_producer> create_thumbnail_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params)
 {
-	return create_raw_producer(frame_factory, params);
+	return create_raw_producer(frame_factory, params, true);
+}
+
+bool preload_image(
+		const safe_ptr<core::frame_factory>& frame_factory,
+		const core::parameters& params)
+{
+	if(params.empty())
+		return false;
+
+	auto filename = find_image_file(params.at_original(0));
+
+	if(filename.empty())
+		return false;
+
+	auto frame = load_image_async(frame_factory, filename, get_downscale(params));
+
+	if(params.has(L"WAIT"))
+		frame.get();
+
+	return true;
 }
 
 }}
\ No newline at end of file
@@ -23,12 +23,16 @@
 
 #include <core/producer/frame_producer.h>
 
+#include <FreeImage.h>
+
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace caspar { 
 namespace core {
 	class parameters;
+	class write_frame;
 }
 namespace image {
 
@@ -39,4 +43,12 @@ safe_ptr<core::frame_producer> create_thumbnail_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params);
 
+// A still frame of a 32 bit bitmap, which is left as it is.
+safe_ptr<core::write_frame> create_image_frame(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const std::shared_ptr<FIBITMAP>& bitmap);
+
+// Decodes the still image named by params into the image cache, returns false if there is no such image.
+bool preload_image(
+		const safe_ptr<core::frame_factory>& frame_factory,
+		const core::parameters& params);
+
 }}
\ No newline at end of file
@@ -39,7 +39,6 @@
 #include <common/log/log.h>
 #include <common/memory/memclr.h>
 #include <common/exception/exceptions.h>
-#include <common/utility/tweener.h>
 
 #include <boost/assign.hpp>
 #include <boost/filesystem.hpp>
@@ -50,8 +49,8 @@
 
 #include <algorithm>
 #include <array>
+#include <map>
 #include <boost/math/special_functions/round.hpp>
-#include <boost/scoped_array.hpp>
 
 using namespace boost::assign;
 
@@ -61,7 +60,7 @@ struct image_scroll_producer : public core::frame_producer
 {	
 	core::monitor::subject						monitor_subject_;
 	const std::wstring							filename_;
-	std::vector<safe_ptr<core::basic_frame>>	frames_;
+	const safe_ptr<core::frame_factory>			frame_factory_;
 	core::video_format_desc						format_desc_;
 	size_t										width_;
 	size_t										height_;
@@ -72,8 +71,14 @@ struct image_scroll_producer : public core::frame_producer
 	int											start_offset_x_;
 	int											start_offset_y_;
 	bool										progressive_;
+	int											motion_blur_px_; // At most, the blur is the distance moved per field.
 
 	safe_ptr<core::basic_frame>					last_frame_;
+
+	std::shared_ptr<FIBITMAP>					bitmap_;
+	uint8_t*									bytes_;
+	int											tile_count_;
+	std::map<int, safe_ptr<core::basic_frame>>	tiles_;
 	
 	explicit image_scroll_producer(
 		const safe_ptr<core::frame_factory>& frame_factory, 
@@ -84,20 +89,22 @@ struct image_scroll_producer : public core::frame_producer
 		bool premultiply_with_alpha = false,
 		bool progressive = false) 
 		: filename_(filename)
+		, frame_factory_(frame_factory)
 		, delta_(0)
 		, format_desc_(frame_factory->get_video_format_desc())
 		, speed_(speed)
 		, progressive_(progressive)
+		, motion_blur_px_(std::max(0, motion_blur_px))
 		, last_frame_(core::basic_frame::empty())
 	{
 		start_offset_x_ = 0;
 		start_offset_y_ = 0;
 
-		auto bitmap = load_image(filename_);
-		FreeImage_FlipVertical(bitmap.get());
+		bitmap_ = load_image(filename_);
+		FreeImage_FlipVertical(bitmap_.get());
 
-		width_  = FreeImage_GetWidth(bitmap.get());
-		height_ = FreeImage_GetHeight(bitmap.get());
+		width_  = FreeImage_GetWidth(bitmap_.get());
+		height_ = FreeImage_GetHeight(bitmap_.get());
 
 		bool vertical = width_ == format_desc_.width;
 		bool horizontal = height_ == format_desc_.height;
@@ -139,140 +146,109 @@ struct image_scroll_producer : public core::frame_producer
 				start_offset_x_ = format_desc_.width - (width_ % format_desc_.width) + width_ + format_desc_.width;
 		}
 
-		auto bytes = FreeImage_GetBits(bitmap.get());
-		int count = width_*height_*4;
-		image_view<bgra_pixel> original_view(bytes, width_, height_);
+		bytes_ = FreeImage_GetBits(bitmap_.get());
+		image_view<bgra_pixel> original_view(bytes_, width_, height_);
 
 		if (premultiply_with_alpha)
 			premultiply(original_view);
 
-		boost::scoped_array<uint8_t> blurred_copy;
+		// The image is kept in host memory and split into screen sized tiles, which are only created while they are 
+		// visible or about to become visible.
+		if (vertical)
+			tile_count_ = static_cast<int>((height_ + format_desc_.height - 1) / format_desc_.height);
+		else
+			tile_count_ = static_cast<int>((width_ + format_desc_.width - 1) / format_desc_.width);
 
-		if (motion_blur_px > 0)
-		{
-			double angle = 3.14159265 / 2; // Up
-
-			if (horizontal && speed_ < 0)
-				angle *= 2; // Left
-			else if (vertical && speed > 0)
-				angle *= 3; // Down
-			else if (horizontal && speed  > 0)
-				angle = 0.0; // Right
-
-			blurred_copy.reset(new uint8_t[count]);
-			image_view<bgra_pixel> blurred_view(blurred_copy.get(), width_, height_);
-			tweener_t blur_tweener = get_tweener(L"easeInQuad");
-			blur(original_view, blurred_view, angle, motion_blur_px, blur_tweener);
-			bytes = blurred_copy.get();
-			bitmap.reset();
-		}
+		CASPAR_LOG(info) << print() << L" Initialized";
+	}
 
-		if (vertical)
+	// Position of tile n relative to the scroll, in screens.
+	double tile_translation(int n) const
+	{
+		if (width_ == format_desc_.width)
+			return - (static_cast<double>(n) + 1.0);
+		else
+			return - static_cast<double>(tile_count_ - n);
+	}
+
+	safe_ptr<core::basic_frame> create_tile(int n)
+	{
+		core::pixel_format_desc desc;
+		desc.pix_fmt = core::pixel_format::bgra;
+
+		if (width_ == format_desc_.width)
 		{
-			int n = 1;
+			desc.planes.push_back(core::pixel_format_desc::plane(width_, format_desc_.height, 4));
+			auto frame = frame_factory_->create_frame(reinterpret_cast<void*>(rand()), desc);
+			
+			size_t count = (height_ - n * format_desc_.height) * width_ * 4;
 
-			while(count > 0)
+			if(count >= frame->image_data().size())
+			{	
+				std::copy_n(bytes_ + count - frame->image_data().size(), frame->image_data().size(), frame->image_data().begin());
+			}
+			else
 			{
-				core::pixel_format_desc desc;
-				desc.pix_fmt = core::pixel_format::bgra;
-				desc.planes.push_back(core::pixel_format_desc::plane(width_, format_desc_.height, 4));
-				auto frame = frame_factory->create_frame(reinterpret_cast<void*>(rand()), desc);
-
-				if(count >= frame->image_data().size())
-				{	
-					std::copy_n(bytes + count - frame->image_data().size(), frame->image_data().size(), frame->image_data().begin());
-					count -= frame->image_data().size();
-				}
-				else
-				{
-					fast_memclr(frame->image_data().begin(), frame->image_data().size());	
-					std::copy_n(bytes, count, frame->image_data().begin() + format_desc_.size - count);
-					count = 0;
-				}
-
-				frame->commit();
-				frames_.push_back(frame);
-
-				// Set the relative position to the other image fragments
-				frame->get_frame_transform().fill_translation[1] = - n++;
+				fast_memclr(frame->image_data().begin(), frame->image_data().size());	
+				std::copy_n(bytes_, count, frame->image_data().begin() + format_desc_.size - count);
 			}
 
+			frame->commit();
+			frame->get_frame_transform().fill_translation[1] = tile_translation(n);
+			return frame;
 		}
-		else if (horizontal)
+		else
 		{
-			int i = 0;
-			while(count > 0)
-			{
-				core::pixel_format_desc desc;
-				desc.pix_fmt = core::pixel_format::bgra;
-				desc.planes.push_back(core::pixel_format_desc::plane(format_desc_.width, height_, 4));
-				auto frame = frame_factory->create_frame(reinterpret_cast<void*>(rand()), desc);
-				if(count >= frame->image_data().size())
-				{	
-					for(size_t y = 0; y < height_; ++y)
-						std::copy_n(bytes + i * format_desc_.width*4 + y * width_*4, format_desc_.width*4, frame->image_data().begin() + y * format_desc_.width*4);
-					
-					++i;
-					count -= frame->image_data().size();
-				}
-				else
-				{
-					fast_memclr(frame->image_data().begin(), frame->image_data().size());	
-					int width2 = width_ % format_desc_.width;
-					for(size_t y = 0; y < height_; ++y)
-						std::copy_n(bytes + i * format_desc_.width*4 + y * width_*4, width2*4, frame->image_data().begin() + y * format_desc_.width*4);
-
-					count = 0;
-				}
-			
-				frame->commit();
-				frames_.push_back(frame);
-			}
+			desc.planes.push_back(core::pixel_format_desc::plane(format_desc_.width, height_, 4));
+			auto frame = frame_factory_->create_frame(reinterpret_cast<void*>(rand()), desc);
 
-			std::reverse(frames_.begin(), frames_.end());
-
-			// Set the relative positions of the image fragments.
-			for (size_t n = 0; n < frames_.size(); ++n)
+			if(width_ - n * format_desc_.width >= format_desc_.width)
+			{	
+				for(size_t y = 0; y < height_; ++y)
+					std::copy_n(bytes_ + n * format_desc_.width*4 + y * width_*4, format_desc_.width*4, frame->image_data().begin() + y * format_desc_.width*4);
+			}
+			else
 			{
-				double translation = - (static_cast<double>(n) + 1.0);
-				frames_[n]->get_frame_transform().fill_translation[0] = translation;
+				fast_memclr(frame->image_data().begin(), frame->image_data().size());	
+				int width2 = width_ % format_desc_.width;
+				for(size_t y = 0; y < height_; ++y)
+					std::copy_n(bytes_ + n * format_desc_.width*4 + y * width_*4, width2*4, frame->image_data().begin() + y * format_desc_.width*4);
 			}
+			
+			frame->commit();
+			frame->get_frame_transform().fill_translation[0] = tile_translation(n);
+			return frame;
 		}
-
-		CASPAR_LOG(info) << print() << L" Initialized";
 	}
 
 	std::vector<safe_ptr<core::basic_frame>> get_visible()
 	{
 		std::vector<safe_ptr<core::basic_frame>> result;
-		result.reserve(frames_.size());
 
-		BOOST_FOREACH(auto& frame, frames_)
+		auto motion_offset_in_screens = width_ == format_desc_.width
+			? (static_cast<double>(start_offset_y_) + delta_) / static_cast<double>(format_desc_.height)
+			: (static_cast<double>(start_offset_x_) + delta_) / static_cast<double>(format_desc_.width);
+		
+		// Offsets grow with speed, the tile one screen ahead of the visible ones is prefetched.
+		auto min_offset = speed_ > 0.0 ? -2.0 : -1.0;
+		auto max_offset = speed_ > 0.0 ?  1.0 :  2.0;
+
+		for (int n = 0; n < tile_count_; ++n)
 		{
-			auto& fill_translation = frame->get_frame_transform().fill_translation;
+			auto offset = tile_translation(n) + motion_offset_in_screens;
 
-			if (width_ == format_desc_.width)
+			if (offset < min_offset || offset > max_offset)
 			{
-				auto motion_offset_in_screens = (static_cast<double>(start_offset_y_) + delta_) / static_cast<double>(format_desc_.height);
-				auto vertical_offset = fill_translation[1] + motion_offset_in_screens;
-
-				if (vertical_offset < -1.0 || vertical_offset > 1.0)
-				{
-					continue;
-				}
+				tiles_.erase(n);
+				continue;
 			}
-			else
-			{
-				auto motion_offset_in_screens = (static_cast<double>(start_offset_x_) + delta_) / static_cast<double>(format_desc_.width);
-				auto horizontal_offset = fill_translation[0] + motion_offset_in_screens;
 
-				if (horizontal_offset < -1.0 || horizontal_offset > 1.0)
-				{
-					continue;
-				}
-			}
+			auto it = tiles_.find(n);
+			if (it == tiles_.end())
+				it = tiles_.insert(std::make_pair(n, create_tile(n))).first;
 
-			result.push_back(frame);
+			if (offset >= -1.0 && offset <= 1.0)
+				result.push_back(it->second);
 		}
 
 		return std::move(result);
@@ -282,12 +258,15 @@ struct image_scroll_producer : public core::frame_producer
 
 	safe_ptr<core::basic_frame> render_frame(bool allow_eof)
 	{
-		if(frames_.empty())
+		if(tile_count_ == 0)
 			return core::basic_frame::eof();
 		
 		auto result = make_safe<core::basic_frame>(get_visible());
 		auto& fill_translation = result->get_frame_transform().fill_translation;
 
+		// Blurred by the mixer along the scroll, as far as the image moves until the next field.
+		auto motion_blur = std::min(std::abs(speed_), static_cast<double>(motion_blur_px_)) * (speed_ < 0.0 ? -1.0 : 1.0);
+
 		if (width_ == format_desc_.width)
 		{
 			if (static_cast<size_t>(std::abs(delta_)) >= height_ + format_desc_.height && allow_eof)
@@ -296,6 +275,7 @@ struct image_scroll_producer : public core::frame_producer
 			fill_translation[1] = 
 				static_cast<double>(start_offset_y_) / static_cast<double>(format_desc_.height)
 				+ delta_ / static_cast<double>(format_desc_.height);
+			result->get_frame_transform().motion_blur[1] = motion_blur;
 		}
 		else
 		{
@@ -305,6 +285,7 @@ struct image_scroll_producer : public core::frame_producer
 			fill_translation[0] = 
 				static_cast<double>(start_offset_x_) / static_cast<double>(format_desc_.width)
 				+ (delta_) / static_cast<double>(format_desc_.width);
+			result->get_frame_transform().motion_blur[0] = motion_blur;
 		}
 
 		return result;
@@ -368,6 +349,8 @@ struct image_scroll_producer : public core::frame_producer
 		boost::property_tree::wptree info;
 		info.add(L"type", L"image-scroll-producer");
 		info.add(L"filename", filename_);
+		info.add(L"tiles", tile_count_);
+		info.add(L"loaded-tiles", tiles_.size());
 		return info;
 	}
 
@@ -0,0 +1,435 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "image_sequence_producer.h"
+#include "image_producer.h"
+
+#include "../util/image_loader.h"
+
+#include <core/video_format.h>
+
+#include <core/parameters/parameters.h>
+#include <core/monitor/monitor.h>
+#include <core/producer/frame/basic_frame.h>
+#include <core/producer/frame/frame_factory.h>
+#include <core/mixer/write_frame.h>
+
+#include <common/concurrency/executor.h>
+#include <common/diagnostics/graph.h>
+#include <common/env.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/assign.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/regex.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/timer.hpp>
+
+#include <algorithm>
+#include <cwctype>
+#include <deque>
+#include <limits>
+#include <vector>
+
+using namespace boost::assign;
+
+namespace caspar { namespace image {
+
+// The number at the end of the name of a still, frames which have none come first.
+uint64_t get_sequence_number(const std::wstring& filename)
+{
+	const auto stem = boost::filesystem::wpath(filename).stem();
+
+	auto first = stem.size();
+	while(first > 0 && std::iswdigit(stem[first - 1]))
+		--first;
+
+	if(first == stem.size())
+		return 0;
+
+	try
+	{
+		return boost::lexical_cast<uint64_t>(stem.substr(first, std::min<std::size_t>(stem.size() - first, 18)));
+	}
+	catch(...)
+	{
+		return 0;
+	}
+}
+
+std::vector<std::wstring> find_sequence_files(const std::wstring& name)
+{
+	static const std::vector<std::wstring> extensions = list_of(L".png")(L".tga")(L".exr")(L".tif")(L".tiff")(L".bmp")(L".jpg")(L".jpeg");
+
+	std::vector<std::wstring> files;
+
+	const auto folder = env::media_folder() + name;
+	if(!boost::filesystem::is_directory(folder))
+		return files;
+
+	for(auto it = boost::filesystem::wdirectory_iterator(folder); it != boost::filesystem::wdirectory_iterator(); ++it)
+	{
+		const auto extension = boost::to_lower_copy(it->path().extension());
+		if(boost::filesystem::is_regular_file(it->path()) && std::find(extensions.begin(), extensions.end(), extension) != extensions.end())
+			files.push_back(it->path().file_string());
+	}
+
+	std::sort(files.begin(), files.end(), [](const std::wstring& lhs, const std::wstring& rhs)
+	{
+		const auto lhs_number = get_sequence_number(lhs);
+		const auto rhs_number = get_sequence_number(rhs);
+		return lhs_number != rhs_number ? lhs_number < rhs_number : lhs < rhs;
+	});
+
+	return files;
+}
+
+struct decoded_still
+{
+	safe_ptr<core::write_frame>	frame;
+	double						decode_time;
+
+	decoded_still(const safe_ptr<core::write_frame>& frame, double decode_time)
+		: frame(frame)
+		, decode_time(decode_time)
+	{
+	}
+};
+
+struct image_sequence_producer : public core::frame_producer
+{	
+	core::monitor::subject								monitor_subject_;
+	const std::wstring									name_;
+	const std::string									name_utf8_;	// Sent every frame, so converted once.
+	const std::vector<std::wstring>						files_;
+	const safe_ptr<core::frame_factory>					frame_factory_;
+	const core::video_format_desc						format_desc_;
+	const safe_ptr<diagnostics::graph>					graph_;
+	boost::timer										frame_timer_;
+
+	std::vector<std::shared_ptr<executor>>				decoders_;
+	std::size_t											next_decoder_;
+	
+	struct pending_still
+	{
+		uint32_t								index;
+		boost::shared_future<decoded_still>		still;
+	};
+
+	std::deque<pending_still>							window_;
+	const std::size_t									max_window_frames_;
+	const std::size_t									max_window_bytes_;
+	std::size_t											frame_bytes_;
+
+	bool												loop_;
+	uint32_t											start_;
+	const uint32_t										length_;
+	uint32_t											next_index_;
+	uint32_t											file_frame_number_;
+	double												decode_time_;
+	
+	safe_ptr<core::basic_frame>							last_frame_;
+
+	explicit image_sequence_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& name, const std::vector<std::wstring>& files, bool loop, uint32_t start, uint32_t length) 
+		: name_(name)
+		, name_utf8_(narrow(name))
+		, files_(files)
+		, frame_factory_(frame_factory)
+		, format_desc_(frame_factory->get_video_format_desc())
+		, next_decoder_(0)
+		, max_window_frames_(std::max(1, env::properties().get(L"configuration.image.sequence.prefetch-frames", 16)))
+		, max_window_bytes_(static_cast<std::size_t>(std::max(1, env::properties().get(L"configuration.image.sequence.prefetch-size", 256))) * 1024 * 1024)
+		, frame_bytes_(0)
+		, loop_(loop)
+		, start_(std::min(start, static_cast<uint32_t>(files.size() - 1)))
+		, length_(length)
+		, next_index_(start_)
+		, file_frame_number_(start_)
+		, decode_time_(0.0)
+		, last_frame_(core::basic_frame::empty())
+	{
+		graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
+		graph_->set_color("decode-time", diagnostics::color(0.9f, 0.6f, 0.1f));
+		graph_->set_color("prefetch", diagnostics::color(0.3f, 0.6f, 1.0f));
+		graph_->set_color("underflow", diagnostics::color(0.6f, 0.3f, 0.9f));	
+		graph_->set_color("decode-error", diagnostics::color(1.0f, 0.1f, 0.1f));
+		graph_->set_text(print());
+		diagnostics::register_graph(graph_);
+
+		const auto decoders = std::max(1, env::properties().get(L"configuration.image.sequence.decoders", 4));
+		for(int n = 0; n < decoders; ++n)
+			decoders_.push_back(std::make_shared<executor>(L"image_sequence_decoder"));
+
+		fill();
+	}
+
+	~image_sequence_producer()
+	{
+		// Stills which have not started decoding are dropped rather than waited for.
+		BOOST_FOREACH(auto& decoder, decoders_)
+			decoder->clear();
+	}
+
+	uint32_t end_index() const
+	{
+		return static_cast<uint32_t>(std::min<uint64_t>(files_.size(), static_cast<uint64_t>(start_) + length_));
+	}
+
+	// Bounded by frames, and by bytes once the size of a frame is known.
+	std::size_t window_size() const
+	{
+		if(frame_bytes_ == 0)
+			return std::min(max_window_frames_, decoders_.size());
+
+		return std::max<std::size_t>(1, std::min(max_window_frames_, max_window_bytes_ / frame_bytes_));
+	}
+
+	void fill()
+	{
+		while(window_.size() < window_size())
+		{
+			if(next_index_ >= end_index())
+			{
+				if(!loop_ || start_ >= end_index())
+					return;
+				next_index_ = start_;
+			}
+
+			schedule(next_index_++);
+		}
+	}
+
+	void schedule(uint32_t index)
+	{
+		auto frame_factory	= frame_factory_;
+		auto filename		= files_[index];
+
+		pending_still pending;
+		pending.index = index;
+		pending.still = decoders_[next_decoder_++ % decoders_.size()]->begin_invoke([=]() -> decoded_still
+		{
+			boost::timer timer;
+			auto frame = create_image_frame(frame_factory, nullptr, load_image(filename));
+			return decoded_still(frame, timer.elapsed());
+		});
+		window_.push_back(pending);
+	}
+
+	std::size_t ready_frames() const
+	{
+		return std::count_if(window_.begin(), window_.end(), [](const pending_still& pending)
+		{
+			return pending.still.is_ready();
+		});
+	}
+
+	void update_graph()
+	{
+		graph_->set_value("frame-time", frame_timer_.elapsed()*format_desc_.fps*0.5);
+		// Each decoder has as many frame intervals to decode a still as there are decoders.
+		graph_->set_value("decode-time", decode_time_*format_desc_.fps*0.5/decoders_.size());
+		graph_->set_value("prefetch", static_cast<double>(ready_frames())/static_cast<double>(window_size()));
+	}
+
+	void send_osc()
+	{
+		if(!monitor_subject_.is_observed())
+			return;
+
+		monitor_subject_	<< core::monitor::message("/profiler/time")			% frame_timer_.elapsed() % (1.0/format_desc_.fps)
+							<< core::monitor::message("/profiler/decode-time")	% decode_time_ % (1.0/format_desc_.fps)
+							<< core::monitor::message("/file/frame")			% static_cast<int32_t>(file_frame_number_) % static_cast<int32_t>(files_.size())
+							<< core::monitor::message("/file/path")				% name_utf8_
+							<< core::monitor::message("/loop")					% loop_;
+	}
+
+	// frame_producer
+
+	virtual void preroll(int) override
+	{
+		fill();
+	}
+
+	virtual bool is_ready() const override
+	{
+		return window_.empty() || window_.front().still.is_ready();
+	}
+
+	virtual safe_ptr<core::basic_frame> receive(int) override
+	{
+		frame_timer_.restart();
+		fill();
+
+		if(window_.empty())
+		{
+			send_osc();
+			return last_frame();
+		}
+
+		if(!window_.front().still.is_ready())
+		{
+			graph_->set_tag("underflow");
+			update_graph();
+			send_osc();
+			return core::basic_frame::late();
+		}
+
+		auto pending = window_.front();
+		window_.pop_front();
+
+		try
+		{
+			auto still		= pending.still.get();
+			last_frame_		= still.frame;
+			frame_bytes_	= still.frame->image_data().size();
+			decode_time_	= still.decode_time;
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << print() << L" Failed to decode " << files_[pending.index] << L", repeating the previous frame.";
+			graph_->set_tag("decode-error");
+		}
+
+		file_frame_number_ = pending.index;
+		fill();
+
+		update_graph();
+		graph_->set_text(print());
+		send_osc();
+
+		return last_frame_;
+	}
+
+	virtual safe_ptr<core::basic_frame> last_frame() const override
+	{
+		return last_frame_;
+	}
+
+	virtual safe_ptr<core::basic_frame> create_thumbnail_frame() override
+	{
+		if(!window_.empty())
+		{
+			try
+			{
+				return window_.front().still.get().frame;
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+
+		return last_frame_;
+	}
+
+	virtual uint32_t nb_frames() const override
+	{
+		return loop_ ? std::numeric_limits<uint32_t>::max() : end_index() - start_;
+	}
+
+	virtual boost::unique_future<std::wstring> call(const std::wstring& param) override
+	{
+		boost::promise<std::wstring> promise;
+		promise.set_value(do_call(param));
+		return promise.get_future();
+	}
+		
+	virtual std::wstring print() const override
+	{
+		return L"image_sequence_producer[" + name_ + L"|" + boost::lexical_cast<std::wstring>(file_frame_number_) + L"/" + boost::lexical_cast<std::wstring>(files_.size()) + L"]";
+	}
+
+	virtual boost::property_tree::wptree info() const override
+	{
+		boost::property_tree::wptree info;
+		info.add(L"type",					L"image-sequence-producer");
+		info.add(L"location",				name_);
+		info.add(L"loop",					loop_);
+		info.add(L"nb-frames",				loop_ ? -1 : static_cast<int64_t>(nb_frames()));
+		info.add(L"file-frame-number",		file_frame_number_);
+		info.add(L"file-nb-frames",			files_.size());
+		info.add(L"decode-time",			decode_time_);
+		info.add(L"decoders",				decoders_.size());
+		info.add(L"prefetch",				window_size());
+		info.add(L"resources.queue-depth",	window_.size());
+		return info;
+	}
+
+	core::monitor::subject& monitor_output()
+	{
+		return monitor_subject_;
+	}
+
+	// image_sequence_producer
+
+	std::wstring do_call(const std::wstring& param)
+	{
+		static const boost::wregex loop_exp(L"LOOP\\s*(?<VALUE>\\d?)?", boost::regex::icase);
+		static const boost::wregex seek_exp(L"SEEK\\s+(?<VALUE>\\d+)", boost::regex::icase);
+		
+		boost::wsmatch what;
+		if(boost::regex_match(param, what, loop_exp))
+		{
+			if(!what["VALUE"].str().empty())
+				loop_ = boost::lexical_cast<bool>(what["VALUE"].str());
+			return L"LOOP OK";
+		}
+
+		if(boost::regex_match(param, what, seek_exp))
+		{
+			// Stills already decoding finish in the background and are dropped.
+			BOOST_FOREACH(auto& decoder, decoders_)
+				decoder->clear();
+			window_.clear();
+
+			next_index_ = std::min(boost::lexical_cast<uint32_t>(what["VALUE"].str()), static_cast<uint32_t>(files_.size() - 1));
+			fill();
+			return L"SEEK OK";
+		}
+		
+		BOOST_THROW_EXCEPTION(invalid_argument());
+	}
+};
+
+safe_ptr<core::frame_producer> create_sequence_producer(
+		const safe_ptr<core::frame_factory>& frame_factory,
+		const core::parameters& params)
+{
+	const auto name	 = params.at_original(0);
+	const auto files = find_sequence_files(name);
+
+	if(files.empty())
+		return core::frame_producer::empty();
+
+	auto loop	= params.has(L"LOOP");
+	auto start	= params.get(L"SEEK", static_cast<uint32_t>(0));
+	auto length	= params.get(L"LENGTH", std::numeric_limits<uint32_t>::max());
+
+	return create_producer_destroy_proxy(make_safe<image_sequence_producer>(frame_factory, name, files, loop, start, length));
+}
+
+}}
@@ -0,0 +1,237 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "compressed_image.h"
+
+#include <core/mixer/write_frame.h>
+#include <core/producer/frame/frame_factory.h>
+
+#include <common/exception/exceptions.h>
+#include <common/memory/pixel_kernels.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/exception/errinfo_file_name.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <fstream>
+
+namespace caspar { namespace image {
+
+namespace {
+
+uint32_t read_u32(const std::vector<uint8_t>& data, std::size_t offset)
+{
+	if(offset + 4 > data.size())
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Corrupt compressed image."));
+
+	return data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | static_cast<uint32_t>(data[offset + 3]) << 24;
+}
+
+void write_u32(std::vector<uint8_t>& data, std::size_t offset, uint32_t value)
+{
+	for(int n = 0; n < 4; ++n)
+		data[offset + n] = static_cast<uint8_t>(value >> (8 * n));
+}
+
+uint32_t make_fourcc(const char* code)
+{
+	return code[0] | code[1] << 8 | code[2] << 16 | static_cast<uint32_t>(code[3]) << 24;
+}
+
+std::vector<uint8_t> read_file(const std::wstring& filename)
+{
+	std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+	if(!stream)
+		BOOST_THROW_EXCEPTION(file_read_error() << boost::errinfo_file_name(narrow(filename)));
+
+	stream.seekg(0, std::ios::end);
+	std::vector<uint8_t> data(static_cast<std::size_t>(stream.tellg()));
+	stream.seekg(0, std::ios::beg);
+	stream.read(reinterpret_cast<char*>(data.data()), data.size());
+	if(!stream)
+		BOOST_THROW_EXCEPTION(file_read_error() << boost::errinfo_file_name(narrow(filename)));
+
+	return data;
+}
+
+void read_payload(compressed_image& image, const std::vector<uint8_t>& data, std::size_t offset)
+{
+	const auto size = core::get_compressed_size(core::get_texture_compression(image.format), image.width, image.height);
+
+	if(image.width == 0 || image.height == 0 || offset + size > data.size())
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Corrupt compressed image."));
+
+	image.data.assign(data.begin() + offset, data.begin() + offset + size);
+}
+
+// A DDS file is the magic, a 124 byte header and, for newer formats such as BC7, a 20 byte DX10 header.
+compressed_image read_dds(const std::vector<uint8_t>& data)
+{
+	static const uint32_t DDPF_FOURCC = 0x4;
+
+	if(data.size() < 128 || read_u32(data, 4) != 124 || !(read_u32(data, 80) & DDPF_FOURCC))
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Corrupt DDS image."));
+
+	compressed_image image;
+	image.height = read_u32(data, 12);
+	image.width	 = read_u32(data, 16);
+
+	const auto fourcc = read_u32(data, 84);
+	std::size_t offset = 128;
+
+	if(fourcc == make_fourcc("DXT1"))
+		image.format = core::pixel_format::dxt1;
+	else if(fourcc == make_fourcc("DXT4") || fourcc == make_fourcc("DXT5"))
+		image.format = core::pixel_format::dxt5;
+	else if(fourcc == make_fourcc("DX10"))
+	{
+		switch(read_u32(data, 128)) // DXGI_FORMAT
+		{
+		case 71: // BC1_UNORM
+		case 72: image.format = core::pixel_format::dxt1; break;
+		case 77: // BC3_UNORM
+		case 78: image.format = core::pixel_format::dxt5; break;
+		case 98: // BC7_UNORM
+		case 99: image.format = core::pixel_format::bc7; break;
+		default: BOOST_THROW_EXCEPTION(not_supported() << msg_info("Unsupported DDS format."));
+		}
+		offset += 20;
+	}
+	else
+		BOOST_THROW_EXCEPTION(not_supported() << msg_info("Unsupported DDS format."));
+
+	read_payload(image, data, offset);
+	return image;
+}
+
+// A KTX file is a 64 byte header, key value pairs and the levels, each after its size.
+compressed_image read_ktx(const std::vector<uint8_t>& data)
+{
+	if(data.size() < 64 || read_u32(data, 12) != 0x04030201)
+		BOOST_THROW_EXCEPTION(not_supported() << msg_info("Unsupported KTX image."));
+
+	compressed_image image;
+	image.width	 = read_u32(data, 36);
+	image.height = read_u32(data, 40);
+
+	switch(read_u32(data, 28)) // glInternalFormat
+	{
+	case 0x83F0: // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	case 0x83F1: image.format = core::pixel_format::dxt1; break;
+	case 0x83F3: image.format = core::pixel_format::dxt5; break;
+	case 0x8E8C: image.format = core::pixel_format::bc7;  break;
+	default: BOOST_THROW_EXCEPTION(not_supported() << msg_info("Unsupported KTX format."));
+	}
+
+	const std::size_t key_values_end = 64 + read_u32(data, 60);
+	for(std::size_t offset = 64; offset + 4 <= key_values_end; )
+	{
+		const auto size = read_u32(data, offset);
+		if(offset + 4 + size > data.size())
+			BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Corrupt KTX image."));
+
+		const std::string key_value(data.begin() + offset + 4, data.begin() + offset + 4 + size);
+		const auto value = key_value.find('\0') != std::string::npos ? key_value.substr(key_value.find('\0') + 1) : std::string();
+
+		// Blocks cannot be flipped row by row, the image has to be written top row first.
+		if(boost::starts_with(key_value, "KTXorientation") && value.find("T=u") != std::string::npos)
+			BOOST_THROW_EXCEPTION(not_supported() << msg_info("KTX images written bottom row first are not supported."));
+
+		offset += 4 + ((size + 3) & ~3);
+	}
+
+	read_payload(image, data, key_values_end + 4);
+	return image;
+}
+
+}
+
+bool is_compressed_image_file(const std::wstring& filename)
+{
+	return boost::iends_with(filename, L".dds") || boost::iends_with(filename, L".ktx");
+}
+
+compressed_image read_compressed_image(const std::wstring& filename)
+{
+	const auto data = read_file(filename);
+
+	static const uint8_t ktx_identifier[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+
+	if(data.size() >= 4 && read_u32(data, 0) == make_fourcc("DDS "))
+		return read_dds(data);
+
+	if(data.size() >= sizeof(ktx_identifier) && std::memcmp(data.data(), ktx_identifier, sizeof(ktx_identifier)) == 0)
+		return read_ktx(data);
+
+	BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Unsupported image format.") << boost::errinfo_file_name(narrow(filename)));
+}
+
+std::shared_ptr<core::write_frame> create_compressed_image_frame(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const compressed_image& image)
+{
+	if(!frame_factory->supports(image.format))
+		return nullptr;
+
+	auto desc = core::get_compressed_pixel_format_desc(image.format, image.width, image.height);
+	desc.is_still = true;
+
+	auto frame = frame_factory->create_frame(tag, desc);
+	std::copy_n(image.data.begin(), std::min(image.data.size(), frame->image_data().size()), frame->image_data().begin());
+	frame->commit();
+	return frame;
+}
+
+void write_dxt5_image(const std::shared_ptr<FIBITMAP>& bitmap, const std::wstring& filename)
+{
+	const auto width  = FreeImage_GetWidth(bitmap.get());
+	const auto height = FreeImage_GetHeight(bitmap.get());
+
+	std::vector<uint8_t> data(128 + core::get_compressed_size(core::texture_compression::dxt5, width, height), 0);
+	write_u32(data, 0,   make_fourcc("DDS "));
+	write_u32(data, 4,   124);
+	write_u32(data, 8,   0x1 | 0x2 | 0x4 | 0x1000 | 0x80000); // caps, height, width, pixel format and linear size.
+	write_u32(data, 12,  height);
+	write_u32(data, 16,  width);
+	write_u32(data, 20,  core::get_compressed_size(core::texture_compression::dxt5, width, height));
+	write_u32(data, 76,  32);
+	write_u32(data, 80,  0x4);
+	write_u32(data, 84,  make_fourcc("DXT5"));
+	write_u32(data, 108, 0x1000); // DDSCAPS_TEXTURE
+
+	// FreeImage keeps the bottom row first, blocks are written top row first.
+	auto top_row = FreeImage_GetScanLine(bitmap.get(), height - 1);
+	encode_dxt5(data.data() + 128, top_row, -static_cast<int>(FreeImage_GetPitch(bitmap.get())), width, height);
+
+	// Written next to the target and renamed, so that a half written file is never loaded.
+	const auto temp_filename = filename + L".tmp";
+	{
+		std::ofstream stream(temp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if(!stream)
+			BOOST_THROW_EXCEPTION(file_write_error() << boost::errinfo_file_name(narrow(filename)));
+	}
+
+	boost::filesystem::remove(boost::filesystem::wpath(filename));
+	boost::filesystem::rename(boost::filesystem::wpath(temp_filename), boost::filesystem::wpath(filename));
+}
+
+}}
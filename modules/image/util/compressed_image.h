@@ -0,0 +1,65 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/producer/frame/pixel_format.h>
+
+#include <FreeImage.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace caspar { 
+	
+namespace core {
+	class write_frame;
+	struct frame_factory;
+}
+
+namespace image {
+
+// The first mip level of a DDS or KTX file, in blocks of one of the compressed pixel formats, top row first.
+struct compressed_image
+{
+	core::pixel_format::type	format;
+	uint32_t					width;
+	uint32_t					height;
+	std::vector<uint8_t>		data;
+};
+
+bool is_compressed_image_file(const std::wstring& filename);
+
+// Reads DXT1, DXT5 and BC7 blocks from a DDS file, or from a KTX file written top row first. Colors are 
+// expected to be premultiplied with alpha, as they are uploaded as they are.
+compressed_image read_compressed_image(const std::wstring& filename);
+
+// The image as a still frame of compressed blocks, nullptr when the frame factory cannot upload its format.
+std::shared_ptr<core::write_frame> create_compressed_image_frame(const safe_ptr<core::frame_factory>& frame_factory, const void* tag, const compressed_image& image);
+
+// Writes a 32 bit premultiplied bitmap to a DDS file of DXT5 blocks.
+void write_dxt5_image(const std::shared_ptr<FIBITMAP>& bitmap, const std::wstring& filename);
+
+}}
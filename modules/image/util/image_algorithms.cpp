@@ -19,9 +19,16 @@
 * Author: Helge Norberg, helge.norberg@svt.se.com
 */
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <stdint.h>
 #include "../util/image_algorithms.h"
+#include <common/concurrency/parallel_arena.h>
+
+#include <intrin.h>
+
+#include <tbb/parallel_for.h>
 
 namespace caspar { namespace image {
 
@@ -45,4 +52,191 @@ std::vector<std::pair<int, int>> get_line_points(int num_pixels, double angle_ra
 	return std::move(line_points);
 }
 
+void blur(
+	const image_view<bgra_pixel>& src,
+	image_view<bgra_pixel>& dst,
+	const std::vector<std::pair<int, int>> motion_trail_coordinates, 
+	caspar::tweener_t& tweener)
+{
+	int blur_px = motion_trail_coordinates.size();
+	auto tweened_weights_y = get_tweened_values<uint8_t>(tweener, blur_px + 2, 255, 0);
+	tweened_weights_y.pop_back();
+	tweened_weights_y.erase(tweened_weights_y.begin());
+
+	std::vector<int> offsets;
+	BOOST_FOREACH(auto& coordinate, motion_trail_coordinates)
+		offsets.push_back(coordinate.first + src.width() * coordinate.second);
+
+	const int width	= src.width();
+	const int count	= src.width() * src.height();
+	auto src_pixels	= reinterpret_cast<const int*>(src.begin());
+	auto dst_pixels	= dst.begin();
+
+	arena_parallel_for(tbb::blocked_range<int>(0, src.height()), [&](const tbb::blocked_range<int>& r)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		for(int n = r.begin() * width; n < r.end() * width; ++n)
+		{
+			// Sums the weighted channels of 4 bytes as 32 bit lanes.
+			__m128i sum = _mm_unpacklo_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(src_pixels[n]), zero), _mm_set1_epi16(255)), zero);
+			int total_weight = 255;
+
+			for(int i = 0; i < blur_px; ++i)
+			{
+				int other = n + offsets[i];
+
+				if(other < 0 || other >= count)
+					break;
+
+				auto weight = _mm_set1_epi16(tweened_weights_y[i]);
+				sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(src_pixels[other]), zero), weight), zero));
+				total_weight += tweened_weights_y[i];
+			}
+
+			__declspec(align(16)) int channels[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(channels), sum);
+
+			dst_pixels[n] = bgra_pixel(
+				static_cast<uint8_t>(channels[0] / total_weight),
+				static_cast<uint8_t>(channels[1] / total_weight),
+				static_cast<uint8_t>(channels[2] / total_weight),
+				static_cast<uint8_t>(channels[3] / total_weight));
+		}
+	});
+}
+
+struct area_weight
+{
+	int		first;		// Source pixel of the first weight.
+	int		count;
+	int		offset;		// Of the first weight in weights.
+};
+
+// The source pixels every destination pixel of a row or column covers, weighted by the part of it they cover.
+static void get_area_weights(int src_size, int dst_size, std::vector<area_weight>& spans, std::vector<float>& weights)
+{
+	const double scale = static_cast<double>(src_size) / static_cast<double>(dst_size);
+
+	spans.resize(dst_size);
+	weights.clear();
+
+	for(int n = 0; n < dst_size; ++n)
+	{
+		const double begin	= n * scale;
+		const double end	= std::min(static_cast<double>(src_size), (n + 1) * scale);
+
+		auto& span	= spans[n];
+		span.first	= static_cast<int>(begin);
+		span.count	= std::max(1, std::min(src_size, static_cast<int>(std::ceil(end))) - span.first);
+		span.offset	= static_cast<int>(weights.size());
+
+		for(int i = 0; i < span.count; ++i)
+		{
+			const double covered = std::min(end, static_cast<double>(span.first + i + 1)) - std::max(begin, static_cast<double>(span.first + i));
+			weights.push_back(static_cast<float>(std::max(0.0, covered) / scale));
+		}
+	}
+}
+
+void downscale(const image_view<bgra_pixel>& src, image_view<bgra_pixel>& dst)
+{
+	const int src_width	 = src.width();
+	const int dst_width	 = dst.width();
+	const int dst_height = dst.height();
+
+	std::vector<area_weight>	columns, rows;
+	std::vector<float>			column_weights, row_weights;
+	get_area_weights(src_width, dst_width, columns, column_weights);
+	get_area_weights(src.height(), dst_height, rows, row_weights);
+
+	auto src_pixels = reinterpret_cast<const int*>(src.begin());
+	auto dst_pixels = reinterpret_cast<int*>(dst.begin());
+
+	// Every destination row sums the horizontally downscaled source rows it covers, an image sized intermediate 
+	// would be as large as the source is high.
+	arena_parallel_for(tbb::blocked_range<int>(0, dst_height), [&](const tbb::blocked_range<int>& r)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		std::vector<float> sums(dst_width * 4); // Not necessarily 16 byte aligned.
+
+		for(int y = r.begin(); y < r.end(); ++y)
+		{
+			std::fill(sums.begin(), sums.end(), 0.0f);
+
+			const auto& row = rows[y];
+			for(int j = 0; j < row.count; ++j)
+			{
+				auto line			= src_pixels + (row.first + j) * src_width;
+				const auto row_weight = _mm_set1_ps(row_weights[row.offset + j]);
+
+				for(int x = 0; x < dst_width; ++x)
+				{
+					const auto& column = columns[x];
+					auto weight = column_weights.data() + column.offset;
+
+					__m128 sum = _mm_setzero_ps();
+					for(int i = 0; i < column.count; ++i)
+					{
+						auto pixel = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(line[column.first + i]), zero), zero));
+						sum = _mm_add_ps(sum, _mm_mul_ps(pixel, _mm_set1_ps(weight[i])));
+					}
+
+					_mm_storeu_ps(&sums[x*4], _mm_add_ps(_mm_loadu_ps(&sums[x*4]), _mm_mul_ps(sum, row_weight)));
+				}
+			}
+
+			auto out = dst_pixels + y * dst_width;
+			for(int x = 0; x < dst_width; ++x)
+			{
+				auto channels = _mm_cvtps_epi32(_mm_loadu_ps(&sums[x*4]));
+				channels = _mm_packs_epi32(channels, channels);
+				out[x]	 = _mm_cvtsi128_si32(_mm_packus_epi16(channels, channels));
+			}
+		}
+	});
+}
+
+void premultiply(image_view<bgra_pixel>& view_to_modify)
+{
+	auto pixels = reinterpret_cast<uint8_t*>(view_to_modify.begin());
+	const size_t count = view_to_modify.width() * view_to_modify.height();
+
+	arena_parallel_for(tbb::blocked_range<size_t>(0, count, 16384), [&](const tbb::blocked_range<size_t>& r)
+	{
+		const __m128i zero			= _mm_setzero_si128();
+		const __m128i one			= _mm_set1_epi16(1);
+		const __m128i color_mask	= _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+		const __m128i alpha_255		= _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+		// Multiplies 2 pixels of 16 bit channels with their alpha, keeping alpha itself. 
+		// (v + (v >> 8) + 1) >> 8 equals v / 255 for every product of two bytes.
+		auto premultiply2 = [&](__m128i x) -> __m128i
+		{
+			auto alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			alpha = _mm_or_si128(_mm_and_si128(alpha, color_mask), alpha_255);
+			auto v = _mm_mullo_epi16(x, alpha);
+			return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), one), 8);
+		};
+
+		size_t n = r.begin();
+
+		for(; n + 4 <= r.end(); n += 4)
+		{
+			auto xmm0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + n*4));
+			auto lo = premultiply2(_mm_unpacklo_epi8(xmm0, zero));
+			auto hi = premultiply2(_mm_unpackhi_epi8(xmm0, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + n*4), _mm_packus_epi16(lo, hi));
+		}
+
+		for(; n < r.end(); ++n)
+		{
+			int alpha = pixels[n*4+3];
+			for(int c = 0; c < 3; ++c)
+				pixels[n*4+c] = static_cast<uint8_t>(static_cast<int>(pixels[n*4+c]) * alpha / 255);
+		}
+	});
+}
+
 }}	//namespace caspar::image
\ No newline at end of file
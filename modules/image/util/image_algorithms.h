@@ -21,9 +21,12 @@
 
 #pragma once
 
+#include "image_view.h"
+
 #include <common/utility/tweener.h>
 
 #include <cmath>
+#include <vector>
 #include <boost/foreach.hpp>
 
 namespace caspar { namespace image {
@@ -141,6 +144,16 @@ void blur(
 	}
 }
 
+/**
+ * Blur specialized for packed bgra images, vectorized and split across cores.
+ * Gives the same result as the generic blur.
+ */
+void blur(
+	const image_view<bgra_pixel>& src,
+	image_view<bgra_pixel>& dst,
+	const std::vector<std::pair<int, int>> motion_trail_coordinates, 
+	caspar::tweener_t& tweener);
+
 /**
  * Calculate relative x-y coordinates of a straight line with a given angle and
  * a given number of points.
@@ -181,6 +194,22 @@ void blur(
 	blur(src, dst, motion_trail, tweener);
 }
 
+/**
+ * Downscales a packed bgra image to the size of the destination, averaging
+ * every source pixel a destination pixel covers by the area it covers.
+ * Vectorized and split across cores. Premultiplied images stay premultiplied.
+ *
+ * @param src The source view, not smaller than dst in either dimension.
+ * @param dst The destination view.
+ */
+void downscale(const image_view<bgra_pixel>& src, image_view<bgra_pixel>& dst);
+
+/**
+ * Premultiply specialized for packed bgra images, vectorized and split across
+ * cores. Gives the same result as the generic premultiply.
+ */
+void premultiply(image_view<bgra_pixel>& view_to_modify);
+
 /**
  * Premultiply with alpha for each pixel in an ImageView. The modifications is
  * done in place. The pixel type of the ImageView must model the RGBAPixel
@@ -0,0 +1,236 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "image_cache.h"
+
+#include <core/mixer/write_frame.h>
+
+#include <common/concurrency/strand.h>
+#include <common/env.h>
+#include <common/log/log.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/future.hpp>
+
+#include <tbb/mutex.h>
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace caspar { namespace image {
+
+struct image_cache
+{
+	typedef std::pair<std::wstring, std::time_t> key_t;
+
+	struct entry
+	{
+		std::weak_ptr<core::write_frame>	frame;
+		std::shared_ptr<core::write_frame>	retained;
+		std::size_t							size;
+		int64_t								last_use;
+		int64_t								hits;
+
+		entry() : size(0), last_use(0), hits(0){}
+
+		bool in_use() const
+		{
+			auto frame = this->frame.lock();
+			return frame && frame.use_count() > (retained ? 2 : 1);
+		}
+	};
+
+	tbb::mutex				mutex_;
+	std::map<key_t, entry>	entries_;
+	const std::size_t		max_size_;
+	int64_t					use_count_;
+	int64_t					hits_;
+	int64_t					misses_;
+	strand					strand_;
+
+	image_cache()
+		: max_size_(env::properties().get(L"configuration.image.cache-size", 256) * 1024 * 1024)
+		, use_count_(0)
+		, hits_(0)
+		, misses_(0)
+		, strand_(L"image_cache")
+	{
+	}
+
+	static key_t make_key(const std::wstring& filename, const std::wstring& variant)
+	{
+		return key_t(filename + variant, boost::filesystem::last_write_time(boost::filesystem::wpath(filename)));
+	}
+
+	std::shared_ptr<core::write_frame> find(const key_t& key)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = entries_.find(key);
+		if(it == entries_.end())
+			return nullptr;
+
+		auto frame = it->second.frame.lock();
+		if(frame)
+		{
+			++hits_;
+			++it->second.hits;
+			it->second.last_use = ++use_count_;
+		}
+		return frame;
+	}
+
+	boost::unique_future<safe_ptr<core::write_frame>> get_async(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant)
+	{
+		if(auto frame = find(make_key(filename, variant)))
+		{
+			boost::promise<safe_ptr<core::write_frame>> promise;
+			promise.set_value(make_safe_ptr(frame));
+			return promise.get_future();
+		}
+
+		// Decoding is serialized on a strand, requests for an image already being decoded become hits.
+		return strand_.begin_invoke([=]
+		{
+			return get(filename, load, variant);
+		});
+	}
+
+	safe_ptr<core::write_frame> get(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant)
+	{
+		const auto key = make_key(filename, variant);
+
+		if(auto frame = find(key))
+			return make_safe_ptr(frame);
+
+		// Decoded outside of the lock, concurrent loads of the same file are resolved below.
+		auto frame = load();
+		
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto& entry = entries_[key];
+		if(auto existing = entry.frame.lock())
+		{
+			++hits_;
+			entry.last_use = ++use_count_;
+			return make_safe_ptr(existing);
+		}
+
+		++misses_;
+		entry.frame		= frame;
+		entry.retained	= frame;
+		entry.size		= frame->image_data().size();
+		entry.last_use	= ++use_count_;
+		entry.hits		= 0;
+
+		trim();
+
+		return frame;
+	}
+
+	void trim()
+	{
+		std::size_t size = 0;
+		for(auto it = entries_.begin(); it != entries_.end();)
+		{
+			if(it->second.frame.expired())
+				it = entries_.erase(it);
+			else
+				size += (it++)->second.size;
+		}
+
+		while(size > max_size_)
+		{
+			auto lru = entries_.end();
+			for(auto it = entries_.begin(); it != entries_.end(); ++it)
+			{
+				if(it->second.retained && !it->second.in_use() && (lru == entries_.end() || it->second.last_use < lru->second.last_use))
+					lru = it;
+			}
+
+			if(lru == entries_.end())
+				break;
+
+			CASPAR_LOG(trace) << L"[image_cache] Released " << lru->first.first;
+
+			size -= lru->second.size;
+			entries_.erase(lru);
+		}
+	}
+
+	boost::property_tree::wptree info()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		trim();
+
+		boost::property_tree::wptree info;
+		std::size_t size = 0;
+		std::size_t in_use = 0;
+		for(auto it = entries_.begin(); it != entries_.end(); ++it)
+		{
+			boost::property_tree::wptree image;
+			image.add(L"path", it->first.first);
+			image.add(L"bytes", it->second.size);
+			image.add(L"hits", it->second.hits);
+			image.add(L"in-use", it->second.in_use());
+			info.add_child(L"images.image", image);
+
+			size += it->second.size;
+			in_use += it->second.in_use() ? 1 : 0;
+		}
+		info.add(L"count", entries_.size());
+		info.add(L"in-use", in_use);
+		info.add(L"bytes", size);
+		info.add(L"max-bytes", max_size_);
+		info.add(L"hits", hits_);
+		info.add(L"misses", misses_);
+		info.add(L"queue.size", strand_.size());
+		info.add(L"queue.peak-size", strand_.peak_size());
+		return info;
+	}
+
+	static image_cache& instance()
+	{
+		static image_cache cache;
+		return cache;
+	}
+};
+
+safe_ptr<core::write_frame> get_cached_image(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant)
+{
+	return image_cache::instance().get(filename, load, variant);
+}
+
+boost::unique_future<safe_ptr<core::write_frame>> get_cached_image_async(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant)
+{
+	return image_cache::instance().get_async(filename, load, variant);
+}
+
+boost::property_tree::wptree get_image_cache_info()
+{
+	return image_cache::instance().info();
+}
+
+}}
@@ -0,0 +1,51 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+#include <boost/thread/future.hpp>
+
+#include <functional>
+#include <string>
+
+namespace caspar { 
+	
+namespace core {
+	class write_frame;
+}
+
+namespace image {
+
+// Returns the frame for filename shared by every producer currently showing the same version of the file, calling
+// load when there is none. Frames no longer in use are kept, least recently used first out, within 
+// configuration.image.cache-size. Versions of the same file which load differently, such as in a different size, 
+// are told apart by variant.
+safe_ptr<core::write_frame> get_cached_image(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant = L"");
+
+// As get_cached_image, with load running on a background thread.
+boost::unique_future<safe_ptr<core::write_frame>> get_cached_image_async(const std::wstring& filename, const std::function<safe_ptr<core::write_frame>()>& load, const std::wstring& variant = L"");
+
+boost::property_tree::wptree get_image_cache_info();
+
+}}
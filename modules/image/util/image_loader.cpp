@@ -34,8 +34,51 @@
 #include "image_algorithms.h"
 #include "image_view.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace caspar { namespace image {
 
+// Float images, such as EXR renders, hold linear light premultiplied with alpha. Colors are clamped and sRGB 
+// encoded before they are premultiplied again.
+std::shared_ptr<FIBITMAP> convert_float_image(const std::shared_ptr<FIBITMAP>& bitmap)
+{
+	const auto type	  = FreeImage_GetImageType(bitmap.get());
+	const auto width  = FreeImage_GetWidth(bitmap.get());
+	const auto height = FreeImage_GetHeight(bitmap.get());
+
+	auto result = std::shared_ptr<FIBITMAP>(FreeImage_Allocate(width, height, 32), FreeImage_Unload);
+	if(!result)
+		BOOST_THROW_EXCEPTION(std::bad_alloc());
+
+	auto encode = [](float value) -> float
+	{
+		value = std::min(1.0f, std::max(0.0f, value));
+		return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+	};
+
+	for(unsigned int y = 0; y < height; ++y)
+	{
+		auto source = reinterpret_cast<const float*>(FreeImage_GetScanLine(bitmap.get(), y));
+		auto target = FreeImage_GetScanLine(result.get(), y);
+
+		for(unsigned int x = 0; x < width; ++x, target += 4)
+		{
+			const float alpha = type == FIT_RGBAF ? std::min(1.0f, std::max(0.0f, source[3])) : 1.0f;
+			const float scale = alpha > 0.0f ? 1.0f / alpha : 0.0f;
+
+			target[FI_RGBA_RED]		= static_cast<BYTE>(encode(source[0] * scale) * alpha * 255.0f + 0.5f);
+			target[FI_RGBA_GREEN]	= static_cast<BYTE>(encode(source[1] * scale) * alpha * 255.0f + 0.5f);
+			target[FI_RGBA_BLUE]	= static_cast<BYTE>(encode(source[2] * scale) * alpha * 255.0f + 0.5f);
+			target[FI_RGBA_ALPHA]	= static_cast<BYTE>(alpha * 255.0f + 0.5f);
+
+			source += type == FIT_RGBAF ? 4 : 3;
+		}
+	}
+
+	return result;
+}
+
 std::shared_ptr<FIBITMAP> load_image(const std::wstring& filename)
 {
 	if(!boost::filesystem::exists(filename))
@@ -50,6 +93,11 @@ std::shared_ptr<FIBITMAP> load_image(const std::wstring& filename)
 		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Unsupported image format."));
 		
 	auto bitmap = std::shared_ptr<FIBITMAP>(FreeImage_LoadU(fif, filename.c_str(), 0), FreeImage_Unload);
+	if(!bitmap)
+		BOOST_THROW_EXCEPTION(file_read_error() << boost::errinfo_file_name(narrow(filename)));
+
+	if(FreeImage_GetImageType(bitmap.get()) == FIT_RGBAF || FreeImage_GetImageType(bitmap.get()) == FIT_RGBF)
+		return convert_float_image(bitmap);
 		  
 	if(FreeImage_GetBPP(bitmap.get()) != 32)
 	{
@@ -93,4 +141,27 @@ std::shared_ptr<FIBITMAP> load_png_from_memory(const void* memory_location, size
 	return bitmap;
 }
 
+std::shared_ptr<FIBITMAP> downscale_image(const std::shared_ptr<FIBITMAP>& bitmap, unsigned int max_width, unsigned int max_height)
+{
+	const auto width  = FreeImage_GetWidth(bitmap.get());
+	const auto height = FreeImage_GetHeight(bitmap.get());
+
+	// Each dimension on its own, stills are stretched to the frame unless they are transformed.
+	const auto target_width  = max_width  > 0 ? std::min(width, max_width)   : width;
+	const auto target_height = max_height > 0 ? std::min(height, max_height) : height;
+
+	if(target_width == width && target_height == height)
+		return bitmap;
+
+	auto result = std::shared_ptr<FIBITMAP>(FreeImage_Allocate(target_width, target_height, 32), FreeImage_Unload);
+	if(!result)
+		BOOST_THROW_EXCEPTION(std::bad_alloc());
+
+	image_view<bgra_pixel> source(FreeImage_GetBits(bitmap.get()), width, height);
+	image_view<bgra_pixel> target(FreeImage_GetBits(result.get()), target_width, target_height);
+	downscale(source, target);
+
+	return result;
+}
+
 }}
\ No newline at end of file
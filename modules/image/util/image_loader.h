@@ -32,4 +32,7 @@ std::shared_ptr<FIBITMAP> load_image(const std::string& filename);
 std::shared_ptr<FIBITMAP> load_image(const std::wstring& filename);
 std::shared_ptr<FIBITMAP> load_png_from_memory(const void* memory_location, size_t size);
 
+// A 32 bit bitmap downscaled to fit within the size, or the bitmap itself when it already does. A size of 0 is unlimited.
+std::shared_ptr<FIBITMAP> downscale_image(const std::shared_ptr<FIBITMAP>& bitmap, unsigned int max_width, unsigned int max_height);
+
 }}
@@ -30,16 +30,23 @@
 #include <common/diagnostics/graph.h>
 #include <common/memory/memclr.h>
 #include <common/memory/memcpy.h>
+#include <common/memory/pixel_kernels.h>
 
 #include <core/parameters/parameters.h>
 #include <core/consumer/frame_consumer.h>
 #include <core/mixer/read_frame.h>
 #include <core/video_format.h>
 
+#include <tbb/atomic.h>
+#include <tbb/cache_aligned_allocator.h>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 #include <boost/timer.hpp>
 
+#include <array>
+
 #if defined(_MSC_VER)
 #pragma warning (push)
 #pragma warning (disable : 4244)
@@ -71,7 +78,8 @@ namespace caspar {
 		{
 			if (!ndi_lib)
 				BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(" NDI library not loaded"));
-			NDIlib_send_create_t NDI_send_create_desc = { ndi_name.c_str(), groups.c_str(), true, false };
+			// Not clocked by the SDK, frames are sent as the channel produces them.
+			NDIlib_send_create_t NDI_send_create_desc = { ndi_name.c_str(), groups.c_str(), false, false };
 			return ndi_lib->NDIlib_send_create(&NDI_send_create_desc);
 		}
 
@@ -107,7 +115,11 @@ namespace caspar {
 			const NDIlib_v2*												ndi_lib_;
 			const NDIlib_send_instance_t									ndi_send_;
 			executor														executor_;
-			std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>     send_frame_buffer_;
+			// The frame given to NDIlib_send_send_video_async must stay valid until the next call, conversions alternate between these.
+			std::array<std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>, 2> send_frame_buffers_;
+			size_t															next_send_frame_buffer_;
+			std::shared_ptr<core::read_frame>								sent_frame_;
+			bool															warned_packing_;
 			int																input_audio_channel_count_;
 			std::unique_ptr<SwrContext, std::function<void(SwrContext*)>>	swr_;
 			std::unique_ptr<SwsContext, std::function<void(SwsContext*)>>	sws_;
@@ -134,8 +146,11 @@ namespace caspar {
 				, input_audio_channel_count_(channel_layout.num_channels)
 				, sws_(is_alpha ? nullptr : sws_getContext(format_desc.width, format_desc.height, AV_PIX_FMT_BGRA, format_desc.width, format_desc.height, AV_PIX_FMT_UYVY422, SWS_POINT, NULL, NULL, NULL), [](SwsContext * ctx) { sws_freeContext(ctx); })
 				, swr_(create_swr(format_desc_, channel_layout_, input_audio_channel_count_), [](SwrContext * ctx) { swr_free(&ctx); })
-				, send_frame_buffer_(is_alpha ? 0 : av_image_get_buffer_size(AV_PIX_FMT_BGRA, format_desc.width, format_desc.height, 16))
+				, next_send_frame_buffer_(0)
+				, warned_packing_(false)
 		{
+				BOOST_FOREACH(auto& buffer, send_frame_buffers_)
+					buffer.resize(av_image_get_buffer_size(AV_PIX_FMT_BGRA, format_desc.width, format_desc.height, 16));
 				current_encoding_delay_ = 0;
 				executor_.set_capacity(1);
 				graph_->set_text(print());
@@ -143,8 +158,7 @@ namespace caspar {
 				graph_->set_color("video-send-time", diagnostics::color(1.0f, 1.0f, 0.1f));
 				graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));
 				graph_->set_color("dropped-frame", diagnostics::color(1.0f, 0.1f, 0.1f));
-				if (!is_alpha)
-					graph_->set_color("frame-convert-time", diagnostics::color(0.8f, 0.6f, 0.9f));
+				graph_->set_color("frame-convert-time", diagnostics::color(0.8f, 0.6f, 0.9f));
 				diagnostics::register_graph(graph_);
 			}
 
@@ -153,7 +167,10 @@ namespace caspar {
 				executor_.stop();
 				executor_.join();
 				if (ndi_send_)
+				{
+					ndi_lib_->NDIlib_send_send_video_async(ndi_send_, nullptr); // Waits until the SDK has released the last frame.
 					ndi_lib_->NDIlib_send_destroy(ndi_send_);
+				}
 				CASPAR_LOG(info) << print() << L" Successfully Uninitialized.";
 			}
 
@@ -199,29 +216,72 @@ namespace caspar {
 			void send_video(const safe_ptr<core::read_frame>& frame)
 			{
 				std::unique_ptr<NDIlib_video_frame_t> ndi_frame(create_video_frame(format_desc_, is_alpha_));
-				if (is_alpha_)
+				const int width = format_desc_.width;
+				const int height = format_desc_.height;
+				auto packed = frame->packing() == core::output_packing::uyvy && frame->split() == core::output_split::none 
+					? frame->packed_image_data() 
+					: boost::iterator_range<const uint8_t*>();
+
+				if (!packed.empty() && !is_alpha_)
+				{
+					// Packed by the mixer, sent as it is.
+					video_send_timer_.restart();
+					ndi_frame->p_data = const_cast<uint8_t*>(packed.begin());
+				}
+				else if (!packed.empty())
+				{
+					// UYVA, the packed image followed by the alpha plane taken from the bgra image.
+					frame_convert_timer_.restart();
+					auto& buffer = next_send_frame_buffer();
+					auto alpha = buffer.data() + width*height*2;
+					auto bgra = frame->image_data().begin();
+					fast_memcpy(buffer.data(), packed.begin(), width*height*2);
+					extract_alpha(alpha, bgra, width*height);
+					graph_->set_value("frame-convert-time", frame_convert_timer_.elapsed() * format_desc_.fps * 0.5f);
+					ndi_frame->FourCC = NDIlib_FourCC_type_UYVA;
+					ndi_frame->line_stride_in_bytes = width*2;
+					ndi_frame->p_data = buffer.data();
+					video_send_timer_.restart();
+				}
+				else if (is_alpha_)
 				{
 					video_send_timer_.restart();
 					ndi_frame->p_data = const_cast<uint8_t*>(frame->image_data().begin());
 				}
 				else  //colorspace conversion
 				{
+					if (!warned_packing_)
+					{
+						CASPAR_LOG(info) << print() << L" Converting to uyvy on the cpu, set output-packing to uyvy on the channel to convert on the gpu.";
+						warned_packing_ = true;
+					}
 					frame_convert_timer_.restart();
+					auto& buffer = next_send_frame_buffer();
 					uint8_t * src_data[AV_NUM_DATA_POINTERS];
 					int src_linesize[AV_NUM_DATA_POINTERS];
 					uint8_t * dest_data[AV_NUM_DATA_POINTERS];
 					int dst_linesize[AV_NUM_DATA_POINTERS];
 					av_image_fill_arrays(src_data, src_linesize, frame->image_data().begin(), AV_PIX_FMT_BGRA, format_desc_.width, format_desc_.height, 1);
-					av_image_fill_arrays(dest_data, dst_linesize, &send_frame_buffer_.front(), AV_PIX_FMT_UYVY422, format_desc_.width, format_desc_.height, 16);
+					av_image_fill_arrays(dest_data, dst_linesize, buffer.data(), AV_PIX_FMT_UYVY422, format_desc_.width, format_desc_.height, 16);
 					sws_scale(sws_.get(), src_data, src_linesize, 0, format_desc_.height, dest_data, dst_linesize);
 					graph_->set_value("frame-convert-time", frame_convert_timer_.elapsed() * format_desc_.fps * 0.5f);
-					ndi_frame->p_data = &send_frame_buffer_.front();
+					ndi_frame->p_data = buffer.data();
 					video_send_timer_.restart();
 				}
-				ndi_lib_->NDIlib_send_send_video(ndi_send_, ndi_frame.get());
+				ndi_lib_->NDIlib_send_send_video_async(ndi_send_, ndi_frame.get());
+
+				// The SDK has released the previous frame, this one is kept until the next call.
+				sent_frame_ = frame;
 				graph_->set_value("video-send-time", video_send_timer_.elapsed() * format_desc_.fps * 0.5f);
 			}
 
+			std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>& next_send_frame_buffer()
+			{
+				auto& buffer = send_frame_buffers_[next_send_frame_buffer_];
+				next_send_frame_buffer_ = (next_send_frame_buffer_ + 1) % send_frame_buffers_.size();
+				return buffer;
+			}
+
 			void send_audio(const safe_ptr<core::read_frame>& frame)
 			{
 				if (input_audio_channel_count_ != frame->num_channels())
@@ -230,6 +290,21 @@ namespace caspar {
 					input_audio_channel_count_ = frame->num_channels();
 					CASPAR_LOG(trace) << print() << L" Replaced audio resampler.";
 				}
+				if (frame->num_channels() == channel_layout_.num_channels)
+				{
+					// Same channels, the float samples converted once on the frame are sent as they are.
+					auto samples = frame->audio_data_float();
+
+					NDIlib_audio_frame_interleaved_32f_t audio_frame;
+					audio_frame.sample_rate = format_desc_.audio_sample_rate;
+					audio_frame.no_channels = channel_layout_.num_channels;
+					audio_frame.no_samples	= static_cast<int>(samples.size()) / std::max(1, channel_layout_.num_channels);
+					audio_frame.timecode	= NDIlib_send_timecode_synthesize;
+					audio_frame.p_data		= const_cast<float*>(samples.begin());
+					ndi_lib_->NDIlib_util_send_send_audio_interleaved_32f(ndi_send_, &audio_frame);
+					return;
+				}
+
 				auto audio_frame = create_audio_frame(channel_layout_, frame->multichannel_view().num_samples(), format_desc_.audio_sample_rate);
 				const uint8_t* in[] = { reinterpret_cast<const uint8_t*>(frame->audio_data().begin()) };
 				int converted_sample_count = swr_convert(swr_.get(),
@@ -275,7 +350,7 @@ namespace caspar {
 
 			virtual bool has_synchronization_clock() const override
 			{
-				return consumer_ && is_blocking_;
+				return false; // The SDK does not clock the sending.
 			}
 
 			virtual size_t buffer_depth() const override
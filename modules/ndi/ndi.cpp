@@ -23,11 +23,14 @@
 #include "util/ndi_util.h"
 #include <core/consumer/frame_consumer.h>
 #include <core/producer/frame_producer.h>
+#include <core/parameters/parameters.h>
 #include "consumer/ndi_consumer.h"
 #include "producer/ndi_producer.h"
 #include <common/log/log.h>
 #include <common/utility/string.h>
 
+#include <boost/algorithm/string/predicate.hpp>
+
 
 namespace caspar {
 	namespace ndi {
@@ -48,7 +51,9 @@ namespace caspar {
 			}
 			ndi_lib->NDIlib_destroy();
 			core::register_consumer_factory(create_consumer);
-			core::register_producer_factory([](const safe_ptr<core::frame_factory>& factory, const core::parameters& params) { return ndi::create_producer(factory, params); });
+			core::register_producer_factory(
+					[](const safe_ptr<core::frame_factory>& factory, const core::parameters& params) { return ndi::create_producer(factory, params); },
+					[](const core::parameters& params) { return boost::iequals(params.at(0), L"NDI"); });
 
 		}
 
@@ -1,4 +1,4 @@
-﻿/*
+﻿﻿/*
 * Copyright 2013 Sveriges Television AB http://casparcg.com/
 *
 * This file is part of CasparCG (www.casparcg.com).
@@ -31,27 +31,37 @@
 
 #include <common/concurrency/executor.h>
 #include <common/diagnostics/graph.h>
+#include <common/env.h>
 #include <common/exception/exceptions.h>
 #include <common/exception/win32_exception.h>
 #include <common/log/log.h>
+#include <common/memory/memcpy.h>
+#include <common/memory/pixel_kernels.h>
 #include <common/utility/string.h>
+#include <common/concurrency/parallel_arena.h>
 
 #include <core/producer/frame_producer.h>
 #include <core/parameters/parameters.h>
 #include <core/monitor/monitor.h>
 #include <core/mixer/write_frame.h>
+#include <core/producer/clock_bridge.h>
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/frame_factory.h>
 
+#include <tbb/atomic.h>
 #include <tbb/concurrent_queue.h>
+#include <tbb/parallel_for.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 #include <boost/timer.hpp>
 #include <boost/circular_buffer.hpp>
 #include <boost/rational.hpp>
+#include <boost/range/algorithm/rotate.hpp>
 #include <queue>
 
+#include <intrin.h>
+
 #if defined(_MSC_VER)
 #pragma warning (push)
 #pragma warning (disable : 4244)
@@ -72,7 +82,16 @@ namespace caspar { namespace ndi {
 
 	typedef std::unique_ptr<void, std::function<void(NDIlib_recv_instance_t)>> ndi_receiver_ptr_t;
 	typedef std::unique_ptr<SwrContext, std::function<void(SwrContext*)>> swr_ptr_t;
-	typedef std::pair<int64_t, std::shared_ptr<core::audio_buffer>> audio_buffer_item_t;
+
+	// Received audio, int32 for the muxer or float with full scale 1.0 when the frames skip it.
+	struct audio_buffer_item_t
+	{
+		int64_t									timecode;
+		std::shared_ptr<core::audio_buffer>		samples;
+		std::shared_ptr<core::audio_buffer_ps>	float_samples;
+
+		explicit audio_buffer_item_t(int64_t timecode) : timecode(timecode){}
+	};
 	const std::pair<int64_t, std::shared_ptr<AVFrame>> empty_video(0, nullptr);
 
 	swr_ptr_t create_swr(const int out_sample_rate, const int out_nb_channels, const int in_nb_channels, const int in_sample_rate)
@@ -97,6 +116,39 @@ namespace caspar { namespace ndi {
 		return swr_ptr_t(swr, [](SwrContext* ctx) { if (ctx) swr_free(&ctx); });
 	}
 
+	// Converts planar float audio to interleaved 32 bit samples in one pass, four samples of a channel at a time.
+	void convert_audio(const NDIlib_audio_frame_t& frame, int32_t* dest)
+	{
+		const auto scale	= _mm_set1_ps(2147483648.0f);
+		const auto max		= _mm_set1_ps(2147483520.0f); // Largest float below 2^31, converts without overflow.
+		const auto min		= _mm_set1_ps(-2147483648.0f);
+		const int channels	= frame.no_channels;
+
+		for (int channel = 0; channel < channels; ++channel)
+		{
+			auto src = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(frame.p_data) + channel * frame.channel_stride_in_bytes);
+			auto dst = dest + channel;
+			int n = 0;
+			for (; n + 4 <= frame.no_samples; n += 4)
+			{
+				auto value = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + n), scale), min), max);
+				auto samples = _mm_cvtps_epi32(value);
+				dst[(n + 0) * channels] = _mm_cvtsi128_si32(samples);
+				dst[(n + 1) * channels] = _mm_cvtsi128_si32(_mm_shuffle_epi32(samples, _MM_SHUFFLE(1, 1, 1, 1)));
+				dst[(n + 2) * channels] = _mm_cvtsi128_si32(_mm_shuffle_epi32(samples, _MM_SHUFFLE(2, 2, 2, 2)));
+				dst[(n + 3) * channels] = _mm_cvtsi128_si32(_mm_shuffle_epi32(samples, _MM_SHUFFLE(3, 3, 3, 3)));
+			}
+			for (; n < frame.no_samples; ++n)
+				dst[n * channels] = _mm_cvtss_si32(_mm_min_ss(_mm_max_ss(_mm_mul_ss(_mm_load_ss(src + n), scale), min), max));
+		}
+	}
+
+	// Unpacks uyvy into the planes of a ycbcr 4:2:2 frame.
+	void unpack_uyvy(const uint8_t* src, int line_stride, int width, int height, core::write_frame& frame)
+	{
+		caspar::unpack_uyvy(src, line_stride, width, height, frame.image_data(0).begin(), frame.image_data(1).begin(), frame.image_data(2).begin());
+	}
+
 class ndi_producer : public core::frame_producer
 {	
 	core::monitor::subject																	monitor_subject_;
@@ -121,9 +173,19 @@ class ndi_producer : public core::frame_producer
 			
 	safe_ptr<core::frame_factory>															frame_factory_;
 	tbb::concurrent_bounded_queue<safe_ptr<core::basic_frame>>								frame_buffer_;
+	std::unique_ptr<core::clock_bridge>														clock_bridge_; // Instead of frame_buffer_ when recovering the source clock.
 	std::queue<audio_buffer_item_t>															audio_buffer_;
 	std::pair<int64_t, std::shared_ptr<AVFrame>>											video_;
 
+	// Frames matching the channel skip the muxer, their audio is taken from audio_fifo_ with the channel cadence.
+	const bool																				allow_direct_;
+	bool																					is_direct_;
+	tbb::atomic<int>																		hints_;
+	std::queue<safe_ptr<core::write_frame>>													direct_frames_;
+	int64_t																					direct_timecode_;
+	core::audio_buffer_ps																	audio_fifo_;
+	std::vector<size_t>																		audio_cadence_;
+
 	std::vector<float>																		audio_conversion_buffer_;
 	const int64_t																			video_frame_duration_; // in 100 ns
 	int64_t																					frame_pts_;
@@ -149,7 +211,12 @@ public:
 		, video_frame_duration_(static_cast<int64_t>(format_desc.duration) * 10000000 / format_desc.time_scale)
 		, frame_pts_(0)
 		, video_(0, nullptr)
+		, allow_direct_(env::properties().get(L"configuration.ndi.direct-capture", true))
+		, is_direct_(false)
+		, direct_timecode_(0)
+		, audio_cadence_(frame_factory->get_video_format_desc().audio_cadence)
 	{		
+		hints_ = 0;
 		if (!ndi_lib_)
 			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(" NDI library not loaded"));
 
@@ -160,8 +227,11 @@ public:
 		graph_->set_color("empty-audio", diagnostics::color(0.3f, 0.9f, 1.0f));
 		graph_->set_color("output-buffer", diagnostics::color(0.0f, 1.0f, 0.0f));
 		graph_->set_color("audio-sync-buffer", diagnostics::color(0.3f, 0.3f, 1.0f));
+		graph_->set_color("dropped-audio", diagnostics::color(1.0f, 0.5f, 0.0f));
 		graph_->set_text(print());
 		diagnostics::register_graph(graph_);
+		if (env::properties().get(L"configuration.ndi.clock-recovery", true))
+			clock_bridge_.reset(new core::clock_bridge(frame_factory->get_video_format_desc(), audio_channel_layout, buffer_depth, graph_));
 		executor_.begin_invoke([this]() { receiver_proc(); });
 		CASPAR_LOG(info) << print() << L" successfully initialized.";
 	}
@@ -215,15 +285,7 @@ public:
 			if (!muxer_)
 				return;
 			while (auto frame = muxer_->poll())
-			{
-				auto safe_frame = make_safe_ptr(frame);
-				while (!frame_buffer_.try_push(safe_frame))
-				{
-					auto dummy = core::basic_frame::empty();
-					frame_buffer_.try_pop(dummy);
-					graph_->set_tag("dropped-frame");
-				}
-			}
+				push_frame(make_safe_ptr(frame));
 		}
 		catch (...)
 		{
@@ -241,17 +303,11 @@ public:
 		case NDIlib_frame_type_video:
 			if (video_.first) //we already have unprocessed frame received
 				add_silent_audio();
-			process_received_video(&video_frame);
 			ensure_muxer(boost::rational<int>(video_frame.frame_rate_N, video_frame.frame_rate_D));
-			ndi_lib_->NDIlib_recv_free_video(ndi_receive_.get(), &video_frame);
+			process_received_video(video_frame); // Frees the NDI frame.
 			break;
 		case NDIlib_frame_type_audio:
-			NDIlib_audio_frame_interleaved_32f_t interleaved_frame;
-			if (audio_conversion_buffer_.size() < static_cast<size_t>(audio_frame.no_samples * audio_frame.no_channels))
-				audio_conversion_buffer_.resize(audio_frame.no_samples * audio_frame.no_channels);
-			interleaved_frame.p_data = audio_conversion_buffer_.data();
-			ndi_lib_->NDIlib_util_audio_to_interleaved_32f(&audio_frame, &interleaved_frame);
-			queue_received_audio(&interleaved_frame);
+			queue_received_audio(audio_frame);
 			ndi_lib_->NDIlib_recv_free_audio(ndi_receive_.get(), &audio_frame);
 			break;
 		case NDIlib_frame_type_error:
@@ -264,14 +320,57 @@ public:
 		sync_and_send_to_muxer();
 	}
 
-	void process_received_video(NDIlib_video_frame_t * ndi_video)
+	bool can_capture_direct(const NDIlib_video_frame_t& ndi_video) const
+	{
+		if (!allow_direct_ || (hints_ & core::frame_producer::DEINTERLACE_HINT))
+			return false;
+
+		if (ndi_video.FourCC != NDIlib_FourCC_type_UYVY && ndi_video.FourCC != NDIlib_FourCC_type_BGRA && ndi_video.FourCC != NDIlib_FourCC_type_RGBA)
+			return false;
+
+		auto channel_format = frame_factory_->get_video_format_desc();
+		auto interlaced = ndi_video.frame_format_type == NDIlib_frame_format_type_interleaved;
+
+		return ndi_video.xres == static_cast<int>(channel_format.width)
+			&& ndi_video.yres == static_cast<int>(channel_format.height)
+			&& static_cast<int64_t>(ndi_video.frame_rate_N) * channel_format.duration == static_cast<int64_t>(ndi_video.frame_rate_D) * channel_format.time_scale
+			&& interlaced == (channel_format.field_mode != core::field_mode::progressive);
+	}
+
+	void process_received_video(const NDIlib_video_frame_t& ndi_video)
 	{
 		graph_->set_value("tick-time", tick_timer_.elapsed()*format_desc_.fps*0.5);
 		tick_timer_.restart();
-		std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [](AVFrame* frame) {av_frame_free(&frame); });
-		av_frame->data[0] = ndi_video->p_data;
-		av_frame->linesize[0] = ndi_video->line_stride_in_bytes;
-		switch (ndi_video->FourCC)
+
+		auto direct = can_capture_direct(ndi_video);
+		if (direct != is_direct_)
+		{
+			CASPAR_LOG(info) << print() << (direct ? L" Source matches the channel, receiving directly." : L" Source needs conversion, receiving through the muxer.");
+			is_direct_ = direct;
+		}
+
+		if (is_direct_)
+		{
+			// Copied once into the host buffer of the frame, the NDI frame is returned right away.
+			auto write = create_direct_frame(ndi_video);
+			ndi_lib_->NDIlib_recv_free_video(ndi_receive_.get(), &ndi_video);
+			direct_frames_.push(write);
+			direct_timecode_ = ndi_video.timecode;
+			return;
+		}
+
+		// The muxer reads the NDI buffer, it is returned together with the AVFrame.
+		auto lib = ndi_lib_;
+		auto receiver = ndi_receive_.get();
+		auto ndi_frame = ndi_video;
+		std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [lib, receiver, ndi_frame](AVFrame* frame) mutable
+		{
+			lib->NDIlib_recv_free_video(receiver, &ndi_frame);
+			av_frame_free(&frame); 
+		});
+		av_frame->data[0] = ndi_video.p_data;
+		av_frame->linesize[0] = ndi_video.line_stride_in_bytes;
+		switch (ndi_video.FourCC)
 		{
 		case NDIlib_FourCC_type_UYVY:
 			av_frame->format = AV_PIX_FMT_UYVY422;
@@ -289,22 +388,58 @@ public:
 			av_frame->format = AV_PIX_FMT_RGB0;
 			break;
 		default:
-			CASPAR_LOG(warning) << print() << L" Invalid format of NDI frame (" << ndi_video->FourCC << L").";
+			CASPAR_LOG(warning) << print() << L" Invalid format of NDI frame (" << ndi_video.FourCC << L").";
 			return;
 		}
-		av_frame->format = ndi_video->FourCC == NDIlib_FourCC_type_UYVY ? AV_PIX_FMT_UYVY422 : AV_PIX_FMT_BGRA;
-		av_frame->width = ndi_video->xres;
-		av_frame->height = ndi_video->yres;
+		av_frame->width = ndi_video.xres;
+		av_frame->height = ndi_video.yres;
 		av_frame->pict_type = AV_PICTURE_TYPE_I;
-		av_frame->interlaced_frame = ndi_video->frame_format_type == NDIlib_frame_format_type_interleaved ? 1 : 0;
+		av_frame->interlaced_frame = ndi_video.frame_format_type == NDIlib_frame_format_type_interleaved ? 1 : 0;
 		av_frame->top_field_first = av_frame->interlaced_frame;
 		av_frame->pts = frame_pts_++;
-		video_ = std::make_pair(ndi_video->timecode, av_frame);
+		video_ = std::make_pair(ndi_video.timecode, av_frame);
+	}
+
+	safe_ptr<core::write_frame> create_direct_frame(const NDIlib_video_frame_t& ndi_video)
+	{
+		const int width = ndi_video.xres;
+		const int height = ndi_video.yres;
+
+		core::pixel_format_desc desc;
+		if (ndi_video.FourCC == NDIlib_FourCC_type_UYVY)
+		{
+			desc.pix_fmt = core::pixel_format::ycbcr;
+			desc.planes.push_back(core::pixel_format_desc::plane(width,	height, 1));
+			desc.planes.push_back(core::pixel_format_desc::plane(width/2, height, 1));
+			desc.planes.push_back(core::pixel_format_desc::plane(width/2, height, 1));
+		}
+		else
+		{
+			desc.pix_fmt = ndi_video.FourCC == NDIlib_FourCC_type_BGRA ? core::pixel_format::bgra : core::pixel_format::rgba;
+			desc.planes.push_back(core::pixel_format_desc::plane(width, height, 4));
+		}
+
+		auto write = frame_factory_->create_frame(this, desc, audio_channel_layout_);
+		if (ndi_video.FourCC == NDIlib_FourCC_type_UYVY)
+			unpack_uyvy(ndi_video.p_data, ndi_video.line_stride_in_bytes, width, height, *write);
+		else if (ndi_video.line_stride_in_bytes == width*4)
+			fast_memcpy(write->image_data(0).begin(), ndi_video.p_data, width*height*4);
+		else
+		{
+			auto dest = write->image_data(0).begin();
+			arena_parallel_for(tbb::blocked_range<int>(0, height), [&](const tbb::blocked_range<int>& r)
+			{
+				for (int row = r.begin(); row != r.end(); ++row)
+					std::memcpy(dest + row*width*4, ndi_video.p_data + row*ndi_video.line_stride_in_bytes, width*4);
+			});
+		}
+		write->set_type(frame_factory_->get_video_format_desc().field_mode);
+		return write;
 	}
 
 	void ensure_muxer(const boost::rational<int> in_frame_rate)
 	{
-		if (!muxer_ || in_frame_rate_ != in_frame_rate_)
+		if (!muxer_ || in_frame_rate_ != in_frame_rate)
 		{
 			in_frame_rate_ = in_frame_rate;
 			muxer_.reset(new ffmpeg::frame_muxer(in_frame_rate_, frame_factory_, false, audio_channel_layout_, ""));
@@ -322,13 +457,14 @@ public:
 
 	void sync_and_send_to_muxer()
 	{
+		if (!direct_frames_.empty())
+			send_direct_frames();
 		if (!video_.second)
 			return;
 		muxer_->push(video_.second);
-		audio_buffer_item_t audio;
 		while (!audio_buffer_.empty())
 		{
-			int64_t frame_timecode = audio_buffer_.front().first;
+			int64_t frame_timecode = audio_buffer_.front().timecode;
 			if (video_.first)
 			{
 				if (frame_timecode > video_.first)
@@ -336,49 +472,199 @@ public:
 				if (frame_timecode <= video_.first)
 				{
 					if (frame_timecode > video_.first - video_frame_duration_)
-						muxer_->push(audio_buffer_.front().second);
+						muxer_->push(int_samples(audio_buffer_.front()));
 					audio_buffer_.pop();
 				}
 			}
 			else
 			{
-				muxer_->push(audio_buffer_.front().second);
+				muxer_->push(int_samples(audio_buffer_.front()));
 				audio_buffer_.pop();
 			}
 		}
 		video_ = empty_video;
 	}
 
-	void queue_received_audio(NDIlib_audio_frame_interleaved_32f_t * ndi_audio)
+	void send_direct_frames()
 	{
-		if (!swr_ || ndi_audio->sample_rate != in_audio_sample_rate_ || ndi_audio->no_channels != in_audio_nb_channels_)
+		if (clock_bridge_)
+		{
+			// The audio went to the bridge as it was received.
+			while (!audio_buffer_.empty())
+				audio_buffer_.pop();
+			while (!direct_frames_.empty())
+			{
+				auto write = direct_frames_.front();
+				direct_frames_.pop();
+				write->commit();
+				push_frame(write);
+			}
+			return;
+		}
+
+		// Audio up to the latest frame goes into the fifo, older than the first pending frame is dropped.
+		auto first_timecode = direct_timecode_ - video_frame_duration_ * static_cast<int64_t>(direct_frames_.size());
+		while (!audio_buffer_.empty() && audio_buffer_.front().timecode < direct_timecode_ + video_frame_duration_)
 		{
-			swr_ = create_swr(format_desc_.audio_sample_rate, audio_channel_layout_.num_channels, ndi_audio->no_channels, ndi_audio->sample_rate);
-			in_audio_nb_channels_ = ndi_audio->no_channels;
-			in_audio_sample_rate_ = ndi_audio->sample_rate;
+			if (audio_buffer_.front().timecode > first_timecode)
+				append_float_samples(audio_buffer_.front());
+			audio_buffer_.pop();
+		}
+
+		const auto channels = audio_channel_layout_.num_channels;
+		while (!direct_frames_.empty())
+		{
+			const auto samples = audio_cadence_.front() * channels;
+			if (audio_fifo_.size() < samples)
+			{
+				// Audio lags up to two frames behind, after that the frame is sent with silence.
+				if (direct_frames_.size() < 3)
+					break;
+				audio_fifo_.resize(samples, 0.0f);
+				graph_->set_tag("empty-audio");
+			}
+
+			auto write = direct_frames_.front();
+			direct_frames_.pop();
+			write->audio_data_float().assign(audio_fifo_.begin(), audio_fifo_.begin() + samples);
+			audio_fifo_.erase(audio_fifo_.begin(), audio_fifo_.begin() + samples);
+			boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
+			write->commit();
+			push_frame(write);
+		}
+
+		// Never let the audio drift more than a few frames ahead of the video.
+		const auto max_samples = audio_cadence_.front() * channels * 4;
+		if (audio_fifo_.size() > max_samples)
+		{
+			audio_fifo_.erase(audio_fifo_.begin(), audio_fifo_.end() - max_samples);
+			graph_->set_tag("dropped-audio");
+		}
+		graph_->set_value("audio-sync-buffer", static_cast<float>(audio_fifo_.size()) / static_cast<float>(max_samples));
+	}
+
+	void push_frame(const safe_ptr<core::basic_frame>& frame)
+	{
+		if (clock_bridge_)
+		{
+			clock_bridge_->push_video(frame);
+			return;
+		}
+
+		while (!frame_buffer_.try_push(frame))
+		{
+			auto dummy = core::basic_frame::empty();
+			frame_buffer_.try_pop(dummy);
+			graph_->set_tag("dropped-frame");
+		}
+	}
+
+	// Muxer input for audio that was queued as float.
+	std::shared_ptr<core::audio_buffer> int_samples(const audio_buffer_item_t& item)
+	{
+		if (item.samples)
+			return item.samples;
+
+		auto& source = *item.float_samples;
+		auto samples = std::make_shared<core::audio_buffer>(source.size());
+		for (size_t n = 0; n < source.size(); ++n)
+			(*samples)[n] = static_cast<int32_t>(std::min(std::max(source[n] * 2147483648.0f, -2147483648.0f), 2147483520.0f));
+		return samples;
+	}
+
+	void append_float_samples(const audio_buffer_item_t& item)
+	{
+		if (item.float_samples)
+		{
+			audio_fifo_.insert(audio_fifo_.end(), item.float_samples->begin(), item.float_samples->end());
+			return;
+		}
+
+		auto offset = audio_fifo_.size();
+		audio_fifo_.resize(offset + item.samples->size());
+		core::audio_32_to_float(item.samples->data(), audio_fifo_.data() + offset, item.samples->size());
+	}
+
+	void queue_received_audio(const NDIlib_audio_frame_t& ndi_audio)
+	{
+		audio_buffer_item_t item(ndi_audio.timecode);
+		if (ndi_audio.sample_rate == static_cast<int>(format_desc_.audio_sample_rate) && ndi_audio.no_channels == audio_channel_layout_.num_channels)
+		{
+			if (is_direct_)
+			{
+				// The frames skip the muxer, the float samples are mixed as they are.
+				item.float_samples = std::make_shared<core::audio_buffer_ps>(ndi_audio.no_samples * ndi_audio.no_channels);
+				NDIlib_audio_frame_interleaved_32f_t interleaved_frame;
+				interleaved_frame.p_data = item.float_samples->data();
+				ndi_lib_->NDIlib_util_audio_to_interleaved_32f(&ndi_audio, &interleaved_frame);
+			}
+			else
+			{
+				item.samples = std::make_shared<core::audio_buffer>(ndi_audio.no_samples * ndi_audio.no_channels);
+				convert_audio(ndi_audio, item.samples->data());
+			}
+		}
+		else
+		{
+			NDIlib_audio_frame_interleaved_32f_t interleaved_frame;
+			if (audio_conversion_buffer_.size() < static_cast<size_t>(ndi_audio.no_samples * ndi_audio.no_channels))
+				audio_conversion_buffer_.resize(ndi_audio.no_samples * ndi_audio.no_channels);
+			interleaved_frame.p_data = audio_conversion_buffer_.data();
+			ndi_lib_->NDIlib_util_audio_to_interleaved_32f(&ndi_audio, &interleaved_frame);
+			item.samples = resample_audio(interleaved_frame);
+		}
+		if (clock_bridge_)
+		{
+			// The frames are mixed without their audio, it is resampled to the channel clock by the bridge.
+			if (item.float_samples)
+				clock_bridge_->push_audio(item.float_samples->data(), item.float_samples->size());
+			else
+				clock_bridge_->push_audio(item.samples->data(), item.samples->size());
+		}
+		audio_buffer_.push(item);
+		while (audio_buffer_.size() > 10)
+			audio_buffer_.pop();
+		if (!is_direct_)
+			graph_->set_value("audio-sync-buffer", static_cast<float>(audio_buffer_.size()) / 10.0f);
+	}
+
+	std::shared_ptr<core::audio_buffer> resample_audio(const NDIlib_audio_frame_interleaved_32f_t& ndi_audio)
+	{
+		if (!swr_ || ndi_audio.sample_rate != in_audio_sample_rate_ || ndi_audio.no_channels != in_audio_nb_channels_)
+		{
+			swr_ = create_swr(format_desc_.audio_sample_rate, audio_channel_layout_.num_channels, ndi_audio.no_channels, ndi_audio.sample_rate);
+			in_audio_nb_channels_ = ndi_audio.no_channels;
+			in_audio_sample_rate_ = ndi_audio.sample_rate;
 			CASPAR_LOG(trace) << print() << L" Created resampler for " << in_audio_nb_channels_ << L" channels and " << in_audio_sample_rate_ << L" sample rate";
 		}
-		int out_samples_count = swr_get_out_samples(swr_.get(), ndi_audio->no_samples);
+		int out_samples_count = swr_get_out_samples(swr_.get(), ndi_audio.no_samples);
 		std::shared_ptr<core::audio_buffer> buffer (std::make_shared<core::audio_buffer>(out_samples_count * audio_channel_layout_.num_channels , 0));
 		uint8_t* out[AV_NUM_DATA_POINTERS] = { reinterpret_cast<uint8_t*>(buffer->data()) }; 
-		const uint8_t *in[AV_NUM_DATA_POINTERS] = { reinterpret_cast<uint8_t*>(ndi_audio->p_data) };
+		const uint8_t *in[AV_NUM_DATA_POINTERS] = { reinterpret_cast<uint8_t*>(ndi_audio.p_data) };
 		int converted_sample_count = swr_convert(swr_.get(),
 			out, out_samples_count,
-			in, ndi_audio->no_samples);
+			in, ndi_audio.no_samples);
 		if (converted_sample_count != out_samples_count)
 			CASPAR_LOG(warning) << print() << L" Not all samples were converted (" << converted_sample_count << L" of " << out_samples_count << L").";
-		audio_buffer_.push(audio_buffer_item_t(ndi_audio->timecode, buffer));
-		while (audio_buffer_.size() > 10)
-			audio_buffer_.pop();
-		graph_->set_value("audio-sync-buffer", static_cast<float>(audio_buffer_.size()) / 10.0f);
+		return buffer;
 	}
 				
 	virtual safe_ptr<core::basic_frame> receive(int hints) override
 	{
+		hints_ = hints;
 		safe_ptr<core::basic_frame> frame = core::basic_frame::late();
-		if(!frame_buffer_.try_pop(frame))
-			graph_->set_tag("late-frame");
-		graph_->set_value("output-buffer", static_cast<float>(frame_buffer_.size())/static_cast<float>(frame_buffer_.capacity()));	
+		if (clock_bridge_)
+		{
+			frame = clock_bridge_->pop();
+			monitor_subject_ << core::monitor::message("/clock/drift") % clock_bridge_->drift_ppm()
+							 << core::monitor::message("/clock/resample-ratio") % clock_bridge_->resample_ratio();
+		}
+		else
+		{
+			if(!frame_buffer_.try_pop(frame))
+				graph_->set_tag("late-frame");
+			graph_->set_value("output-buffer", static_cast<float>(frame_buffer_.size())/static_cast<float>(frame_buffer_.capacity()));	
+		}
 		if (frame != core::basic_frame::late())
 			last_frame_ = frame;
 		monitor_subject_ << core::monitor::message("/source") % source_name_;
@@ -399,6 +685,8 @@ public:
 	{
 		boost::property_tree::wptree info;
 		info.add(L"type", L"ndi-producer");
+		if (clock_bridge_)
+			info.add(L"drift-ppm", clock_bridge_->drift_ppm());
 		return info;
 	}
 
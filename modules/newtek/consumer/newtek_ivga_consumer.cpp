@@ -31,47 +31,87 @@
 #include <common/utility/assert.h>
 #include <common/concurrency/executor.h>
 #include <common/diagnostics/graph.h>
+#include <common/memory/memcpy.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
 #include <boost/timer.hpp>
 
 #include <tbb/atomic.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/spin_mutex.h>
+
+#include <deque>
+#include <vector>
 
 #include "../util/air_send.h"
 
 namespace caspar { namespace newtek {
 
+// A frame converted for AirSend, reused from the ring.
+struct ivga_frame
+{
+	std::vector<uint8_t, tbb::cache_aligned_allocator<uint8_t>>	image;
+	std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>>	audio;
+	boost::timer												queued; // Since it was handed to the sender.
+};
+
+// AirSend blocks while the link to the TriCaster is congested, so it is called from a sender of its own. Frames
+// wait for it in a small ring, when the ring is full the oldest waiting frame is dropped, which keeps the latency 
+// bounded and never stalls the channel.
 struct newtek_ivga_consumer : public core::frame_consumer
 {
+	static const int				FRAME_RING_SIZE = 3;
+
 	std::shared_ptr<void>			air_send_;
 	core::video_format_desc			format_desc_;
 	core::channel_layout			channel_layout_;
-	executor						executor_;
 	tbb::atomic<bool>				connected_;
 
+	tbb::spin_mutex					ring_mutex_;
+	std::vector<std::shared_ptr<ivga_frame>> free_frames_;
+	std::deque<std::shared_ptr<ivga_frame>>	 queued_frames_;
+	tbb::atomic<int64_t>			dropped_frames_;
+
 	safe_ptr<diagnostics::graph>	graph_;
 	boost::timer					tick_timer_;
 	boost::timer					frame_timer_;
 
+	executor						executor_;
+	executor						sender_;
+
 public:
 
 	newtek_ivga_consumer(core::channel_layout channel_layout)
-		: executor_(print())
-		, channel_layout_(channel_layout)
+		: channel_layout_(channel_layout)
+		, executor_(L"newtek-ivga")
+		, sender_(L"newtek-ivga-sender")
 	{
 		if (!airsend::is_available())
 			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(narrow(airsend::dll_name()) + " not available"));
 
-		connected_ = false;
+		connected_		= false;
+		dropped_frames_ = 0;
+
+		for(int n = 0; n < FRAME_RING_SIZE; ++n)
+			free_frames_.push_back(std::make_shared<ivga_frame>());
 
 		graph_->set_text(print());
 		graph_->set_color("frame-time", diagnostics::color(0.5f, 1.0f, 0.2f));
 		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));
+		graph_->set_color("send-time", diagnostics::color(0.9f, 0.6f, 0.1f));
+		graph_->set_color("send-latency", diagnostics::color(0.8f, 0.3f, 0.8f));
+		graph_->set_color("dropped-frame", diagnostics::color(0.3f, 0.6f, 0.3f));
 		diagnostics::register_graph(graph_);
 	}
 	
 	~newtek_ivga_consumer()
 	{
+		// The converting executor queues to the sender, so it has to finish first.
+		executor_.stop();
+		executor_.join();
+		sender_.stop();
+		sender_.join();
 	}
 
 	// frame_consumer
@@ -108,9 +148,12 @@ public:
 			tick_timer_.restart();
 			frame_timer_.restart();
 
-			// AUDIO
+			auto converted = acquire_frame();
+
+			// AUDIO, converted by the shared kernels of the read_frame unless it has to be remixed.
 
 			std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>> audio_buffer;
+			boost::iterator_range<const int16_t*> audio_samples;
 
 			if (core::needs_rearranging(
 					frame->multichannel_view(),
@@ -133,24 +176,94 @@ public:
 						core::default_mix_config_repository());
 
 				audio_buffer = core::audio_32_to_16(downmixed);
+				audio_samples = boost::iterator_range<const int16_t*>(audio_buffer.data(), audio_buffer.data() + audio_buffer.size());
 			}
 			else
 			{
-				audio_buffer = core::audio_32_to_16(frame->audio_data());
+				audio_samples = frame->audio_data_16();
 			}
 
-			airsend::add_audio(air_send_.get(), audio_buffer.data(), audio_buffer.size() / channel_layout_.num_channels);
+			converted->audio.assign(audio_samples.begin(), audio_samples.end());
 
 			// VIDEO
 
-			connected_ = airsend::add_frame_bgra(air_send_.get(), frame->image_data().begin());
+			auto image = frame->image_data();
+			converted->image.resize(image.size());
+			fast_memcpy(converted->image.data(), image.begin(), image.size());
+
+			queue_frame(converted);
 
-			graph_->set_text(print());
 			graph_->set_value("frame-time", frame_timer_.elapsed() * format_desc_.fps * 0.5);
 			
 			return true;
 		});
 	}
+
+	// A free frame of the ring, or the oldest one still waiting for the sender, which is dropped.
+	std::shared_ptr<ivga_frame> acquire_frame()
+	{
+		tbb::spin_mutex::scoped_lock lock(ring_mutex_);
+
+		std::shared_ptr<ivga_frame> result;
+		if(!free_frames_.empty())
+		{
+			result = free_frames_.back();
+			free_frames_.pop_back();
+		}
+		else if(!queued_frames_.empty())
+		{
+			result = queued_frames_.front();
+			queued_frames_.pop_front();
+			++dropped_frames_;
+			graph_->set_tag("dropped-frame");
+		}
+		else
+			result = std::make_shared<ivga_frame>(); // Only while the sender holds all of a ring smaller than two.
+
+		return result;
+	}
+
+	void queue_frame(const std::shared_ptr<ivga_frame>& frame)
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(ring_mutex_);
+			frame->queued.restart();
+			queued_frames_.push_back(frame);
+		}
+
+		// One task per queued frame, tasks of dropped frames find the queue empty.
+		sender_.begin_invoke([=]
+		{
+			send_queued();
+		});
+	}
+
+	void send_queued()
+	{
+		std::shared_ptr<ivga_frame> frame;
+		{
+			tbb::spin_mutex::scoped_lock lock(ring_mutex_);
+			if(queued_frames_.empty())
+				return;
+
+			frame = queued_frames_.front();
+			queued_frames_.pop_front();
+		}
+
+		boost::timer send_timer;
+
+		if(!frame->audio.empty())
+			airsend::add_audio(air_send_.get(), frame->audio.data(), static_cast<int>(frame->audio.size()) / channel_layout_.num_channels);
+
+		connected_ = airsend::add_frame_bgra(air_send_.get(), frame->image.data());
+
+		graph_->set_value("send-time", send_timer.elapsed() * format_desc_.fps * 0.5);
+		graph_->set_value("send-latency", frame->queued.elapsed() * format_desc_.fps * 0.5);
+		graph_->set_text(print());
+
+		tbb::spin_mutex::scoped_lock lock(ring_mutex_);
+		free_frames_.push_back(frame);
+	}
 		
 	virtual std::wstring print() const override
 	{
@@ -163,6 +276,7 @@ public:
 		boost::property_tree::wptree info;
 		info.add(L"type", L"newtek-ivga-consumer");
 		info.add(L"connected", connected_ ? L"true" : L"false");
+		info.add(L"dropped-frames", static_cast<int64_t>(dropped_frames_));
 		return info;
 	}
 
@@ -181,9 +295,10 @@ public:
 		return 0;
 	}
 
+	// AirSend no longer paces the channel now that it is called from the sender.
 	virtual bool has_synchronization_clock() const override
 	{
-		return connected_;
+		return false;
 	}
 };	
 
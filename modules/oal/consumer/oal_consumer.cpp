@@ -28,6 +28,7 @@
 #include <common/utility/string.h>
 #include <common/concurrency/future_util.h>
 #include <common/exception/win32_exception.h>
+#include <common/memory/tagged_allocator.h>
 
 #include <core/parameters/parameters.h>
 #include <core/consumer/frame_consumer.h>
@@ -38,18 +39,103 @@
 
 #include <SFML/Audio.hpp>
 
-#include <boost/circular_buffer.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/timer.hpp>
 #include <boost/thread/future.hpp>
 #include <boost/optional.hpp>
 
 #include <tbb/atomic.h>
-#include <tbb/concurrent_queue.h>
+
+#include <emmintrin.h>
+
+#include <algorithm>
 
 namespace caspar { namespace oal {
 
-typedef std::vector<int16_t, tbb::cache_aligned_allocator<int16_t>> audio_buffer_16;
+typedef std::vector<int16_t, tagged_allocator<int16_t, allocation_subsystem::consumer, tbb::cache_aligned_allocator<int16_t>>> audio_buffer_16;
+
+// Keeps the upper 16 bits of every sample, the same as core::audio_32_to_16.
+static void convert_32_to_16(const int32_t* source, int16_t* dest, size_t count)
+{
+	size_t n = 0;
+	for(; n + 8 <= count; n += 8)
+	{
+		auto lo = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n)), 16);
+		auto hi = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + n + 4)), 16);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + n), _mm_packs_epi32(lo, hi));
+	}
+	for(; n < count; ++n)
+		dest[n] = static_cast<int16_t>(source[n] >> 16);
+}
+
+// Interleaved 16 bit samples written by the channel and read by the sfml audio thread, one of each, without locks.
+class sample_ring : boost::noncopyable
+{
+	audio_buffer_16			samples_;
+	const size_t			mask_;
+	tbb::atomic<size_t>		write_pos_; // Only advanced by the writer.
+	tbb::atomic<size_t>		read_pos_; // Only advanced by the reader.
+public:
+	explicit sample_ring(size_t capacity) // Rounded up to a power of two.
+		: samples_(round_up(capacity), 0)
+		, mask_(samples_.size() - 1)
+	{
+		write_pos_ = 0;
+		read_pos_ = 0;
+	}
+
+	size_t size() const
+	{
+		return write_pos_ - read_pos_;
+	}
+
+	size_t capacity() const
+	{
+		return samples_.size();
+	}
+
+	// Returns how many of the samples fit, the rest is dropped.
+	size_t write(const int32_t* source, size_t count, size_t limit)
+	{
+		const size_t write_pos = write_pos_;
+		const size_t used = write_pos - read_pos_;
+
+		limit = std::min(limit, samples_.size());
+		count = std::min(count, limit > used ? limit - used : 0);
+
+		const size_t offset = write_pos & mask_;
+		const size_t first = std::min(count, samples_.size() - offset);
+		convert_32_to_16(source, samples_.data() + offset, first);
+		convert_32_to_16(source + first, samples_.data(), count - first);
+
+		write_pos_ = write_pos + count; // Release, the samples are visible before the position.
+		return count;
+	}
+
+	// Returns how many samples were available, never waits for more.
+	size_t read(int16_t* dest, size_t count)
+	{
+		const size_t read_pos = read_pos_;
+		count = std::min(count, write_pos_ - read_pos);
+
+		const size_t offset = read_pos & mask_;
+		const size_t first = std::min(count, samples_.size() - offset);
+		std::copy_n(samples_.data() + offset, first, dest);
+		std::copy_n(samples_.data(), count - first, dest + first);
+
+		read_pos_ = read_pos + count;
+		return count;
+	}
+private:
+	static size_t round_up(size_t capacity)
+	{
+		size_t size = 1;
+		while(size < capacity)
+			size <<= 1;
+		return size;
+	}
+};
 
 struct oal_consumer : public core::frame_consumer,  public sf::SoundStream
 {
@@ -57,8 +143,11 @@ struct oal_consumer : public core::frame_consumer,  public sf::SoundStream
 	boost::timer										perf_timer_;
 	int													channel_index_;
 
-	tbb::concurrent_bounded_queue<std::pair<std::shared_ptr<core::read_frame>, std::shared_ptr<audio_buffer_16>>>	input_;
-	boost::circular_buffer<audio_buffer_16>				container_;
+	sample_ring											ring_;
+	tbb::atomic<size_t>									max_buffered_; // Samples, bounds the latency.
+	tbb::atomic<size_t>									chunk_size_; // Samples handed to openal per request.
+	audio_buffer_16										chunk_;
+	tbb::atomic<uint32_t>								underruns_;
 	tbb::atomic<bool>									is_running_;
 	tbb::atomic<int64_t>								presentation_age_;
 	bool												started_;
@@ -67,30 +156,30 @@ struct oal_consumer : public core::frame_consumer,  public sf::SoundStream
 	core::channel_layout								channel_layout_;
 public:
 	oal_consumer() 
-		: container_(16)
-		, channel_index_(-1)
+		: channel_index_(-1)
+		, ring_(96000) // A second of 48 kHz stereo.
 		, started_(false)
 		, channel_layout_(
 				core::default_channel_layout_repository().get_by_name(
 						L"STEREO"))
 	{
 		graph_->set_color("tick-time", diagnostics::color(0.0f, 0.6f, 0.9f));	
+		graph_->set_color("buffer", diagnostics::color(0.6f, 0.6f, 0.9f));	
 		graph_->set_color("dropped-frame", diagnostics::color(0.3f, 0.6f, 0.3f));
+		graph_->set_color("underrun", diagnostics::color(0.6f, 0.3f, 0.3f));
 		diagnostics::register_graph(graph_);
 
+		max_buffered_ = ring_.capacity();
+		chunk_size_ = 0;
+		underruns_ = 0;
 		is_running_ = true;
 		presentation_age_ = 0;
-		input_.set_capacity(2);
 	}
 
 	~oal_consumer()
 	{
 		is_running_ = false;
-		input_.try_push(std::make_pair(std::shared_ptr<core::read_frame>(), std::make_shared<audio_buffer_16>()));
-		input_.try_push(std::make_pair(std::shared_ptr<core::read_frame>(), std::make_shared<audio_buffer_16>()));
 		Stop();
-		input_.try_push(std::make_pair(std::shared_ptr<core::read_frame>(), std::make_shared<audio_buffer_16>()));
-		input_.try_push(std::make_pair(std::shared_ptr<core::read_frame>(), std::make_shared<audio_buffer_16>()));
 
 		CASPAR_LOG(info) << print() << L" Successfully Uninitialized.";	
 	}
@@ -103,6 +192,10 @@ public:
 		channel_index_	= channel_index;
 		graph_->set_text(print());
 
+		auto frame_samples = *std::max_element(format_desc_.audio_cadence.begin(), format_desc_.audio_cadence.end()) * channel_layout_.num_channels;
+		chunk_size_		= frame_samples;
+		max_buffered_	= frame_samples * buffer_depth(); // Further samples are dropped rather than delaying the monitoring.
+
 		/*if (Status() != Playing)
 		{
 			sf::SoundStream::Initialize(2, format_desc_.audio_sample_rate);
@@ -118,14 +211,14 @@ public:
 
 	virtual boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame) override
 	{
-		std::shared_ptr<audio_buffer_16> buffer;
+		core::audio_buffer downmixed;
+		auto audio = frame->audio_data();
 
 		if (core::needs_rearranging(
 				frame->multichannel_view(),
 				channel_layout_,
 				channel_layout_.num_channels))
 		{
-			core::audio_buffer downmixed;
 			downmixed.resize(
 					frame->multichannel_view().num_samples() 
 							* channel_layout_.num_channels,
@@ -139,18 +232,19 @@ public:
 					dest_view,
 					core::default_mix_config_repository());
 
-			buffer = std::make_shared<audio_buffer_16>(
-					core::audio_32_to_16(downmixed));
-		}
-		else
-		{
-			buffer = std::make_shared<audio_buffer_16>(
-					core::audio_32_to_16(frame->audio_data()));
+			audio = boost::iterator_range<const int32_t*>(downmixed.data(), downmixed.data() + downmixed.size());
 		}
 
-		if (!input_.try_push(std::make_pair(frame, buffer)))
+		const size_t count = audio.size();
+		if (ring_.write(audio.begin(), count, max_buffered_) < count)
 			graph_->set_tag("dropped-frame");
 
+		const auto buffered = ring_.size();
+		graph_->set_value("buffer", static_cast<double>(buffered) / static_cast<double>(std::max<size_t>(1, max_buffered_)));
+
+		if (format_desc_.audio_sample_rate > 0)
+			presentation_age_ = frame->get_age_millis() + static_cast<int64_t>(buffered / channel_layout_.num_channels * 1000 / format_desc_.audio_sample_rate);
+
 		if (Status() != Playing && !started_)
 		{
 			sf::SoundStream::Initialize(2, format_desc_.audio_sample_rate);
@@ -171,10 +265,16 @@ public:
 		return false;
 	}
 
+	virtual int get_image_usage() const override
+	{
+		return 0; // Audio only.
+	}
+
 	virtual boost::property_tree::wptree info() const override
 	{
 		boost::property_tree::wptree info;
 		info.add(L"type", L"oal-consumer");
+		info.add(L"underruns", underruns_);
 		return info;
 	}
 	
@@ -189,20 +289,22 @@ public:
 	{		
 		win32_exception::ensure_handler_installed_for_thread(
 				"sfml-audio-thread");
-		std::pair<std::shared_ptr<core::read_frame>, std::shared_ptr<audio_buffer_16>> audio_data;
-
-		input_.pop(audio_data); // Block until available
 
 		graph_->set_value("tick-time", perf_timer_.elapsed()*format_desc_.fps*0.5);		
 		perf_timer_.restart();
 
-		container_.push_back(std::move(*audio_data.second));
-		data.Samples = container_.back().data();
-		data.NbSamples = container_.back().size();	
-		
+		// Openal has queued buffers of its own, a short ring is padded with silence instead of waiting on the channel.
+		chunk_.resize(std::max<size_t>(chunk_size_, 2));
+		auto count = ring_.read(chunk_.data(), chunk_.size());
+		if (count < chunk_.size())
+		{
+			std::fill(chunk_.begin() + count, chunk_.end(), 0);
+			++underruns_;
+			graph_->set_tag("underrun");
+		}
 
-		if (audio_data.first)
-			presentation_age_ = audio_data.first->get_age_millis();
+		data.Samples = chunk_.data();
+		data.NbSamples = chunk_.size();	
 
 		return is_running_;
 	}
@@ -29,7 +29,6 @@
 #include <common/log/log.h>
 #include <common/memory/safe_ptr.h>
 #include <common/memory/memcpy.h>
-#include <common/memory/memshfl.h>
 #include <common/utility/timer.h>
 #include <common/utility/string.h>
 #include <common/concurrency/future_util.h>
@@ -39,6 +38,7 @@
 #include <core/parameters/parameters.h>
 #include <core/video_format.h>
 #include <core/mixer/read_frame.h>
+#include <core/mixer/gpu/device_buffer.h>
 #include <core/consumer/frame_consumer.h>
 
 #include <boost/timer.hpp>
@@ -49,10 +49,13 @@
 
 #include <tbb/atomic.h>
 #include <tbb/concurrent_queue.h>
+#include <tbb/mutex.h>
 
 #include <boost/assign.hpp>
 
 #include <algorithm>
+#include <limits>
+#include <memory>
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -93,6 +96,7 @@ struct configuration
 	aspect_ratio	aspect;	
 	bool			vsync;
 	bool			borderless;
+	bool			share_texture;
 
 	configuration()
 		: name(L"Screen consumer")
@@ -104,10 +108,79 @@ struct configuration
 		, aspect(aspect_invalid)
 		, vsync(false)
 		, borderless(false)
+		, share_texture(true)
 	{
 	}
 };
 
+struct ogl_consumer;
+
+// Drives the windows of all screen consumers from one thread, so that a multiviewer with many screens does not have a
+// render thread of its own spinning towards the vblank for every window. The windows are drawn one after another 
+// and presented after a single wait, only the first window with vsync waits for the vblank in its swap. Uploads go 
+// through a pool of pbos shared by all windows, all contexts share their objects with the one of the ogl_device.
+class screen_host : boost::noncopyable
+{
+	std::vector<ogl_consumer*>	screens_;		// On the host thread.
+	ogl_consumer*				vsync_screen_;
+	std::vector<GLuint>			free_pbos_;
+	bool						ticking_;
+	caspar::high_prec_timer		wait_timer_;
+	executor					executor_;
+public:
+	screen_host()
+		: vsync_screen_(nullptr)
+		, ticking_(false)
+		, executor_(L"screen-host")
+	{
+		executor_.set_priority_class(above_normal_priority_class);
+	}
+
+	void attach(ogl_consumer* screen);
+	void detach(ogl_consumer* screen);
+
+	// On the host thread, with the context of any window active.
+	GLuint acquire_pbo()
+	{
+		if(free_pbos_.empty())
+		{
+			GLuint pbo = 0;
+			GL(glGenBuffers(1, &pbo));
+			return pbo;
+		}
+
+		auto pbo = free_pbos_.back();
+		free_pbos_.pop_back();
+		return pbo;
+	}
+
+	void release_pbo(GLuint pbo)
+	{
+		free_pbos_.push_back(pbo);
+	}
+private:
+	void tick();
+	void elect_vsync_screen();
+};
+
+tbb::mutex					g_screen_host_mutex;
+std::weak_ptr<screen_host>	g_screen_host;
+
+// The host lives as long as any screen consumer.
+std::shared_ptr<screen_host> get_screen_host()
+{
+	tbb::mutex::scoped_lock lock(g_screen_host_mutex);
+
+	auto host = g_screen_host.lock();
+	if(!host)
+	{
+		host = std::make_shared<screen_host>();
+		g_screen_host = host;
+	}
+
+	return host;
+}
+
 struct ogl_consumer : boost::noncopyable
 {		
 	const configuration		config_;
@@ -115,7 +188,7 @@ struct ogl_consumer : boost::noncopyable
 	int						channel_index_;
 
 	GLuint					texture_;
-	std::vector<GLuint>		pbos_;
+	GLuint					pending_pbo_; // Holds the previous frame, uploaded to the texture before the next is written.
 			
 	float					width_;
 	float					height_;	
@@ -132,13 +205,13 @@ struct ogl_consumer : boost::noncopyable
 	boost::timer					perf_timer_;
 	boost::timer					tick_timer_;
 
-	caspar::high_prec_timer	wait_timer_;
-
 	tbb::concurrent_bounded_queue<safe_ptr<core::read_frame>>	frame_buffer_;
+	std::shared_ptr<core::read_frame>							drawn_frame_;
+	std::shared_ptr<core::read_frame>							displayed_frame_;
 
-	boost::thread			thread_;
-	tbb::atomic<bool>		is_running_;
-	tbb::atomic<int64_t>	current_presentation_age_;
+	std::shared_ptr<screen_host>	host_;
+	tbb::atomic<bool>				is_running_;
+	tbb::atomic<int64_t>			current_presentation_age_;
 	
 public:
 	ogl_consumer(const configuration& config, const core::video_format_desc& format_desc, int channel_index) 
@@ -146,11 +219,12 @@ public:
 		, format_desc_(format_desc)
 		, channel_index_(channel_index)
 		, texture_(0)
-		, pbos_(2, 0)	
+		, pending_pbo_(0)
 		, screen_width_(format_desc.width)
 		, screen_height_(format_desc.height)
 		, square_width_(format_desc.square_width)
 		, square_height_(format_desc.square_height)
+		, host_(get_screen_host())
 	{		
 		if(format_desc_.format == core::video_format::ntsc && config_.aspect == configuration::aspect_4_3)
 		{
@@ -192,16 +266,17 @@ public:
 
 		is_running_ = true;
 		current_presentation_age_ = 0;
-		thread_ = boost::thread([this]{run();});
+		host_->attach(this);
 	}
 	
 	~ogl_consumer()
 	{
 		is_running_ = false;
-		frame_buffer_.try_push(make_safe<core::read_frame>());
-		thread_.join();
+		host_->detach(this);
 	}
 
+	// The rest runs on the host thread.
+
 	void init()
 	{
 		if(!GLEW_VERSION_2_1)
@@ -228,137 +303,150 @@ public:
 		GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP));
 		GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, format_desc_.width, format_desc_.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0));
 		GL(glBindTexture(GL_TEXTURE_2D, 0));
-					
-		GL(glGenBuffers(2, pbos_.data()));
-			
-		glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbos_[0]);
-		glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, format_desc_.size, 0, GL_STREAM_DRAW_ARB);
-		glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbos_[1]);
-		glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, format_desc_.size, 0, GL_STREAM_DRAW_ARB);
-		glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
-				
-		if(config_.vsync)
-		{
-			auto wglSwapIntervalEXT = reinterpret_cast<void(APIENTRY*)(int)>(wglGetProcAddress("wglSwapIntervalEXT"));
-			if(wglSwapIntervalEXT)
-			{
-				wglSwapIntervalEXT(1);
-				CASPAR_LOG(info) << print() << " Successfully enabled vsync.";
-			}
-			else
-				CASPAR_LOG(info) << print() << " Failed to enable vsync.";
-		}
+
+		set_vsync(false);
 
 		CASPAR_LOG(info) << print() << " Successfully Initialized.";
 	}
 
 	void uninit()
 	{		
+		window_.SetActive();
+
 		if(texture_)
 			glDeleteTextures(1, &texture_);
 
-		BOOST_FOREACH(auto& pbo, pbos_)
+		if(pending_pbo_)
+			host_->release_pbo(pending_pbo_);
+
+		pending_pbo_ = 0;
+		drawn_frame_.reset();
+		displayed_frame_.reset();
+	}
+
+	// Only the window the host presents with waits for the vblank in its swap, the others would wait for the next one.
+	void set_vsync(bool vsync)
+	{
+		auto wglSwapIntervalEXT = reinterpret_cast<void(APIENTRY*)(int)>(wglGetProcAddress("wglSwapIntervalEXT"));
+		if(wglSwapIntervalEXT)
 		{
-			if(pbo)
-				glDeleteBuffers(1, &pbo);
+			window_.SetActive();
+			wglSwapIntervalEXT(vsync ? 1 : 0);
+			if(vsync)
+				CASPAR_LOG(info) << print() << " Successfully enabled vsync.";
 		}
+		else if(vsync)
+			CASPAR_LOG(info) << print() << " Failed to enable vsync.";
 	}
 
-	void run()
+	void poll_events()
 	{
-		win32_exception::ensure_handler_installed_for_thread(
-				"ogl-consumer-thread");
+		sf::Event e;		
+		while(window_.GetEvent(e))
+		{
+			if(e.Type == sf::Event::Resized)
+			{
+				window_.SetActive();
+				calculate_aspect();
+			}
+			else if(e.Type == sf::Event::Closed)
+				is_running_ = false;
+		}
+	}
+
+	// Draws the latest frame sent, returns false if there is none.
+	bool try_draw()
+	{
+		if(!is_running_)
+			return false;
+
+		std::shared_ptr<core::read_frame> frame;
+		safe_ptr<core::read_frame> next;
+		while(frame_buffer_.try_pop(next))
+		{
+			if(frame)
+				graph_->set_tag("dropped-frame");
+			frame = next;
+		}
+
+		if(!frame)
+			return false;
+
+		auto texture = frame->image_texture();
+
+		if(!texture && static_cast<uint32_t>(frame->image_data().size()) != format_desc_.size)
+			return false;
 
 		try
 		{
-			init();
-
-			while(is_running_)
-			{			
-				try
-				{
-
-					sf::Event e;		
-					while(window_.GetEvent(e))
-					{
-						if(e.Type == sf::Event::Resized)
-							calculate_aspect();
-						else if(e.Type == sf::Event::Closed)
-							is_running_ = false;
-					}
-			
-					safe_ptr<core::read_frame> frame;
-
-					frame_buffer_.pop(frame);
-
-					render_and_draw_frame(frame);
-					
-					graph_->set_value("tick-time", tick_timer_.elapsed()*format_desc_.fps*0.5);	
-					tick_timer_.restart();
-				}
-				catch(...)
-				{
-					CASPAR_LOG_CURRENT_EXCEPTION();
-					is_running_ = false;
-				}
-			}
+			window_.SetActive();
 
-			uninit();
+			perf_timer_.restart();
+			if(texture)
+				render(*texture);
+			else
+				render(make_safe_ptr(frame));
+			graph_->set_value("frame-time", perf_timer_.elapsed() * format_desc_.fps * 0.5);
 		}
 		catch(...)
 		{
 			CASPAR_LOG_CURRENT_EXCEPTION();
+			is_running_ = false;
+			return false;
 		}
+
+		drawn_frame_ = frame;
+		return true;
 	}
 
-	void try_sleep_almost_until_vblank()
+	void display()
 	{
-		static const double THRESHOLD = 0.003;
-		double threshold = config_.vsync ? THRESHOLD : 0.0;
+		window_.Display();
+		current_presentation_age_ = drawn_frame_->get_age_millis();
 
-		auto frame_time = 1.0 / (format_desc_.fps * format_desc_.field_count);
+		// The mixer may reuse the texture once the frame is released, keep it until the next frame has been displayed.
+		displayed_frame_ = drawn_frame_;
+		drawn_frame_.reset();
 
-		wait_timer_.tick(frame_time - threshold);
+		graph_->set_value("tick-time", tick_timer_.elapsed()*format_desc_.fps*0.5);	
+		tick_timer_.restart();
 	}
 
-	void wait_for_vblank_and_display()
+	double frame_time() const
 	{
-		try_sleep_almost_until_vblank();
-		window_.Display();
-		// Make sure that the next tick measures the duration from this point in time.
-		wait_timer_.tick(0.0);
+		return 1.0 / (format_desc_.fps * format_desc_.field_count);
 	}
-	
 
-	void render_and_draw_frame(const safe_ptr<core::read_frame>& frame)
+	// Samples the final image of the mixer, SFML contexts all share objects with the one of the ogl_device.
+	void render(core::device_buffer& texture)
 	{
-		if(static_cast<uint32_t>(frame->image_data().size()) != format_desc_.size)
-			return;
-					
-		perf_timer_.restart();
-		render(frame);
-		graph_->set_value("frame-time", perf_timer_.elapsed() * format_desc_.fps * 0.5);
-
-		wait_for_vblank_and_display(); 
-		current_presentation_age_ = frame->get_age_millis();
+		texture.wait_written();
+		texture.bind(0);
+		draw_quad();
+		texture.unbind();
 	}
 
 	void render(const safe_ptr<core::read_frame>& frame)
 	{
-
 		glBindTexture(GL_TEXTURE_2D, texture_);
 
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos_[0]);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, format_desc_.width, format_desc_.height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+		if(pending_pbo_)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pending_pbo_);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, format_desc_.width, format_desc_.height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+			host_->release_pbo(pending_pbo_);
+		}
 
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos_[1]);
+		// Orphans the storage of the pbo, an upload from it by another window that is still pending keeps the old one.
+		pending_pbo_ = host_->acquire_pbo();
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pending_pbo_);
 		glBufferData(GL_PIXEL_UNPACK_BUFFER, format_desc_.size, 0, GL_STREAM_DRAW);
 
 		auto ptr = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
 		if(ptr)
 		{
 			if(config_.key_only)
-				fast_memshfl(reinterpret_cast<char*>(ptr), std::begin(frame->image_data()), frame->image_data().size(), 0x0F0F0F0F, 0x0B0B0B0B, 0x07070707, 0x03030303);
+				fast_memcpy(reinterpret_cast<char*>(ptr), std::begin(frame->key_image_data()), frame->key_image_data().size());
 			else
 				fast_memcpy(reinterpret_cast<char*>(ptr), std::begin(frame->image_data()), frame->image_data().size());
 
@@ -367,6 +455,13 @@ public:
 
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 				
+		draw_quad();
+		
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void draw_quad()
+	{
 		GL(glClear(GL_COLOR_BUFFER_BIT));			
 		glBegin(GL_QUADS);
 				glTexCoord2f(0.0f,	  1.0f);	glVertex2f(-width_, -height_);
@@ -374,10 +469,6 @@ public:
 				glTexCoord2f(1.0f,	  0.0f);	glVertex2f( width_,  height_);
 				glTexCoord2f(0.0f,	  0.0f);	glVertex2f(-width_,  height_);
 		glEnd();
-		
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		std::rotate(pbos_.begin(), pbos_.begin() + 1, pbos_.end());
 	}
 
 	boost::unique_future<bool> send(const safe_ptr<core::read_frame>& frame)
@@ -455,6 +546,114 @@ public:
 	}
 };
 
+void screen_host::attach(ogl_consumer* screen)
+{
+	executor_.invoke([=]
+	{
+		win32_exception::ensure_handler_installed_for_thread("screen-host-thread");
+
+		screen->init();
+		screens_.push_back(screen);
+		elect_vsync_screen();
+
+		if(!ticking_)
+		{
+			ticking_ = true;
+			wait_timer_.tick(0.0);
+			executor_.begin_invoke([this]{tick();});
+		}
+	}, high_priority);
+}
+
+void screen_host::detach(ogl_consumer* screen)
+{
+	executor_.invoke([=]
+	{
+		screens_.erase(std::remove(screens_.begin(), screens_.end(), screen), screens_.end());
+
+		try
+		{
+			screen->uninit();
+
+			// The pbos go with the context of the last window, which uninit left active.
+			if(screens_.empty())
+			{
+				BOOST_FOREACH(auto pbo, free_pbos_)
+					glDeleteBuffers(1, &pbo);
+				free_pbos_.clear();
+			}
+
+			// Windows are destroyed by the thread which created them.
+			screen->window_.Close();
+
+			if(vsync_screen_ == screen)
+			{
+				vsync_screen_ = nullptr;
+				elect_vsync_screen();
+			}
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+	}, high_priority);
+}
+
+void screen_host::elect_vsync_screen()
+{
+	if(vsync_screen_)
+		return;
+
+	BOOST_FOREACH(auto screen, screens_)
+	{
+		if(screen->config_.vsync)
+		{
+			vsync_screen_ = screen;
+			screen->set_vsync(true);
+			return;
+		}
+	}
+}
+
+void screen_host::tick()
+{
+	if(screens_.empty())
+	{
+		ticking_ = false;
+		return;
+	}
+
+	static const double VSYNC_THRESHOLD = 0.003;
+
+	std::vector<ogl_consumer*> drawn;
+	auto frame_time = std::numeric_limits<double>::max();
+
+	BOOST_FOREACH(auto screen, screens_)
+	{
+		screen->poll_events();
+
+		if(screen->try_draw())
+			drawn.push_back(screen);
+
+		frame_time = std::min(frame_time, screen->frame_time());
+	}
+
+	// One wait for all windows, at the pace of the fastest channel, leaving the swap of the vsync window to find 
+	// the vblank.
+	wait_timer_.tick(frame_time - (vsync_screen_ ? VSYNC_THRESHOLD : 0.0));
+
+	// The vsync window first, so that the others swap right after the vblank it waited for.
+	std::stable_partition(drawn.begin(), drawn.end(), [this](ogl_consumer* screen) {return screen == vsync_screen_;});
+
+	BOOST_FOREACH(auto screen, drawn)
+		screen->display();
+
+	// Make sure that the next tick measures the duration from this point in time.
+	if(!drawn.empty())
+		wait_timer_.tick(0.0);
+
+	executor_.begin_invoke([this]{tick();});
+}
 
 struct ogl_consumer_proxy : public core::frame_consumer
 {
@@ -507,6 +706,7 @@ public:
 		info.add(L"key-only", config_.key_only);
 		info.add(L"windowed", config_.windowed);
 		info.add(L"auto-deinterlace", config_.auto_deinterlace);
+		info.add(L"share-texture", config_.share_texture);
 		return info;
 	}
 
@@ -514,6 +714,12 @@ public:
 	{
 		return false;
 	}
+
+	virtual int get_image_usage() const override
+	{
+		// The key is only rendered into host memory.
+		return config_.share_texture && !config_.key_only ? core::image_usage::texture : core::image_usage::host;
+	}
 	
 	virtual uint32_t buffer_depth() const override
 	{
@@ -556,6 +762,7 @@ safe_ptr<core::frame_consumer> create_consumer(const boost::property_tree::wptre
 	config.auto_deinterlace	= ptree.get(L"auto-deinterlace", config.auto_deinterlace);
 	config.vsync			= ptree.get(L"vsync", config.vsync);
 	config.borderless       = ptree.get(L"borderless", config.borderless);
+	config.share_texture	= ptree.get(L"share-texture", config.share_texture);
 
 	auto stretch_str = ptree.get(L"stretch", L"default");
 	if(stretch_str == L"uniform")
@@ -28,11 +28,25 @@
 #include <core/video_channel.h>
 #include <core/recorder.h>
 #include <core/thumbnail_generator.h>
+#include <core/media_library.h>
 
 #include <boost/algorithm/string.hpp>
 
+#include <functional>
+
 namespace caspar { namespace protocol { namespace amcp {
 
+	// The reply to a request sent as "REQ <id> <command>" starts with "RES <id> ".
+	inline std::wstring MakeReply(const std::wstring& requestId, const std::wstring& reply)
+	{
+		return requestId.empty() ? reply : L"RES " + requestId + L" " + reply;
+	}
+
+	inline std::string MakeReplyUtf8(const std::wstring& requestId, const std::string& reply)
+	{
+		return requestId.empty() ? reply : "RES " + narrow(requestId) + " " + reply;
+	}
+
 	class AMCPCommand
 	{
 		AMCPCommand(const AMCPCommand&);
@@ -71,6 +85,9 @@ namespace caspar { namespace protocol { namespace amcp {
 		void SetMediaInfoRepo(const safe_ptr<core::media_info_repository>& media_info_repo) {media_info_repo_ = media_info_repo;}
 		std::shared_ptr<core::media_info_repository> GetMediaInfoRepo() { return media_info_repo_; }
 
+		void SetMediaLibraries(const core::media_libraries& libraries) {libraries_ = libraries;}
+		const core::media_libraries& GetMediaLibraries() { return libraries_; }
+
 		void SetShutdownServerNow(boost::promise<bool>& shutdown_server_now) {shutdown_server_now_ = &shutdown_server_now;}
 		boost::promise<bool>& GetShutdownServerNow() { return *shutdown_server_now_; }
 
@@ -86,6 +103,17 @@ namespace caspar { namespace protocol { namespace amcp {
 
 		void SetReplyString(const std::wstring& str){replyString_ = str;}
 
+		// For a large reply that is already UTF-8, such as one served from a media library's cache. It is sent as is
+		// instead of the reply string.
+		void SetReplyUtf8(const std::string& str){replyUtf8_ = str;}
+
+		// For a reply that is not known when Execute returns. It is called by SendReply, which the
+		// command queue does off the thread executing the commands.
+		void SetReplyFunc(const std::function<std::wstring()>& func){replyFunc_ = func;}
+
+		void SetRequestId(const std::wstring& requestId){requestId_ = requestId;}
+		const std::wstring& GetRequestId() const{return requestId_;}
+
 	protected:
 		core::parameters _parameters;
 
@@ -98,8 +126,12 @@ namespace caspar { namespace protocol { namespace amcp {
 		std::vector<safe_ptr<core::recorder>> recorders_;
 		std::shared_ptr<core::thumbnail_generator> thumb_gen_;
 		std::shared_ptr<core::media_info_repository> media_info_repo_;
+		core::media_libraries libraries_;
 		boost::promise<bool>* shutdown_server_now_;
 		std::wstring replyString_;
+		std::string replyUtf8_;
+		std::function<std::wstring()> replyFunc_;
+		std::wstring requestId_;
 	};
 
 	typedef std::tr1::shared_ptr<AMCPCommand> AMCPCommandPtr;
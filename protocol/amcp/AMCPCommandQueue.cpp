@@ -26,7 +26,8 @@
 namespace caspar { namespace protocol { namespace amcp {
 	
 AMCPCommandQueue::AMCPCommandQueue() 
-	: executor_(L"AMCPCommandQueue")
+	: reply_executor_(L"AMCPReplyQueue")
+	, executor_(L"AMCPCommandQueue")
 {
 }
 
@@ -69,10 +70,23 @@ void AMCPCommandQueue::AddCommand(AMCPCommandPtr pCurrentCommand)
 			{
 				CASPAR_LOG_CURRENT_EXCEPTION();
 				CASPAR_LOG(error) << "Failed to execute command:" << pCurrentCommand->print();
+				pCurrentCommand->SetReplyFunc(nullptr);
 				pCurrentCommand->SetReplyString(L"500 FAILED\r\n");
 			}
 				
-			pCurrentCommand->SendReply();
+			// Replies may wait on the producer, so they are sent in order from their own thread
+			// while the following commands execute.
+			reply_executor_.begin_invoke([=]
+			{
+				try
+				{
+					pCurrentCommand->SendReply();
+				}
+				catch(...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+			});
 			
 			CASPAR_LOG(trace) << "Ready for a new command";
 		}
@@ -42,6 +42,7 @@ public:
 	void AddCommand(AMCPCommandPtr pCommand);
 
 private:
+	executor			reply_executor_;
 	executor			executor_;
 };
 typedef std::tr1::shared_ptr<AMCPCommandQueue> AMCPCommandQueuePtr;
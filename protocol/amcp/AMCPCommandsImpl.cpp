@@ -31,7 +31,14 @@
 #include <common/env.h>
 
 #include <common/log/log.h>
+#include <common/concurrency/lock.h>
+#include <common/concurrency/parallel_arena.h>
+#include <common/concurrency/thread_placement.h>
+#include <common/diagnostics/executor_stats.h>
 #include <common/diagnostics/graph.h>
+#include <common/diagnostics/trace.h>
+#include <common/memory/locked_memory_pool.h>
+#include <common/memory/tagged_allocator.h>
 #include <common/os/windows/current_version.h>
 #include <common/os/windows/system_info.h>
 #include <common/utility/string.h>
@@ -49,6 +56,7 @@
 #include <core/producer/media_info/media_info.h>
 #include <core/producer/media_info/media_info_repository.h>
 #include <core/mixer/mixer.h>
+#include <core/mixer/image/color_lut.h>
 #include <core/mixer/gpu/ogl_device.h>
 #include <core/consumer/output.h>
 
@@ -60,14 +68,20 @@
 #include <modules/flash/producer/flash_producer.h>
 #include <modules/flash/producer/cg_producer.h>
 #include <modules/ffmpeg/producer/util/util.h>
+#include <modules/ffmpeg/producer/util/clip_cache.h>
+#include <modules/ffmpeg/producer/util/conversion_cache.h>
+#include <modules/ffmpeg/producer/ffmpeg_producer.h>
 #include <modules/image/image.h>
+#include <modules/image/producer/image_producer.h>
 #include <modules/ogl/ogl.h>
 
 #include <algorithm>
+#include <cmath>
 #include <locale>
 #include <fstream>
 #include <memory>
 #include <cctype>
+#include <cwctype>
 #include <io.h>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -80,9 +94,6 @@
 #include <boost/locale.hpp>
 #include <boost/range/adaptor/transformed.hpp>
 #include <boost/range/algorithm/copy.hpp>
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/insert_linebreaks.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
 
 #include <tbb/concurrent_unordered_map.h>
 
@@ -112,21 +123,19 @@ namespace caspar { namespace protocol {
 
 using namespace core;
 
-std::wstring read_file_base64(const boost::filesystem::wpath& file)
+std::string read_file_base64(const boost::filesystem::wpath& file)
 {
-	using namespace boost::archive::iterators;
-
 	boost::filesystem::ifstream filestream(file, std::ios::binary);
 
 	if (!filestream)
-		return L"";
+		return "";
 
 	auto length = boost::filesystem::file_size(file);
 	std::vector<char> bytes;
 	bytes.resize(length);
 	filestream.read(bytes.data(), length);
 
-	return widen(to_base64(bytes.data(), length));
+	return to_base64(bytes.data(), static_cast<unsigned int>(length));
 }
 
 std::wstring read_utf8_file(const boost::filesystem::wpath& file)
@@ -199,102 +208,214 @@ std::wstring read_file(const boost::filesystem::wpath& file)
 	return read_latin1_file(file);
 }
 
-std::wstring MediaInfo(const boost::filesystem::wpath& path, const std::shared_ptr<core::media_info_repository>& media_info_repo)
+// The content of a data file with its lines joined by \n, as UTF-8.
+std::string read_data_file(const boost::filesystem::wpath& file)
 {
-	if(boost::filesystem::is_regular_file(path))
+	std::wstring file_contents = read_file(file);
+
+	if (file_contents.empty())
+		return "";
+
+	std::wstringstream result;
+	std::wstringstream file_contents_stream(file_contents);
+	std::wstring line;
+	bool bFirstLine = true;
+	
+	while(std::getline(file_contents_stream, line))
 	{
-		std::wstring clipttype = TEXT(" N/A ");
-		std::wstring extension = boost::to_upper_copy(path.extension());
-		if(extension == TEXT(".TGA") || extension == TEXT(".COL") || extension == L".PNG" || extension == L".JPEG" || extension == L".JPG" ||
-			extension == L".GIF" || extension == L".BMP")
-		{
-			clipttype = TEXT(" STILL ");			
-		}
-		else if(extension == TEXT(".WAV") || extension == TEXT(".MP3"))
-		{
-			clipttype = TEXT(" AUDIO ");
-		}
-		else if(extension == TEXT(".SWF") || extension == TEXT(".CT") ||
-				extension == TEXT(".DV") || extension == TEXT(".MOV") || 
-				extension == TEXT(".MPG") || extension == TEXT(".AVI") || 
-				extension == TEXT(".MP4") || extension == TEXT(".FLV") || 
-				caspar::ffmpeg::is_valid_file(path.file_string()))
+		if(!bFirstLine)
+			result << "\n";
+		else
+			bFirstLine = false;
+
+		result << line;
+	}
+
+	return narrow(result.str());
+}
+
+// From the library when there is one, so that files asked for again are not read again.
+std::string read_cached(
+		const std::shared_ptr<core::media_library>& library,
+		const boost::filesystem::wpath& file,
+		const core::file_reader& reader)
+{
+	return library ? library->read(file, reader) : reader(file);
+}
+
+std::wstring GetClipType(const boost::filesystem::wpath& path)
+{
+	std::wstring extension = boost::to_upper_copy(path.extension());
+	if(extension == TEXT(".TGA") || extension == TEXT(".COL") || extension == L".PNG" || extension == L".JPEG" || extension == L".JPG" ||
+		extension == L".GIF" || extension == L".BMP" ||
+		extension == L".DDS" || extension == L".KTX")
+	{
+		return L"STILL";
+	}
+	else if(extension == TEXT(".WAV") || extension == TEXT(".MP3"))
+	{
+		return L"AUDIO";
+	}
+	else if(extension == TEXT(".SWF") || extension == TEXT(".CT") ||
+			extension == TEXT(".DV") || extension == TEXT(".MOV") || 
+			extension == TEXT(".MPG") || extension == TEXT(".AVI") || 
+			extension == TEXT(".MP4") || extension == TEXT(".FLV") || 
+			caspar::ffmpeg::is_valid_file(path.file_string()))
+	{
+		return L"MOVIE";
+	}
+
+	return L"";
+}
+
+std::wstring GetTemplateType(const boost::filesystem::wpath& path)
+{
+	return path.extension() == L".ft" || path.extension() == L".ct" ? L"TEMPLATE" : L"";
+}
+
+std::wstring GetDataType(const boost::filesystem::wpath& path)
+{
+	return boost::iequals(path.extension(), L".ftd") ? L"DATA" : L"";
+}
+
+// Scrub strips are kept next to the thumbnails but are not listed as thumbnails of their own.
+std::wstring GetThumbnailType(const boost::filesystem::wpath& path)
+{
+	return boost::iequals(path.extension(), L".png") && !boost::iends_with(path.stem(), L".strip") ? L"THUMBNAIL" : L"";
+}
+
+// Memory kept for the replies of DATA RETRIEVE, THUMBNAIL RETRIEVE and THUMBNAIL STRIP.
+const std::size_t DATA_CACHE_BYTES		= 16 * 1024 * 1024;
+const std::size_t THUMBNAIL_CACHE_BYTES	= 64 * 1024 * 1024;
+
+core::media_libraries CreateMediaLibraries(filesystem_monitor_factory& monitor_factory, const std::shared_ptr<core::media_info_repository>& media_info_repo)
+{
+	core::media_libraries libraries;
+	libraries.media			= std::shared_ptr<core::media_library>(new core::media_library(monitor_factory, env::media_folder(), &GetClipType, media_info_repo));
+	libraries.templates		= std::shared_ptr<core::media_library>(new core::media_library(monitor_factory, env::template_folder(), &GetTemplateType, media_info_repo));
+	libraries.data			= std::shared_ptr<core::media_library>(new core::media_library(monitor_factory, env::data_folder(), &GetDataType, nullptr, DATA_CACHE_BYTES));
+	libraries.thumbnails	= std::shared_ptr<core::media_library>(new core::media_library(monitor_factory, env::thumbnails_folder(), &GetThumbnailType, nullptr, THUMBNAIL_CACHE_BYTES));
+	return libraries;
+}
+
+struct ListingOptions
+{
+	std::wstring	prefix;
+	std::size_t		offset;
+	std::size_t		count;
+
+	ListingOptions()
+		: offset(0)
+		, count(std::numeric_limits<std::size_t>::max())
+	{
+	}
+};
+
+// [prefix] [OFFSET offset] [COUNT count], from the parameter at first on.
+bool ParseListingOptions(const core::parameters& params, std::size_t first, ListingOptions& options)
+{
+	try
+	{
+		for(auto n = first; n < params.size(); ++n)
 		{
-			clipttype = TEXT(" MOVIE ");
+			if(params[n] == L"OFFSET" && n + 1 < params.size())
+				options.offset = boost::lexical_cast<std::size_t>(params[++n]);
+			else if(params[n] == L"COUNT" && n + 1 < params.size())
+				options.count = boost::lexical_cast<std::size_t>(params[++n]);
+			else
+				options.prefix = params.get_original()[n];
 		}
 
-		if(clipttype != TEXT(" N/A "))
-		{		
-			auto is_not_digit = [](char c){ return std::isdigit(c) == 0; };
+		return true;
+	}
+	catch(boost::bad_lexical_cast&)
+	{
+		return false;
+	}
+}
 
-			auto relativePath = boost::filesystem::wpath(path.file_string().substr(env::media_folder().size()-1, path.file_string().size()));
+// Served from the library once it has indexed its folder, by walking the folder until then.
+std::vector<core::library_entry> ListEntries(
+		const std::shared_ptr<core::media_library>& library,
+		const std::wstring& folder,
+		const core::library_classifier& classifier,
+		const std::shared_ptr<core::media_info_repository>& media_info_repo,
+		const ListingOptions& options)
+{
+	if(library && library->is_ready())
+		return library->list(options.prefix, options.offset, options.count);
 
-			auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(boost::filesystem::last_write_time(path)));
-			writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), is_not_digit), writeTimeStr.end());
-			auto writeTimeWStr = std::wstring(writeTimeStr.begin(), writeTimeStr.end());
+	std::vector<core::library_entry> entries;
+	auto offset = options.offset;
 
-			auto sizeStr = boost::lexical_cast<std::wstring>(boost::filesystem::file_size(path));
-			sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), is_not_digit), sizeStr.end());
-			auto sizeWStr = std::wstring(sizeStr.begin(), sizeStr.end());
-				
-			auto str = relativePath.replace_extension(TEXT("")).external_file_string();
-			if(str[0] == '\\' || str[0] == '/')
-				str = std::wstring(str.begin() + 1, str.end());
-			auto media_info = media_info_repo->get(path.file_string());
-			
-			return std::wstring() 
-					+ L"\""		+ str +
-					+ L"\" "	+ clipttype +
-					+ L" "		+ sizeStr +
-					+ L" "		+ writeTimeWStr +
-					+ L" "		+ boost::lexical_cast<std::wstring>(media_info.duration) +
-					+ L" "		+ boost::lexical_cast<std::wstring>(media_info.time_base.numerator()) + L"/" + boost::lexical_cast<std::wstring>(media_info.time_base.denominator())
-					+ L"\r\n"; 	
-		}	
+	for (boost::filesystem::wrecursive_directory_iterator itr(folder), end; itr != end && entries.size() < options.count; ++itr)
+	{
+		core::library_entry entry;
+		if(!core::describe_file(folder, itr->path(), classifier, media_info_repo, entry) || !core::matches_prefix(entry.name, options.prefix))
+			continue;
+
+		if(offset > 0)
+			--offset;
+		else
+			entries.push_back(entry);
 	}
-	return L"";
+
+	return entries;
+}
+
+std::wstring FormatWriteTime(std::time_t time)
+{
+	auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(time));
+	writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), [](char c){ return std::isdigit(c) == 0;}), writeTimeStr.end());
+	return std::wstring(writeTimeStr.begin(), writeTimeStr.end());
+}
+
+std::wstring FormatSize(std::uintmax_t size)
+{
+	auto sizeStr = boost::lexical_cast<std::wstring>(size);
+	sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), [](wchar_t c){ return std::iswdigit(c) == 0;}), sizeStr.end());
+	return sizeStr;
+}
+
+std::wstring MediaInfo(const core::library_entry& entry)
+{
+	return std::wstring() 
+			+ L"\""		+ entry.name +
+			+ L"\"  "	+ entry.type +
+			+ L"  "		+ FormatSize(entry.size) +
+			+ L" "		+ FormatWriteTime(entry.last_write_time) +
+			+ L" "		+ boost::lexical_cast<std::wstring>(entry.info.duration) +
+			+ L" "		+ boost::lexical_cast<std::wstring>(entry.info.time_base.numerator()) + L"/" + boost::lexical_cast<std::wstring>(entry.info.time_base.denominator())
+			+ L"\r\n"; 	
 }
 
-std::wstring ListMedia(const std::shared_ptr<core::media_info_repository>& media_info_repo)
+std::wstring ListMedia(const core::media_libraries& libraries, const std::shared_ptr<core::media_info_repository>& media_info_repo, const ListingOptions& options)
 {		
 	std::wstringstream replyString;
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::media_folder()), end; itr != end; ++itr)	
-		replyString << MediaInfo(itr->path(), media_info_repo);
+	BOOST_FOREACH(auto& entry, ListEntries(libraries.media, env::media_folder(), &GetClipType, media_info_repo, options))
+		replyString << MediaInfo(entry);
 	
 	return boost::to_upper_copy(replyString.str());
 }
 
-std::wstring ListTemplates() 
+std::wstring ListTemplates(const core::media_libraries& libraries, const ListingOptions& options) 
 {
 	std::wstringstream replyString;
 
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::template_folder()), end; itr != end; ++itr)
-	{		
-		if(boost::filesystem::is_regular_file(itr->path()) && (itr->path().extension() == L".ft" || itr->path().extension() == L".ct"))
-		{
-			auto relativePath = boost::filesystem::wpath(itr->path().file_string().substr(env::template_folder().size()-1, itr->path().file_string().size()));
-
-			auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(boost::filesystem::last_write_time(itr->path())));
-			writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), [](char c){ return std::isdigit(c) == 0;}), writeTimeStr.end());
-			auto writeTimeWStr = std::wstring(writeTimeStr.begin(), writeTimeStr.end());
-
-			auto sizeStr = boost::lexical_cast<std::string>(boost::filesystem::file_size(itr->path()));
-			sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), [](char c){ return std::isdigit(c) == 0;}), sizeStr.end());
-
-			auto sizeWStr = std::wstring(sizeStr.begin(), sizeStr.end());
+	BOOST_FOREACH(auto& entry, ListEntries(libraries.templates, env::template_folder(), &GetTemplateType, nullptr, options))
+	{
+		auto relativePath = boost::filesystem::wpath(entry.name);
 
-			std::wstring dir = relativePath.parent_path().external_directory_string();
-			std::wstring file = boost::to_upper_copy(relativePath.filename());
-			relativePath = boost::filesystem::wpath(dir + L"/" + file);
-						
-			auto str = relativePath.replace_extension(TEXT("")).external_file_string();
-			boost::trim_if(str, boost::is_any_of("\\/"));
+		std::wstring dir = relativePath.parent_path().external_directory_string();
+		std::wstring file = boost::to_upper_copy(relativePath.filename());
+		
+		auto str = boost::filesystem::wpath(dir + L"/" + file).external_file_string();
+		boost::trim_if(str, boost::is_any_of("\\/"));
 
-			replyString << TEXT("\"") << str
-						<< TEXT("\" ") << sizeWStr
-						<< TEXT(" ") << writeTimeWStr
-						<< TEXT("\r\n");		
-		}
+		replyString << TEXT("\"") << str
+					<< TEXT("\" ") << FormatSize(entry.size)
+					<< TEXT(" ") << FormatWriteTime(entry.last_write_time)
+					<< TEXT("\r\n");		
 	}
 	return replyString.str();
 }
@@ -306,12 +427,33 @@ AMCPCommand::AMCPCommand() : channelIndex_(0), layerIndex_(-1)
 
 void AMCPCommand::SendReply()
 {
+	if(replyFunc_)
+	{
+		try
+		{
+			replyString_ = replyFunc_();
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(error) << "Failed to complete command:" << print();
+			replyString_ = L"500 FAILED\r\n";
+		}
+		replyFunc_ = nullptr;
+	}
+
 	if(!pClientInfo_) 
 		return;
 
+	if(!replyUtf8_.empty())
+	{
+		pClientInfo_->SendUtf8(MakeReplyUtf8(requestId_, replyUtf8_));
+		return;
+	}
+
 	if(replyString_.empty())
 		return;
-	pClientInfo_->Send(replyString_);
+	pClientInfo_->Send(MakeReply(requestId_, replyString_));
 }
 
 void AMCPCommand::Clear() 
@@ -322,10 +464,17 @@ void AMCPCommand::Clear()
 	_parameters.clear();
 }
 
+// DIAG [METRICS], METRICS replies with the graph values in the Prometheus text format instead of opening the window.
 bool DiagnosticsCommand::DoExecute()
 {	
 	try
 	{
+		if(!_parameters.empty() && _parameters[0] == L"METRICS")
+		{
+			SetReplyString(L"201 DIAG OK\r\n" + widen(diagnostics::print_metrics()) + L"\r\n");
+			return true;
+		}
+
 		diagnostics::show_graphs(true);
 
 		SetReplyString(TEXT("202 DIAG OK\r\n"));
@@ -340,6 +489,81 @@ bool DiagnosticsCommand::DoExecute()
 	}
 }
 
+// TRACE START|STOP|CLEAR|DUMP [file], the dump is written to the log folder in the Chrome trace_event format.
+bool TraceCommand::DoExecute()
+{	
+	try
+	{
+		if(_parameters[0] == L"START")
+			diagnostics::trace::set_enabled(true);
+		else if(_parameters[0] == L"STOP")
+			diagnostics::trace::set_enabled(false);
+		else if(_parameters[0] == L"CLEAR")
+			diagnostics::trace::clear();
+		else if(_parameters[0] == L"DUMP")
+		{
+			auto name = _parameters.size() > 1 ? boost::filesystem::wpath(_parameters.get_original()[1]).filename() : L"trace.json";
+			auto filename = env::log_folder() + name;
+
+			diagnostics::trace::dump(filename);
+
+			SetReplyString(L"201 TRACE OK\r\n" + filename + L"\r\n");
+			return true;
+		}
+		else
+		{
+			SetReplyString(TEXT("403 TRACE ERROR\r\n"));
+			return false;
+		}
+
+		SetReplyString(TEXT("202 TRACE OK\r\n"));
+
+		return true;
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+		SetReplyString(TEXT("502 TRACE FAILED\r\n"));
+		return false;
+	}
+}
+
+bool BatchCommand::DoExecute()
+{
+	// The stage changes of all commands are held back until every one has succeeded.
+	core::stage_batch batch;
+
+	BOOST_FOREACH(auto& command, commands_)
+	{
+		bool succeeded = false;
+		try
+		{
+			succeeded = command->Execute();
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+
+		if(!succeeded)
+		{
+			CASPAR_LOG(warning) << L"Failed to execute batched command: " << command->print() << L". Discarding batch.";
+			SetReplyString(TEXT("502 COMMIT FAILED\r\n"));
+			return false;
+		}
+	}
+
+	if(tick_ >= 0)
+		batch.commit_at_tick(tick_);
+	else if(!time_of_day_.is_not_a_date_time())
+		batch.commit_at_time(time_of_day_, frames_);
+	else
+		batch.commit();
+
+	SetReplyString(TEXT("202 COMMIT OK\r\n"));
+	return true;
+}
+
 bool ChannelGridCommand::DoExecute()
 {
 	int index = 1;
@@ -357,20 +581,23 @@ bool ChannelGridCommand::DoExecute()
 	{
 		if(channel != self)
 		{
-			auto producer = create_channel_producer(self->mixer(), channel);		
+			auto producer = create_channel_producer(self->mixer(), channel, true);		
 			self->stage()->load(index, producer, false);
 			self->stage()->play(index);
 			index++;
 		}
 	}
 
-	int n = GetChannels().size()-1;
+	int count = GetChannels().size()-1;
+	int n = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(count)))));
 	double delta = 1.0/static_cast<double>(n);
 	for(int x = 0; x < n; ++x)
 	{
 		for(int y = 0; y < n; ++y)
 		{
 			int index = x+y*n+1;
+			if(index > count)
+				continue;
 			auto transform = [=](frame_transform transform) -> frame_transform
 			{		
 				transform.fill_translation[0]	= x*delta;
@@ -396,6 +623,8 @@ bool CallCommand::DoExecute()
 	try
 	{
 		auto what = _parameters.at(0);
+
+		WaitForLayerLoads(*this, GetLayerIndex());
 				
 		boost::unique_future<std::wstring> result;
 		auto& params_orig = _parameters.get_original();
@@ -414,16 +643,29 @@ bool CallCommand::DoExecute()
 			result = GetChannel()->stage()->call(GetLayerIndex(), true, boost::trim_copy(param));
 		}
 
-		if(!result.timed_wait(boost::posix_time::seconds(2)))
-			BOOST_THROW_EXCEPTION(timed_out());
-				
-		std::wstringstream replyString;
-		if(result.get().empty())
-			replyString << TEXT("202 CALL OK\r\n");
-		else
-			replyString << TEXT("201 CALL OK\r\n") << result.get() << L"\r\n";
-		
-		SetReplyString(replyString.str());
+		// The producer may take a while to answer, which only holds back the reply.
+		auto pending = std::make_shared<boost::unique_future<std::wstring>>(std::move(result));
+		SetReplyFunc([pending]() -> std::wstring
+		{
+			try
+			{
+				if(!pending->timed_wait(boost::posix_time::seconds(2)))
+					BOOST_THROW_EXCEPTION(timed_out());
+
+				std::wstringstream replyString;
+				if(pending->get().empty())
+					replyString << TEXT("202 CALL OK\r\n");
+				else
+					replyString << TEXT("201 CALL OK\r\n") << pending->get() << L"\r\n";
+
+				return replyString.str();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				return TEXT("502 CALL FAILED\r\n");
+			}
+		});
 
 		return true;
 	}
@@ -710,6 +952,31 @@ bool MixerCommand::DoExecute()
 				return transform;
 			}, duration, tween));
 		}
+		else if(_parameters[0] == L"LUT")
+		{
+			if (_parameters.size() == 1)
+			{
+				auto lut = get_color_lut(get_current_transform().lut);
+				SetReplyString(L"201 MIXER OK\r\n" + (lut ? lut->name : L"NONE") + L"\r\n");
+				return true;
+			}
+
+			int value = 0;
+			if(!boost::iequals(_parameters.at(1), L"NONE"))
+			{
+				auto file = env::media_folder() + _parameters.at(1);
+				if(boost::filesystem::wpath(file).extension().empty())
+					file += L".cube";
+
+				value = load_color_lut(file);
+			}
+
+			transforms.push_back(stage::transform_tuple_t(GetLayerIndex(), [=](frame_transform transform) -> frame_transform
+			{
+				transform.lut = value;
+				return transform;
+			}, 0, L"linear"));
+		}
 		else if(_parameters[0] == L"STRAIGHT_ALPHA_OUTPUT")
 		{
 			if (_parameters.size() == 1)
@@ -794,6 +1061,8 @@ bool SwapCommand::DoExecute()
 	//Perform loading of the clip
 	try
 	{
+		WaitForLayerLoads(*this, GetLayerIndex(std::numeric_limits<int>::min()));
+
 		if(GetLayerIndex(-1) != -1)
 		{
 			std::vector<std::string> strs;
@@ -837,6 +1106,8 @@ bool AddCommand::DoExecute()
 	//Perform loading of the clip
 	try
 	{
+		scoped_thread_placement placement(GetChannel()->get_thread_placement().consumers);
+		parallel_arena::scope arena(GetChannel()->get_parallel_arena());
 		auto consumer = create_consumer(_parameters);
 		GetChannel()->output()->add(GetLayerIndex(consumer->index()), consumer);
 	
@@ -985,41 +1256,175 @@ bool RouteCommand::DoExecute()
 	}
 }
 
-bool LoadCommand::DoExecute()
-{	
-	//Perform loading of the clip
-	try
+namespace {
+
+// The last load of every layer, so that the commands for a layer that follow a
+// load wait for it and the loads of a layer are attached in order.
+class layer_loads : boost::noncopyable
+{
+	boost::mutex															mutex_;
+	std::map<std::pair<int, int>, boost::shared_future<std::wstring>>		loads_;
+public:
+	bool replace(int channel, int layer, const boost::shared_future<std::wstring>& load, boost::shared_future<std::wstring>& previous)
 	{
-		auto uri_tokens = parameters::protocol_split(_parameters.at_original(0));
-		auto pFP = frame_producer::empty();
-		if (uri_tokens[0] == L"route")
+		boost::mutex::scoped_lock lock(mutex_);
+
+		auto it = loads_.find(std::make_pair(channel, layer));
+		if(it == loads_.end())
 		{
-			pFP = RouteCommand::TryCreateProducer(*this, _parameters.at_original(0));
+			loads_.insert(std::make_pair(std::make_pair(channel, layer), load));
+			return false;
 		}
-		if (pFP == frame_producer::empty())
+
+		previous	= it->second;
+		it->second	= load;
+		return true;
+	}
+
+	void wait(int channel, int layer)
+	{
+		std::vector<boost::shared_future<std::wstring>> pending;
 		{
-			pFP = create_producer(GetChannel()->mixer(), _parameters);
+			boost::mutex::scoped_lock lock(mutex_);
+
+			BOOST_FOREACH(auto& load, loads_)
+			{
+				if(load.first.first == channel && (layer == std::numeric_limits<int>::min() || load.first.second == layer))
+					pending.push_back(load.second);
+			}
 		}
-		GetChannel()->stage()->load(GetLayerIndex(), pFP, true);
-	
-		SetReplyString(TEXT("202 LOAD OK\r\n"));
 
-		return true;
+		BOOST_FOREACH(auto& load, pending)
+			load.wait();
+	}
+};
+
+layer_loads& get_layer_loads()
+{
+	static layer_loads loads;
+	return loads;
+}
+
+std::wstring LoadLayer(
+		const std::wstring& name,
+		const std::wstring& description,
+		const std::function<safe_ptr<frame_producer> ()>& create,
+		const std::function<void ()>& wait_for_previous,
+		const std::function<void (const safe_ptr<frame_producer>&)>& attach)
+{
+	try
+	{
+		auto producer = create();
+		if(producer == frame_producer::empty())
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(description)));
+
+		wait_for_previous();
+		attach(producer);
+
+		return L"202 " + name + L" OK\r\n";
 	}
 	catch(file_not_found&)
 	{
-		CASPAR_LOG_CURRENT_EXCEPTION();
-		SetReplyString(TEXT("404 LOAD ERROR\r\n"));
-		return false;
+		CASPAR_LOG(error) << L"File not found. No match found for parameters. Check syntax:" << description;
+		return L"404 " + name + L" ERROR\r\n";
 	}
 	catch(...)
 	{
 		CASPAR_LOG_CURRENT_EXCEPTION();
-		SetReplyString(TEXT("502 LOAD FAILED\r\n"));
-		return false;
+		return L"502 " + name + L" FAILED\r\n";
 	}
 }
 
+// Creating a producer can take seconds, for a stream, an input or a template, so
+// unless asked to be synchronous it is done on a thread of its own, and only
+// the reply waits for it while the commands that follow execute.
+bool RunLayerLoad(
+		AMCPCommand& command,
+		bool synchronous,
+		const std::wstring& name,
+		const std::wstring& description,
+		const std::function<safe_ptr<frame_producer> ()>& create,
+		const std::function<void (const safe_ptr<frame_producer>&)>& attach)
+{
+	auto channel	= static_cast<int>(command.GetChannelIndex());
+	auto layer		= command.GetLayerIndex();
+
+	// Producers start their threads while being created, those inherit the channel's placement and arena.
+	auto placement	= command.GetChannel() ? command.GetChannel()->get_thread_placement().producers : thread_placement();
+	auto arena		= command.GetChannel() ? command.GetChannel()->get_parallel_arena() : std::shared_ptr<parallel_arena>();
+	auto placed		= [=]() -> safe_ptr<frame_producer>
+	{
+		scoped_thread_placement scope(placement);
+		parallel_arena::scope arena_scope(arena);
+		return create();
+	};
+
+	if(synchronous)
+	{
+		auto reply = LoadLayer(name, description, placed, [=] { get_layer_loads().wait(channel, layer); }, attach);
+		command.SetReplyString(reply);
+		return boost::starts_with(reply, L"202");
+	}
+
+	auto done = std::make_shared<boost::promise<std::wstring>>();
+	boost::shared_future<std::wstring> result(done->get_future());
+
+	boost::shared_future<std::wstring> previous;
+	bool has_previous = get_layer_loads().replace(channel, layer, result, previous);
+
+	boost::thread loader([=]
+	{
+		win32_exception::ensure_handler_installed_for_thread("producer-loader");
+
+		done->set_value(LoadLayer(name, description, placed, [=]
+		{
+			if(has_previous)
+				previous.wait();
+		}, attach));
+	});
+	loader.detach();
+
+	command.SetReplyFunc([result]() -> std::wstring
+	{
+		return result.get();
+	});
+
+	return true;
+}
+
+}
+
+void WaitForLayerLoads(AMCPCommand& command, int layer)
+{
+	get_layer_loads().wait(static_cast<int>(command.GetChannelIndex()), layer);
+}
+
+bool LoadCommand::DoExecute()
+{	
+	bool synchronous	= _parameters.remove_if_exists(L"SYNC") || core::stage_batch::is_collecting();
+	auto channel		= GetChannel();
+	auto layer			= GetLayerIndex();
+	auto params			= _parameters;
+
+	return RunLayerLoad(*this, synchronous, L"LOAD", params.get_original_string(), [=]() -> safe_ptr<frame_producer>
+	{
+		auto uri_tokens = parameters::protocol_split(params.at_original(0));
+		auto pFP = frame_producer::empty();
+		if (uri_tokens[0] == L"route")
+		{
+			pFP = RouteCommand::TryCreateProducer(*this, params.at_original(0));
+		}
+		if (pFP == frame_producer::empty())
+		{
+			pFP = create_producer(channel->mixer(), params);
+		}
+		return pFP;
+	}, [=](const safe_ptr<frame_producer>& producer)
+	{
+		channel->stage()->load(layer, producer, true);
+	});
+}
+
 
 
 //std::function<std::wstring()> channel_cg_add_command::parse(const std::wstring& message, const std::vector<renderer::render_device_ptr>& channels)
@@ -1104,41 +1509,101 @@ bool LoadbgCommand::DoExecute()
 			transitionInfo.direction = transition_direction::from_left;
 	}
 	
+	bool synchronous	= synchronous_ || _parameters.remove_if_exists(L"SYNC") || core::stage_batch::is_collecting();
+	auto channel		= GetChannel();
+	auto layer			= GetLayerIndex();
+	auto params			= _parameters;
+
 	//Perform loading of the clip
-	try
+	return RunLayerLoad(*this, synchronous, L"LOADBG", params.get_original_string(), [=]() -> safe_ptr<frame_producer>
 	{
-		auto uri_tokens = core::parameters::protocol_split(_parameters.at_original(0));
+		auto uri_tokens = core::parameters::protocol_split(params.at_original(0));
 		auto pFP = frame_producer::empty();
 		if (uri_tokens[0] == L"route")
 		{
-			pFP = RouteCommand::TryCreateProducer(*this, _parameters.at_original(0));
+			pFP = RouteCommand::TryCreateProducer(*this, params.at_original(0));
 		}
 		if (pFP == frame_producer::empty())
 		{
-			pFP = create_producer(GetChannel()->mixer(), _parameters);
+			pFP = create_producer(channel->mixer(), params);
 		}
-		if(pFP == frame_producer::empty())
-			BOOST_THROW_EXCEPTION(file_not_found() << msg_info(_parameters.size() > 0 ? narrow(_parameters[0]) : ""));
+		return pFP;
+	}, [=](const safe_ptr<frame_producer>& producer)
+	{
+		bool auto_play = std::find(params.begin(), params.end(), L"AUTO") != params.end();
 
-		bool auto_play = std::find(_parameters.begin(), _parameters.end(), L"AUTO") != _parameters.end();
+		auto pFP2 = create_transition_producer(channel->get_video_format_desc().field_mode, producer, transitionInfo);
+		channel->stage()->load(layer, pFP2, false, auto_play ? transitionInfo.duration : -1); // TODO: LOOP
+	});
+}
 
-		auto pFP2 = create_transition_producer(GetChannel()->get_video_format_desc().field_mode, pFP, transitionInfo);
-		GetChannel()->stage()->load(GetLayerIndex(), pFP2, false, auto_play ? transitionInfo.duration : -1); // TODO: LOOP
-	
-		SetReplyString(TEXT("202 LOADBG OK\r\n"));
+bool PreloadCommand::DoExecute()
+{
+	try
+	{
+		if(!image::preload_image(GetChannel()->mixer(), _parameters))
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(_parameters[0])));
+
+		SetReplyString(TEXT("202 PRELOAD OK\r\n"));
+		return true;
+	}
+	catch(file_not_found&)
+	{
+		CASPAR_LOG(error) << L"File not found. No match found for parameters. Check syntax:" << _parameters.get_original_string();
+		SetReplyString(TEXT("404 PRELOAD ERROR\r\n"));
+		return false;
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+		SetReplyString(TEXT("502 PRELOAD FAILED\r\n"));
+		return false;
+	}
+}
+
+bool PinCommand::DoExecute()
+{
+	try
+	{
+		if(!ffmpeg::pin_clip(GetChannel()->mixer(), _parameters))
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(_parameters[0])));
 
+		SetReplyString(TEXT("202 PIN OK\r\n"));
 		return true;
 	}
 	catch(file_not_found&)
-	{		
+	{
 		CASPAR_LOG(error) << L"File not found. No match found for parameters. Check syntax:" << _parameters.get_original_string();
-		SetReplyString(TEXT("404 LOADBG ERROR\r\n"));
+		SetReplyString(TEXT("404 PIN ERROR\r\n"));
 		return false;
 	}
 	catch(...)
 	{
 		CASPAR_LOG_CURRENT_EXCEPTION();
-		SetReplyString(TEXT("502 LOADBG FAILED\r\n"));
+		SetReplyString(TEXT("502 PIN FAILED\r\n"));
+		return false;
+	}
+}
+
+bool UnpinCommand::DoExecute()
+{
+	try
+	{
+		if(!ffmpeg::unpin_clip(_parameters))
+			BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(_parameters[0])));
+
+		SetReplyString(TEXT("202 UNPIN OK\r\n"));
+		return true;
+	}
+	catch(file_not_found&)
+	{
+		SetReplyString(TEXT("404 UNPIN ERROR\r\n"));
+		return false;
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+		SetReplyString(TEXT("502 UNPIN FAILED\r\n"));
 		return false;
 	}
 }
@@ -1147,6 +1612,7 @@ bool PauseCommand::DoExecute()
 {
 	try
 	{
+		WaitForLayerLoads(*this, GetLayerIndex());
 		GetChannel()->stage()->pause(GetLayerIndex());
 		SetReplyString(TEXT("202 PAUSE OK\r\n"));
 		return true;
@@ -1172,9 +1638,12 @@ bool PlayCommand::DoExecute()
 			lbg.SetLayerIntex(GetLayerIndex());
 			lbg.SetClientInfo(GetClientInfo());
 			lbg.SetParameters(_parameters);
+			lbg.SetSynchronous(true);
 			if(!lbg.Execute())
 				throw std::exception();
 		}
+		else
+			WaitForLayerLoads(*this, GetLayerIndex());
 
 		GetChannel()->stage()->play(GetLayerIndex());
 		
@@ -1193,6 +1662,7 @@ bool StopCommand::DoExecute()
 {
 	try
 	{
+		WaitForLayerLoads(*this, GetLayerIndex());
 		GetChannel()->stage()->stop(GetLayerIndex());
 		SetReplyString(TEXT("202 STOP OK\r\n"));
 		return true;
@@ -1208,6 +1678,7 @@ bool StopCommand::DoExecute()
 bool ClearCommand::DoExecute()
 {
 	int index = GetLayerIndex(std::numeric_limits<int>::min());
+	WaitForLayerLoads(*this, index);
 	if(index != std::numeric_limits<int>::min())
 		GetChannel()->stage()->clear(index);
 	else
@@ -1222,6 +1693,8 @@ bool PrintCommand::DoExecute()
 {
 	parameters params;
 	params.push_back(L"IMAGE");
+	scoped_thread_placement placement(GetChannel()->get_thread_placement().consumers);
+	parallel_arena::scope arena(GetChannel()->get_parallel_arena());
 	GetChannel()->output()->add(create_consumer(params));
 		
 	SetReplyString(TEXT("202 PRINT OK\r\n"));
@@ -1239,6 +1712,24 @@ bool LogCommand::DoExecute()
 	return true;
 }
 
+namespace {
+
+// Waits as long as the template host calls used to block the command queue, and replies with
+// an empty result if it does not answer in time.
+std::function<std::wstring()> MakeTimedReply(const std::wstring& header, boost::unique_future<std::wstring>&& result)
+{
+	auto pending = std::make_shared<boost::unique_future<std::wstring>>(std::move(result));
+	return [header, pending]() -> std::wstring
+	{
+		std::wstring value;
+		if(pending->timed_wait(boost::posix_time::seconds(2)))
+			value = pending->get();
+		return header + value + TEXT("\r\n");
+	};
+}
+
+}
+
 bool CGCommand::DoExecute()
 {
 	try
@@ -1357,13 +1848,20 @@ bool CGCommand::DoExecuteAdd() {
 		std::wstring filename = _parameters[2];
 		filename.append(extension);
 
+		std::shared_ptr<boost::unique_future<std::wstring>> pending;
 		flash::with_default_cg_producer(
 				[&](safe_ptr<flash::cg_producer> producer)
 				{
-					producer->add(layer, filename, bDoStart, label, (pDataString!=0) ? pDataString : TEXT(""));
+					pending = std::make_shared<boost::unique_future<std::wstring>>(producer->add_async(layer, filename, bDoStart, label, (pDataString!=0) ? pDataString : TEXT("")));
 				},
 				safe_ptr<core::video_channel>(GetChannel()), false, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER));
-		SetReplyString(TEXT("202 CG OK\r\n"));
+
+		// Replied to once the template is added, without holding back the commands after it.
+		SetReplyFunc([pending]() -> std::wstring
+		{
+			pending->wait();
+			return TEXT("202 CG OK\r\n");
+		});
 	}
 	else
 	{
@@ -1517,8 +2015,8 @@ bool CGCommand::DoExecuteInvoke()
 			return false;
 		}
 		int layer = _ttoi(_parameters[1].c_str());
-		auto result = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), true, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->invoke(layer, _parameters.at_original(2));
-		replyString << result << TEXT("\r\n"); 
+		auto result = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), true, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->invoke_async(layer, _parameters.at_original(2));
+		SetReplyFunc(MakeTimedReply(replyString.str(), std::move(result)));
 	}
 	else 
 	{
@@ -1526,7 +2024,6 @@ bool CGCommand::DoExecuteInvoke()
 		return true;
 	}
 	
-	SetReplyString(replyString.str());
 	return true;
 }
 
@@ -1544,17 +2041,15 @@ bool CGCommand::DoExecuteInfo()
 		}
 
 		int layer = _ttoi(_parameters[1].c_str());
-		auto desc = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), false, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->description(layer);
-		
-		replyString << desc << TEXT("\r\n"); 
+		auto desc = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), false, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->description_async(layer);
+		SetReplyFunc(MakeTimedReply(replyString.str(), std::move(desc)));
 	}
 	else 
 	{
-		auto info = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), false, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->template_host_info();
-		replyString << info << TEXT("\r\n"); 
+		auto info = flash::get_default_cg_producer(safe_ptr<core::video_channel>(GetChannel()), false, GetLayerIndex(flash::cg_producer::DEFAULT_LAYER))->template_host_info_async();
+		SetReplyFunc(MakeTimedReply(replyString.str(), std::move(info)));
 	}	
 
-	SetReplyString(replyString.str());
 	return true;
 }
 
@@ -1621,7 +2116,7 @@ bool DataCommand::DoExecuteRetrieve()
 	filename.append(_parameters[1]);
 	filename.append(TEXT(".ftd"));
 
-	std::wstring file_contents = read_file(boost::filesystem::wpath(filename));
+	std::string file_contents = read_cached(GetMediaLibraries().data, boost::filesystem::wpath(filename), &read_data_file);
 
 	if (file_contents.empty()) 
 	{
@@ -1629,25 +2124,12 @@ bool DataCommand::DoExecuteRetrieve()
 		return false;
 	}
 
-	std::wstringstream reply;
-	reply << TEXT("201 DATA RETRIEVE OK\r\n");
-
-	std::wstringstream file_contents_stream(file_contents);
-	std::wstring line;
-	bool bFirstLine = true;
-	
-	while(std::getline(file_contents_stream, line))
-	{
-		if(!bFirstLine)
-			reply << "\n";
-		else
-			bFirstLine = false;
-
-		reply << line;
-	}
-
-	reply << "\r\n";
-	SetReplyString(reply.str());
+	std::string reply;
+	reply.reserve(file_contents.size() + 32);
+	reply += "201 DATA RETRIEVE OK\r\n";
+	reply += file_contents;
+	reply += "\r\n";
+	SetReplyUtf8(reply);
 	return true;
 }
 
@@ -1682,25 +2164,18 @@ bool DataCommand::DoExecuteRemove()
 
 bool DataCommand::DoExecuteList() 
 {
+	ListingOptions options;
+	if(!ParseListingOptions(_parameters, 1, options))
+	{
+		SetReplyString(TEXT("402 DATA LIST ERROR\r\n"));
+		return false;
+	}
+
 	std::wstringstream replyString;
 	replyString << TEXT("200 DATA LIST OK\r\n");
 
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::data_folder()), end; itr != end; ++itr)
-	{			
-		if(boost::filesystem::is_regular_file(itr->path()))
-		{
-			if(!boost::iequals(itr->path().extension(), L".ftd"))
-				continue;
-			
-			auto relativePath = boost::filesystem::wpath(itr->path().file_string().substr(env::data_folder().size()-1, itr->path().file_string().size()));
-			
-			auto str = relativePath.replace_extension(TEXT("")).external_file_string();
-			if(str[0] == '\\' || str[0] == '/')
-				str = std::wstring(str.begin() + 1, str.end());
-
-			replyString << str << TEXT("\r\n"); 	
-		}
-	}
+	BOOST_FOREACH(auto& entry, ListEntries(GetMediaLibraries().data, env::data_folder(), &GetDataType, nullptr, options))
+		replyString << entry.name << TEXT("\r\n");
 	
 	replyString << TEXT("\r\n");
 
@@ -1794,6 +2269,8 @@ bool ThumbnailCommand::DoExecute()
 
 	if (command == TEXT("RETRIEVE"))
 		return DoExecuteRetrieve();
+	else if (command == TEXT("STRIP"))
+		return DoExecuteStrip();
 	else if (command == TEXT("LIST"))
 		return DoExecuteList();
 	else if (command == TEXT("GENERATE"))
@@ -1817,7 +2294,7 @@ bool ThumbnailCommand::DoExecuteRetrieve()
 	filename.append(_parameters[1]);
 	filename.append(TEXT(".png"));
 
-	std::wstring file_contents = read_file_base64(boost::filesystem::wpath(filename));
+	std::string file_contents = read_cached(GetMediaLibraries().thumbnails, boost::filesystem::wpath(filename), &read_file_base64);
 
 	if (file_contents.empty())
 	{
@@ -1825,39 +2302,61 @@ bool ThumbnailCommand::DoExecuteRetrieve()
 		return false;
 	}
 
-	std::wstringstream reply;
+	std::string reply;
+	reply.reserve(file_contents.size() + 32);
+	reply += "201 THUMBNAIL RETRIEVE OK\r\n";
+	reply += file_contents;
+	reply += "\r\n";
+	SetReplyUtf8(reply);
+	return true;
+}
 
-	reply << L"201 THUMBNAIL RETRIEVE OK\r\n";
-	reply << file_contents;
-	reply << L"\r\n";
-	SetReplyString(reply.str());
+bool ThumbnailCommand::DoExecuteStrip() 
+{
+	if(_parameters.size() < 2) 
+	{
+		SetReplyString(TEXT("402 THUMBNAIL STRIP ERROR\r\n"));
+		return false;
+	}
+
+	std::wstring filename = env::thumbnails_folder();
+	filename.append(_parameters[1]);
+	filename.append(TEXT(".strip.png"));
+
+	std::string file_contents = read_cached(GetMediaLibraries().thumbnails, boost::filesystem::wpath(filename), &read_file_base64);
+
+	if (file_contents.empty())
+	{
+		SetReplyString(TEXT("404 THUMBNAIL STRIP ERROR\r\n"));
+		return false;
+	}
+
+	std::string reply;
+	reply.reserve(file_contents.size() + 32);
+	reply += "201 THUMBNAIL STRIP OK\r\n";
+	reply += file_contents;
+	reply += "\r\n";
+	SetReplyUtf8(reply);
 	return true;
 }
 
 bool ThumbnailCommand::DoExecuteList()
 {
+	ListingOptions options;
+	if(!ParseListingOptions(_parameters, 1, options))
+	{
+		SetReplyString(TEXT("402 THUMBNAIL LIST ERROR\r\n"));
+		return false;
+	}
+
 	std::wstringstream replyString;
 	replyString << TEXT("200 THUMBNAIL LIST OK\r\n");
 
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::thumbnails_folder()), end; itr != end; ++itr)
-	{			
-		if(boost::filesystem::is_regular_file(itr->path()))
-		{
-			if(!boost::iequals(itr->path().extension(), L".png"))
-				continue;
-			
-			auto relativePath = boost::filesystem::wpath(itr->path().file_string().substr(env::thumbnails_folder().size()-1, itr->path().file_string().size()));
-			
-			auto str = relativePath.replace_extension(L"").external_file_string();
-			if(str[0] == '\\' || str[0] == '/')
-				str = std::wstring(str.begin() + 1, str.end());
-
-			auto mtime = boost::filesystem::last_write_time(itr->path());
-			auto mtime_readable = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(mtime));
-			auto file_size = boost::filesystem::file_size(itr->path());
+	BOOST_FOREACH(auto& entry, ListEntries(GetMediaLibraries().thumbnails, env::thumbnails_folder(), &GetThumbnailType, nullptr, options))
+	{
+		auto mtime_readable = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(entry.last_write_time));
 
-			replyString << L"\"" << str << L"\" " << widen(mtime_readable) << L" " << file_size << L"\r\n";
-		}
+		replyString << L"\"" << entry.name << L"\" " << widen(mtime_readable) << L" " << entry.size << L"\r\n";
 	}
 	
 	replyString << TEXT("\r\n");
@@ -1912,15 +2411,27 @@ bool CinfCommand::DoExecute()
 	
 	try
 	{
-		std::wstring info;
-		for (boost::filesystem::wrecursive_directory_iterator itr(env::media_folder()), end; itr != end; ++itr)
+		std::vector<core::library_entry> entries;
+		auto library = GetMediaLibraries().media;
+
+		if(library && library->is_ready())
+			entries = library->find(_parameters.at(0));
+		else
 		{
-			auto path = itr->path();
-			auto file = path.replace_extension(L"").filename();
-			if(boost::iequals(file, _parameters.at(0)))
-				info += MediaInfo(itr->path(), GetMediaInfoRepo()) + L"\r\n";
+			for (boost::filesystem::wrecursive_directory_iterator itr(env::media_folder()), end; itr != end; ++itr)
+			{
+				auto path = itr->path();
+				auto file = path.replace_extension(L"").filename();
+				core::library_entry entry;
+				if(boost::iequals(file, _parameters.at(0)) && core::describe_file(env::media_folder(), itr->path(), &GetClipType, GetMediaInfoRepo(), entry))
+					entries.push_back(entry);
+			}
 		}
 
+		std::wstring info;
+		BOOST_FOREACH(auto& entry, entries)
+			info += MediaInfo(entry) + L"\r\n";
+
 		if(info.empty())
 		{
 			SetReplyString(TEXT("404 CINF ERROR\r\n"));
@@ -1959,9 +2470,15 @@ bool InfoCommand::DoExecute()
 			// Needs to be extended for any file, not just flash.
 
 			auto filename = flash::find_template(env::template_folder() + _parameters.at(1));
+
+			std::wstring template_info;
+			if(GetMediaInfoRepo())
+				template_info = GetMediaInfoRepo()->get(filename).template_info;
+			if(template_info.empty())
+				template_info = widen(flash::read_template_meta_info(filename));
 						
 			std::wstringstream str;
-			str << widen(flash::read_template_meta_info(filename));
+			str << template_info;
 			boost::property_tree::wptree info;
 			boost::property_tree::xml_parser::read_xml(str, info, boost::property_tree::xml_parser::trim_whitespace | boost::property_tree::xml_parser::no_comments);
 
@@ -1993,6 +2510,9 @@ bool InfoCommand::DoExecute()
 			info.add(L"system.windows.name",			caspar::get_win_product_name());
 			info.add(L"system.windows.service-pack",	caspar::get_win_sp_version());
 			info.add(L"system.cpu",						caspar::get_cpu_info());
+			info.add_child(L"system.caspar.locked-memory",	caspar::locked_memory_info());
+			info.add_child(L"system.caspar.producer-teardown",	core::get_producer_teardown_info());
+			info.add_child(L"system.caspar.allocations",		caspar::get_allocation_info());
 	
 			BOOST_FOREACH(auto device, caspar::decklink::get_device_list())
 				info.add(L"system.caspar.decklink.device", device);
@@ -2036,6 +2556,46 @@ bool InfoCommand::DoExecute()
 				.add(L"index", ++index);
 			boost::property_tree::write_xml(replyString, info, w);
 		}
+		else if(_parameters.size() >= 1 && _parameters[0] == L"IMAGES")
+		{
+			replyString << L"201 INFO IMAGES OK\r\n";
+
+			boost::property_tree::wptree info;
+			info.add_child(L"image-cache", caspar::image::get_cache_info());
+			boost::property_tree::write_xml(replyString, info, w);
+		}
+		else if(_parameters.size() >= 1 && _parameters[0] == L"CLIPS")
+		{
+			replyString << L"201 INFO CLIPS OK\r\n";
+
+			boost::property_tree::wptree info;
+			info.add_child(L"clip-cache", caspar::ffmpeg::get_clip_cache_info());
+			boost::property_tree::write_xml(replyString, info, w);
+		}
+		else if(_parameters.size() >= 1 && _parameters[0] == L"CONVERSIONS")
+		{
+			replyString << L"201 INFO CONVERSIONS OK\r\n";
+
+			boost::property_tree::wptree info;
+			info.add_child(L"conversion-cache", caspar::ffmpeg::get_conversion_cache_info());
+			boost::property_tree::write_xml(replyString, info, w);
+		}
+		else if(_parameters.size() >= 1 && _parameters[0] == L"LOCKS")
+		{
+			replyString << L"201 INFO LOCKS OK\r\n";
+
+			boost::property_tree::wptree info;
+			info.add_child(L"locks", get_lock_info());
+			boost::property_tree::write_xml(replyString, info, w);
+		}
+		else if(_parameters.size() >= 1 && _parameters[0] == L"EXECUTORS")
+		{
+			replyString << L"201 INFO EXECUTORS OK\r\n";
+
+			boost::property_tree::wptree info;
+			info.add_child(L"executors", diagnostics::get_executor_info());
+			boost::property_tree::write_xml(replyString, info, w);
+		}
 		else if(_parameters.size() >= 2 && _parameters[1] == L"DELAY")
 		{
 			replyString << L"201 INFO DELAY OK\r\n";
@@ -2130,9 +2690,16 @@ bool ClsCommand::DoExecute()
 		tga = still
 		col = still
 	*/
+	ListingOptions options;
+	if(!ParseListingOptions(_parameters, 0, options))
+	{
+		SetReplyString(TEXT("402 CLS ERROR\r\n"));
+		return false;
+	}
+
 	std::wstringstream replyString;
 	replyString << TEXT("200 CLS OK\r\n");
-	replyString << ListMedia(GetMediaInfoRepo());
+	replyString << ListMedia(GetMediaLibraries(), GetMediaInfoRepo(), options);
 	replyString << TEXT("\r\n");
 	SetReplyString(boost::to_upper_copy(replyString.str()));
 	return true;
@@ -2140,10 +2707,17 @@ bool ClsCommand::DoExecute()
 
 bool TlsCommand::DoExecute()
 {
+	ListingOptions options;
+	if(!ParseListingOptions(_parameters, 0, options))
+	{
+		SetReplyString(TEXT("402 TLS ERROR\r\n"));
+		return false;
+	}
+
 	std::wstringstream replyString;
 	replyString << TEXT("200 TLS OK\r\n");
 
-	replyString << ListTemplates();
+	replyString << ListTemplates(GetMediaLibraries(), options);
 	replyString << TEXT("\r\n");
 
 	SetReplyString(replyString.str());
@@ -2193,6 +2767,12 @@ bool SetCommand::DoExecute()
 		else
 			SetReplyString(TEXT("501 SET MODE FAILED\r\n"));
 	}
+	else if(name == TEXT("OFFLINE"))
+	{
+		// Consumers added after this follow the mode, set it before adding them.
+		GetChannel()->set_offline(value == TEXT("1") || value == TEXT("TRUE"));
+		SetReplyString(TEXT("202 SET OFFLINE OK\r\n"));
+	}
 	else
 	{
 		this->SetReplyString(TEXT("403 SET ERROR\r\n"));
@@ -25,6 +25,8 @@
 
 #include "AMCPCommand.h"
 
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
 namespace caspar {
 
 namespace core {
@@ -34,10 +36,14 @@ namespace core {
 
 namespace protocol {
 
-std::wstring ListMedia();
-std::wstring ListTemplates();
+// The indexes CLS, TLS, CINF, DATA LIST and THUMBNAIL LIST are served from.
+core::media_libraries CreateMediaLibraries(filesystem_monitor_factory& monitor_factory, const std::shared_ptr<core::media_info_repository>& media_info_repo);
 
 namespace amcp {
+
+// Waits for the LOAD and LOADBG of the layer still building their producers,
+// or those of every layer of the channel for std::numeric_limits<int>::min().
+void WaitForLayerLoads(AMCPCommand& command, int layer);
 	
 class ChannelGridCommand : public AMCPCommandBase<false, 0>
 {
@@ -51,6 +57,30 @@ class DiagnosticsCommand : public AMCPCommandBase<false, 0>
 	bool DoExecute();
 };
 
+class TraceCommand : public AMCPCommandBase<false, 1>
+{
+	std::wstring print() const { return L"TraceCommand";}
+	bool DoExecute();
+};
+
+class BatchCommand : public AMCPCommandBase<false, 0>
+{
+public:
+	explicit BatchCommand(const std::vector<AMCPCommandPtr>& commands) : commands_(commands), tick_(-1), frames_(0){}
+
+	// COMMIT AT, the stage changes are applied before a tick or at a time of day, see core::stage_batch.
+	void ScheduleAtTick(int64_t tick) { tick_ = tick; }
+	void ScheduleAtTime(const boost::posix_time::time_duration& time_of_day, int frames) { time_of_day_ = time_of_day; frames_ = frames; }
+private:
+	std::wstring print() const { return L"BatchCommand";}
+	bool DoExecute();
+
+	std::vector<AMCPCommandPtr>			commands_;
+	int64_t								tick_;
+	boost::posix_time::time_duration	time_of_day_; // Not a date time unless scheduled at a time.
+	int									frames_;
+};
+
 class CallCommand : public AMCPCommandBase<true, 1>
 {
 	std::wstring print() const { return L"CallCommand";}
@@ -114,8 +144,34 @@ class LoadCommand : public AMCPCommandBase<true, 1>
 
 class LoadbgCommand : public AMCPCommandBase<true, 1>
 {
+public:
+	LoadbgCommand() : synchronous_(false) {}
+
+	// Builds the producer on the command queue, as with the SYNC flag.
+	void SetSynchronous(bool synchronous) { synchronous_ = synchronous; }
+private:
 	std::wstring print() const { return L"LoadbgCommand";}
 	bool DoExecute();
+
+	bool synchronous_;
+};
+
+class PreloadCommand : public AMCPCommandBase<true, 1>
+{
+	std::wstring print() const { return L"PreloadCommand";}
+	bool DoExecute();
+};
+
+class PinCommand : public AMCPCommandBase<true, 1>
+{
+	std::wstring print() const { return L"PinCommand";}
+	bool DoExecute();
+};
+
+class UnpinCommand : public AMCPCommandBase<false, 1>
+{
+	std::wstring print() const { return L"UnpinCommand";}
+	bool DoExecute();
 };
 
 class PlayCommand: public AMCPCommandBase<true, 0>
@@ -186,6 +242,7 @@ class ThumbnailCommand : public AMCPCommandBase<false, 1>
 	std::wstring print() const { return L"ThumbnailCommand";}
 	bool DoExecute();
 	bool DoExecuteRetrieve();
+	bool DoExecuteStrip();
 	bool DoExecuteList();
 	bool DoExecuteGenerate();
 	bool DoExecuteGenerateAll();
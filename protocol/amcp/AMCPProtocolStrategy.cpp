@@ -33,9 +33,11 @@
 #include <algorithm>
 #include <cctype>
 
+#include <boost/algorithm/string/case_conv.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/classification.hpp>
 #include <boost/lexical_cast.hpp>
 
 #if defined(_MSC_VER)
@@ -48,6 +50,45 @@ using IO::ClientInfoPtr;
 
 const std::wstring AMCPProtocolStrategy::MessageDelimiter = TEXT("\r\n");
 
+// COMMIT AT <tick> or COMMIT AT <hh:mm:ss:ff>, where the time is the local time of day.
+bool ParseCommitSchedule(const std::vector<std::wstring>& tokens, BatchCommand& command)
+{
+	if(tokens.size() == 1)
+		return true;
+
+	if(tokens.size() != 3 || tokens[1] != L"AT")
+		return false;
+
+	try
+	{
+		if(tokens[2].find(L':') == std::wstring::npos)
+		{
+			command.ScheduleAtTick(boost::lexical_cast<int64_t>(tokens[2]));
+			return true;
+		}
+
+		std::vector<std::wstring> fields;
+		boost::split(fields, tokens[2], boost::is_any_of(L":;"));
+		if(fields.size() < 3 || fields.size() > 4)
+			return false;
+
+		auto hours		= boost::lexical_cast<int>(fields[0]);
+		auto minutes	= boost::lexical_cast<int>(fields[1]);
+		auto seconds	= boost::lexical_cast<int>(fields[2]);
+		auto frames		= fields.size() > 3 ? boost::lexical_cast<int>(fields[3]) : 0;
+
+		if(hours < 0 || hours > 23 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 59 || frames < 0)
+			return false;
+
+		command.ScheduleAtTime(boost::posix_time::time_duration(hours, minutes, seconds), frames);
+		return true;
+	}
+	catch(boost::bad_lexical_cast&)
+	{
+		return false;
+	}
+}
+
 inline std::shared_ptr<core::video_channel> GetChannelSafe(unsigned int index, const std::vector<safe_ptr<core::video_channel>>& channels)
 {
 	return index < channels.size() ? std::shared_ptr<core::video_channel>(channels[index]) : nullptr;
@@ -58,13 +99,19 @@ AMCPProtocolStrategy::AMCPProtocolStrategy(
 		const std::vector<safe_ptr<core::recorder>>& recorders,
 		const std::shared_ptr<core::thumbnail_generator>& thumb_gen,
 		const safe_ptr<core::media_info_repository>& media_info_repo,
-		boost::promise<bool>& shutdown_server_now)
+		const core::media_libraries& libraries,
+		boost::promise<bool>& shutdown_server_now,
+		const std::shared_ptr<command_log>& commandLog)
 	: channels_(channels)
 	, recorders_(recorders)
 	, thumb_gen_(thumb_gen)
 	, media_info_repo_(media_info_repo)
+	, libraries_(libraries)
 	, shutdown_server_now_(shutdown_server_now)
+	, commandLog_(commandLog)
 {
+	RegisterCommands();
+
 	AMCPCommandQueuePtr pGeneralCommandQueue(new AMCPCommandQueue());
 	commandQueues_.push_back(pGeneralCommandQueue);
 
@@ -89,38 +136,34 @@ AMCPProtocolStrategy::~AMCPProtocolStrategy() {
 
 void AMCPProtocolStrategy::Parse(const TCHAR* pData, int charCount, ClientInfoPtr pClientInfo)
 {
-	size_t pos;
-	size_t oldLength = pClientInfo->currentMessage_.length();
+	auto& buffer = pClientInfo->currentMessage_;
+	std::size_t oldLength = buffer.length();
+
+	if(buffer.capacity() < (oldLength + charCount))
+		buffer.reserve(oldLength + 8192 * 4);
 
-	if(pClientInfo->currentMessage_.capacity() < (oldLength + charCount))
-		pClientInfo->currentMessage_.reserve(oldLength + 8192 * 4);
+	buffer.append(pData, charCount);
 
-	pClientInfo->currentMessage_.append(pData, charCount);
+	// The messages are taken from where they lie in the buffer, which is compacted once when all are done.
+	std::size_t start = 0;
+	std::size_t searchFrom = (oldLength>(MessageDelimiter.size()-1)) ? oldLength-(MessageDelimiter.size()-1) : 0;
 
 	while(true) {
-		pos = pClientInfo->currentMessage_.find(MessageDelimiter, (oldLength>(MessageDelimiter.size()-1)) ? oldLength-(MessageDelimiter.size()-1) : 0);
-		if(pos != std::wstring::npos)
-		{
-			std::wstring message = pClientInfo->currentMessage_.substr(0,pos);
+		std::size_t pos = buffer.find(MessageDelimiter, std::max(start, searchFrom));
+		if(pos == std::wstring::npos)
+			break;
 
-			//This is where a complete message gets taken care of
-			if(message.length() > 0) {
-				ProcessMessage(message, pClientInfo);
-			}
+		//This is where a complete message gets taken care of
+		if(pos > start)
+			ProcessMessage(buffer.substr(start, pos-start), pClientInfo);
 
-			std::size_t nextStartPos = pos + MessageDelimiter.length();
-			if(nextStartPos < pClientInfo->currentMessage_.length())
-				pClientInfo->currentMessage_ = pClientInfo->currentMessage_.substr(nextStartPos);
-			else {
-				pClientInfo->currentMessage_.clear();
-				break;
-			}
-		}
-		else
-		{
-			break;
-		}
+		start = pos + MessageDelimiter.length();
 	}
+
+	if(start >= buffer.length())
+		buffer.clear();
+	else if(start > 0)
+		buffer.erase(0, start);
 }
 
 void AMCPProtocolStrategy::ProcessMessage(const std::wstring& message, ClientInfoPtr& pClientInfo)
@@ -129,28 +172,49 @@ void AMCPProtocolStrategy::ProcessMessage(const std::wstring& message, ClientInf
 		CASPAR_LOG(info) << L"Received message from " << pClientInfo->print() << ": " << message << L"\\r\\n";
 	else
 		CASPAR_LOG(info) << L"Received long message from " << pClientInfo->print() << ": " << message.substr(0, 510) << " [...]\\r\\n";
+
+	if(commandLog_)
+		commandLog_->record(pClientInfo, message);
 	
+	// "REQ <id> <command>" has the reply tagged with the id, see MakeReply.
+	std::wstring requestId;
+	std::wstring command = message;
+	if(boost::istarts_with(message, L"REQ "))
+	{
+		auto idEnd = message.find(L' ', 4);
+		requestId = message.substr(4, idEnd - 4);
+		command = idEnd != std::wstring::npos ? message.substr(idEnd + 1) : L"";
+	}
+
+	if(ProcessBatchMessage(command, requestId, pClientInfo))
+		return;
+
 	bool bError = true;
 	MessageParserState state = New;
 
 	AMCPCommandPtr pCommand;
 
-	pCommand = InterpretCommandString(message, &state);
+	pCommand = InterpretCommandString(command, &state);
 
 	if(pCommand != 0) {
 		pCommand->SetClientInfo(pClientInfo);	
-		if(QueueCommand(pCommand))
+		pCommand->SetRequestId(requestId);
+		if(AddToBatch(pCommand, pClientInfo))
+			return;
+		else if(QueueCommand(pCommand))
 			bError = false;
 		else
 			state = GetChannel;
 	}
+	else
+		InvalidateBatch(pClientInfo);
 
 	if(bError == true) {
 		std::wstringstream answer;
 		switch(state)
 		{
 		case GetCommand:
-			answer << TEXT("400 ERROR\r\n") + message << "\r\n";
+			answer << TEXT("400 ERROR\r\n") + command << "\r\n";
 			break;
 		case GetChannel:
 			answer << TEXT("401 ERROR\r\n");
@@ -162,13 +226,97 @@ void AMCPProtocolStrategy::ProcessMessage(const std::wstring& message, ClientInf
 			answer << TEXT("500 FAILED\r\n");
 			break;
 		}
-		pClientInfo->Send(answer.str());
+		pClientInfo->Send(MakeReply(requestId, answer.str()));
 	}
 }
 
+bool AMCPProtocolStrategy::ProcessBatchMessage(const std::wstring& message, const std::wstring& requestId, ClientInfoPtr& pClientInfo)
+{
+	std::vector<std::wstring> tokens;
+	auto upper_message = boost::to_upper_copy(boost::trim_copy(message));
+	boost::split(tokens, upper_message, boost::is_space(), boost::token_compress_on);
+
+	auto keyword = tokens.front();
+	auto is_commit_at = keyword == L"COMMIT" && tokens.size() > 1 && tokens[1] == L"AT";
+	if(keyword != L"BEGIN" && keyword != L"COMMIT" && keyword != L"DISCARD" || tokens.size() > 1 && !is_commit_at)
+		return false;
+
+	std::shared_ptr<Batch> batch;
+	{
+		boost::lock_guard<boost::mutex> lock(batchMutex_);
+
+		for(auto it = batches_.begin(); it != batches_.end();)
+		{
+			if(it->first.expired())
+				it = batches_.erase(it);
+			else
+				++it;
+		}
+
+		auto it = batches_.find(pClientInfo);
+		if(it != batches_.end())
+		{
+			batch = it->second;
+			batches_.erase(it);
+		}
+
+		if(keyword == L"BEGIN")
+			batches_[pClientInfo] = std::make_shared<Batch>();
+	}
+
+	if(keyword == L"BEGIN")
+	{
+		if(batch)
+			CASPAR_LOG(warning) << L"Discarding unfinished batch from " << pClientInfo->print() << L".";
+
+		pClientInfo->Send(MakeReply(requestId, TEXT("202 BEGIN OK\r\n")));
+	}
+	else if(keyword == L"DISCARD")
+		pClientInfo->Send(MakeReply(requestId, batch ? TEXT("202 DISCARD OK\r\n") : TEXT("403 DISCARD ERROR\r\n")));
+	else
+	{
+		auto pCommand = std::make_shared<BatchCommand>(batch ? batch->commands : std::vector<AMCPCommandPtr>());
+		if(!batch || !batch->valid || !ParseCommitSchedule(tokens, *pCommand))
+		{
+			pClientInfo->Send(MakeReply(requestId, TEXT("403 COMMIT ERROR\r\n")));
+			return true;
+		}
+
+		pCommand->SetClientInfo(pClientInfo);
+		pCommand->SetRequestId(requestId);
+		QueueCommand(pCommand);
+	}
+
+	return true;
+}
+
+bool AMCPProtocolStrategy::AddToBatch(const AMCPCommandPtr& pCommand, ClientInfoPtr& pClientInfo)
+{
+	boost::lock_guard<boost::mutex> lock(batchMutex_);
+
+	auto it = batches_.find(pClientInfo);
+	if(it == batches_.end())
+		return false;
+
+	it->second->commands.push_back(pCommand);
+	pClientInfo->Send(MakeReply(pCommand->GetRequestId(), TEXT("202 QUEUED OK\r\n")));
+
+	return true;
+}
+
+void AMCPProtocolStrategy::InvalidateBatch(ClientInfoPtr& pClientInfo)
+{
+	boost::lock_guard<boost::mutex> lock(batchMutex_);
+
+	auto it = batches_.find(pClientInfo);
+	if(it != batches_.end())
+		it->second->valid = false;
+}
+
 AMCPCommandPtr AMCPProtocolStrategy::InterpretCommandString(const std::wstring& message, MessageParserState* pOutState)
 {
 	std::vector<std::wstring> tokens;
+	tokens.reserve(16);
 	unsigned int currentToken = 0;
 	std::wstring commandSwitch;
 
@@ -206,6 +354,7 @@ AMCPCommandPtr AMCPProtocolStrategy::InterpretCommandString(const std::wstring&
 				pCommand->SetRecorders(recorders_);
 				pCommand->SetThumbGenerator(thumb_gen_);
 				pCommand->SetMediaInfoRepo(media_info_repo_);
+				pCommand->SetMediaLibraries(libraries_);
 				pCommand->SetShutdownServerNow(shutdown_server_now_);
 				//Set scheduling
 				if(commandSwitch.size() > 0) {
@@ -309,46 +458,51 @@ bool AMCPProtocolStrategy::QueueCommand(AMCPCommandPtr pCommand) {
 	return true;
 }
 
+void AMCPProtocolStrategy::RegisterCommands()
+{
+	commandFactories_[L"MIXER"] = []{ return std::make_shared<MixerCommand>(); };
+	commandFactories_[L"DIAG"] = []{ return std::make_shared<DiagnosticsCommand>(); };
+	commandFactories_[L"TRACE"] = []{ return std::make_shared<TraceCommand>(); };
+	commandFactories_[L"CHANNEL_GRID"] = []{ return std::make_shared<ChannelGridCommand>(); };
+	commandFactories_[L"CALL"] = []{ return std::make_shared<CallCommand>(); };
+	commandFactories_[L"SWAP"] = []{ return std::make_shared<SwapCommand>(); };
+	commandFactories_[L"ROUTE"] = []{ return std::make_shared<RouteCommand>(); };
+	commandFactories_[L"LOAD"] = []{ return std::make_shared<LoadCommand>(); };
+	commandFactories_[L"LOADBG"] = []{ return std::make_shared<LoadbgCommand>(); };
+	commandFactories_[L"PRELOAD"] = []{ return std::make_shared<PreloadCommand>(); };
+	commandFactories_[L"PIN"] = []{ return std::make_shared<PinCommand>(); };
+	commandFactories_[L"UNPIN"] = []{ return std::make_shared<UnpinCommand>(); };
+	commandFactories_[L"ADD"] = []{ return std::make_shared<AddCommand>(); };
+	commandFactories_[L"REMOVE"] = []{ return std::make_shared<RemoveCommand>(); };
+	commandFactories_[L"PAUSE"] = []{ return std::make_shared<PauseCommand>(); };
+	commandFactories_[L"PLAY"] = []{ return std::make_shared<PlayCommand>(); };
+	commandFactories_[L"STOP"] = []{ return std::make_shared<StopCommand>(); };
+	commandFactories_[L"CLEAR"] = []{ return std::make_shared<ClearCommand>(); };
+	commandFactories_[L"PRINT"] = []{ return std::make_shared<PrintCommand>(); };
+	commandFactories_[L"LOG"] = []{ return std::make_shared<LogCommand>(); };
+	commandFactories_[L"CG"] = []{ return std::make_shared<CGCommand>(); };
+	commandFactories_[L"DATA"] = []{ return std::make_shared<DataCommand>(); };
+	commandFactories_[L"CAPTURE"] = []{ return std::make_shared<CaptureCommand>(); };
+	commandFactories_[L"RECORDER"] = []{ return std::make_shared<RecorderCommand>(); };
+	commandFactories_[L"CINF"] = []{ return std::make_shared<CinfCommand>(); };
+	commandFactories_[L"INFO"] = [this]{ return std::make_shared<InfoCommand>(channels_, recorders_); };
+	commandFactories_[L"CLS"] = []{ return std::make_shared<ClsCommand>(); };
+	commandFactories_[L"TLS"] = []{ return std::make_shared<TlsCommand>(); };
+	commandFactories_[L"VERSION"] = []{ return std::make_shared<VersionCommand>(); };
+	commandFactories_[L"BYE"] = []{ return std::make_shared<ByeCommand>(); };
+	commandFactories_[L"SET"] = []{ return std::make_shared<SetCommand>(); };
+	commandFactories_[L"THUMBNAIL"] = []{ return std::make_shared<ThumbnailCommand>(); };
+	commandFactories_[L"KILL"] = []{ return std::make_shared<KillCommand>(); };
+	commandFactories_[L"RESTART"] = []{ return std::make_shared<RestartCommand>(); };
+}
+
 AMCPCommandPtr AMCPProtocolStrategy::CommandFactory(const std::wstring& str)
 {
 	std::wstring s = str;
 	transform(s.begin(), s.end(), s.begin(), toupper);
 	
-	if	   (s == TEXT("MIXER"))			return std::make_shared<MixerCommand>();
-	else if(s == TEXT("DIAG"))			return std::make_shared<DiagnosticsCommand>();
-	else if(s == TEXT("CHANNEL_GRID"))	return std::make_shared<ChannelGridCommand>();
-	else if(s == TEXT("CALL"))			return std::make_shared<CallCommand>();
-	else if(s == TEXT("SWAP"))			return std::make_shared<SwapCommand>();
-	else if(s == TEXT("ROUTE"))			return std::make_shared<RouteCommand>();
-	else if(s == TEXT("LOAD"))			return std::make_shared<LoadCommand>();
-	else if(s == TEXT("LOADBG"))		return std::make_shared<LoadbgCommand>();
-	else if(s == TEXT("ADD"))			return std::make_shared<AddCommand>();
-	else if(s == TEXT("REMOVE"))		return std::make_shared<RemoveCommand>();
-	else if(s == TEXT("PAUSE"))			return std::make_shared<PauseCommand>();
-	else if(s == TEXT("PLAY"))			return std::make_shared<PlayCommand>();
-	else if(s == TEXT("STOP"))			return std::make_shared<StopCommand>();
-	else if(s == TEXT("CLEAR"))			return std::make_shared<ClearCommand>();
-	else if(s == TEXT("PRINT"))			return std::make_shared<PrintCommand>();
-	else if(s == TEXT("LOG"))			return std::make_shared<LogCommand>();
-	else if(s == TEXT("CG"))			return std::make_shared<CGCommand>();
-	else if(s == TEXT("DATA"))			return std::make_shared<DataCommand>();
-	else if(s == TEXT("CAPTURE"))		return std::make_shared<CaptureCommand>();
-	else if(s == TEXT("RECORDER"))		return std::make_shared<RecorderCommand>();
-	else if(s == TEXT("CINF"))			return std::make_shared<CinfCommand>();
-	else if(s == TEXT("INFO"))			return std::make_shared<InfoCommand>(channels_, recorders_);
-	else if(s == TEXT("CLS"))			return std::make_shared<ClsCommand>();
-	else if(s == TEXT("TLS"))			return std::make_shared<TlsCommand>();
-	else if(s == TEXT("VERSION"))		return std::make_shared<VersionCommand>();
-	else if(s == TEXT("BYE"))			return std::make_shared<ByeCommand>();
-	else if(s == TEXT("SET"))			return std::make_shared<SetCommand>();
-	else if(s == TEXT("THUMBNAIL"))		return std::make_shared<ThumbnailCommand>();
-	//else if(s == TEXT("MONITOR"))
-	//{
-	//	result = AMCPCommandPtr(new MonitorCommand());
-	//}
-	else if(s == TEXT("KILL"))			return std::make_shared<KillCommand>();
-	else if(s == TEXT("RESTART"))		return std::make_shared<RestartCommand>();
-	return nullptr;
+	auto it = commandFactories_.find(s);
+	return it != commandFactories_.end() ? it->second() : nullptr;
 }
 
 std::size_t AMCPProtocolStrategy::TokenizeMessage(const std::wstring& message, std::vector<std::wstring>* pTokenVector)
@@ -356,70 +510,66 @@ std::size_t AMCPProtocolStrategy::TokenizeMessage(const std::wstring& message, s
 	//split on whitespace but keep strings within quotationmarks
 	//treat \ as the start of an escape-sequence: the following char will indicate what to actually put in the string
 
-	std::wstring currentToken;
+	// Plain characters are copied a run at a time, so a token without escapes costs a single allocation.
+	const wchar_t* data = message.c_str();
+	const std::size_t size = message.size();
 
-	char inQuote = 0;
-	bool getSpecialCode = false;
+	std::wstring currentToken;
+	std::size_t runStart = 0;
+	bool inQuote = false;
 
-	for(unsigned int charIndex=0; charIndex<message.size(); ++charIndex)
+	for(std::size_t charIndex = 0; charIndex < size; ++charIndex)
 	{
-		if(getSpecialCode)
-		{
-			//insert code-handling here
-			switch(message[charIndex])
-			{
-			case TEXT('\\'):
-				currentToken += TEXT("\\");
-				break;
-			case TEXT('\"'):
-				currentToken += TEXT("\"");
-				break;
-			case TEXT('n'):
-				currentToken += TEXT("\n");
-				break;
-			default:
-				break;
-			};
-			getSpecialCode = false;
-			continue;
-		}
+		const wchar_t c = data[charIndex];
 
-		if(message[charIndex]==TEXT('\\'))
+		if(c == TEXT('\\'))
 		{
-			getSpecialCode = true;
-			continue;
-		}
+			currentToken.append(data + runStart, data + charIndex);
 
-		if(message[charIndex]==' ' && inQuote==false)
-		{
-			if(currentToken.size()>0)
+			if(++charIndex < size)
 			{
-				pTokenVector->push_back(currentToken);
-				currentToken.clear();
+				//insert code-handling here
+				switch(data[charIndex])
+				{
+				case TEXT('\\'):
+					currentToken += TEXT('\\');
+					break;
+				case TEXT('\"'):
+					currentToken += TEXT('\"');
+					break;
+				case TEXT('n'):
+					currentToken += TEXT('\n');
+					break;
+				default:
+					break;
+				};
 			}
+
+			runStart = charIndex + 1;
 			continue;
 		}
 
-		if(message[charIndex]==TEXT('\"'))
+		if((c == TEXT(' ') && !inQuote) || c == TEXT('\"'))
 		{
-			inQuote ^= 1;
+			if(c == TEXT('\"'))
+				inQuote = !inQuote;
+
+			currentToken.append(data + runStart, data + charIndex);
+			runStart = charIndex + 1;
 
-			if(currentToken.size()>0)
+			if(!currentToken.empty())
 			{
-				pTokenVector->push_back(currentToken);
+				pTokenVector->push_back(std::move(currentToken));
 				currentToken.clear();
 			}
 			continue;
 		}
-
-		currentToken += message[charIndex];
 	}
 
-	if(currentToken.size()>0)
-	{
-		pTokenVector->push_back(currentToken);
-		currentToken.clear();
-	}
+	currentToken.append(data + std::min(runStart, size), data + size);
+
+	if(!currentToken.empty())
+		pTokenVector->push_back(std::move(currentToken));
 
 	return pTokenVector->size();
 }
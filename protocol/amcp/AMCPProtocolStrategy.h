@@ -29,9 +29,15 @@
 
 #include "AMCPCommand.h"
 #include "AMCPCommandQueue.h"
+#include "command_log.h"
 
 #include <boost/noncopyable.hpp>
 #include <boost/thread/future.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <functional>
+#include <map>
+#include <unordered_map>
 
 namespace caspar { namespace protocol { namespace amcp {
 
@@ -55,7 +61,9 @@ public:
 			const std::vector<safe_ptr<core::recorder>>& recorders,
 			const std::shared_ptr<core::thumbnail_generator>& thumb_gen,
 			const safe_ptr<core::media_info_repository>& media_info_repo,
-			boost::promise<bool>& shutdown_server_now);
+			const core::media_libraries& libraries,
+			boost::promise<bool>& shutdown_server_now,
+			const std::shared_ptr<command_log>& commandLog = nullptr);
 	virtual ~AMCPProtocolStrategy();
 
 	virtual void Parse(const TCHAR* pData, int charCount, IO::ClientInfoPtr pClientInfo);
@@ -68,8 +76,21 @@ public:
 private:
 	friend class AMCPCommand;
 
+	// The commands of a client between BEGIN and COMMIT, executed together once committed.
+	struct Batch
+	{
+		Batch() : valid(true) {}
+
+		std::vector<AMCPCommandPtr> commands;
+		bool valid;
+	};
+
 	void ProcessMessage(const std::wstring& message, IO::ClientInfoPtr& pClientInfo);
+	bool ProcessBatchMessage(const std::wstring& message, const std::wstring& requestId, IO::ClientInfoPtr& pClientInfo);
+	bool AddToBatch(const AMCPCommandPtr& pCommand, IO::ClientInfoPtr& pClientInfo);
+	void InvalidateBatch(IO::ClientInfoPtr& pClientInfo);
 	std::size_t TokenizeMessage(const std::wstring& message, std::vector<std::wstring>* pTokenVector);
+	void RegisterCommands();
 	AMCPCommandPtr CommandFactory(const std::wstring& str);
 
 	bool QueueCommand(AMCPCommandPtr);
@@ -78,8 +99,13 @@ private:
 	std::vector<safe_ptr<core::recorder>> recorders_;
 	std::shared_ptr<core::thumbnail_generator> thumb_gen_;
 	safe_ptr<core::media_info_repository> media_info_repo_;
+	core::media_libraries libraries_;
 	boost::promise<bool>& shutdown_server_now_;
+	std::shared_ptr<command_log> commandLog_;
 	std::vector<AMCPCommandQueuePtr> commandQueues_;
+	std::unordered_map<std::wstring, std::function<AMCPCommandPtr()>> commandFactories_;
+	boost::mutex batchMutex_;
+	std::map<std::weak_ptr<IO::ClientInfo>, std::shared_ptr<Batch>, std::owner_less<std::weak_ptr<IO::ClientInfo>>> batches_;
 	static const std::wstring MessageDelimiter;
 };
 
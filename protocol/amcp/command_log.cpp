@@ -0,0 +1,202 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../stdafx.h"
+
+#include "command_log.h"
+
+#include <common/concurrency/executor.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <tbb/mutex.h>
+
+#include <fstream>
+#include <map>
+
+namespace caspar { namespace protocol { namespace amcp {
+
+namespace {
+
+std::string escape(const std::string& message)
+{
+	std::string result;
+	result.reserve(message.size());
+
+	BOOST_FOREACH(auto c, message)
+	{
+		switch(c)
+		{
+		case '\\':	result += "\\\\";	break;
+		case '\r':	result += "\\r";	break;
+		case '\n':	result += "\\n";	break;
+		default:	result += c;		break;
+		}
+	}
+
+	return result;
+}
+
+std::string unescape(const std::string& message)
+{
+	std::string result;
+	result.reserve(message.size());
+
+	for(std::size_t n = 0; n < message.size(); ++n)
+	{
+		if(message[n] != '\\' || n + 1 == message.size())
+		{
+			result += message[n];
+			continue;
+		}
+
+		switch(message[++n])
+		{
+		case 'r':	result += '\r';			break;
+		case 'n':	result += '\n';			break;
+		default:	result += message[n];	break;
+		}
+	}
+
+	return result;
+}
+
+}
+
+struct command_log::impl
+{
+	const std::wstring								file_;
+	const boost::posix_time::ptime					start_;
+
+	tbb::mutex										mutex_;
+	std::map<std::weak_ptr<IO::ClientInfo>, int, std::owner_less<std::weak_ptr<IO::ClientInfo>>> clients_;
+	int												last_client_;
+
+	std::ofstream									out_;
+	executor										executor_;
+
+	impl(const std::wstring& file)
+		: file_(file)
+		, start_(boost::posix_time::microsec_clock::universal_time())
+		, last_client_(0)
+		, out_(file.c_str(), std::ios::binary | std::ios::trunc)
+		, executor_(L"command_log")
+	{
+		if(!out_)
+			BOOST_THROW_EXCEPTION(file_write_error() << msg_info(narrow(L"Could not open the command log " + file)));
+
+		CASPAR_LOG(info) << L"Recording AMCP commands to " << file_;
+	}
+
+	~impl()
+	{
+		executor_.invoke([this]
+		{
+			out_.flush();
+		});
+	}
+
+	void record(const IO::ClientInfoPtr& client, const std::wstring& message)
+	{
+		auto millis = (boost::posix_time::microsec_clock::universal_time() - start_).total_milliseconds();
+		int id;
+
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = clients_.find(client);
+			if(it == clients_.end())
+			{
+				for(auto expired = clients_.begin(); expired != clients_.end();)
+				{
+					if(expired->first.expired())
+						expired = clients_.erase(expired);
+					else
+						++expired;
+				}
+
+				it = clients_.insert(std::make_pair(std::weak_ptr<IO::ClientInfo>(client), ++last_client_)).first;
+			}
+
+			id = it->second;
+		}
+
+		// Only the order matters to the file, which the executor keeps.
+		executor_.begin_invoke([=]
+		{
+			out_ << millis << '\t' << id << '\t' << escape(narrow(message)) << '\n';
+
+			if(!out_)
+				CASPAR_LOG(warning) << L"Failed to write to the command log " << file_;
+		});
+	}
+};
+
+command_log::command_log(const std::wstring& file) : impl_(new impl(file)){}
+command_log::~command_log(){}
+void command_log::record(const IO::ClientInfoPtr& client, const std::wstring& message){impl_->record(client, message);}
+
+std::vector<logged_command> read_command_log(const std::wstring& file)
+{
+	std::ifstream in(file.c_str(), std::ios::binary);
+
+	if(!in)
+		BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(L"Could not open the command log " + file)));
+
+	std::vector<logged_command> commands;
+	std::string line;
+	int skipped = 0;
+
+	while(std::getline(in, line))
+	{
+		auto first	= line.find('\t');
+		auto second	= first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+
+		try
+		{
+			if(second == std::string::npos)
+				BOOST_THROW_EXCEPTION(invalid_argument());
+
+			logged_command command;
+			command.millis	= boost::lexical_cast<std::int64_t>(line.substr(0, first));
+			command.client	= boost::lexical_cast<int>(line.substr(first + 1, second - first - 1));
+			command.message	= widen(unescape(line.substr(second + 1)));
+			commands.push_back(command);
+		}
+		catch(...)
+		{
+			++skipped;
+		}
+	}
+
+	if(skipped > 0)
+		CASPAR_LOG(warning) << L"Skipped " << skipped << L" unreadable lines of the command log " << file;
+
+	return commands;
+}
+
+}}}
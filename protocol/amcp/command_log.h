@@ -0,0 +1,77 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include "../util/ClientInfo.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace caspar { namespace protocol { namespace amcp {
+
+/**
+ * A message as recorded by command_log.
+ */
+struct logged_command
+{
+	std::int64_t	millis;		// Since the log was started.
+	int				client;		// Numbered from 1 in the order the clients first sent something.
+	std::wstring	message;	// Without the \r\n delimiter.
+};
+
+/**
+ * Records every AMCP message received, for replaying the load later with
+ * casparcg --replay, see shell/benchmark.h.
+ *
+ * The file has one message per line as "<millis>\t<client>\t<message>" in
+ * UTF-8, with backslashes, carriage returns and line feeds in the message
+ * escaped as \\, \r and \n. It is written on a thread of its own.
+ */
+class command_log : boost::noncopyable
+{
+public:
+
+	// Constructors
+
+	explicit command_log(const std::wstring& file);
+	~command_log();
+
+	// Methods
+
+	void record(const IO::ClientInfoPtr& client, const std::wstring& message);
+private:
+	struct impl;
+	safe_ptr<impl> impl_;
+};
+
+/**
+ * Reads a file written by command_log, leaving out lines it cannot parse.
+ */
+std::vector<logged_command> read_command_log(const std::wstring& file);
+
+}}}
@@ -24,8 +24,14 @@
 #include <stdexcept>
 #include <sstream>
 
+#include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/timer.hpp>
 
+#include <tbb/spin_mutex.h>
+
+#include <common/concurrency/executor.h>
 #include <common/log/log.h>
 
 #include <modules/flash/producer/cg_producer.h>
@@ -34,18 +40,106 @@
 
 namespace caspar { namespace protocol { namespace CLK {
 
+// Clock controllers send updates many times a second. They are queued and delivered to the template from 
+// an executor of its own, at most once per frame of the channel, so the protocol thread never waits on the 
+// channel or the flash player.
 class command_context
 {
-	bool clock_loaded_;
-	safe_ptr<core::video_channel> channel_;
+	struct pending_command
+	{
+		std::wstring key; // Empty if it must be delivered.
+		std::wstring data;
+	};
+
+	safe_ptr<core::video_channel>	channel_;
+	tbb::spin_mutex					mutex_;
+	std::vector<pending_command>	pending_;
+	bool							flush_scheduled_;
+	boost::timer					since_flush_;
+	bool							clock_loaded_; // Only used on the executor.
+	executor						executor_;
 public:
 	command_context(const safe_ptr<core::video_channel>& channel)
-		: clock_loaded_(false)
-		, channel_(channel)
+		: channel_(channel)
+		, flush_scheduled_(false)
+		, clock_loaded_(false)
+		, executor_(L"clk")
+	{
+	}
+
+	// A command with the same key as one still pending replaces it, unless a command without a key, such as
+	// ADD, has been queued after that one.
+	void send_to_flash(const std::wstring& data, const std::wstring& key = L"")
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		for(auto it = pending_.rbegin(); !key.empty() && it != pending_.rend() && !it->key.empty(); ++it)
+		{
+			if(it->key == key)
+			{
+				it->data = data;
+				return;
+			}
+		}
+
+		pending_command command = {key, data};
+		pending_.push_back(command);
+
+		if(flush_scheduled_)
+			return;
+
+		flush_scheduled_ = true;
+		executor_.begin_invoke([=]
+		{
+			flush();
+		});
+	}
+
+	void reset()
 	{
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			pending_.clear();
+		}
+
+		executor_.begin_invoke([=]
+		{
+			channel_->stage()->clear(flash::cg_producer::DEFAULT_LAYER);
+			clock_loaded_ = false;
+			CASPAR_LOG(info) << L"CLK: Recieved and executed reset-command";
+		});
+	}
+private:
+	void flush()
+	{
+		// What arrives in the meantime is merged into the next flush.
+		auto remaining = 1.0 / channel_->get_video_format_desc().fps - since_flush_.elapsed();
+		if(remaining > 0.0)
+			boost::this_thread::sleep(boost::posix_time::microseconds(static_cast<int64_t>(remaining * 1000000.0)));
+
+		std::vector<pending_command> commands;
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			commands.swap(pending_);
+			flush_scheduled_ = false;
+		}
+
+		since_flush_.restart();
+
+		BOOST_FOREACH(auto& command, commands)
+		{
+			try
+			{
+				deliver(command.data);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
 	}
 
-	void send_to_flash(const std::wstring& data)
+	void deliver(const std::wstring& data)
 	{
 		if (!clock_loaded_) 
 		{
@@ -60,13 +154,6 @@ public:
 				
 		CASPAR_LOG(debug) << L"CLK: Clockdata sent: " << data;
 	}
-
-	void reset()
-	{
-		channel_->stage()->clear(flash::cg_producer::DEFAULT_LAYER);
-		clock_loaded_ = false;
-		CASPAR_LOG(info) << L"CLK: Recieved and executed reset-command";
-	}
 };
 
 template<class T>
@@ -136,12 +223,15 @@ clk_command_handler create_send_xml_handler(
 	const std::wstring& command_name, 
 	bool expect_clock, 
 	bool expect_time, 
-	const safe_ptr<command_context>& context)
+	const safe_ptr<command_context>& context,
+	bool coalesce = false)
 {
 	return [=] (const std::vector<std::wstring>& params)
 	{
-		context->send_to_flash(get_xml(
-			command_name, expect_clock, expect_time, params));
+		auto xml = get_xml(command_name, expect_clock, expect_time, params);
+
+		// Only the latest of commands which set the time of a clock matters.
+		context->send_to_flash(xml, coalesce ? command_name + L" " + params.at(0) : L"");
 	};
 }
 
@@ -153,11 +243,11 @@ void add_command_handlers(
 
 	processor
 		.add_handler(L"DUR", 
-			create_send_xml_handler(L"DUR", true, true, context))
+			create_send_xml_handler(L"DUR", true, true, context, true))
 		.add_handler(L"NEWDUR", 
-			create_send_xml_handler(L"NEWDUR", true, true, context))
+			create_send_xml_handler(L"NEWDUR", true, true, context, true))
 		.add_handler(L"UNTIL", 
-			create_send_xml_handler(L"UNTIL", true, true, context))
+			create_send_xml_handler(L"UNTIL", true, true, context, true))
 		.add_handler(L"NEXTEVENT", 
 			create_send_xml_handler(L"NEXTEVENT", true, false, context))
 		.add_handler(L"STOP", 
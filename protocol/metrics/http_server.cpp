@@ -0,0 +1,255 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "http_server.h"
+
+#include <common/diagnostics/graph.h>
+#include <common/env.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <tbb/atomic.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <string>
+
+using namespace boost::asio::ip;
+
+namespace caspar { namespace protocol { namespace metrics {
+
+std::string url_decode(const std::string& str)
+{
+	std::string result;
+
+	for (std::size_t n = 0; n < str.size(); ++n)
+	{
+		if (str[n] == '%' && n + 2 < str.size())
+		{
+			result += static_cast<char>(std::strtol(str.substr(n + 1, 2).c_str(), nullptr, 16));
+			n += 2;
+		}
+		else
+			result += str[n] == '+' ? ' ' : str[n];
+	}
+
+	return result;
+}
+
+// The png the thumbnail generator wrote for a media file, relative to the media folder and without extension. 
+// Returns false if there is none.
+bool read_thumbnail(const std::string& name, const std::wstring& suffix, std::string& content)
+{
+	if (name.empty() || name.find("..") != std::string::npos)
+		return false;
+
+	std::ifstream file((env::thumbnails_folder() + widen(name) + suffix).c_str(), std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+struct http_server::impl : public std::enable_shared_from_this<http_server::impl>
+{
+	struct connection
+	{
+		tcp::socket					socket;
+		boost::asio::streambuf		request;
+		std::string					response;
+
+		connection(boost::asio::io_service& service)
+			: socket(service)
+			, request(MAX_REQUEST_SIZE)
+		{
+		}
+	};
+
+	static const std::size_t					MAX_REQUEST_SIZE = 8192;
+
+	std::shared_ptr<boost::asio::io_service>	service_;
+	tcp::acceptor								acceptor_;
+	tbb::atomic<bool>							is_running_;
+
+	impl(std::shared_ptr<boost::asio::io_service> service, unsigned short port)
+		: service_(std::move(service))
+		, acceptor_(*service_, tcp::endpoint(tcp::v4(), port))
+	{
+		is_running_ = true;
+	}
+
+	void start()
+	{
+		start_accept();
+
+		CASPAR_LOG(info) << L"[metrics] Listening on port " << acceptor_.local_endpoint().port() << L".";
+	}
+
+	void stop()
+	{
+		is_running_ = false;
+
+		auto self = shared_from_this();
+		service_->post([self]
+		{
+			boost::system::error_code ec;
+			self->acceptor_.close(ec);
+		});
+	}
+private:
+	void start_accept()
+	{
+		auto self = shared_from_this();
+		auto c = std::make_shared<connection>(*service_);
+
+		acceptor_.async_accept(c->socket, [self, c](const boost::system::error_code& ec)
+		{
+			if (!self->is_running_ || ec == boost::asio::error::operation_aborted)
+				return;
+
+			if (!ec)
+				self->start_read(c);
+
+			self->start_accept();
+		});
+	}
+
+	void start_read(const std::shared_ptr<connection>& c)
+	{
+		auto self = shared_from_this();
+
+		boost::asio::async_read_until(c->socket, c->request, "\r\n\r\n", [self, c](const boost::system::error_code& ec, std::size_t)
+		{
+			if (ec)
+			{
+				boost::system::error_code close_ec;
+				c->socket.close(close_ec);
+				return;
+			}
+
+			self->respond(c);
+		});
+	}
+
+	void respond(const std::shared_ptr<connection>& c)
+	{
+		std::istream request(&c->request);
+		std::string method;
+		std::string target;
+		request >> method >> target;
+
+		std::string status;
+		std::string body;
+		std::string content_type = "text/plain; version=0.0.4";
+
+		// /graphs[?columns=N] serves the lines of the diagnostics window for a viewer on another machine.
+		auto path		= target.substr(0, target.find('?'));
+		auto columns	= 750;
+		auto query		= target.find("?columns=");
+		if (query != std::string::npos)
+			columns = std::atoi(target.c_str() + query + 9);
+
+		if (method != "GET")
+		{
+			status	= "405 Method Not Allowed";
+			body	= "Only GET is supported.\n";
+		}
+		else if (boost::starts_with(path, "/thumbnails/") || boost::starts_with(path, "/strips/"))
+		{
+			// The previews of the thumbnail generator, so that clients scrub without loading a clip on a channel.
+			auto is_strip	= boost::starts_with(path, "/strips/");
+			auto name		= url_decode(path.substr(is_strip ? 8 : 12));
+
+			if (read_thumbnail(name, is_strip ? L".strip.png" : L".png", body))
+			{
+				status			= "200 OK";
+				content_type	= "image/png";
+			}
+			else
+			{
+				status	= "404 Not Found";
+				body	= "No preview of " + name + ".\n";
+			}
+		}
+		else if (path != "/metrics" && path != "/graphs")
+		{
+			status	= "404 Not Found";
+			body	= "Metrics are served at /metrics, the diagnostics graphs at /graphs and the thumbnails and scrub strips "
+					  "at /thumbnails/<name> and /strips/<name>.\n";
+		}
+		else
+		{
+			try
+			{
+				status	= "200 OK";
+				if (path == "/graphs")
+				{
+					content_type	= "application/json";
+					body			= diagnostics::print_graphs(columns);
+				}
+				else
+					body = diagnostics::print_metrics();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				status	= "500 Internal Server Error";
+				body	= "";
+			}
+		}
+
+		c->response =
+				"HTTP/1.1 " + status + "\r\n"
+				"Content-Type: " + content_type + "\r\n"
+				"Content-Length: " + boost::lexical_cast<std::string>(body.size()) + "\r\n"
+				"Connection: close\r\n"
+				"\r\n" + body;
+
+		boost::asio::async_write(c->socket, boost::asio::buffer(c->response), [c](const boost::system::error_code&, std::size_t)
+		{
+			boost::system::error_code ec;
+			c->socket.shutdown(tcp::socket::shutdown_both, ec);
+			c->socket.close(ec);
+		});
+	}
+};
+
+http_server::http_server(std::shared_ptr<boost::asio::io_service> service, unsigned short port) 
+	: impl_(new impl(std::move(service), port))
+{
+	impl_->start();
+}
+
+http_server::~http_server()
+{
+	impl_->stop();
+}
+
+}}}
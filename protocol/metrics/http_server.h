@@ -0,0 +1,50 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace caspar { namespace protocol { namespace metrics {
+
+/**
+ * Serves diagnostics::print_metrics() over HTTP, GET /metrics answers in the
+ * Prometheus text format. GET /thumbnails/<name> and /strips/<name> answer
+ * with the thumbnail and scrub strip of a media file. Every request gets its
+ * own connection.
+ */
+class http_server : boost::noncopyable
+{
+public:
+
+	// Constructors
+
+	http_server(std::shared_ptr<boost::asio::io_service> service, unsigned short port);
+	~http_server();
+private:
+	struct impl;
+	safe_ptr<impl> impl_;
+};
+
+}}}
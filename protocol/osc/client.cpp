@@ -27,21 +27,28 @@
 #include "oscpack/OscOutboundPacketStream.h"
 #include "oscpack/OscHostEndianness.h"
 
+#include <common/env.h>
 #include <common/utility/string.h>
 #include <common/exception/win32_exception.h>
 #include <common/memory/endian.h>
 
+#include <core/load_governor.h>
 #include <core/monitor/monitor.h>
 
+#include <cstring>
 #include <functional>
+#include <limits>
 #include <vector>
 #include <unordered_map>
 
 #include <boost/asio.hpp>
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
+#include <boost/chrono.hpp>
 #include <boost/thread.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
 #include <tbb/spin_mutex.h>
 #include <tbb/cache_aligned_allocator.h>
 
@@ -127,16 +134,56 @@ void write_osc_bundle_element_start(byte_vector& destination, const byte_vector&
 #endif
 }
 
+bool has_same_bytes(const byte_vector& lhs, const byte_vector& rhs)
+{
+	return lhs.size() == rhs.size() && (lhs.empty() || std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+}
+
+int64_t now_millis()
+{
+	using namespace boost::chrono;
+
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 struct client::impl : public std::enable_shared_from_this<client::impl>, core::monitor::sink
 {
+	// The last message of a path, and what of it has been sent.
+	struct slot
+	{
+		byte_vector	next;
+		byte_vector	sent;
+		std::string			path;
+		int64_t				last_update;
+		int64_t				last_sent;
+		bool				is_pending;
+		int					wanted_version;
+		std::vector<bool>	wanted_by;
+
+		slot() : last_update(0), last_sent(std::numeric_limits<int64_t>::min() / 2), is_pending(false), wanted_version(-1) {}
+	};
+
+	// The paths wanted by an endpoint, over all of its subscription tokens.
+	typedef std::pair<udp::endpoint, std::vector<std::string>> destination;
+
+	static const int								MAX_QUEUED = 65536;
+
 	std::shared_ptr<boost::asio::io_service>		service_;
 	udp::socket socket_;
 	tbb::spin_mutex									endpoints_mutex_;
-	std::map<udp::endpoint, int>					reference_counts_by_endpoint_;
+	std::map<int, destination>						subscriptions_by_token_;
+	int												next_token_;
+	tbb::atomic<int>								subscriptions_version_;
+
+	const int64_t									min_interval_;
+	const int64_t									degraded_interval_; // The minimum interval while a channel sheds osc-rate.
+	const int64_t									refresh_interval_;
 
-	std::unordered_map<std::string, byte_vector>	updates_;
-	boost::mutex									updates_mutex_;								
-	boost::condition_variable						updates_cond_;
+	tbb::concurrent_queue<core::monitor::message>	queue_;
+	tbb::atomic<int>								queue_size_;
+	tbb::atomic<bool>								is_sleeping_;
+	boost::mutex									wake_mutex_;
+	boost::condition_variable						wake_cond_;
 
 	tbb::atomic<bool>								is_running_;
 
@@ -146,29 +193,48 @@ public:
 	impl(std::shared_ptr<boost::asio::io_service> service)
 		: service_(std::move(service))
 		, socket_(*service_, udp::v4())
-		, thread_(boost::bind(&impl::run, this))
+		, min_interval_(env::properties().get(L"configuration.osc.min-interval", 0))
+		, degraded_interval_(env::properties().get(L"configuration.osc.degraded-interval", 100))
+		, refresh_interval_(env::properties().get(L"configuration.osc.refresh-interval", 1000))
 	{
+		next_token_				= 0;
+		subscriptions_version_	= 0;
+		queue_size_				= 0;
+		is_sleeping_			= false;
+		is_running_				= true;
+
+		thread_ = boost::thread(boost::bind(&impl::run, this));
 	}
 
 	~impl()
 	{
 		is_running_ = false;
 
-		updates_cond_.notify_one();
+		{
+			boost::lock_guard<boost::mutex> lock(wake_mutex_);
+			wake_cond_.notify_one();
+		}
 
 		thread_.join();
 	}
 
 	std::shared_ptr<void> get_subscription_token(
-			const boost::asio::ip::udp::endpoint& endpoint)
+			const boost::asio::ip::udp::endpoint& endpoint,
+			const std::vector<std::string>& paths)
 	{
-		tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
+		int token;
+		{
+			tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
+
+			token = next_token_++;
+			subscriptions_by_token_[token] = destination(endpoint, paths);
+		}
 
-		++reference_counts_by_endpoint_[endpoint];
+		on_subscriptions_changed();
 
 		std::weak_ptr<impl> weak_self = shared_from_this();
 
-		return std::shared_ptr<void>(nullptr, [weak_self, endpoint] (void*)
+		return std::shared_ptr<void>(nullptr, [weak_self, token] (void*)
 		{
 			auto strong = weak_self.lock();
 
@@ -177,31 +243,83 @@ public:
 
 			auto& self = *strong;
 
-			tbb::spin_mutex::scoped_lock lock(self.endpoints_mutex_);
+			{
+				tbb::spin_mutex::scoped_lock lock(self.endpoints_mutex_);
 
-			int reference_count_after =
-				--self.reference_counts_by_endpoint_[endpoint];
+				self.subscriptions_by_token_.erase(token);
+			}
 
-			if (reference_count_after == 0)
-				self.reference_counts_by_endpoint_.erase(endpoint);
+			self.on_subscriptions_changed();
 		});
 	}
+
+	virtual bool wants(const std::string& path_prefix) override
+	{
+		tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
+
+		BOOST_FOREACH(const auto& subscription, subscriptions_by_token_)
+		{
+			BOOST_FOREACH(const auto& pattern, subscription.second.second)
+			{
+				if (core::monitor::may_match(pattern, path_prefix))
+					return true;
+			}
+		}
+
+		return false;
+	}
 private:
-	void propagate(const core::monitor::message& msg)
+	void on_subscriptions_changed()
 	{
-		boost::lock_guard<boost::mutex> lock(updates_mutex_);
+		++subscriptions_version_;
+		core::monitor::invalidate_observed();
+	}
+
+	std::vector<destination> get_destinations()
+	{
+		std::map<udp::endpoint, std::vector<std::string>> paths_by_endpoint;
+		{
+			tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
+
+			BOOST_FOREACH(const auto& subscription, subscriptions_by_token_)
+			{
+				auto& paths = paths_by_endpoint[subscription.second.first];
+				paths.insert(paths.end(), subscription.second.second.begin(), subscription.second.second.end());
+			}
+		}
+
+		return std::vector<destination>(paths_by_endpoint.begin(), paths_by_endpoint.end());
+	}
 
-		try 
+	// Called on the producer threads, which only queue the message. It is serialized
+	// and compared with what was sent before on the sender thread.
+	void propagate(const core::monitor::message& msg)
+	{
+		if (queue_size_.fetch_and_increment() >= MAX_QUEUED)
 		{
-			write_osc_event(updates_[msg.path()], msg);
+			--queue_size_;
+			return;
 		}
-		catch(...)
+
+		queue_.push(msg);
+
+		if (is_sleeping_)
 		{
-			CASPAR_LOG_CURRENT_EXCEPTION();
-			updates_.erase(msg.path());
+			boost::lock_guard<boost::mutex> lock(wake_mutex_);
+			wake_cond_.notify_one();
 		}
+	}
 
-		updates_cond_.notify_one();
+	void wait_for_messages(int64_t timeout)
+	{
+		boost::unique_lock<boost::mutex> lock(wake_mutex_);
+
+		is_sleeping_.fetch_and_store(true);
+
+		if (queue_size_ == 0 && is_running_)
+			wake_cond_.timed_wait(lock, boost::posix_time::milliseconds(std::max<int64_t>(timeout, 1)));
+
+		is_sleeping_ = false;
 	}
 
 	template<typename T>
@@ -214,76 +332,190 @@ private:
 			socket_.send_to(buffers, endpoint, 0, ec);
 	}
 
-	void run()
+	void send_bundles(
+			const std::vector<const byte_vector*>& messages,
+			const udp::endpoint& endpoint,
+			const byte_vector& bundle_header,
+			std::vector<byte_vector>& element_headers)
 	{
 		// http://stackoverflow.com/questions/14993000/the-most-reliable-and-efficient-udp-packet-size
 		const int SAFE_DATAGRAM_SIZE = 508;
 
-		try
+		if (messages.empty())
+			return;
+
+		std::vector<udp::endpoint> destinations(1, endpoint);
+		std::vector<boost::asio::const_buffers_1> buffers;
+		element_headers.resize(
+				std::max(element_headers.size(), messages.size()));
+
+		int i = 0;
+		int datagram_size = bundle_header.size();
+		buffers.push_back(boost::asio::buffer(bundle_header));
+
+		BOOST_FOREACH(const auto bytes, messages)
 		{
-			is_running_ = true;
+			write_osc_bundle_element_start(element_headers[i], *bytes);
+			const auto& headers = element_headers;
+
+			auto size_of_element = headers[i].size() + bytes->size();
+	
+			if (datagram_size + size_of_element >= SAFE_DATAGRAM_SIZE)
+			{
+				do_send(buffers, destinations);
+				buffers.clear();
+				buffers.push_back(boost::asio::buffer(bundle_header));
+				datagram_size = bundle_header.size();
+			}
+
+			buffers.push_back(boost::asio::buffer(headers[i]));
+			buffers.push_back(boost::asio::buffer(*bytes));
+
+			datagram_size += size_of_element;
+			++i;
+		}
+			
+		if (!buffers.empty())
+			do_send(buffers, destinations);
+	}
+
+	void run()
+	{
+		// Paths that have not been updated for this long are forgotten.
+		const int64_t SLOT_TIMEOUT = std::max<int64_t>(refresh_interval_, 1000) * 10;
 
-			std::unordered_map<std::string, byte_vector> updates;
-			std::vector<udp::endpoint> destinations;
+		try
+		{
+			std::unordered_map<std::string, slot> slots;
+			std::vector<slot*> pending;
+			std::vector<slot*> still_pending;
+			std::vector<slot*> ready;
+			std::vector<const byte_vector*> messages;
+			std::vector<destination> destinations;
+			int destinations_version = -1;
 			const byte_vector bundle_header = write_osc_bundle_start();
 			std::vector<byte_vector> element_headers;
+			core::monitor::message msg("");
+			int64_t timeout = 1000;
+			int64_t last_prune = now_millis();
 
 			while (is_running_)
 			{		
-				updates.clear();
-				destinations.clear();
+				wait_for_messages(timeout);
+
+				auto now = now_millis();
+
+				while (queue_.try_pop(msg))
+				{
+					--queue_size_;
 
-				{			
-					boost::unique_lock<boost::mutex> cond_lock(updates_mutex_);
+					auto& s = slots[msg.path()];
+
+					if (s.path.empty())
+						s.path = msg.path();
+
+					try 
+					{
+						write_osc_event(s.next, msg);
+					}
+					catch(...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						continue;
+					}
 
-					if (updates_.empty())
-						updates_cond_.wait(cond_lock);
+					s.last_update = now;
 
-					std::swap(updates, updates_);
+					if (!s.is_pending)
+					{
+						s.is_pending = true;
+						pending.push_back(&s);
+					}
 				}
 
+				if (destinations_version != subscriptions_version_)
+				{
+					destinations_version	= subscriptions_version_;
+					destinations			= get_destinations();
+				}
+
+				// An unchanged value is only sent again once it is due for a refresh, and no
+				// path is sent more often than the minimum interval.
+				ready.clear();
+				still_pending.clear();
+				timeout = 1000;
+
+				auto min_interval = core::load_governor::active_anywhere() & core::degradation::osc_rate ? std::max(min_interval_, degraded_interval_) : min_interval_;
+
+				BOOST_FOREACH(auto s, pending)
 				{
-					tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
+					auto since_sent = now - s->last_sent;
+
+					if (!destinations.empty() && since_sent < min_interval)
+					{
+						timeout = std::min(timeout, min_interval - since_sent);
+						still_pending.push_back(s);
+						continue;
+					}
+
+					if (!destinations.empty() && (!has_same_bytes(s->next, s->sent) || since_sent >= refresh_interval_))
+					{
+						s->sent.swap(s->next);
+						s->last_sent = now;
+						ready.push_back(s);
+					}
 
-					BOOST_FOREACH(const auto& endpoint, reference_counts_by_endpoint_)
-						destinations.push_back(endpoint.first);
+					s->is_pending = false;
 				}
 
-				if (destinations.empty())
-					continue;
+				pending.swap(still_pending);
 
-				std::vector<boost::asio::const_buffers_1> buffers;
-				element_headers.resize(
-						std::max(element_headers.size(), updates.size()));
+				if (now - last_prune > SLOT_TIMEOUT)
+				{
+					for (auto it = slots.begin(); it != slots.end();)
+					{
+						if (!it->second.is_pending && now - it->second.last_update > SLOT_TIMEOUT)
+							it = slots.erase(it);
+						else
+							++it;
+					}
 
-				int i = 0;
-				int datagram_size = bundle_header.size();
-				buffers.push_back(boost::asio::buffer(bundle_header));
+					last_prune = now;
+				}
 
-				BOOST_FOREACH(const auto& slot, updates)
+				if (ready.empty())
+					continue;
+
+				for (std::size_t n = 0; n < destinations.size(); ++n)
 				{
-					write_osc_bundle_element_start(element_headers[i], slot.second);
-					const auto& headers = element_headers;
+					messages.clear();
 
-					auto size_of_element = headers[i].size() + slot.second.size();
-	
-					if (datagram_size + size_of_element >= SAFE_DATAGRAM_SIZE)
+					BOOST_FOREACH(auto s, ready)
 					{
-						do_send(buffers, destinations);
-						buffers.clear();
-						buffers.push_back(boost::asio::buffer(bundle_header));
-						datagram_size = bundle_header.size();
+						if (s->wanted_version != destinations_version)
+						{
+							s->wanted_version = destinations_version;
+							s->wanted_by.assign(destinations.size(), false);
+
+							for (std::size_t m = 0; m < destinations.size(); ++m)
+							{
+								BOOST_FOREACH(const auto& pattern, destinations[m].second)
+								{
+									if (core::monitor::matches(pattern, s->path))
+									{
+										s->wanted_by[m] = true;
+										break;
+									}
+								}
+							}
+						}
+
+						if (s->wanted_by[n])
+							messages.push_back(&s->sent);
 					}
 
-					buffers.push_back(boost::asio::buffer(headers[i]));
-					buffers.push_back(boost::asio::buffer(slot.second));
-
-					datagram_size += size_of_element;
-					++i;
+					send_bundles(messages, destinations[n].first, bundle_header, element_headers);
 				}
-			
-				if (!buffers.empty())
-					do_send(buffers, destinations);
 			}
 		}
 		catch (...)
@@ -293,6 +525,7 @@ private:
 	}
 };
 
+
 client::client(std::shared_ptr<boost::asio::io_service> service) 
 	: impl_(new impl(std::move(service)))
 {
@@ -314,9 +547,10 @@ client::~client()
 }
 
 std::shared_ptr<void> client::get_subscription_token(
-			const boost::asio::ip::udp::endpoint& endpoint)
+			const boost::asio::ip::udp::endpoint& endpoint,
+			const std::vector<std::string>& paths)
 {
-	return impl_->get_subscription_token(endpoint);
+	return impl_->get_subscription_token(endpoint, paths);
 }
 
 safe_ptr<core::monitor::sink> client::sink()
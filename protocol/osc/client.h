@@ -28,6 +28,9 @@
 #include <boost/asio/ip/udp.hpp>
 #include <boost/noncopyable.hpp>
 
+#include <string>
+#include <vector>
+
 namespace caspar { namespace protocol { namespace osc {
 
 class client
@@ -51,11 +54,14 @@ public:
 	 * previously been checked out.
 	 *
 	 * @param endpoint The UDP endpoint to send OSC messages to.
+	 * @param paths    The path patterns to send, see core::monitor::matches.
+	 *                 Nothing outside of them is produced for this token.
 	 *
 	 * @return The token. It is ok for the token to outlive the client
 	 */
 	std::shared_ptr<void> get_subscription_token(
-			const boost::asio::ip::udp::endpoint& endpoint);
+			const boost::asio::ip::udp::endpoint& endpoint,
+			const std::vector<std::string>& paths = std::vector<std::string>(1, "/"));
 
 	~client();
 
@@ -0,0 +1,445 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#include "../stdafx.h"
+
+#include "server.h"
+
+#include <common/env.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace boost::asio::ip;
+
+namespace caspar { namespace protocol { namespace state {
+
+enum frame_type
+{
+	snapshot_frame	= 1,
+	path_frame		= 2,
+	value_frame		= 3,
+	tick_frame		= 4
+};
+
+typedef std::vector<char> byte_vector;
+
+template<typename T>
+void write_raw(byte_vector& destination, T value)
+{
+	auto size = destination.size();
+	destination.resize(size + sizeof(T));
+	std::memcpy(destination.data() + size, &value, sizeof(T));
+}
+
+void write_bytes(byte_vector& destination, const void* data, std::size_t size)
+{
+	write_raw(destination, static_cast<uint32_t>(size));
+	destination.insert(destination.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+}
+
+struct param_writer : public boost::static_visitor<void>
+{
+	byte_vector& o;
+
+	param_writer(byte_vector& o)
+		: o(o)
+	{
+	}
+		
+	void operator()(const bool value)					{o.push_back(value ? 'T' : 'F');}
+	void operator()(const int32_t value)				{o.push_back('i'); write_raw(o, value);}
+	void operator()(const int64_t value)				{o.push_back('h'); write_raw(o, value);}
+	void operator()(const float value)					{o.push_back('f'); write_raw(o, value);}
+	void operator()(const double value)					{o.push_back('d'); write_raw(o, value);}
+	void operator()(const std::string& value)			{o.push_back('s'); write_bytes(o, value.data(), value.size());}
+	void operator()(const std::wstring& value)			{(*this)(narrow(value));}
+	void operator()(const std::vector<int8_t>& value)	{o.push_back('b'); write_bytes(o, value.data(), value.size());}
+};
+
+// A frame is written as its length, the type and the payload. The length is patched in by end_frame.
+std::size_t begin_frame(byte_vector& destination, frame_type type)
+{
+	auto start = destination.size();
+	write_raw(destination, static_cast<uint32_t>(0));
+	destination.push_back(static_cast<char>(type));
+	return start;
+}
+
+void end_frame(byte_vector& destination, std::size_t start)
+{
+	auto length = static_cast<uint32_t>(destination.size() - start - sizeof(uint32_t));
+	std::memcpy(destination.data() + start, &length, sizeof(length));
+}
+
+struct server::impl : public std::enable_shared_from_this<server::impl>, core::monitor::sink
+{
+	// The latest arguments of a path, encoded as in a value frame.
+	struct entry
+	{
+		uint32_t	id;
+		byte_vector	value;
+	};
+
+	struct session
+	{
+		tcp::socket	socket;
+		byte_vector	writing;
+		byte_vector	pending;
+		bool		is_writing;
+		bool		needs_snapshot;
+		char		read_buffer[256];
+
+		session(boost::asio::io_service& service)
+			: socket(service)
+			, is_writing(false)
+			, needs_snapshot(true)
+		{
+		}
+	};
+
+	static const int								MAX_QUEUED = 65536;
+
+	std::shared_ptr<boost::asio::io_service>		service_;
+	boost::asio::io_service::strand					strand_;
+	tcp::acceptor									acceptor_;
+	boost::asio::deadline_timer						timer_;
+	const int										interval_;
+	const std::size_t								max_pending_;
+
+	tbb::concurrent_queue<core::monitor::message>	queue_;
+	tbb::atomic<int>								queue_size_;
+	tbb::atomic<int>								num_sessions_;
+	tbb::atomic<bool>								is_running_;
+
+	// Only used on the strand.
+	std::unordered_map<std::string, entry>			state_;
+	std::vector<std::shared_ptr<session>>			sessions_;
+	uint32_t										next_id_;
+	uint64_t										tick_;
+	byte_vector										changes_;
+	byte_vector										value_;
+
+public:
+	impl(std::shared_ptr<boost::asio::io_service> service, unsigned short port)
+		: service_(std::move(service))
+		, strand_(*service_)
+		, acceptor_(*service_, tcp::endpoint(tcp::v4(), port))
+		, timer_(*service_)
+		, interval_(std::max(1, env::properties().get(L"configuration.state-stream.interval", 20)))
+		, max_pending_(env::properties().get(L"configuration.state-stream.max-pending", 4 * 1024 * 1024))
+		, next_id_(0)
+		, tick_(0)
+	{
+		queue_size_		= 0;
+		num_sessions_	= 0;
+		is_running_		= true;
+	}
+
+	void start()
+	{
+		start_accept();
+		schedule_tick();
+
+		CASPAR_LOG(info) << L"[state-stream] Listening on port " << acceptor_.local_endpoint().port() << L".";
+	}
+
+	void stop()
+	{
+		is_running_ = false;
+
+		auto self = shared_from_this();
+		strand_.post([self]
+		{
+			boost::system::error_code ec;
+			self->acceptor_.close(ec);
+			self->timer_.cancel(ec);
+
+			BOOST_FOREACH(auto& session, self->sessions_)
+				session->socket.close(ec);
+		});
+	}
+
+	// Nothing is produced for the stream while no client is connected.
+	virtual bool wants(const std::string& path_prefix) override
+	{
+		return num_sessions_ > 0;
+	}
+
+	virtual void propagate(const core::monitor::message& msg) override
+	{
+		if (num_sessions_ == 0)
+			return;
+
+		if (queue_size_.fetch_and_increment() >= MAX_QUEUED)
+		{
+			--queue_size_;
+			return;
+		}
+
+		queue_.push(msg);
+	}
+private:
+	void start_accept()
+	{
+		auto self = shared_from_this();
+		auto s = std::make_shared<session>(*service_);
+
+		acceptor_.async_accept(s->socket, strand_.wrap([self, s](const boost::system::error_code& ec)
+		{
+			if (!self->is_running_ || ec == boost::asio::error::operation_aborted)
+				return;
+
+			if (!ec)
+			{
+				boost::system::error_code option_ec;
+				s->socket.set_option(tcp::no_delay(true), option_ec);
+
+				self->sessions_.push_back(s);
+				++self->num_sessions_;
+				core::monitor::invalidate_observed();
+
+				CASPAR_LOG(info) << L"[state-stream] Client connected: " << s->socket.remote_endpoint(option_ec).address().to_string().c_str();
+
+				self->start_read(s);
+				self->write(s);
+			}
+
+			self->start_accept();
+		}));
+	}
+
+	// Clients do not send anything, reading only finds out when they go away.
+	void start_read(const std::shared_ptr<session>& s)
+	{
+		auto self = shared_from_this();
+
+		s->socket.async_read_some(boost::asio::buffer(s->read_buffer), strand_.wrap([self, s](const boost::system::error_code& ec, std::size_t)
+		{
+			if (ec)
+				self->close(s);
+			else
+				self->start_read(s);
+		}));
+	}
+
+	void close(const std::shared_ptr<session>& s)
+	{
+		auto it = std::find(sessions_.begin(), sessions_.end(), s);
+		if (it == sessions_.end())
+			return;
+
+		sessions_.erase(it);
+		--num_sessions_;
+		core::monitor::invalidate_observed();
+
+		boost::system::error_code ec;
+		s->socket.close(ec);
+
+		CASPAR_LOG(info) << L"[state-stream] Client disconnected.";
+
+		// Nobody gets the changes while no one is connected, so the state would go stale.
+		if (sessions_.empty())
+			state_.clear();
+	}
+
+	void schedule_tick()
+	{
+		auto self = shared_from_this();
+
+		timer_.expires_from_now(boost::posix_time::milliseconds(interval_));
+		timer_.async_wait(strand_.wrap([self](const boost::system::error_code& ec)
+		{
+			if (!self->is_running_ || ec == boost::asio::error::operation_aborted)
+				return;
+
+			self->tick();
+			self->schedule_tick();
+		}));
+	}
+
+	void tick()
+	{
+		changes_.clear();
+
+		core::monitor::message msg("");
+		while (queue_.try_pop(msg))
+		{
+			--queue_size_;
+
+			value_.clear();
+			value_.push_back(static_cast<char>(std::min<std::size_t>(msg.data().size(), 255)));
+
+			param_writer writer(value_);
+			for (std::size_t n = 0; n < msg.data().size() && n < 255; ++n)
+				boost::apply_visitor(writer, msg.data()[n]);
+
+			auto it = state_.find(msg.path());
+			if (it == state_.end())
+			{
+				entry e;
+				e.id = next_id_++;
+				it = state_.insert(std::make_pair(msg.path(), e)).first;
+
+				write_path(changes_, it->first, it->second);
+			}
+			else if (it->second.value == value_)
+				continue;
+
+			it->second.value = value_;
+			write_value(changes_, it->second);
+		}
+
+		if (changes_.empty())
+			return;
+
+		write_tick(changes_);
+
+		BOOST_FOREACH(auto& s, sessions_)
+			send(s, changes_);
+	}
+
+	void write_path(byte_vector& destination, const std::string& path, const entry& e)
+	{
+		auto frame = begin_frame(destination, path_frame);
+		write_raw(destination, e.id);
+		destination.insert(destination.end(), path.begin(), path.end());
+		end_frame(destination, frame);
+	}
+
+	void write_value(byte_vector& destination, const entry& e)
+	{
+		auto frame = begin_frame(destination, value_frame);
+		write_raw(destination, e.id);
+		destination.insert(destination.end(), e.value.begin(), e.value.end());
+		end_frame(destination, frame);
+	}
+
+	void write_tick(byte_vector& destination)
+	{
+		auto frame = begin_frame(destination, tick_frame);
+		write_raw(destination, tick_++);
+		end_frame(destination, frame);
+	}
+
+	void write_snapshot(byte_vector& destination)
+	{
+		end_frame(destination, begin_frame(destination, snapshot_frame));
+
+		BOOST_FOREACH(auto& e, state_)
+		{
+			write_path(destination, e.first, e.second);
+			write_value(destination, e.second);
+		}
+
+		write_tick(destination);
+	}
+
+	void send(const std::shared_ptr<session>& s, const byte_vector& changes)
+	{
+		// Until the snapshot goes out, it will include these changes anyway.
+		if (s->needs_snapshot)
+			return;
+
+		if (!s->is_writing)
+		{
+			s->writing = changes;
+			write(s);
+			return;
+		}
+
+		s->pending.insert(s->pending.end(), changes.begin(), changes.end());
+
+		if (s->pending.size() > max_pending_)
+		{
+			CASPAR_LOG(warning) << L"[state-stream] Client is too far behind, resending a snapshot.";
+
+			byte_vector().swap(s->pending);
+			s->needs_snapshot = true;
+		}
+	}
+
+	// Starts the next write of a session that is not writing, if it has anything to send.
+	void write(const std::shared_ptr<session>& s)
+	{
+		if (s->needs_snapshot)
+		{
+			s->writing.clear();
+			write_snapshot(s->writing);
+			s->needs_snapshot = false;
+		}
+		else if (s->writing.empty())
+		{
+			s->writing.swap(s->pending);
+		}
+
+		if (s->writing.empty())
+		{
+			s->is_writing = false;
+			return;
+		}
+
+		s->is_writing = true;
+
+		auto self = shared_from_this();
+		boost::asio::async_write(s->socket, boost::asio::buffer(s->writing), strand_.wrap([self, s](const boost::system::error_code& ec, std::size_t)
+		{
+			if (ec)
+			{
+				self->close(s);
+				return;
+			}
+
+			s->writing.clear();
+			self->write(s);
+		}));
+	}
+};
+
+server::server(std::shared_ptr<boost::asio::io_service> service, unsigned short port) 
+	: impl_(new impl(std::move(service), port))
+{
+	impl_->start();
+}
+
+server::~server()
+{
+	impl_->stop();
+}
+
+safe_ptr<core::monitor::sink> server::sink()
+{
+	return impl_;
+}
+
+}}}
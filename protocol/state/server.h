@@ -0,0 +1,67 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/monitor/monitor.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace caspar { namespace protocol { namespace state {
+
+/**
+ * Streams the monitor state to TCP clients, as a reliable alternative to OSC.
+ *
+ * A client first gets a snapshot of every value and then, once per interval,
+ * the values that have changed. Each frame is a little endian uint32 length,
+ * followed by that many bytes: a uint8 type and its payload.
+ *
+ *   1 snapshot  Forget all state, the values of the snapshot follow.
+ *   2 path      uint32 id, then the path. Sent before the first value of it.
+ *   3 value     uint32 id, uint8 count, then count arguments, each a type
+ *               tag and its data: T/F bool, i int32, h int64, f float,
+ *               d double, s and b uint32 length and bytes (strings in UTF-8).
+ *   4 tick      uint64 sequence, ends a snapshot or a set of changes.
+ *
+ * A client that falls too far behind is sent a new snapshot instead of the
+ * changes it has missed.
+ */
+class server : boost::noncopyable
+{
+public:
+
+	// Constructors
+
+	server(std::shared_ptr<boost::asio::io_service> service, unsigned short port);
+	~server();
+	
+	// Properties
+
+	safe_ptr<core::monitor::sink> sink();
+private:
+	struct impl;
+	safe_ptr<impl> impl_;
+};
+
+}}}
@@ -0,0 +1,188 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#include "../stdafx.h"
+
+#include "server.h"
+
+#include <common/log/log.h>
+
+#include <core/video_channel.h>
+#include <core/producer/stage.h>
+
+#include <boost/asio.hpp>
+
+#include <tbb/atomic.h>
+
+#include <cstdint>
+#include <cstring>
+
+using namespace boost::asio::ip;
+
+namespace caspar { namespace protocol { namespace transform {
+
+class record_reader
+{
+	const char* pos_;
+	const char* end_;
+public:
+	record_reader(const char* data, std::size_t size)
+		: pos_(data)
+		, end_(data + size)
+	{
+	}
+
+	bool empty() const
+	{
+		return pos_ == end_;
+	}
+
+	template<typename T>
+	bool read(T& value)
+	{
+		if(static_cast<std::size_t>(end_ - pos_) < sizeof(T))
+			return false;
+
+		std::memcpy(&value, pos_, sizeof(T));
+		pos_ += sizeof(T);
+		return true;
+	}
+
+	bool read(double* values, int count)
+	{
+		for(int n = 0; n < count; ++n)
+		{
+			float value;
+			if(!read(value))
+				return false;
+			values[n] = value;
+		}
+		return true;
+	}
+};
+
+struct server::impl : public std::enable_shared_from_this<server::impl>
+{
+	static const std::size_t						MAX_DATAGRAM_SIZE = 65536;
+	static const int								ALL_FIELDS = 63;
+
+	std::shared_ptr<boost::asio::io_service>		service_;
+	udp::socket										socket_;
+	udp::endpoint									sender_;
+	std::vector<char>								buffer_;
+	const std::vector<safe_ptr<core::video_channel>> channels_;
+	tbb::atomic<bool>								is_running_;
+	bool											has_warned_;
+
+	impl(std::shared_ptr<boost::asio::io_service> service, unsigned short port, const std::vector<safe_ptr<core::video_channel>>& channels)
+		: service_(std::move(service))
+		, socket_(*service_, udp::endpoint(udp::v4(), port))
+		, buffer_(MAX_DATAGRAM_SIZE)
+		, channels_(channels)
+		, has_warned_(false)
+	{
+		is_running_ = true;
+	}
+
+	void start()
+	{
+		start_receive();
+
+		CASPAR_LOG(info) << L"[transform-stream] Listening on UDP port " << socket_.local_endpoint().port() << L".";
+	}
+
+	void stop()
+	{
+		is_running_ = false;
+
+		auto self = shared_from_this();
+		service_->post([self]
+		{
+			boost::system::error_code ec;
+			self->socket_.close(ec);
+		});
+	}
+private:
+	void start_receive()
+	{
+		auto self = shared_from_this();
+
+		socket_.async_receive_from(boost::asio::buffer(buffer_), sender_, [self](const boost::system::error_code& ec, std::size_t size)
+		{
+			if (!self->is_running_ || ec == boost::asio::error::operation_aborted)
+				return;
+
+			if (!ec)
+				self->handle(record_reader(self->buffer_.data(), size));
+
+			self->start_receive();
+		});
+	}
+
+	void handle(record_reader reader)
+	{
+		while(!reader.empty())
+		{
+			uint8_t channel;
+			uint8_t fields;
+			int32_t layer;
+			core::live_transform transform;
+
+			bool valid = reader.read(channel) && reader.read(fields) && reader.read(layer) &&
+						 channel >= 1 && channel <= channels_.size() && fields != 0 && (fields & ~ALL_FIELDS) == 0;
+
+			transform.fields = fields;
+
+			valid = valid &&
+				(!(fields & core::live_transform::opacity_field)			|| reader.read(&transform.opacity, 1)) &&
+				(!(fields & core::live_transform::fill_translation_field)	|| reader.read(transform.fill_translation.data(), 2)) &&
+				(!(fields & core::live_transform::fill_scale_field)			|| reader.read(transform.fill_scale.data(), 2)) &&
+				(!(fields & core::live_transform::clip_translation_field)	|| reader.read(transform.clip_translation.data(), 2)) &&
+				(!(fields & core::live_transform::clip_scale_field)			|| reader.read(transform.clip_scale.data(), 2)) &&
+				(!(fields & core::live_transform::volume_field)				|| reader.read(&transform.volume, 1));
+
+			if(!valid)
+			{
+				// Senders typically repeat the same mistake at the frame rate.
+				if(!has_warned_)
+					CASPAR_LOG(warning) << L"[transform-stream] Dropping malformed datagram from " << sender_.address().to_string().c_str() << L".";
+				has_warned_ = true;
+				return;
+			}
+
+			channels_[channel - 1]->stage()->set_live_transform(layer, transform);
+		}
+	}
+};
+
+server::server(std::shared_ptr<boost::asio::io_service> service, unsigned short port, const std::vector<safe_ptr<core::video_channel>>& channels) 
+	: impl_(new impl(std::move(service), port, channels))
+{
+	impl_->start();
+}
+
+server::~server()
+{
+	impl_->stop();
+}
+
+}}}
@@ -0,0 +1,68 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+
+namespace caspar { 
+	
+namespace core {
+	class video_channel;
+}
+
+namespace protocol { namespace transform {
+
+/**
+ * Receives layer transforms over UDP, for controllers which update them at the
+ * frame rate such as camera tracking. The values bypass AMCP and the channel
+ * executors and are applied on the next frame, see core::stage::set_live_transform.
+ *
+ * A datagram holds any number of records, all little endian:
+ *
+ *   uint8   channel, starting at 1
+ *   uint8   fields, the bits of core::live_transform::field
+ *   int32   layer
+ *   float32 the values of the fields in the order of the bits: opacity,
+ *           fill x y, fill scale x y, clip x y, clip scale x y, volume.
+ *
+ * The rest of a datagram is dropped at the first malformed record.
+ */
+class server : boost::noncopyable
+{
+public:
+
+	// Constructors
+
+	server(std::shared_ptr<boost::asio::io_service> service, unsigned short port, const std::vector<safe_ptr<core::video_channel>>& channels);
+	~server();
+private:
+	struct impl;
+	safe_ptr<impl> impl_;
+};
+
+}}}
@@ -19,299 +19,41 @@
 * Author: Nicklas P Andersson
 */
 
- 
-// AsyncEventServer.cpp: implementation of the AsyncEventServer class.
-//
-//////////////////////////////////////////////////////////////////////
 
 #include "../stdafx.h"
 
 #include "AsyncEventServer.h"
-#include "SocketInfo.h"
 
 #include <common/log/log.h>
-#include <string>
-#include <algorithm>
-#include <boost/algorithm/string/replace.hpp>
-
-#if defined(_MSC_VER)
-#pragma warning (push, 1) // TODO: Legacy code, just disable warnings, will replace with boost::asio in future
-#endif
-
-namespace caspar { namespace IO {
-	
-#define CASPAR_MAXIMUM_SOCKET_CLIENTS	(MAXIMUM_WAIT_OBJECTS-1)	
-
-long AsyncEventServer::instanceCount_ = 0;
-//////////////////////////////
-// AsyncEventServer constructor
-// PARAMS: port(TCP-port the server should listen to)
-// COMMENT: Initializes the WinSock2 library
-AsyncEventServer::AsyncEventServer(const safe_ptr<IProtocolStrategy>& pProtocol, int port) : port_(port), pProtocolStrategy_(pProtocol)
-{
-	if(instanceCount_ == 0) {
-		WSADATA wsaData;
-		if(WSAStartup(MAKEWORD(2,2), &wsaData) != NO_ERROR)
-			throw std::exception("Error initializing WinSock2");
-		else {
-			CASPAR_LOG(info) << "WinSock2 Initialized.";
-		}
-	}
-
-	InterlockedIncrement(&instanceCount_);
-}
-
-/////////////////////////////
-// AsyncEventServer destructor
-AsyncEventServer::~AsyncEventServer() {
-	Stop();
-
-	InterlockedDecrement(&instanceCount_);
-	if(instanceCount_ == 0)
-		WSACleanup();
-}
-
-void AsyncEventServer::SetClientDisconnectHandler(ClientDisconnectEvent handler) {
-	socketInfoCollection_.onSocketInfoRemoved = handler;
-}
-
-void AsyncEventServer::add_lifecycle_factory(const lifecycle_factory_t& factory)
-{
-	tbb::mutex::scoped_lock lock(mutex_);
-
-	lifecycle_factories_.push_back(factory);
-}
-
-//////////////////////////////
-// AsyncEventServer::Start
-// RETURNS: true at successful startup
-bool AsyncEventServer::Start() {
-	if(listenThread_.IsRunning())
-		return false;
-
-	socketInfoCollection_.Clear();
-
-	sockaddr_in sockAddr;
-	ZeroMemory(&sockAddr, sizeof(sockAddr));
-	sockAddr.sin_family = AF_INET;
-	sockAddr.sin_addr.s_addr = INADDR_ANY;
-	sockAddr.sin_port = htons(port_);
-	
-	SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(listenSocket == INVALID_SOCKET) {
-		CASPAR_LOG(error) << "Failed to create listenSocket";
-		return false;
-	}
-	
-	pListenSocketInfo_ = SocketInfoPtr(new SocketInfo(listenSocket, this));
-
-	if(WSAEventSelect(pListenSocketInfo_->socket_, pListenSocketInfo_->event_, FD_ACCEPT|FD_CLOSE) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to enter EventSelect-mode for listenSocket";
-		return false;
-	}
-
-	if(bind(pListenSocketInfo_->socket_, (sockaddr*)&sockAddr, sizeof(sockAddr)) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to bind listenSocket";
-		return false;
-	}
-
-	if(listen(pListenSocketInfo_->socket_, SOMAXCONN) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to listen";
-		return false;
-	}
-
-	socketInfoCollection_.AddSocketInfo(pListenSocketInfo_);
-
-	//start thread: the entrypoint is Run(EVENT stopEvent)
-	if(!listenThread_.Start(this)) {
-		CASPAR_LOG(error) << "Failed to create ListenThread";
-		return false;
-	}
-
-	CASPAR_LOG(info) << "Listener successfully initialized";
-	return true;
-}
+#include <common/memory/tagged_allocator.h>
+#include <common/utility/string.h>
 
-void AsyncEventServer::Run(HANDLE stopEvent)
-{
-	WSANETWORKEVENTS networkEvents;
-
-	HANDLE waitHandlesCopy[MAXIMUM_WAIT_OBJECTS];
-	waitHandlesCopy[0] = stopEvent;
-
-	while(true)	{
-		//Update local copy of the array of wait-handles if nessecery
-		if(socketInfoCollection_.IsDirty()) {
-			socketInfoCollection_.CopyCollectionToArray(&(waitHandlesCopy[1]), CASPAR_MAXIMUM_SOCKET_CLIENTS);
-			socketInfoCollection_.ClearDirty();
-		}
-
-		DWORD waitResult = WSAWaitForMultipleEvents(std::min<DWORD>(static_cast<DWORD>(socketInfoCollection_.Size()+1), MAXIMUM_WAIT_OBJECTS), waitHandlesCopy, FALSE, 1500, FALSE);
-		if(waitResult == WAIT_TIMEOUT)
-			continue;
-		else if(waitResult == WAIT_FAILED)
-			break;
-		else {
-			DWORD eventIndex = waitResult - WAIT_OBJECT_0;
-
-			HANDLE waitEvent = waitHandlesCopy[eventIndex];
-			SocketInfoPtr pSocketInfo;
-
-			if(eventIndex == 0)	//stopEvent
-				break;
-			else if(socketInfoCollection_.FindSocketInfo(waitEvent, pSocketInfo)) {
-				WSAEnumNetworkEvents(pSocketInfo->socket_, waitEvent, &networkEvents);
-
-				if(networkEvents.lNetworkEvents & FD_ACCEPT) {
-					if(networkEvents.iErrorCode[FD_ACCEPT_BIT] == 0)
-						OnAccept(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnAccept (ErrorCode: " << networkEvents.iErrorCode[FD_ACCEPT_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_ACCEPT_BIT]);
-					}
-				}
-
-				if(networkEvents.lNetworkEvents & FD_CLOSE) {
-					if(networkEvents.iErrorCode[FD_CLOSE_BIT] == 0)
-						OnClose(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnClose (ErrorCode: " << networkEvents.iErrorCode[FD_CLOSE_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_CLOSE_BIT]);
-					}
-					continue;
-				}
-
-				if(networkEvents.lNetworkEvents & FD_READ) {
-					if(networkEvents.iErrorCode[FD_READ_BIT] == 0)
-						OnRead(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnRead (ErrorCode: " << networkEvents.iErrorCode[FD_READ_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_READ_BIT]);
-					}
-				}
-
-				if(networkEvents.lNetworkEvents & FD_WRITE) {
-					if(networkEvents.iErrorCode[FD_WRITE_BIT] == 0)
-						OnWrite(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnWrite (ErrorCode: " << networkEvents.iErrorCode[FD_WRITE_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_WRITE_BIT]);
-					}
-				}
-			}
-			else {
-				//Could not find the waitHandle in the SocketInfoCollection.
-				//It must have been removed during the last call to WSAWaitForMultipleEvents
-			}
-		}
-	}
-}
-
-bool AsyncEventServer::OnUnhandledException(const std::exception& ex) throw() {
-	bool bDoRestart = true;
-
-	try 
-	{
-		CASPAR_LOG(fatal) << "UNHANDLED EXCEPTION in TCPServers listeningthread. Message: " << ex.what();
-	}
-	catch(...)
-	{
-		bDoRestart = false;
-	}
-
-	return bDoRestart;
-}
-
-///////////////////////////////
-// AsyncEventServer:Stop
-// COMMENT: Shuts down
-void AsyncEventServer::Stop()
-{
-	//TODO: initiate shutdown on all clients connected
-//	for(int i=0; i < _totalActiveSockets; ++i) {
-//		shutdown(_pSocketInfo[i]->_socket, SD_SEND);
-//	}
-
-	if(!listenThread_.Stop()) {
-		CASPAR_LOG(warning) << "Wait for listenThread timed out.";
-	}
-
-	socketInfoCollection_.Clear();
-}
-
-////////////////////////////////////////////////////////////////////
-//
-// MESSAGE HANDLERS   
-//
-////////////////////////////////////////////////////////////////////
-
-
-//////////////////////////////
-// AsyncEventServer::OnAccept
-// PARAMS: ...
-// COMMENT: Called when a new client connects
-bool AsyncEventServer::OnAccept(SocketInfoPtr& pSI) {
-	sockaddr_in	clientAddr;
-	int addrSize = sizeof(clientAddr);
-	SOCKET clientSocket = WSAAccept(pSI->socket_, (sockaddr*)&clientAddr, &addrSize, NULL, NULL);
-	if(clientSocket == INVALID_SOCKET) {
-		LogSocketError(TEXT("Accept"));
-		return false;
-	}
-
-	SocketInfoPtr pClientSocket(new SocketInfo(clientSocket, this));
-
-	try
-	{ // !!!!!!!!!!!!
-		if(socketInfoCollection_.Size() >= 50) 
-		{
-			HANDLE handle = nullptr;
-			{
-				tbb::mutex::scoped_lock lock(socketInfoCollection_.mutex_);				
-				handle = *(socketInfoCollection_.waitEvents_.begin()+0);
-				if(handle == pListenSocketInfo_->event_)
-					handle = *(socketInfoCollection_.waitEvents_.begin()+1);
-			}
-			socketInfoCollection_.RemoveSocketInfo(handle);
-			CASPAR_LOG(error) << " Too many connections. Removed last used connection.";
-		}
-	}catch(...){}
-
-	//Determine if we can handle one more client
-	if(socketInfoCollection_.Size() >= CASPAR_MAXIMUM_SOCKET_CLIENTS) {
-		CASPAR_LOG(error) << "Could not accept ) << too many connections).";
-		return true;
-	}
-
-	if(WSAEventSelect(pClientSocket->socket_, pClientSocket->event_, FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR) {
-		LogSocketError(TEXT("Accept (failed create event for new client)"));
-		return false;
-	}
+#include <boost/asio.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
-	TCHAR addressBuffer[32];
-	auto ipv4_address = inet_ntoa(clientAddr.sin_addr);
-	MultiByteToWideChar(CP_ACP, 0, ipv4_address, -1, addressBuffer, 32);
-	pClientSocket->host_ = addressBuffer;
+#include <tbb/mutex.h>
+#include <tbb/spin_mutex.h>
 
-	{
-		tbb::mutex::scoped_lock lock(mutex_);
+#include <algorithm>
+#include <array>
+#include <set>
+#include <string>
+#include <vector>
 
-		BOOST_FOREACH(auto& lifecycle_factory, lifecycle_factories_)
-		{
-			auto lifecycle_bound = lifecycle_factory(ipv4_address);
+using boost::asio::ip::tcp;
 
-			pClientSocket->bind_to_lifecycle(lifecycle_bound);
-		}
-	}
+namespace caspar { namespace IO {
 
-	socketInfoCollection_.AddSocketInfo(pClientSocket);
+namespace {
 
-	CASPAR_LOG(info) << "Accepted connection from " << pClientSocket->host_.c_str() << " " << socketInfoCollection_.Size();
+typedef std::vector<wchar_t, tagged_allocator<wchar_t, allocation_subsystem::protocol>>									wide_buffer;
+typedef std::basic_string<wchar_t, std::char_traits<wchar_t>, tagged_allocator<wchar_t, allocation_subsystem::protocol>>	wide_text;
+typedef std::basic_string<char, std::char_traits<char>, tagged_allocator<char, allocation_subsystem::protocol>>				utf8_text;
 
-	return true;
-}
-
-bool ConvertMultiByteToWideChar(UINT codePage, char* pSource, int sourceLength, std::vector<wchar_t>& wideBuffer, int& countLeftovers)
+bool ConvertMultiByteToWideChar(UINT codePage, char* pSource, int sourceLength, wide_buffer& wideBuffer, int& countLeftovers)
 {
 	if(codePage == CP_UTF8) {
 		countLeftovers = 0;
@@ -370,266 +112,463 @@ bool ConvertMultiByteToWideChar(UINT codePage, char* pSource, int sourceLength,
 	wideBuffer.resize(charsWritten);
 	return (charsWritten > 0);
 }
+bool ConvertWideCharToMultiByte(UINT codePage, const wide_text& wideString, utf8_text& destBuffer)
+{
+	int bytesWritten = 0;
+	int multibyteBufferCapacity = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), 0, 0, NULL, NULL);
+	if(multibyteBufferCapacity > 0) 
+	{
+		destBuffer.resize(multibyteBufferCapacity);
+		bytesWritten = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), &destBuffer[0], destBuffer.size(), NULL, NULL);
+	}
+	destBuffer.resize(bytesWritten);
+	return (bytesWritten > 0);
+}
+}
 
-//////////////////////////////
-// AsyncEventServer::OnRead
-// PARAMS: ...
-// COMMENT: Called then something arrives on the socket that has to be read
-bool AsyncEventServer::OnRead(SocketInfoPtr& pSI) {
-	int recvResult = SOCKET_ERROR;
-	
-	try
-	{ // !!!!!!!!!!!!
-		if(pSI)
-		{
-			tbb::mutex::scoped_lock lock(socketInfoCollection_.mutex_);
-			auto it = std::find(socketInfoCollection_.waitEvents_.begin(), socketInfoCollection_.waitEvents_.end(), pSI->event_);
-			if(it != socketInfoCollection_.waitEvents_.end())
-			{
-				auto handle = *it;
-				socketInfoCollection_.waitEvents_.erase(it);
-				socketInfoCollection_.waitEvents_.push_back(handle);
-			}
-		}
-	}catch(...){}
+class connection;
 
-	int maxRecvLength = sizeof(pSI->recvBuffer_)-pSI->recvLeftoverOffset_;
-	recvResult = recv(pSI->socket_, pSI->recvBuffer_+pSI->recvLeftoverOffset_, maxRecvLength, 0);
-	while(recvResult != SOCKET_ERROR) {
-		if(recvResult == 0) {
-			CASPAR_LOG(info) << "Client " << pSI->host_.c_str() << TEXT(" disconnected");
+// A reply waiting to be written, either still wide or already UTF-8.
+struct pending_reply
+{
+	wide_text	text;
+	utf8_text	utf8;
+};
 
-			socketInfoCollection_.RemoveSocketInfo(pSI);
-			return true;
-		}
+// Shared by the server and its connections, which may outlive the server while commands still hold them.
+struct connection_set
+{	
+	tbb::mutex							mutex;
+	std::set<std::shared_ptr<connection>>	connections;
+	ClientDisconnectEvent				on_disconnect;
+	bool								no_delay;
+
+	tbb::mutex							parse_mutex; // Replies may be sent from within Parse, so sending must not take it.
+
+	tbb::spin_mutex						protocol_mutex;
+	std::shared_ptr<IProtocolStrategy>	protocol;
 
-		//Convert to widechar
-		if(ConvertMultiByteToWideChar(pProtocolStrategy_->GetCodepage(), pSI->recvBuffer_, recvResult + pSI->recvLeftoverOffset_, pSI->wideRecvBuffer_, pSI->recvLeftoverOffset_))		
-			pProtocolStrategy_->Parse(&pSI->wideRecvBuffer_[0], pSI->wideRecvBuffer_.size(), pSI);		
-		else			
-			CASPAR_LOG(error) << "Read from " << pSI->host_.c_str() << TEXT(" failed, could not convert command to UNICODE");
-			
-		maxRecvLength = sizeof(pSI->recvBuffer_)-pSI->recvLeftoverOffset_;
-		recvResult = recv(pSI->socket_, pSI->recvBuffer_+pSI->recvLeftoverOffset_, maxRecvLength, 0);
+	std::shared_ptr<IProtocolStrategy> get_protocol()
+	{
+		tbb::spin_mutex::scoped_lock lock(protocol_mutex);
+		return protocol;
 	}
-			
-	if(recvResult == SOCKET_ERROR) {
-		int errorCode = WSAGetLastError();
-		if(errorCode == WSAEWOULDBLOCK)
-			return true;
-		else {
-			LogSocketError(TEXT("Read"), errorCode);
-			OnError(pSI->event_, errorCode);
+};
+
+class connection : public ClientInfo, public std::enable_shared_from_this<connection>
+{
+	tcp::socket							socket_;
+	boost::asio::io_service::strand		strand_;
+	std::shared_ptr<connection_set>		connection_set_;
+	std::wstring						host_;
+	std::vector<std::shared_ptr<void>>	lifecycle_bound_items_;
+
+	std::array<char, 8192>				recv_buffer_;
+	int									recv_leftover_;
+	wide_buffer							wide_recv_buffer_;
+
+	// Whatever is sent while a write is in progress is collected and goes out in the next single write, which
+	// converts the replies to the code page together and hands them to the socket as one buffer sequence.
+	tbb::mutex							send_mutex_;
+	std::vector<pending_reply>			pending_;
+	std::vector<pending_reply>			writing_;
+	std::vector<utf8_text>				write_buffers_;
+	std::vector<boost::asio::const_buffer> write_sequence_;
+	bool								is_writing_;
+	bool								is_closed_;
+public:
+	connection(boost::asio::io_service& service, const std::shared_ptr<connection_set>& connection_set)
+		: socket_(service)
+		, strand_(service)
+		, connection_set_(connection_set)
+		, recv_leftover_(0)
+		, is_writing_(false)
+		, is_closed_(false)
+	{
+	}
+
+	tcp::socket& socket()
+	{
+		return socket_;
+	}
+
+	void start(const std::vector<std::shared_ptr<void>>& lifecycle_bound_items)
+	{
+		boost::system::error_code ec;
+		auto endpoint = socket_.remote_endpoint(ec);
+		host_ = ec ? L"unknown" : widen(endpoint.address().to_string());
+		lifecycle_bound_items_ = lifecycle_bound_items;
+
+		socket_.set_option(tcp::no_delay(connection_set_->no_delay), ec);
+
+		read_some();
+	}
+
+	virtual void Send(const std::wstring& data) override
+	{
+		if(data.empty())
+			return;
+
+		if(data.size() < 512)
+			CASPAR_LOG(info) << L"Sent message to " << host_ << L": " << boost::replace_all_copy(boost::replace_all_copy(data, L"\n", L"\\n"), L"\r", L"\\r");
+		else
+			CASPAR_LOG(info) << "Sent more than 512 bytes to " << host_;
+
+		pending_reply reply;
+		reply.text.assign(data.begin(), data.end());
+		queue(std::move(reply));
+	}
+
+	virtual void SendUtf8(const std::string& data) override
+	{
+		if(data.empty())
+			return;
+
+		if(codepage() != CP_UTF8)
+		{
+			Send(widen(data));
+			return;
 		}
+
+		if(data.size() < 512)
+			CASPAR_LOG(info) << L"Sent message to " << host_ << L": " << boost::replace_all_copy(boost::replace_all_copy(widen(data), L"\n", L"\\n"), L"\r", L"\\r");
+		else
+			CASPAR_LOG(info) << "Sent more than 512 bytes to " << host_;
+
+		pending_reply reply;
+		reply.utf8.assign(data.begin(), data.end());
+		queue(std::move(reply));
 	}
 
-	return false;
-}
+	void queue(pending_reply&& reply)
+	{
+		tbb::mutex::scoped_lock lock(send_mutex_);
 
-//////////////////////////////
-// AsyncEventServer::OnWrite
-// PARAMS: ...
-// COMMENT: Called when the socket is ready to send more data
-void AsyncEventServer::OnWrite(SocketInfoPtr& pSI) {		
-	DoSend(*pSI);	
-}
+		if(is_closed_)
+			return;
 
-bool ConvertWideCharToMultiByte(UINT codePage, const std::wstring& wideString, std::vector<char>& destBuffer)
-{
-	int bytesWritten = 0;
-	int multibyteBufferCapacity = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), 0, 0, NULL, NULL);
-	if(multibyteBufferCapacity > 0) 
+		pending_.push_back(std::move(reply));
+		if(is_writing_)
+			return;
+
+		is_writing_ = true;
+
+		auto self = shared_from_this();
+		strand_.post([self]
+		{
+			self->write_pending();
+		});
+	}
+
+	virtual void Disconnect() override
 	{
-		destBuffer.resize(multibyteBufferCapacity);
-		bytesWritten = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), &destBuffer[0], destBuffer.size(), NULL, NULL);
+		auto self = shared_from_this();
+		strand_.post([self]
+		{
+			boost::system::error_code ec;
+			self->socket_.shutdown(tcp::socket::shutdown_send, ec);
+		});
 	}
-	destBuffer.resize(bytesWritten);
-	return (bytesWritten > 0);
-}
 
-void AsyncEventServer::DoSend(SocketInfo& socketInfo) {
-	//Locks the socketInfo-object so that no one else tampers with the sendqueue at the same time
-	tbb::mutex::scoped_lock lock(socketInfo.mutex_);
+	virtual std::wstring print() const override
+	{
+		return host_;
+	}
 
-	while(!socketInfo.sendQueue_.empty() || socketInfo.currentlySending_.size() > 0) {
-		if(socketInfo.currentlySending_.size() == 0) {
-			//Read the next string in the queue and convert to UTF-8
-			if(!ConvertWideCharToMultiByte(pProtocolStrategy_->GetCodepage(), socketInfo.sendQueue_.front(), socketInfo.currentlySending_))
+	void close()
+	{
+		auto self = shared_from_this();
+		strand_.post([self]
+		{
+			self->do_close();
+		});
+	}
+private:
+	unsigned int codepage()
+	{
+		return connection_set_->get_protocol()->GetCodepage();
+	}
+
+	// Called on the strand.
+	void write_pending()
+	{
+		while(true)
+		{
 			{
-				CASPAR_LOG(error) << "Send to " << socketInfo.host_.c_str() << TEXT(" failed, could not convert response to UTF-8");
-			}
-			socketInfo.currentlySendingOffset_ = 0;
-		}
+				tbb::mutex::scoped_lock lock(send_mutex_);
 
-		if(socketInfo.currentlySending_.size() > 0) {
-			int bytesToSend = static_cast<int>(socketInfo.currentlySending_.size()-socketInfo.currentlySendingOffset_);
-			int sentBytes = send(socketInfo.socket_, &socketInfo.currentlySending_[0] + socketInfo.currentlySendingOffset_, bytesToSend, 0);
-			if(sentBytes == SOCKET_ERROR) {
-				int errorCode = WSAGetLastError();
-				if(errorCode == WSAEWOULDBLOCK) {
-					CASPAR_LOG(debug) << "Send to " << socketInfo.host_.c_str() << TEXT(" would block, sending later");
-					break;
+				if(pending_.empty() || is_closed_)
+				{
+					is_writing_ = false;
+					return;
 				}
-				else {
-					LogSocketError(TEXT("Send"), errorCode);
-					OnError(socketInfo.event_, errorCode);
 
-					socketInfo.currentlySending_.resize(0);
-					socketInfo.currentlySendingOffset_ = 0;
-					socketInfo.sendQueue_.pop();
-					break;
-				}
+				writing_.swap(pending_);
+				pending_.clear();
 			}
-			else {
-				if(sentBytes == bytesToSend) {
-					
-					if(sentBytes < 512)
-					{
-						boost::replace_all(socketInfo.sendQueue_.front(), L"\n", L"\\n");
-						boost::replace_all(socketInfo.sendQueue_.front(), L"\r", L"\\r");
-						CASPAR_LOG(info) << L"Sent message to " << socketInfo.host_.c_str() << L": " << socketInfo.sendQueue_.front().c_str();
-					}
-					else
-						CASPAR_LOG(info) << "Sent more than 512 bytes to " << socketInfo.host_.c_str();
 
-					socketInfo.currentlySending_.resize(0);
-					socketInfo.currentlySendingOffset_ = 0;
-					socketInfo.sendQueue_.pop();
-				}
-				else {
-					socketInfo.currentlySendingOffset_ += sentBytes;
-					CASPAR_LOG(info) << "Sent partial message to " << socketInfo.host_.c_str();
+			// Converted outside the lock, so that commands replying meanwhile are not held up.
+			auto page = codepage();
+
+			write_buffers_.clear();
+			write_buffers_.resize(writing_.size());
+			write_sequence_.clear();
+
+			for(std::size_t n = 0; n < writing_.size(); ++n)
+			{
+				if(!writing_[n].utf8.empty())
+				{
+					write_buffers_[n].swap(writing_[n].utf8);
+					write_sequence_.push_back(boost::asio::buffer(write_buffers_[n]));
 				}
+				else if(ConvertWideCharToMultiByte(page, writing_[n].text, write_buffers_[n]))
+					write_sequence_.push_back(boost::asio::buffer(write_buffers_[n]));
+				else
+					CASPAR_LOG(error) << "Send to " << host_ << TEXT(" failed, could not convert response to UTF-8");
 			}
+
+			writing_.clear();
+
+			if(!write_sequence_.empty())
+				break;
 		}
-		else
-			socketInfo.sendQueue_.pop();
-	}
-}
 
-//////////////////////////////
-// AsyncEventServer::OnClose
-// PARAMS: ...
-// COMMENT: Called when a client disconnects / is disconnected
-void AsyncEventServer::OnClose(SocketInfoPtr& pSI) {
-	CASPAR_LOG(info) << "Client " << pSI->host_.c_str() << TEXT(" was disconnected");
+		boost::asio::async_write(socket_, write_sequence_, strand_.wrap(boost::bind(&connection::handle_write, shared_from_this(), boost::asio::placeholders::error)));
+	}
 
-	socketInfoCollection_.RemoveSocketInfo(pSI);
-}
+	void handle_write(const boost::system::error_code& error)
+	{
+		if(error)
+		{
+			tbb::mutex::scoped_lock lock(send_mutex_);
 
-//////////////////////////////
-// AsyncEventServer::OnError
-// PARAMS: ...
-// COMMENT: Called when an errorcode is recieved
-void AsyncEventServer::OnError(HANDLE waitEvent, int errorCode) {
-	if(errorCode == WSAENETDOWN || errorCode == WSAECONNABORTED || errorCode == WSAECONNRESET || errorCode == WSAESHUTDOWN || errorCode == WSAETIMEDOUT || errorCode == WSAENOTCONN || errorCode == WSAENETRESET) {
-		SocketInfoPtr pSocketInfo;
-		if(socketInfoCollection_.FindSocketInfo(waitEvent, pSocketInfo)) {
-			CASPAR_LOG(info) << "Client " << pSocketInfo->host_.c_str() << TEXT(" was disconnected, Errorcode ") << errorCode;
+			is_writing_ = false;
+			if(error != boost::asio::error::operation_aborted)
+				CASPAR_LOG(error) << "Failed to Send to " << host_ << TEXT(" Errorcode: ") << error.value();
+			return;
 		}
 
-		socketInfoCollection_.RemoveSocketInfo(waitEvent);
+		write_pending();
 	}
-}
 
-//////////////////////////////
-// AsyncEventServer::DisconnectClient
-// PARAMS: ...
-// COMMENT: The client is removed from the actual client-list when an FD_CLOSE notification is recieved
-void AsyncEventServer::DisconnectClient(SocketInfo& socketInfo) {
-	int result = shutdown(socketInfo.socket_, SD_SEND);
-	if(result == SOCKET_ERROR)
-		OnError(socketInfo.event_, result);
-}
+	void read_some()
+	{
+		socket_.async_read_some(
+				boost::asio::buffer(recv_buffer_.data() + recv_leftover_, recv_buffer_.size() - recv_leftover_), 
+				strand_.wrap(boost::bind(&connection::handle_read, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+	}
 
-//////////////////////////////
-// AsyncEventServer::LogSocketError
-void AsyncEventServer::LogSocketError(const TCHAR* pStr, int socketError) {
-	if(socketError == 0)
-		socketError = WSAGetLastError();
+	void handle_read(const boost::system::error_code& error, std::size_t bytes_transferred)
+	{
+		if(error)
+		{
+			if(error == boost::asio::error::eof)
+				CASPAR_LOG(info) << "Client " << host_ << TEXT(" disconnected");
+			else if(error != boost::asio::error::operation_aborted)
+				CASPAR_LOG(info) << "Client " << host_ << TEXT(" was disconnected, Errorcode ") << error.value();
 
-	CASPAR_LOG(error) << "Failed to " << pStr << TEXT(" Errorcode: ") << socketError;
-}
+			do_close();
+			return;
+		}
+
+		if(ConvertMultiByteToWideChar(codepage(), recv_buffer_.data(), static_cast<int>(bytes_transferred) + recv_leftover_, wide_recv_buffer_, recv_leftover_))
+		{
+			auto protocol = connection_set_->get_protocol();
+
+			tbb::mutex::scoped_lock lock(connection_set_->parse_mutex);
+			protocol->Parse(&wide_recv_buffer_[0], static_cast<int>(wide_recv_buffer_.size()), shared_from_this());
+		}
+		else
+			CASPAR_LOG(error) << "Read from " << host_ << TEXT(" failed, could not convert command to UNICODE");
 
+		read_some();
+	}
 
-//////////////////////////////
-//  SocketInfoCollection
-//////////////////////////////
+	void do_close()
+	{
+		{
+			tbb::mutex::scoped_lock lock(send_mutex_);
+			if(is_closed_)
+				return;
+			is_closed_ = true;
+		}
 
-AsyncEventServer::SocketInfoCollection::SocketInfoCollection() : bDirty_(false) {
-}
+		boost::system::error_code ec;
+		socket_.shutdown(tcp::socket::shutdown_both, ec);
+		socket_.close(ec);
 
-AsyncEventServer::SocketInfoCollection::~SocketInfoCollection() {
-}
+		std::shared_ptr<connection> self = shared_from_this();
+		ClientDisconnectEvent on_disconnect;
+		{
+			tbb::mutex::scoped_lock lock(connection_set_->mutex);
+			connection_set_->connections.erase(self);
+			on_disconnect = connection_set_->on_disconnect;
+		}
 
-bool AsyncEventServer::SocketInfoCollection::AddSocketInfo(SocketInfoPtr& pSocketInfo) {
-	tbb::mutex::scoped_lock lock(mutex_);
+		if(on_disconnect)
+			on_disconnect(self);
 
-	waitEvents_.resize(waitEvents_.size()+1);
-	bool bSuccess = socketInfoMap_.insert(SocketInfoMap::value_type(pSocketInfo->event_, pSocketInfo)).second;
-	if(bSuccess) {
-		waitEvents_[waitEvents_.size()-1] = pSocketInfo->event_;
-		bDirty_ = true;
+		lifecycle_bound_items_.clear();
 	}
+};
 
-	return bSuccess;
-}
+struct AsyncEventServer::implementation : boost::noncopyable
+{
+	const int								port_;
+	std::shared_ptr<connection_set>			connection_set_;
+
+	tbb::mutex								lifecycle_mutex_;
+	std::vector<lifecycle_factory_t>		lifecycle_factories_;
 
-void AsyncEventServer::SocketInfoCollection::RemoveSocketInfo(SocketInfoPtr& pSocketInfo) {
-	if(pSocketInfo != 0) {
-		RemoveSocketInfo(pSocketInfo->event_);
+	boost::asio::io_service					service_;
+	std::shared_ptr<boost::asio::io_service::work> work_;
+	std::shared_ptr<tcp::acceptor>			acceptor_;
+	boost::thread_group						threads_;
+
+	implementation(const safe_ptr<IProtocolStrategy>& protocol, int port, bool no_delay)
+		: port_(port)
+		, connection_set_(std::make_shared<connection_set>())
+	{
+		connection_set_->protocol = protocol;
+		connection_set_->no_delay = no_delay;
+	}
+
+	~implementation()
+	{
+		stop();
 	}
-}
-void AsyncEventServer::SocketInfoCollection::RemoveSocketInfo(HANDLE waitEvent) {
-	tbb::mutex::scoped_lock lock(mutex_);
 
-	//Find instance
-	SocketInfoPtr pSocketInfo;
-	SocketInfoMap::iterator it = socketInfoMap_.find(waitEvent);
-	SocketInfoMap::iterator end = socketInfoMap_.end();
-	if(it != end)
-		pSocketInfo = it->second;
+	bool start()
+	{
+		if(acceptor_)
+			return false;
 
-	if(pSocketInfo) {
-		pSocketInfo->pServer_ = NULL;
+		try
+		{
+			acceptor_ = std::make_shared<tcp::acceptor>(service_, tcp::endpoint(tcp::v4(), static_cast<unsigned short>(port_)));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(error) << "Failed to listen on port " << port_;
+			acceptor_.reset();
+			return false;
+		}
 
-		socketInfoMap_.erase(waitEvent);
+		service_.reset();
+		work_ = std::make_shared<boost::asio::io_service::work>(service_);
 
-		HandleVector::iterator it = std::find(waitEvents_.begin(), waitEvents_.end(), waitEvent);
-		if(it != waitEvents_.end()) {
-			std::swap((*it), waitEvents_.back());
-			waitEvents_.resize(waitEvents_.size()-1);
+		auto num_threads = std::max(2, std::min(4, static_cast<int>(boost::thread::hardware_concurrency())));
+		for(int n = 0; n < num_threads; ++n)
+			threads_.create_thread([this]{ run(); });
 
-			bDirty_ = true;
+		accept();
+
+		CASPAR_LOG(info) << "Listener successfully initialized";
+		return true;
+	}
+
+	void run()
+	{
+		while(true)
+		{
+			try
+			{
+				service_.run();
+				return;
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
 		}
 	}
-	if(onSocketInfoRemoved)
-		onSocketInfoRemoved(pSocketInfo);
-}
 
-bool AsyncEventServer::SocketInfoCollection::FindSocketInfo(HANDLE key, SocketInfoPtr& pResult) {
-	tbb::mutex::scoped_lock lock(mutex_);
+	void stop()
+	{
+		if(!acceptor_)
+			return;
 
-	SocketInfoMap::iterator it = socketInfoMap_.find(key);
-	SocketInfoMap::iterator end = socketInfoMap_.end();
-	if(it != end)
-		pResult = it->second;
+		boost::system::error_code ec;
+		acceptor_->close(ec);
 
-	return (it != end);
-}
+		std::set<std::shared_ptr<connection>> connections;
+		{
+			tbb::mutex::scoped_lock lock(connection_set_->mutex);
+			connections = connection_set_->connections;
+		}
 
-void AsyncEventServer::SocketInfoCollection::CopyCollectionToArray(HANDLE* pDest, int maxCount) {
-	tbb::mutex::scoped_lock lock(mutex_);
+		BOOST_FOREACH(auto& connection, connections)
+			connection->close();
+
+		work_.reset();
+		threads_.join_all();
+		acceptor_.reset();
+	}
+
+	void accept()
+	{
+		auto new_connection = std::make_shared<connection>(service_, connection_set_);
+		acceptor_->async_accept(new_connection->socket(), boost::bind(&implementation::handle_accept, this, new_connection, boost::asio::placeholders::error));
+	}
+
+	void handle_accept(const std::shared_ptr<connection>& new_connection, const boost::system::error_code& error)
+	{
+		if(error == boost::asio::error::operation_aborted || !acceptor_->is_open())
+			return;
+
+		if(error)
+			CASPAR_LOG(error) << "Failed to Accept Errorcode: " << error.value();
+		else
+		{
+			boost::system::error_code ec;
+			auto ipv4_address = new_connection->socket().remote_endpoint(ec).address().to_string();
+
+			std::vector<std::shared_ptr<void>> lifecycle_bound_items;
+			{
+				tbb::mutex::scoped_lock lock(lifecycle_mutex_);
 
-	memcpy(pDest, &(waitEvents_[0]), std::min( maxCount, static_cast<int>(waitEvents_.size()) ) * sizeof(HANDLE) );
+				BOOST_FOREACH(auto& lifecycle_factory, lifecycle_factories_)
+					lifecycle_bound_items.push_back(lifecycle_factory(ipv4_address));
+			}
+
+			std::size_t count = 0;
+			{
+				tbb::mutex::scoped_lock lock(connection_set_->mutex);
+				connection_set_->connections.insert(new_connection);
+				count = connection_set_->connections.size();
+			}
+
+			new_connection->start(lifecycle_bound_items);
+
+			CASPAR_LOG(info) << "Accepted connection from " << new_connection->print() << " " << count;
+		}
+
+		accept();
+	}
+};
+
+AsyncEventServer::AsyncEventServer(const safe_ptr<IProtocolStrategy>& pProtocol, int port, bool no_delay) : impl_(new implementation(pProtocol, port, no_delay)){}
+AsyncEventServer::~AsyncEventServer(){}
+bool AsyncEventServer::Start(){return impl_->start();}
+void AsyncEventServer::Stop(){impl_->stop();}
+
+void AsyncEventServer::SetProtocolStrategy(safe_ptr<IProtocolStrategy> pPS)
+{
+	tbb::spin_mutex::scoped_lock lock(impl_->connection_set_->protocol_mutex);
+	impl_->connection_set_->protocol = pPS;
 }
 
-void AsyncEventServer::SocketInfoCollection::Clear() {
-	tbb::mutex::scoped_lock lock(mutex_);
+void AsyncEventServer::SetClientDisconnectHandler(ClientDisconnectEvent handler)
+{
+	tbb::mutex::scoped_lock lock(impl_->connection_set_->mutex);
+	impl_->connection_set_->on_disconnect = handler;
+}
 
-	socketInfoMap_.clear();
-	waitEvents_.clear();
+void AsyncEventServer::add_lifecycle_factory(const lifecycle_factory_t& factory)
+{
+	tbb::mutex::scoped_lock lock(impl_->lifecycle_mutex_);
+	impl_->lifecycle_factories_.push_back(factory);
 }
 
-}	//namespace IO
-}	//namespace caspar
\ No newline at end of file
+}}
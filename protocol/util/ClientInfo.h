@@ -26,6 +26,7 @@
 #include <iostream>
 
 #include <common/log/log.h>
+#include <common/utility/string.h>
 
 namespace caspar { namespace IO {
 
@@ -38,6 +39,9 @@ public:
 	virtual ~ClientInfo(){}
 
 	virtual void Send(const std::wstring& data) = 0;
+
+	// For replies already encoded as UTF-8, which a client speaking UTF-8 is sent without converting them.
+	virtual void SendUtf8(const std::string& data) { Send(widen(data)); }
 	virtual void Disconnect() = 0;
 	virtual std::wstring print() const = 0;
 
@@ -0,0 +1,1085 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#define NOMINMAX
+
+#include "benchmark.h"
+
+#include "server.h"
+
+#include <windows.h>
+#include <psapi.h>
+
+#include <common/env.h>
+#include <common/diagnostics/graph.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <core/mixer/audio/audio_util.h>
+#include <core/mixer/gpu/ogl_device.h>
+#include <core/mixer/image/image_mixer.h>
+#include <core/mixer/write_frame.h>
+#include <core/video_channel.h>
+#include <core/video_format.h>
+
+#include <protocol/amcp/AMCPProtocolStrategy.h>
+#include <protocol/amcp/command_log.h>
+#include <protocol/util/ClientInfo.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/optional.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include <boost/thread.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/spin_mutex.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <vector>
+
+namespace caspar {
+
+namespace {
+
+// Collects the replies to the scenario's commands.
+struct benchmark_client : public IO::ClientInfo
+{
+	boost::mutex				mutex_;
+	boost::condition_variable	cond_;
+	std::deque<std::wstring>	replies_;
+
+	virtual void Send(const std::wstring& data) override
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			replies_.push_back(data);
+		}
+		cond_.notify_one();
+	}
+
+	virtual void Disconnect() override
+	{
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"Benchmark";
+	}
+
+	boost::optional<std::wstring> wait_for_reply(const boost::posix_time::time_duration& timeout)
+	{
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
+		auto deadline = boost::get_system_time() + timeout;
+		while(replies_.empty())
+		{
+			if(!cond_.timed_wait(lock, deadline))
+				return boost::none;
+		}
+
+		auto reply = replies_.front();
+		replies_.pop_front();
+		return reply;
+	}
+};
+
+// The state shared by the clients of a replay, commands are tagged "REQ <id>" with ids unique across the clients.
+class replay_state
+{
+	struct pending_command
+	{
+		boost::posix_time::ptime	sent;
+		std::wstring				command;
+	};
+
+	boost::mutex					mutex_;
+	boost::condition_variable		cond_;
+	std::map<int, pending_command>	pending_;
+	std::vector<double>				latencies_; // ms
+	boost::property_tree::wptree	errors_;
+	int								failures_;
+public:
+	replay_state()
+		: failures_(0)
+	{
+	}
+
+	void sent(int id, const std::wstring& command)
+	{
+		pending_command pending = {boost::posix_time::microsec_clock::universal_time(), command};
+
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		pending_[id] = pending;
+	}
+
+	void replied(const std::wstring& data)
+	{
+		auto now = boost::posix_time::microsec_clock::universal_time();
+
+		if(!boost::starts_with(data, L"RES "))
+			return;
+
+		auto id_end = data.find(L' ', 4);
+		if(id_end == std::wstring::npos)
+			return;
+
+		int id;
+		try
+		{
+			id = boost::lexical_cast<int>(data.substr(4, id_end - 4));
+		}
+		catch(boost::bad_lexical_cast&)
+		{
+			return;
+		}
+
+		auto text = boost::trim_copy(data.substr(id_end + 1));
+
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+
+			auto it = pending_.find(id);
+			if(it == pending_.end())
+				return;
+
+			latencies_.push_back(static_cast<double>((now - it->second.sent).total_microseconds()) / 1000.0);
+
+			if(!boost::starts_with(text, L"2"))
+			{
+				boost::property_tree::wptree error;
+				error.add(L"<xmlattr>.command",	it->second.command);
+				error.add(L"<xmlattr>.reply",	text.substr(0, text.find(L'\r')));
+				errors_.add_child(L"error", error);
+				++failures_;
+			}
+
+			pending_.erase(it);
+		}
+		cond_.notify_all();
+	}
+
+	// Returns the number of commands still without a reply at the timeout.
+	std::size_t wait_for_replies(const boost::posix_time::time_duration& timeout)
+	{
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
+		auto deadline = boost::get_system_time() + timeout;
+		while(!pending_.empty())
+		{
+			if(!cond_.timed_wait(lock, deadline))
+				break;
+		}
+
+		return pending_.size();
+	}
+
+	std::vector<double> latencies()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		return latencies_;
+	}
+
+	boost::property_tree::wptree errors()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		return errors_;
+	}
+
+	int failures()
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		return failures_;
+	}
+};
+
+// One client of the recording, so that batches and per-client state stay apart.
+struct replay_client : public IO::ClientInfo
+{
+	const std::shared_ptr<replay_state>	state_;
+	const int							id_;
+
+	replay_client(const std::shared_ptr<replay_state>& state, int id)
+		: state_(state)
+		, id_(id)
+	{
+	}
+
+	virtual void Send(const std::wstring& data) override
+	{
+		state_->replied(data);
+	}
+
+	virtual void Disconnect() override
+	{
+	}
+
+	virtual std::wstring print() const override
+	{
+		return L"Replay client " + boost::lexical_cast<std::wstring>(id_);
+	}
+};
+
+typedef std::pair<std::wstring, std::string> sample_key; // Graph text and line name.
+
+// The values set on the diagnostics graphs while measuring.
+class sample_store
+{
+	tbb::spin_mutex										mutex_;
+	bool												recording_;
+	std::map<sample_key, std::vector<double>>			samples_;
+public:
+	sample_store()
+		: recording_(false)
+	{
+	}
+
+	void add(const std::wstring& graph, const std::string& line, double value)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		if(recording_)
+			samples_[std::make_pair(graph, line)].push_back(value);
+	}
+
+	void start()
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		samples_.clear();
+		recording_ = true;
+	}
+
+	std::map<sample_key, std::vector<double>> stop()
+	{
+		std::map<sample_key, std::vector<double>> result;
+
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		recording_ = false;
+		std::swap(result, samples_);
+		return result;
+	}
+};
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+	auto index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+boost::property_tree::wptree memory_info(server& server)
+{
+	boost::property_tree::wptree info;
+
+	PROCESS_MEMORY_COUNTERS_EX counters = {};
+	counters.cb = sizeof(counters);
+	if(GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters)))
+	{
+		info.add(L"<xmlattr>.working-set-mb",		counters.WorkingSetSize / (1024 * 1024));
+		info.add(L"<xmlattr>.peak-working-set-mb",	counters.PeakWorkingSetSize / (1024 * 1024));
+		info.add(L"<xmlattr>.private-mb",			counters.PrivateUsage / (1024 * 1024));
+	}
+
+	auto ogl = server.get_ogl_device();
+	info.add(L"<xmlattr>.device-buffers-mb",	ogl->device_bytes() / (1024 * 1024));
+	info.add(L"<xmlattr>.host-buffers-mb",		ogl->host_bytes() / (1024 * 1024));
+
+	return info;
+}
+
+// Values are as on the diagnostics graphs, where most times are relative to the frame duration and 0.5 is one frame.
+boost::property_tree::wptree measurement_info(const std::wstring& name, double seconds, const std::map<sample_key, std::vector<double>>& samples)
+{
+	boost::property_tree::wptree info;
+	info.add(L"<xmlattr>.name",		name);
+	info.add(L"<xmlattr>.seconds",	seconds);
+
+	std::map<std::wstring, boost::property_tree::wptree> graphs;
+
+	BOOST_FOREACH(auto& entry, samples)
+	{
+		auto values = entry.second;
+		if(values.empty())
+			continue;
+
+		std::sort(values.begin(), values.end());
+
+		double sum = 0.0;
+		BOOST_FOREACH(auto value, values)
+			sum += value;
+
+		boost::property_tree::wptree line;
+		line.add(L"<xmlattr>.name",		widen(entry.first.second));
+		line.add(L"<xmlattr>.count",	values.size());
+		line.add(L"<xmlattr>.rate",		static_cast<double>(values.size()) / seconds);
+		line.add(L"<xmlattr>.mean",		sum / static_cast<double>(values.size()));
+		line.add(L"<xmlattr>.p50",		percentile(values, 0.5));
+		line.add(L"<xmlattr>.p90",		percentile(values, 0.9));
+		line.add(L"<xmlattr>.p99",		percentile(values, 0.99));
+		line.add(L"<xmlattr>.max",		values.back());
+
+		auto& graph = graphs[entry.first.first];
+		if(graph.empty())
+			graph.add(L"<xmlattr>.text", entry.first.first);
+		graph.add_child(L"line", line);
+	}
+
+	BOOST_FOREACH(auto& graph, graphs)
+		info.add_child(L"graph", graph.second);
+
+	return info;
+}
+
+// Ticks over a frame duration and tagged frame problems, summed over the channels.
+boost::property_tree::wptree frame_info(const std::map<sample_key, std::vector<double>>& samples)
+{
+	std::size_t late_ticks		= 0;
+	std::size_t dropped_frames	= 0;
+	std::size_t late_frames		= 0;
+
+	BOOST_FOREACH(auto& entry, samples)
+	{
+		if(entry.first.second == "tick-time")
+			late_ticks += std::count_if(entry.second.begin(), entry.second.end(), [](double value) { return value > 0.5; });
+		else if(entry.first.second == "dropped-frame")
+			dropped_frames += entry.second.size();
+		else if(entry.first.second == "late-frame")
+			late_frames += entry.second.size();
+	}
+
+	boost::property_tree::wptree info;
+	info.add(L"<xmlattr>.late-ticks",		late_ticks);
+	info.add(L"<xmlattr>.dropped-frames",	dropped_frames);
+	info.add(L"<xmlattr>.late-frames",		late_frames);
+	return info;
+}
+
+void write_result(const boost::property_tree::wptree& result, const std::wstring& result_file)
+{
+	boost::property_tree::xml_writer_settings<wchar_t> settings(' ', 3);
+	if(result_file.empty())
+		boost::property_tree::write_xml(std::wcout, result, settings);
+	else
+	{
+		std::wofstream file(result_file.c_str());
+		boost::property_tree::write_xml(file, result, settings);
+		CASPAR_LOG(info) << L"Wrote the benchmark results to " << result_file;
+	}
+}
+
+std::vector<std::wstring> expand(const std::wstring& line)
+{
+	std::vector<std::wstring> commands;
+
+	if(!boost::istarts_with(line, L"REPEAT "))
+	{
+		commands.push_back(line);
+		return commands;
+	}
+
+	auto rest	= boost::trim_copy(line.substr(7));
+	auto space	= rest.find(L' ');
+	if(space == std::wstring::npos)
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("REPEAT needs a count and a command."));
+
+	auto count		= boost::lexical_cast<int>(rest.substr(0, space));
+	auto command	= boost::trim_copy(rest.substr(space + 1));
+
+	for(int n = 1; n <= count; ++n)
+		commands.push_back(boost::replace_all_copy(command, L"$n", boost::lexical_cast<std::wstring>(n)));
+
+	return commands;
+}
+
+}
+
+int run_benchmark(server& server, const std::wstring& scenario_file, const std::wstring& result_file)
+{
+	std::wifstream scenario(scenario_file.c_str());
+	if(!scenario)
+	{
+		CASPAR_LOG(error) << L"Could not open the benchmark scenario " << scenario_file;
+		return 1;
+	}
+
+	auto samples = std::make_shared<sample_store>();
+	diagnostics::set_value_sampler([samples](const std::wstring& graph, const std::string& line, double value)
+	{
+		samples->add(graph, line, value);
+	});
+
+	boost::promise<bool> shutdown_server_now;
+	protocol::amcp::AMCPProtocolStrategy amcp(
+			server.get_channels(),
+			server.get_recorders(),
+			server.get_thumbnail_generator(),
+			server.get_media_info_repo(),
+			server.get_media_libraries(),
+			shutdown_server_now);
+
+	auto client = std::make_shared<benchmark_client>();
+
+	boost::property_tree::wptree result;
+	result.add(L"benchmark.<xmlattr>.version",	env::version());
+	result.add(L"benchmark.<xmlattr>.scenario",	scenario_file);
+	result.add(L"benchmark.<xmlattr>.channels",	server.get_channels().size());
+
+	int failures = 0;
+	std::wstring line;
+	while(std::getline(scenario, line))
+	{
+		boost::trim(line);
+		if(line.empty() || line[0] == L'#')
+			continue;
+
+		try
+		{
+			if(boost::istarts_with(line, L"WAIT "))
+			{
+				boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<int64_t>(boost::lexical_cast<double>(boost::trim_copy(line.substr(5))) * 1000.0)));
+				continue;
+			}
+
+			if(boost::istarts_with(line, L"MEASURE "))
+			{
+				std::vector<std::wstring> args;
+				auto rest = boost::trim_copy(line.substr(8));
+				boost::split(args, rest, boost::is_space(), boost::token_compress_on);
+
+				auto seconds	= boost::lexical_cast<double>(args.at(0));
+				auto name		= args.size() > 1 ? args.at(1) : L"measurement-" + boost::lexical_cast<std::wstring>(result.get_child(L"benchmark").count(L"measurement") + 1);
+
+				CASPAR_LOG(info) << L"Benchmark measuring " << name << L" for " << seconds << L" s.";
+
+				boost::timer timer;
+				samples->start();
+				boost::this_thread::sleep(boost::posix_time::milliseconds(static_cast<int64_t>(seconds * 1000.0)));
+				auto measured = samples->stop();
+
+				auto info = measurement_info(name, timer.elapsed(), measured);
+				info.add_child(L"memory", memory_info(server));
+				result.add_child(L"benchmark.measurement", info);
+				continue;
+			}
+
+			BOOST_FOREACH(auto& command, expand(line))
+			{
+				auto data = command + L"\r\n";
+				amcp.Parse(data.c_str(), static_cast<int>(data.length()), client);
+
+				auto reply = client->wait_for_reply(boost::posix_time::seconds(30));
+				auto text = reply ? boost::trim_copy(*reply) : L"no reply";
+				if(!boost::starts_with(text, L"2"))
+				{
+					CASPAR_LOG(warning) << L"Benchmark command " << command << L" failed: " << text;
+					boost::property_tree::wptree error;
+					error.add(L"<xmlattr>.command",	command);
+					error.add(L"<xmlattr>.reply",	text);
+					result.add_child(L"benchmark.error", error);
+					++failures;
+				}
+			}
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(error) << L"Invalid benchmark scenario line: " << line;
+			++failures;
+		}
+	}
+
+	diagnostics::set_value_sampler(diagnostics::value_sampler());
+
+	write_result(result, result_file);
+
+	return failures == 0 ? 0 : 2;
+}
+
+int run_replay(server& server, const std::wstring& log_file, double speed, const std::wstring& result_file)
+{
+	std::vector<protocol::amcp::logged_command> commands;
+	try
+	{
+		commands = protocol::amcp::read_command_log(log_file);
+	}
+	catch(...)
+	{
+		CASPAR_LOG_CURRENT_EXCEPTION();
+	}
+
+	if(commands.empty())
+	{
+		CASPAR_LOG(error) << L"No commands to replay in " << log_file;
+		return 1;
+	}
+
+	auto samples = std::make_shared<sample_store>();
+	diagnostics::set_value_sampler([samples](const std::wstring& graph, const std::string& line, double value)
+	{
+		samples->add(graph, line, value);
+	});
+
+	boost::promise<bool> shutdown_server_now;
+	protocol::amcp::AMCPProtocolStrategy amcp(
+			server.get_channels(),
+			server.get_recorders(),
+			server.get_thumbnail_generator(),
+			server.get_media_info_repo(),
+			server.get_media_libraries(),
+			shutdown_server_now);
+
+	auto state = std::make_shared<replay_state>();
+	std::map<int, std::shared_ptr<replay_client>> clients;
+
+	CASPAR_LOG(info) << L"Replaying " << commands.size() << L" commands from " << log_file << (speed > 0.0 ? L" at " + boost::lexical_cast<std::wstring>(speed) + L"x." : L" as fast as possible.");
+
+	boost::timer timer;
+	samples->start();
+
+	auto start		= boost::posix_time::microsec_clock::universal_time();
+	double max_lag	= 0.0; // ms behind the recorded schedule, when the commands are not accepted fast enough.
+
+	for(std::size_t n = 0; n < commands.size(); ++n)
+	{
+		auto& logged = commands[n];
+
+		if(speed > 0.0)
+		{
+			auto due	= start + boost::posix_time::microseconds(static_cast<int64_t>(static_cast<double>(logged.millis) * 1000.0 / speed));
+			auto now	= boost::posix_time::microsec_clock::universal_time();
+			if(due > now)
+				boost::this_thread::sleep(due - now);
+			else
+				max_lag = std::max(max_lag, static_cast<double>((now - due).total_microseconds()) / 1000.0);
+		}
+
+		// The recorded request id, if any, is replaced by the index of the command.
+		auto command = logged.message;
+		if(boost::istarts_with(command, L"REQ "))
+		{
+			auto id_end = command.find(L' ', 4);
+			command = id_end != std::wstring::npos ? command.substr(id_end + 1) : L"";
+		}
+
+		auto& client = clients[logged.client];
+		if(!client)
+			client = std::make_shared<replay_client>(state, logged.client);
+
+		auto id		= static_cast<int>(n);
+		auto data	= L"REQ " + boost::lexical_cast<std::wstring>(id) + L" " + command + L"\r\n";
+		state->sent(id, command);
+		amcp.Parse(data.c_str(), static_cast<int>(data.length()), client);
+	}
+
+	auto unanswered = state->wait_for_replies(boost::posix_time::seconds(30));
+	auto measured	= samples->stop();
+	auto seconds	= timer.elapsed();
+
+	diagnostics::set_value_sampler(diagnostics::value_sampler());
+
+	auto latencies = state->latencies();
+	std::sort(latencies.begin(), latencies.end());
+
+	boost::property_tree::wptree result;
+	result.add(L"benchmark.<xmlattr>.version",	env::version());
+	result.add(L"benchmark.<xmlattr>.replay",	log_file);
+	result.add(L"benchmark.<xmlattr>.speed",	speed > 0.0 ? boost::lexical_cast<std::wstring>(speed) : L"max");
+	result.add(L"benchmark.<xmlattr>.channels",	server.get_channels().size());
+
+	boost::property_tree::wptree latency;
+	latency.add(L"<xmlattr>.commands",		commands.size());
+	latency.add(L"<xmlattr>.clients",		clients.size());
+	latency.add(L"<xmlattr>.failed",		state->failures());
+	latency.add(L"<xmlattr>.unanswered",	unanswered);
+	latency.add(L"<xmlattr>.max-lag-ms",	max_lag);
+	if(!latencies.empty())
+	{
+		latency.add(L"<xmlattr>.p50-ms",	percentile(latencies, 0.5));
+		latency.add(L"<xmlattr>.p90-ms",	percentile(latencies, 0.9));
+		latency.add(L"<xmlattr>.p99-ms",	percentile(latencies, 0.99));
+		latency.add(L"<xmlattr>.max-ms",	latencies.back());
+	}
+	result.add_child(L"benchmark.latency", latency);
+	result.add_child(L"benchmark.frames", frame_info(measured));
+
+	auto info = measurement_info(L"replay", seconds, measured);
+	info.add_child(L"memory", memory_info(server));
+	result.add_child(L"benchmark.measurement", info);
+
+	BOOST_FOREACH(auto& error, state->errors())
+		result.add_child(L"benchmark.error", error.second);
+
+	write_result(result, result_file);
+
+	return state->failures() == 0 && unanswered == 0 ? 0 : 2;
+}
+
+
+namespace {
+
+const int mixer_warmup_frames	= 10; // Also covers the renders the gpu timer queries lag behind.
+const int mixer_upload_frames	= 20;
+
+const core::video_format::type mixer_formats[] =
+{
+	core::video_format::pal,
+	core::video_format::x720p5000,
+	core::video_format::x1080i5000,
+	core::video_format::x1080p5000,
+	core::video_format::x2160p5000
+};
+
+const core::pixel_format::type mixer_pixel_formats[] =
+{
+	core::pixel_format::bgra,
+	core::pixel_format::ycbcr,
+	core::pixel_format::ycbcra,
+	core::pixel_format::luma,
+	core::pixel_format::nv12,
+	core::pixel_format::p010,
+	core::pixel_format::ycbcr10,
+	core::pixel_format::ycbcra10,
+	core::pixel_format::rgba64,
+	core::pixel_format::v210
+};
+
+struct keying
+{
+	enum type
+	{
+		none = 0,
+		key,	// Each layer keyed by the luma of a frame with is_key below it.
+		chroma,	// Each layer chroma keyed on green.
+		count
+	};
+};
+
+struct field
+{
+	enum type
+	{
+		frames = 0,		// Shown as they are, as fields on the interlaced formats.
+		deinterlace,	// Deinterlaced by the image mixer.
+		count
+	};
+};
+
+struct mixer_case
+{
+	core::video_format::type	format;
+	core::pixel_format::type	pix_fmt;
+	core::blend_mode::type		blend;
+	keying::type				keying;
+	field::type					field;
+};
+
+std::wstring pixel_format_name(core::pixel_format::type format)
+{
+	switch(format)
+	{
+	case core::pixel_format::bgra:		return L"bgra";
+	case core::pixel_format::ycbcr:		return L"ycbcr";
+	case core::pixel_format::ycbcra:	return L"ycbcra";
+	case core::pixel_format::luma:		return L"luma";
+	case core::pixel_format::nv12:		return L"nv12";
+	case core::pixel_format::p010:		return L"p010";
+	case core::pixel_format::ycbcr10:	return L"ycbcr10";
+	case core::pixel_format::ycbcra10:	return L"ycbcra10";
+	case core::pixel_format::rgba64:	return L"rgba64";
+	case core::pixel_format::v210:		return L"v210";
+	default:							return L"invalid";
+	}
+}
+
+std::wstring keying_name(keying::type value)
+{
+	switch(value)
+	{
+	case keying::key:		return L"key";
+	case keying::chroma:	return L"chroma";
+	default:				return L"none";
+	}
+}
+
+std::wstring field_name(field::type value)
+{
+	return value == field::deinterlace ? L"deinterlace" : L"frames";
+}
+
+std::wstring case_name(const mixer_case& c)
+{
+	return core::video_format_desc::get(c.format).name + L"/" + pixel_format_name(c.pix_fmt) + L"/" + core::get_blend_mode(c.blend) + L"/" + keying_name(c.keying) + L"/" + field_name(c.field);
+}
+
+// Whether the name contains every term of the filter, "all" or an empty filter selects every case.
+bool matches(const std::wstring& name, const std::vector<std::wstring>& terms)
+{
+	return std::all_of(terms.begin(), terms.end(), [&](const std::wstring& term)
+	{
+		return term.empty() || boost::iequals(term, L"all") || boost::icontains(name, term);
+	});
+}
+
+// The planes of an image in the format as the producers make them, with 4:2:2 chroma for the planar formats.
+core::pixel_format_desc synthetic_pixel_format_desc(core::pixel_format::type format, uint32_t width, uint32_t height)
+{
+	typedef core::pixel_format_desc::plane plane;
+
+	core::pixel_format_desc desc;
+	desc.pix_fmt = format;
+
+	switch(format)
+	{
+	case core::pixel_format::bgra:
+		desc.planes.push_back(plane(width, height, 4));
+		break;
+	case core::pixel_format::luma:
+		desc.planes.push_back(plane(width, height, 1));
+		break;
+	case core::pixel_format::ycbcr:
+	case core::pixel_format::ycbcra:
+	case core::pixel_format::ycbcr10:
+	case core::pixel_format::ycbcra10:
+		{
+			uint32_t depth = format == core::pixel_format::ycbcr10 || format == core::pixel_format::ycbcra10 ? 2 : 1;
+			desc.planes.push_back(plane(width, height, 1, depth));
+			desc.planes.push_back(plane(width/2, height, 1, depth));
+			desc.planes.push_back(plane(width/2, height, 1, depth));
+			if(format == core::pixel_format::ycbcra || format == core::pixel_format::ycbcra10)
+				desc.planes.push_back(plane(width, height, 1, depth));
+			break;
+		}
+	case core::pixel_format::nv12:
+	case core::pixel_format::p010:
+		{
+			uint32_t depth = format == core::pixel_format::p010 ? 2 : 1;
+			desc.planes.push_back(plane(width, height, 1, depth));
+			desc.planes.push_back(plane(width/2, height/2, 2, depth));
+			break;
+		}
+	case core::pixel_format::rgba64:
+		desc.planes.push_back(plane(width, height, 4, 2));
+		break;
+	case core::pixel_format::v210:
+		desc.packed_width = width;
+		desc.planes.push_back(plane(((width + 47) / 48) * 128 / 4, height, 4));
+		break;
+	}
+
+	return desc;
+}
+
+uint32_t image_size(const core::pixel_format_desc& desc)
+{
+	uint32_t size = 0;
+	BOOST_FOREACH(auto& plane, desc.planes)
+		size += plane.size;
+	return size;
+}
+
+// A frame with every byte of its planes set to value, which is partly transparent for the formats with alpha.
+safe_ptr<core::write_frame> synthetic_frame(const safe_ptr<core::ogl_device>& ogl, const core::pixel_format_desc& desc, uint8_t value)
+{
+	static int tag;
+
+	auto frame = make_safe<core::write_frame>(ogl, &tag, desc, core::channel_layout::stereo());
+	for(uint32_t n = 0; n < desc.planes.size(); ++n)
+	{
+		auto image = frame->image_data(n);
+		std::fill(image.begin(), image.end(), value);
+	}
+	return frame;
+}
+
+double elapsed_ms(const boost::posix_time::ptime& start)
+{
+	return static_cast<double>((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000.0;
+}
+
+boost::property_tree::wptree value_stats(std::vector<double> values)
+{
+	boost::property_tree::wptree info;
+	if(values.empty())
+		return info;
+
+	std::sort(values.begin(), values.end());
+
+	double sum = 0.0;
+	BOOST_FOREACH(auto value, values)
+		sum += value;
+
+	info.add(L"mean",	sum / static_cast<double>(values.size()));
+	info.add(L"p50",	percentile(values, 0.5));
+	info.add(L"p90",	percentile(values, 0.9));
+	info.add(L"max",	values.back());
+	return info;
+}
+
+// Commits frames of the format at once and waits for the gpu to have them.
+boost::property_tree::wptree measure_uploads(const safe_ptr<core::ogl_device>& ogl, core::video_format::type format, core::pixel_format::type pix_fmt)
+{
+	auto& format_desc	= core::video_format_desc::get(format);
+	auto desc			= synthetic_pixel_format_desc(pix_fmt, format_desc.width, format_desc.height);
+
+	std::vector<safe_ptr<core::write_frame>> frames;
+	for(int n = 0; n < mixer_upload_frames; ++n)
+		frames.push_back(synthetic_frame(ogl, desc, 0x80));
+
+	auto start = boost::posix_time::microsec_clock::universal_time();
+	BOOST_FOREACH(auto& frame, frames)
+		frame->commit();
+	ogl->invoke([&]
+	{
+		ogl->sync_uploads();
+		if(!ogl->software())
+			glFinish();
+	});
+	auto ms = elapsed_ms(start);
+
+	boost::property_tree::wptree info;
+	info.add(L"resolution",		format_desc.name);
+	info.add(L"pixel-format",	pixel_format_name(pix_fmt));
+	info.add(L"frames",			mixer_upload_frames);
+	info.add(L"ms",				ms);
+	info.add(L"mb-per-s",		static_cast<double>(image_size(desc)) * mixer_upload_frames / (1024.0 * 1024.0) / std::max(ms / 1000.0, 0.000001));
+	return info;
+}
+
+// Three quarters of the frame, stepped along the diagonal so that no layer covers another completely.
+void place_layer(core::write_frame& frame, int index)
+{
+	auto& transform = frame.get_frame_transform();
+	transform.fill_scale[0]			= 0.75;
+	transform.fill_scale[1]			= 0.75;
+	transform.fill_translation[0]	= 0.25 * static_cast<double>(index % 2);
+	transform.fill_translation[1]	= 0.25 * static_cast<double>((index / 2) % 2);
+}
+
+// Renders a background and the layers of the case for every frame. The frames are new each time so that the 
+// static layer cache does not take any of them away, their uploads are done before the render is submitted.
+boost::property_tree::wptree measure_case(const safe_ptr<core::ogl_device>& ogl, core::image_mixer& mixer, const mixer_case& c, int layers, int frames)
+{
+	auto& format_desc		= core::video_format_desc::get(c.format);
+	auto desc				= synthetic_pixel_format_desc(c.pix_fmt, format_desc.width, format_desc.height);
+	auto background_desc	= synthetic_pixel_format_desc(core::pixel_format::bgra, format_desc.width, format_desc.height);
+	auto key_desc			= synthetic_pixel_format_desc(core::pixel_format::luma, format_desc.width, format_desc.height);
+
+	core::blend_mode blend(c.blend);
+	if(c.keying == keying::chroma)
+	{
+		blend.chroma			= core::chroma(core::chroma::green);
+		blend.chroma.threshold	= 0.3f;
+		blend.chroma.softness	= 0.1f;
+		blend.chroma.spill		= 0.5f;
+	}
+
+	std::vector<double> submit_times, render_times, draw_times, key_times, post_times, output_times, draw_calls;
+
+	for(int n = -mixer_warmup_frames; n < frames; ++n)
+	{
+		auto background = synthetic_frame(ogl, background_desc, 0xff);
+		background->commit();
+
+		std::vector<std::pair<std::shared_ptr<core::write_frame>, safe_ptr<core::write_frame>>> stack;
+		for(int m = 0; m < layers; ++m)
+		{
+			std::shared_ptr<core::write_frame> key;
+			if(c.keying == keying::key)
+			{
+				auto key_frame = synthetic_frame(ogl, key_desc, 0xa0);
+				key_frame->get_frame_transform().is_key = true;
+				place_layer(*key_frame, m);
+				key_frame->commit();
+				key = key_frame;
+			}
+
+			auto fill = synthetic_frame(ogl, desc, 0x80);
+			if(c.field == field::deinterlace)
+				fill->set_deinterlace(core::field_mode::upper, nullptr, nullptr);
+			place_layer(*fill, m);
+			fill->commit();
+
+			stack.push_back(std::make_pair(key, fill));
+		}
+
+		ogl->invoke([&]
+		{
+			ogl->sync_uploads();
+		});
+
+		auto start = boost::posix_time::microsec_clock::universal_time();
+
+		mixer.begin_layer(core::blend_mode::normal);
+		background->accept(mixer);
+		mixer.end_layer();
+
+		BOOST_FOREACH(auto& layer, stack)
+		{
+			mixer.begin_layer(blend);
+			if(layer.first)
+				layer.first->accept(mixer);
+			layer.second->accept(mixer);
+			mixer.end_layer();
+		}
+
+		auto image		= mixer(format_desc, false, core::output_packing::none, false);
+		auto submit_ms	= elapsed_ms(start);
+		image.get();
+		auto render_ms	= elapsed_ms(start);
+
+		if(n < 0)
+			continue;
+
+		auto times = mixer.last_gpu_times();
+		submit_times.push_back(submit_ms * 1000.0);
+		render_times.push_back(render_ms);
+		draw_times.push_back(times.draw * 1000.0);
+		key_times.push_back(times.key * 1000.0);
+		post_times.push_back(times.post * 1000.0);
+		output_times.push_back(times.output * 1000.0);
+		draw_calls.push_back(static_cast<double>(mixer.draw_calls()));
+	}
+
+	boost::property_tree::wptree info;
+	info.add(L"resolution",		format_desc.name);
+	info.add(L"pixel-format",	pixel_format_name(c.pix_fmt));
+	info.add(L"blend",			core::get_blend_mode(c.blend));
+	info.add(L"keying",			keying_name(c.keying));
+	info.add(L"field",			field_name(c.field));
+	info.add(L"layers",			layers);
+	info.add(L"frames",			frames);
+	info.add_child(L"submit-us",		value_stats(submit_times));
+	info.add_child(L"render-ms",		value_stats(render_times));
+	info.add_child(L"gpu-draw-ms",		value_stats(draw_times));
+	info.add_child(L"gpu-key-ms",		value_stats(key_times));
+	info.add_child(L"gpu-post-ms",		value_stats(post_times));
+	info.add_child(L"gpu-output-ms",	value_stats(output_times));
+	info.add_child(L"draw-calls",		value_stats(draw_calls));
+
+	// Without packing or key the output pass is only the readback of the channel image.
+	auto output = value_stats(output_times).get(L"mean", 0.0);
+	if(output > 0.0)
+		info.add(L"readback-mb-per-s", static_cast<double>(format_desc.size) / (1024.0 * 1024.0) / (output / 1000.0));
+
+	return info;
+}
+
+}
+
+int run_mixer_benchmark(const std::wstring& filter, int frames, const std::wstring& result_file)
+{
+	std::vector<std::wstring> terms;
+	boost::split(terms, filter, boost::is_any_of(L" ,"), boost::token_compress_on);
+
+	std::vector<mixer_case> cases;
+	BOOST_FOREACH(auto format, mixer_formats)
+	{
+		BOOST_FOREACH(auto pix_fmt, mixer_pixel_formats)
+		{
+			for(int b = 0; b < core::blend_mode::blend_mode_count; ++b)
+			{
+				for(int k = 0; k < keying::count; ++k)
+				{
+					for(int f = 0; f < field::count; ++f)
+					{
+						mixer_case c = {format, pix_fmt, static_cast<core::blend_mode::type>(b), static_cast<keying::type>(k), static_cast<field::type>(f)};
+						if(matches(case_name(c), terms))
+							cases.push_back(c);
+					}
+				}
+			}
+		}
+	}
+
+	if(cases.empty())
+	{
+		CASPAR_LOG(error) << L"No mixer benchmark cases match " << filter;
+		return 1;
+	}
+
+	auto ogl	= core::ogl_device::create(env::properties().get(L"configuration.mixer.renderer", L"gpu") == L"cpu");
+	auto graph	= make_safe<diagnostics::graph>();
+	auto layers	= env::properties().get(L"configuration.mixer.benchmark-layers", 3);
+
+	CASPAR_LOG(info) << L"Mixer benchmark running " << cases.size() << L" cases of " << frames << L" frames on " << ogl->version() << L".";
+
+	boost::property_tree::wptree uploads;
+	boost::property_tree::wptree results;
+	int failures = 0;
+
+	std::unique_ptr<core::image_mixer> mixer;
+	for(std::size_t n = 0; n < cases.size(); ++n)
+	{
+		auto& c = cases[n];
+
+		try
+		{
+			// Transfers are measured once for each size and format, each resolution gets a new mixer.
+			if(n == 0 || c.format != cases[n-1].format || c.pix_fmt != cases[n-1].pix_fmt)
+				uploads.push_back(std::make_pair(std::wstring(), measure_uploads(ogl, c.format, c.pix_fmt)));
+
+			if(!mixer || c.format != cases[n-1].format)
+				mixer.reset(new core::image_mixer(ogl, graph));
+
+			results.push_back(std::make_pair(std::wstring(), measure_case(ogl, *mixer, c, layers, frames)));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(error) << L"Mixer benchmark case " << case_name(c) << L" failed.";
+			mixer.reset();
+			++failures;
+		}
+
+		if((n + 1) % 100 == 0)
+			CASPAR_LOG(info) << L"Mixer benchmark done with " << n + 1 << L" of " << cases.size() << L" cases.";
+	}
+
+	mixer.reset();
+
+	boost::property_tree::wptree result;
+	result.add(L"mixer-benchmark.version",	env::version());
+	result.add(L"mixer-benchmark.gpu",		ogl->version());
+	result.add(L"mixer-benchmark.filter",	filter);
+	result.add(L"mixer-benchmark.failures",	failures);
+	result.add_child(L"mixer-benchmark.uploads",	uploads);
+	result.add_child(L"mixer-benchmark.cases",		results);
+
+	if(result_file.empty())
+		boost::property_tree::write_json(std::wcout, result);
+	else
+	{
+		std::wofstream file(result_file.c_str());
+		boost::property_tree::write_json(file, result);
+		CASPAR_LOG(info) << L"Wrote the mixer benchmark results to " << result_file;
+	}
+
+	return failures == 0 ? 0 : 2;
+}
+
+}
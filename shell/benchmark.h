@@ -0,0 +1,57 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* Author: Robert Nagy, ronag89@gmail.com
+*/
+
+#pragma once
+
+#include <string>
+
+namespace caspar {
+
+class server;
+
+// Runs an AMCP scenario against the channels of a benchmark server, see server.h, and writes the tick times,
+// frame rates and memory use measured during it as xml, to the console when result_file is empty.
+//
+// The scenario has one AMCP command per line, and:
+//   # comment
+//   REPEAT <count> <command>		the command count times, with $n replaced by 1..count
+//   WAIT <seconds>
+//   MEASURE <seconds> [<name>]		records every diagnostics value set during the seconds
+//
+// Returns the exit code of the process, 0 when every command succeeded.
+int run_benchmark(server& server, const std::wstring& scenario_file, const std::wstring& result_file);
+
+// Replays the AMCP commands recorded by a controller's <record-file>, see protocol/amcp/command_log.h, with one
+// client per recorded client. Commands are sent at speed times the recorded pace, or as fast as possible when speed
+// is 0, and the result has the command latency percentiles, the late ticks and the dropped and late frames.
+//
+// Returns the exit code of the process, 0 when every command succeeded.
+int run_replay(server& server, const std::wstring& log_file, double speed, const std::wstring& result_file);
+
+// Renders synthetic layer stacks with an off-screen ogl device and image mixer, without a server, for every 
+// resolution from SD to 2160p, pixel format, blend mode, keying and deinterlacing, and writes the gpu times of the 
+// passes, the cpu time submitting a frame and the upload and readback throughput as json. Only cases whose name, 
+// e.g. 1080i5000/ycbcr/multiply/chroma/frames, contains every term of the filter are run, "all" runs all of them.
+//
+// Returns the exit code of the process, 0 when every case was rendered.
+int run_mixer_benchmark(const std::wstring& filter, int frames, const std::wstring& result_file);
+
+}
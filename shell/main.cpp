@@ -34,6 +34,7 @@
 #include "resource.h"
 
 #include "server.h"
+#include "benchmark.h"
 
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
@@ -234,7 +235,33 @@ int main(int argc, wchar_t* argv[])
 		}
 	} tbb_thread_installer;
 
+	// casparcg --benchmark <scenario> [--benchmark-output <file>] runs the scenario instead of serving controllers, and
+	// casparcg --replay <record-file> [--replay-speed <N|max>] [--benchmark-output <file>] replays recorded commands, and
+	// casparcg --mixer-benchmark <filter> [--mixer-benchmark-frames <N>] [--benchmark-output <file>] measures the image mixer, see benchmark.h.
+	std::wstring benchmark_scenario;
+	std::wstring benchmark_output;
+	std::wstring replay_log;
+	std::wstring replay_speed = L"1";
+	std::wstring mixer_benchmark;
+	int mixer_benchmark_frames = 50;
+	for(int n = 1; n + 1 < argc; ++n)
+	{
+		if(std::wstring(argv[n]) == L"--benchmark")
+			benchmark_scenario = argv[++n];
+		else if(std::wstring(argv[n]) == L"--benchmark-output")
+			benchmark_output = argv[++n];
+		else if(std::wstring(argv[n]) == L"--replay")
+			replay_log = argv[++n];
+		else if(std::wstring(argv[n]) == L"--replay-speed")
+			replay_speed = argv[++n];
+		else if(std::wstring(argv[n]) == L"--mixer-benchmark")
+			mixer_benchmark = argv[++n];
+		else if(std::wstring(argv[n]) == L"--mixer-benchmark-frames")
+			mixer_benchmark_frames = boost::lexical_cast<int>(argv[++n]);
+	}
+
 	bool restart = false;
+	int benchmark_result = 0;
 	tbb::task_scheduler_init init;
 	
 	try 
@@ -250,7 +277,7 @@ int main(int argc, wchar_t* argv[])
 	#endif	 
 
 		// Start logging to file.
-		caspar::log::add_file_sink(caspar::env::log_folder());			
+		caspar::log::add_file_sink(caspar::env::log_folder(), caspar::env::properties().get(L"configuration.log-queue-size", 8192));			
 		std::wcout << L"Logging [info] or higher severity to " << caspar::env::log_folder() << std::endl << std::endl;
 		
 		// Setup console window.
@@ -266,6 +293,21 @@ int main(int argc, wchar_t* argv[])
 		tbb::atomic<bool> wait_for_keypress;
 		wait_for_keypress = false;
 
+		if(!mixer_benchmark.empty())
+			benchmark_result = caspar::run_mixer_benchmark(mixer_benchmark, mixer_benchmark_frames, benchmark_output);
+		else if(!benchmark_scenario.empty())
+		{
+			boost::promise<bool> shutdown_server_now;
+			caspar::server caspar_server(shutdown_server_now, true);
+			benchmark_result = caspar::run_benchmark(caspar_server, benchmark_scenario, benchmark_output);
+		}
+		else if(!replay_log.empty())
+		{
+			boost::promise<bool> shutdown_server_now;
+			caspar::server caspar_server(shutdown_server_now, true);
+			benchmark_result = caspar::run_replay(caspar_server, replay_log, replay_speed == L"max" ? 0.0 : boost::lexical_cast<double>(replay_speed), benchmark_output);
+		}
+		else
 		{
 			boost::promise<bool> shutdown_server_now;
 			boost::unique_future<bool> shutdown_server = shutdown_server_now.get_future();
@@ -390,5 +432,5 @@ int main(int argc, wchar_t* argv[])
 		Sleep(4000);
 	}	
 	
-	return restart ? 5 : 0;
+	return restart ? 5 : benchmark_result;
 }
\ No newline at end of file
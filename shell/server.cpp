@@ -25,22 +25,36 @@
 #include <memory>
 
 #include <common/env.h>
+#include <common/diagnostics/executor_stats.h>
 #include <common/exception/exceptions.h>
 #include <common/utility/string.h>
 #include <common/filesystem/polling_filesystem_monitor.h>
+#include <common/filesystem/native_filesystem_monitor.h>
+#include <common/memory/locked_memory_pool.h>
+#include <common/concurrency/parallel_arena.h>
+#include <common/concurrency/thread_placement.h>
 
 #include <core/mixer/gpu/ogl_device.h>
 #include <core/mixer/audio/audio_util.h>
 #include <core/mixer/mixer.h>
+#include <core/mixer/image/image_mixer.h>
 #include <core/video_channel.h>
+#include <core/load_governor.h>
 #include <core/recorder.h>
 #include <core/producer/stage.h>
 #include <core/consumer/output.h>
 #include <core/consumer/synchronizing/synchronizing_consumer.h>
+#include <core/consumer/shared_memory/shared_memory_consumer.h>
+#include <core/producer/shared_memory/shared_memory_producer.h>
+#include <core/consumer/replay/replay_consumer.h>
+#include <core/producer/playlist/playlist_producer.h>
+#include <core/producer/replay/replay_producer.h>
 #include <core/thumbnail_generator.h>
+#include <core/channel_state.h>
 #include <core/producer/media_info/media_info.h>
 #include <core/producer/media_info/media_info_repository.h>
 #include <core/producer/media_info/in_memory_media_info_repository.h>
+#include <core/producer/media_info/persistent_media_info_repository.h>
 
 #include <modules/bluefish/bluefish.h>
 #include <modules/decklink/decklink.h>
@@ -67,11 +81,16 @@
 #include <modules/ndi/producer/ndi_producer.h>
 
 #include <protocol/amcp/AMCPProtocolStrategy.h>
+#include <protocol/amcp/AMCPCommandsImpl.h>
+#include <protocol/amcp/command_log.h>
 #include <protocol/cii/CIIProtocolStrategy.h>
 #include <protocol/CLK/CLKProtocolStrategy.h>
 #include <protocol/util/AsyncEventServer.h>
 #include <protocol/util/stateful_protocol_strategy_wrapper.h>
 #include <protocol/osc/client.h>
+#include <protocol/state/server.h>
+#include <protocol/metrics/http_server.h>
+#include <protocol/transform/server.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
@@ -80,6 +99,8 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
 #include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/timer.hpp>
 
 #include <tbb/atomic.h>
 
@@ -111,6 +132,49 @@ std::shared_ptr<boost::asio::io_service> create_running_io_service()
 			});
 }
 
+// Runs startup work on threads of its own, joining them all before the
+// owner goes away even if startup is aborted by an exception.
+class startup_tasks : boost::noncopyable
+{
+	boost::thread_group threads_;
+public:
+	~startup_tasks()
+	{
+		threads_.join_all();
+	}
+
+	template<typename Func>
+	void run(const std::string& name, const Func& func)
+	{
+		threads_.create_thread([=]
+		{
+			win32_exception::ensure_handler_installed_for_thread(name.c_str());
+
+			try
+			{
+				func();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		});
+	}
+
+	void wait()
+	{
+		threads_.join_all();
+	}
+};
+
+template<typename Func>
+void timed(const std::wstring& phase, const Func& func)
+{
+	boost::timer timer;
+	func();
+	CASPAR_LOG(info) << L"Initialized " << phase << L" in " << static_cast<int>(timer.elapsed() * 1000.0) << L" ms.";
+}
+
 struct server::implementation : boost::noncopyable
 {
 	std::shared_ptr<boost::asio::io_service>	io_service_;
@@ -121,78 +185,116 @@ struct server::implementation : boost::noncopyable
 	std::shared_ptr<IO::AsyncEventServer>		primary_amcp_server_;
 	osc::client									osc_client_;
 	std::vector<std::shared_ptr<void>>			predefined_osc_subscriptions_;
+	std::shared_ptr<protocol::state::server>	state_server_;
+	std::shared_ptr<core::monitor::multi_sink>	monitor_sinks_;
+	std::shared_ptr<protocol::metrics::http_server>	metrics_server_;
+	std::shared_ptr<protocol::transform::server>	transform_server_;
 	std::vector<safe_ptr<video_channel>>		channels_;
 	std::vector<safe_ptr<recorder>>				recorders_;
 	safe_ptr<media_info_repository>				media_info_repo_;
-	boost::thread								initial_media_info_thread_;
-	tbb::atomic<bool>							running_;
+	core::media_libraries						media_libraries_;
 	std::shared_ptr<thumbnail_generator>		thumbnail_generator_;
+	std::shared_ptr<channel_state_store>		channel_state_;
+	const bool									benchmark_;
 
-	implementation(boost::promise<bool>& shutdown_server_now)
+	implementation(boost::promise<bool>& shutdown_server_now, bool benchmark)
 		: io_service_(create_running_io_service())
 		, shutdown_server_now_(shutdown_server_now)
-		, ogl_(ogl_device::create())
+		, ogl_(ogl_device::create(env::properties().get(L"configuration.mixer.renderer", L"gpu") == L"cpu"))
 		, osc_client_(io_service_)
-		, media_info_repo_(create_in_memory_media_info_repository())
+		, media_info_repo_(create_media_info_repository(env::properties()))
+		, benchmark_(benchmark)
 	{
-		running_ = true;
+		boost::timer startup_timer;
+		startup_tasks hardware_modules;
+		startup_tasks channel_outputs;
+		startup_tasks pool_prewarm;
+
 		setup_audio(env::properties());
+		setup_locked_memory(env::properties());
+		setup_stall_watchdog(env::properties());
 		
-		ffmpeg::init(media_info_repo_);
-		CASPAR_LOG(info) << L"Initialized ffmpeg module.";
-							  
-		bluefish::init();	  
-		CASPAR_LOG(info) << L"Initialized bluefish module.";
-							  
-		decklink::init();	  
-		CASPAR_LOG(info) << L"Initialized decklink module.";
-
-		oal::init();
-		CASPAR_LOG(info) << L"Initialized oal module.";
-							  
-		ogl::init();		  
-		CASPAR_LOG(info) << L"Initialized ogl module.";
-
-		flash::init();		  
-		CASPAR_LOG(info) << L"Initialized flash module.";
+		timed(L"ffmpeg module", [&] { ffmpeg::init(media_info_repo_); });
+		timed(L"oal module", [&] { oal::init(); });
+		timed(L"ogl module", [&] { ogl::init(); });
+		timed(L"flash module", [&] { flash::init(media_info_repo_); });
+		timed(L"image module", [&] { image::init(); });
+		core::register_consumer_factory([](const core::parameters& params)
+		{
+			return core::create_shared_memory_consumer(params);
+		});
+		core::register_producer_factory(core::create_shared_memory_producer);
+		core::register_consumer_factory([](const core::parameters& params)
+		{
+			return core::create_replay_consumer(params);
+		});
+		core::register_producer_factory(core::create_replay_producer);
+		core::register_producer_factory(core::create_playlist_producer);
+
+		// Probing for hardware and vendor runtimes is what takes time, and
+		// the channels create their devices directly, so the probes run
+		// next to channel setup. They register their factories one after
+		// the other, and are done before any controller can look them up.
+		hardware_modules.run("hardware-module-init", []
+		{
+			timed(L"bluefish module", [] { bluefish::init(); });
+			timed(L"decklink module", [] { decklink::init(); });
+			timed(L"newtek module", [] { newtek::init(); });
+			timed(L"ndi module", [] { ndi::init(); });
+		});
 
-		image::init();		  
-		CASPAR_LOG(info) << L"Initialized image module.";
+		timed(L"channels", [&] { setup_channels(env::properties(), channel_outputs, pool_prewarm); });
 
-		newtek::init();
-		CASPAR_LOG(info) << L"Initialized newtek module.";
+		// Benchmarks only drive the channels, from the scenario instead of controllers
+		// and without restoring what they played before.
+		if (benchmark_)
+		{
+			setup_media_libraries(env::properties());
+			timed(L"hardware modules", [&] { hardware_modules.wait(); });
+			timed(L"pool prewarm", [&] { pool_prewarm.wait(); });
+			CASPAR_LOG(info) << L"Server started for benchmarking in " << static_cast<int>(startup_timer.elapsed() * 1000.0) << L" ms.";
+			return;
+		}
 
-		ndi::init();
-		CASPAR_LOG(info) << L"Initialized ndi module.";
+		timed(L"recorders", [&] { setup_recorders(env::properties()); });
+		timed(L"thumbnail generation", [&] { setup_thumbnail_generation(env::properties()); });
 
-		setup_channels(env::properties());
-		CASPAR_LOG(info) << L"Initialized channels.";
+		setup_media_libraries(env::properties());
+		CASPAR_LOG(info) << L"Started indexing the media library.";
 
-		setup_recorders(env::properties());
-		CASPAR_LOG(info) << L"Initialized recorders.";
+		timed(L"hardware modules", [&] { hardware_modules.wait(); });
+		timed(L"channel state", [&] { setup_channel_state(env::properties()); });
 
-		setup_thumbnail_generation(env::properties());
+		// The first clips played should not be the ones filling the pools.
+		timed(L"pool prewarm", [&] { pool_prewarm.wait(); });
 
-		setup_controllers(env::properties());
-		CASPAR_LOG(info) << L"Initialized controllers.";
+		// Consumers are attached to their channels asynchronously, so
+		// commands can be served while the outputs are still coming up.
+		timed(L"controllers", [&] { setup_controllers(env::properties()); });
+		timed(L"osc", [&] { setup_osc(env::properties()); });
+		timed(L"metrics", [&] { setup_metrics(env::properties()); });
+		timed(L"transform stream", [&] { setup_transform_stream(env::properties()); });
 
-		setup_osc(env::properties());
-		CASPAR_LOG(info) << L"Initialized osc.";
+		timed(L"channel outputs", [&] { channel_outputs.wait(); });
 
-		start_initial_media_info_scan();
-		CASPAR_LOG(info) << L"Started initial media information retrieval.";
+		CASPAR_LOG(info) << L"Server started in " << static_cast<int>(startup_timer.elapsed() * 1000.0) << L" ms.";
 	}
 
 	~implementation()
 	{
-		running_ = false;
-		initial_media_info_thread_.join();
+		diagnostics::set_stall_watchdog(0, nullptr);
+		channel_state_.reset();
+		media_libraries_ = core::media_libraries();
 		thumbnail_generator_.reset();
 		primary_amcp_server_.reset();
 		async_servers_.clear();
 		destroy_producers_synchronously();
 		recorders_.clear();
+		transform_server_.reset();
 		channels_.clear();
+		state_server_.reset();
+		metrics_server_.reset();
+		flash::uninit();
 		ffmpeg::uninit();
 	}
 
@@ -214,8 +316,22 @@ struct server::implementation : boost::noncopyable
 			parse_mix_configs(
 					default_mix_config_repository(), *mix_configs);
 	}
+
+	// Reserves the page locked arenas before any module allocates from them.
+	void setup_locked_memory(const boost::property_tree::wptree& pt)
+	{
+		if (!pt.get(L"configuration.locked-memory.enabled", false))
+			return;
+
+		locked_memory_config config;
+		config.large_pages		= pt.get(L"configuration.locked-memory.large-pages", config.large_pages);
+		config.numa_local		= pt.get(L"configuration.locked-memory.numa-local", config.numa_local);
+		config.arena_size		= pt.get(L"configuration.locked-memory.arena-size-mb", 64) * 1024 * 1024;
+		config.arenas_per_node	= pt.get(L"configuration.locked-memory.arenas-per-node", config.arenas_per_node);
+		init_locked_memory_pool(config);
+	}
 				
-	void setup_channels(const boost::property_tree::wptree& pt)
+	void setup_channels(const boost::property_tree::wptree& pt, startup_tasks& outputs, startup_tasks& prewarm)
 	{   
 		using boost::property_tree::wptree;
 		BOOST_FOREACH(auto& xml_channel, pt.get_child(L"configuration.channels"))
@@ -226,25 +342,82 @@ struct server::implementation : boost::noncopyable
 			auto audio_channel_layout = default_channel_layout_repository().get_by_name(
 				boost::to_upper_copy(xml_channel.second.get(L"channel-layout", L"STEREO")));
 
-			channels_.push_back(make_safe<video_channel>(channels_.size() + 1, format_desc, ogl_, audio_channel_layout));
+			// Channels with contexts of their own mix on separate threads. The contexts share resources 
+			// with the default one, which the thumbnail generator keeps using.
+			auto ogl = env::properties().get(L"configuration.mixer.channel-contexts", false) ? ogl_device::create(ogl_->software()) : ogl_;
+
+			auto channel = make_safe<video_channel>(channels_.size() + 1, format_desc, ogl, audio_channel_layout);
+			channels_.push_back(channel);
 
-			channels_.back()->monitor_output().attach_parent(monitor_subject_);
-			channels_.back()->mixer()->set_straight_alpha_output(
+			channel->monitor_output().attach_parent(monitor_subject_);
+			channel->mixer()->set_straight_alpha_output(
 				xml_channel.second.get(L"straight-alpha-output", false));
+			channel->mixer()->set_output_packing(
+				get_output_packing(xml_channel.second.get(L"output-packing", L"none")));
+			channel->mixer()->set_output_split(
+				get_output_split(xml_channel.second.get(L"output-split", L"none")));
+			channel->mixer()->set_key_output(
+				xml_channel.second.get(L"key-output", false));
+
+			auto rasters = xml_channel.second.get_child_optional(L"rasters");
+			if (rasters.is_initialized())
+				channel->mixer()->set_output_rasters(parse_rasters(rasters.get()));
+
+			auto threads = xml_channel.second.get_child_optional(L"threads");
+			if (threads.is_initialized())
+				setup_thread_placement(*channel, threads.get(), ogl != ogl_);
+
+			channel->set_parallel_concurrency(xml_channel.second.get(L"parallel-concurrency", 0));
+			channel->set_offline(xml_channel.second.get(L"offline", false));
+			channel->set_composition(xml_channel.second.get(L"composition", false));
+
+			prewarm.run("channel-" + boost::lexical_cast<std::string>(channel->index()) + "-prewarm", [=]
+			{
+				prewarm_image_mixer(ogl, format_desc);
+			});
+
+			// Replaces configuration.governor for the channel.
+			auto governor = xml_channel.second.get_child_optional(L"governor");
+			if (governor.is_initialized())
+				channel->set_load_governor(core::parse_load_governor_config(governor.get()));
 
-			auto consumers = xml_channel.second.get_child_optional(L"consumers");
-			if (consumers.is_initialized())
+			// Benchmarked channels have no consumers or input and run as fast as they can.
+			if (benchmark_)
 			{
-				create_consumers(
-					consumers.get(),
-					[&](const safe_ptr<core::frame_consumer>& consumer)
-				{
-					channels_.back()->output()->add(consumer);
-				});
+				channel->set_load_governor(core::load_governor_config());
+				channel->output()->set_free_running(true);
+				continue;
 			}
-			auto input = xml_channel.second.get_child_optional(L"input");
-			if (input.is_initialized())
-				create_input(input.get(), channels_.back());
+
+			// Opening devices is slow, so every channel brings up its
+			// consumers and input on a thread of its own.
+			auto xml = xml_channel.second;
+			outputs.run("channel-" + boost::lexical_cast<std::string>(channel->index()) + "-init", [=]
+			{
+				boost::timer timer;
+				auto placement = channel->get_thread_placement();
+				parallel_arena::scope arena(channel->get_parallel_arena());
+
+				auto consumers = xml.get_child_optional(L"consumers");
+				if (consumers.is_initialized())
+				{
+					scoped_thread_placement scope(placement.consumers);
+					create_consumers(
+						consumers.get(),
+						[&](const safe_ptr<core::frame_consumer>& consumer)
+					{
+						channel->output()->add(consumer);
+					});
+				}
+				auto input = xml.get_child_optional(L"input");
+				if (input.is_initialized())
+				{
+					scoped_thread_placement scope(placement.producers);
+					create_input(input.get(), channel);
+				}
+
+				CASPAR_LOG(info) << L"Initialized outputs of channel " << channel->index() << L" in " << static_cast<int>(timer.elapsed() * 1000.0) << L" ms.";
+			});
 		}
 
 		// Dummy diagnostics channel
@@ -252,6 +425,52 @@ struct server::implementation : boost::noncopyable
 			channels_.push_back(make_safe<video_channel>(channels_.size()+1, core::video_format_desc::get(core::video_format::x576p2500), ogl_, default_channel_layout_repository().get_by_name(L"STEREO")));
 	}
 
+	std::vector<video_format_desc> parse_rasters(const boost::property_tree::wptree& pt)
+	{
+		std::vector<video_format_desc> rasters;
+
+		BOOST_FOREACH(auto& xml_raster, pt)
+		{
+			if (xml_raster.first != L"raster")
+				continue;
+
+			auto raster = video_format_desc::get(xml_raster.second.get_value<std::wstring>());
+			if (raster.format == video_format::invalid)
+				BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Invalid raster."));
+
+			rasters.push_back(raster);
+		}
+
+		return rasters;
+	}
+
+	void setup_thread_placement(video_channel& channel, const boost::property_tree::wptree& pt, bool own_context)
+	{
+		channel_thread_placement placement;
+
+		auto parse = [&](const wchar_t* name, thread_placement& target)
+		{
+			auto child = pt.get_child_optional(name);
+			if (child.is_initialized())
+				target = parse_thread_placement(child.get());
+		};
+
+		parse(L"stage",		placement.stage);
+		parse(L"mixer",		placement.mixer);
+		parse(L"output",	placement.output);
+		parse(L"consumers",	placement.consumers);
+		parse(L"producers",	placement.producers);
+		parse(L"gl",		placement.gl);
+
+		if (!own_context && !placement.gl.empty())
+		{
+			CASPAR_LOG(warning) << L"Channel " << channel.index() << L" shares the default OpenGL context, ignoring its gl thread placement. Enable channel-contexts to place it.";
+			placement.gl = thread_placement();
+		}
+
+		channel.set_thread_placement(placement);
+	}
+
 	template<typename Base>
 	std::vector<safe_ptr<Base>> create_consumers(const boost::property_tree::wptree& pt)
 	{
@@ -266,7 +485,7 @@ struct server::implementation : boost::noncopyable
 	}
 
 	template<class Func>
-	void create_consumers(const boost::property_tree::wptree& pt, const Func& on_consumer)
+	void create_consumers(const boost::property_tree::wptree& pt, const Func& on_created)
 	{
 		BOOST_FOREACH(auto& xml_consumer, pt)
 		{
@@ -274,6 +493,16 @@ struct server::implementation : boost::noncopyable
 			{
 				auto name = xml_consumer.first;
 
+				// Consumers of an output raster of the channel, see <rasters>.
+				auto raster = xml_consumer.second.get(L"raster", L"");
+				if (!raster.empty() && video_format_desc::get(raster).format == video_format::invalid)
+					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Invalid raster."));
+
+				auto on_consumer = [&](const safe_ptr<core::frame_consumer>& consumer)
+				{
+					on_created(raster.empty() ? consumer : core::create_raster_consumer(consumer, video_format_desc::get(raster)));
+				};
+
 				if (name == L"screen")
 					on_consumer(ogl::create_consumer(xml_consumer.second));
 				else if (name == L"bluefish")
@@ -290,6 +519,10 @@ struct server::implementation : boost::noncopyable
 					on_consumer(newtek::create_ivga_consumer(xml_consumer.second));
 				else if (name == L"ndi")
 					on_consumer(ndi::create_ndi_consumer(xml_consumer.second));
+				else if (name == L"shared-memory")
+					on_consumer(core::create_shared_memory_consumer(xml_consumer.second));
+				else if (name == L"replay")
+					on_consumer(core::create_replay_consumer(xml_consumer.second));
 				else if (name == L"synchronizing")
 					on_consumer(make_safe<core::synchronizing_consumer>(
 							create_consumers<core::frame_consumer>(
@@ -351,7 +584,8 @@ struct server::implementation : boost::noncopyable
 				if(name == L"tcp")
 				{					
 					unsigned int port = xml_controller.second.get(L"port", 5250);
-					auto asyncbootstrapper = make_safe<IO::AsyncEventServer>(create_protocol(protocol), port);
+					bool no_delay = xml_controller.second.get(L"no-delay", true);
+					auto asyncbootstrapper = make_safe<IO::AsyncEventServer>(create_protocol(protocol, create_command_log(xml_controller.second)), port, no_delay);
 					asyncbootstrapper->Start();
 					async_servers_.push_back(asyncbootstrapper);
 
@@ -368,12 +602,44 @@ struct server::implementation : boost::noncopyable
 		}
 	}
 
+	// The <paths> of an osc client, everything if there are none.
+	static std::vector<std::string> get_osc_paths(const boost::property_tree::wptree& pt)
+	{
+		std::vector<std::string> paths;
+
+		auto paths_pt = pt.get_child_optional(L"paths");
+		if (paths_pt)
+		{
+			BOOST_FOREACH(auto& path, *paths_pt)
+				paths.push_back(narrow(path.second.get_value<std::wstring>()));
+		}
+
+		if (paths.empty())
+			paths.push_back("/");
+
+		return paths;
+	}
+
 	void setup_osc(const boost::property_tree::wptree& pt)
 	{		
 		using boost::property_tree::wptree;
 		using namespace boost::asio::ip;
 
-		monitor_subject_->attach_parent(osc_client_.sink());
+		auto state_stream_port =
+				pt.get<unsigned short>(L"configuration.state-stream.port", 0);
+
+		if (state_stream_port > 0)
+		{
+			state_server_.reset(new protocol::state::server(io_service_, state_stream_port));
+
+			auto sinks = make_safe<core::monitor::multi_sink>();
+			sinks->add(osc_client_.sink());
+			sinks->add(state_server_->sink());
+			monitor_sinks_ = sinks;
+			monitor_subject_->attach_parent(sinks);
+		}
+		else
+			monitor_subject_->attach_parent(osc_client_.sink());
 		
 		auto default_port =
 				pt.get<unsigned short>(L"configuration.osc.default-port", 6250);
@@ -391,10 +657,12 @@ struct server::implementation : boost::noncopyable
 				predefined_osc_subscriptions_.push_back(
 						osc_client_.get_subscription_token(udp::endpoint(
 								address_v4::from_string(narrow(address)),
-								port)));
+								port), get_osc_paths(predefined_client.second)));
 			}
 		}
 
+		auto amcp_client_paths = get_osc_paths(pt.get_child(L"configuration.osc", wptree()));
+
 		if (primary_amcp_server_)
 			primary_amcp_server_->add_lifecycle_factory(
 					[=] (const std::string& ipv4_address)
@@ -405,10 +673,85 @@ struct server::implementation : boost::noncopyable
 						return osc_client_.get_subscription_token(
 								udp::endpoint(
 										address_v4::from_string(ipv4_address),
-										default_port));
+										default_port), amcp_client_paths);
 					});
 	}
 
+	void setup_stall_watchdog(const boost::property_tree::wptree& pt)
+	{
+		auto subject = monitor_subject_;
+
+		diagnostics::set_stall_watchdog(pt.get(L"configuration.stall-threshold", 500), [subject](const std::string& executor, const std::string& origin, int64_t running_micros)
+		{
+			*subject << core::monitor::message("/executor/" + executor + "/stall") % origin % (running_micros / 1000.0);
+		});
+	}
+
+	void setup_metrics(const boost::property_tree::wptree& pt)
+	{
+		auto port = pt.get<unsigned short>(L"configuration.metrics.port", 0);
+
+		if (port > 0)
+			metrics_server_.reset(new protocol::metrics::http_server(io_service_, port));
+	}
+
+	void setup_transform_stream(const boost::property_tree::wptree& pt)
+	{
+		auto port = pt.get<unsigned short>(L"configuration.transform-stream.port", 0);
+
+		if (port > 0)
+			transform_server_.reset(new protocol::transform::server(io_service_, port, channels_));
+	}
+
+	static safe_ptr<media_info_repository> create_media_info_repository(const boost::property_tree::wptree& pt)
+	{
+		if (!pt.get(L"configuration.media-info-cache.enabled", true))
+			return create_in_memory_media_info_repository();
+
+		return create_persistent_media_info_repository(
+				env::data_folder() + pt.get(L"configuration.media-info-cache.file", L"media-info.cache"),
+				pt.get(L"configuration.media-info-cache.save-delay-millis", 5000),
+				pt.get(L"configuration.media-info-cache.fingerprints", false));
+	}
+
+	// The scan interval is only used when polling, or when falling back to it.
+	std::unique_ptr<filesystem_monitor_factory> create_monitor_factory(
+			const boost::property_tree::wptree& pt, int scan_interval_millis) const
+	{
+		auto type = pt.get(L"configuration.filesystem-monitor", L"native");
+
+		if (boost::iequals(type, L"polling"))
+			return std::unique_ptr<filesystem_monitor_factory>(
+					new polling_filesystem_monitor_factory(io_service_, scan_interval_millis));
+
+		if (!boost::iequals(type, L"native"))
+			CASPAR_LOG(warning) << L"Invalid filesystem-monitor: " << type << L". Using native.";
+
+		return std::unique_ptr<filesystem_monitor_factory>(
+				new native_filesystem_monitor_factory(io_service_, scan_interval_millis));
+	}
+
+	// Also retrieves the media information of every file, once at startup and then as files change.
+	void setup_media_libraries(const boost::property_tree::wptree& pt)
+	{
+		auto monitor_factory = create_monitor_factory(
+				pt, pt.get(L"configuration.media-library.scan-interval-millis", 5000));
+		media_libraries_ = protocol::CreateMediaLibraries(*monitor_factory, media_info_repo_);
+	}
+
+	// Restores what played before the server went down, before any controller
+	// can change it.
+	void setup_channel_state(const boost::property_tree::wptree& pt)
+	{
+		if (!pt.get(L"configuration.channel-state.enabled", false))
+			return;
+
+		channel_state_.reset(new channel_state_store(
+				channels_,
+				env::data_folder() + pt.get(L"configuration.channel-state.file", L"channel-state.xml"),
+				pt.get(L"configuration.channel-state.save-interval-millis", 1000)));
+	}
+
 	void setup_thumbnail_generation(const boost::property_tree::wptree& pt)
 	{
 		if (!pt.get(L"configuration.thumbnails.generate-thumbnails", true))
@@ -416,10 +759,11 @@ struct server::implementation : boost::noncopyable
 
 		auto scan_interval_millis = pt.get(L"configuration.thumbnails.scan-interval-millis", 5000);
 
-		polling_filesystem_monitor_factory monitor_factory(
-				io_service_, scan_interval_millis);
+		auto monitor_factory = create_monitor_factory(pt, scan_interval_millis);
+		auto channels = channels_;
+		auto yield_load = pt.get(L"configuration.thumbnails.yield-load", 0.8);
 		thumbnail_generator_.reset(new thumbnail_generator(
-				monitor_factory, 
+				*monitor_factory, 
 				env::media_folder(),
 				env::thumbnails_folder(),
 				pt.get(L"configuration.thumbnails.width", 256),
@@ -428,7 +772,24 @@ struct server::implementation : boost::noncopyable
 				ogl_,
 				pt.get(L"configuration.thumbnails.generate-delay-millis", 2000),
 				&image::write_cropped_png,
-				media_info_repo_));
+				media_info_repo_,
+				pt.get(L"configuration.thumbnails.workers", 2),
+				pt.get(L"configuration.thumbnails.job-timeout-millis", 10000),
+				[channels, yield_load]() -> bool
+				{
+					if (core::load_governor::active_anywhere() & core::degradation::thumbnails)
+						return true;
+
+					BOOST_FOREACH(auto& channel, channels)
+					{
+						if (channel->stage()->produce_load() > yield_load)
+							return true;
+					}
+
+					return false;
+				},
+				pt.get(L"configuration.thumbnails.scrub-strip.frames", 0),
+				pt.get(L"configuration.thumbnails.scrub-strip.columns", 5)));
 
 		CASPAR_LOG(info) << L"Initialized thumbnail generator.";
 	}
@@ -459,10 +820,24 @@ struct server::implementation : boost::noncopyable
 			}
 	}
 
-	safe_ptr<IO::IProtocolStrategy> create_protocol(const std::wstring& name) const
+	// The <record-file> of a controller, relative to the log folder, for replaying its traffic with --replay.
+	static std::shared_ptr<amcp::command_log> create_command_log(const boost::property_tree::wptree& pt)
+	{
+		auto file = pt.get(L"record-file", L"");
+		if(file.empty())
+			return nullptr;
+
+		boost::filesystem::wpath path(file);
+		if(!path.is_complete())
+			path = boost::filesystem::wpath(env::log_folder()) / path;
+
+		return std::make_shared<amcp::command_log>(path.file_string());
+	}
+
+	safe_ptr<IO::IProtocolStrategy> create_protocol(const std::wstring& name, const std::shared_ptr<amcp::command_log>& command_log = nullptr) const
 	{
 		if(boost::iequals(name, L"AMCP"))
-			return make_safe<amcp::AMCPProtocolStrategy>(channels_, recorders_, thumbnail_generator_, media_info_repo_, shutdown_server_now_);
+			return make_safe<amcp::AMCPProtocolStrategy>(channels_, recorders_, thumbnail_generator_, media_info_repo_, media_libraries_, shutdown_server_now_, command_log);
 		else if(boost::iequals(name, L"CII"))
 			return make_safe<cii::CIIProtocolStrategy>(channels_);
 		else if(boost::iequals(name, L"CLOCK"))
@@ -475,27 +850,9 @@ struct server::implementation : boost::noncopyable
 		BOOST_THROW_EXCEPTION(caspar_exception() << arg_name_info("name") << arg_value_info(narrow(name)) << msg_info("Invalid protocol"));
 	}
 
-	void start_initial_media_info_scan()
-	{
-		initial_media_info_thread_ = boost::thread([this]
-		{
-			for (boost::filesystem::wrecursive_directory_iterator iter(env::media_folder()), end; iter != end; ++iter)
-			{
-				if (running_)
-					media_info_repo_->get(iter->path().file_string());
-				else
-				{
-					CASPAR_LOG(info) << L"Initial media information retrieval aborted.";
-					return;
-				}
-			}
-
-			CASPAR_LOG(info) << L"Initial media information retrieval finished.";
-		});
-	}
 };
 
-server::server(boost::promise<bool>& shutdown_server_now) : impl_(new implementation(shutdown_server_now)){}
+server::server(boost::promise<bool>& shutdown_server_now, bool benchmark) : impl_(new implementation(shutdown_server_now, benchmark)){}
 
 const std::vector<safe_ptr<video_channel>> server::get_channels() const
 {
@@ -517,6 +874,16 @@ safe_ptr<media_info_repository> server::get_media_info_repo() const
 	return impl_->media_info_repo_;
 }
 
+core::media_libraries server::get_media_libraries() const
+{
+	return impl_->media_libraries_;
+}
+
+safe_ptr<ogl_device> server::get_ogl_device() const
+{
+	return impl_->ogl_;
+}
+
 core::monitor::subject& server::monitor_output()
 {
 	return *impl_->monitor_subject_;
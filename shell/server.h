@@ -24,6 +24,7 @@
 
 #include <common/memory/safe_ptr.h>
 
+#include <core/media_library.h>
 #include <core/monitor/monitor.h>
 
 #include <boost/noncopyable.hpp>
@@ -37,17 +38,21 @@ namespace core {
 	class video_channel;
 	class recorder;
 	class thumbnail_generator;
+	class ogl_device;
 	struct media_info_repository;
 }
 
 class server : boost::noncopyable
 {
 public:
-	server(boost::promise<bool>& shutdown_server_now);
+	// A benchmark server only sets up its channels, without consumers or inputs and free running, see benchmark.h.
+	server(boost::promise<bool>& shutdown_server_now, bool benchmark = false);
 	const std::vector<safe_ptr<core::video_channel>> get_channels() const;
 	const std::vector<safe_ptr<core::recorder>> get_recorders() const;
 	std::shared_ptr<core::thumbnail_generator> get_thumbnail_generator() const;
 	safe_ptr<core::media_info_repository> get_media_info_repo() const;
+	core::media_libraries get_media_libraries() const;
+	safe_ptr<core::ogl_device> get_ogl_device() const;
 
 	core::monitor::subject& monitor_output();
 